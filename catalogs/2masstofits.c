@@ -16,14 +16,16 @@
 #include "starutil.h"
 #include "boilerplate.h"
 #include "fitsioutils.h"
+#include "catalog-ingest.h"
 
-#define OPTIONS "ho:N:"
+#define OPTIONS "ho:N:t:"
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
     printf("usage:\n"
            "  %s -o <output-filename-template>\n"
            "  [-N <healpix-nside>]  (default = 8.)\n"
+           "  [-t <threads>]: decompress and parse this many files at once (default 1)\n"
            "  <input-file> [<input-file> ...]\n"
            "\n"
            "Input files are gzipped 2MASS PSC catalog files, named like psc_aaa.gz."
@@ -31,15 +33,134 @@ void print_help(char* progname) {
 }
 
 
+typedef struct {
+    char* outfn;
+    int Nside;
+    int nfiles;
+    twomass_fits** cats;
+} twomass_ingest_t;
+
+static int parse_input(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    gzFile fiz = NULL;
+    char line[1024];
+
+    fiz = gzopen(infn, "rb");
+    if (!fiz) {
+        fprintf(stderr, "Failed to open file %s: %s\n", infn, strerror(errno));
+        return -1;
+    }
+    for (;;) {
+        twomass_entry* e;
+        if (gzeof(fiz))
+            break;
+
+        if (gzgets(fiz, line, 1024) == Z_NULL) {
+            if (gzeof(fiz))
+                break;
+            fprintf(stderr, "Failed to read a line from file %s: %s\n", infn, strerror(errno));
+            gzclose(fiz);
+            return -1;
+        }
+        e = catalog_batch_append(batch);
+        if (!e || twomass_parse_entry(e, line)) {
+            fprintf(stderr, "Failed to parse 2MASS entry from file %s.\n", infn);
+            gzclose(fiz);
+            return -1;
+        }
+    }
+    gzclose(fiz);
+    return 0;
+}
+
+static int write_entries(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    twomass_ingest_t* ti = token;
+    twomass_fits** cats = ti->cats;
+    int Nside = ti->Nside;
+    int nentries;
+
+    printf("\nReading file %i of %i: %s\n", 1 + fileindex, ti->nfiles, infn);
+    for (nentries=0; nentries<batch->nentries; nentries++) {
+        twomass_entry* e = (twomass_entry*)batch->entries + nentries;
+        int hp;
+
+        hp = radectohealpix(deg2rad(e->ra), deg2rad(e->dec), Nside);
+        if (!cats[hp]) {
+            char fn[256];
+            qfits_header* hdr;
+
+            sprintf(fn, ti->outfn, hp);
+            cats[hp] = twomass_fits_open_for_writing(fn);
+            if (!cats[hp]) {
+                fprintf(stderr, "Failed to open 2MASS catalog for writing to file %s (hp %i).\n", fn, hp);
+                return -1;
+            }
+            // header remarks...
+            hdr = twomass_fits_get_primary_header(cats[hp]);
+            BOILERPLATE_ADD_FITS_HEADERS(hdr);
+            fits_header_add_int(hdr, "HEALPIX", hp, "The healpix number of this catalog.");
+            fits_header_add_int(hdr, "NSIDE", Nside, "The healpix resolution.");
+
+            fits_add_long_comment(hdr, "The fields are as described in the 2MASS documentation:");
+            fits_add_long_comment(hdr, "  ftp://ftp.ipac.caltech.edu/pub/2mass/allsky/format_psc.html");
+            fits_add_long_comment(hdr, "with a few exceptions:");
+            fits_add_long_comment(hdr, "* all angular fields are measured in degrees");
+            fits_add_long_comment(hdr, "* the photometric quality flag values are:");
+            fits_add_long_comment(hdr, "    %i: 'X' in 2MASS, No brightness info available.", TWOMASS_QUALITY_NO_BRIGHTNESS);
+            fits_add_long_comment(hdr, "    %i: 'U' in 2MASS, The brightness val is an upper bound.", TWOMASS_QUALITY_UPPER_LIMIT_MAG);
+            fits_add_long_comment(hdr, "    %i: 'F' in 2MASS, No magnitude sigma is available", TWOMASS_QUALITY_NO_SIGMA);
+            fits_add_long_comment(hdr, "    %i: 'E' in 2MASS, Profile-fit photometry was bad", TWOMASS_QUALITY_BAD_FIT);
+            fits_add_long_comment(hdr, "    %i: 'A' in 2MASS, Best quality", TWOMASS_QUALITY_A);
+            fits_add_long_comment(hdr, "    %i: 'B' in 2MASS, ...", TWOMASS_QUALITY_B);
+            fits_add_long_comment(hdr, "    %i: 'C' in 2MASS, ...", TWOMASS_QUALITY_C);
+            fits_add_long_comment(hdr, "    %i: 'D' in 2MASS, Worst quality", TWOMASS_QUALITY_D);
+            fits_add_long_comment(hdr, "* the confusion/contamination flag values are:");
+            fits_add_long_comment(hdr, "    %i: '0' in 2MASS, No problems.", TWOMASS_CC_NONE);
+            fits_add_long_comment(hdr, "    %i: 'p' in 2MASS, Persistence.", TWOMASS_CC_PERSISTENCE);
+            fits_add_long_comment(hdr, "    %i: 'c' in 2MASS, Confusion.", TWOMASS_CC_CONFUSION);
+            fits_add_long_comment(hdr, "    %i: 'd' in 2MASS, Diffraction.", TWOMASS_CC_DIFFRACTION);
+            fits_add_long_comment(hdr, "    %i: 's' in 2MASS, Stripe.", TWOMASS_CC_STRIPE);
+            fits_add_long_comment(hdr, "    %i: 'b' in 2MASS, Band merge.", TWOMASS_CC_BANDMERGE);
+            fits_add_long_comment(hdr, "* the association flag values are:");
+            fits_add_long_comment(hdr, "    %i: none.", TWOMASS_ASSOCIATION_NONE);
+            fits_add_long_comment(hdr, "    %i: Tycho.", TWOMASS_ASSOCIATION_TYCHO);
+            fits_add_long_comment(hdr, "    %i: USNO A-2.", TWOMASS_ASSOCIATION_USNOA2);
+            fits_add_long_comment(hdr, "* the NULL value for floats is %f", TWOMASS_NULL);
+            fits_add_long_comment(hdr, "* the NULL value for the 'ext_key' aka 'xsc_key' field is");
+            fits_add_long_comment(hdr, "   %i (0x%x).", TWOMASS_KEY_NULL, TWOMASS_KEY_NULL);
+
+            if (twomass_fits_write_headers(cats[hp])) {
+                fprintf(stderr, "Failed to write 2MASS catalog headers: %s\n", fn);
+                return -1;
+            }
+        }
+        if (twomass_fits_write_entry(cats[hp], e)) {
+            fprintf(stderr, "Failed to write 2MASS catalog entry.\n");
+            return -1;
+        }
+
+        if (!((nentries+1) % 100000)) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+
+    printf("Read %i entries.\n", batch->nentries);
+    return 0;
+}
+
 int main(int argc, char** args) {
     int c;
     char* outfn = NULL;
-    int startoptind;
     int Nside = 8;
+    int nthreads = 1;
     int HP;
     int i;
 
     twomass_fits** cats;
+    twomass_ingest_t ti;
 
     while ((c = getopt(argc, args, OPTIONS)) != -1) {
         switch (c) {
@@ -53,6 +174,9 @@ int main(int argc, char** args) {
         case 'o':
             outfn = optarg;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         }
     }
 
@@ -75,108 +199,13 @@ int main(int argc, char** args) {
     printf("Reading 2MASS files... ");
     fflush(stdout);
 
-    startoptind = optind;
-    for (; optind<argc; optind++) {
-        char* infn;
-        gzFile fiz = NULL;
-        char line[1024];
-        int nentries;
-
-        infn = args[optind];
-        printf("\nReading file %i of %i: %s\n", 1 + optind - startoptind,
-               argc - startoptind, infn);
-        infn = args[optind];
-        fiz = gzopen(infn, "rb");
-        if (!fiz) {
-            fprintf(stderr, "Failed to open file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-        nentries = 0;
-        for (;;) {
-            twomass_entry e;
-            int hp;
-
-            if (gzeof(fiz))
-                break;
-
-            if (gzgets(fiz, line, 1024) == Z_NULL) {
-                if (gzeof(fiz))
-                    break;
-                fprintf(stderr, "Failed to read a line from file %s: %s\n", infn, strerror(errno));
-                exit(-1);
-            }
-
-            if (twomass_parse_entry(&e, line)) {
-                fprintf(stderr, "Failed to parse 2MASS entry from file %s.\n", infn);
-                exit(-1);
-            }
-
-            hp = radectohealpix(deg2rad(e.ra), deg2rad(e.dec), Nside);
-            if (!cats[hp]) {
-                char fn[256];
-                qfits_header* hdr;
-
-                sprintf(fn, outfn, hp);
-                cats[hp] = twomass_fits_open_for_writing(fn);
-                if (!cats[hp]) {
-                    fprintf(stderr, "Failed to open 2MASS catalog for writing to file %s (hp %i).\n", fn, hp);
-                    exit(-1);
-                }
-                // header remarks...
-                hdr = twomass_fits_get_primary_header(cats[hp]);
-                BOILERPLATE_ADD_FITS_HEADERS(hdr);
-                fits_header_add_int(hdr, "HEALPIX", hp, "The healpix number of this catalog.");
-                fits_header_add_int(hdr, "NSIDE", Nside, "The healpix resolution.");
-
-                fits_add_long_comment(hdr, "The fields are as described in the 2MASS documentation:");
-                fits_add_long_comment(hdr, "  ftp://ftp.ipac.caltech.edu/pub/2mass/allsky/format_psc.html");
-                fits_add_long_comment(hdr, "with a few exceptions:");
-                fits_add_long_comment(hdr, "* all angular fields are measured in degrees");
-                fits_add_long_comment(hdr, "* the photometric quality flag values are:");
-                fits_add_long_comment(hdr, "    %i: 'X' in 2MASS, No brightness info available.", TWOMASS_QUALITY_NO_BRIGHTNESS);
-                fits_add_long_comment(hdr, "    %i: 'U' in 2MASS, The brightness val is an upper bound.", TWOMASS_QUALITY_UPPER_LIMIT_MAG);
-                fits_add_long_comment(hdr, "    %i: 'F' in 2MASS, No magnitude sigma is available", TWOMASS_QUALITY_NO_SIGMA);
-                fits_add_long_comment(hdr, "    %i: 'E' in 2MASS, Profile-fit photometry was bad", TWOMASS_QUALITY_BAD_FIT);
-                fits_add_long_comment(hdr, "    %i: 'A' in 2MASS, Best quality", TWOMASS_QUALITY_A);
-                fits_add_long_comment(hdr, "    %i: 'B' in 2MASS, ...", TWOMASS_QUALITY_B);
-                fits_add_long_comment(hdr, "    %i: 'C' in 2MASS, ...", TWOMASS_QUALITY_C);
-                fits_add_long_comment(hdr, "    %i: 'D' in 2MASS, Worst quality", TWOMASS_QUALITY_D);
-                fits_add_long_comment(hdr, "* the confusion/contamination flag values are:");
-                fits_add_long_comment(hdr, "    %i: '0' in 2MASS, No problems.", TWOMASS_CC_NONE);
-                fits_add_long_comment(hdr, "    %i: 'p' in 2MASS, Persistence.", TWOMASS_CC_PERSISTENCE);
-                fits_add_long_comment(hdr, "    %i: 'c' in 2MASS, Confusion.", TWOMASS_CC_CONFUSION);
-                fits_add_long_comment(hdr, "    %i: 'd' in 2MASS, Diffraction.", TWOMASS_CC_DIFFRACTION);
-                fits_add_long_comment(hdr, "    %i: 's' in 2MASS, Stripe.", TWOMASS_CC_STRIPE);
-                fits_add_long_comment(hdr, "    %i: 'b' in 2MASS, Band merge.", TWOMASS_CC_BANDMERGE);
-                fits_add_long_comment(hdr, "* the association flag values are:");
-                fits_add_long_comment(hdr, "    %i: none.", TWOMASS_ASSOCIATION_NONE);
-                fits_add_long_comment(hdr, "    %i: Tycho.", TWOMASS_ASSOCIATION_TYCHO);
-                fits_add_long_comment(hdr, "    %i: USNO A-2.", TWOMASS_ASSOCIATION_USNOA2);
-                fits_add_long_comment(hdr, "* the NULL value for floats is %f", TWOMASS_NULL);
-                fits_add_long_comment(hdr, "* the NULL value for the 'ext_key' aka 'xsc_key' field is");
-                fits_add_long_comment(hdr, "   %i (0x%x).", TWOMASS_KEY_NULL, TWOMASS_KEY_NULL);
-
-                if (twomass_fits_write_headers(cats[hp])) {
-                    fprintf(stderr, "Failed to write 2MASS catalog headers: %s\n", fn);
-                    exit(-1);
-                }
-            }
-            if (twomass_fits_write_entry(cats[hp], &e)) {
-                fprintf(stderr, "Failed to write 2MASS catalog entry.\n");
-                exit(-1);
-            }
-
-            nentries++;
-            if (!(nentries % 100000)) {
-                printf(".");
-                fflush(stdout);
-            }
-        }
-        gzclose(fiz);
-        printf("\n");
-
-        printf("Read %i entries.\n", nentries);
-    }
+    ti.outfn = outfn;
+    ti.Nside = Nside;
+    ti.nfiles = argc - optind;
+    ti.cats = cats;
+    if (catalog_ingest(args + optind, argc - optind, nthreads,
+                       sizeof(twomass_entry), parse_input, write_entries, &ti))
+        exit(-1);
 
     printf("Finishing up...\n");
     for (i=0; i<HP; i++) {
@@ -4,8 +4,11 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "brightstars.h"
+#include "healpix-buckets.h"
 
 static brightstar_t bs[] =
 #include "brightstars-data.c"
@@ -21,3 +24,20 @@ const brightstar_t* bright_stars_get(int starindex) {
     return bs + starindex;
 }
 
+
+static healpix_buckets_t* buckets = NULL;
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void build_buckets(void) {
+    buckets = healpix_buckets_new(&bs[0].ra, &bs[0].dec, sizeof(brightstar_t),
+                                  bright_stars_n(), 8);
+}
+
+int* bright_stars_within(double ra, double dec, double radius, int* N) {
+    pthread_once(&buckets_once, build_buckets);
+    if (!buckets) {
+        *N = 0;
+        return NULL;
+    }
+    return healpix_buckets_within(buckets, ra, dec, radius, N);
+}
@@ -0,0 +1,172 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "catalog-ingest.h"
+#include "os-features.h"
+#include "errors.h"
+
+typedef struct {
+    char** fns;
+    int nfiles;
+    catalog_parse_func parse;
+    void* token;
+    catalog_batch_t* batches;
+    // 1 when a batch has been parsed.
+    char* done;
+    // the next file to parse, and the number written so far.
+    int next;
+    int nwritten;
+    int window;
+    int failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ingest_t;
+
+void* catalog_batch_append(catalog_batch_t* batch) {
+    if (batch->nentries == batch->capacity) {
+        int cap = MAX(1024, 2 * batch->capacity);
+        void* entries = realloc(batch->entries, (size_t)cap * batch->entrysize);
+        if (!entries) {
+            SYSERROR("Failed to grow catalog batch to %i entries", cap);
+            return NULL;
+        }
+        batch->entries = entries;
+        batch->capacity = cap;
+    }
+    batch->nentries++;
+    return (char*)batch->entries + (size_t)(batch->nentries - 1) * batch->entrysize;
+}
+
+static void* ingest_worker(void* arg) {
+    ingest_t* g = arg;
+    for (;;) {
+        int f;
+        int rtn;
+        pthread_mutex_lock(&g->mutex);
+        // don't get too far ahead of the writer.
+        while (!g->failed && g->next < g->nfiles &&
+               g->next - g->nwritten >= g->window)
+            pthread_cond_wait(&g->cond, &g->mutex);
+        if (g->failed || g->next >= g->nfiles) {
+            pthread_mutex_unlock(&g->mutex);
+            break;
+        }
+        f = g->next++;
+        pthread_mutex_unlock(&g->mutex);
+
+        rtn = g->parse(g->fns[f], f, g->token, g->batches + f);
+        if (rtn)
+            ERROR("Failed to parse input file %s", g->fns[f]);
+
+        pthread_mutex_lock(&g->mutex);
+        if (rtn)
+            g->failed = 1;
+        g->done[f] = 1;
+        pthread_cond_broadcast(&g->cond);
+        pthread_mutex_unlock(&g->mutex);
+    }
+    return NULL;
+}
+
+int catalog_ingest(char** fns, int nfiles, int nthreads, size_t entrysize,
+                   catalog_parse_func parse, catalog_write_func write,
+                   void* token) {
+    ingest_t g;
+    pthread_t* threads;
+    int nstarted = 0;
+    int i, f;
+    int rtn = 0;
+
+    memset(&g, 0, sizeof(ingest_t));
+    g.fns = fns;
+    g.nfiles = nfiles;
+    g.parse = parse;
+    g.token = token;
+    g.batches = calloc(MAX(nfiles, 1), sizeof(catalog_batch_t));
+    g.done = calloc(MAX(nfiles, 1), 1);
+    for (f=0; f<nfiles; f++)
+        g.batches[f].entrysize = entrysize;
+    nthreads = MAX(1, nthreads);
+    g.window = nthreads;
+
+    if (nthreads == 1) {
+        // no threads; parse and write each file in turn.
+        for (f=0; f<nfiles; f++) {
+            catalog_batch_t* batch = g.batches + f;
+            if (parse(fns[f], f, token, batch)) {
+                ERROR("Failed to parse input file %s", fns[f]);
+                rtn = -1;
+            } else if (write(fns[f], f, token, batch)) {
+                ERROR("Failed to write the entries of input file %s", fns[f]);
+                rtn = -1;
+            }
+            free(batch->entries);
+            batch->entries = NULL;
+            if (rtn)
+                break;
+        }
+        free(g.batches);
+        free(g.done);
+        return rtn;
+    }
+
+    pthread_mutex_init(&g.mutex, NULL);
+    pthread_cond_init(&g.cond, NULL);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, ingest_worker, &g))
+            break;
+        nstarted++;
+    }
+    if (!nstarted) {
+        ERROR("Failed to start any catalog-parsing threads");
+        g.failed = 1;
+    }
+
+    for (f=0; f<nfiles; f++) {
+        catalog_batch_t* batch = g.batches + f;
+        int ok;
+        pthread_mutex_lock(&g.mutex);
+        while (!g.done[f] && !g.failed)
+            pthread_cond_wait(&g.cond, &g.mutex);
+        ok = g.done[f] && !g.failed;
+        pthread_mutex_unlock(&g.mutex);
+        if (!ok)
+            break;
+
+        rtn = write(fns[f], f, token, batch);
+        if (rtn)
+            ERROR("Failed to write the entries of input file %s", fns[f]);
+        free(batch->entries);
+        batch->entries = NULL;
+
+        pthread_mutex_lock(&g.mutex);
+        if (rtn)
+            g.failed = 1;
+        g.nwritten++;
+        pthread_cond_broadcast(&g.cond);
+        pthread_mutex_unlock(&g.mutex);
+        if (rtn)
+            break;
+    }
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    if (g.failed)
+        rtn = -1;
+
+    // batches parsed but not written, after a failure.
+    for (f=0; f<nfiles; f++)
+        free(g.batches[f].entries);
+    free(threads);
+    free(g.batches);
+    free(g.done);
+    pthread_mutex_destroy(&g.mutex);
+    pthread_cond_destroy(&g.cond);
+    return rtn;
+}
@@ -0,0 +1,59 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef CATALOG_INGEST_H
+#define CATALOG_INGEST_H
+
+#include <stddef.h>
+
+/**
+ Shared driver for the *tofits catalog converters.
+
+ Each input file is read (and decompressed, if need be) and parsed on a
+ worker thread, into a batch of entries.  The batches are handed to the
+ "write" callback on the calling thread, one at a time and in input-file
+ order, so the output is the same as a serial conversion's.  At most
+ "nthreads" parsed batches are held in memory at once.
+ */
+typedef struct {
+    // the parsed entries, "entrysize" bytes each; freed after "write".
+    void* entries;
+    int nentries;
+    int capacity;
+    size_t entrysize;
+} catalog_batch_t;
+
+/**
+ Reads and parses input file "fn" (number "fileindex") into "batch",
+ which starts out empty with only "entrysize" set; called on a worker
+ thread.  Returns 0 on success.
+ */
+typedef int (*catalog_parse_func)(const char* fn, int fileindex,
+                                  void* token, catalog_batch_t* batch);
+
+/**
+ Writes the entries of "batch"; called in input-file order, on the
+ thread that called catalog_ingest().  Returns 0 on success.
+ */
+typedef int (*catalog_write_func)(const char* fn, int fileindex,
+                                  void* token, catalog_batch_t* batch);
+
+/**
+ Runs "parse" on each of the "nfiles" input files on "nthreads" threads,
+ into batches of "entrysize"-byte entries, and "write" on the batches in
+ order.  Returns 0 on success; stops at the
+ first failure.
+ */
+int catalog_ingest(char** fns, int nfiles, int nthreads, size_t entrysize,
+                   catalog_parse_func parse, catalog_write_func write,
+                   void* token);
+
+/**
+ Appends an entry to "batch", growing it as needed; returns a pointer to
+ the new (uninitialized) entry, or NULL on failure.
+ */
+void* catalog_batch_append(catalog_batch_t* batch);
+
+#endif
@@ -40,8 +40,14 @@
  ----------	-----------	----
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "os-features.h"
 #include "constellation-boundaries.h"
 #include "an-bool.h"
+#include "healpix.h"
 #include "bl.h"
 #include "starutil.h"
 #include "mathutil.h"
@@ -56,51 +62,146 @@ static boundarypoint_t boundaries[] = {
 #include "constellation-boundaries-data.c"
 };
 
+#define N_BOUNDARIES (sizeof(boundaries) / sizeof(boundarypoint_t))
+
+// The index, built on first use: the boundary points of constellation
+// c are boundaries[order[constart[c] ... constart[c+1]-1]] (in their
+// original order); each constellation's boundary lies within a cap;
+// and the constellations whose caps overlap HEALPix cell h are
+// cellcons[cellstart[h] ... cellstart[h+1]-1], in ascending order.
+#define INDEX_NSIDE 4
+static int* order = NULL;
+static int constart[CON_FINAL + 1];
+static double capxyz[CON_FINAL * 3];
+static double capr2[CON_FINAL];
+static int* cellstart = NULL;
+static int* cellcons = NULL;
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+static void build_index(void) {
+    int N = N_BOUNDARIES;
+    int ncells = 12 * INDEX_NSIDE * INDEX_NSIDE;
+    il* lists;
+    int i, c, h;
+
+    order = malloc(N * sizeof(int));
+    cellstart = malloc((ncells + 1) * sizeof(int));
+    if (!order || !cellstart) {
+        free(order);
+        free(cellstart);
+        order = cellstart = NULL;
+        return;
+    }
+    memset(constart, 0, sizeof(constart));
+    for (i=0; i<N; i++)
+        constart[boundaries[i].con + 1]++;
+    for (c=0; c<CON_FINAL; c++)
+        constart[c+1] += constart[c];
+    for (i=0; i<N; i++)
+        order[constart[boundaries[i].con]++] = i;
+    memmove(constart + 1, constart, CON_FINAL * sizeof(int));
+    constart[0] = 0;
+
+    lists = il_new(256);
+    for (c=0; c<CON_FINAL; c++) {
+        double* center = capxyz + 3*c;
+        double xyz[3];
+        double maxr2 = 0.;
+        int k;
+        center[0] = center[1] = center[2] = 0.;
+        for (i=constart[c]; i<constart[c+1]; i++) {
+            radecdeg2xyzarr(boundaries[order[i]].ra, boundaries[order[i]].dec,
+                            xyz);
+            for (k=0; k<3; k++)
+                center[k] += xyz[k];
+        }
+        normalize_3(center);
+        for (i=constart[c]; i<constart[c+1]; i++) {
+            radecdeg2xyzarr(boundaries[order[i]].ra, boundaries[order[i]].dec,
+                            xyz);
+            maxr2 = MAX(maxr2, distsq(center, xyz, 3));
+        }
+        // The inside of a boundary lies within its vertices' cap, as
+        // long as that's smaller than a hemisphere; otherwise the
+        // constellation is looked at everywhere.
+        if (maxr2 >= 2.)
+            capr2[c] = 4.;
+        else
+            capr2[c] = deg2distsq(distsq2deg(maxr2) + 1e-6);
+    }
+    for (h=0; h<ncells; h++) {
+        cellstart[h] = il_size(lists);
+        for (c=0; c<CON_FINAL; c++)
+            if (capr2[c] >= 4. ||
+                healpix_within_range_of_xyz(h, INDEX_NSIDE, capxyz + 3*c,
+                                            distsq2deg(capr2[c])))
+                il_append(lists, c);
+    }
+    cellstart[ncells] = il_size(lists);
+    cellcons = malloc(MAX(1, il_size(lists)) * sizeof(int));
+    if (cellcons)
+        il_copy(lists, 0, il_size(lists), cellcons);
+    il_free(lists);
+}
+
+// Is the point "xyz" inside constellation "c"'s boundary?
+static anbool inside(int c, const double* xyz, const int* pts, int npts,
+                     dl* poly) {
+    int j;
+    dl_remove_all(poly);
+    // project the boundary points about the target RA,Dec.
+    for (j=0; j<npts; j++) {
+        double xyzc[3];
+        double px, py;
+        const boundarypoint_t* b = boundaries + (pts ? pts[j] : j);
+        if (!pts && b->con != c)
+            continue;
+        radecdeg2xyzarr(b->ra, b->dec, xyzc);
+        if (!star_coords(xyzc, xyz, TRUE, &px, &py))
+            // the constellation is too far away (on other side of
+            // the sky)
+            return FALSE;
+        dl_append(poly, px);
+        dl_append(poly, py);
+    }
+    // Now we have projected all the boundary points of this
+    // constellation about the query point, which is (0,0) by
+    // definition.  Does the boundary polygon contain (0,0)?
+    return point_in_polygon(0., 0., poly);
+}
+
 /**
  Returns the "enum constellations" number of the constellation
  containing the given RA,Dec point, or -1 if none such is found.
  */
 int constellation_containing(double ra, double dec) {
-    int i;
-    int N = sizeof(boundaries) / sizeof(boundarypoint_t);
+    int i, h, rtn = -1;
     dl* poly = dl_new(256);
     double xyz[3];
     radecdeg2xyzarr(ra, dec, xyz);
 
-    //printf("%i boundary points, %i constellations (%i to %i)\n", N,
-    //CON_FINAL, CON_AND, CON_VUL);
-    for (i=0; i<CON_FINAL; i++) {
-        int j;
-        anbool con_ok;
-        con_ok = TRUE;
-        dl_remove_all(poly);
-        // Find start and end of this constellation, and project
-        // boundary points about the target RA,Dec.
-        for (j=0; j<N; j++) {
-            double xyzc[3];
-            double px, py;
-            if (boundaries[j].con != i)
-                continue;
-            radecdeg2xyzarr(boundaries[j].ra, boundaries[j].dec, xyzc);
-            if (!star_coords(xyzc, xyz, TRUE, &px, &py)) {
-                // the constellation is too far away (on other side of
-                // the sky)
-                con_ok = FALSE;
+    pthread_once(&index_once, build_index);
+    if (!cellcons) {
+        // (couldn't build the index) look at every constellation.
+        for (i=0; i<CON_FINAL; i++)
+            if (inside(i, xyz, NULL, N_BOUNDARIES, poly)) {
+                rtn = i;
                 break;
             }
-            dl_append(poly, px);
-            dl_append(poly, py);
-        }
-        if (!con_ok)
+        dl_free(poly);
+        return rtn;
+    }
+    h = xyzarrtohealpix(xyz, INDEX_NSIDE);
+    for (i=cellstart[h]; i<cellstart[h+1]; i++) {
+        int c = cellcons[i];
+        if (distsq(xyz, capxyz + 3*c, 3) > capr2[c])
             continue;
-        // Now we have projected all the boundary points of this
-        // constellation about the query point, which is (0,0) by
-        // definition.  Does the boundary polygon contain (0,0)?
-        if (point_in_polygon(0., 0., poly))
-            return i;
+        if (inside(c, xyz, order + constart[c], constart[c+1] - constart[c],
+                   poly)) {
+            rtn = c;
+            break;
+        }
     }
-
-    return -1;
+    dl_free(poly);
+    return rtn;
 }
-
-
@@ -4,9 +4,15 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
 
+#include "os-features.h"
 #include "constellations.h"
+#include "starutil.h"
+#include "mathutil.h"
 
 #include "stellarium-constellations.c"
 
@@ -216,3 +222,52 @@ void constellations_get_star_radec(int s, double* ra, double* dec) {
     *dec = radec[1];
 }
 
+
+// the cap around each constellation's stars, computed on first use.
+static double* bounds = NULL;
+static pthread_once_t bounds_once = PTHREAD_ONCE_INIT;
+
+static void compute_bounds(void) {
+    int c;
+    bounds = malloc(constellations_N * 3 * sizeof(double));
+    if (!bounds)
+        return;
+    for (c=0; c<constellations_N; c++) {
+        il* stars = constellations_get_unique_stars(c);
+        double xyzc[3] = { 0., 0., 0. };
+        double xyz[3];
+        double maxr2 = 0.;
+        size_t i;
+        int k;
+        for (i=0; i<il_size(stars); i++) {
+            const double* radec = star_positions + il_get(stars, i)*2;
+            radecdeg2xyzarr(radec[0], radec[1], xyz);
+            for (k=0; k<3; k++)
+                xyzc[k] += xyz[k];
+        }
+        normalize_3(xyzc);
+        for (i=0; i<il_size(stars); i++) {
+            const double* radec = star_positions + il_get(stars, i)*2;
+            radecdeg2xyzarr(radec[0], radec[1], xyz);
+            maxr2 = MAX(maxr2, distsq(xyzc, xyz, 3));
+        }
+        il_free(stars);
+        xyzarr2radecdeg(xyzc, bounds + 3*c, bounds + 3*c + 1);
+        bounds[3*c + 2] = distsq2deg(maxr2);
+    }
+}
+
+void constellations_get_bounds(int c, double* ra, double* dec,
+                               double* radius) {
+    check_const_num(c);
+    pthread_once(&bounds_once, compute_bounds);
+    if (!bounds) {
+        // the whole sky.
+        *ra = *dec = 0.;
+        *radius = 180.;
+        return;
+    }
+    *ra = bounds[3*c];
+    *dec = bounds[3*c + 1];
+    *radius = bounds[3*c + 2];
+}
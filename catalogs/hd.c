@@ -47,7 +47,8 @@ bl* henry_draper_get(hd_catalog_t* hdcat,
 
     radecdeg2xyzarr(racenter, deccenter, xyz);
     r2 = arcsec2distsq(r_arcsec);
-    q = kdtree_rangesearch(hdcat->kd, xyz, r2);
+    q = kdtree_rangesearch_options_reuse(hdcat->kd, kdtree_qres_acquire(), xyz, r2,
+                                         KD_OPTIONS_SORT_DISTS | KD_OPTIONS_NO_RESIZE_RESULTS);
     if (!q) {
         return NULL;
     }
@@ -60,7 +61,7 @@ bl* henry_draper_get(hd_catalog_t* hdcat,
         bl_append(res, &hd);
     }
 
-    kdtree_free_query(q);
+    kdtree_qres_release(q);
 
     return res;
 }
@@ -0,0 +1,136 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "os-features.h"
+#include "healpix-buckets.h"
+#include "healpix.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "permutedsort.h"
+#include "errors.h"
+
+struct healpix_buckets {
+    int N;
+    int Nside;
+    // unit vectors, in bucket order
+    double* xyz;
+    // the points in cell c are [cellstart[c], cellstart[c+1])
+    int* cellstart;
+    // catalog index of each point, in bucket order
+    int* inds;
+};
+
+static healpix_buckets_t* buckets_new(const double* xyz, int N, int Nside) {
+    healpix_buckets_t* b;
+    int ncells = 12 * Nside * Nside;
+    int* cell;
+    int i;
+
+    b = calloc(1, sizeof(healpix_buckets_t));
+    cell = malloc(MAX(1, N) * sizeof(int));
+    if (b) {
+        b->cellstart = calloc(ncells + 1, sizeof(int));
+        b->inds = malloc(MAX(1, N) * sizeof(int));
+        b->xyz = malloc(MAX(1, N) * 3 * sizeof(double));
+    }
+    if (!b || !cell || !b->cellstart || !b->inds || !b->xyz) {
+        SYSERROR("Failed to allocate HEALPix buckets for %i points", N);
+        free(cell);
+        healpix_buckets_free(b);
+        return NULL;
+    }
+    b->N = N;
+    b->Nside = Nside;
+    // counting sort into the cells (which keeps catalog order within
+    // each cell).
+    for (i=0; i<N; i++) {
+        cell[i] = xyzarrtohealpix(xyz + 3*i, Nside);
+        b->cellstart[cell[i] + 1]++;
+    }
+    for (i=0; i<ncells; i++)
+        b->cellstart[i+1] += b->cellstart[i];
+    for (i=0; i<N; i++) {
+        int k = b->cellstart[cell[i]]++;
+        b->inds[k] = i;
+        memcpy(b->xyz + 3*k, xyz + 3*i, 3 * sizeof(double));
+    }
+    // (the counting sort left each cellstart at the next cell's start.)
+    memmove(b->cellstart + 1, b->cellstart, ncells * sizeof(int));
+    b->cellstart[0] = 0;
+    free(cell);
+    return b;
+}
+
+healpix_buckets_t* healpix_buckets_new(const double* ra, const double* dec,
+                                       int stride, int N, int Nside) {
+    healpix_buckets_t* b;
+    double* xyz = malloc(MAX(1, N) * 3 * sizeof(double));
+    int i;
+    if (!xyz) {
+        SYSERROR("Failed to allocate HEALPix buckets for %i points", N);
+        return NULL;
+    }
+    for (i=0; i<N; i++)
+        radecdeg2xyzarr(*(const double*)((const char*)ra + (size_t)i * stride),
+                        *(const double*)((const char*)dec + (size_t)i * stride),
+                        xyz + 3*i);
+    b = buckets_new(xyz, N, Nside);
+    free(xyz);
+    return b;
+}
+
+healpix_buckets_t* healpix_buckets_new_f(const float* ra, const float* dec,
+                                         int stride, int N, int Nside) {
+    healpix_buckets_t* b;
+    double* xyz = malloc(MAX(1, N) * 3 * sizeof(double));
+    int i;
+    if (!xyz) {
+        SYSERROR("Failed to allocate HEALPix buckets for %i points", N);
+        return NULL;
+    }
+    for (i=0; i<N; i++)
+        radecdeg2xyzarr(*(const float*)((const char*)ra + (size_t)i * stride),
+                        *(const float*)((const char*)dec + (size_t)i * stride),
+                        xyz + 3*i);
+    b = buckets_new(xyz, N, Nside);
+    free(xyz);
+    return b;
+}
+
+int* healpix_buckets_within(const healpix_buckets_t* b, double ra,
+                            double dec, double radius, int* N) {
+    double xyz[3];
+    double r2;
+    int ncells = 12 * b->Nside * b->Nside;
+    int* inds;
+    int c, k, n = 0;
+
+    radecdeg2xyzarr(ra, dec, xyz);
+    r2 = deg2distsq(MIN(radius, 180.));
+    inds = malloc(MAX(1, b->N) * sizeof(int));
+    for (c=0; c<ncells; c++) {
+        if (b->cellstart[c] == b->cellstart[c+1])
+            continue;
+        if (!healpix_within_range_of_xyz(c, b->Nside, xyz, radius))
+            continue;
+        for (k=b->cellstart[c]; k<b->cellstart[c+1]; k++)
+            if (distsq(xyz, b->xyz + 3*k, 3) <= r2)
+                inds[n++] = b->inds[k];
+    }
+    qsort(inds, n, sizeof(int), compare_ints_asc);
+    *N = n;
+    return inds;
+}
+
+void healpix_buckets_free(healpix_buckets_t* b) {
+    if (!b)
+        return;
+    free(b->xyz);
+    free(b->cellstart);
+    free(b->inds);
+    free(b);
+}
@@ -20,14 +20,16 @@
 #include "starutil.h"
 #include "fitsioutils.h"
 #include "boilerplate.h"
+#include "catalog-ingest.h"
 
-#define OPTIONS "ho:N:"
+#define OPTIONS "ho:N:t:"
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
     printf("\nUsage:\n"
            "  %s -o <output-filename-template>     [eg, nomad_%%03i.fits]\n"
            "  [-N <healpix-nside>]  (default = 9)\n"
+           "  [-t <threads>]        (parse this many files at once; default = 1)\n"
            "  <input-file> [<input-file> ...]\n"
            "\n"
            "The output-filename-template should contain a \"printf\" sequence like \"%%03i\";\n"
@@ -38,14 +40,145 @@ void print_help(char* progname) {
 }
 
 
+typedef struct {
+    char* outfn;
+    int Nside;
+    int argc;
+    char** args;
+    int nfiles;
+    int nrecords;
+    int* slicecounts;
+    nomad_fits** nomads;
+} nomad_ingest_t;
+
+static int parse_input(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    FILE* fid;
+    unsigned char* map;
+    size_t map_size;
+    size_t i;
+    int rtn = -1;
+
+    fid = fopen(infn, "rb");
+    if (!fid) {
+        fprintf(stderr, "Couldn't open input file %s: %s\n", infn, strerror(errno));
+        return -1;
+    }
+    if (fseeko(fid, 0, SEEK_END)) {
+        fprintf(stderr, "Couldn't seek to end of input file %s: %s\n", infn, strerror(errno));
+        fclose(fid);
+        return -1;
+    }
+    map_size = ftello(fid);
+    fseeko(fid, 0, SEEK_SET);
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fid), 0);
+    fclose(fid);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't mmap input file %s: %s\n", infn, strerror(errno));
+        return -1;
+    }
+
+    if (map_size % NOMAD_RECORD_SIZE) {
+        fprintf(stderr, "Warning, input file %s has size %u which is not divisible into %i-byte records.\n",
+                infn, (unsigned int)map_size, NOMAD_RECORD_SIZE);
+    }
+
+    for (i=0; i+NOMAD_RECORD_SIZE<=map_size; i+=NOMAD_RECORD_SIZE) {
+        nomad_entry* entry = catalog_batch_append(batch);
+        if (!entry)
+            goto bailout;
+        if (nomad_parse_entry(entry, map + i)) {
+            fprintf(stderr, "Failed to parse NOMAD entry: offset %i in file %s.\n",
+                    (int)i, infn);
+            goto bailout;
+        }
+    }
+    rtn = 0;
+ bailout:
+    munmap(map, map_size);
+    return rtn;
+}
+
+static int write_entries(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    nomad_ingest_t* ni = token;
+    nomad_fits** nomads = ni->nomads;
+    int* slicecounts = ni->slicecounts;
+    int i;
+    int lastgrass;
+
+    if (fileindex && (fileindex % 100 == 0)) {
+        printf("\nReading file %i of %i: %s\n", fileindex, ni->nfiles, infn);
+    }
+    printf("File %i of %i: %s: %i records.\n", fileindex, ni->nfiles, infn, batch->nentries);
+
+    lastgrass = 0;
+    for (i=0; i<batch->nentries; i++) {
+        nomad_entry* entry = (nomad_entry*)batch->entries + i;
+        int hp;
+        int slice;
+
+        if (((int64_t)i * 80 / batch->nentries) != lastgrass) {
+            printf(".");
+            fflush(stdout);
+            lastgrass = (int64_t)i * 80 / batch->nentries;
+        }
+
+        // compute the nomad_id based on its DEC slice and index; this
+        // depends on the entries of all previous files, so is done here,
+        // in file order.
+        slice = (int)(10.0 * (entry->dec + 90.0));
+        assert(slice < 1800);
+        assert((slicecounts[slice] & 0xffe00000) == 0);
+        entry->nomad_id = (slice << 21) | (slicecounts[slice]);
+        slicecounts[slice]++;
+
+        hp = radectohealpix(deg2rad(entry->ra), deg2rad(entry->dec), ni->Nside);
+
+        if (!nomads[hp]) {
+            char fn[256];
+            sprintf(fn, ni->outfn, hp);
+            nomads[hp] = nomad_fits_open_for_writing(fn);
+            if (!nomads[hp]) {
+                fprintf(stderr, "Failed to initialized FITS file %i (filename %s).\n", hp, fn);
+                return -1;
+            }
+
+            // header remarks...
+            fits_header_add_int(nomads[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
+            fits_header_add_int(nomads[hp]->header, "NSIDE", ni->Nside, "The healpix resolution.");
+            BOILERPLATE_ADD_FITS_HEADERS(nomads[hp]->header);
+            qfits_header_add(nomads[hp]->header, "HISTORY", "Created by the program \"nomadtofits\"", NULL, NULL);
+            qfits_header_add(nomads[hp]->header, "HISTORY", "nomadtofits command line:", NULL, NULL);
+            fits_add_args(nomads[hp]->header, ni->args, ni->argc);
+            qfits_header_add(nomads[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
+
+            if (nomad_fits_write_headers(nomads[hp])) {
+                fprintf(stderr, "Failed to write header for FITS file %s.\n", fn);
+                return -1;
+            }
+        }
+
+        if (nomad_fits_write_entry(nomads[hp], entry)) {
+            fprintf(stderr, "Failed to write FITS entry.\n");
+            return -1;
+        }
+
+        ni->nrecords++;
+    }
+    printf("\n");
+    return 0;
+}
+
 int main(int argc, char** args) {
     char* outfn = NULL;
     int c;
-    int startoptind;
     int nrecords, nfiles;
+    int nthreads = 1;
     int Nside = 9;
 
     nomad_fits** nomads;
+    nomad_ingest_t ni;
 
     int i, HP;
     int slicecounts[1800];
@@ -62,6 +195,9 @@ int main(int argc, char** args) {
         case 'o':
             outfn = optarg;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         }
     }
 
@@ -84,120 +220,22 @@ int main(int argc, char** args) {
 
     memset(slicecounts, 0, 1800 * sizeof(uint));
 
-    nrecords = 0;
-    nfiles = 0;
-
     printf("Reading NOMAD files... ");
     fflush(stdout);
 
-    startoptind = optind;
-    for (; optind<argc; optind++) {
-        char* infn;
-        FILE* fid;
-        unsigned char* map;
-        size_t map_size;
-        int i;
-        int lastgrass;
-
-        infn = args[optind];
-        fid = fopen(infn, "rb");
-        if (!fid) {
-            fprintf(stderr, "Couldn't open input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-
-        if ((optind > startoptind) && ((optind - startoptind) % 100 == 0)) {
-            printf("\nReading file %i of %i: %s\n", optind - startoptind,
-                   argc - startoptind, infn);
-        }
-
-        if (fseeko(fid, 0, SEEK_END)) {
-            fprintf(stderr, "Couldn't seek to end of input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-
-        map_size = ftello(fid);
-
-        fseeko(fid, 0, SEEK_SET);
-
-        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fid), 0);
-        if (map == MAP_FAILED) {
-            fprintf(stderr, "Couldn't mmap input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-        fclose(fid);
-
-        if (map_size % NOMAD_RECORD_SIZE) {
-            fprintf(stderr, "Warning, input file %s has size %u which is not divisible into %i-byte records.\n",
-                    infn, (unsigned int)map_size, NOMAD_RECORD_SIZE);
-        }
-
-        printf("File %i of %i: %s: %i records.\n", optind - startoptind, argc - startoptind, infn, (int)(map_size / NOMAD_RECORD_SIZE));
-
-        lastgrass = 0;
-        for (i=0; i<map_size; i+=NOMAD_RECORD_SIZE) {
-            nomad_entry entry;
-            int hp;
-            int slice;
-
-            if ((i * 80 / map_size) != lastgrass) {
-                printf(".");
-                fflush(stdout);
-                lastgrass = i * 80 / map_size;
-            }
-			
-            if (nomad_parse_entry(&entry, map + i)) {
-                fprintf(stderr, "Failed to parse NOMAD entry: offset %i in file %s.\n",
-                        i, infn);
-                exit(-1);
-            }
-
-            // compute the nomad_id based on its DEC slice and index.
-            slice = (int)(10.0 * (entry.dec + 90.0));
-            assert(slice < 1800);
-            assert((slicecounts[slice] & 0xffe00000) == 0);
-            entry.nomad_id = (slice << 21) | (slicecounts[slice]);
-            slicecounts[slice]++;
-
-            hp = radectohealpix(deg2rad(entry.ra), deg2rad(entry.dec), Nside);
-
-            if (!nomads[hp]) {
-                char fn[256];
-                sprintf(fn, outfn, hp);
-                nomads[hp] = nomad_fits_open_for_writing(fn);
-                if (!nomads[hp]) {
-                    fprintf(stderr, "Failed to initialized FITS file %i (filename %s).\n", hp, fn);
-                    exit(-1);
-                }
-
-                // header remarks...
-                fits_header_add_int(nomads[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
-                fits_header_add_int(nomads[hp]->header, "NSIDE", Nside, "The healpix resolution.");
-                BOILERPLATE_ADD_FITS_HEADERS(nomads[hp]->header);
-                qfits_header_add(nomads[hp]->header, "HISTORY", "Created by the program \"nomadtofits\"", NULL, NULL);
-                qfits_header_add(nomads[hp]->header, "HISTORY", "nomadtofits command line:", NULL, NULL);
-                fits_add_args(nomads[hp]->header, args, argc);
-                qfits_header_add(nomads[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
-
-                if (nomad_fits_write_headers(nomads[hp])) {
-                    fprintf(stderr, "Failed to write header for FITS file %s.\n", fn);
-                    exit(-1);
-                }
-            }
-
-            if (nomad_fits_write_entry(nomads[hp], &entry)) {
-                fprintf(stderr, "Failed to write FITS entry.\n");
-                exit(-1);
-            }
-
-            nrecords++;
-        }
-
-        munmap(map, map_size);
-
-        nfiles++;
-        printf("\n");
-    }
+    ni.outfn = outfn;
+    ni.Nside = Nside;
+    ni.argc = argc;
+    ni.args = args;
+    ni.nfiles = argc - optind;
+    ni.nrecords = 0;
+    ni.slicecounts = slicecounts;
+    ni.nomads = nomads;
+    if (catalog_ingest(args + optind, argc - optind, nthreads,
+                       sizeof(nomad_entry), parse_input, write_entries, &ni))
+        exit(-1);
+    nfiles = argc - optind;
+    nrecords = ni.nrecords;
     printf("\n");
 
     // close all the files...
@@ -6,10 +6,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "openngc.h"
 #include "bl.h"
 #include "ioutils.h"
+#include "healpix-buckets.h"
 
 struct ngc_name {
     anbool is_ngc;
@@ -129,3 +131,20 @@ char* ngc_get_name_list(ngc_entry* entry, const char* separator) {
     return str;
 }
 
+
+static healpix_buckets_t* buckets = NULL;
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void build_buckets(void) {
+    buckets = healpix_buckets_new_f(&ngc_entries[0].ra, &ngc_entries[0].dec,
+                                    sizeof(ngc_entry), ngc_num_entries(), 8);
+}
+
+int* ngc_entries_within(double ra, double dec, double radius, int* N) {
+    pthread_once(&buckets_once, build_buckets);
+    if (!buckets) {
+        *N = 0;
+        return NULL;
+    }
+    return healpix_buckets_within(buckets, ra, dec, radius, N);
+}
@@ -0,0 +1,91 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cutest.h"
+#include "catalog-ingest.h"
+
+// Fake input: file "k" holds entries k*1000 .. k*1000 + (k*37 % 500).
+typedef struct {
+    int nwritten;
+    int nextfile;
+    int inorder;
+    int failfile;
+} ingest_test_t;
+
+static int fake_parse(const char* fn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    ingest_test_t* t = token;
+    int n = (fileindex * 37) % 500;
+    int i;
+    if (fileindex == t->failfile)
+        return -1;
+    for (i=0; i<n; i++) {
+        int* e = catalog_batch_append(batch);
+        if (!e)
+            return -1;
+        *e = fileindex * 1000 + i;
+    }
+    return 0;
+}
+
+static int fake_write(const char* fn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    ingest_test_t* t = token;
+    int i;
+    if (fileindex != t->nextfile)
+        t->inorder = 0;
+    if (batch->nentries != (fileindex * 37) % 500)
+        t->inorder = 0;
+    for (i=0; i<batch->nentries; i++)
+        if (((int*)batch->entries)[i] != fileindex * 1000 + i)
+            t->inorder = 0;
+    t->nextfile++;
+    t->nwritten += batch->nentries;
+    return 0;
+}
+
+static void run_ingest(CuTest* tc, int nthreads, int failfile) {
+    char* fns[40];
+    char names[40][16];
+    ingest_test_t t;
+    int i, expect = 0;
+    for (i=0; i<40; i++) {
+        sprintf(names[i], "file%02i", i);
+        fns[i] = names[i];
+        if (failfile < 0)
+            expect += (i * 37) % 500;
+    }
+    t.nwritten = 0;
+    t.nextfile = 0;
+    t.inorder = 1;
+    t.failfile = failfile;
+    CuAssertIntEquals(tc, (failfile < 0) ? 0 : -1,
+                      catalog_ingest(fns, 40, nthreads, sizeof(int),
+                                     fake_parse, fake_write, &t));
+    CuAssertIntEquals(tc, 1, t.inorder);
+    if (failfile < 0) {
+        CuAssertIntEquals(tc, 40, t.nextfile);
+        CuAssertIntEquals(tc, expect, t.nwritten);
+    } else {
+        // nothing at or after the failed file gets written.
+        CuAssertTrue(tc, t.nextfile <= failfile);
+    }
+}
+
+void test_ingest_serial(CuTest* tc) {
+    run_ingest(tc, 1, -1);
+}
+
+void test_ingest_threaded(CuTest* tc) {
+    run_ingest(tc, 4, -1);
+    run_ingest(tc, 64, -1);
+}
+
+void test_ingest_failure(CuTest* tc) {
+    run_ingest(tc, 1, 17);
+    run_ingest(tc, 4, 17);
+}
@@ -0,0 +1,68 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "healpix-buckets.h"
+#include "brightstars.h"
+#include "constellation-boundaries.h"
+#include "starutil.h"
+
+void test_buckets_within(CuTest* tc) {
+    int N = 5000;
+    double* radec = malloc(N * 2 * sizeof(double));
+    healpix_buckets_t* b;
+    int i, q;
+    srand(3);
+    for (i=0; i<N; i++) {
+        radec[2*i] = 360. * rand() / (double)RAND_MAX;
+        radec[2*i+1] = asin(2. * rand() / (double)RAND_MAX - 1.) * 180. / M_PI;
+    }
+    b = healpix_buckets_new(radec, radec + 1, 2 * sizeof(double), N, 8);
+    CuAssertPtrNotNull(tc, b);
+    for (q=0; q<100; q++) {
+        double ra = 360. * rand() / (double)RAND_MAX;
+        double dec = 180. * rand() / (double)RAND_MAX - 90.;
+        double radius = (q == 0) ? 180. : 20. * rand() / (double)RAND_MAX;
+        int n, k = 0;
+        int* inds = healpix_buckets_within(b, ra, dec, radius, &n);
+        // the same points, in the same order, as checking them all.
+        for (i=0; i<N; i++) {
+            if (distsq2deg(distsq_between_radecdeg(ra, dec, radec[2*i],
+                                                   radec[2*i+1])) > radius)
+                continue;
+            CuAssertTrue(tc, k < n);
+            CuAssertIntEquals(tc, i, inds[k]);
+            k++;
+        }
+        CuAssertIntEquals(tc, k, n);
+        free(inds);
+    }
+    healpix_buckets_free(b);
+    free(radec);
+}
+
+void test_bright_stars_within(CuTest* tc) {
+    int n, i;
+    // Betelgeuse and Rigel are about 18.6 degrees apart.
+    int* inds = bright_stars_within(81.3, 0.0, 12., &n);
+    int gotbetel = 0, gotrigel = 0;
+    CuAssertPtrNotNull(tc, inds);
+    for (i=0; i<n; i++) {
+        const brightstar_t* bs = bright_stars_get(inds[i]);
+        if (strstr(bs->common_name, "Betelgeuse"))
+            gotbetel = 1;
+        if (strstr(bs->common_name, "Rigel"))
+            gotrigel = 1;
+    }
+    CuAssertIntEquals(tc, 1, gotbetel);
+    CuAssertIntEquals(tc, 1, gotrigel);
+    free(inds);
+    // and the constellation lookup, through its index.
+    CuAssertIntEquals(tc, CON_ORI, constellation_containing(88.79, 7.41));
+}
@@ -18,8 +18,9 @@
 #include "healpix.h"
 #include "boilerplate.h"
 #include "fitsioutils.h"
+#include "catalog-ingest.h"
 
-#define OPTIONS "ho:HN:"
+#define OPTIONS "ho:HN:t:"
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -27,12 +28,169 @@ void print_help(char* progname) {
            "  %s -o <output-filename(-template)>   (eg, tycho2_hp%%02i.fits if you use the -H option)\n"
            "  [-H]: do healpixification\n"
            "  [-N <healpix-nside>]\n"
+           "  [-t <threads>]: parse this many files at once (default 1)\n"
            "  <input-file> [<input-file> ...]\n\n"
            "(Healpixification isn't usually necessary because the Tycho-2 catalog is small.)\n\n",
            progname);
 }
 
 
+typedef struct {
+    char* outfn;
+    int Nside;
+    int do_hp;
+    int argc;
+    char** args;
+    // per input file: is it in the supplement format?
+    anbool* supplement;
+    int nrecords;
+    int nobs;
+    tycho2_fits** tycs;
+} tycho2_ingest_t;
+
+static int parse_input(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    tycho2_ingest_t* ti = token;
+    FILE* fid;
+    char* map;
+    size_t map_size;
+    size_t i;
+    anbool supplement;
+    int recsize;
+    int rtn = -1;
+
+    fid = fopen(infn, "rb");
+    if (!fid) {
+        fprintf(stderr, "Couldn't open input file %s: %s\n", infn, strerror(errno));
+        return -1;
+    }
+
+    if (fseeko(fid, 0, SEEK_END)) {
+        fprintf(stderr, "Couldn't seek to end of input file %s: %s\n", infn, strerror(errno));
+        fclose(fid);
+        return -1;
+    }
+    map_size = ftello(fid);
+    fseeko(fid, 0, SEEK_SET);
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fid), 0);
+    fclose(fid);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't mmap input file %s: %s\n", infn, strerror(errno));
+        return -1;
+    }
+
+    supplement = tycho2_guess_is_supplement(map);
+    ti->supplement[fileindex] = supplement;
+
+    if (supplement) {
+        recsize = TYCHO_SUPPLEMENT_RECORD_SIZE_RAW;
+    } else {
+        recsize = TYCHO_RECORD_SIZE_RAW;
+    }
+
+    if ((map_size % recsize) && (map_size % (recsize+1)) && (map_size % (recsize+2))) {
+        fprintf(stderr, "Warning, input file %s has size %u which is not divisible into %i-, %i-, or %i-byte records.\n",
+                infn, (uint)map_size, recsize, recsize+1, recsize+2);
+    }
+
+    for (i=0; i<map_size;) {
+        tycho2_entry* entry = catalog_batch_append(batch);
+        if (!entry)
+            goto bailout;
+        if (supplement) {
+            if (tycho2_supplement_parse_entry(map + i, entry)) {
+                fprintf(stderr, "Failed to parse TYCHO-2 supplement entry: offset %i in file %s.\n",
+                        (int)i, infn);
+                goto bailout;
+            }
+        } else {
+            if (tycho2_parse_entry(map + i, entry)) {
+                fprintf(stderr, "Failed to parse TYCHO-2 entry: offset %i in file %s.\n",
+                        (int)i, infn);
+                goto bailout;
+            }
+        }
+        i += recsize;
+        // skip past "\r" and "\n".
+        while ((i < map_size) &&
+               ((map[i] == '\r') || (map[i] == '\n')))
+            i++;
+    }
+    rtn = 0;
+ bailout:
+    munmap(map, map_size);
+    return rtn;
+}
+
+static int write_entries(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    tycho2_ingest_t* ti = token;
+    tycho2_fits** tycs = ti->tycs;
+    int i;
+
+    printf("File %s: supplement format: %s\n", infn,
+           (ti->supplement[fileindex] ? "Yes" : "No"));
+
+    for (i=0; i<batch->nentries; i++) {
+        tycho2_entry* entry = (tycho2_entry*)batch->entries + i;
+        int hp;
+
+        if (ti->do_hp) {
+            hp = radectohealpix(deg2rad(entry->ra), deg2rad(entry->dec), ti->Nside);
+        } else {
+            hp = 0;
+        }
+
+        if (!tycs[hp]) {
+            char fn[256];
+            qfits_header* hdr;
+            sprintf(fn, ti->outfn, hp);
+            tycs[hp] = tycho2_fits_open_for_writing(fn);
+            if (!tycs[hp]) {
+                fprintf(stderr, "Failed to initialized FITS output file %s.\n", fn);
+                return -1;
+            }
+            hdr = tycho2_fits_get_header(tycs[hp]);
+
+            // header remarks...
+            qfits_header_add(hdr, "HEALPIXD", (ti->do_hp ? "T" : "F"), "Is this catalog healpixified?", NULL);
+            if (ti->do_hp) {
+                fits_header_add_int(hdr, "HEALPIX", hp, "The healpix number of this catalog.");
+                fits_header_add_int(hdr, "NSIDE", ti->Nside, "The healpix resolution.");
+            }
+
+            BOILERPLATE_ADD_FITS_HEADERS(hdr);
+
+            qfits_header_add(hdr, "HISTORY", "Created by the program \"tycho2tofits\"", NULL, NULL);
+            qfits_header_add(hdr, "HISTORY", "tycho2tofits command line:", NULL, NULL);
+            fits_add_args(hdr, ti->args, ti->argc);
+            qfits_header_add(hdr, "HISTORY", "(end of command line)", NULL, NULL);
+
+            if (tycho2_fits_write_headers(tycs[hp])) {
+                fprintf(stderr, "Failed to write header for FITS file %s.\n", fn);
+                return -1;
+            }
+        }
+
+        if (tycho2_fits_write_entry(tycs[hp], entry)) {
+            fprintf(stderr, "Failed to write Tycho-2 FITS entry.\n");
+            return -1;
+        }
+
+        if (i && (i % 100000 == 0)) {
+            printf(".");
+            fflush(stdout);
+        }
+
+        ti->nrecords++;
+        ti->nobs += entry->nobs;
+    }
+
+    printf(".");
+    fflush(stdout);
+    return 0;
+}
+
 int main(int argc, char** args) {
     char* outfn = NULL;
     int c;
@@ -41,6 +199,8 @@ int main(int argc, char** args) {
     tycho2_fits** tycs;
     int i, HP;
     int do_hp = 0;
+    int nthreads = 1;
+    tycho2_ingest_t ti;
 
     while ((c = getopt(argc, args, OPTIONS)) != -1) {
         switch (c) {
@@ -57,6 +217,9 @@ int main(int argc, char** args) {
         case 'o':
             outfn = optarg;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         }
     }
 
@@ -80,136 +243,24 @@ int main(int argc, char** args) {
     tycs = malloc(HP * sizeof(tycho2_fits*));
     memset(tycs, 0, HP * sizeof(tycho2_fits*));
 
-    nrecords = 0;
-    nobs = 0;
-
     printf("Reading Tycho-2 files... \n");
     fflush(stdout);
 
-    for (; optind<argc; optind++) {
-        char* infn;
-        FILE* fid;
-        char* map;
-        size_t map_size;
-        int i;
-        anbool supplement;
-        int recsize;
-
-        infn = args[optind];
-        fid = fopen(infn, "rb");
-        if (!fid) {
-            fprintf(stderr, "Couldn't open input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-
-        if (fseeko(fid, 0, SEEK_END)) {
-            fprintf(stderr, "Couldn't seek to end of input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-        map_size = ftello(fid);
-        fseeko(fid, 0, SEEK_SET);
-        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(fid), 0);
-        if (map == MAP_FAILED) {
-            fprintf(stderr, "Couldn't mmap input file %s: %s\n", infn, strerror(errno));
-            exit(-1);
-        }
-        fclose(fid);
-
-        supplement = tycho2_guess_is_supplement(map);
-        printf("File %s: supplement format: %s\n", infn, (supplement ? "Yes" : "No"));
-
-        if (supplement) {
-            recsize = TYCHO_SUPPLEMENT_RECORD_SIZE_RAW;
-        } else {
-            recsize = TYCHO_RECORD_SIZE_RAW;
-        }
-
-        if ((map_size % recsize) && (map_size % (recsize+1)) && (map_size % (recsize+2))) {
-            fprintf(stderr, "Warning, input file %s has size %u which is not divisible into %i-, %i-, or %i-byte records.\n",
-                    infn, (uint)map_size, recsize, recsize+1, recsize+2);
-        }
-
-        for (i=0; i<map_size;) {
-            tycho2_entry entry;
-            int hp;
-
-            if (supplement) {
-                if (tycho2_supplement_parse_entry(map + i, &entry)) {
-                    fprintf(stderr, "Failed to parse TYCHO-2 supplement entry: offset %i in file %s.\n",
-                            i, infn);
-                    exit(-1);
-                }
-            } else {
-                if (tycho2_parse_entry(map + i, &entry)) {
-                    fprintf(stderr, "Failed to parse TYCHO-2 entry: offset %i in file %s.\n",
-                            i, infn);
-                    exit(-1);
-                }
-            }
-            //printf("RA, DEC (%g, %g)\n", entry.RA, entry.DEC);
-
-            i += recsize;
-            // skip past "\r" and "\n".
-            while ((i < map_size) &&
-                   ((map[i] == '\r') || (map[i] == '\n')))
-                i++;
-
-            if (do_hp) {
-                hp = radectohealpix(deg2rad(entry.ra), deg2rad(entry.dec), Nside);
-            } else {
-                hp = 0;
-            }
-
-            if (!tycs[hp]) {
-                char fn[256];
-                qfits_header* hdr;
-                sprintf(fn, outfn, hp);
-                tycs[hp] = tycho2_fits_open_for_writing(fn);
-                if (!tycs[hp]) {
-                    fprintf(stderr, "Failed to initialized FITS output file %s.\n", fn);
-                    exit(-1);
-                }
-                hdr = tycho2_fits_get_header(tycs[hp]);
-
-                // header remarks...
-                qfits_header_add(hdr, "HEALPIXD", (do_hp ? "T" : "F"), "Is this catalog healpixified?", NULL);
-                if (do_hp) {
-                    fits_header_add_int(hdr, "HEALPIX", hp, "The healpix number of this catalog.");
-                    fits_header_add_int(hdr, "NSIDE", Nside, "The healpix resolution.");
-                }
-
-                BOILERPLATE_ADD_FITS_HEADERS(hdr);
-
-                qfits_header_add(hdr, "HISTORY", "Created by the program \"tycho2tofits\"", NULL, NULL);
-                qfits_header_add(hdr, "HISTORY", "tycho2tofits command line:", NULL, NULL);
-                fits_add_args(hdr, args, argc);
-                qfits_header_add(hdr, "HISTORY", "(end of command line)", NULL, NULL);
-
-                if (tycho2_fits_write_headers(tycs[hp])) {
-                    fprintf(stderr, "Failed to write header for FITS file %s.\n", fn);
-                    exit(-1);
-                }
-            }
-
-            if (tycho2_fits_write_entry(tycs[hp], &entry)) {
-                fprintf(stderr, "Failed to write Tycho-2 FITS entry.\n");
-                exit(-1);
-            }
-
-            if (i && ((i/recsize) % 100000 == 0)) {
-                printf(".");
-                fflush(stdout);
-            }
-
-            nrecords++;
-            nobs += entry.nobs;
-        }
-
-        munmap(map, map_size);
-
-        printf(".");
-        fflush(stdout);
-    }
+    ti.outfn = outfn;
+    ti.Nside = Nside;
+    ti.do_hp = do_hp;
+    ti.argc = argc;
+    ti.args = args;
+    ti.supplement = calloc(argc - optind, sizeof(anbool));
+    ti.nrecords = 0;
+    ti.nobs = 0;
+    ti.tycs = tycs;
+    if (catalog_ingest(args + optind, argc - optind, nthreads,
+                       sizeof(tycho2_entry), parse_input, write_entries, &ti))
+        exit(-1);
+    free(ti.supplement);
+    nrecords = ti.nrecords;
+    nobs = ti.nobs;
     printf("\n");
 
     // close all the files...
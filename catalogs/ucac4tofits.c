@@ -23,14 +23,16 @@
 #include "log.h"
 #include "errors.h"
 #include "boilerplate.h"
+#include "catalog-ingest.h"
 
-#define OPTIONS "ho:N:"
+#define OPTIONS "ho:N:t:"
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
     printf("\nUsage:\n"
            "  %s -o <output-filename-template>     [default: ucac4_%%03i.fits]\n"
            "  [-N <healpix-nside>]  (default = 9)\n"
+           "  [-t <threads>]        (decompress this many files at once; default = 1)\n"
            "  <input-file> [<input-file> ...]\n"
            "\n"
            "The output-filename-template should contain a \"printf\" sequence like \"%%03i\";\n"
@@ -43,19 +45,123 @@ void print_help(char* progname) {
 
 #define CHECK_BZERR()                                                   \
     do { if (bzerr != BZ_OK) { ERROR("bzip2 error: code %i", bzerr);	\
-            BZ2_bzReadClose(&bzerr, bzfid); exit(-1); }} while (0);
+            BZ2_bzReadClose(&bzerr, bzfid); fclose(fid); return -1; }} while (0);
+
+typedef struct {
+    char* outfn;
+    int Nside;
+    int argc;
+    char** args;
+    int nfiles;
+    int nrecords;
+    ucac4_fits** ucacs;
+} ucac4_ingest_t;
+
+static int parse_input(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    FILE* fid;
+    BZFILE* bzfid = NULL;
+    int bzerr;
+    int i;
+
+    fid = fopen(infn, "rb");
+    if (!fid) {
+        SYSERROR("Couldn't open input file \"%s\"", infn);
+        return -1;
+    }
+
+    // MAGIC 1: bzip verbosity: [0=silent, 4=debug]
+    // 0: small -- don't use less memory
+    bzfid = BZ2_bzReadOpen(&bzerr, fid, 1, 0, NULL, 0);
+    CHECK_BZERR();
+
+    for (i=0;; i++) {
+        ucac4_entry* entry;
+        char buf[UCAC4_RECORD_SIZE];
+        int nr;
+        anbool eof = 0;
+
+        nr = BZ2_bzRead(&bzerr, bzfid, buf, UCAC4_RECORD_SIZE);
+        if ((bzerr == BZ_STREAM_END) && (nr == UCAC4_RECORD_SIZE))
+            eof = TRUE;
+        else
+            CHECK_BZERR();
+
+        entry = catalog_batch_append(batch);
+        if (!entry || ucac4_parse_entry(entry, buf)) {
+            ERROR("Failed to parse UCAC4 entry %i in file \"%s\".", i, infn);
+            BZ2_bzReadClose(&bzerr, bzfid);
+            fclose(fid);
+            return -1;
+        }
+        if (eof)
+            break;
+    }
+
+    BZ2_bzReadClose(&bzerr, bzfid);
+    fclose(fid);
+    return 0;
+}
+
+static int write_entries(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    ucac4_ingest_t* ui = token;
+    ucac4_fits** ucacs = ui->ucacs;
+    int i;
+
+    printf("Reading %s\n", infn);
+    if (fileindex && (fileindex % 100 == 0)) {
+        printf("\nReading file %i of %i: %s\n", fileindex, ui->nfiles, infn);
+    }
+    fflush(stdout);
+
+    for (i=0; i<batch->nentries; i++) {
+        ucac4_entry* entry = (ucac4_entry*)batch->entries + i;
+        int hp;
+
+        hp = radecdegtohealpix(entry->ra, entry->dec, ui->Nside);
+
+        if (!ucacs[hp]) {
+            char fn[256];
+            sprintf(fn, ui->outfn, hp);
+            ucacs[hp] = ucac4_fits_open_for_writing(fn);
+            if (!ucacs[hp]) {
+                ERROR("Failed to initialize FITS file %i (filename %s)", hp, fn);
+                return -1;
+            }
+            fits_header_add_int(ucacs[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
+            fits_header_add_int(ucacs[hp]->header, "NSIDE", ui->Nside, "The healpix resolution.");
+            BOILERPLATE_ADD_FITS_HEADERS(ucacs[hp]->header);
+            qfits_header_add(ucacs[hp]->header, "HISTORY", "Created by the program \"ucac4tofits\"", NULL, NULL);
+            qfits_header_add(ucacs[hp]->header, "HISTORY", "ucac4tofits command line:", NULL, NULL);
+            fits_add_args(ucacs[hp]->header, ui->args, ui->argc);
+            qfits_header_add(ucacs[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
+            if (ucac4_fits_write_headers(ucacs[hp])) {
+                ERROR("Failed to write header for FITS file %s", fn);
+                return -1;
+            }
+        }
+        if (ucac4_fits_write_entry(ucacs[hp], entry)) {
+            ERROR("Failed to write FITS entry");
+            return -1;
+        }
+        ui->nrecords++;
+    }
+    printf("\n");
+    return 0;
+}
 
 int main(int argc, char** args) {
     char* outfn = "ucac4_%03i.fits";
     int c;
-    int startoptind;
     int nrecords, nfiles;
+    int nthreads = 1;
     int Nside = 9;
 
     ucac4_fits** ucacs;
+    ucac4_ingest_t ui;
 
     int i, HP;
-    int slicecounts[1800];
 
     while ((c = getopt(argc, args, OPTIONS)) != -1) {
         switch (c) {
@@ -69,6 +175,9 @@ int main(int argc, char** args) {
         case 'o':
             outfn = optarg;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         }
     }
 
@@ -86,93 +195,19 @@ int main(int argc, char** args) {
     HP = 12 * Nside * Nside;
     printf("Nside = %i, using %i healpixes.\n", Nside, HP);
     ucacs = calloc(HP, sizeof(ucac4_fits*));
-    memset(slicecounts, 0, 1800 * sizeof(uint));
-    nrecords = 0;
-    nfiles = 0;
-
-    startoptind = optind;
-    for (; optind<argc; optind++) {
-        char* infn;
-        FILE* fid;
-        BZFILE* bzfid;
-        int bzerr;
-        int i;
-
-        infn = args[optind];
-        printf("Reading %s\n", infn);
-        if ((optind > startoptind) && ((optind - startoptind) % 100 == 0)) {
-            printf("\nReading file %i of %i: %s\n", optind - startoptind,
-                   argc - startoptind, infn);
-        }
-        fflush(stdout);
-
-        fid = fopen(infn, "rb");
-        if (!fid) {
-            SYSERROR("Couldn't open input file \"%s\"", infn);
-            exit(-1);
-        }
-
-        // MAGIC 1: bzip verbosity: [0=silent, 4=debug]
-        // 0: small -- don't use less memory
-        bzfid = BZ2_bzReadOpen(&bzerr, fid, 1, 0, NULL, 0);
-        CHECK_BZERR();
-
-        for (i=0;; i++) {
-            ucac4_entry entry;
-            int hp;
-            char buf[UCAC4_RECORD_SIZE];
-            int nr;
-            anbool eof = 0;
-
-            nr = BZ2_bzRead(&bzerr, bzfid, buf, UCAC4_RECORD_SIZE);
-            if ((bzerr == BZ_STREAM_END) && (nr == UCAC4_RECORD_SIZE))
-                eof = TRUE;
-            else
-                CHECK_BZERR();
-
-            if (ucac4_parse_entry(&entry, buf)) {
-                ERROR("Failed to parse UCAC4 entry %i in file \"%s\".", i, infn);
-                exit(-1);
-            }
 
-            hp = radecdegtohealpix(entry.ra, entry.dec, Nside);
-
-            if (!ucacs[hp]) {
-                char fn[256];
-                sprintf(fn, outfn, hp);
-                ucacs[hp] = ucac4_fits_open_for_writing(fn);
-                if (!ucacs[hp]) {
-                    ERROR("Failed to initialize FITS file %i (filename %s)", hp, fn);
-                    exit(-1);
-                }
-                fits_header_add_int(ucacs[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
-                fits_header_add_int(ucacs[hp]->header, "NSIDE", Nside, "The healpix resolution.");
-                BOILERPLATE_ADD_FITS_HEADERS(ucacs[hp]->header);
-                qfits_header_add(ucacs[hp]->header, "HISTORY", "Created by the program \"ucac4tofits\"", NULL, NULL);
-                qfits_header_add(ucacs[hp]->header, "HISTORY", "ucac4tofits command line:", NULL, NULL);
-                fits_add_args(ucacs[hp]->header, args, argc);
-                qfits_header_add(ucacs[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
-                if (ucac4_fits_write_headers(ucacs[hp])) {
-                    ERROR("Failed to write header for FITS file %s", fn);
-                    exit(-1);
-                }
-            }
-            if (ucac4_fits_write_entry(ucacs[hp], &entry)) {
-                ERROR("Failed to write FITS entry");
-                exit(-1);
-            }
-            nrecords++;
-
-            if (eof)
-                break;
-        }
-
-        BZ2_bzReadClose(&bzerr, bzfid);
-        fclose(fid);
-
-        nfiles++;
-        printf("\n");
-    }
+    ui.outfn = outfn;
+    ui.Nside = Nside;
+    ui.argc = argc;
+    ui.args = args;
+    ui.nfiles = argc - optind;
+    ui.nrecords = 0;
+    ui.ucacs = ucacs;
+    if (catalog_ingest(args + optind, argc - optind, nthreads,
+                       sizeof(ucac4_entry), parse_input, write_entries, &ui))
+        exit(-1);
+    nfiles = argc - optind;
+    nrecords = ui.nrecords;
     printf("\n");
 
     // close all the files...
@@ -28,8 +28,9 @@
 #include "log.h"
 #include "errors.h"
 #include "boilerplate.h"
+#include "catalog-ingest.h"
 
-#define OPTIONS "ho:N:e:m:f:"
+#define OPTIONS "ho:N:e:m:f:t:"
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -39,6 +40,7 @@ void print_help(char* progname) {
            "  [-e <epoch in years>]             (default = UCAC epoch)\n"
            "  [-m <margin in degrees>]          (default = 0)\n"
            "  [-f <1 = include tag-along data>] (default = 0)\n"
+           "  [-t <threads>]                    (parse this many files at once; default = 1)\n"
            "  <input-file> [<input-file> ...]\n"
            "\n"
            "The output-filename-template should contain a \"printf\" sequence like \"%%03i\";\n"
@@ -52,17 +54,129 @@ void print_help(char* progname) {
 }
 
 
+typedef struct {
+    char* outfn;
+    int Nside;
+    float epoch;
+    double margin;
+    anbool full;
+    int argc;
+    char** args;
+    int nfiles;
+    int nrecords;
+    ucac5_fits** ucacs;
+} ucac5_ingest_t;
+
+static int parse_input(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    ucac5_ingest_t* ui = token;
+    FILE* fid;
+    int i;
+
+    fid = fopen(infn, "rb");
+    if (!fid) {
+        SYSERROR("Couldn't open input file \"%s\"", infn);
+        return -1;
+    }
+    for (i=0;; i++) {
+        ucac5_entry* entry;
+        char buf[UCAC5_RECORD_SIZE];
+
+        if (fread(buf, UCAC5_RECORD_SIZE, 1, fid) != 1) {
+            if (feof(fid))
+                break;
+            SYSERROR("Error reading input file \"%s\".", infn);
+            fclose(fid);
+            return -1;
+        }
+        entry = catalog_batch_append(batch);
+        if (!entry || ucac5_parse_entry(entry, buf, ui->epoch)) {
+            ERROR("Failed to parse UCAC5 entry %i in file \"%s\".", i, infn);
+            fclose(fid);
+            return -1;
+        }
+    }
+    fclose(fid);
+    return 0;
+}
+
+static int write_entries(const char* infn, int fileindex, void* token,
+                      catalog_batch_t* batch) {
+    ucac5_ingest_t* ui = token;
+    ucac5_fits** ucacs = ui->ucacs;
+    int Nside = ui->Nside;
+    int i;
+
+    printf("Reading %s\n", infn);
+    if (fileindex && (fileindex % 100 == 0)) {
+        printf("\nReading file %i of %i: %s\n", fileindex, ui->nfiles, infn);
+    }
+    fflush(stdout);
+
+    for (i=0; i<batch->nentries; i++) {
+        ucac5_entry* entry = (ucac5_entry*)batch->entries + i;
+        il *hplist;
+        int ihp;
+
+        if (Nside) {
+            if (ui->margin > 0.0)
+                hplist = healpix_rangesearch_radec(entry->ra, entry->dec, ui->margin, Nside, NULL);
+            else {
+                int hp = radecdegtohealpix(entry->ra, entry->dec, Nside);
+                hplist = il_new(1);
+                il_append(hplist, hp);
+            }
+        }
+        else {
+            hplist = il_new(1);
+            il_append(hplist, 0);
+        }
+        for (ihp=0; ihp<il_size(hplist); ihp++) {
+            int hp = il_get(hplist, ihp);
+            if (!ucacs[hp]) {
+                char fn[256];
+                sprintf(fn, ui->outfn, hp);
+                ucacs[hp] = ucac5_fits_open_for_writing(fn, ui->full);
+                if (!ucacs[hp]) {
+                    ERROR("Failed to initialize FITS file %i (filename %s)", hp, fn);
+                    return -1;
+                }
+                fits_header_add_int(ucacs[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
+                fits_header_add_int(ucacs[hp]->header, "NSIDE", Nside ? Nside : 1, "The healpix resolution.");
+                BOILERPLATE_ADD_FITS_HEADERS(ucacs[hp]->header);
+                qfits_header_add(ucacs[hp]->header, "HISTORY", "Created by the program \"ucac5tofits\"", NULL, NULL);
+                qfits_header_add(ucacs[hp]->header, "HISTORY", "ucac5tofits command line:", NULL, NULL);
+                fits_add_args(ucacs[hp]->header, ui->args, ui->argc);
+                qfits_header_add(ucacs[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
+                if (ucac5_fits_write_headers(ucacs[hp])) {
+                    ERROR("Failed to write header for FITS file %s", fn);
+                    return -1;
+                }
+            }
+            if (ucac5_fits_write_entry(ucacs[hp], entry)) {
+                ERROR("Failed to write FITS entry");
+                return -1;
+            }
+            ui->nrecords++;
+        }
+        il_free(hplist);
+    }
+    printf("\n");
+    return 0;
+}
+
 int main(int argc, char** args) {
     char* outfn = "ucac5_%02i.fits";
     int c;
-    int startoptind;
     int nrecords, nfiles;
+    int nthreads = 1;
     int Nside = 0;
     float epoch = 0.0;
     double margin = 0.0;
     anbool full = FALSE;
 
     ucac5_fits** ucacs;
+    ucac5_ingest_t ui;
 
     int i, HP;
 
@@ -87,6 +201,9 @@ int main(int argc, char** args) {
             case 'o':
                 outfn = optarg;
                 break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
         }
     }
 
@@ -110,104 +227,22 @@ int main(int argc, char** args) {
         printf("Using one all-sky healpix.\n");
     }
     ucacs = calloc(HP, sizeof(ucac5_fits*));
-    nrecords = 0;
-    nfiles = 0;
-
-    startoptind = optind;
-    for (; optind<argc; optind++) {
-        char* infn;
-        FILE* fid;
-        int i;
-
-        infn = args[optind];
-        printf("Reading %s\n", infn);
-        if ((optind > startoptind) && ((optind - startoptind) % 100 == 0)) {
-            printf("\nReading file %i of %i: %s\n", optind - startoptind,
-                   argc - startoptind, infn);
-        }
-        fflush(stdout);
-
-        fid = fopen(infn, "rb");
-        if (!fid) {
-            SYSERROR("Couldn't open input file \"%s\"", infn);
-            exit(-1);
-        }
-
-        for (i=0;; i++) {
-            ucac5_entry entry;
-            il *hplist;
-            char buf[UCAC5_RECORD_SIZE];
-            int nr;
-            anbool eof = 0;
-
-            nr = fread(buf, UCAC5_RECORD_SIZE, 1, fid);
-            if (!nr) {
-                if (feof(fid))
-                    eof = TRUE;
-                else {
-                    SYSERROR("Error reading input file \"%s\".", infn);
-                    exit(-1);
-                }
-            }
-
-            if (ucac5_parse_entry(&entry, buf, epoch)) {
-                ERROR("Failed to parse UCAC5 entry %i in file \"%s\".", i, infn);
-                exit(-1);
-            }
-
-            if (Nside) {
-                if (margin > 0.0)
-                    hplist = healpix_rangesearch_radec(entry.ra, entry.dec, margin, Nside, NULL);
-                else {
-                    int hp = radecdegtohealpix(entry.ra, entry.dec, Nside);
-                    hplist = il_new(1);
-                    il_append(hplist, hp);
-                }
-            }
-            else {
-                hplist = il_new(1);
-                il_append(hplist, 0);
-            }
-            int ihp;
-            for (ihp=0; ihp<il_size(hplist); ihp++) {
-                int hp = il_get(hplist, ihp);
-                if (!ucacs[hp]) {
-                    char fn[256];
-                    sprintf(fn, outfn, hp);
-                    ucacs[hp] = ucac5_fits_open_for_writing(fn, full);
-                    if (!ucacs[hp]) {
-                        ERROR("Failed to initialize FITS file %i (filename %s)", hp, fn);
-                        exit(-1);
-                    }
-                    fits_header_add_int(ucacs[hp]->header, "HEALPIX", hp, "The healpix number of this catalog.");
-                    fits_header_add_int(ucacs[hp]->header, "NSIDE", Nside ? Nside : 1, "The healpix resolution.");
-                    BOILERPLATE_ADD_FITS_HEADERS(ucacs[hp]->header);
-                    qfits_header_add(ucacs[hp]->header, "HISTORY", "Created by the program \"ucac5tofits\"", NULL, NULL);
-                    qfits_header_add(ucacs[hp]->header, "HISTORY", "ucac5tofits command line:", NULL, NULL);
-                    fits_add_args(ucacs[hp]->header, args, argc);
-                    qfits_header_add(ucacs[hp]->header, "HISTORY", "(end of command line)", NULL, NULL);
-                    if (ucac5_fits_write_headers(ucacs[hp])) {
-                        ERROR("Failed to write header for FITS file %s", fn);
-                        exit(-1);
-                    }
-                }
-                if (ucac5_fits_write_entry(ucacs[hp], &entry)) {
-                    ERROR("Failed to write FITS entry");
-                    exit(-1);
-                }
-                nrecords++;
-            }
-            il_free(hplist);
-
-            if (eof)
-                break;
-        }
 
-        fclose(fid);
-
-        nfiles++;
-        printf("\n");
-    }
+    ui.outfn = outfn;
+    ui.Nside = Nside;
+    ui.epoch = epoch;
+    ui.margin = margin;
+    ui.full = full;
+    ui.argc = argc;
+    ui.args = args;
+    ui.nfiles = argc - optind;
+    ui.nrecords = 0;
+    ui.ucacs = ucacs;
+    if (catalog_ingest(args + optind, argc - optind, nthreads,
+                       sizeof(ucac5_entry), parse_input, write_entries, &ui))
+        exit(-1);
+    nfiles = argc - optind;
+    nrecords = ui.nrecords;
     printf("\n");
 
     // close all the files...
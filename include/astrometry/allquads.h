@@ -9,6 +9,7 @@
 #include "starkd.h"
 #include "quadfile.h"
 #include "codefile.h"
+#include "quad-utils.h"
 
 struct allquads {
     int dimquads;
@@ -28,7 +29,15 @@ struct allquads {
     anbool use_d2_lower;
     anbool use_d2_upper;
 
+    // build quads on this many threads (-1: one per CPU); the output is
+    // the same as with one thread.
+    int nthreads;
+
     int starA;
+
+    // quads waiting to be written, a block at a time.
+    unsigned int batch[QUAD_CODE_BLOCK * DQMAX];
+    int nbatch;
 };
 typedef struct allquads allquads_t;
 
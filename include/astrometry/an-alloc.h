@@ -0,0 +1,92 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_ALLOC_H
+#define AN_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ A shared allocator for libkd (its MALLOC etc), qfits (qfits_malloc etc)
+ and the solver's larger buffers, which keeps a count of the bytes each
+ of them has outstanding, and their peaks.
+
+ The counts are of the allocator's usable size of each block
+ (malloc_usable_size()), added when a block is allocated through these
+ functions and subtracted when it is freed through them.  Memory that
+ callers allocate one way and free the other is not tracked exactly, so
+ the counts are best read as trends: something that grows without bound
+ across jobs in a long-running process is a leak.  Without a way to get
+ the usable size (see an_allocator_t), nothing is counted.
+
+ The counts are process-wide: when jobs run concurrently, a job's peak
+ and limit apply to all of them together.
+ */
+enum an_alloc_subsystem {
+    AN_ALLOC_OTHER = 0,
+    AN_ALLOC_LIBKD,
+    AN_ALLOC_QFITS,
+    AN_ALLOC_SOLVER,
+    AN_ALLOC_NSUBSYSTEMS
+};
+
+/*
+ The backend that the an_alloc_*() functions call.  Since memory from
+ these subsystems is sometimes released with plain free(), a backend must
+ be free()-compatible: a wrapper around the C library, or a malloc
+ replacement (jemalloc, mimalloc) built to override malloc.
+ "usable_size" may be NULL, which turns the counts off.
+ */
+struct an_allocator {
+    void* (*malloc)(size_t size);
+    void* (*calloc)(size_t nmemb, size_t size);
+    void* (*realloc)(void* ptr, size_t size);
+    void  (*free)(void* ptr);
+    size_t (*usable_size)(void* ptr);
+};
+typedef struct an_allocator an_allocator_t;
+
+/*
+ Sets the backend (NULL: the C library's).  Call this at startup, before
+ anything has been allocated through the old one.
+ */
+void an_alloc_set_backend(const an_allocator_t* backend);
+
+void* an_alloc_malloc(int subsystem, size_t size);
+void* an_alloc_calloc(int subsystem, size_t nmemb, size_t size);
+void* an_alloc_realloc(int subsystem, void* ptr, size_t size);
+char* an_alloc_strdup(int subsystem, const char* str);
+void  an_alloc_free(int subsystem, void* ptr);
+
+// Bytes the subsystem (or, for AN_ALLOC_NSUBSYSTEMS, all of them)
+// currently has allocated.
+int64_t an_alloc_current(int subsystem);
+
+// The most bytes the subsystem (or all of them) has had allocated at
+// once since the last an_alloc_reset_peaks().
+int64_t an_alloc_peak(int subsystem);
+
+// Starts the peaks again from the current counts, eg at the start of a
+// job.
+void an_alloc_reset_peaks(void);
+
+const char* an_alloc_subsystem_name(int subsystem);
+
+/*
+ A limit, in bytes, on the total of all the counts (0: none).  This is
+ not enforced by failing allocations (few callers could recover), but
+ checked with an_alloc_over_limit() at points where work can stop
+ cleanly; see "memlimit" in the engine.
+ */
+void an_alloc_set_limit(int64_t bytes);
+
+int an_alloc_over_limit(void);
+
+// Logs (with logverb()) the current and peak counts of each subsystem.
+void an_alloc_log_report(void);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_NUMA_H
+#define AN_NUMA_H
+
+#include <stddef.h>
+
+/*
+ Placing memory and threads on the nodes of a NUMA machine, through the
+ Linux system calls (mbind, set_mempolicy, sched_setaffinity) and the
+ topology in /sys/devices/system/node, so that libnuma isn't needed.
+
+ Elsewhere -- and on machines with one node -- everything still works:
+ there is a single node, 0, and placing memory or pinning threads
+ returns -1 (or does nothing useful).
+ */
+
+// For an_numa_place(): spread the pages over all the nodes.
+#define AN_NUMA_INTERLEAVE -1
+
+/*
+ The number of nodes with memory, at least 1.  Their ids are those
+ returned by an_numa_node_id(0 ... n-1); usually, but not always, 0 to
+ n-1.
+ */
+int an_numa_nodes(void);
+
+int an_numa_node_id(int i);
+
+// The largest node id, plus one; for arrays indexed by node id.
+int an_numa_max_node(void);
+
+/*
+ Restricts the calling thread to the CPUs of "node" (an id).  Returns 0
+ on success.
+ */
+int an_numa_pin_thread(int node);
+
+// Lets the calling thread run on any CPU again.
+int an_numa_unpin_thread(void);
+
+/*
+ Moves the pages of [addr, addr + len) to "node", or interleaves them
+ over all nodes (AN_NUMA_INTERLEAVE), and reads them in: pages of file
+ mappings that aren't in the page cache yet are allocated where the
+ thread that faults them in wants them, so they are faulted in here,
+ under that policy.  The range needn't be page-aligned.  Returns 0 on
+ success.
+ */
+int an_numa_place(const void* addr, size_t len, int node);
+
+/*
+ Returns "len" bytes of anonymous memory on "node", or NULL; free it
+ with an_numa_free(p, len).
+ */
+void* an_numa_alloc_on_node(size_t len, int node);
+
+// an_numa_alloc_on_node() plus a copy of "src".
+void* an_numa_copy_to_node(const void* src, size_t len, int node);
+
+void an_numa_free(void* p, size_t len);
+
+#endif
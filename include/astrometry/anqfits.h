@@ -50,6 +50,8 @@ typedef struct {
     int bitpix;
     double bscale;
     double bzero;
+    // stored as a tile-compressed binary table (see qfits_tilecomp.h)?
+    int tilecomp;
 } anqfits_image_t;
 
 anqfits_image_t* anqfits_image_new(void);
@@ -87,6 +89,16 @@ anqfits_t* anqfits_open(const char* filename);
 // number of HDUs the file is reported to contain will be hdu+1.
 anqfits_t* anqfits_open_hdu(const char* filename, int hdu);
 
+/**
+ Turns on the HDU index: when enabled, anqfits_open() looks for a
+ "<filename>.hdus" file listing the offsets of the file's extensions,
+ and skips scanning the file if it is up to date (same file size and
+ modification time).  After a scan, it (re)writes that file if it can.
+ Off by default.
+ */
+void anqfits_set_hdu_index_enabled(int enabled);
+int anqfits_hdu_index_enabled(void);
+
 void anqfits_close(anqfits_t* qf);
 
 int anqfits_n_ext(const anqfits_t* qf);
@@ -131,6 +143,15 @@ anqfits_image_t* anqfits_get_image(const anqfits_t* qf, int ext);
 const anqfits_image_t* anqfits_get_image_const(const anqfits_t* qf, int ext);
 
 
+// Returns the TFITS_BIN_TYPE_* for a PTYPE_*.
+tfits_type anqfits_ptype_to_ttype(int ptype);
+
+/**
+ Reads pixels of an image; tile-compressed images (".fits.fz") are
+ decompressed as they are read.  Only the window is read: a window
+ much narrower than the image is read row by row, so a small cutout of
+ a large file costs I/O in proportion to the cutout.
+ */
 void* anqfits_readpix(const anqfits_t* qf, int ext,
                       /** Pixel window coordinates (0 for whole image);
                        THESE ARE ZERO-INDEXED, unlike qfits_loadpix,
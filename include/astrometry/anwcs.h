@@ -7,6 +7,7 @@
 #define ANWCSLIB_H
 
 #include "astrometry/sip.h"
+#include "astrometry/sip-invgrid.h"
 #include "astrometry/an-bool.h"
 #include "astrometry/qfits_header.h"
 #include "astrometry/bl.h"
@@ -31,6 +32,12 @@ struct anwcs_t {
      */
     int type;
     void* data;
+
+    /**
+     If non-NULL (ANWCS_TYPE_SIP only), used for RA,Dec to pixel
+     transforms; see anwcs_use_inverse_grid().
+     */
+    struct sip_invgrid_t* invgrid;
 };
 typedef struct anwcs_t anwcs_t;
 
@@ -121,6 +128,35 @@ int anwcs_radec2pixelxy(const anwcs_t* wcs, double ra, double dec, double* p_x,
 
 int anwcs_pixelxy2radec(const anwcs_t* wcs, double px, double py, double* ra, double* dec);
 
+/**
+ Array versions of anwcs_pixelxy2radec and anwcs_radec2pixelxy, for N
+ points with interleaved (x,y) and (RA,Dec) coordinates.  SIP WCSes use
+ the batched transforms in sip.h.
+
+ anwcs_pixelxy2radec_array returns 0 if all the points succeeded, -1
+ otherwise.  anwcs_radec2pixelxy_array returns the number of points that
+ succeeded; if "ok" is non-NULL, ok[i] says whether point i did.
+ */
+int anwcs_pixelxy2radec_array(const anwcs_t* wcs, const double* xy, int N,
+                              double* radec);
+
+int anwcs_radec2pixelxy_array(const anwcs_t* wcs, const double* radec, int N,
+                              double* xy, anbool* ok);
+
+/**
+ For SIP WCSes: use a table-driven inverse of the SIP distortion
+ (sip_invgrid_t) for RA,Dec to pixel transforms, rather than the AP,BP
+ polynomials.  The table is built the first time it is used.  "step" is
+ the grid spacing in pixels (0 for the default) and "newton" the number
+ of Newton steps to refine each point with.
+
+ The grid is discarded by functions that modify the WCS through this
+ interface; call this again after modifying the sip_t directly.
+
+ Returns 0 on success.
+ */
+int anwcs_use_inverse_grid(anwcs_t* wcs, double step, int newton);
+
 int anwcs_pixelxy2xyz(const anwcs_t* wcs, double px, double py, double* p_xyz);
 
 int anwcs_xyz2pixelxy(const anwcs_t* wcs, const double* xyz, double *px, double *py);
@@ -183,6 +219,15 @@ void anwcs_set_size(anwcs_t* anwcs, int W, int H);
 
 int anwcs_scale_wcs(anwcs_t* anwcs, double scale);
 
+/**
+ Returns a new WCS for the "W" x "H" pixel region of "wcs" whose
+ top-left pixel is (x0, y0) (zero-indexed): pixel (x, y) of the new WCS
+ is pixel (x + x0, y + y0) of "wcs".  Returns NULL on error (or for
+ WCS types that don't support it).
+ */
+anwcs_t* anwcs_get_subimage(const anwcs_t* wcs, int x0, int y0,
+                            int W, int H);
+
 // angle in deg
 int anwcs_rotate_wcs(anwcs_t* anwcs, double angle);
 
@@ -0,0 +1,84 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ A simple "bump" allocator: memory is handed out sequentially from
+ large blocks, and is only ever released all at once, by
+ arena_reset() or arena_free().  This is much cheaper than malloc()
+ for large numbers of small, short-lived buffers that all die at the
+ same time.
+
+ Not thread-safe; use one arena per thread.
+ */
+
+struct arena_block;
+
+struct arena {
+    // size of the blocks we allocate (unless a larger one is needed)
+    size_t blocksize;
+    // blocks in use; the first one is the one we are allocating from.
+    struct arena_block* blocks;
+    // blocks retained by arena_reset() for reuse.
+    struct arena_block* spare;
+    // bytes handed out since the last arena_reset().
+    size_t used;
+    // the largest value "used" has reached.
+    size_t peak;
+    // bytes held in blocks (in use or spare).
+    size_t reserved;
+};
+typedef struct arena arena_t;
+
+/**
+ Creates a new arena that allocates memory in blocks of "blocksize"
+ bytes (0 for a default of 1 MB).
+ */
+arena_t* arena_new(size_t blocksize);
+
+/**
+ Returns "size" bytes of uninitialized memory, aligned for any type.
+ Returns NULL if memory can't be allocated.
+ */
+void* arena_alloc(arena_t* a, size_t size);
+
+/**
+ Like arena_alloc(), but the memory is set to zero.
+ */
+void* arena_calloc(arena_t* a, size_t size);
+
+/**
+ Invalidates all memory handed out by this arena, but keeps the blocks
+ for reuse.
+ */
+void arena_reset(arena_t* a);
+
+/**
+ Moves all the blocks (and the memory handed out from them) from
+ "src" into "dst"; "src" is left empty.  Afterward, arena_reset(dst)
+ or arena_free(dst) releases memory allocated from either arena.
+ */
+void arena_steal(arena_t* dst, arena_t* src);
+
+/**
+ Releases all memory.
+ */
+void arena_free(arena_t* a);
+
+/**
+ Bytes handed out since the last reset.
+ */
+size_t arena_bytes_used(const arena_t* a);
+
+/**
+ Bytes held by the arena, including memory kept for reuse.
+ */
+size_t arena_bytes_reserved(const arena_t* a);
+
+#endif
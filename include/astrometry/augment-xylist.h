@@ -62,8 +62,20 @@ struct augment_xylist_s {
     char* scampfn;
     char* wcsfn;
     char* corrfn;
+    // solver timing statistics (JSON)
+    char* statsfn;
+    // record of the solver's searches (see solver-trace.h)
+    char* tracefn;
+    // search checkpoint (read and written)
+    char* checkpointfn;
     char* keepxylsfn;
     char* pnmfn;
+    // directory of source lists from earlier runs, keyed by the MD5 of
+    // the image and the source-extraction settings.
+    char* xylist_cache;
+    // decode the image and extract and filter its sources in memory,
+    // when the settings allow it.
+    anbool in_memory;
 
     time_t wcs_last_mod;
 
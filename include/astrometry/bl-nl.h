@@ -21,6 +21,8 @@ Malloc nl*  NLF(new)(int blocksize);
 Pure InlineDeclare size_t NLF(size)(const nl* list);
 void NLF(new_existing)(nl* list, int blocksize);
 void NLF(init)(nl* list, int blocksize);
+// see bl_init_arena().
+void NLF(init_arena)(nl* list, int blocksize, struct arena* a);
 void NLF(reverse)(nl* list);
 void NLF(remove_all)(nl* list);
 void NLF(remove_all_reuse)(nl* list);
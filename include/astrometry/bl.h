@@ -27,6 +27,8 @@ struct bl_node {
 };
 typedef struct bl_node bl_node;
 
+struct arena;
+
 // the top-level data structure of a blocklist.
 typedef struct {
     bl_node* head;
@@ -40,6 +42,16 @@ typedef struct {
     // rapid accessors for "jumping in" at the last block accessed
     bl_node* last_access;
     size_t last_access_n;
+    // directory of the first "ndir" blocks and the index of the first
+    // element of each, for O(log n) random access.  Built lazily, and
+    // cut back when a block is changed.
+    bl_node** dir;
+    size_t* dirstart;
+    size_t ndir;
+    size_t dircap;
+    // if non-NULL, blocks are allocated from (and released with) this
+    // arena; see bl_init_arena().
+    struct arena* arena;
 } bl;
 
 #define BL_NOT_FOUND (ptrdiff_t)(-1)
@@ -47,6 +59,14 @@ typedef struct {
 
 Malloc bl*  bl_new(int blocksize, int datasize);
 void bl_init(bl* l, int blocksize, int datasize);
+/**
+ Like bl_init(), but the list's blocks are allocated from arena "a"
+ rather than with malloc(), for short-lived lists on hot paths.  The
+ blocks are only released, all at once, by arena_reset() or
+ arena_free(); bl_remove_all() and bl_free() just drop them.  Lists that
+ trade blocks (bl_append_list(), bl_split()) must share an arena.
+ */
+void bl_init_arena(bl* l, int blocksize, int datasize, struct arena* a);
 void bl_free(bl* list);
 void  bl_remove_all(bl* list);
 Pure InlineDeclare size_t  bl_size(const bl* list);
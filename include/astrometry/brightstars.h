@@ -19,4 +19,12 @@ typedef struct brightstar brightstar_t;
 int bright_stars_n();
 const brightstar_t* bright_stars_get(int starindex);
 
+/**
+ Returns the indices, in ascending order, of the bright stars within
+ "radius" degrees of RA,Dec (ra,dec); sets "N" to their number.  The
+ first call builds a HEALPix-bucketed index that later calls share.
+ Free the result with free().
+ */
+int* bright_stars_within(double ra, double dec, double radius, int* N);
+
 #endif
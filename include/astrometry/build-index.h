@@ -43,13 +43,32 @@ struct index_params {
     int passes;
     int Nreuse; int Nloosen;
     anbool scanoccupied;
+    // threads for building quads (0: visit the healpixes in order)
+    int hpquads_threads;
     int dimquads;
     int indexid;
+    // write the code kd-tree's data packed (see KD_BUILD_PACK_DATA)?
+    anbool pack_codes;
+    // ... and the star kd-tree's?
+    anbool pack_stars;
+    // write the "quadxyz" table, a copy of each quad's star positions
+    // (see quadfile.h)?
+    anbool quad_xyz;
+    // if more than one, also write the code kd-tree split into this many
+    // trees by quad scale (see codekd.h)
+    int scale_bins;
+    // if positive, also write the code kd-tree split into trees by the
+    // HEALPix cell (at this Nside) of each quad's position (see codekd.h)
+    int sky_bins_nside;
 
     // general options
+    // pass the intermediate products between the steps in memory, rather
+    // than through temp files
     anbool inmemory;
     anbool delete_tempfiles;
     const char* tempdir;
+    // threads for uniformizing and building the kd-trees
+    int nthreads;
     char** args;
     int argc;
 };
@@ -61,9 +80,17 @@ int build_index_files(const char* catalogfn, int extension,
                       const char* indexfn,
                       index_params_t* params);
 
+/**
+ Builds an index from "catalog".  Without "inmemory", "indexfn" must be
+ set and the steps communicate through temp files.  With "inmemory",
+ the index is returned in "p_index" if that is set; otherwise it is
+ written to "indexfn", once, at the end.
+ */
 int build_index(fitstable_t* catalog, index_params_t* p,
                 index_t** p_index, const char* indexfn);
 
+// Like build_index(), but using the stars of an existing index;
+// "starkd" is not closed.
 int build_index_shared_skdt(const char* starkdfn, startree_t* starkd,
                             index_params_t* p,
                             index_t** p_index, const char* indexfn);
@@ -71,4 +98,41 @@ int build_index_shared_skdt(const char* starkdfn, startree_t* starkd,
 int build_index_shared_skdt_files(const char* starkdfn, const char* indexfn,
                                   index_params_t* p);
 
+/**
+ Updates the existing index "oldindex" with the stars of "catalog" in
+ healpix "p->bighp" (at nside "p->bignside"): the index's stars there
+ are replaced by the catalog's (uniformized the way the index was), and
+ only the quads of the healpixes whose star searches reach into it are
+ rebuilt; the other quads are kept.  "p->Nside" must be the one the
+ index was built with; the quad scales, dimquads and uniformization
+ settings are taken from the index.  The update is always built in
+ memory; the result is returned in "p_index" if that is set, and
+ otherwise written to "indexfn".  "catalog" is closed; "oldindex" is not.
+ */
+int build_index_update(index_t* oldindex, fitstable_t* catalog,
+                       index_params_t* p,
+                       index_t** p_index, const char* indexfn);
+
+int build_index_update_files(const char* oldindexfn, const char* catalogfn,
+                             int extension, const char* indexfn,
+                             index_params_t* p);
+
+/**
+ Builds stratum "stratum" (of "nstrata") of the fully-loaded index
+ "oldindex", split by the star sweep numbers (which run from 0 to 255,
+ brightest first; see unpermute-stars.c): the index's stars with sweep
+ below "sweephi", and the quads whose faintest star has sweep in
+ ["sweeplo", "sweephi").  With cuts 0 = c0 < c1 < ... < cN = 256,
+ stratum s (from 1) takes [c(s-1), c(s)), so stratum 1 alone is a
+ complete index of the brightest stars, and each deeper one adds the
+ quads that need fainter stars, without repeating any.  The strata are
+ marked with the STRATUM, NSTRATA, STRATLO and STRATHI headers, which
+ the engine uses to try them bright-first.  Built in memory; the result
+ is returned in "p_index" if that is set, and otherwise written to
+ "indexfn".
+ */
+int build_index_stratum(index_t* oldindex, int sweeplo, int sweephi,
+                        int stratum, int nstrata, index_params_t* p,
+                        index_t** p_index, const char* indexfn);
+
 #endif
@@ -17,6 +17,13 @@ typedef struct {
     number* weight;
     int W, H;
     anwcs_t* wcs;
+    // "img" and "weight" hold rows [y0, y0+H) of the output image; see
+    // coadd_new_band().
+    int y0;
+    // rows allocated.
+    int Hmax;
+    // threads used by coadd_add_image(); 0 means one per CPU.
+    int nthreads;
 
     double (*resample_func)(double px, double py,
                             const number* img, const number* weightimg,
@@ -32,8 +39,30 @@ coadd_t* coadd_new(int W, int H);
 
 coadd_t* coadd_new_from_wcs(anwcs_t* wcs);
 
+/*
+ For outputs too big to hold at once: accumulates only a band of "H"
+ rows of the output image (of width "W"), starting at row "y0".  Add
+ every image that overlaps the band (see coadd_get_image_rows()), write
+ the band out, then move on with coadd_set_band().
+ */
+coadd_t* coadd_new_band(int W, int H, int y0);
+
+// Moves to rows [y0, y0+H) (at most the number of rows allocated), and
+// zeroes the accumulators.
+int coadd_set_band(coadd_t* co, int y0, int H);
+
+// Finds the rows [*ylo, *yhi) of the whole output image that an image
+// with WCS "wcs" projects into.  Returns FALSE if there are none.
+anbool coadd_get_image_rows(const coadd_t* co, const anwcs_t* wcs,
+                            int* ylo, int* yhi);
+
 void coadd_set_lanczos(coadd_t* co, int Lorder);
 
+/*
+ Resamples "img" into the output band, splitting its rows among
+ "c->nthreads" threads; each output pixel is summed in the same order as
+ with one thread, so the results don't depend on the number of threads.
+ */
 int coadd_add_image(coadd_t* c, const number* img, const number* weightimg,
                     number weight, const anwcs_t* wcs);
 //, badpixfunc_t badpix, void* badpix_token);
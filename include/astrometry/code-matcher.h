@@ -0,0 +1,65 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef CODE_MATCHER_H
+#define CODE_MATCHER_H
+
+#include "astrometry/index.h"
+#include "astrometry/kdtree.h"
+
+/**
+ A code matcher finds, for a batch of field codes, the index quads whose
+ codes are within a given distance -- the search the solver runs for
+ every batch of quads it builds (see flush_codes() in solver.c).
+
+ By default the solver searches the index's code kd-tree directly; a
+ code matcher replaces that search with another backend.  Backends that
+ want the codes in some other form (a flat grid, memory on a
+ co-processor...) set them up the first time they see an index and keep
+ them until the matcher is freed, so the cost is paid once per index
+ set rather than once per search.
+
+ Matchers are shared between the solver's threads, so "search" must be
+ thread-safe.
+ */
+typedef struct code_matcher code_matcher_t;
+
+struct code_matcher {
+    const char* name;
+    /*
+     For each of the "N" codes (of the index's dimension) in "codes",
+     finds the index's codes within squared distance "tol2s[i]", writing
+     the quad numbers and squared distances into "res[i]" (in no
+     particular order).  "res[i]" is reused if non-NULL and allocated
+     otherwise, as in kdtree_rangesearch_batch().  Returns 0 on success.
+     */
+    int (*search)(code_matcher_t* m, index_t* index, const double* codes,
+                  int N, const double* tol2s, kdtree_qres_t** res);
+    void (*free)(code_matcher_t* m);
+    void* priv;
+};
+
+/**
+ Creates the code matcher called "name":
+
+   "kdtree": searches the code kd-tree, as the solver does without a
+             matcher.
+   "grid":   copies each index's codes into a flat grid, bucketed by the
+             position of star C, and scans the cells each code's
+             tolerance overlaps.  This is the layout an accelerator would
+             be handed; on the CPU it trades memory (the codes, as
+             doubles) for a search with no tree walk.
+
+ Returns NULL if there is no matcher of that name.
+ */
+code_matcher_t* code_matcher_new(const char* name);
+
+int code_matcher_search(code_matcher_t* m, index_t* index,
+                        const double* codes, int N, const double* tol2s,
+                        kdtree_qres_t** res);
+
+void code_matcher_free(code_matcher_t* m);
+
+#endif
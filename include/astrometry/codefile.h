@@ -76,6 +76,14 @@ void quad_write(codefile_t* codes, quadfile_t* quads,
                 unsigned int* quad, startree_t* starkd,
                 int dimquads, int dimcodes);
 
+/*
+ Like quad_write(), for "N" quads ("quad" holds each in turn), whose codes
+ are computed a block at a time (see quad_compute_codes()).
+ */
+int quad_write_many(codefile_t* codes, quadfile_t* quads,
+                    unsigned int* quad, int N, startree_t* starkd,
+                    int dimquads, int dimcodes);
+
 void quad_write_const(codefile_t* codes, quadfile_t* quads,
                       const unsigned int* quad, startree_t* starkd,
                       int dimquads, int dimcodes);
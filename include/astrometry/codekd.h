@@ -9,15 +9,45 @@
 #include "astrometry/kdtree.h"
 #include "astrometry/qfits_header.h"
 #include "astrometry/anqfits.h"
+#include "astrometry/an-bool.h"
 
 #define AN_FILETYPE_CODETREE "CKDT"
 
 #define CODETREE_NAME "codes"
 
+// names of the optional scale-bin trees: "codes-scale-0", ...
+#define CODETREE_SCALEBIN_NAME "codes-scale-%i"
+// ... and of the sky-bin trees.
+#define CODETREE_SKYBIN_NAME "codes-sky-%i"
+
 typedef struct {
     kdtree_t* tree;
     qfits_header* header;
     int* inverse_perm;
+    // is "inverse_perm" in shared memory (see shmcache.h)?
+    anbool inverse_perm_shared;
+
+    // Optionally, the same codes split into bins by the quad's scale
+    // (the angular length of AB), each bin with its own tree, in order
+    // of increasing scale.  The bin trees' permutations give quad
+    // numbers, so their results can be used in place of "tree"'s.
+    int nscalebins;
+    kdtree_t** scalebins;
+    // bin i holds the quads with AB lengths (in radians) in
+    // [scalebin_lo[i], scalebin_hi[i]].
+    double* scalebin_lo;
+    double* scalebin_hi;
+
+    // Optionally, the same codes split into bins by where the quad is
+    // on the sky: by the HEALPix cell that the midpoint of its stars A
+    // and B falls in.  As with the scale bins, the bin trees'
+    // permutations give quad numbers.
+    int nskybins;
+    kdtree_t** skybins;
+    // the AB midpoints of bin i's quads are within the cap around
+    // skybin_xyz[3*i] of squared (chord) radius skybin_r2[i].
+    double* skybin_xyz;
+    double* skybin_r2;
 } codetree_t;
 
 codetree_t* codetree_open(const char* fn);
@@ -38,11 +68,47 @@ qfits_header* codetree_header(codetree_t* s);
 
 int codetree_close(codetree_t* s);
 
+void codetree_compute_inverse_perm(codetree_t* s);
+
+/**
+ Finds the scale bins that can hold quads with AB lengths (in radians)
+ in [ablo, abhi]: bins "*b0" to "*b1" inclusive.  Returns their number,
+ which is zero if none do (or the tree has no scale bins).
+ */
+int codetree_scale_bins_between(const codetree_t* s, double ablo, double abhi,
+                                int* b0, int* b1);
+
+/**
+ Finds the sky bins that can hold quads with all their stars within
+ the cap of squared (chord) radius "r2" around "xyz", which must be at
+ most a hemisphere (r2 <= 2).  Sets "near[i]" for each, and returns
+ their number.
+ */
+int codetree_sky_bins_near(const codetree_t* s, const double* xyz,
+                           double r2, anbool* near);
+
 // for writing
 codetree_t* codetree_new(void);
 
 int codetree_append_to(codetree_t* s, FILE* fid);
 
+/**
+ Splits the codes into "nbins" bins of (about) equal numbers of quads
+ by the AB lengths "ablen" (in radians, indexed by quad number), builds
+ a tree for each with the same tree type as the full tree, and appends
+ them to "fid".
+ */
+int codetree_append_scale_bins_to(codetree_t* s, const double* ablen,
+                                  int nbins, FILE* fid);
+
+/**
+ Splits the codes into bins by the HEALPix cell (at "nside") of their
+ quad's AB midpoint "abmid" (unit vectors, indexed by quad number),
+ builds a tree for each non-empty cell, and appends them to "fid".
+ */
+int codetree_append_sky_bins_to(codetree_t* s, const double* abmid,
+                                int nside, FILE* fid);
+
 int codetree_write_to_file(codetree_t* s, const char* fn);
 
 int codetree_write_to_file_flipped(codetree_t* s, const char* fn);
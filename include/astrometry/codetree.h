@@ -11,15 +11,17 @@
 #include "astrometry/fitstable.h"
 
 /**
+ Builds a kd-tree from the given codes, using "nthreads" threads (0 or 1
+ to build in the calling thread).
  */
 codetree_t* codetree_build(codefile_t* codes,
                            int Nleaf, int datatype, int treetype,
-                           int buildopts,
+                           int buildopts, int nthreads,
                            char** args, int argc);
 
 int codetree_files(const char* codefn, const char* ckdtfn,
                    int Nleaf, int datatype, int treetype,
-                   int buildopts,
+                   int buildopts, int nthreads,
                    char** args, int argc);
 
 #endif
@@ -39,4 +39,11 @@ dl* constellations_get_lines_radec(int constellation_num);
  */
 void constellations_get_star_radec(int starnum, double* ra, double* dec);
 
+/*
+ The center and radius (in degrees) of a circle containing all of a
+ constellation's stars; computed once, on first use.
+ */
+void constellations_get_bounds(int constellation_num, double* ra,
+                               double* dec, double* radius);
+
 #endif
@@ -24,4 +24,34 @@ float* convolve_separable_weighted_f(const float* img, int W, int H,
                                      const float* kernel, int k0, int NK,
                                      float* outimg, float* tempimg);
 
+/**
+ As convolve_separable_weighted_f() ("weight" may be NULL), on
+ "nthreads" threads, each taking a block of rows (<= 0: one per CPU for
+ images of a megapixel or more, else one).  The plain functions above
+ use this with nthreads = 0.
+
+ Kernels of CONVOLVE_FFT_MIN_NK or more elements are applied with FFTs
+ (two rows at a time), whose cost hardly grows with the kernel width;
+ the results match the direct sums to float precision.  Rows with
+ non-finite pixels (or weights) are always done directly, so that those
+ spread no further than the kernel.
+ */
+float* convolve_separable_weighted_threaded_f(const float* img, int W, int H,
+                                              const float* weight,
+                                              const float* kernel, int k0,
+                                              int NK, float* outimg,
+                                              float* tempimg, int nthreads);
+
+#define CONVOLVE_FFT_MIN_NK 32
+
+enum convolve_method {
+    // by kernel size, as above.
+    CONVOLVE_AUTO = 0,
+    CONVOLVE_DIRECT,
+    CONVOLVE_FFT,
+};
+
+// Forces the direct or FFT sums, for tests and benchmarks (process-wide).
+void convolve_set_method(int method);
+
 #endif
@@ -0,0 +1,62 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#include "astrometry/an-bool.h"
+
+/*
+ Which SIMD instruction sets the CPU we're running on has, so that the
+ hot kernels can be compiled several times (for the baseline and for
+ wider instruction sets) and pick a version at run time: one build
+ then runs at full speed on every machine rather than at the speed of
+ the oldest one it must run on.
+
+ On x86 with GCC or clang, a kernel variant for, say, AVX2 is a
+ function marked CPU_TARGET("avx2"), called only if
+ cpu_has(CPU_AVX2).  Elsewhere the instruction set is fixed when
+ compiling (NEON on arm64 is always there) and these report what the
+ compiler was told to use.
+
+ The environment variable AN_SIMD ("none", "sse2", "avx", "avx2" or
+ "avx512") caps the level that is used, for testing and benchmarking the
+ variants.
+ */
+
+#define CPU_SSE2    0x01
+#define CPU_AVX     0x02
+#define CPU_AVX2    0x04
+#define CPU_AVX512F 0x08
+#define CPU_NEON    0x10
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH_X86 1
+#define CPU_TARGET(x) __attribute__((target(x)))
+#else
+#define CPU_TARGET(x)
+#endif
+
+/*
+ The CPU_* bits of the instruction sets that can be used.  The CPU is
+ probed the first time this is called (from any thread).
+ */
+unsigned int cpu_features(void);
+
+// Can all the instruction sets in "features" (CPU_* bits) be used?
+anbool cpu_has(unsigned int features);
+
+/*
+ Restricts cpu_features() to the bits in "mask" (~0 lifts the
+ restriction, leaving AN_SIMD's); kernels that bind their version once
+ aren't affected after that.  For tests.
+ */
+void cpu_features_restrict(unsigned int mask);
+
+// The widest instruction set that is used: "none", "sse2", "avx",
+// "avx2", "avx512" or "neon".
+const char* cpu_features_name(void);
+
+#endif
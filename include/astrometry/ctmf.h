@@ -50,6 +50,20 @@ void ctmf(
         int r, int channels, unsigned long memsize
         );
 
+/**
+ * \brief Constant-time median filtering on several threads
+ *
+ * As ctmf(), filtering vertical stripes of the image on up to \a nthreads
+ * threads; the result is the same.
+ */
+void ctmf_threaded(
+        const unsigned char* src, unsigned char* dst,
+        int width, int height,
+        int src_step_row, int dst_step_row,
+        int r, int channels, unsigned long memsize,
+        int nthreads
+        );
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,6 +6,7 @@
 #ifndef DIMAGE_H
 #define DIMAGE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 // this is only really included here so that it can be tested :)
@@ -17,8 +18,48 @@ dimage_label_t collapsing_find_minlabel(dimage_label_t label, dimage_label_t *eq
 int dfind2(const int* image, int nx, int ny, int* objectimg, int* p_nobjects);
 int dfind2_u8(const unsigned char* image, int nx, int ny, int* objectimg, int* p_nobjects);
 
+/**
+ Like dfind2() and dfind2_u8(), with the same output, but the image is
+ cut into bands of rows that are labelled on up to "nthreads" threads (0
+ means one per CPU) and then joined up.
+ */
+int dfind2_threaded(const int* image, int nx, int ny, int* objectimg,
+                    int* p_nobjects, int nthreads);
+int dfind2_u8_threaded(const unsigned char* image, int nx, int ny,
+                       int* objectimg, int* p_nobjects, int nthreads);
+
 float dselip(unsigned long k, unsigned long n, const float *arr);
 void dselip_cleanup(void);
+/**
+ Returns the k-th smallest of the "n" elements of "arr", reordering
+ "arr" in place.  Unlike dselip(), this is reentrant and doesn't sort.
+ */
+float dselect(unsigned long k, unsigned long n, float *arr);
+
+/**
+ Percentiles of the finite values among the "N" floats of "data"
+ (which isn't modified): out[i] is the value of rank
+ floor(ps[i] * Nfinite) (clamped to Nfinite-1) in sorted order, the
+ same as sorting and indexing would give.
+
+ Instead of sorting, it makes a pass for the range and one for a
+ DPERCENTILE_BINS-bin histogram, then re-histograms the bin holding
+ each rank until it is small enough to select from directly.  Passes
+ are split over "nthreads" threads (0: one per CPU).
+
+ If "nsample" is nonzero and less than "N", the percentiles are instead
+ those of "nsample" values picked pseudo-randomly (but repeatably),
+ one from each of "nsample" equal strides of "data".  The rank of the
+ result among all the values is then off by about
+ sqrt(p (1-p) / nsample) * Nfinite (one sigma); eg, 0.3% of the values
+ at the median with 30000 samples.
+
+ Returns the number of finite values considered (leaving "out" alone
+ if it's zero), or -1 on error.
+ */
+#define DPERCENTILE_BINS 65536
+int64_t dpercentiles(const float* data, size_t N, const double* ps, int np,
+                     size_t nsample, int nthreads, float* out);
 
 int dsmooth(float *image, int nx, int ny, float sigma, float *smooth);
 
@@ -26,23 +67,104 @@ void dsmooth2(float *image, int nx, int ny, float sigma, float *smooth);
 void dsmooth2_u8(uint8_t *image, int nx, int ny, float sigma, float *smooth);
 void dsmooth2_i16(int16_t *image, int nx, int ny, float sigma, float *smooth);
 
+/**
+ Equivalent to dsmooth2_u8() followed by average_image_f() with
+ "S"x"S" blocks and EDGE_AVERAGE, writing the
+ ceil(nx/S) x ceil(ny/S) result to "output", but without ever holding
+ a full-size float image.
+ */
+void dsmooth2_average_u8(const uint8_t* image, int nx, int ny, float sigma,
+                         int S, float* output);
+
+/**
+ Gaussian smoothing with a recursive filter, whose cost does not depend
+ on "sigma"; worth it for sigma above about 10 pixels.  It matches
+ dsmooth2() to within about 1% of the peak response, mostly because
+ dsmooth2() cuts its kernel at 3 sigma.  Sigmas below DSMOOTH2_IIR_MIN_SIGMA fall back
+ to dsmooth2().  "smooth" may be "image".
+ */
+#define DSMOOTH2_IIR_MIN_SIGMA 0.5
+void dsmooth2_iir(float *image, int nx, int ny, float sigma, float *smooth);
+
 int dobjects(float *image, int nx, int ny, float limit,
              float dpsf, int *objects);
 
 int dmask(float *image, int nx, int ny, float limit,
           float dpsf, uint8_t* mask);
 
+/**
+ dsmooth2() by "dpsf" followed by dmask(), in one pass over the rows,
+ without a full-size smoothed image.  If "bg" is non-NULL, the input is
+ "image" - "bg", which is written into "bg" as it goes; otherwise it is
+ "image".  Returns the same as dmask().
+ */
+int dsmooth2_mask(float* image, float* bg, int nx, int ny, float dpsf,
+                  float limit, uint8_t* mask);
+int dsmooth2_mask_i16(const int16_t* image, int nx, int ny, float dpsf,
+                      float limit, uint8_t* mask);
+
 int dpeaks(float *image, int nx, int ny, int *npeaks, int *xcen,
            int *ycen, float sigma, float dlim, float saddle, int maxnpeaks,
            int smooth, int checkpeaks, float minpeak);
 
 int dcen3x3(float *image, float *xcen, float *ycen);
 
+/**
+ dcen3x3() on "n" boxes at once, which are in structure-of-arrays form:
+ pixel k (0 to 8, in dcen3x3()'s order) of box i is
+ boxes[k * stride + i].  Sets ok[i] to what dcen3x3() would return, and
+ xcen[i], ycen[i] (meaningful only where ok[i]) to the same centroid.
+ */
+void dcen3x3_batch(const float* boxes, int stride, int n,
+                   float* xcen, float* ycen, uint8_t* ok);
+
 int dsigma(float *image, int nx, int ny, int sp, int gridsize, float *sigma);
 int dsigma_u8(uint8_t *image, int nx, int ny, int sp, int gridsize, float *sigma);
+/**
+ As dsigma(), sampling the pixel differences on "nthreads" threads (if
+ <= 0: one per CPU for grids of a quarter million samples or more, else
+ one); the result is the same.  The selection is reentrant, so this can
+ be called from several threads at once.
+ */
+int dsigma_threaded(const float *image, int nx, int ny, int sp,
+                    int gridsize, int nthreads, float *sigma);
+int dsigma_u8_threaded(const uint8_t *image, int nx, int ny, int sp,
+                       int gridsize, int nthreads, float *sigma);
+/**
+ A noise map: dsigma() of each of "ntx" x "nty" tiles, tile (tx, ty)
+ covering x in [nx*tx/ntx, nx*(tx+1)/ntx) and likewise in y, into
+ sigmamap[ty * ntx + tx] (0 where it can't be measured).  The grid
+ spacing "gridsize" is shrunk to a quarter of a small tile.  The tiles
+ are done on "nthreads" threads (one per CPU if <= 0).  Returns the
+ number of tiles measured.
+ */
+int dsigma_map(const float *image, int nx, int ny, int sp, int gridsize,
+               int ntx, int nty, int nthreads, float *sigmamap);
+int dsigma_map_u8(const uint8_t *image, int nx, int ny, int sp,
+                  int gridsize, int ntx, int nty, int nthreads,
+                  float *sigmamap);
+/**
+ The dsigma() "gridsize" that samples an "nx" x "ny" image at about
+ "nsamples" points; 0 (the default, 20) if "nsamples" is 0.
+ */
+int dsigma_gridsize(int nx, int ny, int nsamples);
 
 int dmedsmooth(const float *image, const uint8_t *masked,
                int nx, int ny, int halfbox, float *smooth);
+/**
+ As dmedsmooth(), splitting the work over "nthreads" threads (one per
+ CPU if zero); the result is the same.
+ */
+int dmedsmooth_threaded(const float *image, const uint8_t *masked,
+                        int nx, int ny, int halfbox, float *smooth,
+                        int nthreads);
+/**
+ The centers "xgrid" of the dmedsmooth() grid boxes along an axis of
+ "nx" pixels, and their (inclusive) extents "xlo" to "xhi"; the
+ arrays, of "nxgrid" elements, are malloc'd.
+ */
+int dmedsmooth_gridpoints(int nx, int halfbox, int* p_nxgrid, int** p_xgrid,
+                          int** p_xlo, int** p_xhi);
 
 int dallpeaks(float *image, int nx, int ny, int *objects, float *xcen,
               float *ycen, int *npeaks, float dpsf, float sigma,
@@ -57,4 +179,24 @@ int dallpeaks_i16(int16_t *image, int nx, int ny, int *objects, float *xcen,
                   float dlim, float saddle,
                   int maxper, int maxnpeaks, float minpeak, int maxsize);
 
+/**
+ Like dallpeaks(), with the same result, but the objects are shared out
+ among "nthreads" threads (0 means one per CPU).
+ */
+int dallpeaks_threaded(float *image, int nx, int ny, int *objects,
+                       float *xcen, float *ycen, int *npeaks, float dpsf,
+                       float sigma, float dlim, float saddle,
+                       int maxper, int maxnpeaks, float minpeak,
+                       int maxsize, int nthreads);
+int dallpeaks_u8_threaded(uint8_t *image, int nx, int ny, int *objects,
+                          float *xcen, float *ycen, int *npeaks, float dpsf,
+                          float sigma, float dlim, float saddle,
+                          int maxper, int maxnpeaks, float minpeak,
+                          int maxsize, int nthreads);
+int dallpeaks_i16_threaded(int16_t *image, int nx, int ny, int *objects,
+                           float *xcen, float *ycen, int *npeaks, float dpsf,
+                           float sigma, float dlim, float saddle,
+                           int maxper, int maxnpeaks, float minpeak,
+                           int maxsize, int nthreads);
+
 #endif
@@ -48,4 +48,39 @@ typedef struct dualtree_callbacks dualtree_callbacks;
 void dualtree_search(kdtree_t* search, kdtree_t* query,
                      dualtree_callbacks* callbacks);
 
+/*
+ For running a dual-tree search on several threads: the search split
+ into independent tasks, each the search below one node of the query
+ tree, with the list of search nodes that survived the decision
+ function above it.
+
+ dualtree_tasks_new() calls the decision function on the node pairs
+ above the tasks, in the same way dualtree_search() does, and makes at
+ least "ntasks" tasks if the query tree is deep enough.  Running all the
+ tasks, in order, then makes exactly the calls dualtree_search() would.
+ Tasks touch disjoint query nodes and points, so they can run
+ concurrently if the callbacks allow it; each task can be given its
+ own callbacks (and result buffers).
+ */
+typedef struct dualtree_tasks dualtree_tasks;
+
+// Tasks per thread, so that the threads finish together.
+#define DUALTREE_TASKS_PER_THREAD 8
+
+dualtree_tasks* dualtree_tasks_new(kdtree_t* search, kdtree_t* query,
+                                   dualtree_callbacks* callbacks,
+                                   int ntasks);
 
+int dualtree_tasks_count(const dualtree_tasks* tasks);
+
+void dualtree_tasks_run(dualtree_tasks* tasks, int i,
+                        dualtree_callbacks* callbacks);
+
+void dualtree_tasks_free(dualtree_tasks* tasks);
+
+/*
+ dualtree_search() on "nthreads" threads, for callbacks that can be
+ called concurrently for different query nodes.
+ */
+void dualtree_search_threads(kdtree_t* search, kdtree_t* query,
+                             dualtree_callbacks* callbacks, int nthreads);
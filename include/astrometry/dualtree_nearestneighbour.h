@@ -13,5 +13,15 @@ void dualtree_nearestneighbour(kdtree_t* xtree, kdtree_t* ytree, double maxdist2
                                int** count_within_range,
                                int notself);
 
+/*
+ Like dualtree_nearestneighbour(), searching on "nthreads" threads.  The
+ results are the same for any number of threads.
+ */
+void dualtree_nearestneighbour_threads(kdtree_t* xtree, kdtree_t* ytree,
+                                       double maxdist2,
+                                       double** nearest_d2, int** nearest_ind,
+                                       int** count_within_range,
+                                       int notself, int nthreads);
+
 #endif
 
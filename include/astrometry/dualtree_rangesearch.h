@@ -28,6 +28,21 @@ void dualtree_rangesearch(kdtree_t* xtree, kdtree_t* ytree,
                           progress_callback progress,
                           void* progress_param);
 
+/*
+ Like dualtree_rangesearch(), searching on "nthreads" threads, each
+ collecting its pairs in its own lists.  Returns the "npairs" pairs, in
+ the order dualtree_rangesearch() would report them, as new arrays of
+ kd-tree indices and distances-squared.  Returns 0 on success, -1 if
+ out of memory.
+ */
+int dualtree_rangesearch_pairs(kdtree_t* xtree, kdtree_t* ytree,
+                               double mindist, double maxdist,
+                               int notself,
+                               dist2_function distsquared,
+                               int nthreads,
+                               size_t* npairs, int** xinds, int** yinds,
+                               double** dist2s);
+
 /*
  void dualtree_rangecount(kdtree_t* x, kdtree_t* y,
  double mindist, double maxdist,
@@ -0,0 +1,47 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef ENGINE_COORDINATOR_H
+#define ENGINE_COORDINATOR_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/bl.h"
+
+struct engine;
+
+/**
+ Scatter/gather solving over a cluster of "astrometry-engine --listen"
+ nodes that each hold a shard of the index set (see the "shard" config
+ line).  At startup the coordinator asks each node for its indexes'
+ quad scale ranges and HEALPix tiles (the "indexes" command).  Each job
+ is then sent to every node that holds an index the job could use --
+ by its scale range and, if it has one, its RA,Dec search area -- in a
+ scratch directory there ("tmpdir", "put", "solve").  The first node to
+ solve the field wins: the others' connections are closed, which
+ cancels their runs, and the winner's output files are fetched back.
+
+ The nodes write the outputs under their base names, so the job's
+ output file names must differ in more than their directories.
+ */
+typedef struct engine_coordinator engine_coordinator_t;
+
+/**
+ Connects to each of the nodes' addresses (as for --listen: a Unix
+ socket path, or [host:]port) to list their indexes.  Returns NULL if
+ any of them can't be reached.
+ */
+engine_coordinator_t* engine_coordinator_new(const sl* nodes);
+
+/**
+ Runs the job file "jobfn" on the nodes, as engine_run_job_file() runs
+ it locally (with the same return values); the engine supplies the
+ default scale range and the cancellation token.
+ */
+int engine_coordinator_run_job_file(engine_coordinator_t* c,
+                                    struct engine* engine, const char* jobfn,
+                                    const char* basedir, anbool* solved);
+
+void engine_coordinator_free(engine_coordinator_t* c);
+
+#endif
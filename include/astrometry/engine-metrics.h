@@ -0,0 +1,75 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef ENGINE_METRICS_H
+#define ENGINE_METRICS_H
+
+#include <stdio.h>
+
+#include "astrometry/onefield.h"
+#include "astrometry/index.h"
+
+/**
+ Running totals for an astrometry-engine server: jobs by outcome, jobs
+ and connections in progress, time-to-solve histograms by index, the
+ solver's time in each stage, quad counts, index load times and page
+ faults.  They live in memory shared by the server and its forked
+ workers (all updates are atomic), and are published in the Prometheus
+ text format, either to a FILE* or over HTTP.
+ */
+typedef struct engine_metrics engine_metrics_t;
+
+enum {
+    ENGINE_METRICS_SOLVED,
+    ENGINE_METRICS_UNSOLVED,
+    ENGINE_METRICS_ERROR,
+    ENGINE_METRICS_N_RESULTS
+};
+
+/**
+ Creates the metrics, in memory that processes fork()ed afterwards will
+ share.  Returns NULL on failure.
+ */
+engine_metrics_t* engine_metrics_new(void);
+
+void engine_metrics_free(engine_metrics_t* m);
+
+void engine_metrics_set_workers(engine_metrics_t* m, int nworkers);
+
+// "delta" is +1 when a client connects, -1 when it hangs up.
+void engine_metrics_add_connection(engine_metrics_t* m, int delta);
+
+void engine_metrics_job_started(engine_metrics_t* m);
+
+/**
+ Records a finished job: its outcome (ENGINE_METRICS_*), wall-clock
+ time, the page faults it caused, and the totals kept in "bp" (which
+ may be NULL if the job couldn't be read).
+ */
+void engine_metrics_job_finished(engine_metrics_t* m, int result,
+                                 double seconds, long majflt, long minflt,
+                                 const onefield_t* bp);
+
+/**
+ Records the change in the index residency stats from "before" to
+ "after" (around a job).
+ */
+void engine_metrics_index_residency(engine_metrics_t* m,
+                                    const index_residency_stats_t* before,
+                                    const index_residency_stats_t* after);
+
+/**
+ Writes the metrics in the Prometheus text exposition format.
+ */
+int engine_metrics_write(const engine_metrics_t* m, FILE* fid);
+
+/**
+ Starts a thread that answers HTTP requests on the listening socket
+ "lfd" with the metrics (whatever the path asked for).  Returns 0 on
+ success.
+ */
+int engine_metrics_serve(engine_metrics_t* m, int lfd);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef ENGINE_MOSAIC_H
+#define ENGINE_MOSAIC_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/sip.h"
+
+struct engine;
+
+/**
+ Joint solving of the chips of a mosaic camera, whose layout in the
+ focal plane is known.  A layout file lists the chips' jobs (one
+ augmented xylist each) and where each chip lies:
+
+    # comment
+    chip <job.axy> <x> <y> <rotation>
+    blind <n>
+    joint_tweak <order>
+
+ A chip's pixel (px,py), in the coordinates of its WCS, is at
+ focal-plane position
+
+    (x,y) + R(rotation) (px,py)
+
+ with the rotation in degrees, anticlockwise; the focal-plane units are
+ the chips' pixels, which must all have the same size.  Relative job
+ file names are relative to the layout file.
+
+ The chips with the most sources are blind-solved first, up to
+ "blind" of them (default 3), until one solves.  The WCS of every other
+ chip is then predicted from the solved chip's (its SIP distortion
+ extrapolated over the other chip) and checked, untweaked, with the
+ verify-only path; chips whose prediction doesn't verify are
+ blind-solved.  With "joint_tweak", a SIP
+ WCS of that order is fit to the matched stars of all the solved chips
+ at once, in focal-plane coordinates, and each chip's share of it is
+ verified and written in place of the chip's own solution.
+ */
+typedef struct {
+    // focal-plane position of pixel (0,0), and rotation in degrees.
+    double x;
+    double y;
+    double rotation;
+} mosaic_chip_t;
+
+/**
+ Given "wcs", the WCS of chip "from", returns in "out" the TAN WCS that
+ chip "to" has if the two chips are placed as described.  Only the TAN
+ part of "wcs" is used; the reference pixel of "out" is where that of
+ "wcs" falls, which may be far outside chip "to".
+ */
+void mosaic_predict_tan(const tan_t* wcs, const mosaic_chip_t* from,
+                        const mosaic_chip_t* to, tan_t* out);
+
+/**
+ Runs the mosaic described in layout file "layoutfn", writing outputs
+ relative to "basedir" if non-NULL, as engine_run_job_file() does.
+ Returns -1 if the layout or a job file can't be read, and 0 otherwise;
+ sets "nsolved" (if non-NULL) to the number of chips solved.
+ */
+int engine_run_mosaic(struct engine* engine, const char* layoutfn,
+                      const char* basedir, int* nsolved);
+
+#endif
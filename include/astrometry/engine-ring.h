@@ -0,0 +1,225 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef ENGINE_RING_H
+#define ENGINE_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "astrometry/an-bool.h"
+
+struct engine;
+
+/**
+ Live frames for the engine through a ring of slots in POSIX shared
+ memory, for guiding and other uses that need each frame solved within
+ a fraction of a second of being read out.  A camera process puts each
+ frame -- an image, or the sources already extracted from one -- into
+ a slot, and "astrometry-engine --ring" finds the image's sources in
+ memory (as image2xy does), solves it with the indexes it keeps loaded,
+ and writes the WCS back into the same slot.  No files are read or
+ written per frame.
+
+ Successive frames are tracked as by engine-tracking.h: a frame that
+ can be aligned with the last solved one has the WCS predicted from
+ that frame's verified, which takes milliseconds, and is blind-solved
+ only if that fails.
+
+ The segment is a frame_ring_header_t, then (from FRAME_RING_HEADER
+ bytes) "nslots" slots of "slotsize" bytes: each is a
+ frame_ring_slot_t followed, from FRAME_RING_PAYLOAD bytes, by the
+ frame.  A slot goes
+
+   FREE -> FILLING     client: frame_ring_acquire(), then fills it
+        -> READY       client: frame_ring_submit()
+        -> BUSY        engine: frame_ring_next()
+        -> DONE        engine: frame_ring_finish(), with the results
+        -> FREE        client: frame_ring_release(), once it has read them
+
+ with each change made under the header's mutex and signalled on its
+ condition variable, both process-shared.  READY slots are taken in the
+ order they were submitted.  The layout uses fixed-size types only, so
+ clients in other languages can map it too.
+ */
+
+#define FRAME_RING_MAGIC "ANFRING"
+#define FRAME_RING_VERSION 1
+
+// where the slots start in the segment, and the payload in a slot.
+#define FRAME_RING_HEADER 1024
+#define FRAME_RING_PAYLOAD 512
+
+// Slot states
+enum frame_ring_state {
+    FRAME_RING_FREE = 0,
+    FRAME_RING_FILLING,
+    FRAME_RING_READY,
+    FRAME_RING_BUSY,
+    FRAME_RING_DONE,
+};
+
+// What a slot's payload holds ("kind"):
+enum frame_ring_kind {
+    // "width" x "height" pixels, row by row, of these types:
+    FRAME_RING_FLOAT = 1,
+    FRAME_RING_U8,
+    FRAME_RING_U16,
+    // "nsources" (x, y, flux) triples of floats, with the centre of the
+    // first pixel at (1, 1), as in an xylist; in any order.
+    FRAME_RING_SOURCES,
+};
+
+// Results ("status"):
+enum frame_ring_status {
+    FRAME_RING_SOLVED = 1,
+    FRAME_RING_UNSOLVED,
+    FRAME_RING_ERROR,
+};
+
+// "flags": blind-solve, rather than tracking from the last frame (eg,
+// after a slew).
+#define FRAME_RING_BLIND 1
+
+typedef struct {
+    // managed by the frame_ring_*() calls.
+    uint32_t state;
+    uint32_t pad0;
+    uint64_t ticket;
+
+    /* Set by the client */
+    // echoed back; not used by the engine.
+    uint64_t seq;
+    uint32_t kind;
+    uint32_t flags;
+    // the image size in pixels (for FRAME_RING_SOURCES, of the image
+    // the sources came from).
+    int32_t width;
+    int32_t height;
+    int32_t nsources;
+    // for images: the factor to downsample by before finding sources
+    // (0 or 1: none).
+    int32_t downsample;
+    // for images: the detection significance and PSF width (sigma, in
+    // pixels) of simplexy; zero for the defaults.
+    float plim;
+    float dpsf;
+    // pixel scale range in arcsec/pixel (zero: the engine's defaults).
+    double scale_lo;
+    double scale_hi;
+    // if "radius" > 0, search only within "radius" degrees of ("ra", "dec").
+    double ra;
+    double dec;
+    double radius;
+    // wall-clock time limit in seconds (zero: the engine's CPU limit).
+    double timelimit;
+
+    /* Set by the engine */
+    int32_t status;
+    // number of sources found (or given).
+    int32_t nfound;
+    // whether it was solved by tracking, rather than blind.
+    int32_t tracked;
+    // the index that solved it (zero if tracked), and the number of
+    // stars matched.
+    int32_t indexid;
+    int32_t nmatch;
+    int32_t pad1;
+    // The TAN part of the WCS, with FITS conventions (first pixel (1,1)).
+    double crval[2];
+    double crpix[2];
+    double cd[2][2];
+    // seconds spent finding the sources, and solving.
+    double extract_time;
+    double solve_time;
+} frame_ring_slot_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint64_t slotsize;
+    // the ticket of the next submitted slot.
+    uint64_t next_ticket;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} frame_ring_header_t;
+
+typedef struct frame_ring frame_ring_t;
+
+/**
+ Creates the segment "name" (a POSIX shared memory name, "/something"),
+ replacing any old one, with "nslots" slots of payloads up to
+ "maxpayload" bytes.  It is removed by frame_ring_close().
+ */
+frame_ring_t* frame_ring_create(const char* name, int nslots,
+                                size_t maxpayload);
+
+// Maps an existing ring, as a client.
+frame_ring_t* frame_ring_open(const char* name);
+
+// Unmaps the ring, and removes it if this process created it.
+void frame_ring_close(frame_ring_t* r);
+
+int frame_ring_nslots(const frame_ring_t* r);
+size_t frame_ring_max_payload(const frame_ring_t* r);
+frame_ring_slot_t* frame_ring_get_slot(frame_ring_t* r, int i);
+void* frame_ring_payload(frame_ring_t* r, frame_ring_slot_t* slot);
+
+/**
+ (client) Takes a free slot, with its inputs zeroed, waiting up to
+ "timeout" seconds (forever if negative) for one.  Returns NULL on
+ timeout.
+ */
+frame_ring_slot_t* frame_ring_acquire(frame_ring_t* r, double timeout);
+
+// (client) Queues a filled slot for the engine.
+void frame_ring_submit(frame_ring_t* r, frame_ring_slot_t* slot);
+
+/**
+ (client) Waits up to "timeout" seconds (forever if negative) for the
+ engine to finish a submitted slot; returns 0 when the results are in
+ the slot, -1 on timeout.
+ */
+int frame_ring_wait(frame_ring_t* r, frame_ring_slot_t* slot,
+                    double timeout);
+
+// (client) Frees a finished slot.
+void frame_ring_release(frame_ring_t* r, frame_ring_slot_t* slot);
+
+/**
+ (engine) Takes the earliest submitted slot, waiting up to "timeout"
+ seconds (forever if negative); returns NULL on timeout.
+ */
+frame_ring_slot_t* frame_ring_next(frame_ring_t* r, double timeout);
+
+// (engine) Hands a slot's results back to the client.
+void frame_ring_finish(frame_ring_t* r, frame_ring_slot_t* slot);
+
+/**
+ The engine's side: solves the frames of a ring, tracking from one to
+ the next.
+ */
+typedef struct engine_ring engine_ring_t;
+
+engine_ring_t* engine_ring_new(struct engine* engine, frame_ring_t* ring);
+
+/**
+ Solves the frame in "slot" (one taken by frame_ring_next()), setting
+ its results.  Returns 0 if it ran (solved or not), -1 on error (with
+ "status" FRAME_RING_ERROR).
+ */
+int engine_ring_solve(engine_ring_t* er, frame_ring_slot_t* slot);
+
+/**
+ Solves frames as they are submitted until "*stop" (if non-NULL) is
+ set, which is checked at least every second.
+ */
+void engine_ring_serve(engine_ring_t* er, const volatile int* stop);
+
+// Logs the totals: frames, tracked, blind solves, failures.
+void engine_ring_free(engine_ring_t* er);
+
+#endif
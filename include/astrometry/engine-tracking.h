@@ -0,0 +1,68 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef ENGINE_TRACKING_H
+#define ENGINE_TRACKING_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/starxy.h"
+
+struct engine;
+
+/**
+ Tracking a sequence of frames (video, time series) of a field that
+ moves little from one frame to the next.  The frames are the fields of
+ the jobs given -- those in each job's field list (solve-field --fields),
+ in order -- and the jobs in the order given, so a sequence can be one
+ multi-field xylist or a stream of single-field ones.
+
+ The first frame is blind-solved.  Each following frame is aligned
+ with the last solved one by cross-matching their sources, its WCS is
+ predicted from that frame's through the alignment, and the prediction
+ is checked with the verify-only path; if that fails, the frame is
+ blind-solved.  The jobs' outputs are written as usual; in a
+ multi-field job, the WCS file name may contain a "%i" for the field
+ number, as in the solver.
+ */
+typedef struct engine_tracker engine_tracker_t;
+
+/**
+ The alignment of a frame with an earlier one: pixel p of the frame is
+ at A p + t in the earlier frame.
+ */
+typedef struct {
+    double A[2][2];
+    double t[2];
+    // the number of sources matched, and their rms residual in pixels.
+    int nmatch;
+    double rms;
+} frame_align_t;
+
+/**
+ Finds the shift and rotation (and change of scale) between two frames,
+ by trying the offsets between pairs of their brightest sources and
+ keeping the one that brings the most sources of "cur" within "radius"
+ pixels of one of "prev" (a kd-tree of "prev" answers the queries), then
+ fitting to all the matches.  The sources are assumed to be sorted by
+ brightness.  Returns 0 on success, -1 if fewer than three sources
+ match.
+ */
+int frame_align(const starxy_t* prev, const starxy_t* cur, double radius,
+                frame_align_t* align);
+
+engine_tracker_t* engine_tracker_new(struct engine* engine);
+
+/**
+ Runs the frames of job file "jobfn", continuing the sequence of the
+ earlier jobs; outputs are written relative to "basedir" if non-NULL.
+ Returns -1 if the job file can't be read, and 0 otherwise; sets
+ "nsolved" (if non-NULL) to the number of its frames solved.
+ */
+int engine_tracker_run_job_file(engine_tracker_t* t, const char* jobfn,
+                                const char* basedir, int* nsolved);
+
+// Logs the totals: frames tracked, blind solves, failures.
+void engine_tracker_free(engine_tracker_t* t);
+
+#endif
@@ -7,11 +7,21 @@
 #define ENGINE_H
 
 #include <stdio.h>
+#include <pthread.h>
 
 #include "astrometry/onefield.h"
 #include "astrometry/bl.h"
 #include "astrometry/an-bool.h"
 #include "astrometry/index.h"
+#include "astrometry/index-lookup.h"
+#include "astrometry/index-remote.h"
+#include "astrometry/engine-metrics.h"
+#include "astrometry/solution-cache.h"
+#include "astrometry/code-matcher.h"
+#include "astrometry/engine-coordinator.h"
+
+// the most cached solutions verified for a field; see "solution_cache".
+#define ENGINE_CACHE_MAX_HITS 3
 
 struct engine {
     // search paths (directories)
@@ -26,29 +36,109 @@ struct engine {
     pl* free_indexes;
     // multiindexes that need to be freed
     pl* free_mindexes;
+    // remote index stores (index_remote_t) that "indexes" come from; see
+    // "remote_index".
+    pl* remotes;
 
     il* ibiggest;
     il* ismallest;
     il* default_depths;
     double sizesmallest;
     double sizebiggest;
+    // HEALPix lookup of "indexes", for jobs with a position; built when
+    // first needed, and dropped when an index is added.
+    index_lookup_t* lookup;
     anbool inparallel;
+    // without "inparallel": read this many upcoming indexes ahead, up to
+    // "prefetch_max" bytes; see onefield_t.
+    int prefetch;
+    size_t prefetch_max;
+
+    // use (and update) the index manifests in the search paths?  See
+    // index_manifest_scan().
+    anbool use_manifests;
     double minwidth;
     double maxwidth;
     float cpulimit;
+    // number of threads the solver searches with.
+    int nthreads;
+    // number of threads that verify matches while the search continues.
+    int nverifiers;
+    // number of fields of a multi-field job to solve at once; see
+    // onefield_t.
+    int nfieldthreads;
+    // write each job's output files at once, on separate threads?
+    anbool parallel_writers;
+    // run the (depth, scale, index) combinations cheapest & likeliest first?
+    anbool schedule;
+    // if set, fields solved before are looked up here and their old WCSes
+    // verified before searching; new solutions are added.
+    solution_cache_t* solution_cache;
+    // if set, searches the indexes' codes in place of their code
+    // kd-trees; see "code_matcher".
+    code_matcher_t* code_matcher;
+    // pick the depths (for jobs using the default depths) and quad sizes
+    // to try first from the field's source density and the indexes' star
+    // density at the job's scale; see engine_run_job().
+    anbool adaptive;
+    // if > 0, give each run at most this many seconds at first, and come
+    // back to the runs that didn't finish after trying all the others.
+    int timeslice;
+    // number of runs each index has been used in, and how many of them
+    // solved the field (indexed like "indexes").
+    il* index_ntried;
+    il* index_nsolved;
+    // protects "lookup", "index_ntried" and "index_nsolved", which jobs
+    // running at the same time (engine_run_jobs()) share.
+    pthread_mutex_t lock;
     char* cancelfn;
     char* solvedfn;
+    // cancellation token given to the jobs read by engine_read_job_file();
+    // see job_set_cancel_token().
+    int* cancel;
+    // if set, engine_run_job_file() records each job in these; not owned.
+    engine_metrics_t* metrics;
+    // keep only shard "shard" (of "nshards", if > 1) of the indexes: a
+    // range of index scales, or (with "shard_by_healpix") a share of the
+    // HEALPix tiles; see "shard".
+    int shard;
+    int nshards;
+    anbool shard_by_healpix;
+    // NUMA placement of the indexes (INDEX_NUMA_*, see
+    // index_numa_set_policy()), and the largest code-tree node arrays
+    // to copy to each node; see "numa".
+    int numa_policy;
+    size_t numa_replicate;
+    // if set, engine_run_job_file() sends jobs to these nodes instead of
+    // running them here; not owned.
+    engine_coordinator_t* coordinator;
+    // write each job's output files in the current directory, under
+    // their base names (for the server's "tmpdir" clients).
+    anbool flat_outputs;
 };
 typedef struct engine engine_t;
 
 struct job_t {
     dl* scales;
     il* depths;
+    // were "depths" filled in from the engine's default depths?
+    anbool default_depths;
     anbool include_default_scales;
     double ra_center;
     double dec_center;
     double search_radius;
     anbool use_radec_center;
+    // cancellation token and wall-clock deadline for the solver; see
+    // job_set_cancel_token() and job_set_deadline().
+    int* cancel;
+    double deadline;
+    // only check the WCSes in the verify list (bp.verify_wcs_list), with
+    // the indexes of their scales; don't search.
+    anbool verify_only;
+    // checkpoint file (ANCKPT): if the job is cut short by a limit, how
+    // far it got is saved here, and a job with a checkpoint resumes from
+    // it; see job-checkpoint.h.  Single-field jobs only.
+    char* checkpoint_fn;
     onefield_t bp;
 };
 typedef struct job_t job_t;
@@ -58,19 +148,84 @@ void engine_add_search_path(engine_t* engine, const char* path);
 char* engine_find_index(engine_t*, const char* name);
 // note that "path" must be a full path name.
 int engine_add_index(engine_t* engine, char* path);
+// adds the indexes in the remote store at "url", cached in "cachedir"
+// (up to "maxbytes"; 0 for no limit), and starts downloading the
+// "nprefetch" most-used ones.
+int engine_add_remote_indexes(engine_t* engine, const char* url,
+                              const char* cachedir, int64_t maxbytes,
+                              int nprefetch);
 // look in all the search path directories for index files.
 int engine_autoindex_search_paths(engine_t* engine);
 int engine_parse_config_file_stream(engine_t* engine, FILE* fconf);
 int engine_parse_config_file(engine_t* engine, const char* fn);
 int engine_run_job(engine_t* engine, job_t* job);
+
+/**
+ Runs the "njobs" jobs on "nthreads" threads (the number of CPUs if
+ <= 0), each thread running one job at a time with engine_run_job().
+ The jobs share the engine's indexes, which must not be added to while
+ the jobs run; each job must have its own output files.  Returns 0 on
+ success.
+ */
+int engine_run_jobs(engine_t* engine, job_t** jobs, int njobs, int nthreads);
+
 void engine_free(engine_t* engine);
 
+/**
+ Returns the default config file, "astrometry.cfg", looked for in ../etc
+ relative to "mydir" (the directory containing the executable), in /etc
+ (if "mydir" is /usr/bin), in "mydir", and in the current directory; or
+ NULL if there is none.  The result is newly-allocated.
+ */
+char* engine_find_config_file(const char* mydir);
+
+/**
+ Sets up the engine as astrometry-engine does: reads the config file
+ ("configfn", or the default one for "mydir" if NULL; "none" for no
+ config file), adds the indexes found in "index_dirs" and those named
+ (with wildcards) in "index_files" -- either may be NULL -- and fills in
+ the default depths.  Returns 0 on success.
+ */
+int engine_configure(engine_t* engine, const char* configfn,
+                     const char* mydir, sl* index_dirs, sl* index_files);
+
+/**
+ Reads the given job file (an augmented xylist) and runs it, writing
+ outputs relative to "basedir" if non-NULL.  Returns -1 if the job file
+ can't be read, 1 if the job fails, and 0 if it ran; sets "solved" (if
+ non-NULL) to whether the field was solved.
+ */
+int engine_run_job_file(engine_t* engine, const char* jobfn,
+                        const char* basedir, anbool* solved);
+
 job_t* engine_read_job_file(engine_t* engine, const char* jobfn);
+/**
+ The job described by the keywords of "hdr" (those of an augmented
+ xylist's primary header), with the engine's defaults filled in, as
+ engine_read_job_file() does; but the field is left unset, to be given
+ by onefield_set_field_file() or, in memory, by "bp.field_xy".
+ Returns NULL if the keywords are invalid.
+ */
+job_t* engine_job_from_header(engine_t* engine, const qfits_header* hdr);
 int job_set_base_dir(job_t* job, const char* dir);
 int job_set_input_base_dir(job_t* job, const char* dir);
+// (with "dir" NULL, the output files' directories are dropped.)
 int job_set_output_base_dir(job_t* job, const char* dir);
 void job_set_cancel_file(job_t* job, const char* fn);
 void job_set_solved_file(job_t* job, const char* fn);
+void job_set_checkpoint_file(job_t* job, const char* fn);
+/**
+ The job stops as soon as "*token" becomes non-zero; set it with
+ solver_cancel() from any thread (eg, when another job has already
+ solved the field).  Unlike the cancel file, this needs no polling of
+ the file system.  NULL for none.
+ */
+void job_set_cancel_token(job_t* job, int* token);
+/**
+ The job stops at wall-clock time "deadline" (as returned by timenow());
+ zero for none.
+ */
+void job_set_deadline(job_t* job, double deadline);
 void job_free(job_t* job);
 
 
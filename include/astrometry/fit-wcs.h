@@ -9,6 +9,20 @@
 #include "astrometry/sip.h"
 #include "astrometry/starkd.h"
 
+/**
+ Scratch space for the fitting routines below, so that repeated fits do
+ no allocation.  Sized for fits of up to "maxstars" correspondences with
+ SIP order up to "maxorder"; the "_ws" variants fail (returning -1) if
+ asked for more.  A workspace must not be shared between threads.
+
+ The variants without a workspace allocate a temporary one per call.
+ */
+typedef struct fit_wcs_workspace_t fit_wcs_workspace_t;
+
+fit_wcs_workspace_t* fit_wcs_workspace_new(int maxorder, int maxstars);
+
+void fit_wcs_workspace_free(fit_wcs_workspace_t* ws);
+
 int fit_sip_coefficients(const double* starxyz,
                          const double* fieldxy,
                          const double* weights,
@@ -18,6 +32,16 @@ int fit_sip_coefficients(const double* starxyz,
                          int inv_order,
                          sip_t* sipout);
 
+int fit_sip_coefficients_ws(fit_wcs_workspace_t* ws,
+                            const double* starxyz,
+                            const double* fieldxy,
+                            const double* weights,
+                            int M,
+                            const tan_t* tanin1,
+                            int sip_order,
+                            int inv_order,
+                            sip_t* sipout);
+
 void wcs_shift(tan_t* wcs, double xs, double ys);
 
 /**
@@ -39,6 +63,85 @@ int fit_sip_wcs(const double* starxyz,
                 sip_t* sipout
                 );
 
+int fit_sip_wcs_ws(fit_wcs_workspace_t* ws,
+                   const double* starxyz,
+                   const double* fieldxy,
+                   const double* weights,
+                   int M,
+                   const tan_t* tanin,
+                   int sip_order,
+                   int inv_order,
+                   int doshift,
+                   sip_t* sipout);
+
+/**
+ Accumulates the normal equations of the fit_sip_wcs() least-squares
+ problem one correspondence at a time, so that the fit can be updated as
+ correspondences are added and removed without rebuilding the full
+ (M x N) system, and so that the SIP fit of any order up to "maxorder"
+ can be solved from the same sums (the lower-order systems are leading
+ blocks of the higher-order one).
+
+ The workspace is allocated once; fit_sip_normal_reset() starts a new
+ accumulation about a given TAN WCS (its CRVAL and CRPIX; the CD matrix
+ is re-fit if "doshift" is set when solving, as in fit_sip_wcs()).
+ */
+struct fit_sip_normal_t {
+    int maxorder;
+    // number of polynomial terms at "maxorder".
+    int NT;
+    tan_t tan;
+    double xyzcrval[3];
+    // pixel offsets from CRPIX are divided by this, for conditioning.
+    double scale;
+    // upper triangle of A^T A (NT x NT), and A^T b for the x and y IWCs.
+    double* ata;
+    double* atb1;
+    double* atb2;
+    // scratch: Cholesky factor, solutions, and one row of A.
+    double* chol;
+    double* x1;
+    double* x2;
+    double* terms;
+    // number of correspondences (with non-zero weight) accumulated.
+    int npairs;
+    double totalweight;
+};
+typedef struct fit_sip_normal_t fit_sip_normal_t;
+
+fit_sip_normal_t* fit_sip_normal_new(int maxorder);
+
+void fit_sip_normal_free(fit_sip_normal_t* f);
+
+/**
+ Clears the sums, and sets the TAN WCS about which the fit is done.  The
+ conditioning scale is taken from the TAN's image size.
+ */
+void fit_sip_normal_reset(fit_sip_normal_t* f, const tan_t* tan);
+
+/**
+ Adds (or removes) the correspondence between the star at unit vector
+ "starxyz" and the field object at pixel "fieldxy", with the given
+ weight (as in fit_sip_wcs(); 1.0 for uniform weighting).  A pair must be
+ removed with the same weight it was added with.
+
+ Returns -1 if the star does not project onto the tangent plane (and
+ nothing was accumulated), 0 otherwise.
+ */
+int fit_sip_normal_add(fit_sip_normal_t* f, const double* starxyz,
+                       const double* fieldxy, double weight);
+int fit_sip_normal_remove(fit_sip_normal_t* f, const double* starxyz,
+                          const double* fieldxy, double weight);
+
+/**
+ Solves the accumulated normal equations for a SIP WCS of the given
+ order (<= maxorder) with a single Cholesky factorization, and fills in
+ "sipout" exactly as fit_sip_wcs() does.  Returns 0 on success, -1 if
+ there are too few correspondences or the system is singular.
+ */
+int fit_sip_normal_solve(fit_sip_normal_t* f, int sip_order, int inv_order,
+                         int doshift, sip_t* sipout);
+
 int fit_sip_wcs_2(const double* starxyz,
                   const double* fieldxy,
                   const double* weights,
@@ -75,6 +178,15 @@ int fit_tan_wcs_move_tangent_point_weighted(const double* starxyz,
                                             const tan_t* tanin,
                                             tan_t* tanout);
 
+int fit_tan_wcs_move_tangent_point_weighted_ws(fit_wcs_workspace_t* ws,
+                                               const double* starxyz,
+                                               const double* fieldxy,
+                                               const double* weights,
+                                               int N,
+                                               const double* crpix,
+                                               const tan_t* tanin,
+                                               tan_t* tanout);
+
 /*
  Computes a rigid (conformal) TAN WCS projection, based on the correspondence
  between stars and field objects.
@@ -101,4 +213,24 @@ int fit_tan_wcs_weighted(const double* starxyz,
                          tan_t* tan,
                          double* p_scale);
 
+int fit_tan_wcs_weighted_ws(fit_wcs_workspace_t* ws,
+                            const double* starxyz,
+                            const double* fieldxy,
+                            const double* weights,
+                            int N,
+                            // output:
+                            tan_t* tan,
+                            double* p_scale);
+
+/**
+ Fits "out", the WCS of a W x H image whose pixel p is pixel A p + t of
+ an image with WCS "in" (eg, the next frame of a sequence, or another
+ chip of a mosaic).  SIP terms, of the orders of those of "in", are fit
+ on a grid of pixels over the image, so "in" is extrapolated where the
+ images don't overlap; the reference pixel is the image centre.
+ Returns 0 on success.
+ */
+int fit_wcs_transformed(const sip_t* in, const double A[2][2],
+                        const double* t, double W, double H, sip_t* out);
+
 #endif
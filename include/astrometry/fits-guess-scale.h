@@ -33,4 +33,23 @@ int fits_guess_scale(const char* infn,
 void fits_guess_scale_hdr(const qfits_header* hdr,
                           sl** p_methods, dl** p_scales);
 
+/*
+ Guesses the scale (in arcsec/pixel) of a JPEG image from its EXIF tags,
+ reading only the start of the file:
+
+ "exif-focalplane": FocalLength and the FocalPlaneXResolution of the
+ sensor;
+ "exif-35mm": FocalLengthIn35mmFilm, over the 35mm frame's diagonal.
+
+ "imagew" is the image width, if known (0: use the JPEG's own).  The
+ methods and scales are appended as in fits_guess_scale_hdr().  These
+ are estimates: focal lengths are often rounded, and lenses aren't
+ perfectly rectilinear, so allow a few percent either way.
+
+ Returns the number of scales found (0 if the file isn't a JPEG or has
+ no usable EXIF tags), or -1 if the file can't be read.
+ */
+int exif_guess_scale(const char* fn, int imagew,
+                     sl** p_methods, dl** p_scales);
+
 #endif
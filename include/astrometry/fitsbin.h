@@ -132,7 +132,10 @@ struct fitsbin_t {
 
     // only used for in_memory():
     anbool inmemory;
-    bl* items;
+    // rows of the chunk being written, stored contiguously
+    char* items;
+    size_t nitems;
+    size_t itemscap;
     bl* extensions;
 
     // The primary FITS header
@@ -150,6 +153,48 @@ struct fitsbin_t {
 };
 typedef struct fitsbin_t fitsbin_t;
 
+/**
+ How the chunks of files opened for reading are mmap()ed.  These are
+ process-wide, and apply to chunks read after they are set.
+ */
+enum fitsbin_mmap_flags {
+    // madvise(MADV_WILLNEED): start reading the chunk in.
+    FITSBIN_MMAP_WILLNEED = 1,
+    // madvise(MADV_RANDOM): don't read ahead on page faults.
+    FITSBIN_MMAP_RANDOM   = 2,
+    // madvise(MADV_HUGEPAGE), where supported.
+    FITSBIN_MMAP_HUGEPAGE = 4,
+    // MAP_POPULATE: fault the whole chunk in before returning, for chunks
+    // no larger than the "populate_max" given to fitsbin_set_mmap_policy().
+    FITSBIN_MMAP_POPULATE = 8,
+    // read the chunk into the page cache in the background, with
+    // read_parallel().
+    FITSBIN_MMAP_PREFETCH = 16,
+    // don't map the file at all: read the chunk into memory up front with
+    // read_parallel(), on get_parallel_read_threads() threads.
+    FITSBIN_MMAP_READ     = 32,
+    // don't map kd-tree arrays when the tree is read, only when it is
+    // first searched (or its data accessed); see kdtree_load().
+    FITSBIN_MMAP_LAZY     = 64,
+};
+
+/**
+ Sets the mmap policy: "flags" is a bitwise OR of fitsbin_mmap_flags;
+ "populate_max" is the size in bytes of the largest chunk to which
+ FITSBIN_MMAP_POPULATE applies (0: no limit).  The default is 0, 0,
+ ie, plain mmap().
+ */
+void fitsbin_set_mmap_policy(int flags, size_t populate_max);
+
+int fitsbin_get_mmap_policy(size_t* populate_max);
+
+/**
+ Parses a list of mmap flag names ("willneed", "random", "hugepage",
+ "populate", "prefetch", "read", "lazy"), separated by spaces or commas, into a bitwise
+ OR of fitsbin_mmap_flags.  Returns -1 on an unknown name.
+ */
+int fitsbin_parse_mmap_flags(const char* str);
+
 // Initializes a chunk to default values
 void fitsbin_chunk_init(fitsbin_chunk_t* chunk);
 
@@ -202,6 +247,12 @@ fitsbin_chunk_t* fitsbin_add_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk);
  */
 int fitsbin_read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk);
 
+/**
+ Returns TRUE if this file contains the table "tablename", without
+ reading (or mapping) it.
+ */
+anbool fitsbin_has_chunk(fitsbin_t* fb, const char* tablename);
+
 FILE* fitsbin_get_fid(fitsbin_t* fb);
 
 int fitsbin_close(fitsbin_t* fb);
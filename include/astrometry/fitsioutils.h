@@ -143,6 +143,30 @@ int fits_blocks_needed(int size);
 
 size_t fits_bytes_needed(size_t size);
 
+/**
+ Adds "len" bytes (a multiple of 4) to the FITS DATASUM "sum": the
+ 32-bit ones'-complement sum of the data read as big-endian words.
+ Start with sum = 0.
+ */
+uint32_t fits_datasum(uint32_t sum, const void* data, size_t len);
+
+/**
+ Copies FITS file "infn" to "outfn", adding blank cards to each header
+ so that every non-empty data unit starts at a multiple of "align"
+ bytes (a power of two; up to 64 is free, 4096 costs up to 184 kB per
+ extension), and recording the DATASUM of each data unit.  The result
+ is a plain FITS file, read as before, but its tables can be mmap()ed
+ without an offset into the first page.  Returns 0 on success.
+ */
+int fits_copy_aligned(const char* infn, const char* outfn, int align);
+
+/**
+ Checks the data of each extension of "fn" that has a DATASUM card
+ against it.  Returns the number of mismatches, or -1 on error;
+ "nchecked", if not NULL, is set to the number of extensions checked.
+ */
+int fits_check_datasums(const char* fn, int* nchecked);
+
 int fits_pad_file_with(FILE* fid, char pad);
 
 int fits_pad_file(FILE* fid);
@@ -126,8 +126,12 @@ struct fitstable_t {
 
     // when working in-memory:
     anbool inmemory;
-    // rows of the current table, in FITS format but un-endian-flipped
-    bl* rows;
+    // rows of the current table, in FITS format but un-endian-flipped,
+    // stored contiguously: "nmemrows" rows of "memrowsize" bytes.
+    char* memrows;
+    size_t nmemrows;
+    size_t memrowscap;
+    int memrowsize;
     // other extensions that are available.
     bl* extensions;
 
@@ -140,6 +144,9 @@ struct fitstable_t {
     // end of the current table's header (including FITS padding)
     // (also used when reading via 'readfid'):
     off_t end_table_offset;
+    // rows waiting to be written, packed and endian-flipped.
+    char* wbuf;
+    size_t wbufused;
 
     // Buffered reading.
     bread_t* br;
@@ -362,6 +369,43 @@ void* fitstable_read_column_offset(const fitstable_t* tab,
                                    const char* colname, tfits_type ctype,
                                    int offset, int N);
 
+/**
+ A view of one column of a table, for reading big columns without a
+ full-size copy.
+
+ If the table is being read from a file and the column's FITS type is
+ "ctype" and needs no byte-swapping (single bytes, or a big-endian
+ machine), the view points straight into the file, mapped once, with a
+ stride of the table's row width.  Likewise, a view of an in-memory
+ table whose column type is "ctype" points straight at its rows.
+ Otherwise, fitstable_view_rows()
+ converts just the rows it is asked for into a buffer owned by the view,
+ so reading a column in blocks takes memory for one block.
+ */
+typedef struct fitstable_view_t fitstable_view_t;
+
+fitstable_view_t* fitstable_view_column(const fitstable_t* tab,
+                                        const char* colname,
+                                        tfits_type ctype);
+
+/**
+ Returns rows [start, start+N) of the column: row i (and its array
+ elements, if the column is an array) is at
+ (char*)result + (i - start) * (*p_stride).  The pointer is valid until
+ the next call (if the view is not direct) or fitstable_view_free().
+ */
+const void* fitstable_view_rows(fitstable_view_t* view, int start, int N,
+                                int* p_stride);
+
+// Does the view point into the file (or the in-memory table)?
+anbool fitstable_view_is_direct(const fitstable_view_t* view);
+
+int fitstable_view_nrows(const fitstable_view_t* view);
+
+int fitstable_view_array_size(const fitstable_view_t* view);
+
+void fitstable_view_free(fitstable_view_t* view);
+
 // NOTE NOTE NOTE, you must call this with *pointers* to the data to write.
 int fitstable_write_row(fitstable_t* table, ...);
 
@@ -384,6 +428,40 @@ int fitstable_write_row_data(fitstable_t* table, void* data);
 int fitstable_copy_row_data(fitstable_t* table, int row, fitstable_t* outtable);
 int fitstable_copy_rows_data(fitstable_t* table, int* rows, int Nrows, fitstable_t* outtable);
 
+/**
+ Like fitstable_copy_rows_data(), but gathers the rows on "nthreads"
+ threads, in blocks, and writes them out a large buffer at a time.
+ */
+int fitstable_copy_rows_data_parallel(fitstable_t* table, const int* rows,
+                                      int Nrows, fitstable_t* outtable,
+                                      int nthreads);
+
+/**
+ A gather of the rows "inds" (in any order, with repeats) of a table,
+ read once in file order -- each run of consecutive rows in one read,
+ the runs shared out over "nthreads" threads (0: one per CPU) when there
+ are many -- so that any number of its columns can then be pulled out
+ with fitstable_gather_column() without going back to the file.
+ */
+typedef struct fitstable_gather_t fitstable_gather_t;
+
+fitstable_gather_t* fitstable_gather_rows(fitstable_t* tab, const int* inds,
+                                          int N, int nthreads);
+
+/**
+ Like fitstable_read_column_array_inds() with the gather's "inds": the
+ column, converted to "ctype", for each of the rows in the order they
+ were asked for.  Sets "*p_arraysize" (if non-NULL) to the column's
+ array size.  Free with free().
+ */
+void* fitstable_gather_column(const fitstable_gather_t* g, const char* colname,
+                              tfits_type ctype, int* p_arraysize);
+
+// The number of distinct rows read.
+int fitstable_gather_nrows(const fitstable_gather_t* g);
+
+void fitstable_gather_free(fitstable_gather_t* g);
+
 /**
  Endian-flips a row of data, IF NECESSARY, according to the current
  list of columns.  (See fitstable_add_fits_columns_as_struct()).
@@ -428,6 +506,10 @@ int fitstable_write_header(fitstable_t* t);
 // Rewrite (fix) the table header.
 int fitstable_fix_header(fitstable_t* t);
 
+// Writes out any rows still buffered for writing, so that the caller
+// can use "t->fid" directly (eg, ftello() or fclose() it).
+int fitstable_flush(fitstable_t* t);
+
 // When reading: close the current table and reset all fields that refer to it.
 void fitstable_close_table(fitstable_t* tab);
 
@@ -0,0 +1,39 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef HEALPIX_BUCKETS_H
+#define HEALPIX_BUCKETS_H
+
+/**
+ A small spatial index for the built-in catalogs: points on the sky,
+ bucketed by the HEALPix cell (at a coarse Nside) they fall in, so that
+ the ones near a field can be found without looking at them all.
+ */
+typedef struct healpix_buckets healpix_buckets_t;
+
+/**
+ Buckets the "N" points with the given RA,Dec (degrees; "ra" and "dec"
+ are "stride" bytes apart from one point to the next, so that they can
+ point into an array of structs).
+ */
+healpix_buckets_t* healpix_buckets_new(const double* ra, const double* dec,
+                                       int stride, int N, int Nside);
+
+/**
+ As healpix_buckets_new(), for positions stored as floats.
+ */
+healpix_buckets_t* healpix_buckets_new_f(const float* ra, const float* dec,
+                                         int stride, int N, int Nside);
+
+/**
+ Returns the indices (in ascending order) of the points within "radius"
+ degrees of RA,Dec (ra,dec), and sets "N" to their number.  Free with
+ free().
+ */
+int* healpix_buckets_within(const healpix_buckets_t* b, double ra,
+                            double dec, double radius, int* N);
+
+void healpix_buckets_free(healpix_buckets_t* b);
+
+#endif
@@ -22,6 +22,41 @@ il* healpix_rangesearch_xyz_approx(const double* xyz, double radius, int Nside,
 il* healpix_rangesearch_radec_approx(double ra, double dec, double radius, int Nside, il* hps);
 il* healpix_rangesearch_radec(double ra, double dec, double radius, int Nside, il* hps);
 
+/**
+ Coverage queries that return compact, sorted lists of pixel ranges
+ rather than lists of pixels: the healpixes (xy scheme, at "Nside") are
+ those in the half-open ranges [ranges[2i], ranges[2i+1]).  The ranges
+ are appended to "ranges", or to a new list, which is returned.
+
+ The work grows with the length of the region's boundary (in pixels),
+ not its area: blocks of pixels that lie entirely inside or outside the
+ region are settled without looking at their pixels one by one.
+
+ healpix_disc_ranges() finds the same healpixes as
+ healpix_rangesearch_xyz(): those within "radius" *degrees* of the
+ point.  (For Nside above 13377, whose pixel numbers don't fit in an
+ int, pixels on the boundary are kept if they might be in range.)
+ */
+ll* healpix_disc_ranges(const double* xyz, double radius, int Nside,
+                        ll* ranges);
+
+ll* healpix_disc_ranges_radec(double ra, double dec, double radius,
+                              int Nside, ll* ranges);
+
+/**
+ The healpixes that overlap the convex spherical polygon with vertices
+ "verts" (an array of "nverts" unit vectors, counter-clockwise as seen
+ from outside the sphere).  Pixels touching the boundary are included,
+ as may be a few lying just outside it, near its corners.
+ */
+ll* healpix_polygon_ranges(const double* verts, int nverts, int Nside,
+                           ll* ranges);
+
+/**
+ The number of healpixes in a list of ranges.
+ */
+int64_t healpix_ranges_count(ll* ranges);
+
 /**
  Starting from a "seed" or list of "seeds" healpixes, grows a region
  by looking at healpix neighbours.  Accepts healpixes for which the
@@ -259,6 +259,18 @@ int64_t xyzarrtohealpixl(const double* xyz, int Nside);
 
 int xyzarrtohealpixf(const double* xyz,int Nside, double* p_dx, double* p_dy);
 
+/**
+   Batch versions: the healpixes of "N" points, given as (x,y,z) triples
+   or as RA,Dec arrays in degrees, are written to "hps".  The results
+   are the same as xyzarrtohealpixl() and radecdegtohealpixl(), but the
+   loop avoids their per-point call and branching overhead.
+*/
+void xyzarrtohealpixl_array(const double* xyz, size_t N, int Nside,
+                            int64_t* hps);
+
+void radecdegtohealpixl_array(const double* ra, const double* dec, size_t N,
+                              int Nside, int64_t* hps);
+
 /**
    Converts a healpix index, plus fractional offsets (dx,dy), into (x,y,z)
    coordinates on the unit sphere.  (dx,dy) must be in [0, 1].  (0.5, 0.5)
@@ -278,6 +290,18 @@ void healpix_to_xyzarr(int hp, int Nside, double dx, double dy,
 void healpixl_to_xyzarr(int64_t hp, int Nside, double dx, double dy,
                         double* xyz);
 
+/**
+   Batch versions of healpixl_to_xyzarr() and healpixl_to_radecdeg(): the
+   positions of offset (dx,dy) within each of the "N" healpixes "hps".
+   "xyz" gets "N" (x,y,z) triples.
+*/
+void healpixl_to_xyzarr_array(const int64_t* hps, size_t N, int Nside,
+                              double dx, double dy, double* xyz);
+
+void healpixl_to_radecdeg_array(const int64_t* hps, size_t N, int Nside,
+                                double dx, double dy,
+                                double* ra, double* dec);
+
 
 /**
    Same as healpix_to_xyz, but returns (RA,DEC) in radians.
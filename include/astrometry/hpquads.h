@@ -6,6 +6,8 @@
 #ifndef HPQUADS_H
 #define HPQUADS_H
 
+#include <stdint.h>
+
 #include "astrometry/an-bool.h"
 #include "astrometry/starkd.h"
 #include "astrometry/codefile.h"
@@ -23,6 +25,11 @@ int hpquads(startree_t* starkd,
             int Nloosen,
             int id,
             anbool scanoccupied,
+            // 0: visit the healpixes one at a time, in order.  Otherwise,
+            // visit them in blocks, on this many threads (< 0: one per
+            // CPU); the quads differ from the one-at-a-time order's, but
+            // don't depend on the number of threads.
+            int nthreads,
 
             void* sort_data,
             int (*sort_func)(const void*, const void*),
@@ -30,6 +37,33 @@ int hpquads(startree_t* starkd,
 
             char** args, int argc);
 
+/**
+ Like hpquads(), but for updating part of an index: only the healpixes
+ in "cells" are tried, and the "nkeep" quads in "keep" (each "dimquads"
+ star indices into "starkd") are kept.  The kept quads count toward
+ their stars' reuse limits, and no new quad duplicates one of them.
+ */
+int hpquads_update(startree_t* starkd,
+                   codefile_t* codes,
+                   quadfile_t* quads,
+                   int Nside,
+                   double scale_min_arcmin,
+                   double scale_max_arcmin,
+                   int dimquads,
+                   int passes,
+                   int Nreuses,
+                   int Nloosen,
+                   int id,
+                   int nthreads,
+                   const int64_t* cells, int ncells,
+                   const unsigned int* keep, int nkeep,
+
+                   void* sort_data,
+                   int (*sort_func)(const void*, const void*),
+                   int sort_size,
+
+                   char** args, int argc);
+
 int hpquads_files(const char* skdtfn,
                   const char* codefn,
                   const char* quadfn,
@@ -42,6 +76,7 @@ int hpquads_files(const char* skdtfn,
                   int Nloosen,
                   int id,
                   anbool scanoccupied,
+                  int nthreads,
 
                   void* sort_data,
                   int (*sort_func)(const void*, const void*),
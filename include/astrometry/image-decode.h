@@ -0,0 +1,42 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef IMAGE_DECODE_H
+#define IMAGE_DECODE_H
+
+#include "astrometry/an-bool.h"
+
+/**
+ An image read into memory as a single plane of pixels, in the order
+ they would have in the FITS file that image2pnm + an-pnmtofits would
+ have made of it.  Exactly one of "image" and "image_u8" is set.
+ */
+typedef struct {
+    int W;
+    int H;
+    float* image;
+    // set instead of "image" when the pixels are 8-bit.
+    unsigned char* image_u8;
+    // was the input a FITS image?
+    anbool isfits;
+} decoded_image_t;
+
+/**
+ Reads the image in file "fn" (extension "ext" if it's a FITS file;
+ QFITS convention, 0 is the primary) without writing any temp files.
+
+ FITS images are read directly; PNG and JPEG images are decoded with
+ libpng and libjpeg (if built with HAVE_PNG / HAVE_JPEG), and color
+ images are converted to grey with the weights ppmtopgm uses.
+
+ Returns 0 on success, -1 on failure or for inputs it can't handle
+ (compressed files, other formats, tile-compressed FITS images...); the
+ caller should then fall back to converting the image with image2pnm.
+ */
+int image_decode(const char* fn, int ext, decoded_image_t* img);
+
+void image_decode_free_contents(decoded_image_t* img);
+
+#endif
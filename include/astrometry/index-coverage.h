@@ -0,0 +1,79 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_INDEX_COVERAGE_H
+#define AN_INDEX_COVERAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/anqfits.h"
+#include "astrometry/bl.h"
+
+/**
+ Coverage maps for index files: the part of the sky where an index
+ actually has stars, as a sorted list of disjoint ranges of healpixes
+ (xy scheme) at a single Nside, [ranges[2i], ranges[2i+1]) -- the same
+ form healpix_disc_ranges() returns.
+
+ An index's HEALPix tile (or, for all-sky indexes, the whole sky) is
+ only an upper bound on where it has stars: a tile can be mostly empty,
+ and an index built from a partial-sky catalog can cover a small patch
+ of the sky while claiming all of it.  The coverage map lets the solver
+ skip such indexes when the field's position is known.
+
+ The map is stored as an extra binary table in the index file, with
+ AN_FILE = AN_FILETYPE_COVERAGE and int64 columns LO and HI; its Nside
+ is in the COVNSIDE header card.  Index files without one are assumed
+ to cover their whole tile.
+ */
+
+#define AN_FILETYPE_COVERAGE "COVERAGE"
+
+/**
+ The Nside of the coverage map for an index whose largest quads are
+ "quadsize_arcsec": the finest power of two (up to 256) whose pixels are
+ no smaller than the quads.
+ */
+int index_coverage_nside(double quadsize_arcsec);
+
+/**
+ Computes the coverage map of the "N" stars (unit vectors) "xyz": the
+ healpixes containing stars, plus their neighbours, so that a field
+ overlapping the stars but centered just outside their pixels still
+ counts.  Returns the ranges in a new list.
+ */
+ll* index_coverage_from_xyz(const double* xyz, int N, int nside);
+
+/**
+ Appends the coverage map as a FITS table to "fid".
+ */
+int index_coverage_write_to(const ll* ranges, int nside, FILE* fid);
+
+/**
+ Reads the coverage map from an index file, if it has one.  Returns 0
+ and sets "nside", "ranges" (malloc'd, 2 x "nranges" values) on
+ success; 1 if the file has no coverage map; -1 on error.
+ */
+int index_coverage_read(anqfits_t* fits, int* nside, int64_t** ranges,
+                        int* nranges);
+
+/**
+ Does the coverage map overlap the list of healpix ranges "hps" (at the
+ same Nside, as from healpix_disc_ranges())?
+ */
+anbool index_coverage_overlaps(const int64_t* ranges, int nranges,
+                               const ll* hps);
+
+/**
+ Does the coverage map contain any healpix within "radius_deg" degrees
+ of the point "xyz"?  ("Within" as in healpix_distance_to_xyz().)
+ */
+anbool index_coverage_intersects(int nside, const int64_t* ranges,
+                                 int nranges, const double* xyz,
+                                 double radius_deg);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef AN_INDEX_HEATMAP_H
+#define AN_INDEX_HEATMAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/index.h"
+
+/**
+ Index heatmaps: which parts of each index file the solver actually
+ reads.  Most real fields touch a small part of a large index (the
+ quads and stars near where fields tend to be, and the kd-tree nodes
+ above them), so knowing which part lets the prefetcher read just that
+ (see the "hot lists" below) and tells the kd-tree layout work which
+ nodes to keep together.
+
+ Tracing is opt-in and process-wide (index_heatmap_set_dir()).  Each
+ index loaded after it is turned on gets a heatmap, which counts, for
+ one in "rate" of the solver's accesses:
+
+   quads  - the quad records (by 4 kB block of the quads table) of the
+            code-tree matches the solver looked at;
+   stars  - the star records (by 4 kB block of the star kd-tree's data)
+            of those quads' stars and of the reference stars verified;
+   codekd - the code kd-tree nodes: the leaf holding each matched code,
+   starkd   and the star kd-tree leaf holding each star, and all their
+            ancestors.
+
+ (kd-tree nodes are counted from the results of the searches, not from
+ inside the searches, so nodes that were visited but held no result are
+ missed.  A tree whose permutation isn't available gets no node
+ counts.)
+
+ When the index is unloaded its counts are added to the heatmap file
+ "<dir>/<index file name>.heat" (under a lock, so several processes can
+ share the directory) and reset.  The file is text:
+
+    # astrometry.net index heatmap
+    file <index file>
+    rate <sampling rate of the latest run>
+    samples <accesses sampled, times the rate>
+    array <name> <records> <record bytes> <records per block> <file offset>
+    table <name> <file offset> <bytes>
+    heat <array> <block> <count>
+
+ with one "array" line per array above (offset -1 if the records aren't
+ in one table of the file), one "table" line per kd-tree node table
+ (which every search reads from the top, so they are always "hot"), and
+ a "heat" line for each block with a non-zero count; counts are
+ estimates (sampled counts times the rate).
+
+ The "index-heat" program summarizes heatmaps and turns them into hot
+ lists and node-order hints.
+ */
+typedef struct index_heatmap index_heatmap_t;
+
+enum index_heatmap_array {
+    INDEX_HEAT_QUADS = 0,
+    INDEX_HEAT_STARS,
+    INDEX_HEAT_CODEKD,
+    INDEX_HEAT_STARKD,
+    INDEX_HEAT_N
+};
+
+/**
+ Turns heatmap tracing on for indexes loaded from now on, writing the
+ heatmaps in directory "dir" (NULL turns tracing off), sampling one in
+ "rate" accesses (1: all of them).  Returns 0 on success.
+ */
+int index_heatmap_set_dir(const char* dir, int rate);
+
+// The heatmap directory, or NULL if tracing is off.
+const char* index_heatmap_get_dir(void);
+
+/**
+ A new heatmap for "index", which must be loaded, with one in "rate"
+ accesses sampled.
+ */
+index_heatmap_t* index_heatmap_new(const index_t* index, int rate);
+
+void index_heatmap_free(index_heatmap_t* hm);
+
+/**
+ If tracing is on, gives loaded index "index" a heatmap (unless it has
+ one); index_reload() calls this.
+ */
+void index_heatmap_attach(index_t* index);
+
+/**
+ Adds the counts of the heatmap of "index" (if it has one) to its file
+ and frees it; index_unload() calls this.
+ */
+void index_heatmap_detach(index_t* index);
+
+/**
+ Records that the solver looked at quad "quadno" (its record and its
+ code).  Thread-safe.
+ */
+void index_heatmap_touch_quad(index_heatmap_t* hm, int quadno);
+
+/**
+ Records that the solver read the stars "starids" (as the star kd-tree
+ numbers them to its callers, ie, after the permutation).  Thread-safe.
+ */
+void index_heatmap_touch_stars(index_heatmap_t* hm, const int* starids,
+                               int N);
+
+/**
+ Adds the counts to the heatmap file "fn" (creating it if need be, and
+ replacing it if it is for a different index layout), then resets them.
+ Returns 0 on success.
+ */
+int index_heatmap_flush(index_heatmap_t* hm, const char* fn);
+
+// The heatmap file name for index file "indexfn" in directory "dir".
+char* index_heatmap_filename(const char* dir, const char* indexfn);
+
+/**
+ A heatmap as read from a file (by index-heat).  "counts[a]" has
+ "nblocks[a]" entries.
+ */
+typedef struct {
+    char* indexfn;
+    int rate;
+    uint64_t samples;
+    int64_t nrecords[INDEX_HEAT_N];
+    int recbytes[INDEX_HEAT_N];
+    int perblock[INDEX_HEAT_N];
+    off_t offset[INDEX_HEAT_N];
+    int64_t nblocks[INDEX_HEAT_N];
+    uint64_t* counts[INDEX_HEAT_N];
+    // the kd-tree node tables: "ntables" (offset, size) pairs.
+    int ntables;
+    int64_t* tables;
+} index_heatmap_file_t;
+
+// Returns NULL on error.
+index_heatmap_file_t* index_heatmap_read(const char* fn);
+
+void index_heatmap_file_free(index_heatmap_file_t* hf);
+
+// "quads", "stars", "codekd" or "starkd".
+const char* index_heatmap_array_name(int array);
+
+/**
+ A hot list is the byte ranges of an index file worth reading ahead of
+ a search: a text file of "<offset> <bytes>" lines.  The prefetcher in
+ onefield reads "<index file>.hot", if there is one, in place of the
+ whole file.
+
+ Reads hot list "fn": returns the number of ranges, with (offset,
+ bytes) pairs in "*ranges" (free() it), or -1 on error.
+ */
+int index_heatmap_read_hot_list(const char* fn, int64_t** ranges);
+
+#endif
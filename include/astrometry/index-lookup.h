@@ -0,0 +1,46 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_INDEX_LOOKUP_H
+#define AN_INDEX_LOOKUP_H
+
+#include "astrometry/index.h"
+#include "astrometry/bl.h"
+
+/**
+ A HEALPix-keyed lookup table over a list of indexes, for finding the
+ ones whose tiles are near a position without looking at all of them.
+
+ Indexes whose HEALPix Nside is a power of two (up to 256) are stored in
+ a tree following the nested HEALPix hierarchy, which is searched from
+ the twelve base pixels down, skipping any branch that is far from the
+ search circle or holds no indexes.  All-sky indexes always match;
+ indexes with other Nsides are checked one at a time.
+
+ Indexes with coverage maps are then checked against them, so that
+ those with no stars near the position are dropped.
+
+ Only the metadata of the indexes (healpix, hpnside, coverage) is used,
+ so they need not be loaded.
+ */
+typedef struct index_lookup_t index_lookup_t;
+
+/**
+ Builds a lookup over the "index_t*"s in "indexes".  The list is not
+ kept; the results of index_lookup_search() are positions in it.
+ */
+index_lookup_t* index_lookup_new(pl* indexes);
+
+void index_lookup_free(index_lookup_t* lookup);
+
+/**
+ Appends to "result", in increasing order, the positions of the indexes
+ for which index_is_within_range(index, ra, dec, radius_deg) is true.
+ RA, Dec and radius are in degrees.
+ */
+void index_lookup_search(const index_lookup_t* lookup, double ra,
+                         double dec, double radius_deg, il* result);
+
+#endif
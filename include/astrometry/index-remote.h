@@ -0,0 +1,79 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef AN_INDEX_REMOTE_H
+#define AN_INDEX_REMOTE_H
+
+#include <stdint.h>
+
+#include "astrometry/bl.h"
+
+/**
+ A remote index store: a directory of index files, plus their manifest
+ (see index_manifest_scan()), served over HTTP(S) -- for example an S3
+ or GCS bucket -- or any other URL that "curl" can fetch byte ranges of.
+
+ Opening the store downloads only the manifest, so the indexes'
+ metadata (scales, sky coverage) are available at once and the solver
+ can pick the indexes it needs.  An index file is downloaded into the
+ local cache directory the first time it is loaded (by index_reload()),
+ in chunks fetched with HTTP range requests over several connections;
+ an interrupted download resumes where it left off.
+
+ The cache is bounded: before a download, the least-recently-used
+ cached files are removed to make room.  Each file's use count is
+ kept in the cache, so that a restarted process can prefetch the
+ indexes it used most.
+
+ The cache directory is owned by one process at a time.  Indexes that
+ share a separate star kd-tree file aren't supported.
+ */
+typedef struct index_remote index_remote_t;
+
+/**
+ Opens the remote store at "url" (the directory, without the manifest
+ file name), caching files in "cachedir" (which is created if needed)
+ up to "maxbytes" bytes in total (0 for no limit).
+
+ If the manifest can't be downloaded but a copy from an earlier run is
+ in the cache, that is used.  Returns NULL on error.
+ */
+index_remote_t* index_remote_open(const char* url, const char* cachedir,
+                                  int64_t maxbytes);
+
+/**
+ Sets the size of the chunks that files are downloaded in (default 16
+ MB), and the number of chunks downloaded at once (default 4).
+ */
+void index_remote_set_chunks(index_remote_t* r, int64_t chunksize,
+                             int nconnections);
+
+/**
+ Appends to "indexes" a metadata-only index_t for each index in the
+ store, as index_manifest_scan() does.  Their files are in the cache
+ directory; index_reload() downloads them if they aren't there yet.
+ The store must stay open while they are in use.  Returns 0 on success.
+ */
+int index_remote_list(index_remote_t* r, pl* indexes);
+
+/**
+ Makes sure that the file "path" (in the cache directory) has been
+ downloaded, and marks it as just used.  Returns 0 on success.
+ */
+int index_remote_fetch(index_remote_t* r, const char* path);
+
+/**
+ Starts downloading, in the background, the (at most) "n" files that
+ have been used most often with this cache.  Returns the number of
+ files queued.
+ */
+int index_remote_prefetch(index_remote_t* r, int n);
+
+/**
+ Waits for the current background download (if any) to finish,
+ abandoning the rest of the prefetch queue; then frees "r".
+ */
+void index_remote_close(index_remote_t* r);
+
+#endif
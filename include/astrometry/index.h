@@ -11,6 +11,7 @@
 #include "astrometry/codekd.h"
 #include "astrometry/an-bool.h"
 #include "astrometry/anqfits.h"
+#include "astrometry/bl.h"
 
 /*
  * These routines handle loading of index files, which can consist of
@@ -71,6 +72,54 @@ typedef struct {
     int dimquads;
     int nstars;
     int nquads;
+
+    // For indexes built with build_index_shared_skdt(): the name of the
+    // file (in the same directory) whose stars the index uses, and how
+    // many stars it had.  NULL and 0 for other indexes.
+    char* skdtfn;
+    int skdt_nstars;
+
+    // For indexes split into sweep strata (see build_index_stratum()):
+    // this file's stratum, from 1 (the brightest stars) to "nstrata".
+    // Zero for other indexes.
+    int stratum;
+    int nstrata;
+
+    // Coverage map (see index-coverage.h): "ncoverage" ranges of
+    // healpixes at Nside "covnside", [coverage[2i], coverage[2i+1]);
+    // NULL if the index file doesn't have one.
+    int covnside;
+    int64_t* coverage;
+    int ncoverage;
+
+    // Number of index_acquire()s not yet released, and whether
+    // index_acquire() loaded the index (so index_release() unloads it).
+    int refcount;
+    anbool acquire_loaded;
+    // Is "starkd" shared with other indexes (by a multiindex_t, which
+    // closes it)?  If so, index_unload() leaves it alone.
+    anbool shared_starkd;
+    // For the residency budget (see index_residency_set_budget()): the
+    // size of the loaded index, when it was last released, and how many
+    // fields it has solved.
+    size_t resident_bytes;
+    uint64_t last_used;
+    int nsolves;
+
+    // For indexes listed by index_remote_list(): the store that
+    // index_reload() downloads "indexfn" from if it isn't cached yet.
+    struct index_remote* remote;
+
+    // For NUMA placement (see index_numa_set_policy()): the node that
+    // holds the index under INDEX_NUMA_LOCAL; and, by node id, copies of
+    // the code tree whose node arrays are on that node (NULL if none).
+    int numa_node;
+    kdtree_t** code_replicas;
+    // Where the solver reads the index, while heatmap tracing is on (see
+    // index-heatmap.h); NULL otherwise.
+    struct index_heatmap* heatmap;
+    // ... and the directory that it is written to.
+    char* heatmap_dir;
 } index_t;
 
 /**
@@ -88,7 +137,8 @@ anbool index_overlaps_scale_range(index_t* indx, double quadlo, double quadhi);
 /**
  Returns TRUE if the given index covers a part of the sky that is
  within "radius_deg" degrees of the given "ra","dec" position (in
- degrees).
+ degrees): its HEALPix tile is, and so is some part of its coverage map,
+ if it has one.
  */
 anbool index_is_within_range(index_t* indx, double ra, double dec, double radius_deg);
 
@@ -154,6 +204,91 @@ void index_unload(index_t* index);
 
 int index_reload(index_t* index);
 
+/**
+ Takes a reference to the index for searching it, loading it (as
+ index_reload()) if it is metadata-only.  The index is then safe to
+ search from several threads at once: the kd-tree inverse permutations,
+ which are otherwise computed on first use, are computed here, under a
+ lock.  Returns 0 on success.
+
+ Each successful index_acquire() must be matched by an index_release();
+ an index loaded by index_acquire() is unloaded again when the last
+ reference is released.  index_load(), index_unload() and index_close()
+ must not be called on an index while references to it are held.
+ */
+int index_acquire(index_t* index);
+
+void index_release(index_t* index);
+
+#define INDEX_RESIDENCY_LRU    0
+#define INDEX_RESIDENCY_SOLVES 1
+
+/**
+ Index residency: by default index_release() unloads the indexes that
+ index_acquire() loaded as soon as their last reference goes.  With a
+ budget of "maxbytes" (> 0), they stay loaded -- so the next job that
+ needs them doesn't reload them -- until the loaded indexes' files add
+ up to more than the budget; then the unreferenced ones are unloaded
+ (unmapped), the least recently used first (INDEX_RESIDENCY_LRU) or the
+ ones that have solved the fewest fields first (INDEX_RESIDENCY_SOLVES;
+ see index_residency_solved()).  Zero turns it off again.
+ */
+void index_residency_set_budget(size_t maxbytes, int policy);
+
+// Counts a field solved by "index", for INDEX_RESIDENCY_SOLVES.
+void index_residency_solved(index_t* index);
+
+typedef struct {
+    // index_acquire()s that found the index loaded, and that loaded it.
+    int64_t hits;
+    int64_t misses;
+    // indexes unloaded to keep within the budget.
+    int64_t evictions;
+    // indexes kept loaded, and the size of their files.
+    int nresident;
+    size_t resident_bytes;
+} index_residency_stats_t;
+
+void index_residency_get_stats(index_residency_stats_t* stats);
+
+#define INDEX_NUMA_OFF        0
+#define INDEX_NUMA_INTERLEAVE 1
+#define INDEX_NUMA_LOCAL      2
+
+/**
+ NUMA placement of the indexes that index_reload() loads (see
+ an-numa.h).  INDEX_NUMA_INTERLEAVE spreads the pages of their trees and
+ quads over all the nodes; INDEX_NUMA_LOCAL puts all of an index's
+ pages on node "index->numa_node" (set it before loading).  Either way
+ the pages are read in when the index is loaded, even under the "lazy"
+ mmap policy.
+
+ With "replicate_max" > 0, the node arrays (bounding boxes, splits) of
+ code trees that take no more than that many bytes are also copied to
+ every node: the upper levels of the tree are read by every search, so
+ each node's threads should read their own copy; see
+ index_code_tree_for_node().
+ */
+void index_numa_set_policy(int policy, size_t replicate_max);
+
+/**
+ Applies the policy to an index that is already loaded (index_reload()
+ applies it to the indexes it loads).
+ */
+void index_numa_place(index_t* index);
+
+/**
+ The node whose CPUs should search "index": its "numa_node" under
+ INDEX_NUMA_LOCAL, otherwise -1.
+ */
+int index_numa_node(const index_t* index);
+
+/**
+ The code tree for a thread on "node" (-1: don't know) to search: the
+ index's copy on that node if it has one, else "index->codekd->tree".
+ */
+const kdtree_t* index_code_tree_for_node(const index_t* index, int node);
+
 /**
  Closes the FILE*s in this index.  Once you have index_reload()ed,
  you can call this function and the index will remain valid.
@@ -174,4 +309,43 @@ void index_free(index_t* index);
 int index_get_missing_cut_params(int indexid, int* hpnside, int* nsweep,
                                  double* dedup, int* margin, char** band);
 
+/**
+ Index manifests: reading the metadata of every index in a directory
+ means opening every file, which is slow for large sets of indexes on
+ network filesystems.  A manifest (a text file named
+ INDEX_MANIFEST_FILENAME in the directory) caches, for each file, its
+ size and modification time and, if it is an index, its metadata.
+ */
+#define INDEX_MANIFEST_FILENAME "astrometry-index-manifest.txt"
+
+// ignore any existing manifest, and re-read every file.
+#define INDEX_MANIFEST_REBUILD 1
+// rewrite the manifest if any file was added, removed or changed.
+#define INDEX_MANIFEST_UPDATE  2
+
+/**
+ Finds the index files in directory "dir", reading the metadata of
+ those that are not in the manifest (or have changed since it was
+ written).  If "indexes" is non-NULL, appends to it a metadata-only
+ index_t for each index file, in filename order; free them with
+ index_free().  These have not been opened ("fits" is NULL);
+ index_reload() opens them.
+
+ Returns 0 on success; 1 if the manifest needed rewriting but couldn't
+ be written (the indexes are still listed); -1 if the directory can't
+ be read.
+ */
+int index_manifest_scan(const char* dir, int flags, pl* indexes);
+
+/**
+ Reads the index manifest file "fn" without looking at the files it
+ lists: appends to "indexes" a metadata-only index_t for each index in
+ it, as index_manifest_scan() does, but with its file in directory
+ "dir"; and, if "sizes" is non-NULL, the file's size to "sizes".
+
+ Returns 0 on success, -1 if the manifest can't be read or parsed.
+ */
+int index_manifest_read(const char* fn, const char* dir, pl* indexes,
+                        ll* sizes);
+
 #endif
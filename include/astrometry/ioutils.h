@@ -100,6 +100,31 @@ anbool file_executable(const char* fn);
 
 anbool path_is_dir(const char* path);
 
+/**
+ Reads "len" bytes at "offset" of "fd" into "buf" with concurrent
+ pread()s of 4 MB segments on "nthreads" threads (<= 0: one per CPU, at
+ most 16), so that fast devices see many requests in flight rather than
+ one at a time.  If "buf" is NULL, the data are just read into the page
+ cache.  Returns 0 on success, -1 on error or a short read.
+ */
+int read_parallel(int fd, void* buf, size_t len, off_t offset, int nthreads);
+
+/**
+ Reads "len" bytes at "offset" of "fd" into "buf": with read_parallel()
+ if parallel reads are turned on and the read is large, otherwise with
+ plain pread()s.  Returns 0 on success, -1 on error or a short read.
+ */
+int read_at(int fd, void* buf, size_t len, off_t offset);
+
+/**
+ Turns on parallel reads for the bulk reads that go through read_at()
+ (whole files, images, table row ranges), using "nthreads" threads
+ (< 0: one per CPU).  The default, 0, is off.
+ */
+void set_parallel_read_threads(int nthreads);
+
+int get_parallel_read_threads(void);
+
 void* file_get_contents(const char* fn, size_t* len, anbool addzero);
 
 char* file_get_contents_offset(const char* fn, int offset, int length);
@@ -0,0 +1,87 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef JOB_CHECKPOINT_H
+#define JOB_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/sip.h"
+#include "astrometry/bl.h"
+
+/**
+ How far a job's search got, so that a job stopped by its time or CPU
+ limit (or cancelled) can be run again and pick up where it stopped
+ instead of starting over.
+
+ The engine runs a job as a schedule of solver runs (a depth range, a
+ scale range and a set of indexes each).  The checkpoint records, for
+ each run, whether it finished; for a run cut short, how many of its
+ indexes (when they are searched one at a time) were done, and the
+ field object the search had reached in the next one.  Runs are
+ identified by a hash of their parameters, so the schedule can change
+ order between attempts.  It also keeps the best match found so far,
+ which is verified again on resuming.
+
+ On disk it's a small text file:
+
+    # astrometry.net job checkpoint
+    run <key> done
+    run <key> <indexes done> <object>
+    best <log-odds> <crval1> <crval2> <crpix1> <crpix2> <cd11> <cd12>
+         <cd21> <cd22> <imagew> <imageh>
+
+ (the "best" line is all on one line.)
+ */
+typedef struct {
+    uint64_t key;
+    anbool done;
+    int index;
+    int object;
+} checkpoint_run_t;
+
+typedef struct {
+    // checkpoint_run_t
+    bl* runs;
+    anbool have_best;
+    double best_logodds;
+    tan_t best_wcs;
+} job_checkpoint_t;
+
+job_checkpoint_t* job_checkpoint_new(void);
+
+/**
+ Reads the checkpoint in file "fn".  Returns NULL if the file doesn't
+ exist or can't be parsed.
+ */
+job_checkpoint_t* job_checkpoint_read(const char* fn);
+
+/**
+ Writes the checkpoint to file "fn" (through a temporary file, so the
+ old one is replaced only by a complete new one).  Returns 0 on success.
+ */
+int job_checkpoint_write(const job_checkpoint_t* ck, const char* fn);
+
+// The record of the run with hash "key", or NULL.
+checkpoint_run_t* job_checkpoint_find(job_checkpoint_t* ck, uint64_t key);
+
+/**
+ Records that run "key" finished ("done"), or was cut short after
+ "index" of its indexes, at field object "object".
+ */
+void job_checkpoint_set_run(job_checkpoint_t* ck, uint64_t key,
+                            anbool done, int index, int object);
+
+// Keeps "wcs" as the best match if it beats the one recorded.
+void job_checkpoint_set_best(job_checkpoint_t* ck, double logodds,
+                             const tan_t* wcs);
+
+// Adds "n" bytes of "data" to the (FNV-1a) hash "h"; start with h = 0.
+uint64_t job_checkpoint_hash(uint64_t h, const void* data, size_t n);
+
+void job_checkpoint_free(job_checkpoint_t* ck);
+
+#endif
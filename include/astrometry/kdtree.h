@@ -59,6 +59,13 @@ enum kd_build_options {
     KD_BUILD_LINEAR_LR     = 0x10,
     // DEBUG
     KD_BUILD_FORCE_SORT    = 0x20,
+    /* Store the nodes in van Emde Boas order; see
+     kdtree_convert_to_veb_layout(). */
+    KD_BUILD_VEB_LAYOUT    = 0x40,
+    /* Write the data packed into half as many bits, relative to each
+     leaf's bounding box; see kdtree_t.packed_data.  Integer data types
+     only. */
+    KD_BUILD_PACK_DATA     = 0x80,
     
 };
 
@@ -149,7 +156,12 @@ struct kdtree_funcs {
     void (*fix_bounding_boxes)(kdtree_t* kd);
 
     void  (*nearest_neighbour_internal)(const kdtree_t* kd, const void* query, double* bestd2, int* pbest);
+    void  (*nearest_neighbour_approx)(const kdtree_t* kd, const void* query, double eps, double* bestd2, int* pbest);
     kdtree_qres_t* (*rangesearch)(const kdtree_t* kd, kdtree_qres_t* res, const void* pt, double maxd2, int options);
+    int (*rangesearch_batch)(const kdtree_t* kd, kdtree_qres_t** res, const void* pts, int N, const double* maxd2s, int options);
+    int (*nn_batch)(const kdtree_t* kd, const void* pts, int N, const double* maxd2s, int* inds, double* d2s);
+    int (*knn)(const kdtree_t* kd, const void* pt, int k, double maxd2, int* inds, double* d2s);
+    int (*knn_batch)(const kdtree_t* kd, const void* pts, int N, int k, const double* maxd2s, int* inds, double* d2s, int* counts);
 
     void (*nodes_contained)(const kdtree_t* kd,
                             const void* querylow, const void* queryhi,
@@ -253,11 +265,36 @@ struct kdtree {
 
     int has_linear_lr;
 
+    // Are the bounding-box, split and splitdim arrays stored in van Emde
+    // Boas order, rather than breadth-first?  See
+    // kdtree_convert_to_veb_layout().
+    int veb_layout;
+
+    // Is the data written to (or was it read from) FITS files packed?
+    // Each point is then stored in half the bits of the data type (u16
+    // data in 8 bits, u32 in 16), relative to its leaf's bounding box,
+    // and unpacked when the tree is read: the unpacked data are within
+    // "pack_error" of the original (and still inside their leaves, so
+    // searches stay consistent).  Integer data types only.
+    int packed_data;
+    // The largest error in any coordinate of the data due to packing, in
+    // external units; zero if the data are exact.
+    double pack_error;
+
+    // Number of threads to use in kdtree_build(); see
+    // kdtree_set_build_threads().
+    int build_threads;
+
     // For i/o: the name of this tree in the file.
     char* name;
 
     void* io;
 
+    // If the tree was read with the FITSBIN_MMAP_LAZY policy, its arrays
+    // are not mapped until they are first needed: this maps them, and is
+    // cleared once it has.  Use kdtree_load() rather than calling it.
+    int (*load)(kdtree_t* kd);
+
     struct kdtree_funcs fun;
 };
 
@@ -276,6 +313,25 @@ struct kdtree_qres {
     u32 *inds;    /* Indexes into original data set */
 };
 
+/*
+ Results of a batched range search, in compressed-sparse-row form: the
+ results for query i are elements offsets[i] to offsets[i+1]-1 of "inds"
+ (indexes into the original data set) and "sdists" (squared distances,
+ if KD_OPTIONS_COMPUTE_DISTS was given).
+ */
+struct kdtree_batch_res {
+    int nq;
+    int* offsets;   /* nq+1 elements */
+    int nres;
+    int capacity;   /* Allocated size of inds and sdists. */
+    u32* inds;
+    double* sdists;
+    /* per-query results, kept for reuse by the next search. */
+    kdtree_qres_t** qres;
+    int qcapacity;
+};
+typedef struct kdtree_batch_res kdtree_batch_res_t;
+
 // Returns the number of data points in this kdtree.
 int kdtree_n(const kdtree_t* kd);
 
@@ -313,6 +369,21 @@ static inline int kdtree_treetype(const kdtree_t* kd) {
     return kd->treetype & KDT_TREE_MASK;
 }
 
+/*
+ Makes sure the tree's arrays are in memory, for trees read lazily (see
+ kdtree_t.load); a no-op otherwise.  The searches and the kdtree_*()
+ data, permutation and node-distance functions call this themselves;
+ code that uses kd->perm, kd->data etc directly, or walks the nodes with
+ kdtree_left() and friends before any of those, must call it first.
+ Thread-safe.  Returns 0 on success.
+ */
+static inline int kdtree_load(const kdtree_t* kd) {
+    int (*load)(kdtree_t*) = __atomic_load_n(&kd->load, __ATOMIC_ACQUIRE);
+    if (!load)
+        return 0;
+    return load((kdtree_t*)kd);
+}
+
 void kdtree_memory_report(kdtree_t* kd);
 
 kdtree_t* kdtree_new(int N, int D, int Nleaf);
@@ -326,6 +397,36 @@ void kdtree_update_funcs(kdtree_t* kd);
 
 void kdtree_set_limits(kdtree_t* kd, double* low, double* high);
 
+/*
+ Sets "kd->name" to a copy of "name" (or NULL).  The tree owns the copy,
+ which kdtree_free() frees, so set it with this rather than strdup().
+ */
+void kdtree_set_name(kdtree_t* kd, const char* name);
+
+/*
+ Sets the number of threads that kdtree_build() will use to build this
+ tree (which must have been created with kdtree_new()).  The tree built
+ is the same for any number of threads.
+ */
+void kdtree_set_build_threads(kdtree_t* kd, int nthreads);
+
+/*
+ Reorders the bounding-box, split and splitdim arrays of a tree into the
+ (cache-oblivious) van Emde Boas layout: the top half of the levels of
+ the tree are stored first, followed by each of the subtrees below them,
+ each laid out the same way, recursively.  A root-to-leaf path then
+ touches O(log_B N) rather than O(log N) blocks of size B, which is
+ mostly a win when the tree is read cold from disk.
+
+ Nodes are still numbered breadth-first (KD_CHILD_LEFT etc), so this
+ changes nothing for callers; it is recorded in kdtree FITS files and
+ picked up when they are read.
+
+ The tree must have been built in memory, not read from a file.
+ Returns 0 on success.
+ */
+int kdtree_convert_to_veb_layout(kdtree_t* kd);
+
 void* kdtree_get_data(const kdtree_t* kd, int i);
 
 void kdtree_copy_data_double(const kdtree_t* kd, int i, int N, double* dest);
@@ -350,6 +451,23 @@ void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm);
 /* Free results */
 void kdtree_free_query(kdtree_qres_t *res);
 
+/*
+ Query results from the calling thread's pool, for callers that run
+ many queries: pass the result to kdtree_rangesearch_options_reuse()
+ (with KD_OPTIONS_NO_RESIZE_RESULTS, so that it keeps its arrays) and
+ hand it back with kdtree_qres_release() rather than
+ kdtree_free_query().  Each thread has its own pool, so no locking is
+ involved; a result released by another thread joins that thread's
+ pool.  Results that grew very large are trimmed when released.
+ */
+kdtree_qres_t* kdtree_qres_acquire(void);
+
+void kdtree_qres_release(kdtree_qres_t* res);
+
+/* Frees the calling thread's pooled results (other threads' pools are
+ freed when they exit). */
+void kdtree_qres_pool_clear(void);
+
 /* Free a tree; does not free kd->data */
 void kdtree_free(kdtree_t *kd);
 
@@ -416,6 +534,77 @@ int kdtree_nearest_neighbour(const kdtree_t* kd, const void *pt, double* bestd2)
 int kdtree_nearest_neighbour_within(const kdtree_t* kd, const void *pt,
                                     double maxd2, double* bestd2);
 
+/* Approximate nearest neighbour: like kdtree_nearest_neighbour_within(),
+ * but the point returned need only be within a factor (1 + eps) of the
+ * distance of the true nearest neighbour.  Nodes that could only hold a
+ * point closer than the best so far by less than that factor are not
+ * searched, which saves most of the work of a deep tree for callers
+ * (de-duplication, culling) that don't need the very nearest.  Only
+ * points within "maxd2" are returned, and one farther than
+ * sqrt(maxd2) / (1 + eps) may be missed.  eps = 0 is exact.
+ */
+int kdtree_nearest_neighbour_approx(const kdtree_t* kd, const void *pt,
+                                    double maxd2, double eps, double* bestd2);
+
+/* Nearest neighbours of a batch of "N" query points "pts" (N*D values
+ * of the tree's external type).  Each is like
+ * kdtree_nearest_neighbour_within(), with maximum distance-squared
+ * maxd2s[i] (or no limit if "maxd2s" is NULL): inds[i] is set to the
+ * index _in the kdtree_ of the nearest point, or -1; and if "d2s" is
+ * non-NULL, d2s[i] to its distance-squared (if found).
+ *
+ * This is faster than one search per point when the queries are
+ * clustered, because nearby queries are searched one after another.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int kdtree_nn_batch(const kdtree_t* kd, const void* pts, int N,
+                    const double* maxd2s, int* inds, double* d2s);
+
+/* The "k" nearest neighbours of "pt" that are within distance-squared
+ * "maxd2" (use LARGE_VAL for no limit): fills inds[0..n-1] with their
+ * indices _in the kdtree_, nearest first, and if "d2s" is non-NULL,
+ * d2s[0..n-1] with their distances-squared.  (Points at the same
+ * distance as the k-th may be left out.)
+ *
+ * This keeps the k best in a bounded heap and prunes nodes farther than
+ * the k-th best, so it is much faster than a range search that has to
+ * be big enough to hold k points and then sorted.
+ *
+ * Returns the number found, n <= k; or -1 on error.
+ */
+int kdtree_knn(const kdtree_t* kd, const void* pt, int k, double maxd2,
+               int* inds, double* d2s);
+
+/* kdtree_knn() for a batch of "N" query points "pts" (N*D values of the
+ * tree's external type), with maximum distances-squared maxd2s[i] (or
+ * no limit if "maxd2s" is NULL).  The neighbours of query i go in
+ * inds[i*k .. i*k+k-1] (and "d2s" likewise, if non-NULL), with -1 for
+ * the slots not filled; if "counts" is non-NULL, counts[i] is set to
+ * the number found.  As in kdtree_nn_batch(), nearby queries are
+ * searched one after another.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int kdtree_knn_batch(const kdtree_t* kd, const void* pts, int N, int k,
+                     const double* maxd2s, int* inds, double* d2s,
+                     int* counts);
+
+/*
+ Like kdtree_rangesearch_batch(), but gathers the results into a single
+ kdtree_batch_res_t.  If "res" is non-NULL it is reused (and returned),
+ otherwise a new one is allocated.  KD_OPTIONS_RETURN_POINTS is ignored.
+
+ Returns NULL on error.
+ */
+kdtree_batch_res_t* kdtree_rangesearch_batch_csr(const kdtree_t *kd,
+                                                 kdtree_batch_res_t* res,
+                                                 const void *pts, int N,
+                                                 const double* maxd2s,
+                                                 int options);
+
+void kdtree_batch_res_free(kdtree_batch_res_t* res);
+
 /*
  * Finds the set of non-leaf nodes that are completely contained
  * within the given query rectangle, plus the leaf nodes that
@@ -596,6 +785,21 @@ kdtree_qres_t* KDFUNC(kdtree_rangesearch_options)(const kdtree_t *kd, const void
  */
 kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)(const kdtree_t *kd, kdtree_qres_t* res, const void *pt, double maxd2, int options);
 
+/*
+ Range search for a batch of "N" query points at once; this is faster
+ than one search per point because the top of the tree is only walked
+ once.  "pts" holds the N query points (N*D values of the tree's
+ external type), and "maxd2s" their N maximum distances-squared.
+
+ The results for query i are placed in res[i]; elements that are NULL
+ get allocated, others are reused as in
+ kdtree_rangesearch_options_reuse().  The order of the results within
+ each one may differ from kdtree_rangesearch_options().
+
+ Returns 0 on success, -1 on error.
+ */
+int KDFUNC(kdtree_rangesearch_batch)(const kdtree_t *kd, kdtree_qres_t** res, const void *pts, int N, const double* maxd2s, int options);
+
 #if !defined(KD_DIM)
 #undef KD_DIM_GENERIC
 #endif
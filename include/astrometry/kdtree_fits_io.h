@@ -125,6 +125,13 @@ int kdtree_fits_append_tree_flipped(kdtree_fits_t* io, const kdtree_t* kd,
 #define KD_STR_SPLITDIM  "kdtree_splitdim"
 #define KD_STR_DATA      "kdtree_data"
 #define KD_STR_RANGE     "kdtree_range"
+// the node arrays of trees with "veb_layout" set.
+#define KD_STR_BB_VEB       "kdtree_bb_veb"
+#define KD_STR_SPLIT_VEB    "kdtree_split_veb"
+#define KD_STR_SPLITDIM_VEB "kdtree_splitdim_veb"
+// the data of trees with "packed_data" set.
+#define KD_STR_DATA_PACKED  "kdtree_data_packed"
+#define KD_STR_DATA_LEAFBB  "kdtree_data_leafbb"
 
 // is the given column name one of the above strings?
 int kdtree_fits_column_is_kdtree(char* columnname);
@@ -59,6 +59,8 @@
 # define Packed           __attribute__ ((packed))
 # define likely(x)        __builtin_expect (!!(x), 1)
 # define unlikely(x)      __builtin_expect (!!(x), 0)
+// a hint to start reading "addr" into the cache; it never faults.
+# define prefetch_read(addr) __builtin_prefetch((addr), 0, 1)
 # define Noinline         __attribute__ ((noinline))
 // alloc_size
 
@@ -109,6 +111,7 @@
 # define Packed
 # define likely(x)	(x)
 # define unlikely(x)	(x)
+# define prefetch_read(addr)	((void)(addr))
 # define Noinline
 # define WarnUnusedResult
 # define Flatten
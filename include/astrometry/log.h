@@ -47,10 +47,32 @@ void log_set_timestamp(anbool b);
 
 /**
  * Initialize global logging object. Must be called before any of the other
- * log_* functions.
+ * log_* functions.  If the environment variable AN_LOG_ASYNC is set (and
+ * isn't "0"), turns on asynchronous logging.
  */
 void log_init(enum log_level level);
 
+/**
+ Asynchronous logging: messages are formatted by the thread that logs
+ them into a buffer of its own, and a background thread writes them out
+ (in order) in batches, without flushing after each line.  Messages sent
+ to a user-specified logging function are still handled synchronously.
+ The default is synchronous logging, which writes and flushes each
+ message before returning.
+
+ Pending messages are written out by log_flush(), log_to(),
+ log_get_fid(), fork() and at exit; call log_flush() before closing a
+ FILE* that messages were logged to.
+
+ Returns 0 on success.
+ */
+int log_set_async(anbool async);
+
+/**
+ Writes out any messages queued by asynchronous logging.
+ */
+void log_flush(void);
+
 void log_set_level(enum log_level level);
 
 /**
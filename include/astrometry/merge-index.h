@@ -22,4 +22,18 @@ int merge_index_open_files(const char* quadfn, const char* ckdtfn, const char* s
 int merge_index(quadfile_t* quads, codetree_t* codekd, startree_t* starkd,
                 const char* indexfn);
 
+// also write the "quadxyz" table (see quadfile.h).
+#define MERGE_INDEX_QUAD_XYZ 1
+
+// merge_index() with a bitwise OR of the MERGE_INDEX_* flags.
+int merge_index_flags(quadfile_t* quads, codetree_t* codekd, startree_t* starkd,
+                      const char* indexfn, int flags);
+
+// merge_index_flags(), also writing the code kd-tree split into
+// "nscalebins" trees by quad scale if it's more than one, and into trees
+// by HEALPix cell at Nside "skynside" if it's positive (see codekd.h).
+int merge_index_with_bins(quadfile_t* quads, codetree_t* codekd,
+                          startree_t* starkd, const char* indexfn,
+                          int flags, int nscalebins, int skynside);
+
 #endif
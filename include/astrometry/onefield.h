@@ -12,6 +12,8 @@
 #include "astrometry/matchfile.h"
 #include "astrometry/rdlist.h"
 #include "astrometry/bl.h"
+#include "astrometry/solvedfile.h"
+#include "astrometry/solver-trace.h"
 
 #define DEFAULT_QSF_LO 0.1
 #define DEFAULT_QSF_HI 1.0
@@ -33,6 +35,10 @@ struct onefield_params {
     char *indexrdlsfname;
     char *corr_fname;
     char* scamp_fname;
+    // solver timing statistics (JSON)
+    char* stats_fname;
+    // record of each search, to replay it (see solver-trace.h)
+    char* trace_fname;
 
     // WCS filename template (sprintf format with %i for field number)
     char* wcs_template;
@@ -42,11 +48,16 @@ struct onefield_params {
 
     // WCS instances to verify.  (sip_t structs)
     bl* verify_wcs_list;
+    // only verify the WCSes in "verify_wcs_list"; don't search.
+    anbool verify_only;
 
     // Output solved file.
     char *solved_out;
     // Input solved file.
     char* solved_in;
+    // ... kept open while solving (see solvedfile_map_open).
+    solvedfile_map_t* solved_out_map;
+    solvedfile_map_t* solved_in_map;
 
     // Indexes to use (base filenames)
     sl* indexnames;
@@ -56,6 +67,13 @@ struct onefield_params {
 
     int index_options;
 
+    // If the indexes are not searched in parallel, read up to this many
+    // of the next index files into memory on a background thread while
+    // searching the current one, keeping at most "prefetch_max" bytes
+    // (0: no limit) read ahead.
+    int prefetch;
+    size_t prefetch_max;
+
     // Quad size fraction: select indexes that contain quads of size fraction
     // [quad_size_fraction_lo, quad_size_fraction_hi] of the image size.
     double quad_size_fraction_lo;
@@ -63,6 +81,13 @@ struct onefield_params {
 
     // Fields to try
     il* fieldlist;
+    // If > 1, solve up to this many of the fields at once, each on its
+    // own thread (with its own copy of "solver").
+    int nfieldthreads;
+
+    // Write the output files (match, rdls, wcs, scamp, corr) on several
+    // threads at once?
+    anbool parallel_writers;
 
     // Which field in a multi-HDU xyls file is this?
     int fieldnum;
@@ -76,10 +101,70 @@ struct onefield_params {
 
     // The fields to solve!
     xylist_t* xyls;
+    // If set, the field to solve (as field 1), held in memory, instead
+    // of the xylist "fieldfname"; it isn't freed by onefield_free().
+    // Not for field-parallel solving, tag-along columns or FIELDID.
+    starxy_t* field_xy;
+    // If nonzero, read only the first this many sources of each field
+    // (the brightest, if it was sorted by resort-xylist); the solver and
+    // verification never see the rest.  Zero reads them all.
+    int max_field_read;
 
     // Output files
     matchfile* mf;
     rdlist_t* indexrdls;
+    FILE* statsfid;
+    // number of records written to "statsfid"
+    int nstats;
+    // open while solving, like "statsfid"; shared by the field threads.
+    solver_trace_t* trace;
+
+    // Totals over the runs of this onefield_t, for the engine's metrics:
+    // if "collect_stats" is set, the solver's time in each stage (see
+    // solver_stats_t); and always, the quad counts and the time spent
+    // getting indexes ready.
+    anbool collect_stats;
+    double stage_wall[SOLVER_N_STAGES];
+    double stage_cpu[SOLVER_N_STAGES];
+    long long numtries;
+    long long nummatches;
+    long long num_verified;
+    double index_load_time;
+    int nindex_loads;
+    // the ID of the index that solved the last solved field.
+    int solved_indexid;
+    // the WCS of the best solution found by the last onefield_run(), if
+    // "have_solved_wcs".
+    sip_t solved_wcs;
+    anbool have_solved_wcs;
+    // If "keep_matches" is set, the matched stars of that solution:
+    // "solved_nmatch" field positions (x,y) and the positions (x,y,z on
+    // the unit sphere) of the reference stars they matched.  Freed by
+    // onefield_free_solved_matches().
+    anbool keep_matches;
+    int solved_nmatch;
+    double* solved_fieldxy;
+    double* solved_refxyz;
+
+    // Resuming a search that was cut short (see job-checkpoint.h): the
+    // next onefield_run() skips the first "resume_index" indexes (when
+    // they are searched one at a time), and starts the search with the
+    // next one at field object "resume_object" rather than
+    // solver.startobj.
+    int resume_index;
+    int resume_object;
+    // Set by onefield_run(): if a time or CPU limit, the memory limit or
+    // cancellation cut the search short, the number of indexes done and
+    // the field object the search had reached in the next; otherwise
+    // "stopped_object" is -1.
+    int stopped_index;
+    int stopped_object;
+    // (internal: a limit has stopped the current search.)
+    anbool search_stopped;
+    // The best match found that didn't solve the field, over all runs.
+    anbool have_best_unsolved;
+    double best_unsolved_logodds;
+    tan_t best_unsolved_wcs;
 
     // extra fields to add to index rdls file:
     sl* rdls_tagalong;
@@ -103,7 +188,7 @@ struct onefield_params {
     anbool hit_cpulimit;
 
     int timelimit;
-    time_t time_start;
+    double time_start;
     anbool hit_timelimit;
 
     float total_cpulimit;
@@ -114,6 +199,10 @@ struct onefield_params {
     double time_total_start;
     anbool hit_total_timelimit;
 
+    // the shared allocator's limit was reached (see an_alloc_set_limit()
+    // and "memlimit" in the engine config).
+    anbool hit_memlimit;
+
     anbool single_field_solved;
 
     // filename for cancelling
@@ -133,6 +222,8 @@ void onefield_set_match_file(onefield_t* bp, const char* fn);
 void onefield_set_rdls_file(onefield_t* bp, const char* fn);
 void onefield_set_scamp_file(onefield_t* bp, const char* fn);
 void onefield_set_corr_file(onefield_t* bp, const char* fn);
+void onefield_set_stats_file(onefield_t* bp, const char* fn);
+void onefield_set_trace_file(onefield_t* bp, const char* fn);
 void onefield_set_wcs_file(onefield_t* bp, const char* fn);
 void onefield_set_xcol(onefield_t* bp, const char* x);
 void onefield_set_ycol(onefield_t* bp, const char* x);
@@ -144,6 +235,7 @@ void onefield_add_index(onefield_t* bp, const char* index);
 void onefield_clear_verify_wcses(onefield_t* bp);
 void onefield_clear_indexes(onefield_t* bp);
 void onefield_clear_solutions(onefield_t* bp);
+void onefield_free_solved_matches(onefield_t* bp);
 
 void onefield_add_field(onefield_t* bp, int field);
 void onefield_add_field_range(onefield_t* bp, int lo, int hi);
@@ -55,6 +55,11 @@ ngc_entry* ngc_get_entry(int i);
 
 ngc_entry* ngc_get_entry_named(const char* name);
 
+// Indices (ascending) of the entries within "radius" degrees of
+// RA,Dec (ra,dec); sets "N".  The first call builds a HEALPix-bucketed
+// index that later calls share.  Free the result with free().
+int* ngc_entries_within(double ra, double dec, double radius, int* N);
+
 // find the common name of the given ngc_entry, if it has one.
 char* ngc_get_name(ngc_entry* entry, int num);
 
@@ -0,0 +1,107 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef OSET_H
+#define OSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+
+/**
+ An ordered set (or multiset) of fixed-size elements, kept in a B+tree.
+
+ The elements live in large, contiguous leaf nodes that are chained
+ together in order, and each inner node holds its separator keys in a
+ flat array, so lookups and inserts touch a few cache lines per level
+ rather than one per element (as sorted bl lists do, with their linear
+ scans and memmoves) or one per node (as the bt AVL tree does).
+
+ Sets of int64_t keys (oset_new_int64()) search their nodes with a
+ branch-free counting loop that the compiler vectorizes; other sets
+ use binary search with the given comparison function.
+
+ Readers (oset_contains(), iteration) may run concurrently with each
+ other, but not with oset_insert().
+ */
+
+// Like qsort's comparison function, plus a user "token".
+typedef int (*oset_compare_func)(const void* v1, const void* v2, void* token);
+
+struct oset_node;
+
+struct oset {
+    struct oset_node* root;
+    // the leftmost leaf
+    struct oset_node* first;
+    int datasize;
+    // elements per leaf, separator keys per inner node.
+    int leafcap;
+    int innercap;
+    size_t N;
+    oset_compare_func compare;
+    void* token;
+    // elements are int64_t, compared natively.
+    anbool isint64;
+};
+typedef struct oset oset;
+
+// For iterating over the elements in order; see oset_iter_next().
+struct oset_iter {
+    const struct oset_node* leaf;
+    int index;
+    int datasize;
+};
+typedef struct oset_iter oset_iter;
+
+/**
+ Creates an empty set of "datasize"-byte elements, ordered by
+ "compare" (which is passed "token").
+ */
+oset* oset_new(int datasize, oset_compare_func compare, void* token);
+
+/**
+ Creates an empty set of int64_t elements, in ascending order.
+ */
+oset* oset_new_int64(void);
+
+void oset_free(oset* s);
+
+size_t oset_size(const oset* s);
+
+/**
+ Inserts a copy of "data".  If "unique" is TRUE and an equal element
+ is already present, the set is unchanged and FALSE is returned;
+ otherwise the new element goes after any equal ones, and TRUE is
+ returned.
+ */
+anbool oset_insert(oset* s, const void* data, anbool unique);
+
+anbool oset_contains(const oset* s, const void* data);
+
+anbool oset_insert_int64(oset* s, int64_t val, anbool unique);
+
+anbool oset_contains_int64(const oset* s, int64_t val);
+
+/**
+ Copies all the elements, in order, into "dest", which must have room
+ for oset_size() of them.
+ */
+void oset_copy(const oset* s, void* dest);
+
+void oset_iter_init(const oset* s, oset_iter* it);
+
+/**
+ Returns a pointer to the next element, or NULL after the last one.
+ */
+const void* oset_iter_next(oset_iter* it);
+
+/**
+ Checks the tree's invariants; returns 0 if they hold.
+ */
+int oset_check(const oset* s);
+
+#endif
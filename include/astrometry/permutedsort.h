@@ -30,6 +30,27 @@ int* permuted_sort(const void* realarray, int array_stride,
                    int (*compare)(const void*, const void*),
                    int* perm, int Nperm);
 
+/*
+ For the compare_{doubles,floats,ints,int64}_{asc,desc} functions below,
+ sets "*key" to an unsigned integer that sorts in the order permuted_sort()
+ puts "value" (NaNs last), and returns TRUE.  Returns FALSE for any other
+ "compare" function.
+ */
+anbool permuted_sort_key(const void* value,
+                         int (*compare)(const void*, const void*),
+                         uint64_t* key);
+
+/*
+ Returns (in a new array) the first min(K, N) entries of the
+ permutation permuted_sort() would give, without sorting all "N"
+ elements: for the compare functions permuted_sort_key() knows, it
+ selects the K-th key and sorts just the K elements up to it, so the
+ result (ties included) is the same as truncating the full sort.
+ */
+int* permuted_sort_topk(const void* realarray, int array_stride,
+                        int (*compare)(const void*, const void*),
+                        int K, int N);
+
 int* permutation_init(int* perm, int Nperm);
 
 /**
@@ -37,11 +58,21 @@ int* permutation_init(int* perm, int Nperm);
 
  Copies "inarray" into "outarray" according to the given "perm"utation.
 
- This also works when "inarray" == "outarray".
+ This also works when "inarray" == "outarray": when "perm" is a
+ permutation of [0, Nperm), or picks elements with perm[i] >= i, that
+ takes no copy of the array.
  */
 void permutation_apply(const int* perm, int Nperm, const void* inarray,
 					   void* outarray, int elemsize);
 
+/**
+ Applies "perm" in place to "narrays" parallel arrays, "arrays[k]"
+ having elements of "elemsizes[k]" bytes, following the permutation
+ once for all of them.  NULL arrays are skipped.
+ */
+void permutation_apply_multi(const int* perm, int Nperm, void** arrays,
+                             const int* elemsizes, int narrays);
+
 /*
   Some sort functions that might come in handy:
  */
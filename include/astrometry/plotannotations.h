@@ -6,6 +6,7 @@
 #define PLOTANNOTATIONS_H
 
 #include "astrometry/plotstuff.h"
+#include "astrometry/kdtree.h"
 
 struct annotation_args {
     anbool NGC;
@@ -31,6 +32,14 @@ struct annotation_args {
     float ngc_fraction;
     bl* targets;
     char* hd_catalog;
+
+    // kd-trees over the NGC/IC and bright-star catalogs' unit vectors,
+    // built on first use, so that each plot only looks at the objects
+    // near the field.
+    kdtree_t* ngc_kd;
+    double* ngc_xyz;
+    kdtree_t* bright_kd;
+    double* bright_xyz;
 };
 typedef struct annotation_args plotann_t;
 
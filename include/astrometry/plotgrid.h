@@ -62,6 +62,10 @@ int plot_grid_count_ra_labels(plot_args_t* pargs);
 // With the current "declabelstep", how many labels will be added?
 int plot_grid_count_dec_labels(plot_args_t* pargs);
 
+// Grids without labels can be drawn in tiles; labels are placed relative
+// to the edges of the whole image.
+anbool plot_grid_tileable(plot_args_t* pargs, void* baton);
+
 DECLARE_PLOTTER(grid);
 
 #endif
@@ -45,6 +45,9 @@ void plot_radec_free(plot_args_t* args, void* baton);
 void plot_radec_vals(plotradec_t* args, double ra, double dec);
 
 //extern const plotter_t plotter_radec;
+// Can be drawn in tiles when plotting from an rdlist file.
+anbool plot_radec_tileable(plot_args_t* pargs, void* baton);
+
 DECLARE_PLOTTER(radec);
 
 #endif
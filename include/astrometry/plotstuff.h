@@ -77,6 +77,17 @@ struct plot_args {
 
     // step size in pixels for drawing curved lines in RA,Dec; default 10
     float linestep;
+
+    // Tiled rendering: if "tilesize" > 0, layers whose plotters support
+    // it are drawn in "tilesize" x "tilesize" tiles, on "tilethreads"
+    // threads, each with its own cairo_t and a WCS for just that tile;
+    // the tiles are then composited onto the canvas.
+    int tilesize;
+    int tilethreads;
+    // When drawing a tile: the tile's offset in the full canvas, which
+    // plotters working in canvas pixel coordinates must subtract.
+    int tilex0;
+    int tiley0;
 };
 typedef struct plot_args plot_args_t;
 
@@ -85,6 +96,8 @@ typedef int   (*plot_func_init2_t)(plot_args_t* args, void* baton);
 typedef int   (*plot_func_command_t)(const char* command, const char* cmdargs, plot_args_t* args, void* baton);
 typedef int   (*plot_func_plot_t)(const char* command, cairo_t* cr, plot_args_t* args, void* baton);
 typedef void  (*plot_func_free_t)(plot_args_t* args, void* baton);
+// Can the next "plot" be drawn tile by tile, on several threads at once?
+typedef anbool (*plot_func_tileable_t)(plot_args_t* args, void* baton);
 
 struct plotter {
     // don't change the order of these fields!
@@ -95,6 +108,8 @@ struct plotter {
     plot_func_plot_t doplot;
     plot_func_free_t free;
     void* baton;
+    // NULL if the plotter can't be drawn in tiles.
+    plot_func_tileable_t tileable;
 };
 
 //#define DECLARE_PLOTTER(name) plotter_t* plot_ ## name ## _new()
@@ -110,6 +125,15 @@ struct plotter {
         DEFINE_PLOTTER_BODY(name)                       \
             }
 
+// For plotters whose "plot" function, when "tilefunc" says so, only
+// reads its baton and draws through the given cairo_t and plot_args_t,
+// so that several tiles can be drawn at once.
+#define DEFINE_TILEABLE_PLOTTER(name, tilefunc)         \
+    DECLARE_PLOTTER(name) {                             \
+        DEFINE_PLOTTER_BODY(name)                       \
+            p->tileable = tilefunc;                     \
+    }
+
 /*
  #define DEFINE_PLOTTER(name) void plot_ ## name ## _describe(plotter_t* p) { \
  p->name = #name;												\
@@ -139,6 +163,16 @@ void plotstuff_set_text_bg_alpha(plot_args_t* pargs, float alpha);
 
 int plotstuff_plot_layer(plot_args_t* pargs, const char* layer);
 
+/**
+ Turns on tiled rendering (see "tilesize" in plot_args_t) of raster
+ output, with tiles of "tilesize" pixels drawn on "nthreads" threads;
+ "tilesize" = 0 turns it off.
+ */
+int plotstuff_set_tiles(plot_args_t* pargs, int tilesize, int nthreads);
+
+// A plot_func_tileable_t for plotters that can always be tiled.
+anbool plotstuff_always_tileable(plot_args_t* pargs, void* baton);
+
 void* plotstuff_get_config(plot_args_t* pargs, const char* name);
 
 int plotstuff_set_color(plot_args_t* pargs, const char* name);
@@ -56,6 +56,9 @@ void plot_xy_free(plot_args_t* args, void* baton);
 
 void plot_xy_vals(plotxy_t* args, double x, double y);
 
+// Can be drawn in tiles when plotting from an xylist file.
+anbool plot_xy_tileable(plot_args_t* pargs, void* baton);
+
 DECLARE_PLOTTER(xy);
 
 #endif
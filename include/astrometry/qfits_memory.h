@@ -43,11 +43,36 @@
                                    Defines
  -----------------------------------------------------------------------------*/
 
+/*
+  This symbol defines the level of usage of the memory module.
+
+  0   Use the memory system calls.
+  1   Use the memory system calls, but exit if they are not succesfull
+  2   Fully use the memory functions (tracking every allocation in a
+      table, with swap-file fallback; see qfits_memory_status())
+
+  Build with -DQFITS_MEMORY_MODE=2 to turn the tracker on.
+*/
+#ifndef QFITS_MEMORY_MODE
+#define QFITS_MEMORY_MODE        0
+#endif
+
+#if (QFITS_MEMORY_MODE == 0)
+/* No table of allocations: through the shared allocator, which just
+   counts qfits' bytes (see an-alloc.h). */
+#include "an-alloc.h"
+#define qfits_malloc(s)         an_alloc_malloc(AN_ALLOC_QFITS, s)
+#define qfits_calloc(n,s)       an_alloc_calloc(AN_ALLOC_QFITS, n, s)
+#define qfits_realloc(p,s)      an_alloc_realloc(AN_ALLOC_QFITS, p, s)
+#define qfits_free(p)           an_alloc_free(AN_ALLOC_QFITS, p)
+#define qfits_strdup(s)         an_alloc_strdup(AN_ALLOC_QFITS, s)
+#else
 #define qfits_malloc(s)         qfits_memory_malloc(s,      __FILE__,__LINE__)
 #define qfits_calloc(n,s)       qfits_memory_calloc(n,s,    __FILE__,__LINE__)
 #define qfits_realloc(p,s)      qfits_memory_realloc(p,s,   __FILE__,__LINE__)
 #define qfits_free(p)           qfits_memory_free(p,        __FILE__,__LINE__)
 #define qfits_strdup(s)         qfits_memory_strdup(s,      __FILE__,__LINE__)
+#endif
 #define qfits_falloc(f,o,s)     qfits_memory_falloc(f,o,s,  __FILE__,__LINE__)
 #define qfits_fdealloc(f,o,s)   qfits_memory_fdealloc(f,o,s,__FILE__,__LINE__)
 
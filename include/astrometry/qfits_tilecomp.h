@@ -0,0 +1,50 @@
+/*
+ This file was added by the Astrometry.net team.
+
+ Licensed under GPL v2 or later.
+ */
+
+#ifndef QFITS_TILECOMP_H
+#define QFITS_TILECOMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "astrometry/anqfits.h"
+
+/**
+ Reading of tile-compressed images: the convention used by fpack
+ (".fits.fz" files), where an image is cut into tiles that are each
+ compressed and stored in the heap of a binary table with ZIMAGE = T.
+
+ Rice-compressed tiles (ZCMPTYPE = 'RICE_1') and tiles stored
+ uncompressed are supported, for integer images and for floating-point
+ images quantized with NO_DITHER, SUBTRACTIVE_DITHER_1 or
+ SUBTRACTIVE_DITHER_2.  Other compression types are reported as errors.
+ */
+
+// Does this header describe a tile-compressed image?
+int qfits_is_tile_compressed(const qfits_header* hdr);
+
+/**
+ Decompresses one Rice-compressed tile: "nin" bytes at "in" holding "n"
+ integers of "bytepix" (1, 2 or 4) bytes each, compressed in blocks of
+ "blocksize" values.  Writes them to "out".  Returns 0 on success.
+ */
+int qfits_rice_decompress(const unsigned char* in, size_t nin,
+                          int bytepix, int blocksize,
+                          int32_t* out, int n);
+
+/**
+ Reads pixels [x0, x1) x [y0, y1) of plane "plane" of the tile-compressed
+ image in extension "ext" into "output", as "ptype" (PTYPE_*).  Only the
+ tiles that overlap the window are decompressed; they are decompressed
+ on several threads, straight into "output".  "img" is the image
+ description from anqfits_get_image_const().  Returns 0 on success.
+ */
+int anqfits_readpix_tilecomp(const anqfits_t* qf, int ext,
+                             const anqfits_image_t* img,
+                             int x0, int x1, int y0, int y1, int plane,
+                             int ptype, void* output);
+
+#endif
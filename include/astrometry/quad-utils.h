@@ -12,11 +12,27 @@
 
 void quad_compute_star_code(const double* starxyz, double* code, int dimquads);
 
+// Quads are coded in blocks of this many by the functions below.
+#define QUAD_CODE_BLOCK 64
+
+/*
+ Like quad_compute_star_code(), for "N" quads at once, with SIMD across
+ quads: "starxyz" holds the stars of each quad in turn, and "codes"
+ receives their codes.  The codes agree with quad_compute_star_code()'s
+ to within rounding.
+ */
+void quad_compute_star_codes(const double* starxyz, double* codes, int N,
+                             int dimquads);
+
 void quad_flip_parity(const double* code, double* flipcode, int dimcode);
 
 int quad_compute_code(const unsigned int* quad, int dimquads, startree_t* starkd, 
                       double* code);
 
+// Like quad_compute_code(), for "N" quads ("quads" holds each in turn).
+int quad_compute_codes(const unsigned int* quads, int N, int dimquads,
+                       startree_t* starkd, double* codes);
+
 void quad_enforce_invariants(unsigned int* quad, double* code,
                              int dimquads, int dimcodes);
 
@@ -31,8 +31,25 @@ typedef struct {
     fitsbin_t* fb;
     // when reading:
     uint32_t* quadarray;
+    // when reading, if the file has them (else NULL): the geometry of
+    // each quad, QUADFILE_GEOM_FLOATS floats each; see
+    // quadfile_compute_geometry().
+    float* geomarray;
+    // when reading, if the file has them and quadfile_set_load_star_xyz()
+    // is on (else NULL): the positions of the stars of each quad,
+    // dimquads x 3 floats each.
+    float* xyzarray;
 } quadfile_t;
 
+/*
+ The per-quad geometry table: for each quad, the midpoint of its stars A
+ and B (a unit vector, x,y,z) and their separation in radians.  It's an
+ optional "quadgeom" table in index files, so that the solver can reject
+ most code matches from one sequential read instead of fetching each
+ star from the star kdtree.
+ */
+#define QUADFILE_GEOM_FLOATS 4
+
 quadfile_t* quadfile_open(const char* fname);
 quadfile_t* quadfile_open_fits(anqfits_t* fits);
 
@@ -59,12 +76,60 @@ int quadfile_get_stars(const quadfile_t* qf, unsigned int quadid,
 
 int quadfile_write_quad(quadfile_t* qf, unsigned int* stars);
 
+// Writes "N" quads, "dimquads" star ids each.
+int quadfile_write_quads(quadfile_t* qf, const uint32_t* stars, int N);
+
 int quadfile_dimquads(const quadfile_t* qf);
 
 int quadfile_nquads(const quadfile_t* qf);
 
 int quadfile_fix_header(quadfile_t* qf);
 
+// The geometry of quad "quadid" (QUADFILE_GEOM_FLOATS floats), or NULL if
+// the file has no geometry table.
+const float* quadfile_get_geometry(const quadfile_t* qf, unsigned int quadid);
+
+// Computes the geometry table of all the quads into "geom"
+// (QUADFILE_GEOM_FLOATS x numquads floats), given the positions of the
+// stars as unit vectors, "starxyz" (3 x numstars).
+void quadfile_compute_geometry(const quadfile_t* qf, const double* starxyz,
+                               float* geom);
+
+// Appends the geometry table "geom" to "fid".
+int quadfile_write_geometry_to(quadfile_t* qf, const float* geom, FILE* fid);
+
+/*
+ The optional "quadxyz" table: a copy of the positions of each quad's
+ stars (unit vectors, in single precision), stored quad by quad, so that
+ the solver can read one record per code match rather than looking each
+ star up in the star kdtree.  Whether files opened for reading load it
+ is a process-wide setting (default off); it applies to files opened
+ after it is set.
+ */
+void quadfile_set_load_star_xyz(anbool load);
+
+anbool quadfile_get_load_star_xyz(void);
+
+// The positions of the stars of quad "quadid" (dimquads x 3 floats), or
+// NULL if the table isn't loaded.
+const float* quadfile_get_star_xyz(const quadfile_t* qf, unsigned int quadid);
+
+/**
+ Hints that quad "quadid" will be looked at soon: starts reading its
+ star IDs, and its "quadgeom" and "quadxyz" rows if they are loaded,
+ into the CPU cache.  Doesn't wait, or fault in unmapped pages.
+ */
+void quadfile_prefetch(const quadfile_t* qf, unsigned int quadid);
+
+// Computes the "quadxyz" table of all the quads into "xyz" (dimquads x
+// 3 x numquads floats), given the star positions "starxyz" (3 x
+// numstars).
+void quadfile_compute_star_xyz(const quadfile_t* qf, const double* starxyz,
+                               float* xyz);
+
+// Appends the "quadxyz" table "xyz" to "fid".
+int quadfile_write_star_xyz_to(quadfile_t* qf, const float* xyz, FILE* fid);
+
 int quadfile_write_header(quadfile_t* qf);
 
 double quadfile_get_index_scale_upper_arcsec(const quadfile_t* qf);
@@ -40,6 +40,32 @@ double lanczos_resample_d(double px, double py,
                           const double* img, const double* weightimg,
                           int W, int H, double* out_wt, void* token);
 
+/**
+ The Lanczos kernel, tabulated at LANCZOS_TABLE_RES samples per pixel,
+ for resampling many pixels without calling sin() for every tap.
+ Orders up to LANCZOS_TABLE_MAX_ORDER are supported.
+ */
+#define LANCZOS_TABLE_RES 1024
+#define LANCZOS_TABLE_MAX_ORDER 5
+typedef struct {
+    int order;
+    // order * LANCZOS_TABLE_RES + 2 samples, of lanczos(x) for x >= 0.
+    float* k;
+} lanczos_table_t;
+
+lanczos_table_t* lanczos_table_new(int order);
+
+void lanczos_table_free(lanczos_table_t* table);
+
+/**
+ Like lanczos_resample_unw_sep_f(), using the tabulated kernel
+ (linearly interpolated).  NaN pixels are skipped.  If "weighted", the
+ result is normalized by the sum of the kernel weights used.
+ */
+float lanczos_table_resample_f(const lanczos_table_t* table,
+                               double px, double py, const float* img,
+                               int W, int H, int weighted);
+
 
 #endif
 
@@ -17,5 +17,14 @@ int resort_xylist(const char* infn, const char* outfn,
                   const char* fluxcol, const char* backcol,
                   int ascending);
 
+/*
+ Like resort_xylist(), but writes only the first "K" rows of each
+ extension in that order (all of them if K is zero), selecting them
+ without a full sort.
+ */
+int resort_xylist_topk(const char* infn, const char* outfn,
+                       const char* fluxcol, const char* backcol,
+                       int ascending, int K);
+
 #endif
 
@@ -0,0 +1,62 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_SHMCACHE_H
+#define AN_SHMCACHE_H
+
+#include <stddef.h>
+
+#include "astrometry/an-bool.h"
+
+/**
+ A registry of read-only arrays in POSIX shared memory, so that arrays
+ computed from a file (eg, the inverse permutation of a star kd-tree)
+ are computed by the first process that needs them and then shared by
+ all the others, rather than each one keeping its own copy on the heap.
+
+ Each array is a named segment (see shmcache_key()); the first process
+ to ask for it creates it and fills it in, and the others wait until it
+ is ready and then map it read-only.  Segments stay until they are
+ removed with shmcache_remove() (or the machine restarts).
+
+ The registry is off by default; when it is off, or shared memory is not
+ available, shmcache_attach() returns NULL and callers should fall back
+ to computing the array themselves.
+ */
+
+void shmcache_set_enabled(anbool enabled);
+anbool shmcache_enabled(void);
+
+/**
+ Returns a newly-allocated segment name for the array "what" derived from
+ file "filename": it depends on the file's path, inode, size and
+ modification time, so a changed file gets a new segment.  Returns NULL
+ if the file can't be stat'ed.
+ */
+char* shmcache_key(const char* filename, const char* what);
+
+/**
+ Fills "data" ("size" bytes); returns 0 on success.
+ */
+typedef int (*shmcache_fill_func)(void* data, size_t size, void* token);
+
+/**
+ Returns a read-only pointer to the "size"-byte segment "key", calling
+ "fill" to create it if it does not exist yet.  Returns NULL if the
+ registry is disabled or the segment can't be created or attached.  The
+ result must be released with shmcache_detach().
+ */
+const void* shmcache_attach(const char* key, size_t size,
+                            shmcache_fill_func fill, void* token);
+
+void shmcache_detach(const void* data, size_t size);
+
+/**
+ Removes the segment "key"; processes that have it attached keep their
+ mappings.  Returns 0 on success.
+ */
+int shmcache_remove(const char* key);
+
+#endif
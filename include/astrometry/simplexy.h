@@ -15,10 +15,13 @@
 #define SIMPLEXY_DEFAULT_MAXSIZE    2000
 #define SIMPLEXY_DEFAULT_HALFBOX     100
 #define SIMPLEXY_DEFAULT_MAXNPEAKS 100000
+#define SIMPLEXY_DEFAULT_BANDROWS   1024
 
 #define SIMPLEXY_U8_DEFAULT_PLIM     4.0
 #define SIMPLEXY_U8_DEFAULT_SADDLE   2.0
 
+typedef struct simplexy_cache_t simplexy_cache_t;
+
 struct simplexy_t {
     /******
      Inputs
@@ -57,6 +60,47 @@ struct simplexy_t {
     // otherwise a value will be estimated.
     float sigma;
 
+    // The number of points at which the noise is sampled when it is
+    // estimated (see dsigma()); if zero, one every 20 pixels.
+    int sigmasamples;
+
+    // (boolean) In tiled mode, estimate the noise in each tile, so that
+    // the detection threshold follows noise that varies across the
+    // image; "sigma" is then set to the median over the tiles.
+    // Otherwise one value is used for the whole image.
+    int tilesigma;
+
+    // If > 0, process images larger than this (in either dimension) in
+    // tiles of about this many pixels square, on "nthreads" threads (or
+    // one per CPU if zero); see simplexy_run().  Otherwise "nthreads"
+    // threads are used for the background (median) estimate.
+    int tilesize;
+    int nthreads;
+
+    // For simplexy_run_streaming(): the height of the bands of rows
+    // (SIMPLEXY_DEFAULT_BANDROWS if zero).  image2xy_files() streams
+    // the image if this is set.
+    int bandrows;
+
+    // If set, the background-subtracted image, the noise estimate and
+    // the smoothed image are kept here, and reused by later runs on the
+    // same image ("image" or "image_u8", which must not be changed in
+    // between) with the same "nx", "ny", "halfbox", "nobgsub" and
+    // "invert" -- and, for the smoothed image, "dpsf".  So rerunning
+    // with only the detection settings changed ("plim", "dlim",
+    // "saddle", ...) skips the expensive steps.  Not used in tiled mode
+    // or when "bgimgfn" is set.
+    simplexy_cache_t* cache;
+
+    // (boolean) Run the background, smoothing and masking steps on an
+    // OpenCL device (a GPU) if there is one, which needs a build with
+    // WITH_OPENCL (see util/makefile.opencl); the results match the
+    // CPU's to rounding.  The image is then processed whole
+    // ("tilesize" is ignored).  Otherwise, and for u8 images, with
+    // "cache", "bgimgfn" or "smoothimgfn", or with "dpsf" zero, the
+    // CPU is used.
+    int gpu;
+
     /******
      Outputs
      ******/
@@ -93,10 +137,44 @@ void simplexy_set_u8_defaults(simplexy_t* i);
 void simplexy_fill_in_defaults(simplexy_t* s);
 void simplexy_fill_in_defaults_u8(simplexy_t* s);
 
+/**
+ Finds the sources in the image.  With "tilesize" set, large images
+ are split into overlapping tiles that are processed in parallel and
+ stitched together; the results match those for the whole image except
+ that the background is estimated per tile, so sources can differ
+ slightly where the background varies on scales near "halfbox".  The
+ debugging images are only written when the whole image is processed
+ at once.
+ */
 int simplexy_run(simplexy_t* s);
 
+/**
+ Reads "nrows" full rows of the image, starting at row "y0", into
+ "rows" as floats; returns 0 on success.
+ */
+typedef int (*simplexy_read_rows_func)(void* token, int y0, int nrows,
+                                       float* rows);
+
+/**
+ Like simplexy_run(), for images too big to hold in memory: "s->image"
+ and "s->image_u8" must be NULL, and the image ("s->nx" by "s->ny") is
+ read through "read_rows" in bands of "s->bandrows" rows, each of which
+ is processed as a tile.  Memory use is a few times the image width
+ times the band height.  If "s->sigma" is not set, the image is read
+ twice: first to measure the noise (the median over the bands).
+
+ Returns -1 if reading fails, otherwise as simplexy_run().
+ */
+int simplexy_run_streaming(simplexy_t* s, simplexy_read_rows_func read_rows,
+                           void* token);
+
 void simplexy_free_contents(simplexy_t* s);
 
 void simplexy_clean_cache();
 
+simplexy_cache_t* simplexy_cache_new(void);
+// Drops everything in the cache.
+void simplexy_cache_reset(simplexy_cache_t* c);
+void simplexy_cache_free(simplexy_cache_t* c);
+
 #endif
@@ -0,0 +1,96 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef SIP_INVGRID_H
+#define SIP_INVGRID_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/sip.h"
+
+/**
+ A table-driven inverse of the forward (A,B) SIP distortion.
+
+ The inverse distortion is found by Newton's method at the nodes of a
+ regular grid covering the (undistorted) image, and interpolated
+ bicubically in between; a number of Newton steps can then be applied
+ to each interpolated point to refine it.  This does not use the AP,BP
+ polynomials (except as a starting guess when building the table), so it
+ works for WCSes that do not have them, and does not suffer from their
+ errors near the corners of the image.
+
+ Points outside the table (more than a couple of grid cells beyond the
+ image) are inverted by Newton's method from scratch.
+
+ The table is built lazily, the first time it is needed; that is not
+ thread-safe, so call sip_invgrid_build() first if the grid is to be
+ shared between threads.
+ */
+struct sip_invgrid_t {
+    // copy of the WCS.
+    sip_t sip;
+    // grid spacing, in pixels.
+    double step;
+    // Newton steps applied after interpolation.
+    int newton;
+
+    anbool built;
+    // number of nodes; and the position (relative to CRPIX) of node 0,0.
+    int NX, NY;
+    double u0, v0;
+    // at each node U,V: the correction u-U, v-V.  NX*NY, row-major.
+    double* du;
+    double* dv;
+    // largest error (in pixels) of the interpolated inverse (without
+    // Newton steps) found at the cell centers while building.
+    double maxerr;
+};
+typedef struct sip_invgrid_t sip_invgrid_t;
+
+/**
+ Creates an inverse-distortion grid for the given WCS (which is copied),
+ which must have its image size set.
+
+ "step" is the grid spacing in pixels; 0 chooses a spacing giving about
+ 32 cells across the image.  "newton" is the number of Newton steps to
+ apply to each interpolated point; 0 means use the interpolated value.
+ */
+sip_invgrid_t* sip_invgrid_new(const sip_t* sip, double step, int newton);
+
+void sip_invgrid_free(sip_invgrid_t* g);
+
+/**
+ Builds the table, if it has not been built already.  Returns 0 on
+ success.
+ */
+int sip_invgrid_build(sip_invgrid_t* g);
+
+/**
+ Returns the largest error, in pixels, of the interpolated inverse found
+ while building the table (before any Newton steps).
+ */
+double sip_invgrid_max_error(sip_invgrid_t* g);
+
+/**
+ Equivalent to sip_pixel_undistortion(): TAN pixel coordinates to
+ distorted pixel coordinates.
+ */
+void sip_invgrid_undistort(sip_invgrid_t* g, double x, double y,
+                           double* px, double* py);
+
+/**
+ Equivalent to sip_radec2pixelxy(): RA,Dec in degrees to pixels.
+ */
+anbool sip_invgrid_radec2pixelxy(sip_invgrid_t* g, double ra, double dec,
+                                 double* px, double* py);
+
+/**
+ Array versions; see sip_radec2pixelxy_array().
+ */
+int sip_invgrid_radec2pixelxy_array(sip_invgrid_t* g, const double* radec,
+                                    int N, double* xy, anbool* ok);
+int sip_invgrid_xyzarr2pixelxy_array(sip_invgrid_t* g, const double* xyz,
+                                     int N, double* xy, anbool* ok);
+
+#endif
@@ -33,6 +33,8 @@ int sip_compute_inverse_polynomials(sip_t* sip, int NX, int NY,
  Finds stars that are inside the bounds of a given field (wcs).
 
  One of "sip" or "tan" must be non-NULL; if "sip" is non-NULL it is used.
+ If "sip" has forward but no inverse (AP,BP) distortion terms, the
+ inverse is computed with a sip_invgrid_t.
 
  One of "xyz" or "radec" must be non-NULL.  If both are non-NULL, xyz is used.
  "N" indicates how many elements are in these arrays.  "radec" are in degrees.
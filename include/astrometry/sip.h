@@ -224,6 +224,47 @@ void sip_iwc2pixelxy(const sip_t* sip, double iwcx, double iwcy,
 
 void sip_iwc2radec(const sip_t* sip, double x, double y, double *p_ra, double *p_dec);
 
+/**
+ Array versions of the transforms above, for N points at a time.  The
+ per-WCS setup (CD inverse, tangent-plane basis) is done once per call
+ and the SIP polynomials are evaluated with Horner's scheme over blocks
+ of points.
+
+ Pixel coordinates are interleaved (x0,y0, x1,y1, ...), as are RA,Dec
+ (in degrees); XYZ unit vectors are packed 3 per point.
+
+ The world-to-pixel functions return the number of points that project
+ onto the tangent plane; if "ok" is non-NULL, ok[i] is set to say
+ whether point i did.  The pixel position of a point that did not is
+ left unset.
+ */
+void sip_pixelxy2radec_array(const sip_t* sip, const double* xy, int N,
+                             double* radec);
+void sip_pixelxy2xyzarr_array(const sip_t* sip, const double* xy, int N,
+                              double* xyz);
+int sip_radec2pixelxy_array(const sip_t* sip, const double* radec, int N,
+                            double* xy, anbool* ok);
+int sip_xyzarr2pixelxy_array(const sip_t* sip, const double* xyz, int N,
+                             double* xy, anbool* ok);
+
+void tan_pixelxy2radec_array(const tan_t* tan, const double* xy, int N,
+                             double* radec);
+void tan_pixelxy2xyzarr_array(const tan_t* tan, const double* xy, int N,
+                              double* xyz);
+int tan_radec2pixelxy_array(const tan_t* tan, const double* radec, int N,
+                            double* xy, anbool* ok);
+int tan_xyzarr2pixelxy_array(const tan_t* tan, const double* xyz, int N,
+                             double* xy, anbool* ok);
+
+// Array versions of sip_calc_distortion / sip_calc_inv_distortion; these
+// take *relative* pixel coords, in separate u and v arrays.  The outputs
+// may be the same arrays as the inputs.
+void sip_calc_distortion_array(const sip_t* sip, const double* u,
+                               const double* v, int N, double* U, double* V);
+void sip_calc_inv_distortion_array(const sip_t* sip, const double* U,
+                                   const double* V, int N,
+                                   double* u, double* v);
+
 void   sip_print(const sip_t*);
 void   sip_print_to(const sip_t*, FILE* fid);
 
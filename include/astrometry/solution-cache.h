@@ -0,0 +1,90 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef SOLUTION_CACHE_H
+#define SOLUTION_CACHE_H
+
+#include <stdint.h>
+
+#include "astrometry/starxy.h"
+#include "astrometry/sip.h"
+
+/**
+ A cache of solved fields, so that a field that has been solved before
+ (the same pointing, seen again) can be verified against its old WCS
+ instead of being searched for.
+
+ Fields are looked up by a fingerprint of the geometry of their
+ brightest sources: the quad codes (see codefile_compute_field_code())
+ of every four of the SOLUTION_CACHE_NSTARS brightest sources, which
+ don't change with the field's position, rotation or scale, nor with
+ the order of those sources.  A cached field matches if enough of its
+ codes are close to the new field's; the WCS still has to be verified.
+
+ The cache is a directory holding one FITS file per solved field: its
+ WCS in the primary header, and its codes in a table.
+ */
+
+// the number of brightest sources the fingerprint is made from...
+#define SOLUTION_CACHE_NSTARS 8
+// ... and the number of codes: (SOLUTION_CACHE_NSTARS choose 4).
+#define SOLUTION_CACHE_NCODES 70
+// two codes are the same if they're this close.
+#define SOLUTION_CACHE_CODE_TOL 0.01
+// a cached field matches if at least this many codes are the same.
+#define SOLUTION_CACHE_MIN_MATCHES 5
+
+typedef struct {
+    int ncodes;
+    double codes[SOLUTION_CACHE_NCODES * 4];
+} field_fingerprint_t;
+
+typedef struct solution_cache solution_cache_t;
+
+/**
+ Computes the fingerprint of the first SOLUTION_CACHE_NSTARS sources in
+ "xy" (which should be sorted brightest first).  Returns -1 if the
+ field has fewer than 5 sources.
+ */
+int field_fingerprint_compute(const starxy_t* xy, field_fingerprint_t* fp);
+
+/**
+ Returns the number of codes in "fp1" that are within
+ SOLUTION_CACHE_CODE_TOL of one in "fp2".
+ */
+int field_fingerprint_matches(const field_fingerprint_t* fp1,
+                              const field_fingerprint_t* fp2);
+
+// A hash of the fingerprint, the same whatever order its codes are in.
+uint64_t field_fingerprint_hash(const field_fingerprint_t* fp);
+
+/**
+ Opens (creating it if need be) the cache in directory "dir", and reads
+ the fields in it.  Returns NULL on failure.
+ */
+solution_cache_t* solution_cache_open(const char* dir);
+
+/**
+ Looks up the fingerprint "fp", writing the WCSes of up to "maxwcs"
+ matching fields, best match first, into "wcses".  Returns the number
+ found.  Thread-safe.
+ */
+int solution_cache_lookup(solution_cache_t* cache,
+                          const field_fingerprint_t* fp,
+                          sip_t* wcses, int maxwcs);
+
+/**
+ Adds a solved field to the cache, in memory and on disk.  Returns 0 on
+ success.  Thread-safe.
+ */
+int solution_cache_add(solution_cache_t* cache,
+                       const field_fingerprint_t* fp, const sip_t* wcs);
+
+// The number of fields in the cache.
+int solution_cache_size(solution_cache_t* cache);
+
+void solution_cache_free(solution_cache_t* cache);
+
+#endif
@@ -49,4 +49,33 @@ int solvedfile_set_file(char* fn, anbool* vals, int N);
 
 int solvedfile_setsize(char* fn, int fieldnum);
 
+/**
+ A solved file that stays open and mmap()ed, for callers that check it
+ over and over (eg, the solver's once-a-second timer).  Reads and writes
+ are single atomic byte accesses to the shared mapping, so processes on
+ the same machine using the same file see each other's updates at once,
+ without opening, seeking and closing the file each time.
+
+ The file format is the same as above.  The file isn't created until
+ solvedfile_map_set() is first called; until then (or if it doesn't
+ exist), all fields are unsolved.
+
+ A solvedfile_map_t is not thread-safe: callers must serialize access.
+ */
+typedef struct solvedfile_map solvedfile_map_t;
+
+solvedfile_map_t* solvedfile_map_open(const char* fn);
+
+/**
+ Returns 1 if the field is solved, 0 if not, -1 on error.
+ */
+int solvedfile_map_get(solvedfile_map_t* sf, int fieldnum);
+
+/**
+ Marks the field solved, growing (or creating) the file if necessary.
+ */
+int solvedfile_map_set(solvedfile_map_t* sf, int fieldnum);
+
+void solvedfile_map_close(solvedfile_map_t* sf);
+
 #endif
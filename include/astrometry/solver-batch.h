@@ -0,0 +1,90 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef SOLVER_BATCH_H
+#define SOLVER_BATCH_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/bl.h"
+#include "astrometry/sip.h"
+#include "astrometry/index.h"
+
+/**
+ Solves many in-memory star lists against one set of loaded indexes, on
+ several threads: each thread takes the next field, runs it through its
+ own solver_t, and moves on.  The indexes are shared (index_acquire()d
+ once for the whole batch), so each is loaded only once.
+ */
+
+typedef struct {
+    // pixel scale range, in arcsec/pixel; if zero, fields 0.1 to 180
+    // degrees wide (the engine's default).
+    double pixscale_low;
+    double pixscale_high;
+    // PARITY_NORMAL, PARITY_FLIP or PARITY_BOTH.
+    int parity;
+    // accept a match with at least these log-odds.
+    double logodds_solve;
+    // if set, only look within "radius" degrees of ("ra", "dec").
+    anbool use_radec;
+    double ra;
+    double dec;
+    double radius;
+    // the field objects to look at (0 for all).
+    int depth;
+    // SIP polynomial order of the result (< 2 for TAN only).
+    int tweak_order;
+    // quad sizes, as fractions of the image size.
+    double quadsize_min;
+    double quadsize_max;
+    // give up on a field after this many seconds of wall time (0 for no
+    // limit).
+    double timelimit;
+} solver_batch_params_t;
+
+typedef struct {
+    int N;
+    // star positions, brightest first (unless "flux" is given, in which
+    // case they are sorted by it).
+    const double* x;
+    const double* y;
+    // may be NULL.
+    const double* flux;
+    // image size; if zero, the bounding box of the stars is used.
+    int imagew;
+    int imageh;
+} solver_batch_field_t;
+
+typedef struct {
+    anbool solved;
+    double logodds;
+    // the solution (a TAN-only SIP unless tweaked); NULL if unsolved.
+    // Owned by the caller: sip_free() it.
+    sip_t* wcs;
+    // the index that solved it, and the number of matched stars.
+    index_t* index;
+    int nmatch;
+} solver_batch_result_t;
+
+/**
+ Sets the parameters to those solve-field uses by default: all scales,
+ both parities, log-odds 1e9, a second-order tweak, quads 0.1 to 1
+ times the image size.
+ */
+void solver_batch_params_init(solver_batch_params_t* params);
+
+/**
+ Solves the "nfields" "fields" with the "indexes" (a list of index_t*),
+ on "nthreads" threads (the number of CPUs if <= 0), writing
+ "results[i]" for each field.  Fields with too few stars are simply
+ left unsolved.  Takes no locks the caller can see, so it may be called
+ with a scripting language's interpreter lock released.  Returns 0 on
+ success, -1 if an index could not be loaded.
+ */
+int solver_batch_run(pl* indexes, const solver_batch_params_t* params,
+                     const solver_batch_field_t* fields, int nfields,
+                     int nthreads, solver_batch_result_t* results);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef SOLVER_TRACE_H
+#define SOLVER_TRACE_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/solver.h"
+#include "astrometry/starxy.h"
+#include "astrometry/bl.h"
+
+/**
+ A record of the solver's searches, so that a slow (or wrong) search
+ can be run again on its own -- by "replay-trace", on another machine or
+ another version of the code -- and the time it takes and what it finds
+ compared.
+
+ Each search is one solver_run(): the field as it was given to the
+ solver, the solver's parameters, the indexes (by file name, with their
+ ids and the MD5 of the file, so that replaying with different index
+ files is noticed), and what happened: the counters, the best match and
+ the time spent in each stage.
+
+ On disk it's a text file, one search after another:
+
+    # astrometry.net solver trace
+    search <field number>
+    tosolve <log-odds needed to solve>
+    field <number of stars>          (or "field same": as the last search)
+    star <x> <y> [<flux>]
+    index <indexid> <healpix> <hpnside> <md5 or -> <path>
+    param <name> <value>
+    result <numtries> <nummatches> <numscaleok> <num_verified> <solved>
+           <best log-odds> <wall seconds> <cpu seconds>
+    stage <name> <wall seconds> <cpu seconds>
+    end
+
+ (the "result" line is all on one line.)  Predistortion (solver_t
+ "predistort") and code matchers aren't recorded; the cancel flag,
+ deadline and callbacks don't apply to a replay.
+ */
+typedef struct solver_trace_t solver_trace_t;
+
+typedef struct {
+    char* path;
+    int indexid;
+    int healpix;
+    int hpnside;
+    // hex MD5 of the file, or "-" if it couldn't be read.
+    char md5[33];
+} solver_trace_index_t;
+
+typedef struct {
+    int fieldnum;
+    // a match with at least this log-odds solves the field.
+    double logratio_tosolve;
+    starxy_t* field;
+    // solver_trace_index_t
+    bl* indexes;
+    // the solver_t holding the recorded parameters (and nothing else:
+    // no indexes or field).
+    solver_t params;
+
+    // what happened
+    int numtries;
+    int nummatches;
+    int numscaleok;
+    int num_verified;
+    anbool solved;
+    double best_logodds;
+    double wall;
+    double cpu;
+    double stage_wall[SOLVER_N_STAGES];
+    double stage_cpu[SOLVER_N_STAGES];
+} solver_trace_search_t;
+
+/**
+ Starts a trace in file "fn" (replacing it).  The recorder may be used
+ from several threads at once.
+ */
+solver_trace_t* solver_trace_open(const char* fn);
+
+/**
+ Records the search that "sp" has just finished (call it before the
+ solver's field is freed), of field "fieldnum", where matches with
+ log-odds of at least "logratio_tosolve" solve the field, which took
+ "wall" and "cpu" seconds.  The per-stage times are recorded if
+ sp->collect_stats was set.  Returns 0 on success.
+ */
+int solver_trace_record(solver_trace_t* tr, const solver_t* sp,
+                        int fieldnum, double logratio_tosolve,
+                        double wall, double cpu);
+
+// Returns 0 if all the records were written.
+int solver_trace_close(solver_trace_t* tr);
+
+/**
+ Reads the searches in trace file "fn": a list of
+ solver_trace_search_t, or NULL on error.  Free with
+ solver_trace_free_searches().
+ */
+bl* solver_trace_read(const char* fn);
+
+void solver_trace_free_searches(bl* searches);
+
+/**
+ Sets up "sp" (initialized with solver_set_default_values()) to run
+ "search" again: copies the parameters and the field (the indexes are
+ the caller's job).
+ */
+void solver_trace_setup_solver(const solver_trace_search_t* search,
+                               solver_t* sp);
+
+/**
+ The hex MD5 of the contents of file "fn" (33 chars, with the
+ terminator, in "hex").  Returns 0 on success.
+ */
+int solver_trace_file_md5(const char* fn, char* hex);
+
+#endif
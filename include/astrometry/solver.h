@@ -20,6 +20,7 @@
 #include "astrometry/verify.h"
 #include "astrometry/sip.h"
 #include "astrometry/an-bool.h"
+#include "astrometry/arena.h"
 
 enum {
     PARITY_NORMAL,
@@ -34,6 +35,56 @@ enum {
 #define DEFAULT_DISTRACTOR_RATIO 0.25
 #define DEFAULT_VERIFY_PIX 1.0
 #define DEFAULT_BAIL_THRESHOLD 1e-100
+#define DEFAULT_MAX_FIELD_OBJS 1000
+
+/*
+ The stages of solver_run() that "solver_stats_t" times.  Each moment
+ is charged to exactly one stage; SOLVER_STAGE_OTHER is everything not
+ covered by the rest (mostly building quads from the pquads).
+ */
+enum solver_stage {
+    // check_scale() and setting up the pquads
+    SOLVER_STAGE_PQUAD,
+    // deciding which stars are in the AB circles
+    SOLVER_STAGE_INBOX,
+    // searching for codes in the code trees
+    SOLVER_STAGE_SEARCH,
+    // looking at the code matches (excluding verify and tweak)
+    SOLVER_STAGE_RESOLVE,
+    SOLVER_STAGE_VERIFY,
+    SOLVER_STAGE_TWEAK,
+    SOLVER_STAGE_OTHER,
+    SOLVER_N_STAGES
+};
+
+// Per-index counters; see the matching fields in solver_t.
+struct solver_index_stats {
+    int numtries;
+    int nummatches;
+    int numscaleok;
+    int num_verified;
+};
+typedef struct solver_index_stats solver_index_stats_t;
+
+struct solver_stats {
+    // Seconds spent in each stage, summed over threads.
+    double wall[SOLVER_N_STAGES];
+    double cpu[SOLVER_N_STAGES];
+    // [nindexes], in the order of solver_t.indexes.
+    solver_index_stats_t* index;
+    int nindexes;
+
+    // internal: the stage we're in (or -1), and when we entered it.
+    int stage;
+    double stage_wall;
+    double stage_cpu;
+};
+typedef struct solver_stats solver_stats_t;
+
+/**
+ Returns a short name for the given stage, eg "verify".
+ */
+const char* solver_stage_name(int stage);
 
 struct verify_field_t;
 struct solver_t {
@@ -104,6 +155,9 @@ struct solver_t {
     // The first and last field objects to look at; default is all of them.
     int startobj;
     int endobj;
+    // If "endobj" isn't set, look at no more than this many field
+    // objects; zero for no limit.  Default DEFAULT_MAX_FIELD_OBJS.
+    int max_field_objs;
 
     // One of PARITY_NORMAL, PARITY_FLIP, or PARITY_BOTH.  Are the X and Y axes of
     // the image flipped?  Default PARITY_BOTH.
@@ -127,6 +181,9 @@ struct solver_t {
     int maxquads;
     // Number of quad matches to try or zero for no limit.
     int maxmatches;
+    // Stop adding field objects when the pquad buffers (see pquad.h)
+    // reach this many bytes, or zero for no limit.
+    size_t max_pquad_bytes;
 
     // Force CRPIX to be the given point "crpix", or the center of the image?
     anbool set_crpix;
@@ -141,10 +198,47 @@ struct solver_t {
     // calling again.  The parameter is "userdata".
     time_t (*timer_callback)(void*);
 
+    // Cancellation token: if non-NULL, the search stops soon after
+    // "*cancel" becomes non-zero (see solver_cancel(), which may be
+    // called from any thread).  It is checked between units of work, so
+    // cancelling takes effect within milliseconds, with no file-system
+    // access.  Default NULL.
+    int* cancel;
+
+    // If > 0, the search stops once the wall-clock time (as returned by
+    // timenow()) passes this.  Checked like "cancel".
+    double deadline;
+
+    // Number of threads to search with in solver_run().  Zero or one
+    // means search in the calling thread only.  The callbacks above are
+    // always called with a lock held, so they need not be thread-safe;
+    // "timer_callback" is only called from the calling thread.
+    int nthreads;
+
+    // If non-NULL, searches the index's codes in place of its code
+    // kd-tree (see code-matcher.h).  Shared by the solver's threads.
+    // Default NULL.
+    struct code_matcher* code_matcher;
+
+    // Number of threads that verify candidate matches while the search
+    // carries on; the search stops as soon as one of them solves the
+    // field.  Zero means verify each match before searching further.
+    int nverifiers;
+
+    // Pin the search threads to NUMA nodes (see an-numa.h)?  Each goes
+    // to the node of the index whose units it starts with (see
+    // index_numa_node()), or if that has none they are spread evenly
+    // over the nodes; each searches its node's copies of the code trees
+    // (see index_code_tree_for_node()).
+    anbool numa_pin;
+
+    // Collect timing and per-index counts in "stats"?
+    anbool collect_stats;
+
     // FIELDS THAT AFFECT THE RUNNING SOLVER ON CALLBACK
     // =================================================
 
-    // Bail out ASAP.
+    // Bail out ASAP.  Set it with solver_set_quit().
     anbool quit_now;
 
     // SOLVER OUTPUTS
@@ -166,11 +260,17 @@ struct solver_t {
     int num_abscale_skipped;
     // The number of times we ran verification on a quad.
     int num_verified;
+    // The most memory used by the pquad buffers in a solver_run(), in bytes.
+    size_t pquad_bytes_peak;
+    // If "collect_stats" is set: per-stage timing and per-index counts.
+    solver_stats_t stats;
 
     // INTERNAL PARAMETERS; DO NOT MODIFY
     // ==================================
     // The index we're currently dealing with.
     index_t* index;
+    // ... and its position in "indexes".
+    int indexnum;
 
     // The extreme limits of quad size, for all indexes, in pixels^2.
     double minminAB2;
@@ -209,6 +309,30 @@ struct solver_t {
 
     // Cached data about this field, for verify_hit().
     verify_field_t* vf;
+
+    // The field's AB pairs, sorted by length; see solver_preprocess_field().
+    struct solver_pair_table* pairtable;
+
+    // Codes waiting to be searched for in the code tree, and the
+    // search results (reused between searches).
+    struct solver_code_batch_t* codebatch;
+
+    // Scratch space for fitting the TAN WCS of each quad match.
+    struct fit_wcs_workspace_t* fitws;
+
+    // Memory for the pquad inbox and xy buffers.  Reset at the end of
+    // each solver_run(); released by solver_free_field().
+    arena_t* pquad_arena;
+
+    // When solver_run() uses multiple threads, each worker searches
+    // with its own copy of the solver_t; "parent" points back to the
+    // solver_t that solver_run() was called with.
+    struct solver_t* parent;
+    struct solver_workers_t* workers;
+    // With "numa_pin", the node this copy's thread runs on.
+    int numa_node;
+    // The verifier threads, if "nverifiers" is set.
+    struct solver_verifiers_t* verifiers;
 };
 typedef struct solver_t solver_t;
 
@@ -379,8 +503,35 @@ index_t* solver_get_index(const solver_t* solver, int i);
 
 void solver_verify_sip_wcs(solver_t* solver, sip_t* sip); //, MatchObj* mo);
 
+/**
+ Verifies many candidate WCSes of the field, as solver_verify_sip_wcs()
+ would one at a time, but sharing the index star searches between the
+ candidates near each other on the sky and scoring them on "nthreads"
+ threads.  The candidates that score well enough are then handled best
+ first, so the field's best match is the best candidate.
+ */
+void solver_verify_sip_wcses(solver_t* solver, sip_t* wcses, int N);
+
 void solver_run(solver_t* solver);
 
+/**
+ Sets the cancellation token "token" (see solver_t.cancel), making the
+ solvers that use it stop.  Safe to call from any thread.
+ */
+void solver_cancel(int* token);
+
+/**
+ Tells the solver to stop ("quit_now").  It may be running in other
+ threads, so set it with this rather than directly.
+ */
+void solver_set_quit(solver_t* solver);
+
+/**
+ Has the solver's cancellation token been set, or its deadline passed?
+ If so, also sets "quit_now".
+ */
+anbool solver_check_cancel(solver_t* solver);
+
 #define SOLVER_TWEAK2_AVAILABLE 1
 void solver_tweak2(solver_t* solver, MatchObj* mo, int order, sip_t* verifysip);
 
@@ -411,4 +562,14 @@ void solver_print_to(const solver_t* sp, FILE* stream);
 
 void solver_log_params(const solver_t* sp);
 
+/**
+ Logs (at verbose level) the "stats" collected if "collect_stats" is set.
+ */
+void solver_log_stats(const solver_t* sp);
+
+/**
+ Writes the "stats" as a JSON object (without a trailing newline).
+ */
+int solver_write_stats_json(const solver_t* sp, FILE* fid);
+
 #endif
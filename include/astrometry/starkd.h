@@ -30,6 +30,10 @@ typedef struct {
     kdtree_t* tree;
     qfits_header* header;
     int* inverse_perm;
+    // is "inverse_perm" in shared memory (see shmcache.h)?
+    anbool inverse_perm_shared;
+    // ... or mapped from the file (its "invperm" table)?
+    anbool inverse_perm_in_file;
     uint8_t* sweep;
 
     // reading or writing?
@@ -38,6 +42,10 @@ typedef struct {
     // reading: tagged-along data (a FITS BINTABLE with one row per star,
     // in the same order); access this via startree_get_tagalong() ONLY!
     fitstable_t* tagalong;
+
+    // reading: the heatmap of the index using this tree, if heatmap
+    // tracing is on (see index-heatmap.h), for verify_hit().
+    struct index_heatmap* heatmap;
 } startree_t;
 
 startree_t* startree_open(const char* fn);
@@ -62,12 +70,49 @@ startree_t* startree_open_fits(anqfits_t* fits);
  starinds: if non-NULL, returns the indices of stars within range.
  This can be used to retrieve extra information about the stars, using
  the 'startree_get_data_column()' function.
+
+ If the star positions were packed (startree -p; see
+ kdtree_t.packed_data), each coordinate is off by up to
+ s->tree->pack_error, so positions are good to pack_error * sqrt(3) on
+ the unit sphere, and only stars that close to the edge of the search
+ radius can be found (or missed) where the exact positions would not.
  
  */
 void startree_search_for(const startree_t* s, const double* xyzcenter, double radius2,
                          double** xyzresults, double** radecresults,
                          int** starinds, int* nresults);
 
+/**
+ Caller-owned buffers for startree_search_into(), which grow as needed
+ and are reused from one search to the next.  Start with all zeros;
+ free with startree_results_free_data().
+ */
+typedef struct {
+    // 3 per star
+    double* xyz;
+    // 2 per star, if asked for
+    double* radec;
+    int* inds;
+    int N;
+    // allocated sizes, in stars
+    int capacity;
+    int radec_capacity;
+} startree_results_t;
+
+/**
+ Like startree_search_for(), but writes the stars' positions and
+ indices (and RA,Decs, if "radec") into "res", allocating only when
+ they don't fit.  Returns the number of stars found, or -1 on error.
+ */
+int startree_search_into(const startree_t* s, const double* xyzcenter,
+                         double radius2, anbool radec,
+                         startree_results_t* res);
+
+// Makes room for "N" stars (and their RA,Decs, if "radec").
+int startree_results_reserve(startree_results_t* res, int N, anbool radec);
+
+void startree_results_free_data(startree_results_t* res);
+
 /**
  RA, Dec, and radius in degrees.  Otherwise same as startree_search_for().
  */
@@ -110,6 +155,15 @@ double* startree_get_data_column_array(startree_t* s, const char* colname, const
 
 void startree_free_data_column(startree_t* s, double* d);
 
+/**
+ Reads the "tag-along" rows of the stars "indices" once, in file order,
+ for taking several columns from with fitstable_gather_column() (which
+ gives them in the order of "indices").  Free with
+ fitstable_gather_free().
+ */
+fitstable_gather_t* startree_gather_tagalong(startree_t* s, const int* indices,
+                                             int N, int nthreads);
+
 
 
 
@@ -185,10 +239,21 @@ qfits_header* startree_header(const startree_t* s);
 
 int startree_get(startree_t* s, int starid, double *p_xyz);
 
+// Hints that startree_get() will soon be called for star "starid"; see
+// quadfile_prefetch().  Does nothing if the tree's data aren't loaded.
+void startree_prefetch(const startree_t* s, int starid);
+
 int startree_get_radec(startree_t* s, int starid, double *p_ra, double *p_dec);
 
 int startree_close(startree_t* s);
 
+/**
+ Sets "inverse_perm", the tree position of each star ID (for a tree
+ with a permutation): from the file if it has the "invperm" table,
+ else computed (in shared memory if that's enabled).  When writing, a
+ tree with "inverse_perm" set gets the table, so readers needn't
+ compute it.
+ */
 void startree_compute_inverse_perm(startree_t* s);
 
 int startree_check_inverse_perm(startree_t* s);
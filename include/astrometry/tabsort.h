@@ -6,7 +6,24 @@
 #ifndef TABSORT_H
 #define TABSORT_H
 
+#include <stdint.h>
+
+/**
+ Sorts the rows of each table extension of "infn" by the (FITS type D, E
+ or K) column "colname", writing "outfn".  The sort is stable.
+ */
 int tabsort(const char* infn, const char* outfn, const char* colname,
             int descending);
 
+/**
+ Like tabsort(), for tables too big to sort in memory: sorts runs of
+ "runrows" rows on "nthreads" threads, spills each sorted run to a temp
+ file in "tempdir" (NULL: the default temp dir), and merges the runs into
+ the output.  The output is identical to tabsort()'s.  Tables of at most
+ "runrows" rows are sorted in memory.
+ */
+int tabsort_external(const char* infn, const char* outfn, const char* colname,
+                     int descending, int64_t runrows, int nthreads,
+                     const char* tempdir);
+
 #endif
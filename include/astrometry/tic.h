@@ -19,4 +19,57 @@ double millis_between(struct timeval* tv1, struct timeval* tv2);
 // You probably only want to look at differences in the values returned by this function.
 double timenow();
 
+/*
+ Hierarchical profiling: nested, named regions, timed per thread.
+
+     PROFILE_BEGIN("verify");
+     ...
+     PROFILE_END("verify");
+
+ Regions nest within the region that is open on the same thread, and
+ repeated entries into the same region (with the same parent) are
+ summed.  Names must be string literals (or otherwise outlive the
+ profile).  When profiling is off, each macro is a single test of
+ "profile_enabled".
+ */
+extern int profile_enabled;
+
+#define PROFILE_BEGIN(name) \
+    do { if (profile_enabled) profile_push(name); } while (0)
+#define PROFILE_END(name) \
+    do { if (profile_enabled) profile_pop(name); } while (0)
+
+void profile_push(const char* name);
+void profile_pop(const char* name);
+
+void profile_enable(int enable);
+
+/*
+ If the environment variable AN_PROFILE is set, turns profiling on, and
+ arranges for the profile to be appended to the file it names when the
+ process exits, with "progname" as the root frame of the stacks.
+ Returns 1 if profiling was turned on.
+ */
+int profile_enable_from_env(const char* progname);
+
+/*
+ If profiling was turned on by AN_PROFILE, appends the profile so far to
+ that file, with "root" as the root frame, and resets it: eg, once per
+ job in a program that runs several.
+ */
+int profile_flush(const char* root);
+
+/*
+ Writes the profile, in the "folded stacks" format that flame-graph tools
+ read: one line per region, "root;outer;inner <microseconds>", where the
+ value is the time spent in that region but not in the regions nested in
+ it.  Regions with the same stack on different threads are written once,
+ summed.  Call it when no other threads are inside a region.
+ */
+int profile_write(FILE* fid, const char* root);
+int profile_append_to_file(const char* fn, const char* root);
+
+// Forgets all the times collected so far.
+void profile_reset();
+
 #endif
@@ -83,6 +83,10 @@ typedef struct tweak_s {
     // Weighted or unweighted fit?
     anbool weighted_fit;
 
+    // Threads for the Hough shift search (0: one per CPU; it only
+    // uses them for large star lists).
+    int nthreads;
+
     // push SIP shift term onto CRPIX, or CRVAL?
     // traditional behavior is CRPIX; ie push_crval = FALSE.
     //anbool push_crval;
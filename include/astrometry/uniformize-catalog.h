@@ -44,6 +44,10 @@ int uniformize_catalog(fitstable_t* intable, fitstable_t* outtable,
                        int finenside,
                        double dedup_radius_arcsec,
                        int nsweeps,
+                       // threads for placing the stars in the cells
+                       // (-1: one per CPU); the selection is the same
+                       // for any number of threads.
+                       int nthreads,
                        char** args, int argc);
 
 #endif
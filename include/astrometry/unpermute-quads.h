@@ -17,14 +17,16 @@
  In:  .quad, .ckdt
  Out: .quad, .ckdt
 
+ The quads are gathered through the permutation on "nthreads" threads.
+
  Original author: dstn
  */
 int unpermute_quads_files(const char* quadinfn, const char* ckdtinfn,
                           const char* quadoutfn, const char* ckdtoutfn,
-                          char** args, int argc);
+                          int nthreads, char** args, int argc);
 
 int unpermute_quads(quadfile_t* quadin, codetree_t* ckdtin,
                     quadfile_t* quadout, codetree_t** ckdtout,
-                    char** args, int argc);
+                    int nthreads, char** args, int argc);
 
 #endif
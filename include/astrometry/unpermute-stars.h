@@ -19,19 +19,21 @@
  In:  .quad, .skdt
  Out: .quad, .skdt
 
+ The quads and tag-along rows are rewritten on "nthreads" threads.
+
  Original author: dstn
  */
 int unpermute_stars_files(const char* skdtinfn, const char* quadinfn,
                           const char* skdtoutfn, const char* quadoutfn,
-                          anbool sweep, anbool check,
+                          anbool sweep, anbool check, int nthreads,
                           char** args, int argc);
 
 int unpermute_stars(startree_t* starkdin, quadfile_t* quadin,
                     startree_t** starkdout, quadfile_t* quadout,
-                    anbool sweep, anbool check,
+                    anbool sweep, anbool check, int nthreads,
                     char** args, int argc);
 
 int unpermute_stars_tagalong(startree_t* starkdin,
-                             fitstable_t* tagalong_out);
+                             fitstable_t* tagalong_out, int nthreads);
 
 #endif
@@ -18,9 +18,17 @@ struct verify_field_t {
     const starxy_t* field;
     // this copy is normal.
     double* xy;
-    // this copy is permuted by the kdtree
-    double* fieldcopy;
-    kdtree_t* ftree;
+
+    // The field stars bucketed into a uniform grid of square cells (in
+    // pixel space), for finding nearby field stars.  The stars in cell
+    // (ix, iy) are gridstars[gridstart[c] : gridstart[c+1]], with
+    // c = iy * gridnx + ix; gridxy holds their positions in that order.
+    double gridx0, gridy0;
+    double gridcell;
+    int gridnx, gridny;
+    int* gridstart;
+    int* gridstars;
+    double* gridxy;
 
     // should this field be spatially uniformized at the index's scale?
     anbool do_uniformize;
@@ -28,17 +36,32 @@ struct verify_field_t {
     anbool do_dedup;
     // apply radius-of-relevance filtering
     anbool do_ror;
+
+    // reference stars found near recently-verified candidates; see
+    // verify_hit().
+    struct verify_cache* cache;
 };
 typedef struct verify_field_t verify_field_t;
 
 
 /*
  This function must be called once for each field before verification
- begins.  We build a kdtree out of the field stars (in pixel space)
+ begins.  We build a grid over the field stars (in pixel space)
  which will be used during deduplication.
+
+ The result may be shared by threads calling verify_hit().
  */
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy);
 
+/*
+ Searches the index for the stars within the circle and keeps them with
+ the field, so that the verify_hit() calls for candidates whose fields
+ fall inside the circle needn't search the index themselves.
+ */
+void verify_field_prefetch_index_stars(verify_field_t* vf,
+                                       const startree_t* skdt,
+                                       const double* center, double r2);
+
 /*
  This function must be called after all verification calls for a field
  are finished; we clean up the data structures we created in the
@@ -51,6 +74,15 @@ void verify_field_free(verify_field_t* vf);
 
 void verify_count_hits(int* theta, int besti, int* p_nmatch, int* p_nconflict, int* p_ndistractor);
 
+/*
+ By default, the verification functions match stars in blocks, with a
+ fast approximate log(); the log-odds can differ from the original,
+ scalar, loop in the last few bits, and exactly-tied nearest
+ neighbours may be broken differently.  With "exact" = TRUE, the
+ original loop is used.  This setting is global.
+ */
+void verify_set_exact(anbool exact);
+
 void verify_wcs(const startree_t* skdt,
                 int index_cutnside,
                 const sip_t* sip,
@@ -13,6 +13,7 @@ int wcs_rd2xy(const char* wcsfn, int wcsext,
               const char* racol, const char* deccol,
               int forcetan,
               int forcewcslib,
+              int invgrid,
               il* fields);
 
 #endif
@@ -0,0 +1,83 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef XYLIST_FILTER_H
+#define XYLIST_FILTER_H
+
+#include "astrometry/an-bool.h"
+#include "astrometry/starxy.h"
+
+/**
+ In-memory versions of the source-list filters that augment-xylist
+ runs: "removelines" and "uniformize" (as in util/removelines.py and
+ util/uniformize.py) and the brightness sort of resort-xylist.
+ */
+
+// removelines.py's default significance cut.
+#define REMOVELINES_DEFAULT_CUT 100
+
+/**
+ Finds sources that lie in suspiciously crowded one-pixel-wide columns
+ or rows (eg, bleed trails and bad columns): a column or row is cut if
+ its count is less likely than exp(-cut) under a Poisson model.  Sets
+ keep[i] = FALSE for those sources (and leaves the others alone).
+ Returns the number of sources cut.
+ */
+int removelines(const double* x, const double* y, int N, double cut,
+                anbool* keep);
+
+/**
+ Returns the order in which to list sources so that they spread evenly
+ across the image: the sources are binned into about "nboxes" boxes,
+ and the result takes the first source of each box, then the second,
+ and so on (keeping the input order within each round).  Sources with
+ non-finite positions are dropped.  The number of sources in the result
+ is put in "*pN".
+ */
+int* uniformize(const double* x, const double* y, int N, int nboxes,
+                int* pN);
+
+/**
+ Returns the brightness order used by resort-xylist: alternately the
+ next source by "flux" and the next by "flux + background" (ie, before
+ background subtraction), skipping sources already taken.  For large
+ lists the two sorts run on two threads.
+ */
+int* resort_flux_background(const double* flux, const double* background,
+                            int N, anbool ascending);
+
+/**
+ The first min(K, N) entries of resort_flux_background(), found by
+ partially sorting only the brightest K by each measure.
+ */
+int* resort_flux_background_topk(const double* flux,
+                                 const double* background,
+                                 int N, anbool ascending, int K);
+
+/**
+ removelines() on a source list: drops the sources in crowded columns
+ and rows, keeping the order of the others.  Returns the number cut.
+ */
+int starxy_removelines(starxy_t* xy, double cut);
+
+/**
+ uniformize() on a source list: reorders it (and drops sources with
+ non-finite positions).
+ */
+void starxy_uniformize(starxy_t* xy, int nboxes);
+
+/**
+ The "removelines" and "uniformize" programs, in-process: filters each
+ table extension of the xylist "infn" (with columns "xcol" and "ycol",
+ NULL for "X" and "Y"), writing all its columns for the sources kept,
+ in the new order, to "outfn".  The primary header is copied as-is.
+ Returns 0 on success.
+ */
+int removelines_file(const char* infn, const char* outfn,
+                     const char* xcol, const char* ycol, double cut);
+
+int uniformize_file(const char* infn, const char* outfn,
+                    const char* xcol, const char* ycol, int nboxes);
+
+#endif
@@ -137,6 +137,19 @@ starxy_t* xylist_read_field(xylist_t* ls, starxy_t* fld);
 
 starxy_t* xylist_read_field_num(xylist_t* ls, int ext, starxy_t* fld);
 
+/**
+ Reads only rows [offset, offset + N) of the current field (N < 0: to
+ the end; it is also cut short at the end), straight from the table
+ without reading the rest.  Since resort-xylist leaves the sources
+ sorted brightest-first, xylist_read_field_rows(ls, 0, N, fld) reads
+ the N brightest.  "fld" is as in xylist_read_field().
+ */
+starxy_t* xylist_read_field_rows(xylist_t* ls, int offset, int N,
+                                 starxy_t* fld);
+
+// The number of rows in the current field, or -1 if it can't be read.
+int xylist_get_nrows(xylist_t* ls);
+
 int xylist_fix_header(xylist_t* ls);
 
 int xylist_close(xylist_t* ls);
@@ -0,0 +1,626 @@
+/*
+ # This file is part of libkd.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Timings of the libkd tree types (ddd, fff, lll, ddu, duu, dds, dss)
+ on the same points: tree building, single-point range searches and
+ nearest-neighbour searches, and the dual-tree self-match and
+ nearest-neighbour searches that spherematch does.  The points are
+ either synthetic stars on the sky (uniform, or clustered like a real
+ catalog) or the data of a kd-tree file, eg the star tree of an index.
+ Random numbers come from a fixed seed, so runs on different commits
+ can be compared; "-j" and "-o" write the results as JSON.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "os-features.h"
+#include "kdtree.h"
+#include "kdtree_fits_io.h"
+#include "dualtree_rangesearch.h"
+#include "dualtree_nearestneighbour.h"
+#include "mathutil.h"
+#include "starutil.h"
+#include "tic.h"
+#include "errors.h"
+#include "log.h"
+
+static const char* OPTIONS = "hvi:n:N:q:d:R:m:L:r:t:jo:";
+
+struct treetype {
+    const char* name;
+    int treetype;
+};
+
+static const struct treetype treetypes[] = {
+    { "ddd", KDTT_DOUBLE },
+    { "fff", KDTT_FLOAT },
+    { "lll", KDTT_U64 },
+    { "ddu", KDTT_DDU },
+    { "duu", KDTT_DUU },
+    { "dds", KDTT_DOUBLE_U16 },
+    { "dss", KDTT_DSS },
+};
+#define N_TREETYPES (sizeof(treetypes) / sizeof(struct treetype))
+
+static const struct {
+    const char* name;
+    unsigned int options;
+} buildopts[] = {
+    { "bbox",  KD_BUILD_BBOX },
+    { "split", KD_BUILD_SPLIT },
+};
+#define N_BUILDOPTS (sizeof(buildopts) / sizeof(buildopts[0]))
+
+// synthetic data: fraction of the stars in clumps, number and size of
+// the clumps.
+#define CLUMP_FRACTION 0.7
+#define N_CLUMPS 50
+#define CLUMP_SIGMA_DEG 2.0
+
+// the U64 trees get the data scaled to this range.
+#define U64_RANGE 4294967296.0
+
+void printHelp(char* progname) {
+    printf("\nUsage: %s [options]\n"
+           "    [-i <kd-tree file>]: use the points of this tree (eg, an index file)\n"
+           "        [-n <tree name>]: the tree to read (default: the first one)\n"
+           "    [-d <distribution>]: synthetic stars on the sky: \"uniform\" or\n"
+           "                         \"clustered\" (default)\n"
+           "    [-N <n>]: number of synthetic stars (default 200000)\n"
+           "    [-q <n>]: number of query points (default 20000)\n"
+           "    [-R <radius>]: range-search radius, in degrees for points on the\n"
+           "                   sky (default 0.5), else in data units (required)\n"
+           "    [-m <radius>]: dual-tree match radius, likewise (default R/10)\n"
+           "    [-L <n>]: points per leaf node (default 10)\n"
+           "    [-r <n>]: repeat each timing this many times and keep the best\n"
+           "              (default 3)\n"
+           "    [-t <types>]: comma-separated tree types to time (default all of\n"
+           "                  ddd,fff,lll,ddu,duu,dds,dss)\n"
+           "    [-j]: print the results as JSON\n"
+           "    [-o <file>]: write the JSON results to this file\n"
+           "    [-v]: +verbose\n"
+           "\n", progname);
+}
+
+struct config {
+    const char* source;
+    int N;
+    int D;
+    int Q;
+    int Nleaf;
+    int repeats;
+    // the points and queries are unit vectors; radii are in degrees.
+    anbool sky;
+    double radius;
+    double match_radius;
+    // in data units
+    double maxd2;
+    double match_maxd2;
+};
+
+struct tree_result {
+    const char* type;
+    const char* build;
+    size_t bytes;
+    double build_seconds;
+    double rs_seconds;
+    long long rs_results;
+    double nn_seconds;
+    double nn_mean_d2;
+    // dual-tree searches, where the tree type supports them.
+    anbool dualtree;
+    double dt_seconds;
+    long long dt_pairs;
+    anbool dualtree_nn;
+    double dtnn_seconds;
+    int dtnn_matched;
+};
+
+static double uniform(void) {
+    return rand() / (double)RAND_MAX;
+}
+
+static double gaussian(void) {
+    double u1 = (rand() + 1.0) / ((double)RAND_MAX + 1.0);
+    double u2 = uniform();
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static void random_sky(double* xyz) {
+    radecdeg2xyzarr(360.0 * uniform(), rad2deg(asin(2.0 * uniform() - 1.0)),
+                    xyz);
+}
+
+// moves "xyz" by a Gaussian of "sigma" (in distance units) and
+// renormalizes.
+static void jitter(double* xyz, int D, double sigma, anbool sky) {
+    int d;
+    for (d=0; d<D; d++)
+        xyz[d] += sigma * gaussian();
+    if (sky)
+        normalize_3(xyz);
+}
+
+static double* synthetic_stars(int N, anbool clustered) {
+    double* xyz = malloc((size_t)N * 3 * sizeof(double));
+    double centers[N_CLUMPS * 3];
+    double sigma = deg2dist(CLUMP_SIGMA_DEG);
+    int i;
+    for (i=0; i<N_CLUMPS; i++)
+        random_sky(centers + i*3);
+    for (i=0; i<N; i++) {
+        double* p = xyz + i*3;
+        if (clustered && uniform() < CLUMP_FRACTION) {
+            memcpy(p, centers + 3*(rand() % N_CLUMPS), 3 * sizeof(double));
+            jitter(p, 3, sigma, TRUE);
+        } else
+            random_sky(p);
+    }
+    return xyz;
+}
+
+static double* read_tree_points(const char* fn, const char* treename,
+                                int* pN, int* pD) {
+    kdtree_t* kd;
+    double* data;
+    kd = kdtree_fits_read(fn, treename, NULL);
+    if (!kd) {
+        ERROR("Failed to read kd-tree from %s", fn);
+        return NULL;
+    }
+    *pN = kdtree_n(kd);
+    *pD = kd->ndim;
+    data = malloc((size_t)(*pN) * (*pD) * sizeof(double));
+    kdtree_copy_data_double(kd, 0, *pN, data);
+    kdtree_fits_close(kd);
+    return data;
+}
+
+// Query points near the data points, so they follow the same
+// distribution.
+static double* make_queries(const double* data, const struct config* c) {
+    double* q = malloc((size_t)c->Q * c->D * sizeof(double));
+    double sigma = sqrt(c->maxd2);
+    int i;
+    for (i=0; i<c->Q; i++) {
+        double* p = q + i * c->D;
+        memcpy(p, data + (size_t)(rand() % c->N) * c->D,
+               c->D * sizeof(double));
+        jitter(p, c->D, sigma, c->sky);
+    }
+    return q;
+}
+
+/*
+ The points in the external type of tree type "tt"; U64 trees get the
+ data offset and scaled by "u64scale" to fit.  Returns a new array.
+ */
+static void* convert_points(const double* x, size_t n, int tt,
+                            const double* lo, int D, double u64scale) {
+    size_t i;
+    if (tt & KDT_EXT_FLOAT) {
+        float* f = malloc(n * sizeof(float));
+        for (i=0; i<n; i++)
+            f[i] = x[i];
+        return f;
+    }
+    if (tt & KDT_EXT_U64) {
+        uint64_t* u = malloc(n * sizeof(uint64_t));
+        for (i=0; i<n; i++)
+            u[i] = (uint64_t)fmax(0.0, round((x[i] - lo[i % D]) * u64scale));
+        return u;
+    }
+    {
+        double* d = malloc(n * sizeof(double));
+        memcpy(d, x, n * sizeof(double));
+        return d;
+    }
+}
+
+static size_t tree_bytes(const kdtree_t* kd) {
+    return kdtree_sizeof_lr(kd) + kdtree_sizeof_perm(kd) +
+        kdtree_sizeof_bb(kd) + kdtree_sizeof_split(kd) +
+        kdtree_sizeof_splitdim(kd) + kdtree_sizeof_data(kd);
+}
+
+static void count_pair(void* v, int xind, int yind, double dist2) {
+    (*(long long*)v)++;
+}
+
+static kdtree_t* build(const void* points, int N, int tt, unsigned int opts,
+                       const struct config* c, const double* lo,
+                       const double* hi, void** pdata) {
+    size_t sz = (tt & KDT_EXT_FLOAT) ? sizeof(float) :
+        (tt & KDT_EXT_U64) ? sizeof(uint64_t) : sizeof(double);
+    kdtree_t* kd = NULL;
+    // (the tree permutes the data in place, so give it a copy.)
+    *pdata = malloc((size_t)N * c->D * sz);
+    memcpy(*pdata, points, (size_t)N * c->D * sz);
+    if (tt & (KDT_TREE_U32 | KDT_TREE_U16)) {
+        // integer trees of double data need the limits set.
+        kd = kdtree_new(N, c->D, c->Nleaf);
+        kdtree_set_limits(kd, (double*)lo, (double*)hi);
+    }
+    return kdtree_build(kd, *pdata, N, c->D, c->Nleaf, tt, opts);
+}
+
+static int bench_tree(struct tree_result* tr, const struct treetype* t,
+                      unsigned int opts, const double* data,
+                      const double* queries, const struct config* c,
+                      const double* lo, const double* hi,
+                      double u64scale) {
+    int tt = t->treetype;
+    double scale2 = (tt & KDT_EXT_U64) ? u64scale * u64scale : 1.0;
+    double maxd2 = c->maxd2 * scale2;
+    size_t esize;
+    void* points;
+    void* qpts;
+    void* treedata = NULL;
+    kdtree_t* kd = NULL;
+    kdtree_qres_t* res = NULL;
+    int i, k;
+
+    tr->type = t->name;
+    esize = (tt & KDT_EXT_FLOAT) ? sizeof(float) :
+        (tt & KDT_EXT_U64) ? sizeof(uint64_t) : sizeof(double);
+    points = convert_points(data, (size_t)c->N * c->D, tt, lo, c->D, u64scale);
+    qpts = convert_points(queries, (size_t)c->Q * c->D, tt, lo, c->D, u64scale);
+
+    for (k=0; k<c->repeats; k++) {
+        double t0;
+        if (kd) {
+            kdtree_free(kd);
+            free(treedata);
+        }
+        t0 = timenow();
+        kd = build(points, c->N, tt, opts, c, lo, hi, &treedata);
+        t0 = timenow() - t0;
+        if (!kd) {
+            ERROR("Failed to build a %s tree", t->name);
+            free(points);
+            free(qpts);
+            free(treedata);
+            return -1;
+        }
+        if (k == 0 || t0 < tr->build_seconds)
+            tr->build_seconds = t0;
+    }
+    tr->bytes = tree_bytes(kd);
+
+    for (k=0; k<c->repeats; k++) {
+        long long nres = 0;
+        double t0 = timenow();
+        for (i=0; i<c->Q; i++) {
+            res = kdtree_rangesearch_options_reuse
+                (kd, res, (char*)qpts + (size_t)i * c->D * esize, maxd2,
+                 KD_OPTIONS_COMPUTE_DISTS | KD_OPTIONS_SORT_DISTS);
+            nres += res->nres;
+        }
+        t0 = timenow() - t0;
+        if (k == 0 || t0 < tr->rs_seconds)
+            tr->rs_seconds = t0;
+        tr->rs_results = nres;
+    }
+    kdtree_free_query(res);
+
+    for (k=0; k<c->repeats; k++) {
+        double sum = 0;
+        double t0 = timenow();
+        for (i=0; i<c->Q; i++) {
+            double d2;
+            kdtree_nearest_neighbour
+                (kd, (char*)qpts + (size_t)i * c->D * esize, &d2);
+            sum += d2;
+        }
+        t0 = timenow() - t0;
+        if (k == 0 || t0 < tr->nn_seconds)
+            tr->nn_seconds = t0;
+        tr->nn_mean_d2 = sum / scale2 / c->Q;
+    }
+
+    // The dual-tree range search passes points around as doubles, and
+    // both searches need bounding boxes to prune; the nearest-neighbour
+    // search reads the raw data, so only works with double data.
+    tr->dualtree = (tt & KDT_EXT_DOUBLE) && (opts & KD_BUILD_BBOX);
+    tr->dualtree_nn = tr->dualtree && (tt & KDT_DATA_DOUBLE);
+    for (k=0; tr->dualtree && k<c->repeats; k++) {
+        long long npairs = 0;
+        double t0 = timenow();
+        dualtree_rangesearch(kd, kd, RANGESEARCH_NO_LIMIT,
+                             sqrt(c->match_maxd2), TRUE, NULL,
+                             count_pair, &npairs, NULL, NULL);
+        t0 = timenow() - t0;
+        if (k == 0 || t0 < tr->dt_seconds)
+            tr->dt_seconds = t0;
+        tr->dt_pairs = npairs;
+    }
+    if (tr->dualtree_nn) {
+        void* qdata;
+        kdtree_t* qkd = build(queries, c->Q, tt, opts, c, lo, hi, &qdata);
+        for (k=0; k<c->repeats; k++) {
+            double* d2s = NULL;
+            int* inds = NULL;
+            int matched = 0;
+            double t0 = timenow();
+            dualtree_nearestneighbour(kd, qkd, c->maxd2, &d2s, &inds,
+                                      NULL, FALSE);
+            t0 = timenow() - t0;
+            if (k == 0 || t0 < tr->dtnn_seconds)
+                tr->dtnn_seconds = t0;
+            for (i=0; i<c->Q; i++)
+                if (inds[i] != -1)
+                    matched++;
+            tr->dtnn_matched = matched;
+            free(d2s);
+            free(inds);
+        }
+        kdtree_free(qkd);
+        free(qdata);
+    }
+
+    kdtree_free(kd);
+    free(treedata);
+    free(points);
+    free(qpts);
+    return 0;
+}
+
+static void print_text(const struct config* c, const struct tree_result* r,
+                       int nr) {
+    int i;
+    printf("%s: %i points in %i dimensions, %i queries, radius %g%s, "
+           "match radius %g%s\n", c->source, c->N, c->D, c->Q, c->radius,
+           c->sky ? " deg" : "", c->match_radius, c->sky ? " deg" : "");
+    printf("%-4s %-6s %10s %9s %12s %8s %12s %10s %10s\n", "type", "build",
+           "MB", "build(s)", "range/s", "results", "nn/s", "match(s)",
+           "dtnn(s)");
+    for (i=0; i<nr; i++) {
+        const struct tree_result* tr = r + i;
+        printf("%-4s %-6s %10.2f %9.3f %12.0f %8.2f %12.0f", tr->type,
+               tr->build, tr->bytes * 1e-6, tr->build_seconds,
+               c->Q / tr->rs_seconds, tr->rs_results / (double)c->Q,
+               c->Q / tr->nn_seconds);
+        if (tr->dualtree)
+            printf(" %10.3f", tr->dt_seconds);
+        else
+            printf(" %10s", "-");
+        if (tr->dualtree_nn)
+            printf(" %10.3f\n", tr->dtnn_seconds);
+        else
+            printf(" %10s\n", "-");
+    }
+}
+
+static void write_json(const struct config* c, const struct tree_result* r,
+                       int nr, FILE* fid) {
+    int i;
+    fprintf(fid, "{\n  \"data\": {\"source\": \"%s\", \"points\": %i, "
+            "\"dimensions\": %i, \"queries\": %i, \"leaf\": %i, "
+            "\"sky\": %s, \"radius\": %g, \"match_radius\": %g},\n",
+            c->source, c->N, c->D, c->Q, c->Nleaf, c->sky ? "true" : "false",
+            c->radius, c->match_radius);
+    fprintf(fid, "  \"repeats\": %i,\n  \"trees\": [\n", c->repeats);
+    for (i=0; i<nr; i++) {
+        const struct tree_result* tr = r + i;
+        fprintf(fid, "    {\"type\": \"%s\", \"build\": \"%s\", \"bytes\": %zu, "
+                "\"build_seconds\": %.6f, \"rangesearch_seconds\": %.6f, "
+                "\"rangesearch_results\": %lld, \"nn_seconds\": %.6f, "
+                "\"nn_mean_d2\": %.6g, ", tr->type, tr->build, tr->bytes,
+                tr->build_seconds, tr->rs_seconds, tr->rs_results,
+                tr->nn_seconds, tr->nn_mean_d2);
+        if (tr->dualtree)
+            fprintf(fid, "\"dualtree_seconds\": %.6f, \"dualtree_pairs\": %lld, ",
+                    tr->dt_seconds, tr->dt_pairs);
+        else
+            fprintf(fid, "\"dualtree_seconds\": null, \"dualtree_pairs\": null, ");
+        if (tr->dualtree_nn)
+            fprintf(fid, "\"dualtree_nn_seconds\": %.6f, \"dualtree_nn_matched\": %i}",
+                    tr->dtnn_seconds, tr->dtnn_matched);
+        else
+            fprintf(fid, "\"dualtree_nn_seconds\": null, \"dualtree_nn_matched\": null}");
+        fprintf(fid, "%s\n", (i+1 < nr) ? "," : "");
+    }
+    fprintf(fid, "  ]\n}\n");
+}
+
+static anbool type_selected(const char* types, const char* name) {
+    const char* s = types;
+    size_t n = strlen(name);
+    if (!types)
+        return TRUE;
+    while (s && *s) {
+        if (!strncmp(s, name, n) && (s[n] == ',' || s[n] == '\0'))
+            return TRUE;
+        s = strchr(s, ',');
+        if (s)
+            s++;
+    }
+    return FALSE;
+}
+
+int main(int argc, char** argv) {
+    int argchar;
+    char* treefn = NULL;
+    char* treename = NULL;
+    char* dist = "clustered";
+    char* types = NULL;
+    char* jsonfn = NULL;
+    anbool json = FALSE;
+    int loglvl = LOG_MSG;
+    struct config c;
+    struct tree_result* results;
+    int nr = 0;
+    double* data;
+    double* queries;
+    double lo[64], hi[64];
+    double range = 0, u64scale;
+    size_t i, j;
+    int d, rtn = 0;
+
+    memset(&c, 0, sizeof(c));
+    c.N = 200000;
+    c.Q = 20000;
+    c.Nleaf = 10;
+    c.repeats = 3;
+    c.radius = -1;
+    c.match_radius = -1;
+
+    while ((argchar = getopt(argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'i':
+            treefn = optarg;
+            break;
+        case 'n':
+            treename = optarg;
+            break;
+        case 'd':
+            dist = optarg;
+            break;
+        case 'N':
+            c.N = atoi(optarg);
+            break;
+        case 'q':
+            c.Q = atoi(optarg);
+            break;
+        case 'R':
+            c.radius = atof(optarg);
+            break;
+        case 'm':
+            c.match_radius = atof(optarg);
+            break;
+        case 'L':
+            c.Nleaf = atoi(optarg);
+            break;
+        case 'r':
+            c.repeats = atoi(optarg);
+            break;
+        case 't':
+            types = optarg;
+            break;
+        case 'j':
+            json = TRUE;
+            break;
+        case 'o':
+            jsonfn = optarg;
+            break;
+        case 'v':
+            loglvl++;
+            break;
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            printHelp(argv[0]);
+            exit(-1);
+        }
+    if (c.N < 1 || c.Q < 1 || c.Nleaf < 1 || c.repeats < 1) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+    log_init(loglvl);
+    srand(42);
+
+    if (treefn) {
+        data = read_tree_points(treefn, treename, &c.N, &c.D);
+        if (!data)
+            exit(-1);
+        c.source = treefn;
+        // star trees hold unit vectors.
+        c.sky = (c.D == 3);
+    } else {
+        if (strcmp(dist, "uniform") && strcmp(dist, "clustered")) {
+            printHelp(argv[0]);
+            exit(-1);
+        }
+        data = synthetic_stars(c.N, !strcmp(dist, "clustered"));
+        c.source = dist;
+        c.D = 3;
+        c.sky = TRUE;
+    }
+    if (c.D > (int)(sizeof(lo) / sizeof(double))) {
+        ERROR("Too many dimensions: %i", c.D);
+        exit(-1);
+    }
+    if (c.radius < 0) {
+        if (!c.sky) {
+            ERROR("Need a search radius (-R) for %i-dimensional data", c.D);
+            exit(-1);
+        }
+        c.radius = 0.5;
+    }
+    if (c.match_radius < 0)
+        c.match_radius = c.radius / 10.0;
+    if (c.sky) {
+        c.maxd2 = deg2distsq(c.radius);
+        c.match_maxd2 = deg2distsq(c.match_radius);
+    } else {
+        c.maxd2 = square(c.radius);
+        c.match_maxd2 = square(c.match_radius);
+    }
+    queries = make_queries(data, &c);
+
+    // the U64 trees get all the points and queries scaled to the same
+    // range.
+    for (d=0; d<c.D; d++) {
+        lo[d] = HUGE_VAL;
+        hi[d] = -HUGE_VAL;
+    }
+    for (i=0; i<(size_t)c.N; i++)
+        for (d=0; d<c.D; d++) {
+            lo[d] = fmin(lo[d], data[i*c.D + d]);
+            hi[d] = fmax(hi[d], data[i*c.D + d]);
+        }
+    for (i=0; i<(size_t)c.Q; i++)
+        for (d=0; d<c.D; d++) {
+            lo[d] = fmin(lo[d], queries[i*c.D + d]);
+            hi[d] = fmax(hi[d], queries[i*c.D + d]);
+        }
+    for (d=0; d<c.D; d++)
+        range = fmax(range, hi[d] - lo[d]);
+    u64scale = (range > 0) ? U64_RANGE / range : 1.0;
+
+    results = calloc(N_TREETYPES * N_BUILDOPTS, sizeof(struct tree_result));
+    for (i=0; i<N_TREETYPES; i++) {
+        if (!type_selected(types, treetypes[i].name))
+            continue;
+        for (j=0; j<N_BUILDOPTS; j++) {
+            struct tree_result* tr = results + nr;
+            logverb("Timing %s tree with %s\n", treetypes[i].name,
+                    buildopts[j].name);
+            tr->build = buildopts[j].name;
+            if (bench_tree(tr, treetypes + i, buildopts[j].options, data,
+                           queries, &c, lo, hi, u64scale)) {
+                rtn = -1;
+                continue;
+            }
+            nr++;
+        }
+    }
+
+    if (json)
+        write_json(&c, results, nr, stdout);
+    else
+        print_text(&c, results, nr);
+    if (jsonfn) {
+        FILE* fid = fopen(jsonfn, "w");
+        if (!fid) {
+            SYSERROR("Failed to open %s", jsonfn);
+            rtn = -1;
+        } else {
+            write_json(&c, results, nr, fid);
+            fclose(fid);
+        }
+    }
+    free(results);
+    free(queries);
+    free(data);
+    return rtn;
+}
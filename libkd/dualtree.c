@@ -3,7 +3,10 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
+#include <stdlib.h>
+
 #include "dualtree.h"
+#include "kdtree_internal.h"
 #include "bl.h"
 
 /*
@@ -148,3 +151,139 @@ void dualtree_search(kdtree_t* xtree, kdtree_t* ytree,
     il_free(leaves);
 }
 
+// A call to dualtree_recurse() that the search would make.
+struct dualtree_task {
+    int ynode;
+    il* nodes;
+    il* leaves;
+};
+typedef struct dualtree_task dualtree_task;
+
+struct dualtree_tasks {
+    kdtree_t* xtree;
+    kdtree_t* ytree;
+    dualtree_task* tasks;
+    int ntasks;
+};
+
+dualtree_tasks* dualtree_tasks_new(kdtree_t* xtree, kdtree_t* ytree,
+                                   dualtree_callbacks* callbacks,
+                                   int ntasks) {
+    dualtree_tasks* dt = calloc(1, sizeof(dualtree_tasks));
+    dualtree_task* next;
+    anbool split;
+    int i, j, n;
+
+    dt->xtree = xtree;
+    dt->ytree = ytree;
+    dt->tasks = malloc(sizeof(dualtree_task));
+    dt->ntasks = 1;
+    dt->tasks[0].ynode = 0;
+    dt->tasks[0].nodes = il_new(32);
+    dt->tasks[0].leaves = il_new(32);
+    if (KD_IS_LEAF(xtree, 0))
+        il_append(dt->tasks[0].leaves, 0);
+    else
+        il_append(dt->tasks[0].nodes, 0);
+
+    // Take the search down one level of the query tree at a time, doing
+    // what dualtree_recurse() does on the way down, until there are
+    // enough tasks.  Tasks that would produce results right away (query
+    // leaves, or no search nodes left) stay as they are.  The tasks stay
+    // in depth-first order.
+    for (split = TRUE; split && dt->ntasks < ntasks;) {
+        split = FALSE;
+        next = malloc(2 * dt->ntasks * sizeof(dualtree_task));
+        n = 0;
+        for (i=0; i<dt->ntasks; i++) {
+            dualtree_task* t = dt->tasks + i;
+            il* childnodes;
+            if (KD_IS_LEAF(ytree, t->ynode) || !il_size(t->nodes)) {
+                next[n++] = *t;
+                continue;
+            }
+            childnodes = il_new(32);
+            for (j=0; j<il_size(t->nodes); j++) {
+                int child1, child2;
+                int xnode = il_get(t->nodes, j);
+                if (!callbacks->decision(callbacks->decision_extra,
+                                         xtree, xnode, ytree, t->ynode))
+                    continue;
+                child1 = KD_CHILD_LEFT(xnode);
+                child2 = KD_CHILD_RIGHT(xnode);
+                if (KD_IS_LEAF(xtree, child1)) {
+                    il_append(t->leaves, child1);
+                    il_append(t->leaves, child2);
+                } else {
+                    il_append(childnodes, child1);
+                    il_append(childnodes, child2);
+                }
+            }
+            next[n].ynode = KD_CHILD_LEFT(t->ynode);
+            next[n].nodes = childnodes;
+            next[n].leaves = t->leaves;
+            n++;
+            next[n].ynode = KD_CHILD_RIGHT(t->ynode);
+            next[n].nodes = il_dupe(childnodes);
+            next[n].leaves = il_dupe(t->leaves);
+            n++;
+            il_free(t->nodes);
+            split = TRUE;
+        }
+        free(dt->tasks);
+        dt->tasks = next;
+        dt->ntasks = n;
+    }
+    return dt;
+}
+
+int dualtree_tasks_count(const dualtree_tasks* dt) {
+    return dt->ntasks;
+}
+
+void dualtree_tasks_run(dualtree_tasks* dt, int i,
+                        dualtree_callbacks* callbacks) {
+    dualtree_task* t = dt->tasks + i;
+    dualtree_recurse(dt->xtree, dt->ytree, t->nodes, t->leaves, t->ynode,
+                     callbacks);
+}
+
+void dualtree_tasks_free(dualtree_tasks* dt) {
+    int i;
+    if (!dt)
+        return;
+    for (i=0; i<dt->ntasks; i++) {
+        il_free(dt->tasks[i].nodes);
+        il_free(dt->tasks[i].leaves);
+    }
+    free(dt->tasks);
+    free(dt);
+}
+
+struct search_threads {
+    dualtree_tasks* tasks;
+    dualtree_callbacks* callbacks;
+};
+
+static int run_tasks(void* varg, int lo, int hi) {
+    struct search_threads* a = varg;
+    int i;
+    for (i=lo; i<hi; i++)
+        dualtree_tasks_run(a->tasks, i, a->callbacks);
+    return 0;
+}
+
+void dualtree_search_threads(kdtree_t* xtree, kdtree_t* ytree,
+                             dualtree_callbacks* callbacks, int nthreads) {
+    struct search_threads a;
+    if (nthreads <= 1) {
+        dualtree_search(xtree, ytree, callbacks);
+        return;
+    }
+    a.tasks = dualtree_tasks_new(xtree, ytree, callbacks,
+                                 DUALTREE_TASKS_PER_THREAD * nthreads);
+    a.callbacks = callbacks;
+    kdtree_parallel_for(nthreads, dualtree_tasks_count(a.tasks), 1,
+                        run_tasks, &a);
+    dualtree_tasks_free(a.tasks);
+}
@@ -37,6 +37,15 @@ void dualtree_nearestneighbour(kdtree_t* xtree, kdtree_t* ytree, double maxdist2
                                double** nearest_d2, int** nearest_ind,
                                int** count_in_range,
                                int notself) {
+    dualtree_nearestneighbour_threads(xtree, ytree, maxdist2, nearest_d2,
+                                      nearest_ind, count_in_range, notself, 1);
+}
+
+void dualtree_nearestneighbour_threads(kdtree_t* xtree, kdtree_t* ytree,
+                                       double maxdist2,
+                                       double** nearest_d2, int** nearest_ind,
+                                       int** count_in_range,
+                                       int notself, int nthreads) {
     int i, NY, NNY;
 
     // dual-tree search callback functions
@@ -94,8 +103,11 @@ void dualtree_nearestneighbour(kdtree_t* xtree, kdtree_t* ytree, double maxdist2
     params.node_nearest_d2 = malloc(NNY * sizeof(double));
     for (i=0; i<NNY; i++)
         params.node_nearest_d2[i] = maxdist2;
-    
-    dualtree_search(xtree, ytree, &callbacks);
+
+    // The callbacks for a query node only touch the entries of the
+    // arrays above for that node, its children and its points, so
+    // different query subtrees can be searched at once without locking.
+    dualtree_search_threads(xtree, ytree, &callbacks, nthreads);
 
     // Return array addresses
     *nearest_d2 = params.nearest_d2;
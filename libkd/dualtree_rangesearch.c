@@ -4,9 +4,13 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 
+#include "os-features.h"
 #include "dualtree_rangesearch.h"
 #include "dualtree.h"
+#include "kdtree_internal.h"
+#include "bl.h"
 #include "mathutil.h"
 
 double RANGESEARCH_NO_LIMIT = 1.12345e308;
@@ -50,35 +54,30 @@ static double mydistsq(void* v1, void* v2, int D) {
     return distsq((double*)v1, (double*)v2, D);
 }
 
-void dualtree_rangesearch(kdtree_t* xtree, kdtree_t* ytree,
-                          double mindist, double maxdist,
-                          int notself,
-                          dist2_function distsquared,
-                          result_callback callback,
-                          void* param,
-                          progress_callback progress,
-                          void* progress_param) {
-    // dual-tree search callback functions
-    dualtree_callbacks callbacks;
-    rs_params params;
-
-    memset(&callbacks, 0, sizeof(dualtree_callbacks));
-    callbacks.decision = rs_within_range;
-    callbacks.decision_extra = &params;
-    callbacks.result = rs_handle_result;
-    callbacks.result_extra = &params;
+static void init_search(rs_params* params, dualtree_callbacks* callbacks,
+                        kdtree_t* xtree, kdtree_t* ytree,
+                        double mindist, double maxdist,
+                        int notself,
+                        dist2_function distsquared,
+                        result_callback callback,
+                        void* param) {
+    memset(callbacks, 0, sizeof(dualtree_callbacks));
+    callbacks->decision = rs_within_range;
+    callbacks->decision_extra = params;
+    callbacks->result = rs_handle_result;
+    callbacks->result_extra = params;
 
     // set search params
-    memset(&params, 0, sizeof(params));
+    memset(params, 0, sizeof(rs_params));
     if ((mindist == RANGESEARCH_NO_LIMIT) || (mindist == 0.0)) {
-        params.usemin = FALSE;
+        params->usemin = FALSE;
     } else {
-        params.usemin = TRUE;
-        params.mindistsq = mindist * mindist;
+        params->usemin = TRUE;
+        params->mindistsq = mindist * mindist;
     }
 
     if (maxdist == RANGESEARCH_NO_LIMIT) {
-        params.usemax = FALSE;
+        params->usemax = FALSE;
     } else {
         double d = maxdist;
         /*
@@ -88,20 +87,36 @@ void dualtree_rangesearch(kdtree_t* xtree, kdtree_t* ytree,
          d = kdtree_get_conservative_query_radius(ytree, d);
          printf("Conservative distance in tree 2: %.16g\n", d);
          */
-        params.usemax = TRUE;
-        params.maxdistsq = d*d;
+        params->usemax = TRUE;
+        params->maxdistsq = d*d;
     }
-    params.notself = notself;
+    params->notself = notself;
 
     if (distsquared)
-        params.distsquared = distsquared;
+        params->distsquared = distsquared;
     else
-        params.distsquared = mydistsq;
+        params->distsquared = mydistsq;
+
+    params->user_callback = callback;
+    params->user_callback_param = param;
+    params->xtree = xtree;
+    params->ytree = ytree;
+}
+
+void dualtree_rangesearch(kdtree_t* xtree, kdtree_t* ytree,
+                          double mindist, double maxdist,
+                          int notself,
+                          dist2_function distsquared,
+                          result_callback callback,
+                          void* param,
+                          progress_callback progress,
+                          void* progress_param) {
+    // dual-tree search callback functions
+    dualtree_callbacks callbacks;
+    rs_params params;
 
-    params.user_callback = callback;
-    params.user_callback_param = param;
-    params.xtree = xtree;
-    params.ytree = ytree;
+    init_search(&params, &callbacks, xtree, ytree, mindist, maxdist, notself,
+                distsquared, callback, param);
     if (progress) {
         callbacks.start_results = rs_start_results;
         callbacks.start_extra = &params;
@@ -113,6 +128,106 @@ void dualtree_rangesearch(kdtree_t* xtree, kdtree_t* ytree,
     dualtree_search(xtree, ytree, &callbacks);
 }
 
+// The pairs found by one task of dualtree_rangesearch_pairs().
+struct pairs_task {
+    il* xinds;
+    il* yinds;
+    dl* dist2s;
+};
+
+static void pairs_callback(void* v, int xind, int yind, double dist2) {
+    struct pairs_task* t = v;
+    il_append(t->xinds, xind);
+    il_append(t->yinds, yind);
+    dl_append(t->dist2s, dist2);
+}
+
+struct pairs_args {
+    dualtree_tasks* tasks;
+    rs_params* params;
+    struct pairs_task* results;
+};
+
+static int run_pairs_tasks(void* varg, int lo, int hi) {
+    struct pairs_args* a = varg;
+    int i;
+    for (i=lo; i<hi; i++) {
+        struct pairs_task* t = a->results + i;
+        dualtree_callbacks callbacks;
+        // each task gets its own copy of the parameters, pointing at its
+        // own result lists.
+        rs_params params = *(a->params);
+        t->xinds = il_new(256);
+        t->yinds = il_new(256);
+        t->dist2s = dl_new(256);
+        params.user_callback_param = t;
+        memset(&callbacks, 0, sizeof(dualtree_callbacks));
+        callbacks.decision = rs_within_range;
+        callbacks.decision_extra = &params;
+        callbacks.result = rs_handle_result;
+        callbacks.result_extra = &params;
+        dualtree_tasks_run(a->tasks, i, &callbacks);
+    }
+    return 0;
+}
+
+int dualtree_rangesearch_pairs(kdtree_t* xtree, kdtree_t* ytree,
+                               double mindist, double maxdist,
+                               int notself,
+                               dist2_function distsquared,
+                               int nthreads,
+                               size_t* npairs, int** xinds, int** yinds,
+                               double** dist2s) {
+    dualtree_callbacks callbacks;
+    rs_params params;
+    struct pairs_args a;
+    size_t N, j;
+    int i, ntasks;
+
+    init_search(&params, &callbacks, xtree, ytree, mindist, maxdist, notself,
+                distsquared, pairs_callback, NULL);
+    a.params = &params;
+    a.tasks = dualtree_tasks_new(xtree, ytree, &callbacks,
+                                 (nthreads > 1) ?
+                                 DUALTREE_TASKS_PER_THREAD * nthreads : 1);
+    ntasks = dualtree_tasks_count(a.tasks);
+    a.results = calloc(ntasks, sizeof(struct pairs_task));
+    kdtree_parallel_for(nthreads, ntasks, 1, run_pairs_tasks, &a);
+    dualtree_tasks_free(a.tasks);
+
+    N = 0;
+    for (i=0; i<ntasks; i++)
+        N += il_size(a.results[i].xinds);
+    *npairs = N;
+    *xinds = malloc(MAX(N, 1) * sizeof(int));
+    *yinds = malloc(MAX(N, 1) * sizeof(int));
+    *dist2s = malloc(MAX(N, 1) * sizeof(double));
+    j = 0;
+    for (i=0; i<ntasks; i++) {
+        struct pairs_task* t = a.results + i;
+        size_t n = il_size(t->xinds);
+        if (*xinds && *yinds && *dist2s) {
+            bl_copy(t->xinds, 0, n, *xinds + j);
+            bl_copy(t->yinds, 0, n, *yinds + j);
+            bl_copy(t->dist2s, 0, n, *dist2s + j);
+        }
+        j += n;
+        il_free(t->xinds);
+        il_free(t->yinds);
+        dl_free(t->dist2s);
+    }
+    free(a.results);
+    if (!*xinds || !*yinds || !*dist2s) {
+        free(*xinds);
+        free(*yinds);
+        free(*dist2s);
+        *xinds = *yinds = NULL;
+        *dist2s = NULL;
+        return -1;
+    }
+    return 0;
+}
+
 static void rs_start_results(void* vparams,
                              kdtree_t* ytree, int ynode) {
     rs_params* p = (rs_params*)vparams;
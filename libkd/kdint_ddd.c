@@ -38,6 +38,9 @@
 #define EQUAL_DT 1
 #define EQUAL_ET 1
 
+// Dimensions with their own query instantiations (kdint_ddd_D.c): fields (2), stars (3) and codes (4, 6) held as doubles.
+#define KD_SPECIALIZED_DIMS(X) X(2) X(3) X(4) X(6)
+
 #include "kdtree_internal.c"
 #include "kdtree_internal_fits.c"
 
@@ -38,6 +38,9 @@
 #define EQUAL_DT 1
 #define EQUAL_ET 0
 
+// Dimensions with their own query instantiations (kdint_dss_D.c): index code trees (dimquads 3, 4 and 5).
+#define KD_SPECIALIZED_DIMS(X) X(2) X(4) X(6)
+
 #include "kdtree_internal.c"
 #include "kdtree_internal_fits.c"
 
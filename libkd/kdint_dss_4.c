@@ -0,0 +1,8 @@
+/*
+ # This file is part of libkd.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+// The dss query functions, for 4-dimensional trees only.
+#define KD_DIM 4
+#include "kdint_dss.c"
@@ -14,4 +14,8 @@ typedef u64 dtype;
 #define DTYPE l
 #define DTYPE_M l
 
+// packed data (see kdtree_t.packed_data) use half the bits.
+typedef u32 packtype;
+#define PACKTYPE_MAX  UINT32_MAX
+
 #define DTYPE_KDT_DATA  KDT_DATA_U64
@@ -14,5 +14,9 @@ typedef u16 dtype;
 #define DTYPE s
 #define DTYPE_M s
 
+// packed data (see kdtree_t.packed_data) use half the bits.
+typedef u8 packtype;
+#define PACKTYPE_MAX  UINT8_MAX
+
 #define DTYPE_KDT_DATA  KDT_DATA_U16
 
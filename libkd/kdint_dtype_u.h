@@ -14,4 +14,8 @@ typedef u32 dtype;
 #define DTYPE u
 #define DTYPE_M u
 
+// packed data (see kdtree_t.packed_data) use half the bits.
+typedef u16 packtype;
+#define PACKTYPE_MAX  UINT16_MAX
+
 #define DTYPE_KDT_DATA  KDT_DATA_U32
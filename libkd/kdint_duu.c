@@ -38,11 +38,16 @@
 #define EQUAL_DT 1
 #define EQUAL_ET 0
 
+// Dimensions with their own query instantiations (kdint_duu_D.c): index star trees.
+#define KD_SPECIALIZED_DIMS(X) X(3)
+
 #include "kdtree_internal.c"
 #include "kdtree_internal_fits.c"
 
+#if !defined(KD_DIM)
 // FIXME
 double kd_round(double x) {
     return KD_ROUND(x);
 }
+#endif
 
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "kdtree.h"
@@ -69,6 +70,7 @@ int kdtree_nnodes(const kdtree_t* kd) {
 }
 
 int kdtree_has_old_bb(const kdtree_t* kd) {
+    kdtree_load(kd);
     return kd->n_bb != kd->nnodes;
 }
 
@@ -143,6 +145,9 @@ void kdtree_memory_report(kdtree_t* kd) {
 
     char* fmt = "%-10s:   %12i %10s * %2i = %12i B  (%10.3f MB)\n";
 
+    if (kdtree_load(kd))
+        return;
+
     printf("Memory usage of kdtree (ndata %i, ndim %i, nnodes %i, nleaves %i)\n",
            kd->ndata, kd->ndim, kd->nnodes, kd->nbottom);
 
@@ -212,26 +217,32 @@ int kdtree_get_level(const kdtree_t* kd, int nodeid) {
 }
 
 int kdtree_get_splitdim(const kdtree_t* kd, int nodeid) {
+    if (kdtree_load(kd))
+        return -1;
     if (kd->splitdim)
-        return kd->splitdim[nodeid];
+        return KD_SPLITDIM(kd, nodeid);
 
     switch (kdtree_treetype(kd)) {
     case KDT_TREE_U64:
-        return kd->split.l[nodeid] & kd->dimmask;
+        return kd->split.l[KD_SPLIT_NODE(kd, nodeid)] & kd->dimmask;
     case KDT_TREE_U32:
-        return kd->split.u[nodeid] & kd->dimmask;
+        return kd->split.u[KD_SPLIT_NODE(kd, nodeid)] & kd->dimmask;
     case KDT_TREE_U16:
-        return kd->split.s[nodeid] & kd->dimmask;
+        return kd->split.s[KD_SPLIT_NODE(kd, nodeid)] & kd->dimmask;
     }
     return -1;
 }
 
 double kdtree_get_splitval(const kdtree_t* kd, int nodeid) {
+    if (kdtree_load(kd))
+        return 0.0;
     assert(kd->fun.get_splitval);
     return kd->fun.get_splitval(kd, nodeid);
 }
 
 void* kdtree_get_data(const kdtree_t* kd, int i) {
+    if (kdtree_load(kd))
+        return NULL;
     switch (kdtree_datatype(kd)) {
     case KDT_DATA_DOUBLE:
         return kd->data.d + kd->ndim * i;
@@ -252,6 +263,8 @@ void* kdtree_get_data(const kdtree_t* kd, int i) {
 void kdtree_copy_data_double(const kdtree_t* kd, int start, int N, double* dest) {
     int i;
     int d, D;
+    if (kdtree_load(kd))
+        return;
     D = kd->ndim;
     switch (kdtree_datatype(kd)) {
     case KDT_DATA_DOUBLE:
@@ -284,6 +297,8 @@ void kdtree_copy_data_double(const kdtree_t* kd, int start, int N, double* dest)
 }
 
 int kdtree_permute(const kdtree_t* tree, int ind) {
+    if (kdtree_load(tree))
+        return -1;
     if (!tree->perm)
         return ind;
     return tree->perm[ind];
@@ -291,6 +306,8 @@ int kdtree_permute(const kdtree_t* tree, int ind) {
 
 void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm) {
     int i;
+    if (kdtree_load(tree))
+        return;
     if (!tree->perm) {
         for (i=0; i<tree->ndata; i++)
             invperm[i] = i;
@@ -305,12 +322,14 @@ void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm) {
 
 const char* kdtree_build_options_to_string(int opts) {
     static char buf[256];
-    sprintf(buf, "%s%s%s%s%s",
+    sprintf(buf, "%s%s%s%s%s%s%s",
             (opts & KD_BUILD_BBOX) ? "BBOX ":"",
             (opts & KD_BUILD_SPLIT) ? "SPLIT ":"",
             (opts & KD_BUILD_SPLITDIM) ? "SPLITDIM ":"",
             (opts & KD_BUILD_NO_LR) ? "NOLR ":"",
-            (opts & KD_BUILD_LINEAR_LR) ? "LINEARLR ":"");
+            (opts & KD_BUILD_LINEAR_LR) ? "LINEARLR ":"",
+            (opts & KD_BUILD_VEB_LAYOUT) ? "VEB ":"",
+            (opts & KD_BUILD_PACK_DATA) ? "PACK ":"");
     return buf;
 }
 
@@ -416,6 +435,178 @@ void kdtree_set_limits(kdtree_t* kd, double* low, double* high) {
     memcpy(kd->maxval, high, D * sizeof(double));
 }
 
+void kdtree_set_name(kdtree_t* kd, const char* name) {
+    FREE(kd->name);
+    kd->name = (name ? an_alloc_strdup(AN_ALLOC_LIBKD, name) : NULL);
+}
+
+void kdtree_set_build_threads(kdtree_t* kd, int nthreads) {
+    kd->build_threads = nthreads;
+}
+
+size_t kdtree_veb_position(int i, int nlevels) {
+    size_t pos = 0;
+    int h = nlevels;
+    // depth of the node, and its index within that level.
+    int d = an_flsB((uint32_t)i + 1);
+    unsigned int k = (unsigned int)i + 1 - (1u << d);
+    while (h > 1) {
+        int htop = h / 2;
+        int hbot = h - htop;
+        if (d < htop) {
+            h = htop;
+            continue;
+        }
+        // skip the top tree, and the bottom trees to the left of ours.
+        d -= htop;
+        pos += (((size_t)1 << htop) - 1) +
+            (size_t)(k >> d) * (((size_t)1 << hbot) - 1);
+        k &= (1u << d) - 1;
+        h = hbot;
+    }
+    return pos;
+}
+
+// Moves "N" items of "size" bytes from breadth-first to vEB order.
+static void* veb_permute(const void* src, int N, int nlevels, size_t size) {
+    char* dst;
+    int i;
+    dst = MALLOC((size_t)N * size);
+    if (!dst)
+        return NULL;
+    for (i=0; i<N; i++)
+        memcpy(dst + kdtree_veb_position(i, nlevels) * size,
+               (const char*)src + (size_t)i * size, size);
+    return dst;
+}
+
+int kdtree_convert_to_veb_layout(kdtree_t* kd) {
+    void* bb = NULL;
+    void* split = NULL;
+    void* splitdim = NULL;
+    int tsz;
+
+    if (kd->veb_layout)
+        return 0;
+    if (kd->io) {
+        ERROR("Can't change the node layout of a kd-tree read from a file");
+        return -1;
+    }
+    if (kd->bb.any && kdtree_has_old_bb(kd)) {
+        ERROR("Can't change the node layout of an old-style kd-tree");
+        return -1;
+    }
+    tsz = get_tree_size(kd->treetype);
+    if (kd->bb.any) {
+        bb = veb_permute(kd->bb.any, kd->nnodes, kd->nlevels,
+                         (size_t)tsz * 2 * kd->ndim);
+        if (!bb)
+            goto bailout;
+    }
+    if (kd->split.any) {
+        split = veb_permute(kd->split.any, kd->ninterior, kd->nlevels - 1,
+                            tsz);
+        if (!split)
+            goto bailout;
+    }
+    if (kd->splitdim) {
+        splitdim = veb_permute(kd->splitdim, kd->ninterior, kd->nlevels - 1,
+                               sizeof(u8));
+        if (!splitdim)
+            goto bailout;
+    }
+    if (bb) {
+        FREE(kd->bb.any);
+        kd->bb.any = bb;
+    }
+    if (split) {
+        FREE(kd->split.any);
+        kd->split.any = split;
+    }
+    if (splitdim) {
+        FREE(kd->splitdim);
+        kd->splitdim = splitdim;
+    }
+    kd->veb_layout = 1;
+    return 0;
+
+ bailout:
+    SYSERROR("Failed to allocate kd-tree arrays for vEB layout");
+    FREE(bb);
+    FREE(split);
+    return -1;
+}
+
+struct parallel_for {
+    pthread_mutex_t lock;
+    int next;
+    int N;
+    int chunk;
+    int (*func)(void* arg, int lo, int hi);
+    void* arg;
+    anbool failed;
+};
+
+static void* parallel_for_main(void* varg) {
+    struct parallel_for* p = varg;
+    for (;;) {
+        int lo, hi;
+        pthread_mutex_lock(&p->lock);
+        if (p->failed || p->next >= p->N) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        lo = p->next;
+        hi = MIN(p->N, lo + p->chunk);
+        p->next = hi;
+        pthread_mutex_unlock(&p->lock);
+        if (p->func(p->arg, lo, hi)) {
+            pthread_mutex_lock(&p->lock);
+            p->failed = TRUE;
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    return NULL;
+}
+
+int kdtree_parallel_for(int nthreads, int N, int chunk,
+                        int (*func)(void* arg, int lo, int hi), void* arg) {
+    struct parallel_for p;
+    pthread_t* threads;
+    int i;
+
+    if (chunk < 1)
+        chunk = 1;
+    nthreads = MIN(nthreads, (N + chunk - 1) / chunk);
+    if (nthreads <= 1) {
+        for (i=0; i<N; i+=chunk)
+            if (func(arg, i, MIN(N, i + chunk)))
+                return -1;
+        return 0;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    p.next = 0;
+    p.N = N;
+    p.chunk = chunk;
+    p.func = func;
+    p.arg = arg;
+    p.failed = FALSE;
+    threads = MALLOC((nthreads - 1) * sizeof(pthread_t));
+    for (i=0; threads && i<nthreads-1; i++)
+        if (pthread_create(threads + i, NULL, parallel_for_main, &p)) {
+            SYSERROR("Failed to create kd-tree thread");
+            break;
+        }
+    // (if thread creation failed, carry on with the threads we have)
+    parallel_for_main(&p);
+    nthreads = i;
+    for (i=0; i<nthreads; i++)
+        pthread_join(threads[i], NULL);
+    FREE(threads);
+    pthread_mutex_destroy(&p.lock);
+    return (p.failed ? -1 : 0);
+}
+
 double kdtree_get_conservative_query_radius(const kdtree_t* kd, double radius) {
     if (!kd->minval) {
         return radius;
@@ -549,6 +740,94 @@ void kdtree_free_query(kdtree_qres_t *kq) {
     FREE(kq);
 }
 
+/*
+ Each thread keeps a few released query results, arrays and all, so
+ that a thread running one query after another doesn't go back to
+ malloc each time.  The pool is per-thread, so needs no locking.
+ */
+#define QRES_POOL_SIZE 8
+// Results that grew beyond this many entries give their arrays back
+// when released, so that one huge query doesn't pin its memory.
+#define QRES_POOL_MAX_CAPACITY 65536
+
+struct qres_pool {
+    int n;
+    kdtree_qres_t* res[QRES_POOL_SIZE];
+};
+
+static pthread_key_t qres_pool_key;
+static pthread_once_t qres_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void free_qres_pool(void* v) {
+    struct qres_pool* pool = v;
+    int i;
+    if (!pool)
+        return;
+    for (i=0; i<pool->n; i++)
+        kdtree_free_query(pool->res[i]);
+    free(pool);
+}
+
+static void make_qres_pool_key(void) {
+    pthread_key_create(&qres_pool_key, free_qres_pool);
+}
+
+static struct qres_pool* get_qres_pool(anbool create) {
+    struct qres_pool* pool;
+    pthread_once(&qres_pool_key_once, make_qres_pool_key);
+    pool = pthread_getspecific(qres_pool_key);
+    if (!pool && create) {
+        pool = calloc(1, sizeof(struct qres_pool));
+        pthread_setspecific(qres_pool_key, pool);
+    }
+    return pool;
+}
+
+kdtree_qres_t* kdtree_qres_acquire(void) {
+    struct qres_pool* pool = get_qres_pool(FALSE);
+    kdtree_qres_t* res;
+    if (pool && pool->n) {
+        // the most recently released, whose arrays are likely in cache.
+        res = pool->res[--pool->n];
+        res->nres = 0;
+        return res;
+    }
+    res = CALLOC(1, sizeof(kdtree_qres_t));
+    if (!res)
+        SYSERROR("Failed to allocate kdtree_qres_t struct");
+    return res;
+}
+
+void kdtree_qres_release(kdtree_qres_t* res) {
+    struct qres_pool* pool;
+    if (!res)
+        return;
+    pool = get_qres_pool(TRUE);
+    if (!pool || pool->n == QRES_POOL_SIZE) {
+        kdtree_free_query(res);
+        return;
+    }
+    if (res->capacity > QRES_POOL_MAX_CAPACITY) {
+        FREE(res->results.any);
+        FREE(res->sdists);
+        FREE(res->inds);
+        res->results.any = NULL;
+        res->sdists = NULL;
+        res->inds = NULL;
+        res->capacity = 0;
+    }
+    res->nres = 0;
+    pool->res[pool->n++] = res;
+}
+
+void kdtree_qres_pool_clear(void) {
+    struct qres_pool* pool = get_qres_pool(FALSE);
+    if (!pool)
+        return;
+    pthread_setspecific(qres_pool_key, NULL);
+    free_qres_pool(pool);
+}
+
 void kdtree_free(kdtree_t *kd) {
     if (!kd) return;
     FREE(kd->name);
@@ -570,6 +849,8 @@ int kdtree_nearest_neighbour(const kdtree_t* kd, const void* pt, double* p_mindi
 }
 
 int kdtree_check(const kdtree_t* kd) {
+    if (kdtree_load(kd))
+        return -1;
     assert(kd->fun.check);
     return kd->fun.check(kd);
 }
@@ -578,6 +859,8 @@ int kdtree_nearest_neighbour_within(const kdtree_t* kd, const void *pt, double m
                                     double* p_mindist2) {
     double bestd2 = maxd2;
     int ibest = -1;
+    if (kdtree_load(kd))
+        return -1;
 
     assert(kd->fun.nearest_neighbour_internal);
     kd->fun.nearest_neighbour_internal(kd, pt, &bestd2, &ibest);
@@ -587,11 +870,155 @@ int kdtree_nearest_neighbour_within(const kdtree_t* kd, const void *pt, double m
     return ibest;
 }
 
+int kdtree_nearest_neighbour_approx(const kdtree_t* kd, const void *pt,
+                                    double maxd2, double eps,
+                                    double* p_mindist2) {
+    double bestd2 = maxd2;
+    int ibest = -1;
+    if (kdtree_load(kd))
+        return -1;
+
+    assert(kd->fun.nearest_neighbour_approx);
+    kd->fun.nearest_neighbour_approx(kd, pt, eps, &bestd2, &ibest);
+
+    if (p_mindist2 && (ibest != -1))
+        *p_mindist2 = bestd2;
+    return ibest;
+}
+
+int kdtree_nn_batch(const kdtree_t* kd, const void* pts, int N,
+                    const double* maxd2s, int* inds, double* d2s) {
+    if (kdtree_load(kd))
+        return -1;
+    assert(kd->fun.nn_batch);
+    return kd->fun.nn_batch(kd, pts, N, maxd2s, inds, d2s);
+}
+
+int kdtree_knn(const kdtree_t* kd, const void* pt, int k, double maxd2,
+               int* inds, double* d2s) {
+    if (kdtree_load(kd))
+        return -1;
+    assert(kd->fun.knn);
+    return kd->fun.knn(kd, pt, k, maxd2, inds, d2s);
+}
+
+int kdtree_knn_batch(const kdtree_t* kd, const void* pts, int N, int k,
+                     const double* maxd2s, int* inds, double* d2s,
+                     int* counts) {
+    if (kdtree_load(kd))
+        return -1;
+    assert(kd->fun.knn_batch);
+    return kd->fun.knn_batch(kd, pts, N, k, maxd2s, inds, d2s, counts);
+}
+
+kdtree_batch_res_t* kdtree_rangesearch_batch_csr(const kdtree_t* kd,
+                                                 kdtree_batch_res_t* res,
+                                                 const void* pts, int N,
+                                                 const double* maxd2s,
+                                                 int options) {
+    anbool newres = (res == NULL);
+    int i, n;
+
+    if (kdtree_load(kd))
+        return NULL;
+
+    if (newres) {
+        res = CALLOC(1, sizeof(kdtree_batch_res_t));
+        if (!res) {
+            SYSERROR("Failed to allocate kdtree_batch_res_t");
+            return NULL;
+        }
+    }
+    options &= ~KD_OPTIONS_RETURN_POINTS;
+
+    if (N > res->qcapacity) {
+        kdtree_qres_t** q = REALLOC(res->qres, N * sizeof(kdtree_qres_t*));
+        if (!q) {
+            SYSERROR("Failed to allocate %i query results", N);
+            goto bailout;
+        }
+        for (i=res->qcapacity; i<N; i++)
+            q[i] = NULL;
+        res->qres = q;
+        res->qcapacity = N;
+    }
+    FREE(res->offsets);
+    res->offsets = MALLOC((N+1) * sizeof(int));
+    if (!res->offsets) {
+        SYSERROR("Failed to allocate %i offsets", N+1);
+        goto bailout;
+    }
+    res->nq = N;
+
+    assert(kd->fun.rangesearch_batch);
+    if (kd->fun.rangesearch_batch(kd, res->qres, pts, N, maxd2s, options))
+        goto bailout;
+
+    n = 0;
+    for (i=0; i<N; i++) {
+        res->offsets[i] = n;
+        n += res->qres[i]->nres;
+    }
+    res->offsets[N] = n;
+    res->nres = n;
+    if (n > res->capacity) {
+        FREE(res->inds);
+        FREE(res->sdists);
+        res->sdists = NULL;
+        res->capacity = 0;
+        res->inds = MALLOC(n * sizeof(u32));
+        if ((options & KD_OPTIONS_COMPUTE_DISTS) && res->inds)
+            res->sdists = MALLOC(n * sizeof(double));
+        if (!res->inds ||
+            ((options & KD_OPTIONS_COMPUTE_DISTS) && !res->sdists)) {
+            SYSERROR("Failed to allocate %i results", n);
+            goto bailout;
+        }
+        res->capacity = n;
+    } else if ((options & KD_OPTIONS_COMPUTE_DISTS) && !res->sdists &&
+               res->capacity) {
+        res->sdists = MALLOC(res->capacity * sizeof(double));
+        if (!res->sdists) {
+            SYSERROR("Failed to allocate %i distances", res->capacity);
+            goto bailout;
+        }
+    }
+    for (i=0; i<N; i++) {
+        kdtree_qres_t* q = res->qres[i];
+        if (!q->nres)
+            continue;
+        memcpy(res->inds + res->offsets[i], q->inds, q->nres * sizeof(u32));
+        if (options & KD_OPTIONS_COMPUTE_DISTS)
+            memcpy(res->sdists + res->offsets[i], q->sdists,
+                   q->nres * sizeof(double));
+    }
+    return res;
+
+ bailout:
+    if (newres)
+        kdtree_batch_res_free(res);
+    return NULL;
+}
+
+void kdtree_batch_res_free(kdtree_batch_res_t* res) {
+    int i;
+    if (!res) return;
+    for (i=0; i<res->qcapacity; i++)
+        kdtree_free_query(res->qres[i]);
+    FREE(res->qres);
+    FREE(res->offsets);
+    FREE(res->inds);
+    FREE(res->sdists);
+    FREE(res);
+}
+
 KD_DECLARE(kdtree_node_node_mindist2, double, (const kdtree_t* kd1, int node1, const kdtree_t* kd2, int node2));
 
 double kdtree_node_node_mindist2(const kdtree_t* kd1, int node1,
                                  const kdtree_t* kd2, int node2) {
     double res = LARGE_VAL;
+    if (kdtree_load(kd1) || kdtree_load(kd2))
+        return res;
     KD_DISPATCH(kdtree_node_node_mindist2, kd1->treetype, res=, (kd1, node1, kd2, node2));
     return res;
 }
@@ -601,6 +1028,8 @@ KD_DECLARE(kdtree_node_node_maxdist2, double, (const kdtree_t* kd1, int node1, c
 double kdtree_node_node_maxdist2(const kdtree_t* kd1, int node1,
                                  const kdtree_t* kd2, int node2) {
     double res = LARGE_VAL;
+    if (kdtree_load(kd1) || kdtree_load(kd2))
+        return res;
     KD_DISPATCH(kdtree_node_node_maxdist2, kd1->treetype, res=, (kd1, node1, kd2, node2));
     return res;
 }
@@ -611,6 +1040,8 @@ int kdtree_node_node_mindist2_exceeds(const kdtree_t* kd1, int node1,
                                       const kdtree_t* kd2, int node2,
                                       double dist2) {
     int res = FALSE;
+    if (kdtree_load(kd1) || kdtree_load(kd2))
+        return res;
     KD_DISPATCH(kdtree_node_node_mindist2_exceeds, kd1->treetype, res=, (kd1, node1, kd2, node2, dist2));
     return res;
 }
@@ -621,6 +1052,8 @@ int kdtree_node_node_maxdist2_exceeds(const kdtree_t* kd1, int node1,
                                       const kdtree_t* kd2, int node2,
                                       double dist2) {
     int res = FALSE;
+    if (kdtree_load(kd1) || kdtree_load(kd2))
+        return res;
     KD_DISPATCH(kdtree_node_node_maxdist2_exceeds, kd1->treetype, res=, (kd1, node1, kd2, node2, dist2));
     return res;
 }
@@ -629,6 +1062,8 @@ KD_DECLARE(kdtree_node_point_mindist2, double, (const kdtree_t* kd, int node, co
 
 double kdtree_node_point_mindist2(const kdtree_t* kd, int node, const void* pt) {
     double res = LARGE_VAL;
+    if (kdtree_load(kd))
+        return res;
     KD_DISPATCH(kdtree_node_point_mindist2, kd->treetype, res=, (kd, node, pt));
     return res;
 }
@@ -637,6 +1072,8 @@ KD_DECLARE(kdtree_node_point_maxdist2, double, (const kdtree_t* kd, int node, co
 
 double kdtree_node_point_maxdist2(const kdtree_t* kd, int node, const void* pt) {
     double res = LARGE_VAL;
+    if (kdtree_load(kd))
+        return res;
     KD_DISPATCH(kdtree_node_point_maxdist2, kd->treetype, res=, (kd, node, pt));
     return res;
 }
@@ -646,6 +1083,8 @@ KD_DECLARE(kdtree_node_point_mindist2_exceeds, int, (const kdtree_t* kd, int nod
 int kdtree_node_point_mindist2_exceeds(const kdtree_t* kd, int node, const void* pt,
                                        double dist2) {
     int res = FALSE;
+    if (kdtree_load(kd))
+        return res;
     KD_DISPATCH(kdtree_node_point_mindist2_exceeds, kd->treetype, res=, (kd, node, pt, dist2));
     return res;
 }
@@ -655,6 +1094,8 @@ KD_DECLARE(kdtree_node_point_maxdist2_exceeds, int, (const kdtree_t* kd, int nod
 int kdtree_node_point_maxdist2_exceeds(const kdtree_t* kd, int node, const void* pt,
                                        double dist2) {
     int res = FALSE;
+    if (kdtree_load(kd))
+        return res;
     KD_DISPATCH(kdtree_node_point_maxdist2_exceeds, kd->treetype, res=, (kd, node, pt, dist2));
     return res;
 }
@@ -664,16 +1105,22 @@ void kdtree_nodes_contained(const kdtree_t* kd,
                             void (*callback_contained)(const kdtree_t* kd, int node, void* extra),
                             void (*callback_overlap)(const kdtree_t* kd, int node, void* extra),
                             void* cb_extra) {
+    if (kdtree_load(kd))
+        return;
     assert(kd->fun.nodes_contained);
     kd->fun.nodes_contained(kd, querylow, queryhi, callback_contained, callback_overlap, cb_extra);
 }
 
 int kdtree_get_bboxes(const kdtree_t* kd, int node, void* bblo, void* bbhi) {
+    if (kdtree_load(kd))
+        return FALSE;
     assert(kd->fun.get_bboxes);
     return kd->fun.get_bboxes(kd, node, bblo, bbhi);
 }
 
 void kdtree_fix_bounding_boxes(kdtree_t* kd) {
+    if (kdtree_load(kd))
+        return;
     assert(kd->fun.fix_bounding_boxes);
     kd->fun.fix_bounding_boxes(kd);
 }
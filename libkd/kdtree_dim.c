@@ -46,8 +46,19 @@ KD_DECLARE(kdtree_rangesearch_options, kdtree_qres_t*, (const kdtree_t* kd, kdtr
 
 kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)
      (const kdtree_t *kd, kdtree_qres_t* res, const void *pt, double maxd2, int options) {
+    if (kdtree_load(kd))
+        return NULL;
     assert(kd->fun.rangesearch);
     return kd->fun.rangesearch(kd, res, pt, maxd2, options);
 }
 
 
+
+int KDFUNC(kdtree_rangesearch_batch)
+     (const kdtree_t *kd, kdtree_qres_t** res, const void *pts, int N,
+      const double* maxd2s, int options) {
+    if (kdtree_load(kd))
+        return -1;
+    assert(kd->fun.rangesearch_batch);
+    return kd->fun.rangesearch_batch(kd, res, pts, N, maxd2s, options);
+}
@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "kdtree_fits_io.h"
 #include "kdtree_internal.h"
@@ -170,7 +171,8 @@ int kdtree_fits_read_chunk(kdtree_fits_t* io, fitsbin_chunk_t* chunk) {
 }
 
 // declarations
-KD_DECLARE(kdtree_read_fits, int, (kdtree_fits_t* io, kdtree_t* kd));
+KD_DECLARE(kdtree_read_fits, int, (kdtree_fits_t* io, kdtree_t* kd, anbool lazy));
+KD_DECLARE(kdtree_map_fits, int, (kdtree_fits_t* io, kdtree_t* kd));
 KD_DECLARE(kdtree_write_fits, int, (kdtree_fits_t* io, const kdtree_t* kd,
                                     const qfits_header* inhdr, anbool flip_endian,
                                     FILE* fid));
@@ -248,6 +250,30 @@ int kdtree_fits_contains_tree(const kdtree_fits_t* io, const char* treename) {
     return rtn;
 }
 
+// serializes the first kdtree_load() of lazily-read trees.
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_lazy(kdtree_t* kd) {
+    int rtn = 0;
+    pthread_mutex_lock(&lazy_lock);
+    // (another thread may have got here first.)
+    if (kd->load) {
+        if (!kd->io) {
+            ERROR("Lazily-read kdtree has no file to read from");
+            rtn = -1;
+        } else {
+            KD_DISPATCH(kdtree_map_fits, kd->treetype, rtn = , (kd->io, kd));
+            if (rtn)
+                ERROR("Failed to read kdtree arrays from file \"%s\"",
+                      fitsbin_get_filename(kd->io));
+        }
+        if (!rtn)
+            __atomic_store_n(&kd->load, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lazy_lock);
+    return rtn;
+}
+
 kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
                                 qfits_header** p_hdr) {
     int ndim, ndata, nnodes;
@@ -256,7 +282,9 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
     fitsbin_t* fb = kdtree_fits_get_fitsbin(io);
     qfits_header* header;
     int rtn = 0;
+    anbool lazy;
     char* fn = fb->filename;
+    char* name = NULL;
     //double t0;
 
     kd = CALLOC(1, sizeof(kdtree_t));
@@ -265,7 +293,10 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
         return NULL;
     }
 
-    header = find_tree(treename, fb, &ndim, &ndata, &nnodes, &tt, &kd->name);
+    header = find_tree(treename, fb, &ndim, &ndata, &nnodes, &tt, &name);
+    // (kd->name is freed by FREE(), so it must come from libkd's allocator.)
+    kdtree_set_name(kd, name);
+    free(name);
     if (!header) {
         // Not found.
         if (treename)
@@ -278,6 +309,9 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
     }
 
     kd->has_linear_lr = qfits_header_getboolean(header, "KDT_LINL", 0);
+    kd->veb_layout = qfits_header_getboolean(header, "KDT_VEB", 0);
+    kd->packed_data = qfits_header_getboolean(header, "KDT_PACK", 0);
+    kd->pack_error = qfits_header_getdouble(header, "KDT_PKER", 0.0);
 
     if (p_hdr)
         *p_hdr = header;
@@ -293,7 +327,10 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
     kd->treetype = tt;
 
     //t0 = timenow();
-    KD_DISPATCH(kdtree_read_fits, tt, rtn = , (io, kd));
+    // (lazy reading needs the file; in-memory fitsbins are already read.)
+    lazy = ((fitsbin_get_mmap_policy(NULL) & FITSBIN_MMAP_LAZY) &&
+            !fb->inmemory);
+    KD_DISPATCH(kdtree_read_fits, tt, rtn = , (io, kd, lazy));
     //debug("kdtree_read_fits(%s) took %g ms\n", fn, 1000. * (timenow() - t0));
 
     if (rtn) {
@@ -305,6 +342,8 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
     kdtree_update_funcs(kd);
 
     kd->io = io;
+    if (lazy)
+        kd->load = load_lazy;
 
     return kd;
 }
@@ -340,6 +379,8 @@ int kdtree_fits_write_chunk_flipped(kdtree_fits_t* io, fitsbin_chunk_t* chunk,
 int kdtree_fits_append_tree(kdtree_fits_t* io, const kdtree_t* kd,
                             const qfits_header* inhdr) {
     int rtn = -1;
+    if (kdtree_load(kd))
+        return -1;
     KD_DISPATCH(kdtree_write_fits, kd->treetype, rtn = , (io, kd, inhdr, FALSE, NULL));
     return rtn;
 }
@@ -348,6 +389,8 @@ int kdtree_fits_append_tree_to(kdtree_t* kd,
                                const qfits_header* inhdr,
                                FILE* fid) {
     int rtn = -1;
+    if (kdtree_load(kd))
+        return -1;
     KD_DISPATCH(kdtree_write_fits, kd->treetype, rtn = , (NULL, kd, inhdr, FALSE, fid));
     return rtn;
 }
@@ -355,6 +398,8 @@ int kdtree_fits_append_tree_to(kdtree_t* kd,
 int kdtree_fits_append_tree_flipped(kdtree_fits_t* io, const kdtree_t* kd,
                                     const qfits_header* inhdr) {
     int rtn = -1;
+    if (kdtree_load(kd))
+        return -1;
     KD_DISPATCH(kdtree_write_fits, kd->treetype, rtn = , (io, kd, inhdr, TRUE, NULL));
     return rtn;
 }
@@ -397,6 +442,9 @@ int kdtree_fits_close(kdtree_t* kd) {
     // multiple kdtrees from one file...  reference count??
     if (kd->io)
         kdtree_fits_io_close(kd->io);
+    // (unpacked data)
+    if (kd->free_data)
+        FREE(kd->data.any);
     FREE(kd->name);
     FREE(kd);
     return 0;
@@ -15,13 +15,19 @@
 #include "keywords.h"
 #include "errors.h"
 #include "mathutil.h"
+#include "ioutils.h"
 
 #define KDTREE_MAX_RESULTS 1000
+#define KDTREE_BATCH_RESULTS 16
 #define KDTREE_MAX_DIM 100
 
 #define WARNING(x, ...) fprintf(stderr, x, ## __VA_ARGS__)
 
+#if defined(KD_DIM)
+#define MANGLE(x) KDMANGLE_DIM(x, ETYPE, DTYPE, TTYPE, KD_DIM)
+#else
 #define MANGLE(x) KDMANGLE(x, ETYPE, DTYPE, TTYPE)
+#endif
 
 /*
  The "external" type is the data type that the outside world works in.
@@ -131,13 +137,13 @@
 #define KD_ROUND rint
 
 // Get the low corner of the bounding box
-#define LOW_HR( kd, D, i) ((kd)->bb.TTYPE + (2*(size_t)(i)*(size_t)(D)))
+#define LOW_HR( kd, D, i) ((kd)->bb.TTYPE + (2*KD_BB_NODE(kd, i)*(size_t)(D)))
 
 // Get the high corner of the bounding box
-#define HIGH_HR(kd, D, i) ((kd)->bb.TTYPE + ((2*(size_t)(i)+1)*(size_t)(D)))
+#define HIGH_HR(kd, D, i) ((kd)->bb.TTYPE + ((2*KD_BB_NODE(kd, i)+1)*(size_t)(D)))
 
 // Get the splitting-plane position
-#define KD_SPLIT(kd, i) ((kd)->split.TTYPE + (size_t)(i))
+#define KD_SPLIT(kd, i) ((kd)->split.TTYPE + KD_SPLIT_NODE(kd, i))
 
 // Get a pointer to the 'i'-th data point.
 #define KD_DATA(kd, D, i) ((kd)->data.DTYPE + ((size_t)(D)*(size_t)(i)))
@@ -297,7 +303,11 @@ static inline void dist2_bailout(const kdtree_t* kd, const etype* q, const dtype
          delta = q[d]  - pp;
          }
          */
-        delta = q[d]  - pp;
+        // (unsigned integers would wrap around.)
+        if (ETYPE_INTEGER)
+            delta = (double)q[d] - (double)pp;
+        else
+            delta = q[d] - pp;
         d2 += delta * delta;
         if (d2 > maxd2) {
             *bailedout = TRUE;
@@ -357,6 +367,68 @@ static inline anbool dist2_exceeds(const kdtree_t* kd, const etype* q, const dty
     return 0;
 }
 
+/*
+ Squared distances from a query to "n" consecutive data points "p", for
+ the leaf scans of the range searches.  The query "qd" is given relative
+ to the data offset, and "s" is the data scale, so that a coordinate
+ costs one multiply-subtract: POINT_DE(p) - q = p*s - qd.
+
+ There is no early bail-out, so the loop over points is branch-free;
+ the fixed-dimension cases (D = 2 for image trees, 3 for star trees, 4
+ for code trees) give the compiler a constant stride, which it
+ vectorizes.
+ */
+#define LEAF_BLOCK 64
+
+static inline void leaf_dist2s(const dtype* p, int n, int D,
+                               const double* qd, double s, double* d2) {
+    int k, d;
+#if defined(KD_DIM)
+    D = KD_DIM;
+#endif
+    switch (D) {
+    case 2: {
+        const double q0 = qd[0], q1 = qd[1];
+        for (k=0; k<n; k++) {
+            double d0 = s * (double)p[2*k+0] - q0;
+            double d1 = s * (double)p[2*k+1] - q1;
+            d2[k] = d0*d0 + d1*d1;
+        }
+        return;
+    }
+    case 3: {
+        const double q0 = qd[0], q1 = qd[1], q2 = qd[2];
+        for (k=0; k<n; k++) {
+            double d0 = s * (double)p[3*k+0] - q0;
+            double d1 = s * (double)p[3*k+1] - q1;
+            double d2_ = s * (double)p[3*k+2] - q2;
+            d2[k] = d0*d0 + d1*d1 + d2_*d2_;
+        }
+        return;
+    }
+    case 4: {
+        const double q0 = qd[0], q1 = qd[1], q2 = qd[2], q3 = qd[3];
+        for (k=0; k<n; k++) {
+            double d0 = s * (double)p[4*k+0] - q0;
+            double d1 = s * (double)p[4*k+1] - q1;
+            double d2_ = s * (double)p[4*k+2] - q2;
+            double d3 = s * (double)p[4*k+3] - q3;
+            d2[k] = (d0*d0 + d1*d1) + (d2_*d2_ + d3*d3);
+        }
+        return;
+    }
+    }
+    for (k=0; k<n; k++)
+        d2[k] = 0.0;
+    for (d=0; d<D; d++) {
+        const double qq = qd[d];
+        for (k=0; k<n; k++) {
+            double dd = s * (double)p[(size_t)k*D + d] - qq;
+            d2[k] += dd*dd;
+        }
+    }
+}
+
 static anbool bb_point_l1mindist_exceeds_ttype(ttype* lo, ttype* hi,
                                                ttype* query, int D,
                                                ttype maxl1, ttype maxlinf) {
@@ -538,6 +610,74 @@ anbool add_result(const kdtree_t* kd, kdtree_qres_t* res, double sdist,
     return TRUE;
 }
 
+/*
+ Adds the points L..R (of a leaf, or of a node entirely within range if
+ "wholenode") that are within "maxd2" of the query to "res".  Returns
+ FALSE if the results could not be grown.
+ */
+static anbool leaf_rangesearch(const kdtree_t* kd, const etype* query,
+                               int L, int R, int D, double maxd2,
+                               anbool wholenode, kdtree_qres_t* res,
+                               anbool do_dists, anbool do_points) {
+    int i;
+#if ETYPE_INTEGER
+    // (integer external types keep the scalar, exact-type loops)
+    for (i=L; i<=R; i++) {
+        const dtype* data = KD_DATA(kd, D, i);
+        double dsqd = LARGE_VAL;
+        if (do_dists) {
+            if (wholenode)
+                dsqd = dist2(kd, query, data, D);
+            else {
+                anbool bailedout = FALSE;
+                dist2_bailout(kd, query, data, D, maxd2, &bailedout, &dsqd);
+                if (bailedout)
+                    continue;
+            }
+        } else if (!wholenode && dist2_exceeds(kd, query, data, D, maxd2))
+            continue;
+        if (!add_result(kd, res, dsqd, KD_PERM(kd, i), data,
+                        D, do_dists, do_points))
+            return FALSE;
+    }
+#else
+    double qd[D];
+    double d2[LEAF_BLOCK];
+    double s;
+    int d, k;
+
+    if (wholenode && !do_dists) {
+        for (i=L; i<=R; i++)
+            if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i),
+                            KD_DATA(kd, D, i), D, do_dists, do_points))
+                return FALSE;
+        return TRUE;
+    }
+#if EQUAL_ED
+    s = 1.0;
+    for (d=0; d<D; d++)
+        qd[d] = query[d];
+#else
+    s = kd->invscale;
+    for (d=0; d<D; d++)
+        qd[d] = query[d] - kd->minval[d];
+#endif
+    for (i=L; i<=R; i+=LEAF_BLOCK) {
+        int n = MIN(LEAF_BLOCK, R+1 - i);
+        leaf_dist2s(KD_DATA(kd, D, i), n, D, qd, s, d2);
+        for (k=0; k<n; k++) {
+            if (!wholenode && d2[k] > maxd2)
+                continue;
+            if (!add_result(kd, res, do_dists ? d2[k] : LARGE_VAL,
+                            KD_PERM(kd, i+k), KD_DATA(kd, D, i+k), D,
+                            do_dists, do_points))
+                return FALSE;
+        }
+    }
+#endif
+    return TRUE;
+}
+
 /*
  Can the query be represented as a ttype?
 
@@ -566,14 +706,20 @@ double MANGLE(kdtree_get_splitval)(const kdtree_t* kd, int nodeid) {
         dim = tmpsplit & kd->dimmask;
         return POINT_TE(kd, dim, tmpsplit & kd->splitmask);
     } else {
-        dim = kd->splitdim[nodeid];
+        dim = KD_SPLITDIM(kd, nodeid);
     }
     return POINT_TE(kd, dim, split);
 }
 
 
+/*
+ The nearest-neighbour searches take "prune2", the factor (at most 1)
+ by which the best distance-squared so far is shrunk before comparing
+ it with a node's: 1 finds the exact nearest neighbour, 1/(1+eps)^2
+ one within a factor (1+eps) of it.
+ */
 static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
-                         double* p_bestd2, int* p_ibest) {
+                         double prune2, double* p_bestd2, int* p_ibest) {
     int nodestack[100];
     double dist2stack[100];
     int stackpos = 0;
@@ -624,7 +770,7 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
         double firstd2, secondd2;
         int firstid, secondid;
         
-        if (dist2stack[stackpos] > bestd2) {
+        if (dist2stack[stackpos] > bestd2 * prune2) {
             // pruned!
             if (kd->fun.nn_prune)
                 kd->fun.nn_prune(kd, nodestack[stackpos], dist2stack[stackpos], bestd2, 1);
@@ -703,7 +849,7 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
                         } else
                             continue;
                     }
-                    if (dist2 > bestd2) {
+                    if (dist2 > bestd2 * prune2) {
                         bailed = TRUE;
                         break;
                     }
@@ -753,7 +899,7 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
 }
 
 static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
-                                const ttype* tquery,
+                                const ttype* tquery, double prune2,
                                 double* p_bestd2, int* p_ibest) {
     int nodestack[100];
     ttype mindists[100];
@@ -763,6 +909,9 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
 
     ttype closest_so_far;
     bigttype closest2;
+    // nodes farther than this are pruned.
+    ttype prune_dist;
+    double prune = sqrt(prune2);
 
     int ibest = -1;
     
@@ -782,6 +931,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
             closest_so_far = ceil(closest);
             closest2 = (bigttype)closest_so_far * (bigttype)closest_so_far;
         }
+        prune_dist = (prune == 1.0) ? closest_so_far : (ttype)(closest_so_far * prune);
     }
 
     // queue root.
@@ -795,7 +945,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
         int L, R;
         ttype split = 0;
 
-        if (mindists[stackpos] > closest_so_far) {
+        if (mindists[stackpos] > prune_dist) {
             // pruned!
             stackpos--;
             continue;
@@ -823,6 +973,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
             if (oldbest != ibest) {
                 // FIXME - replace with int sqrt
                 closest_so_far = ceil(sqrt((double)closest2));
+                prune_dist = (prune == 1.0) ? closest_so_far : (ttype)(closest_so_far * prune);
             }
             continue;
         }
@@ -831,7 +982,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
         split = *KD_SPLIT(kd, nodeid);
 
         if (kd->splitdim)
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
         else {
             bigint tmpsplit;
             tmpsplit = split;
@@ -845,7 +996,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
             assert(query[dim] < POINT_TE(kd, dim, split));
             // is the right child within range?
             // look mum, no int overflow!
-            if (split - tquery[dim] <= closest_so_far) {
+            if (split - tquery[dim] <= prune_dist) {
                 // visit right child - it is within range.
                 assert(POINT_TE(kd, dim, split) - query[dim] > 0.0);
                 //assert(POINT_TE(kd, dim, split) - query[dim] <= bestdist);
@@ -861,7 +1012,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
             // query is on "right" side.
             assert(POINT_TE(kd, dim, split) <= query[dim]);
             // is the left child within range?
-            if (tquery[dim] - split < closest_so_far) {
+            if (tquery[dim] - split < prune_dist) {
                 assert(query[dim] - POINT_TE(kd, dim, split) >= 0.0);
                 //assert(query[dim] - POINT_TE(kd, dim, split) < bestdist);
                 stackpos++;
@@ -883,8 +1034,8 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
     }
 }
 
-void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
-                       double* p_bestd2, int* p_ibest) {
+void MANGLE(kdtree_nn_approx)(const kdtree_t* kd, const void* vquery,
+                              double eps, double* p_bestd2, int* p_ibest) {
     int nodestack[100];
     double dist2stack[100];
     int stackpos = 0;
@@ -893,6 +1044,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
     double bestd2 = *p_bestd2;
     int ibest = *p_ibest;
     const etype* query = vquery;
+    double prune2 = (eps > 0) ? 1.0 / square(1.0 + eps) : 1.0;
 
     if (!kd) {
         WARNING("kdtree_nn: null tree!\n");
@@ -901,7 +1053,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
 
     // Bounding boxes
     if (!kd->split.any) {
-        kdtree_nn_bb(kd, query, p_bestd2, p_ibest);
+        kdtree_nn_bb(kd, query, prune2, p_bestd2, p_ibest);
         return;
     }
 
@@ -912,11 +1064,11 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
     D = kd->ndim;
 #endif
 
-    // Integers.
-    if (TTYPE_INTEGER) {
+    // Integers (with the data in tree units; not "ddu" or "dds").
+    if (TTYPE_INTEGER && DTYPE_INTEGER) {
         ttype tquery[D];
         if (ttype_query(kd, query, tquery)) {
-            kdtree_nn_int_split(kd, query, tquery, p_bestd2, p_ibest);
+            kdtree_nn_int_split(kd, query, tquery, prune2, p_bestd2, p_ibest);
             return;
         }
     }
@@ -943,7 +1095,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
         int farchild;
         double fard2;
 
-        if (dist2stack[stackpos] > bestd2) {
+        if (dist2stack[stackpos] > bestd2 * prune2) {
             // pruned!
             if (kd->fun.nn_prune)
                 kd->fun.nn_prune(kd, nodestack[stackpos], dist2stack[stackpos], bestd2, 1);
@@ -984,7 +1136,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
         // split/dim trees
         split = *KD_SPLIT(kd, nodeid);
         if (kd->splitdim) {
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
         } else {
             // packed int
             bigint tmpsplit = split;
@@ -1002,7 +1154,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
             farchild  = KD_CHILD_LEFT (nodeid);
         }
 
-        if (fard2 <= bestd2) {
+        if (fard2 <= bestd2 * prune2) {
             // is the far child within range?
             stackpos++;
             nodestack[stackpos] = farchild;
@@ -1025,6 +1177,11 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
     *p_ibest = ibest;
 }
 
+void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
+                       double* p_bestd2, int* p_ibest) {
+    MANGLE(kdtree_nn_approx)(kd, vquery, 0.0, p_bestd2, p_ibest);
+}
+
 
 kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
      (const kdtree_t* kd, kdtree_qres_t* res, const void* vquery,
@@ -1181,7 +1338,6 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
 
     while (stackpos >= 0) {
         int nodeid;
-        int i;
         int dim = -1;
         int L, R;
         ttype split = 0;
@@ -1191,41 +1347,16 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
         stackpos--;
 
         if (KD_IS_LEAF(kd, nodeid)) {
-            dtype* data;
             L = kdtree_left(kd, nodeid);
             R = kdtree_right(kd, nodeid);
-
-            if (do_dists) {
-                for (i=L; i<=R; i++) {
-                    anbool bailedout = FALSE;
-                    double dsqd;
-                    data = KD_DATA(kd, D, i);
-                    // FIXME benchmark dist2 vs dist2_bailout.
-
-                    // HACK - should do "use_dtype", just like "use_ttype".
-                    dist2_bailout(kd, query, data, D, maxd2, &bailedout, &dsqd);
-                    if (bailedout)
-                        continue;
-                    if (!add_result(kd, res, dsqd, KD_PERM(kd, i), data,
-                                    D, do_dists, do_points))
-                        return NULL;
-                }
-            } else {
-                for (i=L; i<=R; i++) {
-                    data = KD_DATA(kd, D, i);
-                    // HACK - should do "use_dtype", just like "use_ttype".
-                    if (dist2_exceeds(kd, query, data, D, maxd2))
-                        continue;
-                    if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i), data,
-                                    D, do_dists, do_points))
-                        return NULL;
-                }
-            }
+            if (!leaf_rangesearch(kd, query, L, R, D, maxd2, FALSE, res,
+                                  do_dists, do_points))
+                return NULL;
             continue;
         }
 
         if (kd->splitdim)
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
 
         if (use_bboxes) {
             anbool wholenode = FALSE;
@@ -1239,9 +1370,9 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                 int pdim;
                 anbool cut;
                 if (kd->splitdim)
-                    pdim = kd->splitdim[KD_PARENT(nodeid)];
+                    pdim = KD_SPLITDIM(kd, KD_PARENT(nodeid));
                 else {
-                    pdim = kd->split.TTYPE[KD_PARENT(nodeid)];
+                    pdim = *KD_SPLIT(kd, KD_PARENT(nodeid));
                     pdim &= kd->dimmask;
                 }
                 if (TTYPE_INTEGER && use_tquery) {
@@ -1300,21 +1431,9 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
             if (wholenode) {
                 L = kdtree_left(kd, nodeid);
                 R = kdtree_right(kd, nodeid);
-                if (do_dists) {
-                    for (i=L; i<=R; i++) {
-                        double dsqd = dist2(kd, query, KD_DATA(kd, D, i), D);
-                        if (!add_result(kd, res, dsqd, KD_PERM(kd, i),
-                                        KD_DATA(kd, D, i), D,
-                                        do_dists, do_points))
-                            return NULL;
-                    }
-                } else {
-                    for (i=L; i<=R; i++)
-                        if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i),
-                                        KD_DATA(kd, D, i), D,
-                                        do_dists, do_points))
-                            return NULL;
-                }
+                if (!leaf_rangesearch(kd, query, L, R, D, maxd2, TRUE, res,
+                                      do_dists, do_points))
+                    return NULL;
                 continue;
             }
 
@@ -1367,7 +1486,7 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                     }
                 }
             } else {
-                dtype rsplit = POINT_TE(kd, dim, split);
+                etype rsplit = POINT_TE(kd, dim, split);
                 if (query[dim] < rsplit) {
                     // query is on the "left" side of the split.
                     stackpos++;
@@ -1410,6 +1529,612 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
 }
 
 
+/*
+ Range search for a batch of queries at once.  We walk down the tree
+ carrying the list of queries that could still have results in the
+ current node, so each node's bounding box (or split) is only fetched
+ once for the whole batch.
+
+ The list of queries for each node on the stack lives in "qbuf": the
+ children's lists are written just past their parent's list, so a
+ node's list stays intact until it has been popped.
+ */
+int MANGLE(kdtree_rangesearch_batch)
+     (const kdtree_t* kd, kdtree_qres_t** results, const void* vqueries,
+      int N, const double* maxd2s, int options)
+{
+    int nodestack[100];
+    int liststart[100];
+    int listsize[100];
+    int stackpos = 0;
+    int D;
+    anbool do_dists;
+    anbool do_points = TRUE;
+    anbool use_bboxes = FALSE;
+    const etype* queries = vqueries;
+    double* maxdists = NULL;
+    int* qbuf = NULL;
+    int j;
+    int rtn = -1;
+
+    if (!kd || !queries || N <= 0)
+        return (N == 0 ? 0 : -1);
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#else
+    D = kd->ndim;
+#endif
+
+    if (options & KD_OPTIONS_SORT_DISTS)
+        options |= KD_OPTIONS_COMPUTE_DISTS;
+    do_dists = options & KD_OPTIONS_COMPUTE_DISTS;
+
+    if (!kd->split.any) {
+        assert(kd->bb.any);
+        use_bboxes = TRUE;
+    } else if (kd->bb.any && !(options & KD_OPTIONS_USE_SPLIT)) {
+        use_bboxes = TRUE;
+    }
+    assert(use_bboxes || kd->splitdim || TTYPE_INTEGER);
+
+    for (j=0; j<N; j++) {
+        kdtree_qres_t* res = results[j];
+        if (!res) {
+            res = results[j] = CALLOC(1, sizeof(kdtree_qres_t));
+            if (!res) {
+                SYSERROR("Failed to allocate kdtree_qres_t struct");
+                return -1;
+            }
+        }
+        // (start small: there are many of these, and most get few results)
+        resize_results(res, res->capacity ? res->capacity : KDTREE_BATCH_RESULTS,
+                       D, do_dists, do_points);
+        res->nres = 0;
+    }
+
+    maxdists = MALLOC((size_t)N * sizeof(double));
+    // (each level of the stack holds at most two lists of <= N queries)
+    qbuf = MALLOC((size_t)N * (size_t)(2 * kd->nlevels + 1) * sizeof(int));
+    if (!maxdists || !qbuf) {
+        SYSERROR("Failed to allocate batch query buffers");
+        goto bailout;
+    }
+    for (j=0; j<N; j++) {
+        maxdists[j] = sqrt(maxd2s[j]);
+        qbuf[j] = j;
+    }
+
+    // queue root, with all the queries.
+    nodestack[0] = 0;
+    liststart[0] = 0;
+    listsize[0] = N;
+
+    while (stackpos >= 0) {
+        int nodeid = nodestack[stackpos];
+        int* qlist = qbuf + liststart[stackpos];
+        int nq = listsize[stackpos];
+        int* leftlist;
+        int* rightlist = qlist + nq;
+        int nleft = 0, nright = 0;
+        stackpos--;
+
+        if (KD_IS_LEAF(kd, nodeid)) {
+            int L = kdtree_left(kd, nodeid);
+            int R = kdtree_right(kd, nodeid);
+            for (j=0; j<nq; j++) {
+                int q = qlist[j];
+                if (!leaf_rangesearch(kd, queries + (size_t)q * D, L, R, D,
+                                      maxd2s[q], FALSE, results[q],
+                                      do_dists, do_points))
+                    goto bailout;
+            }
+            continue;
+        }
+
+        if (use_bboxes) {
+            ttype *tlo=NULL, *thi=NULL;
+            etype bblo[D], bbhi[D];
+            int d;
+            bboxes(kd, nodeid, &tlo, &thi, D);
+            assert(tlo && thi);
+            for (d=0; d<D; d++) {
+                bblo[d] = POINT_TE(kd, d, tlo[d]);
+                bbhi[d] = POINT_TE(kd, d, thi[d]);
+            }
+            // both children get the queries that overlap this node.
+            for (j=0; j<nq; j++) {
+                int q = qlist[j];
+                if (bb_point_mindist2_exceeds(bblo, bbhi, queries + (size_t)q * D,
+                                              D, maxd2s[q]))
+                    continue;
+                rightlist[nright++] = q;
+            }
+            leftlist = rightlist;
+            nleft = nright;
+        } else {
+            int dim = -1;
+            ttype split = *KD_SPLIT(kd, nodeid);
+            etype rsplit;
+            if (kd->splitdim)
+                dim = KD_SPLITDIM(kd, nodeid);
+            else {
+                bigint tmpsplit = split;
+                dim = tmpsplit & kd->dimmask;
+                split = tmpsplit & kd->splitmask;
+            }
+            rsplit = POINT_TE(kd, dim, split);
+            for (j=0; j<nq; j++) {
+                int q = qlist[j];
+                if (rsplit - queries[(size_t)q * D + dim] <= maxdists[q])
+                    rightlist[nright++] = q;
+            }
+            // (the left list goes last, since it gets popped first)
+            leftlist = rightlist + nright;
+            for (j=0; j<nq; j++) {
+                int q = qlist[j];
+                if (queries[(size_t)q * D + dim] - rsplit <= maxdists[q])
+                    leftlist[nleft++] = q;
+            }
+        }
+
+        // (the left child gets searched first)
+        if (nright) {
+            stackpos++;
+            nodestack[stackpos] = KD_CHILD_RIGHT(nodeid);
+            liststart[stackpos] = rightlist - qbuf;
+            listsize[stackpos] = nright;
+        }
+        if (nleft) {
+            stackpos++;
+            nodestack[stackpos] = KD_CHILD_LEFT(nodeid);
+            liststart[stackpos] = leftlist - qbuf;
+            listsize[stackpos] = nleft;
+        }
+    }
+
+    for (j=0; j<N; j++) {
+        if (!(options & KD_OPTIONS_NO_RESIZE_RESULTS))
+            resize_results(results[j], results[j]->nres, D, do_dists, do_points);
+        if (options & KD_OPTIONS_SORT_DISTS)
+            kdtree_qsort_results(results[j], kd->ndim);
+    }
+    rtn = 0;
+
+ bailout:
+    FREE(maxdists);
+    FREE(qbuf);
+    return rtn;
+}
+
+/*
+ Spreads the low 16 bits of "x" out so that there are three zero bits
+ between each of them, for interleaving up to four coordinates.
+ */
+static inline u64 morton_spread4(u64 x) {
+    x &= 0xffff;
+    x = (x | (x << 24)) & 0x000000ff000000ffULL;
+    x = (x | (x << 12)) & 0x000f000f000f000fULL;
+    x = (x | (x <<  6)) & 0x0303030303030303ULL;
+    x = (x | (x <<  3)) & 0x1111111111111111ULL;
+    return x;
+}
+
+struct morton_order {
+    u64 code;
+    int index;
+};
+
+static int compare_morton_order(const void* v1, const void* v2) {
+    const struct morton_order* m1 = v1;
+    const struct morton_order* m2 = v2;
+    if (m1->code < m2->code)
+        return -1;
+    if (m1->code > m2->code)
+        return 1;
+    return m1->index - m2->index;
+}
+
+/*
+ Returns the order in which to visit the "N" queries: Morton (Z-curve)
+ order of their first (up to) four coordinates, so consecutive queries
+ are usually close together.  Returns NULL on error.
+ */
+static struct morton_order* morton_order_queries(const etype* queries,
+                                                 int N, int D) {
+    struct morton_order* order;
+    double qlo[4], qscale[4];
+    int ND = MIN(D, 4);
+    int i, d;
+
+    order = MALLOC(N * sizeof(struct morton_order));
+    if (!order) {
+        SYSERROR("Failed to allocate %i Morton codes", N);
+        return NULL;
+    }
+
+    // Morton codes are computed in the bounding box of the queries.
+    for (d=0; d<ND; d++) {
+        double lo = LARGE_VAL, hi = -LARGE_VAL;
+        for (i=0; i<N; i++) {
+            double x = queries[(size_t)i*D + d];
+            lo = MIN(lo, x);
+            hi = MAX(hi, x);
+        }
+        qlo[d] = lo;
+        qscale[d] = (hi > lo) ? 65535.0 / (hi - lo) : 0.0;
+    }
+    for (i=0; i<N; i++) {
+        const etype* query = queries + (size_t)i*D;
+        u64 code = 0;
+        for (d=0; d<ND; d++) {
+            double x = ((double)query[d] - qlo[d]) * qscale[d];
+            code |= morton_spread4((u64)x) << (3 - d);
+        }
+        order[i].code = code;
+        order[i].index = i;
+    }
+    qsort(order, N, sizeof(struct morton_order), compare_morton_order);
+    return order;
+}
+
+/*
+ Nearest-neighbour search for a batch of queries.  The queries are
+ visited in Morton order (see morton_order_queries()); each search is
+ started with the previous query's nearest neighbour as its
+ best-so-far, which lets most of the tree be pruned right away and
+ keeps the nodes it does visit warm in the cache.
+ */
+int MANGLE(kdtree_nn_batch)
+     (const kdtree_t* kd, const void* vqueries, int N,
+      const double* maxd2s, int* inds, double* d2s)
+{
+    const etype* queries = vqueries;
+    struct morton_order* order;
+    int D;
+    int i, j;
+    int prev = -1;
+
+    if (!kd) {
+        ERROR("kdtree_nn_batch: null tree");
+        return -1;
+    }
+    if (N <= 0)
+        return 0;
+    D = kd->ndim;
+
+    order = morton_order_queries(queries, N, D);
+    if (!order)
+        return -1;
+
+    for (j=0; j<N; j++) {
+        const etype* query;
+        double bestd2;
+        int ibest = -1;
+        i = order[j].index;
+        query = queries + (size_t)i*D;
+        bestd2 = (maxd2s ? maxd2s[i] : LARGE_VAL);
+        if (prev != -1) {
+            double d2 = dist2(kd, query, KD_DATA(kd, D, prev), D);
+            if (d2 <= bestd2) {
+                bestd2 = d2;
+                ibest = prev;
+            }
+        }
+        MANGLE(kdtree_nn)(kd, query, &bestd2, &ibest);
+        inds[i] = ibest;
+        if (ibest == -1)
+            continue;
+        if (d2s)
+            d2s[i] = bestd2;
+        prev = ibest;
+    }
+    FREE(order);
+    return 0;
+}
+
+/*
+ The k nearest points found so far, as a max-heap on distance-squared
+ with "n" of "k" entries filled: the farthest is at the top.
+ */
+struct knn_heap {
+    int* inds;
+    double* d2s;
+    int n;
+    int k;
+};
+
+// Distance-squared a point must be within to get into the heap.
+static inline double knn_heap_bound(const struct knn_heap* h, double maxd2) {
+    return (h->n < h->k) ? maxd2 : h->d2s[0];
+}
+
+static void knn_heap_sift_down(struct knn_heap* h, int i, int n) {
+    int ind = h->inds[i];
+    double d2 = h->d2s[i];
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= n)
+            break;
+        if (c+1 < n && h->d2s[c+1] > h->d2s[c])
+            c++;
+        if (h->d2s[c] <= d2)
+            break;
+        h->inds[i] = h->inds[c];
+        h->d2s[i] = h->d2s[c];
+        i = c;
+    }
+    h->inds[i] = ind;
+    h->d2s[i] = d2;
+}
+
+static void knn_heap_add(struct knn_heap* h, int ind, double d2) {
+    int i;
+    if (h->n == h->k) {
+        // replace the farthest.
+        h->inds[0] = ind;
+        h->d2s[0] = d2;
+        knn_heap_sift_down(h, 0, h->n);
+        return;
+    }
+    // sift up.
+    i = h->n++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (h->d2s[parent] >= d2)
+            break;
+        h->inds[i] = h->inds[parent];
+        h->d2s[i] = h->d2s[parent];
+        i = parent;
+    }
+    h->inds[i] = ind;
+    h->d2s[i] = d2;
+}
+
+// Sorts the heap in place, nearest first.
+static void knn_heap_sort(struct knn_heap* h) {
+    int i;
+    for (i=h->n-1; i>0; i--) {
+        int ind = h->inds[0];
+        double d2 = h->d2s[0];
+        h->inds[0] = h->inds[i];
+        h->d2s[0] = h->d2s[i];
+        h->inds[i] = ind;
+        h->d2s[i] = d2;
+        knn_heap_sift_down(h, 0, i);
+    }
+}
+
+/*
+ Adds the nearest points to "query" to the heap "h" (which may already
+ hold some points, as a head start), visiting nearer children first and
+ pruning nodes that are farther than the heap's bound.  Nodes are
+ bounded by their bounding boxes if the tree has them, otherwise by the
+ splitting planes above them.
+ */
+static void kdtree_knn_search(const kdtree_t* kd, const etype* query,
+                              double maxd2, struct knn_heap* h) {
+    int nodestack[100];
+    double dist2stack[100];
+    int stackpos = 0;
+    int D = kd->ndim;
+    double bound;
+
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#endif
+
+    nodestack[0] = 0;
+    dist2stack[0] = 0.0;
+
+    while (stackpos >= 0) {
+        int nodeid;
+        double noded2;
+        int child, nearchild, farchild;
+        double childd2[2];
+
+        nodeid = nodestack[stackpos];
+        noded2 = dist2stack[stackpos];
+        stackpos--;
+        bound = knn_heap_bound(h, maxd2);
+        if (noded2 > bound)
+            continue;
+
+        if (KD_IS_LEAF(kd, nodeid)) {
+            int i, L, R;
+            L = kdtree_left(kd, nodeid);
+            R = kdtree_right(kd, nodeid);
+            for (i=L; i<=R; i++) {
+                anbool bailedout = FALSE;
+                double d2;
+                dist2_bailout(kd, query, KD_DATA(kd, D, i), D, bound,
+                              &bailedout, &d2);
+                if (bailedout)
+                    continue;
+                // (ties with the farthest don't displace it)
+                if (h->n == h->k && d2 >= bound)
+                    continue;
+                knn_heap_add(h, i, d2);
+                bound = knn_heap_bound(h, maxd2);
+            }
+            continue;
+        }
+
+        if (kd->bb.any) {
+            for (child=0; child<2; child++) {
+                ttype *tlo = NULL, *thi = NULL;
+                int childid = (child ? KD_CHILD_RIGHT(nodeid) :
+                               KD_CHILD_LEFT(nodeid));
+                double d2 = 0.0;
+                int d;
+                bboxes(kd, childid, &tlo, &thi, D);
+                for (d=0; d<D; d++) {
+                    etype bblo = POINT_TE(kd, d, tlo[d]);
+                    etype bbhi;
+                    if (query[d] < bblo) {
+                        d2 += (bblo - query[d])*(bblo - query[d]);
+                        continue;
+                    }
+                    bbhi = POINT_TE(kd, d, thi[d]);
+                    if (query[d] > bbhi)
+                        d2 += (query[d] - bbhi)*(query[d] - bbhi);
+                }
+                childd2[child] = d2;
+            }
+            if (childd2[0] <= childd2[1]) {
+                nearchild = KD_CHILD_LEFT(nodeid);
+                farchild = KD_CHILD_RIGHT(nodeid);
+            } else {
+                double tmp = childd2[0];
+                childd2[0] = childd2[1];
+                childd2[1] = tmp;
+                nearchild = KD_CHILD_RIGHT(nodeid);
+                farchild = KD_CHILD_LEFT(nodeid);
+            }
+        } else {
+            ttype split = *KD_SPLIT(kd, nodeid);
+            int dim;
+            etype rsplit;
+            double del;
+            if (kd->splitdim) {
+                dim = KD_SPLITDIM(kd, nodeid);
+            } else {
+                // packed int
+                bigint tmpsplit = split;
+                dim = tmpsplit & kd->dimmask;
+                split = tmpsplit & kd->splitmask;
+            }
+            rsplit = POINT_TE(kd, dim, split);
+            del = query[dim] - rsplit;
+            if (query[dim] < rsplit) {
+                nearchild = KD_CHILD_LEFT (nodeid);
+                farchild  = KD_CHILD_RIGHT(nodeid);
+            } else {
+                nearchild = KD_CHILD_RIGHT(nodeid);
+                farchild  = KD_CHILD_LEFT (nodeid);
+            }
+            // both are lower bounds for the far child.
+            childd2[0] = noded2;
+            childd2[1] = MAX(noded2, del*del);
+        }
+
+        // it's a stack, so put the far one on first.
+        if (childd2[1] <= bound) {
+            stackpos++;
+            nodestack[stackpos] = farchild;
+            dist2stack[stackpos] = childd2[1];
+        }
+        if (childd2[0] <= bound) {
+            stackpos++;
+            nodestack[stackpos] = nearchild;
+            dist2stack[stackpos] = childd2[0];
+        }
+    }
+}
+
+int MANGLE(kdtree_knn)(const kdtree_t* kd, const void* vquery, int k,
+                       double maxd2, int* inds, double* d2s) {
+    struct knn_heap h;
+    double* tempd2s = NULL;
+
+    if (!kd) {
+        ERROR("kdtree_knn: null tree");
+        return -1;
+    }
+    if (k <= 0)
+        return 0;
+    if (!d2s) {
+        tempd2s = MALLOC(k * sizeof(double));
+        if (!tempd2s) {
+            SYSERROR("Failed to allocate %i distances", k);
+            return -1;
+        }
+        d2s = tempd2s;
+    }
+    h.inds = inds;
+    h.d2s = d2s;
+    h.n = 0;
+    h.k = k;
+    kdtree_knn_search(kd, vquery, maxd2, &h);
+    knn_heap_sort(&h);
+    FREE(tempd2s);
+    return h.n;
+}
+
+/*
+ k-nearest-neighbour search for a batch of queries, in Morton order;
+ each search is bounded by the distance to the previous query's
+ neighbours, which prunes most of the tree right away.
+ */
+int MANGLE(kdtree_knn_batch)
+     (const kdtree_t* kd, const void* vqueries, int N, int k,
+      const double* maxd2s, int* inds, double* d2s, int* counts)
+{
+    const etype* queries = vqueries;
+    struct morton_order* order;
+    struct knn_heap h;
+    double* tempd2s = NULL;
+    int* prev = NULL;
+    int nprev = 0;
+    int D;
+    int i, j, m;
+    int rtn = -1;
+
+    if (!kd) {
+        ERROR("kdtree_knn_batch: null tree");
+        return -1;
+    }
+    if (N <= 0 || k <= 0)
+        return 0;
+    D = kd->ndim;
+
+    order = morton_order_queries(queries, N, D);
+    prev = MALLOC(k * sizeof(int));
+    if (!d2s)
+        tempd2s = MALLOC(k * sizeof(double));
+    if (!order || !prev || (!d2s && !tempd2s)) {
+        SYSERROR("Failed to allocate k-nearest-neighbour buffers");
+        goto bailout;
+    }
+    h.k = k;
+
+    for (j=0; j<N; j++) {
+        const etype* query;
+        double maxd2;
+        i = order[j].index;
+        query = queries + (size_t)i*D;
+        maxd2 = (maxd2s ? maxd2s[i] : LARGE_VAL);
+        h.inds = inds + (size_t)i*k;
+        h.d2s = d2s ? (d2s + (size_t)i*k) : tempd2s;
+        // the previous query's k neighbours are k points within the
+        // farthest of their distances to this query, so the search can
+        // be limited to that.
+        if (nprev == k) {
+            double bound = 0.0;
+            for (m=0; m<nprev; m++)
+                bound = MAX(bound, dist2(kd, query, KD_DATA(kd, D, prev[m]), D));
+            maxd2 = MIN(maxd2, bound);
+        }
+        h.n = 0;
+        kdtree_knn_search(kd, query, maxd2, &h);
+        knn_heap_sort(&h);
+        for (m=h.n; m<k; m++)
+            h.inds[m] = -1;
+        if (counts)
+            counts[i] = h.n;
+        nprev = h.n;
+        memcpy(prev, h.inds, nprev * sizeof(int));
+    }
+    rtn = 0;
+ bailout:
+    FREE(order);
+    FREE(prev);
+    FREE(tempd2s);
+    return rtn;
+}
+
+
 static void* get_data(const kdtree_t* kd, int i) {
     return KD_DATA(kd, kd->ndim, i);
 }
@@ -1438,17 +2163,20 @@ static void copy_data_double(const kdtree_t* kd, int start, int N,
 #endif
 }
 
-static dtype* kdqsort_arr;
-static int kdqsort_D;
+struct kdqsort_token {
+    const dtype* arr;
+    int D;
+};
 
-static int kdqsort_compare(const void* v1, const void* v2)
+static int kdqsort_compare(void* token, const void* v1, const void* v2)
 {
+    const struct kdqsort_token* t = token;
     int i1, i2;
     dtype val1, val2;
     i1 = *((int*)v1);
     i2 = *((int*)v2);
-    val1 = kdqsort_arr[(size_t)i1 * (size_t)kdqsort_D];
-    val2 = kdqsort_arr[(size_t)i2 * (size_t)kdqsort_D];
+    val1 = t->arr[(size_t)i1 * (size_t)t->D];
+    val2 = t->arr[(size_t)i2 * (size_t)t->D];
     if (val1 < val2)
         return -1;
     else if (val1 > val2)
@@ -1462,6 +2190,7 @@ static int kdtree_qsort(dtype *arr, unsigned int *parr, int l, int r, int D, int
     int i, j, N;
     dtype* tmparr;
     int* tmpparr;
+    struct kdqsort_token token;
 
     N = r - l + 1;
     permute = MALLOC((size_t)N * sizeof(int));
@@ -1471,10 +2200,10 @@ static int kdtree_qsort(dtype *arr, unsigned int *parr, int l, int r, int D, int
     }
     for (i = 0; i < N; i++)
         permute[i] = i;
-    kdqsort_arr = arr + (size_t)l * (size_t)D + (size_t)d;
-    kdqsort_D = D;
+    token.arr = arr + (size_t)l * (size_t)D + (size_t)d;
+    token.D = D;
 
-    qsort(permute, N, sizeof(int), kdqsort_compare);
+    QSORT_R(permute, N, sizeof(int), &token, kdqsort_compare);
 
     // permute the data one dimension at a time...
     tmparr = MALLOC(N * sizeof(dtype));
@@ -1919,7 +2648,7 @@ static int kdtree_check_node(const kdtree_t* kd, int nodeid) {
 
             split = *KD_SPLIT(kd, nodeid);
             if (kd->splitdim)
-                dim = kd->splitdim[nodeid];
+                dim = KD_SPLITDIM(kd, nodeid);
             else {
                 if (TTYPE_INTEGER) {
                     bigint tmpsplit;
@@ -2002,7 +2731,7 @@ static double compute_scale(dtype* ddata, int N, int D,
         }
     }
     range = maxrange(lo, hi, D);
-    return (double)(DTYPE_MAX) / range;
+    return (double)(TTYPE_MAX) / range;
 }
 
 // same as "compute_scale" but takes data of "etype".
@@ -2124,18 +2853,300 @@ static int needs_data_conversion() {
     return DTYPE_INTEGER && !ETYPE_INTEGER;
 }
 
+// An integer tree over non-integer data (eg, "ddu") also needs the
+// scale, to convert the bounding boxes and splitting planes.
+static int needs_tree_scale() {
+    return TTYPE_INTEGER && !ETYPE_INTEGER;
+}
+
+/*
+ Splits node "i", which owns data points [left, right], and stores its
+ bounding box and/or splitting plane.  Returns "m", such that the left
+ child owns [left, m-1] and the right child [m, right]; or -1 on error.
+ Nodes with fewer than two points are not split: the right child is
+ empty.
+
+ This only touches node i's data, so nodes that own disjoint ranges can
+ be split concurrently.
+ */
+static int build_node(kdtree_t* kd, int i, int left, int right,
+                      unsigned int options) {
+#if defined(KD_DIM)
+    const int D = KD_DIM;
+#else
+    const int D = kd->ndim;
+#endif
+    unsigned int d;
+    dtype hi[D], lo[D];
+    dtype maxrange;
+    ttype s;
+    int dim = 0;
+    int m;
+    dtype qsplit = 0;
+    int xx;
+    dtype* data = kd->data.DTYPE;
+
+    // (this also tells the compiler that compute_bb() sets lo,hi.)
+    if (D < 1)
+        return -1;
+
+    if (left >= right) {
+        //debug("Empty node %i: left=right=%i\n", i, left);
+        if (options & KD_BUILD_BBOX) {
+            for (d=0; d<D; d++)
+                lo[d] = 0;
+            save_bb(kd, i, lo, lo);
+        }
+        if (kd->splitdim)
+            KD_SPLITDIM(kd, i) = 0;
+        return right + 1;
+    }
+
+    /* More sanity */
+    assert(0 <= left);
+    assert(left <= right);
+    assert(right < kd->ndata);
+
+    /* Find the bounding-box for this node. */
+    compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
+
+    if (options & KD_BUILD_BBOX)
+        save_bb(kd, i, lo, hi);
+
+    /* Split along dimension with largest range */
+    maxrange = DTYPE_MIN;
+    for (d=0; d<D; d++)
+        if ((hi[d] - lo[d]) >= maxrange) {
+            maxrange = hi[d] - lo[d];
+            dim = d;
+        }
+    d = dim;
+    assert (d < D);
+
+    if ((options & KD_BUILD_FORCE_SORT) ||
+        (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM))) {
+        
+        /* We're packing dimension and split location into an int. */
+
+        /* Sort the data. */
+
+        /* Because the nature of the inttree is to bin the split
+         * planes, we have to be careful. Here, we MUST sort instead
+         * of merely partitioning, because we may not be able to
+         * properly represent the median as a split plane. Imagine the
+         * following on the dtype line: 
+         *
+         *    |P P   | P M  | P    |P     |  PP |  ------> X
+         *           1      2
+         * The |'s are possible split positions. If M is selected to
+         * split on, we actually cannot select the split 1 or 2
+         * immediately, because if we selected 2, then M would be on
+         * the wrong side (the medians always go to the right) and we
+         * can't select 1 because then P would be on the wrong side.
+         * So, the solution is to try split 2, and if point M-1 is on
+         * the correct side, great. Otherwise, we have to move shift
+         * point M-1 into the right side and only then chose plane 1. */
+
+
+        /* FIXME but qsort allocates a 2nd perm array GAH */
+        if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
+            ERROR("kdtree_qsort failed");
+            return -1;
+        }
+        m = (1 + (size_t)left + (size_t)right)/2;
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        
+        /* Make sure sort works */
+        for(xx=left; xx<=right-1; xx++) {
+            assert(KD_ARRAY_VAL(data, D, xx,   d) <=
+                   KD_ARRAY_VAL(data, D, xx+1, d));
+        }
+
+        /* Encode split dimension and value. */
+        /* "s" is the location of the splitting plane in the "tree"
+         data type. */
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        if (kd->split.any) {
+            /* If we are using the "split" array to store both the
+             splitting plane and the splitting dimension, then we
+             truncate a few bits from "s" here. */
+            bigint tmps = s;
+            tmps &= kd->splitmask;
+            assert((tmps & kd->dimmask) == 0);
+            s = tmps;
+        }
+        /* "qsplit" is the location of the splitting plane in the "data"
+         type. */
+        qsplit = POINT_TD(kd, d, s);
+
+        /* Play games to make sure we properly partition the data */
+        while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
+        while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
+
+        /* Even more sanity */
+        assert(m >= -1);
+        assert(left <= m);
+        assert(m <= right);
+        for (xx=left; m && xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
+        for (xx=m; xx<=right; xx++)
+            assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
+
+    } else {
+        /* "m-1" becomes R of the left child;
+         "m" becomes L of the right child. */
+        if (kd->has_linear_lr) {
+            m = kdtree_left(kd, KD_CHILD_RIGHT(i));
+        } else {
+            /* Pivot the data at the median */
+            m = (1 + (size_t)left + (size_t)right) / 2;
+        }
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
+
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        assert(m != 0);
+        assert(left <= (m-1));
+        assert(m <= right);
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <=
+                   KD_ARRAY_VAL(data, D, m, d));
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
+        for (xx=m; xx<=right; xx++)
+            assert(KD_ARRAY_VAL(data, D, m, d) <=
+                   KD_ARRAY_VAL(data, D, xx, d));
+        for (xx=m; xx<=right; xx++)
+            assert(s <= KD_ARRAY_VAL(data, D, xx, d));
+    }
+
+    if (kd->split.any) {
+        if (kd->splitdim)
+            *KD_SPLIT(kd, i) = s;
+        else {
+            bigint tmps = s;
+            *KD_SPLIT(kd, i) = tmps | dim;
+        }
+    }
+    if (kd->splitdim)
+        KD_SPLITDIM(kd, i) = dim;
+
+    return m;
+}
+
+/*
+ The parallel build keeps the [left, right] range of every node, rather
+ than using the "lr" array as a stack, so that nodes can be built in any
+ order once their parent has been split.
+ */
+struct build_arg {
+    kdtree_t* kd;
+    unsigned int options;
+    int* nodeL;
+    int* nodeR;
+    // first node of the level being built
+    int first;
+    // build each node's whole subtree?
+    anbool subtrees;
+};
+
+static int build_split(struct build_arg* a, int i) {
+    int m = build_node(a->kd, i, a->nodeL[i], a->nodeR[i], a->options);
+    if (m == -1)
+        return -1;
+    a->nodeL[KD_CHILD_LEFT(i)]  = a->nodeL[i];
+    a->nodeR[KD_CHILD_LEFT(i)]  = m - 1;
+    a->nodeL[KD_CHILD_RIGHT(i)] = m;
+    a->nodeR[KD_CHILD_RIGHT(i)] = a->nodeR[i];
+    return 0;
+}
+
+static int build_subtree(struct build_arg* a, int i) {
+    kdtree_t* kd = a->kd;
+    if (i >= kd->ninterior) {
+        if (a->options & KD_BUILD_BBOX) {
+#if defined(KD_DIM)
+            const int D = KD_DIM;
+#else
+            int D = kd->ndim;
+#endif
+            dtype hi[D], lo[D];
+            compute_bb(KD_DATA(kd, D, a->nodeL[i]), D,
+                       a->nodeR[i] - a->nodeL[i] + 1, lo, hi);
+            save_bb(kd, i, lo, hi);
+        }
+        return 0;
+    }
+    if (build_split(a, i) ||
+        build_subtree(a, KD_CHILD_LEFT(i)) ||
+        build_subtree(a, KD_CHILD_RIGHT(i)))
+        return -1;
+    return 0;
+}
+
+static int build_level(void* varg, int lo, int hi) {
+    struct build_arg* a = varg;
+    int i;
+    for (i=lo; i<hi; i++) {
+        int node = a->first + i;
+        if (a->subtrees ? build_subtree(a, node) : build_split(a, node))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ Builds the tree with kd->build_threads threads: the top levels are
+ built one level at a time, with the nodes of each level shared among
+ the threads; once there are enough nodes, each thread builds whole
+ subtrees (including the leaf bounding boxes).
+ */
+static int build_parallel(kdtree_t* kd, unsigned int options) {
+    struct build_arg a;
+    int level, i;
+    int rtn = -1;
+
+    a.kd = kd;
+    a.options = options;
+    a.nodeL = MALLOC(kd->nnodes * sizeof(int));
+    a.nodeR = MALLOC(kd->nnodes * sizeof(int));
+    if (!a.nodeL || !a.nodeR) {
+        SYSERROR("Failed to allocate node ranges for %i nodes", kd->nnodes);
+        goto bailout;
+    }
+    a.nodeL[0] = 0;
+    a.nodeR[0] = kd->ndata - 1;
+    a.first = 0;
+    for (level=0; level<kd->nlevels; level++) {
+        int n = 1 << level;
+        a.subtrees = (n >= 4 * kd->build_threads) || (level == kd->nlevels-1);
+        if (kdtree_parallel_for(kd->build_threads, n, 1, build_level, &a))
+            goto bailout;
+        if (a.subtrees)
+            break;
+        a.first += n;
+    }
+    for (i=0; i<kd->nbottom; i++)
+        kd->lr[i] = a.nodeR[kd->ninterior + i];
+    rtn = 0;
+ bailout:
+    FREE(a.nodeL);
+    FREE(a.nodeR);
+    return rtn;
+}
+
 kdtree_t* MANGLE(kdtree_build_2)
      (kdtree_t* kd, etype* indata, int N, int D, int Nleaf, int treetype, unsigned int options, double* minval, double* maxval) {
     int i;
-    int xx;
     int lnext, level;
     int maxlevel;
     dtype hi[D], lo[D];
-    dtype* data = NULL;
-
-    dtype nullbb[D];
-    for (i=0; i<D; i++)
-        nullbb[i] = 0;
 
     maxlevel = kdtree_compute_levels(N, Nleaf);
 
@@ -2206,11 +3217,11 @@ kdtree_t* MANGLE(kdtree_build_2)
             }
         }
     }
-    if (needs_data_conversion()) {
+    if (needs_tree_scale()) {
         // compute scaling params
         if (!kd->minval || !kd->maxval) {
-            free(kd->minval);
-            free(kd->maxval);
+            FREE(kd->minval);
+            FREE(kd->maxval);
             kd->minval = MALLOC(D * sizeof(double));
             kd->maxval = MALLOC(D * sizeof(double));
             assert(kd->minval);
@@ -2260,199 +3271,53 @@ kdtree_t* MANGLE(kdtree_build_2)
     lnext = 1;
     level = 0;
 
-    // shorthand
-    data = kd->data.DTYPE;
-
     /* And in one shot, make the kdtree. Because the lr pointers
      * are only stored for the bottom layer, we use the lr array as a
      * stack. At finish, it contains the r pointers for the bottom nodes.
      * The l pointer is simply +1 of the previous right pointer, or 0 if we
      * are at the first element of the lr array. */
-    for (i = 0; i < kd->ninterior; i++) {
-        unsigned int d;
-        int left, right;
-        dtype maxrange;
-        ttype s;
-        unsigned int c;
-        int dim = 0;
-        int m;
-        dtype qsplit = 0;
-
-        /* Have we reached the next level in the tree? */
-        if (i == lnext) {
-            level++;
-            lnext = lnext * 2 + 1;
-        }
-
-        /* Since we're not storing the L pointers, we have to infer L */
-        if (i == (1<<level)-1) {
-            left = 0;
-        } else {
-            left = kd->lr[i-1] + 1;
-        }
-        right = kd->lr[i];
-
-        assert(right != (unsigned int)-1);
-
-        if (left >= right) {
-            //debug("Empty node %i: left=right=%i\n", i, left);
-            if (options & KD_BUILD_BBOX)
-                save_bb(kd, i, nullbb, nullbb);
-            if (kd->splitdim)
-                kd->splitdim[i] = 0;
-            c = 2*i;
-            if (level == maxlevel - 2)
-                c -= kd->ninterior;
-            kd->lr[c+1] = right;
-            kd->lr[c+2] = right;
-            continue;
+    if (kd->build_threads > 1) {
+        if (build_parallel(kd, options)) {
+            ERROR("Failed to build kd-tree");
+            return NULL;
         }
+    } else {
+        for (i = 0; i < kd->ninterior; i++) {
+            int left, right, m;
+            unsigned int c;
+
+            /* Have we reached the next level in the tree? */
+            if (i == lnext) {
+                level++;
+                lnext = lnext * 2 + 1;
+            }
 
-        /* More sanity */
-        assert(0 <= left);
-        assert(left <= right);
-        assert(right < N);
+            /* Since we're not storing the L pointers, we have to infer L */
+            if (i == (1<<level)-1) {
+                left = 0;
+            } else {
+                left = kd->lr[i-1] + 1;
+            }
+            right = kd->lr[i];
 
-        /* Find the bounding-box for this node. */
-        compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
+            assert(right != (unsigned int)-1);
 
-        if (options & KD_BUILD_BBOX)
-            save_bb(kd, i, lo, hi);
-
-        /* Split along dimension with largest range */
-        maxrange = DTYPE_MIN;
-        for (d=0; d<D; d++)
-            if ((hi[d] - lo[d]) >= maxrange) {
-                maxrange = hi[d] - lo[d];
-                dim = d;
-            }
-        d = dim;
-        assert (d < D);
-
-        if ((options & KD_BUILD_FORCE_SORT) ||
-            (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM))) {
-            
-            /* We're packing dimension and split location into an int. */
-
-            /* Sort the data. */
-
-            /* Because the nature of the inttree is to bin the split
-             * planes, we have to be careful. Here, we MUST sort instead
-             * of merely partitioning, because we may not be able to
-             * properly represent the median as a split plane. Imagine the
-             * following on the dtype line: 
-             *
-             *    |P P   | P M  | P    |P     |  PP |  ------> X
-             *           1      2
-             * The |'s are possible split positions. If M is selected to
-             * split on, we actually cannot select the split 1 or 2
-             * immediately, because if we selected 2, then M would be on
-             * the wrong side (the medians always go to the right) and we
-             * can't select 1 because then P would be on the wrong side.
-             * So, the solution is to try split 2, and if point M-1 is on
-             * the correct side, great. Otherwise, we have to move shift
-             * point M-1 into the right side and only then chose plane 1. */
-
-
-            /* FIXME but qsort allocates a 2nd perm array GAH */
-            if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
-                ERROR("kdtree_qsort failed");
+            m = build_node(kd, i, left, right, options);
+            if (m == -1) {
                 // FIXME: memleak mania!
                 return NULL;
             }
-            m = (1 + (size_t)left + (size_t)right)/2;
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            
-            /* Make sure sort works */
-            for(xx=left; xx<=right-1; xx++) {
-                assert(KD_ARRAY_VAL(data, D, xx,   d) <=
-                       KD_ARRAY_VAL(data, D, xx+1, d));
-            }
 
-            /* Encode split dimension and value. */
-            /* "s" is the location of the splitting plane in the "tree"
-             data type. */
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            if (kd->split.any) {
-                /* If we are using the "split" array to store both the
-                 splitting plane and the splitting dimension, then we
-                 truncate a few bits from "s" here. */
-                bigint tmps = s;
-                tmps &= kd->splitmask;
-                assert((tmps & kd->dimmask) == 0);
-                s = tmps;
-            }
-            /* "qsplit" is the location of the splitting plane in the "data"
-             type. */
-            qsplit = POINT_TD(kd, d, s);
-
-            /* Play games to make sure we properly partition the data */
-            while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
-            while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
-
-            /* Even more sanity */
-            assert(m >= -1);
-            assert(left <= m);
-            assert(m <= right);
-            for (xx=left; m && xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
-            for (xx=m; xx<=right; xx++)
-                assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
+            /* Store the R pointers for each child */
+            c = 2*i;
+            if (level == maxlevel - 2)
+                c -= kd->ninterior;
 
-        } else {
-            /* "m-1" becomes R of the left child;
-             "m" becomes L of the right child. */
-            if (kd->has_linear_lr) {
-                m = kdtree_left(kd, KD_CHILD_RIGHT(i));
-            } else {
-                /* Pivot the data at the median */
-                m = (1 + (size_t)left + (size_t)right) / 2;
-            }
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
-
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            assert(m != 0);
-            assert(left <= (m-1));
-            assert(m <= right);
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <=
-                       KD_ARRAY_VAL(data, D, m, d));
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
-            for (xx=m; xx<=right; xx++)
-                assert(KD_ARRAY_VAL(data, D, m, d) <=
-                       KD_ARRAY_VAL(data, D, xx, d));
-            for (xx=m; xx<=right; xx++)
-                assert(s <= KD_ARRAY_VAL(data, D, xx, d));
-        }
+            kd->lr[c+1] = m-1;
+            kd->lr[c+2] = right;
 
-        if (kd->split.any) {
-            if (kd->splitdim)
-                *KD_SPLIT(kd, i) = s;
-            else {
-                bigint tmps = s;
-                *KD_SPLIT(kd, i) = tmps | dim;
-            }
+            assert(c+2 < kd->nbottom);
         }
-        if (kd->splitdim)
-            kd->splitdim[i] = dim;
-
-        /* Store the R pointers for each child */
-        c = 2*i;
-        if (level == maxlevel - 2)
-            c -= kd->ninterior;
-
-        kd->lr[c+1] = m-1;
-        kd->lr[c+2] = right;
-
-        assert(c+2 < kd->nbottom);
     }
 
     for (i=0; i<kd->nbottom-1; i++)
@@ -2460,8 +3325,9 @@ kdtree_t* MANGLE(kdtree_build_2)
 
     if (options & KD_BUILD_BBOX) {
         // Compute bounding boxes for leaf nodes.
+        // (The parallel build has already done this.)
         int L, R = -1;
-        for (i=0; i<kd->nbottom; i++) {
+        for (i=0; kd->build_threads <= 1 && i<kd->nbottom; i++) {
             L = R + 1;
             R = kd->lr[i];
             assert(L == kdtree_leaf_left(kd, i + kd->ninterior));
@@ -2498,6 +3364,19 @@ kdtree_t* MANGLE(kdtree_build_2)
         kd->lr = NULL;
     }
 
+    if ((options & KD_BUILD_VEB_LAYOUT) &&
+        kdtree_convert_to_veb_layout(kd)) {
+        ERROR("Failed to convert kd-tree to vEB layout");
+        return NULL;
+    }
+
+    if (options & KD_BUILD_PACK_DATA) {
+        if (DTYPE_INTEGER)
+            kd->packed_data = 1;
+        else
+            ERROR("Warning: only integer kd-tree data can be packed");
+    }
+
     // set function table pointers.
     MANGLE(kdtree_update_funcs)(kd);
 
@@ -2905,6 +3784,31 @@ int MANGLE(kdtree_get_bboxes)(const kdtree_t* kd, int node,
     return TRUE;
 }
 
+#if defined(KD_DIM)
+/*
+ Points the query functions of tree "kd" (whose dimension is KD_DIM) at
+ this instantiation's, where the distance and bounding-box loops have a
+ fixed trip count.  Called by the general instantiation's
+ kdtree_update_funcs().
+ */
+void MANGLE(kdtree_update_funcs_dim)(kdtree_t* kd) {
+    assert(kd->ndim == KD_DIM);
+    kd->fun.nearest_neighbour_internal = MANGLE(kdtree_nn);
+    kd->fun.nearest_neighbour_approx = MANGLE(kdtree_nn_approx);
+    kd->fun.rangesearch = MANGLE(kdtree_rangesearch_options);
+    kd->fun.rangesearch_batch = MANGLE(kdtree_rangesearch_batch);
+    kd->fun.nn_batch = MANGLE(kdtree_nn_batch);
+    kd->fun.knn = MANGLE(kdtree_knn);
+    kd->fun.knn_batch = MANGLE(kdtree_knn_batch);
+    kd->fun.nodes_contained = MANGLE(kdtree_nodes_contained);
+}
+#elif defined(KD_SPECIALIZED_DIMS)
+#define KD_DECLARE_DIM_FUNCS(D)                                         \
+    void KDMANGLE_DIM(kdtree_update_funcs_dim, ETYPE, DTYPE, TTYPE, D)(kdtree_t* kd);
+KD_SPECIALIZED_DIMS(KD_DECLARE_DIM_FUNCS)
+#undef KD_DECLARE_DIM_FUNCS
+#endif
+
 void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
     kd->fun.get_data = get_data;
     kd->fun.copy_data_double = copy_data_double;
@@ -2913,7 +3817,22 @@ void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
     kd->fun.check = MANGLE(kdtree_check);
     kd->fun.fix_bounding_boxes = MANGLE(kdtree_fix_bounding_boxes);
     kd->fun.nearest_neighbour_internal = MANGLE(kdtree_nn);
+    kd->fun.nearest_neighbour_approx = MANGLE(kdtree_nn_approx);
     kd->fun.rangesearch = MANGLE(kdtree_rangesearch_options);
+    kd->fun.rangesearch_batch = MANGLE(kdtree_rangesearch_batch);
+    kd->fun.nn_batch = MANGLE(kdtree_nn_batch);
+    kd->fun.knn = MANGLE(kdtree_knn);
+    kd->fun.knn_batch = MANGLE(kdtree_knn_batch);
     kd->fun.nodes_contained = MANGLE(kdtree_nodes_contained);
+#if !defined(KD_DIM) && defined(KD_SPECIALIZED_DIMS)
+#define KD_SET_DIM_FUNCS(D)                                             \
+    case D: KDMANGLE_DIM(kdtree_update_funcs_dim, ETYPE, DTYPE, TTYPE, D)(kd); break;
+    switch (kd->ndim) {
+        KD_SPECIALIZED_DIMS(KD_SET_DIM_FUNCS)
+    default:
+        break;
+    }
+#undef KD_SET_DIM_FUNCS
+#endif
 }
 
@@ -11,6 +11,11 @@
 #define GLUE3(base, x, y, z) base ## _ ## x ## y ## z
 #define KDMANGLE(func, e, d, t) GLUE3(func, e, d, t)
 
+// Functions of the instantiations specialized for dimension "D" (see
+// kdint_ddd_3.c, eg) get an extra suffix: kdtree_knn_ddd_3.
+#define GLUE4(base, x, y, z, D) base ## _ ## x ## y ## z ## _ ## D
+#define KDMANGLE_DIM(func, e, d, t, D) GLUE4(func, e, d, t, D)
+
 #define KD_DECLARE(func, rtn, args) \
 rtn KDMANGLE(func, d, d, d)args; \
 rtn KDMANGLE(func, f, f, f)args; \
@@ -37,9 +42,36 @@ rtn KDMANGLE(func, d, s, s)args
 		fprintf(stderr, #func ": unimplemented treetype %#x.\n", tt); \
 	}
 
+/*
+ Position of node "i" (in breadth-first numbering) in the van Emde Boas
+ layout of a complete binary tree with "nlevels" levels: the top
+ floor(nlevels/2) levels come first, then each of the subtrees hanging
+ below them, each laid out the same way.
+ */
+size_t kdtree_veb_position(int i, int nlevels);
+
+// Index into the bounding-box array of node "i", and into the split and
+// splitdim arrays of interior node "i".
+#define KD_BB_NODE(kd, i)                                               \
+    ((kd)->veb_layout ? kdtree_veb_position((i), (kd)->nlevels) : (size_t)(i))
+#define KD_SPLIT_NODE(kd, i)                                            \
+    ((kd)->veb_layout ? kdtree_veb_position((i), (kd)->nlevels - 1) : (size_t)(i))
+
+// Get the split dimension of interior node "i"; kd->splitdim must be set.
+#define KD_SPLITDIM(kd, i) ((kd)->splitdim[KD_SPLIT_NODE(kd, i)])
+
 /* Compute how many levels should be used if you have "N" points and you
    want "Nleaf" points in the leaf nodes.
 */
 int kdtree_compute_levels(int N, int Nleaf);
 
+/*
+ Calls func(arg, lo, hi) for consecutive ranges [lo, hi) of [0, N), at
+ most "chunk" long, shared among "nthreads" threads (including the
+ calling thread).  Stops handing out ranges once a call returns
+ non-zero.  Returns 0 if all calls returned 0, -1 otherwise.
+ */
+int kdtree_parallel_for(int nthreads, int N, int chunk,
+                        int (*func)(void* arg, int lo, int hi), void* arg);
+
 #endif
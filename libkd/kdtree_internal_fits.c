@@ -3,7 +3,8 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
-#ifndef KDTREE_NO_FITS
+// (dimension-specialized instantiations have only the query functions.)
+#if !defined(KDTREE_NO_FITS) && !defined(KD_DIM)
 
 #include "kdtree_fits_io.h"
 #include "kdtree.h"
@@ -22,8 +23,93 @@ static char* get_table_name(const char* treename, const char* tabname) {
     return rtn;
 }
 
-int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
+#if DTYPE_INTEGER
+/*
+ Packed data (see kdtree_t.packed_data): each point is stored as one
+ packtype (half the width of the data type) per dimension, giving its
+ position between the lower and upper corners of its leaf's bounding box
+ (stored as two points per leaf, in the data type) in PACKTYPE_MAXths of
+ the way across.
+ */
+static dtype unpack_value(dtype lo, dtype hi, packtype q) {
+    return lo + (dtype)floor(q * ((double)hi - (double)lo) / PACKTYPE_MAX + 0.5);
+}
+
+// Returns the largest error of a packed value, in the data type's units.
+static double pack_data(const kdtree_t* kd, dtype* leafbb, packtype* packed) {
+    const dtype* data = kd->data.any;
+    int D = kd->ndim;
+    double maxerr = 0.0;
+    int leaf, i, d;
+    for (leaf=0; leaf<kd->nbottom; leaf++) {
+        int nodeid = kd->ninterior + leaf;
+        int L = kdtree_leaf_left(kd, nodeid);
+        int R = kdtree_leaf_right(kd, nodeid);
+        dtype* lo = leafbb + 2 * D * leaf;
+        dtype* hi = lo + D;
+        for (d=0; d<D; d++) {
+            lo[d] = DTYPE_MAX;
+            hi[d] = DTYPE_MIN;
+        }
+        if (L > R) {
+            // empty leaf
+            memset(lo, 0, 2 * D * sizeof(dtype));
+            continue;
+        }
+        for (i=L; i<=R; i++)
+            for (d=0; d<D; d++) {
+                lo[d] = MIN(lo[d], data[(size_t)i*D + d]);
+                hi[d] = MAX(hi[d], data[(size_t)i*D + d]);
+            }
+        for (i=L; i<=R; i++)
+            for (d=0; d<D; d++) {
+                dtype x = data[(size_t)i*D + d];
+                double span = (double)hi[d] - (double)lo[d];
+                packtype q = (span > 0) ?
+                    (packtype)floor(((double)x - (double)lo[d]) * PACKTYPE_MAX / span + 0.5) : 0;
+                dtype y = unpack_value(lo[d], hi[d], q);
+                packed[(size_t)i*D + d] = q;
+                maxerr = MAX(maxerr, fabs((double)x - (double)y));
+            }
+    }
+    return maxerr;
+}
+
+static void unpack_data(kdtree_t* kd, const dtype* leafbb, const packtype* packed) {
+    dtype* data = kd->data.any;
+    int D = kd->ndim;
+    int leaf, i, d;
+    for (leaf=0; leaf<kd->nbottom; leaf++) {
+        int nodeid = kd->ninterior + leaf;
+        int L = kdtree_leaf_left(kd, nodeid);
+        int R = kdtree_leaf_right(kd, nodeid);
+        const dtype* lo = leafbb + 2 * D * leaf;
+        const dtype* hi = lo + D;
+        for (i=L; i<=R; i++)
+            for (d=0; d<D; d++)
+                data[(size_t)i*D + d] = unpack_value(lo[d], hi[d],
+                                                     packed[(size_t)i*D + d]);
+    }
+}
+#else
+// (only integer data can be packed.)
+typedef u8 packtype;
+#define PACKTYPE_MAX  UINT8_MAX
+#endif
+
+static anbool has_chunk(kdtree_fits_t* io, const kdtree_t* kd,
+                        const char* tabname) {
+    char* name = get_table_name(kd->name, tabname);
+    anbool rtn = fitsbin_has_chunk(io, name);
+    free(name);
+    return rtn;
+}
+
+int MANGLE(kdtree_map_fits)(kdtree_fits_t* io, kdtree_t* kd) {
     fitsbin_chunk_t chunk;
+    // vEB-ordered node arrays have their own table names, so that older
+    // readers don't mistake them for breadth-first ones.
+    anbool veb = kd->veb_layout;
 
     fitsbin_chunk_init(&chunk);
 
@@ -48,7 +134,7 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
     free(chunk.tablename);
 
     // kd->bb
-    chunk.tablename = get_table_name(kd->name, KD_STR_BB);
+    chunk.tablename = get_table_name(kd->name, veb ? KD_STR_BB_VEB : KD_STR_BB);
     chunk.itemsize = sizeof(ttype) * kd->ndim * 2;
     chunk.nrows = 0;
     chunk.required = FALSE;
@@ -58,7 +144,7 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
 
         // accept (but warn about) old-school buggy BB extension.
         if (chunk.nrows == nbb_new) {
-        } else if (chunk.nrows == nbb_old) {
+        } else if (chunk.nrows == nbb_old && !veb) {
             ERROR("Warning: this file contains an old, buggy, %s "
                   "extension; it has %i rather than %i items.  Proceeding "
                   "anyway, but this is probably going to cause problems!",
@@ -77,7 +163,7 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
     free(chunk.tablename);
 
     // kd->split
-    chunk.tablename = get_table_name(kd->name, KD_STR_SPLIT);
+    chunk.tablename = get_table_name(kd->name, veb ? KD_STR_SPLIT_VEB : KD_STR_SPLIT);
     chunk.itemsize = sizeof(ttype);
     chunk.nrows = kd->ninterior;
     chunk.required = FALSE;
@@ -87,7 +173,7 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
     free(chunk.tablename);
 
     // kd->splitdim
-    chunk.tablename = get_table_name(kd->name, KD_STR_SPLITDIM);
+    chunk.tablename = get_table_name(kd->name, veb ? KD_STR_SPLITDIM_VEB : KD_STR_SPLITDIM);
     chunk.itemsize = sizeof(u8);
     chunk.nrows = kd->ninterior;
     chunk.required = FALSE;
@@ -97,14 +183,47 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
     free(chunk.tablename);
 
     // kd->data
-    chunk.tablename = get_table_name(kd->name, KD_STR_DATA);
-    chunk.itemsize = sizeof(dtype) * kd->ndim;
-    chunk.nrows = kd->ndata;
-    chunk.required = TRUE;
-    if (kdtree_fits_read_chunk(io, &chunk) == 0) {
-        kd->data.any = chunk.data;
+    if (kd->packed_data) {
+#if DTYPE_INTEGER
+        // (the lr / split arrays, needed to find the leaves, are read by now.)
+        dtype* leafbb = NULL;
+        chunk.tablename = get_table_name(kd->name, KD_STR_DATA_LEAFBB);
+        chunk.itemsize = sizeof(dtype) * kd->ndim * 2;
+        chunk.nrows = kd->nbottom;
+        chunk.required = TRUE;
+        if (kdtree_fits_read_chunk(io, &chunk) == 0)
+            leafbb = chunk.data;
+        free(chunk.tablename);
+        chunk.tablename = get_table_name(kd->name, KD_STR_DATA_PACKED);
+        chunk.itemsize = sizeof(packtype) * kd->ndim;
+        chunk.nrows = kd->ndata;
+        chunk.required = TRUE;
+        if (leafbb && (kdtree_fits_read_chunk(io, &chunk) == 0)) {
+            kd->data.any = MALLOC((size_t)kd->ndata * kd->ndim * sizeof(dtype));
+            if (!kd->data.any) {
+                SYSERROR("Failed to allocate %i unpacked kdtree data points",
+                         kd->ndata);
+                free(chunk.tablename);
+                return -1;
+            }
+            kd->free_data = TRUE;
+            unpack_data(kd, leafbb, chunk.data);
+        }
+        free(chunk.tablename);
+#else
+        ERROR("kdtree claims to have packed data, but its data type is not an integer");
+        return -1;
+#endif
+    } else {
+        chunk.tablename = get_table_name(kd->name, KD_STR_DATA);
+        chunk.itemsize = sizeof(dtype) * kd->ndim;
+        chunk.nrows = kd->ndata;
+        chunk.required = TRUE;
+        if (kdtree_fits_read_chunk(io, &chunk) == 0) {
+            kd->data.any = chunk.data;
+        }
+        free(chunk.tablename);
     }
-    free(chunk.tablename);
 
     // kd->minval/kd->maxval/kd->scale
     chunk.tablename = get_table_name(kd->name, KD_STR_RANGE);
@@ -120,21 +239,45 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
         kd->invscale = 1.0 / kd->scale;
     }
     free(chunk.tablename);
+    return 0;
+}
+
+int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd, anbool lazy) {
+    anbool veb = kd->veb_layout;
+    anbool hasbb, hassplit, hassplitdim, hasrange;
 
-    if (!(kd->bb.any ||
-          (kd->split.any && (TTYPE_INTEGER || kd->splitdim)))) {
+    if (lazy) {
+        // just check which arrays are there; kdtree_map_fits() reads them
+        // when they're needed.
+        hasbb = has_chunk(io, kd, veb ? KD_STR_BB_VEB : KD_STR_BB);
+        hassplit = has_chunk(io, kd, veb ? KD_STR_SPLIT_VEB : KD_STR_SPLIT);
+        hassplitdim = has_chunk(io, kd, veb ? KD_STR_SPLITDIM_VEB : KD_STR_SPLITDIM);
+        hasrange = has_chunk(io, kd, KD_STR_RANGE);
+        if (!has_chunk(io, kd, kd->packed_data ? KD_STR_DATA_PACKED : KD_STR_DATA)) {
+            ERROR("kdtree %s has no data table", kd->name ? kd->name : "");
+            return -1;
+        }
+    } else {
+        if (MANGLE(kdtree_map_fits)(io, kd))
+            return -1;
+        hasbb = (kd->bb.any != NULL);
+        hassplit = (kd->split.any != NULL);
+        hassplitdim = (kd->splitdim != NULL);
+        hasrange = (kd->minval && kd->maxval);
+    }
+
+    if (!(hasbb || (hassplit && (TTYPE_INTEGER || hassplitdim)))) {
         ERROR("kdtree contains neither bounding boxes nor split+dim data");
         return -1;
     }
 
-    if ((TTYPE_INTEGER && !ETYPE_INTEGER) &&
-        !(kd->minval && kd->maxval)) {
+    if ((TTYPE_INTEGER && !ETYPE_INTEGER) && !hasrange) {
         ERROR("treee does not contain required range information");
         return -1;
     }
 
-    if (kd->split.any) {
-        if (kd->splitdim)
+    if (hassplit) {
+        if (hassplitdim)
             kd->splitmask = UINT32_MAX;
         else
             compute_splitbits(kd);
@@ -149,6 +292,8 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
             if (fitsbin_write_chunk_flipped(fb, &chunk, wordsize)) {    \
                 ERROR("Failed to write (flipped) kdtree chunk");        \
                 fitsbin_chunk_clean(&chunk);                            \
+                FREE(leafbb);                                           \
+                FREE(packed);                                           \
                 return -1;                                              \
             }                                                           \
         } else {                                                        \
@@ -157,6 +302,8 @@ int MANGLE(kdtree_read_fits)(kdtree_fits_t* io, kdtree_t* kd) {
 		fitsbin_write_chunk(fb, &chunk)) {                      \
                 ERROR("Failed to write kdtree chunk");                  \
                 fitsbin_chunk_clean(&chunk);                            \
+                FREE(leafbb);                                           \
+                FREE(packed);                                           \
                 return -1;                                              \
             }                                                           \
         }                                                               \
@@ -169,12 +316,30 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
     fitsbin_t* fb = kdtree_fits_get_fitsbin(io);
     qfits_header* hdr;
     int wordsize = 0;
+    dtype* leafbb = NULL;
+    packtype* packed = NULL;
+    double packerr = kd->pack_error;
 
     // haven't bothered to support this.
     assert(!(flip_endian && fid));
 
     fitsbin_chunk_init(&chunk);
 
+#if DTYPE_INTEGER
+    if (kd->packed_data && kd->data.any) {
+        leafbb = MALLOC((size_t)kd->nbottom * kd->ndim * 2 * sizeof(dtype));
+        packed = MALLOC((size_t)kd->ndata * kd->ndim * sizeof(packtype));
+        if (!leafbb || !packed) {
+            SYSERROR("Failed to allocate packed kdtree data");
+            FREE(leafbb);
+            FREE(packed);
+            return -1;
+        }
+        // (the packing error adds to any the data already had.)
+        packerr += DIST_DE(kd, pack_data(kd, leafbb, packed));
+    }
+#endif
+
     // kdtree header is an empty fitsbin_chunk.
     chunk.tablename = get_table_name(kd->name, KD_STR_HEADER);
     hdr = fitsbin_get_chunk_header(fb, &chunk);
@@ -193,6 +358,12 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
     qfits_header_add(hdr, "KDT_INT",  (char*)kdtree_kdtype_to_string(kdtree_treetype(kd)), "kdtree: type of the tree's structures", NULL);
     qfits_header_add(hdr, "KDT_DATA", (char*)kdtree_kdtype_to_string(kdtree_datatype(kd)), "kdtree: type of the data", NULL);
     qfits_header_add(hdr, "KDT_LINL", (kd->has_linear_lr ? "T" : "F"), "kdtree: has_linear_lr", NULL);
+    if (kd->veb_layout)
+        qfits_header_add(hdr, "KDT_VEB", "T", "kdtree: nodes are in van Emde Boas order", NULL);
+    if (packed)
+        qfits_header_add(hdr, "KDT_PACK", "T", "kdtree: data are packed relative to their leaves", NULL);
+    if (packerr > 0)
+        fits_header_add_double(hdr, "KDT_PKER", packerr, "kdtree: max error of the data from packing");
     WRITE_CHUNK();
     free(chunk.tablename);
     fitsbin_chunk_reset(&chunk);
@@ -234,7 +405,8 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
         fitsbin_chunk_reset(&chunk);
     }
     if (kd->bb.any) {
-        chunk.tablename = get_table_name(kd->name, KD_STR_BB);
+        chunk.tablename = get_table_name(kd->name, kd->veb_layout ?
+                                         KD_STR_BB_VEB : KD_STR_BB);
         chunk.itemsize = sizeof(ttype) * kd->ndim * 2;
         chunk.nrows = kd->nnodes;
         chunk.data = kd->bb.any;
@@ -249,12 +421,16 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
              chunk.tablename, (unsigned int)kd->ndim,
              (unsigned int)sizeof(ttype),
              kdtree_kdtype_to_string(kdtree_treetype(kd)));
+        if (kd->veb_layout)
+            fits_add_long_comment
+                (hdr, "The nodes are stored in van Emde Boas order (see KDT_VEB).");
         WRITE_CHUNK();
         free(chunk.tablename);
         fitsbin_chunk_reset(&chunk);
     }
     if (kd->split.any) {
-        chunk.tablename = get_table_name(kd->name, KD_STR_SPLIT);
+        chunk.tablename = get_table_name(kd->name, kd->veb_layout ?
+                                         KD_STR_SPLIT_VEB : KD_STR_SPLIT);
         chunk.itemsize = sizeof(ttype);
         chunk.nrows = kd->ninterior;
         chunk.data = kd->split.any;
@@ -286,12 +462,16 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
                  chunk.tablename, chunk.itemsize,
                  kdtree_kdtype_to_string(kdtree_treetype(kd)));
         }
+        if (kd->veb_layout)
+            fits_add_long_comment
+                (hdr, "The nodes are stored in van Emde Boas order (see KDT_VEB).");
         WRITE_CHUNK();
         free(chunk.tablename);
         fitsbin_chunk_reset(&chunk);
     }
     if (kd->splitdim) {
-        chunk.tablename = get_table_name(kd->name, KD_STR_SPLITDIM);
+        chunk.tablename = get_table_name(kd->name, kd->veb_layout ?
+                                         KD_STR_SPLITDIM_VEB : KD_STR_SPLITDIM);
         chunk.itemsize = sizeof(u8);
         chunk.nrows = kd->ninterior;
         chunk.data = kd->splitdim;
@@ -307,6 +487,9 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
              "low side of the splitting plane, and the right child contains "
              "data points on the high side of the plane.",
              chunk.tablename, chunk.itemsize);
+        if (kd->veb_layout)
+            fits_add_long_comment
+                (hdr, "The nodes are stored in van Emde Boas order (see KDT_VEB).");
         WRITE_CHUNK();
         free(chunk.tablename);
         fitsbin_chunk_reset(&chunk);
@@ -347,7 +530,44 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
         WRITE_CHUNK();
         fitsbin_chunk_reset(&chunk);
     }
-    if (kd->data.any) {
+    if (packed) {
+        chunk.tablename = get_table_name(kd->name, KD_STR_DATA_LEAFBB);
+        chunk.itemsize = sizeof(dtype) * kd->ndim * 2;
+        chunk.nrows = kd->nbottom;
+        chunk.data = leafbb;
+        if (flip_endian)
+            wordsize = sizeof(dtype);
+        hdr = fitsbin_get_chunk_header(fb, &chunk);
+        fits_add_long_comment
+            (hdr, "The \"%s\" table contains the bounding box of the data in "
+             "each leaf node of the kdtree, as two %u-dimensional, %u-byte "
+             "native-endian %ss: the lower and upper corners.",
+             chunk.tablename, (unsigned int)kd->ndim, (unsigned int)sizeof(dtype),
+             kdtree_kdtype_to_string(kdtree_datatype(kd)));
+        free(chunk.tablename);
+        WRITE_CHUNK();
+        fitsbin_chunk_reset(&chunk);
+
+        chunk.tablename = get_table_name(kd->name, KD_STR_DATA_PACKED);
+        chunk.itemsize = sizeof(packtype) * kd->ndim;
+        chunk.nrows = kd->ndata;
+        chunk.data = packed;
+        if (flip_endian)
+            wordsize = sizeof(packtype);
+        hdr = fitsbin_get_chunk_header(fb, &chunk);
+        fits_add_long_comment
+            (hdr, "The \"%s\" table contains the kdtree data, packed.  Each "
+             "%u-dimensional point is stored as one %u-byte unsigned integer "
+             "per dimension, q, giving its value as lo + round(q (hi - lo) / %u), "
+             "where lo and hi are the corners of its leaf's bounding box.",
+             chunk.tablename, (unsigned int)kd->ndim,
+             (unsigned int)sizeof(packtype), (unsigned int)PACKTYPE_MAX);
+        free(chunk.tablename);
+        WRITE_CHUNK();
+        fitsbin_chunk_reset(&chunk);
+        FREE(leafbb);
+        FREE(packed);
+    } else if (kd->data.any) {
         chunk.tablename = get_table_name(kd->name, KD_STR_DATA);
         chunk.itemsize = sizeof(dtype) * kd->ndim;
         chunk.nrows = kd->ndata;
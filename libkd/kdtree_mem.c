@@ -81,6 +81,10 @@ void kdtree_mem_reset() {
 
 // Get the current memory usage
 int  kdtree_mem_get() {
+#if defined(KDTREE_MEM_TRACK)
     return memory_total;
+#else
+    return (int)an_alloc_current(AN_ALLOC_LIBKD);
+#endif
 }
 
@@ -8,7 +8,10 @@
 
 #include <stdlib.h>
 
-// Are we tracking memory usage by libkd?
+#include "an-alloc.h"
+
+// Are we tracking memory usage by libkd?  (Without KDTREE_MEM_TRACK, the
+// shared allocator still counts libkd's bytes; see an-alloc.h.)
 #if defined(KDTREE_MEM_TRACK)
 
 void* CALLOC(size_t nmemb, size_t sz);
@@ -18,10 +21,10 @@ void  FREE(void* ptr);
 
 #else
 
-#define CALLOC calloc
-#define MALLOC malloc
-#define REALLOC realloc
-#define FREE free
+#define CALLOC(n, sz)   an_alloc_calloc(AN_ALLOC_LIBKD, n, sz)
+#define MALLOC(sz)      an_alloc_malloc(AN_ALLOC_LIBKD, sz)
+#define REALLOC(p, sz)  an_alloc_realloc(AN_ALLOC_LIBKD, p, sz)
+#define FREE(p)         an_alloc_free(AN_ALLOC_LIBKD, p)
 
 #endif
 
@@ -11,6 +11,7 @@
 #endif
 
 #include <stdio.h>
+#include <unistd.h>
 #include <assert.h>
 
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
@@ -205,9 +206,7 @@ static PyObject* KdTree_set_name(KdObject* self, PyObject* args) {
         PyErr_SetString(PyExc_ValueError, "need one arg: Kd-Tree name (string)");
         return NULL;
     }
-    if (self->kd->name)
-        free(self->kd->name);
-    self->kd->name = strdup(name);
+    kdtree_set_name(self->kd, name);
     Py_RETURN_NONE;
 }
 
@@ -434,6 +433,161 @@ static PyObject* KdTree_permute(KdObject* self, PyObject* args) {
     return rtn;
 }
 
+static PyObject* KdTree_knn(KdObject* self, PyObject* args) {
+    PyObject* rtn;
+    npy_intp dims[2];
+    kdtree_t* kd;
+    int D, N, K;
+    int i, rtnval;
+    PyObject* pyO;
+    PyArrayObject* npX;
+    PyArrayObject* pyInds;
+    PyArrayObject* pyD2s;
+    PyArray_Descr* dtype;
+    int req = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_NOTSWAPPED
+        | NPY_ARRAY_ELEMENTSTRIDES;
+    double maxradius = -1.0;
+    double* maxd2s = NULL;
+    int* inds;
+    void* X;
+
+    if (!PyArg_ParseTuple(args, "Oi|d", &pyO, &K, &maxradius)) {
+        PyErr_SetString(PyExc_ValueError, "need two args: query points (N x D numpy array), k (int); and optionally maximum radius (double)");
+        return NULL;
+    }
+    if (K < 1) {
+        PyErr_SetString(PyExc_ValueError, "k must be positive");
+        return NULL;
+    }
+    kd = self->kd;
+    D = kd->ndim;
+
+    if (kdtree_exttype(kd) == KDT_EXT_U64)
+        dtype = PyArray_DescrFromType(NPY_UINT64);
+    else
+        dtype = PyArray_DescrFromType(NPY_DOUBLE);
+    // (FromAny steals a reference)
+    npX = (PyArrayObject*)PyArray_FromAny(pyO, dtype, 2, 2, req, NULL);
+    if (!npX) {
+        PyErr_SetString(PyExc_ValueError, "Failed to convert query points to N x D np array of float or uint64 (depending on tree data type)");
+        return NULL;
+    }
+    if (PyArray_DIM(npX, 1) != D) {
+        PyErr_SetString(PyExc_ValueError, "Query points must have size N x dimension of tree");
+        Py_DECREF(npX);
+        return NULL;
+    }
+    N = (int)PyArray_DIM(npX, 0);
+    X = PyArray_DATA(npX);
+
+    dims[0] = N;
+    dims[1] = K;
+    pyInds = (PyArrayObject*)PyArray_SimpleNew(2, dims, NPY_INT);
+    pyD2s = (PyArrayObject*)PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+    inds = PyArray_DATA(pyInds);
+
+    Py_BEGIN_ALLOW_THREADS
+    if (maxradius >= 0) {
+        maxd2s = malloc(MAX(N, 1) * sizeof(double));
+        for (i=0; i<N; i++)
+            maxd2s[i] = maxradius * maxradius;
+    }
+    rtnval = kdtree_knn_batch(kd, X, N, K, maxd2s, inds,
+                              PyArray_DATA(pyD2s), NULL);
+    // back to the original indexing.
+    for (i=0; i<N*K; i++)
+        if (inds[i] != -1)
+            inds[i] = kdtree_permute(kd, inds[i]);
+    free(maxd2s);
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(npX);
+    if (rtnval) {
+        Py_DECREF(pyInds);
+        Py_DECREF(pyD2s);
+        PyErr_SetString(PyExc_RuntimeError, "kdtree_knn_batch failed");
+        return NULL;
+    }
+    rtn = Py_BuildValue("(OO)", pyInds, pyD2s);
+    Py_DECREF(pyInds);
+    Py_DECREF(pyD2s);
+    return rtn;
+}
+
+static PyObject* KdTree_nn(KdObject* self, PyObject* args) {
+    PyObject* rtn;
+    npy_intp dims[1];
+    kdtree_t* kd;
+    int D, N;
+    int i;
+    PyObject* pyO;
+    PyArrayObject* npX;
+    PyArrayObject* pyInds;
+    PyArrayObject* pyD2s;
+    PyArray_Descr* dtype;
+    int req = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_NOTSWAPPED
+        | NPY_ARRAY_ELEMENTSTRIDES;
+    double maxradius = -1.0;
+    double eps = 0.0;
+    double maxd2;
+    int* inds;
+    double* d2s;
+    char* X;
+
+    if (!PyArg_ParseTuple(args, "O|dd", &pyO, &maxradius, &eps)) {
+        PyErr_SetString(PyExc_ValueError, "need args: query points (N x D numpy array); and optionally maximum radius (double) and approximation factor eps (double)");
+        return NULL;
+    }
+    if (eps < 0) {
+        PyErr_SetString(PyExc_ValueError, "eps must be non-negative");
+        return NULL;
+    }
+    kd = self->kd;
+    D = kd->ndim;
+
+    if (kdtree_exttype(kd) == KDT_EXT_U64)
+        dtype = PyArray_DescrFromType(NPY_UINT64);
+    else
+        dtype = PyArray_DescrFromType(NPY_DOUBLE);
+    // (FromAny steals a reference)
+    npX = (PyArrayObject*)PyArray_FromAny(pyO, dtype, 2, 2, req, NULL);
+    if (!npX) {
+        PyErr_SetString(PyExc_ValueError, "Failed to convert query points to N x D np array of float or uint64 (depending on tree data type)");
+        return NULL;
+    }
+    if (PyArray_DIM(npX, 1) != D) {
+        PyErr_SetString(PyExc_ValueError, "Query points must have size N x dimension of tree");
+        Py_DECREF(npX);
+        return NULL;
+    }
+    N = (int)PyArray_DIM(npX, 0);
+    X = PyArray_DATA(npX);
+
+    dims[0] = N;
+    pyInds = (PyArrayObject*)PyArray_SimpleNew(1, dims, NPY_INT);
+    pyD2s = (PyArrayObject*)PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    inds = PyArray_DATA(pyInds);
+    d2s = PyArray_DATA(pyD2s);
+    maxd2 = (maxradius >= 0) ? maxradius * maxradius : LARGE_VAL;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i=0; i<N; i++) {
+        d2s[i] = -1.0;
+        inds[i] = kdtree_nearest_neighbour_approx(kd, X + (size_t)i * D * PyArray_ITEMSIZE(npX),
+                                                  maxd2, eps, d2s + i);
+        // back to the original indexing.
+        if (inds[i] != -1)
+            inds[i] = kdtree_permute(kd, inds[i]);
+    }
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(npX);
+    rtn = Py_BuildValue("(OO)", pyInds, pyD2s);
+    Py_DECREF(pyInds);
+    Py_DECREF(pyD2s);
+    return rtn;
+}
+
 static PyMethodDef kdtree_methods[] = {
     {"set_name", (PyCFunction)KdTree_set_name, METH_VARARGS,
      "Sets the Kd-Tree's name to the given string",
@@ -447,6 +601,12 @@ static PyMethodDef kdtree_methods[] = {
     {"search", (PyCFunction)KdTree_search, METH_VARARGS,
      "Searches for points within range in the Kd-Tree."
     },
+    {"knn", (PyCFunction)KdTree_knn, METH_VARARGS,
+     "Finds the k nearest neighbours of each of the given (N x D numpy array) points, optionally within a maximum radius.  Returns (indices, distances-squared), each N x k, nearest first; indices are -1 where there are fewer than k."
+    },
+    {"nn", (PyCFunction)KdTree_nn, METH_VARARGS,
+     "Finds the nearest neighbour of each of the given (N x D numpy array) points, optionally within a maximum radius, and optionally only to within a factor (1 + eps) of the nearest distance.  Returns (indices, distances-squared), each of length N; indices are -1 (and distances -1) where none was found."
+    },
     {"get_data", (PyCFunction)KdTree_get_data, METH_VARARGS,
      "Returns data from this tree, given numpy array of indices (MUST be np.uint32)."
     },
@@ -615,17 +775,10 @@ static PyObject* spherematch_match2(PyObject* self, PyObject* args) {
     return indlist;
 }
 
-struct dualtree_results {
-    il* inds1;
-    il* inds2;
-    dl* dists;
-};
-
-static void callback_dualtree(void* v, int ind1, int ind2, double dist2) {
-    struct dualtree_results* dtresults = v;
-    il_append(dtresults->inds1, ind1);
-    il_append(dtresults->inds2, ind2);
-    dl_append(dtresults->dists, sqrt(dist2));
+static int get_nthreads(int nthreads) {
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return MAX(nthreads, 1);
 }
 
 static PyObject* spherematch_match(PyObject* self, PyObject* args) {
@@ -633,61 +786,66 @@ static PyObject* spherematch_match(PyObject* self, PyObject* args) {
     KdObject *kdobj1 = NULL, *kdobj2 = NULL;
     kdtree_t *kd1, *kd2;
     double rad;
-    struct dualtree_results dtresults;
     PyArrayObject* inds;
     npy_intp dims[2];
     PyArrayObject* dists;
     anbool notself;
     anbool permute;
+    int nthreads = 1;
+    int rtnval;
+    int* inds1;
+    int* inds2;
+    double* dist2s;
+    int* pinds;
+    double* pdists;
     PyObject* rtn;
 	
     // So that ParseTuple("b") with a C "anbool" works
     assert(sizeof(anbool) == sizeof(unsigned char));
 
-    if (!PyArg_ParseTuple(args, "O!O!dbb",
+    if (!PyArg_ParseTuple(args, "O!O!dbb|i",
                           &KdType, &kdobj1, &KdType, &kdobj2,
-                          &rad, &notself, &permute)) {
-        PyErr_SetString(PyExc_ValueError, "spherematch_c.match: need five args: two KdTree objects, search radius (float), notself (boolean), permuted (boolean)");
+                          &rad, &notself, &permute, &nthreads)) {
+        PyErr_SetString(PyExc_ValueError, "spherematch_c.match: need five args: two KdTree objects, search radius (float), notself (boolean), permuted (boolean); and optionally nthreads (int)");
         return NULL;
     }
     kd1 = kdobj1->kd;
     kd2 = kdobj2->kd;
+    nthreads = get_nthreads(nthreads);
 
-    dtresults.inds1 = il_new(256);
-    dtresults.inds2 = il_new(256);
-    dtresults.dists = dl_new(256);
-    dualtree_rangesearch(kd1, kd2, 0.0, rad, notself, NULL,
-                         callback_dualtree, &dtresults,
-                         NULL, NULL);
+    Py_BEGIN_ALLOW_THREADS
+    rtnval = dualtree_rangesearch_pairs(kd1, kd2, 0.0, rad, notself, NULL,
+                                        nthreads, &N, &inds1, &inds2, &dist2s);
+    Py_END_ALLOW_THREADS
+    if (rtnval)
+        return PyErr_NoMemory();
 
-    N = il_size(dtresults.inds1);
     dims[0] = N;
     dims[1] = 2;
-
     inds =  (PyArrayObject*)PyArray_SimpleNew(2, dims, NPY_INT);
     dims[1] = 1;
     dists = (PyArrayObject*)PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+    assert(PyArray_ITEMSIZE(inds) == sizeof(int));
+    pinds = PyArray_DATA(inds);
+    pdists = PyArray_DATA(dists);
+
+    // Fill the new arrays.
+    Py_BEGIN_ALLOW_THREADS
     for (i=0; i<N; i++) {
-        int index;
-        int* iptr;
-        double* dptr;
-        iptr = PyArray_GETPTR2(inds, i, 0);
-        index = il_get(dtresults.inds1, i);
-        if (permute)
-            index = kdtree_permute(kd1, index);
-        *iptr = index;
-        iptr = PyArray_GETPTR2(inds, i, 1);
-        index = il_get(dtresults.inds2, i);
-        if (permute)
-            index = kdtree_permute(kd2, index);
-        *iptr = index;
-        dptr = PyArray_GETPTR2(dists, i, 0);
-        *dptr = dl_get(dtresults.dists, i);
-    }
-
-    il_free(dtresults.inds1);
-    il_free(dtresults.inds2);
-    dl_free(dtresults.dists);
+        int ind1 = inds1[i];
+        int ind2 = inds2[i];
+        if (permute) {
+            ind1 = kdtree_permute(kd1, ind1);
+            ind2 = kdtree_permute(kd2, ind2);
+        }
+        pinds[2*i  ] = ind1;
+        pinds[2*i+1] = ind2;
+        pdists[i] = sqrt(dist2s[i]);
+    }
+    free(inds1);
+    free(inds2);
+    free(dist2s);
+    Py_END_ALLOW_THREADS
 
     rtn = Py_BuildValue("(OO)", inds, dists);
     Py_DECREF(inds);
@@ -707,19 +865,22 @@ static PyObject* spherematch_nn(PyObject* self, PyObject* args) {
     double rad;
     anbool notself;
     int* tempinds;
+    double* tempdists;
+    int nthreads = 1;
     PyObject* rtn;
 
     // So that ParseTuple("b") with a C "anbool" works
     assert(sizeof(anbool) == sizeof(unsigned char));
 
-    if (!PyArg_ParseTuple(args, "O!O!db",
+    if (!PyArg_ParseTuple(args, "O!O!db|i",
                           &KdType, &kdobj1, &KdType, &kdobj2,
-                          &rad, &notself)) {
-        PyErr_SetString(PyExc_ValueError, "need three args: two KdTree objects, and search radius");
+                          &rad, &notself, &nthreads)) {
+        PyErr_SetString(PyExc_ValueError, "need four args: two KdTree objects, search radius and notself (bool); and optionally nthreads (int)");
         return NULL;
     }
     kd1 = kdobj1->kd;
     kd2 = kdobj2->kd;
+    nthreads = get_nthreads(nthreads);
 
     NY = kdtree_n(kd2);
 
@@ -729,15 +890,17 @@ static PyObject* spherematch_nn(PyObject* self, PyObject* args) {
     assert(PyArray_ITEMSIZE(inds) == sizeof(int));
     assert(PyArray_ITEMSIZE(dist2s) == sizeof(double));
 
+    Py_BEGIN_ALLOW_THREADS
     // YUCK!
     tempinds = (int*)malloc(NY * sizeof(int));
-    double* tempdists = (double*)malloc(NY * sizeof(double));
+    tempdists = (double*)malloc(NY * sizeof(double));
 
     pinds   = tempinds; //PyArray_DATA(inds);
     //pdist2s = PyArray_DATA(dist2s);
     pdist2s = tempdists;
 
-    dualtree_nearestneighbour(kd1, kd2, rad*rad, &pdist2s, &pinds, NULL, notself);
+    dualtree_nearestneighbour_threads(kd1, kd2, rad*rad, &pdist2s, &pinds,
+                                      NULL, notself, nthreads);
 
     // now we have to apply kd1's permutation array!
     for (i=0; i<NY; i++)
@@ -762,6 +925,7 @@ static PyObject* spherematch_nn(PyObject* self, PyObject* args) {
     }
     free(tempinds);
     free(tempdists);
+    Py_END_ALLOW_THREADS
 
     rtn = Py_BuildValue("(OO)", inds, dist2s);
     Py_DECREF(inds);
@@ -789,19 +953,21 @@ static PyObject* spherematch_nn2(PyObject* self, PyObject* args) {
     int* tempcount = NULL;
     int** ptempcount = NULL;
     double* tempd2;
+    int nthreads = 1;
     PyObject* rtn;
 
     // So that ParseTuple("b") with a C "anbool" works
     assert(sizeof(anbool) == sizeof(unsigned char));
 
-    if (!PyArg_ParseTuple(args, "O!O!dbb",
+    if (!PyArg_ParseTuple(args, "O!O!dbb|i",
                           &KdType, &kdobj1, &KdType, &kdobj2,
-                          &rad, &notself, &docount)) {
-        PyErr_SetString(PyExc_ValueError, "need five args: two kdtree identifiers (ints), search radius, notself (bool) and docount (bool)");
+                          &rad, &notself, &docount, &nthreads)) {
+        PyErr_SetString(PyExc_ValueError, "need five args: two kdtree identifiers (ints), search radius, notself (bool) and docount (bool); and optionally nthreads (int)");
         return NULL;
     }
     kd1 = kdobj1->kd;
     kd2 = kdobj2->kd;
+    nthreads = get_nthreads(nthreads);
 
     // quick check for no-overlap case
     if (kdtree_node_node_mindist2_exceeds(kd1, 0, kd2, 0, rad*rad)) {
@@ -825,6 +991,7 @@ static PyObject* spherematch_nn2(PyObject* self, PyObject* args) {
 
     NY = kdtree_n(kd2);
 
+    Py_BEGIN_ALLOW_THREADS
     tempinds = (int*)malloc(NY * sizeof(int));
     tempd2 = (double*)malloc(NY * sizeof(double));
     if (docount) {
@@ -832,13 +999,15 @@ static PyObject* spherematch_nn2(PyObject* self, PyObject* args) {
         ptempcount = &tempcount;
     }
 
-    dualtree_nearestneighbour(kd1, kd2, rad*rad, &tempd2, &tempinds, ptempcount, notself);
+    dualtree_nearestneighbour_threads(kd1, kd2, rad*rad, &tempd2, &tempinds,
+                                      ptempcount, notself, nthreads);
 
     // count number of matches
     N = 0;
     for (i=0; i<NY; i++)
         if (tempinds[i] != -1)
             N++;
+    Py_END_ALLOW_THREADS
 
     // allocate return arrays
     dims[0] = N;
@@ -853,6 +1022,7 @@ static PyObject* spherematch_nn2(PyObject* self, PyObject* args) {
         pc = PyArray_DATA((PyArrayObject*)counts);
     }
 
+    Py_BEGIN_ALLOW_THREADS
     j = 0;
     for (i=0; i<NY; i++) {
         if (tempinds[i] == -1)
@@ -868,6 +1038,7 @@ static PyObject* spherematch_nn2(PyObject* self, PyObject* args) {
     free(tempinds);
     free(tempd2);
     free(tempcount);
+    Py_END_ALLOW_THREADS
 
     if (docount) {
         rtn = Py_BuildValue("(OOOO)", I, J, dist2s, counts);
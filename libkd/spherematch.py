@@ -16,7 +16,7 @@ def match_xy(x1,y1, x2,y2, R, **kwargs):
     
 # Copied from "celestial.py" by Sjoert van Velzen.
 def match_radec(ra1, dec1, ra2, dec2, radius_in_deg, notself=False,
-                nearest=False, indexlist=False, count=False):
+                nearest=False, indexlist=False, count=False, nthreads=1):
     '''
     Cross-matches numpy arrays of RA,Dec points.
 
@@ -42,6 +42,9 @@ def match_radec(ra1, dec1, ra2, dec2, radius_in_deg, notself=False,
         If True, returns a list of length *len(ra1)*, containing *None*
         or a list of ints of matched points in *ra2,dec2*.
         
+    nthreads : int
+        Number of threads to search with; 0 for one per CPU.
+
 
     Returns
     -------
@@ -63,7 +66,8 @@ def match_radec(ra1, dec1, ra2, dec2, radius_in_deg, notself=False,
 
     extra = ()
     if nearest:
-        X = _nearest_func(xyz2, xyz1, r, notself=notself, count=count)
+        X = _nearest_func(xyz2, xyz1, r, notself=notself, count=count,
+                          nthreads=nthreads)
         if not count:
             (inds,dists2) = X
             I = np.flatnonzero(inds >= 0)
@@ -78,7 +82,8 @@ def match_radec(ra1, dec1, ra2, dec2, radius_in_deg, notself=False,
             print('J', J.shape, J.dtype)
             print('counts', counts.shape, counts.dtype)
     else:
-        X = match(xyz1, xyz2, r, notself=notself, indexlist=indexlist)
+        X = match(xyz1, xyz2, r, notself=notself, indexlist=indexlist,
+                  nthreads=nthreads)
         if indexlist:
             return X
         (inds,dists) = X
@@ -176,7 +181,8 @@ def _buildtrees(x1, x2):
         kd2 = spherematch_c.KdTree(fx2)
     return (kd1, kd2)
 
-def match(x1, x2, radius, notself=False, permuted=True, indexlist=False):
+def match(x1, x2, radius, notself=False, permuted=True, indexlist=False,
+          nthreads=1):
     '''
     ::
 
@@ -274,6 +280,10 @@ def match(x1, x2, radius, notself=False, permuted=True, indexlist=False):
 
     radius : float
         Scalar Euclidean distance to match
+
+    nthreads : int
+        Number of threads to search with; 0 for one per CPU.  The
+        search runs without holding the GIL.
         
     Returns
     -------
@@ -295,7 +305,8 @@ def match(x1, x2, radius, notself=False, permuted=True, indexlist=False):
     if indexlist:
         inds = spherematch_c.match2(kd1, kd2, radius, notself, permuted)
     else:
-        (inds,dists) = spherematch_c.match(kd1, kd2, radius, notself, permuted)
+        (inds,dists) = spherematch_c.match(kd1, kd2, radius, notself, permuted,
+                                           nthreads)
     if indexlist:
         return inds
     return (inds,dists)
@@ -323,18 +334,21 @@ def match_naive(x1, x2, radius, notself=False):
     dists = array(dists)
     return (inds,dists)
 
-def nearest(x1, x2, maxradius, notself=False, count=False):
+def nearest(x1, x2, maxradius, notself=False, count=False, nthreads=1):
     '''
     For each point in x2, returns the index of the nearest point in x1,
     if there is a point within 'maxradius'.
 
     (Note, this may be backward from what you want/expect!)
+
+    The search uses *nthreads* threads (0 for one per CPU).
     '''
     (kd1,kd2) = _buildtrees(x1, x2)
     if count:
-        X = spherematch_c.nearest2(kd1, kd2, maxradius, notself, count)
+        X = spherematch_c.nearest2(kd1, kd2, maxradius, notself, count,
+                                   nthreads)
     else:
-        X = spherematch_c.nearest(kd1, kd2, maxradius, notself)
+        X = spherematch_c.nearest(kd1, kd2, maxradius, notself, nthreads)
     return X
 _nearest_func = nearest
 
@@ -408,6 +422,34 @@ def tree_search(kd, pos, radius, getdists=False, sortdists=False):
     #print('Unnecessary call to tree_search(kd, ...); use kd.search(...)')
     return kd.search(pos, radius, int(getdists), int(sortdists))
 
+def tree_knn(kd, pos, k, maxradius=None):
+    '''
+    Finds the *k* nearest points in the given kd-tree to each of the
+    positions *pos* (N x D), optionally only within *maxradius*.
+
+    Returns (I, d2): N x k arrays of indices and distances-squared,
+    nearest first; I is -1 where fewer than *k* points were found.
+    '''
+    pos = np.atleast_2d(pos)
+    if maxradius is None:
+        return kd.knn(pos, k)
+    return kd.knn(pos, k, maxradius)
+
+def tree_nn(kd, pos, maxradius=None, eps=0.):
+    '''
+    Finds the nearest point in the given kd-tree to each of the
+    positions *pos* (N x D), optionally only within *maxradius*.  With
+    *eps* > 0 the point found need only be within a factor (1 + *eps*)
+    of the distance of the nearest, which is faster.
+
+    Returns (I, d2): length-N arrays of indices and distances-squared;
+    I is -1 where no point was found.
+    '''
+    pos = np.atleast_2d(pos)
+    if maxradius is None:
+        maxradius = -1.
+    return kd.nn(pos, maxradius, eps)
+
 def tree_search_radec(kd, ra, dec, radius, getdists=False, sortdists=False):
     '''
     ra,dec in degrees
@@ -421,7 +463,7 @@ def tree_search_radec(kd, ra, dec, radius, getdists=False, sortdists=False):
     return tree_search(kd, pos, rad, getdists=getdists, sortdists=sortdists)
 
 def trees_match(kd1, kd2, radius, nearest=False, notself=False,
-                permuted=True, count=False):
+                permuted=True, count=False, nthreads=1):
     '''
     Runs rangesearch or nearest-neighbour matching on given kdtrees.
 
@@ -434,6 +476,8 @@ def trees_match(kd1, kd2, radius, nearest=False, notself=False,
     as well as returning the nearest neighbor of each point in "kd1";
     the return value becomes I,J,d,counts , counts a numpy array of ints.
 
+    The search uses 'nthreads' threads (0 for one per CPU).
+
     Returns (I, J, d), where
       I are indices into kd1
       J are indices into kd2
@@ -464,12 +508,14 @@ def trees_match(kd1, kd2, radius, nearest=False, notself=False,
     '''
     rtn = None
     if nearest:
-        rtn = spherematch_c.nearest2(kd2, kd1, radius, notself, count)
+        rtn = spherematch_c.nearest2(kd2, kd1, radius, notself, count,
+                                     nthreads)
         # J,I,d,[count]
         rtn = (rtn[1], rtn[0], np.sqrt(rtn[2])) + rtn[3:]
         #distsq2deg(rtn[2]),
     else:
-        (inds,dists) = spherematch_c.match(kd1, kd2, radius, notself, permuted)
+        (inds,dists) = spherematch_c.match(kd1, kd2, radius, notself, permuted,
+                                           nthreads)
         #d = dist2deg(dists[:,0])
         d = dists[:,0]
         I,J = inds[:,0], inds[:,1]
@@ -13,6 +13,8 @@
 #include "cutest.h"
 
 #include "dualtree_nearestneighbour.h"
+#include "dualtree_rangesearch.h"
+#include "bl.h"
 #include "mathutil.h"
 #include "tic.h"
 
@@ -101,3 +103,96 @@ void test_nn_1(CuTest* tc) {
     free(ydata);
 }
 
+
+struct pair_list {
+    il* xinds;
+    il* yinds;
+    dl* dist2s;
+};
+
+static void add_pair(void* v, int xind, int yind, double d2) {
+    struct pair_list* p = v;
+    il_append(p->xinds, xind);
+    il_append(p->yinds, yind);
+    dl_append(p->dist2s, d2);
+}
+
+void test_nn_threads(CuTest* tc) {
+    int NX = 3000;
+    int NY = 4000;
+    int D = 3;
+    double maxr2 = 0.005;
+    int i, nthreads;
+    kdtree_t* xkd;
+    kdtree_t* ykd;
+    double* xdata;
+    double* ydata;
+    double* d2_1 = NULL;
+    int* ind_1 = NULL;
+    int* count_1 = NULL;
+    struct pair_list pairs;
+
+    srand(1);
+    xdata = malloc(NX * D * sizeof(double));
+    ydata = malloc(NY * D * sizeof(double));
+    for (i=0; i<(NX*D); i++)
+        xdata[i] = rand() / (double)RAND_MAX;
+    for (i=0; i<(NY*D); i++)
+        ydata[i] = rand() / (double)RAND_MAX;
+    xkd = kdtree_build(NULL, xdata, NX, D, 8, KDTT_DOUBLE, KD_BUILD_BBOX);
+    ykd = kdtree_build(NULL, ydata, NY, D, 8, KDTT_DOUBLE, KD_BUILD_BBOX);
+
+    dualtree_nearestneighbour(xkd, ykd, maxr2, &d2_1, &ind_1, &count_1, 0);
+    pairs.xinds = il_new(256);
+    pairs.yinds = il_new(256);
+    pairs.dist2s = dl_new(256);
+    dualtree_rangesearch(xkd, ykd, 0.0, sqrt(maxr2), 0, NULL,
+                         add_pair, &pairs, NULL, NULL);
+    CuAssertTrue(tc, il_size(pairs.xinds) > 0);
+
+    for (nthreads=1; nthreads<=8; nthreads*=2) {
+        double* d2 = NULL;
+        int* ind = NULL;
+        int* count = NULL;
+        size_t N;
+        int* xinds;
+        int* yinds;
+        double* dist2s;
+        dualtree_nearestneighbour_threads(xkd, ykd, maxr2, &d2, &ind, &count,
+                                          0, nthreads);
+        for (i=0; i<NY; i++) {
+            CuAssertIntEquals(tc, ind_1[i], ind[i]);
+            CuAssertDblEquals(tc, d2_1[i], d2[i], 0);
+            CuAssertIntEquals(tc, count_1[i], count[i]);
+        }
+        free(d2);
+        free(ind);
+        free(count);
+
+        // the same pairs, in the same order.
+        CuAssertIntEquals(tc, 0,
+                          dualtree_rangesearch_pairs(xkd, ykd, 0.0, sqrt(maxr2),
+                                                     0, NULL, nthreads, &N,
+                                                     &xinds, &yinds, &dist2s));
+        CuAssertIntEquals(tc, (int)il_size(pairs.xinds), (int)N);
+        for (i=0; i<(int)N; i++) {
+            CuAssertIntEquals(tc, il_get(pairs.xinds, i), xinds[i]);
+            CuAssertIntEquals(tc, il_get(pairs.yinds, i), yinds[i]);
+            CuAssertDblEquals(tc, dl_get(pairs.dist2s, i), dist2s[i], 0);
+        }
+        free(xinds);
+        free(yinds);
+        free(dist2s);
+    }
+
+    il_free(pairs.xinds);
+    il_free(pairs.yinds);
+    dl_free(pairs.dist2s);
+    free(d2_1);
+    free(ind_1);
+    free(count_1);
+    kdtree_free(xkd);
+    kdtree_free(ykd);
+    free(xdata);
+    free(ydata);
+}
@@ -426,13 +426,26 @@ void test_rs_split_duu(CuTest* tc) {
     run_test_rs(tc, KDTT_DUU, KD_BUILD_SPLIT, 1e-9);
 }
 
-/**
- Sadly, does not work.
+void test_rs_split_ddu(CuTest* tc) {
+    run_test_rs(tc, KDTT_DDU, KD_BUILD_SPLIT, 1e-9);
+}
 
- void test_rs_split_ddu(CuTest* tc) {
- run_test_rs(tc, KDTT_DDU, KD_BUILD_SPLIT, 1e-9);
- }
- */
+void test_rs_bb_ddu(CuTest* tc) {
+    run_test_rs(tc, KDTT_DDU, KD_BUILD_BBOX, 1e-9);
+}
+
+// The leaf scans have fixed-dimension versions for D = 2, 3, 4, and
+// whole query instantiations for the dimensions in KD_SPECIALIZED_DIMS.
+void test_rs_bb_ddd_dims(CuTest* tc) {
+    int D;
+    for (D=1; D<=7; D++)
+        run_test_rs_ND(tc, KDTT_DOUBLE, KD_BUILD_BBOX, 1e-9, 1000, D);
+}
+void test_rs_bb_duu_dims(CuTest* tc) {
+    int D;
+    for (D=2; D<=5; D++)
+        run_test_rs_ND(tc, KDTT_DUU, KD_BUILD_BBOX, 1e-9, 1000, D);
+}
 
 void test_rs_bb_dss(CuTest* tc) {
     run_test_rs(tc, KDTT_DSS, KD_BUILD_BBOX, 1e-5);
@@ -440,9 +453,290 @@ void test_rs_bb_dss(CuTest* tc) {
 void test_rs_split_dss(CuTest* tc) {
     run_test_rs(tc, KDTT_DSS, KD_BUILD_SPLIT, 1e-5);
 }
+void test_rs_split_dss_dims(CuTest* tc) {
+    int D;
+    for (D=2; D<=6; D++)
+        run_test_rs_ND(tc, KDTT_DSS, KD_BUILD_SPLIT, 1e-5, 1000, D);
+}
+
+
+
+
+/*
+ Checks that kdtree_rangesearch_batch() finds the same points as
+ one kdtree_rangesearch() per query.
+ */
+static void run_test_rs_batch(CuTest* tc, int treetype, int treeopts,
+                              int options) {
+    int N = 1000;
+    int D = 3;
+    int Nleaf = 10;
+    int Q = 50;
+    double* origdata;
+    double* treedata;
+    kdtree_t* kd;
+    double queries[Q * D];
+    double maxd2s[Q];
+    kdtree_qres_t* res[Q];
+    kdtree_batch_res_t* csr;
+    int i, q;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    treedata = malloc(N * D * sizeof(double));
+    memcpy(treedata, origdata, N*D*sizeof(double));
+    kd = build_tree(tc, treedata, N, D, Nleaf, treetype, treeopts);
+    CuAssert(tc, "kd", kd != NULL);
+
+    for (q=0; q<Q; q++) {
+        // (including some outside the range of the tree's data)
+        for (i=0; i<D; i++)
+            queries[q*D + i] = -0.2 + 1.4 * rand() / (double)RAND_MAX;
+        // a range of radii, including some that find nothing.
+        maxd2s[q] = square(0.005 * q);
+        res[q] = NULL;
+    }
+    CuAssertIntEquals(tc, 0, kdtree_rangesearch_batch(kd, res, queries, Q,
+                                                      maxd2s, options));
+    // again, reusing the results.
+    CuAssertIntEquals(tc, 0, kdtree_rangesearch_batch(kd, res, queries, Q,
+                                                      maxd2s, options));
+    // and gathered into one result.
+    csr = kdtree_rangesearch_batch_csr(kd, NULL, queries, Q, maxd2s, options);
+    CuAssertPtrNotNull(tc, csr);
+    CuAssertPtrEquals(tc, csr, kdtree_rangesearch_batch_csr(kd, csr, queries,
+                                                            Q, maxd2s, options));
+    CuAssertIntEquals(tc, Q, csr->nq);
+    CuAssertIntEquals(tc, 0, csr->offsets[0]);
+    CuAssertIntEquals(tc, csr->nres, csr->offsets[Q]);
+
+    for (q=0; q<Q; q++) {
+        kdtree_qres_t* one = kdtree_rangesearch(kd, queries + q*D, maxd2s[q]);
+        int nfound = 0;
+        CuAssertPtrNotNull(tc, res[q]);
+        CuAssertIntEquals(tc, one->nres, res[q]->nres);
+        for (i=0; i<(int)one->nres; i++) {
+            int j;
+            for (j=0; j<(int)res[q]->nres; j++)
+                if (res[q]->inds[j] == one->inds[i]) {
+                    CuAssertDblEquals(tc, one->sdists[i], res[q]->sdists[j], 1e-12);
+                    nfound++;
+                    break;
+                }
+        }
+        CuAssertIntEquals(tc, one->nres, nfound);
+        CuAssertIntEquals(tc, res[q]->nres,
+                          csr->offsets[q+1] - csr->offsets[q]);
+        for (i=0; i<(int)res[q]->nres; i++) {
+            CuAssertIntEquals(tc, res[q]->inds[i],
+                              csr->inds[csr->offsets[q] + i]);
+            CuAssertDblEquals(tc, res[q]->sdists[i],
+                              csr->sdists[csr->offsets[q] + i], 0.0);
+        }
+        kdtree_free_query(one);
+        kdtree_free_query(res[q]);
+    }
+    kdtree_batch_res_free(csr);
+
+    kdtree_free(kd);
+    free(treedata);
+    free(origdata);
+}
+
+void test_rs_batch_bb_ddd(CuTest* tc) {
+    run_test_rs_batch(tc, KDTT_DOUBLE, KD_BUILD_BBOX,
+                      KD_OPTIONS_COMPUTE_DISTS);
+}
+void test_rs_batch_split_ddd(CuTest* tc) {
+    run_test_rs_batch(tc, KDTT_DOUBLE, KD_BUILD_SPLIT,
+                      KD_OPTIONS_COMPUTE_DISTS | KD_OPTIONS_SORT_DISTS);
+}
+void test_rs_batch_split_dss(CuTest* tc) {
+    run_test_rs_batch(tc, KDTT_DSS, KD_BUILD_SPLIT | KD_BUILD_SPLITDIM,
+                      KD_OPTIONS_COMPUTE_DISTS | KD_OPTIONS_USE_SPLIT |
+                      KD_OPTIONS_NO_RESIZE_RESULTS);
+}
+void test_rs_batch_bb_duu(CuTest* tc) {
+    run_test_rs_batch(tc, KDTT_DUU, KD_BUILD_BBOX | KD_BUILD_SPLIT,
+                      KD_OPTIONS_COMPUTE_DISTS);
+}
+
+/*
+ Checks that kdtree_nn_batch() finds the same neighbours as one
+ kdtree_nearest_neighbour_within() per query.
+ */
+static void run_test_nn_batch(CuTest* tc, int treetype, int treeopts) {
+    int N = 1000;
+    int D = 3;
+    int Nleaf = 10;
+    int Q = 200;
+    double* origdata;
+    double* treedata;
+    kdtree_t* kd;
+    double queries[Q * D];
+    double maxd2s[Q];
+    int inds[Q];
+    double d2s[Q];
+    int i, q;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    treedata = malloc(N * D * sizeof(double));
+    memcpy(treedata, origdata, N*D*sizeof(double));
+    kd = build_tree(tc, treedata, N, D, Nleaf, treetype, treeopts);
+    CuAssert(tc, "kd", kd != NULL);
+
+    for (q=0; q<Q; q++) {
+        for (i=0; i<D; i++)
+            queries[q*D + i] = -0.2 + 1.4 * rand() / (double)RAND_MAX;
+        // some with no neighbour in range.
+        maxd2s[q] = square(0.0005 * (q % 100));
+    }
+
+    for (i=0; i<2; i++) {
+        const double* m = (i ? maxd2s : NULL);
+        CuAssertIntEquals(tc, 0, kdtree_nn_batch(kd, queries, Q, m,
+                                                 inds, d2s));
+        for (q=0; q<Q; q++) {
+            double d2;
+            int ind = kdtree_nearest_neighbour_within(kd, queries + q*D,
+                                                      m ? m[q] : LARGE_VAL,
+                                                      &d2);
+            CuAssertIntEquals(tc, ind == -1, inds[q] == -1);
+            if (ind == -1)
+                continue;
+            // (ties may be broken differently)
+            CuAssertDblEquals(tc, d2, d2s[q], 1e-12);
+        }
+    }
+
+    kdtree_free(kd);
+    free(treedata);
+    free(origdata);
+}
+
+void test_nn_batch_bb_ddd(CuTest* tc) {
+    run_test_nn_batch(tc, KDTT_DOUBLE, KD_BUILD_BBOX);
+}
+void test_nn_batch_split_ddd(CuTest* tc) {
+    run_test_nn_batch(tc, KDTT_DOUBLE, KD_BUILD_SPLIT);
+}
+void test_nn_batch_bb_duu(CuTest* tc) {
+    run_test_nn_batch(tc, KDTT_DUU, KD_BUILD_BBOX);
+}
+void test_nn_batch_split_dss(CuTest* tc) {
+    run_test_nn_batch(tc, KDTT_DSS, KD_BUILD_SPLIT | KD_BUILD_SPLITDIM);
+}
+
+static int compare_doubles_asc(const void* v1, const void* v2) {
+    double d1 = *(const double*)v1;
+    double d2 = *(const double*)v2;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/*
+ Checks kdtree_knn() and kdtree_knn_batch() against sorting the
+ distances to all the points.
+ */
+static void run_test_knn(CuTest* tc, int treetype, int treeopts, double eps) {
+    int N = 1000;
+    int D = 3;
+    int Nleaf = 10;
+    int Q = 100;
+    int K = 12;
+    double* origdata;
+    double* treedata;
+    double* pts;
+    double* alld2;
+    kdtree_t* kd;
+    double queries[Q * D];
+    double maxd2s[Q];
+    int inds[K];
+    double d2s[K];
+    int* binds;
+    double* bd2s;
+    int counts[Q];
+    int i, q, n;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    treedata = malloc(N * D * sizeof(double));
+    memcpy(treedata, origdata, N*D*sizeof(double));
+    kd = build_tree(tc, treedata, N, D, Nleaf, treetype, treeopts);
+    CuAssert(tc, "kd", kd != NULL);
+    pts = malloc(N * D * sizeof(double));
+    kdtree_copy_data_double(kd, 0, N, pts);
+    alld2 = malloc(N * sizeof(double));
+    binds = malloc(Q * K * sizeof(int));
+    bd2s = malloc(Q * K * sizeof(double));
+
+    for (q=0; q<Q; q++) {
+        for (i=0; i<D; i++)
+            queries[q*D + i] = -0.2 + 1.4 * rand() / (double)RAND_MAX;
+        // some with fewer than K neighbours in range.
+        maxd2s[q] = square(0.002 * (q % 50));
+    }
+    CuAssertIntEquals(tc, 0, kdtree_knn_batch(kd, queries, Q, K, maxd2s,
+                                              binds, bd2s, counts));
 
+    for (q=0; q<Q; q++) {
+        int nin = 0;
+        for (i=0; i<N; i++) {
+            alld2[i] = distsq(queries + q*D, pts + i*D, D);
+            if (alld2[i] <= maxd2s[q])
+                nin++;
+        }
+        qsort(alld2, N, sizeof(double), compare_doubles_asc);
+
+        // no limit
+        n = kdtree_knn(kd, queries + q*D, K, LARGE_VAL, inds, d2s);
+        CuAssertIntEquals(tc, K, n);
+        for (i=0; i<K; i++) {
+            CuAssertDblEquals(tc, alld2[i], d2s[i], eps);
+            CuAssertDblEquals(tc, d2s[i],
+                              distsq(queries + q*D, pts + inds[i]*D, D), eps);
+        }
+        // the nearest is the nearest neighbour.
+        CuAssertDblEquals(tc, d2s[0], distsq(queries + q*D, pts + D *
+                          kdtree_nearest_neighbour(kd, queries + q*D, NULL), D), eps);
+
+        // limited, and batched.
+        n = kdtree_knn(kd, queries + q*D, K, maxd2s[q], inds, NULL);
+        CuAssertIntEquals(tc, MIN(K, nin), n);
+        CuAssertIntEquals(tc, n, counts[q]);
+        for (i=0; i<K; i++) {
+            if (i >= n) {
+                CuAssertIntEquals(tc, -1, binds[q*K + i]);
+                continue;
+            }
+            CuAssertDblEquals(tc, alld2[i], bd2s[q*K + i], eps);
+            CuAssertDblEquals(tc, bd2s[q*K + i],
+                              distsq(queries + q*D, pts + binds[q*K + i]*D, D),
+                              eps);
+        }
+    }
 
+    free(binds);
+    free(bd2s);
+    free(alld2);
+    free(pts);
+    kdtree_free(kd);
+    free(treedata);
+    free(origdata);
+}
 
+void test_knn_bb_ddd(CuTest* tc) {
+    run_test_knn(tc, KDTT_DOUBLE, KD_BUILD_BBOX, 1e-12);
+}
+void test_knn_split_ddd(CuTest* tc) {
+    run_test_knn(tc, KDTT_DOUBLE, KD_BUILD_SPLIT, 1e-12);
+}
+void test_knn_bb_duu(CuTest* tc) {
+    run_test_knn(tc, KDTT_DUU, KD_BUILD_BBOX, 1e-9);
+}
+void test_knn_split_dss(CuTest* tc) {
+    run_test_knn(tc, KDTT_DSS, KD_BUILD_SPLIT | KD_BUILD_SPLITDIM, 1e-5);
+}
 
 void test_nn_bb_ddd(CuTest* tc) {
     run_test_nn(tc, KDTT_DOUBLE, KD_BUILD_BBOX, 1e-9);
@@ -460,6 +754,10 @@ void test_nn_split_duu(CuTest* tc) {
     run_test_nn(tc, KDTT_DUU, KD_BUILD_SPLIT, 1e-9);
 }
 
+void test_nn_split_ddu(CuTest* tc) {
+    run_test_nn(tc, KDTT_DDU, KD_BUILD_SPLIT, 1e-9);
+}
+
 void test_nn_bb_duu(CuTest* tc) {
     run_test_nn(tc, KDTT_DUU, KD_BUILD_BBOX, 1e-9);
 }
@@ -482,6 +780,69 @@ void test_nn_bb_dssB(CuTest* tc) {
 
 
 
+/*
+ Checks that kdtree_nearest_neighbour_approx() finds a point within a
+ factor (1+eps) of the nearest one (and the nearest one, with eps = 0),
+ and that with eps > 0 it does sometimes settle for another.
+ */
+static void run_test_nn_approx(CuTest* tc, int treetype, int treeopts) {
+    int N = 20000;
+    int D = 3;
+    int Q = 200;
+    double eps = 0.5;
+    kdtree_t* kd;
+    double* origdata;
+    double* treedata;
+    double query[3];
+    int q, d, i, nworse = 0;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    treedata = malloc(N * D * sizeof(double));
+    memcpy(treedata, origdata, N*D*sizeof(double));
+    kd = build_tree(tc, treedata, N, D, 8, treetype, treeopts);
+    CuAssertPtrNotNull(tc, kd);
+
+    for (q=0; q<Q; q++) {
+        double trued2 = LARGE_VAL;
+        double d2, d2exact;
+        int ind;
+        for (d=0; d<D; d++)
+            query[d] = rand() / (double)RAND_MAX;
+        for (i=0; i<N; i++)
+            trued2 = MIN(trued2, distsq(query, origdata + i*D, D));
+
+        ind = kdtree_nearest_neighbour_approx(kd, query, LARGE_VAL, 0.0, &d2exact);
+        CuAssertTrue(tc, ind >= 0);
+        CuAssertDblEquals(tc, sqrt(trued2), sqrt(d2exact), 1e-4);
+
+        ind = kdtree_nearest_neighbour_approx(kd, query, LARGE_VAL, eps, &d2);
+        CuAssertTrue(tc, ind >= 0);
+        CuAssertDblEquals(tc, d2, distsq(query, origdata + kd->perm[ind]*D, D), 1e-6);
+        CuAssertTrue(tc, sqrt(d2) <= (1.0 + eps) * sqrt(trued2) + 1e-4);
+        if (d2 > d2exact)
+            nworse++;
+    }
+    CuAssertTrue(tc, nworse > 0);
+
+    kdtree_free(kd);
+    free(treedata);
+    free(origdata);
+}
+
+void test_nn_approx_bb_ddd(CuTest* tc) {
+    run_test_nn_approx(tc, KDTT_DOUBLE, KD_BUILD_BBOX);
+}
+void test_nn_approx_split_ddd(CuTest* tc) {
+    run_test_nn_approx(tc, KDTT_DOUBLE, KD_BUILD_SPLIT);
+}
+void test_nn_approx_split_duu(CuTest* tc) {
+    run_test_nn_approx(tc, KDTT_DUU, KD_BUILD_SPLIT);
+}
+void test_nn_approx_bb_dss(CuTest* tc) {
+    run_test_nn_approx(tc, KDTT_DSS, KD_BUILD_BBOX);
+}
+
 void test_nn_split_ddd_linearlr(CuTest* tc) {
     run_test_nn(tc, KDTT_DOUBLE, KD_BUILD_SPLIT | KD_BUILD_NO_LR | KD_BUILD_LINEAR_LR, 1e-9);
 }
@@ -522,6 +883,156 @@ void test_lr_ddd(CuTest* tc) {
     run_test_lr(tc, 3, 10, KDTT_DOUBLE, KD_BUILD_SPLIT);
 }
 
+/*
+ Checks that building with threads gives exactly the same tree.
+ */
+static void run_test_build_threads(CuTest* tc, int treetype, int treeopts) {
+    int N = 20000;
+    int D = 3;
+    int Nleaf = 8;
+    double* origdata;
+    double* data1;
+    double* data2;
+    kdtree_t* kd1;
+    kdtree_t* kd2;
+    int nthreads;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    data1 = malloc(N * D * sizeof(double));
+    memcpy(data1, origdata, N*D*sizeof(double));
+    kd1 = build_tree(tc, data1, N, D, Nleaf, treetype, treeopts);
+    CuAssertPtrNotNull(tc, kd1);
+
+    for (nthreads=2; nthreads<=5; nthreads+=3) {
+        data2 = malloc(N * D * sizeof(double));
+        memcpy(data2, origdata, N*D*sizeof(double));
+        kd2 = kdtree_new(N, D, Nleaf);
+        kdtree_set_build_threads(kd2, nthreads);
+        kd2 = kdtree_build(kd2, data2, N, D, Nleaf, treetype, treeopts);
+        CuAssertPtrNotNull(tc, kd2);
+        CuAssertIntEquals(tc, 0, kdtree_check(kd2));
+
+        CuAssertIntEquals(tc, 0, memcmp(kd1->perm, kd2->perm,
+                                        kdtree_sizeof_perm(kd1)));
+        CuAssertIntEquals(tc, 0, memcmp(kd1->lr, kd2->lr,
+                                        kdtree_sizeof_lr(kd1)));
+        CuAssertIntEquals(tc, 0, memcmp(kd1->data.any, kd2->data.any,
+                                        kdtree_sizeof_data(kd1)));
+        if (kd1->bb.any)
+            CuAssertIntEquals(tc, 0, memcmp(kd1->bb.any, kd2->bb.any,
+                                            kdtree_sizeof_bb(kd1)));
+        if (kd1->split.any)
+            CuAssertIntEquals(tc, 0, memcmp(kd1->split.any, kd2->split.any,
+                                            kdtree_sizeof_split(kd1)));
+        if (kd1->splitdim)
+            CuAssertIntEquals(tc, 0, memcmp(kd1->splitdim, kd2->splitdim,
+                                            kdtree_sizeof_splitdim(kd1)));
+        kdtree_free(kd2);
+        free(data2);
+    }
+    kdtree_free(kd1);
+    free(data1);
+    free(origdata);
+}
+
+void test_build_threads_bb_ddd(CuTest* tc) {
+    run_test_build_threads(tc, KDTT_DOUBLE, KD_BUILD_BBOX);
+}
+void test_build_threads_split_duu(CuTest* tc) {
+    run_test_build_threads(tc, KDTT_DUU, KD_BUILD_SPLIT);
+}
+void test_build_threads_both_dss(CuTest* tc) {
+    run_test_build_threads(tc, KDTT_DSS, KD_BUILD_BBOX | KD_BUILD_SPLIT |
+                           KD_BUILD_SPLITDIM);
+}
+
+/*
+ Checks that a tree in the vEB layout describes the same nodes, and
+ answers queries the same way, as the breadth-first one.
+ */
+static void run_test_veb_layout(CuTest* tc, int treetype, int treeopts) {
+    int N = 5000;
+    int D = 3;
+    int Nleaf = 5;
+    int Q = 100;
+    double* origdata;
+    double* data1;
+    double* data2;
+    double* queries;
+    kdtree_t* kd1;
+    kdtree_t* kd2;
+    int i, d;
+
+    srand(0);
+    origdata = random_points_d(N, D);
+    data1 = malloc(N * D * sizeof(double));
+    data2 = malloc(N * D * sizeof(double));
+    memcpy(data1, origdata, N*D*sizeof(double));
+    memcpy(data2, origdata, N*D*sizeof(double));
+    kd1 = build_tree(tc, data1, N, D, Nleaf, treetype, treeopts);
+    kd2 = build_tree(tc, data2, N, D, Nleaf, treetype,
+                     treeopts | KD_BUILD_VEB_LAYOUT);
+    CuAssertPtrNotNull(tc, kd1);
+    CuAssertPtrNotNull(tc, kd2);
+    CuAssertIntEquals(tc, 0, kd1->veb_layout);
+    CuAssertIntEquals(tc, 1, kd2->veb_layout);
+    CuAssertIntEquals(tc, 0, kdtree_check(kd2));
+
+    for (i=0; i<kd1->nnodes; i++) {
+        if (kd1->bb.any) {
+            double lo1[D], hi1[D], lo2[D], hi2[D];
+            CuAssertIntEquals(tc, 1, kdtree_get_bboxes(kd1, i, lo1, hi1));
+            CuAssertIntEquals(tc, 1, kdtree_get_bboxes(kd2, i, lo2, hi2));
+            for (d=0; d<D; d++) {
+                CuAssertDblEquals(tc, lo1[d], lo2[d], 0.0);
+                CuAssertDblEquals(tc, hi1[d], hi2[d], 0.0);
+            }
+        }
+        if (kd1->split.any && i < kd1->ninterior) {
+            CuAssertIntEquals(tc, kdtree_get_splitdim(kd1, i),
+                              kdtree_get_splitdim(kd2, i));
+            CuAssertDblEquals(tc, kdtree_get_splitval(kd1, i),
+                              kdtree_get_splitval(kd2, i), 0.0);
+        }
+    }
+
+    queries = random_points_d(Q, D);
+    for (i=0; i<Q; i++) {
+        kdtree_qres_t* res1;
+        kdtree_qres_t* res2;
+        double d2a, d2b;
+        res1 = kdtree_rangesearch(kd1, queries + i*D, 0.01);
+        res2 = kdtree_rangesearch(kd2, queries + i*D, 0.01);
+        CuAssertIntEquals(tc, res1->nres, res2->nres);
+        CuAssertIntEquals(tc, 0, memcmp(res1->inds, res2->inds,
+                                        res1->nres * sizeof(u32)));
+        kdtree_free_query(res1);
+        kdtree_free_query(res2);
+        CuAssertIntEquals(tc, kdtree_nearest_neighbour(kd1, queries + i*D, &d2a),
+                          kdtree_nearest_neighbour(kd2, queries + i*D, &d2b));
+        CuAssertDblEquals(tc, d2a, d2b, 0.0);
+    }
+
+    kdtree_free(kd1);
+    kdtree_free(kd2);
+    free(data1);
+    free(data2);
+    free(queries);
+    free(origdata);
+}
+
+void test_veb_layout_bb_ddd(CuTest* tc) {
+    run_test_veb_layout(tc, KDTT_DOUBLE, KD_BUILD_BBOX);
+}
+void test_veb_layout_split_duu(CuTest* tc) {
+    run_test_veb_layout(tc, KDTT_DUU, KD_BUILD_SPLIT);
+}
+void test_veb_layout_both_dss(CuTest* tc) {
+    run_test_veb_layout(tc, KDTT_DSS, KD_BUILD_BBOX | KD_BUILD_SPLIT |
+                        KD_BUILD_SPLITDIM);
+}
+
 void test_no_lr_with_ints(CuTest* tc) {
     double* data;
     kdtree_t* kd;
@@ -536,3 +1047,44 @@ void test_no_lr_with_ints(CuTest* tc) {
     errors_free();
 }
 
+
+void test_qres_pool(CuTest* tc) {
+    int N = 1000, D = 3;
+    double* data;
+    kdtree_t* kd;
+    kdtree_qres_t* res;
+    kdtree_qres_t* res2;
+    kdtree_qres_t* ref;
+    double query[3] = { 0.5, 0.5, 0.5 };
+    int i;
+
+    srand(0);
+    data = random_points_d(N, D);
+    kd = build_tree(tc, data, N, D, 10, KDTT_DOUBLE, KD_BUILD_BBOX);
+    ref = kdtree_rangesearch(kd, query, 0.04);
+
+    res = kdtree_qres_acquire();
+    CuAssertPtrNotNull(tc, res);
+    res = kdtree_rangesearch_options_reuse(kd, res, query, 0.04,
+                                           KD_OPTIONS_SORT_DISTS |
+                                           KD_OPTIONS_NO_RESIZE_RESULTS);
+    CuAssertIntEquals(tc, ref->nres, res->nres);
+    for (i=0; i<ref->nres; i++)
+        CuAssertIntEquals(tc, ref->inds[i], res->inds[i]);
+    kdtree_qres_release(res);
+
+    // the next acquire gets the same result back, arrays and all.
+    res2 = kdtree_qres_acquire();
+    CuAssertPtrEquals(tc, res, res2);
+    CuAssertIntEquals(tc, 0, res2->nres);
+    CuAssertTrue(tc, res2->capacity >= ref->nres);
+    res2 = kdtree_rangesearch_options_reuse(kd, res2, query, 0.04,
+                                            KD_OPTIONS_NO_RESIZE_RESULTS);
+    CuAssertIntEquals(tc, ref->nres, res2->nres);
+    kdtree_qres_release(res2);
+    kdtree_qres_pool_clear();
+
+    kdtree_free_query(ref);
+    kdtree_free(kd);
+    free(data);
+}
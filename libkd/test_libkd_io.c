@@ -10,10 +10,12 @@
 #include <stdint.h>
 #include <strings.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "cutest.h"
 #include "kdtree.h"
 #include "kdtree_fits_io.h"
+#include "an-alloc.h"
 
 #include "test_libkd_common.c"
 
@@ -38,6 +40,7 @@ static void assert_kdtrees_equal(CuTest* ct, const kdtree_t* kd, const kdtree_t*
     CuAssertIntEquals(ct, kd->ninterior, kd2->ninterior);
     CuAssertIntEquals(ct, kd->nlevels, kd2->nlevels);
     CuAssertIntEquals(ct, kd->has_linear_lr, kd2->has_linear_lr);
+    CuAssertIntEquals(ct, kd->veb_layout, kd2->veb_layout);
     CuAssertDblEquals(ct, kd->scale,    kd2->scale,    del);
     CuAssertDblEquals(ct, kd->invscale, kd2->invscale, del);
 
@@ -175,7 +178,7 @@ void test_read_write_single_tree_named(CuTest* ct) {
     data = random_points_d(N, D);
     kd = build_tree(ct, data, N, D, Nleaf, KDTT_DOUBLE,
                     KD_BUILD_SPLIT | KD_BUILD_BBOX | KD_BUILD_LINEAR_LR);
-    kd->name = strdup("christmas");
+    kdtree_set_name(kd, "christmas");
 
     sprintf(fn, "/tmp/test_libkd_io_single_tree_named.XXXXXX");
     fd = mkstemp(fn);
@@ -207,6 +210,179 @@ void test_read_write_single_tree_named(CuTest* ct) {
     kdtree_free(kd);
 }
 
+void test_read_write_veb_layout(CuTest* ct) {
+    kdtree_t* kd;
+    double * data;
+    int N = 1000;
+    int Nleaf = 5;
+    int D = 3;
+    char fn[1024];
+    int rtn;
+    kdtree_t* kd2;
+    int fd;
+
+    data = random_points_d(N, D);
+    kd = build_tree(ct, data, N, D, Nleaf, KDTT_DSS,
+                    KD_BUILD_SPLIT | KD_BUILD_BBOX | KD_BUILD_SPLITDIM |
+                    KD_BUILD_VEB_LAYOUT);
+    CuAssertIntEquals(ct, 1, kd->veb_layout);
+    kdtree_set_name(kd, "veb");
+
+    sprintf(fn, "/tmp/test_libkd_io_veb_layout.XXXXXX");
+    fd = mkstemp(fn);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to generate a temp filename: %s\n", strerror(errno));
+        CuFail(ct, "mkstemp");
+    }
+    close(fd);
+    printf("vEB layout: writing to file %s.\n", fn);
+
+    rtn = kdtree_fits_write(kd, fn, NULL);
+    CuAssertIntEquals(ct, 0, rtn);
+
+    kd2 = kdtree_fits_read(fn, NULL, NULL);
+    assert_kdtrees_equal(ct, kd, kd2);
+    CuAssertIntEquals(ct, 0, kdtree_check(kd2));
+    kdtree_fits_close(kd2);
+
+    free(data);
+    kdtree_free(kd);
+}
+
+void test_read_lazy(CuTest* ct) {
+    kdtree_t* kd;
+    kdtree_t* kd2;
+    kdtree_qres_t* res;
+    kdtree_qres_t* res2;
+    double* data;
+    int N = 1000;
+    int D = 3;
+    char fn[1024];
+    int fd, i, policy;
+    size_t popmax;
+
+    data = random_points_d(N, D);
+    kd = build_tree(ct, data, N, D, 5, KDTT_DSS,
+                    KD_BUILD_SPLIT | KD_BUILD_BBOX | KD_BUILD_SPLITDIM);
+
+    sprintf(fn, "/tmp/test_libkd_io_lazy.XXXXXX");
+    fd = mkstemp(fn);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to generate a temp filename: %s\n", strerror(errno));
+        CuFail(ct, "mkstemp");
+    }
+    close(fd);
+    CuAssertIntEquals(ct, 0, kdtree_fits_write(kd, fn, NULL));
+
+    policy = fitsbin_get_mmap_policy(&popmax);
+    fitsbin_set_mmap_policy(policy | FITSBIN_MMAP_LAZY, popmax);
+    kd2 = kdtree_fits_read(fn, NULL, NULL);
+    fitsbin_set_mmap_policy(policy, popmax);
+    CuAssertPtrNotNull(ct, kd2);
+    // nothing is mapped yet...
+    CuAssertPtrNotNull(ct, kd2->load);
+    CuAssertPtrEquals(ct, NULL, kd2->data.any);
+    CuAssertPtrEquals(ct, NULL, kd2->perm);
+    CuAssertPtrEquals(ct, NULL, kd2->bb.any);
+    // (and the file needn't be open for it to be.)
+    fitsbin_close_fd(kd2->io);
+
+    // ... until the first search.
+    res = kdtree_rangesearch(kd, data, 0.01);
+    res2 = kdtree_rangesearch(kd2, data, 0.01);
+    CuAssertPtrNotNull(ct, res2);
+    CuAssertPtrEquals(ct, NULL, kd2->load);
+    CuAssertIntEquals(ct, res->nres, res2->nres);
+    for (i=0; i<res->nres; i++)
+        CuAssertIntEquals(ct, res->inds[i], res2->inds[i]);
+    kdtree_free_query(res);
+    kdtree_free_query(res2);
+    assert_kdtrees_equal(ct, kd, kd2);
+    kdtree_fits_close(kd2);
+
+    free(data);
+    kdtree_free(kd);
+}
+
+static off_t file_size(const char* fn) {
+    struct stat st;
+    if (stat(fn, &st))
+        return -1;
+    return st.st_size;
+}
+
+static void check_packed(CuTest* ct, int treetype, int D) {
+    kdtree_t* kd;
+    kdtree_t* kd2;
+    double* data;
+    double* d1;
+    double* d2;
+    int N = 20000;
+    int Nleaf = 25;
+    char fn[1024];
+    char fn2[1024];
+    double maxerr = 0.0;
+    int fd, i;
+    off_t packedsize;
+
+    data = random_points_d(N, D);
+    kd = build_tree(ct, data, N, D, Nleaf, treetype,
+                    KD_BUILD_SPLIT | KD_BUILD_PACK_DATA);
+    CuAssertIntEquals(ct, 1, kd->packed_data);
+    // (as in an index, whose quads and stars are in tree order.)
+    an_alloc_free(AN_ALLOC_LIBKD, kd->perm);
+    kd->perm = NULL;
+
+    sprintf(fn, "/tmp/test_libkd_io_packed.XXXXXX");
+    fd = mkstemp(fn);
+    CuAssertTrue(ct, fd != -1);
+    close(fd);
+    CuAssertIntEquals(ct, 0, kdtree_fits_write(kd, fn, NULL));
+    packedsize = file_size(fn);
+
+    kd2 = kdtree_fits_read(fn, NULL, NULL);
+    CuAssertPtrNotNull(ct, kd2);
+    CuAssertIntEquals(ct, 1, kd2->packed_data);
+    CuAssertTrue(ct, kd2->pack_error > 0);
+    CuAssertIntEquals(ct, 0, kdtree_check(kd2));
+    // the points are in the same order, and within the packing error.
+    d1 = malloc(N * D * sizeof(double));
+    d2 = malloc(N * D * sizeof(double));
+    kdtree_copy_data_double(kd, 0, N, d1);
+    kdtree_copy_data_double(kd2, 0, N, d2);
+    for (i=0; i<N*D; i++)
+        maxerr = MAX(maxerr, fabs(d1[i] - d2[i]));
+    CuAssertTrue(ct, maxerr > 0);
+    CuAssertTrue(ct, maxerr <= kd2->pack_error * (1.0 + 1e-9));
+    free(d1);
+    free(d2);
+    kdtree_fits_close(kd2);
+
+    // ... and the file is smaller than the unpacked one.
+    kd->packed_data = 0;
+    sprintf(fn2, "/tmp/test_libkd_io_unpacked.XXXXXX");
+    fd = mkstemp(fn2);
+    CuAssertTrue(ct, fd != -1);
+    close(fd);
+    CuAssertIntEquals(ct, 0, kdtree_fits_write(kd, fn2, NULL));
+    CuAssertTrue(ct, packedsize < 0.7 * file_size(fn2));
+
+    unlink(fn);
+    unlink(fn2);
+    free(data);
+    kdtree_free(kd);
+}
+
+void test_read_write_packed(CuTest* ct) {
+    // code trees: u16 data in 8 bits.
+    check_packed(ct, KDTT_DSS, 4);
+}
+
+void test_read_write_packed_u32(CuTest* ct) {
+    // star trees: u32 data in 16 bits.
+    check_packed(ct, KDTT_DUU, 3);
+}
+
 void test_read_write_two_trees(CuTest* ct) {
     kdtree_t* kd;
     kdtree_t* kdB;
@@ -225,12 +401,12 @@ void test_read_write_two_trees(CuTest* ct) {
     data = random_points_d(N, D);
     kd = build_tree(ct, data, N, D, Nleaf, KDTT_DOUBLE,
                     KD_BUILD_SPLIT | KD_BUILD_BBOX | KD_BUILD_LINEAR_LR);
-    kd->name = strdup("christmas");
+    kdtree_set_name(kd, "christmas");
 
     dataB = random_points_d(N, D);
     kdB = build_tree(ct, dataB, N, D, Nleaf, KDTT_DUU,
                      KD_BUILD_SPLIT | KD_BUILD_SPLITDIM | KD_BUILD_LINEAR_LR);
-    kdB->name = strdup("watermelon");
+    kdtree_set_name(kdB, "watermelon");
 
     sprintf(fn, "/tmp/test_libkd_io_two_trees.XXXXXX");
     fd = mkstemp(fn);
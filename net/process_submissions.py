@@ -45,6 +45,7 @@ import tarfile
 import gzip
 import zipfile
 import math
+import hashlib
 
 from astrometry.net import settings
 settings.LOGGING['loggers'][''] = {
@@ -191,7 +192,8 @@ def create_job_logger(job):
     log.msg('Testing log.msg()')
     return log
 
-def try_dojob(job, userimage, solve_command, solve_locally):
+def try_dojob(job, userimage, solve_command, solve_locally, solve_server=None,
+              stream_files=False):
     print('try_dojob', job, '(sub', job.user_image.submission.id, ')')
     jobdir = job.make_dir()
     log = create_job_logger(job)
@@ -199,7 +201,8 @@ def try_dojob(job, userimage, solve_command, solve_locally):
     rtn = None
     try:
         rtn = dojob(job, userimage, solve_command=solve_command,
-                     solve_locally=solve_locally, tempfiles=tempfiles, log=log)
+                     solve_locally=solve_locally, solve_server=solve_server,
+                     stream_files=stream_files, tempfiles=tempfiles, log=log)
         print('try_dojob', job, 'completed:', rtn)
     except OSError as e:
         print('OSError processing job', job)
@@ -244,8 +247,173 @@ def try_dojob(job, userimage, solve_command, solve_locally):
 
     return rtn
 
+class SolveServerConnection(object):
+    '''
+    A connection to an "astrometry-engine --listen" server; "addr" is a
+    Unix socket path or host:port.  It is kept open between jobs, so
+    that the server's worker stays with this client.
+    '''
+    def __init__(self, addr):
+        import socket
+        if '/' in addr:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(addr)
+        else:
+            host,port = addr.rsplit(':', 1) if ':' in addr else ('localhost', addr)
+            self.sock = socket.create_connection((host, int(port)))
+        self.f = self.sock.makefile('rwb')
+
+    def command(self, line):
+        self.f.write((line + '\n').encode())
+        self.f.flush()
+        reply = self.f.readline()
+        if not reply:
+            raise EOFError('Solve server closed the connection')
+        return reply.decode().strip()
+
+    def put(self, path, name):
+        with open(path, 'rb') as fin:
+            data = fin.read()
+        self.f.write(('put %s %i\n' % (name, len(data))).encode())
+        self.f.write(data)
+        self.f.flush()
+        reply = self.f.readline().decode().strip()
+        if reply != 'ok':
+            raise RuntimeError('Solve server: ' + reply)
+
+    def get(self, name, path):
+        reply = self.command('get ' + name)
+        words = reply.split()
+        if len(words) != 3 or words[0] != 'data':
+            raise RuntimeError('Solve server: ' + reply)
+        n = int(words[2])
+        with open(path, 'wb') as fout:
+            while n > 0:
+                data = self.f.read(min(n, 1 << 20))
+                if not data:
+                    raise EOFError('Solve server closed the connection')
+                fout.write(data)
+                n -= len(data)
+
+    def close(self):
+        try:
+            self.f.close()
+        finally:
+            self.sock.close()
+
+# Open connections to solve servers, by address.  Jobs run in a
+# multiprocessing pool, so each worker process has its own.
+solve_server_connections = {}
+
+def solve_with_server(addrs, jobdir, axyfn, log, stream_files=False):
+    '''
+    Sends a job to one of the "astrometry-engine --listen" servers in
+    "addrs" (Unix socket paths or host:port; a single address may be
+    given as a string), reusing this process's connection to it.  The
+    processes in the job pool start with different servers, and move on
+    to the next if a server can't be reached.
+
+    With "stream_files", the axy file is sent over the connection and
+    the output files sent back, so the server needn't share the job
+    directory.  Returns the server's reply line.
+    '''
+    import socket
+    if isinstance(addrs, str):
+        addrs = [addrs]
+    first = os.getpid() % len(addrs)
+    for i in range(len(addrs)):
+        addr = addrs[(first + i) % len(addrs)]
+        conn = solve_server_connections.get(addr)
+        try:
+            if conn is None:
+                conn = SolveServerConnection(addr)
+                solve_server_connections[addr] = conn
+            return run_on_solve_server(conn, jobdir, axyfn, log, stream_files)
+        except (socket.error, EOFError) as e:
+            log.msg('Solve server', addr, 'failed:', e)
+            solve_server_connections.pop(addr, None)
+            if conn is not None:
+                conn.close()
+    raise RuntimeError('No solve server could run the job')
+
+def run_on_solve_server(conn, jobdir, axyfn, log, stream_files):
+    if stream_files:
+        reply = conn.command('tmpdir')
+        if not reply.startswith('ok'):
+            raise RuntimeError('Solve server: ' + reply)
+        conn.put(os.path.join(jobdir, axyfn), axyfn)
+    else:
+        reply = conn.command('cd %s' % jobdir)
+        if reply != 'ok':
+            raise RuntimeError('Solve server: ' + reply)
+    reply = conn.command('solve %s' % axyfn)
+    log.msg('Solve server replied:', reply)
+    if not reply or reply.startswith('error'):
+        raise RuntimeError('Solve server: ' + reply)
+    if stream_files:
+        files = conn.command('list').split()
+        if not files or files[0] != 'files':
+            raise RuntimeError('Solve server: ' + ' '.join(files))
+        for fn in files[1:]:
+            if fn == axyfn:
+                continue
+            conn.get(fn, os.path.join(jobdir, fn))
+        log.msg('Fetched', len(files) - 2, 'files from the solve server')
+    return reply
+
+# Solve results are cached by content: the key is the image's hash plus
+# every augment-xylist argument except the (per-job) file paths, so a
+# resubmission of the same image with the same settings reuses the earlier
+# job's output files instead of solving again.
+def solve_cache_key(df, axyargs, axyflags):
+    h = hashlib.sha1(df.file_hash.encode())
+    for k in sorted(axyargs.keys()):
+        if k in ['--out', '--image', '--xylist', '--xylist-cache']:
+            continue
+        h.update(('%s=%s;' % (k, axyargs[k])).encode())
+    for k in sorted(axyflags):
+        h.update(('%s;' % k).encode())
+    return h.hexdigest()
+
+def solve_cache_file(key):
+    return os.path.join(settings.JOBDIR, 'solve-cache', key[:2], key)
+
+def find_cached_solve(key, job):
+    fn = solve_cache_file(key)
+    try:
+        jobid = int(open(fn).read())
+        prev = Job.objects.get(id=jobid)
+    except (IOError, ValueError, Job.DoesNotExist):
+        return None
+    # (the earlier job may since have been re-run, or its files removed.)
+    if (prev.id == job.id or prev.status != 'S' or
+        not os.path.exists(prev.get_wcs_file())):
+        return None
+    return prev
+
+def record_solve(key, job):
+    fn = solve_cache_file(key)
+    try:
+        os.makedirs(os.path.dirname(fn), exist_ok=True)
+        tmpfn = fn + '.%i' % os.getpid()
+        with open(tmpfn, 'w') as f:
+            f.write('%i\n' % job.id)
+        os.rename(tmpfn, fn)
+    except OSError as e:
+        logmsg('Failed to record solve of job', job.id, 'in cache:', e)
+
+def copy_job_files(prev, jobdir):
+    # everything but the earlier job's logs.
+    logs = [prev.get_log_file(), prev.get_log_file2()]
+    prevdir = prev.get_dir()
+    for fn in os.listdir(prevdir):
+        path = os.path.join(prevdir, fn)
+        if path in logs or not os.path.isfile(path):
+            continue
+        shutil.copy2(path, os.path.join(jobdir, fn))
+
 def dojob(job, userimage, log=None, solve_command=None, solve_locally=None,
-          tempfiles=None):
+          solve_server=None, stream_files=False, tempfiles=None):
     jobdir = job.get_dir()
     if not os.path.exists(jobdir):
         # make_dir deletes an existing directory if it already exists!!
@@ -312,6 +480,9 @@ def dojob(job, userimage, log=None, solve_command=None, solve_locally=None,
         axyargs['--height'] = h
     else:
         axyargs['--image'] = df.get_path()
+        # reuse the sources found in the image by earlier jobs with
+        # different solve parameters.
+        axyargs['--xylist-cache'] = os.path.join(settings.JOBDIR, 'xylist-cache')
 
     # UGLY
     if sub.parity == 0:
@@ -333,77 +504,91 @@ def dojob(job, userimage, log=None, solve_command=None, solve_locally=None,
     if sub.invert:
         axyflags.append('--invert')
 
-    cmd = 'augment-xylist '
-    for (k,v) in list(axyargs.items()):
-        if v:
-            cmd += k + ' ' + str(v) + ' '
-    for k in axyflags:
-        cmd += k + ' '
-
-    log.msg('running: ' + cmd)
-    (rtn, out, err) = run_command(cmd)
-    if rtn:
-        log.msg('out: ' + out)
-        log.msg('err: ' + err)
-        logmsg('augment-xylist failed: rtn val', rtn, 'err', err)
-        raise Exception
-
-    log.msg('created axy file', axypath)
-    # shell into compute server...
-    logfn = job.get_log_file()
-    # the "tar" commands both use "-C" to chdir, and the ssh command
-    # and redirect uses absolute paths.
-
-    if solve_locally is not None:
-
-        cmd = (('cd %(jobdir)s && %(solvecmd)s %(jobid)s %(axyfile)s >> ' +
-               '%(logfile)s') %
-               dict(jobid='job-%s-%i' % (settings.sitename, job.id),
-                    solvecmd=solve_locally,
-                    axyfile=axyfn, jobdir=jobdir,
-                    logfile=logfn))
-        log.msg('command:', cmd)
-        w = os.system(cmd)
-        if not os.WIFEXITED(w):
-            log.msg('Solver failed (sent signal?)')
-            logmsg('Call to solver failed for job', job.id)
-            raise Exception
-        rtn = os.WEXITSTATUS(w)
-        if rtn:
-            log.msg('Solver failed with return value %i' % rtn)
-            logmsg('Call to solver failed for job', job.id, 'with return val',
-                   rtn)
-            raise Exception
-
-        log.msg('Solver completed successfully.')
-
+    # Has this image already been solved with the same parameters?
+    solvekey = solve_cache_key(df, axyargs, axyflags)
+    prevjob = find_cached_solve(solvekey, job)
+    if prevjob is not None:
+        log.msg('Same image and solve parameters as job', prevjob.id,
+                '; reusing its results')
+        copy_job_files(prevjob, jobdir)
     else:
-        if solve_command is None:
-            solve_command = 'ssh -x -T %(sshconfig)s'
-
-        cmd = (('(echo %(jobid)s; '
-                'tar cf - --ignore-failed-read -C %(jobdir)s %(axyfile)s) | '
-                + solve_command + ' 2>>%(logfile)s | '
-                'tar xf - --atime-preserve -m --exclude=%(axyfile)s -C %(jobdir)s '
-                '>>%(logfile)s 2>&1') %
-               dict(jobid='job-%s-%i' % (settings.sitename, job.id),
-                    axyfile=axyfn, jobdir=jobdir,
-                    sshconfig=settings.ssh_solver_config,
-                    logfile=logfn))
-        log.msg('command:', cmd)
-        w = os.system(cmd)
-        if not os.WIFEXITED(w):
-            log.msg('Solver failed (sent signal?)')
-            logmsg('Call to solver failed for job', job.id)
-            raise Exception
-        rtn = os.WEXITSTATUS(w)
+        cmd = 'augment-xylist '
+        for (k,v) in list(axyargs.items()):
+            if v:
+                cmd += k + ' ' + str(v) + ' '
+        for k in axyflags:
+            cmd += k + ' '
+
+        log.msg('running: ' + cmd)
+        (rtn, out, err) = run_command(cmd)
         if rtn:
-            log.msg('Solver failed with return value %i' % rtn)
-            logmsg('Call to solver failed for job', job.id, 'with return val',
-                   rtn)
+            log.msg('out: ' + out)
+            log.msg('err: ' + err)
+            logmsg('augment-xylist failed: rtn val', rtn, 'err', err)
             raise Exception
 
-        log.msg('Solver completed successfully.')
+        log.msg('created axy file', axypath)
+        # shell into compute server...
+        logfn = job.get_log_file()
+        # the "tar" commands both use "-C" to chdir, and the ssh command
+        # and redirect uses absolute paths.
+
+        if solve_server is not None:
+
+            solve_with_server(solve_server, jobdir, axyfn, log,
+                              stream_files=stream_files)
+            log.msg('Solver completed successfully.')
+
+        elif solve_locally is not None:
+
+            cmd = (('cd %(jobdir)s && %(solvecmd)s %(jobid)s %(axyfile)s >> ' +
+                   '%(logfile)s') %
+                   dict(jobid='job-%s-%i' % (settings.sitename, job.id),
+                        solvecmd=solve_locally,
+                        axyfile=axyfn, jobdir=jobdir,
+                        logfile=logfn))
+            log.msg('command:', cmd)
+            w = os.system(cmd)
+            if not os.WIFEXITED(w):
+                log.msg('Solver failed (sent signal?)')
+                logmsg('Call to solver failed for job', job.id)
+                raise Exception
+            rtn = os.WEXITSTATUS(w)
+            if rtn:
+                log.msg('Solver failed with return value %i' % rtn)
+                logmsg('Call to solver failed for job', job.id, 'with return val',
+                       rtn)
+                raise Exception
+
+            log.msg('Solver completed successfully.')
+
+        else:
+            if solve_command is None:
+                solve_command = 'ssh -x -T %(sshconfig)s'
+
+            cmd = (('(echo %(jobid)s; '
+                    'tar cf - --ignore-failed-read -C %(jobdir)s %(axyfile)s) | '
+                    + solve_command + ' 2>>%(logfile)s | '
+                    'tar xf - --atime-preserve -m --exclude=%(axyfile)s -C %(jobdir)s '
+                    '>>%(logfile)s 2>&1') %
+                   dict(jobid='job-%s-%i' % (settings.sitename, job.id),
+                        axyfile=axyfn, jobdir=jobdir,
+                        sshconfig=settings.ssh_solver_config,
+                        logfile=logfn))
+            log.msg('command:', cmd)
+            w = os.system(cmd)
+            if not os.WIFEXITED(w):
+                log.msg('Solver failed (sent signal?)')
+                logmsg('Call to solver failed for job', job.id)
+                raise Exception
+            rtn = os.WEXITSTATUS(w)
+            if rtn:
+                log.msg('Solver failed with return value %i' % rtn)
+                logmsg('Call to solver failed for job', job.id, 'with return val',
+                       rtn)
+                raise Exception
+
+            log.msg('Solver completed successfully.')
 
     # Solved?
     wcsfn = os.path.join(jobdir, wcsfile)
@@ -461,6 +646,8 @@ def dojob(job, userimage, log=None, solve_command=None, solve_locally=None,
         job.status = 'F'
     job.set_end_time()
     job.save()
+    if job.status == 'S' and prevjob is None:
+        record_solve(solvekey, job)
     log.msg('Finished job', job.id)
     logmsg('Finished job',job.id)
     return job.id
@@ -795,7 +982,7 @@ def job_callback(result):
 
 
 def main(dojob_nthreads, dosub_nthreads, refresh_rate, max_sub_retries,
-         solve_command, solve_locally):
+         solve_command, solve_locally, solve_server=None, stream_files=False):
 
     print('Tempdir:', tempfile.gettempdir())
     
@@ -1025,11 +1212,13 @@ def main(dojob_nthreads, dosub_nthreads, refresh_rate, max_sub_retries,
             qj.save()
 
             if dojob_pool:
-                res = dojob_pool.apply_async(try_dojob, (job, userimage, solve_command, solve_locally),
+                res = dojob_pool.apply_async(try_dojob, (job, userimage, solve_command, solve_locally,
+                                                         solve_server, stream_files),
                                              callback=job_callback)
                 jobresults.append((job.id, res))
             else:
-                try_dojob(job, userimage, solve_command=solve_command, solve_locally=solve_locally)
+                try_dojob(job, userimage, solve_command=solve_command, solve_locally=solve_locally,
+                          solve_server=solve_server, stream_files=stream_files)
 
 if __name__ == '__main__':
     import optparse
@@ -1049,7 +1238,17 @@ if __name__ == '__main__':
     parser.add_option('--solve-locally',
                       help='Command to run astrometry-engine on this machine, not via ssh')
 
+    parser.add_option('--solve-server', action='append',
+                      help='Send jobs to an "astrometry-engine --listen" server, '
+                      'at this Unix socket path or host:port; repeat to spread '
+                      'jobs over several servers')
+
+    parser.add_option('--stream-files', action='store_true', default=False,
+                      help='With --solve-server: send the job files over the '
+                      'connection, for servers that do not share the job directories')
+
     opt,args = parser.parse_args()
 
     main(opt.jobthreads, opt.subthreads, opt.refreshrate, opt.maxsubretries,
-         opt.solve_command, opt.solve_locally)
+         opt.solve_command, opt.solve_locally, opt.solve_server,
+         opt.stream_files)
@@ -24,6 +24,8 @@
 #include "mathutil.h"
 #include "constellations.h"
 #include "constellation-boundaries.h"
+#include "kdtree.h"
+#include "permutedsort.h"
 
 DEFINE_PLOTTER(annotations);
 
@@ -290,24 +292,61 @@ static void plot_constellations(cairo_t* cairo, plot_args_t* pargs, plotann_t* a
     }
 }
 
+// Builds a kd-tree over "N" unit vectors, which it keeps (and reorders).
+static kdtree_t* build_catalog_tree(double* xyz, int N) {
+    return kdtree_build(NULL, xyz, N, 3, 16, KDTT_DOUBLE, KD_BUILD_BBOX);
+}
+
+// Returns the catalog indices of objects within "radius" degrees of
+// RA,Dec (ra,dec), in catalog order; sets "N".
+static int* search_catalog_tree(const kdtree_t* kd, double ra, double dec,
+                                double radius, int* N) {
+    double xyz[3];
+    kdtree_qres_t* res;
+    int* inds;
+    radecdeg2xyzarr(ra, dec, xyz);
+    res = kdtree_rangesearch_options_reuse(kd, kdtree_qres_acquire(), xyz,
+                                           deg2distsq(radius),
+                                           KD_OPTIONS_COMPUTE_DISTS |
+                                           KD_OPTIONS_NO_RESIZE_RESULTS);
+    *N = res ? res->nres : 0;
+    inds = malloc(MAX(*N, 1) * sizeof(int));
+    if (*N)
+        memcpy(inds, res->inds, *N * sizeof(int));
+    kdtree_qres_release(res);
+    // keep the catalog order, which is the drawing order.
+    qsort(inds, *N, sizeof(int), compare_ints_asc);
+    return inds;
+}
+
 static void plot_brightstars(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann) {
-    int i, N;
+    int i, j, N;
+    int* inds;
 
     // Get plot center, to use in trimming bright stars
     double rc,dc,radius;
     plotstuff_get_radec_center_and_radius(pargs, &rc, &dc, &radius);
 
-    N = bright_stars_n();
-    for (i=0; i<N; i++) {
+    if (!ann->bright_kd) {
+        N = bright_stars_n();
+        ann->bright_xyz = malloc(MAX(N, 1) * 3 * sizeof(double));
+        for (i=0; i<N; i++) {
+            const brightstar_t* bs = bright_stars_get(i);
+            radecdeg2xyzarr(bs->ra, bs->dec, ann->bright_xyz + 3*i);
+        }
+        ann->bright_kd = build_catalog_tree(ann->bright_xyz, N);
+    }
+    // skip stars too far away
+    inds = search_catalog_tree(ann->bright_kd, rc, dc, radius * 1.2, &N);
+    logverb("Checking %i of %i bright stars.\n", N, bright_stars_n());
+
+    for (j=0; j<N; j++) {
         double px, py;
         char* label;
-        const brightstar_t* bs = bright_stars_get(i);
+        const brightstar_t* bs = bright_stars_get(inds[j]);
         // skip unnamed
         if (!strlen(bs->name) && !strlen(bs->common_name))
             continue;
-        // skip stars too far away
-        if (deg_between_radecdeg(rc, dc, bs->ra, bs->dec) > radius * 1.2)
-            continue;
         if (!plotstuff_radec2xy(pargs, bs->ra, bs->dec, &px, &py))
             continue;
         logverb("Bright star %s/%s at RA,Dec (%g,%g) -> xy (%g, %g)\n",
@@ -329,6 +368,7 @@ static void plot_brightstars(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann)
             plotstuff_stack_text(pargs, cairo, label, px, py);
         }
     }
+    free(inds);
 }
 
 int plot_annotations_set_hd_catalog(plotann_t* ann, const char* hdfn) {
@@ -385,7 +425,8 @@ static void plot_hd(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann) {
 static void plot_ngc(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann) {
     double imscale;
     double imsize;
-    int i, N;
+    int i, j, N;
+    int* inds;
 
     // arcsec/pixel
     imscale = plotstuff_pixel_scale(pargs);
@@ -403,23 +444,32 @@ static void plot_ngc(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann) {
     // bit of margin
     radius_deg *= 1.1;
 
-    N = ngc_num_entries();
+    if (!ann->ngc_kd) {
+        N = ngc_num_entries();
+        ann->ngc_xyz = malloc(MAX(N, 1) * 3 * sizeof(double));
+        for (i=0; i<N; i++) {
+            ngc_entry* ngc = ngc_get_entry(i);
+            if (!ngc) {
+                N = i;
+                break;
+            }
+            radecdeg2xyzarr(ngc->ra, ngc->dec, ann->ngc_xyz + 3*i);
+        }
+        ann->ngc_kd = build_catalog_tree(ann->ngc_xyz, N);
+    }
+    // Quick filter
+    inds = search_catalog_tree(ann->ngc_kd, ra_center, dec_center,
+                               radius_deg, &N);
     logverb("Checking %i NGC/IC objects.\n", N);
 
-    for (i=0; i<N; i++) {
+    for (j=0; j<N; j++) {
         ngc_entry* ngc;
         char* names;
         double pixrad;
         double px, py;
         double r;
 
-        ngc = ngc_get_entry(i);
-        if (!ngc)
-            break;
-
-        // Quick filter
-        if (deg_between_radecdeg(ra_center, dec_center, ngc->ra, ngc->dec) > radius_deg)
-            continue;
+        ngc = ngc_get_entry(inds[j]);
 
         if (ngc->size < imsize * ann->ngc_fraction) {
             // FIXME -- just plot an X-mark with label.
@@ -472,6 +522,7 @@ static void plot_ngc(cairo_t* cairo, plot_args_t* pargs, plotann_t* ann) {
          }
          */
     }
+    free(inds);
 }
 
 void* plot_annotations_init(plot_args_t* args) {
@@ -595,6 +646,12 @@ void plot_annotations_clear_targets(plotann_t* ann) {
 void plot_annotations_free(plot_args_t* args, void* baton) {
     plotann_t* ann = (plotann_t*)baton;
     free(ann->hd_catalog);
+    if (ann->ngc_kd)
+        kdtree_free(ann->ngc_kd);
+    free(ann->ngc_xyz);
+    if (ann->bright_kd)
+        kdtree_free(ann->bright_kd);
+    free(ann->bright_xyz);
     free(ann);
 }
 
@@ -11,7 +11,7 @@
 #include "log.h"
 #include "errors.h"
 
-DEFINE_PLOTTER(fill);
+DEFINE_TILEABLE_PLOTTER(fill, plotstuff_always_tileable);
 
 void* plot_fill_init(plot_args_t* plotargs) {
     plotfill_t* args = calloc(1, sizeof(plotfill_t));
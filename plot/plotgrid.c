@@ -14,7 +14,7 @@
 #include "log.h"
 #include "errors.h"
 
-DEFINE_PLOTTER(grid);
+DEFINE_TILEABLE_PLOTTER(grid, plot_grid_tileable);
 
 plotgrid_t* plot_grid_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "grid");
@@ -224,13 +224,18 @@ static int do_radec_labels(plot_args_t* pargs, plotgrid_t* args,
 			   int* count_ra, int* count_dec) {
     double cra, cdec;
     double ra, dec;
+    anbool dolabel;
 
     if (count_ra)
       *count_ra = 0;
     if (count_dec)
       *count_dec = 0;
 
-    args->dolabel = (args->ralabelstep > 0) || (args->declabelstep > 0);
+    dolabel = (args->ralabelstep > 0) || (args->declabelstep > 0);
+    // (only written when it changes: grids without labels are drawn in
+    // tiles, concurrently.)
+    if (args->dolabel != dolabel)
+        args->dolabel = dolabel;
     if (!args->dolabel)
         return 0;
 
@@ -336,6 +341,11 @@ void plot_grid_add_label(plot_args_t* pargs, double ra, double dec,
     plotstuff_plot_stack(pargs, cairo);
 }
 
+anbool plot_grid_tileable(plot_args_t* pargs, void* baton) {
+    plotgrid_t* args = (plotgrid_t*)baton;
+    return (args->ralabelstep <= 0) && (args->declabelstep <= 0);
+}
+
 int plot_grid_plot(const char* command,
                    cairo_t* cairo, plot_args_t* pargs, void* baton) {
     plotgrid_t* args = (plotgrid_t*)baton;
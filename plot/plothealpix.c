@@ -15,7 +15,7 @@
 #include "healpix-utils.h"
 #include "healpix.h"
 
-DEFINE_PLOTTER(healpix);
+DEFINE_TILEABLE_PLOTTER(healpix, plotstuff_always_tileable);
 
 plothealpix_t* plot_healpix_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "healpix");
@@ -32,7 +32,8 @@ int plot_healpix_plot(const char* command,
                       cairo_t* cairo, plot_args_t* pargs, void* baton) {
     plothealpix_t* args = (plothealpix_t*)baton;
     double ra,dec,rad;
-    il* hps;
+    ll* ranges;
+    size_t j;
     int i;
     double hpstep;
     int minx[12], maxx[12], miny[12], maxy[12];
@@ -43,8 +44,9 @@ int plot_healpix_plot(const char* command,
         ERROR("Failed to get RA,Dec center and radius");
         return -1;
     }
-    hps = healpix_rangesearch_radec(ra, dec, rad, args->nside, NULL);
-    logmsg("Found %zu healpixes in range.\n", il_size(hps));
+    ranges = healpix_disc_ranges_radec(ra, dec, rad, args->nside, NULL);
+    logmsg("Found %lli healpixes in range.\n",
+           (long long)healpix_ranges_count(ranges));
     hpstep = args->nside * args->stepsize * plotstuff_pixel_scale(pargs) / 60.0 / healpix_side_length_arcmin(args->nside);
     hpstep = MIN(1, hpstep);
     logmsg("Taking steps of %g in healpix space\n", hpstep);
@@ -54,18 +56,24 @@ int plot_healpix_plot(const char* command,
         maxx[i] = maxy[i] = -1;
         minx[i] = miny[i] = args->nside+1;
     }
-    for (i=0; i<il_size(hps); i++) {
-        int hp = il_get(hps, i);
-        int hpx, hpy;
-        int bighp;
-        healpix_decompose_xy(hp, &bighp, &hpx, &hpy, args->nside);
-        logverb("  hp %i: bighp %i, x,y (%i,%i)\n", i, bighp, hpx, hpy);
-        minx[bighp] = MIN(minx[bighp], hpx);
-        maxx[bighp] = MAX(maxx[bighp], hpx);
-        miny[bighp] = MIN(miny[bighp], hpy);
-        maxy[bighp] = MAX(maxy[bighp], hpy);
+    for (j=0; j<ll_size(ranges); j+=2) {
+        int64_t hp = ll_get(ranges, j);
+        int64_t hi = ll_get(ranges, j+1);
+        // one row (fixed x) of healpixes at a time
+        while (hp < hi) {
+            int hpx, hpy, hpy2;
+            int bighp;
+            healpix_decompose_xyl(hp, &bighp, &hpx, &hpy, args->nside);
+            hpy2 = MIN(args->nside, hpy + (hi - hp)) - 1;
+            logverb("  bighp %i, x %i, y [%i, %i]\n", bighp, hpx, hpy, hpy2);
+            minx[bighp] = MIN(minx[bighp], hpx);
+            maxx[bighp] = MAX(maxx[bighp], hpx);
+            miny[bighp] = MIN(miny[bighp], hpy);
+            maxy[bighp] = MAX(maxy[bighp], hpy2);
+            hp += hpy2 - hpy + 1;
+        }
     }
-    il_free(hps);
+    ll_free(ranges);
 
     for (i=0; i<12; i++) {
         int hx,hy;
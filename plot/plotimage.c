@@ -14,7 +14,7 @@
 #include "log.h"
 #include "errors.h"
 #include "anwcs.h"
-#include "permutedsort.h"
+#include "dimage.h"
 #include "wcs-resample.h"
 #include "mathutil.h"
 #include "anqfits.h"
@@ -73,13 +73,21 @@ int plot_image_get_percentile(plot_args_t* pargs, plotimage_t* args,
         }
     }
 
+    // (exact, from a histogram of each channel)
     N = args->W * args->H;
     I = MAX(0, MIN(N-1, floor(N * percentile)));
     for (j=0; j<3; j++) {
-        int* P;
-        P = permuted_sort(args->img + j, 4, compare_uchars_asc, NULL, N);
-        rgb[j] = args->img[4 * P[I] + j];
-        free(P);
+        int hist[256];
+        int i, below = 0;
+        memset(hist, 0, sizeof(hist));
+        for (i=0; i<N; i++)
+            hist[args->img[4*i + j]]++;
+        for (i=0; i<255; i++) {
+            if (below + hist[i] > I)
+                break;
+            below += hist[i];
+        }
+        rgb[j] = i;
     }
     return 0;
 }
@@ -114,6 +122,7 @@ void plot_image_wcs(cairo_t* cairo, unsigned char* img, int W, int H,
     cairo_matrix_t mat;
     int i,j;
     double *xs, *ys;
+    double *gridxy, *gridrd;
     int NX, NY;
     double x,y;
 
@@ -169,26 +178,30 @@ void plot_image_wcs(cairo_t* cairo, unsigned char* img, int W, int H,
     // resample image in this case, since I doubt cairo is very smart in this case.
     cairo_pattern_set_filter(pat, CAIRO_FILTER_GOOD);
     //CAIRO_FILTER_NEAREST);
+    // Image pixel -> RA,Dec -> plot pixel for the whole grid at once.
+    gridxy = malloc(NX*NY * 2 * sizeof(double));
+    gridrd = malloc(NX*NY * 2 * sizeof(double));
     for (j=0; j<NY; j++) {
-        double ra,dec;
         y = MIN(j * args->gridsize, H-1);
         for (i=0; i<NX; i++) {
-            double ox,oy;
-#if 0
-            anbool ok;
-#endif
             x = MIN(i * args->gridsize, W-1);
-            anwcs_pixelxy2radec(args->wcs, x+1, y+1, &ra, &dec);
-#if 0
-            ok = plotstuff_radec2xy(pargs, ra, dec, &ox, &oy);
-#else
-            (void)plotstuff_radec2xy(pargs, ra, dec, &ox, &oy);
-#endif
-            xs[j*NX+i] = ox-1;
-            ys[j*NX+i] = oy-1;
-            debug("image (%.1f,%.1f) -> radec (%.4f,%.4f), plot (%.1f,%.1f)\n", x, y, ra, dec, xs[j*NX+i], ys[j*NX+i]);
+            gridxy[2*(j*NX+i) + 0] = x+1;
+            gridxy[2*(j*NX+i) + 1] = y+1;
         }
     }
+    anwcs_pixelxy2radec_array(args->wcs, gridxy, NX*NY, gridrd);
+    if (pargs->wcs)
+        anwcs_radec2pixelxy_array(pargs->wcs, gridrd, NX*NY, gridxy, NULL);
+    else
+        ERROR("No WCS defined!");
+    for (i=0; i<NX*NY; i++) {
+        xs[i] = gridxy[2*i+0]-1;
+        ys[i] = gridxy[2*i+1]-1;
+        debug("image grid point %i -> radec (%.4f,%.4f), plot (%.1f,%.1f)\n",
+              i, gridrd[2*i+0], gridrd[2*i+1], xs[i], ys[i]);
+    }
+    free(gridxy);
+    free(gridrd);
     cairo_save(cairo);
     cairo_set_source(cairo, pat);
     //cairo_set_source_rgb(cairo, 1,0,0);
@@ -289,23 +302,85 @@ void plot_image_wcs(cairo_t* cairo, unsigned char* img, int W, int H,
     cairo_restore(cairo);
 }
 
+/*
+ When the image is resampled onto the plot, only the part of it under
+ the plot is read: the window [x0,x1) x [y0,y1) (zero-indexed) of the
+ "W" x "H" image found by projecting a grid of points across the plot,
+ plus a margin of one grid cell.  Returns FALSE if that's the whole
+ image, or if some of the plot doesn't project onto the image's WCS.
+ */
+static anbool plot_footprint(const plot_args_t* pargs, const plotimage_t* args,
+                             int W, int H, int* x0, int* x1, int* y0, int* y1) {
+    const int NG = 17;
+    double xlo = LARGE_VAL, xhi = -LARGE_VAL;
+    double ylo = LARGE_VAL, yhi = -LARGE_VAL;
+    double mx, my;
+    int i, j;
+
+    if (!pargs->wcs || !args->wcs)
+        return FALSE;
+    for (j=0; j<NG; j++) {
+        for (i=0; i<NG; i++) {
+            double ra, dec, x, y;
+            // (FITS pixels: the plot spans 0.5 to W+0.5.)
+            double px = 0.5 + pargs->W * i / (double)(NG-1);
+            double py = 0.5 + pargs->H * j / (double)(NG-1);
+            if (anwcs_pixelxy2radec(pargs->wcs, px, py, &ra, &dec) ||
+                anwcs_radec2pixelxy(args->wcs, ra, dec, &x, &y))
+                return FALSE;
+            xlo = MIN(xlo, x - 1);
+            xhi = MAX(xhi, x - 1);
+            ylo = MIN(ylo, y - 1);
+            yhi = MAX(yhi, y - 1);
+        }
+    }
+    mx = (xhi - xlo) / (NG-1) + 2;
+    my = (yhi - ylo) / (NG-1) + 2;
+    *x0 = MAX(0, (int)floor(xlo - mx));
+    *x1 = MIN(W, (int)ceil(xhi + mx) + 1);
+    *y0 = MAX(0, (int)floor(ylo - my));
+    *y1 = MIN(H, (int)ceil(yhi + my) + 1);
+    if (*x0 >= *x1 || *y0 >= *y1)
+        return FALSE;
+    return !(*x0 == 0 && *x1 == W && *y0 == 0 && *y1 == H);
+}
+
 static unsigned char* read_fits_image(const plot_args_t* pargs, plotimage_t* args) {
     float* fimg;
+    float* pix;
     anqfits_t* anq;
     unsigned char* img;
     float* rimg = NULL;
     float* dimg = NULL;
+    anwcs_t* subwcs = NULL;
+    int wx0 = 0, wx1 = 0, wy0 = 0, wy1 = 0;
 
     anq = anqfits_open(args->fn);
     if (!anq) {
         ERROR("Failed to read input file: \"%s\"", args->fn);
         return NULL;
     }
-    fimg = anqfits_readpix(anq, args->fitsext, 0,0,0,0, args->fitsplane,
-                           PTYPE_FLOAT, NULL, &args->W, &args->H);
+    if (args->resample && !args->downsample) {
+        const anqfits_image_t* aimg = anqfits_get_image_const(anq, args->fitsext);
+        if (aimg && plot_footprint(pargs, args, aimg->width, aimg->height,
+                                   &wx0, &wx1, &wy0, &wy1)) {
+            subwcs = anwcs_get_subimage(args->wcs, wx0, wy0,
+                                        wx1 - wx0, wy1 - wy0);
+            if (subwcs)
+                logverb("Reading image pixels [%i, %i) x [%i, %i) under the plot\n",
+                        wx0, wx1, wy0, wy1);
+            else
+                wx0 = wx1 = wy0 = wy1 = 0;
+        }
+    }
+    fimg = pix = anqfits_readpix(anq, args->fitsext, wx0, wx1, wy0, wy1,
+                                 args->fitsplane, PTYPE_FLOAT, NULL,
+                                 &args->W, &args->H);
     anqfits_close(anq);
     if (!fimg) {
         ERROR("Failed to load pixels.");
+        if (subwcs)
+            anwcs_free(subwcs);
         return NULL;
     }
 
@@ -328,8 +403,11 @@ static unsigned char* read_fits_image(const plot_args_t* pargs, plotimage_t* arg
         for (i=0; i<(pargs->W * pargs->H); i++) {
             rimg[i] = args->image_null;
         }
-        if (resample_wcs(args->wcs, fimg, args->W, args->H,
-                         pargs->wcs, rimg, pargs->W, pargs->H, 0, 0)) {
+        // (interpolating the pixel mapping to 0.1 pixel)
+        if (resample_wcs_fast(subwcs ? subwcs : args->wcs, fimg,
+                              args->W, args->H,
+                              pargs->wcs, rimg, pargs->W, pargs->H, 0, 0,
+                              0.1, 0)) {
             ERROR("Failed to resample image");
             return NULL;
         }
@@ -353,9 +431,12 @@ static unsigned char* read_fits_image(const plot_args_t* pargs, plotimage_t* arg
 
     img = plot_image_scale_float(args, fimg);
 
-    free(fimg);
+    // ("fimg" is one of these.)
+    free(pix);
     free(rimg);
     free(dimg);
+    if (subwcs)
+        anwcs_free(subwcs);
     return img;
 }
 
@@ -374,21 +455,17 @@ unsigned char* plot_image_scale_float(plotimage_t* args, const float* fimg) {
              mx = MAX(mx, fimg[i]);
              }
              */
-            int N = args->W * args->H;
-            int* perm = permutation_init(NULL, N);
-            int i;
-            int Nreal = 0;
-            for (i=0; i<N; i++) {
-                if (isfinite(fimg[i])) {
-                    perm[Nreal] = perm[i];
-                    Nreal++;
-                }
+            double ps[] = { 0.0, 0.1, 0.98, 1.0 };
+            float pct[4];
+            double mn, mx;
+            if (dpercentiles(fimg, (size_t)args->W * args->H, ps, 4, 0, 0,
+                             pct) <= 0) {
+                ERROR("No finite pixels to auto-scale");
+                return NULL;
             }
-            permuted_sort(fimg, sizeof(float), compare_floats_asc, perm, Nreal);
-            double mn = fimg[perm[(int)(Nreal * 0.1)]];
-            double mx = fimg[perm[(int)(Nreal * 0.98)]];
-            logmsg("Image auto-scaling: range %g, %g; percentiles %g, %g\n", fimg[perm[0]], fimg[perm[N-1]], mn, mx);
-            free(perm);
+            mn = pct[1];
+            mx = pct[2];
+            logmsg("Image auto-scaling: range %g, %g; percentiles %g, %g\n", pct[0], pct[3], mn, mx);
 
             offset = mn;
             scale = (255.0 / (mx - mn));
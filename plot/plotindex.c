@@ -134,20 +134,30 @@ int plot_index_plot(const char* command,
         if (args->stars) {
             // plot stars
             double* radecs = NULL;
+            double* starxys;
+            anbool* ok;
             startree_search_for(index->starkd, xyz, r2, NULL, &radecs, NULL, &N);
             if (N) {
                 assert(radecs);
             }
             logmsg("Found %i stars in range in index %s\n", N, index->indexname);
+            // project them all at once.
+            starxys = malloc(N * 2 * sizeof(double));
+            ok = malloc(N * sizeof(anbool));
+            anwcs_radec2pixelxy_array(pargs->wcs, radecs, N, starxys, ok);
             for (j=0; j<N; j++) {
-                logverb("  RA,Dec (%g,%g) -> x,y (%g,%g)\n", radecs[2*j], radecs[2*j+1], px, py);
-                if (!plotstuff_radec2xy(pargs, radecs[j*2], radecs[j*2+1], &px, &py)) {
+                if (!ok[j]) {
                     ERROR("Failed to convert RA,Dec %g,%g to pixels\n", radecs[j*2], radecs[j*2+1]);
                     continue;
                 }
+                px = starxys[2*j+0];
+                py = starxys[2*j+1];
+                logverb("  RA,Dec (%g,%g) -> x,y (%g,%g)\n", radecs[2*j], radecs[2*j+1], px, py);
                 cairoutils_draw_marker(cairo, pargs->marker, px, py, pargs->markersize);
                 cairo_stroke(cairo);
             }
+            free(starxys);
+            free(ok);
             free(radecs);
         }
         if (args->quads) {
@@ -179,11 +189,27 @@ int plot_index_plot(const char* command,
                 }
 
             } else {
-                // plot quads
+                // plot quads whose first star is close enough that the
+                // quad could reach the field.
+                int* stars;
+                int Nstars;
+                unsigned int qstars[DQMAX];
+                anbool* near;
+                double qr2 = deg2distsq(radius + arcsec2deg(index->index_scale_upper));
+                startree_search_for(index->starkd, xyz, qr2, NULL, NULL, &stars, &Nstars);
+                near = calloc(MAX(index_nstars(index), 1), sizeof(anbool));
+                for (j=0; j<Nstars; j++)
+                    near[stars[j]] = TRUE;
+                free(stars);
+                logmsg("Found %i stars in range of quads of index %s\n", Nstars, index->indexname);
                 N = index_nquads(index);
                 for (j=0; j<N; j++) {
+                    quadfile_get_stars(index->quads, j, qstars);
+                    if (!near[qstars[0]])
+                        continue;
                     plotquad(cairo, pargs, args, index, j, DQ);
                 }
+                free(near);
             }
         }
     }
@@ -13,7 +13,7 @@
 #include "permutedsort.h"
 #include "matchfile.h"
 
-DEFINE_PLOTTER(match);
+DEFINE_TILEABLE_PLOTTER(match, plotstuff_always_tileable);
 
 plotmatch_t* plot_match_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "match");
@@ -34,7 +34,8 @@ int plot_match_plot(const char* command,
     plotstuff_builtin_apply(cairo, pargs);
 
     for (i=0; i<bl_size(args->matches); i++) {
-        MatchObj* mo = bl_access(args->matches, i);
+        // (const: this may be drawn by several tile threads at once)
+        const MatchObj* mo = bl_access_const(args->matches, i);
         double xy[DQMAX*2];
         double theta[DQMAX];
         int perm[DQMAX];
@@ -15,7 +15,7 @@
 #include "sip_qfits.h"
 #include "starutil.h"
 
-DEFINE_PLOTTER(outline);
+DEFINE_TILEABLE_PLOTTER(outline, plotstuff_always_tileable);
 
 plotoutline_t* plot_outline_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "outline");
@@ -12,7 +12,7 @@
 #include "errors.h"
 #include "sip_qfits.h"
 
-DEFINE_PLOTTER(radec);
+DEFINE_TILEABLE_PLOTTER(radec, plot_radec_tileable);
 
 plotradec_t* plot_radec_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "radec");
@@ -69,6 +69,12 @@ static rd_t* get_rd(plotradec_t* args, rd_t* myrd) {
     return rd;
 }
 
+anbool plot_radec_tileable(plot_args_t* pargs, void* baton) {
+    plotradec_t* args = (plotradec_t*)baton;
+    // (bl_access() isn't safe to call concurrently on the value list.)
+    return (args->fn != NULL);
+}
+
 int plot_radec_plot(const char* command, cairo_t* cairo,
                     plot_args_t* pargs, void* baton) {
     plotradec_t* args = (plotradec_t*)baton;
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 #include <cairo-pdf.h>
@@ -506,6 +507,14 @@ static int plot_builtin_command(const char* cmd, const char* cmdargs,
         if (plotstuff_set_wcs_box(pargs, ra, dec, width)) {
             return -1;
         }
+    } else if (streq(cmd, "plot_tiles")) {
+        int tilesize, nthreads;
+        if (sscanf(cmdargs, "%i %i", &tilesize, &nthreads) != 2) {
+            ERROR("Failed to parse plot_tiles args \"%s\"", cmdargs);
+            return -1;
+        }
+        if (plotstuff_set_tiles(pargs, tilesize, nthreads))
+            return -1;
     } else if (streq(cmd, "plot_wcs_setsize")) {
         assert(pargs->wcs);
         plotstuff_set_size_wcs(pargs);
@@ -1106,6 +1115,171 @@ ATTRIB_FORMAT(printf,2,3)
     return rtn;
 }
 
+int plotstuff_set_tiles(plot_args_t* pargs, int tilesize, int nthreads) {
+    if (tilesize < 0 || (tilesize && nthreads < 1)) {
+        ERROR("Invalid tile size %i / number of threads %i", tilesize, nthreads);
+        return -1;
+    }
+    pargs->tilesize = tilesize;
+    pargs->tilethreads = nthreads;
+    return 0;
+}
+
+anbool plotstuff_always_tileable(plot_args_t* pargs, void* baton) {
+    return TRUE;
+}
+
+struct plot_tile {
+    int x0, y0, W, H;
+    cairo_surface_t* surf;
+};
+
+struct tile_job {
+    plot_args_t* pargs;
+    plotter_t* plotter;
+    const char* layer;
+    struct plot_tile* tiles;
+    int ntiles;
+    // the next tile to draw, and whether any has failed; under "lock".
+    int next;
+    anbool failed;
+    pthread_mutex_t lock;
+};
+
+// Draws one tile into a new surface, through a copy of "pargs" that
+// describes just the tile.
+static int draw_tile(struct tile_job* job, struct plot_tile* tile) {
+    plot_args_t targs;
+    size_t i;
+    int rtn;
+
+    memcpy(&targs, job->pargs, sizeof(plot_args_t));
+    targs.W = tile->W;
+    targs.H = tile->H;
+    targs.tilex0 = job->pargs->tilex0 + tile->x0;
+    targs.tiley0 = job->pargs->tiley0 + tile->y0;
+    targs.wcs = anwcs_get_subimage(job->pargs->wcs, tile->x0, tile->y0,
+                                   tile->W, tile->H);
+    if (!targs.wcs)
+        return -1;
+    targs.cairocmds = bl_new(256, sizeof(cairocmd_t));
+    tile->surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                            tile->W, tile->H);
+    targs.target = tile->surf;
+    targs.cairo = cairo_create(tile->surf);
+    cairo_set_antialias(targs.cairo, cairo_get_antialias(job->pargs->cairo));
+    plotstuff_builtin_apply(targs.cairo, &targs);
+
+    rtn = job->plotter->doplot(job->layer, targs.cairo, &targs,
+                               job->plotter->baton);
+    if (rtn)
+        ERROR("Plotter \"%s\" failed on tile at (%i,%i)",
+              job->plotter->name, tile->x0, tile->y0);
+
+    // (anything stacked but not drawn)
+    for (i=0; i<bl_size(targs.cairocmds); i++)
+        cairocmd_clear(bl_access(targs.cairocmds, i));
+    bl_free(targs.cairocmds);
+    cairo_destroy(targs.cairo);
+    anwcs_free(targs.wcs);
+    return rtn;
+}
+
+static void* tile_worker(void* v) {
+    struct tile_job* job = v;
+    while (1) {
+        int i;
+        pthread_mutex_lock(&job->lock);
+        i = job->failed ? job->ntiles : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->ntiles)
+            break;
+        if (draw_tile(job, job->tiles + i)) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = TRUE;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ Draws "layer" by tiles, each on a transparent surface of its own, and
+ paints them onto the canvas.  With the OVER operator this gives the
+ same result as drawing straight onto the canvas: each pixel receives
+ the same primitives, in the same order.
+ */
+static int plot_layer_tiled(plot_args_t* pargs, plotter_t* plotter,
+                            const char* layer) {
+    struct tile_job job;
+    pthread_t* threads;
+    int nx, ny, i, nthreads, nstarted;
+
+    nx = (pargs->W + pargs->tilesize - 1) / pargs->tilesize;
+    ny = (pargs->H + pargs->tilesize - 1) / pargs->tilesize;
+    memset(&job, 0, sizeof(job));
+    job.pargs = pargs;
+    job.plotter = plotter;
+    job.layer = layer;
+    job.ntiles = nx * ny;
+    job.tiles = calloc(job.ntiles, sizeof(struct plot_tile));
+    for (i=0; i<job.ntiles; i++) {
+        struct plot_tile* t = job.tiles + i;
+        t->x0 = (i % nx) * pargs->tilesize;
+        t->y0 = (i / nx) * pargs->tilesize;
+        t->W = MIN(pargs->tilesize, pargs->W - t->x0);
+        t->H = MIN(pargs->tilesize, pargs->H - t->y0);
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    logverb("Plotting layer \"%s\" in %i x %i tiles on %i threads\n",
+            layer, nx, ny, pargs->tilethreads);
+
+    nthreads = MIN(pargs->tilethreads, job.ntiles);
+    threads = malloc(MAX(nthreads, 1) * sizeof(pthread_t));
+    // this thread is the first worker.
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, tile_worker, &job))
+            break;
+    tile_worker(&job);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    cairo_save(pargs->cairo);
+    cairo_set_operator(pargs->cairo, CAIRO_OPERATOR_OVER);
+    for (i=0; i<job.ntiles; i++) {
+        struct plot_tile* t = job.tiles + i;
+        if (!t->surf)
+            continue;
+        if (!job.failed) {
+            cairo_surface_flush(t->surf);
+            cairo_set_source_surface(pargs->cairo, t->surf, t->x0, t->y0);
+            cairo_rectangle(pargs->cairo, t->x0, t->y0, t->W, t->H);
+            cairo_fill(pargs->cairo);
+        }
+        cairo_surface_destroy(t->surf);
+    }
+    cairo_restore(pargs->cairo);
+    free(job.tiles);
+    return job.failed ? -1 : 0;
+}
+
+// Should this plotter's next plot be drawn in tiles?
+static anbool use_tiles(plot_args_t* pargs, plotter_t* plotter) {
+    if (pargs->tilesize <= 0 || !plotter->tileable)
+        return FALSE;
+    // only raster output, through a WCS, and only when the results are
+    // the same as drawing directly.
+    if (pargs->outformat == PLOTSTUFF_FORMAT_PDF || !pargs->wcs ||
+        pargs->op != CAIRO_OPERATOR_OVER ||
+        pargs->move_to || pargs->line_to)
+        return FALSE;
+    if (pargs->W <= pargs->tilesize && pargs->H <= pargs->tilesize)
+        return FALSE;
+    return plotter->tileable(pargs, plotter->baton);
+}
+
 int plotstuff_plot_layer(plot_args_t* pargs, const char* layer) {
     int i;
     for (i=0; i<pargs->NP; i++) {
@@ -1115,6 +1289,13 @@ int plotstuff_plot_layer(plot_args_t* pargs, const char* layer) {
                     return -1;
                 }
             }
+            if (pargs->plotters[i].doplot && use_tiles(pargs, pargs->plotters + i)) {
+                if (plot_layer_tiled(pargs, pargs->plotters + i, layer)) {
+                    ERROR("Plotter \"%s\" failed on command \"%s\"", pargs->plotters[i].name, layer);
+                    return -1;
+                } else
+                    return 0;
+            }
             if (pargs->plotters[i].doplot) {
                 if (pargs->plotters[i].doplot(layer, pargs->cairo, pargs, pargs->plotters[i].baton)) {
                     ERROR("Plotter \"%s\" failed on command \"%s\"", pargs->plotters[i].name, layer);
@@ -13,7 +13,7 @@
 #include "sip_qfits.h"
 #include "tic.h"
 
-DEFINE_PLOTTER(xy);
+DEFINE_TILEABLE_PLOTTER(xy, plot_xy_tileable);
 
 plotxy_t* plot_xy_get(plot_args_t* pargs) {
     return plotstuff_get_config(pargs, "xy");
@@ -48,6 +48,12 @@ int plot_xy_setsize(plot_args_t* pargs, plotxy_t* args) {
     return 0;
 }
 
+anbool plot_xy_tileable(plot_args_t* pargs, void* baton) {
+    plotxy_t* args = (plotxy_t*)baton;
+    // (bl_access() isn't safe to call concurrently on the value list.)
+    return (args->fn != NULL);
+}
+
 int plot_xy_plot(const char* command, cairo_t* cairo,
                  plot_args_t* pargs, void* baton) {
     plotxy_t* args = (plotxy_t*)baton;
@@ -160,6 +166,13 @@ int plot_xy_plot(const char* command, cairo_t* cairo,
                 starxy_sety(xy, i, args->scale * starxy_gety(xy, i));
             }
         }
+        // When drawing a tile, shift to its origin.
+        if (pargs->tilex0 || pargs->tiley0) {
+            for (i=0; i<Nxy; i++) {
+                starxy_setx(xy, i, starxy_getx(xy, i) - pargs->tilex0);
+                starxy_sety(xy, i, starxy_gety(xy, i) - pargs->tiley0);
+            }
+        }
     }
 
     // Plot markers.
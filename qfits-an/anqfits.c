@@ -15,6 +15,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "anqfits.h"
 #include "qfits_std.h"
@@ -28,6 +34,7 @@
 #include "qfits_image.h"
 #include "qfits_convert.h"
 #include "qfits_byteswap.h"
+#include "qfits_tilecomp.h"
 
 #include "ioutils.h"
 #include "errors.h"
@@ -67,6 +74,128 @@ int fits_get_atom_size(tfits_type type) {
 	return atomsize;
 }
 
+/*
+ Fast paths for fits_convert_data_2(), for the common pairs of types when
+ the "n" values are packed and need no scaling.  Returns 0 if it
+ converted them, -1 if the caller must.
+
+ read_array_into() in fitstable.c converts in place, with "dest" and
+ "src" starting at the same address; so conversions to a wider type run
+ from the end to the start, the others from the start to the end, and
+ each block of values is loaded before any of it is stored.
+ */
+#if defined(__SSE2__)
+
+// sign-extends the low four int16s of "v" to int32s.
+static __m128i i16_to_i32_lo(__m128i v) {
+    return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+static int convert_packed(char* dest, tfits_type desttype,
+                          const char* src, tfits_type srctype, size_t n) {
+    size_t i;
+    size_t nvec;
+
+#define TAIL_DOWN(dtype, stype)                                         \
+    for (i=n; i>nvec; i--) {                                            \
+        stype v;                                                        \
+        dtype d;                                                        \
+        memcpy(&v, src + (i-1)*sizeof(stype), sizeof(stype));           \
+        d = v;                                                          \
+        memcpy(dest + (i-1)*sizeof(dtype), &d, sizeof(dtype));          \
+    }
+#define TAIL_UP(dtype, stype)                                           \
+    for (i=nvec; i<n; i++) {                                            \
+        stype v;                                                        \
+        dtype d;                                                        \
+        memcpy(&v, src + i*sizeof(stype), sizeof(stype));               \
+        d = v;                                                          \
+        memcpy(dest + i*sizeof(dtype), &d, sizeof(dtype));              \
+    }
+
+    nvec = n - (n % 4);
+    if (srctype == TFITS_BIN_TYPE_E && desttype == TFITS_BIN_TYPE_D) {
+        TAIL_DOWN(double, float);
+        for (i=nvec; i>0; i-=4) {
+            __m128 v = _mm_loadu_ps((const float*)src + i-4);
+            _mm_storeu_pd((double*)dest + i-4, _mm_cvtps_pd(v));
+            _mm_storeu_pd((double*)dest + i-2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+        }
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_D && desttype == TFITS_BIN_TYPE_E) {
+        for (i=0; i<nvec; i+=4) {
+            __m128d a = _mm_loadu_pd((const double*)src + i);
+            __m128d b = _mm_loadu_pd((const double*)src + i+2);
+            _mm_storeu_ps((float*)dest + i,
+                          _mm_movelh_ps(_mm_cvtpd_ps(a), _mm_cvtpd_ps(b)));
+        }
+        TAIL_UP(float, double);
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_J && desttype == TFITS_BIN_TYPE_D) {
+        TAIL_DOWN(double, int32_t);
+        for (i=nvec; i>0; i-=4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)((const int32_t*)src + i-4));
+            _mm_storeu_pd((double*)dest + i-4, _mm_cvtepi32_pd(v));
+            _mm_storeu_pd((double*)dest + i-2,
+                          _mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)));
+        }
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_J && desttype == TFITS_BIN_TYPE_E) {
+        for (i=0; i<nvec; i+=4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)((const int32_t*)src + i));
+            _mm_storeu_ps((float*)dest + i, _mm_cvtepi32_ps(v));
+        }
+        TAIL_UP(float, int32_t);
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_I && desttype == TFITS_BIN_TYPE_D) {
+        TAIL_DOWN(double, int16_t);
+        for (i=nvec; i>0; i-=4) {
+            __m128i v = i16_to_i32_lo(_mm_loadl_epi64((const __m128i*)((const int16_t*)src + i-4)));
+            _mm_storeu_pd((double*)dest + i-4, _mm_cvtepi32_pd(v));
+            _mm_storeu_pd((double*)dest + i-2,
+                          _mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)));
+        }
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_I && desttype == TFITS_BIN_TYPE_E) {
+        TAIL_DOWN(float, int16_t);
+        for (i=nvec; i>0; i-=4) {
+            __m128i v = i16_to_i32_lo(_mm_loadl_epi64((const __m128i*)((const int16_t*)src + i-4)));
+            _mm_storeu_ps((float*)dest + i-4, _mm_cvtepi32_ps(v));
+        }
+        return 0;
+    }
+    if (srctype == TFITS_BIN_TYPE_B && desttype == TFITS_BIN_TYPE_E) {
+        TAIL_DOWN(float, uint8_t);
+        for (i=nvec; i>0; i-=4) {
+            int32_t four;
+            __m128i v;
+            memcpy(&four, src + i-4, 4);
+            v = _mm_cvtsi32_si128(four);
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, _mm_setzero_si128()),
+                                   _mm_setzero_si128());
+            _mm_storeu_ps((float*)dest + i-4, _mm_cvtepi32_ps(v));
+        }
+        return 0;
+    }
+#undef TAIL_DOWN
+#undef TAIL_UP
+    return -1;
+}
+
+#else
+
+static int convert_packed(char* dest, tfits_type desttype,
+                          const char* src, tfits_type srctype, size_t n) {
+    return -1;
+}
+
+#endif
+
 int fits_convert_data_2(void* vdest, int deststride, tfits_type desttype,
                         const void* vsrc, int srcstride, tfits_type srctype,
                         int arraysize, size_t N,
@@ -79,6 +208,21 @@ int fits_convert_data_2(void* vdest, int deststride, tfits_type desttype,
     int srcatomsize = fits_get_atom_size(srctype);
     anbool scaling = (bzero != 0.0) || (bscale != 1.0);
 
+    if (!scaling) {
+        if (N == 1 || (srcstride == srcatomsize * arraysize &&
+                       deststride == destatomsize * arraysize)) {
+            if (!convert_packed(dest, desttype, src, srctype,
+                                N * (size_t)arraysize))
+                return 0;
+        } else if (arraysize == 1 && srcstride == -srcatomsize &&
+                   deststride == -destatomsize && N > 0) {
+            // packed, but walking backward from the last value.
+            if (!convert_packed(dest - (N-1) * (size_t)destatomsize, desttype,
+                                src - (N-1) * (size_t)srcatomsize, srctype, N))
+                return 0;
+        }
+    }
+
     // this loop is over rows of data
     for (i=0; i<N; i++) {
         // store local pointers so we can stride over the array, without
@@ -511,21 +655,17 @@ static char* file_get_contents_offset(const char* fn, int offset, int size) {
 const qfits_header* anqfits_get_header_const(const anqfits_t* qf, int ext) {
     assert(ext >= 0 && ext < qf->Nexts);
     if (!qf->exts[ext].header) {
-        off_t start, size;
+        // (extension headers are only parsed when they're needed.)
         char* str;
-        start = anqfits_header_start(qf, ext);
-        size  = anqfits_header_size (qf, ext);
-        if ((start == -1) || (size == -1)) {
-            ERROR("failed to get header start + size for file \"%s\" extension %i", qf->filename, ext);
-            return NULL;
-        }
-        str = file_get_contents_offset(qf->filename, (int)start, (int)size);
+        int size;
+        str = anqfits_header_get_data(qf, ext, &size);
         if (!str) {
-            ERROR("failed to read \"%s\" extension %i: offset %i size %i\n", qf->filename, ext, (int)start, (int)size);
+            ERROR("failed to read header of \"%s\" extension %i", qf->filename, ext);
             return NULL;
         }
         qf->exts[ext].header = qfits_header_read_hdr_string
-            ((unsigned char*)str, (int)size);
+            ((unsigned char*)str, size);
+        free(str);
     }
     return qf->exts[ext].header;
 }
@@ -616,12 +756,22 @@ const anqfits_image_t* anqfits_get_image_const(const anqfits_t* qf, int ext) {
         }
         img = anqfits_image_new();
 
-        // from qfits_image.c : qfitsloader_init()
-        img->bitpix = qfits_header_getint(hdr, "BITPIX", -1);
-        img->naxis  = qfits_header_getint(hdr, "NAXIS",  -1);
-        naxis1 = qfits_header_getint(hdr, "NAXIS1", -1);
-        naxis2 = qfits_header_getint(hdr, "NAXIS2", -1);
-        naxis3 = qfits_header_getint(hdr, "NAXIS3", -1);
+        img->tilecomp = qfits_is_tile_compressed(hdr);
+        if (img->tilecomp) {
+            // the image's keywords are the "Z" versions.
+            img->bitpix = qfits_header_getint(hdr, "ZBITPIX", -1);
+            img->naxis  = qfits_header_getint(hdr, "ZNAXIS",  -1);
+            naxis1 = qfits_header_getint(hdr, "ZNAXIS1", -1);
+            naxis2 = qfits_header_getint(hdr, "ZNAXIS2", -1);
+            naxis3 = qfits_header_getint(hdr, "ZNAXIS3", -1);
+        } else {
+            // from qfits_image.c : qfitsloader_init()
+            img->bitpix = qfits_header_getint(hdr, "BITPIX", -1);
+            img->naxis  = qfits_header_getint(hdr, "NAXIS",  -1);
+            naxis1 = qfits_header_getint(hdr, "NAXIS1", -1);
+            naxis2 = qfits_header_getint(hdr, "NAXIS2", -1);
+            naxis3 = qfits_header_getint(hdr, "NAXIS3", -1);
+        }
         img->bzero  = qfits_header_getdouble(hdr, "BZERO", 0.0);
         img->bscale = qfits_header_getdouble(hdr, "BSCALE", 1.0);
 
@@ -764,6 +914,262 @@ static size_t get_data_bytes(const qfits_header* hdr) {
     return data_bytes;
 }
 
+// What the scan for extensions needs to know about a header: enough
+// to find the size of the data that follows it.  Extension headers are
+// only parsed in full when someone asks for them
+// (anqfits_get_header_const).
+#define SCAN_MAX_NAXIS 999
+typedef struct {
+    int bitpix;
+    int naxis;
+    int gcount;
+    int pcount;
+    int naxes[SCAN_MAX_NAXIS + 1];
+} hdu_size_t;
+
+#define SCAN_UNSET INT_MIN
+
+static void hdu_size_init(hdu_size_t* sz) {
+    int i;
+    sz->bitpix = sz->naxis = sz->gcount = sz->pcount = SCAN_UNSET;
+    for (i=0; i<=SCAN_MAX_NAXIS; i++)
+        sz->naxes[i] = SCAN_UNSET;
+}
+
+// (like qfits_header_getint, the first card with a keyword wins.)
+static void scan_set(int* val, const char* str) {
+    if (*val == SCAN_UNSET)
+        *val = (int)strtol(str, NULL, 10);
+}
+
+static void scan_header_block(const char* buf, hdu_size_t* sz, int* found_it) {
+    int i, k, n;
+    for (i=0; i<FITS_NCARDS; i++) {
+        const char* card = buf + i * FITS_LINESZ;
+        const char* eq;
+        char key[FITS_LINESZ+1];
+        if (!strncmp(card, "END ", 4)) {
+            *found_it = 1;
+            return;
+        }
+        eq = memchr(card, '=', FITS_LINESZ);
+        if (!eq || !strncmp(card, "HISTORY ", 8) ||
+            !strncmp(card, "COMMENT ", 8) || !strncmp(card, "        ", 8))
+            continue;
+        n = eq - card;
+        while (n > 0 && card[n-1] == ' ')
+            n--;
+        memcpy(key, card, n);
+        key[n] = '\0';
+        if (!strcmp(key, "BITPIX"))
+            scan_set(&sz->bitpix, eq + 1);
+        else if (!strcmp(key, "NAXIS"))
+            scan_set(&sz->naxis, eq + 1);
+        else if (!strcmp(key, "GCOUNT"))
+            scan_set(&sz->gcount, eq + 1);
+        else if (!strcmp(key, "PCOUNT"))
+            scan_set(&sz->pcount, eq + 1);
+        else if (starts_with(key, "NAXIS")) {
+            k = atoi(key + 5);
+            if (k >= 1 && k <= SCAN_MAX_NAXIS)
+                scan_set(&sz->naxes[k], eq + 1);
+        }
+    }
+}
+
+// Same as get_data_bytes(), from the scanned values.
+static size_t scan_data_bytes(const hdu_size_t* sz) {
+    size_t data_bytes;
+    size_t npix;
+    int naxis;
+    int i;
+#define SCAN_GET(v, def) ((v) == SCAN_UNSET ? (def) : (v))
+    data_bytes = abs(SCAN_GET(sz->bitpix, 0) / 8);
+    naxis = SCAN_GET(sz->naxis, 0);
+    data_bytes *= SCAN_GET(sz->gcount, 1);
+    npix = 1;
+    if (!naxis)
+        npix = 0;
+    for (i=0; i<naxis; i++) {
+        int nax = (i+1 <= SCAN_MAX_NAXIS) ? SCAN_GET(sz->naxes[i+1], 0) : 0;
+        if (i == 0 && nax == 0) {
+            // random groups signature; skip naxis1
+        } else {
+            npix *= (size_t)nax;
+        }
+    }
+    npix += SCAN_GET(sz->pcount, 0);
+#undef SCAN_GET
+    data_bytes *= npix;
+    return data_bytes;
+}
+
+// Fills in the header and data sizes from the start offsets.
+static void set_ext_sizes(anqfits_t* qf, const struct stat* sta) {
+    int i;
+    for (i=0; i<qf->Nexts; i++) {
+        qf->exts[i].hdr_size = qf->exts[i].data_start - qf->exts[i].hdr_start;
+        if (i == qf->Nexts-1) {
+            debug("st_size %zu, /block_size = %zu\n",
+                  (size_t)sta->st_size,
+                  (size_t)(sta->st_size / (size_t)FITS_BLOCK_SIZE));
+            qf->exts[i].data_size = ((sta->st_size/FITS_BLOCK_SIZE) -
+                                     qf->exts[i].data_start);
+        } else
+            qf->exts[i].data_size = (qf->exts[i+1].hdr_start -
+                                     qf->exts[i].data_start);
+        debug("  Ext %i: header size %i, data size %i; hdr=%p\n",
+              i, qf->exts[i].hdr_size, qf->exts[i].data_size,
+              qf->exts[i].header);
+        debug("ext %i: hdr_start %i, hdr_size %i, data_start %i, data_size %i, blocks\n",
+              i,
+              qf->exts[i].hdr_start, qf->exts[i].hdr_size,
+              qf->exts[i].data_start, qf->exts[i].data_size);
+    }
+    qf->filesize = sta->st_size / FITS_BLOCK_SIZE;
+}
+
+/*
+ The HDU index: a small "<filename>.hdus" file next to a FITS file,
+ recording where each extension starts, so that files with many
+ extensions can be opened without reading every header.  It's only
+ trusted if the file's size and modification time still match.
+ */
+static int hdu_index_enabled = 0;
+
+#define HDU_INDEX_MAGIC "ANHDUIX1"
+
+struct hdu_index_header {
+    char magic[8];
+    uint64_t filesize;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t nexts;
+};
+
+void anqfits_set_hdu_index_enabled(int enabled) {
+    hdu_index_enabled = enabled;
+}
+
+int anqfits_hdu_index_enabled(void) {
+    return hdu_index_enabled;
+}
+
+static char* hdu_index_filename(const char* filename) {
+    char* fn = malloc(strlen(filename) + 6);
+    if (fn)
+        sprintf(fn, "%s.hdus", filename);
+    return fn;
+}
+
+static void hdu_index_fill_header(struct hdu_index_header* h,
+                                  const struct stat* sta, int nexts) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, HDU_INDEX_MAGIC, 8);
+    h->filesize = sta->st_size;
+    h->mtime = sta->st_mtime;
+#ifdef __linux__
+    h->mtime_nsec = sta->st_mtim.tv_nsec;
+#endif
+    h->nexts = nexts;
+}
+
+// Returns NULL if there's no up-to-date index.
+static anqfits_t* read_hdu_index(const char* filename, const struct stat* sta) {
+    struct hdu_index_header h, want;
+    char* fn;
+    FILE* fid;
+    anqfits_t* qf = NULL;
+    int64_t i;
+
+    fn = hdu_index_filename(filename);
+    if (!fn)
+        return NULL;
+    fid = fopen(fn, "rb");
+    free(fn);
+    if (!fid)
+        return NULL;
+    if (fread(&h, sizeof(h), 1, fid) != 1)
+        goto bailout;
+    hdu_index_fill_header(&want, sta, h.nexts);
+    if (memcmp(&h, &want, sizeof(h)) || h.nexts < 1 || h.nexts > INT_MAX)
+        goto bailout;
+    qf = calloc(1, sizeof(anqfits_t));
+    if (!qf)
+        goto bailout;
+    qf->filename = strdup(filename);
+    qf->Nexts = (int)h.nexts;
+    qf->exts = calloc(qf->Nexts, sizeof(anqfits_ext_t));
+    if (!qf->exts)
+        goto bailout;
+    for (i=0; i<h.nexts; i++) {
+        int32_t off[2];
+        if (fread(off, sizeof(int32_t), 2, fid) != 2)
+            goto bailout;
+        qf->exts[i].hdr_start = off[0];
+        qf->exts[i].data_start = off[1];
+        if (off[0] < 0 || off[1] <= off[0] ||
+            (i && off[0] < qf->exts[i-1].data_start) ||
+            (off_t)off[1] * FITS_BLOCK_SIZE > sta->st_size)
+            goto bailout;
+    }
+    fclose(fid);
+    set_ext_sizes(qf, sta);
+    return qf;
+
+ bailout:
+    fclose(fid);
+    if (qf) {
+        free(qf->filename);
+        free(qf->exts);
+        free(qf);
+    }
+    return NULL;
+}
+
+// Best effort: if the index can't be written, we just scan next time.
+static void write_hdu_index(const anqfits_t* qf, const struct stat* sta) {
+    struct hdu_index_header h;
+    char* fn;
+    char* tmpfn;
+    FILE* fid;
+    int i;
+    int ok;
+
+    fn = hdu_index_filename(qf->filename);
+    if (!fn)
+        return;
+    tmpfn = malloc(strlen(fn) + 32);
+    if (!tmpfn) {
+        free(fn);
+        return;
+    }
+    // (written to a temp file and renamed into place, so that readers
+    // never see a partial index.)
+    sprintf(tmpfn, "%s.tmp%i", fn, (int)getpid());
+    fid = fopen(tmpfn, "wb");
+    if (!fid) {
+        debug("Failed to write HDU index %s\n", tmpfn);
+        free(tmpfn);
+        free(fn);
+        return;
+    }
+    hdu_index_fill_header(&h, sta, qf->Nexts);
+    ok = (fwrite(&h, sizeof(h), 1, fid) == 1);
+    for (i=0; ok && i<qf->Nexts; i++) {
+        int32_t off[2];
+        off[0] = qf->exts[i].hdr_start;
+        off[1] = qf->exts[i].data_start;
+        ok = (fwrite(off, sizeof(int32_t), 2, fid) == 2);
+    }
+    if (fclose(fid))
+        ok = 0;
+    if (!ok || rename(tmpfn, fn))
+        remove(tmpfn);
+    free(tmpfn);
+    free(fn);
+}
+
 anqfits_t* anqfits_open(const char* filename) {
     return anqfits_open_hdu(filename, -1);
 }
@@ -782,12 +1188,12 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
     char buf[FITS_BLOCK_SIZE];
     int seeked;
     int firsttime;
-    int i;
 
     // initial maximum number of extensions: we grow automatically
     int ext_capacity = 1024;
 
     qfits_header* hdr = NULL;
+    hdu_size_t sz;
 
     /* Stat file to get its size */
     if (stat(filename, &sta)!=0) {
@@ -796,6 +1202,14 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
         goto bailout;
     }
 
+    if (hdu == -1 && hdu_index_enabled) {
+        qf = read_hdu_index(filename, &sta);
+        if (qf) {
+            debug("Read %i extensions from HDU index\n", qf->Nexts);
+            return qf;
+        }
+    }
+
     /* Open input file */
     fin=fopen(filename, "r");
     if (!fin) {
@@ -875,7 +1289,6 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
         /*
          * Register all extension offsets
          */
-        hdr = qfits_header_new();
         end_of_file = 0;
         while (!end_of_file) {
 
@@ -938,8 +1351,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
             found_it = 0;
             firsttime = 1;
 
-            if (!hdr)
-                hdr = qfits_header_new();
+            hdu_size_init(&sz);
 
             while (!found_it && !end_of_file) {
                 if (!firsttime) {
@@ -953,20 +1365,15 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
                 firsttime = 0;
                 n_blocks++;
 
-                if (parse_header_block(buf, hdr, &found_it)) {
-                    debug("parse_header_block() failed: bailing\n");
-                    goto bailout;
-                }
-                debug("parse_header_block() succeeded: found END? %s\n",
+                scan_header_block(buf, &sz, &found_it);
+                debug("scan_header_block(): found END? %s\n",
                       found_it ? "yes":"no");
             }
             if (found_it) {
-                data_bytes = get_data_bytes(hdr);
+                data_bytes = scan_data_bytes(&sz);
                 debug("This data block will have %zu bytes\n", data_bytes);
 
                 qf->exts[qf->Nexts].data_start = n_blocks;
-                qf->exts[qf->Nexts].header = hdr;
-                hdr = NULL;
                 qf->Nexts++;
                 if (qf->Nexts >= ext_capacity) {
                     ext_capacity *= 2;
@@ -975,6 +1382,8 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
                     assert(qf->exts);
                     if (!qf->exts)
                         goto bailout;
+                    memset(qf->exts + qf->Nexts, 0,
+                           (ext_capacity - qf->Nexts) * sizeof(anqfits_ext_t));
                 }
             }
         }
@@ -995,26 +1404,10 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
     if (!qf->exts)
         goto bailout;
 
-    for (i=0; i<qf->Nexts; i++) {
-        qf->exts[i].hdr_size = qf->exts[i].data_start - qf->exts[i].hdr_start;
-        if (i == qf->Nexts-1) {
-            debug("st_size %zu, /block_size = %zu\n",
-                  (size_t)sta.st_size,
-                  (size_t)(sta.st_size / (size_t)FITS_BLOCK_SIZE));
-            qf->exts[i].data_size = ((sta.st_size/FITS_BLOCK_SIZE) -
-                                     qf->exts[i].data_start);
-        } else
-            qf->exts[i].data_size = (qf->exts[i+1].hdr_start -
-                                     qf->exts[i].data_start);
-        debug("  Ext %i: header size %i, data size %i; hdr=%p\n",
-              i, qf->exts[i].hdr_size, qf->exts[i].data_size,
-              qf->exts[i].header);
-        debug("ext %i: hdr_start %i, hdr_size %i, data_start %i, data_size %i, blocks\n",
-              i,
-              qf->exts[i].hdr_start, qf->exts[i].hdr_size,
-              qf->exts[i].data_start, qf->exts[i].data_size);
-    }
-    qf->filesize = sta.st_size / FITS_BLOCK_SIZE;
+    set_ext_sizes(qf, &sta);
+
+    if (hdu == -1 && hdu_index_enabled)
+        write_hdu_index(qf, &sta);
 
     return qf;
 
@@ -1076,6 +1469,102 @@ tfits_type anqfits_ptype_to_ttype(int ptype) {
     return -1;
 }
 
+/*
+ Big-endian (FITS) pixel loads.
+ */
+static inline int16_t load_be16(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return (int16_t)(((uint16_t)u[0] << 8) | (uint16_t)u[1]);
+}
+static inline uint32_t load_be32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) |
+        ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+static inline uint64_t load_be64(const char* p) {
+    return ((uint64_t)load_be32(p) << 32) | (uint64_t)load_be32(p + 4);
+}
+static inline float load_be_float(const char* p) {
+    uint32_t u = load_be32(p);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+static inline double load_be_double(const char* p) {
+    uint64_t u = load_be64(p);
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+#define load_be8(p) (*(const uint8_t*)(p))
+
+/*
+ Converts "n" big-endian pixels of type "inptype" at "in" to "ptype" at
+ "out", applying BZERO and BSCALE, in one pass: the same values that
+ byte-swapping and then fits_convert_data_2() give (the arithmetic is in
+ double).
+ */
+#define READPIX_CONVERT(otype, stride, LOAD)                            \
+    do {                                                                \
+        otype* o = (otype*)out;                                         \
+        if (scaling)                                                    \
+            for (i=0; i<n; i++)                                         \
+                o[i] = (otype)(bzero + (double)LOAD(in + i*(stride)) * bscale); \
+        else                                                            \
+            for (i=0; i<n; i++)                                         \
+                o[i] = (otype)(double)LOAD(in + i*(stride));            \
+    } while (0)
+
+#define READPIX_CONVERT_FROM(otype)                                     \
+    switch (inptype) {                                                  \
+    case PTYPE_UINT8:  READPIX_CONVERT(otype, 1, load_be8);       break; \
+    case PTYPE_INT16:  READPIX_CONVERT(otype, 2, load_be16);      break; \
+    case PTYPE_INT:    READPIX_CONVERT(otype, 4, (int32_t)load_be32); break; \
+    case PTYPE_FLOAT:  READPIX_CONVERT(otype, 4, load_be_float);  break; \
+    case PTYPE_DOUBLE: READPIX_CONVERT(otype, 8, load_be_double); break; \
+    default: return -1;                                                 \
+    }
+
+static int readpix_convert_row(char* out, int ptype, const char* in,
+                               int inptype, int n,
+                               double bzero, double bscale) {
+    int scaling = (bzero != 0.0) || (bscale != 1.0);
+    int bpp = qfits_pixel_ctype_size(inptype);
+    int i;
+
+    if (!scaling && inptype == ptype) {
+        // passthrough
+        memcpy(out, in, (size_t)n * bpp);
+#ifndef WORDS_BIGENDIAN
+        qfits_swap_bytes_array(out, bpp, n);
+#endif
+        return 0;
+    }
+    switch (ptype) {
+    case PTYPE_FLOAT:
+        READPIX_CONVERT_FROM(float);
+        return 0;
+    case PTYPE_DOUBLE:
+        READPIX_CONVERT_FROM(double);
+        return 0;
+    case PTYPE_INT:
+        READPIX_CONVERT_FROM(int32_t);
+        return 0;
+    case PTYPE_INT16:
+        READPIX_CONVERT_FROM(int16_t);
+        return 0;
+    case PTYPE_UINT8:
+        READPIX_CONVERT_FROM(uint8_t);
+        return 0;
+    }
+    return -1;
+}
+#undef READPIX_CONVERT_FROM
+#undef READPIX_CONVERT
+
+// Windows at most this fraction of the image width are read row by row.
+#define READPIX_NARROW_FRACTION 4
+
 void* anqfits_readpix(const anqfits_t* qf, int ext,
                       int x0, int x1, int y0, int y1,
                       /** The plane you want, from 0 to planes-1 */
@@ -1086,32 +1575,29 @@ void* anqfits_readpix(const anqfits_t* qf, int ext,
                       void* output,
                       int* pW, int* pH) {
     const anqfits_image_t* img = anqfits_get_image_const(qf, ext);
-    //off_t NX, NY;
-    //off_t planesize;
     off_t start;
     off_t size;
+    off_t planesize;
 
     off_t mapstart;
-    size_t mapsize;
+    size_t mapsize = 0;
     int mapoffset;
     char* map = NULL;
     FILE* f = NULL;
-    char* datastart;
-    char* rowstart;
+    char* datastart = NULL;
     char* outrowstart;
     off_t outrowsize;
 
-    int x, y;
+    int y;
     off_t inlinesize;
     char* inlinebuf = NULL;
+    anbool narrow;
 
     int inptype;
 
     char* alloc_output = NULL;
     int outbpp;
 
-    tfits_type in_ttype, out_ttype;
-
     if (!img)
         return NULL;
 
@@ -1154,47 +1640,22 @@ void* anqfits_readpix(const anqfits_t* qf, int ext,
         return NULL;
     }
 
-    //NX = x1 - x0;
-    //NY = y1 - y0;
-    //planesize = img->width * img->height * (off_t)img->bpp;
-
-    f = fopen(qf->filename, "rb");
-    if (!f) {
-        qfits_error("Failed to fopen %s: %s\n", qf->filename, strerror(errno));
-        return NULL;
-    }
-
-    start = ((off_t)qf->exts[ext].data_start * (off_t)FITS_BLOCK_SIZE
-             + ((off_t)y0 * img->width + (off_t)x0) * (off_t)img->bpp);
-    size = (((off_t)(y1 - y0 - 1) * img->width + (off_t)(x1 - x0)) *
-            (off_t)img->bpp);
-
-    get_mmap_size(start, size, &mapstart, &mapsize, &mapoffset);
-	int mode, flags;
-    mode = PROT_READ;
-    flags = MAP_SHARED;
-    map = mmap(0, mapsize, mode, flags, fileno(f), mapstart);
-    if (map == MAP_FAILED) {
-        qfits_error("Failed to mmap file %s: %s",
-                    qf->filename, strerror(errno));
-        map = NULL;
-        goto bailout;
+    if (img->tilecomp) {
+        outbpp = qfits_pixel_ctype_size(ptype);
+        if (!output)
+            output = alloc_output = malloc((off_t)(x1-x0) * (off_t)(y1-y0) *
+                                           (off_t)outbpp);
+        if (anqfits_readpix_tilecomp(qf, ext, img, x0, x1, y0, y1, plane,
+                                     ptype, output)) {
+            free(alloc_output);
+            return NULL;
+        }
+        if (pW)
+            *pW = (x1 - x0);
+        if (pH)
+            *pH = (y1 - y0);
+        return output;
     }
-    fclose(f);
-    f = NULL;
-
-    datastart = map + mapoffset;
-
-    /*
-     if (fseeko(f, start, SEEK_SET)) {
-     qfits_error("Failed to fseeko(%zu) in file %s ext %i: %s\n",
-     start, qf->filename, ext, strerror(errno));
-     goto bailout;
-     }
-     */
-
-    inlinesize = (off_t)(x1 - x0) * (off_t)img->bpp;
-    inlinebuf = malloc(inlinesize);
 
     switch (img->bitpix) {
     case 8:
@@ -1214,54 +1675,96 @@ void* anqfits_readpix(const anqfits_t* qf, int ext,
         break;
     default:
         qfits_error("Unknown bitpix %i\n", img->bitpix);
-        goto bailout;
+        return NULL;
     }
 
-    in_ttype = anqfits_ptype_to_ttype(inptype);
-    out_ttype = anqfits_ptype_to_ttype(ptype);
+    f = fopen(qf->filename, "rb");
+    if (!f) {
+        qfits_error("Failed to fopen %s: %s\n", qf->filename, strerror(errno));
+        return NULL;
+    }
+
+    planesize = img->width * img->height * (off_t)img->bpp;
+    start = ((off_t)qf->exts[ext].data_start * (off_t)FITS_BLOCK_SIZE
+             + (off_t)plane * planesize
+             + ((off_t)y0 * img->width + (off_t)x0) * (off_t)img->bpp);
+    size = (((off_t)(y1 - y0 - 1) * img->width + (off_t)(x1 - x0)) *
+            (off_t)img->bpp);
+    inlinesize = (off_t)(x1 - x0) * (off_t)img->bpp;
+
+    // A window much narrower than the image (a cutout) is read a row at
+    // a time, so that only its own bytes are read rather than the whole
+    // band of rows it spans.
+    narrow = (y1 - y0 > 1 &&
+              (off_t)(x1 - x0) * READPIX_NARROW_FRACTION <= img->width);
+    if (narrow) {
+        inlinebuf = malloc(inlinesize);
+        if (!inlinebuf) {
+            qfits_error("Failed to allocate a row of %zi bytes", (size_t)inlinesize);
+            goto bailout;
+        }
+    } else {
+        get_mmap_size(start, size, &mapstart, &mapsize, &mapoffset);
+        if (get_parallel_read_threads() && mapsize > 4*1024*1024) {
+            // read big windows up front, with many requests in flight, rather
+            // than page-faulting through the mapping.
+            map = mmap(0, mapsize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map != MAP_FAILED &&
+                read_at(fileno(f), map, mapsize, mapstart)) {
+                qfits_error("Failed to read file %s", qf->filename);
+                munmap(map, mapsize);
+                map = NULL;
+                goto bailout;
+            }
+        } else
+            map = mmap(0, mapsize, PROT_READ, MAP_SHARED, fileno(f), mapstart);
+        if (map == MAP_FAILED) {
+            qfits_error("Failed to mmap file %s: %s",
+                        qf->filename, strerror(errno));
+            map = NULL;
+            goto bailout;
+        }
+        fclose(f);
+        f = NULL;
+        datastart = map + mapoffset;
+    }
 
     outbpp = qfits_pixel_ctype_size(ptype);
     if (!output) {
         output = alloc_output = malloc((off_t)(x1-x0) * (off_t)(y1-y0) *
                                        (off_t)outbpp);
     }
-
-    rowstart = datastart;
     outrowstart = output;
     outrowsize = (off_t)outbpp * (off_t)(x1-x0);
 
     // Rows...
     for (y=y0; y<y1; y++) {
-        memcpy(inlinebuf, rowstart, (off_t)img->bpp * (off_t)(x1-x0));
-        rowstart += (off_t)img->bpp * img->width;
-#ifndef WORDS_BIGENDIAN
-        char* ptr = inlinebuf;
-        for (x=x0; x<x1; x++) {
-            qfits_swap_bytes(ptr, img->bpp);
-            ptr += img->bpp;
-        }
-#endif
-        // passthrough?
-        if ((img->bzero == 0.0) && (img->bscale == 1.0) &&
-            (inptype == ptype)) {
-            memcpy(outrowstart, inlinebuf, outrowsize);
-            outrowstart += outrowsize;
-            continue;
-        }
+        const char* row;
+        if (narrow) {
+            if (read_at(fileno(f), inlinebuf, inlinesize,
+                        start + (off_t)(y - y0) * img->width * (off_t)img->bpp)) {
+                qfits_error("Failed to read row %i of %s ext %i", y,
+                            qf->filename, ext);
+                goto bailout;
+            }
+            row = inlinebuf;
+        } else
+            row = datastart + (off_t)(y - y0) * img->width * (off_t)img->bpp;
 
-        // we treat these as "arrays" since both the input and output
-        // are contiguous; hence no stride needed, and N=1.
-        if (fits_convert_data_2(outrowstart, 0, out_ttype,
-                                inlinebuf, 0, in_ttype,
-                                x1-x0, 1, img->bzero, img->bscale)) {
-            qfits_error("Failed to fits_convert_data_2\n");
+        if (readpix_convert_row(outrowstart, ptype, row, inptype, x1-x0,
+                                img->bzero, img->bscale)) {
+            qfits_error("Failed to convert pixels from bitpix %i to type %i\n",
+                        img->bitpix, ptype);
             goto bailout;
         }
-
         outrowstart += outrowsize;
     }
 
-    munmap(map, mapsize);
+    if (map)
+        munmap(map, mapsize);
+    if (f)
+        fclose(f);
     free(inlinebuf);
 
     if (pW)
@@ -1274,7 +1777,8 @@ void* anqfits_readpix(const anqfits_t* qf, int ext,
  bailout:
     free(inlinebuf);
     free(alloc_output);
-    fclose(f);
+    if (f)
+        fclose(f);
     if (map) {
         munmap(map, mapsize);
     }
@@ -29,6 +29,13 @@
                                    Includes
  -----------------------------------------------------------------------------*/
 
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #include "qfits_config.h"
 #include "qfits_byteswap.h"
 
@@ -138,4 +145,64 @@ void qfits_swap_bytes(void * p, int s)
     }
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Swaps bytes in an array of values of the same size
+  @param    p pointer to the first value
+  @param    s size of each value: 2, 4 or 8 bytes (others go one at a time)
+  @param    n number of values
+  @return    void
+
+  Equivalent to calling qfits_swap_bytes() on each value in turn, but
+  sixteen bytes at a time with SSSE3 byte shuffles when they are
+  available.  The values need not be aligned.
+ */
+/*----------------------------------------------------------------------------*/
+void qfits_swap_bytes_array(void * p, int s, size_t n)
+{
+    unsigned char * a = (unsigned char*)p;
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    if (s == 2 || s == 4 || s == 8) {
+        __m128i order;
+        size_t nvec = (n * s) / 16;
+        size_t k;
+        if (s == 2)
+            order = _mm_set_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+        else if (s == 4)
+            order = _mm_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+        else
+            order = _mm_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+        for (k=0; k<nvec; k++) {
+            __m128i v = _mm_loadu_si128((__m128i*)(a + 16*k));
+            _mm_storeu_si128((__m128i*)(a + 16*k), _mm_shuffle_epi8(v, order));
+        }
+        i = (nvec * 16) / s;
+    }
+#endif
+    switch (s) {
+    case 2:
+        for (; i<n; i++) {
+            uint16_t v;
+            memcpy(&v, a + 2*i, 2);
+            v = qfits_swap_bytes_16(v);
+            memcpy(a + 2*i, &v, 2);
+        }
+        break;
+    case 4:
+        for (; i<n; i++) {
+            uint32_t v;
+            memcpy(&v, a + 4*i, 4);
+            v = qfits_swap_bytes_32(v);
+            memcpy(a + 4*i, &v, 4);
+        }
+        break;
+    default:
+        for (; i<n; i++)
+            qfits_swap_bytes(a + (size_t)s*i, s);
+        break;
+    }
+}
+
 /**@}*/
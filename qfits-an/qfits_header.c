@@ -46,6 +46,8 @@ struct qfits_header {
     /* For efficient looping internally */
     void    *   current;
     int         current_idx;
+    /* Hash index over the keys, or NULL; built on the first lookup */
+    void    *   index;
 };
 
 
@@ -149,6 +151,30 @@ static void keytuple_del(keytuple *);
 static keytype keytuple_type(const char *);
 static int qfits_header_makeline(char *, const keytuple *, int);
 
+/*
+  Hash index over the (expanded) keys of a header, so that looking up a
+  key doesn't walk the whole list.  It maps each key to the first card
+  with that key, in an open-addressed table at most half full.  It is
+  built on the first lookup in a header of more than INDEX_MIN_CARDS
+  cards, kept up to date when cards are added at the end, and dropped
+  when cards are deleted, inserted in the middle or renamed.
+
+  Lookups take a const header, so building the index is published with
+  a compare-and-swap: two threads reading the same header may both build
+  it, and one copy is thrown away.
+ */
+#define INDEX_MIN_CARDS 16
+
+typedef struct _header_index_ {
+    int         size;       /** Number of slots, a power of two */
+    int         count;      /** Number of slots used */
+    keytuple ** slots;
+} header_index;
+
+static keytuple * qfits_header_find(const qfits_header *, const char *);
+static void header_index_drop(qfits_header *);
+static void header_index_added(qfits_header *, keytuple *);
+
 /*----------------------------------------------------------------------------*/
 /**
  * @defgroup    qfits_header    FITS header handling
@@ -201,6 +227,7 @@ qfits_header * qfits_header_new(void)
 
     h->current = NULL;
     h->current_idx = -1;
+    h->index = NULL;
 
     return h;
 }
@@ -300,6 +327,7 @@ void qfits_header_add(
     k->prev = kbf;
 
     hdr->n ++;
+    header_index_added(hdr, k);
     return;
 }
 
@@ -335,13 +363,11 @@ void qfits_header_add_after(
 
     qfits_expand_keyword_r(after, exp_after);
     /* Locate where the entry is requested */
-    kreq = (keytuple*)(hdr->first);
-    while (kreq!=NULL) {
-        if (!strcmp(kreq->key, exp_after)) break;
-        kreq = kreq->next;
-    }
+    kreq = qfits_header_find(hdr, exp_after);
     if (kreq==NULL) return;
     k = keytuple_new(key, val, com, lin);
+    /* It may now be the first card with its key */
+    header_index_drop(hdr);
 
     k->next = kreq->next;
     kreq->next->prev = k;
@@ -388,6 +414,7 @@ void qfits_header_append(
     k->prev = last;
     hdr->last = k;
     hdr->n++;
+    header_index_added(hdr, k);
     return;
 }
 
@@ -410,13 +437,10 @@ void qfits_header_del(qfits_header * hdr, const char * key)
     if (hdr==NULL || key==NULL) return;
 
     qfits_expand_keyword_r(key, xkey);
-    k = (keytuple*)hdr->first;
-    while (k!=NULL) {
-        if (!strcmp(k->key, xkey)) break;
-        k = k->next;
-    }
+    k = qfits_header_find(hdr, xkey);
     if (k==NULL)
         return;
+    header_index_drop(hdr);
     if(k == hdr->first) {
         hdr->first = k->next;
     } else {
@@ -453,11 +477,7 @@ void qfits_header_mod(
     if (hdr==NULL || key==NULL) return;
 
     qfits_expand_keyword_r(key, xkey);
-    k = (keytuple*)hdr->first;
-    while (k!=NULL) {
-        if (!strcmp(k->key, xkey)) break;
-        k=k->next;
-    }
+    k = qfits_header_find(hdr, xkey);
     if (k==NULL) return;
     
     if (k->val) qfits_free(k->val);
@@ -497,6 +517,7 @@ int qfits_header_sort(qfits_header ** hdr)
     
     /* Create the new FITS header */
     sorted = qfits_header_new();
+    header_index_drop(*hdr);
 
     /* Move the first keytuple to the sorted empty header */
     k = (keytuple*)(*hdr)->first;
@@ -586,6 +607,7 @@ void qfits_header_destroy(qfits_header * hdr)
 
     if (hdr==NULL) return;
 
+    header_index_drop(hdr);
     k = (keytuple*)hdr->first;
     while (k!=NULL) {
         kn = k->next;
@@ -618,11 +640,7 @@ char * qfits_header_getstr(const qfits_header * hdr, const char * key)
     if (hdr==NULL || key==NULL) return NULL;
 
     qfits_expand_keyword_r(key, xkey);
-    k = (keytuple*)hdr->first;
-    while (k!=NULL) {
-        if (!strcmp(k->key, xkey)) break;
-        k=k->next;
-    }
+    k = qfits_header_find(hdr, xkey);
     if (k==NULL) return NULL;
     return k->val;
 }
@@ -742,6 +760,7 @@ int qfits_header_setitem(
     if (idx<0 || idx>=hdr->n) return -1;
 
     k = get_keytuple(hdr, idx);
+    header_index_drop(hdr);
 
     // free existing strings as per keytuple_del
     if (k->key)
@@ -802,11 +821,7 @@ char * qfits_header_getcom(const qfits_header * hdr, const char * key)
     if (hdr==NULL || key==NULL) return NULL;
 
     qfits_expand_keyword_r(key, xkey);
-    k = (keytuple*)hdr->first;
-    while (k!=NULL) {
-        if (!strcmp(k->key, xkey)) break;
-        k=k->next;
-    }
+    k = qfits_header_find(hdr, xkey);
     if (k==NULL) return NULL;
     return k->com;
 }
@@ -1242,3 +1257,110 @@ char * qfits_header_findmatch(const qfits_header * hdr, const char * key)
 	if (k==NULL) return NULL;
 	return k->key;
 }
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    FNV-1a hash of a key
+ */
+/*----------------------------------------------------------------------------*/
+static unsigned int header_key_hash(const char * key)
+{
+    unsigned int h = 2166136261u;
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Puts "k" in the table unless a card with its key is there already */
+static void header_index_insert(header_index * idx, keytuple * k)
+{
+    unsigned int i = header_key_hash(k->key) & (idx->size - 1);
+    while (idx->slots[i]) {
+        if (!strcmp(idx->slots[i]->key, k->key)) return;
+        i = (i + 1) & (idx->size - 1);
+    }
+    idx->slots[i] = k;
+    idx->count++;
+}
+
+static void header_index_free(header_index * idx)
+{
+    if (idx==NULL) return;
+    qfits_free(idx->slots);
+    qfits_free(idx);
+}
+
+static header_index * header_index_build(const qfits_header * hdr)
+{
+    header_index * idx;
+    keytuple * k;
+
+    idx = qfits_malloc(sizeof(header_index));
+    idx->size = 64;
+    while (idx->size < 2 * hdr->n) idx->size *= 2;
+    idx->count = 0;
+    idx->slots = qfits_calloc(idx->size, sizeof(keytuple*));
+    /* In list order, so that each key maps to its first card */
+    for (k = (keytuple*)hdr->first; k != NULL; k = k->next)
+        header_index_insert(idx, k);
+    return idx;
+}
+
+static void header_index_drop(qfits_header * hdr)
+{
+    header_index_free(hdr->index);
+    hdr->index = NULL;
+}
+
+/* Card "k" was added after all cards that might share its key */
+static void header_index_added(qfits_header * hdr, keytuple * k)
+{
+    header_index * idx = hdr->index;
+    if (idx==NULL) return;
+    if (2 * (idx->count + 1) > idx->size) {
+        header_index_drop(hdr);
+        return;
+    }
+    header_index_insert(idx, k);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the first card with a given (expanded) key
+  @param    hdr     Header to search
+  @param    xkey    Key, as returned by qfits_expand_keyword_r()
+  @return   The card, or NULL if there is none.
+ */
+/*----------------------------------------------------------------------------*/
+static keytuple * qfits_header_find(const qfits_header * hdr, const char * xkey)
+{
+    header_index * idx;
+    keytuple * k;
+    unsigned int i;
+
+    idx = __atomic_load_n((header_index**)&hdr->index, __ATOMIC_ACQUIRE);
+    if (idx==NULL) {
+        void * expect = NULL;
+        if (hdr->n <= INDEX_MIN_CARDS) {
+            for (k = (keytuple*)hdr->first; k != NULL; k = k->next)
+                if (!strcmp(k->key, xkey)) return k;
+            return NULL;
+        }
+        idx = header_index_build(hdr);
+        if (!__atomic_compare_exchange_n((void**)&((qfits_header*)hdr)->index,
+                                         &expect, idx, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            /* Someone else built it first */
+            header_index_free(idx);
+            idx = expect;
+        }
+    }
+    i = header_key_hash(xkey) & (idx->size - 1);
+    while ((k = idx->slots[i]) != NULL) {
+        if (!strcmp(k->key, xkey)) return k;
+        i = (i + 1) & (idx->size - 1);
+    }
+    return NULL;
+}
@@ -44,6 +44,7 @@
 #include <errno.h>
 #include <assert.h>
 
+#include "qfits_memory.h"
 #include "qfits_error.h"
 
 /*-----------------------------------------------------------------------------
@@ -62,16 +63,7 @@
 #define QFITS_MEMORY_DEBUG       0
 #endif
 
-/*
-  This symbol defines the level of usage of the memory module. 
-
-  0   Use the memory system calls.
-  1   Use the memory system calls, but exit if they are not succesfull
-  2   Fully use the memory functions
-*/
-#ifndef QFITS_MEMORY_MODE
-#define QFITS_MEMORY_MODE        0
-#endif
+/* QFITS_MEMORY_MODE is defined in qfits_memory.h */
 
 /* Initial number of entries in memory table */
 /* If this number is big, the size of the memory table can become
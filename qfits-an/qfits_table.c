@@ -61,6 +61,9 @@
 
 #define LARGE_VALF 1e30f
 
+// rows of a packed column that are byte-swapped at a time.
+#define SWAP_BLOCK_ROWS 1024
+
 /*-----------------------------------------------------------------------------
  Function prototypes
  -----------------------------------------------------------------------------*/
@@ -753,11 +756,8 @@ unsigned char * qfits_query_column(
     /* SWAP the bytes if necessary */
 #ifndef WORDS_BIGENDIAN
     if ((th->tab_t == QFITS_BINTABLE) && (col->atom_size > 1)) {
-        r = array;
-        for (i=0; i<nb_rows * col->atom_nb; i++) {
-            qfits_swap_bytes(r, col->atom_size);
-            r += col->atom_size;
-        }
+        qfits_swap_bytes_array(array, col->atom_size,
+                               (size_t)nb_rows * col->atom_nb);
     }
 #endif
 
@@ -847,11 +847,8 @@ unsigned char * qfits_query_column_seq(
     /* SWAP the bytes if necessary */
 #ifndef WORDS_BIGENDIAN
     if ((th->tab_t == QFITS_BINTABLE) && (col->atom_size > 1)) {
-        r = array;
-        for (i=0; i<nb_rows * col->atom_nb; i++) {
-            qfits_swap_bytes(r, col->atom_size);
-            r += col->atom_size;
-        }
+        qfits_swap_bytes_array(array, col->atom_size,
+                               (size_t)nb_rows * col->atom_nb);
     }
 #endif
 
@@ -969,12 +966,17 @@ static int qfits_query_column_seq_to_array_endian(
 
 #ifndef WORDS_BIGENDIAN
         if (do_swap) {
-            int j;
-            unsigned char* r2 = r;
-            for (j=0; j<col->atom_nb; j++) {
-                qfits_swap_bytes(r2, col->atom_size);
-                r2 += col->atom_size;
-            }
+            if (dest_stride == field_size) {
+                // packed: swap runs of rows at once, while they're
+                // still in cache.
+                if ((i+1) % SWAP_BLOCK_ROWS == 0 || i == nb_rows-1) {
+                    int nrun = i % SWAP_BLOCK_ROWS + 1;
+                    qfits_swap_bytes_array(r - (size_t)(nrun-1) * field_size,
+                                           col->atom_size,
+                                           (size_t)nrun * col->atom_nb);
+                }
+            } else
+                qfits_swap_bytes_array(r, col->atom_size, col->atom_nb);
         }
 #endif
 
@@ -2503,11 +2505,8 @@ static int qfits_table_append_data(
             /* Byte swapping needed if on a little-endian machine */
 #ifndef WORDS_BIGENDIAN
             if (curr_col->atom_size > 1) {
-                r = array[i];
-                for (j=0; j<t->nr * curr_col->atom_nb; j++) {
-                    qfits_swap_bytes(r, curr_col->atom_size);
-                    r += curr_col->atom_size;
-                }
+                qfits_swap_bytes_array(array[i], curr_col->atom_size,
+                                       (size_t)t->nr * curr_col->atom_nb);
             }
 #endif
         } else return -1;
@@ -0,0 +1,653 @@
+/*
+ This file was added by the Astrometry.net team.
+
+ Licensed under GPL v2 or later.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "qfits_tilecomp.h"
+#include "qfits_error.h"
+#include "qfits_memory.h"
+#include "qfits_tools.h"
+#include "qfits_convert.h"
+#include "qfits_std.h"
+
+// the dither sequence of the quantization convention.
+#define N_RANDOM 10000
+// quantized values standing for NaN and (SUBTRACTIVE_DITHER_2) zero.
+#define NULL_VALUE -2147483647
+#define ZERO_VALUE -2147483646
+
+#define MAX_TILE_THREADS 8
+
+enum {
+    NO_DITHER,
+    SUBTRACTIVE_DITHER_1,
+    SUBTRACTIVE_DITHER_2,
+};
+
+// A column of the compressed table.
+struct tcol {
+    int present;
+    // offset in the row, in bytes.
+    int offset;
+    // for a variable-length array, 'P' or 'Q'; otherwise the type.
+    char type;
+};
+
+struct tilecomp {
+    const char* filename;
+    int bitpix;
+    int bytepix;
+    int blocksize;
+    // image and tile sizes
+    int nx, ny;
+    int tx, ty;
+    int ntx, nty;
+    // the table: rows are tiles.
+    int rowwidth;
+    int nrows;
+    const unsigned char* data;
+    size_t datasize;
+    off_t heap;
+    struct tcol cdata;
+    struct tcol udata;
+    struct tcol gdata;
+    struct tcol zscale;
+    struct tcol zzero;
+    struct tcol zblank;
+    // keyword versions of the per-tile values
+    double zscale_key;
+    double zzero_key;
+    int zblank_key;
+    int have_zblank_key;
+    int quantize;
+    int dither0;
+    double bzero;
+    double bscale;
+
+    // what we're reading
+    int x0, x1, y0, y1;
+    int plane;
+    tfits_type outtype;
+    int outbpp;
+    char* output;
+    int* tiles;
+    int ntiles;
+    int next;
+    int failed;
+};
+
+static float rand_value[N_RANDOM];
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT;
+
+// The pseudo-random sequence that quantized images were dithered with.
+static void init_randoms(void) {
+    double a = 16807.0;
+    double m = 2147483647.0;
+    double seed = 1.0;
+    double temp;
+    int i;
+    for (i=0; i<N_RANDOM; i++) {
+        temp = a * seed;
+        seed = temp - m * ((int)(temp / m));
+        rand_value[i] = (float)(seed / m);
+    }
+}
+
+static int nonzero_count(uint32_t b) {
+#if defined(__GNUC__)
+    return b ? 32 - __builtin_clz(b) : 0;
+#else
+    int n = 0;
+    while (b) {
+        n++;
+        b >>= 1;
+    }
+    return n;
+#endif
+}
+
+int qfits_rice_decompress(const unsigned char* c, size_t nin,
+                          int bytepix, int blocksize,
+                          int32_t* out, int n) {
+    const unsigned char* cend = c + nin;
+    int fsbits, fsmax, bbits;
+    uint32_t b, diff, lastpix;
+    int nbits, fs, i, imax, k, nzero;
+
+    switch (bytepix) {
+    case 1:
+        fsbits = 3;
+        fsmax = 6;
+        break;
+    case 2:
+        fsbits = 4;
+        fsmax = 14;
+        break;
+    case 4:
+        fsbits = 5;
+        fsmax = 25;
+        break;
+    default:
+        qfits_error("Rice decompression: unsupported BYTEPIX %i", bytepix);
+        return -1;
+    }
+    bbits = 1 << fsbits;
+    if (blocksize <= 0) {
+        qfits_error("Rice decompression: bad BLOCKSIZE %i", blocksize);
+        return -1;
+    }
+    if (nin < (size_t)bytepix + 1) {
+        qfits_error("Rice decompression: tile too short");
+        return -1;
+    }
+
+#define NEXT_BYTE(dest)                                 \
+    do {                                                \
+        if (c >= cend)                                  \
+            goto overrun;                               \
+        dest = *c++;                                    \
+    } while (0)
+
+    // the first value is stored as it is...
+    lastpix = 0;
+    for (k=0; k<bytepix; k++)
+        lastpix = (lastpix << 8) | *c++;
+    b = *c++;
+    nbits = 8;
+
+    // ... and the rest as differences, a block at a time.
+    for (i=0; i<n; ) {
+        uint32_t byte;
+        nbits -= fsbits;
+        while (nbits < 0) {
+            NEXT_BYTE(byte);
+            b = (b << 8) | byte;
+            nbits += 8;
+        }
+        fs = (int)(b >> nbits) - 1;
+        b &= (1u << nbits) - 1;
+        imax = i + blocksize;
+        if (imax > n)
+            imax = n;
+
+        if (fs < 0) {
+            // all differences are zero.
+            for (; i<imax; i++)
+                out[i] = lastpix;
+        } else if (fs == fsmax) {
+            // the differences are stored as they are.
+            for (; i<imax; i++) {
+                k = bbits - nbits;
+                diff = (k < 32) ? (b << k) : 0;
+                for (k -= 8; k >= 0; k -= 8) {
+                    NEXT_BYTE(b);
+                    diff |= b << k;
+                }
+                if (nbits > 0) {
+                    NEXT_BYTE(b);
+                    diff |= b >> (-k);
+                    b &= (1u << nbits) - 1;
+                } else
+                    b = 0;
+                diff = (diff & 1) ? ~(diff >> 1) : (diff >> 1);
+                lastpix += diff;
+                out[i] = lastpix;
+            }
+        } else {
+            // Rice codes: a unary high part and "fs" low bits.
+            for (; i<imax; i++) {
+                while (b == 0) {
+                    nbits += 8;
+                    NEXT_BYTE(b);
+                }
+                nzero = nbits - nonzero_count(b);
+                nbits -= nzero + 1;
+                b ^= 1u << nbits;
+                nbits -= fs;
+                while (nbits < 0) {
+                    NEXT_BYTE(byte);
+                    b = (b << 8) | byte;
+                    nbits += 8;
+                }
+                diff = ((uint32_t)nzero << fs) | (b >> nbits);
+                b &= (1u << nbits) - 1;
+                diff = (diff & 1) ? ~(diff >> 1) : (diff >> 1);
+                lastpix += diff;
+                out[i] = lastpix;
+            }
+        }
+    }
+#undef NEXT_BYTE
+
+    // the values wrap around at "bytepix" bytes.
+    if (bytepix == 1)
+        for (i=0; i<n; i++)
+            out[i] = (uint8_t)out[i];
+    else if (bytepix == 2)
+        for (i=0; i<n; i++)
+            out[i] = (int16_t)out[i];
+    return 0;
+
+ overrun:
+    qfits_error("Rice decompression: ran out of data");
+    return -1;
+}
+
+int qfits_is_tile_compressed(const qfits_header* hdr) {
+    return qfits_header_getboolean(hdr, "ZIMAGE", 0);
+}
+
+static uint32_t get_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char* p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+// Reads a big-endian value of FITS type "type".
+static double get_value(const unsigned char* p, char type) {
+    uint64_t u;
+    uint32_t v;
+    float f;
+    double d;
+    switch (type) {
+    case 'B':
+        return p[0];
+    case 'I':
+        return (int16_t)((p[0] << 8) | p[1]);
+    case 'J':
+        return (int32_t)get_be32(p);
+    case 'K':
+        return (double)(int64_t)get_be64(p);
+    case 'E':
+        v = get_be32(p);
+        memcpy(&f, &v, 4);
+        return f;
+    case 'D':
+        u = get_be64(p);
+        memcpy(&d, &u, 8);
+        return d;
+    }
+    return 0.0;
+}
+
+static int type_size(char type) {
+    switch (type) {
+    case 'L': case 'X': case 'B': case 'A':
+        return 1;
+    case 'I':
+        return 2;
+    case 'J': case 'E':
+        return 4;
+    case 'K': case 'D': case 'C': case 'P':
+        return 8;
+    case 'M': case 'Q':
+        return 16;
+    }
+    return -1;
+}
+
+static int get_string(const qfits_header* hdr, const char* key, char* val) {
+    char* str = qfits_header_getstr(hdr, key);
+    if (!str)
+        return -1;
+    qfits_pretty_string_r(str, val);
+    return 0;
+}
+
+// Finds the columns of the table from TTYPEn and TFORMn.
+static int find_columns(struct tilecomp* tc, const qfits_header* hdr) {
+    int ncols = qfits_header_getint(hdr, "TFIELDS", 0);
+    int offset = 0;
+    int i;
+    for (i=1; i<=ncols; i++) {
+        char key[16];
+        char name[FITS_LINESZ+1];
+        char form[FITS_LINESZ+1];
+        char* f;
+        int repeat = 1;
+        int size;
+        struct tcol* col = NULL;
+
+        sprintf(key, "TFORM%i", i);
+        if (get_string(hdr, key, form)) {
+            qfits_error("Missing %s in tile-compressed image %s", key,
+                        tc->filename);
+            return -1;
+        }
+        f = form;
+        if (*f >= '0' && *f <= '9')
+            repeat = (int)strtol(f, &f, 10);
+        size = type_size(*f);
+        if (size == -1) {
+            qfits_error("Unknown %s = '%s' in tile-compressed image %s",
+                        key, form, tc->filename);
+            return -1;
+        }
+
+        sprintf(key, "TTYPE%i", i);
+        if (!get_string(hdr, key, name)) {
+            if (!strcmp(name, "COMPRESSED_DATA"))
+                col = &tc->cdata;
+            else if (!strcmp(name, "UNCOMPRESSED_DATA"))
+                col = &tc->udata;
+            else if (!strcmp(name, "GZIP_COMPRESSED_DATA"))
+                col = &tc->gdata;
+            else if (!strcmp(name, "ZSCALE"))
+                col = &tc->zscale;
+            else if (!strcmp(name, "ZZERO"))
+                col = &tc->zzero;
+            else if (!strcmp(name, "ZBLANK"))
+                col = &tc->zblank;
+        }
+        if (col) {
+            col->present = 1;
+            col->offset = offset;
+            col->type = *f;
+        }
+        offset += repeat * size;
+    }
+    if (offset != tc->rowwidth) {
+        qfits_error("Columns of tile-compressed image %s add up to %i bytes, "
+                    "but NAXIS1 = %i", tc->filename, offset, tc->rowwidth);
+        return -1;
+    }
+    if (!tc->cdata.present || (tc->cdata.type != 'P' && tc->cdata.type != 'Q')) {
+        qfits_error("No COMPRESSED_DATA array column in tile-compressed image %s",
+                    tc->filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Finds the heap data of the variable-length array "col" in row "row".
+static const unsigned char* get_array(const struct tcol* col,
+                                      const struct tilecomp* tc, int row,
+                                      size_t* pn) {
+    const unsigned char* p = tc->data + (size_t)row * tc->rowwidth + col->offset;
+    uint64_t n, offset;
+    if (col->type == 'P') {
+        n = get_be32(p);
+        offset = get_be32(p + 4);
+    } else {
+        n = get_be64(p);
+        offset = get_be64(p + 8);
+    }
+    if ((uint64_t)tc->heap + offset + n > tc->datasize) {
+        qfits_error("Tile %i of %s extends beyond the data", row+1,
+                    tc->filename);
+        return NULL;
+    }
+    *pn = n;
+    return tc->data + tc->heap + offset;
+}
+
+static double get_tile_value(const struct tcol* col, double keyval,
+                             const struct tilecomp* tc, int row) {
+    if (!col->present)
+        return keyval;
+    return get_value(tc->data + (size_t)row * tc->rowwidth + col->offset,
+                     col->type);
+}
+
+// Decompresses tile "t" into "ivals" and "vals", and copies the part in
+// the window to the output.
+static int read_tile(struct tilecomp* tc, int t, int32_t* ivals,
+                     double* vals) {
+    int tx = t % tc->ntx;
+    int ty = (t / tc->ntx) % tc->nty;
+    int xlo = tx * tc->tx;
+    int ylo = ty * tc->ty;
+    int w = MIN(tc->tx, tc->nx - xlo);
+    int h = MIN(tc->ty, tc->ny - ylo);
+    int npix = w * h;
+    const unsigned char* in;
+    size_t nin = 0;
+    int i, y;
+    int xs, xe;
+
+    in = get_array(&tc->cdata, tc, t, &nin);
+    if (!in)
+        return -1;
+    if (nin) {
+        if (qfits_rice_decompress(in, nin, tc->bytepix, tc->blocksize,
+                                  ivals, npix))
+            return -1;
+    } else if (tc->udata.present) {
+        // a tile that couldn't be compressed, stored as it is.
+        char type;
+        int size;
+        switch (tc->bitpix) {
+        case 8: type = 'B'; break;
+        case 16: type = 'I'; break;
+        case 32: type = 'J'; break;
+        case -32: type = 'E'; break;
+        default: type = 'D'; break;
+        }
+        size = type_size(type);
+        in = get_array(&tc->udata, tc, t, &nin);
+        if (!in)
+            return -1;
+        if (nin < (size_t)npix) {
+            qfits_error("Tile %i of %s is too short", t+1, tc->filename);
+            return -1;
+        }
+        for (i=0; i<npix; i++)
+            vals[i] = get_value(in + (size_t)i * size, type);
+        goto copy;
+    } else {
+        qfits_error("Tile %i of %s is not Rice-compressed%s", t+1, tc->filename,
+                    tc->gdata.present ? " (it's gzipped)" : "");
+        return -1;
+    }
+
+    if (tc->bitpix > 0) {
+        for (i=0; i<npix; i++)
+            vals[i] = tc->bzero + tc->bscale * ivals[i];
+    } else {
+        double scale = get_tile_value(&tc->zscale, tc->zscale_key, tc, t);
+        double zero = get_tile_value(&tc->zzero, tc->zzero_key, tc, t);
+        int have_blank = tc->zblank.present || tc->have_zblank_key;
+        int blank = (int)get_tile_value(&tc->zblank, tc->zblank_key, tc, t);
+        int iseed = 0, nextrand = 0;
+        if (tc->quantize != NO_DITHER) {
+            iseed = (int)((t + tc->dither0 - 1) % N_RANDOM);
+            nextrand = (int)(rand_value[iseed] * 500.0);
+        }
+        for (i=0; i<npix; i++) {
+            if (have_blank && ivals[i] == blank)
+                vals[i] = NAN;
+            else if (tc->quantize == NO_DITHER)
+                vals[i] = ivals[i] * scale + zero;
+            else if (tc->quantize == SUBTRACTIVE_DITHER_2 &&
+                     ivals[i] == ZERO_VALUE)
+                vals[i] = 0.0;
+            else
+                vals[i] = ((double)ivals[i] - rand_value[nextrand] + 0.5)
+                    * scale + zero;
+            if (tc->quantize != NO_DITHER) {
+                nextrand++;
+                if (nextrand == N_RANDOM) {
+                    iseed++;
+                    if (iseed == N_RANDOM)
+                        iseed = 0;
+                    nextrand = (int)(rand_value[iseed] * 500.0);
+                }
+            }
+        }
+    }
+
+ copy:
+    xs = MAX(xlo, tc->x0);
+    xe = MIN(xlo + w, tc->x1);
+    for (y=MAX(ylo, tc->y0); y<MIN(ylo + h, tc->y1); y++) {
+        char* outrow = tc->output + ((size_t)(y - tc->y0) * (tc->x1 - tc->x0)
+                                     + (xs - tc->x0)) * tc->outbpp;
+        fits_convert_data(outrow, 0, tc->outtype,
+                          vals + (size_t)(y - ylo) * w + (xs - xlo), 0,
+                          TFITS_BIN_TYPE_D, xe - xs, 1);
+    }
+    return 0;
+}
+
+static void* tile_thread(void* arg) {
+    struct tilecomp* tc = arg;
+    int32_t* ivals = malloc((size_t)tc->tx * tc->ty * sizeof(int32_t));
+    double* vals = malloc((size_t)tc->tx * tc->ty * sizeof(double));
+    for (;;) {
+        int i = __atomic_fetch_add(&tc->next, 1, __ATOMIC_RELAXED);
+        if (i >= tc->ntiles || __atomic_load_n(&tc->failed, __ATOMIC_RELAXED))
+            break;
+        if (read_tile(tc, tc->tiles[i], ivals, vals)) {
+            __atomic_store_n(&tc->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    free(ivals);
+    free(vals);
+    return NULL;
+}
+
+static int get_param(const qfits_header* hdr, const char* name, int def) {
+    int i;
+    for (i=1; i<100; i++) {
+        char key[16];
+        char val[FITS_LINESZ+1];
+        sprintf(key, "ZNAME%i", i);
+        if (get_string(hdr, key, val))
+            break;
+        if (!strcmp(val, name)) {
+            sprintf(key, "ZVAL%i", i);
+            return qfits_header_getint(hdr, key, def);
+        }
+    }
+    return def;
+}
+
+int anqfits_readpix_tilecomp(const anqfits_t* qf, int ext,
+                             const anqfits_image_t* img,
+                             int x0, int x1, int y0, int y1, int plane,
+                             int ptype, void* output) {
+    const qfits_header* hdr = anqfits_get_header_const(qf, ext);
+    struct tilecomp tc;
+    char str[FITS_LINESZ+1];
+    off_t start, size;
+    char* freeaddr = NULL;
+    size_t freesize = 0;
+    pthread_t threads[MAX_TILE_THREADS];
+    int nthreads, nstarted, i;
+    int tx, ty;
+    int rtn = -1;
+
+    memset(&tc, 0, sizeof(tc));
+    tc.filename = qf->filename;
+    if (!hdr)
+        return -1;
+
+    if (get_string(hdr, "ZCMPTYPE", str) || strcmp(str, "RICE_1")) {
+        qfits_error("Tile-compressed image %s ext %i: compression type '%s' "
+                    "is not supported (only RICE_1 is)", qf->filename, ext,
+                    get_string(hdr, "ZCMPTYPE", str) ? "" : str);
+        return -1;
+    }
+    tc.bitpix = img->bitpix;
+    tc.nx = img->width;
+    tc.ny = img->height;
+    tc.tx = qfits_header_getint(hdr, "ZTILE1", tc.nx);
+    tc.ty = qfits_header_getint(hdr, "ZTILE2", 1);
+    if (img->naxis < 2)
+        tc.ty = 1;
+    if (img->naxis == 3 && qfits_header_getint(hdr, "ZTILE3", 1) != 1) {
+        qfits_error("Tile-compressed image %s ext %i: tiles more than one "
+                    "plane deep are not supported", qf->filename, ext);
+        return -1;
+    }
+    if (tc.tx <= 0 || tc.ty <= 0) {
+        qfits_error("Tile-compressed image %s ext %i: bad tile size %i x %i",
+                    qf->filename, ext, tc.tx, tc.ty);
+        return -1;
+    }
+    tc.ntx = (tc.nx + tc.tx - 1) / tc.tx;
+    tc.nty = (tc.ny + tc.ty - 1) / tc.ty;
+    tc.blocksize = get_param(hdr, "BLOCKSIZE", 32);
+    tc.bytepix = get_param(hdr, "BYTEPIX", 4);
+    tc.rowwidth = qfits_header_getint(hdr, "NAXIS1", 0);
+    tc.nrows = qfits_header_getint(hdr, "NAXIS2", 0);
+    tc.heap = qfits_header_getint(hdr, "THEAP", tc.rowwidth * tc.nrows);
+    tc.bzero = img->bzero;
+    tc.bscale = img->bscale;
+    tc.zscale_key = qfits_header_getdouble(hdr, "ZSCALE", 1.0);
+    tc.zzero_key = qfits_header_getdouble(hdr, "ZZERO", 0.0);
+    tc.have_zblank_key = (qfits_header_getstr(hdr, "ZBLANK") != NULL);
+    tc.zblank_key = qfits_header_getint(hdr, "ZBLANK", 0);
+    tc.quantize = NO_DITHER;
+    if (!get_string(hdr, "ZQUANTIZ", str)) {
+        if (!strcmp(str, "SUBTRACTIVE_DITHER_1"))
+            tc.quantize = SUBTRACTIVE_DITHER_1;
+        else if (!strcmp(str, "SUBTRACTIVE_DITHER_2"))
+            tc.quantize = SUBTRACTIVE_DITHER_2;
+    }
+    tc.dither0 = qfits_header_getint(hdr, "ZDITHER0", 1);
+    if (find_columns(&tc, hdr))
+        return -1;
+    if (tc.nrows < tc.ntx * tc.nty * (int)img->planes) {
+        qfits_error("Tile-compressed image %s ext %i has %i tiles; expected %i",
+                    qf->filename, ext, tc.nrows,
+                    tc.ntx * tc.nty * (int)img->planes);
+        return -1;
+    }
+    if (tc.bitpix < 0)
+        pthread_once(&rand_once, init_randoms);
+
+    if (anqfits_get_data_start_and_size(qf, ext, &start, &size))
+        return -1;
+    tc.data = qfits_falloc2(qf->filename, start, size, &freeaddr, &freesize);
+    if (!tc.data) {
+        qfits_error("Failed to map tile-compressed image %s ext %i",
+                    qf->filename, ext);
+        return -1;
+    }
+    tc.datasize = size;
+
+    tc.x0 = x0;
+    tc.x1 = x1;
+    tc.y0 = y0;
+    tc.y1 = y1;
+    tc.plane = plane;
+    tc.outtype = anqfits_ptype_to_ttype(ptype);
+    tc.outbpp = qfits_pixel_ctype_size(ptype);
+    tc.output = output;
+
+    // the tiles that overlap the window.
+    tc.tiles = malloc(sizeof(int) * tc.ntx * tc.nty);
+    for (ty=y0 / tc.ty; ty<=(y1-1) / tc.ty; ty++)
+        for (tx=x0 / tc.tx; tx<=(x1-1) / tc.tx; tx++)
+            tc.tiles[tc.ntiles++] = (plane * tc.nty + ty) * tc.ntx + tx;
+
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, MIN(tc.ntiles, MAX_TILE_THREADS)));
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, tile_thread, &tc))
+            break;
+    // (whoever runs picks up the tiles of threads that failed to start.)
+    tile_thread(&tc);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    if (!tc.failed)
+        rtn = 0;
+
+    free(tc.tiles);
+    qfits_fdealloc2(freeaddr, freesize);
+    return rtn;
+}
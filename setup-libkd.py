@@ -17,6 +17,9 @@ libkd_srcs = [
     'kdint_duu.c',
     'kdint_dds.c',
     'kdint_dss.c',
+    'kdint_ddd_2.c', 'kdint_ddd_3.c', 'kdint_ddd_4.c', 'kdint_ddd_6.c',
+    'kdint_duu_3.c',
+    'kdint_dss_2.c', 'kdint_dss_4.c', 'kdint_dss_6.c',
     ]
 util_srcs = [
     'ioutils.c', 'bl.c', 'mathutil.c', 'fitsioutils.c', 'fitsbin.c',
@@ -27,6 +30,7 @@ qfits_srcs = [
     'anqfits.c', 'qfits_tools.c', 'qfits_table.c', 'qfits_float.c',
     'qfits_error.c', 'qfits_time.c', 'qfits_card.c', 'qfits_header.c',
     'qfits_rw.c', 'qfits_memory.c', 'qfits_convert.c', 'qfits_byteswap.c',
+    'qfits_tilecomp.c',
     ]
 
 srcs = ([os.path.join('libkd',x) for x in libkd_srcs] +
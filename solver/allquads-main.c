@@ -39,7 +39,7 @@
 
 //#include "build-index.h"
 
-const char* OPTIONS = "hi:o:u:l:d:I:v";
+const char* OPTIONS = "hi:o:u:l:d:I:w:v";
 
 static void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -49,7 +49,8 @@ static void print_help(char* progname) {
            "     [-u <scale>]    upper bound of quad scale (arcmin)\n"
            "     [-l <scale>]    lower bound of quad scale (arcmin)\n"
            "     [-d <dimquads>] number of stars in a \"quad\".\n"
-           "     [-I <unique-id>] set the unique ID of this index\n\n"
+           "     [-I <unique-id>] set the unique ID of this index\n"
+           "     [-w <threads>]: build quads on this many threads (-1: one per CPU)\n\n"
            "\nReads skdt, writes {code, quad}.\n\n"
            , progname);
 }
@@ -91,6 +92,9 @@ int main(int argc, char** argv) {
         case 'I':
             aq->id = atoi(optarg);
             break;
+        case 'w':
+            aq->nthreads = atoi(optarg);
+            break;
         case 'h':
             print_help(argv[0]);
             exit(0);
@@ -150,7 +154,7 @@ int main(int argc, char** argv) {
     }
     logmsg("Got %i stars\n", fitstable_nrows(cat));
     starkd = startree_build(cat, racol, deccol, datatype, treetype,
-                            buildopts, Nleaf, argv, argc);
+                            buildopts, Nleaf, 0, argv, argc);
     if (!starkd) {
         ERROR("Failed to create star kdtree");
         exit(-1);
@@ -203,7 +207,7 @@ int main(int argc, char** argv) {
 
     ckdtfn = create_temp_file("ckdt", tempdir);
     logmsg("Creating code kdtree, reading %s, writing to %s\n", aq->codefn, ckdtfn);
-    if (codetree_files(aq->codefn, ckdtfn, 0, 0, 0, 0, argv, argc)) {
+    if (codetree_files(aq->codefn, ckdtfn, 0, 0, 0, 0, 0, argv, argc)) {
         ERROR("codetree failed");
         return -1;
     }
@@ -219,7 +223,7 @@ int main(int argc, char** argv) {
     logmsg("Unpermuting stars from %s and %s to %s and %s\n",
            aq->skdtfn, aq->quadfn, skdt2fn, quad2fn);
     if (unpermute_stars_files(aq->skdtfn, aq->quadfn, skdt2fn, quad2fn,
-                              TRUE, FALSE, argv, argc)) {
+                              TRUE, FALSE, 1, argv, argc)) {
         ERROR("Failed to unpermute-stars");
         return -1;
     }
@@ -240,7 +244,7 @@ int main(int argc, char** argv) {
     logmsg("Unpermuting quads from %s and %s to %s and %s\n",
            quad2fn, ckdtfn, quad3fn, ckdt2fn);
     if (unpermute_quads_files(quad2fn, ckdtfn,
-                              quad3fn, ckdt2fn, argv, argc)) {
+                              quad3fn, ckdt2fn, 1, argv, argc)) {
         ERROR("Failed to unpermute-quads");
         return -1;
     }
@@ -13,6 +13,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "starutil.h"
 #include "codefile.h"
@@ -39,6 +40,13 @@ void allquads_free(allquads_t* aq) {
     free(aq);
 }
 
+static void flush_quads(allquads_t* aq) {
+    if (quad_write_many(aq->codes, aq->quads, aq->batch, aq->nbatch,
+                        aq->starkd, aq->dimquads, aq->dimcodes))
+        ERROR("Failed to write quads");
+    aq->nbatch = 0;
+}
+
 static void add_quad(quadbuilder_t* qb, unsigned int* quad, void* token) {
     allquads_t* aq = token;
     if (log_get_level() > LOG_VERB) {
@@ -48,7 +56,10 @@ static void add_quad(quadbuilder_t* qb, unsigned int* quad, void* token) {
             debug("%-6i ", quad[k]);
         logverb("\n");
     }
-    quad_write_const(aq->codes, aq->quads, quad, aq->starkd, qb->dimquads, aq->dimcodes);
+    memcpy(aq->batch + aq->nbatch * qb->dimquads, quad,
+           qb->dimquads * sizeof(unsigned int));
+    if (++aq->nbatch == QUAD_CODE_BLOCK)
+        flush_quads(aq);
 }
 
 static anbool check_AB(quadbuilder_t* qb, pquad_t* pq, void* token) {
@@ -77,10 +88,207 @@ static anbool check_AB(quadbuilder_t* qb, pquad_t* pq, void* token) {
  }
  */
 
+/*
+ The multi-threaded mode: the star A's are handed out to the workers in
+ chunks of consecutive stars.  Each worker builds its chunk's quads with
+ its own quadbuilder and computes their codes; the calling thread writes
+ the finished chunks in order, so the output is the same as with one
+ thread.
+ */
+struct aq_chunk {
+    int i0, i1;
+    unsigned int* quads;
+    double* codes;
+    int nquads;
+    int capacity;
+    anbool done;
+    anbool failed;
+};
+
+struct aq_job {
+    allquads_t* aq;
+    struct aq_chunk* chunks;
+    int nchunks;
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct aq_worker {
+    allquads_t* aq;
+    int starA;
+    struct aq_chunk* chunk;
+};
+
+static void add_quad_chunk(quadbuilder_t* qb, unsigned int* quad, void* token) {
+    struct aq_worker* w = token;
+    struct aq_chunk* c = w->chunk;
+    if (c->nquads == c->capacity) {
+        c->capacity = MAX(QUAD_CODE_BLOCK, 2 * c->capacity);
+        c->quads = realloc(c->quads, (size_t)c->capacity * qb->dimquads *
+                           sizeof(unsigned int));
+    }
+    memcpy(c->quads + (size_t)c->nquads * qb->dimquads, quad,
+           qb->dimquads * sizeof(unsigned int));
+    c->nquads++;
+}
+
+static anbool check_AB_chunk(quadbuilder_t* qb, pquad_t* pq, void* token) {
+    struct aq_worker* w = token;
+    return (pq->iA == w->starA);
+}
+
+// Builds the quads of star A's [c->i0, c->i1), and their codes.
+static void build_chunk(quadbuilder_t* qb, struct aq_worker* w,
+                        struct aq_chunk* c) {
+    allquads_t* aq = w->aq;
+    int i, k;
+    w->chunk = c;
+    for (i=c->i0; i<c->i1; i++) {
+        double xyzA[3];
+        double* xyz;
+        int* inds;
+        int NR;
+        startree_get(aq->starkd, i, xyzA);
+        startree_search_for(aq->starkd, xyzA, aq->quad_d2_upper,
+                            &xyz, NULL, &inds, &NR);
+        w->starA = i;
+        qb->starxyz = xyz;
+        qb->starinds = inds;
+        qb->Nstars = NR;
+        quadbuilder_create(qb);
+        free(inds);
+        free(xyz);
+    }
+    if (!c->nquads)
+        return;
+    c->codes = malloc((size_t)c->nquads * aq->dimcodes * sizeof(double));
+    if (quad_compute_codes(c->quads, c->nquads, aq->dimquads, aq->starkd,
+                           c->codes)) {
+        c->failed = TRUE;
+        return;
+    }
+    for (k=0; k<c->nquads; k++)
+        quad_enforce_invariants(c->quads + (size_t)k * aq->dimquads,
+                                c->codes + (size_t)k * aq->dimcodes,
+                                aq->dimquads, aq->dimcodes);
+}
+
+static void* chunk_worker(void* varg) {
+    struct aq_job* job = varg;
+    allquads_t* aq = job->aq;
+    struct aq_worker w;
+    quadbuilder_t* qb = quadbuilder_init();
+
+    qb->quadd2_high = aq->quad_d2_upper;
+    qb->quadd2_low  = aq->quad_d2_lower;
+    qb->check_scale_high = aq->use_d2_upper;
+    qb->check_scale_low  = aq->use_d2_lower;
+    qb->dimquads = aq->dimquads;
+    qb->add_quad = add_quad_chunk;
+    qb->add_quad_token = &w;
+    qb->check_AB_stars = check_AB_chunk;
+    qb->check_AB_stars_token = &w;
+    w.aq = aq;
+
+    for (;;) {
+        int c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (c >= job->nchunks)
+            break;
+        build_chunk(qb, &w, job->chunks + c);
+        pthread_mutex_lock(&job->lock);
+        job->chunks[c].done = TRUE;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    quadbuilder_free(qb);
+    return NULL;
+}
+
+static int create_quads_parallel(allquads_t* aq, int nthreads) {
+    struct aq_job job;
+    pthread_t* threads;
+    int N, chunksize;
+    int i, k, nstarted = 0;
+    int lastgrass = 0;
+    int rtn = 0;
+
+    N = startree_N(aq->starkd);
+    // enough chunks to balance the load, small enough to keep the
+    // finished-but-unwritten ones from piling up.
+    chunksize = MAX(1, N / (16 * nthreads));
+    job.aq = aq;
+    job.nchunks = (N + chunksize - 1) / chunksize;
+    job.chunks = calloc(MAX(job.nchunks, 1), sizeof(struct aq_chunk));
+    for (i=0; i<job.nchunks; i++) {
+        job.chunks[i].i0 = i * chunksize;
+        job.chunks[i].i1 = MIN(N, (i+1) * chunksize);
+    }
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    logmsg("Building quads on %i threads, %i chunks of %i stars.\n",
+           nthreads, job.nchunks, chunksize);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, chunk_worker, &job)) {
+            SYSERROR("Failed to start thread");
+            break;
+        }
+        nstarted++;
+    }
+    if (!nstarted)
+        // this thread does it all.
+        chunk_worker(&job);
+
+    for (i=0; i<job.nchunks; i++) {
+        struct aq_chunk* c = job.chunks + i;
+        int grass = (int)((int64_t)c->i1 * 80 / N);
+        pthread_mutex_lock(&job.lock);
+        while (!c->done)
+            pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        if (c->failed) {
+            ERROR("Failed to compute codes for quads");
+            rtn = -1;
+        }
+        for (k=0; !rtn && k<c->nquads; k++) {
+            codefile_write_code(aq->codes, c->codes + (size_t)k * aq->dimcodes);
+            quadfile_write_quad(aq->quads, c->quads + (size_t)k * aq->dimquads);
+        }
+        logverb("Stars %i to %i of %i: wrote %i quads, total %i so far.\n",
+                c->i0 + 1, c->i1, N, c->nquads, aq->quads->numquads);
+        free(c->quads);
+        free(c->codes);
+        c->quads = NULL;
+        c->codes = NULL;
+        for (; lastgrass < grass; lastgrass++) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    free(job.chunks);
+    return rtn;
+}
+
 int allquads_create_quads(allquads_t* aq) {
     quadbuilder_t* qb;
     int i, N;
     double* xyz;
+    int nthreads = aq->nthreads;
+
+    if (nthreads < 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > 1)
+        return create_quads_parallel(aq, nthreads);
 
     qb = quadbuilder_init();
 
@@ -110,6 +318,7 @@ int allquads_create_quads(allquads_t* aq) {
         qb->Nstars = N;
 
         quadbuilder_create(qb);
+        flush_quads(aq);
 
         free(xyz);
         free(inds);
@@ -157,6 +366,7 @@ int allquads_create_quads(allquads_t* aq) {
             //qb->check_full_quad_token = aq;
 
             quadbuilder_create(qb);
+            flush_quads(aq);
 
             logverb("Star %i of %i: wrote %i quads for this star, total %i so far.\n", i+1, N, aq->quads->numquads - nq, aq->quads->numquads);
             free(inds);
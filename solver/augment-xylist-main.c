@@ -37,6 +37,7 @@
 #include "anqfits.h"
 #include "an-opts.h"
 #include "augment-xylist.h"
+#include "tic.h"
 
 static void print_help(const char* progname, bl* opts) {
     printf("\nUsage: %s [options]\n", progname);
@@ -110,6 +111,7 @@ int main(int argc, char** args) {
     }
     bl_free(opts);
 
+    profile_enable_from_env("augment-xylist");
     rtn = augment_xylist(axy, me);
 
     augment_xylist_free_contents(axy);
@@ -36,12 +36,21 @@
 #include "errors.h"
 #include "fits-guess-scale.h"
 #include "image2xy-files.h"
+#include "image2xy.h"
+#include "image-decode.h"
+#include "simplexy.h"
+#include "xylist-filter.h"
+#include "permutedsort.h"
+#include "starxy.h"
+#include "fitstable.h"
 #include "resort-xylist.h"
 #include "an-opts.h"
 #include "augment-xylist.h"
 #include "log.h"
 #include "anqfits.h"
 #include "mathutil.h"
+#include "md5.h"
+#include "tic.h"
 
 static void delete_existing_an_headers(qfits_header* hdr);
 
@@ -204,6 +213,14 @@ static an_option_t options[] = {
      "output filename for SCAMP reference catalog"},
     {'B', "corr",          required_argument, "filename",
      "output filename for correspondences"},
+    {'\x98', "stats",        required_argument, "filename",
+     "output filename for solver timing statistics (JSON)"},
+    {'\x9e', "trace",        required_argument, "filename",
+     "record each search (field, parameters, indexes, timings) to this file, "
+     "to be run again with replay-trace"},
+    {'\x9d', "checkpoint",   required_argument, "filename",
+     "save the progress of a search cut short by a time or CPU limit to this "
+     "file, and resume from it if it exists"},
     {'W', "wcs",                   required_argument, "filename",
      "output filename for WCS file"},
     {'P', "pnm",                   required_argument, "filename",
@@ -212,6 +229,12 @@ static an_option_t options[] = {
      "force the PNM file to be a PPM"},
     {'k', "keep-xylist",   required_argument, "filename",
      "save the (unaugmented) xylist to <filename>"},
+    {'\x9a', "xylist-cache", required_argument, "dir",
+     "reuse source lists of identical images (with identical source-extraction "
+     "settings) from this directory, adding new ones to it"},
+    {'\x9c', "in-memory",    no_argument, NULL,
+     "decode the image and extract and filter its sources in memory, without "
+     "temp files or helper programs (falls back to them for images it can't decode)"},
     {'A', "dont-augment",   no_argument, NULL,
      "quit after writing the unaugmented xylist"},
     {'V', "verify",         required_argument, "filename",
@@ -221,7 +244,7 @@ static an_option_t options[] = {
     {'y', "no-verify",     no_argument, NULL,
      "ignore existing WCS headers in FITS input images"},
     {'g', "guess-scale",   no_argument, NULL,
-     "try to guess the image scale from the FITS headers"},
+     "try to guess the image scale from the FITS headers, or a JPEG's EXIF tags"},
     {'>', "crpix-center",  no_argument, NULL,
      "set the WCS reference point to the image center"},
     {'/', "crpix-x",  required_argument, "pix",
@@ -387,6 +410,21 @@ int augment_xylist_parse_option(char argchar, char* optarg,
     case 'B':
         axy->corrfn = optarg;
         break;
+    case '\x98':
+        axy->statsfn = optarg;
+        break;
+    case '\x9e':
+        axy->tracefn = optarg;
+        break;
+    case '\x9d':
+        axy->checkpointfn = optarg;
+        break;
+    case '\x9a':
+        axy->xylist_cache = optarg;
+        break;
+    case '\x9c':
+        axy->in_memory = TRUE;
+        break;
     case 'y':
         axy->try_verify = FALSE;
         break;
@@ -655,8 +693,296 @@ static void add_sip_coeffs(qfits_header* hdr, const char* prefix, const sip_t* s
     }
 }
 
-int augment_xylist(augment_xylist_t* axy,
-                   const char* me) {
+/*
+ The file in the source-list cache for the FITS image "fitsimgfn": named
+ by the MD5 of the image's bytes plus every setting that changes what
+ image2xy finds in it.  Returns NULL if the image can't be read.
+ */
+static char* xylist_cache_filename(const augment_xylist_t* axy,
+                                   const char* fitsimgfn) {
+    md5_context ctx;
+    unsigned char digest[16];
+    char hex[33];
+    char* settings;
+    char* cachefn;
+    char buf[65536];
+    size_t n;
+    FILE* fid;
+    int i;
+
+    fid = fopen(fitsimgfn, "rb");
+    if (!fid) {
+        SYSERROR("Failed to open image \"%s\" to compute its MD5", fitsimgfn);
+        return NULL;
+    }
+    md5_starts(&ctx);
+    while ((n = fread(buf, 1, sizeof(buf), fid)) > 0)
+        md5_update(&ctx, (uint8*)buf, n);
+    if (ferror(fid)) {
+        SYSERROR("Failed to read image \"%s\" to compute its MD5", fitsimgfn);
+        fclose(fid);
+        return NULL;
+    }
+    fclose(fid);
+    asprintf_safe(&settings, "image2xy ext=%i downsample=%i nobgsub=%i "
+                  "sigma=%g nsigma=%g invert=%i", axy->fitsimgext,
+                  axy->downsample, (int)axy->no_bg_subtraction,
+                  axy->image_sigma, axy->image_nsigma,
+                  (int)axy->invert_image);
+    md5_update(&ctx, (uint8*)settings, strlen(settings));
+    free(settings);
+    md5_finish(&ctx, digest);
+    for (i=0; i<16; i++)
+        sprintf(hex + 2*i, "%02x", digest[i]);
+    asprintf_safe(&cachefn, "%s/%s.xyls", axy->xylist_cache, hex);
+    return cachefn;
+}
+
+static void xylist_cache_add(const char* cachedir, const char* xylsfn,
+                             const char* cachefn) {
+    char* tmpfn;
+    if (mkdir_p(cachedir)) {
+        ERROR("Failed to create source-list cache directory %s", cachedir);
+        return;
+    }
+    // copy to a temp file in the cache dir, then rename, so that
+    // concurrent runs never see a partial file.
+    tmpfn = create_temp_file("xyls", cachedir);
+    if (copy_file(xylsfn, tmpfn) || rename(tmpfn, cachefn)) {
+        ERROR("Failed to add source list to cache as %s", cachefn);
+        unlink(tmpfn);
+    }
+    free(tmpfn);
+}
+
+// Try to read a WCS header from the FITS image; if successful, add it
+// to the list of WCS headers to verify.
+static void add_image_wcs_to_verify(augment_xylist_t* axy,
+                                    const char* fitsimgfn) {
+    char* errstr;
+    sip_t sip;
+    anbool ok;
+    logverb("Looking for a WCS header in FITS input image %s ext %i\n", fitsimgfn, axy->fitsimgext);
+
+    // FIXME - Right now we just try to read SIP/TAN -
+    // obviously this should be more flexible and robust.
+    errors_start_logging_to_string();
+    memset(&sip, 0, sizeof(sip_t));
+    ok = (sip_read_header_file_ext(fitsimgfn, axy->fitsimgext, &sip) != NULL);
+    errstr = errors_stop_logging_to_string(": ");
+    if (ok) {
+        logmsg("Found an existing WCS header, will try to verify it.\n");
+        sl_append(axy->verifywcs, fitsimgfn);
+        il_append(axy->verifywcs_ext, axy->fitsimgext);
+    } else {
+        logverb("Failed to read a SIP or TAN header from FITS image.\n");
+        logverb("  (reason: %s)\n", errstr);
+    }
+    free(errstr);
+}
+
+// The source list of --in-memory: what image2xy, removelines, sorting,
+// uniformize and cutting would have left in the xyls temp files.
+struct mem_sources {
+    starxy_t* xy;
+    int W, H;
+    anbool isfits;
+};
+
+static void mem_sources_free(struct mem_sources* src) {
+    if (src->xy)
+        starxy_free(src->xy);
+    memset(src, 0, sizeof(struct mem_sources));
+}
+
+// Can --in-memory produce what the temp-file pipeline would, for these
+// settings?
+static anbool can_run_in_memory(const augment_xylist_t* axy) {
+    return (axy->in_memory && axy->imagefn &&
+            !axy->use_source_extractor && !axy->pnmfn &&
+            !axy->keep_fitsimg && !axy->xylist_cache &&
+            !axy->xcol && !axy->ycol &&
+            (!axy->sortcol || streq(axy->sortcol, "FLUX")) &&
+            (!axy->bgcol || streq(axy->bgcol, "BACKGROUND")));
+}
+
+static void filter_sources_in_memory(const augment_xylist_t* axy,
+                                     starxy_t* xy) {
+    int* perm;
+    // Without uniformizing, only the first "cutobjs" are kept, so only
+    // they need sorting.
+    int K = (axy->cutobjs && !axy->uniformize) ?
+        MIN(axy->cutobjs, xy->N) : xy->N;
+
+    if (!axy->no_removelines) {
+        int ncut = starxy_removelines(xy, REMOVELINES_DEFAULT_CUT);
+        logverb("Removed %i sources in lines of (spurious) sources\n", ncut);
+    }
+
+    if (axy->resort) {
+        logverb("Sorting using columns flux (FLUX) and background (BACKGROUND), %sscending\n",
+                axy->sort_ascending ? "a" : "de");
+        perm = resort_flux_background_topk(xy->flux, xy->background, xy->N,
+                                           axy->sort_ascending, K);
+    } else {
+        logverb("Sorting by brightness: column=FLUX.\n");
+        perm = permuted_sort_topk(xy->flux, sizeof(double),
+                                  axy->sort_ascending ? compare_doubles_asc :
+                                  compare_doubles_desc, K, xy->N);
+    }
+    {
+        void* arrays[] = { xy->x, xy->y, xy->flux, xy->background };
+        int sizes[] = { sizeof(double), sizeof(double), sizeof(double), sizeof(double) };
+        permutation_apply_multi(perm, K, arrays, sizes, 4);
+    }
+    free(perm);
+    xy->N = K;
+
+    if (axy->uniformize)
+        starxy_uniformize(xy, axy->uniformize);
+
+    if (axy->cutobjs && xy->N > axy->cutobjs)
+        xy->N = axy->cutobjs;
+}
+
+/*
+ Decodes the image, runs image2xy on it and filters the sources, all in
+ memory.  Returns -1 if the image can't be decoded here.
+ */
+static int extract_sources_in_memory(augment_xylist_t* axy,
+                                     struct mem_sources* src) {
+    decoded_image_t img;
+    simplexy_t sxy;
+    int i;
+
+    memset(src, 0, sizeof(struct mem_sources));
+    PROFILE_BEGIN("image-convert");
+    if (image_decode(axy->imagefn, axy->extension, &img)) {
+        PROFILE_END("image-convert");
+        logverb("Couldn't decode image %s in memory; using the external converters\n",
+                axy->imagefn);
+        return -1;
+    }
+    PROFILE_END("image-convert");
+    logverb("Decoded %s image %s in memory: %i x %i pixels\n",
+            img.isfits ? "FITS" : "PNG/JPEG", axy->imagefn, img.W, img.H);
+
+    logmsg("Extracting sources...\n");
+    PROFILE_BEGIN("source-extraction");
+    memset(&sxy, 0, sizeof(simplexy_t));
+    // The other params get set to defaults for float or u8 images.
+    sxy.nobgsub = axy->no_bg_subtraction;
+    sxy.sigma = axy->image_sigma;
+    sxy.invert = axy->invert_image;
+    sxy.plim = axy->image_nsigma;
+    sxy.nx = img.W;
+    sxy.ny = img.H;
+    if (img.image_u8 && axy->downsample) {
+        // image2xy_files only uses the u8 settings without downsampling.
+        size_t j, N = (size_t)img.W * (size_t)img.H;
+        img.image = malloc(N * sizeof(float));
+        if (!img.image) {
+            SYSERROR("Failed to allocate image array");
+            image_decode_free_contents(&img);
+            return -1;
+        }
+        for (j=0; j<N; j++)
+            img.image[j] = img.image_u8[j];
+        free(img.image_u8);
+        img.image_u8 = NULL;
+    }
+    if (img.image_u8) {
+        simplexy_fill_in_defaults_u8(&sxy);
+        sxy.image_u8 = img.image_u8;
+    } else {
+        simplexy_fill_in_defaults(&sxy);
+        sxy.image = img.image;
+    }
+    // image2xy_run() frees or keeps these as it needs.
+    img.image = NULL;
+    img.image_u8 = NULL;
+
+    // MAGIC 3: downsample by a factor of 2, up to 3 times.
+    if (image2xy_run(&sxy, axy->downsample, 3)) {
+        ERROR("Source extraction failed");
+        simplexy_free_contents(&sxy);
+        exit(-1);
+    }
+    src->xy = starxy_new(sxy.npeaks, TRUE, TRUE);
+    for (i=0; i<sxy.npeaks; i++) {
+        src->xy->x[i] = sxy.x[i];
+        src->xy->y[i] = sxy.y[i];
+        src->xy->flux[i] = sxy.flux[i];
+        src->xy->background[i] = sxy.background[i];
+    }
+    simplexy_free_contents(&sxy);
+    simplexy_clean_cache();
+    PROFILE_END("source-extraction");
+
+    src->W = img.W;
+    src->H = img.H;
+    src->isfits = img.isfits;
+
+    PROFILE_BEGIN("filter-xylist");
+    filter_sources_in_memory(axy, src->xy);
+    PROFILE_END("filter-xylist");
+    return 0;
+}
+
+// Writes the sources as a table in the format image2xy writes.
+static int write_sources_table(fitstable_t* tab,
+                               const struct mem_sources* src) {
+    const starxy_t* xy = src->xy;
+    qfits_header* hdr;
+    int i;
+
+    fitstable_add_write_column_convert(tab, TFITS_BIN_TYPE_E,
+                                       TFITS_BIN_TYPE_D, "X", "pix");
+    fitstable_add_write_column_convert(tab, TFITS_BIN_TYPE_E,
+                                       TFITS_BIN_TYPE_D, "Y", "pix");
+    fitstable_add_write_column_convert(tab, TFITS_BIN_TYPE_E,
+                                       TFITS_BIN_TYPE_D, "FLUX", "unknown");
+    fitstable_add_write_column_convert(tab, TFITS_BIN_TYPE_E,
+                                       TFITS_BIN_TYPE_D, "BACKGROUND",
+                                       "unknown");
+    hdr = fitstable_get_header(tab);
+    qfits_header_add(hdr, "EXTNAME", "SOURCES", NULL, NULL);
+    fits_header_add_int(hdr, "IMAGEW", src->W, "Input image width");
+    fits_header_add_int(hdr, "IMAGEH", src->H, "Input image height");
+    if (fitstable_write_header(tab)) {
+        ERROR("Failed to write source table header");
+        return -1;
+    }
+    for (i=0; i<xy->N; i++) {
+        if (fitstable_write_row(tab, xy->x + i, xy->y + i,
+                                xy->flux + i, xy->background + i)) {
+            ERROR("Failed to write source table row %i", i);
+            return -1;
+        }
+    }
+    if (fitstable_fix_header(tab)) {
+        ERROR("Failed to fix source table header");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_sources_file(const char* fn, const struct mem_sources* src) {
+    fitstable_t* tab = fitstable_open_for_writing(fn);
+    if (!tab) {
+        ERROR("Failed to open %s for writing", fn);
+        return -1;
+    }
+    if (fitstable_write_primary_header(tab) ||
+        write_sources_table(tab, src) ||
+        fitstable_close(tab)) {
+        ERROR("Failed to write source list %s", fn);
+        return -1;
+    }
+    return 0;
+}
+
+static int run_augment_xylist(augment_xylist_t* axy, const char* me) {
     // tempfiles to delete when we finish
     sl* tempfiles;
     sl* cmd;
@@ -674,6 +1000,8 @@ int augment_xylist(augment_xylist_t* axy,
     char* sortedxylsfn = NULL;
     char* unixylsfn = NULL;
     char* cutxylsfn = NULL;
+    struct mem_sources memsrc;
+    anbool in_memory = FALSE;
     // as we process the image (uncompress it, eg), keep track of extension
     // (along with axy->fitsimgfn if keep_fitsimg is set)
     axy->fitsimgext = axy->extension;
@@ -682,7 +1010,22 @@ int augment_xylist(augment_xylist_t* axy,
     tempfiles = sl_new(4);
     scales = dl_new(4);
 
-    if (axy->imagefn) {
+    if (can_run_in_memory(axy) &&
+        extract_sources_in_memory(axy, &memsrc) == 0) {
+        in_memory = TRUE;
+        xylsfn = NULL;
+        axy->W = memsrc.W;
+        axy->H = memsrc.H;
+        if (memsrc.isfits) {
+            axy->isfits = TRUE;
+            fitsimgfn = axy->imagefn;
+            if (axy->try_verify)
+                add_image_wcs_to_verify(axy, fitsimgfn);
+        }
+        if (axy->keepxylsfn && write_sources_file(axy->keepxylsfn, &memsrc))
+            return -1;
+
+    } else if (axy->imagefn) {
         // if --image is given:
         //       -run image2pnm
         //       -if it's a FITS image, keep the original
@@ -697,6 +1040,7 @@ int augment_xylist(augment_xylist_t* axy,
         char typestr[256];
         anbool want_pnm = TRUE;
 
+        PROFILE_BEGIN("image-convert");
         uncompressedfn = create_temp_file("uncompressed", axy->tempdir);
         sl_append_nocopy(tempfiles, uncompressedfn);
 
@@ -789,30 +1133,8 @@ int augment_xylist(augment_xylist_t* axy,
             else
                 fitsimgfn = axy->imagefn;
 
-            if (axy->try_verify) {
-                char* errstr;
-                sip_t sip;
-                anbool ok;
-                // Try to read WCS header from FITS image; if successful,
-                // add it to the list of WCS headers to verify.
-                logverb("Looking for a WCS header in FITS input image %s ext %i\n", fitsimgfn, axy->fitsimgext);
-
-                // FIXME - Right now we just try to read SIP/TAN -
-                // obviously this should be more flexible and robust.
-                errors_start_logging_to_string();
-                memset(&sip, 0, sizeof(sip_t));
-                ok = (sip_read_header_file_ext(fitsimgfn, axy->fitsimgext, &sip) != NULL);
-                errstr = errors_stop_logging_to_string(": ");
-                if (ok) {
-                    logmsg("Found an existing WCS header, will try to verify it.\n");
-                    sl_append(axy->verifywcs, fitsimgfn);
-                    il_append(axy->verifywcs_ext, axy->fitsimgext);
-                } else {
-                    logverb("Failed to read a SIP or TAN header from FITS image.\n");
-                    logverb("  (reason: %s)\n", errstr);
-                }
-                free(errstr);
-            }
+            if (axy->try_verify)
+                add_image_wcs_to_verify(axy, fitsimgfn);
 
         } else {
             fitsimgfn = create_temp_file("fits", axy->tempdir);
@@ -855,6 +1177,7 @@ int augment_xylist(augment_xylist_t* axy,
             }
 
         }
+        PROFILE_END("image-convert");
 
         if (axy->keep_fitsimg) {
             axy->fitsimgfn = strdup(fitsimgfn);
@@ -862,6 +1185,7 @@ int augment_xylist(augment_xylist_t* axy,
         }
 
         logmsg("Extracting sources...\n");
+        PROFILE_BEGIN("source-extraction");
         xylsfn = create_temp_file("xyls", axy->tempdir);
         sl_append_nocopy(tempfiles, xylsfn);
 
@@ -921,28 +1245,41 @@ int augment_xylist(augment_xylist_t* axy,
 
         } else {
             simplexy_t sxyparams;
-            logverb("Running image2xy: input=%s, output=%s, ext=%i\n", fitsimgfn, xylsfn, axy->fitsimgext);
+            char* cachefn = NULL;
 
-            // we have to delete the temp file because otherwise image2xy is too timid to overwrite it.
-            if (unlink(xylsfn)) {
-                SYSERROR("Failed to delete temp file %s", xylsfn);
-                exit(-1);
-            }
+            if (axy->xylist_cache)
+                cachefn = xylist_cache_filename(axy, fitsimgfn);
+            if (cachefn && file_readable(cachefn) &&
+                copy_file(cachefn, xylsfn) == 0) {
+                logverb("Reusing cached source list %s\n", cachefn);
+            } else {
+                logverb("Running image2xy: input=%s, output=%s, ext=%i\n", fitsimgfn, xylsfn, axy->fitsimgext);
 
-            memset(&sxyparams, 0, sizeof(simplexy_t));
-            // The other params get set to defaults for float or u8 images.
-            sxyparams.nobgsub = axy->no_bg_subtraction;
-            sxyparams.sigma = axy->image_sigma;
-            sxyparams.invert = axy->invert_image;
-            sxyparams.plim = axy->image_nsigma;
-
-            // MAGIC 3: downsample by a factor of 2, up to 3 times.
-            if (image2xy_files(fitsimgfn, xylsfn, TRUE, axy->downsample, 3,
-                               axy->fitsimgext, 0, &sxyparams)) {
-                ERROR("Source extraction failed");
-                exit(-1);
+                // we have to delete the temp file because otherwise image2xy is too timid to overwrite it.
+                if (unlink(xylsfn)) {
+                    SYSERROR("Failed to delete temp file %s", xylsfn);
+                    exit(-1);
+                }
+
+                memset(&sxyparams, 0, sizeof(simplexy_t));
+                // The other params get set to defaults for float or u8 images.
+                sxyparams.nobgsub = axy->no_bg_subtraction;
+                sxyparams.sigma = axy->image_sigma;
+                sxyparams.invert = axy->invert_image;
+                sxyparams.plim = axy->image_nsigma;
+
+                // MAGIC 3: downsample by a factor of 2, up to 3 times.
+                if (image2xy_files(fitsimgfn, xylsfn, TRUE, axy->downsample, 3,
+                                   axy->fitsimgext, 0, &sxyparams)) {
+                    ERROR("Source extraction failed");
+                    exit(-1);
+                }
+                if (cachefn)
+                    xylist_cache_add(axy->xylist_cache, xylsfn, cachefn);
             }
+            free(cachefn);
         }
+        PROFILE_END("source-extraction");
         dosort = TRUE;
 
     } else {
@@ -1020,133 +1357,148 @@ int augment_xylist(augment_xylist_t* axy,
             //guessed_scale = TRUE;
         }
         dl_free(estscales);
+    } else if (axy->guess_scale && axy->imagefn) {
+        // no FITS header, but a camera image may say what lens took it.
+        dl* estscales = NULL;
+        exif_guess_scale(axy->imagefn, axy->W, NULL, &estscales);
+        for (i=0; i<dl_size(estscales); i++) {
+            double scale = dl_get(estscales, i);
+            logverb("Scale estimate from EXIF: %g\n", scale);
+            dl_append(scales, scale * 0.9);
+            dl_append(scales, scale * 1.1);
+        }
+        dl_free(estscales);
     }
 
-    // remove lines
-    // sort
-    // uniformize
-    // cut
-    if (axy->keepxylsfn) {
-        // Figure out which is the last stage to run, and set its output
-        // file to "keepxylsfn".
-        if (axy->cutobjs) {
-            cutxylsfn = axy->keepxylsfn;
-        } else if (axy->uniformize) {
-            unixylsfn = axy->keepxylsfn;
-        } else if (dosort) {
-            sortedxylsfn = axy->keepxylsfn;
-        } else if (!axy->no_removelines) {
-            nolinesfn = axy->keepxylsfn;
-        } else {
-            // copy xylsfn to axy->keepxylsfn.
-            if (copy_file(xylsfn, axy->keepxylsfn)) {
-                ERROR("Failed to copy xyls file \"%s\" to \"%s\"",
-                      xylsfn, axy->keepxylsfn);
-                return -1;
+    // (--in-memory has done all this already.)
+    if (!in_memory) {
+        // remove lines
+        // sort
+        // uniformize
+        // cut
+        PROFILE_BEGIN("filter-xylist");
+        if (axy->keepxylsfn) {
+            // Figure out which is the last stage to run, and set its output
+            // file to "keepxylsfn".
+            if (axy->cutobjs) {
+                cutxylsfn = axy->keepxylsfn;
+            } else if (axy->uniformize) {
+                unixylsfn = axy->keepxylsfn;
+            } else if (dosort) {
+                sortedxylsfn = axy->keepxylsfn;
+            } else if (!axy->no_removelines) {
+                nolinesfn = axy->keepxylsfn;
+            } else {
+                // copy xylsfn to axy->keepxylsfn.
+                if (copy_file(xylsfn, axy->keepxylsfn)) {
+                    ERROR("Failed to copy xyls file \"%s\" to \"%s\"",
+                          xylsfn, axy->keepxylsfn);
+                    return -1;
+                }
             }
         }
-    }
 
-    if (!axy->no_removelines) {
-        if (!nolinesfn) {
-            nolinesfn = create_temp_file("removelines", axy->tempdir);
-            sl_append_nocopy(tempfiles, nolinesfn);
+        if (!axy->no_removelines) {
+            if (!nolinesfn) {
+                nolinesfn = create_temp_file("removelines", axy->tempdir);
+                sl_append_nocopy(tempfiles, nolinesfn);
+            }
+            logverb("Removing lines of (spurious) sources from xylist \"%s\", writing to \"%s\"\n",
+                    xylsfn, nolinesfn);
+            if (removelines_file(xylsfn, nolinesfn, axy->xcol, axy->ycol,
+                                 REMOVELINES_DEFAULT_CUT)) {
+                ERROR("Failed to remove lines of sources from xylist %s", xylsfn);
+                exit(-1);
+            }
+            xylsfn = nolinesfn;
         }
-        logverb("Removing lines of (spurious) sources from xylist \"%s\", writing to \"%s\"\n",
-                xylsfn, nolinesfn);
-        append_executable(cmd, "removelines", me);
-        if (axy->xcol)
-            sl_appendf(cmd, "-X %s", axy->xcol);
-        if (axy->ycol)
-            sl_appendf(cmd, "-Y %s", axy->ycol);
-        //if (axy->extension)
-        //    sl_appendf(cmd, "-e %i", axy->extension);
-        append_escape(cmd, xylsfn);
-        append_escape(cmd, nolinesfn);
-        run(cmd, verbose);
-        xylsfn = nolinesfn;
-    }
 
-    if (dosort) {
-        anbool do_tabsort = FALSE;
+        if (dosort) {
+            anbool do_tabsort = FALSE;
 
-        if (!axy->sortcol)
-            axy->sortcol = "FLUX";
-        if (!axy->bgcol)
-            axy->bgcol = "BACKGROUND";
+            if (!axy->sortcol)
+                axy->sortcol = "FLUX";
+            if (!axy->bgcol)
+                axy->bgcol = "BACKGROUND";
 
-        if (!sortedxylsfn) {
-            sortedxylsfn = create_temp_file("sorted", axy->tempdir);
-            sl_append_nocopy(tempfiles, sortedxylsfn);
-        }
-
-        if (axy->resort) {
-            char* err;
-            int rtn;
-            logverb("Sorting file \"%s\" to \"%s\" using columns flux (%s) and background (%s), %sscending\n",
-                    xylsfn, sortedxylsfn, axy->sortcol, axy->bgcol, axy->sort_ascending?"a":"de");
-            errors_start_logging_to_string();
-            rtn = resort_xylist(xylsfn, sortedxylsfn, axy->sortcol, axy->bgcol, axy->sort_ascending);
-            err = errors_stop_logging_to_string(": ");
-            if (rtn) {
-                logmsg("Sorting brightness using %s and BACKGROUND columns failed; falling back to %s.\n",
-                       axy->sortcol, axy->sortcol);
-                logverb("Reason: %s\n", err);
-                do_tabsort = TRUE;
+            if (!sortedxylsfn) {
+                sortedxylsfn = create_temp_file("sorted", axy->tempdir);
+                sl_append_nocopy(tempfiles, sortedxylsfn);
             }
-            free(err);
 
-        } else
-            do_tabsort = TRUE;
+            if (axy->resort) {
+                char* err;
+                int rtn;
+                logverb("Sorting file \"%s\" to \"%s\" using columns flux (%s) and background (%s), %sscending\n",
+                        xylsfn, sortedxylsfn, axy->sortcol, axy->bgcol, axy->sort_ascending?"a":"de");
+                errors_start_logging_to_string();
+                // Without uniformizing, only the first "cutobjs" are kept.
+                rtn = resort_xylist_topk(xylsfn, sortedxylsfn, axy->sortcol,
+                                         axy->bgcol, axy->sort_ascending,
+                                         axy->uniformize ? 0 : axy->cutobjs);
+                err = errors_stop_logging_to_string(": ");
+                if (rtn) {
+                    logmsg("Sorting brightness using %s and BACKGROUND columns failed; falling back to %s.\n",
+                           axy->sortcol, axy->sortcol);
+                    logverb("Reason: %s\n", err);
+                    do_tabsort = TRUE;
+                }
+                free(err);
 
-        if (do_tabsort) {
-            logverb("Sorting by brightness: input=%s, output=%s, column=%s.\n",
-                    xylsfn, sortedxylsfn, axy->sortcol);
-            tabsort(xylsfn, sortedxylsfn,
-                    axy->sortcol, !axy->sort_ascending);
-        }
-        xylsfn = sortedxylsfn;
-    }
+            } else
+                do_tabsort = TRUE;
 
-    if (axy->uniformize) {
-        if (!unixylsfn) {
-            unixylsfn = create_temp_file("uniform", axy->tempdir);
-            sl_append_nocopy(tempfiles, unixylsfn);
+            if (do_tabsort) {
+                logverb("Sorting by brightness: input=%s, output=%s, column=%s.\n",
+                        xylsfn, sortedxylsfn, axy->sortcol);
+                tabsort(xylsfn, sortedxylsfn,
+                        axy->sortcol, !axy->sort_ascending);
+            }
+            xylsfn = sortedxylsfn;
         }
-        append_executable(cmd, "uniformize", me);
-        sl_appendf(cmd, "-n %i", axy->uniformize);
-        if (axy->xcol)
-            sl_appendf(cmd, "-X %s", axy->xcol);
-        if (axy->ycol)
-            sl_appendf(cmd, "-Y %s", axy->ycol);
-        //if (axy->extension)
-        //    sl_appendf(cmd, "-e %i", axy->extension);
-        append_escape(cmd, xylsfn);
-        append_escape(cmd, unixylsfn);
-        run(cmd, verbose);
-        xylsfn = unixylsfn;
-    }
 
-    if (axy->cutobjs) {
-        // cut the source lists to at most "cutobjs" objects.
-        if (!cutxylsfn) {
-            cutxylsfn = create_temp_file("cut", axy->tempdir);
-            sl_append_nocopy(tempfiles, cutxylsfn);
+        if (axy->uniformize) {
+            if (!unixylsfn) {
+                unixylsfn = create_temp_file("uniform", axy->tempdir);
+                sl_append_nocopy(tempfiles, unixylsfn);
+            }
+            logverb("Uniformizing xylist \"%s\" into %i boxes, writing to \"%s\"\n",
+                    xylsfn, axy->uniformize, unixylsfn);
+            if (uniformize_file(xylsfn, unixylsfn, axy->xcol, axy->ycol,
+                                axy->uniformize)) {
+                ERROR("Failed to uniformize xylist %s", xylsfn);
+                exit(-1);
+            }
+            xylsfn = unixylsfn;
         }
 
-        if (cut_table(xylsfn, cutxylsfn, axy->cutobjs)) {
-            ERROR("Failed to cut table %s to %i entries; output file %s", xylsfn, axy->cutobjs, cutxylsfn);
-            return -1;
+        if (axy->cutobjs) {
+            // cut the source lists to at most "cutobjs" objects.
+            if (!cutxylsfn) {
+                cutxylsfn = create_temp_file("cut", axy->tempdir);
+                sl_append_nocopy(tempfiles, cutxylsfn);
+            }
+
+            if (cut_table(xylsfn, cutxylsfn, axy->cutobjs)) {
+                ERROR("Failed to cut table %s to %i entries; output file %s", xylsfn, axy->cutobjs, cutxylsfn);
+                return -1;
+            }
+            xylsfn = cutxylsfn;
         }
-        xylsfn = cutxylsfn;
+
+        PROFILE_END("filter-xylist");
     }
 
     if (axy->dont_augment)
         // done!
         goto cleanup;
+    PROFILE_BEGIN("write-axy");
 
     // start piling FITS headers in there.
-    hdr = anqfits_get_header2(xylsfn, 0);
+    if (in_memory)
+        hdr = qfits_table_prim_header_default();
+    else
+        hdr = anqfits_get_header2(xylsfn, 0);
     if (!hdr) {
         ERROR("Failed to read FITS header from file %s", xylsfn);
         exit(-1);
@@ -1293,6 +1645,8 @@ int augment_xylist(augment_xylist_t* axy,
         fits_header_addf_longstring(hdr, "ANSOLVIN", "solved input file", "%s", axy->solvedinfn);
     if (axy->cancelfn)
         fits_header_addf_longstring(hdr, "ANCANCEL", "cancel output file", "%s", axy->cancelfn);
+    if (axy->checkpointfn)
+        fits_header_addf_longstring(hdr, "ANCKPT", "search checkpoint file", "%s", axy->checkpointfn);
     if (axy->matchfn)
         fits_header_addf_longstring(hdr, "ANMATCH", "match output file", "%s", axy->matchfn);
     if (axy->rdlsfn)
@@ -1303,6 +1657,10 @@ int augment_xylist(augment_xylist_t* axy,
         fits_header_addf_longstring(hdr, "ANWCS", "WCS header output filename", "%s", axy->wcsfn);
     if (axy->corrfn)
         fits_header_addf_longstring(hdr, "ANCORR", "Correspondences output filename", "%s", axy->corrfn);
+    if (axy->statsfn)
+        fits_header_addf_longstring(hdr, "ANSTATS", "Solver statistics output filename", "%s", axy->statsfn);
+    if (axy->tracefn)
+        fits_header_addf_longstring(hdr, "ANTRACE", "Solver trace output filename", "%s", axy->tracefn);
     if (axy->codetol > 0.0)
         fits_header_add_double(hdr, "ANCTOL", axy->codetol, "code tolerance");
     if (axy->pixelerr > 0.0)
@@ -1408,8 +1766,21 @@ int augment_xylist(augment_xylist_t* axy,
     }
     qfits_header_destroy(hdr);
 
-    // copy blocks from xyls to output.
-    {
+    if (in_memory) {
+        fitstable_t* tab;
+        logverb("Writing source list to output %s.\n", axy->axyfn);
+        tab = fitstable_open_for_appending_to(fout);
+        if (!tab || write_sources_table(tab, &memsrc)) {
+            ERROR("Failed to write the source list to %s", axy->axyfn);
+            exit(-1);
+        }
+        // (this closes "fout")
+        if (fitstable_close(tab)) {
+            ERROR("Failed to close output file %s", axy->axyfn);
+            exit(-1);
+        }
+    } else {
+        // copy blocks from xyls to output.
         FILE* fin;
         off_t offset;
         off_t nbytes;
@@ -1440,8 +1811,9 @@ int augment_xylist(augment_xylist_t* axy,
             exit(-1);
         }
         fclose(fin);
+        fclose(fout);
     }
-    fclose(fout);
+    PROFILE_END("write-axy");
 
  cleanup:
     if (!axy->no_delete_temp) {
@@ -1454,12 +1826,23 @@ int augment_xylist(augment_xylist_t* axy,
         }
     }
 
+    if (in_memory)
+        mem_sources_free(&memsrc);
     dl_free(scales);
     sl_free2(cmd);
     sl_free2(tempfiles);
     return 0;
 }
 
+int augment_xylist(augment_xylist_t* axy,
+                   const char* me) {
+    int rtn;
+    PROFILE_BEGIN("augment-xylist");
+    rtn = run_augment_xylist(axy, me);
+    PROFILE_END("augment-xylist");
+    return rtn;
+}
+
 static void delete_existing_an_headers(qfits_header* hdr) {
     int i,j,k;
     char key[64];
@@ -1541,11 +1924,14 @@ static void delete_existing_an_headers(qfits_header* hdr) {
     qfits_header_del(hdr, "ANSOLVED");
     qfits_header_del(hdr, "ANSOLVIN");
     qfits_header_del(hdr, "ANCANCEL");
+    qfits_header_del(hdr, "ANCKPT");
     qfits_header_del(hdr, "ANMATCH");
     qfits_header_del(hdr, "ANRDLS");
     qfits_header_del(hdr, "ANSCAMP");
     qfits_header_del(hdr, "ANWCS");
     qfits_header_del(hdr, "ANCORR");
+    qfits_header_del(hdr, "ANSTATS");
+    qfits_header_del(hdr, "ANTRACE");
     qfits_header_del(hdr, "ANCTOL");
     qfits_header_del(hdr, "ANPOSERR");
     qfits_header_del(hdr, "ANPARITY");
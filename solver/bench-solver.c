@@ -0,0 +1,487 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ A fixed benchmark for the solver and the pieces it depends on: solving
+ the demo/ fields with demo/index-4119.fits, verifying the solutions,
+ source extraction (simplexy) on a synthetic image, star kd-tree range
+ searches and xylist FITS I/O.  All the inputs and parameters are
+ pinned (random numbers come from a fixed seed), so runs on different
+ commits can be compared; "-j" writes the results as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "solver.h"
+#include "index.h"
+#include "starkd.h"
+#include "kdtree.h"
+#include "xylist.h"
+#include "simplexy.h"
+#include "sip.h"
+#include "mathutil.h"
+#include "starutil.h"
+#include "ioutils.h"
+#include "fitsioutils.h"
+#include "boilerplate.h"
+#include "tic.h"
+#include "errors.h"
+#include "log.h"
+
+static const char* OPTIONS = "hvd:r:jo:";
+
+// demo fields: index-4119 solves apod5; for the others, this times an
+// exhaustive search of their brightest stars.
+static const char* fieldnames[] = {
+    "apod5", "apod2", "apod3" };
+#define N_FIELDS (sizeof(fieldnames) / sizeof(char*))
+
+// look at this many of the brightest stars in each field.
+#define FIELD_DEPTH 100
+
+// don't let a field that stops solving hold up the run forever.
+#define SOLVE_TIMELIMIT 60.0
+
+void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options]\n"
+           "    [-d <dir>]: directory with the demo fields and index-4119.fits\n"
+           "                (default ../demo)\n"
+           "    [-r <n>]: repeat each timing this many times (default 3)\n"
+           "    [-j]: print the results as JSON\n"
+           "    [-o <file>]: write the JSON results to this file\n"
+           "    [-v]: +verbose (show the solver's messages)\n"
+           "\n", progname);
+}
+
+struct field_result {
+    const char* name;
+    int nstars;
+    int nsolved;
+    double* seconds;
+    long long numtries;
+    long long nummatches;
+    double verify_wall;
+    double solve_wall;
+    // verifications of the solution per second.
+    double verify_rate;
+};
+
+struct results {
+    int repeats;
+    struct field_result fields[N_FIELDS];
+    double simplexy_seconds;
+    int simplexy_npixels;
+    int simplexy_npeaks;
+    double kd_seconds;
+    int kd_nqueries;
+    double kd_mean_results;
+    double fits_write_seconds;
+    double fits_read_seconds;
+    int fits_nrows;
+};
+
+static int compare_doubles(const void* v1, const void* v2) {
+    double a = *(const double*)v1;
+    double b = *(const double*)v2;
+    return (a > b) - (a < b);
+}
+
+static double median(double* x, int N) {
+    qsort(x, N, sizeof(double), compare_doubles);
+    if (N % 2)
+        return x[N/2];
+    return 0.5 * (x[N/2 - 1] + x[N/2]);
+}
+
+// The parameters solve-field uses by default (see solver-batch.c).
+static void setup_solver(solver_t* sp, index_t* index, starxy_t* xy,
+                         int W, int H) {
+    solver_set_default_values(sp);
+    sp->funits_lower = deg2arcsec(0.1) / W;
+    sp->funits_upper = deg2arcsec(180.0) / W;
+    solver_set_parity(sp, PARITY_BOTH);
+    solver_set_keep_logodds(sp, log(1e9));
+    // (only print the matches that solve.)
+    sp->logratio_toprint = sp->logratio_tokeep;
+    sp->logratio_totune = log(1e6);
+    sp->do_tweak = TRUE;
+    sp->tweak_aborder = sp->tweak_abporder = 2;
+    sp->distance_from_quad_bonus = TRUE;
+    sp->endobj = FIELD_DEPTH;
+    sp->collect_stats = TRUE;
+    sp->nthreads = 1;
+    solver_add_index(sp, index);
+    solver_set_field(sp, xy);
+    solver_set_field_bounds(sp, 0, W, 0, H);
+    solver_set_quad_size_fraction(sp, 0.1, 1.0);
+    solver_preprocess_field(sp);
+}
+
+static int bench_field(struct field_result* fr, const char* dir,
+                       index_t* index, int repeats) {
+    char* fn;
+    xylist_t* xyls;
+    starxy_t* xy;
+    sip_t* wcs = NULL;
+    int W, H, i;
+    solver_t* sp;
+
+    asprintf_safe(&fn, "%s/%s.xyls", dir, fr->name);
+    xyls = xylist_open(fn);
+    if (!xyls) {
+        ERROR("Failed to open %s", fn);
+        free(fn);
+        return -1;
+    }
+    free(fn);
+    W = xylist_get_imagew(xyls);
+    H = xylist_get_imageh(xyls);
+    xylist_set_include_background(xyls, FALSE);
+    xy = xylist_read_field(xyls, NULL);
+    xylist_close(xyls);
+    if (!xy) {
+        ERROR("Failed to read field %s", fr->name);
+        return -1;
+    }
+    fr->nstars = starxy_n(xy);
+    fr->seconds = calloc(repeats, sizeof(double));
+
+    for (i=0; i<repeats; i++) {
+        double t0;
+        sp = solver_new();
+        setup_solver(sp, index, xy, W, H);
+        sp->deadline = timenow() + SOLVE_TIMELIMIT;
+        t0 = timenow();
+        solver_run(sp);
+        fr->seconds[i] = timenow() - t0;
+        fr->numtries += sp->numtries;
+        fr->nummatches += sp->nummatches;
+        fr->verify_wall += sp->stats.wall[SOLVER_STAGE_VERIFY];
+        fr->solve_wall += fr->seconds[i];
+        if (sp->best_match_solves) {
+            fr->nsolved++;
+            if (!wcs) {
+                MatchObj* mo = &(sp->best_match);
+                if (mo->sip) {
+                    wcs = mo->sip;
+                    mo->sip = NULL;
+                } else {
+                    wcs = sip_create();
+                    sip_wrap_tan(&(mo->wcstan), wcs);
+                }
+            }
+        }
+        if (sp->have_best_match && sp->best_match.sip) {
+            sip_free(sp->best_match.sip);
+            sp->best_match.sip = NULL;
+        }
+        // (the field belongs to us.)
+        sp->fieldxy_orig = NULL;
+        solver_free(sp);
+    }
+
+    if (wcs) {
+        int nverify = 10 * repeats;
+        double t0;
+        sp = solver_new();
+        setup_solver(sp, index, xy, W, H);
+        t0 = timenow();
+        for (i=0; i<nverify; i++)
+            solver_verify_sip_wcs(sp, wcs);
+        fr->verify_rate = nverify / (timenow() - t0);
+        sp->fieldxy_orig = NULL;
+        solver_free(sp);
+        sip_free(wcs);
+    }
+    starxy_free(xy);
+    return 0;
+}
+
+// A 1024x1024 image of noise and Gaussian stars.
+static void bench_simplexy(struct results* r) {
+    int W = 1024, H = 1024, nstars = 500;
+    float* img;
+    int i, k;
+    double total = 0;
+
+    srand(42);
+    img = malloc((size_t)W * H * sizeof(float));
+    for (i=0; i<W*H; i++)
+        img[i] = 100.0 + 5.0 * (rand() / (double)RAND_MAX - 0.5);
+    for (k=0; k<nstars; k++) {
+        double cx = 10 + (W - 20) * (rand() / (double)RAND_MAX);
+        double cy = 10 + (H - 20) * (rand() / (double)RAND_MAX);
+        double flux = 200 + 5000 * (rand() / (double)RAND_MAX);
+        int x, y;
+        for (y=(int)cy-5; y<=(int)cy+5; y++)
+            for (x=(int)cx-5; x<=(int)cx+5; x++)
+                img[y*W + x] += flux / (2*M_PI*1.5*1.5) *
+                    exp(-(square(x - cx) + square(y - cy)) / (2*1.5*1.5));
+    }
+    for (k=0; k<r->repeats; k++) {
+        simplexy_t s;
+        double t0;
+        memset(&s, 0, sizeof(s));
+        simplexy_set_defaults(&s);
+        s.nthreads = 1;
+        s.image = img;
+        s.nx = W;
+        s.ny = H;
+        t0 = timenow();
+        simplexy_run(&s);
+        total += timenow() - t0;
+        r->simplexy_npeaks = s.npeaks;
+        // (don't let simplexy_free_contents() free our image.)
+        s.image = NULL;
+        simplexy_free_contents(&s);
+    }
+    r->simplexy_seconds = total / r->repeats;
+    r->simplexy_npixels = W * H;
+    free(img);
+}
+
+// Range searches of the index's stars, 5 degrees around random points.
+static void bench_kdtree(struct results* r, index_t* index) {
+    kdtree_t* kd = index->starkd->tree;
+    kdtree_qres_t* res = NULL;
+    double maxd2 = deg2distsq(5.0);
+    long long nres = 0;
+    int N = 100000;
+    int i;
+    double t0;
+
+    srand(43);
+    t0 = timenow();
+    for (i=0; i<N; i++) {
+        double xyz[3];
+        radecdeg2xyzarr(360.0 * rand() / (double)RAND_MAX,
+                        rad2deg(asin(2.0 * rand() / (double)RAND_MAX - 1.0)),
+                        xyz);
+        res = kdtree_rangesearch_options_reuse(kd, res, xyz, maxd2, 0);
+        nres += res->nres;
+    }
+    r->kd_seconds = timenow() - t0;
+    r->kd_nqueries = N;
+    r->kd_mean_results = nres / (double)N;
+    kdtree_free_query(res);
+}
+
+// Writes and reads back a 100,000-star xylist.
+static int bench_fits(struct results* r) {
+    int N = 100000;
+    starxy_t* xy;
+    starxy_t* xy2;
+    xylist_t* xyls;
+    char* fn;
+    int i;
+    double t0;
+
+    srand(44);
+    xy = starxy_new(N, TRUE, FALSE);
+    for (i=0; i<N; i++) {
+        starxy_setx(xy, i, 4096.0 * rand() / (double)RAND_MAX);
+        starxy_sety(xy, i, 4096.0 * rand() / (double)RAND_MAX);
+        starxy_set_flux(xy, i, 1000.0 * rand() / (double)RAND_MAX);
+    }
+    fn = create_temp_file("bench", NULL);
+    t0 = timenow();
+    xyls = xylist_open_for_writing(fn);
+    if (xyls) {
+        xylist_set_include_flux(xyls, TRUE);
+        xylist_set_include_background(xyls, FALSE);
+    }
+    if (!xyls ||
+        xylist_write_primary_header(xyls) ||
+        xylist_write_header(xyls) ||
+        xylist_write_field(xyls, xy) ||
+        xylist_fix_header(xyls) ||
+        xylist_fix_primary_header(xyls) ||
+        xylist_close(xyls)) {
+        ERROR("Failed to write %s", fn);
+        goto bailout;
+    }
+    r->fits_write_seconds = timenow() - t0;
+
+    t0 = timenow();
+    xyls = xylist_open(fn);
+    if (xyls)
+        xylist_set_include_background(xyls, FALSE);
+    xy2 = xyls ? xylist_read_field(xyls, NULL) : NULL;
+    if (xyls)
+        xylist_close(xyls);
+    if (!xy2 || starxy_n(xy2) != N) {
+        ERROR("Failed to read back %s", fn);
+        starxy_free(xy2);
+        goto bailout;
+    }
+    r->fits_read_seconds = timenow() - t0;
+    r->fits_nrows = N;
+    starxy_free(xy2);
+    starxy_free(xy);
+    unlink(fn);
+    free(fn);
+    return 0;
+ bailout:
+    starxy_free(xy);
+    unlink(fn);
+    free(fn);
+    return -1;
+}
+
+static void print_text(const struct results* r) {
+    size_t i;
+    printf("%-8s %6s %7s %8s %8s %8s %12s %12s %10s\n", "field", "stars",
+           "solved", "min(s)", "med(s)", "max(s)", "quads/s", "matches/s",
+           "verify/s");
+    for (i=0; i<N_FIELDS; i++) {
+        const struct field_result* fr = r->fields + i;
+        double* t = malloc(r->repeats * sizeof(double));
+        double med;
+        memcpy(t, fr->seconds, r->repeats * sizeof(double));
+        // (sorts "t")
+        med = median(t, r->repeats);
+        printf("%-8s %6i %3i/%-3i %8.3f %8.3f %8.3f %12.0f %12.0f %10.1f\n",
+               fr->name, fr->nstars, fr->nsolved, r->repeats,
+               t[0], med, t[r->repeats - 1], fr->numtries / fr->solve_wall,
+               fr->nummatches / fr->solve_wall, fr->verify_rate);
+        free(t);
+    }
+    printf("simplexy: %.3f s per %ix%i image (%.1f Mpixel/s), %i sources\n",
+           r->simplexy_seconds, (int)sqrt(r->simplexy_npixels),
+           (int)sqrt(r->simplexy_npixels),
+           1e-6 * r->simplexy_npixels / r->simplexy_seconds, r->simplexy_npeaks);
+    printf("kd-tree:  %.0f range searches/s (%.1f stars each)\n",
+           r->kd_nqueries / r->kd_seconds, r->kd_mean_results);
+    printf("FITS:     %.0f rows/s written, %.0f rows/s read\n",
+           r->fits_nrows / r->fits_write_seconds,
+           r->fits_nrows / r->fits_read_seconds);
+}
+
+static void write_json(const struct results* r, FILE* fid) {
+    size_t i;
+    int k;
+    fprintf(fid, "{\n  \"repeats\": %i,\n  \"solve\": [\n", r->repeats);
+    for (i=0; i<N_FIELDS; i++) {
+        const struct field_result* fr = r->fields + i;
+        fprintf(fid, "    {\"field\": \"%s\", \"stars\": %i, \"solved\": %i, "
+                "\"seconds\": [", fr->name, fr->nstars, fr->nsolved);
+        for (k=0; k<r->repeats; k++)
+            fprintf(fid, "%s%.6f", k ? ", " : "", fr->seconds[k]);
+        fprintf(fid, "], \"quads_per_sec\": %.1f, \"matches_per_sec\": %.1f, "
+                "\"verify_fraction\": %.4f, \"verifies_per_sec\": %.2f}%s\n",
+                fr->numtries / fr->solve_wall, fr->nummatches / fr->solve_wall,
+                fr->verify_wall / fr->solve_wall, fr->verify_rate,
+                (i+1 < N_FIELDS) ? "," : "");
+    }
+    fprintf(fid, "  ],\n");
+    fprintf(fid, "  \"simplexy\": {\"pixels\": %i, \"seconds\": %.6f, "
+            "\"sources\": %i},\n", r->simplexy_npixels, r->simplexy_seconds,
+            r->simplexy_npeaks);
+    fprintf(fid, "  \"kdtree\": {\"queries\": %i, \"seconds\": %.6f, "
+            "\"mean_results\": %.2f},\n", r->kd_nqueries, r->kd_seconds,
+            r->kd_mean_results);
+    fprintf(fid, "  \"fits\": {\"rows\": %i, \"write_seconds\": %.6f, "
+            "\"read_seconds\": %.6f}\n}\n", r->fits_nrows,
+            r->fits_write_seconds, r->fits_read_seconds);
+}
+
+int main(int argc, char** argv) {
+    int argchar;
+    char* dir = "../demo";
+    char* jsonfn = NULL;
+    anbool json = FALSE;
+    int loglvl = LOG_MSG;
+    FILE* devnull = NULL;
+    struct results r;
+    index_t* index;
+    char* fn;
+    size_t i;
+    int rtn = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.repeats = 3;
+
+    while ((argchar = getopt(argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'r':
+            r.repeats = atoi(optarg);
+            break;
+        case 'j':
+            json = TRUE;
+            break;
+        case 'o':
+            jsonfn = optarg;
+            break;
+        case 'v':
+            loglvl++;
+            break;
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            printHelp(argv[0]);
+            exit(-1);
+        }
+    if (r.repeats < 1) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+    log_init(loglvl);
+    // the solver prints each solving match whatever the log level.
+    if (loglvl == LOG_MSG) {
+        devnull = fopen("/dev/null", "w");
+        if (devnull)
+            log_to(devnull);
+    }
+    fits_use_error_system();
+
+    asprintf_safe(&fn, "%s/index-4119.fits", dir);
+    index = index_load(fn, 0, NULL);
+    if (!index) {
+        ERROR("Failed to load index %s", fn);
+        exit(-1);
+    }
+    free(fn);
+
+    for (i=0; i<N_FIELDS; i++) {
+        r.fields[i].name = fieldnames[i];
+        if (bench_field(r.fields + i, dir, index, r.repeats))
+            exit(-1);
+    }
+    bench_simplexy(&r);
+    bench_kdtree(&r, index);
+    if (bench_fits(&r))
+        rtn = -1;
+
+    if (json)
+        write_json(&r, stdout);
+    else
+        print_text(&r);
+    if (jsonfn) {
+        FILE* fid = fopen(jsonfn, "w");
+        if (!fid) {
+            SYSERROR("Failed to open %s", jsonfn);
+            rtn = -1;
+        } else {
+            write_json(&r, fid);
+            fclose(fid);
+        }
+    }
+    for (i=0; i<N_FIELDS; i++)
+        free(r.fields[i].seconds);
+    index_free(index);
+    if (devnull)
+        fclose(devnull);
+    return rtn;
+}
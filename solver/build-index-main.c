@@ -19,8 +19,9 @@
 #include "errors.h"
 #include "log.h"
 #include "starutil.h"
+#include "ioutils.h"
 
-const char* OPTIONS = "hvi:o:N:l:u:S:fU:H:s:m:n:r:d:p:R:L:EI:MTj:1:P:B:A:D:Kt:e:";
+const char* OPTIONS = "hvi:o:N:l:u:S:fU:H:s:m:n:r:d:p:R:L:EI:MTj:1:P:B:A:D:Kt:e:w:W:O:CQXb:g:";
 
 static void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -30,6 +31,11 @@ static void print_help(char* progname) {
            "         -e <input-FITS-extension> input: FITS extension to read\n"
            "    OR,\n"
            "         -1 <input-index>         to share another index's stars\n"
+           "    OR,\n"
+           "         -O <input-index> -i <input-FITS-catalog> -H <hp> -s <nside>\n"
+           "                                  to update an index: replace its stars in\n"
+           "                                  that healpix, and rebuild the nearby quads\n"
+           "                                  (-N must be the index's)\n"
            "      )\n"
            "      -o <output-index>        output filename for index\n"
            "      (\n"
@@ -69,12 +75,30 @@ static void print_help(char* progname) {
            "      [-L <max-reuses>] make extra passes through the healpixes, increasing the \"-r\" reuse\n"
            "                     limit each time, up to \"max-reuses\".\n"
            "      [-E]: scan through the catalog, checking which healpixes are occupied.\n"
+           "      [-W <threads>]: build quads on this many threads (-1: one per CPU),\n"
+           "                     visiting the healpixes in blocks; the quads differ from\n"
+           "                     the default order's, but not between thread counts\n"
            "\n"
            "      [-I <unique-id>] set the unique ID of this index\n"
+           "      [-C]: pack the codes into one byte per dimension (a smaller code\n"
+           "            kd-tree; the solver checks matches near the tolerance exactly)\n"
+           "      [-Q]: pack the star positions into 16 bits per dimension (a smaller\n"
+           "            star kd-tree, with positions good to a few milliarcseconds)\n"
+           "      [-X]: also store a copy of each quad's star positions, quad by quad\n"
+           "            (a bigger index, but fewer random reads when solving; see\n"
+           "            \"quad_xyz\" in the engine config)\n"
+           "      [-b <bins>]: also store the codes split by quad scale into this many\n"
+           "            kd-trees, so that solves with a narrow scale range search only\n"
+           "            the bins that can match (a bigger index)\n"
+           "      [-g <nside>]: also store the codes split by where the quad is on the\n"
+           "            sky, into HEALPix cells at this Nside, so that solves with a\n"
+           "            position hint search only the cells near it (a bigger index)\n"
            "\n"
-           "      [-M]: in-memory (don't use temp files)\n"
+           "      [-M]: in-memory (don't use temp files; write only the final index)\n"
            "      [-T]: don't delete temp files\n"
            "      [-t <temp-dir>]: use this temp directory (default: /tmp)\n"
+           "      [-w <threads>]: number of threads for uniformizing the catalog,\n"
+           "                     building the kd-trees and unpermuting (default 1)\n"
            "      [-v]: add verbosity.\n"
            "\n", progname);
 }
@@ -86,6 +110,7 @@ int main(int argc, char** argv) {
     char* infn = NULL;
     char* indexfn = NULL;
     char* inindexfn = NULL;
+    char* updatefn = NULL;
     int inext = 0;
 
     index_params_t myp;
@@ -118,6 +143,9 @@ int main(int argc, char** argv) {
         case '1':
             inindexfn = optarg;
             break;
+        case 'O':
+            updatefn = optarg;
+            break;
         case 'j':
             p->jitter = atof(optarg);
             break;
@@ -127,6 +155,12 @@ int main(int argc, char** argv) {
         case 'T':
             p->delete_tempfiles = FALSE;
             break;
+        case 'w':
+            p->nthreads = atoi(optarg);
+            break;
+        case 'W':
+            p->hpquads_threads = atoi(optarg);
+            break;
         case 'E':
             p->scanoccupied = TRUE;
             break;
@@ -142,6 +176,21 @@ int main(int argc, char** argv) {
         case 'M':
             p->inmemory = TRUE;
             break;
+        case 'C':
+            p->pack_codes = TRUE;
+            break;
+        case 'Q':
+            p->pack_stars = TRUE;
+            break;
+        case 'X':
+            p->quad_xyz = TRUE;
+            break;
+        case 'b':
+            p->scale_bins = atoi(optarg);
+            break;
+        case 'g':
+            p->sky_bins_nside = atoi(optarg);
+            break;
         case 'U':
             p->UNside = atoi(optarg);
             break;
@@ -213,6 +262,16 @@ int main(int argc, char** argv) {
         exit( -1);
     }
 
+    if (updatefn && (!infn || p->bighp < 0 || !p->bignside)) {
+        printf("To update an index (-O), give the catalog (-i) and the healpix (-H, -s).\n");
+        print_help(argv[0]);
+        exit( -1);
+    }
+    if (updatefn && streq(updatefn, indexfn)) {
+        printf("The updated index (-o) must not overwrite its input (-O).\n");
+        exit( -1);
+    }
+
     if (optind != argc) {
         print_help(argv[0]);
         printf("\nExtra command-line args were given: ");
@@ -223,7 +282,7 @@ int main(int argc, char** argv) {
         exit(-1);
     }
 
-    if (!p->indexid)
+    if (!p->indexid && !updatefn)
         logmsg("Warning: you should set the unique-id for this index (with -I).\n");
 
     if (p->dimquads > DQMAX) {
@@ -270,7 +329,11 @@ int main(int argc, char** argv) {
     p->argc = argc;
     p->args = argv;
 
-    if (infn) {
+    if (updatefn) {
+        if (build_index_update_files(updatefn, infn, inext, indexfn, p)) {
+            exit(-1);
+        }
+    } else if (infn) {
         if (build_index_files(infn, inext, indexfn, p)) {
             exit(-1);
         }
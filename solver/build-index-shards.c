@@ -0,0 +1,539 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Plans and merges a sharded index build.
+
+ The planner writes, in the output directory, a plan plus two job
+ lists: "split-jobs.txt" (one hpsplit command that cuts the catalog into
+ big-healpix pieces, with margins) and "build-jobs.txt" (one
+ build-astrometry-index command per big healpix).  The build jobs are
+ independent, so they can be run on separate nodes once the split has
+ finished.
+
+ With -M, the outputs listed in the plan are checked (that each is an
+ index of the planned ID and big healpix, that the shards agree on their
+ parameters, and that any DATASUMs are correct) and the index manifest
+ of the directory is written, so that the shards are registered as one
+ index set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <limits.h>
+
+#include "os-features.h"
+#include "index.h"
+#include "healpix.h"
+#include "fitsioutils.h"
+#include "ioutils.h"
+#include "bl.h"
+#include "log.h"
+#include "errors.h"
+#include "boilerplate.h"
+
+#define PLAN_FILENAME "shards.plan"
+#define PLAN_HEADER "# build-index-shards plan 1"
+
+static const char* OPTIONS = "hvo:s:N:m:I:A:D:a:b:M";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] -o <output-dir> -I <unique-id> -N <nside>\n"
+           "            <input-FITS-catalog> [...]\n"
+           "   or: %s -M <output-dir>\n"
+           "\n"
+           "  Planning:\n"
+           "    -o <output-dir>: where the split catalogs, indexes and job lists go\n"
+           "    -I <unique-id>: index ID, shared by all the shards\n"
+           "    -N <nside>: healpix Nside for quad-building (a multiple of -s)\n"
+           "    [-s <big healpix Nside>]: default 1 (12 shards)\n"
+           "    [-m <margin>]: margin of each shard, in healpixels of Nside; default 0\n"
+           "    [-A <column>]: RA column of the catalog (default \"RA\")\n"
+           "    [-D <column>]: Dec column of the catalog (default \"Dec\")\n"
+           "    [-a <options>]: more build-astrometry-index options for every shard,\n"
+           "                    eg, -a \"-S MAG -l 2 -u 2.8\"; can be repeated\n"
+           "    [-b <dir>]: directory holding hpsplit and build-astrometry-index\n"
+           "                (default: from the PATH)\n"
+           "\n"
+           "  Merging:\n"
+           "    -M <output-dir>: check the shards and write the index manifest\n"
+           "\n"
+           "    [-v]: +verbose\n"
+           "\n"
+           "Run split-jobs.txt, then the lines of build-jobs.txt (in any order, on\n"
+           "any nodes sharing the output directory), then %s -M.\n"
+           "\n", progname, progname, progname);
+}
+
+struct shard {
+    int hp;
+    char* catfn;
+    char* indexfn;
+};
+
+struct plan {
+    int bignside;
+    int nside;
+    int margin;
+    int indexid;
+    bl* shards;
+};
+
+static void free_plan(struct plan* plan) {
+    size_t i;
+    for (i=0; i<bl_size(plan->shards); i++) {
+        struct shard* s = bl_access(plan->shards, i);
+        free(s->catfn);
+        free(s->indexfn);
+    }
+    bl_free(plan->shards);
+}
+
+// Writes "str" to "f", escaped for the shell.
+static void put_escaped(FILE* f, const char* str) {
+    char* esc = shell_escape(str);
+    fprintf(f, " %s", esc);
+    free(esc);
+}
+
+static char* join_path(const char* dir, const char* fn) {
+    char* path;
+    asprintf_safe(&path, "%s/%s", dir, fn);
+    return path;
+}
+
+static char* program_path(const char* bindir, const char* prog) {
+    if (!bindir)
+        return strdup(prog);
+    return join_path(bindir, prog);
+}
+
+static int write_plan(const char* dir, const struct plan* plan) {
+    char* fn = join_path(dir, PLAN_FILENAME);
+    FILE* f;
+    size_t i;
+
+    f = fopen(fn, "w");
+    if (!f) {
+        SYSERROR("Failed to open plan file \"%s\" for writing", fn);
+        free(fn);
+        return -1;
+    }
+    fprintf(f, "%s\n", PLAN_HEADER);
+    fprintf(f, "bignside %i\nnside %i\nmargin %i\nindexid %i\n",
+            plan->bignside, plan->nside, plan->margin, plan->indexid);
+    for (i=0; i<bl_size(plan->shards); i++) {
+        struct shard* s = bl_access(plan->shards, i);
+        fprintf(f, "shard %i %s %s\n", s->hp, s->catfn, s->indexfn);
+    }
+    if (fclose(f)) {
+        SYSERROR("Failed to write plan file \"%s\"", fn);
+        free(fn);
+        return -1;
+    }
+    free(fn);
+    return 0;
+}
+
+static int read_plan(const char* dir, struct plan* plan) {
+    char* fn = join_path(dir, PLAN_FILENAME);
+    FILE* f;
+    char* line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int nline = 0;
+    int rtn = -1;
+
+    memset(plan, 0, sizeof(struct plan));
+    plan->shards = bl_new(64, sizeof(struct shard));
+    f = fopen(fn, "r");
+    if (!f) {
+        SYSERROR("Failed to open plan file \"%s\"", fn);
+        free(fn);
+        return -1;
+    }
+    while ((len = getline(&line, &linesize, f)) != -1) {
+        struct shard s;
+        char cat[PATH_MAX], ind[PATH_MAX];
+        nline++;
+        if (len && line[len-1] == '\n')
+            line[--len] = '\0';
+        if (nline == 1) {
+            if (!streq(line, PLAN_HEADER)) {
+                ERROR("Plan file \"%s\" has an unknown format", fn);
+                goto bailout;
+            }
+            continue;
+        }
+        if (sscanf(line, "bignside %i", &plan->bignside) == 1 ||
+            sscanf(line, "nside %i", &plan->nside) == 1 ||
+            sscanf(line, "margin %i", &plan->margin) == 1 ||
+            sscanf(line, "indexid %i", &plan->indexid) == 1)
+            continue;
+        if (sscanf(line, "shard %i %4095s %4095s", &s.hp, cat, ind) == 3) {
+            s.catfn = strdup(cat);
+            s.indexfn = strdup(ind);
+            bl_append(plan->shards, &s);
+            continue;
+        }
+        ERROR("Failed to parse line %i of plan file \"%s\": \"%s\"",
+              nline, fn, line);
+        goto bailout;
+    }
+    if (!plan->bignside || !plan->nside || !bl_size(plan->shards)) {
+        ERROR("Plan file \"%s\" is incomplete", fn);
+        goto bailout;
+    }
+    rtn = 0;
+ bailout:
+    free(line);
+    fclose(f);
+    free(fn);
+    return rtn;
+}
+
+static int plan_shards(const char* outdir, struct plan* plan, sl* catalogs,
+                       const char* racol, const char* deccol, sl* buildargs,
+                       const char* bindir) {
+    char* splitdir;
+    char* absdir;
+    char* fn;
+    FILE* fsplit;
+    FILE* fbuild;
+    int NHP = 12 * plan->bignside * plan->bignside;
+    int ndigits;
+    double margindeg;
+    char* prog;
+    char* pattern;
+    int i;
+    size_t j;
+
+    if (mkdir_p(outdir)) {
+        ERROR("Failed to create output directory \"%s\"", outdir);
+        return -1;
+    }
+    // the jobs may run in other directories, so use absolute paths.
+    absdir = realpath(outdir, NULL);
+    if (!absdir) {
+        SYSERROR("Failed to find the absolute path of \"%s\"", outdir);
+        return -1;
+    }
+    // (the split catalogs go in a subdirectory, out of the way of the
+    // index manifest.)
+    splitdir = join_path(absdir, "split");
+    if (mkdir_p(splitdir)) {
+        ERROR("Failed to create directory \"%s\"", splitdir);
+        return -1;
+    }
+
+    ndigits = MAX(2, (int)ceil(log10(NHP)));
+    for (i=0; i<NHP; i++) {
+        struct shard s;
+        s.hp = i;
+        asprintf_safe(&s.catfn, "split/catalog-%0*i.fits", ndigits, i);
+        asprintf_safe(&s.indexfn, "index-%i-%0*i.fits", plan->indexid,
+                      ndigits, i);
+        bl_append(plan->shards, &s);
+    }
+    if (write_plan(absdir, plan))
+        return -1;
+
+    // The split margin has to hold every star that the build will keep:
+    // the margin healpixels, plus one, measured along the diagonal.
+    margindeg = (plan->margin + 1) * M_SQRT2 *
+        healpix_side_length_arcmin(plan->nside) / 60.0;
+
+    fn = join_path(absdir, "split-jobs.txt");
+    fsplit = fopen(fn, "w");
+    if (!fsplit) {
+        SYSERROR("Failed to open \"%s\" for writing", fn);
+        return -1;
+    }
+    free(fn);
+    prog = program_path(bindir, "hpsplit");
+    asprintf_safe(&pattern, "%s/catalog-%%0%ii.fits", splitdir, ndigits);
+    fprintf(fsplit, "%s -n %i -m %g -r", prog, plan->bignside, margindeg);
+    put_escaped(fsplit, racol);
+    fprintf(fsplit, " -d");
+    put_escaped(fsplit, deccol);
+    fprintf(fsplit, " -o");
+    put_escaped(fsplit, pattern);
+    for (j=0; j<sl_size(catalogs); j++) {
+        char* cat = realpath(sl_get(catalogs, j), NULL);
+        if (!cat) {
+            SYSERROR("Input catalog \"%s\"", sl_get(catalogs, j));
+            fclose(fsplit);
+            return -1;
+        }
+        put_escaped(fsplit, cat);
+        free(cat);
+    }
+    fprintf(fsplit, "\n");
+    free(prog);
+    free(pattern);
+    if (fclose(fsplit)) {
+        SYSERROR("Failed to write split-jobs.txt");
+        return -1;
+    }
+
+    fn = join_path(absdir, "build-jobs.txt");
+    fbuild = fopen(fn, "w");
+    if (!fbuild) {
+        SYSERROR("Failed to open \"%s\" for writing", fn);
+        return -1;
+    }
+    free(fn);
+    prog = program_path(bindir, "build-astrometry-index");
+    for (j=0; j<bl_size(plan->shards); j++) {
+        struct shard* s = bl_access(plan->shards, j);
+        size_t k;
+        fprintf(fbuild, "%s", prog);
+        fprintf(fbuild, " -i");
+        fn = join_path(absdir, s->catfn);
+        put_escaped(fbuild, fn);
+        free(fn);
+        fprintf(fbuild, " -o");
+        fn = join_path(absdir, s->indexfn);
+        put_escaped(fbuild, fn);
+        free(fn);
+        fprintf(fbuild, " -I %i -N %i -H %i -s %i -m %i -A", plan->indexid,
+                plan->nside, s->hp, plan->bignside, plan->margin);
+        put_escaped(fbuild, racol);
+        fprintf(fbuild, " -D");
+        put_escaped(fbuild, deccol);
+        // (these are passed through as written.)
+        for (k=0; k<sl_size(buildargs); k++)
+            fprintf(fbuild, " %s", sl_get(buildargs, k));
+        fprintf(fbuild, "\n");
+    }
+    free(prog);
+    if (fclose(fbuild)) {
+        SYSERROR("Failed to write build-jobs.txt");
+        return -1;
+    }
+
+    logmsg("Planned %zu shards (big healpix Nside %i, margin %i healpixels "
+           "= %g deg in the split) in %s\n", bl_size(plan->shards),
+           plan->bignside, plan->margin, margindeg, absdir);
+    free(splitdir);
+    free(absdir);
+    return 0;
+}
+
+// Checks one shard's output against the plan, and against the first
+// good shard, "first".  Returns the number of problems.
+static int check_shard(const char* dir, const struct plan* plan,
+                       const struct shard* s, index_t** first) {
+    char* fn = join_path(dir, s->indexfn);
+    index_t* ind;
+    int nbad = 0;
+    int nchecked = 0;
+    int nsum;
+
+    ind = index_load(fn, INDEX_ONLY_LOAD_METADATA, NULL);
+    if (!ind) {
+        ERROR("Shard %i: failed to read index \"%s\"", s->hp, fn);
+        free(fn);
+        return 1;
+    }
+    if (ind->indexid != plan->indexid) {
+        logmsg("Shard %i: index ID is %i, not %i\n", s->hp, ind->indexid,
+               plan->indexid);
+        nbad++;
+    }
+    if (ind->healpix != s->hp || ind->hpnside != plan->bignside) {
+        logmsg("Shard %i: covers healpix %i at Nside %i, not %i at Nside %i\n",
+               s->hp, ind->healpix, ind->hpnside, s->hp, plan->bignside);
+        nbad++;
+    }
+    if (ind->cutmargin != plan->margin) {
+        logmsg("Shard %i: margin is %i, not %i\n", s->hp, ind->cutmargin,
+               plan->margin);
+        nbad++;
+    }
+    if (*first) {
+        index_t* f = *first;
+        if (ind->index_scale_lower != f->index_scale_lower ||
+            ind->index_scale_upper != f->index_scale_upper ||
+            ind->dimquads != f->dimquads ||
+            ind->cutnside != f->cutnside ||
+            ind->cutnsweep != f->cutnsweep) {
+            logmsg("Shard %i: quad scales [%g, %g], dimquads %i, cut Nside %i "
+                   "and sweeps %i differ from shard %i's\n", s->hp,
+                   ind->index_scale_lower, ind->index_scale_upper,
+                   ind->dimquads, ind->cutnside, ind->cutnsweep,
+                   f->healpix);
+            nbad++;
+        }
+    }
+    if (!nbad && !*first)
+        *first = ind;
+    else
+        index_free(ind);
+
+    nsum = fits_check_datasums(fn, &nchecked);
+    if (nsum) {
+        logmsg("Shard %i: %s\n", s->hp, (nsum < 0) ? "failed to check DATASUMs" :
+               "DATASUM mismatch");
+        nbad++;
+    } else if (nchecked)
+        logverb("Shard %i: %i DATASUMs ok\n", s->hp, nchecked);
+    free(fn);
+    return nbad;
+}
+
+static int merge_shards(const char* dir) {
+    struct plan plan;
+    index_t* first = NULL;
+    int nok = 0, nempty = 0, nbad = 0;
+    size_t i;
+    int rtn = -1;
+
+    if (read_plan(dir, &plan))
+        goto bailout;
+    for (i=0; i<bl_size(plan.shards); i++) {
+        struct shard* s = bl_access(plan.shards, i);
+        char* ifn = join_path(dir, s->indexfn);
+        char* cfn = join_path(dir, s->catfn);
+        anbool haveindex = file_exists(ifn);
+        anbool havecat = file_exists(cfn);
+        free(ifn);
+        free(cfn);
+        if (!haveindex) {
+            if (havecat) {
+                logmsg("Shard %i: missing output %s\n", s->hp, s->indexfn);
+                nbad++;
+            } else {
+                // hpsplit writes nothing for empty healpixes.
+                logverb("Shard %i: no stars\n", s->hp);
+                nempty++;
+            }
+            continue;
+        }
+        if (check_shard(dir, &plan, s, &first))
+            nbad++;
+        else
+            nok++;
+    }
+    logmsg("%i shards ok, %i empty, %i bad\n", nok, nempty, nbad);
+    if (nbad) {
+        ERROR("%i shards failed; not writing the index manifest", nbad);
+        goto bailout;
+    }
+    if (!nok) {
+        ERROR("No shards have been built");
+        goto bailout;
+    }
+    if (index_manifest_scan(dir, INDEX_MANIFEST_UPDATE, NULL)) {
+        ERROR("Failed to write the index manifest in \"%s\"", dir);
+        goto bailout;
+    }
+    logmsg("Registered index %i: %i shards in %s/%s\n", plan.indexid, nok,
+           dir, INDEX_MANIFEST_FILENAME);
+    rtn = 0;
+ bailout:
+    if (first)
+        index_free(first);
+    if (plan.shards)
+        free_plan(&plan);
+    return rtn;
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    char* outdir = NULL;
+    char* racol = "RA";
+    char* deccol = "Dec";
+    char* bindir = NULL;
+    anbool merge = FALSE;
+    sl* buildargs = sl_new(4);
+    sl* catalogs = sl_new(16);
+    struct plan plan;
+    int i;
+    int rtn = 0;
+
+    memset(&plan, 0, sizeof(plan));
+    plan.bignside = 1;
+    plan.indexid = -1;
+
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 's':
+            plan.bignside = atoi(optarg);
+            break;
+        case 'N':
+            plan.nside = atoi(optarg);
+            break;
+        case 'm':
+            plan.margin = atoi(optarg);
+            break;
+        case 'I':
+            plan.indexid = atoi(optarg);
+            break;
+        case 'A':
+            racol = optarg;
+            break;
+        case 'D':
+            deccol = optarg;
+            break;
+        case 'a':
+            sl_append(buildargs, optarg);
+            break;
+        case 'b':
+            bindir = optarg;
+            break;
+        case 'M':
+            merge = TRUE;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (merge) {
+        if (optind != argc - 1) {
+            printHelp(argv[0]);
+            exit(-1);
+        }
+        rtn = merge_shards(argv[optind]);
+    } else {
+        if (!outdir || optind == argc || plan.nside <= 0 ||
+            plan.indexid < 0 || plan.bignside <= 0) {
+            printHelp(argv[0]);
+            exit(-1);
+        }
+        if (plan.nside % plan.bignside) {
+            ERROR("Nside (%i) must be a multiple of the big healpix Nside (%i)",
+                  plan.nside, plan.bignside);
+            exit(-1);
+        }
+        for (i=optind; i<argc; i++)
+            sl_append(catalogs, argv[i]);
+        plan.shards = bl_new(64, sizeof(struct shard));
+        rtn = plan_shards(outdir, &plan, catalogs, racol, deccol, buildargs,
+                          bindir);
+        free_plan(&plan);
+    }
+    sl_free2(catalogs);
+    sl_free2(buildargs);
+    if (rtn)
+        errors_print_stack(stderr);
+    return rtn;
+}
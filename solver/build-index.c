@@ -26,9 +26,11 @@
 #include "unpermute-quads.h"
 #include "unpermute-stars.h"
 #include "bl.h"
+#include "oset.h"
 #include "ioutils.h"
 #include "rdlist.h"
 #include "kdtree.h"
+#include "an-alloc.h"
 #include "hpquads.h"
 #include "sip.h"
 #include "sip_qfits.h"
@@ -38,11 +40,22 @@
 #include "fitsioutils.h"
 #include "permutedsort.h"
 #include "mathutil.h"
+#include "healpix.h"
+#include "starutil.h"
+
+// For updating an index: the healpixes to build quads in, and the old
+// quads to keep (as star indices into the new catalog).
+struct index_update {
+    int64_t* cells;
+    int ncells;
+    unsigned int* keep;
+    int nkeep;
+};
 
 static void add_boilerplate(index_params_t* p, qfits_header* hdr) {
 }
 
-static int step_hpquads(index_params_t* p,
+static int step_hpquads(index_params_t* p, const struct index_update* up,
                         codefile_t** p_codes, quadfile_t** p_quads,
                         char** p_codefn, char** p_quadfn, 
                         startree_t* starkd, const char* skdtfn,
@@ -55,11 +68,21 @@ static int step_hpquads(index_params_t* p,
     if (p->inmemory) {
         codes = codefile_open_in_memory();
         quads = quadfile_open_in_memory();
-        if (hpquads(starkd, codes, quads, p->Nside,
-                    p->qlo, p->qhi, p->dimquads, p->passes, p->Nreuse, p->Nloosen,
-                    p->indexid, p->scanoccupied,
-                    p->hpquads_sort_data, p->hpquads_sort_func, p->hpquads_sort_size,
-                    p->args, p->argc)) {
+        if (up) {
+            if (hpquads_update(starkd, codes, quads, p->Nside,
+                               p->qlo, p->qhi, p->dimquads, p->passes, p->Nreuse,
+                               p->Nloosen, p->indexid, p->hpquads_threads,
+                               up->cells, up->ncells, up->keep, up->nkeep,
+                               p->hpquads_sort_data, p->hpquads_sort_func,
+                               p->hpquads_sort_size, p->args, p->argc)) {
+                ERROR("hpquads failed");
+                return -1;
+            }
+        } else if (hpquads(starkd, codes, quads, p->Nside,
+                           p->qlo, p->qhi, p->dimquads, p->passes, p->Nreuse, p->Nloosen,
+                           p->indexid, p->scanoccupied, p->hpquads_threads,
+                           p->hpquads_sort_data, p->hpquads_sort_func, p->hpquads_sort_size,
+                           p->args, p->argc)) {
             ERROR("hpquads failed");
             return -1;
         }
@@ -77,6 +100,8 @@ static int step_hpquads(index_params_t* p,
         }
 
     } else {
+        // (updates are always built in memory)
+        assert(!up);
         quadfn = create_temp_file("quad", p->tempdir);
         sl_append_nocopy(tempfiles, quadfn);
         codefn = create_temp_file("code", p->tempdir);
@@ -84,7 +109,7 @@ static int step_hpquads(index_params_t* p,
 
         if (hpquads_files(skdtfn, codefn, quadfn, p->Nside,
                           p->qlo, p->qhi, p->dimquads, p->passes, p->Nreuse, p->Nloosen,
-                          p->indexid, p->scanoccupied, 
+                          p->indexid, p->scanoccupied, p->hpquads_threads,
                           p->hpquads_sort_data, p->hpquads_sort_func, p->hpquads_sort_size,
                           p->args, p->argc)) {
             ERROR("hpquads failed");
@@ -101,6 +126,14 @@ static int step_hpquads(index_params_t* p,
     return 0;
 }
 
+static int codetree_buildopts(const index_params_t* p) {
+    return p->pack_codes ? KD_BUILD_PACK_DATA : 0;
+}
+
+static int merge_index_opts(const index_params_t* p) {
+    return p->quad_xyz ? MERGE_INDEX_QUAD_XYZ : 0;
+}
+
 static int step_codetree(index_params_t* p,
                          codefile_t* codes, codetree_t** p_codekd,
                          const char* codefn, char** p_ckdtfn,
@@ -111,7 +144,8 @@ static int step_codetree(index_params_t* p,
     if (p->inmemory) {
         logmsg("Building code kdtree from %i codes\n", codes->numcodes);
         logmsg("dim: %i\n", codefile_dimcodes(codes));
-        codekd = codetree_build(codes, 0, 0, 0, 0, p->args, p->argc);
+        codekd = codetree_build(codes, 0, 0, 0, codetree_buildopts(p),
+                                p->nthreads, p->args, p->argc);
         if (!codekd) {
             ERROR("Failed to build code kdtree");
             return -1;
@@ -125,7 +159,8 @@ static int step_codetree(index_params_t* p,
         ckdtfn = create_temp_file("ckdt", p->tempdir);
         sl_append_nocopy(tempfiles, ckdtfn);
 
-        if (codetree_files(codefn, ckdtfn, 0, 0, 0, 0, p->args, p->argc)) {
+        if (codetree_files(codefn, ckdtfn, 0, 0, 0, codetree_buildopts(p),
+                           p->nthreads, p->args, p->argc)) {
             ERROR("codetree failed");
             return -1;
         }
@@ -150,13 +185,14 @@ static int step_unpermute_quads(index_params_t* p,
     logmsg("Unpermute-quads...\n");
     if (p->inmemory) {
         quads3 = quadfile_open_in_memory();
-        if (unpermute_quads(quads2, codekd, quads3, &codekd2, p->args, p->argc)) {
+        if (unpermute_quads(quads2, codekd, quads3, &codekd2, p->nthreads,
+                            p->args, p->argc)) {
             ERROR("Failed to unpermute-quads");
             return -1;
         }
         // unpermute-quads makes a shallow copy of the tree, so don't just codetree_close(codekd)...
-        free(codekd->tree->perm);
-        free(codekd->tree);
+        an_alloc_free(AN_ALLOC_LIBKD, codekd->tree->perm);
+        an_alloc_free(AN_ALLOC_LIBKD, codekd->tree);
         codekd->tree = NULL;
         codetree_close(codekd);
 
@@ -176,7 +212,8 @@ static int step_unpermute_quads(index_params_t* p,
         sl_append_nocopy(tempfiles, quad3fn);
         logmsg("Unpermuting quads from %s and %s to %s and %s\n", quad2fn, ckdtfn, quad3fn, ckdt2fn);
         if (unpermute_quads_files(quad2fn, ckdtfn,
-                                  quad3fn, ckdt2fn, p->args, p->argc)) {
+                                  quad3fn, ckdt2fn, p->nthreads,
+                                  p->args, p->argc)) {
             ERROR("Failed to unpermute-quads");
             return -1;
         }
@@ -189,12 +226,27 @@ static int step_unpermute_quads(index_params_t* p,
     return 0;
 }
 
+// Index files whose stars are those of the star kdtree in file
+// "skdtfn" say so, so that the engine can load those stars just once
+// for all of them (see engine_autoindex_search_paths()).
+static void add_shared_skdt_headers(qfits_header* hdr, const char* skdtfn,
+                                    startree_t* starkd) {
+    char* base = basename_safe(skdtfn);
+    qfits_header_add(hdr, "SKDTFN", base, "Stars are those of this file", NULL);
+    fits_header_add_int(hdr, "SKDTN", startree_N(starkd),
+                        "Number of stars in SKDTFN");
+    free(base);
+}
+
+// "shared_skdtfn": if the index's stars are shared with other indexes,
+// the file they're from.
 static int step_merge_index(index_params_t* p,
                             codetree_t* codekd2, quadfile_t* quads3,
                             startree_t* starkd2,
                             index_t** p_index,
                             const char* ckdt2fn, const char* quad3fn,
-                            const char* skdt2fn, const char* indexfn) {
+                            const char* skdt2fn, const char* indexfn,
+                            const char* shared_skdtfn) {
     index_t* index = NULL;
 
     if (p->inmemory) {
@@ -208,6 +260,8 @@ static int step_merge_index(index_params_t* p,
         hdr = quadfile_get_header(index->quads);
         if (hdr)
             add_boilerplate(p, hdr);
+        if (hdr && shared_skdtfn)
+            add_shared_skdt_headers(hdr, shared_skdtfn, starkd2);
 
         /* When closing:
          kdtree_free(codekd2->tree);
@@ -236,7 +290,11 @@ static int step_merge_index(index_params_t* p,
         hdr = quadfile_get_header(quad);
         if (hdr)
             add_boilerplate(p, hdr);
-        if (merge_index(quad, code, star, indexfn)) {
+        if (hdr && shared_skdtfn)
+            add_shared_skdt_headers(hdr, shared_skdtfn, star);
+        if (merge_index_with_bins(quad, code, star, indexfn,
+                                  merge_index_opts(p), p->scale_bins,
+                                  p->sky_bins_nside)) {
             ERROR("Failed to write merged index");
             return -1;
         }
@@ -247,6 +305,32 @@ static int step_merge_index(index_params_t* p,
     return 0;
 }
 
+// An index built in memory is either handed back to the caller or, if
+// the caller didn't ask for it, written to "indexfn" in one pass and
+// freed -- except for the star kdtree if it belongs to the caller.
+static int finish_index(index_params_t* p, index_t* index, index_t** p_index,
+                        const char* indexfn, anbool keep_starkd) {
+    int rtn = 0;
+    if (p_index) {
+        *p_index = index;
+        return 0;
+    }
+    logmsg("Writing to file %s\n", indexfn);
+    if (merge_index_with_bins(index->quads, index->codekd, index->starkd,
+                              indexfn, merge_index_opts(p), p->scale_bins,
+                              p->sky_bins_nside)) {
+        ERROR("Failed to write index file \"%s\"", indexfn);
+        rtn = -1;
+    }
+    // (kdtree_fits_close() would free only the struct, not the data)
+    kdtree_free(index->codekd->tree);
+    index->codekd->tree = NULL;
+    if (keep_starkd)
+        index->starkd = NULL;
+    index_free(index);
+    return rtn;
+}
+
 static void step_delete_tempfiles(index_params_t* p, sl* tempfiles) {
     if (p->delete_tempfiles) {
         int i;
@@ -292,6 +376,7 @@ int build_index_shared_skdt(const char* skdtfn,
     char* quad3fn=NULL;
     char* ckdt2fn=NULL;
 
+    index_t* index = NULL;
     sl* tempfiles;
 
     if (!p->UNside)
@@ -299,8 +384,8 @@ int build_index_shared_skdt(const char* skdtfn,
 
     assert(p->Nside);
 
-    if (p->inmemory && !p_index) {
-        ERROR("If you set inmemory, you must set p_index");
+    if (p->inmemory && !p_index && !indexfn) {
+        ERROR("If you set inmemory, you must set p_index or indexfn");
         return -1;
     }
     if (!p->inmemory && !indexfn) {
@@ -347,7 +432,7 @@ int build_index_shared_skdt(const char* skdtfn,
     p->hpquads_sort_size = sizeof(double);
 
     // hpquads
-    if (step_hpquads(p, &codes, &quads, &codefn, &quadfn,
+    if (step_hpquads(p, NULL, &codes, &quads, &codefn, &quadfn,
                      starkd, skdtfn, tempfiles))
         return -1;
 
@@ -367,8 +452,10 @@ int build_index_shared_skdt(const char* skdtfn,
         return -1;
 
     // merge-index...
-    if (step_merge_index(p, codekd2, quads3, starkd2, p_index,
-                         ckdt2fn, quad3fn, skdtfn, indexfn))
+    if (step_merge_index(p, codekd2, quads3, starkd2, &index,
+                         ckdt2fn, quad3fn, skdtfn, indexfn, skdtfn))
+        return -1;
+    if (index && finish_index(p, index, p_index, indexfn, TRUE))
         return -1;
 
     step_delete_tempfiles(p, tempfiles);
@@ -383,11 +470,12 @@ int build_index_shared_skdt(const char* skdtfn,
     return rtn;
 }
 
-int build_index(fitstable_t* catalog, index_params_t* p,
-                index_t** p_index, const char* indexfn) {
-
-    fitstable_t* uniform;
-
+// Builds the star kdtree from the uniformized catalog "uniform" (which
+// is closed), then the quads, and merges them into the index.
+static int build_index_from_uniform(fitstable_t* uniform, index_params_t* p,
+                                    const struct index_update* up,
+                                    index_t** p_index, const char* indexfn,
+                                    sl* tempfiles) {
     // star kdtree
     startree_t* starkd = NULL;
     fitstable_t* startag = NULL;
@@ -408,10 +496,8 @@ int build_index(fitstable_t* catalog, index_params_t* p,
     quadfile_t* quads3 = NULL;
     codetree_t* codekd2 = NULL;
 
-    //index_t* index = NULL;
+    index_t* index = NULL;
 
-    sl* tempfiles;
-    char* unifn=NULL;
     char* skdtfn=NULL;
     char* quadfn=NULL;
     char* codefn=NULL;
@@ -421,70 +507,9 @@ int build_index(fitstable_t* catalog, index_params_t* p,
     char* quad3fn=NULL;
     char* ckdt2fn=NULL;
 
-    if (!p->UNside)
-        p->UNside = p->Nside;
-
-    assert(p->Nside);
-
-    if (p->inmemory && !p_index) {
-        ERROR("If you set inmemory, you must set p_index");
-        return -1;
-    }
-    if (!p->inmemory && !indexfn) {
-        ERROR("If you set !inmemory, you must set indexfn");
-        return -1;
-    }
-
-    tempfiles = sl_new(4);
-
-    if (p->inmemory)
-        uniform = fitstable_open_in_memory();
-    else {
-        unifn = create_temp_file("uniform", p->tempdir);
-        sl_append_nocopy(tempfiles, unifn);
-        uniform = fitstable_open_for_writing(unifn);
-    }
-    if (!uniform) {
-        ERROR("Failed to open output table %s", unifn);
-        return -1;
-    }
-
-    if (uniformize_catalog(catalog, uniform, p->racol, p->deccol,
-                           p->sortcol, p->sortasc, p->brightcut,
-                           p->bighp, p->bignside, p->margin,
-                           p->UNside, p->dedup, p->sweeps, p->args, p->argc)) {
-        return -1;
-    }
-
-    if (fitstable_fix_primary_header(uniform)) {
-        ERROR("Failed to fix output table");
-        return -1;
-    }
-
-    if (p->inmemory) {
-        if (fitstable_switch_to_reading(uniform)) {
-            ERROR("Failed to switch uniformized table to read-mode");
-            return -1;
-        }
-    } else {
-        if (fitstable_close(uniform)) {
-            ERROR("Failed to close output table");
-            return -1;
-        }
-    }
-    fitstable_close(catalog);
-
-    // startree
     if (!p->inmemory) {
         skdtfn = create_temp_file("skdt", p->tempdir);
         sl_append_nocopy(tempfiles, skdtfn);
-
-        logverb("Reading uniformized catalog %s...\n", unifn);
-        uniform = fitstable_open(unifn);
-        if (!uniform) {
-            ERROR("Failed to open uniformized catalog");
-            return -1;
-        }
     }
 
     // DEBUG -- print RA,Dec from uniform catalog.
@@ -511,10 +536,13 @@ int build_index(fitstable_t* catalog, index_params_t* p,
         int datatype = KDT_DATA_U32;
         int treetype = KDT_TREE_U32;
         int buildopts = KD_BUILD_SPLIT;
+        if (p->pack_stars)
+            buildopts |= KD_BUILD_PACK_DATA;
 
         logverb("Building star kdtree from %i stars\n", fitstable_nrows(uniform));
         starkd = startree_build(uniform, p->racol, p->deccol, datatype, treetype,
-                                buildopts, Nleaf, p->args, p->argc);
+                                buildopts, Nleaf, p->nthreads,
+                                p->args, p->argc);
         if (!starkd) {
             ERROR("Failed to create star kdtree");
             return -1;
@@ -544,7 +572,8 @@ int build_index(fitstable_t* catalog, index_params_t* p,
                     return -1;
                 }
             }
-            if (startree_write_tagalong_table(uniform, startag, p->racol, p->deccol, NULL, p->drop_radec)) {
+            if (startree_write_tagalong_table(uniform, startag, p->racol, p->deccol, NULL, p->drop_radec,
+                                              p->nthreads)) {
                 ERROR("Failed to write tag-along table");
                 return -1;
             }
@@ -565,7 +594,7 @@ int build_index(fitstable_t* catalog, index_params_t* p,
     fitstable_close(uniform);
 
     // hpquads
-    if (step_hpquads(p, &codes, &quads, &codefn, &quadfn, 
+    if (step_hpquads(p, up, &codes, &quads, &codefn, &quadfn,
                      starkd, skdtfn,
                      tempfiles))
         return -1;
@@ -580,7 +609,7 @@ int build_index(fitstable_t* catalog, index_params_t* p,
     if (p->inmemory) {
         quads2 = quadfile_open_in_memory();
         if (unpermute_stars(starkd, quads, &starkd2, quads2,
-                            TRUE, FALSE, p->args, p->argc)) {
+                            TRUE, FALSE, p->nthreads, p->args, p->argc)) {
             ERROR("Failed to unpermute-stars");
             return -1;
         }
@@ -597,7 +626,7 @@ int build_index(fitstable_t* catalog, index_params_t* p,
             startag2->table = fits_copy_table(startag->table);
             startag2->table->nr = 0;
             startag2->header = qfits_header_copy(startag->header);
-            if (unpermute_stars_tagalong(starkd, startag2)) {
+            if (unpermute_stars_tagalong(starkd, startag2, p->nthreads)) {
                 ERROR("Failed to unpermute-stars tag-along data");
                 return -1;
             }
@@ -605,8 +634,8 @@ int build_index(fitstable_t* catalog, index_params_t* p,
         }
 
         // unpermute-stars makes a shallow copy of the tree, so don't just startree_close(starkd)...
-        free(starkd->tree->perm);
-        free(starkd->tree);
+        an_alloc_free(AN_ALLOC_LIBKD, starkd->tree->perm);
+        an_alloc_free(AN_ALLOC_LIBKD, starkd->tree);
         starkd->tree = NULL;
         startree_close(starkd);
 
@@ -618,7 +647,7 @@ int build_index(fitstable_t* catalog, index_params_t* p,
 
         logmsg("Unpermuting stars from %s and %s to %s and %s\n", skdtfn, quadfn, skdt2fn, quad2fn);
         if (unpermute_stars_files(skdtfn, quadfn, skdt2fn, quad2fn,
-                                  TRUE, FALSE, p->args, p->argc)) {
+                                  TRUE, FALSE, p->nthreads, p->args, p->argc)) {
             ERROR("Failed to unpermute-stars");
             return -1;
         }
@@ -631,11 +660,88 @@ int build_index(fitstable_t* catalog, index_params_t* p,
 
 
     // index
-    if (step_merge_index(p, codekd2, quads3, starkd2, p_index,
-                         ckdt2fn, quad3fn, skdt2fn, indexfn))
+    if (step_merge_index(p, codekd2, quads3, starkd2, &index,
+                         ckdt2fn, quad3fn, skdt2fn, indexfn, NULL))
+        return -1;
+    if (index && finish_index(p, index, p_index, indexfn, FALSE))
         return -1;
 
     // FIXME -- close codekd2, quads3, starkd2?
+    return 0;
+}
+
+int build_index(fitstable_t* catalog, index_params_t* p,
+                index_t** p_index, const char* indexfn) {
+
+    fitstable_t* uniform;
+    sl* tempfiles;
+    char* unifn=NULL;
+
+    if (!p->UNside)
+        p->UNside = p->Nside;
+
+    assert(p->Nside);
+
+    if (p->inmemory && !p_index && !indexfn) {
+        ERROR("If you set inmemory, you must set p_index or indexfn");
+        return -1;
+    }
+    if (!p->inmemory && !indexfn) {
+        ERROR("If you set !inmemory, you must set indexfn");
+        return -1;
+    }
+
+    tempfiles = sl_new(4);
+
+    if (p->inmemory)
+        uniform = fitstable_open_in_memory();
+    else {
+        unifn = create_temp_file("uniform", p->tempdir);
+        sl_append_nocopy(tempfiles, unifn);
+        uniform = fitstable_open_for_writing(unifn);
+    }
+    if (!uniform) {
+        ERROR("Failed to open output table %s", unifn);
+        return -1;
+    }
+
+    if (uniformize_catalog(catalog, uniform, p->racol, p->deccol,
+                           p->sortcol, p->sortasc, p->brightcut,
+                           p->bighp, p->bignside, p->margin,
+                           p->UNside, p->dedup, p->sweeps, p->nthreads,
+                           p->args, p->argc)) {
+        return -1;
+    }
+
+    if (fitstable_fix_primary_header(uniform)) {
+        ERROR("Failed to fix output table");
+        return -1;
+    }
+
+    if (p->inmemory) {
+        if (fitstable_switch_to_reading(uniform)) {
+            ERROR("Failed to switch uniformized table to read-mode");
+            return -1;
+        }
+    } else {
+        if (fitstable_close(uniform)) {
+            ERROR("Failed to close output table");
+            return -1;
+        }
+    }
+    fitstable_close(catalog);
+
+    if (!p->inmemory) {
+        logverb("Reading uniformized catalog %s...\n", unifn);
+        uniform = fitstable_open(unifn);
+        if (!uniform) {
+            ERROR("Failed to open uniformized catalog");
+            return -1;
+        }
+    }
+
+    if (build_index_from_uniform(uniform, p, NULL, p_index, indexfn, tempfiles))
+        return -1;
 
     step_delete_tempfiles(p, tempfiles);
 
@@ -658,26 +764,8 @@ int build_index_files(const char* infn, int ext, const char* indexfn,
     }
     logmsg("Got %i stars\n", fitstable_nrows(catalog));
 
-    if (p->inmemory) {
-        index_t* index;
-        if (build_index(catalog, p, &index, NULL)) {
-            return -1;
-        }
-        logmsg("Writing to file %s\n", indexfn);
-        if (merge_index(index->quads, index->codekd, index->starkd, indexfn)) {
-            ERROR("Failed to write index file");
-            return -1;
-        }
-        kdtree_free(index->codekd->tree);
-        index->codekd->tree = NULL;
-        index_close(index);
-
-    } else {
-        if (build_index(catalog, p, NULL, indexfn)) {
-            return -1;
-        }
-    }
-
+    if (build_index(catalog, p, NULL, indexfn))
+        return -1;
     return 0;
 }
 
@@ -693,27 +781,599 @@ int build_index_shared_skdt_files(const char* starkdfn, const char* indexfn,
     }
     logmsg("Got %i stars\n", startree_N(skdt));
 
-    if (p->inmemory) {
-        index_t* index;
-        if (build_index_shared_skdt(starkdfn, skdt, p, &index, NULL)) {
+    if (build_index_shared_skdt(starkdfn, skdt, p, NULL, indexfn))
+        return -1;
+    startree_close(skdt);
+    return 0;
+}
+
+
+// The healpixes (at nside "Nside") whose quad searches, of radius
+// "radius" degrees around their centers, reach into healpix "bighp" (at
+// "bignside"): the healpixes inside it plus a ring around it.  If "skhp"
+// is not -1, only those inside healpix "skhp" (at "sknside") are kept,
+// since those are the only ones a full build would have tried.
+static ll* update_cells(int bighp, int bignside, int Nside, double radius,
+                        int skhp, int sknside) {
+    oset* found = oset_new_int64();
+    ll* queue = ll_new(1024);
+    ll* cells = ll_new(1024);
+    oset_iter it;
+    const int64_t* cell;
+    int base, bx, by, x, y, f;
+    size_t i;
+
+    f = Nside / bignside;
+    healpix_decompose_xy(bighp, &base, &bx, &by, bignside);
+    for (y=by*f; y<(by+1)*f; y++)
+        for (x=bx*f; x<(bx+1)*f; x++) {
+            int64_t hp = healpix_compose_xyl(base, x, y, Nside);
+            oset_insert_int64(found, hp, TRUE);
+            ll_append(queue, hp);
+        }
+    for (i=0; i<ll_size(queue); i++) {
+        int64_t nbrs[8];
+        int j, nn;
+        nn = healpix_get_neighboursl(ll_get(queue, i), nbrs, Nside);
+        for (j=0; j<nn; j++) {
+            double xyz[3];
+            if (oset_contains_int64(found, nbrs[j]))
+                continue;
+            healpixl_to_xyzarr(nbrs[j], Nside, 0.5, 0.5, xyz);
+            if (!healpix_within_range_of_xyz(bighp, bignside, xyz, radius))
+                continue;
+            oset_insert_int64(found, nbrs[j], TRUE);
+            ll_append(queue, nbrs[j]);
+        }
+    }
+    ll_free(queue);
+
+    oset_iter_init(found, &it);
+    while ((cell = oset_iter_next(&it))) {
+        if (skhp != -1) {
+            f = Nside / sknside;
+            healpix_decompose_xyl(*cell, &base, &x, &y, Nside);
+            if (healpix_compose_xy(base, x / f, y / f, sknside) != skhp)
+                continue;
+        }
+        ll_append(cells, *cell);
+    }
+    oset_free(found);
+    return cells;
+}
+
+// Copies rows "inds" of the column like "col" of table "tab" into
+// "dest", whose rows are "rowsize" bytes apart.
+static int copy_column(fitstable_t* tab, const qfits_col* col,
+                       const int* inds, int N, char* dest, size_t rowsize) {
+    size_t sz = (size_t)fits_get_atom_size(col->atom_type) * col->atom_nb;
+    char* data;
+    int i, arraysize;
+    if (!N)
+        return 0;
+    data = fitstable_read_column_array_inds(tab, col->tlabel, col->atom_type,
+                                            inds, N, &arraysize);
+    if (!data)
+        return -1;
+    if (arraysize != col->atom_nb) {
+        ERROR("Column \"%s\" has array size %i, not %i", col->tlabel,
+              arraysize, col->atom_nb);
+        free(data);
+        return -1;
+    }
+    for (i=0; i<N; i++)
+        memcpy(dest + i * rowsize, data + i * sz, sz);
+    free(data);
+    return 0;
+}
+
+// Writes the catalog for an updated index: RA,Dec plus the old index's
+// tag-along columns, for the "Nnew" rows "newrows" of "uniform" followed
+// by the old index's stars "oldrows".
+static fitstable_t* update_catalog(index_t* old, fitstable_t* uniform,
+                                   const int* newrows, int Nnew,
+                                   const int* oldrows, int Nold,
+                                   index_params_t* p) {
+    char* keys[] = { "HEALPIX", "HPNSIDE", "ALLSKY", "JITTER", "CUTNSIDE",
+                     "CUTMARG", "CUTDEDUP", "CUTNSWEP" };
+    tfits_type dubl = fitscolumn_double_type();
+    fitstable_t* cat;
+    fitstable_t* tag;
+    qfits_header* hdr;
+    il* tagcols;
+    double* radec;
+    char* rows;
+    size_t rowsize;
+    size_t off;
+    int i, j, N;
+
+    N = Nnew + Nold;
+    cat = fitstable_open_in_memory();
+    hdr = fitstable_get_primary_header(cat);
+    for (i=0; i<sizeof(keys)/sizeof(char*); i++)
+        an_fits_copy_header(startree_header(old->starkd), hdr, keys[i]);
+
+    fitstable_add_write_column(cat, dubl, p->racol, "deg");
+    fitstable_add_write_column(cat, dubl, p->deccol, "deg");
+    rowsize = 2 * sizeof(double);
+    tagcols = il_new(16);
+    tag = startree_get_tagalong(old->starkd);
+    for (i=0; tag && i<tag->table->nc; i++) {
+        qfits_col* col = tag->table->col + i;
+        if (strcaseeq(col->tlabel, p->racol) || strcaseeq(col->tlabel, p->deccol)) {
+            // the index kept RA,Dec in its tag-along table.
+            p->drop_radec = FALSE;
+            continue;
+        }
+        fitstable_add_write_column_array(cat, col->atom_type, col->atom_nb,
+                                         col->tlabel, col->tunit);
+        il_append(tagcols, i);
+        rowsize += (size_t)fits_get_atom_size(col->atom_type) * col->atom_nb;
+    }
+
+    rows = malloc(MAX(N, 1) * rowsize);
+    radec = malloc(MAX(N, 1) * 2 * sizeof(double));
+    if (Nnew) {
+        double* ra = fitstable_read_column_inds(uniform, p->racol, dubl, newrows, Nnew);
+        double* dec = fitstable_read_column_inds(uniform, p->deccol, dubl, newrows, Nnew);
+        if (!ra || !dec) {
+            ERROR("Failed to read RA,Dec of the new stars");
+            free(ra);
+            free(dec);
+            goto bailout;
+        }
+        for (i=0; i<Nnew; i++) {
+            radec[2*i] = ra[i];
+            radec[2*i+1] = dec[i];
+        }
+        free(ra);
+        free(dec);
+    }
+    for (i=0; i<Nold; i++) {
+        double xyz[3];
+        startree_get(old->starkd, oldrows[i], xyz);
+        xyzarr2radecdegarr(xyz, radec + 2 * (Nnew + i));
+    }
+    for (i=0; i<N; i++)
+        memcpy(rows + i * rowsize, radec + 2*i, 2 * sizeof(double));
+
+    off = 2 * sizeof(double);
+    for (j=0; j<il_size(tagcols); j++) {
+        qfits_col* col = tag->table->col + il_get(tagcols, j);
+        if (copy_column(uniform, col, newrows, Nnew, rows + off, rowsize)) {
+            ERROR("The catalog must have the index's tag-along column \"%s\"",
+                  col->tlabel);
+            goto bailout;
+        }
+        if (copy_column(tag, col, oldrows, Nold, rows + Nnew * rowsize + off, rowsize)) {
+            ERROR("Failed to read tag-along column \"%s\" from the index",
+                  col->tlabel);
+            goto bailout;
+        }
+        off += (size_t)fits_get_atom_size(col->atom_type) * col->atom_nb;
+    }
+
+    if (fitstable_write_primary_header(cat) ||
+        fitstable_write_header(cat)) {
+        ERROR("Failed to write headers of the updated catalog");
+        goto bailout;
+    }
+    for (i=0; i<N; i++)
+        if (fitstable_write_row_data(cat, rows + i * rowsize)) {
+            ERROR("Failed to write the updated catalog");
+            goto bailout;
+        }
+    if (fitstable_fix_header(cat) ||
+        fitstable_switch_to_reading(cat)) {
+        ERROR("Failed to switch the updated catalog to read-mode");
+        goto bailout;
+    }
+    free(rows);
+    free(radec);
+    il_free(tagcols);
+    return cat;
+
+ bailout:
+    free(rows);
+    free(radec);
+    il_free(tagcols);
+    fitstable_close(cat);
+    return NULL;
+}
+
+int build_index_update(index_t* old, fitstable_t* catalog, index_params_t* params,
+                       index_t** p_index, const char* indexfn) {
+    index_params_t myp;
+    index_params_t* p = &myp;
+    struct index_update up;
+    fitstable_t* uniform = NULL;
+    fitstable_t* cat = NULL;
+    il* oldrows = NULL;
+    il* newrows = NULL;
+    int* newid = NULL;
+    ll* cells = NULL;
+    bl* keep = NULL;
+    double* sortdata = NULL;
+    kdtree_qres_t* res = NULL;
+    sl* tempfiles = NULL;
+    double radius;
+    int i, d, Nold, Nuni, rtn = -1;
+
+    // copy, since we fill in the index's own settings.
+    memcpy(p, params, sizeof(index_params_t));
+    p->inmemory = TRUE;
+
+    if (!p_index && !indexfn) {
+        ERROR("You must set p_index or indexfn");
+        return -1;
+    }
+    if (!old->starkd || !old->quads || !old->codekd) {
+        ERROR("The index to update must be fully loaded");
+        return -1;
+    }
+    if (p->bighp < 0 || p->bignside < 1) {
+        ERROR("You must give the healpix (and its nside) to update");
+        return -1;
+    }
+    if (!p->Nside || p->Nside % p->bignside) {
+        ERROR("The quad-building nside (%i) must be that of the index, and a "
+              "multiple of the updated healpix's nside (%i)", p->Nside, p->bignside);
+        return -1;
+    }
+    if (old->healpix != -1) {
+        int base, x, y, f;
+        if (p->bignside % old->hpnside) {
+            ERROR("The updated healpix's nside (%i) must be a multiple of the "
+                  "index's (%i)", p->bignside, old->hpnside);
             return -1;
         }
-        logmsg("Writing to file %s\n", indexfn);
-        if (merge_index(index->quads, index->codekd, index->starkd, indexfn)) {
-            ERROR("Failed to write index file \"%s\"", indexfn);
+        f = p->bignside / old->hpnside;
+        healpix_decompose_xy(p->bighp, &base, &x, &y, p->bignside);
+        if (healpix_compose_xy(base, x / f, y / f, old->hpnside) != old->healpix) {
+            ERROR("Healpix %i (nside %i) is not inside the index's healpix %i (nside %i)",
+                  p->bighp, p->bignside, old->healpix, old->hpnside);
             return -1;
         }
-        // FIXME?  Why close codekd independently?
-        kdtree_free(index->codekd->tree);
-        index->codekd->tree = NULL;
-        index_close(index);
+    }
+    if (old->starkd->tree->perm) {
+        ERROR("The index's star kdtree must be un-permuted");
+        return -1;
+    }
 
-    } else {
-        if (build_index_shared_skdt(starkdfn, skdt, p, NULL, indexfn)) {
-            return -1;
+    // the quads and uniformization must match the rest of the index.
+    p->qlo = arcsec2arcmin(old->index_scale_lower);
+    p->qhi = arcsec2arcmin(old->index_scale_upper);
+    p->dimquads = old->dimquads;
+    if (!p->indexid)
+        p->indexid = old->indexid;
+    if (old->cutnside > 0)
+        p->UNside = old->cutnside;
+    if (!p->UNside)
+        p->UNside = p->Nside;
+    if (old->cutnsweep > 0)
+        p->sweeps = old->cutnsweep;
+    p->dedup = old->cutdedup;
+
+    // the catalog's stars in the healpix.
+    uniform = fitstable_open_in_memory();
+    if (uniformize_catalog(catalog, uniform, p->racol, p->deccol,
+                           p->sortcol, p->sortasc, p->brightcut,
+                           p->bighp, p->bignside, 0,
+                           p->UNside, p->dedup, p->sweeps, p->nthreads,
+                           p->args, p->argc) ||
+        fitstable_fix_primary_header(uniform) ||
+        fitstable_switch_to_reading(uniform)) {
+        ERROR("Failed to uniformize the catalog");
+        goto cleanup;
+    }
+    fitstable_close(catalog);
+
+    // the index's stars outside it.
+    Nold = startree_N(old->starkd);
+    oldrows = il_new(1024);
+    newid = malloc(MAX(Nold, 1) * sizeof(int));
+    for (i=0; i<Nold; i++) {
+        double xyz[3];
+        newid[i] = -1;
+        startree_get(old->starkd, i, xyz);
+        if (xyzarrtohealpixl(xyz, p->bignside) == p->bighp)
+            continue;
+        il_append(oldrows, i);
+    }
+
+    // drop new stars that duplicate a kept star across the healpix's edge.
+    Nuni = fitstable_nrows(uniform);
+    newrows = il_new(1024);
+    {
+        tfits_type dubl = fitscolumn_double_type();
+        double* ra = fitstable_read_column(uniform, p->racol, dubl);
+        double* dec = fitstable_read_column(uniform, p->deccol, dubl);
+        double r2 = arcsec2distsq(p->dedup);
+        if (!ra || !dec) {
+            ERROR("Failed to read RA,Dec of the uniformized catalog");
+            free(ra);
+            free(dec);
+            goto cleanup;
         }
+        for (i=0; i<Nuni; i++) {
+            double xyz[3];
+            anbool dup = FALSE;
+            if (p->dedup > 0) {
+                int k;
+                radecdeg2xyzarr(ra[i], dec[i], xyz);
+                res = kdtree_rangesearch_options_reuse(old->starkd->tree, res, xyz, r2,
+                                                       KD_OPTIONS_SMALL_RADIUS);
+                for (k=0; k<res->nres; k++) {
+                    double oxyz[3];
+                    startree_get(old->starkd, res->inds[k], oxyz);
+                    if (xyzarrtohealpixl(oxyz, p->bignside) != p->bighp)
+                        dup = TRUE;
+                }
+            }
+            if (!dup)
+                il_append(newrows, i);
+        }
+        free(ra);
+        free(dec);
     }
-    return 0;
+    for (i=0; i<il_size(oldrows); i++)
+        newid[il_get(oldrows, i)] = il_size(newrows) + i;
+    logmsg("Replacing %i of the index's %i stars, in healpix %i (nside %i), "
+           "with %zu catalog stars.\n", Nold - (int)il_size(oldrows), Nold,
+           p->bighp, p->bignside, il_size(newrows));
+
+    {
+        int* newarr = il_to_array(newrows);
+        int* oldarr = il_to_array(oldrows);
+        cat = update_catalog(old, uniform, newarr, il_size(newrows),
+                             oldarr, il_size(oldrows), p);
+        free(newarr);
+        free(oldarr);
+    }
+    if (!cat)
+        goto cleanup;
+    fitstable_close(uniform);
+    uniform = NULL;
+
+    // the healpixes whose quads can change: those whose star searches
+    // (as in hpquads) reach into the updated healpix.
+    radius = 1.01 * (arcmin2dist(healpix_side_length_arcmin(p->Nside)) * M_SQRT1_2 +
+                     0.5 * arcmin2dist(p->qhi));
+    cells = update_cells(p->bighp, p->bignside, p->Nside, rad2deg(radius),
+                         old->healpix, old->hpnside);
+
+    // keep the other quads.
+    keep = bl_new(4096, p->dimquads * sizeof(unsigned int));
+    for (i=0; i<quadfile_nquads(old->quads); i++) {
+        unsigned int stars[DQMAX];
+        double xyzA[3], xyzB[3], mid[3];
+        anbool ok = TRUE;
+        if (quadfile_get_stars(old->quads, i, stars)) {
+            ERROR("Failed to read quad %i", i);
+            goto cleanup;
+        }
+        startree_get(old->starkd, stars[0], xyzA);
+        startree_get(old->starkd, stars[1], xyzB);
+        star_midpoint(mid, xyzA, xyzB);
+        if (ll_sorted_contains(cells, xyzarrtohealpixl(mid, p->Nside)))
+            continue;
+        for (d=0; d<p->dimquads; d++) {
+            if (newid[stars[d]] == -1)
+                ok = FALSE;
+            stars[d] = newid[stars[d]];
+        }
+        if (ok)
+            bl_append(keep, stars);
+    }
+    logmsg("Rebuilding the quads of %zu healpixes; keeping %zu of the index's %i quads.\n",
+           ll_size(cells), bl_size(keep), quadfile_nquads(old->quads));
+
+    up.ncells = ll_size(cells);
+    up.cells = malloc(MAX(up.ncells, 1) * sizeof(int64_t));
+    ll_copy(cells, 0, up.ncells, up.cells);
+    up.nkeep = bl_size(keep);
+    up.keep = malloc(MAX(up.nkeep, 1) * p->dimquads * sizeof(unsigned int));
+    bl_copy(keep, 0, up.nkeep, up.keep);
+
+    if (p->sortcol && fitstable_find_fits_column(cat, p->sortcol, NULL, NULL, NULL) == 0) {
+        // the kept stars are in kdtree order, so sort on the catalog column.
+        sortdata = fitstable_read_column(cat, p->sortcol, fitscolumn_double_type());
+        p->hpquads_sort_data = sortdata;
+        p->hpquads_sort_func = (p->sortasc ? compare_doubles_asc : compare_doubles_desc);
+        p->hpquads_sort_size = sizeof(double);
+    }
+
+    tempfiles = sl_new(4);
+    rtn = build_index_from_uniform(cat, p, &up, p_index, indexfn, tempfiles);
+    cat = NULL;
+    sl_free2(tempfiles);
+    free(up.cells);
+    free(up.keep);
+
+ cleanup:
+    if (uniform)
+        fitstable_close(uniform);
+    if (cat)
+        fitstable_close(cat);
+    kdtree_free_query(res);
+    free(sortdata);
+    free(newid);
+    il_free(oldrows);
+    il_free(newrows);
+    if (cells)
+        ll_free(cells);
+    if (keep)
+        bl_free(keep);
+    return rtn;
+}
+
+int build_index_update_files(const char* oldindexfn, const char* catalogfn,
+                             int ext, const char* indexfn, index_params_t* p) {
+    fitstable_t* catalog;
+    index_t* old;
+    int rtn;
+
+    logmsg("Reading index %s...\n", oldindexfn);
+    old = index_load(oldindexfn, 0, NULL);
+    if (!old) {
+        ERROR("Couldn't read index %s", oldindexfn);
+        return -1;
+    }
+    logmsg("Reading %s...\n", catalogfn);
+    if (ext)
+        catalog = fitstable_open_extension_2(catalogfn, ext);
+    else
+        catalog = fitstable_open(catalogfn);
+    if (!catalog) {
+        ERROR("Couldn't read catalog %s", catalogfn);
+        index_free(old);
+        return -1;
+    }
+    logmsg("Got %i stars\n", fitstable_nrows(catalog));
+
+    rtn = build_index_update(old, catalog, p, NULL, indexfn);
+    index_free(old);
+    return rtn;
+}
+
+int build_index_stratum(index_t* old, int sweeplo, int sweephi,
+                        int stratum, int nstrata, index_params_t* params,
+                        index_t** p_index, const char* indexfn) {
+    index_params_t myp;
+    index_params_t* p = &myp;
+    struct index_update up;
+    startree_t* starkd = old->starkd;
+    fitstable_t* cat = NULL;
+    index_t* index = NULL;
+    qfits_header* hdr;
+    sl* tempfiles;
+    bl* keep = NULL;
+    int* rows = NULL;
+    int* newid = NULL;
+    int counts[256];
+    int i, d, v, N, Nkept, rtn = -1;
+
+    memcpy(p, params, sizeof(index_params_t));
+    p->inmemory = TRUE;
+
+    if (!p_index && !indexfn) {
+        ERROR("You must set p_index or indexfn");
+        return -1;
+    }
+    if (!old->starkd || !old->quads || !old->codekd) {
+        ERROR("The index to split must be fully loaded");
+        return -1;
+    }
+    if (starkd->tree->perm) {
+        ERROR("The index's star kdtree must be un-permuted");
+        return -1;
+    }
+    if (!starkd->sweep) {
+        ERROR("The index has no star sweep numbers");
+        return -1;
+    }
+    if (sweeplo < 0 || sweephi > 256 || sweeplo >= sweephi) {
+        ERROR("Bad sweep range [%i, %i)", sweeplo, sweephi);
+        return -1;
+    }
+
+    p->qlo = arcsec2arcmin(old->index_scale_lower);
+    p->qhi = arcsec2arcmin(old->index_scale_upper);
+    p->dimquads = old->dimquads;
+    if (!p->indexid)
+        p->indexid = old->indexid;
+    // (no healpixes are searched for new quads)
+    p->Nside = MAX(old->hpnside, 1);
+
+    // the stars brighter than "sweephi", in the order of their sweeps,
+    // so that the stratum's own sweep numbers follow the index's.
+    N = startree_N(starkd);
+    memset(counts, 0, sizeof(counts));
+    for (i=0; i<N; i++)
+        counts[starkd->sweep[i]]++;
+    Nkept = 0;
+    for (v=0; v<sweephi; v++) {
+        int n = counts[v];
+        counts[v] = Nkept;
+        Nkept += n;
+    }
+    rows = malloc(MAX(Nkept, 1) * sizeof(int));
+    newid = malloc(MAX(N, 1) * sizeof(int));
+    for (i=0; i<N; i++) {
+        v = starkd->sweep[i];
+        newid[i] = -1;
+        if (v >= sweephi)
+            continue;
+        newid[i] = counts[v]++;
+        rows[newid[i]] = i;
+    }
+
+    // the quads whose faintest star is in [sweeplo, sweephi).
+    keep = bl_new(4096, p->dimquads * sizeof(unsigned int));
+    for (i=0; i<quadfile_nquads(old->quads); i++) {
+        unsigned int stars[DQMAX];
+        int maxsweep = 0;
+        if (quadfile_get_stars(old->quads, i, stars)) {
+            ERROR("Failed to read quad %i", i);
+            goto cleanup;
+        }
+        for (d=0; d<p->dimquads; d++)
+            maxsweep = MAX(maxsweep, starkd->sweep[stars[d]]);
+        if (maxsweep < sweeplo || maxsweep >= sweephi)
+            continue;
+        for (d=0; d<p->dimquads; d++)
+            stars[d] = newid[stars[d]];
+        bl_append(keep, stars);
+    }
+    logmsg("Stratum %i of %i (sweeps [%i, %i) of 256): %i of the index's %i stars, "
+           "%zu of its %i quads.\n", stratum, nstrata, sweeplo, sweephi,
+           Nkept, N, bl_size(keep), quadfile_nquads(old->quads));
+    if (!bl_size(keep)) {
+        ERROR("No quads in stratum %i (sweeps [%i, %i))", stratum, sweeplo, sweephi);
+        goto cleanup;
+    }
+
+    cat = update_catalog(old, NULL, NULL, 0, rows, Nkept, p);
+    if (!cat)
+        goto cleanup;
+    // the stratum has only the brighter sweeps.
+    if (old->cutnsweep > 0)
+        fits_header_mod_int(fitstable_get_primary_header(cat), "CUTNSWEP",
+                            MAX(1, (int)round(old->cutnsweep * sweephi / 256.0)),
+                            "number of sweeps");
+
+    up.cells = malloc(sizeof(int64_t));
+    up.ncells = 0;
+    up.nkeep = bl_size(keep);
+    up.keep = malloc(up.nkeep * p->dimquads * sizeof(unsigned int));
+    bl_copy(keep, 0, up.nkeep, up.keep);
+
+    tempfiles = sl_new(4);
+    rtn = build_index_from_uniform(cat, p, &up, &index, NULL, tempfiles);
+    cat = NULL;
+    sl_free2(tempfiles);
+    free(up.cells);
+    free(up.keep);
+    if (rtn)
+        goto cleanup;
+
+    hdr = quadfile_get_header(index->quads);
+    fits_header_add_int(hdr, "STRATUM", stratum, "Sweep stratum of this index file");
+    fits_header_add_int(hdr, "NSTRATA", nstrata, "Number of sweep strata");
+    fits_header_add_int(hdr, "STRATLO", sweeplo, "Quads' faintest star sweep >= this");
+    fits_header_add_int(hdr, "STRATHI", sweephi, "Stars' sweep < this (of 256)");
+    index->stratum = stratum;
+    index->nstrata = nstrata;
+    rtn = finish_index(p, index, p_index, indexfn, FALSE);
+
+ cleanup:
+    if (cat)
+        fitstable_close(cat);
+    if (keep)
+        bl_free(keep);
+    free(rows);
+    free(newid);
+    return rtn;
 }
 
 
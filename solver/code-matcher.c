@@ -0,0 +1,278 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "code-matcher.h"
+#include "codekd.h"
+#include "mathutil.h"
+#include "bl.h"
+#include "errors.h"
+#include "log.h"
+#include "ioutils.h"
+#include "an-alloc.h"
+
+int code_matcher_search(code_matcher_t* m, index_t* index,
+                        const double* codes, int N, const double* tol2s,
+                        kdtree_qres_t** res) {
+    return m->search(m, index, codes, N, tol2s, res);
+}
+
+void code_matcher_free(code_matcher_t* m) {
+    if (!m)
+        return;
+    if (m->free)
+        m->free(m);
+    free(m);
+}
+
+// "kdtree": the solver's own search.
+
+static int kdtree_search(code_matcher_t* m, index_t* index,
+                         const double* codes, int N, const double* tol2s,
+                         kdtree_qres_t** res) {
+    int options = KD_OPTIONS_COMPUTE_DISTS | KD_OPTIONS_NO_RESIZE_RESULTS |
+        KD_OPTIONS_USE_SPLIT;
+    return kdtree_rangesearch_batch(index->codekd->tree, res, codes, N,
+                                    tol2s, options);
+}
+
+// "grid": the codes in a flat array, bucketed by their first two
+// dimensions (the position of star C).
+
+struct code_grid {
+    // the index, and the file it was read from.  (Indexes that aren't
+    // all loaded at once are unloaded and reloaded between runs; the
+    // grid outlives that.)
+    const index_t* index;
+    char* indexfn;
+    int N;
+    int D;
+    // number of cells along each axis
+    int G;
+    double lo[2];
+    // cells per unit code
+    double scale[2];
+    // the codes in cell c are [cellstart[c], cellstart[c+1])
+    int* cellstart;
+    u32* inds;
+    double* codes;
+};
+
+struct grid_matcher {
+    // struct code_grid*
+    pl* grids;
+    pthread_mutex_t lock;
+};
+
+static void code_grid_free(struct code_grid* g) {
+    if (!g)
+        return;
+    free(g->indexfn);
+    an_alloc_free(AN_ALLOC_SOLVER, g->cellstart);
+    an_alloc_free(AN_ALLOC_SOLVER, g->inds);
+    an_alloc_free(AN_ALLOC_SOLVER, g->codes);
+    free(g);
+}
+
+static int grid_cell(const struct code_grid* g, int d, double x) {
+    double c = floor((x - g->lo[d]) * g->scale[d]);
+    if (c < 0)
+        return 0;
+    if (c >= g->G)
+        return g->G - 1;
+    return (int)c;
+}
+
+static struct code_grid* code_grid_new(index_t* index) {
+    const kdtree_t* kd = index->codekd->tree;
+    struct code_grid* g;
+    double hi[2];
+    double* tmp;
+    int* cell;
+    int N, D, i, d;
+
+    N = kd->ndata;
+    D = kd->ndim;
+    tmp = malloc((size_t)N * D * sizeof(double));
+    cell = malloc((size_t)N * sizeof(int));
+    g = calloc(1, sizeof(struct code_grid));
+    if (!tmp || !cell || !g) {
+        SYSERROR("Failed to allocate code grid for %i codes", N);
+        free(tmp);
+        free(cell);
+        free(g);
+        return NULL;
+    }
+    g->index = index;
+    g->indexfn = strdup_safe(index->indexfn);
+    g->N = N;
+    g->D = D;
+    kdtree_copy_data_double(kd, 0, N, tmp);
+
+    for (d=0; d<2; d++) {
+        g->lo[d] = LARGE_VAL;
+        hi[d] = -LARGE_VAL;
+    }
+    for (i=0; i<N; i++)
+        for (d=0; d<2; d++) {
+            g->lo[d] = MIN(g->lo[d], tmp[i*D + d]);
+            hi[d] = MAX(hi[d], tmp[i*D + d]);
+        }
+    // about 16 codes per cell.
+    g->G = MAX(1, MIN(4096, (int)sqrt(N / 16.0)));
+    for (d=0; d<2; d++)
+        g->scale[d] = (hi[d] > g->lo[d]) ? (g->G / (hi[d] - g->lo[d])) : 0.0;
+
+    // counting sort into the cells.
+    g->cellstart = an_alloc_calloc(AN_ALLOC_SOLVER, (size_t)g->G * g->G + 1,
+                                   sizeof(int));
+    g->inds = an_alloc_malloc(AN_ALLOC_SOLVER, (size_t)N * sizeof(u32));
+    g->codes = an_alloc_malloc(AN_ALLOC_SOLVER, (size_t)N * D * sizeof(double));
+    if (!g->cellstart || !g->inds || !g->codes) {
+        SYSERROR("Failed to allocate code grid for %i codes", N);
+        free(tmp);
+        free(cell);
+        code_grid_free(g);
+        return NULL;
+    }
+    for (i=0; i<N; i++) {
+        cell[i] = grid_cell(g, 1, tmp[i*D + 1]) * g->G +
+            grid_cell(g, 0, tmp[i*D + 0]);
+        g->cellstart[cell[i] + 1]++;
+    }
+    for (i=0; i<g->G * g->G; i++)
+        g->cellstart[i+1] += g->cellstart[i];
+    for (i=0; i<N; i++) {
+        int k = g->cellstart[cell[i]]++;
+        g->inds[k] = kdtree_permute(kd, i);
+        memcpy(g->codes + (size_t)k * D, tmp + (size_t)i * D, D * sizeof(double));
+    }
+    // (the counting sort left each cellstart at the next cell's start.)
+    memmove(g->cellstart + 1, g->cellstart, (size_t)g->G * g->G * sizeof(int));
+    g->cellstart[0] = 0;
+    free(tmp);
+    free(cell);
+    logverb("Built a %i x %i code grid for index %s (%i codes).\n",
+            g->G, g->G, index->indexname, N);
+    return g;
+}
+
+static struct code_grid* get_grid(struct grid_matcher* gm, index_t* index) {
+    struct code_grid* g = NULL;
+    int i;
+    pthread_mutex_lock(&gm->lock);
+    for (i=0; i<pl_size(gm->grids); i++) {
+        struct code_grid* gi = pl_get(gm->grids, i);
+        if (gi->index != index)
+            continue;
+        if (streq(gi->indexfn, index->indexfn) &&
+            (gi->N == index->codekd->tree->ndata)) {
+            g = gi;
+            break;
+        }
+        // a different index file now.
+        code_grid_free(gi);
+        pl_remove(gm->grids, i);
+        break;
+    }
+    if (!g) {
+        g = code_grid_new(index);
+        if (g)
+            pl_append(gm->grids, g);
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return g;
+}
+
+static void qres_add(kdtree_qres_t* r, u32 ind, double d2) {
+    if (r->nres == r->capacity) {
+        r->capacity = MAX(16, 2 * r->capacity);
+        r->inds = realloc(r->inds, r->capacity * sizeof(u32));
+        r->sdists = realloc(r->sdists, r->capacity * sizeof(double));
+    }
+    r->inds[r->nres] = ind;
+    r->sdists[r->nres] = d2;
+    r->nres++;
+}
+
+static int grid_search(code_matcher_t* m, index_t* index,
+                       const double* codes, int N, const double* tol2s,
+                       kdtree_qres_t** res) {
+    struct code_grid* g = get_grid(m->priv, index);
+    int q;
+    if (!g)
+        return -1;
+    for (q=0; q<N; q++) {
+        const double* code = codes + q * g->D;
+        double tol2 = tol2s[q];
+        double tol = sqrt(tol2);
+        int x0, x1, y0, y1, y;
+
+        if (!res[q]) {
+            res[q] = calloc(1, sizeof(kdtree_qres_t));
+            if (!res[q]) {
+                SYSERROR("Failed to allocate code search result");
+                return -1;
+            }
+        }
+        res[q]->nres = 0;
+        x0 = grid_cell(g, 0, code[0] - tol);
+        x1 = grid_cell(g, 0, code[0] + tol);
+        y0 = grid_cell(g, 1, code[1] - tol);
+        y1 = grid_cell(g, 1, code[1] + tol);
+        for (y=y0; y<=y1; y++) {
+            // the cells x0..x1 of a row are contiguous.
+            int k = g->cellstart[y * g->G + x0];
+            int kend = g->cellstart[y * g->G + x1 + 1];
+            for (; k<kend; k++) {
+                const double* c = g->codes + (size_t)k * g->D;
+                double d2 = 0.0;
+                int d;
+                for (d=0; d<g->D; d++)
+                    d2 += square(c[d] - code[d]);
+                if (d2 > tol2)
+                    continue;
+                qres_add(res[q], g->inds[k], d2);
+            }
+        }
+    }
+    return 0;
+}
+
+static void grid_free(code_matcher_t* m) {
+    struct grid_matcher* gm = m->priv;
+    int i;
+    for (i=0; i<pl_size(gm->grids); i++)
+        code_grid_free(pl_get(gm->grids, i));
+    pl_free(gm->grids);
+    pthread_mutex_destroy(&gm->lock);
+    free(gm);
+}
+
+code_matcher_t* code_matcher_new(const char* name) {
+    code_matcher_t* m;
+    if (streq(name, "kdtree")) {
+        m = calloc(1, sizeof(code_matcher_t));
+        m->name = "kdtree";
+        m->search = kdtree_search;
+        return m;
+    }
+    if (streq(name, "grid")) {
+        struct grid_matcher* gm = calloc(1, sizeof(struct grid_matcher));
+        gm->grids = pl_new(8);
+        pthread_mutex_init(&gm->lock, NULL);
+        m = calloc(1, sizeof(code_matcher_t));
+        m->name = "grid";
+        m->search = grid_search;
+        m->free = grid_free;
+        m->priv = gm;
+        return m;
+    }
+    return NULL;
+}
@@ -13,6 +13,7 @@
 #include "fitsioutils.h"
 #include "errors.h"
 #include "quad-utils.h"
+#include "os-features.h"
 
 void quad_write(codefile_t* codes, quadfile_t* quads,
                 unsigned int* quad, startree_t* starkd,
@@ -24,6 +25,26 @@ void quad_write(codefile_t* codes, quadfile_t* quads,
     quadfile_write_quad(quads, quad);
 }
 
+int quad_write_many(codefile_t* codes, quadfile_t* quads,
+                    unsigned int* quad, int N, startree_t* starkd,
+                    int dimquads, int dimcodes) {
+    double code[QUAD_CODE_BLOCK * DCMAX];
+    int q, k;
+    for (q=0; q<N; q+=QUAD_CODE_BLOCK) {
+        int n = MIN(QUAD_CODE_BLOCK, N - q);
+        unsigned int* qq = quad + (size_t)q * dimquads;
+        if (quad_compute_codes(qq, n, dimquads, starkd, code))
+            return -1;
+        for (k=0; k<n; k++) {
+            quad_enforce_invariants(qq + k * dimquads, code + k * dimcodes,
+                                    dimquads, dimcodes);
+            codefile_write_code(codes, code + k * dimcodes);
+            quadfile_write_quad(quads, qq + k * dimquads);
+        }
+    }
+    return 0;
+}
+
 void quad_write_const(codefile_t* codes, quadfile_t* quads,
                       const unsigned int* quad, startree_t* starkd,
                       int dimquads, int dimcodes) {
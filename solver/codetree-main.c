@@ -18,7 +18,7 @@
 #include "codetree.h"
 #include "boilerplate.h"
 
-static const char* OPTIONS = "hR:i:o:bsSt:d:";
+static const char* OPTIONS = "hR:i:o:bsSt:d:w:VP";
 
 static void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -31,6 +31,10 @@ static void printHelp(char* progname) {
            "    [-d  <data type>]:  {double,float,u32,u16}, default u16.\n"
            "    [-S]: include separate splitdim array\n"
            "    [-R <target-leaf-node-size>]   (default 25)\n"
+           "    [-w <threads>]: number of threads to build the tree with (default 1)\n"
+           "    [-V]: store the tree nodes in (cache-oblivious) van Emde Boas order\n"
+           "    [-P]: pack the codes into one byte per dimension, relative to their\n"
+           "          leaf's bounding box (integer data types only)\n"
            "\n", progname);
 }
 
@@ -44,6 +48,7 @@ int main(int argc, char *argv[]) {
     int datatype = KDT_DATA_NULL;
     int treetype = KDT_TREE_NULL;
     int buildopts = 0;
+    int nthreads = 1;
 
     while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
         switch (argchar) {
@@ -71,6 +76,15 @@ int main(int argc, char *argv[]) {
         case 'S':
             buildopts |= KD_BUILD_SPLITDIM;
             break;
+        case 'V':
+            buildopts |= KD_BUILD_VEB_LAYOUT;
+            break;
+        case 'P':
+            buildopts |= KD_BUILD_PACK_DATA;
+            break;
+        case 'w':
+            nthreads = atoi(optarg);
+            break;
         case '?':
             fprintf(stderr, "Unknown option `-%c'.\n", optopt);
         case 'h':
@@ -92,7 +106,7 @@ int main(int argc, char *argv[]) {
     }
 
     if (codetree_files(codefname, treefname, Nleaf, datatype, treetype,
-                       buildopts, argv, argc))
+                       buildopts, nthreads, argv, argc))
         exit(-1);
     return 0;
 }
@@ -26,7 +26,7 @@
 
 int codetree_files(const char* codefn, const char* ckdtfn,
                    int Nleaf, int datatype, int treetype,
-                   int buildopts,
+                   int buildopts, int nthreads,
                    char** args, int argc) {
     codefile_t* codes;
     codetree_t *codekd = NULL;
@@ -45,7 +45,7 @@ int codetree_files(const char* codefn, const char* ckdtfn,
     logmsg("Read %u codes.\n", codes->numcodes);
 
     codekd = codetree_build(codes, Nleaf, datatype, treetype,
-                            buildopts, args, argc);
+                            buildopts, nthreads, args, argc);
     if (!codekd) {
         return -1;
     }
@@ -64,7 +64,7 @@ int codetree_files(const char* codefn, const char* ckdtfn,
 
 codetree_t* codetree_build(codefile_t* codes,
                            int Nleaf, int datatype, int treetype,
-                           int buildopts,
+                           int buildopts, int nthreads,
                            char** args, int argc) {
     codetree_t* codekd;
     qfits_header* hdr;
@@ -85,8 +85,8 @@ codetree_t* codetree_build(codefile_t* codes,
         datatype = KDT_DATA_U16;
     if (!treetype)
         treetype = KDT_TREE_U16;
-    if (!buildopts)
-        buildopts = KD_BUILD_SPLIT;
+    if (!(buildopts & (KD_BUILD_BBOX | KD_BUILD_SPLIT)))
+        buildopts |= KD_BUILD_SPLIT;
 
     tt = kdtree_kdtypes_to_treetype(exttype, treetype, datatype);
     N = codes->numcodes;
@@ -110,6 +110,7 @@ codetree_t* codetree_build(codefile_t* codes,
         }
         kdtree_set_limits(codekd->tree, low, high);
     }
+    kdtree_set_build_threads(codekd->tree, nthreads);
     logmsg("Building tree...\n");
     codekd->tree = kdtree_build(codekd->tree, codes->codearray, N, D,
                                 Nleaf, tt, buildopts);
@@ -118,7 +119,7 @@ codetree_t* codetree_build(codefile_t* codes,
         return NULL;
     }
     logmsg("Done\n");
-    codekd->tree->name = strdup(CODETREE_NAME);
+    kdtree_set_name(codekd->tree, CODETREE_NAME);
 
     hdr = codetree_header(codekd);
     fits_header_add_int(hdr, "NLEAF", Nleaf, "Target number of points in leaves.");
@@ -107,7 +107,6 @@ static anbool record_match_callback(MatchObj* mo, void* userdata) {
     struct callbackdata* cb = userdata;
     MatchObj* mymatch = &(cb->match);
     solver_t* solver = cb->solver;
-    int i;
     // copy "mo" to "mymatch"
     memcpy(mymatch, mo, sizeof(MatchObj));
     // steal these arrays from "mo": we memcpy'd the pointers above, now NULL
@@ -121,9 +120,7 @@ static anbool record_match_callback(MatchObj* mo, void* userdata) {
 
     // Convert xyz to RA,Dec
     mymatch->refradec = malloc(mymatch->nindex * 2 * sizeof(double));
-    for (i=0; i<mymatch->nindex; i++) {
-        xyzarr2radecdegarr(mymatch->refxyz+i*3, mymatch->refradec+i*2);
-    }
+    xyzarr2radecdegarr_batch(mymatch->refxyz, mymatch->refradec, mymatch->nindex);
     mymatch->fieldxy = malloc(mymatch->nfield * 2 * sizeof(double));
     // whew! -- Copy the (permuted) image (field) stars.
     memcpy(mymatch->fieldxy, solver->vf->xy,
@@ -142,11 +139,11 @@ static time_t timer_callback(void* userdata) {
            solver->timeused, walltime, solver->best_logodds);
     if ((cb->max_wall_time > 0) && (walltime > cb->max_wall_time)) {
         printf("max wall time exceeded; exiting\n");
-        solver->quit_now = TRUE;
+        solver_set_quit(solver);
     }
     if ((cb->max_cpu_time > 0) && (solver->timeused > cb->max_cpu_time)) {
         printf("max CPU time exceeded; exiting\n");
-        solver->quit_now = TRUE;
+        solver_set_quit(solver);
     }
     return 1;
 }
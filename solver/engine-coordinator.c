@@ -0,0 +1,580 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "engine-coordinator.h"
+#include "engine.h"
+#include "index.h"
+#include "ioutils.h"
+#include "fileutils.h"
+#include "log.h"
+#include "errors.h"
+
+// one node of the cluster, and the indexes it holds.
+typedef struct {
+    char* addr;
+    // index_t structs with only the fields that index_overlaps_scale_range()
+    // and index_is_within_range() look at.
+    bl* indexes;
+} node_t;
+
+struct engine_coordinator {
+    // node_t
+    bl* nodes;
+};
+
+// A connection to a node, running one job.
+typedef struct {
+    node_t* node;
+    int fd;
+    FILE* fin;
+    FILE* fout;
+    pthread_t thread;
+    anbool started;
+    // did we hang up on it (because another node solved the field)?
+    anbool cancelled;
+    // COORD_*
+    int result;
+    char* error;
+} node_run_t;
+
+enum {
+    COORD_RUNNING,
+    COORD_SOLVED,
+    COORD_UNSOLVED,
+    COORD_FAILED,
+};
+
+// What the node_run_t threads share.
+typedef struct {
+    node_run_t* runs;
+    int nruns;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int ndone;
+    // the first run to solve the field, or -1.
+    int winner;
+} job_runs_t;
+
+// Connects to a Unix socket if "addr" contains a "/", otherwise to TCP
+// "[host:]port" (localhost by default), as engine-main's --listen.
+static int connect_to(const char* addr) {
+    int fd;
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            ERROR("Socket path \"%s\" is too long", addr);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            SYSERROR("Failed to create socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+            SYSERROR("Failed to connect to \"%s\"", addr);
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct addrinfo hints, *res, *ai;
+        char* host = NULL;
+        const char* port = addr;
+        const char* colon = strrchr(addr, ':');
+        int err;
+        if (colon) {
+            host = strndup(addr, colon - addr);
+            port = colon + 1;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        err = getaddrinfo(host, port, &hints, &res);
+        free(host);
+        if (err) {
+            ERROR("Failed to look up address \"%s\": %s", addr, gai_strerror(err));
+            return -1;
+        }
+        fd = -1;
+        for (ai=res; ai; ai=ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd == -1)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd == -1) {
+            SYSERROR("Failed to connect to \"%s\"", addr);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static int open_run(node_run_t* run) {
+    run->fd = connect_to(run->node->addr);
+    if (run->fd == -1)
+        return -1;
+    run->fin = fdopen(run->fd, "r");
+    run->fout = fdopen(dup(run->fd), "w");
+    if (!run->fin || !run->fout) {
+        SYSERROR("Failed to fdopen() connection to \"%s\"", run->node->addr);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_run(node_run_t* run) {
+    if (run->fin)
+        fclose(run->fin);
+    else if (run->fd != -1)
+        close(run->fd);
+    if (run->fout)
+        fclose(run->fout);
+    run->fin = run->fout = NULL;
+    run->fd = -1;
+}
+
+// Reads a reply line (without its newline) into "*line"; returns -1 at
+// the end of the connection.
+static int read_reply(node_run_t* run, char** line, size_t* size) {
+    ssize_t len = getline(line, size, run->fin);
+    if (len == -1)
+        return -1;
+    while (len > 0 && isspace((unsigned char)(*line)[len-1]))
+        (*line)[--len] = '\0';
+    return 0;
+}
+
+static int list_node_indexes(node_t* node) {
+    node_run_t run;
+    char* line = NULL;
+    size_t size = 0;
+    int i, n;
+    int rtn = -1;
+
+    memset(&run, 0, sizeof(run));
+    run.fd = -1;
+    run.node = node;
+    if (open_run(&run))
+        goto bailout;
+    fprintf(run.fout, "indexes\n");
+    if (fflush(run.fout) || read_reply(&run, &line, &size) ||
+        sscanf(line, "indexes %i", &n) != 1) {
+        ERROR("Node \"%s\" didn't list its indexes%s%s", node->addr,
+              line ? ": " : "", line ? line : "");
+        goto bailout;
+    }
+    for (i=0; i<n; i++) {
+        index_t ind;
+        memset(&ind, 0, sizeof(ind));
+        ind.indexname = node->addr;
+        if (read_reply(&run, &line, &size) ||
+            sscanf(line, "index %i %i %i %lg %lg", &ind.indexid, &ind.healpix,
+                   &ind.hpnside, &ind.index_scale_lower,
+                   &ind.index_scale_upper) != 5) {
+            ERROR("Failed to parse index %i from node \"%s\"", i, node->addr);
+            goto bailout;
+        }
+        bl_append(node->indexes, &ind);
+    }
+    fprintf(run.fout, "quit\n");
+    fflush(run.fout);
+    logverb("Node %s has %i indexes\n", node->addr, n);
+    rtn = 0;
+ bailout:
+    free(line);
+    close_run(&run);
+    return rtn;
+}
+
+engine_coordinator_t* engine_coordinator_new(const sl* nodes) {
+    engine_coordinator_t* c = calloc(1, sizeof(engine_coordinator_t));
+    size_t i;
+    c->nodes = bl_new(8, sizeof(node_t));
+    for (i=0; i<sl_size(nodes); i++) {
+        node_t node;
+        node.addr = strdup(sl_get_const(nodes, i));
+        node.indexes = bl_new(16, sizeof(index_t));
+        bl_append(c->nodes, &node);
+        if (list_node_indexes(bl_access(c->nodes, i))) {
+            engine_coordinator_free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+void engine_coordinator_free(engine_coordinator_t* c) {
+    size_t i;
+    if (!c)
+        return;
+    for (i=0; i<bl_size(c->nodes); i++) {
+        node_t* node = bl_access(c->nodes, i);
+        free(node->addr);
+        bl_free(node->indexes);
+    }
+    bl_free(c->nodes);
+    free(c);
+}
+
+// Could one of the node's indexes solve the job?  As list_runs() and
+// select_indexes() in engine.c choose indexes.
+static anbool node_is_relevant(engine_t* engine, const node_t* node,
+                               job_t* job) {
+    onefield_t* bp = &(job->bp);
+    double W = bp->solver.field_maxx;
+    double H = bp->solver.field_maxy;
+    size_t i, j;
+    for (j=0; j<dl_size(job->scales)/2; j++) {
+        double app_min = dl_get(job->scales, j*2);
+        double app_max = dl_get(job->scales, j*2+1);
+        double fmin, fmax;
+        if (app_min == 0.0)
+            app_min = deg2arcsec(engine->minwidth) / W;
+        if (app_max == 0.0)
+            app_max = deg2arcsec(engine->maxwidth) / W;
+        fmin = bp->quad_size_fraction_lo * MIN(W, H) * app_min;
+        fmax = bp->quad_size_fraction_hi * hypot(W, H) * app_max;
+        for (i=0; i<bl_size(node->indexes); i++) {
+            index_t* ind = bl_access(node->indexes, i);
+            if (!index_overlaps_scale_range(ind, fmin, fmax))
+                continue;
+            if (job->use_radec_center &&
+                !index_is_within_range(ind, job->ra_center, job->dec_center,
+                                       job->search_radius))
+                continue;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Sends the job to the node: into a new scratch directory, then "solve".
+static int start_run(node_run_t* run, const char* jobfn, const char* name) {
+    struct stat st;
+    FILE* f;
+    if (open_run(run))
+        return -1;
+    if (stat(jobfn, &st) || !(f = fopen(jobfn, "rb"))) {
+        SYSERROR("Failed to read job file \"%s\"", jobfn);
+        return -1;
+    }
+    fprintf(run->fout, "tmpdir\nput %s %lld\n", name, (long long)st.st_size);
+    if (pipe_file_offset(f, 0, st.st_size, run->fout)) {
+        fclose(f);
+        ERROR("Failed to send job file to node \"%s\"", run->node->addr);
+        return -1;
+    }
+    fclose(f);
+    fprintf(run->fout, "solve %s\n", name);
+    if (fflush(run->fout)) {
+        SYSERROR("Failed to send job to node \"%s\"", run->node->addr);
+        return -1;
+    }
+    return 0;
+}
+
+struct run_arg {
+    job_runs_t* runs;
+    int i;
+};
+
+// Waits for the node's replies to start_run().
+static void* wait_for_run(void* varg) {
+    struct run_arg* arg = varg;
+    job_runs_t* jr = arg->runs;
+    node_run_t* run = jr->runs + arg->i;
+    char* line = NULL;
+    size_t size = 0;
+    int result = COORD_FAILED;
+    int k;
+
+    // "ok <dir>" for "tmpdir", "ok" for "put", then the result.
+    for (k=0; k<3; k++) {
+        if (read_reply(run, &line, &size)) {
+            run->error = strdup("connection closed");
+            break;
+        }
+        if (starts_with(line, "error ")) {
+            run->error = strdup(line + 6);
+            break;
+        }
+        if (k < 2)
+            continue;
+        if (starts_with(line, "solved "))
+            result = COORD_SOLVED;
+        else if (starts_with(line, "unsolved "))
+            result = COORD_UNSOLVED;
+        else
+            asprintf_safe(&run->error, "unexpected reply \"%s\"", line);
+    }
+    free(line);
+    pthread_mutex_lock(&jr->lock);
+    run->result = result;
+    jr->ndone++;
+    if (result == COORD_SOLVED && jr->winner == -1)
+        jr->winner = arg->i;
+    pthread_cond_signal(&jr->changed);
+    pthread_mutex_unlock(&jr->lock);
+    free(arg);
+    return NULL;
+}
+
+// Reads "nbytes" bytes from the node into file "fn".
+static int receive_file(FILE* fin, const char* fn, off_t nbytes) {
+    char buf[65536];
+    FILE* fout = fopen(fn, "wb");
+    int rtn = 0;
+    if (!fout) {
+        SYSERROR("Failed to open \"%s\" for writing", fn);
+        rtn = -1;
+    }
+    while (nbytes > 0) {
+        size_t n = MIN((off_t)sizeof(buf), nbytes);
+        if (fread(buf, 1, n, fin) != n) {
+            ERROR("Connection closed while receiving \"%s\"", fn);
+            return -1;
+        }
+        // (keep reading after a write error, to stay in step.)
+        if (fout && fwrite(buf, 1, n, fout) != n) {
+            SYSERROR("Failed to write \"%s\"", fn);
+            rtn = -1;
+        }
+        nbytes -= n;
+    }
+    if (fout && fclose(fout)) {
+        SYSERROR("Failed to close \"%s\"", fn);
+        rtn = -1;
+    }
+    return rtn;
+}
+
+/*
+ Fetches the winning node's output files: each to the path of the job
+ output with the same base name, or -- for WCS files named from a
+ template -- to the WCS template's directory.
+ */
+static int fetch_outputs(node_run_t* run, job_t* job, const char* name) {
+    onefield_t* bp = &(job->bp);
+    const char* outputs[] = { bp->solved_out, bp->matchfname,
+                              bp->indexrdlsfname, bp->corr_fname,
+                              bp->scamp_fname, bp->stats_fname,
+                              bp->wcs_template };
+    int noutputs = sizeof(outputs) / sizeof(char*);
+    char* line = NULL;
+    size_t size = 0;
+    sl* files;
+    size_t i;
+    int k, rtn = -1;
+
+    fprintf(run->fout, "list\n");
+    if (fflush(run->fout) || read_reply(run, &line, &size) ||
+        !starts_with(line, "files")) {
+        ERROR("Failed to list output files on node \"%s\"", run->node->addr);
+        free(line);
+        return -1;
+    }
+    files = sl_split(NULL, line + 5, " ");
+    for (i=0; i<sl_size(files); i++) {
+        const char* fn = sl_get(files, i);
+        char* path = NULL;
+        long long nbytes;
+        if (!strlen(fn) || streq(fn, name))
+            continue;
+        for (k=0; k<noutputs; k++) {
+            char* base;
+            if (!outputs[k] || strchr(outputs[k], '%'))
+                continue;
+            base = basename_safe(outputs[k]);
+            if (streq(base, fn))
+                path = strdup(outputs[k]);
+            free(base);
+            if (path)
+                break;
+        }
+        if (!path && bp->wcs_template) {
+            char* dir = dirname_safe(bp->wcs_template);
+            asprintf_safe(&path, "%s/%s", dir, fn);
+            free(dir);
+        }
+        if (!path) {
+            logverb("Not fetching file \"%s\" from node %s\n", fn,
+                    run->node->addr);
+            continue;
+        }
+        fprintf(run->fout, "get %s\n", fn);
+        if (fflush(run->fout) || read_reply(run, &line, &size) ||
+            sscanf(line, "data %*s %lld", &nbytes) != 1) {
+            ERROR("Failed to get \"%s\" from node \"%s\"%s%s", fn,
+                  run->node->addr, line ? ": " : "", line ? line : "");
+            free(path);
+            goto bailout;
+        }
+        logverb("Fetching %s from node %s\n", path, run->node->addr);
+        if (receive_file(run->fin, path, nbytes)) {
+            free(path);
+            goto bailout;
+        }
+        free(path);
+    }
+    rtn = 0;
+ bailout:
+    sl_free2(files);
+    free(line);
+    return rtn;
+}
+
+int engine_coordinator_run_job_file(engine_coordinator_t* c,
+                                    engine_t* engine, const char* jobfn,
+                                    const char* basedir, anbool* solved) {
+    job_t* job;
+    job_runs_t jr;
+    char* name;
+    il* chosen;
+    int i;
+    int nfailed = 0;
+    int rtn = 0;
+
+    if (solved)
+        *solved = FALSE;
+    logmsg("Reading file \"%s\"...\n", jobfn);
+    job = engine_read_job_file(engine, jobfn);
+    if (!job) {
+        ERROR("Failed to read job file \"%s\"", jobfn);
+        return -1;
+    }
+    if (basedir)
+        job_set_output_base_dir(job, basedir);
+
+    chosen = il_new(8);
+    for (i=0; i<bl_size(c->nodes); i++)
+        if (node_is_relevant(engine, bl_access(c->nodes, i), job))
+            il_append(chosen, i);
+    if (!il_size(chosen)) {
+        // (as engine.c falls back to the smallest or largest indexes)
+        logmsg("No node has indexes for this job's scales and position; "
+               "sending it to all of them.\n");
+        for (i=0; i<bl_size(c->nodes); i++)
+            il_append(chosen, i);
+    }
+
+    name = basename_safe(jobfn);
+    memset(&jr, 0, sizeof(jr));
+    jr.nruns = il_size(chosen);
+    jr.runs = calloc(jr.nruns, sizeof(node_run_t));
+    jr.winner = -1;
+    pthread_mutex_init(&jr.lock, NULL);
+    pthread_cond_init(&jr.changed, NULL);
+    for (i=0; i<jr.nruns; i++) {
+        node_run_t* run = jr.runs + i;
+        struct run_arg* arg;
+        run->node = bl_access(c->nodes, il_get(chosen, i));
+        run->fd = -1;
+        logverb("Sending job to node %s\n", run->node->addr);
+        if (start_run(run, jobfn, name)) {
+            run->result = COORD_FAILED;
+            jr.ndone++;
+            continue;
+        }
+        arg = malloc(sizeof(struct run_arg));
+        arg->runs = &jr;
+        arg->i = i;
+        if (pthread_create(&run->thread, NULL, wait_for_run, arg)) {
+            SYSERROR("Failed to start thread");
+            free(arg);
+            run->result = COORD_FAILED;
+            jr.ndone++;
+            continue;
+        }
+        run->started = TRUE;
+    }
+
+    // Wait for a solution, for all the nodes to give up, or for the job
+    // to be cancelled.
+    pthread_mutex_lock(&jr.lock);
+    while (jr.ndone < jr.nruns && jr.winner == -1) {
+        struct timespec ts;
+        if (engine->cancel && __atomic_load_n(engine->cancel, __ATOMIC_RELAXED)) {
+            logmsg("Job cancelled.\n");
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&jr.changed, &jr.lock, &ts);
+    }
+    pthread_mutex_unlock(&jr.lock);
+
+    // Hanging up on the other nodes cancels their runs.
+    pthread_mutex_lock(&jr.lock);
+    for (i=0; i<jr.nruns; i++) {
+        node_run_t* run = jr.runs + i;
+        if (run->fd == -1 || run->result != COORD_RUNNING)
+            continue;
+        run->cancelled = TRUE;
+        shutdown(run->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&jr.lock);
+    for (i=0; i<jr.nruns; i++)
+        if (jr.runs[i].started)
+            pthread_join(jr.runs[i].thread, NULL);
+
+    for (i=0; i<jr.nruns; i++) {
+        node_run_t* run = jr.runs + i;
+        if (run->result == COORD_FAILED) {
+            nfailed++;
+            if (run->error && !run->cancelled)
+                logmsg("Node %s failed: %s\n", run->node->addr, run->error);
+        }
+    }
+    if (jr.winner != -1) {
+        node_run_t* run = jr.runs + jr.winner;
+        logmsg("Field solved by node %s.\n", run->node->addr);
+        if (fetch_outputs(run, job, name))
+            rtn = 1;
+        else if (solved)
+            *solved = TRUE;
+        fprintf(run->fout, "quit\n");
+        fflush(run->fout);
+    } else if (nfailed == jr.nruns) {
+        ERROR("The job failed on all %i nodes", jr.nruns);
+        rtn = 1;
+    }
+
+    for (i=0; i<jr.nruns; i++) {
+        close_run(jr.runs + i);
+        free(jr.runs[i].error);
+    }
+    free(jr.runs);
+    pthread_mutex_destroy(&jr.lock);
+    pthread_cond_destroy(&jr.changed);
+    free(name);
+    il_free(chosen);
+    job_free(job);
+    return rtn;
+}
@@ -22,14 +22,18 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <assert.h>
-#include <glob.h>
-
-// Some systems (Solaris) don't have these glob symbols.  Don't really need.
-#ifndef GLOB_BRACE
-#define GLOB_BRACE 0
-#endif
-#ifndef GLOB_TILDE
-#define GLOB_TILDE 0
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/prctl.h>
 #endif
 
 #include "os-features.h"
@@ -41,11 +45,15 @@
 #include "solver.h"
 #include "math.h"
 #include "fitsioutils.h"
+#include "anqfits.h"
 #include "solverutils.h"
 #include "onefield.h"
 #include "log.h"
 #include "errors.h"
 #include "engine.h"
+#include "engine-mosaic.h"
+#include "engine-tracking.h"
+#include "engine-ring.h"
 #include "an-opts.h"
 #include "gslutils.h"
 
@@ -76,11 +84,531 @@ static an_option_t myopts[] = {
      "log data to the given filename"},
     {'j', "job-id", required_argument, "jobid",
      "IGNORED; purely to allow process to contain the job id!"},
+    {'l', "listen", required_argument, "address",
+     "run as a server: load the indexes once, then take jobs over a socket; "
+     "<address> is a Unix socket path (containing \"/\") or [host:]port"},
+    {'w', "workers", required_argument, "N",
+     "with --listen: number of worker processes (default 1)"},
+    {'M', "metrics", required_argument, "[host:]port",
+     "with --listen: serve statistics (jobs, solve times, time in each "
+     "solver stage, index loads, page faults) in the Prometheus text format "
+     "over HTTP on this port"},
+    {'N', "nodes", required_argument, "address(es)",
+     "coordinate a cluster: instead of solving here, send each job to the "
+     "nodes (astrometry-engine --listen servers, comma-separated "
+     "addresses as for --listen) holding the indexes that could solve "
+     "it, and keep the first solution"},
+    {'m', "mosaic", no_argument, NULL,
+     "the inputs are mosaic layout files: solve the listed chips jointly, "
+     "blind-solving one and verifying the others' WCSes predicted from the "
+     "chips' positions in the focal plane"},
+    {'t', "track", no_argument, NULL,
+     "the inputs are successive frames of a sequence: blind-solve the first "
+     "and verify each next frame's WCS predicted from the last solved one "
+     "by aligning their sources, blind-solving only when that fails"},
+    {'r', "ring", required_argument, "name[,slots[,MB]]",
+     "serve live frames through a ring buffer in POSIX shared memory of "
+     "this name (\"/...\"), with this many slots (default 4) of frames "
+     "up to this many megabytes (default 64); see engine-ring.h"},
+    {'x', "hdu-index", no_argument, NULL,
+     "keep a \"<file>.hdus\" index of the FITS extensions next to each input "
+     "file, so that multi-field files open without scanning every header"},
 };
 
 static void print_help(const char* progname, bl* opts) {
     printf("Usage:   %s [options] <augmented xylist (axy) file(s)>\n", progname);
     opts_print_help(opts, stdout, NULL, NULL);
+    printf("\nIn server mode (--listen), clients send lines of:\n"
+           "    cd <dir>        run the following jobs in this directory\n"
+           "    solve <file>    run the given axy file; replies with a line\n"
+           "                    \"solved <file>\", \"unsolved <file>\" or\n"
+           "                    \"error <file>: <message>\"\n"
+           "    cancel          (while a job is running) stop it; closing\n"
+           "                    the connection does the same\n"
+           "    quit            close the connection\n"
+           "    indexes         replies \"indexes <N>\" and N lines of\n"
+           "                    \"index <id> <healpix> <nside> <min> <max>\"\n"
+           "                    (quad sizes in arcsec), for a coordinator\n"
+           "For clients that don't share the server's file system:\n"
+           "    tmpdir          cd to a new scratch directory, replacing the\n"
+           "                    previous one; it is deleted when the\n"
+           "                    connection closes.  Replies \"ok <dir>\"\n"
+           "    put <file> <N>  followed by N bytes: write them to <file>\n"
+           "    list            replies \"files <file> <file> ...\"\n"
+           "    get <file>      replies \"data <file> <N>\" and N bytes\n"
+           "(<file> names are relative to the current directory, with no\n"
+           "\"/\"; commands other than \"get\" reply \"ok\" or \"error ...\").\n"
+           "In a tmpdir, jobs write their outputs there, under their base names.\n");
+    printf("\nWith --ring, a camera process maps the ring (frame_ring_open()),\n"
+           "puts each frame (an image, or its sources) into a slot and waits\n"
+           "for the WCS to be written back into it; successive frames are\n"
+           "tracked as with --track.\n");
+    printf("\nA mosaic layout file (--mosaic) has lines of:\n"
+           "    chip <file> <x> <y> <rot>  a chip's axy file, and the\n"
+           "                    focal-plane position of its pixel (0,0) and\n"
+           "                    its rotation (degrees)\n"
+           "    blind <n>       blind-solve up to n chips (default 3)\n"
+           "    joint_tweak <order>  fit one SIP WCS to all the chips\n");
+}
+
+// Creates a listening socket: a Unix socket if "addr" contains a "/",
+// otherwise TCP on "[host:]port".
+static int listen_on(const char* addr) {
+    int fd;
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            ERROR("Socket path \"%s\" is too long", addr);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            SYSERROR("Failed to create socket");
+            return -1;
+        }
+        // remove a stale socket left behind by a previous server.
+        unlink(addr);
+        if (bind(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+            SYSERROR("Failed to bind socket \"%s\"", addr);
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct addrinfo hints, *res, *ai;
+        char* host = NULL;
+        const char* port = addr;
+        const char* colon = strrchr(addr, ':');
+        int err;
+        if (colon) {
+            host = strndup(addr, colon - addr);
+            port = colon + 1;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        err = getaddrinfo(host, port, &hints, &res);
+        free(host);
+        if (err) {
+            ERROR("Failed to look up address \"%s\": %s", addr, gai_strerror(err));
+            return -1;
+        }
+        fd = -1;
+        for (ai=res; ai; ai=ai->ai_next) {
+            int one = 1;
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd == -1)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd == -1) {
+            SYSERROR("Failed to bind to \"%s\"", addr);
+            return -1;
+        }
+    }
+    if (listen(fd, 16)) {
+        SYSERROR("Failed to listen on \"%s\"", addr);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ While a job runs, watches its connection for a "cancel" line or the
+ client hanging up, and sets the job's cancellation token if so.  It
+ only peeks at the socket, so that other pipelined commands are left for
+ serve_connection() to read.
+ */
+struct cancel_watch {
+    int fd;
+    int cancel;
+    int done;
+};
+
+static void* watch_for_cancel(void* arg) {
+    struct cancel_watch* cw = arg;
+    while (!__atomic_load_n(&cw->done, __ATOMIC_RELAXED)) {
+        struct pollfd pfd;
+        char buf[16];
+        ssize_t n;
+        pfd.fd = cw->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        n = recv(cw->fd, buf, sizeof(buf), MSG_PEEK);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logmsg("Client hung up; cancelling the job.\n");
+            solver_cancel(&cw->cancel);
+            break;
+        }
+        if (n >= 7 && !memcmp(buf, "cancel\n", 7)) {
+            // consume it.
+            if (recv(cw->fd, buf, 7, 0) != 7)
+                SYSERROR("Failed to read \"cancel\" command");
+            logmsg("Client cancelled the job.\n");
+            solver_cancel(&cw->cancel);
+            break;
+        }
+        if (n >= 7 || memchr(buf, '\n', n))
+            // another command: it's for after the job.
+            break;
+        // (a partial line; wait for the rest.)
+        usleep(10000);
+    }
+    return NULL;
+}
+
+// File names sent with "put" and "get" must be in the current directory.
+static anbool is_plain_filename(const char* fn) {
+    return (strlen(fn) && !strchr(fn, '/') && !streq(fn, ".") &&
+            !streq(fn, ".."));
+}
+
+// Reads "nbytes" bytes from the client into file "fn".
+static int receive_file(FILE* fin, const char* fn, off_t nbytes) {
+    char buf[65536];
+    FILE* fout = fopen(fn, "wb");
+    int rtn = 0;
+    if (!fout) {
+        SYSERROR("Failed to open \"%s\" for writing", fn);
+        rtn = -1;
+    }
+    while (nbytes > 0) {
+        size_t n = MIN((off_t)sizeof(buf), nbytes);
+        if (fread(buf, 1, n, fin) != n) {
+            ERROR("Connection closed while receiving \"%s\"", fn);
+            rtn = -1;
+            break;
+        }
+        // (keep reading after a write error, to stay in step.)
+        if (fout && fwrite(buf, 1, n, fout) != n) {
+            SYSERROR("Failed to write \"%s\"", fn);
+            rtn = -1;
+        }
+        nbytes -= n;
+    }
+    if (fout && fclose(fout)) {
+        SYSERROR("Failed to close \"%s\"", fn);
+        rtn = -1;
+    }
+    return rtn;
+}
+
+// Deletes a "tmpdir" and the files in it.
+static void remove_scratch_dir(const char* dir) {
+    DIR* d = opendir(dir);
+    struct dirent* ent;
+    if (d) {
+        while ((ent = readdir(d))) {
+            char* fn;
+            if (streq(ent->d_name, ".") || streq(ent->d_name, ".."))
+                continue;
+            asprintf_safe(&fn, "%s/%s", dir, ent->d_name);
+            if (unlink(fn))
+                SYSERROR("Failed to delete \"%s\"", fn);
+            free(fn);
+        }
+        closedir(d);
+    }
+    if (rmdir(dir))
+        SYSERROR("Failed to delete directory \"%s\"", dir);
+}
+
+// Runs the jobs requested over one connection.
+static void serve_connection(engine_t* engine, int fd, const char* basedir) {
+    FILE* fin;
+    FILE* fout;
+    char* line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int cwd;
+    char* scratch = NULL;
+
+    fin = fdopen(fd, "r");
+    fout = fdopen(dup(fd), "w");
+    if (!fin || !fout) {
+        SYSERROR("Failed to fdopen() connection");
+        if (fin)
+            fclose(fin);
+        else
+            close(fd);
+        return;
+    }
+    // jobs may "cd"; go back afterwards.
+    cwd = open(".", O_RDONLY);
+
+    while ((len = getline(&line, &linesize, fin)) != -1) {
+        char* arg;
+        while (len > 0 && isspace((unsigned char)line[len-1]))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (streq(line, "quit"))
+            break;
+        // (a "cancel" that arrived after its job finished.)
+        if (streq(line, "cancel"))
+            continue;
+        if (is_word(line, "cd ", &arg)) {
+            if (chdir(arg))
+                fprintf(fout, "error %s: %s\n", arg, strerror(errno));
+            else
+                fprintf(fout, "ok\n");
+        } else if (is_word(line, "solve ", &arg)) {
+            anbool solved = FALSE;
+            char* errs;
+            int rtn;
+            struct cancel_watch cw;
+            pthread_t watcher;
+            anbool watching;
+            memset(&cw, 0, sizeof(cw));
+            cw.fd = fd;
+            watching = (pthread_create(&watcher, NULL, watch_for_cancel, &cw) == 0);
+            engine->cancel = &cw.cancel;
+            engine->flat_outputs = (scratch != NULL);
+            errors_start_logging_to_string();
+            rtn = engine_run_job_file(engine, arg, basedir, &solved);
+            errs = errors_stop_logging_to_string("; ");
+            engine->cancel = NULL;
+            engine->flat_outputs = FALSE;
+            if (watching) {
+                __atomic_store_n(&cw.done, 1, __ATOMIC_RELAXED);
+                pthread_join(watcher, NULL);
+            }
+            if (rtn)
+                fprintf(fout, "error %s: %s\n", arg,
+                        (errs && strlen(errs)) ? errs : "failed");
+            else
+                fprintf(fout, "%s %s\n", solved ? "solved" : "unsolved", arg);
+            free(errs);
+        } else if (streq(line, "indexes")) {
+            int k;
+            fprintf(fout, "indexes %zu\n", pl_size(engine->indexes));
+            for (k=0; k<pl_size(engine->indexes); k++) {
+                index_t* ind = pl_get(engine->indexes, k);
+                fprintf(fout, "index %i %i %i %.12g %.12g\n", ind->indexid,
+                        ind->healpix, ind->hpnside, ind->index_scale_lower,
+                        ind->index_scale_upper);
+            }
+        } else if (streq(line, "tmpdir")) {
+            if (scratch) {
+                remove_scratch_dir(scratch);
+                free(scratch);
+            }
+            scratch = create_temp_dir("engine", NULL);
+            if (!scratch || chdir(scratch))
+                fprintf(fout, "error tmpdir: %s\n", strerror(errno));
+            else
+                fprintf(fout, "ok %s\n", scratch);
+        } else if (is_word(line, "put ", &arg)) {
+            char fn[256];
+            long long nbytes;
+            if (sscanf(arg, "%255s %lld", fn, &nbytes) != 2 || nbytes < 0) {
+                fprintf(fout, "error %s: expected \"put <file> <nbytes>\"\n", arg);
+                // we can't tell where the data ends; give up.
+                fflush(fout);
+                break;
+            }
+            if (!is_plain_filename(fn)) {
+                // (read the data anyway, to stay in step.)
+                receive_file(fin, "/dev/null", nbytes);
+                fprintf(fout, "error %s: not a plain file name\n", fn);
+            } else if (receive_file(fin, fn, nbytes))
+                fprintf(fout, "error %s: failed to write\n", fn);
+            else
+                fprintf(fout, "ok\n");
+        } else if (streq(line, "list")) {
+            DIR* d = opendir(".");
+            struct dirent* ent;
+            fprintf(fout, "files");
+            while (d && (ent = readdir(d))) {
+                struct stat st;
+                if (stat(ent->d_name, &st) || !S_ISREG(st.st_mode) ||
+                    strchr(ent->d_name, ' '))
+                    continue;
+                fprintf(fout, " %s", ent->d_name);
+            }
+            fprintf(fout, "\n");
+            if (d)
+                closedir(d);
+        } else if (is_word(line, "get ", &arg)) {
+            struct stat st;
+            FILE* f = NULL;
+            if (!is_plain_filename(arg))
+                fprintf(fout, "error %s: not a plain file name\n", arg);
+            else if (stat(arg, &st) || !(f = fopen(arg, "rb")))
+                fprintf(fout, "error %s: %s\n", arg, strerror(errno));
+            else {
+                fprintf(fout, "data %s %lld\n", arg, (long long)st.st_size);
+                if (pipe_file_offset(f, 0, st.st_size, fout)) {
+                    // the client is expecting more bytes than we can send.
+                    fclose(f);
+                    break;
+                }
+            }
+            if (f)
+                fclose(f);
+        } else {
+            fprintf(fout, "error %s: unknown command\n", line);
+        }
+        if (fflush(fout))
+            break;
+    }
+    free(line);
+    fclose(fin);
+    fclose(fout);
+    if (cwd != -1) {
+        if (fchdir(cwd))
+            SYSERROR("Failed to return to the original directory");
+        close(cwd);
+    }
+    if (scratch) {
+        remove_scratch_dir(scratch);
+        free(scratch);
+    }
+}
+
+static void serve_forever(engine_t* engine, int lfd, const char* basedir) {
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            SYSERROR("Failed to accept() connection");
+            sleep(1);
+            continue;
+        }
+        if (engine->metrics)
+            engine_metrics_add_connection(engine->metrics, 1);
+        serve_connection(engine, fd, basedir);
+        if (engine->metrics)
+            engine_metrics_add_connection(engine->metrics, -1);
+    }
+}
+
+static void run_worker(engine_t* engine, int lfd, const char* basedir) {
+#ifdef PR_SET_PDEATHSIG
+    // don't outlive the server.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    serve_forever(engine, lfd, basedir);
+    _exit(0);
+}
+
+/*
+ Server mode: the indexes are loaded (or, if not "inparallel", their
+ headers are read) once, then "nworkers" processes forked from this one
+ take connections from the shared socket, so they share the index pages.
+ Workers that die are replaced.  If "metricsaddr" is given, this process
+ also answers HTTP requests for the workers' combined statistics there.
+ */
+static int run_server(engine_t* engine, const char* addr, int nworkers,
+                      const char* metricsaddr, const char* basedir) {
+    int lfd;
+    int i;
+
+    lfd = listen_on(addr);
+    if (lfd == -1)
+        return -1;
+    if (metricsaddr) {
+        int mfd;
+        engine->metrics = engine_metrics_new();
+        if (!engine->metrics)
+            return -1;
+        engine_metrics_set_workers(engine->metrics, MAX(nworkers, 1));
+        mfd = listen_on(metricsaddr);
+        if (mfd == -1 || engine_metrics_serve(engine->metrics, mfd))
+            return -1;
+        logmsg("Serving metrics on %s\n", metricsaddr);
+    }
+    // a client hanging up shouldn't kill us.
+    signal(SIGPIPE, SIG_IGN);
+    logmsg("Listening on %s with %i worker%s\n", addr, nworkers,
+           nworkers == 1 ? "" : "s");
+
+    if (nworkers <= 1) {
+        serve_forever(engine, lfd, basedir);
+        return 0;
+    }
+    for (i=0; i<nworkers; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            SYSERROR("Failed to fork worker");
+            return -1;
+        }
+        if (pid == 0)
+            run_worker(engine, lfd, basedir);
+    }
+    for (;;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            SYSERROR("wait() failed");
+            return -1;
+        }
+        logmsg("Worker %i exited (status %i); starting a new one.\n",
+               (int)pid, status);
+        pid = fork();
+        if (pid == -1) {
+            SYSERROR("Failed to fork worker");
+            return -1;
+        }
+        if (pid == 0)
+            run_worker(engine, lfd, basedir);
+    }
+    return 0;
+}
+
+static volatile int ring_stop = 0;
+
+static void stop_ring(int sig) {
+    ring_stop = 1;
+}
+
+/*
+ Ring mode: creates the ring from the --ring spec "name[,slots[,MB]]"
+ and solves the frames put into it until interrupted, when the ring is
+ removed.
+ */
+static int run_ring(engine_t* engine, const char* spec) {
+    char name[256];
+    int nslots = 4;
+    double mb = 64;
+    const char* comma;
+    frame_ring_t* ring;
+    engine_ring_t* er;
+
+    comma = strchr(spec, ',');
+    snprintf(name, sizeof(name), "%.*s",
+             (int)(comma ? comma - spec : (int)strlen(spec)), spec);
+    if (comma && sscanf(comma + 1, "%i,%lf", &nslots, &mb) < 1) {
+        ERROR("Failed to parse --ring \"%s\"", spec);
+        return -1;
+    }
+    ring = frame_ring_create(name, nslots, (size_t)(mb * 1024 * 1024));
+    if (!ring)
+        return -1;
+    signal(SIGINT, stop_ring);
+    signal(SIGTERM, stop_ring);
+    logmsg("Serving frames through ring \"%s\" (%i slots of %g MB)\n",
+           name, nslots, mb);
+    er = engine_ring_new(engine, ring);
+    engine_ring_serve(er, &ring_stop);
+    engine_ring_free(er);
+    frame_ring_close(ring);
+    return 0;
 }
 
 FILE* datalogfid = NULL;
@@ -94,9 +622,6 @@ static void close_datalogfid() {
 }
 
 int main(int argc, char** args) {
-    char* default_configfn = "astrometry.cfg";
-    char* default_config_path = "../etc";
-
     int c;
     char* configfn = NULL;
     int i;
@@ -119,6 +644,14 @@ int main(int argc, char** args) {
     sl* index_dirs = sl_new(4);
 
     char* datalog = NULL;
+    char* listenaddr = NULL;
+    int nworkers = 1;
+    char* metricsaddr = NULL;
+    char* ringspec = NULL;
+    sl* nodes = sl_new(4);
+    anbool mosaic = FALSE;
+    anbool track = FALSE;
+    engine_tracker_t* tracker = NULL;
 
     engine = engine_new();
 
@@ -129,6 +662,30 @@ int main(int argc, char** args) {
         switch (c) {
 	case 'j':
 	    break;
+        case 'l':
+            listenaddr = optarg;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'M':
+            metricsaddr = optarg;
+            break;
+        case 'N':
+            sl_split(nodes, optarg, ",");
+            break;
+        case 'm':
+            mosaic = TRUE;
+            break;
+        case 't':
+            track = TRUE;
+            break;
+        case 'r':
+            ringspec = optarg;
+            break;
+        case 'x':
+            anqfits_set_hdu_index_enabled(TRUE);
+            break;
         case 'D':
             datalog = optarg;
             break;
@@ -173,7 +730,7 @@ int main(int argc, char** args) {
         }
     }
 
-    if (optind == argc && !infn) {
+    if (optind == argc && !infn && !listenaddr && !ringspec) {
         // Need extra args: filename
         printf("You must specify at least one input file!\n\n");
         help = TRUE;
@@ -187,6 +744,7 @@ int main(int argc, char** args) {
     gslutils_use_error_system();
 
     log_init(loglvl);
+    profile_enable_from_env("astrometry-engine");
     if (tostderr)
         log_to(stderr);
 
@@ -222,105 +780,50 @@ int main(int argc, char** args) {
     mydir = sl_append(strings, dirname(me));
     free(me);
 
-    // Read config file
-    if (!configfn) {
-        int i;
-        sl* trycf = sl_new(4);
-        sl_appendf(trycf, "%s/%s/%s", mydir, default_config_path, default_configfn);
-        // if I'm in /usr/bin, look for config file in /etc
-        if (streq(mydir, "/usr/bin")) {
-            sl_appendf(trycf, "/etc/%s", default_configfn);
-        }
-        sl_appendf(trycf, "%s/%s", mydir, default_configfn);
-        sl_appendf(trycf, "./%s", default_configfn);
-        sl_appendf(trycf, "./%s/%s", default_config_path, default_configfn);
-        for (i=0; i<sl_size(trycf); i++) {
-            char* cf = sl_get(trycf, i);
-            if (file_exists(cf)) {
-                configfn = strdup(cf);
-                logverb("Using config file \"%s\"\n", cf);
-                break;
-            } else {
-                logverb("Config file \"%s\" doesn't exist.\n", cf);
-            }
-        }
-        if (!configfn) {
-            char* cflist = sl_join(trycf, "\n  ");
-            logerr("Couldn't find config file: tried:\n  %s\n", cflist);
-            free(cflist);
-        }
-        sl_free2(trycf);
-    }
-
-    if (!streq(configfn, "none")) {
-        if (engine_parse_config_file(engine, configfn)) {
-            logerr("Failed to parse (or encountered an error while interpreting) config file \"%s\"\n", configfn);
-            exit( -1);
-        }
-    }
-
-    if (sl_size(index_dirs)) {
-        // save the engine_t state, add the search paths & auto-index them, then revert.
-        sl* saved_paths = engine->index_paths;
-        engine->index_paths = index_dirs;
-        if (engine_autoindex_search_paths(engine)) {
-            logerr("Failed to search directories for index files: [%s]", sl_join(index_dirs, ", "));
-            exit( -1);
-        }
-        engine->index_paths = saved_paths;
-    }
-
-    if (sl_size(index_files)) {
-        // Expand globs.
-        for (i=0; i<sl_size(index_files); i++) {
-            char* s = sl_get(index_files, i);
-            glob_t myglob;
-            int flags = GLOB_TILDE | GLOB_BRACE;
-            if (glob(s, flags, NULL, &myglob)) {
-                SYSERROR("Failed to expand wildcards in index-file path \"%s\"", s);
-                exit(-1);
-            }
-            for (c=0; c<myglob.gl_pathc; c++) {
-                if (engine_add_index(engine, myglob.gl_pathv[c])) {
-                    ERROR("Failed to add index \"%s\"", myglob.gl_pathv[c]);
-                    exit(-1);
-                }
-            }
-            globfree(&myglob);
-        }
+    if (sl_size(nodes)) {
+        engine->coordinator = engine_coordinator_new(nodes);
+        if (!engine->coordinator)
+            exit(-1);
+        logmsg("Coordinating %zu nodes\n", sl_size(nodes));
     }
 
-    if (!pl_size(engine->indexes)) {
-        logerr("\n\n"
-               "---------------------------------------------------------------------\n"
-               "You must list at least one index in the config file (%s)\n\n"
-               "See http://astrometry.net/use.html about how to get some index files.\n"
-               "---------------------------------------------------------------------\n"
-               "\n", configfn);
+    if (engine_configure(engine, configfn, mydir, index_dirs, index_files))
         exit(-1);
-    }
+    free(configfn);
 
-    if (engine->minwidth <= 0.0 || engine->maxwidth <= 0.0) {
-        logerr("\"minwidth\" and \"maxwidth\" in the config file %s must be positive!\n", configfn);
-        exit(-1);
-    }
+    engine->cancelfn = cancelfn;
+    engine->solvedfn = solvedfn;
 
-    free(configfn);
+    if (listenaddr) {
+        int rtn = run_server(engine, listenaddr, nworkers, metricsaddr,
+                             basedir);
+        engine_metrics_free(engine->metrics);
+        engine_coordinator_free(engine->coordinator);
+        engine_free(engine);
+        sl_free2(nodes);
+        sl_free2(strings);
+        sl_free2(index_files);
+        sl_free2(index_dirs);
+        return rtn;
+    }
 
-    if (!il_size(engine->default_depths)) {
-        parse_depth_string(engine->default_depths,
-                           "10 20 30 40 50 60 70 80 90 100 "
-                           "110 120 130 140 150 160 170 180 190 200");
+    if (ringspec) {
+        int rtn = run_ring(engine, ringspec);
+        engine_coordinator_free(engine->coordinator);
+        engine_free(engine);
+        sl_free2(nodes);
+        sl_free2(strings);
+        sl_free2(index_files);
+        sl_free2(index_dirs);
+        return rtn;
     }
 
-    engine->cancelfn = cancelfn;
-    engine->solvedfn = solvedfn;
+    if (track)
+        tracker = engine_tracker_new(engine);
 
     i = optind;
     while (1) {
         char* jobfn;
-        job_t* job;
-        struct timeval tv1, tv2;
 
         if (infn) {
             // Read name of next input file to be read.
@@ -334,28 +837,20 @@ int main(int argc, char** args) {
             jobfn = args[i];
             i++;
         }
-        gettimeofday(&tv1, NULL);
-        logmsg("Reading file \"%s\"...\n", jobfn);
-        job = engine_read_job_file(engine, jobfn);
-        if (!job) {
-            ERROR("Failed to read job file \"%s\"", jobfn);
+        if (mosaic) {
+            if (engine_run_mosaic(engine, jobfn, basedir, NULL))
+                exit(-1);
+        } else if (tracker) {
+            if (engine_tracker_run_job_file(tracker, jobfn, basedir, NULL))
+                exit(-1);
+        } else if (engine_run_job_file(engine, jobfn, basedir, NULL) == -1)
             exit(-1);
-        }
-
-	if (basedir) {
-            logverb("Setting job's output base directory to %s\n", basedir);
-            job_set_output_base_dir(job, basedir);
-	}
-
-        if (engine_run_job(engine, job))
-            logerr("Failed to run_job()\n");
-
-        job_free(job);
-        gettimeofday(&tv2, NULL);
-        logverb("Spent %g seconds on this field.\n", millis_between(&tv1, &tv2)/1000.0);
     }
 
+    engine_tracker_free(tracker);
+    engine_coordinator_free(engine->coordinator);
     engine_free(engine);
+    sl_free2(nodes);
     sl_free2(strings);
     sl_free2(index_files);
     sl_free2(index_dirs);
@@ -0,0 +1,369 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "os-features.h"
+#include "engine-metrics.h"
+#include "solver.h"
+#include "errors.h"
+#include "log.h"
+
+// upper bounds of the time-to-solve histogram buckets, in seconds (plus
+// +Inf).
+static const double solve_buckets[] = {
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300 };
+#define N_BUCKETS (sizeof(solve_buckets) / sizeof(double))
+
+// distinct indexes with their own histogram; solves with any others are
+// lumped together under index="other".
+#define N_INDEX_SLOTS 64
+
+static const char* result_names[ENGINE_METRICS_N_RESULTS] = {
+    "solved", "unsolved", "error" };
+
+struct solve_histogram {
+    // 0 while the slot is free.
+    int32_t indexid;
+    int64_t buckets[N_BUCKETS + 1];
+    int64_t count;
+    int64_t sum_us;
+};
+
+// Times are kept as integer microseconds so that they can be updated
+// atomically.
+struct engine_metrics {
+    int64_t start_time;
+    int64_t workers;
+    int64_t connections;
+    int64_t jobs_running;
+    int64_t jobs[ENGINE_METRICS_N_RESULTS];
+    int64_t job_us;
+    struct solve_histogram solve[N_INDEX_SLOTS];
+    struct solve_histogram solve_other;
+    int64_t stage_wall_us[SOLVER_N_STAGES];
+    int64_t stage_cpu_us[SOLVER_N_STAGES];
+    int64_t quads_tried;
+    int64_t quads_matched;
+    int64_t matches_verified;
+    int64_t index_loads;
+    int64_t index_load_us;
+    int64_t index_hits;
+    int64_t index_misses;
+    int64_t index_evictions;
+    int64_t resident_indexes;
+    int64_t resident_bytes;
+    int64_t majflt;
+    int64_t minflt;
+};
+
+#define ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static int64_t to_us(double seconds) {
+    return (int64_t)(seconds * 1e6 + 0.5);
+}
+
+engine_metrics_t* engine_metrics_new(void) {
+    engine_metrics_t* m;
+    m = mmap(NULL, sizeof(engine_metrics_t), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        SYSERROR("Failed to allocate shared memory for metrics");
+        return NULL;
+    }
+    // (anonymous mappings start zeroed.)
+    m->start_time = (int64_t)time(NULL);
+    return m;
+}
+
+void engine_metrics_free(engine_metrics_t* m) {
+    if (!m)
+        return;
+    munmap(m, sizeof(engine_metrics_t));
+}
+
+void engine_metrics_set_workers(engine_metrics_t* m, int nworkers) {
+    __atomic_store_n(&m->workers, nworkers, __ATOMIC_RELAXED);
+}
+
+void engine_metrics_add_connection(engine_metrics_t* m, int delta) {
+    ADD(m->connections, delta);
+}
+
+void engine_metrics_job_started(engine_metrics_t* m) {
+    ADD(m->jobs_running, 1);
+}
+
+// Finds (or claims) the histogram for "indexid".
+static struct solve_histogram* get_histogram(engine_metrics_t* m,
+                                             int indexid) {
+    int i;
+    if (indexid <= 0)
+        return &m->solve_other;
+    for (i=0; i<N_INDEX_SLOTS; i++) {
+        int32_t id = GET(m->solve[i].indexid);
+        if (id == indexid)
+            return m->solve + i;
+        if (id == 0) {
+            int32_t expected = 0;
+            if (__atomic_compare_exchange_n(&m->solve[i].indexid, &expected,
+                                            indexid, FALSE, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED) ||
+                expected == indexid)
+                return m->solve + i;
+        }
+    }
+    return &m->solve_other;
+}
+
+void engine_metrics_job_finished(engine_metrics_t* m, int result,
+                                 double seconds, long majflt, long minflt,
+                                 const onefield_t* bp) {
+    int i;
+    ADD(m->jobs_running, -1);
+    ADD(m->jobs[result], 1);
+    ADD(m->job_us, to_us(seconds));
+    ADD(m->majflt, majflt);
+    ADD(m->minflt, minflt);
+    if (!bp)
+        return;
+    if (result == ENGINE_METRICS_SOLVED) {
+        struct solve_histogram* h = get_histogram(m, bp->solved_indexid);
+        for (i=0; i<(int)N_BUCKETS; i++)
+            if (seconds <= solve_buckets[i])
+                break;
+        ADD(h->buckets[i], 1);
+        ADD(h->count, 1);
+        ADD(h->sum_us, to_us(seconds));
+    }
+    for (i=0; i<SOLVER_N_STAGES; i++) {
+        ADD(m->stage_wall_us[i], to_us(bp->stage_wall[i]));
+        ADD(m->stage_cpu_us [i], to_us(bp->stage_cpu [i]));
+    }
+    ADD(m->quads_tried, bp->numtries);
+    ADD(m->quads_matched, bp->nummatches);
+    ADD(m->matches_verified, bp->num_verified);
+    ADD(m->index_loads, bp->nindex_loads);
+    ADD(m->index_load_us, to_us(bp->index_load_time));
+}
+
+void engine_metrics_index_residency(engine_metrics_t* m,
+                                    const index_residency_stats_t* before,
+                                    const index_residency_stats_t* after) {
+    ADD(m->index_hits, after->hits - before->hits);
+    ADD(m->index_misses, after->misses - before->misses);
+    ADD(m->index_evictions, after->evictions - before->evictions);
+    // (summed over the workers)
+    ADD(m->resident_indexes, after->nresident - before->nresident);
+    ADD(m->resident_bytes, (int64_t)after->resident_bytes -
+        (int64_t)before->resident_bytes);
+}
+
+static void write_histogram(FILE* fid, const struct solve_histogram* h,
+                            const char* label) {
+    int64_t n = 0;
+    int i;
+    for (i=0; i<(int)N_BUCKETS; i++) {
+        n += GET(h->buckets[i]);
+        fprintf(fid, "astrometry_engine_solve_seconds_bucket{index=\"%s\",le=\"%g\"} %lld\n",
+                label, solve_buckets[i], (long long)n);
+    }
+    fprintf(fid, "astrometry_engine_solve_seconds_bucket{index=\"%s\",le=\"+Inf\"} %lld\n",
+            label, (long long)GET(h->count));
+    fprintf(fid, "astrometry_engine_solve_seconds_sum{index=\"%s\"} %g\n",
+            label, GET(h->sum_us) * 1e-6);
+    fprintf(fid, "astrometry_engine_solve_seconds_count{index=\"%s\"} %lld\n",
+            label, (long long)GET(h->count));
+}
+
+static void write_counter(FILE* fid, const char* name, const char* help,
+                          long long val) {
+    fprintf(fid, "# HELP %s %s\n# TYPE %s counter\n%s %lld\n",
+            name, help, name, name, val);
+}
+
+static void write_gauge(FILE* fid, const char* name, const char* help,
+                        long long val) {
+    fprintf(fid, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+            name, help, name, name, val);
+}
+
+int engine_metrics_write(const engine_metrics_t* cm, FILE* fid) {
+    // (GET() wants a non-const pointer.)
+    engine_metrics_t* m = (engine_metrics_t*)cm;
+    int i;
+
+    write_gauge(fid, "astrometry_engine_start_time_seconds",
+                "Unix time the server started.", m->start_time);
+    write_gauge(fid, "astrometry_engine_workers",
+                "Number of worker processes.", GET(m->workers));
+    write_gauge(fid, "astrometry_engine_connections",
+                "Client connections being served.", GET(m->connections));
+    write_gauge(fid, "astrometry_engine_jobs_running",
+                "Jobs being solved.", GET(m->jobs_running));
+
+    fprintf(fid, "# HELP astrometry_engine_jobs_total Jobs finished, by outcome.\n"
+            "# TYPE astrometry_engine_jobs_total counter\n");
+    for (i=0; i<ENGINE_METRICS_N_RESULTS; i++)
+        fprintf(fid, "astrometry_engine_jobs_total{result=\"%s\"} %lld\n",
+                result_names[i], (long long)GET(m->jobs[i]));
+    fprintf(fid, "# HELP astrometry_engine_job_seconds_total Wall-clock time spent on jobs.\n"
+            "# TYPE astrometry_engine_job_seconds_total counter\n"
+            "astrometry_engine_job_seconds_total %g\n", GET(m->job_us) * 1e-6);
+
+    fprintf(fid, "# HELP astrometry_engine_solve_seconds Time to solve, by the index that solved.\n"
+            "# TYPE astrometry_engine_solve_seconds histogram\n");
+    for (i=0; i<N_INDEX_SLOTS; i++) {
+        char label[16];
+        int id = GET(m->solve[i].indexid);
+        if (!id)
+            break;
+        sprintf(label, "%i", id);
+        write_histogram(fid, m->solve + i, label);
+    }
+    if (GET(m->solve_other.count))
+        write_histogram(fid, &m->solve_other, "other");
+
+    fprintf(fid, "# HELP astrometry_engine_stage_seconds_total Solver time by stage.\n"
+            "# TYPE astrometry_engine_stage_seconds_total counter\n");
+    for (i=0; i<SOLVER_N_STAGES; i++) {
+        fprintf(fid, "astrometry_engine_stage_seconds_total{stage=\"%s\",clock=\"wall\"} %g\n",
+                solver_stage_name(i), GET(m->stage_wall_us[i]) * 1e-6);
+        fprintf(fid, "astrometry_engine_stage_seconds_total{stage=\"%s\",clock=\"cpu\"} %g\n",
+                solver_stage_name(i), GET(m->stage_cpu_us[i]) * 1e-6);
+    }
+
+    write_counter(fid, "astrometry_engine_quads_tried_total",
+                  "Field quads tried.", GET(m->quads_tried));
+    write_counter(fid, "astrometry_engine_quads_matched_total",
+                  "Field quads that matched an index quad.", GET(m->quads_matched));
+    write_counter(fid, "astrometry_engine_matches_verified_total",
+                  "Matches verified.", GET(m->matches_verified));
+    write_counter(fid, "astrometry_engine_index_loads_total",
+                  "Indexes made ready for a job.", GET(m->index_loads));
+    fprintf(fid, "# HELP astrometry_engine_index_load_seconds_total Time spent making indexes ready.\n"
+            "# TYPE astrometry_engine_index_load_seconds_total counter\n"
+            "astrometry_engine_index_load_seconds_total %g\n",
+            GET(m->index_load_us) * 1e-6);
+    write_counter(fid, "astrometry_engine_index_hits_total",
+                  "Indexes that were already loaded when a job needed them.",
+                  GET(m->index_hits));
+    write_counter(fid, "astrometry_engine_index_misses_total",
+                  "Indexes that had to be loaded when a job needed them.",
+                  GET(m->index_misses));
+    write_counter(fid, "astrometry_engine_index_evictions_total",
+                  "Indexes unloaded to stay within the index_residency budget.",
+                  GET(m->index_evictions));
+    write_gauge(fid, "astrometry_engine_resident_indexes",
+                "Indexes kept loaded under the index_residency budget.",
+                GET(m->resident_indexes));
+    write_gauge(fid, "astrometry_engine_resident_index_bytes",
+                "Size of the indexes kept loaded.", GET(m->resident_bytes));
+    fprintf(fid, "# HELP astrometry_engine_page_faults_total Page faults during jobs.\n"
+            "# TYPE astrometry_engine_page_faults_total counter\n"
+            "astrometry_engine_page_faults_total{kind=\"major\"} %lld\n"
+            "astrometry_engine_page_faults_total{kind=\"minor\"} %lld\n",
+            (long long)GET(m->majflt), (long long)GET(m->minflt));
+    return ferror(fid) ? -1 : 0;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void answer_http(engine_metrics_t* m, int fd) {
+    char req[4096];
+    size_t nreq = 0;
+    char* body = NULL;
+    size_t bodylen = 0;
+    char hdr[256];
+    FILE* fid;
+
+    // read the request headers, without waiting long for a slow client.
+    while (nreq < sizeof(req) - 1) {
+        struct pollfd pfd;
+        ssize_t n;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0)
+            return;
+        n = read(fd, req + nreq, sizeof(req) - 1 - nreq);
+        if (n <= 0)
+            return;
+        nreq += n;
+        req[nreq] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    fid = open_memstream(&body, &bodylen);
+    if (!fid)
+        return;
+    engine_metrics_write(m, fid);
+    fclose(fid);
+    snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", bodylen);
+    if (write_all(fd, hdr, strlen(hdr)) == 0 &&
+        strncmp(req, "HEAD ", 5))
+        write_all(fd, body, bodylen);
+    free(body);
+}
+
+struct metrics_server {
+    engine_metrics_t* m;
+    int lfd;
+};
+
+static void* metrics_thread(void* arg) {
+    struct metrics_server* ms = arg;
+    for (;;) {
+        int fd = accept(ms->lfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            SYSERROR("Failed to accept() metrics connection");
+            sleep(1);
+            continue;
+        }
+        answer_http(ms->m, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int engine_metrics_serve(engine_metrics_t* m, int lfd) {
+    struct metrics_server* ms = malloc(sizeof(struct metrics_server));
+    pthread_t thread;
+    ms->m = m;
+    ms->lfd = lfd;
+    if (pthread_create(&thread, NULL, metrics_thread, ms)) {
+        SYSERROR("Failed to start metrics thread");
+        free(ms);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
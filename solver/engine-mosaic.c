@@ -0,0 +1,404 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "engine-mosaic.h"
+#include "engine.h"
+#include "onefield.h"
+#include "xylist.h"
+#include "fit-wcs.h"
+#include "sip.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "bl.h"
+#include "ioutils.h"
+#include "fileutils.h"
+#include "log.h"
+#include "errors.h"
+
+#define DEFAULT_NBLIND 3
+
+struct chip {
+    mosaic_chip_t pos;
+    char* jobfn;
+    double W;
+    double H;
+    int nsources;
+    anbool solved;
+    sip_t wcs;
+    // the matched stars of "wcs".
+    int nmatch;
+    double* fieldxy;
+    double* refxyz;
+};
+
+// Pixel p of chip "to" is pixel A p + t of chip "from".
+static void chip_transform(const mosaic_chip_t* from, const mosaic_chip_t* to,
+                           double A[2][2], double* t) {
+    double a = deg2rad(from->rotation);
+    double b = deg2rad(to->rotation - from->rotation);
+    double dx = to->x - from->x;
+    double dy = to->y - from->y;
+    A[0][0] =  cos(b);
+    A[0][1] = -sin(b);
+    A[1][0] =  sin(b);
+    A[1][1] =  cos(b);
+    t[0] =  cos(a) * dx + sin(a) * dy;
+    t[1] = -sin(a) * dx + cos(a) * dy;
+}
+
+void mosaic_predict_tan(const tan_t* wcs, const mosaic_chip_t* from,
+                        const mosaic_chip_t* to, tan_t* out) {
+    double A[2][2], t[2];
+    double c[2];
+    tan_t res = *wcs;
+    int i;
+    chip_transform(from, to, A, t);
+    c[0] = wcs->crpix[0] - t[0];
+    c[1] = wcs->crpix[1] - t[1];
+    for (i=0; i<2; i++) {
+        res.cd[i][0] = wcs->cd[i][0] * A[0][0] + wcs->cd[i][1] * A[1][0];
+        res.cd[i][1] = wcs->cd[i][0] * A[0][1] + wcs->cd[i][1] * A[1][1];
+    }
+    res.crpix[0] = A[0][0] * c[0] + A[1][0] * c[1];
+    res.crpix[1] = A[0][1] * c[0] + A[1][1] * c[1];
+    *out = res;
+}
+
+static void chip_to_focal(const mosaic_chip_t* pos, double px, double py,
+                          double* fx, double* fy) {
+    double r = deg2rad(pos->rotation);
+    *fx = pos->x + cos(r) * px - sin(r) * py;
+    *fy = pos->y + sin(r) * px + cos(r) * py;
+}
+
+// The WCS of chip "to" that agrees with "wcs", the WCS of "from".
+static int predict_chip_wcs(const sip_t* wcs, const mosaic_chip_t* from,
+                            const struct chip* to, sip_t* out) {
+    double A[2][2], t[2];
+    chip_transform(from, &to->pos, A, t);
+    return fit_wcs_transformed(wcs, A, t, to->W, to->H, out);
+}
+
+static int parse_layout(const char* layoutfn, bl* chips, int* nblind,
+                        int* joint_order) {
+    sl* lines;
+    char* dir;
+    size_t i;
+    int rtn = 0;
+
+    lines = file_get_lines(layoutfn, FALSE);
+    if (!lines) {
+        ERROR("Failed to read mosaic layout file \"%s\"", layoutfn);
+        return -1;
+    }
+    dir = dirname_safe(layoutfn);
+    for (i=0; i<sl_size(lines); i++) {
+        char* line = sl_get(lines, i);
+        char* nextword;
+        char fn[1024];
+        struct chip chip;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (!*line || *line == '#')
+            continue;
+        if (is_word(line, "chip ", &nextword)) {
+            memset(&chip, 0, sizeof(struct chip));
+            if (sscanf(nextword, "%1023s %lf %lf %lf", fn, &chip.pos.x,
+                       &chip.pos.y, &chip.pos.rotation) != 4) {
+                ERROR("Mosaic layout %s, line %zu: expected \"chip <job> <x> "
+                      "<y> <rotation>\"", layoutfn, i + 1);
+                rtn = -1;
+                break;
+            }
+            chip.jobfn = resolve_path(fn, dir);
+            bl_append(chips, &chip);
+        } else if (is_word(line, "blind ", &nextword)) {
+            *nblind = atoi(nextword);
+        } else if (is_word(line, "joint_tweak ", &nextword)) {
+            *joint_order = atoi(nextword);
+        } else {
+            ERROR("Mosaic layout %s, line %zu: didn't understand \"%s\"",
+                  layoutfn, i + 1, line);
+            rtn = -1;
+            break;
+        }
+    }
+    free(dir);
+    sl_free2(lines);
+    if (!rtn && !bl_size(chips)) {
+        ERROR("Mosaic layout %s has no chips", layoutfn);
+        rtn = -1;
+    }
+    return rtn;
+}
+
+static job_t* read_chip_job(engine_t* engine, struct chip* chip,
+                            const char* basedir) {
+    job_t* job;
+    logmsg("Reading file \"%s\"...\n", chip->jobfn);
+    job = engine_read_job_file(engine, chip->jobfn);
+    if (!job) {
+        ERROR("Failed to read job file \"%s\"", chip->jobfn);
+        return NULL;
+    }
+    if (engine->flat_outputs)
+        job_set_output_base_dir(job, NULL);
+    else if (basedir)
+        job_set_output_base_dir(job, basedir);
+    job->bp.keep_matches = TRUE;
+    return job;
+}
+
+// The number of sources in the job's (first) field, or -1.
+static int count_sources(job_t* job) {
+    onefield_t* bp = &(job->bp);
+    int field = il_size(bp->fieldlist) ? il_get(bp->fieldlist, 0) : 1;
+    xylist_t* ls;
+    int n = -1;
+
+    ls = xylist_open(bp->fieldfname);
+    if (!ls)
+        return -1;
+    if (!xylist_open_field(ls, field))
+        n = xylist_get_nrows(ls);
+    xylist_close(ls);
+    return n;
+}
+
+/*
+ Runs the chip's job: a blind solve, or (with "verify") a check of that
+ WCS only, which is kept untweaked (tweaking the few stars of a small
+ chip can lose the solution).  With "replace", the chip is run even if
+ it has already been solved.  Returns 1 if solved, 0 if not, -1 if the
+ job can't be read.
+ */
+static int run_chip(engine_t* engine, struct chip* chip, const char* basedir,
+                    const sip_t* verify, anbool replace) {
+    job_t* job;
+    onefield_t* bp;
+    int solved;
+
+    job = read_chip_job(engine, chip, basedir);
+    if (!job)
+        return -1;
+    bp = &(job->bp);
+    if (verify) {
+        onefield_clear_verify_wcses(bp);
+        onefield_add_verify_wcs(bp, (sip_t*)verify);
+        job->verify_only = TRUE;
+        bp->solver.do_tweak = FALSE;
+    }
+    if (replace)
+        onefield_set_solvedin_file(bp, NULL);
+    engine_run_job(engine, job);
+
+    solved = bp->have_solved_wcs;
+    if (solved) {
+        chip->solved = TRUE;
+        chip->wcs = bp->solved_wcs;
+        free(chip->fieldxy);
+        free(chip->refxyz);
+        chip->nmatch = bp->solved_nmatch;
+        chip->fieldxy = bp->solved_fieldxy;
+        chip->refxyz = bp->solved_refxyz;
+        bp->solved_fieldxy = bp->solved_refxyz = NULL;
+        bp->solved_nmatch = 0;
+    }
+    job_free(job);
+    return solved;
+}
+
+/*
+ Fits one SIP WCS of order "order" to the matches of all the solved
+ chips, in focal-plane coordinates, starting from that of chip "ref",
+ and re-verifies each solved chip with its part of it.
+ */
+static void joint_tweak(engine_t* engine, struct chip* chips, int N, int ref,
+                        int order, const char* basedir) {
+    mosaic_chip_t origin;
+    double fmax[2];
+    sip_t focal;
+    double* xy;
+    double* xyz;
+    int i, j, k, M = 0, nchips = 0, nok = 0;
+
+    // the focal-plane pixel coordinates start at the chips' lower corner.
+    origin.x = origin.y = HUGE_VAL;
+    fmax[0] = fmax[1] = -HUGE_VAL;
+    origin.rotation = 0.0;
+    for (i=0; i<N; i++) {
+        for (k=0; k<4; k++) {
+            double fx, fy;
+            chip_to_focal(&chips[i].pos, (k & 1) ? chips[i].W : 0,
+                          (k & 2) ? chips[i].H : 0, &fx, &fy);
+            origin.x = MIN(origin.x, fx);
+            origin.y = MIN(origin.y, fy);
+            fmax[0] = MAX(fmax[0], fx);
+            fmax[1] = MAX(fmax[1], fy);
+        }
+        if (chips[i].solved && chips[i].nmatch) {
+            M += chips[i].nmatch;
+            nchips++;
+        }
+    }
+    if (M < (order + 1) * (order + 2)) {
+        logmsg("Mosaic: only %i matched stars; skipping the joint tweak.\n", M);
+        return;
+    }
+
+    xy = malloc(M * 2 * sizeof(double));
+    xyz = malloc(M * 3 * sizeof(double));
+    k = 0;
+    for (i=0; i<N; i++) {
+        if (!chips[i].solved)
+            continue;
+        for (j=0; j<chips[i].nmatch; j++) {
+            chip_to_focal(&chips[i].pos, chips[i].fieldxy[2*j],
+                          chips[i].fieldxy[2*j+1], xy + 2*k, xy + 2*k + 1);
+            xy[2*k]   -= origin.x;
+            xy[2*k+1] -= origin.y;
+            memcpy(xyz + 3*k, chips[i].refxyz + 3*j, 3 * sizeof(double));
+            k++;
+        }
+    }
+    memset(&focal, 0, sizeof(sip_t));
+    mosaic_predict_tan(&chips[ref].wcs.wcstan, &chips[ref].pos, &origin,
+                       &focal.wcstan);
+    focal.wcstan.imagew = fmax[0] - origin.x;
+    focal.wcstan.imageh = fmax[1] - origin.y;
+    if (fit_sip_wcs(xyz, xy, NULL, M, &focal.wcstan, order, order + 1, 1,
+                    &focal)) {
+        logmsg("Mosaic: the joint fit failed.\n");
+        free(xy);
+        free(xyz);
+        return;
+    }
+    free(xy);
+    free(xyz);
+    logmsg("Mosaic: fit a joint SIP WCS of order %i to %i stars on %i chips.\n",
+           order, M, nchips);
+
+    for (i=0; i<N; i++) {
+        sip_t wcs;
+        if (!chips[i].solved)
+            continue;
+        if (predict_chip_wcs(&focal, &origin, chips + i, &wcs)) {
+            logmsg("Mosaic: failed to fit the joint WCS of chip %s\n",
+                   chips[i].jobfn);
+            continue;
+        }
+        if (run_chip(engine, chips + i, basedir, &wcs, TRUE) == 1)
+            nok++;
+        else
+            logmsg("Mosaic: the joint WCS of chip %s didn't verify; keeping "
+                   "its own.\n", chips[i].jobfn);
+    }
+    logmsg("Mosaic: the joint WCS verified on %i of %i chips.\n", nok, nchips);
+}
+
+int engine_run_mosaic(engine_t* engine, const char* layoutfn,
+                      const char* basedir, int* nsolved) {
+    bl* chiplist = bl_new(16, sizeof(struct chip));
+    struct chip* chips = NULL;
+    int nblind = DEFAULT_NBLIND;
+    int joint_order = 0;
+    int* order = NULL;
+    int i, N = 0, ref = -1, nblinded = 0, n = 0;
+    int rtn = -1;
+
+    if (parse_layout(layoutfn, chiplist, &nblind, &joint_order))
+        goto done;
+    N = bl_size(chiplist);
+    chips = calloc(N, sizeof(struct chip));
+    for (i=0; i<N; i++)
+        memcpy(chips + i, bl_access(chiplist, i), sizeof(struct chip));
+
+    for (i=0; i<N; i++) {
+        job_t* job = read_chip_job(engine, chips + i, basedir);
+        if (!job)
+            goto done;
+        chips[i].W = job->bp.solver.field_maxx;
+        chips[i].H = job->bp.solver.field_maxy;
+        chips[i].nsources = count_sources(job);
+        job_free(job);
+    }
+
+    // blind-solve the chips with the most sources first.
+    order = malloc(N * sizeof(int));
+    for (i=0; i<N; i++)
+        order[i] = i;
+    for (i=1; i<N; i++) {
+        int j, o = order[i];
+        for (j=i; j>0 && chips[order[j-1]].nsources < chips[o].nsources; j--)
+            order[j] = order[j-1];
+        order[j] = o;
+    }
+    for (i=0; i<N && nblinded<nblind; i++) {
+        struct chip* chip = chips + order[i];
+        logmsg("Mosaic: blind-solving chip %s (%i sources)\n", chip->jobfn,
+               chip->nsources);
+        nblinded++;
+        if (run_chip(engine, chip, basedir, NULL, FALSE) == 1) {
+            ref = order[i];
+            break;
+        }
+    }
+    if (ref == -1) {
+        logmsg("Mosaic: none of the %i chips tried solved.\n", nblinded);
+        rtn = 0;
+        goto done;
+    }
+
+    for (i=0; i<N; i++) {
+        struct chip* chip = chips + i;
+        sip_t wcs;
+        if (chip->solved || i == ref)
+            continue;
+        if (predict_chip_wcs(&chips[ref].wcs, &chips[ref].pos, chip, &wcs))
+            logmsg("Mosaic: failed to predict the WCS of chip %s\n",
+                   chip->jobfn);
+        else {
+            logmsg("Mosaic: verifying the predicted WCS of chip %s\n",
+                   chip->jobfn);
+            if (run_chip(engine, chip, basedir, &wcs, FALSE) == 1)
+                continue;
+        }
+        logmsg("Mosaic: prediction failed; blind-solving chip %s\n",
+               chip->jobfn);
+        run_chip(engine, chip, basedir, NULL, FALSE);
+    }
+
+    if (joint_order > 0)
+        joint_tweak(engine, chips, N, ref, joint_order, basedir);
+    rtn = 0;
+
+ done:
+    for (i=0; chips && i<N; i++)
+        n += chips[i].solved;
+    if (!rtn)
+        logmsg("Mosaic: solved %i of %i chips.\n", n, N);
+    if (nsolved)
+        *nsolved = n;
+    if (chips) {
+        for (i=0; i<N; i++) {
+            free(chips[i].jobfn);
+            free(chips[i].fieldxy);
+            free(chips[i].refxyz);
+        }
+    } else {
+        for (i=0; i<bl_size(chiplist); i++)
+            free(((struct chip*)bl_access(chiplist, i))->jobfn);
+    }
+    free(chips);
+    free(order);
+    bl_free(chiplist);
+    return rtn;
+}
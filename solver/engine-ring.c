@@ -0,0 +1,581 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "os-features.h"
+#include "engine-ring.h"
+#include "engine-tracking.h"
+#include "engine.h"
+#include "onefield.h"
+#include "image2xy.h"
+#include "simplexy.h"
+#include "starxy.h"
+#include "fit-wcs.h"
+#include "fitsioutils.h"
+#include "qfits_header.h"
+#include "sip.h"
+#include "mathutil.h"
+#include "tic.h"
+#include "log.h"
+#include "errors.h"
+
+// frame alignment, as in engine-tracking.c: match radius in pixels,
+// and the fewest matches to trust.
+#define RING_TRACK_RADIUS 3.0
+#define RING_TRACK_MIN_MATCH 6
+
+struct frame_ring {
+    char* name;
+    frame_ring_header_t* hdr;
+    size_t size;
+    // did we create it?
+    anbool owner;
+};
+
+struct engine_ring {
+    engine_t* engine;
+    frame_ring_t* ring;
+    // the last solved frame: its sources, size and WCS.
+    starxy_t* ref_xy;
+    int ref_w, ref_h;
+    sip_t ref_wcs;
+    int nframes;
+    int ntracked;
+    int nblind;
+    int nfailed;
+};
+
+static void ring_lock(frame_ring_t* r) {
+    int err = pthread_mutex_lock(&r->hdr->lock);
+#ifdef __linux__
+    // a process died holding the lock; each state change is a single
+    // store, so the slots are still consistent.
+    if (err == EOWNERDEAD)
+        pthread_mutex_consistent(&r->hdr->lock);
+#else
+    (void)err;
+#endif
+}
+
+static void ring_unlock(frame_ring_t* r) {
+    pthread_mutex_unlock(&r->hdr->lock);
+}
+
+/*
+ Waits (with the lock held) for a change, until "deadline" (as from
+ timenow(); forever if negative).  Returns nonzero if the deadline
+ passed.
+ */
+static int ring_wait(frame_ring_t* r, double deadline) {
+    struct timespec ts;
+    int err;
+    if (deadline < 0) {
+        err = pthread_cond_wait(&r->hdr->changed, &r->hdr->lock);
+    } else {
+        ts.tv_sec = (time_t)floor(deadline);
+        ts.tv_nsec = (long)((deadline - floor(deadline)) * 1e9);
+        err = pthread_cond_timedwait(&r->hdr->changed, &r->hdr->lock, &ts);
+    }
+#ifdef __linux__
+    if (err == EOWNERDEAD) {
+        pthread_mutex_consistent(&r->hdr->lock);
+        err = 0;
+    }
+#endif
+    return (err == ETIMEDOUT);
+}
+
+static double deadline_after(double timeout) {
+    return (timeout < 0) ? -1 : timenow() + timeout;
+}
+
+static frame_ring_t* ring_map(const char* name, int fd, size_t size,
+                              anbool owner) {
+    frame_ring_t* r;
+    void* base;
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        SYSERROR("Failed to map frame ring \"%s\"", name);
+        return NULL;
+    }
+    r = calloc(1, sizeof(frame_ring_t));
+    r->name = strdup(name);
+    r->hdr = base;
+    r->size = size;
+    r->owner = owner;
+    return r;
+}
+
+frame_ring_t* frame_ring_create(const char* name, int nslots,
+                                size_t maxpayload) {
+    frame_ring_t* r;
+    frame_ring_header_t* hdr;
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    size_t slotsize, size;
+    int fd, i;
+
+    assert(sizeof(frame_ring_header_t) <= FRAME_RING_HEADER);
+    assert(sizeof(frame_ring_slot_t) <= FRAME_RING_PAYLOAD);
+    if (nslots < 1) {
+        ERROR("A frame ring needs at least one slot");
+        return NULL;
+    }
+    // slots are page-aligned, so that images are too.
+    slotsize = FRAME_RING_PAYLOAD + maxpayload;
+    slotsize = (slotsize + 4095) / 4096 * 4096;
+    size = FRAME_RING_HEADER + (size_t)nslots * slotsize;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd == -1) {
+        SYSERROR("Failed to create shared memory \"%s\"", name);
+        return NULL;
+    }
+    if (ftruncate(fd, size)) {
+        SYSERROR("Failed to size shared memory \"%s\" to %zu bytes", name, size);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    r = ring_map(name, fd, size, TRUE);
+    if (!r) {
+        shm_unlink(name);
+        return NULL;
+    }
+    hdr = r->hdr;
+    memset(hdr, 0, FRAME_RING_HEADER);
+    hdr->version = FRAME_RING_VERSION;
+    hdr->nslots = nslots;
+    hdr->slotsize = slotsize;
+    hdr->next_ticket = 1;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&hdr->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&hdr->changed, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    for (i=0; i<nslots; i++)
+        frame_ring_get_slot(r, i)->state = FRAME_RING_FREE;
+    // last: clients check it.
+    __sync_synchronize();
+    memcpy(hdr->magic, FRAME_RING_MAGIC, sizeof(hdr->magic));
+    return r;
+}
+
+frame_ring_t* frame_ring_open(const char* name) {
+    struct stat st;
+    frame_ring_t* r;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        SYSERROR("Failed to open shared memory \"%s\"", name);
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size < FRAME_RING_HEADER) {
+        ERROR("Shared memory \"%s\" is not a frame ring", name);
+        close(fd);
+        return NULL;
+    }
+    r = ring_map(name, fd, st.st_size, FALSE);
+    if (!r)
+        return NULL;
+    if (memcmp(r->hdr->magic, FRAME_RING_MAGIC, sizeof(r->hdr->magic)) ||
+        r->hdr->version != FRAME_RING_VERSION ||
+        FRAME_RING_HEADER + (size_t)r->hdr->nslots * r->hdr->slotsize > r->size) {
+        ERROR("Shared memory \"%s\" is not a frame ring (of version %i)",
+              name, FRAME_RING_VERSION);
+        frame_ring_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void frame_ring_close(frame_ring_t* r) {
+    if (!r)
+        return;
+    if (r->owner) {
+        pthread_cond_destroy(&r->hdr->changed);
+        pthread_mutex_destroy(&r->hdr->lock);
+    }
+    munmap(r->hdr, r->size);
+    if (r->owner)
+        shm_unlink(r->name);
+    free(r->name);
+    free(r);
+}
+
+int frame_ring_nslots(const frame_ring_t* r) {
+    return r->hdr->nslots;
+}
+
+size_t frame_ring_max_payload(const frame_ring_t* r) {
+    return r->hdr->slotsize - FRAME_RING_PAYLOAD;
+}
+
+frame_ring_slot_t* frame_ring_get_slot(frame_ring_t* r, int i) {
+    return (frame_ring_slot_t*)((char*)r->hdr + FRAME_RING_HEADER +
+                                (size_t)i * r->hdr->slotsize);
+}
+
+void* frame_ring_payload(frame_ring_t* r, frame_ring_slot_t* slot) {
+    return (char*)slot + FRAME_RING_PAYLOAD;
+}
+
+frame_ring_slot_t* frame_ring_acquire(frame_ring_t* r, double timeout) {
+    double deadline = deadline_after(timeout);
+    frame_ring_slot_t* slot = NULL;
+    int i;
+    ring_lock(r);
+    for (;;) {
+        for (i=0; i<(int)r->hdr->nslots; i++) {
+            frame_ring_slot_t* s = frame_ring_get_slot(r, i);
+            if (s->state == FRAME_RING_FREE) {
+                slot = s;
+                break;
+            }
+        }
+        if (slot || ring_wait(r, deadline))
+            break;
+    }
+    if (slot) {
+        memset(slot, 0, sizeof(frame_ring_slot_t));
+        slot->state = FRAME_RING_FILLING;
+    }
+    ring_unlock(r);
+    return slot;
+}
+
+void frame_ring_submit(frame_ring_t* r, frame_ring_slot_t* slot) {
+    ring_lock(r);
+    slot->ticket = r->hdr->next_ticket++;
+    slot->state = FRAME_RING_READY;
+    pthread_cond_broadcast(&r->hdr->changed);
+    ring_unlock(r);
+}
+
+int frame_ring_wait(frame_ring_t* r, frame_ring_slot_t* slot,
+                    double timeout) {
+    double deadline = deadline_after(timeout);
+    int rtn = 0;
+    ring_lock(r);
+    while (slot->state != FRAME_RING_DONE) {
+        if (ring_wait(r, deadline)) {
+            rtn = (slot->state == FRAME_RING_DONE) ? 0 : -1;
+            break;
+        }
+    }
+    ring_unlock(r);
+    return rtn;
+}
+
+void frame_ring_release(frame_ring_t* r, frame_ring_slot_t* slot) {
+    ring_lock(r);
+    slot->state = FRAME_RING_FREE;
+    pthread_cond_broadcast(&r->hdr->changed);
+    ring_unlock(r);
+}
+
+frame_ring_slot_t* frame_ring_next(frame_ring_t* r, double timeout) {
+    double deadline = deadline_after(timeout);
+    frame_ring_slot_t* slot = NULL;
+    int i;
+    ring_lock(r);
+    for (;;) {
+        for (i=0; i<(int)r->hdr->nslots; i++) {
+            frame_ring_slot_t* s = frame_ring_get_slot(r, i);
+            if (s->state == FRAME_RING_READY &&
+                (!slot || s->ticket < slot->ticket))
+                slot = s;
+        }
+        if (slot || ring_wait(r, deadline))
+            break;
+    }
+    if (slot)
+        slot->state = FRAME_RING_BUSY;
+    ring_unlock(r);
+    return slot;
+}
+
+void frame_ring_finish(frame_ring_t* r, frame_ring_slot_t* slot) {
+    ring_lock(r);
+    slot->state = FRAME_RING_DONE;
+    pthread_cond_broadcast(&r->hdr->changed);
+    ring_unlock(r);
+}
+
+engine_ring_t* engine_ring_new(engine_t* engine, frame_ring_t* ring) {
+    engine_ring_t* er = calloc(1, sizeof(engine_ring_t));
+    er->engine = engine;
+    er->ring = ring;
+    return er;
+}
+
+void engine_ring_free(engine_ring_t* er) {
+    if (!er)
+        return;
+    if (er->nframes)
+        logmsg("Frame ring: %i frames: %i tracked, %i blind solves, %i "
+               "unsolved.\n", er->nframes, er->ntracked, er->nblind,
+               er->nfailed);
+    starxy_free(er->ref_xy);
+    free(er);
+}
+
+// The bytes per pixel of image kinds, or 0.
+static int pixel_size(int kind) {
+    switch (kind) {
+    case FRAME_RING_FLOAT:
+        return sizeof(float);
+    case FRAME_RING_U8:
+        return 1;
+    case FRAME_RING_U16:
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ The sources of the slot's frame, brightest first: those given, or
+ those found in its image as image2xy finds them.
+ */
+static starxy_t* frame_sources(frame_ring_slot_t* slot, void* payload,
+                               size_t maxpayload) {
+    simplexy_t s;
+    starxy_t* xy;
+    float* fimg = NULL;
+    size_t npix = (size_t)slot->width * (size_t)slot->height;
+    int i, N;
+
+    if (slot->kind == FRAME_RING_SOURCES) {
+        const float* src = payload;
+        if (slot->nsources < 0 ||
+            (size_t)slot->nsources * 3 * sizeof(float) > maxpayload) {
+            ERROR("Frame ring: %i sources don't fit in a slot", slot->nsources);
+            return NULL;
+        }
+        xy = starxy_new(slot->nsources, TRUE, TRUE);
+        for (i=0; i<slot->nsources; i++) {
+            starxy_set_x(xy, i, src[3*i]);
+            starxy_set_y(xy, i, src[3*i + 1]);
+            starxy_set_flux(xy, i, src[3*i + 2]);
+            xy->background[i] = 0.0;
+        }
+        starxy_sort_by_flux(xy);
+        return xy;
+    }
+    if (!pixel_size(slot->kind)) {
+        ERROR("Frame ring: unknown frame kind %i", slot->kind);
+        return NULL;
+    }
+    if (npix * pixel_size(slot->kind) > maxpayload) {
+        ERROR("Frame ring: a %i x %i image doesn't fit in a slot",
+              slot->width, slot->height);
+        return NULL;
+    }
+
+    memset(&s, 0, sizeof(simplexy_t));
+    s.nx = slot->width;
+    s.ny = slot->height;
+    s.plim = slot->plim;
+    s.dpsf = slot->dpsf;
+    // (on a GPU if the build has OpenCL and there is one)
+    s.gpu = TRUE;
+    if (slot->kind == FRAME_RING_U8) {
+        s.image_u8 = payload;
+        simplexy_fill_in_defaults_u8(&s);
+    } else {
+        if (slot->kind == FRAME_RING_U16) {
+            const uint16_t* u16 = payload;
+            fimg = malloc(npix * sizeof(float));
+            for (i=0; i<(int)npix; i++)
+                fimg[i] = u16[i];
+        } else if (slot->downsample > 1) {
+            // (downsampling works in place)
+            fimg = malloc(npix * sizeof(float));
+            memcpy(fimg, payload, npix * sizeof(float));
+        }
+        s.image = fimg ? fimg : payload;
+        simplexy_fill_in_defaults(&s);
+    }
+    i = image2xy_run(&s, slot->downsample, 0);
+    // (simplexy_free_contents() would free the image, too)
+    s.image = NULL;
+    s.image_u8 = NULL;
+    if (i) {
+        ERROR("Frame ring: failed to find the sources");
+        simplexy_free_contents(&s);
+        free(fimg);
+        return NULL;
+    }
+    N = s.npeaks;
+    xy = starxy_new(N, TRUE, TRUE);
+    for (i=0; i<N; i++) {
+        starxy_set_x(xy, i, s.x[i]);
+        starxy_set_y(xy, i, s.y[i]);
+        starxy_set_flux(xy, i, s.flux[i]);
+        xy->background[i] = s.background[i];
+    }
+    simplexy_free_contents(&s);
+    free(fimg);
+    starxy_sort_by_flux(xy);
+    return xy;
+}
+
+/*
+ Runs a job on the sources "xy" of the slot's frame: a blind solve or
+ (with "verify") a check of that WCS only.  Returns 1 if solved (with
+ the WCS in "wcs"), 0 if not, and -1 on error.
+ */
+static int run_frame(engine_ring_t* er, frame_ring_slot_t* slot,
+                     starxy_t* xy, const sip_t* verify, double t0,
+                     sip_t* wcs) {
+    qfits_header* hdr;
+    job_t* job;
+    onefield_t* bp;
+    int solved;
+
+    hdr = qfits_header_default();
+    qfits_header_add(hdr, "ANRUN", "T", NULL, NULL);
+    fits_header_add_int(hdr, "IMAGEW", slot->width, NULL);
+    fits_header_add_int(hdr, "IMAGEH", slot->height, NULL);
+    if (slot->scale_lo > 0 && slot->scale_hi > 0) {
+        fits_header_add_double(hdr, "ANAPPL1", slot->scale_lo, NULL);
+        fits_header_add_double(hdr, "ANAPPU1", slot->scale_hi, NULL);
+    }
+    if (slot->radius > 0) {
+        fits_header_add_double(hdr, "ANERA", slot->ra, NULL);
+        fits_header_add_double(hdr, "ANEDEC", slot->dec, NULL);
+        fits_header_add_double(hdr, "ANERAD", slot->radius, NULL);
+    }
+    job = engine_job_from_header(er->engine, hdr);
+    qfits_header_destroy(hdr);
+    if (!job)
+        return -1;
+    bp = &(job->bp);
+    bp->field_xy = xy;
+    bp->keep_matches = TRUE;
+    if (verify) {
+        onefield_add_verify_wcs(bp, (sip_t*)verify);
+        job->verify_only = TRUE;
+    }
+    if (slot->timelimit > 0)
+        job_set_deadline(job, t0 + slot->timelimit);
+    engine_run_job(er->engine, job);
+    solved = bp->have_solved_wcs;
+    if (solved) {
+        *wcs = bp->solved_wcs;
+        slot->indexid = bp->solved_indexid;
+        slot->nmatch = bp->solved_nmatch;
+    }
+    job_free(job);
+    return solved;
+}
+
+int engine_ring_solve(engine_ring_t* er, frame_ring_slot_t* slot) {
+    double t0 = timenow();
+    double t1;
+    starxy_t* xy;
+    frame_align_t align;
+    sip_t wcs;
+    int solved = 0;
+
+    slot->status = FRAME_RING_ERROR;
+    slot->nfound = slot->tracked = slot->indexid = slot->nmatch = 0;
+    slot->extract_time = slot->solve_time = 0.0;
+    if (slot->width <= 0 || slot->height <= 0) {
+        ERROR("Frame ring: invalid frame size %i x %i", slot->width,
+              slot->height);
+        return -1;
+    }
+    xy = frame_sources(slot, frame_ring_payload(er->ring, slot),
+                       frame_ring_max_payload(er->ring));
+    if (!xy)
+        return -1;
+    t1 = timenow();
+    slot->extract_time = t1 - t0;
+    slot->nfound = starxy_n(xy);
+    er->nframes++;
+    logverb("Frame %llu: %i sources in %.1f ms\n", (unsigned long long)slot->seq,
+            slot->nfound, 1000. * slot->extract_time);
+
+    if (er->ref_xy && !(slot->flags & FRAME_RING_BLIND) &&
+        slot->width == er->ref_w && slot->height == er->ref_h &&
+        !frame_align(er->ref_xy, xy, RING_TRACK_RADIUS, &align) &&
+        align.nmatch >= RING_TRACK_MIN_MATCH) {
+        sip_t pred;
+        if (!fit_wcs_transformed(&er->ref_wcs, align.A, align.t,
+                                 slot->width, slot->height, &pred)) {
+            solved = run_frame(er, slot, xy, &pred, t0, &wcs);
+            if (solved == 1) {
+                er->ntracked++;
+                slot->tracked = 1;
+            }
+        }
+        if (solved == 0)
+            logverb("Frame %llu: the tracked WCS didn't verify.\n",
+                    (unsigned long long)slot->seq);
+    }
+    if (solved == 0 && slot->nfound) {
+        er->nblind++;
+        solved = run_frame(er, slot, xy, NULL, t0, &wcs);
+    }
+    slot->solve_time = timenow() - t1;
+    if (solved == -1) {
+        starxy_free(xy);
+        return -1;
+    }
+    if (solved) {
+        slot->status = FRAME_RING_SOLVED;
+        slot->crval[0] = wcs.wcstan.crval[0];
+        slot->crval[1] = wcs.wcstan.crval[1];
+        slot->crpix[0] = wcs.wcstan.crpix[0];
+        slot->crpix[1] = wcs.wcstan.crpix[1];
+        memcpy(slot->cd, wcs.wcstan.cd, sizeof(slot->cd));
+        starxy_free(er->ref_xy);
+        er->ref_xy = xy;
+        er->ref_w = slot->width;
+        er->ref_h = slot->height;
+        er->ref_wcs = wcs;
+    } else {
+        slot->status = FRAME_RING_UNSOLVED;
+        er->nfailed++;
+        starxy_free(xy);
+    }
+    logmsg("Frame %llu: %s%s in %.1f ms\n", (unsigned long long)slot->seq,
+           solved ? "solved" : "not solved",
+           slot->tracked ? " (tracked)" : "",
+           1000. * (slot->extract_time + slot->solve_time));
+    return 0;
+}
+
+void engine_ring_serve(engine_ring_t* er, const volatile int* stop) {
+    while (!(stop && *stop)) {
+        frame_ring_slot_t* slot = frame_ring_next(er->ring, 1.0);
+        if (!slot)
+            continue;
+        engine_ring_solve(er, slot);
+        frame_ring_finish(er->ring, slot);
+    }
+}
@@ -0,0 +1,333 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "engine-tracking.h"
+#include "engine.h"
+#include "onefield.h"
+#include "xylist.h"
+#include "fit-wcs.h"
+#include "kdtree.h"
+#include "sip.h"
+#include "mathutil.h"
+#include "bl.h"
+#include "tic.h"
+#include "log.h"
+#include "errors.h"
+
+// the brightest sources of each frame whose offsets are tried...
+#define TRACK_NVOTE 15
+// ... counting the matches of this many of the frame's brightest.
+#define TRACK_NCOUNT 45
+// at most this many of the brightest sources are matched.
+#define TRACK_NMATCH 300
+// match radius, in pixels.
+#define TRACK_RADIUS 3.0
+// frames aligned with fewer matches are blind-solved.
+#define TRACK_MIN_MATCH 6
+
+struct engine_tracker {
+    engine_t* engine;
+    // the last solved frame: its sources and WCS.
+    starxy_t* ref_xy;
+    sip_t ref_wcs;
+    int nframes;
+    int ntracked;
+    int nblind;
+    int nfailed;
+};
+
+/*
+ Moves the first "N" sources of "cur" by (A, t) and looks each up in
+ "kd"; records the matches (index in "cur", index in the tree) in
+ "pairs" if non-NULL.  Returns the number matched.
+ */
+static int match_frames(const kdtree_t* kd, const starxy_t* cur, int N,
+                        const double A[2][2], const double* t, double r2,
+                        int* pairs) {
+    int i, n = 0;
+    for (i=0; i<N; i++) {
+        double x = starxy_getx(cur, i);
+        double y = starxy_gety(cur, i);
+        double pt[2];
+        int ind;
+        pt[0] = A[0][0] * x + A[0][1] * y + t[0];
+        pt[1] = A[1][0] * x + A[1][1] * y + t[1];
+        ind = kdtree_nearest_neighbour_within(kd, pt, r2, NULL);
+        if (ind == -1)
+            continue;
+        if (pairs) {
+            pairs[2*n+0] = i;
+            pairs[2*n+1] = ind;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ Least-squares rotation, scale and shift (A, t) taking the matched
+ sources of "cur" to those in "kd"; returns the rms residual.
+ */
+static double fit_similarity(const kdtree_t* kd, const starxy_t* cur,
+                             const int* pairs, int n, double A[2][2],
+                             double* t) {
+    double pm[2] = { 0, 0 }, qm[2] = { 0, 0 };
+    double spp = 0, sa = 0, sb = 0, r2 = 0;
+    double a, b;
+    int k;
+
+    for (k=0; k<n; k++) {
+        const double* q = kd->data.d + 2 * pairs[2*k+1];
+        pm[0] += starxy_getx(cur, pairs[2*k]);
+        pm[1] += starxy_gety(cur, pairs[2*k]);
+        qm[0] += q[0];
+        qm[1] += q[1];
+    }
+    pm[0] /= n;
+    pm[1] /= n;
+    qm[0] /= n;
+    qm[1] /= n;
+    for (k=0; k<n; k++) {
+        const double* q = kd->data.d + 2 * pairs[2*k+1];
+        double px = starxy_getx(cur, pairs[2*k]) - pm[0];
+        double py = starxy_gety(cur, pairs[2*k]) - pm[1];
+        double qx = q[0] - qm[0];
+        double qy = q[1] - qm[1];
+        spp += px*px + py*py;
+        sa += px*qx + py*qy;
+        sb += px*qy - py*qx;
+    }
+    a = sa / spp;
+    b = sb / spp;
+    A[0][0] = a;
+    A[0][1] = -b;
+    A[1][0] = b;
+    A[1][1] = a;
+    t[0] = qm[0] - (a * pm[0] - b * pm[1]);
+    t[1] = qm[1] - (b * pm[0] + a * pm[1]);
+
+    for (k=0; k<n; k++) {
+        const double* q = kd->data.d + 2 * pairs[2*k+1];
+        double x = starxy_getx(cur, pairs[2*k]);
+        double y = starxy_gety(cur, pairs[2*k]);
+        r2 += square(A[0][0] * x + A[0][1] * y + t[0] - q[0]) +
+            square(A[1][0] * x + A[1][1] * y + t[1] - q[1]);
+    }
+    return sqrt(r2 / n);
+}
+
+int frame_align(const starxy_t* prev, const starxy_t* cur, double radius,
+                frame_align_t* align) {
+    int NP = MIN(starxy_n(prev), TRACK_NMATCH);
+    int NC = MIN(starxy_n(cur), TRACK_NMATCH);
+    double A[2][2] = { { 1, 0 }, { 0, 1 } };
+    double t[2] = { 0, 0 };
+    double r2 = square(radius);
+    double rms = 0;
+    double* pxy;
+    kdtree_t* kd;
+    int* pairs;
+    int i, j, n, best = 0;
+
+    if (NP < 3 || NC < 3)
+        return -1;
+    pxy = malloc(NP * 2 * sizeof(double));
+    for (i=0; i<NP; i++) {
+        pxy[2*i+0] = starxy_getx(prev, i);
+        pxy[2*i+1] = starxy_gety(prev, i);
+    }
+    kd = kdtree_build(NULL, pxy, NP, 2, 10, KDTT_DOUBLE, KD_BUILD_SPLIT);
+
+    // the offset that matches up the most bright sources...
+    for (i=0; i<MIN(NC, TRACK_NVOTE); i++)
+        for (j=0; j<MIN(NP, TRACK_NVOTE); j++) {
+            double tt[2];
+            tt[0] = starxy_getx(prev, j) - starxy_getx(cur, i);
+            tt[1] = starxy_gety(prev, j) - starxy_gety(cur, i);
+            n = match_frames(kd, cur, MIN(NC, TRACK_NCOUNT), A, tt, r2, NULL);
+            if (n > best) {
+                best = n;
+                t[0] = tt[0];
+                t[1] = tt[1];
+            }
+        }
+
+    // ... refined with all the matches.
+    pairs = malloc(NC * 2 * sizeof(int));
+    n = 0;
+    if (best >= 3) {
+        for (i=0; i<3; i++) {
+            n = match_frames(kd, cur, NC, A, t, r2, pairs);
+            if (n < 3)
+                break;
+            rms = fit_similarity(kd, cur, pairs, n, A, t);
+        }
+    }
+    free(pairs);
+    kdtree_free(kd);
+    free(pxy);
+    if (n < 3)
+        return -1;
+    memcpy(align->A, A, sizeof(A));
+    align->t[0] = t[0];
+    align->t[1] = t[1];
+    align->nmatch = n;
+    align->rms = rms;
+    return 0;
+}
+
+engine_tracker_t* engine_tracker_new(engine_t* engine) {
+    engine_tracker_t* t = calloc(1, sizeof(engine_tracker_t));
+    t->engine = engine;
+    return t;
+}
+
+/*
+ Runs frame "field" of the job: a blind solve, or (with "verify") a
+ check of that WCS only.  Returns 1 if solved (with its WCS in
+ "wcs"), 0 if not, and -1 if the job can't be read.
+ */
+static int run_frame(engine_tracker_t* t, const char* jobfn,
+                     const char* basedir, int field, const sip_t* verify,
+                     sip_t* wcs) {
+    engine_t* engine = t->engine;
+    job_t* job;
+    onefield_t* bp;
+    int solved;
+
+    job = engine_read_job_file(engine, jobfn);
+    if (!job) {
+        ERROR("Failed to read job file \"%s\"", jobfn);
+        return -1;
+    }
+    if (engine->flat_outputs)
+        job_set_output_base_dir(job, NULL);
+    else if (basedir)
+        job_set_output_base_dir(job, basedir);
+    bp = &(job->bp);
+    il_remove_all(bp->fieldlist);
+    onefield_add_field(bp, field);
+    if (verify) {
+        onefield_clear_verify_wcses(bp);
+        onefield_add_verify_wcs(bp, (sip_t*)verify);
+        job->verify_only = TRUE;
+    }
+    engine_run_job(engine, job);
+    solved = bp->have_solved_wcs;
+    if (solved)
+        *wcs = bp->solved_wcs;
+    job_free(job);
+    return solved;
+}
+
+int engine_tracker_run_job_file(engine_tracker_t* t, const char* jobfn,
+                                const char* basedir, int* nsolved) {
+    job_t* job;
+    onefield_t* bp;
+    xylist_t* ls;
+    il* fields;
+    size_t i;
+    int nfields, n = 0;
+
+    logmsg("Reading file \"%s\"...\n", jobfn);
+    job = engine_read_job_file(t->engine, jobfn);
+    if (!job) {
+        ERROR("Failed to read job file \"%s\"", jobfn);
+        return -1;
+    }
+    bp = &(job->bp);
+    ls = xylist_open(bp->fieldfname);
+    if (!ls) {
+        ERROR("Failed to read xylist \"%s\"", bp->fieldfname);
+        job_free(job);
+        return -1;
+    }
+    xylist_set_xname(ls, bp->xcolname);
+    xylist_set_yname(ls, bp->ycolname);
+    xylist_set_include_flux(ls, FALSE);
+    xylist_set_include_background(ls, FALSE);
+    nfields = xylist_n_fields(ls);
+    fields = il_dupe(bp->fieldlist);
+
+    for (i=0; i<il_size(fields); i++) {
+        int field = il_get(fields, i);
+        double W = bp->solver.field_maxx;
+        double H = bp->solver.field_maxy;
+        starxy_t* xy;
+        frame_align_t align;
+        sip_t wcs;
+        double t0 = timenow();
+        int solved = 0;
+
+        if (field < 1 || field > nfields)
+            continue;
+        xy = xylist_read_field_num(ls, field, NULL);
+        if (!xy) {
+            ERROR("Failed to read field %i of \"%s\"", field, bp->fieldfname);
+            continue;
+        }
+        t->nframes++;
+        if (t->ref_xy &&
+            !frame_align(t->ref_xy, xy, TRACK_RADIUS, &align) &&
+            align.nmatch >= TRACK_MIN_MATCH) {
+            sip_t pred;
+            logmsg("Frame %i: moved (%.1f, %.1f) pixels, rotated %.3f "
+                   "degrees (%i sources matched, rms %.2f pixels)\n", field,
+                   align.t[0], align.t[1],
+                   rad2deg(atan2(align.A[1][0], align.A[0][0])),
+                   align.nmatch, align.rms);
+            if (!fit_wcs_transformed(&t->ref_wcs, align.A, align.t, W, H,
+                                     &pred)) {
+                solved = run_frame(t, jobfn, basedir, field, &pred, &wcs);
+                if (solved == 1)
+                    t->ntracked++;
+            }
+            if (solved == 0)
+                logmsg("Frame %i: the tracked WCS didn't verify.\n", field);
+        }
+        if (solved == 0) {
+            logmsg("Frame %i: blind-solving\n", field);
+            t->nblind++;
+            solved = run_frame(t, jobfn, basedir, field, NULL, &wcs);
+        }
+        if (solved == -1) {
+            starxy_free(xy);
+            break;
+        }
+        if (solved) {
+            n++;
+            starxy_free(t->ref_xy);
+            t->ref_xy = xy;
+            t->ref_wcs = wcs;
+        } else {
+            t->nfailed++;
+            starxy_free(xy);
+        }
+        logverb("Frame %i: %s in %g seconds.\n", field,
+                solved ? "solved" : "not solved", timenow() - t0);
+    }
+    il_free(fields);
+    xylist_close(ls);
+    job_free(job);
+    if (nsolved)
+        *nsolved = n;
+    return 0;
+}
+
+void engine_tracker_free(engine_tracker_t* t) {
+    if (!t)
+        return;
+    if (t->nframes)
+        logmsg("Tracking: %i frames: %i tracked, %i blind solves, %i "
+               "unsolved.\n", t->nframes, t->ntracked, t->nblind,
+               t->nfailed);
+    starxy_free(t->ref_xy);
+    free(t);
+}
@@ -16,10 +16,14 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <libgen.h>
 #include <getopt.h>
 #include <dirent.h>
 #include <assert.h>
+#include <glob.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "math.h"
 
@@ -30,6 +34,7 @@
 #include "an-bool.h"
 #include "solver.h"
 #include "fitsioutils.h"
+#include "fitsbin.h"
 #include "solverutils.h"
 #include "os-features.h"
 #include "onefield.h"
@@ -38,15 +43,66 @@
 #include "errors.h"
 #include "engine.h"
 #include "tic.h"
+#include "an-alloc.h"
+#include "an-numa.h"
 #include "healpix.h"
 #include "sip-utils.h"
 #include "multiindex.h"
 #include "indexset.h"
+#include "index-lookup.h"
+#include "index-heatmap.h"
+#include "xylist.h"
+#include "permutedsort.h"
+#include "solution-cache.h"
+#include "job-checkpoint.h"
+
+// Some systems (Solaris) don't have these glob symbols.  Don't really need.
+#ifndef GLOB_BRACE
+#define GLOB_BRACE 0
+#endif
+#ifndef GLOB_TILDE
+#define GLOB_TILDE 0
+#endif
+
+static int add_index(engine_t* engine, index_t* ind);
 
 void engine_add_search_path(engine_t* engine, const char* path) {
     sl_append(engine->index_paths, path);
 }
 
+int engine_add_remote_indexes(engine_t* engine, const char* url,
+                              const char* cachedir, int64_t maxbytes,
+                              int nprefetch) {
+    index_remote_t* r = index_remote_open(url, cachedir, maxbytes);
+    pl* inds;
+    int j;
+    if (!r)
+        return -1;
+    pl_append(engine->remotes, r);
+    inds = pl_new(16);
+    if (index_remote_list(r, inds)) {
+        pl_free(inds);
+        return -1;
+    }
+    logverb("Adding %zu indexes from remote store \"%s\"\n", pl_size(inds), url);
+    // add them in reverse order, as engine_autoindex_search_paths() does.
+    for (j=pl_size(inds)-1; j>=0; j--) {
+        index_t* ind = pl_get(inds, j);
+        // we need the whole index loaded anyway.
+        if (engine->inparallel && index_reload(ind)) {
+            logmsg("Failed to add index \"%s\".\n", ind->indexfn);
+            index_free(ind);
+            continue;
+        }
+        add_index(engine, ind);
+        pl_append(engine->free_indexes, ind);
+    }
+    pl_free(inds);
+    if (nprefetch > 0)
+        index_remote_prefetch(r, nprefetch);
+    return 0;
+}
+
 char* engine_find_index(engine_t* engine, const char* name) {
     int j;
 
@@ -70,14 +126,161 @@ char* engine_find_index(engine_t* engine, const char* name) {
     return NULL;
 }
 
+
+/*
+ Index files built with build_index_shared_skdt() name the file whose
+ stars they use (see index_t.skdtfn).  Those found in the same directory
+ as that file are added as one multiindex, so that the stars are loaded
+ once rather than once per index.
+ */
+struct shared_skdt {
+    char* skdtpath;
+    sl* paths;
+    // how many stars each index was built from; -1 for the star kdtree
+    // file itself, if it is an index too.
+    il* nstars;
+};
+
+// Adds index file "path" in directory "dir", which uses the stars of
+// file "skdtfn" (if not NULL), to the group for that file in "groups".
+static void group_shared_skdt(pl* groups, const char* dir, const char* path,
+                              const char* skdtfn, int nstars) {
+    struct shared_skdt* g = NULL;
+    char* skdtpath;
+    int k;
+    if (!skdtfn)
+        return;
+    asprintf_safe(&skdtpath, "%s/%s", dir, skdtfn);
+    if (streq(skdtpath, path) || !file_readable(skdtpath)) {
+        free(skdtpath);
+        return;
+    }
+    for (k=0; k<pl_size(groups); k++) {
+        struct shared_skdt* gk = pl_get(groups, k);
+        if (streq(gk->skdtpath, skdtpath)) {
+            g = gk;
+            break;
+        }
+    }
+    if (!g) {
+        g = calloc(1, sizeof(struct shared_skdt));
+        g->skdtpath = skdtpath;
+        g->paths = sl_new(4);
+        g->nstars = il_new(4);
+        pl_append(groups, g);
+    } else
+        free(skdtpath);
+    sl_append(g->paths, path);
+    il_append(g->nstars, nstars);
+}
+
+// Adds the "groups" of indexes as multiindexes, and frees them.
+// "indexpaths" are all the index files in the directory; the ones that
+// get added are appended to "added".
+static void add_shared_skdt_groups(engine_t* engine, pl* groups,
+                                   sl* indexpaths, sl* added) {
+    int flags = engine->inparallel ? 0 : INDEX_ONLY_LOAD_METADATA;
+    int j, k;
+    for (k=0; k<pl_size(groups); k++) {
+        struct shared_skdt* g = pl_get(groups, k);
+        multiindex_t* mi = NULL;
+        if (sl_contains(indexpaths, g->skdtpath)) {
+            sl_insert(g->paths, 0, g->skdtpath);
+            il_insert(g->nstars, 0, -1);
+        }
+        // (with just one index, there's nothing to share.)
+        if (sl_size(g->paths) < 2)
+            goto nextgroup;
+        mi = multiindex_new(g->skdtpath);
+        if (!mi) {
+            logmsg("Failed to read shared star kdtree \"%s\"; adding its indexes separately.\n",
+                   g->skdtpath);
+            goto nextgroup;
+        }
+        for (j=0; j<sl_size(g->paths); j++) {
+            char* path = sl_get(g->paths, j);
+            int n = il_get(g->nstars, j);
+            if (n != -1 && n != startree_N(mi->starkd)) {
+                logmsg("Index \"%s\" was built from %i stars of \"%s\", which has %i; adding it separately.\n",
+                       path, n, g->skdtpath, startree_N(mi->starkd));
+                continue;
+            }
+            if (multiindex_add_index(mi, path, flags)) {
+                logmsg("Failed to add index \"%s\" sharing the stars of \"%s\"; adding it separately.\n",
+                       path, g->skdtpath);
+                continue;
+            }
+            sl_append(added, path);
+        }
+        if (!multiindex_n(mi)) {
+            multiindex_free(mi);
+            goto nextgroup;
+        }
+        logverb("%i indexes share the stars of \"%s\".\n", multiindex_n(mi),
+                g->skdtpath);
+        for (j=0; j<multiindex_n(mi); j++)
+            add_index(engine, multiindex_get(mi, j));
+        pl_append(engine->free_mindexes, mi);
+    nextgroup:
+        free(g->skdtpath);
+        sl_free2(g->paths);
+        il_free(g->nstars);
+        free(g);
+    }
+    pl_free(groups);
+}
+
 int engine_autoindex_search_paths(engine_t* engine) {
     int i;
     // Search the paths specified and add any indexes that are found.
     for (i=0; i<sl_size(engine->index_paths); i++) {
         char* path = sl_get(engine->index_paths, i);
-        DIR* dir = opendir(path);
+        DIR* dir;
         sl* tryinds;
+        pl* groups;
+        sl* added;
         int j;
+
+        if (engine->use_manifests) {
+            pl* inds = pl_new(16);
+            if (index_manifest_scan(path, INDEX_MANIFEST_UPDATE, inds) >= 0) {
+                pl* groups = pl_new(4);
+                sl* indexpaths = sl_new(16);
+                sl* added = sl_new(16);
+                logverb("Auto-indexing directory \"%s\" (with manifest) ...\n", path);
+                for (j=0; j<pl_size(inds); j++) {
+                    index_t* ind = pl_get(inds, j);
+                    sl_append(indexpaths, ind->indexfn);
+                    group_shared_skdt(groups, path, ind->indexfn, ind->skdtfn,
+                                      ind->skdt_nstars);
+                }
+                add_shared_skdt_groups(engine, groups, indexpaths, added);
+                // add them in reverse order, as below.
+                for (j=pl_size(inds)-1; j>=0; j--) {
+                    index_t* ind = pl_get(inds, j);
+                    if (sl_contains(added, ind->indexfn)) {
+                        index_free(ind);
+                        continue;
+                    }
+                    if (engine->inparallel) {
+                        // we need the whole index loaded anyway.
+                        if (engine_add_index(engine, ind->indexfn))
+                            logmsg("Failed to add index \"%s\".\n", ind->indexfn);
+                        index_free(ind);
+                        continue;
+                    }
+                    add_index(engine, ind);
+                    pl_append(engine->free_indexes, ind);
+                }
+                sl_free2(indexpaths);
+                sl_free2(added);
+                pl_free(inds);
+                continue;
+            }
+            pl_free(inds);
+        }
+
+        dir = opendir(path);
         if (!dir) {
             SYSERROR("Warning: failed to open index directory: \"%s\"\n", path);
             continue;
@@ -121,14 +324,33 @@ int engine_autoindex_search_paths(engine_t* engine) {
         }
         closedir(dir);
 
+        groups = pl_new(4);
+        added = sl_new(16);
+        for (j=0; j<sl_size(tryinds); j++) {
+            char* indpath = sl_get(tryinds, j);
+            qfits_header* hdr = anqfits_get_header_only(indpath, 0);
+            char* skdtfn;
+            if (!hdr)
+                continue;
+            skdtfn = fits_get_dupstring(hdr, "SKDTFN");
+            group_shared_skdt(groups, path, indpath, skdtfn,
+                              qfits_header_getint(hdr, "SKDTN", 0));
+            free(skdtfn);
+            qfits_header_destroy(hdr);
+        }
+        add_shared_skdt_groups(engine, groups, tryinds, added);
+
         // add them in reverse order... (why?)
         for (j=sl_size(tryinds)-1; j>=0; j--) {
             char* path = sl_get(tryinds, j);
+            if (sl_contains(added, path))
+                continue;
             logverb("Trying to add index \"%s\".\n", path);
             if (engine_add_index(engine, path))
                 logmsg("Failed to add index \"%s\".\n", path);
         }
         sl_free2(tryinds);
+        sl_free2(added);
     }
     return 0;
 }
@@ -139,7 +361,8 @@ static int add_index(engine_t* engine, index_t* ind) {
     for (k=0; k<pl_size(engine->indexes); k++) {
         index_t* m = pl_get(engine->indexes, k);
         if (m->indexid == ind->indexid &&
-            m->healpix == ind->healpix) {
+            m->healpix == ind->healpix &&
+            m->stratum == ind->stratum) {
             logmsg("Warning: encountered two index files with the same INDEXID = %i and HEALPIX = %i: \"%s\" and \"%s\".  Keeping both.\n",
                    m->indexid, m->healpix, m->indexname, ind->indexname);
             //index_free(ind);
@@ -148,6 +371,8 @@ static int add_index(engine_t* engine, index_t* ind) {
     }
 
     pl_append(engine->indexes, ind);
+    index_lookup_free(engine->lookup);
+    engine->lookup = NULL;
 
     // <= smallest we've seen?
     if (ind->index_scale_lower < engine->sizesmallest) {
@@ -213,22 +438,21 @@ static void add_index_to_onefield(engine_t* engine, onefield_t* bp,
     index = pl_get(engine->indexes, i);
     if (engine->inparallel) {
         // The "indexset" feature means that we can get here without having
-        // actually loaded the index yet.
-        if (!index->codekd) {
-            char* ifn = index->indexfn;
-            char* iname = index->indexname;
-            logverb("Loading index %s\n", ifn);
-            if (!index_load(ifn, 0, index)) {
+        // actually loaded the index yet.  Keep it loaded from now on by
+        // taking a reference that is never released.
+        pthread_mutex_lock(&engine->lock);
+        if (!index->refcount) {
+            logverb("Loading index %s\n", index->indexfn);
+            if (index_acquire(index)) {
+                pthread_mutex_unlock(&engine->lock);
                 ERROR("Failed to load index %s\n", index->indexname);
                 return;
             }
-            free(iname);
-            free(ifn);
         }
-        onefield_add_loaded_index(bp, index);
-    } else {
-        onefield_add_index(bp, index->indexname);
+        pthread_mutex_unlock(&engine->lock);
     }
+    // onefield loads (and unloads) the index around using it.
+    onefield_add_loaded_index(bp, index);
 }
 
 int engine_parse_config_file(engine_t* engine, const char* fn) {
@@ -293,19 +517,144 @@ int engine_parse_config_file_stream(engine_t* engine, FILE* fconf) {
             auto_index = TRUE;
         } else if (is_word(line, "inparallel", &nextword)) {
             engine->inparallel = TRUE;
+        } else if (is_word(line, "no_index_manifest", &nextword)) {
+            engine->use_manifests = FALSE;
         } else if (is_word(line, "minwidth ", &nextword)) {
             engine->minwidth = atof(nextword);
         } else if (is_word(line, "maxwidth ", &nextword)) {
             engine->maxwidth = atof(nextword);
         } else if (is_word(line, "cpulimit ", &nextword)) {
             engine->cpulimit = atof(nextword);
+        } else if (is_word(line, "memlimit ", &nextword)) {
+            an_alloc_set_limit((int64_t)(atof(nextword) * 1024 * 1024));
+        } else if (is_word(line, "threads ", &nextword)) {
+            engine->nthreads = atoi(nextword);
+        } else if (is_word(line, "verifythreads ", &nextword)) {
+            engine->nverifiers = atoi(nextword);
+        } else if (is_word(line, "fieldthreads ", &nextword)) {
+            engine->nfieldthreads = atoi(nextword);
+        } else if (is_word(line, "parallelwriters", &nextword)) {
+            engine->parallel_writers = TRUE;
+        } else if (is_word(line, "schedule", &nextword)) {
+            engine->schedule = TRUE;
+        } else if (is_word(line, "solution_cache ", &nextword)) {
+            solution_cache_free(engine->solution_cache);
+            engine->solution_cache = solution_cache_open(nextword);
+            if (!engine->solution_cache) {
+                rtn = -1;
+                goto done;
+            }
+        } else if (is_word(line, "code_matcher ", &nextword)) {
+            code_matcher_free(engine->code_matcher);
+            engine->code_matcher = code_matcher_new(nextword);
+            if (!engine->code_matcher) {
+                ERROR("Unknown code_matcher \"%s\"", nextword);
+                rtn = -1;
+                goto done;
+            }
+        } else if (is_word(line, "adaptive", &nextword)) {
+            engine->adaptive = TRUE;
+        } else if (is_word(line, "timeslice ", &nextword)) {
+            engine->timeslice = atoi(nextword);
+        } else if (is_word(line, "prefetch ", &nextword)) {
+            engine->prefetch = atoi(nextword);
+        } else if (is_word(line, "prefetch_max ", &nextword)) {
+            engine->prefetch_max = (size_t)(atof(nextword) * 1024 * 1024);
         } else if (is_word(line, "depths ", &nextword)) {
             if (parse_depth_string(engine->default_depths, nextword)) {
                 rtn = -1;
                 goto done;
             }
+        } else if (is_word(line, "mmap ", &nextword)) {
+            size_t popmax;
+            int flags = fitsbin_parse_mmap_flags(nextword);
+            if (flags == -1) {
+                rtn = -1;
+                goto done;
+            }
+            fitsbin_get_mmap_policy(&popmax);
+            fitsbin_set_mmap_policy(flags, popmax);
+        } else if (is_word(line, "mmap_populate_max ", &nextword)) {
+            int flags = fitsbin_get_mmap_policy(NULL);
+            fitsbin_set_mmap_policy(flags, (size_t)(atof(nextword) * 1024 * 1024));
+        } else if (is_word(line, "index_heatmap ", &nextword)) {
+            // index_heatmap <dir> [<sampling rate>]
+            char dir[1024];
+            int rate = 1;
+            if (sscanf(nextword, "%1023s %i", dir, &rate) < 1 || rate < 1) {
+                ERROR("Expected \"index_heatmap <dir> [<rate>]\", got \"%s\"", line);
+                rtn = -1;
+                goto done;
+            }
+            if (index_heatmap_set_dir(dir, rate)) {
+                rtn = -1;
+                goto done;
+            }
+        } else if (is_word(line, "quad_xyz", &nextword)) {
+            quadfile_set_load_star_xyz(TRUE);
+        } else if (is_word(line, "read_threads ", &nextword)) {
+            set_parallel_read_threads(atoi(nextword));
+        } else if (is_word(line, "index_residency ", &nextword)) {
+            // index_residency <MB> [lru|solves]
+            char policy[16] = "lru";
+            double mb;
+            if (sscanf(nextword, "%lg %15s", &mb, policy) < 1 || mb < 0 ||
+                !(streq(policy, "lru") || streq(policy, "solves"))) {
+                ERROR("Expected \"index_residency <MB> [lru|solves]\", got \"%s\"", line);
+                rtn = -1;
+                goto done;
+            }
+            index_residency_set_budget((size_t)(mb * 1024 * 1024),
+                                       streq(policy, "solves") ?
+                                       INDEX_RESIDENCY_SOLVES : INDEX_RESIDENCY_LRU);
+        } else if (is_word(line, "numa ", &nextword)) {
+            // numa <interleave|local> [<replicate MB>]
+            char policy[16];
+            double mb = 0;
+            if (sscanf(nextword, "%15s %lg", policy, &mb) < 1 || mb < 0 ||
+                !(streq(policy, "interleave") || streq(policy, "local"))) {
+                ERROR("Expected \"numa <interleave|local> [<replicate MB>]\", got \"%s\"", line);
+                rtn = -1;
+                goto done;
+            }
+            engine->numa_policy = streq(policy, "local") ?
+                INDEX_NUMA_LOCAL : INDEX_NUMA_INTERLEAVE;
+            engine->numa_replicate = (size_t)(mb * 1024 * 1024);
+        } else if (is_word(line, "shard ", &nextword)) {
+            // shard <i> <n> [scale|healpix]
+            char by[16] = "scale";
+            if (sscanf(nextword, "%i %i %15s", &engine->shard, &engine->nshards, by) < 2 ||
+                engine->shard < 0 || engine->shard >= engine->nshards ||
+                !(streq(by, "scale") || streq(by, "healpix"))) {
+                ERROR("Expected \"shard <i> <n> [scale|healpix]\" with 0 <= i < n, got \"%s\"", line);
+                rtn = -1;
+                goto done;
+            }
+            engine->shard_by_healpix = streq(by, "healpix");
         } else if (is_word(line, "add_path ", &nextword)) {
             engine_add_search_path(engine, nextword);
+        } else if (is_word(line, "remote_index ", &nextword)) {
+            // remote_index <url> <cache dir> [<max GB> [<prefetch>]]
+            sl* words = sl_split(NULL, nextword, " ");
+            double maxgb = 0;
+            int nprefetch = 0;
+            if (sl_size(words) < 2 || sl_size(words) > 4) {
+                ERROR("Expected \"remote_index <url> <cache dir> [<max GB> [<prefetch>]]\", got \"%s\"", line);
+                sl_free2(words);
+                rtn = -1;
+                goto done;
+            }
+            if (sl_size(words) > 2)
+                maxgb = atof(sl_get(words, 2));
+            if (sl_size(words) > 3)
+                nprefetch = atoi(sl_get(words, 3));
+            if (engine_add_remote_indexes(engine, sl_get(words, 0), sl_get(words, 1),
+                                          (int64_t)(maxgb * 1e9), nprefetch)) {
+                sl_free2(words);
+                rtn = -1;
+                goto done;
+            }
+            sl_free2(words);
         } else {
             ERROR("Didn't understand this config file line: \"%s\"", line);
             // unknown config line is a firing offense
@@ -464,6 +813,8 @@ void job_free(job_t* job) {
         return;
     dl_free(job->scales);
     il_free(job->depths);
+    onefield_free_solved_matches(&(job->bp));
+    free(job->checkpoint_fn);
     free(job);
 }
 
@@ -474,30 +825,361 @@ static double job_imageh(job_t* job) {
     return job->bp.solver.field_maxy;
 }
 
-int engine_run_job(engine_t* engine, job_t* job) {
-    onefield_t* bp = &(job->bp);
-    solver_t* sp = &(bp->solver);
-    
-    int i;
-    double app_min_default;
-    double app_max_default;
-    anbool solved = FALSE;
+/*
+ One run of the solver: a depth range, a scale range and a set of
+ indexes.
+ */
+struct job_run {
+    int startobj;
+    int endobj;
+    // arcsec per pixel range
+    double app_min;
+    double app_max;
+    // range of quad sizes that could be found in the field, in arcsec.
+    double fmin;
+    double fmax;
+    // range of quad sizes (AB distances) to try, in pixels; zero for the
+    // defaults (from quad_size_fraction_lo, and the field diagonal).
+    double quadsize_min;
+    double quadsize_max;
+    // indices into engine->indexes
+    il* indexlist;
+    // the order in which the runs were generated; used to break ties.
+    int seq;
+    double cost;
+    double prob;
+    // did this run get cut short by the time slice?
+    anbool sliced;
+    // where to pick up a search that was cut short (see onefield_t).
+    int resume_index;
+    int resume_object;
+};
+typedef struct job_run job_run_t;
+
+// How many times index "i" has been tried / has solved a field.
+static int index_count(il* counts, int i) {
+    if (i >= il_size(counts))
+        return 0;
+    return il_get(counts, i);
+}
 
-    if (onefield_is_run_obsolete(bp, sp)) {
-        goto finish;
+static void index_count_add(il* counts, int i) {
+    while (il_size(counts) <= i)
+        il_append(counts, 0);
+    il_set(counts, i, il_get(counts, i) + 1);
+}
+
+/*
+ Fraction of the index's quad scale range [index_scale_lower,
+ index_scale_upper] that falls in [fmin, fmax], in log space.
+ */
+static double index_scale_overlap(const index_t* index, double fmin,
+                                  double fmax) {
+    double lo = MAX(fmin, index->index_scale_lower);
+    double hi = MIN(fmax, index->index_scale_upper);
+    if (hi <= lo)
+        return 0.0;
+    if ((index->index_scale_lower <= 0.0) ||
+        (index->index_scale_upper <= index->index_scale_lower))
+        return 1.0;
+    return log(hi / lo) / log(index->index_scale_upper / index->index_scale_lower);
+}
+
+/*
+ Estimates the cost of a run (in arbitrary units) and the chance that it
+ will solve the field.  The cost is the number of quads in the part of
+ each index's scale range that the run covers, times the number of new
+ AB pairs in the depth range.  The chance of success is the engine's
+ success rate for each index, with a uniform prior.
+ */
+static void score_run(engine_t* engine, const solver_t* sp, job_run_t* run) {
+    double nquads = 0.0;
+    double pmiss = 1.0;
+    double e, s;
+    int k;
+
+    s = run->startobj;
+    e = run->endobj;
+    if (!e)
+        e = (sp->max_field_objs ? sp->max_field_objs : DEFAULT_MAX_FIELD_OBJS);
+    pthread_mutex_lock(&engine->lock);
+    for (k=0; k<il_size(run->indexlist); k++) {
+        int ii = il_get(run->indexlist, k);
+        index_t* index = pl_get(engine->indexes, ii);
+        double ntried = index_count(engine->index_ntried, ii);
+        double nsolved = index_count(engine->index_nsolved, ii);
+        nquads += MAX(index->nquads, 1) *
+            index_scale_overlap(index, run->fmin, run->fmax);
+        pmiss *= 1.0 - (nsolved + 1.0) / (ntried + 2.0);
     }
+    pthread_mutex_unlock(&engine->lock);
+    run->cost = MAX(nquads, 1.0) * MAX(e*e - s*s, 1.0);
+    run->prob = 1.0 - pmiss;
+}
 
-    app_min_default = deg2arcsec(engine->minwidth) / job_imagew(job);
-    app_max_default = deg2arcsec(engine->maxwidth) / job_imagew(job);
+/*
+ Run the likeliest, cheapest runs first: with independent chances of
+ success, sorting by cost / probability minimizes the expected time to the
+ first solution.
+ */
+static int compare_runs(const void* v1, const void* v2) {
+    const job_run_t* r1 = v1;
+    const job_run_t* r2 = v2;
+    double k1 = r1->cost / MAX(r1->prob, 1e-6);
+    double k2 = r2->cost / MAX(r2->prob, 1e-6);
+    if (k1 < k2)
+        return -1;
+    if (k1 > k2)
+        return 1;
+    return r1->seq - r2->seq;
+}
 
-    if (engine->inparallel)
-        bp->indexes_inparallel = TRUE;
+// Selects the indexes that should be checked for this scale range.
+static il* select_indexes(engine_t* engine, job_t* job, double fmin, double fmax) {
+    il* indexlist = il_new(16);
+    il* selected;
+    il* nearby = NULL;
+    int k;
+    for (k = 0; k < pl_size(engine->indexes); k++) {
+        index_t* index = pl_get(engine->indexes, k);
+        if (!index_overlaps_scale_range(index, fmin, fmax))
+            continue;
+        il_append(indexlist, k);
+    }
+
+    // Use the (list of) smallest or largest indices if no other one fits.
+    if (!il_size(indexlist)) {
+        il* list = NULL;
+        if (fmin > engine->sizebiggest) {
+            list = engine->ibiggest;
+        } else if (fmax < engine->sizesmallest) {
+            list = engine->ismallest;
+        } else {
+            assert(0);
+        }
+        il_append_list(indexlist, list);
+    }
 
+    // The indexes whose tiles are within range, from the HEALPix lookup
+    // rather than checking each one.
     if (job->use_radec_center) {
-        logmsg("Only searching for solutions within %g degrees of RA,Dec (%g,%g)\n",
-               job->search_radius, job->ra_center, job->dec_center);
-        solver_set_radec(sp, job->ra_center, job->dec_center, job->search_radius);
+        pthread_mutex_lock(&engine->lock);
+        if (!engine->lookup)
+            engine->lookup = index_lookup_new(engine->indexes);
+        pthread_mutex_unlock(&engine->lock);
+        nearby = il_new(16);
+        index_lookup_search(engine->lookup, job->ra_center, job->dec_center,
+                            job->search_radius, nearby);
+    }
+
+    selected = il_new(16);
+    for (k=0; k<il_size(indexlist); k++) {
+        int ii = il_get(indexlist, k);
+        index_t* index = pl_get(engine->indexes, ii);
+        anbool inrange = TRUE;
+        if (nearby)
+            inrange = (il_find_index_ascending(nearby, ii) != -1);
+        if (!inrange) {
+            logverb("Not using index %s because it's not within %g degrees of (RA,Dec) = (%g,%g)\n",
+                    index->indexname, job->search_radius, job->ra_center, job->dec_center);
+            continue;
+        }
+        il_append(selected, ii);
+    }
+    il_free(indexlist);
+    if (nearby)
+        il_free(nearby);
+    return selected;
+}
+
+static void add_run(engine_t* engine, const solver_t* sp, bl* runs,
+                    job_run_t* run) {
+    run->seq = bl_size(runs);
+    score_run(engine, sp, run);
+    if (engine->schedule)
+        bl_insert_sorted(runs, run, compare_runs);
+    else
+        bl_append(runs, run);
+}
+
+// Adds "run" with the indexes for its quad size range: as one run, or
+// (with "schedule" but not "inparallel") one run per index.
+static void add_runs(engine_t* engine, job_t* job, bl* runs, job_run_t* run) {
+    solver_t* sp = &(job->bp.solver);
+    il* indexlist;
+    int k;
+
+    indexlist = select_indexes(engine, job, run->fmin, run->fmax);
+    if (!engine->schedule || engine->inparallel) {
+        run->indexlist = indexlist;
+        add_run(engine, sp, runs, run);
+        return;
+    }
+    for (k=0; k<il_size(indexlist); k++) {
+        run->indexlist = il_new(4);
+        il_append(run->indexlist, il_get(indexlist, k));
+        add_run(engine, sp, runs, run);
+    }
+    il_free(indexlist);
+}
+
+/*
+ Expected number of index stars per square degree: the indexes keep up
+ to "cutnsweep" stars in each HEALPix of side "cutnside"; older ones
+ only tell us how many stars their tile (or the whole sky) holds.
+ */
+static double index_star_density(const index_t* index) {
+    double sky = 4.0 * M_PI * square(rad2deg(1.0));
+    if ((index->cutnside > 0) && (index->cutnsweep > 0))
+        return index->cutnsweep * 12.0 * square(index->cutnside) / sky;
+    if (index->nstars <= 0)
+        return 0.0;
+    if ((index->healpix >= 0) && (index->hpnside > 0))
+        return index->nstars * 12.0 * square(index->hpnside) / sky;
+    return index->nstars / sky;
+}
+
+/*
+ (adaptive) The number of index stars we expect in the field at
+ [app_min, app_max] arcsec per pixel -- the median over the indexes
+ that would be tried -- or zero if we can't tell, or the scale range is
+ too wide (more than a factor of two) for the guess to mean anything.
+ */
+static double expected_index_stars(engine_t* engine, job_t* job,
+                                   double app_min, double app_max) {
+    onefield_t* bp = &(job->bp);
+    double W = job_imagew(job);
+    double H = job_imageh(job);
+    double app, area, fmin, fmax, nexp;
+    double* n;
+    il* indexlist;
+    int k, N = 0;
+
+    if ((app_min <= 0.0) || (app_max > 2.0 * app_min) || (W <= 0) || (H <= 0))
+        return 0.0;
+    app = sqrt(app_min * app_max);
+    // square degrees
+    area = W * H * square(app / 3600.0);
+
+    fmin = bp->quad_size_fraction_lo * MIN(W, H) * app_min;
+    fmax = bp->quad_size_fraction_hi * hypot(W, H) * app_max;
+    indexlist = select_indexes(engine, job, fmin, fmax);
+    n = malloc(MAX(1, il_size(indexlist)) * sizeof(double));
+    for (k=0; k<il_size(indexlist); k++) {
+        index_t* index = pl_get(engine->indexes, il_get(indexlist, k));
+        double d = index_star_density(index);
+        if (d > 0.0)
+            n[N++] = d * area;
+    }
+    il_free(indexlist);
+    if (!N) {
+        free(n);
+        return 0.0;
     }
+    qsort(n, N, sizeof(double), compare_doubles_asc);
+    nexp = (N % 2) ? n[N/2] : 0.5 * (n[N/2 - 1] + n[N/2]);
+    free(n);
+    return nexp;
+}
+
+/*
+ (adaptive) The smallest quads (AB distance, in pixels) to try first at
+ this scale: the typical nearest-neighbour distance between the index
+ stars in the field, 0.5 / sqrt(density), since few index quads are
+ smaller than that; or zero if that's no bigger than "quadsize_min".
+ The smaller quads are tried after all the other runs.
+ */
+static double adaptive_quadsize_min(engine_t* engine, job_t* job,
+                                    double app_min, double app_max,
+                                    double quadsize_min) {
+    double W = job_imagew(job);
+    double H = job_imageh(job);
+    double nexp, q;
+
+    nexp = expected_index_stars(engine, job, app_min, app_max);
+    if (nexp <= 0.0)
+        return 0.0;
+    q = 0.5 * sqrt(W * H / nexp);
+    q = MIN(q, 0.5 * MIN(W, H));
+    if (q <= 1.1 * quadsize_min)
+        return 0.0;
+    logverb("Adaptive: expecting %.1f index stars at %g-%g arcsec/pix; trying quads >= %.1f pixels first\n",
+            nexp, app_min, app_max, q);
+    return q;
+}
+
+/*
+ Splits the runs by the sweep strata of their indexes (see
+ build_index_stratum()): the runs with only the first strata (and the
+ unstratified indexes) come first, in their order, then the runs with
+ the second strata, and so on; so the deeper strata are only tried, and
+ (unless "inparallel") loaded, if the brighter ones didn't solve the
+ field.
+ */
+static bl* stratify_runs(engine_t* engine, bl* runs) {
+    bl* strata;
+    int maxstratum = 1;
+    int s, i, k;
+
+    for (i=0; i<bl_size(runs); i++) {
+        job_run_t* run = bl_access(runs, i);
+        for (k=0; k<il_size(run->indexlist); k++) {
+            index_t* index = pl_get(engine->indexes, il_get(run->indexlist, k));
+            maxstratum = MAX(maxstratum, index->stratum);
+        }
+    }
+    if (maxstratum == 1)
+        return runs;
+
+    strata = bl_new(16, sizeof(job_run_t));
+    for (s=1; s<=maxstratum; s++) {
+        for (i=0; i<bl_size(runs); i++) {
+            job_run_t* orig = bl_access(runs, i);
+            job_run_t run = *orig;
+            run.indexlist = il_new(4);
+            for (k=0; k<il_size(orig->indexlist); k++) {
+                int ii = il_get(orig->indexlist, k);
+                index_t* index = pl_get(engine->indexes, ii);
+                if (MAX(index->stratum, 1) == s)
+                    il_append(run.indexlist, ii);
+            }
+            if (!il_size(run.indexlist)) {
+                il_free(run.indexlist);
+                continue;
+            }
+            run.seq = bl_size(strata);
+            bl_append(strata, &run);
+        }
+    }
+    for (i=0; i<bl_size(runs); i++)
+        il_free(((job_run_t*)bl_access(runs, i))->indexlist);
+    bl_free(runs);
+    return strata;
+}
+
+/*
+ Lists the (depth, scale, indexes) runs for this job, in the order they
+ should be run: with "engine->schedule", by cost and chance of success,
+ and with one run per index (unless "inparallel"); otherwise in the
+ order of the depths and scales.  With "engine->adaptive", each run
+ first skips the quads smaller than adaptive_quadsize_min(), and those
+ are tried in runs of their own after all the others.  Runs of deeper
+ index strata come after all of those (see stratify_runs()).
+ */
+static bl* list_runs(engine_t* engine, job_t* job) {
+    onefield_t* bp = &(job->bp);
+    bl* runs = bl_new(16, sizeof(job_run_t));
+    bl* catchups = bl_new(16, sizeof(job_run_t));
+    double app_min_default;
+    double app_max_default;
+    // minimum quad size to try (in pixels)
+    double quadsize_min;
+    int i;
+
+    app_min_default = deg2arcsec(engine->minwidth) / job_imagew(job);
+    app_max_default = deg2arcsec(engine->maxwidth) / job_imagew(job);
+    quadsize_min = bp->quad_size_fraction_lo *
+        MIN(job_imagew(job), job_imageh(job));
 
     for (i=0; i<il_size(job->depths)/2; i++) {
         int startobj = il_get(job->depths, i*2);
@@ -516,99 +1198,528 @@ int engine_run_job(engine_t* engine, job_t* job) {
         }
 
         for (j=0; j<dl_size(job->scales) / 2; j++) {
-            double fmin, fmax;
-            double app_max, app_min;
-            int k;
-            il* indexlist;
+            job_run_t run;
+            double quadsize_split = 0.0;
 
+            memset(&run, 0, sizeof(job_run_t));
+            run.startobj = startobj;
+            run.endobj = endobj;
             // arcsec per pixel range
-            app_min = dl_get(job->scales, j * 2);
-            app_max = dl_get(job->scales, j * 2 + 1);
-            if (app_min == 0.0)
-                app_min = app_min_default;
-            if (app_max == 0.0)
-                app_max = app_max_default;
-            sp->funits_lower = app_min;
-            sp->funits_upper = app_max;
-
-            sp->startobj = startobj;
-            if (endobj)
-                sp->endobj = endobj;
+            run.app_min = dl_get(job->scales, j * 2);
+            run.app_max = dl_get(job->scales, j * 2 + 1);
+            if (run.app_min == 0.0)
+                run.app_min = app_min_default;
+            if (run.app_max == 0.0)
+                run.app_max = app_max_default;
 
-            // minimum quad size to try (in pixels)
-            sp->quadsize_min = bp->quad_size_fraction_lo *
-                MIN(job_imagew(job), job_imageh(job));
-
-            // range of quad sizes that could be found in the field,
-            // in arcsec.
             // the hypotenuse...
-            fmax = bp->quad_size_fraction_hi *
-                hypot(job_imagew(job), job_imageh(job)) * app_max;
-            fmin = sp->quadsize_min * app_min;
-
-            // Select the indices that should be checked.
-            indexlist = il_new(16);
-            for (k = 0; k < pl_size(engine->indexes); k++) {
-                index_t* index = pl_get(engine->indexes, k);
-                if (!index_overlaps_scale_range(index, fmin, fmax))
-                    continue;
-                il_append(indexlist, k);
+            run.fmax = bp->quad_size_fraction_hi *
+                hypot(job_imagew(job), job_imageh(job)) * run.app_max;
+            run.fmin = quadsize_min * run.app_min;
+
+            if (engine->adaptive)
+                quadsize_split = adaptive_quadsize_min(engine, job, run.app_min,
+                                                       run.app_max, quadsize_min);
+            if (quadsize_split > 0.0) {
+                // the smaller quads, after all the other runs.
+                job_run_t small = run;
+                small.quadsize_max = quadsize_split;
+                small.fmax = quadsize_split * run.app_max;
+                add_runs(engine, job, catchups, &small);
+
+                run.quadsize_min = quadsize_split;
+                run.fmin = quadsize_split * run.app_min;
             }
+            add_runs(engine, job, runs, &run);
+        }
+    }
+    for (i=0; i<bl_size(catchups); i++) {
+        job_run_t* run = bl_access(catchups, i);
+        run->seq = bl_size(runs);
+        bl_append(runs, run);
+    }
+    bl_free(catchups);
+    return stratify_runs(engine, runs);
+}
 
-            // Use the (list of) smallest or largest indices if no other one fits.
-            if (!il_size(indexlist)) {
-                il* list = NULL;
-                if (fmin > engine->sizebiggest) {
-                    list = engine->ibiggest;
-                } else if (fmax < engine->sizesmallest) {
-                    list = engine->ismallest;
-                } else {
-                    assert(0);
-                }
-                il_append_list(indexlist, list);
-            }
+// Reads the (first) field of a job, with its fluxes if "flux".
+static starxy_t* read_job_field(job_t* job, anbool flux) {
+    onefield_t* bp = &(job->bp);
+    xylist_t* ls;
+    starxy_t* xy;
+    int field = il_size(bp->fieldlist) ? il_get(bp->fieldlist, 0) : 1;
+
+    if (bp->field_xy) {
+        xy = starxy_copy(bp->field_xy);
+        if (!flux) {
+            free(xy->flux);
+            xy->flux = NULL;
+        }
+        return xy;
+    }
+    ls = xylist_open(bp->fieldfname);
+    if (!ls)
+        return NULL;
+    xylist_set_xname(ls, bp->xcolname);
+    xylist_set_yname(ls, bp->ycolname);
+    xylist_set_include_flux(ls, flux);
+    xy = xylist_read_field_num(ls, field, NULL);
+    xylist_close(ls);
+    return xy;
+}
 
-            for (k=0; k<il_size(indexlist); k++) {
-                int ii = il_get(indexlist, k);
-                index_t* index = pl_get(engine->indexes, ii);
-                anbool inrange = TRUE;
-                if (job->use_radec_center)
-                    inrange = index_is_within_range(index, job->ra_center, job->dec_center, job->search_radius);
-                if (!inrange) {
-                    logverb("Not using index %s because it's not within %g degrees of (RA,Dec) = (%g,%g)\n",
-                            index->indexname, job->search_radius, job->ra_center, job->dec_center);
-                    continue;
-                }
-                add_index_to_onefield(engine, bp, ii);
-            }
+/*
+ (adaptive) Replaces the job's default depths by ones that suit its
+ field.  Sources whose fluxes are within 1% of the brightest are
+ probably saturated, and come in no useful order, so the first depth
+ range takes them all plus the number of index stars we expect in the
+ field (at the narrowest scale range we can tell), and each range after
+ that adds as many again -- or, if we can't tell, as many as the first
+ default range.  The ranges stop at the number of
+ sources in the field or the deepest default depth.
+ */
+static void adapt_depths(engine_t* engine, job_t* job) {
+    onefield_t* bp = &(job->bp);
+    starxy_t* xy;
+    int N, nsat = 0;
+    int maxdepth = 0;
+    double nexp = 0.0;
+    int first, step, lo, hi;
+    int i;
 
-            il_free(indexlist);
+    // only for single-field jobs; the fields of the others differ.
+    if (il_size(bp->fieldlist) > 1)
+        return;
+    xy = read_job_field(job, TRUE);
+    if (!xy) {
+        logverb("Adaptive: failed to read the field; using the default depths\n");
+        return;
+    }
+    N = starxy_n(xy);
+    if (xy->flux && N) {
+        double fmax = xy->flux[0];
+        for (i=1; i<N; i++)
+            fmax = MAX(fmax, xy->flux[i]);
+        if (fmax > 0.0)
+            for (i=0; i<N; i++)
+                if (xy->flux[i] >= 0.99 * fmax)
+                    nsat++;
+        // one source at the top is just the brightest.
+        if (nsat == 1)
+            nsat = 0;
+    }
+    starxy_free(xy);
+    if (bp->solver.max_field_objs)
+        N = MIN(N, bp->solver.max_field_objs);
 
-            logverb("Running solver:\n");
-            onefield_log_run_parameters(bp);
+    for (i=0; i<il_size(engine->default_depths)/2; i++) {
+        int d = il_get(engine->default_depths, i*2+1);
+        maxdepth = (d == 0) ? N : MAX(maxdepth, d);
+    }
+    maxdepth = MIN(maxdepth, N);
+    if (maxdepth < 1)
+        return;
 
-            onefield_run(bp);
+    for (i=0; i<dl_size(job->scales)/2; i++) {
+        double n = expected_index_stars(engine, job, dl_get(job->scales, i*2),
+                                        dl_get(job->scales, i*2+1));
+        if ((n > 0.0) && ((nexp == 0.0) || (n < nexp)))
+            nexp = n;
+    }
+    if (nexp > 0.0)
+        step = MAX(5, (int)(nexp + 0.5));
+    else
+        step = il_get(engine->default_depths, 1);
+    if (step < 1)
+        return;
+    first = nsat + step;
+
+    il_remove_all(job->depths);
+    lo = 1;
+    for (hi = MIN(first, maxdepth); ; hi = MIN(hi + step, maxdepth)) {
+        il_append(job->depths, lo);
+        il_append(job->depths, hi);
+        if (hi >= maxdepth)
+            break;
+        lo = hi + 1;
+    }
+    logverb("Adaptive: %i sources, %i saturated, %.1f index stars expected: depths",
+            N, nsat, nexp);
+    for (i=0; i<il_size(job->depths)/2; i++)
+        logverb(" %i-%i", il_get(job->depths, i*2), il_get(job->depths, i*2+1));
+    logverb("\n");
+}
 
-            // we only want to try using the verify_wcses the first time.
-            onefield_clear_verify_wcses(bp);
-            onefield_clear_indexes(bp);
-            onefield_clear_solutions(bp);
-            onefield_clear_indexes(bp);
-            solver_clear_indexes(sp);
+/*
+ Checks the WCSes in the job's verify list, with the indexes whose
+ scales suit each of them, without searching for new solutions; then
+ clears the list.
+ */
+static void run_verify_only(engine_t* engine, job_t* job) {
+    onefield_t* bp = &(job->bp);
+    solver_t* sp = &(bp->solver);
+    double W = job_imagew(job);
+    double H = job_imageh(job);
+    il* indexes;
+    int i, k;
+
+    indexes = il_new(16);
+    for (i=0; i<bl_size(bp->verify_wcs_list); i++) {
+        double app = sip_pixel_scale(bl_access(bp->verify_wcs_list, i));
+        il* lst = select_indexes(engine, job,
+                                 bp->quad_size_fraction_lo * MIN(W, H) * app,
+                                 bp->quad_size_fraction_hi * hypot(W, H) * app);
+        for (k=0; k<il_size(lst); k++)
+            il_insert_unique_ascending(indexes, il_get(lst, k));
+        il_free(lst);
+    }
+    for (k=0; k<il_size(indexes); k++)
+        add_index_to_onefield(engine, bp, il_get(indexes, k));
+    il_free(indexes);
+
+    bp->verify_only = TRUE;
+    onefield_run(bp);
+    bp->verify_only = FALSE;
+
+    onefield_clear_verify_wcses(bp);
+    onefield_clear_indexes(bp);
+    onefield_clear_solutions(bp);
+    solver_clear_indexes(sp);
+}
 
-            if (onefield_is_run_obsolete(bp, sp)) {
-                solved = TRUE;
-                break;
+/*
+ Looks the job's field up in the solution cache, and verifies the WCSes
+ of the matching fields with the indexes at their scales.  Returns -1 if
+ the field has no fingerprint, 1 if it was solved, and 0 otherwise.
+ */
+static int verify_cached_solutions(engine_t* engine, job_t* job,
+                                   field_fingerprint_t* fp) {
+    onefield_t* bp = &(job->bp);
+    sip_t wcses[ENGINE_CACHE_MAX_HITS];
+    starxy_t* xy;
+    bl* jobwcs;
+    int i, n;
+
+    // only for single-field jobs; the fields of the others differ.
+    if (il_size(bp->fieldlist) > 1)
+        return -1;
+    xy = read_job_field(job, FALSE);
+    if (!xy)
+        return -1;
+    n = field_fingerprint_compute(xy, fp);
+    starxy_free(xy);
+    if (n)
+        return -1;
+    n = solution_cache_lookup(engine->solution_cache, fp, wcses,
+                              ENGINE_CACHE_MAX_HITS);
+    if (!n) {
+        logverb("Field is not in the solution cache.\n");
+        return 0;
+    }
+    logmsg("Found %i matching field%s in the solution cache; verifying.\n",
+           n, (n == 1) ? "" : "s");
+
+    // the job's own WCSes are verified in its first run, as usual.
+    jobwcs = bl_new(4, sizeof(sip_t));
+    for (i=0; i<bl_size(bp->verify_wcs_list); i++)
+        bl_append(jobwcs, bl_access(bp->verify_wcs_list, i));
+    onefield_clear_verify_wcses(bp);
+
+    for (i=0; i<n; i++)
+        onefield_add_verify_wcs(bp, wcses + i);
+    run_verify_only(engine, job);
+
+    for (i=0; i<bl_size(jobwcs); i++)
+        onefield_add_verify_wcs(bp, bl_access(jobwcs, i));
+    bl_free(jobwcs);
+
+    if (!bp->single_field_solved)
+        logmsg("No solution from the solution cache.\n");
+    return bp->single_field_solved ? 1 : 0;
+}
+
+/*
+ How many field sources the runs need read: the deepest end depth, but
+ no fewer than "max_field_objs", so that verification still sees as
+ many sources as the solver would look at by default.  Zero (all of
+ them) if there is no "max_field_objs" limit.
+ */
+static int field_read_limit(const solver_t* sp, bl* runs) {
+    int n = sp->max_field_objs;
+    size_t i;
+    if (!n)
+        return 0;
+    for (i=0; i<bl_size(runs); i++) {
+        job_run_t* run = bl_access(runs, i);
+        n = MAX(n, run->endobj);
+    }
+    return n;
+}
+
+// The key of a run in the job's checkpoint: a hash of its parameters.
+static uint64_t run_key(engine_t* engine, const job_run_t* run) {
+    uint64_t h = 0;
+    int k;
+    h = job_checkpoint_hash(h, &run->startobj, sizeof(int));
+    h = job_checkpoint_hash(h, &run->endobj, sizeof(int));
+    h = job_checkpoint_hash(h, &run->app_min, sizeof(double));
+    h = job_checkpoint_hash(h, &run->app_max, sizeof(double));
+    h = job_checkpoint_hash(h, &run->quadsize_min, sizeof(double));
+    h = job_checkpoint_hash(h, &run->quadsize_max, sizeof(double));
+    for (k=0; k<il_size(run->indexlist); k++) {
+        index_t* index = pl_get(engine->indexes, il_get(run->indexlist, k));
+        h = job_checkpoint_hash(h, &index->indexid, sizeof(int));
+        h = job_checkpoint_hash(h, &index->healpix, sizeof(int));
+        h = job_checkpoint_hash(h, &index->hpnside, sizeof(int));
+        // (so that the keys of unstratified indexes don't change)
+        if (index->stratum)
+            h = job_checkpoint_hash(h, &index->stratum, sizeof(int));
+    }
+    return h;
+}
+
+/*
+ Reads the job's checkpoint, if it has one, and queues its best match
+ for verification; otherwise starts a new one.  Returns NULL if the job
+ doesn't keep a checkpoint.
+ */
+static job_checkpoint_t* open_checkpoint(job_t* job) {
+    onefield_t* bp = &(job->bp);
+    job_checkpoint_t* ck;
+
+    if (!job->checkpoint_fn)
+        return NULL;
+    if (il_size(bp->fieldlist) > 1) {
+        logmsg("Checkpoints are only kept for single-field jobs.\n");
+        return NULL;
+    }
+    ck = job_checkpoint_read(job->checkpoint_fn);
+    if (!ck)
+        return job_checkpoint_new();
+    logmsg("Resuming from checkpoint \"%s\" (%zu runs recorded).\n",
+           job->checkpoint_fn, bl_size(ck->runs));
+    if (ck->have_best) {
+        sip_t wcs;
+        logmsg("Verifying the best match so far (log-odds %g).\n",
+               ck->best_logodds);
+        sip_wrap_tan(&(ck->best_wcs), &wcs);
+        onefield_add_verify_wcs(bp, &wcs);
+    }
+    return ck;
+}
+
+// Runs the solver on one (depth, scale, indexes) run.
+static void run_job_run(engine_t* engine, job_t* job, job_run_t* run) {
+    onefield_t* bp = &(job->bp);
+    solver_t* sp = &(bp->solver);
+    int k;
+
+    sp->funits_lower = run->app_min;
+    sp->funits_upper = run->app_max;
+
+    sp->startobj = run->startobj;
+    sp->endobj = run->endobj;
+    bp->resume_index = run->resume_index;
+    bp->resume_object = run->resume_object;
+
+    // minimum quad size to try (in pixels)
+    sp->quadsize_min = bp->quad_size_fraction_lo *
+        MIN(job_imagew(job), job_imageh(job));
+    if (run->quadsize_min > 0.0)
+        sp->quadsize_min = run->quadsize_min;
+    sp->quadsize_max = run->quadsize_max;
+
+    for (k=0; k<il_size(run->indexlist); k++)
+        add_index_to_onefield(engine, bp, il_get(run->indexlist, k));
+
+    logverb("Running solver:\n");
+    onefield_log_run_parameters(bp);
+
+    onefield_run(bp);
+
+    // we only want to try using the verify_wcses the first time.
+    onefield_clear_verify_wcses(bp);
+    onefield_clear_indexes(bp);
+    onefield_clear_solutions(bp);
+    onefield_clear_indexes(bp);
+    solver_clear_indexes(sp);
+}
+
+int engine_run_job(engine_t* engine, job_t* job) {
+    onefield_t* bp = &(job->bp);
+    solver_t* sp = &(bp->solver);
+    bl* runs;
+    il* order;
+    int timelimit;
+    field_fingerprint_t fp;
+    job_checkpoint_t* ck = NULL;
+    int incache = -1;
+    int i;
+
+    if (onefield_is_run_obsolete(bp, sp)) {
+        goto finish;
+    }
+
+    sp->cancel = job->cancel;
+    sp->deadline = job->deadline;
+    if (solver_check_cancel(sp)) {
+        logmsg("Job cancelled, or past its deadline, before it started.\n");
+        goto finish;
+    }
+    an_alloc_reset_peaks();
+
+    if (engine->inparallel)
+        bp->indexes_inparallel = TRUE;
+
+    if (engine->nthreads)
+        sp->nthreads = engine->nthreads;
+    if (engine->nverifiers)
+        sp->nverifiers = engine->nverifiers;
+    sp->numa_pin = (engine->numa_policy != INDEX_NUMA_OFF);
+    sp->code_matcher = engine->code_matcher;
+    bp->nfieldthreads = engine->nfieldthreads;
+    bp->parallel_writers = engine->parallel_writers;
+    bp->prefetch = engine->prefetch;
+    bp->prefetch_max = engine->prefetch_max;
+
+    if (job->use_radec_center) {
+        logmsg("Only searching for solutions within %g degrees of RA,Dec (%g,%g)\n",
+               job->search_radius, job->ra_center, job->dec_center);
+        solver_set_radec(sp, job->ra_center, job->dec_center, job->search_radius);
+    }
+
+    if (job->verify_only) {
+        logverb("Verifying %zu WCS%s only.\n", bl_size(bp->verify_wcs_list),
+                (bl_size(bp->verify_wcs_list) == 1) ? "" : "es");
+        run_verify_only(engine, job);
+        goto finish;
+    }
+
+    if (engine->solution_cache)
+        incache = verify_cached_solutions(engine, job, &fp);
+
+    if (engine->adaptive && job->default_depths)
+        adapt_depths(engine, job);
+
+    ck = open_checkpoint(job);
+
+    runs = list_runs(engine, job);
+    bp->max_field_read = field_read_limit(sp, runs);
+    if (engine->schedule) {
+        logverb("Scheduled %zu solver runs:\n", bl_size(runs));
+        for (i=0; i<bl_size(runs); i++) {
+            job_run_t* run = bl_access(runs, i);
+            logverb("  objects %i-%i, scale %g-%g arcsec/pix, quads %g-%g arcsec, %zu indexes: cost %g, P(solve) %.3f\n",
+                    run->startobj, run->endobj, run->app_min, run->app_max,
+                    run->fmin, run->fmax, il_size(run->indexlist), run->cost,
+                    run->prob);
+        }
+    }
+
+    // The order to run in; with time slicing, the runs that got cut short
+    // are appended to be re-run in full after all the others.
+    order = il_new(16);
+    for (i=0; i<bl_size(runs); i++)
+        il_append(order, i);
+    timelimit = bp->timelimit;
+
+    for (i=0; i<il_size(order); i++) {
+        job_run_t* run = bl_access(runs, il_get(order, i));
+        anbool slicing = (engine->timeslice > 0) && !run->sliced;
+        uint64_t key = 0;
+        int k;
+
+        if (bp->hit_total_timelimit || bp->hit_total_cpulimit || bp->cancelled ||
+            bp->hit_memlimit || bp->single_field_solved)
+            break;
+
+        if (ck) {
+            checkpoint_run_t* done = job_checkpoint_find(ck, key = run_key(engine, run));
+            if (done && done->done) {
+                logverb("Skipping run %i: done before the checkpoint.\n", il_get(order, i));
+                continue;
+            }
+            if (done && !run->sliced) {
+                run->resume_index = done->index;
+                run->resume_object = done->object;
             }
         }
-        if (solved)
+
+        if (slicing) {
+            bp->timelimit = engine->timeslice;
+            if (timelimit)
+                bp->timelimit = MIN(bp->timelimit, timelimit);
+        } else
+            bp->timelimit = timelimit;
+        bp->hit_timelimit = FALSE;
+
+        run_job_run(engine, job, run);
+
+        pthread_mutex_lock(&engine->lock);
+        for (k=0; k<il_size(run->indexlist); k++)
+            index_count_add(engine->index_ntried, il_get(run->indexlist, k));
+        pthread_mutex_unlock(&engine->lock);
+
+        // ("single_field_solved" stays set, so later runs would be no-ops.)
+        if (bp->single_field_solved || onefield_is_run_obsolete(bp, sp)) {
+            pthread_mutex_lock(&engine->lock);
+            for (k=0; k<il_size(run->indexlist); k++)
+                index_count_add(engine->index_nsolved, il_get(run->indexlist, k));
+            pthread_mutex_unlock(&engine->lock);
+            for (k=0; k<il_size(run->indexlist); k++) {
+                index_t* index = pl_get(engine->indexes, il_get(run->indexlist, k));
+                if (index->indexid == bp->solved_indexid)
+                    index_residency_solved(index);
+            }
             break;
+        }
+        // (a run that's re-run picks up where it stopped.)
+        if (bp->stopped_object != -1) {
+            run->resume_index = bp->stopped_index;
+            run->resume_object = bp->stopped_object;
+        }
+        if (ck) {
+            job_checkpoint_set_run(ck, key, (bp->stopped_object == -1),
+                                   run->resume_index, run->resume_object);
+            if (bp->have_best_unsolved)
+                job_checkpoint_set_best(ck, bp->best_unsolved_logodds,
+                                        &(bp->best_unsolved_wcs));
+            job_checkpoint_write(ck, job->checkpoint_fn);
+        }
+        if (slicing && bp->hit_timelimit &&
+            (!timelimit || (engine->timeslice < timelimit))) {
+            logverb("Run hit the %i-second time slice; will come back to it.\n",
+                    engine->timeslice);
+            run->sliced = TRUE;
+            il_append(order, il_get(order, i));
+        }
+    }
+    bp->timelimit = timelimit;
+
+    if (ck) {
+        // a solved job has nothing to resume.
+        if (bp->single_field_solved && file_exists(job->checkpoint_fn) &&
+            unlink(job->checkpoint_fn))
+            SYSERROR("Failed to delete checkpoint file \"%s\"", job->checkpoint_fn);
+        job_checkpoint_free(ck);
     }
 
+    // remember the new solution.
+    if ((incache == 0) && bp->have_solved_wcs)
+        solution_cache_add(engine->solution_cache, &fp, &(bp->solved_wcs));
+
+    il_free(order);
+    for (i=0; i<bl_size(runs); i++) {
+        job_run_t* run = bl_access(runs, i);
+        il_free(run->indexlist);
+    }
+    bl_free(runs);
+
     logverb("cx<=dx constraints: %i\n", sp->num_cxdx_skipped);
     logverb("meanx constraints: %i\n", sp->num_meanx_skipped);
     logverb("RA,Dec constraints: %i\n", sp->num_radec_skipped);
     logverb("AB scale constraints: %i\n", sp->num_abscale_skipped);
+    an_alloc_log_report();
 
  finish:
     solver_cleanup(sp);
@@ -616,6 +1727,67 @@ int engine_run_job(engine_t* engine, job_t* job) {
     return 0;
 }
 
+struct job_pool {
+    engine_t* engine;
+    job_t** jobs;
+    int njobs;
+    // the next job to run.
+    int next;
+    int nfailed;
+    pthread_mutex_t lock;
+};
+
+static void* job_pool_thread(void* arg) {
+    struct job_pool* pool = arg;
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->njobs)
+            break;
+        if (engine_run_job(pool->engine, pool->jobs[i])) {
+            pthread_mutex_lock(&pool->lock);
+            pool->nfailed++;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+int engine_run_jobs(engine_t* engine, job_t** jobs, int njobs, int nthreads) {
+    struct job_pool pool;
+    pthread_t* threads;
+    int i, nstarted;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, njobs));
+
+    memset(&pool, 0, sizeof(pool));
+    pool.engine = engine;
+    pool.jobs = jobs;
+    pool.njobs = njobs;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    logverb("Running %i jobs on %i threads\n", njobs, nthreads);
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (nstarted=0; nstarted<nthreads; nstarted++) {
+        if (pthread_create(threads + nstarted, NULL, job_pool_thread, &pool)) {
+            SYSERROR("Failed to start job thread %i", nstarted);
+            break;
+        }
+    }
+    // (with no threads, run them here.)
+    if (!nstarted)
+        job_pool_thread(&pool);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    return pool.nfailed ? -1 : 0;
+}
+
 static void parse_sip_coeffs(const qfits_header* hdr, const char* prefix, sip_t* wcs) {
     char key[64];
     int order, i, j;
@@ -717,8 +1889,14 @@ static anbool parse_job_from_qfits_header(const qfits_header* hdr, job_t* job) {
     free(fn);
     onefield_set_corr_file    (bp, fn=fits_get_long_string(hdr, "ANCORR"  ));
     free(fn);
+    onefield_set_stats_file   (bp, fn=fits_get_long_string(hdr, "ANSTATS" ));
+    free(fn);
+    onefield_set_trace_file   (bp, fn=fits_get_long_string(hdr, "ANTRACE" ));
+    free(fn);
     onefield_set_cancel_file  (bp, fn=fits_get_long_string(hdr, "ANCANCEL"));
     free(fn);
+    job_set_checkpoint_file   (job, fn=fits_get_long_string(hdr, "ANCKPT"  ));
+    free(fn);
 
     onefield_set_xcol(bp, fn=fits_get_dupstring(hdr, "ANXCOL"));
     free(fn);
@@ -970,15 +2148,283 @@ static anbool parse_job_from_qfits_header(const qfits_header* hdr, job_t* job) {
 
 
 
+char* engine_find_config_file(const char* mydir) {
+    const char* default_configfn = "astrometry.cfg";
+    const char* default_config_path = "../etc";
+    char* configfn = NULL;
+    sl* trycf = sl_new(4);
+    int i;
+
+    sl_appendf(trycf, "%s/%s/%s", mydir, default_config_path, default_configfn);
+    // if I'm in /usr/bin, look for config file in /etc
+    if (streq(mydir, "/usr/bin")) {
+        sl_appendf(trycf, "/etc/%s", default_configfn);
+    }
+    sl_appendf(trycf, "%s/%s", mydir, default_configfn);
+    sl_appendf(trycf, "./%s", default_configfn);
+    sl_appendf(trycf, "./%s/%s", default_config_path, default_configfn);
+    for (i=0; i<sl_size(trycf); i++) {
+        char* cf = sl_get(trycf, i);
+        if (file_exists(cf)) {
+            configfn = strdup(cf);
+            logverb("Using config file \"%s\"\n", cf);
+            break;
+        } else {
+            logverb("Config file \"%s\" doesn't exist.\n", cf);
+        }
+    }
+    if (!configfn) {
+        char* cflist = sl_join(trycf, "\n  ");
+        logerr("Couldn't find config file: tried:\n  %s\n", cflist);
+        free(cflist);
+    }
+    sl_free2(trycf);
+    return configfn;
+}
+
+/*
+ Drops the indexes that aren't in this engine's shard.  By scale, the
+ distinct index scales are split into "nshards" contiguous ranges, so
+ that a job with a narrow scale range goes to few shards; by HEALPix,
+ the tiles are dealt out (and the all-sky indexes by index id).
+ */
+static void keep_shard(engine_t* engine) {
+    pl* all = pl_dupe(engine->indexes);
+    dl* scales = dl_new(16);
+    int k;
+
+    for (k=0; k<pl_size(all); k++) {
+        index_t* ind = pl_get(all, k);
+        dl_insert_unique_ascending(scales, ind->index_scale_lower);
+    }
+
+    pl_remove_all(engine->indexes);
+    il_remove_all(engine->ismallest);
+    il_remove_all(engine->ibiggest);
+    engine->sizesmallest = LARGE_VAL;
+    engine->sizebiggest = -LARGE_VAL;
+    index_lookup_free(engine->lookup);
+    engine->lookup = NULL;
+    for (k=0; k<pl_size(all); k++) {
+        index_t* ind = pl_get(all, k);
+        int shard;
+        if (engine->shard_by_healpix)
+            shard = ((ind->healpix >= 0) ? ind->healpix : ind->indexid) %
+                engine->nshards;
+        else
+            shard = (int)((int64_t)dl_sorted_index_of(scales, ind->index_scale_lower) *
+                          engine->nshards / dl_size(scales));
+        if (shard == engine->shard)
+            add_index(engine, ind);
+        else
+            // (still in "free_indexes")
+            index_unload(ind);
+    }
+    logmsg("Keeping %zu of %zu indexes (shard %i of %i, by %s)\n",
+           pl_size(engine->indexes), pl_size(all), engine->shard,
+           engine->nshards, engine->shard_by_healpix ? "HEALPix" : "scale");
+    dl_free(scales);
+    pl_free(all);
+}
+
+/*
+ Sets up the NUMA placement of the indexes.  With "local", the indexes
+ are dealt out to the nodes in contiguous runs, in the order the solver
+ takes them, so that each search thread starts on indexes on its own
+ node (see solver_t.numa_pin).  This has to wait until all the indexes
+ are known, so the ones that "inparallel" has loaded already are placed
+ here.
+ */
+static void place_indexes(engine_t* engine) {
+    int nnodes = an_numa_nodes();
+    int n = pl_size(engine->indexes);
+    int k;
+
+    for (k=0; k<n; k++) {
+        index_t* ind = pl_get(engine->indexes, k);
+        ind->numa_node = an_numa_node_id((int)((int64_t)k * nnodes / n));
+    }
+    index_numa_set_policy(engine->numa_policy, engine->numa_replicate);
+    for (k=0; k<n; k++) {
+        index_t* ind = pl_get(engine->indexes, k);
+        if (ind->codekd)
+            index_numa_place(ind);
+    }
+    logverb("Placing %i indexes on %i NUMA node(s) (%s)\n", n, nnodes,
+            (engine->numa_policy == INDEX_NUMA_LOCAL) ? "local" : "interleaved");
+}
+
+int engine_configure(engine_t* engine, const char* configfn,
+                     const char* mydir, sl* index_dirs, sl* index_files) {
+    char* cfn = NULL;
+    int i;
+    size_t c;
+
+    if (configfn)
+        cfn = strdup(configfn);
+    else
+        cfn = engine_find_config_file(mydir);
+
+    if (cfn && !streq(cfn, "none")) {
+        if (engine_parse_config_file(engine, cfn)) {
+            logerr("Failed to parse (or encountered an error while interpreting) config file \"%s\"\n", cfn);
+            free(cfn);
+            return -1;
+        }
+    }
+
+    if (index_dirs && sl_size(index_dirs)) {
+        // save the engine_t state, add the search paths & auto-index them, then revert.
+        sl* saved_paths = engine->index_paths;
+        engine->index_paths = index_dirs;
+        if (engine_autoindex_search_paths(engine)) {
+            char* dirs = sl_join(index_dirs, ", ");
+            logerr("Failed to search directories for index files: [%s]", dirs);
+            free(dirs);
+            engine->index_paths = saved_paths;
+            free(cfn);
+            return -1;
+        }
+        engine->index_paths = saved_paths;
+    }
+
+    if (index_files) {
+        // Expand globs.
+        for (i=0; i<sl_size(index_files); i++) {
+            char* s = sl_get(index_files, i);
+            glob_t myglob;
+            int flags = GLOB_TILDE | GLOB_BRACE;
+            if (glob(s, flags, NULL, &myglob)) {
+                SYSERROR("Failed to expand wildcards in index-file path \"%s\"", s);
+                free(cfn);
+                return -1;
+            }
+            for (c=0; c<myglob.gl_pathc; c++) {
+                if (engine_add_index(engine, myglob.gl_pathv[c])) {
+                    ERROR("Failed to add index \"%s\"", myglob.gl_pathv[c]);
+                    globfree(&myglob);
+                    free(cfn);
+                    return -1;
+                }
+            }
+            globfree(&myglob);
+        }
+    }
+
+    if (engine->nshards > 1)
+        keep_shard(engine);
+
+    if (engine->numa_policy)
+        place_indexes(engine);
+
+    // (a coordinator's nodes have the indexes)
+    if (!pl_size(engine->indexes) && !engine->coordinator) {
+        logerr("\n\n"
+               "---------------------------------------------------------------------\n"
+               "You must list at least one index in the config file (%s)\n\n"
+               "See http://astrometry.net/use.html about how to get some index files.\n"
+               "---------------------------------------------------------------------\n"
+               "\n", cfn);
+        free(cfn);
+        return -1;
+    }
+
+    if (engine->minwidth <= 0.0 || engine->maxwidth <= 0.0) {
+        logerr("\"minwidth\" and \"maxwidth\" in the config file %s must be positive!\n", cfn);
+        free(cfn);
+        return -1;
+    }
+    free(cfn);
+
+    if (!il_size(engine->default_depths)) {
+        parse_depth_string(engine->default_depths,
+                           "10 20 30 40 50 60 70 80 90 100 "
+                           "110 120 130 140 150 160 170 180 190 200");
+    }
+    return 0;
+}
+
+int engine_run_job_file(engine_t* engine, const char* jobfn,
+                        const char* basedir, anbool* solved) {
+    job_t* job;
+    double t0;
+    int rtn = 0;
+    struct rusage ru0, ru1;
+    index_residency_stats_t res0, res1;
+
+    if (engine->coordinator)
+        return engine_coordinator_run_job_file(engine->coordinator, engine,
+                                               jobfn, basedir, solved);
+    t0 = timenow();
+    index_residency_get_stats(&res0);
+    if (engine->metrics) {
+        engine_metrics_job_started(engine->metrics);
+        getrusage(RUSAGE_SELF, &ru0);
+    }
+    logmsg("Reading file \"%s\"...\n", jobfn);
+    job = engine_read_job_file(engine, jobfn);
+    if (!job) {
+        ERROR("Failed to read job file \"%s\"", jobfn);
+        if (engine->metrics)
+            engine_metrics_job_finished(engine->metrics, ENGINE_METRICS_ERROR,
+                                        timenow() - t0, 0, 0, NULL);
+        return -1;
+    }
+    if (engine->flat_outputs)
+        job_set_output_base_dir(job, NULL);
+    else if (basedir) {
+        logverb("Setting job's output base directory to %s\n", basedir);
+        job_set_output_base_dir(job, basedir);
+    }
+    if (engine->metrics)
+        job->bp.collect_stats = TRUE;
+    PROFILE_BEGIN("solve");
+    if (engine_run_job(engine, job)) {
+        logerr("Failed to run_job()\n");
+        rtn = 1;
+    }
+    PROFILE_END("solve");
+    if (solved)
+        *solved = job->bp.single_field_solved;
+    if (engine->metrics) {
+        getrusage(RUSAGE_SELF, &ru1);
+        engine_metrics_job_finished(engine->metrics,
+                                    rtn ? ENGINE_METRICS_ERROR :
+                                    job->bp.single_field_solved ?
+                                    ENGINE_METRICS_SOLVED : ENGINE_METRICS_UNSOLVED,
+                                    timenow() - t0,
+                                    ru1.ru_majflt - ru0.ru_majflt,
+                                    ru1.ru_minflt - ru0.ru_minflt, &(job->bp));
+    }
+    job_free(job);
+    index_residency_get_stats(&res1);
+    if (res1.nresident || res1.evictions)
+        logverb("Index residency: %i indexes (%.1f MB) loaded; this job: "
+                "%lld hits, %lld misses, %lld evictions\n", res1.nresident,
+                res1.resident_bytes / (1024. * 1024.),
+                (long long)(res1.hits - res0.hits),
+                (long long)(res1.misses - res0.misses),
+                (long long)(res1.evictions - res0.evictions));
+    if (engine->metrics)
+        engine_metrics_index_residency(engine->metrics, &res0, &res1);
+    logverb("Spent %g seconds on this field.\n", timenow() - t0);
+    profile_flush(jobfn);
+    return rtn;
+}
+
 engine_t* engine_new() {
     engine_t* engine = calloc(1, sizeof(engine_t));
     engine->index_paths = sl_new(10);
     engine->indexes = pl_new(16);
     engine->free_indexes = pl_new(16);
     engine->free_mindexes = pl_new(16);
+    engine->remotes = pl_new(4);
     engine->ismallest = il_new(4);
     engine->ibiggest = il_new(4);
     engine->default_depths = il_new(4);
+    engine->index_ntried = il_new(16);
+    engine->index_nsolved = il_new(16);
+    pthread_mutex_init(&engine->lock, NULL);
     engine->sizesmallest = LARGE_VAL;
     engine->sizebiggest = -LARGE_VAL;
 
@@ -986,6 +2432,7 @@ engine_t* engine_new() {
     engine->minwidth = 0.1;
     engine->maxwidth = 180.0;
     engine->cpulimit = 600.0;
+    engine->use_manifests = TRUE;
     return engine;
 }
 
@@ -1007,22 +2454,33 @@ void engine_free(engine_t* engine) {
         }
         pl_free(engine->free_mindexes);
     }
+    // (after the indexes: closing waits for any prefetching to finish)
+    if (engine->remotes) {
+        for (i=0; i<pl_size(engine->remotes); i++)
+            index_remote_close(pl_get(engine->remotes, i));
+        pl_free(engine->remotes);
+    }
     pl_free(engine->indexes);
+    index_lookup_free(engine->lookup);
     if (engine->ismallest)
         il_free(engine->ismallest);
     if (engine->ibiggest)
         il_free(engine->ibiggest);
     if (engine->default_depths)
         il_free(engine->default_depths);
+    il_free(engine->index_ntried);
+    il_free(engine->index_nsolved);
+    solution_cache_free(engine->solution_cache);
+    code_matcher_free(engine->code_matcher);
     if (engine->index_paths)
         sl_free2(engine->index_paths);
+    pthread_mutex_destroy(&engine->lock);
     free(engine);
 }
 
 job_t* engine_read_job_file(engine_t* engine, const char* jobfn) {
     qfits_header* hdr;
     job_t* job;
-    onefield_t* bp;
 
     // Read primary header.
     hdr = anqfits_get_header2(jobfn, 0);
@@ -1030,18 +2488,25 @@ job_t* engine_read_job_file(engine_t* engine, const char* jobfn) {
         ERROR("Failed to parse FITS header from file \"%s\"", jobfn);
         return NULL;
     }
+    job = engine_job_from_header(engine, hdr);
+    qfits_header_destroy(hdr);
+    if (!job)
+        return NULL;
+    onefield_set_field_file(&(job->bp), jobfn);
+    return job;
+}
+
+job_t* engine_job_from_header(engine_t* engine, const qfits_header* hdr) {
+    job_t* job;
+    onefield_t* bp;
+
     job = job_new();
     if (!parse_job_from_qfits_header(hdr, job)) {
         job_free(job);
-        qfits_header_destroy(hdr);
         return NULL;
     }
-    qfits_header_destroy(hdr);
-
     bp = &(job->bp);
 
-    onefield_set_field_file(bp, jobfn);
-
     // If the job has no scale estimate, search everything provided
     // by the engine
     if (!dl_size(job->scales) || job->include_default_scales) {
@@ -1070,14 +2535,17 @@ job_t* engine_read_job_file(engine_t* engine, const char* jobfn) {
             // no limit.
             il_append(job->depths, 0);
             il_append(job->depths, 0);
-        } else
+        } else {
             il_append_list(job->depths, engine->default_depths);
+            job->default_depths = TRUE;
+        }
     }
 
     if (engine->cancelfn)
         onefield_set_cancel_file(bp, engine->cancelfn);
     if (engine->solvedfn)
         onefield_set_solved_file(bp, engine->solvedfn);
+    job->cancel = engine->cancel;
 
     return job;
 }
@@ -1090,6 +2558,19 @@ void job_set_solved_file(job_t* job, const char* fn) {
     onefield_set_solved_file(&(job->bp), fn);
 }
 
+void job_set_checkpoint_file(job_t* job, const char* fn) {
+    free(job->checkpoint_fn);
+    job->checkpoint_fn = strdup_safe(fn);
+}
+
+void job_set_cancel_token(job_t* job, int* token) {
+    job->cancel = token;
+}
+
+void job_set_deadline(job_t* job, double deadline) {
+    job->deadline = deadline;
+}
+
 // Modify all filenames to be relative to "dir".
 int job_set_base_dir(job_t* job, const char* dir) {
     return job_set_output_base_dir(job, dir) ||
@@ -1108,47 +2589,69 @@ int job_set_input_base_dir(job_t* job, const char* dir) {
     return 0;
 }
 
+// "fn" in directory "dir", or (if "dir" is NULL) just its base name.
+static char* output_path(const char* fn, const char* dir) {
+    if (!dir)
+        return basename_safe(fn);
+    return resolve_path(fn, dir);
+}
+
 int job_set_output_base_dir(job_t* job, const char* dir) {
     char* path;
     onefield_t* bp = &(job->bp);
-    logverb("Changing output file base dir to %s\n", dir);
+    logverb("Changing output file base dir to %s\n", dir ? dir : "(none)");
     if (bp->cancelfname) {
-        path = resolve_path(bp->cancelfname, dir);
+        path = output_path(bp->cancelfname, dir);
         logverb("Cancel file was %s, changing to %s.\n", bp->cancelfname, path);
         onefield_set_cancel_file(bp, path);
     }
+    if (job->checkpoint_fn) {
+        path = output_path(job->checkpoint_fn, dir);
+        logverb("Changing %s to %s\n", job->checkpoint_fn, path);
+        job_set_checkpoint_file(job, path);
+    }
     if (bp->solved_in) {
-        path = resolve_path(bp->solved_in, dir);
+        path = output_path(bp->solved_in, dir);
         logverb("Changing %s to %s\n", bp->solved_in, path);
         onefield_set_solvedin_file(bp, path);
     }
     if (bp->solved_out) {
-        path = resolve_path(bp->solved_out, dir);
+        path = output_path(bp->solved_out, dir);
         logverb("Changing %s to %s\n", bp->solved_out, path);
         onefield_set_solvedout_file(bp, path);
     }
     if (bp->matchfname) {
-        path = resolve_path(bp->matchfname, dir);
+        path = output_path(bp->matchfname, dir);
         logverb("Changing %s to %s\n", bp->matchfname, path);
         onefield_set_match_file(bp, path);
     }
     if (bp->indexrdlsfname) {
-        path = resolve_path(bp->indexrdlsfname, dir);
+        path = output_path(bp->indexrdlsfname, dir);
         logverb("Changing %s to %s\n", bp->indexrdlsfname, path);
         onefield_set_rdls_file(bp, path);
     }
     if (bp->scamp_fname) {
-        path = resolve_path(bp->scamp_fname, dir);
+        path = output_path(bp->scamp_fname, dir);
         logverb("Changing %s to %s\n", bp->scamp_fname, path);
         onefield_set_scamp_file(bp, path);
     }
     if (bp->corr_fname) {
-        path = resolve_path(bp->corr_fname, dir);
+        path = output_path(bp->corr_fname, dir);
         logverb("Changing %s to %s\n", bp->corr_fname, path);
         onefield_set_corr_file(bp, path);
     }
+    if (bp->stats_fname) {
+        path = output_path(bp->stats_fname, dir);
+        logverb("Changing %s to %s\n", bp->stats_fname, path);
+        onefield_set_stats_file(bp, path);
+    }
+    if (bp->trace_fname) {
+        path = output_path(bp->trace_fname, dir);
+        logverb("Changing %s to %s\n", bp->trace_fname, path);
+        onefield_set_trace_file(bp, path);
+    }
     if (bp->wcs_template) {
-        path = resolve_path(bp->wcs_template, dir);
+        path = output_path(bp->wcs_template, dir);
         logverb("Changing %s to %s\n", bp->wcs_template, path);
         onefield_set_wcs_file(bp, path);
     }
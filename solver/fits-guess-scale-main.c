@@ -12,11 +12,12 @@
 #include "fits-guess-scale.h"
 #include "fitsioutils.h"
 #include "log.h"
+#include "qfits_rw.h"
 
 static char* OPTIONS = "hv";
 
 static void printHelp(char* progname) {
-    printf("%s  <FITS-file>\n\n", progname);
+    printf("%s  <FITS-or-JPEG-file>\n\n", progname);
 }
 
 
@@ -53,8 +54,13 @@ int main(int argc, char *argv[]) {
 
     fits_use_error_system();
 
-    if (fits_guess_scale(infn, &methods, &scales))
-        exit(-1);
+    if (qfits_is_fits(infn) == 1) {
+        if (fits_guess_scale(infn, &methods, &scales))
+            exit(-1);
+    } else {
+        if (exif_guess_scale(infn, 0, &methods, &scales) < 0)
+            exit(-1);
+    }
 
     for (i=0; i<sl_size(methods); i++) {
         printf("scale %s %g\n", sl_get(methods, i), dl_get(scales, i));
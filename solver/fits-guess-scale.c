@@ -19,6 +19,9 @@
 #include "log.h"
 #include "mathutil.h"
 
+// The EXIF tags are near the start of a JPEG: read at most this much.
+#define EXIF_READ_BYTES (256 * 1024)
+
 int fits_guess_scale(const char* infn,
                      sl** p_methods, dl** p_scales) {
     qfits_header* hdr;
@@ -131,3 +134,179 @@ void fits_guess_scale_hdr(const qfits_header* hdr,
         addscale(methods, scales, "cdelt1", 3600.0 * fabs(val));
 }
 
+
+// EXIF (TIFF) values, in the file's byte order.
+static unsigned int exif_u16(const unsigned char* p, anbool bigendian) {
+    return bigendian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]);
+}
+
+static unsigned int exif_u32(const unsigned char* p, anbool bigendian) {
+    return bigendian ?
+        (((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) :
+        (((unsigned int)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]);
+}
+
+/*
+ Looks up "tag" in the IFD at "ifd" of the "N"-byte TIFF block "tiff",
+ returning its (first) value as a number: SHORT, LONG or RATIONAL.
+ Returns 0 if it's not there.
+ */
+static double exif_tag(const unsigned char* tiff, size_t N, size_t ifd,
+                       anbool bigendian, unsigned int tag) {
+    unsigned int i, n;
+    if (ifd + 2 > N)
+        return 0;
+    n = exif_u16(tiff + ifd, bigendian);
+    for (i=0; i<n; i++) {
+        const unsigned char* e = tiff + ifd + 2 + 12*i;
+        unsigned int type;
+        if (ifd + 2 + 12*(i+1) > N)
+            return 0;
+        if (exif_u16(e, bigendian) != tag)
+            continue;
+        type = exif_u16(e + 2, bigendian);
+        if (type == 3)
+            return exif_u16(e + 8, bigendian);
+        if (type == 4)
+            return exif_u32(e + 8, bigendian);
+        if (type == 5) {
+            size_t off = exif_u32(e + 8, bigendian);
+            unsigned int num, den;
+            if (off + 8 > N)
+                return 0;
+            num = exif_u32(tiff + off, bigendian);
+            den = exif_u32(tiff + off + 4, bigendian);
+            return den ? (double)num / (double)den : 0;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int exif_guess_scale(const char* fn, int imagew,
+                     sl** p_methods, dl** p_scales) {
+    unsigned char* buf;
+    size_t N, pos;
+    FILE* fid;
+    const unsigned char* tiff = NULL;
+    size_t ntiff = 0;
+    int jpegw = 0, jpegh = 0;
+    int nfound = 0;
+    sl* methods = NULL;
+    dl* scales = NULL;
+
+    if (p_methods) {
+        if (!*p_methods)
+            *p_methods = sl_new(4);
+        methods = *p_methods;
+    }
+    if (p_scales) {
+        if (!*p_scales)
+            *p_scales = dl_new(4);
+        scales = *p_scales;
+    }
+
+    fid = fopen(fn, "rb");
+    if (!fid) {
+        SYSERROR("Failed to open \"%s\"", fn);
+        return -1;
+    }
+    buf = malloc(EXIF_READ_BYTES);
+    N = fread(buf, 1, EXIF_READ_BYTES, fid);
+    fclose(fid);
+
+    // JPEG markers, up to the start of the image data: APP1 holds the
+    // EXIF tags, SOFn the image size.
+    if (N < 4 || buf[0] != 0xFF || buf[1] != 0xD8)
+        goto done;
+    pos = 2;
+    while (pos + 4 <= N) {
+        unsigned int marker, len;
+        if (buf[pos] != 0xFF)
+            break;
+        marker = buf[pos+1];
+        if (marker == 0xFF) {
+            // padding
+            pos++;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9)
+            break;
+        len = (buf[pos+2] << 8) | buf[pos+3];
+        if (len < 2 || pos + 2 + len > N)
+            break;
+        if (marker == 0xE1 && !tiff && len >= 16 &&
+            memcmp(buf + pos + 4, "Exif\0\0", 6) == 0) {
+            tiff = buf + pos + 10;
+            ntiff = len - 8;
+        }
+        if (marker >= 0xC0 && marker <= 0xCF &&
+            marker != 0xC4 && marker != 0xC8 && marker != 0xCC && len >= 7) {
+            jpegh = (buf[pos+5] << 8) | buf[pos+6];
+            jpegw = (buf[pos+7] << 8) | buf[pos+8];
+        }
+        pos += 2 + len;
+    }
+    if (!imagew)
+        imagew = jpegw;
+
+    if (tiff && ntiff >= 8 &&
+        (memcmp(tiff, "II*\0", 4) == 0 || memcmp(tiff, "MM\0*", 4) == 0)) {
+        anbool be = (tiff[0] == 'M');
+        size_t ifd0 = exif_u32(tiff + 4, be);
+        size_t exififd = (size_t)exif_tag(tiff, ntiff, ifd0, be, 0x8769);
+        double focal, f35, fpres, exifw, exifh, unit, pitch;
+
+        if (!exififd)
+            goto done;
+        focal = exif_tag(tiff, ntiff, exififd, be, 0x920A);
+        fpres = exif_tag(tiff, ntiff, exififd, be, 0xA20E);
+        unit = exif_tag(tiff, ntiff, exififd, be, 0xA210);
+        f35 = exif_tag(tiff, ntiff, exififd, be, 0xA405);
+        exifw = exif_tag(tiff, ntiff, exififd, be, 0xA002);
+        exifh = exif_tag(tiff, ntiff, exififd, be, 0xA003);
+        if (exifw == 0) {
+            exifw = jpegw;
+            exifh = jpegh;
+        }
+        logverb("EXIF: focal length %g mm (%g mm in 35mm film), focal plane "
+                "resolution %g per unit %g, size %g x %g\n",
+                focal, f35, fpres, unit, exifw, exifh);
+        if (imagew <= 0 || exifw <= 0)
+            goto done;
+
+        // FocalPlaneResolutionUnit: 2 = inch (the default), 3 = cm,
+        // 4 = mm, 5 = micron.
+        if (unit == 0 || unit == 2)
+            unit = 25.4;
+        else if (unit == 3)
+            unit = 10.0;
+        else if (unit == 4)
+            unit = 1.0;
+        else if (unit == 5)
+            unit = 1e-3;
+        else
+            unit = 0;
+        if (focal > 0 && fpres > 0 && unit > 0) {
+            // pixel pitch in mm, of the image's pixels.
+            pitch = unit / fpres * exifw / imagew;
+            addscale(methods, scales, "exif-focalplane",
+                     rad2arcsec(pitch / focal));
+            nfound++;
+        }
+        if (f35 > 0) {
+            // The 35mm-equivalent focal length is for a 36 x 24 mm
+            // frame with the same diagonal as the image.
+            double diag = hypot(36.0, 24.0);
+            if (exifh > 0)
+                pitch = diag / hypot(exifw, exifh) * exifw / imagew;
+            else
+                pitch = 36.0 / imagew;
+            addscale(methods, scales, "exif-35mm", rad2arcsec(pitch / f35));
+            nfound++;
+        }
+    }
+ done:
+    free(buf);
+    return nfound;
+}
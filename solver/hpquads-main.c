@@ -33,7 +33,7 @@
 #include "quad-utils.h"
 #include "quad-builder.h"
 
-static const char* OPTIONS = "hi:c:q:bn:u:l:d:p:r:L:RI:F:HEv";
+static const char* OPTIONS = "hi:c:q:bn:u:l:d:p:r:L:RI:F:HEvw:";
 
 static void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -51,6 +51,8 @@ static void print_help(char* progname) {
            "                     limit each time, up to \"max-reuses\".\n"
            "     [-I <unique-id>] set the unique ID of this index\n\n"
            "     [-E]: scan through the catalog, checking which healpixes are occupied.\n"
+           "     [-w <threads>]: build quads on this many threads (-1: one per CPU),\n"
+           "                     visiting the healpixes in blocks\n"
            "     [-v]: verbose\n"
            "\nReads skdt, writes {code, quad}.\n\n"
            , progname);
@@ -69,6 +71,7 @@ int main(int argc, char** argv) {
     int Nreuse = 3;
     int Nloosen = 0;
     anbool scanoccupied = FALSE;
+    int nthreads = 0;
     int dimquads = 4;
     double scale_min_arcmin = 0.0;
     double scale_max_arcmin = 0.0;
@@ -85,6 +88,9 @@ int main(int argc, char** argv) {
         case 'E':
             scanoccupied = TRUE;
             break;
+        case 'w':
+            nthreads = atoi(optarg);
+            break;
         case 'd':
             dimquads = atoi(optarg);
             break;
@@ -157,7 +163,7 @@ int main(int argc, char** argv) {
     if (hpquads_files(skdtfn, codefn, quadfn, Nside,
                       scale_min_arcmin, scale_max_arcmin,
                       dimquads, passes, Nreuse, Nloosen,
-                      id, scanoccupied, 
+                      id, scanoccupied, nthreads,
                       NULL, NULL, 0,
                       argv, argc)) {
         ERROR("hpquads failed");
@@ -13,7 +13,9 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <assert.h>
+#include <pthread.h>
 
+#include "os-features.h"
 #include "healpix.h"
 #include "starutil.h"
 #include "codefile.h"
@@ -24,7 +26,7 @@
 #include "fitsioutils.h"
 #include "anqfits.h"
 #include "permutedsort.h"
-#include "bt.h"
+#include "oset.h"
 #include "starkd.h"
 #include "boilerplate.h"
 #include "log.h"
@@ -37,7 +39,6 @@
 typedef il hpl;
 typedef int hpint;
 #define hpl_new il_new
-#define hpl_insert_unique_ascending il_insert_unique_ascending
 #define hpl_size il_size
 #define hpl_get il_get
 #define hpl_append il_append
@@ -47,7 +48,6 @@ typedef int hpint;
 typedef ll hpl;
 typedef int64_t hpint;
 #define hpl_new ll_new
-#define hpl_insert_unique_ascending ll_insert_unique_ascending
 #define hpl_size ll_size
 #define hpl_get ll_get
 #define hpl_append ll_append
@@ -65,7 +65,7 @@ struct hpquads {
     double radius2;
 
     bl* quadlist;
-    bt* bigquadlist;
+    oset* bigquadlist;
 
     unsigned char* nuses;
 
@@ -86,9 +86,40 @@ struct hpquads {
 
     // for build_quads():
     hpl* retryhps;
+
+    // for build_quads_parallel(): number of threads, and the size of the
+    // blocks of cells (0: cells are visited one at a time, in order).
+    int nthreads;
+    int blocksize;
 };
 typedef struct hpquads hpquads_t;
 
+// Quads are written a block at a time, so that their codes can be
+// computed together (see quad_write_many()).
+struct quad_batch {
+    codefile_t* codes;
+    quadfile_t* quads;
+    startree_t* starkd;
+    int dimquads;
+    int dimcodes;
+    unsigned int quad[QUAD_CODE_BLOCK * DQMAX];
+    int n;
+    anbool failed;
+};
+
+static void batch_flush(struct quad_batch* qb) {
+    if (qb->n && !qb->failed &&
+        quad_write_many(qb->codes, qb->quads, qb->quad, qb->n, qb->starkd,
+                        qb->dimquads, qb->dimcodes))
+        qb->failed = TRUE;
+    qb->n = 0;
+}
+
+static void batch_write_quad(struct quad_batch* qb, const unsigned int* q) {
+    memcpy(qb->quad + qb->n * qb->dimquads, q, qb->dimquads * sizeof(unsigned int));
+    if (++qb->n == QUAD_CODE_BLOCK)
+        batch_flush(qb);
+}
 
 static int compare_quads(const void* v1, const void* v2, void* token) {
     const unsigned int* q1 = v1;
@@ -177,8 +208,11 @@ static anbool find_stars(hpquads_t* me, double radius2, int R) {
         perm = permuted_sort(me->res->inds, sizeof(int), compare_ints_asc, NULL, N);
     }
     // apply the permutation...
-    permutation_apply(perm, N, me->res->inds, me->res->inds, sizeof(int));
-    permutation_apply(perm, N, me->res->results.d, me->res->results.d, 3 * sizeof(double));
+    {
+        void* arrays[] = { me->res->inds, me->res->results.d };
+        int sizes[] = { sizeof(int), 3 * sizeof(double) };
+        permutation_apply_multi(perm, N, arrays, sizes, 2);
+    }
 
     free(perm);
 
@@ -200,7 +234,7 @@ static anbool check_full_quad(quadbuilder_t* qb, unsigned int* quad, int nstars,
     anbool dup;
     if (!me->bigquadlist)
         return TRUE;
-    dup = bt_contains2(me->bigquadlist, quad, compare_quads, &me->dimquads);
+    dup = oset_contains(me->bigquadlist, quad);
     return !dup;
 }
 
@@ -276,13 +310,406 @@ static void add_headers(qfits_header* hdr, char** argv, int argc,
     }
 }
 
+// Tries to make a quad in healpix "hp".  Returns TRUE if it did.
+static anbool try_healpix(hpquads_t* me, hpint hp, int R) {
+    anbool ok;
+    logverb("Trying healpix %lli\n", hp);
+    me->hp = hp;
+    me->quad_created = FALSE;
+    ok = find_stars(me, me->radius2, R);
+    if (ok)
+        create_quad(me, TRUE);
+
+    if (me->quad_created)
+        return TRUE;
+    if (R && me->Nstars && me->retryhps)
+        // there were some stars, and we're counting how many times stars are used.
+        //il_insert_unique_ascending(me->retryhps, hp);
+        // we don't mind hps showing up multiple times because we want to make up for the lost
+        // passes during loosening...
+        hpl_append(me->retryhps, hp);
+    // FIXME -- could also track which hps are worth visiting in a future pass
+    return FALSE;
+}
+
+/*
+ The parallel mode: the cells of each big healpix are grouped into
+ square blocks that are colored like a checkerboard with four colors, so
+ that blocks of the same color are at least one block apart.  The blocks
+ are large enough that the stars searched by the cells of different
+ blocks of the same color never overlap, so those blocks can be run
+ concurrently: they don't see each other's changes to "nuses".  The
+ (big healpix, color) steps run one after another, and each block's
+ quads are appended in block order, so the result doesn't depend on the
+ number of threads.
+ */
+struct hpblock {
+    // the cells: entries [i0, i1) of the sorted try-list, or, without a
+    // try-list, all cells in [x0, x1) x [y0, y1) of big healpix "bighp".
+    hpint i0, i1;
+    int bighp, x0, x1, y0, y1;
+    // results:
+    bl* quads;
+    hpl* retry;
+    int nmade;
+};
+
+struct hpentry {
+    int64_t key;
+    // position in the try-list
+    hpint pos;
+    hpint hp;
+};
+
+struct block_job {
+    hpquads_t* me;
+    struct hpblock* blocks;
+    int nblocks;
+    int next;
+    const struct hpentry* entries;
+    int R;
+};
+
+static void* block_worker(void* varg) {
+    struct block_job* job = varg;
+    hpquads_t mine = *job->me;
+    hpint i;
+    int x, y;
+
+    mine.res = NULL;
+    for (;;) {
+        int b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        struct hpblock* blk;
+        if (b >= job->nblocks)
+            break;
+        blk = job->blocks + b;
+        mine.quadlist = blk->quads;
+        mine.retryhps = blk->retry;
+        if (job->entries) {
+            for (i=blk->i0; i<blk->i1; i++)
+                blk->nmade += try_healpix(&mine, job->entries[i].hp, job->R);
+        } else {
+            for (x=blk->x0; x<blk->x1; x++)
+                for (y=blk->y0; y<blk->y1; y++) {
+                    hpint hp = healpix_compose_xyl(blk->bighp, x, y, mine.Nside);
+                    blk->nmade += try_healpix(&mine, hp, job->R);
+                }
+        }
+    }
+    kdtree_free_query(mine.res);
+    return NULL;
+}
+
+static void run_blocks(hpquads_t* me, struct hpblock* blocks, int nblocks,
+                       const struct hpentry* entries, int R) {
+    struct block_job job;
+    pthread_t* threads;
+    int i, nstarted = 0;
+    int nthreads = MIN(me->nthreads, nblocks);
+
+    job.me = me;
+    job.blocks = blocks;
+    job.nblocks = nblocks;
+    job.next = 0;
+    job.entries = entries;
+    job.R = R;
+    threads = malloc(MAX(nthreads, 1) * sizeof(pthread_t));
+    for (i=1; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, block_worker, &job))
+            // this thread picks up the slack.
+            break;
+        nstarted++;
+    }
+    block_worker(&job);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// The center of the block of cells [x0, x1) x [y0, y1) of a big healpix,
+// and the distance from it to the farthest of its cells' centers.
+static double block_circle(hpquads_t* me, int bighp, int x0, int x1,
+                           int y0, int y1, double* center) {
+    double ns = me->Nside;
+    double corner[3];
+    double r2 = 0;
+    int i;
+    healpixl_to_xyzarr(bighp, 1, 0.5 * (x0 + x1) / ns, 0.5 * (y0 + y1) / ns,
+                       center);
+    for (i=0; i<4; i++) {
+        double cx = ((i & 1) ? x1 - 0.5 : x0 + 0.5) / ns;
+        double cy = ((i & 2) ? y1 - 0.5 : y0 + 0.5) / ns;
+        healpixl_to_xyzarr(bighp, 1, cx, cy, corner);
+        r2 = MAX(r2, distsq(center, corner, 3));
+    }
+    return sqrt(r2);
+}
+
+// The centers of the cells around the edge of a block; returns how many.
+static int block_edge(hpquads_t* me, int bighp, int x0, int x1,
+                      int y0, int y1, double* xyz) {
+    int x, y, n = 0;
+    for (y=y0; y<y1; y++)
+        for (x=x0; x<x1; x++) {
+            if (y != y0 && y != y1-1 && x != x0 && x != x1-1)
+                // (skip the interior)
+                x = x1 - 2;
+            else
+                healpixl_to_xyzarr(healpix_compose_xyl(bighp, x, y, me->Nside),
+                                   me->Nside, 0.5, 0.5, xyz + 3 * n++);
+        }
+    return n;
+}
+
+static void block_bounds(hpquads_t* me, int B, int bx, int by,
+                         int* x0, int* x1, int* y0, int* y1) {
+    *x0 = bx * B;
+    *x1 = MIN((int)me->Nside, (bx+1) * B);
+    *y0 = by * B;
+    *y1 = MIN((int)me->Nside, (by+1) * B);
+}
+
+// Can blocks (bx,by) and (ox,oy) of big healpix "bighp", whose bounding
+// circles are given, run at the same time?
+static anbool blocks_apart(hpquads_t* me, int B, int bighp,
+                           int bx, int by, const double* c1, double r1,
+                           int ox, int oy, const double* c2, double r2,
+                           double* edge1, double* edge2) {
+    double r = sqrt(me->radius2);
+    double mind2 = HUGE_VAL;
+    int x0, x1, y0, y1;
+    int n1, n2, i, j;
+
+    if (sqrt(distsq(c1, c2, 3)) > r1 + r2 + 2*r)
+        return TRUE;
+    // The bounding circles overlap (the blocks near the corners of the big
+    // healpixes are squashed), so check the cells along the blocks' edges.
+    block_bounds(me, B, bx, by, &x0, &x1, &y0, &y1);
+    n1 = block_edge(me, bighp, x0, x1, y0, y1, edge1);
+    block_bounds(me, B, ox, oy, &x0, &x1, &y0, &y1);
+    n2 = block_edge(me, bighp, x0, x1, y0, y1, edge2);
+    for (i=0; i<n1; i++)
+        for (j=0; j<n2; j++)
+            mind2 = MIN(mind2, distsq(edge1 + 3*i, edge2 + 3*j, 3));
+    return (sqrt(mind2) > 2*r);
+}
+
+// the nearest blocks of the same color.
+static const int same_dx[] = { 2, 0, 2, 2 };
+static const int same_dy[] = { 0, 2, 2, -2 };
+
+static int compare_int64s(const void* v1, const void* v2) {
+    int64_t i1 = *(const int64_t*)v1;
+    int64_t i2 = *(const int64_t*)v2;
+    return (i1 < i2) ? -1 : ((i1 > i2) ? 1 : 0);
+}
+
+// Are blocks of size B far enough apart that cells in different blocks of
+// the same color never search the same stars?  With a try-list, only the
+// blocks holding cells in it matter.
+static anbool blocksize_ok(hpquads_t* me, int B, hpint Nhptotry, hpl* hptotry) {
+    int nb = (me->Nside + B - 1) / B;
+    double* edge1;
+    double* edge2;
+    anbool ok = TRUE;
+    int bighp, bx, by, k, x0, x1, y0, y1;
+
+    if (nb < 3)
+        // no two blocks of the same color.
+        return TRUE;
+    edge1 = malloc(4 * B * 3 * sizeof(double));
+    edge2 = malloc(4 * B * 3 * sizeof(double));
+
+    if (hptotry) {
+        int64_t* keys = malloc(Nhptotry * sizeof(int64_t));
+        hpint i, n = 0;
+        for (i=0; i<Nhptotry; i++) {
+            int x, y;
+            healpix_decompose_xyl(hpl_get(hptotry, i), &bighp, &x, &y, me->Nside);
+            keys[i] = ((int64_t)bighp * nb + y / B) * nb + x / B;
+        }
+        qsort(keys, Nhptotry, sizeof(int64_t), compare_int64s);
+        for (i=0; i<Nhptotry; i++)
+            if (!n || keys[i] != keys[n-1])
+                keys[n++] = keys[i];
+        for (i=0; ok && i<n; i++) {
+            double c1[3], c2[3], r1;
+            bighp = keys[i] / ((int64_t)nb * nb);
+            by = (keys[i] / nb) % nb;
+            bx = keys[i] % nb;
+            block_bounds(me, B, bx, by, &x0, &x1, &y0, &y1);
+            r1 = block_circle(me, bighp, x0, x1, y0, y1, c1);
+            for (k=0; k<4; k++) {
+                int ox = bx + same_dx[k], oy = by + same_dy[k];
+                int64_t okey = ((int64_t)bighp * nb + oy) * nb + ox;
+                double r2;
+                if (ox >= nb || oy < 0 || oy >= nb ||
+                    !bsearch(&okey, keys, n, sizeof(int64_t), compare_int64s))
+                    continue;
+                block_bounds(me, B, ox, oy, &x0, &x1, &y0, &y1);
+                r2 = block_circle(me, bighp, x0, x1, y0, y1, c2);
+                if (!blocks_apart(me, B, bighp, bx, by, c1, r1, ox, oy, c2, r2,
+                                  edge1, edge2)) {
+                    ok = FALSE;
+                    break;
+                }
+            }
+        }
+        free(keys);
+    } else {
+        double* centers = malloc((size_t)nb * nb * 3 * sizeof(double));
+        double* radii = malloc((size_t)nb * nb * sizeof(double));
+        // The big healpixes are the same shape in each of the north,
+        // equator and south rows, so it's enough to look at one of each.
+        for (bighp=0; ok && bighp<12; bighp+=4) {
+            for (by=0; by<nb; by++)
+                for (bx=0; bx<nb; bx++) {
+                    block_bounds(me, B, bx, by, &x0, &x1, &y0, &y1);
+                    radii[by*nb + bx] = block_circle(me, bighp, x0, x1, y0, y1,
+                                                     centers + 3*(by*nb + bx));
+                }
+            for (by=0; ok && by<nb; by++)
+                for (bx=0; ok && bx<nb; bx++) {
+                    int a = by*nb + bx;
+                    for (k=0; k<4; k++) {
+                        int ox = bx + same_dx[k], oy = by + same_dy[k];
+                        int o = oy*nb + ox;
+                        if (ox >= nb || oy < 0 || oy >= nb)
+                            continue;
+                        if (!blocks_apart(me, B, bighp, bx, by, centers + 3*a, radii[a],
+                                          ox, oy, centers + 3*o, radii[o],
+                                          edge1, edge2)) {
+                            ok = FALSE;
+                            break;
+                        }
+                    }
+                }
+        }
+        free(centers);
+        free(radii);
+    }
+    debug("Block size %i: %s\n", B, ok ? "ok" : "too small");
+    free(edge1);
+    free(edge2);
+    return ok;
+}
+
+static int compare_entries(const void* v1, const void* v2) {
+    const struct hpentry* e1 = v1;
+    const struct hpentry* e2 = v2;
+    if (e1->key != e2->key)
+        return (e1->key < e2->key) ? -1 : 1;
+    // keep the try-list order within a block.
+    if (e1->pos != e2->pos)
+        return (e1->pos < e2->pos) ? -1 : 1;
+    return 0;
+}
+
+static int build_quads_parallel(hpquads_t* me, hpint Nhptotry, hpl* hptotry,
+                                int R) {
+    int B = me->blocksize;
+    int nb = (me->Nside + B - 1) / B;
+    struct hpentry* entries = NULL;
+    struct hpblock* blocks;
+    int nthispass = 0;
+    int bighp, color, nblocks, b, j;
+    hpint i, ndone = 0;
+    hpint lastgrass = 0;
+
+    if (hptotry) {
+        // sort the cells by (big healpix, color, block).
+        entries = malloc(Nhptotry * sizeof(struct hpentry));
+        for (i=0; i<Nhptotry; i++) {
+            int x, y, bx, by;
+            hpint hp = hpl_get(hptotry, i);
+            healpix_decompose_xyl(hp, &bighp, &x, &y, me->Nside);
+            bx = x / B;
+            by = y / B;
+            color = (bx & 1) | ((by & 1) << 1);
+            entries[i].key = (((int64_t)bighp * 4 + color) * nb + by) * nb + bx;
+            entries[i].pos = i;
+            entries[i].hp = hp;
+        }
+        qsort(entries, Nhptotry, sizeof(struct hpentry), compare_entries);
+    }
+
+    blocks = malloc((size_t)((nb + 1) / 2) * ((nb + 1) / 2) * sizeof(struct hpblock));
+    i = 0;
+    for (bighp=0; bighp<12; bighp++) {
+        for (color=0; color<4; color++) {
+            // gather this step's blocks.
+            nblocks = 0;
+            if (entries) {
+                int64_t step = (int64_t)bighp * 4 + color;
+                while (i < Nhptotry && entries[i].key / ((int64_t)nb * nb) == step) {
+                    hpint i0 = i;
+                    while (i < Nhptotry && entries[i].key == entries[i0].key)
+                        i++;
+                    memset(blocks + nblocks, 0, sizeof(struct hpblock));
+                    blocks[nblocks].i0 = i0;
+                    blocks[nblocks].i1 = i;
+                    nblocks++;
+                }
+            } else {
+                int bx, by;
+                for (by=(color >> 1); by<nb; by+=2)
+                    for (bx=(color & 1); bx<nb; bx+=2) {
+                        struct hpblock* blk = blocks + nblocks;
+                        memset(blk, 0, sizeof(struct hpblock));
+                        blk->bighp = bighp;
+                        blk->x0 = bx * B;
+                        blk->x1 = MIN((int)me->Nside, (bx+1) * B);
+                        blk->y0 = by * B;
+                        blk->y1 = MIN((int)me->Nside, (by+1) * B);
+                        nblocks++;
+                    }
+            }
+            if (!nblocks)
+                continue;
+            for (b=0; b<nblocks; b++) {
+                blocks[b].quads = bl_new(256, bl_datasize(me->quadlist));
+                if (me->retryhps)
+                    blocks[b].retry = hpl_new(256);
+            }
+
+            run_blocks(me, blocks, nblocks, entries, R);
+
+            for (b=0; b<nblocks; b++) {
+                struct hpblock* blk = blocks + b;
+                for (j=0; j<bl_size(blk->quads); j++)
+                    bl_append(me->quadlist, bl_access(blk->quads, j));
+                if (blk->retry)
+                    for (j=0; j<hpl_size(blk->retry); j++)
+                        hpl_append(me->retryhps, hpl_get(blk->retry, j));
+                nthispass += blk->nmade;
+                ndone += entries ? (blk->i1 - blk->i0) :
+                    (hpint)(blk->x1 - blk->x0) * (blk->y1 - blk->y0);
+                bl_free(blk->quads);
+                if (blk->retry)
+                    hpl_free(blk->retry);
+            }
+            while (lastgrass < ndone * 80 / Nhptotry) {
+                printf(".");
+                lastgrass++;
+            }
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+    free(blocks);
+    free(entries);
+    return nthispass;
+}
+
 static int build_quads(hpquads_t* me, hpint Nhptotry, hpl* hptotry, int R) {
     int nthispass = 0;
     hpint lastgrass = 0;
     hpint i;
 
+    if (me->blocksize)
+        return build_quads_parallel(me, Nhptotry, hptotry, R);
+
     for (i=0; i<Nhptotry; i++) {
-        anbool ok;
         hpint hp;
         if ((i * 80 / Nhptotry) != lastgrass) {
             printf(".");
@@ -293,47 +720,34 @@ static int build_quads(hpquads_t* me, hpint Nhptotry, hpl* hptotry, int R) {
             hp = hpl_get(hptotry, i);
         else
             hp = i;
-        logverb("Trying healpix %lli\n", hp);
-        me->hp = hp;
-        me->quad_created = FALSE;
-        ok = find_stars(me, me->radius2, R);
-        if (ok)
-            create_quad(me, TRUE);
-
-        if (me->quad_created)
+        if (try_healpix(me, hp, R))
             nthispass++;
-        else {
-            if (R && me->Nstars && me->retryhps)
-                // there were some stars, and we're counting how many times stars are used.
-                //il_insert_unique_ascending(me->retryhps, hp);
-                // we don't mind hps showing up multiple times because we want to make up for the lost
-                // passes during loosening...
-                hpl_append(me->retryhps, hp);
-            // FIXME -- could also track which hps are worth visiting in a future pass
-        }
     }
     printf("\n");
     return nthispass;
 }
 
-int hpquads(startree_t* starkd,
-            codefile_t* codes,
-            quadfile_t* quads,
-            int Nside_int,
-            double scale_min_arcmin,
-            double scale_max_arcmin,
-            int dimquads,
-            int passes,
-            int Nreuses,
-            int Nloosen,
-            int id,
-            anbool scanoccupied,
-
-            void* sort_data,
-            int (*sort_func)(const void*, const void*),
-            int sort_size,
-			
-            char** args, int argc) {
+static int hpquads_run(startree_t* starkd,
+                       codefile_t* codes,
+                       quadfile_t* quads,
+                       int Nside_int,
+                       double scale_min_arcmin,
+                       double scale_max_arcmin,
+                       int dimquads,
+                       int passes,
+                       int Nreuses,
+                       int Nloosen,
+                       int id,
+                       anbool scanoccupied,
+                       int nthreads,
+                       const int64_t* cells, int ncells,
+                       const unsigned int* keep, int nkeep,
+
+                       void* sort_data,
+                       int (*sort_func)(const void*, const void*),
+                       int sort_size,
+
+                       char** args, int argc) {
     hpquads_t myhpquads;
     hpquads_t* me = &myhpquads;
 
@@ -343,7 +757,6 @@ int hpquads(startree_t* starkd,
     double radius2;
     hpl* hptotry;
     hpint Nhptotry = 0;
-    int nquads;
     double hprad;
     double quadscale;
 
@@ -406,7 +819,7 @@ int hpquads(startree_t* starkd,
         return -1;
     }
 
-    if (!scanoccupied && (N*(skhp == -1 ? 1 : sknside*sknside*12) < NHP)) {
+    if (!cells && !scanoccupied && (N*(skhp == -1 ? 1 : sknside*sknside*12) < NHP)) {
         logmsg("\n\n");
         logmsg("NOTE, your star kdtree is sparse (has only a fraction of the stars expected)\n");
         logmsg("  so you probably will get much faster results by setting the \"-E\" command-line\n");
@@ -448,6 +861,27 @@ int hpquads(startree_t* starkd,
 	
     me->nuses = calloc(N, sizeof(unsigned char));
 
+    if (nkeep) {
+        // the kept quads count toward their stars' reuse limits, and the
+        // new quads must not duplicate them.
+        logmsg("Keeping %i quads.\n", nkeep);
+        me->bigquadlist = oset_new(quadsize, compare_quads, &me->dimquads);
+        for (i=0; i<nkeep; i++) {
+            const unsigned int* q = keep + (size_t)i * dimquads;
+            int d;
+            for (d=0; d<dimquads; d++) {
+                if (q[d] >= N) {
+                    ERROR("Kept quad %i refers to star %u, but there are only %i stars",
+                          i, q[d], N);
+                    return -1;
+                }
+                if (me->nuses[q[d]] < 255)
+                    me->nuses[q[d]]++;
+            }
+            oset_insert(me->bigquadlist, q, FALSE);
+        }
+    }
+
     // hprad = sqrt(2) * (healpix side length / 2.)
     hprad = arcmin2dist(healpix_side_length_arcmin(Nside)) * M_SQRT1_2;
     quadscale = 0.5 * sqrt(me->quad_dist2_upper);
@@ -460,9 +894,18 @@ int hpquads(startree_t* starkd,
            distsq2arcsec(quadscale*quadscale),
            distsq2arcsec(radius2));
 
+
     hptotry = hpl_new(1024);
 
-    if (scanoccupied) {
+    if (cells) {
+        for (i=0; i<ncells; i++)
+            hpl_append(hptotry, cells[i]);
+        logmsg("Will check %i healpixes.\n", ncells);
+
+    } else if (scanoccupied) {
+        oset* occupied = oset_new_int64();
+        oset_iter it;
+        const int64_t* hp;
         logmsg("Scanning %i input stars...\n", N);
         for (i=0; i<N; i++) {
             double xyz[3];
@@ -472,7 +915,7 @@ int hpquads(startree_t* starkd,
                 return -1;
             }
             j = xyzarrtohealpixl(xyz, Nside);
-            hpl_insert_unique_ascending(hptotry, j);
+            oset_insert_int64(occupied, j, TRUE);
             if (log_get_level() > LOG_VERB) {
                 double ra,dec;
                 if (startree_get_radec(me->starkd, i, &ra, &dec)) {
@@ -483,6 +926,10 @@ int hpquads(startree_t* starkd,
                          i, ra, dec, xyz[0], xyz[1], xyz[2], j);
             }
         }
+        oset_iter_init(occupied, &it);
+        while ((hp = oset_iter_next(&it)))
+            hpl_append(hptotry, *hp);
+        oset_free(occupied);
         logmsg("Will check %zu healpixes.\n", hpl_size(hptotry));
         if (log_get_level() > LOG_VERB) {
             logdebug("Checking healpixes: [ ");
@@ -523,6 +970,22 @@ int hpquads(startree_t* starkd,
     }
     if (hptotry)
         Nhptotry = hpl_size(hptotry);
+    if (nthreads) {
+        int B;
+        if (nthreads < 0)
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        me->nthreads = MAX(1, nthreads);
+        // the smallest blocks whose cells' searches don't reach the
+        // next block of the same color; they only depend on the
+        // geometry, so the quads don't depend on the number of threads.
+        B = MAX(1, (int)ceil(2.0 * sqrt(radius2) /
+                             arcmin2dist(healpix_side_length_arcmin(Nside))));
+        while (B < Nside && !blocksize_ok(me, B, Nhptotry, hptotry))
+            B += 1 + B/8;
+        me->blocksize = MIN(B, (int)Nside);
+        logmsg("Building quads on %i threads, in blocks of %i x %i healpixes.\n",
+               me->nthreads, me->blocksize, me->blocksize);
+    }
 
     me->quadlist = bl_new(65536, quadsize);
 
@@ -539,7 +1002,7 @@ int hpquads(startree_t* starkd,
         nthispass = build_quads(me, Nhptotry, hptotry, Nreuses);
 
         logmsg("Made %i quads (out of %lli healpixes) this pass.\n", nthispass, Nhptotry);
-        logmsg("Made %i quads so far.\n", (me->bigquadlist ? bt_size(me->bigquadlist) : 0) + (int)bl_size(me->quadlist));
+        logmsg("Made %i quads so far.\n", (me->bigquadlist ? (int)oset_size(me->bigquadlist) : 0) + (int)bl_size(me->quadlist));
 
         sprintf(key, "PASS%i", pass+1);
         fits_header_mod_int(chdr, key, nthispass, "quads created in this pass");
@@ -547,10 +1010,10 @@ int hpquads(startree_t* starkd,
 
         logmsg("Merging quads...\n");
         if (!me->bigquadlist)
-            me->bigquadlist = bt_new(quadsize, 256);
+            me->bigquadlist = oset_new(quadsize, compare_quads, &me->dimquads);
         for (i=0; i<bl_size(me->quadlist); i++) {
             void* q = bl_access(me->quadlist, i);
-            bt_insert2(me->bigquadlist, q, FALSE, compare_quads, &me->dimquads);
+            oset_insert(me->bigquadlist, q, FALSE);
         }
         bl_remove_all(me->quadlist);
     }
@@ -576,7 +1039,7 @@ int hpquads(startree_t* starkd,
             hpl_free(trylist);
             for (i=0; i<bl_size(me->quadlist); i++) {
                 void* q = bl_access(me->quadlist, i);
-                bt_insert2(me->bigquadlist, q, FALSE, compare_quads, &me->dimquads);
+                oset_insert(me->bigquadlist, q, FALSE);
             }
             bl_remove_all(me->quadlist);
         }
@@ -593,16 +1056,31 @@ int hpquads(startree_t* starkd,
 
     logmsg("Writing quads...\n");
 
-    // add the quads from the big-quadlist
-    nquads = bt_size(me->bigquadlist);
-    for (i=0; i<nquads; i++) {
-        unsigned int* q = bt_access(me->bigquadlist, i);
-        quad_write(codes, quads, q, me->starkd, me->dimquads, dimcodes);
-    }
-    // add the quads that were made during the final round.
-    for (i=0; i<bl_size(me->quadlist); i++) {
-        unsigned int* q = bl_access(me->quadlist, i);
-        quad_write(codes, quads, q, me->starkd, me->dimquads, dimcodes);
+    // add the quads from the big-quadlist, then the quads that were made
+    // during the final round.
+    {
+        struct quad_batch qb;
+        qb.codes = codes;
+        qb.quads = quads;
+        qb.starkd = me->starkd;
+        qb.dimquads = me->dimquads;
+        qb.dimcodes = dimcodes;
+        qb.n = 0;
+        qb.failed = FALSE;
+        if (me->bigquadlist) {
+            oset_iter it;
+            const unsigned int* q;
+            oset_iter_init(me->bigquadlist, &it);
+            while ((q = oset_iter_next(&it)))
+                batch_write_quad(&qb, q);
+        }
+        for (i=0; i<bl_size(me->quadlist); i++)
+            batch_write_quad(&qb, bl_access(me->quadlist, i));
+        batch_flush(&qb);
+        if (qb.failed) {
+            ERROR("Failed to write quads");
+            return -1;
+        }
     }
 
     // fix output file headers.
@@ -616,13 +1094,66 @@ int hpquads(startree_t* starkd,
     }
 
     bl_free(me->quadlist);
-    bt_free(me->bigquadlist);
+    oset_free(me->bigquadlist);
 
     toc();
     logmsg("Done.\n");
     return 0;
 }
 
+int hpquads(startree_t* starkd,
+            codefile_t* codes,
+            quadfile_t* quads,
+            int Nside,
+            double scale_min_arcmin,
+            double scale_max_arcmin,
+            int dimquads,
+            int passes,
+            int Nreuses,
+            int Nloosen,
+            int id,
+            anbool scanoccupied,
+            int nthreads,
+
+            void* sort_data,
+            int (*sort_func)(const void*, const void*),
+            int sort_size,
+
+            char** args, int argc) {
+    return hpquads_run(starkd, codes, quads, Nside,
+                       scale_min_arcmin, scale_max_arcmin,
+                       dimquads, passes, Nreuses, Nloosen, id,
+                       scanoccupied, nthreads, NULL, 0, NULL, 0,
+                       sort_data, sort_func, sort_size, args, argc);
+}
+
+int hpquads_update(startree_t* starkd,
+                   codefile_t* codes,
+                   quadfile_t* quads,
+                   int Nside,
+                   double scale_min_arcmin,
+                   double scale_max_arcmin,
+                   int dimquads,
+                   int passes,
+                   int Nreuses,
+                   int Nloosen,
+                   int id,
+                   int nthreads,
+                   const int64_t* cells, int ncells,
+                   const unsigned int* keep, int nkeep,
+
+                   void* sort_data,
+                   int (*sort_func)(const void*, const void*),
+                   int sort_size,
+
+                   char** args, int argc) {
+    return hpquads_run(starkd, codes, quads, Nside,
+                       scale_min_arcmin, scale_max_arcmin,
+                       dimquads, passes, Nreuses, Nloosen, id,
+                       FALSE, nthreads, cells, ncells, keep, nkeep,
+                       sort_data, sort_func, sort_size, args, argc);
+}
+
 int hpquads_files(const char* skdtfn,
                   const char* codefn,
                   const char* quadfn,
@@ -635,6 +1166,7 @@ int hpquads_files(const char* skdtfn,
                   int Nloosen,
                   int id,
                   anbool scanoccupied,
+                  int nthreads,
 
                   void* sort_data,
                   int (*sort_func)(const void*, const void*),
@@ -668,7 +1200,7 @@ int hpquads_files(const char* skdtfn,
     rtn = hpquads(starkd, codes, quads, Nside,
                   scale_min_arcmin, scale_max_arcmin,
                   dimquads, passes, Nreuses, Nloosen, id,
-                  scanoccupied, 
+                  scanoccupied, nthreads,
                   sort_data, sort_func, sort_size,
                   args, argc);
     if (rtn)
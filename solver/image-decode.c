@@ -0,0 +1,295 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#if HAVE_PNG
+#include <png.h>
+#endif
+#if HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "os-features.h"
+#include "image-decode.h"
+#include "anqfits.h"
+#include "qfits_image.h"
+#include "errors.h"
+#include "log.h"
+
+// ppmtopgm's luminance.
+static unsigned char rgb_to_grey(int r, int g, int b) {
+    return (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b + 0.5);
+}
+
+static int decode_fits(const char* fn, int ext, decoded_image_t* img) {
+    anqfits_t* anq;
+    const anqfits_image_t* info;
+    float* pix;
+    int W, H;
+    int rtn = -1;
+
+    anq = anqfits_open_hdu(fn, ext);
+    if (!anq)
+        return -1;
+    if (ext >= anqfits_n_ext(anq))
+        goto bailout;
+    info = anqfits_get_image_const(anq, ext);
+    if (!info || info->naxis < 2 || info->width <= 0 || info->height <= 0)
+        goto bailout;
+    // image2pnm unpacks these into a different extension of a temp file.
+    if (info->tilecomp)
+        goto bailout;
+    if (info->naxis > 2)
+        logmsg("This looks like a multi-color image: processing the first image plane only.  (NAXIS=%i)\n", info->naxis);
+
+    pix = anqfits_readpix(anq, ext, 0, 0, 0, 0, 0, PTYPE_FLOAT, NULL, &W, &H);
+    if (!pix) {
+        ERROR("Failed to read pixels from FITS image %s ext %i", fn, ext);
+        goto bailout;
+    }
+    img->W = W;
+    img->H = H;
+    img->isfits = TRUE;
+    if (info->bitpix == 8) {
+        size_t i, N = (size_t)W * (size_t)H;
+        img->image_u8 = malloc(N);
+        if (!img->image_u8) {
+            SYSERROR("Failed to allocate u8 image array");
+            free(pix);
+            goto bailout;
+        }
+        for (i=0; i<N; i++)
+            img->image_u8[i] = (unsigned char)pix[i];
+        free(pix);
+    } else
+        img->image = pix;
+    rtn = 0;
+ bailout:
+    anqfits_close(anq);
+    return rtn;
+}
+
+#if HAVE_PNG
+static void png_error_fn(png_structp ping, png_const_charp msg) {
+    ERROR("PNG error: %s", msg);
+    png_longjmp(ping, 1);
+}
+
+static void png_warning_fn(png_structp ping, png_const_charp msg) {
+    logverb("PNG warning: %s\n", msg);
+}
+
+static int decode_png(FILE* fid, decoded_image_t* img) {
+    png_structp ping;
+    png_infop info;
+    png_uint_32 W, H;
+    int bitdepth, color_type, interlace;
+    int nchan, bpc;
+    unsigned char* volatile buf = NULL;
+    png_bytepp volatile rows = NULL;
+    size_t i, j, N;
+
+    ping = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                  png_error_fn, png_warning_fn);
+    if (!ping)
+        return -1;
+    info = png_create_info_struct(ping);
+    if (!info) {
+        png_destroy_read_struct(&ping, NULL, NULL);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(ping))) {
+        png_destroy_read_struct(&ping, &info, NULL);
+        free(rows);
+        free(buf);
+        return -1;
+    }
+    png_init_io(ping, fid);
+    png_read_info(ping, info);
+    png_get_IHDR(ping, info, &W, &H, &bitdepth, &color_type,
+                 &interlace, NULL, NULL);
+
+    // Like pngtopnm: expand palettes and packed pixels, drop alpha.
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(ping);
+    if (bitdepth < 8)
+        png_set_expand(ping);
+    if (color_type & PNG_COLOR_MASK_ALPHA)
+        png_set_strip_alpha(ping);
+    if (interlace != PNG_INTERLACE_NONE)
+        png_set_interlace_handling(ping);
+    png_read_update_info(ping, info);
+
+    nchan = png_get_channels(ping, info);
+    bpc = (png_get_bit_depth(ping, info) == 16) ? 2 : 1;
+    buf = malloc((size_t)W * H * nchan * bpc);
+    rows = malloc(H * sizeof(png_bytep));
+    if (!buf || !rows) {
+        SYSERROR("Failed to allocate PNG image buffer");
+        png_longjmp(ping, 1);
+    }
+    for (j=0; j<H; j++)
+        rows[j] = buf + j * W * nchan * bpc;
+    png_read_image(ping, rows);
+    png_read_end(ping, NULL);
+    png_destroy_read_struct(&ping, &info, NULL);
+    free(rows);
+
+    N = (size_t)W * H;
+    img->W = W;
+    img->H = H;
+    if (bpc == 1) {
+        if (nchan == 1) {
+            img->image_u8 = buf;
+            return 0;
+        }
+        img->image_u8 = malloc(N);
+        if (!img->image_u8) {
+            SYSERROR("Failed to allocate u8 image array");
+            free(buf);
+            return -1;
+        }
+        for (i=0; i<N; i++)
+            img->image_u8[i] = rgb_to_grey(buf[3*i], buf[3*i+1], buf[3*i+2]);
+    } else {
+        // 16-bit samples, big-endian.
+        img->image = malloc(N * sizeof(float));
+        if (!img->image) {
+            SYSERROR("Failed to allocate image array");
+            free(buf);
+            return -1;
+        }
+        for (i=0; i<N; i++) {
+            unsigned char* p = buf + i * nchan * 2;
+            if (nchan == 1)
+                img->image[i] = (p[0] << 8) | p[1];
+            else
+                img->image[i] = (int)(0.299 * ((p[0] << 8) | p[1]) +
+                                      0.587 * ((p[2] << 8) | p[3]) +
+                                      0.114 * ((p[4] << 8) | p[5]) + 0.5);
+        }
+    }
+    free(buf);
+    return 0;
+}
+#endif
+
+#if HAVE_JPEG
+struct jpeg_error_jmp {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+static void jpeg_error_fn(j_common_ptr cinfo) {
+    struct jpeg_error_jmp* err = (struct jpeg_error_jmp*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    ERROR("JPEG error: %s", msg);
+    longjmp(err->jmp, 1);
+}
+
+static int decode_jpeg(FILE* fid, decoded_image_t* img) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_jmp jerr;
+    JSAMPLE* volatile row = NULL;
+    unsigned char* volatile out = NULL;
+    int W, H, nchan;
+    int i, j;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_fn;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(row);
+        free(out);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fid);
+    jpeg_read_header(&cinfo, TRUE);
+    // djpeg (used by image2pnm) writes grey images as PGM, others as PPM.
+    if (cinfo.jpeg_color_space != JCS_GRAYSCALE)
+        cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    W = cinfo.output_width;
+    H = cinfo.output_height;
+    nchan = cinfo.output_components;
+    row = malloc((size_t)W * nchan);
+    out = malloc((size_t)W * H);
+    if (!row || !out) {
+        SYSERROR("Failed to allocate JPEG image buffer");
+        longjmp(jerr.jmp, 1);
+    }
+    for (j=0; j<H; j++) {
+        JSAMPLE* r = row;
+        unsigned char* o = out + (size_t)j * W;
+        jpeg_read_scanlines(&cinfo, &r, 1);
+        if (nchan == 1)
+            memcpy(o, r, W);
+        else
+            for (i=0; i<W; i++)
+                o[i] = rgb_to_grey(r[3*i], r[3*i+1], r[3*i+2]);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+
+    img->W = W;
+    img->H = H;
+    img->image_u8 = out;
+    return 0;
+}
+#endif
+
+int image_decode(const char* fn, int ext, decoded_image_t* img) {
+    unsigned char magic[8];
+    FILE* fid;
+    int rtn = -1;
+
+    memset(img, 0, sizeof(decoded_image_t));
+    fid = fopen(fn, "rb");
+    if (!fid) {
+        SYSERROR("Failed to open image file %s", fn);
+        return -1;
+    }
+    if (fread(magic, 1, sizeof(magic), fid) != sizeof(magic)) {
+        fclose(fid);
+        return -1;
+    }
+
+    if (memcmp(magic, "SIMPLE  ", 8) == 0) {
+        fclose(fid);
+        return decode_fits(fn, ext, img);
+    }
+    if (memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+#if HAVE_PNG
+        rewind(fid);
+        rtn = decode_png(fid, img);
+#else
+        logverb("Not built with libpng; can't decode %s in memory\n", fn);
+#endif
+    } else if (magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff) {
+#if HAVE_JPEG
+        rewind(fid);
+        rtn = decode_jpeg(fid, img);
+#else
+        logverb("Not built with libjpeg; can't decode %s in memory\n", fn);
+#endif
+    }
+    fclose(fid);
+    if (rtn)
+        image_decode_free_contents(img);
+    return rtn;
+}
+
+void image_decode_free_contents(decoded_image_t* img) {
+    free(img->image);
+    img->image = NULL;
+    free(img->image_u8);
+    img->image_u8 = NULL;
+}
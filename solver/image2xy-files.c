@@ -21,6 +21,27 @@
 #include "log.h"
 #include "cfitsutils.h"
 
+struct row_reader {
+    fitsfile* fptr;
+    long* fpixel;
+    long W;
+};
+
+// simplexy_read_rows_func for streaming an image HDU.
+static int read_rows(void* token, int y0, int nrows, float* rows) {
+    struct row_reader* r = token;
+    int status = 0;
+    r->fpixel[0] = 1;
+    r->fpixel[1] = y0 + 1;
+    fits_read_pix(r->fptr, TFLOAT, r->fpixel, r->W * nrows, NULL, rows, NULL,
+                  &status);
+    if (status) {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+    return 0;
+}
+
 int image2xy_files(const char* infn, const char* outfn,
                    anbool do_u8, int downsample, int downsample_as_required,
                    int extension, int plane,
@@ -142,36 +163,60 @@ int image2xy_files(const char* infn, const char* outfn,
         else if (naxis > 2)
             logmsg("This looks like a multi-color image: processing the first image plane only.  (NAXIS=%i)\n", naxis);
 		
-        if (bitpix == 8 && do_u8 && !downsample) {
-            simplexy_fill_in_defaults_u8(params);
-
-            // u8 image.
-            params->image_u8 = malloc(naxisn[0] * naxisn[1]);
-            if (!params->image_u8) {
-                SYSERROR("Failed to allocate u8 image array");
+        if (params->bandrows > 0 && !downsample) {
+            // read the image a band at a time.
+            struct row_reader reader;
+            int jj;
+            simplexy_fill_in_defaults(params);
+            params->nx = naxisn[0];
+            params->ny = naxisn[1];
+            reader.fptr = fptr;
+            reader.fpixel = fpixel;
+            reader.W = naxisn[0];
+            if (simplexy_run_streaming(params, read_rows, &reader) == -1) {
+                ERROR("Failed to read image pixels");
+                free(fpixel);
                 goto bailout;
             }
-            fits_read_pix(fptr, TBYTE, fpixel, naxisn[0]*naxisn[1], NULL,
-                          params->image_u8, NULL, &status);
-
+            free(fpixel);
+            // FITS convention: center of the lower-left pixel is (1,1).
+            for (jj=0; jj<params->npeaks; jj++) {
+                params->x[jj] += 1.0;
+                params->y[jj] += 1.0;
+            }
         } else {
-            simplexy_fill_in_defaults(params);
-
-            params->image = malloc(naxisn[0] * naxisn[1] * sizeof(float));
-            if (!params->image) {
-                SYSERROR("Failed to allocate image array");
-                goto bailout;
+            // (the OpenCL steps take float images.)
+            if (bitpix == 8 && do_u8 && !downsample && !params->gpu) {
+                simplexy_fill_in_defaults_u8(params);
+
+                // u8 image.
+                params->image_u8 = malloc(naxisn[0] * naxisn[1]);
+                if (!params->image_u8) {
+                    SYSERROR("Failed to allocate u8 image array");
+                    goto bailout;
+                }
+                fits_read_pix(fptr, TBYTE, fpixel, naxisn[0]*naxisn[1], NULL,
+                              params->image_u8, NULL, &status);
+
+            } else {
+                simplexy_fill_in_defaults(params);
+
+                params->image = malloc(naxisn[0] * naxisn[1] * sizeof(float));
+                if (!params->image) {
+                    SYSERROR("Failed to allocate image array");
+                    goto bailout;
+                }
+                fits_read_pix(fptr, TFLOAT, fpixel, naxisn[0]*naxisn[1], NULL,
+                              params->image, NULL, &status);
             }
-            fits_read_pix(fptr, TFLOAT, fpixel, naxisn[0]*naxisn[1], NULL,
-                          params->image, NULL, &status);
-        }
-        free(fpixel);
-        CFITS_CHECK("Failed to read image pixels");
+            free(fpixel);
+            CFITS_CHECK("Failed to read image pixels");
 
-        params->nx = naxisn[0];
-        params->ny = naxisn[1];
+            params->nx = naxisn[0];
+            params->ny = naxisn[1];
 
-        image2xy_run(params, downsample, downsample_as_required);
+            image2xy_run(params, downsample, downsample_as_required);
+        }
 
         if (params->Lorder)
             ncols = 6;
@@ -16,7 +16,7 @@
 #include "errors.h"
 #include "ioutils.h"
 
-static const char* OPTIONS = "hi:Oo:8Hd:D:ve:B:S:M:s:p:P:bU:g:C:m:a:G:w:L:";
+static const char* OPTIONS = "hi:Oo:8Hd:D:ve:B:S:M:s:p:P:bU:g:C:m:a:G:w:L:t:T:r:n:lA";
 
 static void printHelp() {
     fprintf(stderr,
@@ -42,6 +42,12 @@ static void printHelp() {
             "   [-b]: don't do (median-based) background subtraction\n"
             "   [-G <background>]: subtract this 'global' background value; implies -b\n"
             "   [-m]: set maximum extended object size for deblending (default %i pixels)\n"
+            "   [-t <tile size>]: process large images in tiles of about this many pixels square, in parallel\n"
+            "   [-T <threads>]: with -t, number of threads to use (default: one per CPU)\n"
+            "   [-l]: with -t, measure the noise level in each tile (for images whose noise varies)\n"
+            "   [-n <samples>]: number of points at which to sample the noise (default: one every 20 pixels)\n"
+            "   [-r <rows>]: read the image in bands of this many rows, to bound memory use on huge images (not with -d/-H)\n"
+            "   [-A]: do the background, smoothing and masking on a GPU (OpenCL device), if there is one\n"
             "\n"
             "   [-S <background-subtracted image>]: save background-subtracted image to this filename (FITS float image)\n"
             "   [-B <background image>]: save background image to filename\n"
@@ -82,6 +88,24 @@ int main(int argc, char *argv[]) {
 
     while ((argchar = getopt (argc, argv, OPTIONS)) != -1) {
         switch (argchar) {
+        case 'A':
+            params->gpu = TRUE;
+            break;
+        case 'r':
+            params->bandrows = atoi(optarg);
+            break;
+        case 'l':
+            params->tilesigma = TRUE;
+            break;
+        case 'n':
+            params->sigmasamples = atoi(optarg);
+            break;
+        case 't':
+            params->tilesize = atoi(optarg);
+            break;
+        case 'T':
+            params->nthreads = atoi(optarg);
+            break;
         case 'L':
             params->Lorder = atoi(optarg);
             break;
@@ -0,0 +1,370 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Summarizes index heatmaps (see index-heatmap.h: astrometry-engine's
+ "index_heatmap" setting), and turns them into hot lists for the
+ prefetcher and node-order hints for the kd-tree layout.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "index-heatmap.h"
+#include "ioutils.h"
+#include "boilerplate.h"
+#include "errors.h"
+#include "log.h"
+
+static const char* OPTIONS = "hvp:Pf:g:n:";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <heatmap> [<heatmap> ...]\n"
+           "    [-f <fraction>]: the hot list holds the blocks that get this\n"
+           "                     fraction of the accesses (default 0.9)\n"
+           "    [-p <hot-list>]: write the hot list of the (one) heatmap to\n"
+           "                     this file\n"
+           "    [-P]: write each heatmap's hot list beside its index file, as\n"
+           "          \"<index file>.hot\", where the prefetcher looks for it\n"
+           "    [-g <bytes>]: join hot ranges less than this far apart\n"
+           "                  (default 65536)\n"
+           "    [-n <hints>]: write the kd-tree nodes of the (one) heatmap,\n"
+           "                  hottest first, to this file\n"
+           "    [-v]: +verbose\n"
+           "\n", progname);
+}
+
+#define PAGE 4096
+
+typedef struct {
+    uint64_t count;
+    int64_t block;
+} heat_t;
+
+static int compare_heat_desc(const void* v1, const void* v2) {
+    const heat_t* h1 = v1;
+    const heat_t* h2 = v2;
+    if (h1->count > h2->count) return -1;
+    if (h1->count < h2->count) return 1;
+    if (h1->block < h2->block) return -1;
+    if (h1->block > h2->block) return 1;
+    return 0;
+}
+
+static int compare_range(const void* v1, const void* v2) {
+    const int64_t* r1 = v1;
+    const int64_t* r2 = v2;
+    if (r1[0] < r2[0]) return -1;
+    if (r1[0] > r2[0]) return 1;
+    return 0;
+}
+
+// The non-zero blocks of array "a" (counts[a][lo..hi)), hottest first.
+static heat_t* hot_blocks(const index_heatmap_file_t* hf, int a, int64_t lo,
+                          int64_t hi, int64_t* pn, uint64_t* ptotal) {
+    heat_t* h = malloc(MAX(1, hi - lo) * sizeof(heat_t));
+    int64_t b, n = 0;
+    uint64_t total = 0;
+    for (b=lo; b<hi; b++) {
+        if (!hf->counts[a][b])
+            continue;
+        h[n].count = hf->counts[a][b];
+        h[n].block = b;
+        total += h[n].count;
+        n++;
+    }
+    qsort(h, n, sizeof(heat_t), compare_heat_desc);
+    *pn = n;
+    *ptotal = total;
+    return h;
+}
+
+// How many of the blocks "h" (hottest first) hold "fraction" of "total".
+static int64_t blocks_for(const heat_t* h, int64_t n, uint64_t total,
+                          double fraction) {
+    uint64_t sum = 0;
+    int64_t i;
+    for (i=0; i<n && sum < fraction * total; i++)
+        sum += h[i].count;
+    return i;
+}
+
+static void print_fractions(const heat_t* h, int64_t n, uint64_t total,
+                            int64_t nblocks) {
+    const double fractions[] = { 0.5, 0.9, 0.99 };
+    size_t k;
+    printf("    ");
+    for (k=0; k<sizeof(fractions)/sizeof(fractions[0]); k++) {
+        int64_t m = blocks_for(h, n, total, fractions[k]);
+        printf("%s%g%% of the accesses in %lld (%.2f%%)", k ? ", " : "",
+               100.0 * fractions[k], (long long)m,
+               100.0 * m / MAX(1, nblocks));
+    }
+    printf("\n");
+}
+
+static void report(const char* fn, const index_heatmap_file_t* hf) {
+    int a;
+    printf("%s: index %s, %llu accesses (1 in %i sampled)\n", fn,
+           hf->indexfn ? hf->indexfn : "?", (unsigned long long)hf->samples,
+           hf->rate);
+    for (a=INDEX_HEAT_QUADS; a<=INDEX_HEAT_STARS; a++) {
+        heat_t* h;
+        int64_t n;
+        uint64_t total;
+        h = hot_blocks(hf, a, 0, hf->nblocks[a], &n, &total);
+        printf("  %s: %lld records in %lld blocks of %i; %lld blocks touched "
+               "(%.2f%%)\n", index_heatmap_array_name(a),
+               (long long)hf->nrecords[a], (long long)hf->nblocks[a],
+               hf->perblock[a], (long long)n,
+               100.0 * n / MAX(1, hf->nblocks[a]));
+        if (n)
+            print_fractions(h, n, total, hf->nblocks[a]);
+        free(h);
+    }
+    for (a=INDEX_HEAT_CODEKD; a<=INDEX_HEAT_STARKD; a++) {
+        int64_t nnodes = hf->nblocks[a];
+        int64_t levelstart, full = 0, touched = 0, nleaves, b;
+        int level;
+        heat_t* h;
+        int64_t n;
+        uint64_t total;
+        // the levels of the tree in which every node was touched.
+        for (level=0, levelstart=0; levelstart < nnodes;
+             level++, levelstart = 2*levelstart + 1) {
+            int64_t end = MIN(nnodes, 2*levelstart + 1);
+            for (b=levelstart; b<end; b++)
+                if (!hf->counts[a][b])
+                    break;
+            if (b < end)
+                break;
+            full = level + 1;
+        }
+        for (b=0; b<nnodes; b++)
+            if (hf->counts[a][b])
+                touched++;
+        printf("  %s: %lld nodes, %lld touched (%.2f%%); every node touched "
+               "in the top %lld levels\n", index_heatmap_array_name(a),
+               (long long)nnodes, (long long)touched,
+               100.0 * touched / MAX(1, nnodes), (long long)full);
+        // the leaves are the last (nnodes+1)/2 nodes.
+        nleaves = (nnodes + 1) / 2;
+        h = hot_blocks(hf, a, nnodes - nleaves, nnodes, &n, &total);
+        if (n) {
+            printf("  %s leaves: %lld of %lld touched\n",
+                   index_heatmap_array_name(a), (long long)n,
+                   (long long)nleaves);
+            print_fractions(h, n, total, nleaves);
+        }
+        free(h);
+    }
+}
+
+/*
+ The hot list: the byte ranges (as (offset, bytes) pairs) of the quad
+ and star blocks that get "fraction" of the accesses, plus the kd-tree
+ node tables, rounded out to pages and joined when less than "gap"
+ apart.  Returns the number of ranges.
+ */
+static int64_t hot_list(const index_heatmap_file_t* hf, double fraction,
+                        int64_t gap, int64_t** pranges) {
+    int64_t* r = NULL;
+    int64_t n = 0, i, m;
+    int a;
+
+    for (a=INDEX_HEAT_QUADS; a<=INDEX_HEAT_STARS; a++) {
+        heat_t* h;
+        int64_t nh, k;
+        uint64_t total;
+        int64_t blockbytes = (int64_t)hf->perblock[a] * hf->recbytes[a];
+        int64_t end = hf->offset[a] + hf->nrecords[a] * hf->recbytes[a];
+        if (hf->offset[a] < 0)
+            continue;
+        h = hot_blocks(hf, a, 0, hf->nblocks[a], &nh, &total);
+        nh = blocks_for(h, nh, total, fraction);
+        r = realloc(r, (n + nh + hf->ntables) * 2 * sizeof(int64_t));
+        for (k=0; k<nh; k++) {
+            int64_t start = hf->offset[a] + h[k].block * blockbytes;
+            r[2*n] = start;
+            r[2*n+1] = MIN(end, start + blockbytes) - start;
+            n++;
+        }
+        free(h);
+    }
+    r = realloc(r, MAX(1, n + hf->ntables) * 2 * sizeof(int64_t));
+    for (i=0; i<hf->ntables; i++) {
+        r[2*n] = hf->tables[2*i];
+        r[2*n+1] = hf->tables[2*i+1];
+        n++;
+    }
+    // to pages.
+    for (i=0; i<n; i++) {
+        int64_t start = r[2*i] / PAGE * PAGE;
+        int64_t end = (r[2*i] + r[2*i+1] + PAGE - 1) / PAGE * PAGE;
+        r[2*i] = start;
+        r[2*i+1] = end - start;
+    }
+    qsort(r, n, 2 * sizeof(int64_t), compare_range);
+    m = 0;
+    for (i=0; i<n; i++) {
+        if (m && r[2*i] <= r[2*(m-1)] + r[2*(m-1)+1] + gap) {
+            int64_t end = MAX(r[2*(m-1)] + r[2*(m-1)+1], r[2*i] + r[2*i+1]);
+            r[2*(m-1)+1] = end - r[2*(m-1)];
+            continue;
+        }
+        r[2*m] = r[2*i];
+        r[2*m+1] = r[2*i+1];
+        m++;
+    }
+    *pranges = r;
+    return m;
+}
+
+static int write_hot_list(const char* heatfn, const index_heatmap_file_t* hf,
+                          double fraction, int64_t gap, const char* outfn) {
+    int64_t* r;
+    int64_t n, i, bytes = 0;
+    FILE* fid;
+
+    n = hot_list(hf, fraction, gap, &r);
+    fid = fopen(outfn, "w");
+    if (!fid) {
+        SYSERROR("Failed to open hot list \"%s\" for writing", outfn);
+        free(r);
+        return -1;
+    }
+    fprintf(fid, "# hot list of %s: %g%% of the accesses in %s\n",
+            hf->indexfn ? hf->indexfn : "?", 100.0 * fraction, heatfn);
+    for (i=0; i<n; i++) {
+        fprintf(fid, "%lld %lld\n", (long long)r[2*i], (long long)r[2*i+1]);
+        bytes += r[2*i+1];
+    }
+    if (fclose(fid)) {
+        SYSERROR("Failed to write hot list \"%s\"", outfn);
+        free(r);
+        return -1;
+    }
+    printf("  hot list %s: %lld ranges, %.1f MB\n", outfn, (long long)n,
+           bytes * 1e-6);
+    free(r);
+    return 0;
+}
+
+static int write_node_hints(const index_heatmap_file_t* hf,
+                            const char* outfn) {
+    FILE* fid;
+    int a;
+
+    fid = fopen(outfn, "w");
+    if (!fid) {
+        SYSERROR("Failed to open node hints \"%s\" for writing", outfn);
+        return -1;
+    }
+    fprintf(fid, "# kd-tree nodes of %s, hottest first\n",
+            hf->indexfn ? hf->indexfn : "?");
+    for (a=INDEX_HEAT_CODEKD; a<=INDEX_HEAT_STARKD; a++) {
+        heat_t* h;
+        int64_t n, i;
+        uint64_t total;
+        h = hot_blocks(hf, a, 0, hf->nblocks[a], &n, &total);
+        fprintf(fid, "tree %s %lld\n", index_heatmap_array_name(a),
+                (long long)hf->nblocks[a]);
+        for (i=0; i<n; i++)
+            fprintf(fid, "node %lld %llu\n", (long long)h[i].block,
+                    (unsigned long long)h[i].count);
+        free(h);
+    }
+    if (fclose(fid)) {
+        SYSERROR("Failed to write node hints \"%s\"", outfn);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    char* hotfn = NULL;
+    char* hintsfn = NULL;
+    anbool besides = FALSE;
+    double fraction = 0.9;
+    int64_t gap = 65536;
+    int i, rtn = 0;
+
+    while ((argchar = getopt(argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'p':
+            hotfn = optarg;
+            break;
+        case 'P':
+            besides = TRUE;
+            break;
+        case 'f':
+            fraction = atof(optarg);
+            break;
+        case 'g':
+            gap = atoll(optarg);
+            break;
+        case 'n':
+            hintsfn = optarg;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (optind == argc || fraction <= 0 || fraction > 1 || gap < 0) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+    if ((hotfn || hintsfn) && argc - optind > 1) {
+        ERROR("-p and -n take one heatmap");
+        errors_print_stack(stderr);
+        exit(-1);
+    }
+
+    for (i=optind; i<argc; i++) {
+        index_heatmap_file_t* hf = index_heatmap_read(argv[i]);
+        if (!hf) {
+            rtn = -1;
+            break;
+        }
+        report(argv[i], hf);
+        if (hotfn && write_hot_list(argv[i], hf, fraction, gap, hotfn))
+            rtn = -1;
+        if (besides) {
+            char* fn;
+            if (!hf->indexfn) {
+                ERROR("Heatmap %s doesn't name its index file", argv[i]);
+                rtn = -1;
+            } else {
+                asprintf_safe(&fn, "%s.hot", hf->indexfn);
+                if (write_hot_list(argv[i], hf, fraction, gap, fn))
+                    rtn = -1;
+                free(fn);
+            }
+        }
+        if (hintsfn && write_node_hints(hf, hintsfn))
+            rtn = -1;
+        index_heatmap_file_free(hf);
+        if (rtn)
+            break;
+    }
+    if (rtn)
+        errors_print_stack(stderr);
+    return rtn;
+}
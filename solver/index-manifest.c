@@ -0,0 +1,79 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Writes (or refreshes) the manifest of index metadata in each of the
+ given directories, so that astrometry-engine doesn't have to open every
+ index file at startup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "index.h"
+#include "log.h"
+#include "errors.h"
+#include "bl.h"
+#include "boilerplate.h"
+
+static const char* OPTIONS = "hvf";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <index-directory> [...]\n"
+           "    [-f]: re-read every index file, ignoring any existing manifest\n"
+           "    [-v]: +verbose\n"
+           "\n"
+           "Writes the file \"%s\" in each directory.\n"
+           "\n", progname, INDEX_MANIFEST_FILENAME);
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    int flags = INDEX_MANIFEST_UPDATE;
+    int i;
+    int rtn = 0;
+
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'f':
+            flags |= INDEX_MANIFEST_REBUILD;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (optind == argc) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+
+    for (i=optind; i<argc; i++) {
+        pl* inds = pl_new(256);
+        int j;
+        if (index_manifest_scan(argv[i], flags, inds)) {
+            ERROR("Failed to scan index directory \"%s\"", argv[i]);
+            rtn = -1;
+        } else
+            logmsg("%s: %zu index files\n", argv[i], pl_size(inds));
+        for (j=0; j<pl_size(inds); j++)
+            index_free(pl_get(inds, j));
+        pl_free(inds);
+    }
+    if (rtn)
+        errors_print_stack(stderr);
+    return rtn;
+}
@@ -0,0 +1,107 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Rewrites an index file so that each of its tables starts on an aligned
+ offset (by default a page boundary) and carries a DATASUM checksum; or,
+ with -c, checks the checksums of the given files.  The packed file is
+ still a FITS file and is loaded exactly like the original.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "index.h"
+#include "fitsioutils.h"
+#include "log.h"
+#include "errors.h"
+#include "boilerplate.h"
+
+static const char* OPTIONS = "hva:c";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <input-index> <output-index>\n"
+           "   or: %s -c <index-file> [...]\n"
+           "    [-a <bytes>]: align the tables to this many bytes (power of two;\n"
+           "                  default %i)\n"
+           "    [-c]: check the checksums of the given files\n"
+           "    [-v]: +verbose\n"
+           "\n", progname, progname, getpagesize());
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    int align = getpagesize();
+    anbool check = FALSE;
+    int i;
+    int rtn = 0;
+    index_t* ind;
+
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'a':
+            align = atoi(optarg);
+            break;
+        case 'c':
+            check = TRUE;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (check) {
+        if (optind == argc) {
+            printHelp(argv[0]);
+            exit(-1);
+        }
+        for (i=optind; i<argc; i++) {
+            int nchecked;
+            int nbad = fits_check_datasums(argv[i], &nchecked);
+            if (nbad) {
+                ERROR("%s: %s", argv[i], nbad < 0 ? "failed to check" :
+                      "checksum mismatch");
+                rtn = -1;
+            } else if (!nchecked) {
+                ERROR("%s: no checksums", argv[i]);
+                rtn = -1;
+            } else
+                logmsg("%s: %i checksums OK\n", argv[i], nchecked);
+        }
+        if (rtn)
+            errors_print_stack(stderr);
+        return rtn;
+    }
+
+    if (optind + 2 != argc) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+    if (fits_copy_aligned(argv[optind], argv[optind+1], align)) {
+        ERROR("Failed to pack \"%s\" into \"%s\"", argv[optind], argv[optind+1]);
+        errors_print_stack(stderr);
+        return -1;
+    }
+    // make sure it still reads as an index.
+    ind = index_load(argv[optind+1], INDEX_ONLY_LOAD_METADATA, NULL);
+    if (!ind) {
+        ERROR("Packed file \"%s\" does not load as an index", argv[optind+1]);
+        errors_print_stack(stderr);
+        return -1;
+    }
+    index_free(ind);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Computes the inverse permutations of the star and code kd-trees of the
+ given index files into shared memory (see shmcache.h), so that other
+ processes that need them can attach to them instead of computing their
+ own; or, with -d, removes them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "index.h"
+#include "starkd.h"
+#include "codekd.h"
+#include "shmcache.h"
+#include "log.h"
+#include "errors.h"
+#include "boilerplate.h"
+
+static const char* OPTIONS = "hvd";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <index-file> [...]\n"
+           "    [-d]: remove the shared-memory arrays rather than creating them\n"
+           "    [-v]: +verbose\n"
+           "\n", progname);
+}
+
+static int remove_key(const char* fn, const char* what) {
+    char* key = shmcache_key(fn, what);
+    int rtn;
+    if (!key)
+        return -1;
+    rtn = shmcache_remove(key);
+    free(key);
+    return rtn;
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    anbool remove = FALSE;
+    int i;
+    int rtn = 0;
+
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'd':
+            remove = TRUE;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (optind == argc) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+
+    shmcache_set_enabled(TRUE);
+    for (i=optind; i<argc; i++) {
+        char* fn = argv[i];
+        index_t* ind;
+        if (remove) {
+            if (remove_key(fn, "stars-invperm") ||
+                remove_key(fn, "codes-invperm"))
+                rtn = -1;
+            continue;
+        }
+        ind = index_load(fn, 0, NULL);
+        if (!ind) {
+            ERROR("Failed to load index \"%s\"", fn);
+            rtn = -1;
+            continue;
+        }
+        startree_compute_inverse_perm(ind->starkd);
+        codetree_compute_inverse_perm(ind->codekd);
+        if (!ind->starkd->inverse_perm_shared ||
+            !ind->codekd->inverse_perm_shared) {
+            ERROR("Failed to put the inverse permutations of \"%s\" in shared memory", fn);
+            rtn = -1;
+        } else
+            logmsg("%s: shared %i stars, %i codes\n", fn,
+                   startree_N(ind->starkd), codetree_N(ind->codekd));
+        index_free(ind);
+    }
+    if (rtn)
+        errors_print_stack(stderr);
+    return rtn;
+}
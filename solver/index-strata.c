@@ -0,0 +1,172 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Splits an index file into strata by star brightness (sweep): stratum 1
+ is a complete index of the brightest stars, and each deeper stratum
+ adds the fainter stars and only the quads that need them.  The engine
+ tries the strata bright-first, loading the deeper ones only when the
+ brighter ones fail; a machine short of memory can keep just the first
+ files.  See build_index_stratum().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "build-index.h"
+#include "index.h"
+#include "starkd.h"
+#include "bl.h"
+#include "log.h"
+#include "errors.h"
+#include "ioutils.h"
+#include "mathutil.h"
+#include "boilerplate.h"
+
+static const char* OPTIONS = "hvn:c:";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <input-index> <output-pattern>\n"
+           "    [-n <strata>]: number of strata, splitting the index's sweeps\n"
+           "                   evenly (default 2)\n"
+           "    [-c <sweep>,<sweep>,...]: or, the last sweep (from 1) of each\n"
+           "                   stratum but the deepest\n"
+           "    [-v]: +verbose\n"
+           "\n"
+           "The output pattern must contain \"%%i\", which is replaced by the\n"
+           "stratum number (from 1), eg, index-4119-s%%i.fits\n"
+           "\n", progname);
+}
+
+/*
+ The fraction of the index's stars in its first "k" sweeps (of
+ "nsweep"), from the SWEEP<n> headers (the number of stars in each) if
+ it has them.
+ */
+static double sweep_fraction(const index_t* ind, int k, int nsweep) {
+    qfits_header* hdr = startree_header(ind->starkd);
+    double n = 0, total = 0;
+    int i;
+    for (i=1; i<=nsweep; i++) {
+        char key[16];
+        int ni;
+        sprintf(key, "SWEEP%i", i);
+        ni = qfits_header_getint(hdr, key, -1);
+        if (ni < 0)
+            return (double)k / nsweep;
+        total += ni;
+        if (i <= k)
+            n += ni;
+    }
+    return total > 0 ? n / total : (double)k / nsweep;
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    int nstrata = 2;
+    const char* cutstr = NULL;
+    il* cuts;
+    index_params_t p;
+    index_t* ind;
+    int nsweep;
+    int i, lo, rtn = 0;
+
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 'n':
+            nstrata = atoi(optarg);
+            break;
+        case 'c':
+            cutstr = optarg;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (optind + 2 != argc || !strstr(argv[optind+1], "%i")) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+
+    logmsg("Reading index %s...\n", argv[optind]);
+    ind = index_load(argv[optind], 0, NULL);
+    if (!ind) {
+        ERROR("Couldn't read index %s", argv[optind]);
+        errors_print_stack(stderr);
+        return -1;
+    }
+    nsweep = ind->cutnsweep > 0 ? ind->cutnsweep : 10;
+
+    // the cuts, in the index's sweeps.
+    cuts = il_new(8);
+    if (cutstr) {
+        sl* words = sl_split(NULL, cutstr, ",");
+        for (i=0; i<sl_size(words); i++)
+            il_append(cuts, atoi(sl_get(words, i)));
+        sl_free2(words);
+        nstrata = il_size(cuts) + 1;
+    } else {
+        for (i=1; i<nstrata; i++)
+            il_append(cuts, (int)round((double)i * nsweep / nstrata));
+    }
+    if (nstrata < 2) {
+        ERROR("Need at least two strata");
+        index_free(ind);
+        return -1;
+    }
+
+    build_index_defaults(&p);
+    lo = 0;
+    for (i=1; i<=nstrata; i++) {
+        char* fn;
+        int hi = 256;
+        if (i < nstrata) {
+            int k = il_get(cuts, i-1);
+            if (k < 1 || k >= nsweep) {
+                ERROR("Sweep cut %i must be between 1 and %i", k, nsweep - 1);
+                rtn = -1;
+                break;
+            }
+            // the sweep numbers are the stars' quantized rank (see
+            // unpermute-stars.c).
+            hi = (int)ceil(256.0 * sweep_fraction(ind, k, nsweep));
+            hi = MAX(1, MIN(255, hi));
+        }
+        if (hi <= lo) {
+            ERROR("Sweep cuts must increase");
+            rtn = -1;
+            break;
+        }
+        asprintf_safe(&fn, argv[optind+1], i);
+        logmsg("Writing stratum %i to %s\n", i, fn);
+        if (build_index_stratum(ind, lo, hi, i, nstrata, &p, NULL, fn)) {
+            ERROR("Failed to build stratum %i", i);
+            free(fn);
+            rtn = -1;
+            break;
+        }
+        free(fn);
+        lo = hi;
+    }
+    if (rtn)
+        errors_print_stack(stderr);
+    il_free(cuts);
+    index_free(ind);
+    return rtn;
+}
@@ -0,0 +1,160 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "os-features.h"
+#include "job-checkpoint.h"
+#include "ioutils.h"
+#include "bl.h"
+#include "errors.h"
+#include "log.h"
+
+job_checkpoint_t* job_checkpoint_new(void) {
+    job_checkpoint_t* ck = calloc(1, sizeof(job_checkpoint_t));
+    ck->runs = bl_new(16, sizeof(checkpoint_run_t));
+    return ck;
+}
+
+job_checkpoint_t* job_checkpoint_read(const char* fn) {
+    job_checkpoint_t* ck;
+    sl* lines;
+    size_t i;
+
+    if (!file_exists(fn))
+        return NULL;
+    lines = file_get_lines(fn, FALSE);
+    if (!lines) {
+        ERROR("Failed to read checkpoint file \"%s\"", fn);
+        return NULL;
+    }
+    ck = job_checkpoint_new();
+    for (i=0; i<sl_size(lines); i++) {
+        char* line = sl_get(lines, i);
+        char* nextword;
+        uint64_t key;
+        int index, object;
+        tan_t* t = &(ck->best_wcs);
+
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if (is_word(line, "run ", &nextword)) {
+            if (sscanf(nextword, "%" SCNx64 " %i %i", &key, &index,
+                       &object) == 3)
+                job_checkpoint_set_run(ck, key, FALSE, index, object);
+            else if (sscanf(nextword, "%" SCNx64, &key) == 1 &&
+                     strstr(nextword, " done"))
+                job_checkpoint_set_run(ck, key, TRUE, 0, 0);
+            else
+                goto bailout;
+        } else if (is_word(line, "best ", &nextword)) {
+            memset(t, 0, sizeof(tan_t));
+            if (sscanf(nextword, "%lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg",
+                       &ck->best_logodds, t->crval+0, t->crval+1, t->crpix+0,
+                       t->crpix+1, &t->cd[0][0], &t->cd[0][1], &t->cd[1][0],
+                       &t->cd[1][1], &t->imagew, &t->imageh) != 11)
+                goto bailout;
+            ck->have_best = TRUE;
+        } else
+            goto bailout;
+    }
+    sl_free2(lines);
+    return ck;
+
+ bailout:
+    ERROR("Failed to parse checkpoint file \"%s\", line %zu", fn, i + 1);
+    sl_free2(lines);
+    job_checkpoint_free(ck);
+    return NULL;
+}
+
+int job_checkpoint_write(const job_checkpoint_t* ck, const char* fn) {
+    char* tmpfn;
+    FILE* fid;
+    size_t i;
+
+    asprintf_safe(&tmpfn, "%s.tmp", fn);
+    fid = fopen(tmpfn, "w");
+    if (!fid) {
+        SYSERROR("Failed to open checkpoint file \"%s\" for writing", tmpfn);
+        free(tmpfn);
+        return -1;
+    }
+    fprintf(fid, "# astrometry.net job checkpoint\n");
+    for (i=0; i<bl_size(ck->runs); i++) {
+        checkpoint_run_t* run = bl_access(ck->runs, i);
+        if (run->done)
+            fprintf(fid, "run %016" PRIx64 " done\n", run->key);
+        else
+            fprintf(fid, "run %016" PRIx64 " %i %i\n", run->key, run->index,
+                    run->object);
+    }
+    if (ck->have_best) {
+        const tan_t* t = &(ck->best_wcs);
+        fprintf(fid, "best %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g "
+                "%.17g %g %g\n", ck->best_logodds, t->crval[0], t->crval[1],
+                t->crpix[0], t->crpix[1], t->cd[0][0], t->cd[0][1],
+                t->cd[1][0], t->cd[1][1], t->imagew, t->imageh);
+    }
+    if (fclose(fid) || rename(tmpfn, fn)) {
+        SYSERROR("Failed to write checkpoint file \"%s\"", fn);
+        free(tmpfn);
+        return -1;
+    }
+    free(tmpfn);
+    return 0;
+}
+
+checkpoint_run_t* job_checkpoint_find(job_checkpoint_t* ck, uint64_t key) {
+    size_t i;
+    for (i=0; i<bl_size(ck->runs); i++) {
+        checkpoint_run_t* run = bl_access(ck->runs, i);
+        if (run->key == key)
+            return run;
+    }
+    return NULL;
+}
+
+void job_checkpoint_set_run(job_checkpoint_t* ck, uint64_t key,
+                            anbool done, int index, int object) {
+    checkpoint_run_t* run = job_checkpoint_find(ck, key);
+    if (!run) {
+        run = bl_append(ck->runs, NULL);
+        run->key = key;
+    }
+    run->done = done;
+    run->index = done ? 0 : index;
+    run->object = done ? 0 : object;
+}
+
+void job_checkpoint_set_best(job_checkpoint_t* ck, double logodds,
+                             const tan_t* wcs) {
+    if (ck->have_best && logodds <= ck->best_logodds)
+        return;
+    ck->have_best = TRUE;
+    ck->best_logodds = logodds;
+    ck->best_wcs = *wcs;
+}
+
+uint64_t job_checkpoint_hash(uint64_t h, const void* data, size_t n) {
+    const unsigned char* p = data;
+    size_t i;
+    if (!h)
+        h = 14695981039346656037ULL;
+    for (i=0; i<n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void job_checkpoint_free(job_checkpoint_t* ck) {
+    if (!ck)
+        return;
+    bl_free(ck->runs);
+    free(ck);
+}
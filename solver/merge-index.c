@@ -9,19 +9,158 @@
 #include <math.h>
 #include <string.h>
 
+#include "merge-index.h"
 #include "quadfile.h"
 #include "codekd.h"
 #include "starkd.h"
+#include "index-coverage.h"
+#include "starutil.h"
+#include "mathutil.h"
 #include "fitstable.h"
 #include "fitsioutils.h"
 #include "errors.h"
 #include "ioutils.h"
 #include "log.h"
 
+// Appends the coverage map of the stars "xyz" to "fout".
+static int write_coverage(quadfile_t* quad, const double* xyz, int N, FILE* fout) {
+    int nside = index_coverage_nside(quadfile_get_index_scale_upper_arcsec(quad));
+    ll* ranges;
+    int rtn;
+
+    ranges = index_coverage_from_xyz(xyz, N, nside);
+    logverb("Coverage map: %zu ranges at Nside %i\n", ll_size(ranges) / 2, nside);
+    rtn = index_coverage_write_to(ranges, nside, fout);
+    ll_free(ranges);
+    return rtn;
+}
+
+// Appends the per-quad tables (the geometry, and with
+// MERGE_INDEX_QUAD_XYZ the star positions), computed from the stars
+// "xyz" (in kdtree order), to "fout".
+// Returns the star positions "xyz" (in kdtree order) in the order of the
+// stars' original ids, which is what quads refer to them by: "xyz"
+// itself if the tree isn't permuted, else a copy in "*p_idxyz".
+static const double* xyz_by_star_id(startree_t* star, const double* xyz,
+                                    double** p_idxyz) {
+    const u32* perm = star->tree->perm;
+    int i, N = startree_N(star);
+    *p_idxyz = NULL;
+    if (!perm)
+        return xyz;
+    *p_idxyz = malloc((size_t)MAX(N, 1) * 3 * sizeof(double));
+    if (!*p_idxyz) {
+        SYSERROR("Failed to allocate positions of %i stars", N);
+        return NULL;
+    }
+    for (i=0; i<N; i++)
+        memcpy(*p_idxyz + 3 * (size_t)perm[i], xyz + 3 * (size_t)i,
+               3 * sizeof(double));
+    return *p_idxyz;
+}
+
+static int write_quad_tables(quadfile_t* quad, startree_t* star,
+                             const double* xyz, int flags, FILE* fout) {
+    double* idxyz = NULL;
+    float* table = NULL;
+    size_t nq = MAX(quadfile_nquads(quad), 1);
+    int rtn = -1;
+
+    xyz = xyz_by_star_id(star, xyz, &idxyz);
+    if (!xyz)
+        return -1;
+
+    table = malloc(nq * MAX(QUADFILE_GEOM_FLOATS, 3 * quad->dimquads) *
+                   sizeof(float));
+    if (!table) {
+        SYSERROR("Failed to allocate per-quad tables for %zu quads", nq);
+        goto bailout;
+    }
+    quadfile_compute_geometry(quad, xyz, table);
+    if (quadfile_write_geometry_to(quad, table, fout) ||
+        fits_pad_file(fout))
+        goto bailout;
+    if (flags & MERGE_INDEX_QUAD_XYZ) {
+        quadfile_compute_star_xyz(quad, xyz, table);
+        if (quadfile_write_star_xyz_to(quad, table, fout) ||
+            fits_pad_file(fout))
+            goto bailout;
+    }
+    rtn = 0;
+ bailout:
+    free(table);
+    free(idxyz);
+    return rtn;
+}
+
+// Appends the code tree split into "nscalebins" scale bins, and into
+// sky bins at HEALPix Nside "skynside" (see codekd.h), by the AB
+// lengths and midpoints of the quads with stars "xyz" (in kdtree
+// order).
+static int write_code_bins(quadfile_t* quad, codetree_t* code,
+                           startree_t* star, const double* xyz,
+                           int nscalebins, int skynside, FILE* fout) {
+    double* idxyz = NULL;
+    double* ablen;
+    double* abmid;
+    int i, nq = quadfile_nquads(quad);
+    int rtn = 0;
+
+    xyz = xyz_by_star_id(star, xyz, &idxyz);
+    if (!xyz)
+        return -1;
+    ablen = malloc((size_t)MAX(nq, 1) * sizeof(double));
+    abmid = malloc((size_t)MAX(nq, 1) * 3 * sizeof(double));
+    if (!ablen || !abmid) {
+        SYSERROR("Failed to allocate AB lengths of %i quads", nq);
+        free(ablen);
+        free(abmid);
+        free(idxyz);
+        return -1;
+    }
+    for (i=0; i<nq; i++) {
+        unsigned int stars[DQMAX];
+        const double* A;
+        const double* B;
+        quadfile_get_stars(quad, i, stars);
+        A = xyz + 3 * (size_t)stars[0];
+        B = xyz + 3 * (size_t)stars[1];
+        // (as resolve_matches() measures them)
+        ablen[i] = distsq2rad(distsq(A, B, 3));
+        star_midpoint(abmid + 3 * (size_t)i, A, B);
+    }
+    if (nscalebins > 1) {
+        logverb("Splitting the code kdtree into %i scale bins\n", nscalebins);
+        rtn = codetree_append_scale_bins_to(code, ablen, nscalebins, fout);
+    }
+    if (!rtn && skynside > 0) {
+        logverb("Splitting the code kdtree into sky bins at Nside %i\n",
+                skynside);
+        rtn = codetree_append_sky_bins_to(code, abmid, skynside, fout);
+    }
+    free(ablen);
+    free(abmid);
+    free(idxyz);
+    return rtn;
+}
+
 int merge_index(quadfile_t* quad, codetree_t* code, startree_t* star,
                 const char* indexfn) {
+    return merge_index_flags(quad, code, star, indexfn, 0);
+}
+
+int merge_index_flags(quadfile_t* quad, codetree_t* code, startree_t* star,
+                      const char* indexfn, int flags) {
+    return merge_index_with_bins(quad, code, star, indexfn, flags, 0, 0);
+}
+
+int merge_index_with_bins(quadfile_t* quad, codetree_t* code, startree_t* star,
+                          const char* indexfn, int flags, int nscalebins,
+                          int skynside) {
     FILE* fout;
     fitstable_t* tag = NULL;
+    double* xyz;
+    int N;
 
     fout = fopen(indexfn, "wb");
     if (!fout) {
@@ -73,6 +212,38 @@ int merge_index(quadfile_t* quad, codetree_t* code, startree_t* star,
         }
     }
 
+    N = startree_N(star);
+    xyz = malloc((size_t)MAX(N, 1) * 3 * sizeof(double));
+    if (!xyz) {
+        SYSERROR("Failed to allocate positions of %i stars", N);
+        return -1;
+    }
+    kdtree_copy_data_double(star->tree, 0, N, xyz);
+
+    if (write_coverage(quad, xyz, N, fout)) {
+        ERROR("Failed to write coverage map to index file %s", indexfn);
+        free(xyz);
+        return -1;
+    }
+    if (fits_pad_file(fout)) {
+        ERROR("Failed to pad index file %s", indexfn);
+        free(xyz);
+        return -1;
+    }
+
+    if (write_quad_tables(quad, star, xyz, flags, fout)) {
+        ERROR("Failed to write per-quad tables to index file %s", indexfn);
+        free(xyz);
+        return -1;
+    }
+    if ((nscalebins > 1 || skynside > 0) &&
+        write_code_bins(quad, code, star, xyz, nscalebins, skynside, fout)) {
+        ERROR("Failed to write code kdtree bins to index file %s", indexfn);
+        free(xyz);
+        return -1;
+    }
+    free(xyz);
+
     if (fclose(fout)) {
         SYSERROR("Failed to close index file %s", indexfn);
         return -1;
@@ -13,6 +13,9 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -36,6 +39,7 @@
 #include "fitsioutils.h"
 #include "verify.h"
 #include "index.h"
+#include "index-heatmap.h"
 #include "log.h"
 #include "tic.h"
 #include "anqfits.h"
@@ -43,18 +47,25 @@
 #include "scamp-catalog.h"
 #include "permutedsort.h"
 #include "bl-sort.h"
+#include "ioutils.h"
+#include "an-thread.h"
+#include "an-alloc.h"
 
 static anbool record_match_callback(MatchObj* mo, void* userdata);
 static time_t timer_callback(void* user_data);
 static void add_onefield_params(onefield_t* bp, qfits_header* hdr);
 static void load_and_parse_wcsfiles(onefield_t* bp);
-static void solve_fields(onefield_t* bp, sip_t* verify_wcs);
+static void solve_fields(onefield_t* bp, sip_t* verify_wcs, int nverify);
+static anbool solve_field(onefield_t* bp, int fieldnum, sip_t* verify_wcs,
+                          int nverify);
 static void remove_invalid_fields(il* fieldlist, int maxfield);
 static anbool is_field_solved(onefield_t* bp, int fieldnum);
 static int write_solutions(onefield_t* bp);
+static void write_stats(onefield_t* bp, int fieldnum);
 static void solved_field(onefield_t* bp, int fieldnum);
 static int compare_matchobjs(const void* v1, const void* v2);
 static void remove_duplicate_solutions(onefield_t* bp);
+static void keep_solved_matches(onefield_t* bp, const MatchObj* mo);
 
 // A tag-along column for index rdls / correspondence file.
 struct tagalong {
@@ -71,15 +82,39 @@ struct tagalong {
 };
 typedef struct tagalong tagalong_t;
 
+// The index (and its tag-along table) may be shared by jobs running on
+// other threads; see engine_run_jobs().
+AN_THREAD_DECLARE_STATIC_MUTEX(tagalong_lock);
+// Fields solved on several threads (see solve_fields_parallel()) share
+// the solved file.
+AN_THREAD_DECLARE_STATIC_MUTEX(solvedfile_lock);
+
+// Call with solvedfile_lock held.
+static solvedfile_map_t* get_solved_map(solvedfile_map_t** pmap, const char* fn) {
+    if (!*pmap && fn)
+        *pmap = solvedfile_map_open(fn);
+    return *pmap;
+}
+
 static anbool grab_tagalong_data(startree_t* starkd, MatchObj* mo, onefield_t* bp,
                                  const int* starinds, int N) {
     fitstable_t* tagalong;
+    fitstable_gather_t* gather;
     int i;
+    AN_THREAD_LOCK(tagalong_lock);
     tagalong = startree_get_tagalong(starkd);
     if (!tagalong) {
+        AN_THREAD_UNLOCK(tagalong_lock);
         ERROR("Failed to find tag-along table in index");
         return FALSE;
     }
+    // Read the stars' rows once, for all the columns.
+    gather = startree_gather_tagalong(starkd, starinds, N, bp->solver.nthreads);
+    if (!gather) {
+        AN_THREAD_UNLOCK(tagalong_lock);
+        ERROR("Failed to read the tag-along rows of %i stars", N);
+        return FALSE;
+    }
     if (!mo->tagalong)
         mo->tagalong = bl_new(16, sizeof(tagalong_t));
 
@@ -103,7 +138,7 @@ static anbool grab_tagalong_data(startree_t* starkd, MatchObj* mo, onefield_t* b
             ERROR("Failed to find column \"%s\" in index", col);
             continue;
         }
-        tag.data = fitstable_read_column_array_inds(tagalong, col, tag.type, starinds, N, NULL);
+        tag.data = fitstable_gather_column(gather, col, tag.type, NULL);
         if (!tag.data) {
             ERROR("Failed to read data for column \"%s\" in index", col);
             continue;
@@ -114,6 +149,8 @@ static anbool grab_tagalong_data(startree_t* starkd, MatchObj* mo, onefield_t* b
         tag.Ndata = N;
         bl_append(mo->tagalong, &tag);
     }
+    fitstable_gather_free(gather);
+    AN_THREAD_UNLOCK(tagalong_lock);
     return TRUE;
 }
 
@@ -157,11 +194,15 @@ static anbool grab_field_tagalong_data(MatchObj* mo, xylist_t* xy, int N) {
 
  Currently it supposedly could handle both "indexnames" and "indexes",
  but we should probably just assert that only one of these can be used.
+
+ "indexes" may be shared with other onefield_t's (see engine_run_jobs()),
+ so they are index_acquire()d for use and index_release()d after.
  **/
-static index_t* get_index(onefield_t* bp, size_t i) {
+static index_t* open_index(onefield_t* bp, size_t i) {
+    index_t* ind;
     if (i < sl_size(bp->indexnames)) {
         char* fn = sl_get(bp->indexnames, i);
-        index_t* ind = index_load(fn, bp->index_options, NULL);
+        ind = index_load(fn, bp->index_options, NULL);
         if (!ind) {
             ERROR("Failed to load index %s", fn);
             exit( -1);
@@ -169,7 +210,19 @@ static index_t* get_index(onefield_t* bp, size_t i) {
         return ind;
     }
     i -= sl_size(bp->indexnames);
-    return pl_get(bp->indexes, i);
+    ind = pl_get(bp->indexes, i);
+    if (index_acquire(ind)) {
+        ERROR("Failed to load index %s", ind->indexname);
+        exit( -1);
+    }
+    return ind;
+}
+static index_t* get_index(onefield_t* bp, size_t i) {
+    double t0 = timenow();
+    index_t* ind = open_index(bp, i);
+    bp->index_load_time += timenow() - t0;
+    bp->nindex_loads++;
+    return ind;
 }
 static char* get_index_name(onefield_t* bp, size_t i) {
     index_t* index;
@@ -184,12 +237,210 @@ static char* get_index_name(onefield_t* bp, size_t i) {
 static void done_with_index(onefield_t* bp, size_t i, index_t* ind) {
     if (i < sl_size(bp->indexnames)) {
         index_close(ind);
+    } else {
+        index_release(ind);
     }
 }
 static size_t n_indexes(onefield_t* bp) {
     return sl_size(bp->indexnames) + pl_size(bp->indexes);
 }
 
+/*
+ Reads the index files that are coming up next into the page cache, on a
+ background thread, while the current index is searched; so that loading
+ each index (on the main thread) doesn't have to wait for the disk.  For
+ an index with a hot list ("<index file>.hot"; see index-heatmap.h), just
+ the byte ranges in the list are read.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // index filenames (NULL if not found) and sizes (of their hot
+    // ranges, if they have hot lists).
+    char** filenames;
+    off_t* sizes;
+    // the hot lists (see index-heatmap.h): "nhot[i]" (offset, bytes)
+    // pairs, or NULL to read the whole file.
+    int64_t** hot;
+    int* nhot;
+    size_t N;
+    int ahead;
+    size_t budget;
+    // the index being searched, and the next one to read.
+    size_t current;
+    size_t next;
+    int quit;
+} prefetcher_t;
+
+// Bytes read ahead of the current index; call with the lock held.
+static size_t prefetched_bytes(prefetcher_t* pf) {
+    size_t i;
+    size_t sum = 0;
+    for (i=pf->current+1; i<pf->next; i++)
+        sum += pf->sizes[i];
+    return sum;
+}
+
+static void prefetch_file(prefetcher_t* pf, size_t i) {
+    char buf[1 << 16];
+    int fd = open(pf->filenames[i], O_RDONLY);
+    int k;
+    if (fd == -1)
+        return;
+    if (!pf->hot[i]) {
+        while (!__atomic_load_n(&pf->quit, __ATOMIC_RELAXED) &&
+               read(fd, buf, sizeof(buf)) > 0);
+        close(fd);
+        return;
+    }
+    for (k=0; k<pf->nhot[i]; k++) {
+        off_t off = pf->hot[i][2*k];
+        off_t end = off + pf->hot[i][2*k+1];
+        while (off < end && !__atomic_load_n(&pf->quit, __ATOMIC_RELAXED)) {
+            ssize_t n = pread(fd, buf, MIN((off_t)sizeof(buf), end - off), off);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+    }
+    close(fd);
+}
+
+// Reads the hot list of index "i", if it has one.
+static void load_hot_list(prefetcher_t* pf, size_t i) {
+    char* hotfn;
+    int n, k;
+    asprintf_safe(&hotfn, "%s.hot", pf->filenames[i]);
+    if (!file_exists(hotfn)) {
+        free(hotfn);
+        return;
+    }
+    n = index_heatmap_read_hot_list(hotfn, pf->hot + i);
+    if (n < 0) {
+        logmsg("Ignoring hot list %s\n", hotfn);
+        errors_clear_stack();
+        free(hotfn);
+        return;
+    }
+    debug("Index %s has a hot list: %i ranges\n", pf->filenames[i], n);
+    pf->nhot[i] = n;
+    pf->sizes[i] = 0;
+    for (k=0; k<n; k++)
+        pf->sizes[i] += pf->hot[i][2*k+1];
+    free(hotfn);
+}
+
+static void* prefetch_thread(void* arg) {
+    prefetcher_t* pf = arg;
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->quit && pf->next < pf->N) {
+        size_t i = pf->next;
+        if (i > pf->current + pf->ahead ||
+            (i > pf->current + 1 && pf->budget &&
+             prefetched_bytes(pf) + pf->sizes[i] > pf->budget)) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pf->lock);
+        if (pf->filenames[i]) {
+            debug("Prefetching index %s\n", pf->filenames[i]);
+            prefetch_file(pf, i);
+        }
+        pthread_mutex_lock(&pf->lock);
+        if (pf->next == i)
+            pf->next = i + 1;
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static prefetcher_t* prefetcher_start(onefield_t* bp) {
+    prefetcher_t* pf;
+    size_t i;
+
+    pf = calloc(1, sizeof(prefetcher_t));
+    pf->N = n_indexes(bp);
+    pf->ahead = bp->prefetch;
+    pf->budget = bp->prefetch_max;
+    pf->filenames = calloc(pf->N, sizeof(char*));
+    pf->sizes = calloc(pf->N, sizeof(off_t));
+    pf->hot = calloc(pf->N, sizeof(int64_t*));
+    pf->nhot = calloc(pf->N, sizeof(int));
+    for (i=0; i<pf->N; i++) {
+        char* name;
+        struct stat st;
+        char* fn;
+        if (i >= sl_size(bp->indexnames)) {
+            index_t* ind = pl_get(bp->indexes, i - sl_size(bp->indexnames));
+            if (ind->indexfn && !stat(ind->indexfn, &st)) {
+                pf->filenames[i] = strdup(ind->indexfn);
+                pf->sizes[i] = st.st_size;
+                load_hot_list(pf, i);
+            }
+            continue;
+        }
+        // as in index_load(): the name, or the name + ".fits".
+        name = sl_get(bp->indexnames, i);
+        fn = strdup(name);
+        if (stat(fn, &st)) {
+            free(fn);
+            asprintf_safe(&fn, "%s.fits", name);
+            if (stat(fn, &st)) {
+                free(fn);
+                continue;
+            }
+        }
+        pf->filenames[i] = fn;
+        pf->sizes[i] = st.st_size;
+        load_hot_list(pf, i);
+    }
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf)) {
+        SYSERROR("Failed to start the index prefetch thread");
+        pf->quit = 1;
+    }
+    return pf;
+}
+
+// The main thread is starting on index "i".
+static void prefetcher_advance(prefetcher_t* pf, size_t i) {
+    pthread_mutex_lock(&pf->lock);
+    pf->current = i;
+    if (pf->next <= i)
+        pf->next = i + 1;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+static void prefetcher_stop(prefetcher_t* pf) {
+    size_t i;
+    if (!pf)
+        return;
+    pthread_mutex_lock(&pf->lock);
+    if (pf->quit) {
+        // never started.
+        pthread_mutex_unlock(&pf->lock);
+    } else {
+        __atomic_store_n(&pf->quit, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+    }
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    for (i=0; i<pf->N; i++) {
+        free(pf->filenames[i]);
+        free(pf->hot[i]);
+    }
+    free(pf->filenames);
+    free(pf->sizes);
+    free(pf->hot);
+    free(pf->nhot);
+    free(pf);
+}
+
 
 
 void onefield_clear_verify_wcses(onefield_t* bp) {
@@ -216,11 +467,15 @@ void onefield_set_solved_file(onefield_t* bp, const char* fn) {
 }
 
 void onefield_set_solvedin_file(onefield_t* bp, const char* fn) {
+    solvedfile_map_close(bp->solved_in_map);
+    bp->solved_in_map = NULL;
     free(bp->solved_in);
     bp->solved_in = strdup_safe(fn);
 }
 
 void onefield_set_solvedout_file(onefield_t* bp, const char* fn) {
+    solvedfile_map_close(bp->solved_out_map);
+    bp->solved_out_map = NULL;
     free(bp->solved_out);
     bp->solved_out = strdup_safe(fn);
 }
@@ -250,6 +505,16 @@ void onefield_set_corr_file(onefield_t* bp, const char* fn) {
     bp->corr_fname = strdup_safe(fn);
 }
 
+void onefield_set_stats_file(onefield_t* bp, const char* fn) {
+    free(bp->stats_fname);
+    bp->stats_fname = strdup_safe(fn);
+}
+
+void onefield_set_trace_file(onefield_t* bp, const char* fn) {
+    free(bp->trace_fname);
+    bp->trace_fname = strdup_safe(fn);
+}
+
 void onefield_set_wcs_file(onefield_t* bp, const char* fn) {
     free(bp->wcs_template);
     bp->wcs_template = strdup_safe(fn);
@@ -292,7 +557,23 @@ void onefield_add_field_range(onefield_t* bp, int lo, int hi) {
     }
 }
 
+// Checks the solver's cancellation token and deadline (see solver_t).
+static void check_cancel(onefield_t* bp) {
+    solver_t* sp = &(bp->solver);
+    if (sp->cancel && __atomic_load_n(sp->cancel, __ATOMIC_RELAXED) &&
+        !bp->cancelled) {
+        logmsg("Cancelled.\n");
+        bp->cancelled = TRUE;
+    }
+    if (sp->deadline > 0.0 && timenow() > sp->deadline &&
+        !bp->hit_total_timelimit) {
+        logmsg("Deadline reached!\n");
+        bp->hit_total_timelimit = TRUE;
+    }
+}
+
 static void check_time_limits(onefield_t* bp) {
+    check_cancel(bp);
     if (bp->total_timelimit || bp->timelimit) {
         double now = timenow();
         if (bp->total_timelimit && (now - bp->time_total_start > bp->total_timelimit)) {
@@ -317,17 +598,45 @@ static void check_time_limits(onefield_t* bp) {
             bp->hit_cpulimit = TRUE;
         }
     }
+    if (!bp->hit_memlimit && an_alloc_over_limit()) {
+        logmsg("Memory limit reached!\n");
+        bp->hit_memlimit = TRUE;
+    }
     if (bp->hit_total_timelimit ||
         bp->hit_total_cpulimit ||
         bp->hit_timelimit ||
-        bp->hit_cpulimit)
-        bp->solver.quit_now = TRUE;
+        bp->hit_cpulimit ||
+        bp->hit_memlimit ||
+        bp->cancelled) {
+        solver_set_quit(&(bp->solver));
+        bp->search_stopped = TRUE;
+    }
+}
+
+/*
+ Searches with the indexes added to the solver, the "I"-th of the
+ run's (0 if they're searched in parallel): from "resume_object" if
+ it's the one to resume, and noting it if it's the one cut short.
+ */
+static void search_fields(onefield_t* bp, size_t I) {
+    solver_t* sp = &(bp->solver);
+    int startobj = sp->startobj;
+    if (((int)I == bp->resume_index) && (bp->resume_object > startobj)) {
+        logmsg("Resuming the search at field object %i.\n",
+               bp->resume_object + 1);
+        sp->startobj = bp->resume_object;
+    }
+    solve_fields(bp, NULL, 0);
+    sp->startobj = startobj;
+    if ((bp->stopped_object != -1) && (bp->stopped_index == -1))
+        bp->stopped_index = I;
 }
 
 void onefield_run(onefield_t* bp) {
     solver_t* sp = &(bp->solver);
     size_t i, I;
     size_t Nindexes;
+    double best_logodds = 0.0;
 
     // Record current time for total wall-clock time limit.
     bp->time_total_start = timenow();
@@ -335,30 +644,70 @@ void onefield_run(onefield_t* bp) {
     // Record current CPU usage for total cpu-usage limit.
     bp->cpu_total_start = get_cpu_usage();
 
+    // Open the solved files now, so that field threads share them.
+    AN_THREAD_LOCK(solvedfile_lock);
+    get_solved_map(&bp->solved_in_map, bp->solved_in);
+    get_solved_map(&bp->solved_out_map, bp->solved_out);
+    AN_THREAD_UNLOCK(solvedfile_lock);
+
     // Parse WCS files submitted for verification.
     load_and_parse_wcsfiles(bp);
 
-    // Read .xyls file...
-    logverb("Reading fields file %s...", bp->fieldfname);
-    bp->xyls = xylist_open(bp->fieldfname);
-    if (!bp->xyls) {
-        ERROR("Failed to read xylist.\n");
-        exit( -1);
+    if (bp->field_xy) {
+        logverb("Solving a field of %i sources held in memory.\n",
+                starxy_n(bp->field_xy));
+        bp->xyls = NULL;
+        remove_invalid_fields(bp->fieldlist, 1);
+    } else {
+        // Read .xyls file...
+        logverb("Reading fields file %s...", bp->fieldfname);
+        bp->xyls = xylist_open(bp->fieldfname);
+        if (!bp->xyls) {
+            ERROR("Failed to read xylist.\n");
+            exit( -1);
+        }
+        xylist_set_xname(bp->xyls, bp->xcolname);
+        xylist_set_yname(bp->xyls, bp->ycolname);
+        xylist_set_include_flux(bp->xyls, FALSE);
+        xylist_set_include_background(bp->xyls, FALSE);
+        logverb("found %u fields.\n", xylist_n_fields(bp->xyls));
+
+        remove_invalid_fields(bp->fieldlist, xylist_n_fields(bp->xyls));
     }
-    xylist_set_xname(bp->xyls, bp->xcolname);
-    xylist_set_yname(bp->xyls, bp->ycolname);
-    xylist_set_include_flux(bp->xyls, FALSE);
-    xylist_set_include_background(bp->xyls, FALSE);
-    logverb("found %u fields.\n", xylist_n_fields(bp->xyls));
 
-    remove_invalid_fields(bp->fieldlist, xylist_n_fields(bp->xyls));
+    bp->stopped_index = -1;
+    bp->stopped_object = -1;
+
+    // (the stats file stays open across runs, until onefield_cleanup())
+    if (bp->stats_fname && !bp->statsfid) {
+        bp->statsfid = fopen(bp->stats_fname, "w");
+        if (!bp->statsfid) {
+            SYSERROR("Failed to open file \"%s\" to write solver stats", bp->stats_fname);
+            exit(-1);
+        }
+        fprintf(bp->statsfid, "[");
+        bp->nstats = 0;
+        sp->collect_stats = TRUE;
+    }
+    // (and so does the trace; it records the stage times too.)
+    if (bp->trace_fname && !bp->trace) {
+        bp->trace = solver_trace_open(bp->trace_fname);
+        if (!bp->trace)
+            exit(-1);
+        sp->collect_stats = TRUE;
+    }
+    if (bp->collect_stats)
+        sp->collect_stats = TRUE;
 
     Nindexes = n_indexes(bp);
 
     // Verify any WCS estimates we have.
     if (bl_size(bp->verify_wcs_list)) {
         int i;
-        int w;
+        int w, nw;
+        double* quadlo;
+        double* quadhi;
+        sip_t* wcses;
 
         // We want to get the best logodds out of all the indices, so we set the
         // logodds-to-solve impossibly high so that a "good enough" solution doesn't
@@ -366,9 +715,12 @@ void onefield_run(onefield_t* bp) {
         double oldodds = bp->logratio_tosolve;
         bp->logratio_tosolve = LARGE_VAL;
 
-        for (w = 0; w < bl_size(bp->verify_wcs_list); w++) {
+        nw = bl_size(bp->verify_wcs_list);
+        quadlo = malloc(nw * sizeof(double));
+        quadhi = malloc(nw * sizeof(double));
+        wcses = malloc(nw * sizeof(sip_t));
+        for (w = 0; w < nw; w++) {
             double pixscale;
-            double quadlo, quadhi;
             sip_t* wcs = bl_access(bp->verify_wcs_list, w);
 
             // We don't want to try to verify a wide-field image using a narrow-
@@ -383,34 +735,51 @@ void onefield_run(onefield_t* bp) {
             if ((wcs->wcstan.imagew == 0) ||
                 (wcs->wcstan.imageh == 0)) {
                 logmsg("Verifying WCS: image width or height is zero / unknown.\n");
+                // (an empty range: no index will be used.)
+                quadlo[w] = 1.0;
+                quadhi[w] = 0.0;
                 continue;
             }
             pixscale = sip_pixel_scale(wcs);
-            quadlo = bp->quad_size_fraction_lo
+            quadlo[w] = bp->quad_size_fraction_lo
                 * MIN(wcs->wcstan.imagew, wcs->wcstan.imageh)
                 * pixscale;
-            quadhi = bp->quad_size_fraction_hi
+            quadhi[w] = bp->quad_size_fraction_hi
                 * MAX(wcs->wcstan.imagew, wcs->wcstan.imageh)
                 * pixscale;
             logmsg("Verifying WCS using indices with quads of size [%g, %g] arcmin\n",
-                   arcsec2arcmin(quadlo), arcsec2arcmin(quadhi));
+                   arcsec2arcmin(quadlo[w]), arcsec2arcmin(quadhi[w]));
+        }
 
-            for (I=0; I<Nindexes; I++) {
-                index_t* index = get_index(bp, I);
-                if (!index_overlaps_scale_range(index, quadlo, quadhi)) {
-                    done_with_index(bp, I, index);
+        // Each index verifies all the WCSes it could have found at once,
+        // so they share its star searches (see solver_verify_sip_wcses()).
+        for (I=0; I<Nindexes; I++) {
+            index_t* index = get_index(bp, I);
+            int n = 0;
+            for (w = 0; w < nw; w++) {
+                if ((quadlo[w] > quadhi[w]) ||
+                    !index_overlaps_scale_range(index, quadlo[w], quadhi[w]))
                     continue;
-                }
-                solver_add_index(sp, index);
-                sp->index = index;
-                logmsg("Verifying WCS with index %zu of %zu (%s)\n",  I + 1, Nindexes, index->indexname);
-                // Do it!
-                solve_fields(bp, wcs);
-                // Clean up this index...
+                memcpy(wcses + n, bl_access(bp->verify_wcs_list, w), sizeof(sip_t));
+                n++;
+            }
+            if (!n) {
                 done_with_index(bp, I, index);
-                solver_clear_indexes(sp);
+                continue;
             }
+            solver_add_index(sp, index);
+            sp->index = index;
+            logmsg("Verifying %i WCS%s with index %zu of %zu (%s)\n",
+                   n, (n == 1) ? "" : "es", I + 1, Nindexes, index->indexname);
+            // Do it!
+            solve_fields(bp, wcses, n);
+            // Clean up this index...
+            done_with_index(bp, I, index);
+            solver_clear_indexes(sp);
         }
+        free(quadlo);
+        free(quadhi);
+        free(wcses);
 
         bp->logratio_tosolve = oldodds;
 
@@ -426,44 +795,58 @@ void onefield_run(onefield_t* bp) {
         }
     }
 
-    if (bp->single_field_solved)
+    if (bp->single_field_solved || bp->verify_only)
         goto cleanup;
 
     // Start solving...
     if (bp->indexes_inparallel) {
 
+        pl* loaded = pl_new(16);
+
         // Add all the indexes...
         for (I=0; I<Nindexes; I++) {
             index_t* index = get_index(bp, I);
             solver_add_index(sp, index);
+            pl_append(loaded, index);
         }
 
         // Record current CPU usage.
         bp->cpu_start = get_cpu_usage();
         // Record current wall-clock time.
-        bp->time_start = time(NULL);
+        bp->time_start = timenow();
 
         // Do it!
-        solve_fields(bp, NULL);
+        search_fields(bp, 0);
 
         // Clean up the indices...
-        for (I=0; I<Nindexes; I++) {
-            index_t* index = get_index(bp, I);
-            done_with_index(bp, I, index);
-        }
+        for (I=0; I<Nindexes; I++)
+            done_with_index(bp, I, pl_get(loaded, I));
+        pl_free(loaded);
         solver_clear_indexes(sp);
 
     } else {
+        prefetcher_t* pf = NULL;
+
+        if (bp->prefetch > 0 && Nindexes > 1)
+            pf = prefetcher_start(bp);
 
         for (I=0; I<Nindexes; I++) {
             index_t* index;
 
-            if (bp->hit_total_timelimit || bp->hit_total_cpulimit)
+            check_cancel(bp);
+            if (bp->hit_total_timelimit || bp->hit_total_cpulimit ||
+                bp->hit_memlimit)
                 break;
             if (bp->single_field_solved)
                 break;
             if (bp->cancelled)
                 break;
+            // (done before the search was cut short.)
+            if ((int)I < bp->resume_index)
+                continue;
+
+            if (pf)
+                prefetcher_advance(pf, I);
 
             // Load the index...
             index = get_index(bp, I);
@@ -473,32 +856,76 @@ void onefield_run(onefield_t* bp) {
             // Record current CPU usage.
             bp->cpu_start = get_cpu_usage();
             // Record current wall-clock time.
-            bp->time_start = time(NULL);
+            bp->time_start = timenow();
 
             // Do it!
-            solve_fields(bp, NULL);
+            search_fields(bp, I);
 
             // Clean up this index...
             done_with_index(bp, I, index);
             solver_clear_indexes(sp);
         }
+        prefetcher_stop(pf);
     }
 
  cleanup:
     // Clean up.
-    xylist_close(bp->xyls);
+    if (bp->xyls)
+        xylist_close(bp->xyls);
+    bp->xyls = NULL;
 
+    PROFILE_BEGIN("write-outputs");
     if (write_solutions(bp))
         exit(-1);
+    PROFILE_END("write-outputs");
 
+    bp->have_solved_wcs = FALSE;
+    onefield_free_solved_matches(bp);
     for (i=0; i<bl_size(bp->solutions); i++) {
         MatchObj* mo = bl_access(bp->solutions, i);
+        if (mo->wcs_valid && (mo->logodds >= bp->logratio_tosolve) &&
+            (!bp->have_solved_wcs || (mo->logodds > best_logodds))) {
+            if (mo->sip)
+                bp->solved_wcs = *(mo->sip);
+            else
+                sip_wrap_tan(&(mo->wcstan), &(bp->solved_wcs));
+            best_logodds = mo->logodds;
+            bp->have_solved_wcs = TRUE;
+            if (bp->keep_matches)
+                keep_solved_matches(bp, mo);
+        }
         verify_free_matchobj(mo);
         onefield_free_matchobj(mo);
     }
     bl_remove_all(bp->solutions);
 }
 
+void onefield_free_solved_matches(onefield_t* bp) {
+    free(bp->solved_fieldxy);
+    free(bp->solved_refxyz);
+    bp->solved_fieldxy = bp->solved_refxyz = NULL;
+    bp->solved_nmatch = 0;
+}
+
+// Copies the matched stars of solution "mo" for "keep_matches".
+static void keep_solved_matches(onefield_t* bp, const MatchObj* mo) {
+    int i, n = 0;
+    onefield_free_solved_matches(bp);
+    if (!mo->theta || !mo->refxyz || !mo->fieldxy)
+        return;
+    bp->solved_fieldxy = malloc(mo->nfield * 2 * sizeof(double));
+    bp->solved_refxyz = malloc(mo->nfield * 3 * sizeof(double));
+    for (i=0; i<MIN(mo->nfield, mo->nbest); i++) {
+        if (mo->theta[i] < 0)
+            continue;
+        memcpy(bp->solved_fieldxy + 2*n, mo->fieldxy + 2*i, 2 * sizeof(double));
+        memcpy(bp->solved_refxyz + 3*n, mo->refxyz + 3*mo->theta[i],
+               3 * sizeof(double));
+        n++;
+    }
+    bp->solved_nmatch = n;
+}
+
 void onefield_init(onefield_t* bp) {
     // Reset params.
     memset(bp, 0, sizeof(onefield_t));
@@ -526,11 +953,11 @@ int onefield_parameters_are_okay(onefield_t* bp, solver_t* sp) {
         logerr("You must set a \"distractors\" proportion.\n");
         return 0;
     }
-    if (!(sl_size(bp->indexnames) || (bp->indexes_inparallel && pl_size(bp->indexes)))) {
+    if (!(sl_size(bp->indexnames) || pl_size(bp->indexes))) {
         logerr("You must specify one or more indexes.\n");
         return 0;
     }
-    if (!bp->fieldfname) {
+    if (!bp->fieldfname && !bp->field_xy) {
         logerr("You must specify a field filename (xylist).\n");
         return 0;
     }
@@ -605,6 +1032,10 @@ void onefield_log_run_parameters(onefield_t* bp) {
     logverb("fieldid %i\n", bp->fieldid);
     if (bp->matchfname)
         logverb("matchfname %s\n", bp->matchfname);
+    if (bp->stats_fname)
+        logverb("stats_fname %s\n", bp->stats_fname);
+    if (bp->trace_fname)
+        logverb("trace_fname %s\n", bp->trace_fname);
     if (bp->solved_in)
         logverb("solved_in %s\n", bp->solved_in);
     if (bp->solved_out)
@@ -621,6 +1052,8 @@ void onefield_log_run_parameters(onefield_t* bp) {
     logverb("codetol %g\n", sp->codetol);
     logverb("startdepth %i\n", sp->startobj);
     logverb("enddepth %i\n", sp->endobj);
+    if (bp->max_field_read)
+        logverb("max_field_read %i\n", bp->max_field_read);
     logverb("fieldunits_lower %g\n", sp->funits_lower);
     logverb("fieldunits_upper %g\n", sp->funits_upper);
     logverb("verify_pix %g\n", sp->verify_pix);
@@ -645,15 +1078,29 @@ void onefield_cleanup(onefield_t* bp) {
     bl_free(bp->verify_wcs_list);
     sl_free2(bp->rdls_tagalong);
 
+    if (bp->statsfid) {
+        fprintf(bp->statsfid, "\n]\n");
+        if (fclose(bp->statsfid))
+            SYSERROR("Failed to close solver stats file \"%s\"", bp->stats_fname);
+        bp->statsfid = NULL;
+    }
+    solver_trace_close(bp->trace);
+    bp->trace = NULL;
+
     free(bp->cancelfname);
     free(bp->fieldfname);
     free(bp->fieldid_key);
     free(bp->indexrdlsfname);
     free(bp->scamp_fname);
     free(bp->corr_fname);
+    free(bp->stats_fname);
+    free(bp->trace_fname);
     free(bp->matchfname);
     free(bp->solved_in);
     free(bp->solved_out);
+    solvedfile_map_close(bp->solved_in_map);
+    solvedfile_map_close(bp->solved_out_map);
+    bp->solved_in_map = bp->solved_out_map = NULL;
     free(bp->wcs_template);
     free(bp->xcolname);
     free(bp->ycolname);
@@ -673,13 +1120,16 @@ static int sort_rdls(MatchObj* mymo, onefield_t* bp) {
         colname++;
         asc = FALSE;
     }
+    AN_THREAD_LOCK(tagalong_lock);
     tagalong = startree_get_tagalong(sp->index->starkd);
     if (!tagalong) {
+        AN_THREAD_UNLOCK(tagalong_lock);
         ERROR("Failed to find tag-along table in index");
         return -1;
     }
     sortdata = fitstable_read_column_inds(tagalong, colname, fitscolumn_double_type(),
                                           mymo->refstarid, mymo->nindex);
+    AN_THREAD_UNLOCK(tagalong_lock);
     if (!sortdata) {
         ERROR("Failed to read data for column \"%s\" in index", colname);
         return -1;
@@ -689,15 +1139,12 @@ static int sort_rdls(MatchObj* mymo, onefield_t* bp) {
                   perm, mymo->nindex);
     free(sortdata);
 
-    if (mymo->refxyz)
-        permutation_apply(perm, mymo->nindex, mymo->refxyz, mymo->refxyz, 3*sizeof(double));
-    // probably not set yet, but what the heck...
-    if (mymo->refradec)
-        permutation_apply(perm, mymo->nindex, mymo->refradec,  mymo->refradec, 2*sizeof(double));
-    if (mymo->refxy)
-        permutation_apply(perm, mymo->nindex, mymo->refxy,     mymo->refxy,    2*sizeof(double));
-    if (mymo->refstarid)
-        permutation_apply(perm, mymo->nindex, mymo->refstarid, mymo->refstarid,  sizeof(int));
+    {
+        // (refradec and refxy are probably not set yet, but what the heck...)
+        void* arrays[] = { mymo->refxyz, mymo->refradec, mymo->refxy, mymo->refstarid };
+        int sizes[] = { 3*sizeof(double), 2*sizeof(double), 2*sizeof(double), sizeof(int) };
+        permutation_apply_multi(perm, mymo->nindex, arrays, sizes, 4);
+    }
     if (mymo->theta)
         for (i=0; i<mymo->nfield; i++) {
             if (mymo->theta[i] < 0)
@@ -746,10 +1193,9 @@ static anbool record_match_callback(MatchObj* mo, void* userdata) {
 
         logdebug("Converting %i reference stars from xyz to radec\n", mymo->nindex);
         mymo->refradec = malloc(mymo->nindex * 2 * sizeof(double));
-        for (i=0; i<mymo->nindex; i++) {
-            xyzarr2radecdegarr(mymo->refxyz+i*3, mymo->refradec+i*2);
+        xyzarr2radecdegarr_batch(mymo->refxyz, mymo->refradec, mymo->nindex);
+        for (i=0; i<mymo->nindex; i++)
             logdebug("  %i: radec %.2f,%.2f\n", i, mymo->refradec[i*2], mymo->refradec[i*2+1]);
-        }
 
         mymo->fieldxy = malloc(mymo->nfield * 2 * sizeof(double));
         // whew!
@@ -765,10 +1211,15 @@ static anbool record_match_callback(MatchObj* mo, void* userdata) {
         // FIXME -- we don't support specifying individual fields (yet)
         assert(bp->xyls_tagalong_all);
         assert(!bp->xyls_tagalong);
-        if (bp->xyls_tagalong_all)
+        if (bp->xyls_tagalong_all && bp->xyls)
             grab_field_tagalong_data(mymo, bp->xyls, mymo->nfield);
     }
 
+    if (bp->keep_matches && !mymo->fieldxy) {
+        mymo->fieldxy = malloc(mymo->nfield * 2 * sizeof(double));
+        memcpy(mymo->fieldxy, bp->solver.vf->xy, mymo->nfield * 2 * sizeof(double));
+    }
+
     if (mymo->logodds < bp->logratio_tosolve)
         return FALSE;
 
@@ -882,119 +1333,366 @@ static void remove_invalid_fields(il* fieldlist, int maxfield) {
     }
 }
 
-static void solve_fields(onefield_t* bp, sip_t* verify_wcs) {
+// Solves (or, with the "nverify" WCSes "verify_wcs", verifies) field
+// "fieldnum".  Returns FALSE if the field was skipped.
+static anbool solve_field(onefield_t* bp, int fieldnum, sip_t* verify_wcs,
+                          int nverify) {
     solver_t* sp = &(bp->solver);
-    double last_utime, last_stime;
-    double utime, stime;
-    struct timeval wtime, last_wtime;
-    int fi;
+    MatchObj template;
+    qfits_header* fieldhdr = NULL;
+    anbool ran = FALSE;
+    double t0, cpu0;
+
+    memset(&template, 0, sizeof(MatchObj));
+    template.fieldnum = fieldnum;
+    template.fieldfile = bp->fieldid;
+
+    // Get the FIELDID string from the xyls FITS header.
+    if (bp->xyls && xylist_open_field(bp->xyls, fieldnum)) {
+        logerr("Failed to open extension %i in xylist.\n", fieldnum);
+        goto cleanup;
+    }
+    if (bp->xyls)
+        fieldhdr = xylist_get_header(bp->xyls);
+    if (fieldhdr) {
+        char* idstr = fits_get_dupstring(fieldhdr, bp->fieldid_key);
+        if (idstr)
+            strncpy(template.fieldname, idstr, sizeof(template.fieldname) - 1);
+        free(idstr);
+    }
 
-    get_resource_stats(&last_utime, &last_stime, NULL);
-    gettimeofday(&last_wtime, NULL);
+    // Has the field already been solved?
+    if (is_field_solved(bp, fieldnum))
+        goto cleanup;
 
-    for (fi = 0; fi < il_size(bp->fieldlist); fi++) {
-        int fieldnum;
-        MatchObj template ;
-        qfits_header* fieldhdr = NULL;
+    // Get the field.
+    if (bp->field_xy)
+        solver_set_field(sp, starxy_subset(bp->field_xy,
+                                           (bp->max_field_read > 0) ?
+                                           MIN(bp->max_field_read, starxy_n(bp->field_xy)) :
+                                           starxy_n(bp->field_xy)));
+    else if (bp->max_field_read > 0)
+        solver_set_field(sp, xylist_read_field_rows(bp->xyls, 0,
+                                                    bp->max_field_read, NULL));
+    else
+        solver_set_field(sp, xylist_read_field(bp->xyls, NULL));
+    if (!sp->fieldxy_orig) {
+        logerr("Failed to read xylist field.\n");
+        goto cleanup;
+    }
 
-        fieldnum = il_get(bp->fieldlist, fi);
+    solver_reset_counters(sp);
+    solver_reset_best_match(sp);
 
-        memset(&template, 0, sizeof(MatchObj));
-        template.fieldnum = fieldnum;
-        template.fieldfile = bp->fieldid;
+    sp->mo_template = &template;
+    sp->record_match_callback = record_match_callback;
+    sp->timer_callback = timer_callback;
+    sp->userdata = bp;
 
-        // Get the FIELDID string from the xyls FITS header.
-        if (xylist_open_field(bp->xyls, fieldnum)) {
-            logerr("Failed to open extension %i in xylist.\n", fieldnum);
-            goto cleanup;
+    bp->fieldnum = fieldnum;
+    bp->nsolves_sofar = 0;
+
+    solver_preprocess_field(sp);
+
+    if (verify_wcs) {
+        //MatchObj mo;
+        logmsg("Verifying WCS of field %i.\n", fieldnum);
+        solver_verify_sip_wcses(sp, verify_wcs, nverify); //, &mo);
+        logmsg(" --> log-odds %g\n", sp->best_logodds);
+
+    } else {
+        logverb("Solving field %i.\n", fieldnum);
+        sp->distance_from_quad_bonus = TRUE;
+        solver_log_params(sp);
+
+        // The real thing
+        bp->search_stopped = FALSE;
+        t0 = timenow();
+        cpu0 = get_cpu_usage();
+        solver_run(sp);
+        if (bp->trace)
+            solver_trace_record(bp->trace, sp, fieldnum, bp->logratio_tosolve,
+                                timenow() - t0, get_cpu_usage() - cpu0);
+
+        check_cancel(bp);
+        if (bp->search_stopped && !sp->best_match_solves &&
+            (bp->stopped_object == -1))
+            bp->stopped_object = sp->last_examined_object;
+        if (sp->have_best_match && !sp->best_match_solves &&
+            sp->best_match.wcs_valid &&
+            (!bp->have_best_unsolved ||
+             (sp->best_match.logodds > bp->best_unsolved_logodds))) {
+            bp->have_best_unsolved = TRUE;
+            bp->best_unsolved_logodds = sp->best_match.logodds;
+            bp->best_unsolved_wcs = sp->best_match.wcstan;
         }
-        fieldhdr = xylist_get_header(bp->xyls);
-        if (fieldhdr) {
-            char* idstr = fits_get_dupstring(fieldhdr, bp->fieldid_key);
-            if (idstr)
-                strncpy(template.fieldname, idstr, sizeof(template.fieldname) - 1);
-            free(idstr);
+        logverb("Field %i: tried %i quads, matched %i codes.\n",
+                fieldnum, sp->numtries, sp->nummatches);
+
+        if (sp->maxquads && sp->numtries >= sp->maxquads)
+            logmsg("  exceeded the number of quads to try: %i >= %i.\n",
+                   sp->numtries, sp->maxquads);
+        if (sp->maxmatches && sp->nummatches >= sp->maxmatches)
+            logmsg("  exceeded the number of quads to match: %i >= %i.\n",
+                   sp->nummatches, sp->maxmatches);
+        if (bp->cancelled)
+            logmsg("  cancelled at user request.\n");
+
+        solver_log_stats(sp);
+        if (bp->statsfid)
+            write_stats(bp, fieldnum);
+        if (sp->collect_stats) {
+            int k;
+            for (k=0; k<SOLVER_N_STAGES; k++) {
+                bp->stage_wall[k] += sp->stats.wall[k];
+                bp->stage_cpu [k] += sp->stats.cpu [k];
+            }
         }
+        bp->numtries += sp->numtries;
+        bp->nummatches += sp->nummatches;
+        bp->num_verified += sp->num_verified;
+    }
+
+
+    if (sp->best_match_solves) {
+        solved_field(bp, fieldnum);
+    } else if (!verify_wcs) {
+        // Field unsolved.
+        logerr("Field %i did not solve", fieldnum);
+        if (bp->solver.index && bp->solver.index->indexname) {
+            char* copy;
+            char* base;
+            copy = strdup(bp->solver.index->indexname);
+            base = strdup(basename(copy));
+            free(copy);
+            logerr(" (index %s", base);
+            free(base);
+            if (bp->solver.endobj)
+                logerr(", field objects %i-%i", bp->solver.startobj+1, bp->solver.endobj);
+            logerr(")");
+        }
+        logerr(".\n");
+        if (sp->have_best_match) {
+            logverb("Best match encountered: ");
+            matchobj_print(&(sp->best_match), log_get_level());
+        } else {
+            logverb("Best odds encountered: %g\n", exp(sp->best_logodds));
+        }
+    }
 
-        // Has the field already been solved?
-        if (is_field_solved(bp, fieldnum))
-            goto cleanup;
+    solver_free_field(sp);
+    ran = TRUE;
 
-        // Get the field.
-        solver_set_field(sp, xylist_read_field(bp->xyls, NULL));
-        if (!sp->fieldxy_orig) {
-            logerr("Failed to read xylist field.\n");
-            goto cleanup;
-        }
+ cleanup:
+    solver_cleanup_field(sp);
+    return ran;
+}
 
-        solver_reset_counters(sp);
-        solver_reset_best_match(sp);
+/*
+ Field-parallel solving: "nfieldthreads" copies of the onefield_t, each
+ with its own solver and xylist handle (but sharing the settings and
+ indexes), take fields from "fieldlist" in turn.  Each copy keeps its
+ own solutions and totals, which are merged into the original
+ afterwards; the solutions are sorted before they are written, and the
+ stats records are buffered and written in field-list order, so the
+ output doesn't depend on which thread solved what.
+ */
+struct field_queue {
+    onefield_t* bp;
+    sip_t* verify_wcs;
+    int nverify;
+    // the next entry in bp->fieldlist to solve.
+    int next;
+    // the stats record of each field (by position in bp->fieldlist).
+    char** stats;
+    pthread_mutex_t lock;
+};
 
-        sp->mo_template = &template;
-        sp->record_match_callback = record_match_callback;
-        sp->timer_callback = timer_callback;
-        sp->userdata = bp;
+struct field_worker {
+    struct field_queue* queue;
+    onefield_t bp;
+};
 
-        bp->fieldnum = fieldnum;
-        bp->nsolves_sofar = 0;
+static void field_worker_init(onefield_t* w, onefield_t* bp) {
+    solver_t* sp = &(w->solver);
+    size_t i;
+
+    memcpy(w, bp, sizeof(onefield_t));
+    // the solver's per-field state is its own.
+    sp->indexes = pl_new(16);
+    for (i=0; i<pl_size(bp->solver.indexes); i++)
+        pl_append(sp->indexes, pl_get(bp->solver.indexes, i));
+    sp->fieldxy = NULL;
+    sp->fieldxy_orig = NULL;
+    sp->vf = NULL;
+    sp->pairtable = NULL;
+    sp->codebatch = NULL;
+    sp->fitws = NULL;
+    sp->pquad_arena = NULL;
+    sp->have_best_match = FALSE;
+    sp->best_match_solves = FALSE;
+    memset(&(sp->best_match), 0, sizeof(MatchObj));
+    sp->best_index = NULL;
+    memset(&(sp->stats), 0, sizeof(solver_stats_t));
+    sp->stats.stage = -1;
+    if (bp->solver.predistort) {
+        sp->predistort = malloc(sizeof(sip_t));
+        memcpy(sp->predistort, bp->solver.predistort, sizeof(sip_t));
+    }
+
+    w->xyls = xylist_open(bp->fieldfname);
+    if (!w->xyls) {
+        ERROR("Failed to read xylist.\n");
+        exit( -1);
+    }
+    xylist_set_xname(w->xyls, bp->xcolname);
+    xylist_set_yname(w->xyls, bp->ycolname);
+    xylist_set_include_flux(w->xyls, FALSE);
+    xylist_set_include_background(w->xyls, FALSE);
+    w->solutions = bl_new(16, sizeof(MatchObj));
+    w->statsfid = NULL;
+    memset(w->stage_wall, 0, sizeof(w->stage_wall));
+    memset(w->stage_cpu, 0, sizeof(w->stage_cpu));
+    w->numtries = w->nummatches = w->num_verified = 0;
+    w->solved_indexid = 0;
+}
 
-        solver_preprocess_field(sp);
+// Moves the solutions and totals of worker "w" into "bp".
+static void field_worker_finish(onefield_t* w, onefield_t* bp) {
+    size_t i;
+    int k;
+    for (i=0; i<bl_size(w->solutions); i++)
+        bl_insert_sorted(bp->solutions, bl_access(w->solutions, i),
+                         compare_matchobjs);
+    bl_free(w->solutions);
+    for (k=0; k<SOLVER_N_STAGES; k++) {
+        bp->stage_wall[k] += w->stage_wall[k];
+        bp->stage_cpu [k] += w->stage_cpu [k];
+    }
+    bp->numtries += w->numtries;
+    bp->nummatches += w->nummatches;
+    bp->num_verified += w->num_verified;
+    if (w->solved_indexid)
+        bp->solved_indexid = w->solved_indexid;
+    bp->cancelled |= w->cancelled;
+    bp->hit_timelimit |= w->hit_timelimit;
+    bp->hit_cpulimit |= w->hit_cpulimit;
+    bp->hit_total_timelimit |= w->hit_total_timelimit;
+    bp->hit_total_cpulimit |= w->hit_total_cpulimit;
+    bp->hit_memlimit |= w->hit_memlimit;
+    xylist_close(w->xyls);
+    solver_cleanup(&(w->solver));
+}
 
-        if (verify_wcs) {
-            //MatchObj mo;
-            logmsg("Verifying WCS of field %i.\n", fieldnum);
-            solver_verify_sip_wcs(sp, verify_wcs); //, &mo);
-            logmsg(" --> log-odds %g\n", sp->best_logodds);
+static void* field_worker_thread(void* arg) {
+    struct field_worker* worker = arg;
+    struct field_queue* q = worker->queue;
+    onefield_t* bp = &(worker->bp);
+    for (;;) {
+        int fi;
+        char* buf = NULL;
+        size_t len = 0;
+
+        check_cancel(bp);
+        if (bp->cancelled || bp->hit_total_timelimit || bp->hit_memlimit)
+            break;
+        pthread_mutex_lock(&q->lock);
+        fi = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (fi >= il_size(bp->fieldlist))
+            break;
+        if (q->stats) {
+            bp->statsfid = open_memstream(&buf, &len);
+            bp->nstats = 0;
+        }
+        solve_field(bp, il_get(bp->fieldlist, fi), q->verify_wcs, q->nverify);
+        if (bp->statsfid) {
+            fclose(bp->statsfid);
+            bp->statsfid = NULL;
+            q->stats[fi] = buf;
+        }
+    }
+    return NULL;
+}
 
-        } else {
-            logverb("Solving field %i.\n", fieldnum);
-            sp->distance_from_quad_bonus = TRUE;
-            solver_log_params(sp);
-
-            // The real thing
-            solver_run(sp);
-
-            logverb("Field %i: tried %i quads, matched %i codes.\n",
-                    fieldnum, sp->numtries, sp->nummatches);
-
-            if (sp->maxquads && sp->numtries >= sp->maxquads)
-                logmsg("  exceeded the number of quads to try: %i >= %i.\n",
-                       sp->numtries, sp->maxquads);
-            if (sp->maxmatches && sp->nummatches >= sp->maxmatches)
-                logmsg("  exceeded the number of quads to match: %i >= %i.\n",
-                       sp->nummatches, sp->maxmatches);
-            if (bp->cancelled)
-                logmsg("  cancelled at user request.\n");
+static void solve_fields_parallel(onefield_t* bp, sip_t* verify_wcs,
+                                  int nverify) {
+    struct field_queue q;
+    struct field_worker* workers;
+    pthread_t* threads;
+    int nthreads, nstarted, i;
+    int N = il_size(bp->fieldlist);
+
+    nthreads = MIN(bp->nfieldthreads, N);
+    logverb("Solving %i fields on %i threads.\n", N, nthreads);
+
+    memset(&q, 0, sizeof(q));
+    q.bp = bp;
+    q.verify_wcs = verify_wcs;
+    q.nverify = nverify;
+    if (bp->statsfid)
+        q.stats = calloc(N, sizeof(char*));
+    pthread_mutex_init(&q.lock, NULL);
+    // (all the copies add to the same list of tag-along columns.)
+    if (bp->rdls_tagalong_all && !bp->rdls_tagalong)
+        bp->rdls_tagalong = sl_new(16);
+
+    workers = calloc(nthreads, sizeof(struct field_worker));
+    for (i=0; i<nthreads; i++) {
+        workers[i].queue = &q;
+        field_worker_init(&(workers[i].bp), bp);
+    }
+    // the calling thread is the first worker.
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (nstarted=1; nstarted<nthreads; nstarted++) {
+        if (pthread_create(threads + nstarted, NULL, field_worker_thread,
+                           workers + nstarted)) {
+            SYSERROR("Failed to start field thread %i", nstarted);
+            break;
+        }
+    }
+    field_worker_thread(workers);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i=0; i<nthreads; i++)
+        field_worker_finish(&(workers[i].bp), bp);
+    free(workers);
+    if (q.stats) {
+        for (i=0; i<N; i++) {
+            if (!q.stats[i])
+                continue;
+            fprintf(bp->statsfid, "%s%s", (bp->nstats ? "," : ""), q.stats[i]);
+            bp->nstats++;
+            free(q.stats[i]);
         }
+        free(q.stats);
+    }
+    pthread_mutex_destroy(&q.lock);
+}
 
+static void solve_fields(onefield_t* bp, sip_t* verify_wcs, int nverify) {
+    double last_utime, last_stime;
+    double utime, stime;
+    struct timeval wtime, last_wtime;
+    int fi;
 
-        if (sp->best_match_solves) {
-            solved_field(bp, fieldnum);
-        } else if (!verify_wcs) {
-            // Field unsolved.
-            logerr("Field %i did not solve", fieldnum);
-            if (bp->solver.index && bp->solver.index->indexname) {
-                char* copy;
-                char* base;
-                copy = strdup(bp->solver.index->indexname);
-                base = strdup(basename(copy));
-                free(copy);
-                logerr(" (index %s", base);
-                free(base);
-                if (bp->solver.endobj)
-                    logerr(", field objects %i-%i", bp->solver.startobj+1, bp->solver.endobj);
-                logerr(")");
-            }
-            logerr(".\n");
-            if (sp->have_best_match) {
-                logverb("Best match encountered: ");
-                matchobj_print(&(sp->best_match), log_get_level());
-            } else {
-                logverb("Best odds encountered: %g\n", exp(sp->best_logodds));
-            }
-        }
+    if (bp->nfieldthreads > 1 && il_size(bp->fieldlist) > 1 && !bp->field_xy) {
+        solve_fields_parallel(bp, verify_wcs, nverify);
+        return;
+    }
 
-        solver_free_field(sp);
+    get_resource_stats(&last_utime, &last_stime, NULL);
+    gettimeofday(&last_wtime, NULL);
+
+    for (fi = 0; fi < il_size(bp->fieldlist); fi++) {
+        check_cancel(bp);
+        if (bp->cancelled || bp->hit_total_timelimit || bp->hit_memlimit)
+            break;
+
+        if (!solve_field(bp, il_get(bp->fieldlist, fi), verify_wcs, nverify))
+            continue;
 
         get_resource_stats(&utime, &stime, NULL);
         gettimeofday(&wtime, NULL);
@@ -1006,16 +1704,17 @@ static void solve_fields(onefield_t* bp, sip_t* verify_wcs) {
         last_utime = utime;
         last_stime = stime;
         last_wtime = wtime;
-
-    cleanup:
-        solver_cleanup_field(sp);
     }
 }
 
 static anbool is_field_solved(onefield_t* bp, int fieldnum) {
     anbool solved = FALSE;
     if (bp->solved_in) {
-        solved = solvedfile_get(bp->solved_in, fieldnum);
+        solvedfile_map_t* sf;
+        AN_THREAD_LOCK(solvedfile_lock);
+        sf = get_solved_map(&bp->solved_in_map, bp->solved_in);
+        solved = (sf && solvedfile_map_get(sf, fieldnum) == 1);
+        AN_THREAD_UNLOCK(solvedfile_lock);
         logverb("Checking %s file %i to see if the field is solved: %s.\n",
                 bp->solved_in, fieldnum, (solved ? "yes" : "no"));
     }
@@ -1031,10 +1730,15 @@ static void solved_field(onefield_t* bp, int fieldnum) {
     // Record in solved file, or send to solved server.
     if (bp->solved_out) {
         logmsg("Field %i solved: writing to file %s to indicate this.\n", fieldnum, bp->solved_out);
-        if (solvedfile_set(bp->solved_out, fieldnum)) {
+        solvedfile_map_t* sf;
+        AN_THREAD_LOCK(solvedfile_lock);
+        sf = get_solved_map(&bp->solved_out_map, bp->solved_out);
+        if (!sf || solvedfile_map_set(sf, fieldnum)) {
             logerr("Failed to write solvedfile %s.\n", bp->solved_out);
         }
+        AN_THREAD_UNLOCK(solvedfile_lock);
     }
+    bp->solved_indexid = bp->solver.best_match.indexid;
     // If we're just solving a single field, and we solved it...
     if (il_size(bp->fieldlist) == 1)
         bp->single_field_solved = TRUE;
@@ -1145,7 +1849,7 @@ static void remove_duplicate_solutions(onefield_t* bp) {
     }
 }
 
-static int write_match_file(onefield_t* bp) {
+static int write_match_file(onefield_t* bp, const char* date) {
     int i;
     bp->mf = matchfile_open_for_writing(bp->matchfname);
     if (!bp->mf) {
@@ -1153,7 +1857,7 @@ static int write_match_file(onefield_t* bp) {
         return -1;
     }
     BOILERPLATE_ADD_FITS_HEADERS(bp->mf->header);
-    qfits_header_add(bp->mf->header, "DATE", qfits_get_datetime_iso8601(), "Date this file was created.", NULL);
+    qfits_header_add(bp->mf->header, "DATE", date, "Date this file was created.", NULL);
     add_onefield_params(bp, bp->mf->header);
     if (matchfile_write_headers(bp->mf)) {
         logerr("Failed to write matchfile header.\n");
@@ -1175,7 +1879,7 @@ static int write_match_file(onefield_t* bp) {
     return 0;
 }
 
-static int write_rdls_file(onefield_t* bp) {
+static int write_rdls_file(onefield_t* bp, const char* date) {
     int i;
     qfits_header* h;
     bp->indexrdls = rdlist_open_for_writing(bp->indexrdlsfname);
@@ -1188,7 +1892,7 @@ static int write_rdls_file(onefield_t* bp) {
 
     BOILERPLATE_ADD_FITS_HEADERS(h);
     fits_add_long_history(h, "This \"indexrdls\" file contains the RA/DEC of index objects that were found inside a solved field.");
-    qfits_header_add(h, "DATE", qfits_get_datetime_iso8601(), "Date this file was created.", NULL);
+    qfits_header_add(h, "DATE", date, "Date this file was created.", NULL);
     add_onefield_params(bp, h);
     if (rdlist_write_primary_header(bp->indexrdls)) {
         logerr("Failed to write index RDLS header.\n");
@@ -1251,13 +1955,12 @@ static int write_rdls_file(onefield_t* bp) {
     return 0;
 }
 
-static int write_wcs_file(onefield_t* bp) {
+static int write_wcs_file(onefield_t* bp, const char* date) {
     int i;
     for (i=0; i<bl_size(bp->solutions); i++) {
         char wcs_fn[1024];
         FILE* fout;
         qfits_header* hdr;
-        char* tm;
 
         MatchObj* mo = bl_access(bp->solutions, i);
         snprintf(wcs_fn, sizeof(wcs_fn), bp->wcs_template, mo->fieldnum);
@@ -1275,8 +1978,7 @@ static int write_wcs_file(onefield_t* bp) {
 
         BOILERPLATE_ADD_FITS_HEADERS(hdr);
         qfits_header_add(hdr, "HISTORY", "This is a WCS header was created by Astrometry.net.", NULL, NULL);
-        tm = qfits_get_datetime_iso8601();
-        qfits_header_add(hdr, "DATE", tm, "Date this file was created.", NULL);
+        qfits_header_add(hdr, "DATE", date, "Date this file was created.", NULL);
         add_onefield_params(bp, hdr);
         fits_add_long_comment(hdr, "-- properties of the matching quad: --");
         fits_add_long_comment(hdr, "index id: %i", mo->indexid);
@@ -1315,7 +2017,7 @@ static int write_wcs_file(onefield_t* bp) {
     return 0;
 }
 
-static int write_scamp_file(onefield_t* bp) {
+static int write_scamp_file(onefield_t* bp, const char* date) {
     int i;
     scamp_cat_t* scamp;
     qfits_header* hdr = NULL;
@@ -1363,7 +2065,32 @@ static int write_scamp_file(onefield_t* bp) {
     return 0;
 }
 
-static int write_corr_file(onefield_t* bp) {
+// Writes the rows of a tag-along column for the correspondences of "mo";
+// "index" says whether it belongs to the index stars or the field stars.
+static int write_corr_tagalong(fitstable_t* tab, tagalong_t* tag,
+                               const MatchObj* mo, anbool index) {
+    char* buf = malloc((size_t)mo->nfield * tag->itemsize);
+    int row = 0;
+    int k, rtn = 0;
+    for (k=0; k<mo->nfield; k++) {
+        int ri = mo->theta[k];
+        if (ri < 0)
+            continue;
+        memcpy(buf + (size_t)row * tag->itemsize,
+               (char*)tag->data + (size_t)(index ? ri : k) * tag->itemsize,
+               tag->itemsize);
+        row++;
+    }
+    if (row && fitstable_write_one_column(tab, tag->colnum, 0, row, buf,
+                                          tag->itemsize)) {
+        ERROR("Failed to write tag-along column %s to correspondences file", tag->name);
+        rtn = -1;
+    }
+    free(buf);
+    return rtn;
+}
+
+static int write_corr_file(onefield_t* bp, const char* date) {
     int i;
     fitstable_t* tab;
     tab = fitstable_open_for_writing(bp->corr_fname);
@@ -1463,35 +2190,19 @@ static int write_corr_file(onefield_t* bp) {
             }
         }
 
+        // Gather each tag-along column's matched rows and write them at once.
         if (mo->tagalong) {
             for (j=0; j<bl_size(mo->tagalong); j++) {
                 tagalong_t* tag = bl_access(mo->tagalong, j);
-                int row = 0;
-                int k;
-                // Ugh, we write each datum individually...
-                for (k=0; k<mo->nfield; k++) {
-                    int ri = mo->theta[k];
-                    if (ri < 0)
-                        continue;
-                    fitstable_write_one_column(tab, tag->colnum, row, 1,
-                                               (char*)tag->data + ri*tag->itemsize, 0);
-                    row++;
-                }
+                if (write_corr_tagalong(tab, tag, mo, TRUE))
+                    return -1;
             }
         }
         if (mo->field_tagalong) {
             for (j=0; j<bl_size(mo->field_tagalong); j++) {
                 tagalong_t* tag = bl_access(mo->field_tagalong, j);
-                int row = 0;
-                int k;
-                // Ugh, we write each datum individually...
-                for (k=0; k<mo->nfield; k++) {
-                    if (mo->theta[k] < 0)
-                        continue;
-                    fitstable_write_one_column(tab, tag->colnum, row, 1,
-                                               (char*)tag->data + k*tag->itemsize, 0);
-                    row++;
-                }
+                if (write_corr_tagalong(tab, tag, mo, FALSE))
+                    return -1;
             }
         }
 		
@@ -1512,8 +2223,66 @@ static int write_corr_file(onefield_t* bp) {
     return 0;
 }
 
+// Appends a record for the run that just finished to the stats file.
+static void write_stats(onefield_t* bp, int fieldnum) {
+    FILE* fid = bp->statsfid;
+    fprintf(fid, "%s\n{\"field\": %i, \"solver\": ", (bp->nstats ? "," : ""),
+            fieldnum);
+    if (solver_write_stats_json(&(bp->solver), fid))
+        ERROR("Failed to write stats for field %i to \"%s\"", fieldnum,
+              bp->stats_fname);
+    fprintf(fid, "}");
+    bp->nstats++;
+}
+
+#define N_OUTPUT_WRITERS 3
+
+struct output_writer {
+    int (*write)(onefield_t* bp, const char* date);
+    onefield_t* bp;
+    const char* date;
+    int rtn;
+};
+
+static void* output_writer_thread(void* arg) {
+    struct output_writer* w = arg;
+    w->rtn = w->write(w->bp, w->date);
+    return NULL;
+}
+
+// Runs the writers, each on a thread of its own if "parallel" (the
+// calling thread runs the last one).  They must not modify any of the
+// same data.
+static int run_output_writers(struct output_writer* w, int N,
+                              anbool parallel) {
+    pthread_t threads[N_OUTPUT_WRITERS];
+    anbool started[N_OUTPUT_WRITERS];
+    int i, rtn = 0;
+    for (i=0; i<N; i++) {
+        started[i] = FALSE;
+        if (parallel && i < N-1) {
+            if (pthread_create(threads + i, NULL, output_writer_thread, w + i) == 0) {
+                started[i] = TRUE;
+                continue;
+            }
+            SYSERROR("Failed to start output-writer thread; writing in this one");
+        }
+        output_writer_thread(w + i);
+    }
+    for (i=0; i<N; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (w[i].rtn)
+            rtn = -1;
+    }
+    return rtn;
+}
+
 static int write_solutions(onefield_t* bp) {
     anbool got_solutions = (bl_size(bp->solutions) > 0);
+    struct output_writer w[N_OUTPUT_WRITERS];
+    char date[32];
+    int i, N;
 
     // If we found no solution, don't write empty output files!
     if (!got_solutions)
@@ -1522,31 +2291,34 @@ static int write_solutions(onefield_t* bp) {
     // The solutions can fall out of order because tweak2() updates their logodds.
     bl_sort(bp->solutions, compare_matchobjs);
 
-    if (bp->matchfname) {
-        if (write_match_file(bp))
-            return -1;
-    }
-    if (bp->indexrdlsfname) {
-        if (write_rdls_file(bp))
-            return -1;
+    // (qfits_get_datetime_iso8601() isn't thread-safe.)
+    strncpy(date, qfits_get_datetime_iso8601(), sizeof(date) - 1);
+    date[sizeof(date) - 1] = '\0';
+    memset(w, 0, sizeof(w));
+    for (i=0; i<N_OUTPUT_WRITERS; i++) {
+        w[i].bp = bp;
+        w[i].date = date;
     }
 
+    N = 0;
+    if (bp->matchfname)
+        w[N++].write = write_match_file;
+    if (bp->indexrdlsfname)
+        w[N++].write = write_rdls_file;
+    if (run_output_writers(w, N, bp->parallel_writers))
+        return -1;
+
     // We only want the best solution for each field in the following outputs:
     remove_duplicate_solutions(bp);
 
-    if (bp->wcs_template) {
-        if (write_wcs_file(bp))
-            return -1;
-    }
-    if (bp->scamp_fname) {
-        if (write_scamp_file(bp))
-            return -1;
-    }
-    if (bp->corr_fname) {
-        if (write_corr_file(bp))
-            return -1;
-    }
-    return 0;
+    N = 0;
+    if (bp->wcs_template)
+        w[N++].write = write_wcs_file;
+    if (bp->scamp_fname)
+        w[N++].write = write_scamp_file;
+    if (bp->corr_fname)
+        w[N++].write = write_corr_file;
+    return run_output_writers(w, N, bp->parallel_writers);
 }
 
 static int compare_matchobjs(const void* v1, const void* v2) {
@@ -6,6 +6,8 @@
 #ifndef PQUAD_H
 #define PQUAD_H
 
+#include <stdint.h>
+
 /**
  This file is just required for testing purposes (of solver.c)
  */
@@ -19,10 +21,26 @@ struct potential_quad
 	double costheta, sintheta;
 	// (field pixel noise / quad scale in pixels)^2
 	double rel_field_noise2;
-	anbool* inbox;
+	// Bitset of the stars that could be star C, D, ... of a quad
+	// with this AB: bit (i % 64) of inbox[i / 64] is star i.
+	// [PQUAD_INBOX_WORDS(numxy)]; allocated from the solver's "pquad_arena".
+	uint64_t* inbox;
 	int ninbox;
+	// [numxy * 2], code-space positions of the "inbox" stars.
 	double* xy;
 };
 typedef struct potential_quad pquad;
 
+#define PQUAD_INBOX_WORDS(n) (((n) + 63) / 64)
+
+static inline anbool pquad_inbox_get(const pquad* pq, int i) {
+	return (pq->inbox[i >> 6] >> (i & 63)) & 1;
+}
+static inline void pquad_inbox_set(pquad* pq, int i) {
+	pq->inbox[i >> 6] |= ((uint64_t)1 << (i & 63));
+}
+static inline void pquad_inbox_clear(pquad* pq, int i) {
+	pq->inbox[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
 #endif
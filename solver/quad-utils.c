@@ -11,6 +11,7 @@
 #include "starkd.h"
 #include "errors.h"
 #include "log.h"
+#include "os-features.h"
 
 void quad_compute_star_code(const double* starxyz, double* code, int dimquads) {
     double Ax=0, Ay=0;
@@ -54,6 +55,121 @@ void quad_compute_star_code(const double* starxyz, double* code, int dimquads) {
     }
 }
 
+/*
+ quad_compute_star_code() for a block of up to QUAD_CODE_BLOCK quads.
+ The stars are transposed into one array per coordinate, so that each
+ step below is a loop across the quads that the compiler can turn into
+ SIMD instructions.  The arithmetic is that of star_midpoint() and
+ star_coords(), except that the length of eta is found with sqrt()
+ rather than hypot().  A partial block is padded with copies of its
+ last quad and computed in full, so that every quad's code is computed
+ by the same instructions, wherever it falls in a block: how the quads
+ are split into blocks doesn't change the results.
+ */
+static void compute_star_codes_block(const double* starxyz, double* codes,
+                                     int n, int dimquads) {
+    double sx[DQMAX][QUAD_CODE_BLOCK];
+    double sy[DQMAX][QUAD_CODE_BLOCK];
+    double sz[DQMAX][QUAD_CODE_BLOCK];
+    // the code-space positions of the stars: (u, v) in star_coords().
+    double u[DQMAX][QUAD_CODE_BLOCK];
+    double v[DQMAX][QUAD_CODE_BLOCK];
+    double mx[QUAD_CODE_BLOCK], my[QUAD_CODE_BLOCK], mz[QUAD_CODE_BLOCK];
+    double ex[QUAD_CODE_BLOCK], ey[QUAD_CODE_BLOCK];
+    double xx[QUAD_CODE_BLOCK], xy[QUAD_CODE_BLOCK], xz[QUAD_CODE_BLOCK];
+    double cost[QUAD_CODE_BLOCK], sint[QUAD_CODE_BLOCK];
+    double c[DCMAX][QUAD_CODE_BLOCK];
+    int dimcodes = dimquad2dimcode(dimquads);
+    int i, k;
+
+    for (k=0; k<QUAD_CODE_BLOCK; k++)
+        for (i=0; i<dimquads; i++) {
+            const double* s = starxyz + ((size_t)MIN(k, n-1) * dimquads + i) * 3;
+            sx[i][k] = s[0];
+            sy[i][k] = s[1];
+            sz[i][k] = s[2];
+        }
+    // midpoint of A and B, and the tangent-plane axes there.
+    for (k=0; k<QUAD_CODE_BLOCK; k++) {
+        double len, invlen, en, inv_en;
+        mx[k] = sx[0][k] + sx[1][k];
+        my[k] = sy[0][k] + sy[1][k];
+        mz[k] = sz[0][k] + sz[1][k];
+        len = sqrt(mx[k] * mx[k] + my[k] * my[k] + mz[k] * mz[k]);
+        invlen = 1.0 / len;
+        mx[k] *= invlen;
+        my[k] *= invlen;
+        mz[k] *= invlen;
+        en = sqrt(my[k] * my[k] + mx[k] * mx[k]);
+        inv_en = 1.0 / en;
+        ex[k] = -my[k] * inv_en;
+        ey[k] =  mx[k] * inv_en;
+        xx[k] = -mz[k] * ey[k];
+        xy[k] =  mz[k] * ex[k];
+        xz[k] =  mx[k] * ey[k] - my[k] * ex[k];
+    }
+    for (i=0; i<dimquads; i++)
+        for (k=0; k<QUAD_CODE_BLOCK; k++) {
+            double sdotr = sx[i][k] * mx[k] + sy[i][k] * my[k] + sz[i][k] * mz[k];
+            double inv_sdotr = 1.0 / sdotr;
+            u[i][k] = (sx[i][k] * ex[k] + sy[i][k] * ey[k]) * inv_sdotr;
+            v[i][k] = (sx[i][k] * xx[k] + sy[i][k] * xy[k] + sz[i][k] * xz[k]) * inv_sdotr;
+        }
+    // (as in quad_compute_star_code(), x is v and y is u.)
+    for (k=0; k<QUAD_CODE_BLOCK; k++) {
+        double ABx = v[1][k] - v[0][k];
+        double ABy = u[1][k] - u[0][k];
+        double invscale = 1.0 / ((ABx * ABx) + (ABy * ABy));
+        cost[k] = (ABy + ABx) * invscale;
+        sint[k] = (ABy - ABx) * invscale;
+    }
+    for (i=2; i<dimquads; i++)
+        for (k=0; k<QUAD_CODE_BLOCK; k++) {
+            double ADx = v[i][k] - v[0][k];
+            double ADy = u[i][k] - u[0][k];
+            c[2*(i-2) + 0][k] =  ADx * cost[k] + ADy * sint[k];
+            c[2*(i-2) + 1][k] = -ADx * sint[k] + ADy * cost[k];
+        }
+    for (k=0; k<n; k++)
+        for (i=0; i<dimcodes; i++)
+            codes[(size_t)k * dimcodes + i] = c[i][k];
+    // star_coords() has special cases for the poles.
+    for (k=0; k<n; k++)
+        if (mz[k] == 1.0 || mz[k] == -1.0)
+            quad_compute_star_code(starxyz + (size_t)k * dimquads * 3,
+                                   codes + (size_t)k * dimcodes, dimquads);
+}
+
+void quad_compute_star_codes(const double* starxyz, double* codes, int N,
+                             int dimquads) {
+    int dimcodes = dimquad2dimcode(dimquads);
+    int q;
+    for (q=0; q<N; q+=QUAD_CODE_BLOCK)
+        compute_star_codes_block(starxyz + (size_t)q * dimquads * 3,
+                                 codes + (size_t)q * dimcodes,
+                                 MIN(QUAD_CODE_BLOCK, N - q), dimquads);
+}
+
+int quad_compute_codes(const unsigned int* quads, int N, int dimquads,
+                       startree_t* starkd, double* codes) {
+    double starxyz[QUAD_CODE_BLOCK * DQMAX * 3];
+    int dimcodes = dimquad2dimcode(dimquads);
+    int q, k;
+    for (q=0; q<N; q+=QUAD_CODE_BLOCK) {
+        int n = MIN(QUAD_CODE_BLOCK, N - q);
+        for (k=0; k<n*dimquads; k++) {
+            if (startree_get(starkd, quads[(size_t)q * dimquads + k],
+                             starxyz + 3*k)) {
+                ERROR("Failed to get stars belonging to a quad.\n");
+                return -1;
+            }
+        }
+        compute_star_codes_block(starxyz, codes + (size_t)q * dimcodes, n,
+                                 dimquads);
+    }
+    return 0;
+}
+
 void quad_flip_parity(const double* code, double* flipcode, int dimcode) {
     int i;
     // swap CX <-> CY, DX <-> DY.
@@ -5,6 +5,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "starkd.h"
 #include "fitsioutils.h"
@@ -13,8 +15,18 @@
 #include "boilerplate.h"
 #include "starutil.h"
 #include "rdlist.h"
+#include "fitstable.h"
+#include "ioutils.h"
+#include "os-features.h"
+#include "qfits_rw.h"
 
-static const char* OPTIONS = "hvr:d:R:t:Io:T";
+static const char* OPTIONS = "hvr:d:R:t:Io:Tb:j:";
+
+// In batch mode (-b), cones are searched in blocks of this many, and
+// the results of CHUNK_BLOCKS blocks (searched on several threads) are
+// written out before the next chunk is searched.
+#define CONE_BLOCK 256
+#define CHUNK_BLOCKS 64
 
 void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -26,10 +38,388 @@ void printHelp(char* progname) {
            "    [-t <tagalong-column>]\n"
            "    [-T]: tag-along all\n"
            "    [-I]: print indices too\n"
+           "    [-b <cones>]: batch mode: search each cone in a FITS table (columns RA, DEC\n"
+           "         and optionally RADIUS) or a text file (\"ra dec [radius]\" per line;\n"
+           "         \"-\" for stdin), writing all the results with a CONE_ID column\n"
+           "         (the cone's row number, from 0).  -R is the radius of cones without one.\n"
+           "    [-j <threads>]: search on this many threads in batch mode (default 1)\n"
            "    [-v]: +verbose\n"
            "\n", progname);
 }
 
+typedef struct {
+    // cones [i0, i0+n)
+    int i0;
+    int n;
+    kdtree_batch_res_t* res;
+} cone_block_t;
+
+typedef struct {
+    const startree_t* starkd;
+    const double* xyz;
+    const double* r2;
+    cone_block_t* blocks;
+    int nblocks;
+    int next;
+    int failed;
+} cone_job_t;
+
+typedef struct {
+    startree_t* starkd;
+    fitstable_t* tagalong;
+    sl* tag;
+    tfits_type* tagtypes;
+    int* tagarraysizes;
+    anbool getinds;
+    // FITS output, with rows of "rowsize" bytes; or NULL to print text.
+    fitstable_t* out;
+    int rowsize;
+    int* tagoffsets;
+    // scratch space for a block's results.
+    int* inds;
+    char* rows;
+    int capacity;
+} batch_output_t;
+
+static void* cone_worker(void* arg) {
+    cone_job_t* j = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->nblocks) {
+        cone_block_t* blk = j->blocks + b;
+        kdtree_batch_res_t* res;
+        res = kdtree_rangesearch_batch_csr(j->starkd->tree, blk->res,
+                                           j->xyz + (size_t)blk->i0 * 3,
+                                           blk->n, j->r2 + blk->i0,
+                                           KD_OPTIONS_SMALL_RADIUS);
+        if (res)
+            blk->res = res;
+        else
+            j->failed = 1;
+    }
+    return NULL;
+}
+
+static void search_cones(cone_job_t* j, int nthreads) {
+    pthread_t* threads;
+    int t, nstarted = 0;
+    j->next = 0;
+    nthreads = MAX(1, MIN(nthreads, j->nblocks));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, cone_worker, j))
+            break;
+        nstarted++;
+    }
+    cone_worker(j);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
+
+// Reads the cones, returning their number (or -1 on error) and their
+// centers (as xyz) and radii (as distance-squared on the unit sphere).
+static int read_cones(const char* fn, double defradius,
+                      double** p_xyz, double** p_r2) {
+    double* ra = NULL;
+    double* dec = NULL;
+    double* radius = NULL;
+    int i, N;
+
+    if (!streq(fn, "-") && (qfits_is_fits(fn) == 1)) {
+        fitstable_t* tab = fitstable_open(fn);
+        tfits_type dubl = fitscolumn_double_type();
+        if (!tab) {
+            ERROR("Failed to open cones table %s", fn);
+            return -1;
+        }
+        N = fitstable_nrows(tab);
+        ra = fitstable_read_column(tab, "RA", dubl);
+        dec = fitstable_read_column(tab, "DEC", dubl);
+        if (!ra || !dec) {
+            ERROR("Failed to read RA,DEC columns from cones table %s", fn);
+            fitstable_close(tab);
+            free(ra);
+            free(dec);
+            return -1;
+        }
+        if (fitstable_find_fits_column(tab, "RADIUS", NULL, NULL, NULL) == 0)
+            radius = fitstable_read_column(tab, "RADIUS", dubl);
+        fitstable_close(tab);
+    } else {
+        sl* lines = streq(fn, "-") ? fid_get_lines(stdin, FALSE) :
+            file_get_lines(fn, FALSE);
+        dl* vals;
+        if (!lines) {
+            ERROR("Failed to read cones from %s", fn);
+            return -1;
+        }
+        vals = dl_new(1024);
+        for (i=0; i<sl_size(lines); i++) {
+            char* line = sl_get(lines, i);
+            double r, d, rad;
+            char* c;
+            int n;
+            for (c=line; *c; c++)
+                if (*c == ',')
+                    *c = ' ';
+            for (c=line; *c == ' ' || *c == '\t'; c++);
+            if (!*c || *c == '#')
+                continue;
+            n = sscanf(c, "%lf %lf %lf", &r, &d, &rad);
+            if (n < 2) {
+                ERROR("Failed to parse line %i of cones file %s: \"%s\"", i+1, fn, line);
+                sl_free2(lines);
+                dl_free(vals);
+                return -1;
+            }
+            dl_append(vals, r);
+            dl_append(vals, d);
+            dl_append(vals, (n == 3) ? rad : defradius);
+        }
+        sl_free2(lines);
+        N = dl_size(vals) / 3;
+        ra = malloc(MAX(1, N) * sizeof(double));
+        dec = malloc(MAX(1, N) * sizeof(double));
+        radius = malloc(MAX(1, N) * sizeof(double));
+        for (i=0; i<N; i++) {
+            ra[i] = dl_get(vals, i*3 + 0);
+            dec[i] = dl_get(vals, i*3 + 1);
+            radius[i] = dl_get(vals, i*3 + 2);
+        }
+        dl_free(vals);
+    }
+
+    *p_xyz = malloc(MAX(1, N) * 3 * sizeof(double));
+    *p_r2 = malloc(MAX(1, N) * sizeof(double));
+    radecdeg2xyz_batch_approx(ra, dec, *p_xyz, N);
+    for (i=0; i<N; i++)
+        (*p_r2)[i] = deg2distsq(radius ? radius[i] : defradius);
+    free(ra);
+    free(dec);
+    free(radius);
+    return N;
+}
+
+static int write_block(batch_output_t* o, const cone_block_t* blk) {
+    const kdtree_batch_res_t* res = blk->res;
+    int N = res->nres;
+    int q, k, i;
+
+    if (!N)
+        return 0;
+    if (N > o->capacity) {
+        o->capacity = MAX(N, 2 * o->capacity);
+        free(o->inds);
+        free(o->rows);
+        o->inds = malloc(o->capacity * sizeof(int));
+        o->rows = o->out ? malloc((size_t)o->capacity * o->rowsize) : NULL;
+        if (!o->inds || (o->out && !o->rows)) {
+            SYSERROR("Failed to allocate space for %i results", N);
+            return -1;
+        }
+    }
+    for (k=0; k<N; k++)
+        o->inds[k] = res->inds[k];
+
+    if (o->out) {
+        memset(o->rows, 0, (size_t)N * o->rowsize);
+        for (q=0; q<res->nq; q++) {
+            int cone = blk->i0 + q;
+            for (k=res->offsets[q]; k<res->offsets[q+1]; k++) {
+                char* row = o->rows + (size_t)k * o->rowsize;
+                double radec[2];
+                startree_get_radec(o->starkd, o->inds[k], radec, radec+1);
+                memcpy(row, &cone, sizeof(int));
+                if (o->getinds)
+                    memcpy(row + sizeof(int), o->inds + k, sizeof(int));
+                memcpy(row + 8, radec, sizeof(radec));
+            }
+        }
+        for (i=0; i<sl_size(o->tag); i++) {
+            if (fitstable_read_column_array_inds_into(o->tagalong, sl_get(o->tag, i),
+                                                      o->tagtypes[i], o->rows + o->tagoffsets[i],
+                                                      o->rowsize, o->tagarraysizes[i],
+                                                      o->inds, N)) {
+                ERROR("Failed to read data for column \"%s\" in index", sl_get(o->tag, i));
+                return -1;
+            }
+        }
+        if (fitstable_write_structs(o->out, o->rows, o->rowsize, N)) {
+            ERROR("Failed to write results");
+            return -1;
+        }
+        return 0;
+    }
+
+    {
+        // Type could be anything. Let's convert to double for display purposes.
+        double** tagdata = calloc(MAX(1, sl_size(o->tag)), sizeof(double*));
+        for (i=0; i<sl_size(o->tag); i++) {
+            tagdata[i] = fitstable_read_column_array_inds(o->tagalong, sl_get(o->tag, i),
+                                                          fitscolumn_double_type(),
+                                                          o->inds, N, NULL);
+            if (!tagdata[i]) {
+                ERROR("Failed to read data for column \"%s\" in index", sl_get(o->tag, i));
+                return -1;
+            }
+        }
+        for (q=0; q<res->nq; q++) {
+            for (k=res->offsets[q]; k<res->offsets[q+1]; k++) {
+                double ra, dec;
+                startree_get_radec(o->starkd, o->inds[k], &ra, &dec);
+                printf("%i, %g, %g", blk->i0 + q, ra, dec);
+                if (o->getinds)
+                    printf(", %i", o->inds[k]);
+                for (i=0; i<sl_size(o->tag); i++)
+                    printf(", %g", tagdata[i][k]);
+                printf("\n");
+            }
+        }
+        for (i=0; i<sl_size(o->tag); i++)
+            free(tagdata[i]);
+        free(tagdata);
+    }
+    return 0;
+}
+
+/*
+ Batch mode: searches each of the cones in "conefn", writing the results
+ of all of them (with the cone's number in a CONE_ID column) to the FITS
+ table "outfn", or to stdout as text if NULL.  The results are written
+ in order of cone, a chunk at a time, so the output is streamed rather
+ than gathered.
+ */
+static int run_batch(startree_t* starkd, fitstable_t* tagalong, sl* tag,
+                     anbool getinds, const char* conefn, double defradius,
+                     const char* outfn, int nthreads) {
+    batch_output_t o;
+    cone_job_t job;
+    cone_block_t blocks[CHUNK_BLOCKS];
+    double* xyz = NULL;
+    double* r2 = NULL;
+    int N, c0, b, i;
+    int64_t nres = 0;
+    int rtn = -1;
+
+    N = read_cones(conefn, defradius, &xyz, &r2);
+    if (N < 0)
+        return -1;
+    logmsg("Searching kdtree for %i cones on %i threads.\n", N, nthreads);
+
+    memset(&o, 0, sizeof(batch_output_t));
+    memset(blocks, 0, sizeof(blocks));
+    o.starkd = starkd;
+    o.tagalong = tagalong;
+    o.tag = tag;
+    o.getinds = getinds;
+    o.tagtypes = malloc(MAX(1, sl_size(tag)) * sizeof(tfits_type));
+    o.tagarraysizes = malloc(MAX(1, sl_size(tag)) * sizeof(int));
+    o.tagoffsets = malloc(MAX(1, sl_size(tag)) * sizeof(int));
+    for (i=0; i<sl_size(tag); i++) {
+        if (fitstable_find_fits_column(tagalong, sl_get(tag, i), NULL,
+                                       o.tagtypes + i, o.tagarraysizes + i)) {
+            ERROR("Failed to find column \"%s\" in index", sl_get(tag, i));
+            goto bailout;
+        }
+    }
+    // (positions are looked up by star ID.)
+    startree_compute_inverse_perm(starkd);
+
+    if (outfn) {
+        tfits_type itype = fitscolumn_int_type();
+        tfits_type dubl = fitscolumn_double_type();
+        o.out = fitstable_open_for_writing(outfn);
+        if (!o.out) {
+            ERROR("Failed to open output file %s", outfn);
+            goto bailout;
+        }
+        if (fitstable_write_primary_header(o.out)) {
+            ERROR("Failed to write header to output file %s", outfn);
+            goto bailout;
+        }
+        // rows: CONE_ID, [INDEX], RA, DEC, tag-along columns (8-byte aligned).
+        fitstable_add_write_column_struct(o.out, itype, 1, 0, itype, "CONE_ID", NULL);
+        if (getinds)
+            fitstable_add_write_column_struct(o.out, itype, 1, sizeof(int), itype,
+                                              "INDEX", NULL);
+        fitstable_add_write_column_struct(o.out, dubl, 1, 8, dubl, "RA", "deg");
+        fitstable_add_write_column_struct(o.out, dubl, 1, 16, dubl, "DEC", "deg");
+        o.rowsize = 24;
+        for (i=0; i<sl_size(tag); i++) {
+            char* units = NULL;
+            fitstable_find_fits_column(tagalong, sl_get(tag, i), &units, NULL, NULL);
+            o.tagoffsets[i] = o.rowsize;
+            fitstable_add_write_column_struct(o.out, o.tagtypes[i], o.tagarraysizes[i],
+                                              o.rowsize, o.tagtypes[i],
+                                              sl_get(tag, i), units);
+            o.rowsize += fits_get_atom_size(o.tagtypes[i]) * o.tagarraysizes[i];
+            o.rowsize = (o.rowsize + 7) & ~7;
+        }
+        if (fitstable_write_header(o.out)) {
+            ERROR("Failed to write header to output file %s", outfn);
+            goto bailout;
+        }
+    } else {
+        printf("# cone, RA, Dec");
+        if (getinds)
+            printf(", index");
+        for (i=0; i<sl_size(tag); i++)
+            printf(", %s", sl_get(tag, i));
+        printf("\n");
+    }
+
+    job.starkd = starkd;
+    job.xyz = xyz;
+    job.r2 = r2;
+    job.blocks = blocks;
+    for (c0=0; c0<N; c0+=CONE_BLOCK*CHUNK_BLOCKS) {
+        job.nblocks = 0;
+        job.failed = 0;
+        for (b=0; b<CHUNK_BLOCKS && c0 + b*CONE_BLOCK < N; b++) {
+            blocks[b].i0 = c0 + b*CONE_BLOCK;
+            blocks[b].n = MIN(CONE_BLOCK, N - blocks[b].i0);
+            job.nblocks++;
+        }
+        search_cones(&job, nthreads);
+        if (job.failed) {
+            ERROR("Failed to search the kdtree");
+            goto bailout;
+        }
+        for (b=0; b<job.nblocks; b++) {
+            if (write_block(&o, blocks + b))
+                goto bailout;
+            nres += blocks[b].res->nres;
+        }
+    }
+    logmsg("Got %lli results.\n", (long long)nres);
+
+    if (o.out) {
+        if (fitstable_fix_header(o.out) ||
+            fitstable_fix_primary_header(o.out) ||
+            fitstable_close(o.out)) {
+            ERROR("Failed to close output file %s", outfn);
+            o.out = NULL;
+            goto bailout;
+        }
+        o.out = NULL;
+    }
+    rtn = 0;
+
+ bailout:
+    if (o.out)
+        fitstable_close(o.out);
+    for (b=0; b<CHUNK_BLOCKS; b++)
+        kdtree_batch_res_free(blocks[b].res);
+    free(o.tagtypes);
+    free(o.tagarraysizes);
+    free(o.tagoffsets);
+    free(o.inds);
+    free(o.rows);
+    free(xyz);
+    free(r2);
+    return rtn;
+}
+
 
 int main(int argc, char **argv) {
     int argchar;
@@ -42,14 +432,16 @@ int main(int argc, char **argv) {
     char** myargs;
     int nmyargs;
     anbool getinds = FALSE;
-    double* radec;
-    int* inds;
-    int N;
+    double* radec = NULL;
+    int* inds = NULL;
+    int N = 0;
     int i;
     char* rdfn = NULL;
     pl* tagdata = pl_new(16);
     il* tagsizes = il_new(16);
     fitstable_t* tagalong = NULL;
+    char* conefn = NULL;
+    int nthreads = 1;
 
     while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
         switch (argchar) {
@@ -74,6 +466,12 @@ int main(int argc, char **argv) {
         case 'T':
             tagall = TRUE;
             break;
+        case 'b':
+            conefn = optarg;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
         case 'v':
             loglvl++;
             break;
@@ -104,6 +502,26 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
+    if (conefn) {
+        if (tagall) {
+            int j, M;
+            M = startree_get_tagalong_N_columns(starkd);
+            for (j=0; j<M; j++)
+                sl_append(tag, startree_get_tagalong_column_name(starkd, j));
+        }
+        if (sl_size(tag)) {
+            tagalong = startree_get_tagalong(starkd);
+            if (!tagalong) {
+                ERROR("Failed to find tag-along table in index");
+                exit(-1);
+            }
+        }
+        if (run_batch(starkd, tagalong, tag, getinds, conefn, radius, rdfn,
+                      nthreads))
+            exit(-1);
+        goto done;
+    }
+
     logmsg("Searching kdtree %s at RA,Dec = (%g,%g), radius %g deg.\n",
            starfn, ra, dec, radius);
 
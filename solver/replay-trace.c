@@ -0,0 +1,328 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/**
+ Runs the searches recorded in a solver trace (see solver-trace.h;
+ solve-field --trace, or ANTRACE in an axy file) again, on their own,
+ and reports how the time they take and their counters compare with
+ the recording.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "os-features.h"
+#include "solver-trace.h"
+#include "solver.h"
+#include "index.h"
+#include "ioutils.h"
+#include "tic.h"
+#include "bl.h"
+#include "boilerplate.h"
+#include "errors.h"
+#include "log.h"
+
+static const char* OPTIONS = "hvs:r:t:I:f";
+
+static void printHelp(char* progname) {
+    BOILERPLATE_HELP_HEADER(stdout);
+    printf("\nUsage: %s [options] <trace-file>\n"
+           "    [-s <n>]: replay only search number <n> (1 is the first)\n"
+           "    [-r <n>]: run each search this many times, and report the\n"
+           "              fastest (default 1)\n"
+           "    [-t <n>]: search with this many threads, rather than the\n"
+           "              recorded number\n"
+           "    [-I <dir>]: look for index files that aren't at their\n"
+           "                recorded paths in this directory\n"
+           "    [-f]: replay even if an index file isn't the recorded one\n"
+           "          (its MD5 differs)\n"
+           "    [-v]: +verbose\n"
+           "\n"
+           "Exits with status 2 if the counters of a replayed search differ\n"
+           "from the recorded ones (expect that with several threads).\n"
+           "\n", progname);
+}
+
+// The indexes, loaded once for all the searches.
+struct index_cache {
+    sl* paths;
+    pl* indexes;
+    char* dir;
+    anbool force;
+};
+
+static index_t* get_index(struct index_cache* ic,
+                          const solver_trace_index_t* ti) {
+    ptrdiff_t k = sl_index_of(ic->paths, ti->path);
+    char* path;
+    char md5[33];
+    index_t* index;
+
+    if (k >= 0)
+        return pl_get(ic->indexes, k);
+    path = strdup(ti->path);
+    if (!file_exists(path) && ic->dir) {
+        char* base = basename_safe(ti->path);
+        free(path);
+        asprintf_safe(&path, "%s/%s", ic->dir, base);
+        free(base);
+    }
+    if (strcmp(ti->md5, "-")) {
+        if (solver_trace_file_md5(path, md5)) {
+            ERROR("Failed to read index file \"%s\"", path);
+            free(path);
+            return NULL;
+        }
+        if (strcmp(md5, ti->md5)) {
+            logmsg("Index file \"%s\" is not the one recorded (MD5 %s, "
+                   "recorded %s).\n", path, md5, ti->md5);
+            if (!ic->force) {
+                ERROR("Use -f to replay with it anyway");
+                free(path);
+                return NULL;
+            }
+        }
+    }
+    index = index_load(path, 0, NULL);
+    if (!index) {
+        ERROR("Failed to load index \"%s\"", path);
+        free(path);
+        return NULL;
+    }
+    free(path);
+    sl_append(ic->paths, ti->path);
+    pl_append(ic->indexes, index);
+    return index;
+}
+
+static anbool replay_callback(MatchObj* mo, void* userdata) {
+    const double* tosolve = userdata;
+    return (mo->logodds >= *tosolve);
+}
+
+struct replay_result {
+    int numtries;
+    int nummatches;
+    int numscaleok;
+    int num_verified;
+    anbool solved;
+    double best_logodds;
+    double wall;
+    double cpu;
+    double stage_wall[SOLVER_N_STAGES];
+};
+
+static int replay_once(const solver_trace_search_t* s,
+                       struct index_cache* ic, int nthreads,
+                       struct replay_result* res) {
+    solver_t* sp = solver_new();
+    double tosolve = s->logratio_tosolve;
+    double t0, cpu0;
+    size_t i;
+    int k;
+
+    solver_trace_setup_solver(s, sp);
+    for (i=0; i<bl_size(s->indexes); i++) {
+        index_t* index = get_index(ic, bl_access(s->indexes, i));
+        if (!index) {
+            solver_free(sp);
+            return -1;
+        }
+        solver_add_index(sp, index);
+    }
+    if (nthreads >= 0)
+        sp->nthreads = nthreads;
+    sp->collect_stats = TRUE;
+    sp->record_match_callback = replay_callback;
+    sp->userdata = &tosolve;
+    solver_preprocess_field(sp);
+
+    t0 = timenow();
+    cpu0 = get_cpu_usage();
+    solver_run(sp);
+    res->wall = timenow() - t0;
+    res->cpu = get_cpu_usage() - cpu0;
+
+    res->numtries = sp->numtries;
+    res->nummatches = sp->nummatches;
+    res->numscaleok = sp->numscaleok;
+    res->num_verified = sp->num_verified;
+    res->solved = sp->best_match_solves;
+    res->best_logodds = sp->best_logodds;
+    for (k=0; k<SOLVER_N_STAGES; k++)
+        res->stage_wall[k] = sp->stats.wall[k];
+    solver_free(sp);
+    return 0;
+}
+
+static double percent(double recorded, double now) {
+    if (recorded <= 0)
+        return 0.0;
+    return 100.0 * (now - recorded) / recorded;
+}
+
+static void print_count(const char* name, int recorded, int now) {
+    printf("  %-14s %12i %12i", name, recorded, now);
+    if (now != recorded)
+        printf("  (%+i)", now - recorded);
+    printf("\n");
+}
+
+// Returns -1 on error, 1 if the counters differ, 0 otherwise.
+static int replay_search(int num, const solver_trace_search_t* s,
+                         struct index_cache* ic, int nthreads, int repeats,
+                         double* total_rec, double* total_now) {
+    struct replay_result best, res;
+    anbool varies = FALSE;
+    int r, k;
+
+    for (r=0; r<repeats; r++) {
+        if (replay_once(s, ic, nthreads, &res))
+            return -1;
+        if (r == 0) {
+            best = res;
+            continue;
+        }
+        if (res.numtries != best.numtries ||
+            res.nummatches != best.nummatches)
+            varies = TRUE;
+        if (res.wall < best.wall)
+            best = res;
+    }
+
+    printf("Search %i: field %i, %zu index%s, field objects %i-%i\n", num,
+           s->fieldnum, bl_size(s->indexes),
+           (bl_size(s->indexes) == 1) ? "" : "es", s->params.startobj + 1,
+           s->params.endobj ? s->params.endobj : starxy_n(s->field));
+    printf("  %-14s %12s %12s\n", "", "recorded", "replayed");
+    printf("  %-14s %12.3f %12.3f  (%+.1f%%)\n", "wall (s)", s->wall,
+           best.wall, percent(s->wall, best.wall));
+    printf("  %-14s %12.3f %12.3f  (%+.1f%%)\n", "cpu (s)", s->cpu,
+           best.cpu, percent(s->cpu, best.cpu));
+    for (k=0; k<SOLVER_N_STAGES; k++) {
+        char name[32];
+        if (s->stage_wall[k] == 0.0 && best.stage_wall[k] == 0.0)
+            continue;
+        snprintf(name, sizeof(name), "  %s (s)", solver_stage_name(k));
+        printf("  %-14s %12.3f %12.3f  (%+.1f%%)\n", name, s->stage_wall[k],
+               best.stage_wall[k], percent(s->stage_wall[k], best.stage_wall[k]));
+    }
+    print_count("quads tried", s->numtries, best.numtries);
+    print_count("quads matched", s->nummatches, best.nummatches);
+    print_count("scale ok", s->numscaleok, best.numscaleok);
+    print_count("verified", s->num_verified, best.num_verified);
+    printf("  %-14s %12s %12s\n", "solved", s->solved ? "yes" : "no",
+           best.solved ? "yes" : "no");
+    printf("  %-14s %12.3f %12.3f\n", "best log-odds", s->best_logodds,
+           best.best_logodds);
+    if (varies)
+        printf("  (the counters varied between the repeats)\n");
+    printf("\n");
+
+    *total_rec += s->wall;
+    *total_now += best.wall;
+    if (s->numtries != best.numtries || s->nummatches != best.nummatches ||
+        s->numscaleok != best.numscaleok ||
+        s->num_verified != best.num_verified || s->solved != best.solved)
+        return 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int argchar;
+    int loglvl = LOG_MSG;
+    int only = 0;
+    int repeats = 1;
+    int nthreads = -1;
+    struct index_cache ic;
+    bl* searches;
+    double total_rec = 0, total_now = 0;
+    int ndiffer = 0;
+    int rtn = 0;
+    size_t i;
+
+    memset(&ic, 0, sizeof(ic));
+    while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
+        switch (argchar) {
+        case 'v':
+            loglvl++;
+            break;
+        case 's':
+            only = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            if (repeats < 1)
+                repeats = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'I':
+            ic.dir = optarg;
+            break;
+        case 'f':
+            ic.force = TRUE;
+            break;
+        case '?':
+            fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        case 'h':
+            printHelp(argv[0]);
+            exit(0);
+        default:
+            return -1;
+        }
+    log_init(loglvl);
+
+    if (optind != argc - 1) {
+        printHelp(argv[0]);
+        exit(-1);
+    }
+
+    searches = solver_trace_read(argv[optind]);
+    if (!searches) {
+        errors_print_stack(stderr);
+        exit(-1);
+    }
+    if (only > (int)bl_size(searches)) {
+        ERROR("The trace has only %zu searches", bl_size(searches));
+        errors_print_stack(stderr);
+        exit(-1);
+    }
+    ic.paths = sl_new(8);
+    ic.indexes = pl_new(8);
+
+    for (i=0; i<bl_size(searches); i++) {
+        int r;
+        if (only && (int)i != only - 1)
+            continue;
+        r = replay_search(i + 1, bl_access(searches, i), &ic, nthreads,
+                          repeats, &total_rec, &total_now);
+        if (r < 0) {
+            rtn = -1;
+            break;
+        }
+        ndiffer += r;
+    }
+    if (!rtn) {
+        printf("Total wall time: recorded %.3f s, replayed %.3f s (%+.1f%%)\n",
+               total_rec, total_now, percent(total_rec, total_now));
+        if (ndiffer) {
+            printf("%i search%s had different counters.\n", ndiffer,
+                   (ndiffer == 1) ? "" : "es");
+            rtn = 2;
+        }
+    }
+
+    for (i=0; i<pl_size(ic.indexes); i++)
+        index_free(pl_get(ic.indexes, i));
+    pl_free(ic.indexes);
+    sl_free2(ic.paths);
+    solver_trace_free_searches(searches);
+    if (rtn < 0)
+        errors_print_stack(stderr);
+    return rtn;
+}
@@ -12,10 +12,12 @@
 // DEBUG
 #include <sys/mman.h>
 
+#include "resort-xylist.h"
+#include "os-features.h"
 #include "anqfits.h"
 #include "ioutils.h"
 #include "fitsioutils.h"
-#include "permutedsort.h"
+#include "xylist-filter.h"
 #include "an-bool.h"
 #include "fitstable.h"
 #include "errors.h"
@@ -25,21 +27,21 @@
 int resort_xylist(const char* infn, const char* outfn,
                   const char* fluxcol, const char* backcol,
                   int ascending) {
+    return resort_xylist_topk(infn, outfn, fluxcol, backcol, ascending, 0);
+}
+
+int resort_xylist_topk(const char* infn, const char* outfn,
+                       const char* fluxcol, const char* backcol,
+                       int ascending, int K) {
     FILE* fin = NULL;
     FILE* fout = NULL;
     double *flux = NULL, *back = NULL;
-    int *perm1 = NULL, *perm2 = NULL;
-    anbool *used = NULL;
+    int *order = NULL;
+    char* rows = NULL;
     int start, size, nextens, ext;
-    int (*compare)(const void*, const void*);
     fitstable_t* tab = NULL;
     anqfits_t* anq = NULL;
 
-    if (ascending)
-        compare = compare_doubles_asc;
-    else
-        compare = compare_doubles_desc;
-
     if (!fluxcol)
         fluxcol = "FLUX";
     if (!backcol)
@@ -81,7 +83,7 @@ int resort_xylist(const char* infn, const char* outfn,
 
     for (ext=1; ext<nextens; ext++) {
         int hdrstart, hdrsize, datstart;
-        int i, N;
+        int i, N, Nout;
         int rowsize;
 
         hdrstart = anqfits_header_start(anq, ext);
@@ -92,17 +94,35 @@ int resort_xylist(const char* infn, const char* outfn,
             ERROR("Extension %i isn't a table. Skipping", ext);
             continue;
         }
-        // Copy the header as-is.
-        if (pipe_file_offset(fin, hdrstart, hdrsize, fout)) {
-            ERROR("Failed to copy the header of extension %i", ext);
-            goto bailout;
-        }
-
         if (fitstable_read_extension(tab, ext)) {
             ERROR("Failed to read FITS table from extension %i", ext);
             goto bailout;
         }
         rowsize = fitstable_row_size(tab);
+        N = fitstable_nrows(tab);
+        Nout = (K > 0) ? MIN(K, N) : N;
+
+        if (Nout == N) {
+            // Copy the header as-is.
+            if (pipe_file_offset(fin, hdrstart, hdrsize, fout)) {
+                ERROR("Failed to copy the header of extension %i", ext);
+                goto bailout;
+            }
+        } else {
+            qfits_header* hdr = anqfits_get_header2(infn, ext);
+            int rtn;
+            if (!hdr) {
+                ERROR("Failed to read the header of extension %i", ext);
+                goto bailout;
+            }
+            fits_header_mod_int(hdr, "NAXIS2", Nout, "number of rows in table");
+            rtn = qfits_header_dump(hdr, fout);
+            qfits_header_destroy(hdr);
+            if (rtn) {
+                ERROR("Failed to write the header of extension %i", ext);
+                goto bailout;
+            }
+        }
 
         // read FLUX column as doubles.
         flux = fitstable_read_column(tab, fluxcol, TFITS_BIN_TYPE_D);
@@ -117,54 +137,36 @@ int resort_xylist(const char* infn, const char* outfn,
             goto bailout;
         }
 
-        N = fitstable_nrows(tab);
         debug("First rows of input table:\n");
         for (i=0; i<MIN(10, N); i++)
             debug("flux %g, background %g\n", flux[i], back[i]);
 
-        // set back = flux + back (ie, non-background-subtracted flux)
-        for (i=0; i<N; i++)
-            back[i] += flux[i];
-
-        // Sort by flux...
-        perm1 = permuted_sort(flux, sizeof(double), compare, NULL, N);
+        // Alternate between sorting by flux and by
+        // non-background-subtracted flux.
+        order = resort_flux_background_topk(flux, back, N, ascending, Nout);
 
-        // Sort by non-background-subtracted flux...
-        perm2 = permuted_sort(back, sizeof(double), compare, NULL, N);
-
-        used = malloc(N * sizeof(anbool));
-        memset(used, 0, N * sizeof(anbool));
-
-        // Check sort...
-        for (i=0; i<N-1; i++) {
-            if (ascending) {
-                assert(flux[perm1[i]] <= flux[perm1[i+1]]);
-                assert(back[perm2[i]] <= back[perm2[i+1]]);
-            } else {
-                assert(flux[perm1[i]] >= flux[perm1[i+1]]);
-                assert(back[perm2[i]] >= back[perm2[i+1]]);
-            }
+        // Read the rows in one go, rather than seeking to each.
+        rows = malloc(MAX((size_t)N * rowsize, 1));
+        if (!rows) {
+            SYSERROR("Failed to allocate %i rows of %i bytes", N, rowsize);
+            goto bailout;
         }
-
-        for (i=0; i<N; i++) {
-            int j;
-            int inds[] = { perm1[i], perm2[i] };
-            for (j=0; j<2; j++) {
-                int index = inds[j];
-                assert(index < N);
-                if (used[index])
-                    continue;
-                used[index] = TRUE;
-                debug("adding index %i: %s %g\n", index, j==0 ? "flux" : "bgsub", j==0 ? flux[index] : back[index]);
-                if (pipe_file_offset(fin, datstart + index * rowsize, rowsize, fout)) {
-                    ERROR("Failed to copy row %i", index);
-                    goto bailout;
-                }
+        if (fseeko(fin, datstart, SEEK_SET) ||
+            fread(rows, rowsize, N, fin) != N) {
+            SYSERROR("Failed to read the rows of extension %i", ext);
+            goto bailout;
+        }
+        for (i=0; i<Nout; i++) {
+            debug("adding index %i: flux %g, background %g\n", order[i],
+                  flux[order[i]], back[order[i]]);
+            if (fwrite(rows + (size_t)order[i] * rowsize, 1, rowsize, fout)
+                != rowsize) {
+                SYSERROR("Failed to write row %i", order[i]);
+                goto bailout;
             }
         }
-
-        for (i=0; i<N; i++)
-            assert(used[i]);
+        free(rows);
+        rows = NULL;
 
         if (fits_pad_file(fout)) {
             ERROR("Failed to add padding to extension %i", ext);
@@ -175,12 +177,8 @@ int resort_xylist(const char* infn, const char* outfn,
         flux = NULL;
         free(back);
         back = NULL;
-        free(perm1);
-        perm1 = NULL;
-        free(perm2);
-        perm2 = NULL;
-        free(used);
-        used = NULL;
+        free(order);
+        order = NULL;
     }
 
     fitstable_close(tab);
@@ -202,9 +200,8 @@ int resort_xylist(const char* infn, const char* outfn,
         fclose(fin);
     free(flux);
     free(back);
-    free(perm1);
-    free(perm2);
-    free(used);
+    free(order);
+    free(rows);
     return -1;
 }
 
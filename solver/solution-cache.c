@@ -0,0 +1,286 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "solution-cache.h"
+#include "codefile.h"
+#include "quad-utils.h"
+#include "fitstable.h"
+#include "fitsioutils.h"
+#include "sip_qfits.h"
+#include "ioutils.h"
+#include "mathutil.h"
+#include "bl.h"
+#include "errors.h"
+#include "log.h"
+
+struct cache_entry {
+    field_fingerprint_t fp;
+    sip_t wcs;
+};
+
+struct solution_cache {
+    char* dir;
+    // struct cache_entry
+    bl* entries;
+    pthread_mutex_t lock;
+};
+
+int field_fingerprint_compute(const starxy_t* xy, field_fingerprint_t* fp) {
+    int N = MIN(starxy_n(xy), SOLUTION_CACHE_NSTARS);
+    int ijkl[4];
+
+    memset(fp, 0, sizeof(field_fingerprint_t));
+    if (N < 5)
+        return -1;
+    for (ijkl[0]=0; ijkl[0]<N; ijkl[0]++)
+    for (ijkl[1]=ijkl[0]+1; ijkl[1]<N; ijkl[1]++)
+    for (ijkl[2]=ijkl[1]+1; ijkl[2]<N; ijkl[2]++)
+    for (ijkl[3]=ijkl[2]+1; ijkl[3]<N; ijkl[3]++) {
+        unsigned int quad[4];
+        double quadxy[8];
+        double* code = fp->codes + 4 * fp->ncodes;
+        double maxd2 = -1.0;
+        int a = 0, b = 1;
+        int p, q, k;
+
+        // A and B are the two sources furthest apart, as in a solver quad.
+        for (p=0; p<4; p++)
+            for (q=p+1; q<4; q++) {
+                double d2 =
+                    square(starxy_getx(xy, ijkl[p]) - starxy_getx(xy, ijkl[q])) +
+                    square(starxy_gety(xy, ijkl[p]) - starxy_gety(xy, ijkl[q]));
+                if (d2 > maxd2) {
+                    maxd2 = d2;
+                    a = p;
+                    b = q;
+                }
+            }
+        quad[0] = ijkl[a];
+        quad[1] = ijkl[b];
+        for (p=0, k=2; p<4; p++)
+            if (p != a && p != b)
+                quad[k++] = ijkl[p];
+        for (k=0; k<4; k++) {
+            quadxy[2*k+0] = starxy_getx(xy, quad[k]);
+            quadxy[2*k+1] = starxy_gety(xy, quad[k]);
+        }
+        codefile_compute_field_code(quadxy, code, 4);
+        quad_enforce_invariants(quad, code, 4, 4);
+        fp->ncodes++;
+    }
+    return 0;
+}
+
+int field_fingerprint_matches(const field_fingerprint_t* fp1,
+                              const field_fingerprint_t* fp2) {
+    double tol2 = square(SOLUTION_CACHE_CODE_TOL);
+    int i, j, n = 0;
+    for (i=0; i<fp1->ncodes; i++) {
+        const double* c1 = fp1->codes + 4*i;
+        for (j=0; j<fp2->ncodes; j++) {
+            const double* c2 = fp2->codes + 4*j;
+            if (square(c1[0] - c2[0]) + square(c1[1] - c2[1]) +
+                square(c1[2] - c2[2]) + square(c1[3] - c2[3]) <= tol2) {
+                n++;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+uint64_t field_fingerprint_hash(const field_fingerprint_t* fp) {
+    uint64_t h = 0;
+    int i, k;
+    // sum of the FNV-1a hashes of the rounded codes.
+    for (i=0; i<fp->ncodes; i++) {
+        uint64_t hc = 14695981039346656037ULL;
+        for (k=0; k<4; k++) {
+            int32_t v = (int32_t)floor(fp->codes[4*i+k] / SOLUTION_CACHE_CODE_TOL);
+            int b;
+            for (b=0; b<4; b++) {
+                hc ^= (v >> (8*b)) & 0xff;
+                hc *= 1099511628211ULL;
+            }
+        }
+        h += hc;
+    }
+    return h;
+}
+
+static int read_entry(const char* fn, struct cache_entry* e) {
+    fitstable_t* tab;
+    double* codes;
+    int N, rtn = -1;
+
+    memset(e, 0, sizeof(struct cache_entry));
+    tab = fitstable_open(fn);
+    if (!tab)
+        return -1;
+    if (!sip_read_header(fitstable_get_primary_header(tab), &(e->wcs)))
+        goto bailout;
+    N = fitstable_nrows(tab);
+    if ((N < 1) || (N > SOLUTION_CACHE_NCODES) ||
+        (fitstable_get_array_size(tab, "CODE") != 4))
+        goto bailout;
+    codes = fitstable_read_column_array(tab, "CODE", fitscolumn_double_type());
+    if (!codes)
+        goto bailout;
+    memcpy(e->fp.codes, codes, N * 4 * sizeof(double));
+    e->fp.ncodes = N;
+    free(codes);
+    rtn = 0;
+ bailout:
+    fitstable_close(tab);
+    return rtn;
+}
+
+static int write_entry(const char* fn, const struct cache_entry* e) {
+    fitstable_t* tab;
+    int i;
+
+    tab = fitstable_open_for_writing(fn);
+    if (!tab)
+        return -1;
+    fitstable_add_write_column_array(tab, fitscolumn_double_type(), 4,
+                                     "CODE", NULL);
+    sip_add_to_header(fitstable_get_primary_header(tab), &(e->wcs));
+    if (fitstable_write_primary_header(tab) ||
+        fitstable_write_header(tab))
+        goto bailout;
+    for (i=0; i<e->fp.ncodes; i++)
+        if (fitstable_write_row(tab, e->fp.codes + 4*i))
+            goto bailout;
+    if (fitstable_fix_header(tab))
+        goto bailout;
+    return fitstable_close(tab);
+ bailout:
+    fitstable_close(tab);
+    return -1;
+}
+
+solution_cache_t* solution_cache_open(const char* dir) {
+    solution_cache_t* cache;
+    DIR* d;
+    struct dirent* de;
+
+    if (mkdir_p(dir)) {
+        ERROR("Failed to create solution cache directory %s", dir);
+        return NULL;
+    }
+    d = opendir(dir);
+    if (!d) {
+        SYSERROR("Failed to open solution cache directory %s", dir);
+        return NULL;
+    }
+    cache = calloc(1, sizeof(solution_cache_t));
+    cache->dir = strdup(dir);
+    cache->entries = bl_new(64, sizeof(struct cache_entry));
+    pthread_mutex_init(&cache->lock, NULL);
+    while ((de = readdir(d))) {
+        struct cache_entry e;
+        char* fn;
+        if (!ends_with(de->d_name, ".fits"))
+            continue;
+        asprintf_safe(&fn, "%s/%s", dir, de->d_name);
+        if (read_entry(fn, &e))
+            logverb("Skipping unreadable solution cache file %s\n", fn);
+        else
+            bl_append(cache->entries, &e);
+        free(fn);
+    }
+    closedir(d);
+    logverb("Read %zu solved fields from solution cache %s\n",
+            bl_size(cache->entries), dir);
+    return cache;
+}
+
+int solution_cache_lookup(solution_cache_t* cache,
+                          const field_fingerprint_t* fp,
+                          sip_t* wcses, int maxwcs) {
+    int* nmatch;
+    int i, j, nfound = 0;
+
+    if (maxwcs < 1)
+        return 0;
+    nmatch = malloc(maxwcs * sizeof(int));
+    pthread_mutex_lock(&cache->lock);
+    for (i=0; i<bl_size(cache->entries); i++) {
+        struct cache_entry* e = bl_access(cache->entries, i);
+        int n = field_fingerprint_matches(fp, &(e->fp));
+        if (n < SOLUTION_CACHE_MIN_MATCHES)
+            continue;
+        // insert into the (sorted) best "maxwcs".
+        j = nfound;
+        if (j == maxwcs) {
+            if (nmatch[j-1] >= n)
+                continue;
+            j--;
+        } else
+            nfound++;
+        for (; j>0 && nmatch[j-1] < n; j--) {
+            nmatch[j] = nmatch[j-1];
+            wcses[j] = wcses[j-1];
+        }
+        nmatch[j] = n;
+        wcses[j] = e->wcs;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(nmatch);
+    return nfound;
+}
+
+int solution_cache_add(solution_cache_t* cache,
+                       const field_fingerprint_t* fp, const sip_t* wcs) {
+    struct cache_entry e;
+    char* tmpfn;
+    char* fn;
+    int rtn = 0;
+
+    e.fp = *fp;
+    e.wcs = *wcs;
+    asprintf_safe(&fn, "%s/%016llx.fits", cache->dir,
+                  (unsigned long long)field_fingerprint_hash(fp));
+    // write to a temp file and rename, so that readers never see a
+    // partial file.
+    tmpfn = create_temp_file("solution", cache->dir);
+    if (write_entry(tmpfn, &e) || rename(tmpfn, fn)) {
+        ERROR("Failed to write solution cache file %s", fn);
+        unlink(tmpfn);
+        rtn = -1;
+    }
+    free(tmpfn);
+    free(fn);
+
+    pthread_mutex_lock(&cache->lock);
+    bl_append(cache->entries, &e);
+    pthread_mutex_unlock(&cache->lock);
+    return rtn;
+}
+
+int solution_cache_size(solution_cache_t* cache) {
+    int n;
+    pthread_mutex_lock(&cache->lock);
+    n = bl_size(cache->entries);
+    pthread_mutex_unlock(&cache->lock);
+    return n;
+}
+
+void solution_cache_free(solution_cache_t* cache) {
+    if (!cache)
+        return;
+    bl_free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    free(cache);
+}
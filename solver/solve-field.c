@@ -20,6 +20,7 @@
 #include <errors.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "boilerplate.h"
 #include "an-bool.h"
@@ -32,12 +33,15 @@
 #include "augment-xylist.h"
 #include "an-opts.h"
 #include "log.h"
+#include "tic.h"
 #include "errors.h"
 #include "anqfits.h"
 #include "sip_qfits.h"
 #include "sip-utils.h"
 #include "wcs-rd2xy.h"
 #include "new-wcs.h"
+#include "engine.h"
+#include "gslutils.h"
 #include "scamp.h"
 
 static an_option_t options[] = {
@@ -61,6 +65,10 @@ static an_option_t options[] = {
      "add this index file to the \"astrometry-engine\" program; you can quote this and include wildcards."},
     {'(', "batch",  no_argument, NULL,
      "run astrometry-engine once, rather than once per input file"},
+    {'\x99', "engine-subprocess", no_argument, NULL,
+     "run the \"astrometry-engine\" program to solve, rather than solving in this process"},
+    {'\x9f', "jobs", required_argument, "<int>",
+     "solve this many input files at once (sharing the indexes), while the next ones are prepared"},
     {'f', "files-on-stdin", no_argument, NULL,
      "read filenames to solve on stdin, one per line"},
     {'p', "no-plots",       no_argument, NULL,
@@ -70,6 +78,8 @@ static an_option_t options[] = {
     {'\x85', "plot-bg",  required_argument, "filename (JPEG)",
      //.jpg, .jpeg, .ppm, .pnm, .png)",
      "set the background image to use for plots"},
+    {'\xa0', "plot-in-background", no_argument, NULL,
+     "make the plots in a background thread, while the next input files are solved"},
     {'G', "use-wget",       no_argument, NULL,
      "use wget instead of curl"},
     {'O', "overwrite",      no_argument, NULL,
@@ -99,6 +109,8 @@ static an_option_t options[] = {
      "write 'augmented xy list' (axy) file to a temp file"},
     {'\x88', "timestamp", no_argument, NULL,
      "add timestamps to log messages"},
+    {'\x9b', "profile", required_argument, "filename",
+     "append a per-job timing profile of each stage, in flame-graph \"folded stacks\" format, to this file"},
 };
 
 static void print_help(const char* progname, bl* opts) {
@@ -255,12 +267,25 @@ static int write_kmz(const augment_xylist_t* axy, const char* kmzfn,
     return 0;
 }
 
-static int plot_source_overlay(const char* plotxy, augment_xylist_t* axy, const char* me,
-                               const char* objsfn, double plotscale, const char* bgfn) {
+// Runs a plotting command; returns 0 on success.
+static int run_plot_command(char* cmd) {
+    anbool ctrlc = FALSE;
+    if (run_command(cmd, &ctrlc)) {
+        ERROR("Plotting command %s", (ctrlc ? "was cancelled" : "failed"));
+        if (!ctrlc) {
+            errors_print_stack(stdout);
+            errors_clear_stack();
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static char* source_overlay_command(const char* plotxy, augment_xylist_t* axy, const char* me,
+                                    const char* objsfn, double plotscale, const char* bgfn) {
     // plotxy -i harvard.axy -I /tmp/pnm -C red -P -w 2 -N 50 | plotxy -w 2 -r 3 -I - -i harvard.axy -C red -n 50 > harvard-objs.png
     sl* cmdline = sl_new(16);
     char* cmd;
-    anbool ctrlc;
     char* imgfn;
 
     if (bgfn) {
@@ -326,29 +351,26 @@ static int plot_source_overlay(const char* plotxy, augment_xylist_t* axy, const
 
     cmd = sl_implode(cmdline, " ");
     sl_free2(cmdline);
+    return cmd;
+}
 
-    if (run_command(cmd, &ctrlc)) {
-        ERROR("Plotting command %s", (ctrlc ? "was cancelled" : "failed"));
-        if (!ctrlc) {
-            errors_print_stack(stdout);
-            errors_clear_stack();
-        }
-        free(cmd);
-        return -1;
-    }
+static int plot_source_overlay(const char* plotxy, augment_xylist_t* axy, const char* me,
+                               const char* objsfn, double plotscale, const char* bgfn) {
+    char* cmd = source_overlay_command(plotxy, axy, me, objsfn, plotscale, bgfn);
+    int rtn = run_plot_command(cmd);
     free(cmd);
-    return 0;
+    return rtn;
 }
 
-static int plot_index_overlay(const char* plotxy, augment_xylist_t* axy, const char* me,
-                              const char* indxylsfn, const char* redgreenfn,
-                              double plotscale, const char* bgfn) {
-    sl* cmdline = sl_new(16);
+// Returns NULL if the match file can't be read.
+static char* index_overlay_command(const char* plotxy, augment_xylist_t* axy, const char* me,
+                                   const char* indxylsfn, const char* redgreenfn,
+                                   double plotscale, const char* bgfn) {
+    sl* cmdline;
     char* cmd;
     matchfile* mf;
     MatchObj* mo;
     int i;
-    anbool ctrlc;
     char* imgfn;
     char* plotquad = NULL;
 
@@ -356,14 +378,16 @@ static int plot_index_overlay(const char* plotxy, augment_xylist_t* axy, const c
     mf = matchfile_open(axy->matchfn);
     if (!mf) {
         ERROR("Failed to read matchfile %s", axy->matchfn);
-        return -1;
+        return NULL;
     }
     // just read the first match...
     mo = matchfile_read_match(mf);
     if (!mo) {
         ERROR("Failed to read a match from matchfile %s", axy->matchfn);
-        return -1;
+        matchfile_close(mf);
+        return NULL;
     }
+    cmdline = sl_new(16);
 
     // sources + index overlay
     imgfn = axy->pnmfn;
@@ -446,21 +470,15 @@ static int plot_index_overlay(const char* plotxy, augment_xylist_t* axy, const c
     
     cmd = sl_implode(cmdline, " ");
     sl_free2(cmdline);
-    logverb("Running:\n  %s\n", cmd);
-    if (run_command(cmd, &ctrlc)) {
-        ERROR("Plotting commands %s; exiting.", (ctrlc ? "were cancelled" : "failed"));
-        return -1;
-    }
-    free(cmd);
     free(plotquad);
-    return 0;
+    return cmd;
 }
 
-static int plot_annotations(augment_xylist_t* axy, const char* me, anbool verbose,
-                            const char* annfn, double plotscale, const char* bgfn) {
+// Returns NULL if plot-constellations can't be found.
+static char* annotations_command(augment_xylist_t* axy, const char* me, anbool verbose,
+                                 const char* annfn, double plotscale, const char* bgfn) {
     sl* cmdline = sl_new(16);
     char* cmd;
-    sl* lines;
     char* imgfn;
     char* plotconst = NULL;
 
@@ -485,7 +503,8 @@ static int plot_annotations(augment_xylist_t* axy, const char* me, anbool verbos
     }
     if (!plotconst) {
 	logerr("Failed to find plot-constellations program, not creating overlay plot.");
-	return -1;
+	sl_free2(cmdline);
+	return NULL;
     }
     append_executable(cmdline, plotconst, me);
     if (verbose)
@@ -510,23 +529,32 @@ static int plot_annotations(augment_xylist_t* axy, const char* me, anbool verbos
     append_escape(cmdline, annfn);
     cmd = sl_implode(cmdline, " ");
     sl_free2(cmdline);
+    free(plotconst);
+    return cmd;
+}
+
+// Runs plot-constellations, and lists what it found in the field
+// (named "field", if given).
+static int run_annotations_command(const char* cmd, const char* field) {
+    sl* lines;
     logverb("Running:\n  %s\n", cmd);
     if (run_command_get_outputs(cmd, &lines, NULL)) {
         ERROR("plot-constellations failed");
         return -1;
     }
-    free(cmd);
     if (lines && sl_size(lines)) {
         int i;
         if (strlen(sl_get(lines, 0))) {
-            logmsg("Your field contains:\n");
+            if (field)
+                logmsg("Field %s contains:\n", field);
+            else
+                logmsg("Your field contains:\n");
             for (i=0; i<sl_size(lines); i++)
                 logmsg("  %s\n", sl_get(lines, i));
         }
     }
     if (lines)
         sl_free2(lines);
-    free(plotconst);
     return 0;
 }
 
@@ -535,6 +563,46 @@ static char* none_is_null(char* in) {
     return streq(in, "none") ? NULL : in;
 }
 
+// Sets up the engine, and the indexes it finds, if that hasn't been
+// done yet.
+static void get_engine(engine_t** pengine, const char* configfn,
+                       const char* me, sl* index_dirs, sl* index_files) {
+    char* mydir;
+    char* tmp;
+    if (*pengine)
+        return;
+    tmp = strdup(me ? me : ".");
+    mydir = strdup(dirname(tmp));
+    free(tmp);
+    gslutils_use_error_system();
+    *pengine = engine_new();
+    if (engine_configure(*pengine, configfn, mydir, index_dirs,
+                         index_files)) {
+        ERROR("Failed to set up the engine");
+        exit(-1);
+    }
+    free(mydir);
+}
+
+/*
+ Solves the given axy files in this process.  The engine, and the
+ indexes it finds, are set up on the first call and kept for the rest.
+ */
+static void run_engine_in_process(engine_t** pengine, const char* configfn,
+                                  const char* me, sl* index_dirs,
+                                  sl* index_files, sl* axyfns) {
+    int i;
+    logmsg("Solving...\n");
+    get_engine(pengine, configfn, me, index_dirs, index_files);
+    for (i=0; i<sl_size(axyfns); i++) {
+        if (engine_run_job_file(*pengine, sl_get(axyfns, i), NULL, NULL) == -1) {
+            ERROR("engine failed on \"%s\"", sl_get(axyfns, i));
+            exit(-1);
+        }
+    }
+    fflush(NULL);
+}
+
 static void run_engine(sl* engineargs) {
     char* cmd;
     cmd = sl_implode(engineargs, " ");
@@ -560,8 +628,36 @@ struct solve_field_args {
 };
 typedef struct solve_field_args solve_field_args_t;
 
+/*
+ With --plot-in-background: an input file's plotting commands, run by
+ a background thread (see struct plot_queue) rather than before the
+ next file is solved.  The job owns the temp files its commands read,
+ and deletes them when they are done.
+ */
+struct plot_job {
+    // the input file, for messages.
+    char* field;
+    // plotxy (and plotquad) commands
+    sl* cmds;
+    // plot-constellations command, whose output lists what's in the field.
+    char* anncmd;
+    sl* tempfiles;
+    sl* tempdirs;
+    anbool keep_temp;
+};
+
+static struct plot_job* plot_job_new(const char* field) {
+    struct plot_job* job = calloc(1, sizeof(struct plot_job));
+    job->field = strdup_safe(field);
+    job->cmds = sl_new(4);
+    return job;
+}
 
-// This runs after "astrometry-engine" is run on the file.
+
+/*
+ This runs after "astrometry-engine" is run on the file.  If "plots" is
+ given, the plotting commands are added to it rather than run.
+ */
 static void after_solved(augment_xylist_t* axy,
                          solve_field_args_t* sf,
                          anbool makeplots,
@@ -572,7 +668,8 @@ static void after_solved(augment_xylist_t* axy,
                          sl* tempfiles,
 			 const char* plotxy,
                          double plotscale,
-                         const char* bgfn) {
+                         const char* bgfn,
+                         struct plot_job* plots) {
     sip_t wcs;
     double ra, dec, fieldw, fieldh;
     char rastr[32], decstr[32];
@@ -626,23 +723,35 @@ static void after_solved(augment_xylist_t* axy,
         assert(axy->rdlsfn);
         // index rdls to xyls.
         if (wcs_rd2xy(axy->wcsfn, 0, axy->rdlsfn, sf->indxylsfn,
-                      NULL, NULL, FALSE, FALSE, NULL)) {
+                      NULL, NULL, FALSE, FALSE, FALSE, NULL)) {
             ERROR("Failed to project index stars into field coordinates using wcs-rd2xy");
             exit(-1);
         }
     }
 
     if (makeplots && file_exists(sf->indxylsfn) && file_readable(axy->matchfn) && file_readable(axy->wcsfn)) {
+        char* cmd;
         logmsg("Creating index object overlay plot...\n");
-        if (plot_index_overlay(plotxy, axy, me, sf->indxylsfn, sf->redgreenfn, plotscale, bgfn)) {
-            ERROR("Plot index overlay failed.");
+        cmd = index_overlay_command(plotxy, axy, me, sf->indxylsfn, sf->redgreenfn, plotscale, bgfn);
+        if (cmd && plots)
+            sl_append_nocopy(plots->cmds, cmd);
+        else {
+            if (!cmd || run_plot_command(cmd))
+                ERROR("Plot index overlay failed.");
+            free(cmd);
         }
     }
 
     if (makeplots && file_readable(axy->wcsfn)) {
+        char* cmd;
         logmsg("Creating annotation plot...\n");
-        if (plot_annotations(axy, me, verbose, sf->ngcfn, plotscale, bgfn)) {
-            ERROR("Plot annotations failed.");
+        cmd = annotations_command(axy, me, verbose, sf->ngcfn, plotscale, bgfn);
+        if (cmd && plots)
+            plots->anncmd = cmd;
+        else {
+            if (!cmd || run_annotations_command(cmd, NULL))
+                ERROR("Plot annotations failed.");
+            free(cmd);
         }
     }
 
@@ -732,6 +841,233 @@ static void delete_temp_files(sl* tempfiles, sl* tempdirs) {
     }
 }
 
+/*
+ The background plotting thread, with --plot-in-background: it runs the
+ queued plot jobs one at a time, in order.  Jobs are never refused, so
+ that queuing one never waits.
+ */
+struct plot_queue {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // signalled when a job is added, and when "done" is set.
+    pthread_cond_t cond;
+    pl* jobs;
+    anbool done;
+};
+
+static void run_plot_job(struct plot_job* job) {
+    int i;
+    for (i=0; i<sl_size(job->cmds); i++)
+        if (run_plot_command(sl_get(job->cmds, i)))
+            ERROR("Plotting failed for %s", job->field);
+    if (job->anncmd && run_annotations_command(job->anncmd, job->field))
+        ERROR("Plot annotations failed for %s", job->field);
+    errors_print_stack(stdout);
+    errors_clear_stack();
+    if (!job->keep_temp)
+        delete_temp_files(job->tempfiles, job->tempdirs);
+    free(job->field);
+    free(job->anncmd);
+    sl_free2(job->cmds);
+    sl_free2(job->tempfiles);
+    sl_free2(job->tempdirs);
+    free(job);
+}
+
+static void* plot_thread(void* v) {
+    struct plot_queue* q = v;
+    // (with --jobs, logging is per-thread.)
+    log_to(stdout);
+    for (;;) {
+        struct plot_job* job = NULL;
+        pthread_mutex_lock(&q->lock);
+        while (!pl_size(q->jobs) && !q->done)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (pl_size(q->jobs)) {
+            job = pl_get(q->jobs, 0);
+            pl_remove(q->jobs, 0);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (!job)
+            break;
+        run_plot_job(job);
+    }
+    return NULL;
+}
+
+static int plot_queue_start(struct plot_queue* q) {
+    memset(q, 0, sizeof(struct plot_queue));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->jobs = pl_new(16);
+    if (pthread_create(&q->thread, NULL, plot_thread, q)) {
+        SYSERROR("Failed to start plotting thread");
+        pl_free(q->jobs);
+        pthread_cond_destroy(&q->cond);
+        pthread_mutex_destroy(&q->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ Queues "job", which takes over the temp files in "tempfiles" and
+ "tempdirs" (leaving them empty).
+ */
+static void plot_queue_add(struct plot_queue* q, struct plot_job* job,
+                           sl* tempfiles, sl* tempdirs, anbool keep_temp) {
+    job->tempfiles = sl_new(4);
+    job->tempdirs = sl_new(4);
+    if (tempfiles) {
+        sl_append_contents(job->tempfiles, tempfiles);
+        sl_remove_all(tempfiles);
+    }
+    if (tempdirs) {
+        sl_append_contents(job->tempdirs, tempdirs);
+        sl_remove_all(tempdirs);
+    }
+    job->keep_temp = keep_temp;
+    pthread_mutex_lock(&q->lock);
+    pl_append(q->jobs, job);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Waits for the queued jobs to finish, and stops the thread.
+static void plot_queue_finish(struct plot_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->done = TRUE;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    pl_free(q->jobs);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+
+/*
+ With --jobs: the input files are prepared (downloaded, source
+ extraction, the objects plot) one after another by the main thread,
+ and queued for "njobs" threads that solve them with one shared engine
+ and make their after-solved outputs, so that preparing the next file
+ overlaps with solving.  Each file's log messages are collected, and
+ printed together when it is done.
+ */
+struct solve_item {
+    augment_xylist_t axy;
+    solve_field_args_t sf;
+    anbool makeplots;
+    const char* plotxy;
+    char* bgfn;
+    // with --plot-in-background: this file's plotting commands.
+    struct plot_job* plots;
+    // (a copy, if it was read from stdin)
+    char* infile;
+    // the strings that "axy" and "sf" point to (and this file's output
+    // and temp files), now owned by the item.
+    sl* outfiles;
+    sl* tempfiles;
+    sl* tempdirs;
+    // this file's log messages, so far.
+    FILE* logf;
+    char* logbuf;
+    size_t logsize;
+};
+
+struct solve_queue {
+    pthread_mutex_t lock;
+    // signalled when an item is added or taken, and when "done" is set.
+    pthread_cond_t cond;
+    pl* items;
+    // items waiting, at most (so that prepared files don't pile up).
+    int maxwaiting;
+    anbool done;
+    engine_t* engine;
+    const augment_xylist_t* allaxy;
+    const char* me;
+    anbool verbose;
+    double plotscale;
+    // with --plot-in-background
+    struct plot_queue* plotq;
+};
+
+// Stops collecting "it"'s log messages, and prints them.
+static void print_item_log(struct solve_queue* q, struct solve_item* it) {
+    log_to(stdout);
+    fclose(it->logf);
+    it->logf = NULL;
+    pthread_mutex_lock(&q->lock);
+    fwrite(it->logbuf, 1, it->logsize, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&q->lock);
+    free(it->logbuf);
+    it->logbuf = NULL;
+}
+
+static void solve_item(struct solve_queue* q, struct solve_item* it) {
+    augment_xylist_t* axy = &it->axy;
+
+    log_to(it->logf);
+    logmsg("Solving...\n");
+    if (engine_run_job_file(q->engine, axy->axyfn, NULL, NULL) == -1) {
+        ERROR("engine failed on \"%s\"", axy->axyfn);
+        exit(-1);
+    }
+    after_solved(axy, &it->sf, it->makeplots, q->me, q->verbose,
+                 axy->tempdir, it->tempdirs, it->tempfiles, it->plotxy,
+                 q->plotscale, it->bgfn, it->plots);
+    if (it->plots)
+        plot_queue_add(q->plotq, it->plots, it->tempfiles, it->tempdirs,
+                       axy->no_delete_temp);
+    else if (!axy->no_delete_temp)
+        delete_temp_files(it->tempfiles, it->tempdirs);
+    logmsg("\n");
+    print_item_log(q, it);
+
+    free(it->infile);
+    free(axy->fitsimgfn);
+    free(axy->solvedinfn);
+    free(axy->checkpointfn);
+    free(it->bgfn);
+    // erm.
+    if (axy->verifywcs != q->allaxy->verifywcs)
+        sl_free2(axy->verifywcs);
+    sl_free2(it->outfiles);
+    sl_free2(it->tempfiles);
+    sl_free2(it->tempdirs);
+    free(it);
+}
+
+static void* solve_thread(void* v) {
+    struct solve_queue* q = v;
+    for (;;) {
+        struct solve_item* it = NULL;
+        pthread_mutex_lock(&q->lock);
+        while (!pl_size(q->items) && !q->done)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (pl_size(q->items)) {
+            it = pl_get(q->items, 0);
+            pl_remove(q->items, 0);
+            pthread_cond_broadcast(&q->cond);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (!it)
+            break;
+        solve_item(q, it);
+    }
+    return NULL;
+}
+
+// Waits until there's room, then queues "it".
+static void solve_queue_add(struct solve_queue* q, struct solve_item* it) {
+    pthread_mutex_lock(&q->lock);
+    while (pl_size(q->items) >= q->maxwaiting)
+        pthread_cond_wait(&q->cond, &q->lock);
+    pl_append(q->items, it);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
 
 int main(int argc, char** args) {
     int c;
@@ -768,6 +1104,13 @@ int main(int argc, char** args) {
     char* index_xyls;
     anbool just_augment = FALSE;
     anbool engine_batch = FALSE;
+    anbool engine_subprocess = FALSE;
+    engine_t* engine = NULL;
+    char* engineconfig = NULL;
+    sl* engine_index_dirs;
+    sl* engine_index_files;
+    // axy files to solve (in this process)
+    sl* engineaxys;
     bl* batchaxy = NULL;
     bl* batchsf = NULL;
     sl* outfiles;
@@ -778,6 +1121,16 @@ int main(int argc, char** args) {
     anbool timestamp = FALSE;
     anbool tempaxy = FALSE;
     char* plotxy = NULL;
+    // --jobs
+    int njobs = 1;
+    anbool pipelined;
+    struct solve_queue queue;
+    pthread_t* solvers = NULL;
+    int nsolvers = 0;
+    // --plot-in-background
+    anbool bgplots = FALSE;
+    struct plot_queue plotq;
+    pl* batchplots = NULL;
 
     errors_print_on_exit(stderr);
     fits_use_error_system();
@@ -786,6 +1139,9 @@ int main(int argc, char** args) {
 
     engineargs = sl_new(16);
     append_executable(engineargs, "astrometry-engine", me);
+    engine_index_dirs = sl_new(4);
+    engine_index_files = sl_new(4);
+    engineaxys = sl_new(16);
 
     // output filenames.
     outfiles = sl_new(16);
@@ -863,18 +1219,31 @@ int main(int argc, char** args) {
         case '\x88':
             timestamp = TRUE;
             break;
+        case '\x9b':
+            // (in the environment, so that astrometry-engine sees it too.)
+            setenv("AN_PROFILE", optarg, 1);
+            break;
         case '\x84':
             plotscale = atof(optarg);
             break;
         case '\x85':
             inbgfn = optarg;
             break;
+        case '\xa0':
+            bgplots = TRUE;
+            break;
         case '\x87':
             allaxy->assume_fits_image = TRUE;
             break;
         case '(':
             engine_batch = TRUE;
             break;
+        case '\x99':
+            engine_subprocess = TRUE;
+            break;
+        case '\x9f':
+            njobs = atoi(optarg);
+            break;
         case '@':
             just_augment = TRUE;
             break;
@@ -912,14 +1281,17 @@ int main(int argc, char** args) {
         case '\x89':
             sl_append(engineargs, "--config");
             append_escape(engineargs, optarg);
+            engineconfig = optarg;
             break;
         case '\x96':
             sl_append(engineargs, "--index-dir");
             append_escape(engineargs, optarg);
+            sl_append(engine_index_dirs, optarg);
             break;
         case '\x97':
             sl_append(engineargs, "--index");
             append_escape(engineargs, optarg);
+            sl_append(engine_index_files, optarg);
             break;
         case 'f':
             fromstdin = TRUE;
@@ -974,6 +1346,7 @@ int main(int argc, char** args) {
     log_init(loglvl);
     if (timestamp)
         log_set_timestamp(TRUE);
+    profile_enable_from_env("solve-field");
 
     if (kmz && starts_with(kmz, "-"))
         logmsg("Do you really want to save KMZ to the file named \"%s\" ??\n", kmz);
@@ -985,6 +1358,7 @@ int main(int argc, char** args) {
     if (engine_batch) {
         batchaxy = bl_new(16, sizeof(augment_xylist_t));
         batchsf  = bl_new(16, sizeof(solve_field_args_t));
+        batchplots = pl_new(16);
     }
 
     // Allow (some of the) default filenames to be disabled by setting them to "none".
@@ -1007,6 +1381,43 @@ int main(int argc, char** args) {
     // number of engine args not specific to a particular file
     nbeargs = sl_size(engineargs);
 
+    bgplots = (bgplots && makeplots && !just_augment);
+    if (bgplots && plot_queue_start(&plotq))
+        bgplots = FALSE;
+
+    pipelined = (njobs > 1 && !engine_batch && !engine_subprocess &&
+                 !just_augment);
+    if (njobs > 1 && !pipelined)
+        logmsg("Ignoring --jobs: it only applies when solving in this process, without --batch.\n");
+    if (pipelined) {
+        // (so that each file's messages can go to its own log.)
+        log_set_thread_specific();
+        get_engine(&engine, engineconfig, me, engine_index_dirs,
+                   engine_index_files);
+        memset(&queue, 0, sizeof(queue));
+        pthread_mutex_init(&queue.lock, NULL);
+        pthread_cond_init(&queue.cond, NULL);
+        queue.items = pl_new(16);
+        queue.maxwaiting = njobs;
+        queue.engine = engine;
+        queue.allaxy = allaxy;
+        queue.me = me;
+        queue.verbose = verbose;
+        queue.plotscale = plotscale;
+        queue.plotq = &plotq;
+        solvers = malloc(njobs * sizeof(pthread_t));
+        for (nsolvers=0; nsolvers<njobs; nsolvers++)
+            if (pthread_create(solvers + nsolvers, NULL, solve_thread, &queue)) {
+                SYSERROR("Failed to start solver thread");
+                break;
+            }
+        if (!nsolvers) {
+            ERROR("No solver threads could be started");
+            exit(-1);
+        }
+        logmsg("Solving up to %i input files at once.\n", nsolvers);
+    }
+
     f = optind;
     inputnum = 0;
     while (1) {
@@ -1030,6 +1441,11 @@ int main(int argc, char** args) {
         solve_field_args_t thesf;
         solve_field_args_t* sf = &thesf;
         anbool want_pnm = FALSE;
+        // with --jobs: this file, to be solved by a solver thread.
+        struct solve_item* item = NULL;
+        // with --plot-in-background: this file's plotting commands.
+        struct plot_job* plots = NULL;
+        char fnbuf[1024];
 
         // reset augment-xylist args.
         memcpy(axy, allaxy, sizeof(augment_xylist_t));
@@ -1037,7 +1453,6 @@ int main(int argc, char** args) {
         memset(sf, 0, sizeof(solve_field_args_t));
 
         if (fromstdin) {
-            char fnbuf[1024];
             if (!fgets(fnbuf, sizeof(fnbuf), stdin)) {
                 if (ferror(stdin))
                     SYSERROR("Failed to read a filename from stdin");
@@ -1047,15 +1462,26 @@ int main(int argc, char** args) {
             if (fnbuf[len-1] == '\n')
                 fnbuf[len-1] = '\0';
             infile = fnbuf;
-            logmsg("Reading input file \"%s\"...\n", infile);
         } else {
             if (f == argc)
                 break;
             infile = args[f];
             f++;
+        }
+        if (pipelined) {
+            item = calloc(1, sizeof(struct solve_item));
+            item->logf = open_memstream(&item->logbuf, &item->logsize);
+            if (!item->logf) {
+                SYSERROR("Failed to collect log messages");
+                exit(-1);
+            }
+            log_to(item->logf);
+        }
+        if (fromstdin)
+            logmsg("Reading input file \"%s\"...\n", infile);
+        else
             logmsg("Reading input file %i of %i: \"%s\"...\n",
                    f - optind, argc - optind, infile);
-        }
         inputnum++;
 
         cmdline = sl_new(16);
@@ -1063,6 +1489,7 @@ int main(int argc, char** args) {
         if (!engine_batch) {
             // Remove arguments that might have been added in previous trips through this loop
             sl_remove_from(engineargs,  nbeargs);
+            sl_remove_all(engineaxys);
         }
 
         // Choose the base path/filename for output files.
@@ -1127,6 +1554,10 @@ int main(int argc, char** args) {
             axy->wcsfn    = sl_appendf(outfiles, axy->wcsfn,       base);
         if (axy->corrfn)
             axy->corrfn   = sl_appendf(outfiles, axy->corrfn,      base);
+        if (axy->statsfn)
+            axy->statsfn  = sl_appendf(outfiles, axy->statsfn,     base);
+        if (axy->tracefn)
+            axy->tracefn  = sl_appendf(outfiles, axy->tracefn,     base);
         if (axy->cancelfn)
             axy->cancelfn  = sl_appendf(outfiles, axy->cancelfn, base);
         if (axy->keepxylsfn)
@@ -1157,6 +1588,9 @@ int main(int argc, char** args) {
 
         if (axy->solvedinfn)
             asprintf_safe(&axy->solvedinfn, axy->solvedinfn, base);
+        // (not an output file: it's kept between runs.)
+        if (axy->checkpointfn)
+            asprintf_safe(&axy->checkpointfn, axy->checkpointfn, base);
 
         // Do %s replacement on --verify-wcs entries...
         if (sl_size(axy->verifywcs)) {
@@ -1342,24 +1776,70 @@ int main(int argc, char** args) {
             logmsg("Making source extraction overlay plot -- pnmfn = %s\n", axy->pnmfn);
 
             // source extraction overlay
-            if (plot_source_overlay(plotxy, axy, me, objsfn, plotscale, bgfn))
+            if (bgplots) {
+                plots = plot_job_new(infile);
+                sl_append_nocopy(plots->cmds,
+                                 source_overlay_command(plotxy, axy, me, objsfn,
+                                                        plotscale, bgfn));
+            } else if (plot_source_overlay(plotxy, axy, me, objsfn, plotscale, bgfn))
                 makeplots = FALSE;
         }
 
         append_escape(engineargs, axy->axyfn);
+        sl_append(engineaxys, axy->axyfn);
 
         if (file_readable(axy->wcsfn))
             axy->wcs_last_mod = file_get_last_modified_time(axy->wcsfn);
         else
             axy->wcs_last_mod = 0;
 
-        if (!engine_batch) {
-            run_engine(engineargs);
+        if (item) {
+            // hand this file over to a solver thread.
+            memcpy(&item->axy, axy, sizeof(augment_xylist_t));
+            memcpy(&item->sf, sf, sizeof(solve_field_args_t));
+            item->makeplots = makeplots;
+            item->plotxy = plotxy;
+            item->bgfn = bgfn;
+            bgfn = NULL;
+            item->plots = plots;
+            plots = NULL;
+            if (fromstdin && infile == fnbuf) {
+                item->infile = strdup(infile);
+                if (item->axy.imagefn == infile)
+                    item->axy.imagefn = item->infile;
+                if (item->axy.xylsfn == infile)
+                    item->axy.xylsfn = item->infile;
+            }
+            item->outfiles = outfiles;
+            item->tempfiles = tempfiles;
+            item->tempdirs = tempdirs;
+            outfiles = sl_new(16);
+            tempfiles = sl_new(4);
+            tempdirs = sl_new(4);
+            log_to(stdout);
+            solve_queue_add(&queue, item);
+            item = NULL;
+            sl_free2(cmdline);
+            free(base);
+            continue;
+        } else if (!engine_batch) {
+            if (engine_subprocess)
+                run_engine(engineargs);
+            else
+                run_engine_in_process(&engine, engineconfig, me,
+                                      engine_index_dirs, engine_index_files,
+                                      engineaxys);
+            PROFILE_BEGIN("after-solved");
             after_solved(axy, sf, makeplots, me, verbose,
-                         axy->tempdir, tempdirs, tempfiles, plotxy, plotscale, bgfn);
+                         axy->tempdir, tempdirs, tempfiles, plotxy, plotscale, bgfn,
+                         plots);
+            PROFILE_END("after-solved");
+            profile_flush(axy->axyfn);
         } else {
             bl_append(batchaxy, axy);
             bl_append(batchsf,  sf );
+            pl_append(batchplots, plots);
+            plots = NULL;
         }
         fflush(NULL);
 
@@ -1371,41 +1851,89 @@ int main(int argc, char** args) {
         if (!engine_batch) {
             free(axy->fitsimgfn);
             free(axy->solvedinfn);
+            free(axy->checkpointfn);
             free(bgfn);
             // erm.
             if (axy->verifywcs != allaxy->verifywcs)
                 sl_free2(axy->verifywcs);
             sl_remove_all(outfiles);
-            if (!axy->no_delete_temp)
+            if (plots) {
+                // (the plots need the temp files.)
+                plot_queue_add(&plotq, plots, tempfiles, tempdirs,
+                               axy->no_delete_temp);
+                plots = NULL;
+            } else if (!axy->no_delete_temp)
                 delete_temp_files(tempfiles, tempdirs);
         }
-        errors_print_stack(stdout);
+        errors_print_stack(item ? item->logf : stdout);
         errors_clear_stack();
         logmsg("\n");
+        if (item) {
+            print_item_log(&queue, item);
+            free(item);
+        }
+    }
+
+    if (pipelined) {
+        pthread_mutex_lock(&queue.lock);
+        queue.done = TRUE;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+        for (i=0; i<nsolvers; i++)
+            pthread_join(solvers[i], NULL);
+        free(solvers);
+        pl_free(queue.items);
+        pthread_cond_destroy(&queue.cond);
+        pthread_mutex_destroy(&queue.lock);
+        errors_print_stack(stdout);
+        errors_clear_stack();
     }
 
     if (engine_batch) {
-        run_engine(engineargs);
+        if (engine_subprocess)
+            run_engine(engineargs);
+        else
+            run_engine_in_process(&engine, engineconfig, me,
+                                  engine_index_dirs, engine_index_files,
+                                  engineaxys);
         for (i=0; i<bl_size(batchaxy); i++) {
             augment_xylist_t* axy = bl_access(batchaxy, i);
             solve_field_args_t* sf = bl_access(batchsf, i);
+            struct plot_job* plots = pl_get(batchplots, i);
 
+            PROFILE_BEGIN("after-solved");
             after_solved(axy, sf, makeplots, me, verbose,
-                         axy->tempdir, tempdirs, tempfiles, plotxy, plotscale, bgfn);
+                         axy->tempdir, tempdirs, tempfiles, plotxy, plotscale, bgfn,
+                         plots);
+            PROFILE_END("after-solved");
+            if (plots)
+                plot_queue_add(&plotq, plots, NULL, NULL, FALSE);
+            profile_flush(axy->axyfn);
             errors_print_stack(stdout);
             errors_clear_stack();
             logmsg("\n");
 
             free(axy->fitsimgfn);
             free(axy->solvedinfn);
+            free(axy->checkpointfn);
             // erm.
             if (axy->verifywcs != allaxy->verifywcs)
                 sl_free2(axy->verifywcs);
         }
-        if (!allaxy->no_delete_temp)
+        if (bgplots)
+            // a job that just deletes the temp files, after the plots.
+            plot_queue_add(&plotq, plot_job_new(NULL), tempfiles, tempdirs,
+                           allaxy->no_delete_temp);
+        else if (!allaxy->no_delete_temp)
             delete_temp_files(tempfiles, tempdirs);
         bl_free(batchaxy);
         bl_free(batchsf);
+        pl_free(batchplots);
+    }
+
+    if (bgplots) {
+        logverb("Waiting for the plots to finish...\n");
+        plot_queue_finish(&plotq);
     }
 
     if (!allaxy->no_delete_temp)
@@ -1417,6 +1945,10 @@ int main(int argc, char** args) {
     sl_free2(tempfiles2);
     sl_free2(tempdirs);
     sl_free2(engineargs);
+    sl_free2(engineaxys);
+    sl_free2(engine_index_dirs);
+    sl_free2(engine_index_files);
+    engine_free(engine);
     free(me);
     augment_xylist_free_contents(allaxy);
 
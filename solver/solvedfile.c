@@ -11,10 +11,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <fcntl.h>
 
+#include "os-features.h"
 #include "solvedfile.h"
 #include "errors.h"
+#include "ioutils.h"
 
 #if defined(__APPLE__)
 // MacOS 10.3 with gcc 3.3 doesn't have O_SYNC.
@@ -295,3 +298,136 @@ int solvedfile_set(char* fn, int fieldnum) {
     return 0;
 }
 
+
+struct solvedfile_map {
+    char* fn;
+    // -1 until the file is opened.
+    int fd;
+    anbool writable;
+    unsigned char* map;
+    size_t size;
+};
+
+solvedfile_map_t* solvedfile_map_open(const char* fn) {
+    solvedfile_map_t* sf = calloc(1, sizeof(solvedfile_map_t));
+    if (!sf) {
+        SYSERROR("Failed to allocate solvedfile map");
+        return NULL;
+    }
+    sf->fn = strdup_safe(fn);
+    sf->fd = -1;
+    return sf;
+}
+
+static void map_unmap(solvedfile_map_t* sf) {
+    if (sf->map)
+        munmap(sf->map, sf->size);
+    sf->map = NULL;
+    sf->size = 0;
+}
+
+// (Re-)maps the whole file, which other processes may have grown.
+static int map_remap(solvedfile_map_t* sf) {
+    struct stat st;
+    if (fstat(sf->fd, &st)) {
+        SYSERROR("Failed to stat solved file \"%s\"", sf->fn);
+        return -1;
+    }
+    if ((size_t)st.st_size == sf->size)
+        return 0;
+    map_unmap(sf);
+    if (st.st_size == 0)
+        return 0;
+    sf->map = mmap(NULL, st.st_size, PROT_READ | (sf->writable ? PROT_WRITE : 0),
+                   MAP_SHARED, sf->fd, 0);
+    if (sf->map == MAP_FAILED) {
+        SYSERROR("Failed to mmap solved file \"%s\"", sf->fn);
+        sf->map = NULL;
+        return -1;
+    }
+    sf->size = st.st_size;
+    return 0;
+}
+
+static int map_reopen(solvedfile_map_t* sf, anbool writable) {
+    int fd;
+    if (writable)
+        // (file mode 666; umask will modify this, if set).
+        fd = open(sf->fn, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    else
+        fd = open(sf->fn, O_RDONLY);
+    if (fd == -1) {
+        if (!writable && errno == ENOENT)
+            return 0;
+        SYSERROR("Failed to open solved file \"%s\"", sf->fn);
+        return -1;
+    }
+    map_unmap(sf);
+    if (sf->fd != -1)
+        close(sf->fd);
+    sf->fd = fd;
+    sf->writable = writable;
+    return map_remap(sf);
+}
+
+int solvedfile_map_get(solvedfile_map_t* sf, int fieldnum) {
+    // 1-index
+    size_t i = fieldnum - 1;
+    if (sf->fd == -1) {
+        if (map_reopen(sf, FALSE))
+            return -1;
+        if (sf->fd == -1)
+            return 0;
+    }
+    if (i >= sf->size && map_remap(sf))
+        return -1;
+    if (i >= sf->size)
+        return 0;
+    return __atomic_load_n(sf->map + i, __ATOMIC_ACQUIRE) ? 1 : 0;
+}
+
+int solvedfile_map_set(solvedfile_map_t* sf, int fieldnum) {
+    // 1-index
+    size_t i = fieldnum - 1;
+    long pagesize;
+    size_t page;
+
+    if (!sf->writable && map_reopen(sf, TRUE))
+        return -1;
+    if (i >= sf->size) {
+        struct stat st;
+        // several processes may be growing the file at once; never shrink it.
+        if (flock(sf->fd, LOCK_EX)) {
+            SYSERROR("Failed to lock solved file \"%s\"", sf->fn);
+            return -1;
+        }
+        if (fstat(sf->fd, &st) ||
+            ((size_t)st.st_size <= i && ftruncate(sf->fd, (off_t)i + 1))) {
+            SYSERROR("Failed to grow solved file \"%s\"", sf->fn);
+            flock(sf->fd, LOCK_UN);
+            return -1;
+        }
+        flock(sf->fd, LOCK_UN);
+        if (map_remap(sf))
+            return -1;
+    }
+    __atomic_store_n(sf->map + i, 1, __ATOMIC_RELEASE);
+    // as with O_SYNC above: make it visible to readers on other machines.
+    pagesize = sysconf(_SC_PAGESIZE);
+    page = i - (i % pagesize);
+    if (msync(sf->map + page, MIN(sf->size - page, (size_t)pagesize), MS_SYNC)) {
+        SYSERROR("Failed to sync solved file \"%s\"", sf->fn);
+        return -1;
+    }
+    return 0;
+}
+
+void solvedfile_map_close(solvedfile_map_t* sf) {
+    if (!sf)
+        return;
+    map_unmap(sf);
+    if (sf->fd != -1)
+        close(sf->fd);
+    free(sf->fn);
+    free(sf);
+}
@@ -0,0 +1,201 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "solver-batch.h"
+#include "solver.h"
+#include "starxy.h"
+#include "matchobj.h"
+#include "mathutil.h"
+#include "starutil.h"
+#include "tic.h"
+#include "errors.h"
+#include "log.h"
+
+void solver_batch_params_init(solver_batch_params_t* params) {
+    memset(params, 0, sizeof(solver_batch_params_t));
+    params->parity = PARITY_BOTH;
+    params->logodds_solve = log(1e9);
+    params->tweak_order = 2;
+    params->quadsize_min = 0.1;
+    params->quadsize_max = 1.0;
+}
+
+struct batch {
+    pl* indexes;
+    const solver_batch_params_t* params;
+    const solver_batch_field_t* fields;
+    solver_batch_result_t* results;
+    int nfields;
+    int next;
+    pthread_mutex_t lock;
+};
+
+static void solve_one(solver_t* sp, const struct batch* b,
+                      const solver_batch_field_t* field,
+                      solver_batch_result_t* result) {
+    const solver_batch_params_t* p = b->params;
+    starxy_t* xy;
+    double xlo, xhi, ylo, yhi;
+    size_t i;
+
+    memset(result, 0, sizeof(solver_batch_result_t));
+    if (field->N < 4)
+        return;
+
+    xy = starxy_new(field->N, field->flux != NULL, FALSE);
+    starxy_set_x_array(xy, field->x);
+    starxy_set_y_array(xy, field->y);
+    if (field->flux) {
+        starxy_set_flux_array(xy, field->flux);
+        starxy_sort_by_flux(xy);
+    }
+
+    if (field->imagew > 0 && field->imageh > 0) {
+        xlo = 0;
+        xhi = field->imagew;
+        ylo = 0;
+        yhi = field->imageh;
+    } else {
+        xlo = ylo =  LARGE_VAL;
+        xhi = yhi = -LARGE_VAL;
+        for (i=0; i<(size_t)field->N; i++) {
+            xlo = MIN(xlo, field->x[i]);
+            xhi = MAX(xhi, field->x[i]);
+            ylo = MIN(ylo, field->y[i]);
+            yhi = MAX(yhi, field->y[i]);
+        }
+    }
+
+    solver_set_default_values(sp);
+    if (p->pixscale_low > 0 && p->pixscale_high > 0) {
+        sp->funits_lower = p->pixscale_low;
+        sp->funits_upper = p->pixscale_high;
+    } else {
+        // the engine's default range of field widths.
+        sp->funits_lower = deg2arcsec(0.1) / (xhi - xlo);
+        sp->funits_upper = deg2arcsec(180.0) / (xhi - xlo);
+    }
+    solver_set_parity(sp, p->parity);
+    solver_set_keep_logodds(sp, p->logodds_solve);
+    // (with no record_match_callback, every match that is kept solves.)
+    sp->logratio_toprint = MIN(sp->logratio_toprint, sp->logratio_tokeep);
+    sp->logratio_totune = log(1e6);
+    sp->endobj = p->depth;
+    if (p->tweak_order >= 2) {
+        sp->do_tweak = TRUE;
+        sp->tweak_aborder = sp->tweak_abporder = p->tweak_order;
+    } else {
+        // as in engine.c: the tune-up can still run a linear tweak.
+        sp->tweak_aborder = sp->tweak_abporder = 1;
+    }
+    if (p->use_radec)
+        solver_set_radec(sp, p->ra, p->dec, p->radius);
+    if (p->timelimit > 0)
+        sp->deadline = timenow() + p->timelimit;
+    sp->distance_from_quad_bonus = TRUE;
+    for (i=0; i<pl_size(b->indexes); i++)
+        solver_add_index(sp, pl_get(b->indexes, i));
+
+    solver_set_field(sp, xy);
+    solver_set_field_bounds(sp, xlo, xhi, ylo, yhi);
+    solver_set_quad_size_fraction(sp, p->quadsize_min, p->quadsize_max);
+    solver_preprocess_field(sp);
+    solver_run(sp);
+
+    if (sp->best_match_solves) {
+        MatchObj* mo = &(sp->best_match);
+        result->solved = TRUE;
+        result->logodds = mo->logodds;
+        result->nmatch = mo->nmatch;
+        result->index = sp->best_index;
+        if (mo->sip) {
+            // take ownership of the tweaked solution.
+            result->wcs = mo->sip;
+            mo->sip = NULL;
+        } else {
+            result->wcs = sip_create();
+            sip_wrap_tan(&(mo->wcstan), result->wcs);
+        }
+    } else if (sp->have_best_match && sp->best_match.sip) {
+        sip_free(sp->best_match.sip);
+        sp->best_match.sip = NULL;
+    }
+    solver_cleanup_field(sp);
+    solver_cleanup(sp);
+}
+
+static void* batch_thread(void* arg) {
+    struct batch* b = arg;
+    solver_t solver;
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->nfields)
+            break;
+        solve_one(&solver, b, b->fields + i, b->results + i);
+        logverb("Field %i: %s\n", i, b->results[i].solved ?
+                "solved" : "did not solve");
+    }
+    return NULL;
+}
+
+int solver_batch_run(pl* indexes, const solver_batch_params_t* params,
+                     const solver_batch_field_t* fields, int nfields,
+                     int nthreads, solver_batch_result_t* results) {
+    struct batch b;
+    pthread_t* threads;
+    size_t i, nacquired;
+    int nstarted, rtn = 0;
+
+    for (nacquired=0; nacquired<pl_size(indexes); nacquired++) {
+        index_t* index = pl_get(indexes, nacquired);
+        if (index_acquire(index)) {
+            ERROR("Failed to load index %s", index->indexname);
+            rtn = -1;
+            goto bailout;
+        }
+    }
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, nfields));
+
+    memset(&b, 0, sizeof(b));
+    b.indexes = indexes;
+    b.params = params;
+    b.fields = fields;
+    b.results = results;
+    b.nfields = nfields;
+    pthread_mutex_init(&b.lock, NULL);
+
+    logverb("Solving %i fields with %zu indexes on %i threads\n",
+            nfields, pl_size(indexes), nthreads);
+    // the calling thread is one of the workers.
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (nstarted=0; nstarted<nthreads-1; nstarted++) {
+        if (pthread_create(threads + nstarted, NULL, batch_thread, &b)) {
+            SYSERROR("Failed to start solver thread %i", nstarted);
+            break;
+        }
+    }
+    batch_thread(&b);
+    for (i=0; i<(size_t)nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+
+ bailout:
+    for (i=0; i<nacquired; i++)
+        index_release(pl_get(indexes, i));
+    return rtn;
+}
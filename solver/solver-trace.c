@@ -0,0 +1,428 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "solver-trace.h"
+#include "md5.h"
+#include "ioutils.h"
+#include "bl.h"
+#include "errors.h"
+#include "log.h"
+
+struct solver_trace_t {
+    char* fn;
+    FILE* fid;
+    pthread_mutex_t lock;
+    // the field of the last search written, for "field same".
+    starxy_t* lastfield;
+    // MD5s of the index files already seen.
+    sl* md5paths;
+    sl* md5s;
+    anbool failed;
+};
+
+enum { P_DOUBLE, P_INT, P_BOOL, P_SIZE };
+
+struct trace_param {
+    const char* name;
+    int type;
+    size_t offset;
+};
+
+#define P(type, name, member) { name, type, offsetof(solver_t, member) }
+#define PI(type, name, member, i) \
+    { name, type, offsetof(solver_t, member) + (i) * sizeof(double) }
+
+// The solver_t fields that change what solver_run() does.
+static const struct trace_param params[] = {
+    P(P_DOUBLE, "pixel_xscale", pixel_xscale),
+    P(P_DOUBLE, "funits_lower", funits_lower),
+    P(P_DOUBLE, "funits_upper", funits_upper),
+    P(P_DOUBLE, "logratio_toprint", logratio_toprint),
+    P(P_DOUBLE, "logratio_tokeep", logratio_tokeep),
+    P(P_DOUBLE, "logratio_totune", logratio_totune),
+    P(P_BOOL,   "distance_from_quad_bonus", distance_from_quad_bonus),
+    P(P_BOOL,   "verify_uniformize", verify_uniformize),
+    P(P_BOOL,   "verify_dedup", verify_dedup),
+    P(P_BOOL,   "do_tweak", do_tweak),
+    P(P_INT,    "tweak_aborder", tweak_aborder),
+    P(P_INT,    "tweak_abporder", tweak_abporder),
+    P(P_DOUBLE, "verify_pix", verify_pix),
+    P(P_DOUBLE, "distractor_ratio", distractor_ratio),
+    P(P_DOUBLE, "codetol", codetol),
+    P(P_DOUBLE, "quadsize_min", quadsize_min),
+    P(P_DOUBLE, "quadsize_max", quadsize_max),
+    P(P_INT,    "startobj", startobj),
+    P(P_INT,    "endobj", endobj),
+    P(P_INT,    "max_field_objs", max_field_objs),
+    P(P_INT,    "parity", parity),
+    P(P_BOOL,   "use_radec", use_radec),
+    PI(P_DOUBLE, "centerx", centerxyz, 0),
+    PI(P_DOUBLE, "centery", centerxyz, 1),
+    PI(P_DOUBLE, "centerz", centerxyz, 2),
+    P(P_DOUBLE, "r2", r2),
+    P(P_DOUBLE, "logratio_bail_threshold", logratio_bail_threshold),
+    P(P_DOUBLE, "logratio_stoplooking", logratio_stoplooking),
+    P(P_INT,    "maxquads", maxquads),
+    P(P_INT,    "maxmatches", maxmatches),
+    P(P_SIZE,   "max_pquad_bytes", max_pquad_bytes),
+    P(P_BOOL,   "set_crpix", set_crpix),
+    P(P_BOOL,   "set_crpix_center", set_crpix_center),
+    PI(P_DOUBLE, "crpix1", crpix, 0),
+    PI(P_DOUBLE, "crpix2", crpix, 1),
+    P(P_INT,    "nthreads", nthreads),
+    P(P_INT,    "nverifiers", nverifiers),
+    P(P_BOOL,   "numa_pin", numa_pin),
+    P(P_DOUBLE, "field_minx", field_minx),
+    P(P_DOUBLE, "field_maxx", field_maxx),
+    P(P_DOUBLE, "field_miny", field_miny),
+    P(P_DOUBLE, "field_maxy", field_maxy),
+};
+#define N_PARAMS (sizeof(params) / sizeof(params[0]))
+
+static void write_param(FILE* fid, const struct trace_param* p,
+                        const solver_t* sp) {
+    const char* v = (const char*)sp + p->offset;
+    switch (p->type) {
+    case P_DOUBLE:
+        fprintf(fid, "param %s %.17g\n", p->name, *(const double*)v);
+        break;
+    case P_INT:
+        fprintf(fid, "param %s %i\n", p->name, *(const int*)v);
+        break;
+    case P_BOOL:
+        fprintf(fid, "param %s %i\n", p->name, (int)*(const anbool*)v);
+        break;
+    case P_SIZE:
+        fprintf(fid, "param %s %zu\n", p->name, *(const size_t*)v);
+        break;
+    }
+}
+
+// Returns 0 if "str" is a value for param "name", which is set.
+static int read_param(const char* name, const char* str, solver_t* sp) {
+    size_t i;
+    for (i=0; i<N_PARAMS; i++) {
+        const struct trace_param* p = params + i;
+        char* v = (char*)sp + p->offset;
+        int ival;
+        if (strcmp(p->name, name))
+            continue;
+        switch (p->type) {
+        case P_DOUBLE:
+            return (sscanf(str, "%lg", (double*)v) == 1) ? 0 : -1;
+        case P_INT:
+            return (sscanf(str, "%i", (int*)v) == 1) ? 0 : -1;
+        case P_BOOL:
+            if (sscanf(str, "%i", &ival) != 1)
+                return -1;
+            *(anbool*)v = (ival != 0);
+            return 0;
+        case P_SIZE:
+            return (sscanf(str, "%zu", (size_t*)v) == 1) ? 0 : -1;
+        }
+    }
+    // (an unknown parameter, eg from a newer version: ignore it.)
+    logverb("Ignoring unknown solver parameter \"%s\" in trace\n", name);
+    return 0;
+}
+
+int solver_trace_file_md5(const char* fn, char* hex) {
+    md5_context ctx;
+    unsigned char digest[16];
+    char buf[65536];
+    size_t n;
+    FILE* fid;
+    int i;
+
+    fid = fopen(fn, "rb");
+    if (!fid)
+        return -1;
+    md5_starts(&ctx);
+    while ((n = fread(buf, 1, sizeof(buf), fid)) > 0)
+        md5_update(&ctx, (uint8*)buf, n);
+    if (ferror(fid)) {
+        fclose(fid);
+        return -1;
+    }
+    fclose(fid);
+    md5_finish(&ctx, digest);
+    for (i=0; i<16; i++)
+        sprintf(hex + 2*i, "%02x", digest[i]);
+    return 0;
+}
+
+solver_trace_t* solver_trace_open(const char* fn) {
+    solver_trace_t* tr;
+    FILE* fid = fopen(fn, "w");
+    if (!fid) {
+        SYSERROR("Failed to open solver trace file \"%s\" for writing", fn);
+        return NULL;
+    }
+    fprintf(fid, "# astrometry.net solver trace\n");
+    tr = calloc(1, sizeof(solver_trace_t));
+    tr->fn = strdup(fn);
+    tr->fid = fid;
+    pthread_mutex_init(&tr->lock, NULL);
+    tr->md5paths = sl_new(4);
+    tr->md5s = sl_new(4);
+    return tr;
+}
+
+// Call with the lock held.
+static const char* index_md5(solver_trace_t* tr, const char* path) {
+    char hex[33];
+    ptrdiff_t i = sl_index_of(tr->md5paths, path);
+    if (i >= 0)
+        return sl_get(tr->md5s, i);
+    if (!path || solver_trace_file_md5(path, hex))
+        strcpy(hex, "-");
+    sl_append(tr->md5paths, path ? path : "");
+    return sl_append(tr->md5s, hex);
+}
+
+static anbool same_array(const double* a, const double* b, int N) {
+    if (!a || !b)
+        return (a == b);
+    return (memcmp(a, b, N * sizeof(double)) == 0);
+}
+
+static anbool same_field(const starxy_t* a, const starxy_t* b) {
+    return (a && b && (a->N == b->N) && same_array(a->x, b->x, a->N) &&
+            same_array(a->y, b->y, a->N) &&
+            same_array(a->flux, b->flux, a->N));
+}
+
+int solver_trace_record(solver_trace_t* tr, const solver_t* sp,
+                        int fieldnum, double logratio_tosolve,
+                        double wall, double cpu) {
+    FILE* fid = tr->fid;
+    const starxy_t* field = sp->fieldxy_orig;
+    size_t i;
+    int k;
+
+    pthread_mutex_lock(&tr->lock);
+    fprintf(fid, "search %i\n", fieldnum);
+    fprintf(fid, "tosolve %.17g\n", logratio_tosolve);
+    if (!field) {
+        fprintf(fid, "field 0\n");
+    } else if (same_field(field, tr->lastfield)) {
+        fprintf(fid, "field same\n");
+    } else {
+        fprintf(fid, "field %i\n", field->N);
+        for (k=0; k<field->N; k++) {
+            if (field->flux)
+                fprintf(fid, "star %.17g %.17g %.17g\n", field->x[k],
+                        field->y[k], field->flux[k]);
+            else
+                fprintf(fid, "star %.17g %.17g\n", field->x[k], field->y[k]);
+        }
+        starxy_free(tr->lastfield);
+        tr->lastfield = starxy_copy((starxy_t*)field);
+    }
+    for (i=0; i<pl_size(sp->indexes); i++) {
+        index_t* index = pl_get(sp->indexes, i);
+        fprintf(fid, "index %i %i %i %s %s\n", index->indexid,
+                index->healpix, index->hpnside,
+                index_md5(tr, index->indexname),
+                index->indexname ? index->indexname : "-");
+    }
+    for (i=0; i<N_PARAMS; i++)
+        write_param(fid, params + i, sp);
+    fprintf(fid, "result %i %i %i %i %i %.17g %.6f %.6f\n", sp->numtries,
+            sp->nummatches, sp->numscaleok, sp->num_verified,
+            (int)sp->best_match_solves, sp->best_logodds, wall, cpu);
+    if (sp->collect_stats)
+        for (k=0; k<SOLVER_N_STAGES; k++)
+            fprintf(fid, "stage %s %.6f %.6f\n", solver_stage_name(k),
+                    sp->stats.wall[k], sp->stats.cpu[k]);
+    fprintf(fid, "end\n");
+    if (fflush(fid) && !tr->failed) {
+        SYSERROR("Failed to write solver trace file \"%s\"", tr->fn);
+        tr->failed = TRUE;
+    }
+    pthread_mutex_unlock(&tr->lock);
+    return tr->failed ? -1 : 0;
+}
+
+int solver_trace_close(solver_trace_t* tr) {
+    int rtn;
+    if (!tr)
+        return 0;
+    rtn = tr->failed ? -1 : 0;
+    if (fclose(tr->fid)) {
+        SYSERROR("Failed to close solver trace file \"%s\"", tr->fn);
+        rtn = -1;
+    }
+    pthread_mutex_destroy(&tr->lock);
+    starxy_free(tr->lastfield);
+    sl_free2(tr->md5paths);
+    sl_free2(tr->md5s);
+    free(tr->fn);
+    free(tr);
+    return rtn;
+}
+
+static void free_search(solver_trace_search_t* s) {
+    size_t i;
+    if (s->field)
+        starxy_free(s->field);
+    if (s->indexes) {
+        for (i=0; i<bl_size(s->indexes); i++) {
+            solver_trace_index_t* ind = bl_access(s->indexes, i);
+            free(ind->path);
+        }
+        bl_free(s->indexes);
+    }
+    // (the params solver_t owns its empty index list.)
+    pl_free(s->params.indexes);
+}
+
+void solver_trace_free_searches(bl* searches) {
+    size_t i;
+    if (!searches)
+        return;
+    for (i=0; i<bl_size(searches); i++)
+        free_search(bl_access(searches, i));
+    bl_free(searches);
+}
+
+static int stage_number(const char* name) {
+    int k;
+    for (k=0; k<SOLVER_N_STAGES; k++)
+        if (streq(name, solver_stage_name(k)))
+            return k;
+    return -1;
+}
+
+bl* solver_trace_read(const char* fn) {
+    sl* lines;
+    bl* searches;
+    solver_trace_search_t* s = NULL;
+    // the field of the last search, for "field same".
+    starxy_t* lastfield = NULL;
+    int nstars = 0;
+    size_t i;
+
+    lines = file_get_lines(fn, FALSE);
+    if (!lines) {
+        ERROR("Failed to read solver trace file \"%s\"", fn);
+        return NULL;
+    }
+    searches = bl_new(16, sizeof(solver_trace_search_t));
+    for (i=0; i<sl_size(lines); i++) {
+        char* line = sl_get(lines, i);
+        char* nextword;
+
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if (is_word(line, "search ", &nextword)) {
+            if (s)
+                goto bailout;
+            s = bl_append(searches, NULL);
+            memset(s, 0, sizeof(solver_trace_search_t));
+            solver_set_default_values(&s->params);
+            s->indexes = bl_new(4, sizeof(solver_trace_index_t));
+            s->fieldnum = atoi(nextword);
+            continue;
+        }
+        if (!s)
+            goto bailout;
+        if (is_word(line, "tosolve ", &nextword)) {
+            if (sscanf(nextword, "%lg", &s->logratio_tosolve) != 1)
+                goto bailout;
+        } else if (is_word(line, "field ", &nextword)) {
+            if (streq(nextword, "same")) {
+                if (!lastfield)
+                    goto bailout;
+                s->field = starxy_copy(lastfield);
+            } else {
+                s->field = starxy_new(atoi(nextword), TRUE, FALSE);
+                s->field->N = 0;
+            }
+            nstars = 0;
+        } else if (is_word(line, "star ", &nextword)) {
+            double x, y, flux = 0;
+            int n = sscanf(nextword, "%lg %lg %lg", &x, &y, &flux);
+            if (!s->field || n < 2)
+                goto bailout;
+            s->field->x[nstars] = x;
+            s->field->y[nstars] = y;
+            s->field->flux[nstars] = flux;
+            nstars++;
+            s->field->N = nstars;
+        } else if (is_word(line, "index ", &nextword)) {
+            solver_trace_index_t* ind = bl_append(s->indexes, NULL);
+            char md5[33];
+            int n;
+            memset(ind, 0, sizeof(solver_trace_index_t));
+            if (sscanf(nextword, "%i %i %i %32s %n", &ind->indexid,
+                       &ind->healpix, &ind->hpnside, md5, &n) != 4)
+                goto bailout;
+            strcpy(ind->md5, md5);
+            ind->path = strdup(nextword + n);
+        } else if (is_word(line, "param ", &nextword)) {
+            char* sp = strchr(nextword, ' ');
+            if (!sp)
+                goto bailout;
+            *sp = '\0';
+            if (read_param(nextword, sp + 1, &s->params))
+                goto bailout;
+        } else if (is_word(line, "result ", &nextword)) {
+            int solved;
+            if (sscanf(nextword, "%i %i %i %i %i %lg %lg %lg", &s->numtries,
+                       &s->nummatches, &s->numscaleok, &s->num_verified,
+                       &solved, &s->best_logodds, &s->wall, &s->cpu) != 8)
+                goto bailout;
+            s->solved = solved;
+        } else if (is_word(line, "stage ", &nextword)) {
+            char name[64];
+            double w, c;
+            int k;
+            if (sscanf(nextword, "%63s %lg %lg", name, &w, &c) != 3)
+                goto bailout;
+            k = stage_number(name);
+            if (k >= 0) {
+                s->stage_wall[k] = w;
+                s->stage_cpu[k] = c;
+            }
+        } else if (streq(line, "end")) {
+            if (!s->field)
+                goto bailout;
+            lastfield = s->field;
+            s = NULL;
+        } else
+            goto bailout;
+    }
+    if (s)
+        goto bailout;
+    sl_free2(lines);
+    return searches;
+
+ bailout:
+    ERROR("Failed to parse solver trace file \"%s\", line %zu", fn, i + 1);
+    sl_free2(lines);
+    solver_trace_free_searches(searches);
+    return NULL;
+}
+
+void solver_trace_setup_solver(const solver_trace_search_t* search,
+                               solver_t* sp) {
+    size_t i;
+    for (i=0; i<N_PARAMS; i++) {
+        const struct trace_param* p = params + i;
+        size_t sz = (p->type == P_DOUBLE) ? sizeof(double) :
+            (p->type == P_INT) ? sizeof(int) :
+            (p->type == P_BOOL) ? sizeof(anbool) : sizeof(size_t);
+        memcpy((char*)sp + p->offset, (const char*)&search->params + p->offset,
+               sz);
+    }
+    solver_set_field(sp, starxy_copy(search->field));
+}
@@ -8,8 +8,10 @@
 #include <math.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "ioutils.h"
@@ -17,6 +19,7 @@
 #include "matchobj.h"
 #include "solver.h"
 #include "verify.h"
+#include "index-heatmap.h"
 #include "tic.h"
 #include "solvedfile.h"
 #include "fit-wcs.h"
@@ -28,6 +31,37 @@
 #include "quad-utils.h"
 #include "errors.h"
 #include "tweak2.h"
+#include "code-matcher.h"
+#include "an-alloc.h"
+#include "an-numa.h"
+#include "cpu-features.h"
+
+/*
+ check_inbox() transforms several field stars at once if it can.  On x86
+ there are SSE2, AVX and AVX-512 versions, and solver_run() picks the
+ widest one the CPU can run (see cpu-features.h); on arm64 it's NEON.
+ */
+#if defined(CPU_DISPATCH_X86)
+#include <immintrin.h>
+#define INBOX_USE_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define INBOX_USE_NEON 1
+#endif
+
+// (x must be non-zero)
+static inline int count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
 
 #if TESTING_TRYALLCODES
 #define DEBUGSOLVER 1
@@ -136,7 +170,6 @@ void solver_tweak2(solver_t* sp, MatchObj* mo, int order, sip_t* verifysip) {
     int* theta;
     double* odds;
     double* refradec;
-    int i;
     double newodds;
     int nm, nc, nd;
     int besti;
@@ -158,8 +191,7 @@ void solver_tweak2(solver_t* sp, MatchObj* mo, int order, sip_t* verifysip) {
 
     // mo->refradec may be NULL at this point, so get it from refxyz instead...
     refradec = malloc(3 * mo->nindex * sizeof(double));
-    for (i=0; i<mo->nindex; i++)
-        xyzarr2radecdegarr(mo->refxyz + i*3, refradec + i*2);
+    xyzarr2radecdegarr_batch(mo->refxyz, refradec, mo->nindex);
 
     // Verifying an existing WCS?
     if (verifysip) {
@@ -180,6 +212,7 @@ void solver_tweak2(solver_t* sp, MatchObj* mo, int order, sip_t* verifysip) {
 
     logverb("solver_tweak2: set_crpix %i, crpix (%.1f,%.1f)\n",
             sp->set_crpix, sp->crpix[0], sp->crpix[1]);
+    PROFILE_BEGIN("tweak");
     mo->sip = tweak2(xy, Nxy,
                      sp->verify_pix, // pixel positional noise sigma
                      solver_field_width(sp),
@@ -192,6 +225,7 @@ void solver_tweak2(solver_t* sp, MatchObj* mo, int order, sip_t* verifysip) {
                      &startsip, NULL, &theta, &odds,
                      sp->set_crpix ? sp->crpix : NULL,
                      &newodds, &besti, mo->testperm, startorder);
+    PROFILE_END("tweak");
     free(refradec);
 
     // FIXME -- update refxy?  Nobody uses it, right?
@@ -247,6 +281,8 @@ void solver_log_params(const solver_t* sp) {
     logverb("  Log bail threshold: %g\n", sp->logratio_bail_threshold);
     logverb("  Log stoplooking threshold: %g\n", sp->logratio_stoplooking);
     logverb("  Maxquads %i\n", sp->maxquads);
+    logverb("  Threads %i\n", sp->nthreads);
+    logverb("  Verifier threads %i\n", sp->nverifiers);
     logverb("  Maxmatches %i\n", sp->maxmatches);
     logverb("  Set CRPIX? %s", sp->set_crpix ? "yes" : "no\n");
     if (sp->set_crpix) {
@@ -311,6 +347,159 @@ void solver_print_to(const solver_t* sp, FILE* stream) {
  }
  */
 
+static const char* stage_names[SOLVER_N_STAGES] = {
+    "pquad", "inbox", "search", "resolve", "verify", "tweak", "other"
+};
+
+const char* solver_stage_name(int stage) {
+    if (stage < 0 || stage >= SOLVER_N_STAGES)
+        return NULL;
+    return stage_names[stage];
+}
+
+static double thread_cpu_time(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0.0;
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ Charges the time since the last switch to the current stage, and
+ enters stage "stage" (or none, if -1).  Returns the stage we were in,
+ so that callers can switch back to it.
+ */
+static int switch_stage(solver_t* s, int stage) {
+    solver_stats_t* st = &(s->stats);
+    int prev = st->stage;
+    double wall, cpu;
+    if (!s->collect_stats)
+        return prev;
+    wall = timenow();
+    cpu = thread_cpu_time();
+    if (prev >= 0) {
+        st->wall[prev] += wall - st->stage_wall;
+        st->cpu [prev] += cpu  - st->stage_cpu;
+    }
+    st->stage = stage;
+    st->stage_wall = wall;
+    st->stage_cpu = cpu;
+    return prev;
+}
+
+static inline solver_index_stats_t* index_stats(solver_t* s) {
+    if (!s->stats.index || s->indexnum >= s->stats.nindexes)
+        return NULL;
+    return s->stats.index + s->indexnum;
+}
+
+// Makes sure there is room for per-index stats for all the indexes.
+static void init_index_stats(solver_t* s, int nindexes) {
+    solver_stats_t* st = &(s->stats);
+    if (st->nindexes >= nindexes)
+        return;
+    st->index = realloc(st->index, nindexes * sizeof(solver_index_stats_t));
+    if (!st->index) {
+        SYSERROR("Failed to allocate per-index stats");
+        st->nindexes = 0;
+        return;
+    }
+    memset(st->index + st->nindexes, 0,
+           (nindexes - st->nindexes) * sizeof(solver_index_stats_t));
+    st->nindexes = nindexes;
+}
+
+static void reset_stats(solver_stats_t* st) {
+    memset(st->wall, 0, sizeof(st->wall));
+    memset(st->cpu, 0, sizeof(st->cpu));
+    if (st->index)
+        memset(st->index, 0, st->nindexes * sizeof(solver_index_stats_t));
+    st->stage = -1;
+}
+
+// Adds the stats in "src" into "dst".
+static void add_stats(solver_stats_t* dst, const solver_stats_t* src) {
+    int i;
+    for (i=0; i<SOLVER_N_STAGES; i++) {
+        dst->wall[i] += src->wall[i];
+        dst->cpu[i] += src->cpu[i];
+    }
+    if (!dst->index || !src->index)
+        return;
+    for (i=0; i<MIN(dst->nindexes, src->nindexes); i++) {
+        dst->index[i].numtries     += src->index[i].numtries;
+        dst->index[i].nummatches   += src->index[i].nummatches;
+        dst->index[i].numscaleok   += src->index[i].numscaleok;
+        dst->index[i].num_verified += src->index[i].num_verified;
+    }
+}
+
+void solver_log_stats(const solver_t* sp) {
+    int i;
+    if (!sp->collect_stats)
+        return;
+    logverb("Time by stage (wall / CPU seconds):\n");
+    for (i=0; i<SOLVER_N_STAGES; i++)
+        logverb("  %-8s %8.3f / %8.3f\n", stage_names[i],
+                sp->stats.wall[i], sp->stats.cpu[i]);
+    for (i=0; i<sp->stats.nindexes && i<pl_size(sp->indexes); i++) {
+        const solver_index_stats_t* is = sp->stats.index + i;
+        index_t* index = pl_get(sp->indexes, i);
+        logverb("  index %s: %i quads tried, %i matched, %i scale ok, %i verified\n",
+                index->indexname, is->numtries, is->nummatches,
+                is->numscaleok, is->num_verified);
+    }
+}
+
+// Writes "str" as a JSON string.
+static void write_json_string(FILE* fid, const char* str) {
+    fputc('"', fid);
+    for (; str && *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(fid, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fid, "\\u%04x", c);
+        else
+            fputc(c, fid);
+    }
+    fputc('"', fid);
+}
+
+int solver_write_stats_json(const solver_t* sp, FILE* fid) {
+    int i;
+    fprintf(fid, "{\"solved\": %s, \"quads_tried\": %i, \"quads_matched\": %i, "
+            "\"scale_ok\": %i, \"verified\": %i, \"objects_examined\": %i,\n",
+            (sp->best_match_solves ? "true" : "false"), sp->numtries,
+            sp->nummatches, sp->numscaleok, sp->num_verified,
+            sp->last_examined_object + 1);
+    fprintf(fid, " \"wall\": {");
+    for (i=0; i<SOLVER_N_STAGES; i++)
+        fprintf(fid, "%s\"%s\": %.6f", (i ? ", " : ""), stage_names[i],
+                sp->stats.wall[i]);
+    fprintf(fid, "},\n \"cpu\": {");
+    for (i=0; i<SOLVER_N_STAGES; i++)
+        fprintf(fid, "%s\"%s\": %.6f", (i ? ", " : ""), stage_names[i],
+                sp->stats.cpu[i]);
+    fprintf(fid, "},\n \"indexes\": [");
+    for (i=0; i<sp->stats.nindexes && i<pl_size(sp->indexes); i++) {
+        const solver_index_stats_t* is = sp->stats.index + i;
+        index_t* index = pl_get(sp->indexes, i);
+        fprintf(fid, "%s\n  {\"name\": ", (i ? "," : ""));
+        write_json_string(fid, index->indexname);
+        fprintf(fid, ", \"quads_tried\": %i, \"quads_matched\": %i, "
+                "\"scale_ok\": %i, \"verified\": %i}",
+                is->numtries, is->nummatches, is->numscaleok,
+                is->num_verified);
+    }
+    fprintf(fid, "]}");
+    if (ferror(fid)) {
+        SYSERROR("Failed to write solver stats");
+        return -1;
+    }
+    return 0;
+}
+
 static const int A = 0, B = 1, C = 2, D = 3;
 
 // Number of stars in the "backbone" of the quad: stars A and B.
@@ -368,6 +557,30 @@ static void get_field_ll_corner(solver_t* s, double* lx, double* ly) {
     *ly = s->field_miny;
 }
 
+/*
+ "quit_now" is set by one thread (eg, workers_quit()) while the others
+ read it in their search loops, so it is accessed atomically.
+ */
+static inline anbool solver_should_quit(const solver_t* s) {
+    return __atomic_load_n(&s->quit_now, __ATOMIC_RELAXED);
+}
+
+void solver_set_quit(solver_t* s) {
+    __atomic_store_n(&s->quit_now, TRUE, __ATOMIC_RELAXED);
+}
+
+void solver_cancel(int* token) {
+    __atomic_store_n(token, 1, __ATOMIC_RELAXED);
+}
+
+anbool solver_check_cancel(solver_t* s) {
+    if (s->cancel && __atomic_load_n(s->cancel, __ATOMIC_RELAXED))
+        solver_set_quit(s);
+    else if (s->deadline > 0.0 && timenow() > s->deadline)
+        solver_set_quit(s);
+    return solver_should_quit(s);
+}
+
 void solver_reset_counters(solver_t* s) {
     s->quit_now = FALSE;
     s->have_best_match = FALSE;
@@ -380,6 +593,8 @@ void solver_reset_counters(solver_t* s) {
     s->num_radec_skipped = 0;
     s->num_abscale_skipped = 0;
     s->num_verified = 0;
+    s->pquad_bytes_peak = 0;
+    reset_stats(&(s->stats));
 }
 
 double solver_field_width(const solver_t* s) {
@@ -416,8 +631,15 @@ static void set_center_and_radius(solver_t* solver, MatchObj* mo,
     mo->radius_deg = dist2deg(mo->radius);
 }
 
-static void set_index(solver_t* s, index_t* index) {
+static void flush_codes(solver_t* solver);
+
+static void set_index(solver_t* s, int indexnum) {
+    index_t* index = pl_get(s->indexes, indexnum);
+    // queued codes have to be searched for in the index they came from.
+    if (s->index != index)
+        flush_codes(s);
     s->index = index;
+    s->indexnum = indexnum;
     s->rel_index_noise2 = square(index->index_jitter / index->index_scale_lower);
 }
 
@@ -468,8 +690,7 @@ void solver_verify_sip_wcs(solver_t* solver, sip_t* sip) { //, MatchObj* pmo) {
 
     nindexes = pl_size(solver->indexes);
     for (i=0; i<nindexes; i++) {
-        index_t* index = pl_get(solver->indexes, i);
-        set_index(solver, index);
+        set_index(solver, i);
         solver_inject_match(solver, pmo, sip);
     }
 
@@ -477,6 +698,208 @@ void solver_verify_sip_wcs(solver_t* solver, sip_t* sip) { //, MatchObj* pmo) {
     solver->distance_from_quad_bonus = olddqb;
 }
 
+/*
+ Batch verification: the candidate WCSes are grouped by where they put
+ the field on the sky, the index stars around each group are found with
+ one search (see verify_field_prefetch_index_stars()), and the group's
+ candidates are scored on "nthreads" threads.  Only the candidates that
+ score well enough to be printed, tuned or kept then go through the
+ usual hit handling -- best first, in the calling thread.
+ */
+struct batch_candidate {
+    sip_t* sip;
+    // the fabricated match, as in solver_verify_sip_wcs().
+    MatchObj mo;
+    // its sky group
+    int group;
+    // log-odds with the current index
+    double logodds;
+};
+
+struct batch_scorer {
+    solver_t* solver;
+    index_t* index;
+    struct batch_candidate* cands;
+    // the candidates to score (indices into "cands")
+    const int* todo;
+    int ntodo;
+    int next;
+};
+
+static void score_candidate(solver_t* sp, index_t* index,
+                            struct batch_candidate* c) {
+    MatchObj mo;
+    double pix2;
+    memcpy(&mo, &(c->mo), sizeof(MatchObj));
+    mo.wcstan.imagew = sp->field_maxx;
+    mo.wcstan.imageh = sp->field_maxy;
+    pix2 = square(sp->verify_pix) + square(index->index_jitter / mo.scale);
+    // (with an impossible "accept" level, nothing is allocated in "mo".)
+    verify_hit(index->starkd, index->cutnside, &mo, c->sip, sp->vf, pix2,
+               sp->distractor_ratio, sp->field_maxx, sp->field_maxy,
+               sp->logratio_bail_threshold, LARGE_VAL,
+               sp->logratio_stoplooking, FALSE, TRUE);
+    c->logodds = mo.logodds;
+}
+
+static void* batch_scorer_main(void* varg) {
+    struct batch_scorer* b = varg;
+    for (;;) {
+        int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->ntodo)
+            break;
+        score_candidate(b->solver, b->index, b->cands + b->todo[i]);
+    }
+    return NULL;
+}
+
+static void score_candidates(solver_t* sp, index_t* index,
+                             struct batch_candidate* cands,
+                             const int* todo, int ntodo) {
+    struct batch_scorer b;
+    pthread_t* threads;
+    int i, nthreads, nstarted;
+
+    memset(&b, 0, sizeof(b));
+    b.solver = sp;
+    b.index = index;
+    b.cands = cands;
+    b.todo = todo;
+    b.ntodo = ntodo;
+    nthreads = MIN(MAX(sp->nthreads, 1), ntodo);
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, batch_scorer_main, &b)) {
+            SYSERROR("Failed to start verification thread");
+            break;
+        }
+    batch_scorer_main(&b);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Puts each candidate in the group of the first candidate whose field
+// center is within a field radius of its own.  Returns the number of groups.
+static int group_candidates(struct batch_candidate* cands, int N) {
+    int i, j, ngroups = 0;
+    for (i=0; i<N; i++)
+        cands[i].group = -1;
+    for (i=0; i<N; i++) {
+        if (cands[i].group >= 0)
+            continue;
+        cands[i].group = ngroups;
+        for (j=i+1; j<N; j++)
+            if ((cands[j].group < 0) &&
+                (distsq(cands[i].mo.center, cands[j].mo.center, 3) <=
+                 square(cands[i].mo.radius)))
+                cands[j].group = ngroups;
+        ngroups++;
+    }
+    return ngroups;
+}
+
+static int QSORT_COMPARISON_FUNCTION(compare_candidate_odds, void* vcands,
+                                     const void* v1, const void* v2) {
+    const struct batch_candidate* cands = vcands;
+    double o1 = cands[*(const int*)v1].logodds;
+    double o2 = cands[*(const int*)v2].logodds;
+    if (o1 > o2)
+        return -1;
+    if (o1 < o2)
+        return 1;
+    return *(const int*)v1 - *(const int*)v2;
+}
+
+void solver_verify_sip_wcses(solver_t* solver, sip_t* wcses, int N) {
+    struct batch_candidate* cands;
+    int* members;
+    int* order;
+    int ngroups;
+    int i, g, k, nindexes;
+    double logmin;
+    anbool olddqb;
+
+    if (N <= 1) {
+        if (N == 1)
+            solver_verify_sip_wcs(solver, wcses);
+        return;
+    }
+    if (!solver->vf)
+        solver_preprocess_field(solver);
+
+    cands = calloc(N, sizeof(struct batch_candidate));
+    for (i=0; i<N; i++) {
+        struct batch_candidate* c = cands + i;
+        c->sip = wcses + i;
+        set_matchobj_template(solver, &(c->mo));
+        memcpy(&(c->mo.wcstan), &(wcses[i].wcstan), sizeof(tan_t));
+        c->mo.wcs_valid = TRUE;
+        c->mo.scale = sip_pixel_scale(wcses + i);
+        set_center_and_radius(solver, &(c->mo), NULL, wcses + i);
+    }
+    ngroups = group_candidates(cands, N);
+    logverb("Verifying %i WCSes in %i sky region%s.\n", N, ngroups,
+            (ngroups == 1) ? "" : "s");
+
+    members = malloc(N * sizeof(int));
+    order = malloc(N * sizeof(int));
+    // below this, solver_handle_hit() would do nothing but count.
+    logmin = MIN(solver->logratio_toprint,
+                 MIN(solver->logratio_tokeep, solver->logratio_totune));
+    olddqb = solver->distance_from_quad_bonus;
+    solver->distance_from_quad_bonus = FALSE;
+
+    nindexes = pl_size(solver->indexes);
+    for (i=0; i<nindexes && !solver_should_quit(solver); i++) {
+        index_t* index = pl_get(solver->indexes, i);
+        solver_index_stats_t* is;
+
+        for (g=0; g<ngroups; g++) {
+            double center[3];
+            double R = 0.0;
+            int n = 0;
+            for (k=0; k<N; k++) {
+                if (cands[k].group != g)
+                    continue;
+                if (!n)
+                    memcpy(center, cands[k].mo.center, sizeof(center));
+                R = MAX(R, sqrt(distsq(center, cands[k].mo.center, 3)) +
+                        cands[k].mo.radius);
+                members[n++] = k;
+            }
+            if (n > 1)
+                verify_field_prefetch_index_stars(solver->vf, index->starkd,
+                                                  center, square(R * (1.0 + 1e-6)));
+            score_candidates(solver, index, cands, members, n);
+        }
+
+        set_index(solver, i);
+        is = index_stats(solver);
+        for (k=0; k<N; k++)
+            order[k] = k;
+        QSORT_R(order, N, sizeof(int), cands, compare_candidate_odds);
+        for (k=0; k<N; k++) {
+            struct batch_candidate* c = cands + order[k];
+            MatchObj mo;
+            if (c->logodds < logmin || solver_should_quit(solver)) {
+                solver->num_verified++;
+                if (is)
+                    is->num_verified++;
+                solver->best_logodds = MAX(solver->best_logodds, c->logodds);
+                continue;
+            }
+            memcpy(&mo, &(c->mo), sizeof(MatchObj));
+            solver_inject_match(solver, &mo, c->sip);
+        }
+    }
+
+    solver->distance_from_quad_bonus = olddqb;
+    free(order);
+    free(members);
+    free(cands);
+}
+
 void solver_add_index(solver_t* solver, index_t* index) {
     pl_append(solver->indexes, index);
 }
@@ -546,15 +969,207 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult);
+                             int slot, anbool* placed);
 
 static void resolve_matches(kdtree_qres_t* krez, const double *field,
                             const int* fstars, int dimquads,
-                            solver_t* solver, anbool current_parity);
+                            solver_t* solver, anbool current_parity,
+                            int numtries);
 
 static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* sip, anbool fake_match);
 
+/*
+ A quad match that passed the scale checks, on its way from
+ resolve_matches() to verification.  It holds only what can't be looked
+ up again in the index and field -- a small fraction of a MatchObj,
+ which is built from it (by candidate_to_matchobj()) just before
+ verification.
+ */
+typedef struct {
+    unsigned int quadno;
+    int field[DQMAX];
+    tan_t wcstan;
+    // actually code error ^2.
+    float code_err;
+    // arcsec per pixel
+    double scale;
+    anbool parity;
+    // the search counters when it was found (see MatchObj).
+    int16_t quad_npeers;
+    int quads_tried;
+    int quads_matched;
+    int quads_scaleok;
+    float timeused;
+} candidate_t;
+
+static int solver_handle_candidate(solver_t* sp, const candidate_t* c);
+
+/*
+ Codes are queued up and searched for in the code tree in batches of
+ up to CODE_BATCH_SIZE (see flush_codes()), rather than one at a time.
+ All the codes in a batch come from the same index, and all the codes of
+ a field quad (with PARITY_BOTH, both parities) go in the same batch, so
+ a quad's parities cost one tree walk rather than two.
+ */
+#define CODE_BATCH_SIZE 128
+
+struct solver_code_batch_t {
+    int n;
+    int dimquad;
+    double codes[CODE_BATCH_SIZE * DCMAX];
+    double tol2[CODE_BATCH_SIZE];
+    int stars[CODE_BATCH_SIZE][DQMAX];
+    anbool parity[CODE_BATCH_SIZE];
+    // value of "numtries" when the code was queued.
+    int numtries[CODE_BATCH_SIZE];
+    kdtree_qres_t* qres[CODE_BATCH_SIZE];
+    // results of one scale bin's search (see search_scale_bins())
+    kdtree_qres_t* binqres[CODE_BATCH_SIZE];
+    // which sky bins are near the search cap (see search_sky_bins())
+    anbool* skynear;
+    int skynear_size;
+};
+typedef struct solver_code_batch_t solver_code_batch_t;
+
+static void code_batch_free(solver_code_batch_t* b) {
+    int i;
+    if (!b)
+        return;
+    for (i=0; i<CODE_BATCH_SIZE; i++) {
+        kdtree_free_query(b->qres[i]);
+        kdtree_free_query(b->binqres[i]);
+    }
+    free(b->skynear);
+    free(b);
+}
+
+static void queue_code(solver_t* solver, const int* stars, const double* code,
+                       int dimquad, anbool parity, double tol2) {
+    solver_code_batch_t* b = solver->codebatch;
+    int dimcode = (dimquad - 2) * 2;
+    if (!b) {
+        b = solver->codebatch = calloc(1, sizeof(solver_code_batch_t));
+        if (!b) {
+            SYSERROR("Failed to allocate code batch");
+            return;
+        }
+    }
+    b->dimquad = dimquad;
+    memcpy(b->codes + b->n * dimcode, code, dimcode * sizeof(double));
+    memcpy(b->stars[b->n], stars, dimquad * sizeof(int));
+    b->tol2[b->n] = tol2;
+    b->parity[b->n] = parity;
+    b->numtries[b->n] = solver->numtries;
+    b->n++;
+    if (b->n == CODE_BATCH_SIZE)
+        flush_codes(solver);
+}
+
+/*
+ For each star B, the stars A < B sorted by squared distance |AB|^2 (in
+ the same arithmetic as check_scale(), so that the two agree exactly).
+ Row B starts at B*(B-1)/2.  Each pass of solver_run() binary-searches
+ the rows for its [minminAB2, maxmaxAB2] window instead of rescanning
+ all the pairs.
+ */
+struct solver_pair {
+    double scale;
+    int A;
+};
+
+struct solver_pair_table {
+    // number of stars (rows)
+    int n;
+    struct solver_pair* pairs;
+};
+
+static int compare_pairs(const void* v1, const void* v2) {
+    const struct solver_pair* p1 = v1;
+    const struct solver_pair* p2 = v2;
+    if (p1->scale < p2->scale)
+        return -1;
+    if (p1->scale > p2->scale)
+        return 1;
+    return p1->A - p2->A;
+}
+
+static void pair_table_free(struct solver_pair_table* t) {
+    if (!t)
+        return;
+    free(t->pairs);
+    free(t);
+}
+
+static struct solver_pair_table* pair_table_new(solver_t* s, int n) {
+    struct solver_pair_table* t;
+    int A, B;
+    t = calloc(1, sizeof(struct solver_pair_table));
+    if (!t) {
+        SYSERROR("Failed to allocate pair table");
+        return NULL;
+    }
+    t->pairs = malloc(((size_t)n * (n-1) / 2) * sizeof(struct solver_pair));
+    if (n > 1 && !t->pairs) {
+        SYSERROR("Failed to allocate pair table for %i stars", n);
+        free(t);
+        return NULL;
+    }
+    t->n = n;
+    for (B=1; B<n; B++) {
+        struct solver_pair* row = t->pairs + (size_t)B * (B-1) / 2;
+        for (A=0; A<B; A++) {
+            double dx, dy;
+            dx = field_getx(s, B) - field_getx(s, A);
+            dy = field_gety(s, B) - field_gety(s, A);
+            row[A].scale = dx*dx + dy*dy;
+            row[A].A = A;
+        }
+        qsort(row, B, sizeof(struct solver_pair), compare_pairs);
+    }
+    return t;
+}
+
+/*
+ Returns the pairs in row B whose scale is in [lo, hi], as the slice
+ [*pstart, *pstart + count).
+ */
+static int pair_table_window(const struct solver_pair_table* t, int B,
+                             double lo, double hi, int* pstart) {
+    const struct solver_pair* row = t->pairs + (size_t)B * (B-1) / 2;
+    int first, last, L, R;
+    // first with scale >= lo
+    L = 0;
+    R = B;
+    while (L < R) {
+        int mid = (L + R) / 2;
+        if (row[mid].scale < lo)
+            L = mid + 1;
+        else
+            R = mid;
+    }
+    first = L;
+    // first with scale > hi
+    R = B;
+    while (L < R) {
+        int mid = (L + R) / 2;
+        if (row[mid].scale <= hi)
+            L = mid + 1;
+        else
+            R = mid;
+    }
+    last = L;
+    *pstart = (int)((size_t)B * (B-1) / 2) + first;
+    return last - first;
+}
+
+// Makes sure the pair table covers the first "n" stars.
+static void pair_table_ensure(solver_t* s, int n) {
+    if (s->pairtable && s->pairtable->n >= n)
+        return;
+    pair_table_free(s->pairtable);
+    s->pairtable = pair_table_new(s, n);
+}
+
 static void check_scale(pquad* pq, solver_t* s) {
     double dx, dy;
     dx = field_getx(s, pq->fieldB) - field_getx(s, pq->fieldA);
@@ -571,38 +1186,256 @@ static void check_scale(pquad* pq, solver_t* s) {
     pq->scale_ok = TRUE;
 }
 
+// Sets bits [0, n) of the "inbox" bitset and clears the rest.
+static void init_inbox(pquad* pq, int n, int numxy) {
+    int i, nwords = PQUAD_INBOX_WORDS(numxy);
+    for (i=0; i<nwords; i++) {
+        if ((i+1) * 64 <= n)
+            pq->inbox[i] = ~(uint64_t)0;
+        else if (i * 64 >= n)
+            pq->inbox[i] = 0;
+        else
+            pq->inbox[i] = ((uint64_t)1 << (n - i*64)) - 1;
+    }
+    pq->ninbox = n;
+}
+
+static inline void check_inbox_one(pquad* pq, int i, const double* fx,
+                                   const double* fy, double Ax, double Ay,
+                                   double maxr) {
+    double r;
+    double Cx, Cy, xxtmp;
+    if (!pquad_inbox_get(pq, i))
+        return;
+    Cx = fx[i] - Ax;
+    Cy = fy[i] - Ay;
+    xxtmp = Cx;
+    Cx = Cx * pq->costheta + Cy * pq->sintheta;
+    Cy = -xxtmp * pq->sintheta + Cy * pq->costheta;
+
+    // make sure it's in the circle centered at (0.5, 0.5)
+    // with radius 1/sqrt(2) (plus codetol for fudge):
+    // (x-1/2)^2 + (y-1/2)^2   <=   (r + codetol)^2
+    // x^2-x+1/4 + y^2-y+1/4   <=   (1/sqrt(2) + codetol)^2
+    // x^2-x + y^2-y + 1/2     <=   1/2 + sqrt(2)*codetol + codetol^2
+    // x^2-x + y^2-y           <=   sqrt(2)*codetol + codetol^2
+    r = (Cx * Cx - Cx) + (Cy * Cy - Cy);
+    if (r > maxr) {
+        pquad_inbox_clear(pq, i);
+        return;
+    }
+    setx(pq->xy, i, Cx);
+    sety(pq->xy, i, Cy);
+}
+
+/*
+ The SIMD versions of check_inbox(): each checks the stars from "i" on in
+ blocks of its width, as far as it can, and returns where it stopped.
+ The code-space positions of stars that aren't in the inbox get written
+ too, but nobody looks at them.
+ */
+typedef int (*inbox_kernel_t)(pquad* pq, int i, const double* fx,
+                              const double* fy, double Ax, double Ay,
+                              double maxr);
+
+// Checks stars one at a time until "i" is a multiple of "width" (blocks
+// must not straddle a word of the bitset).
+static inline int check_inbox_align(pquad* pq, int i, int width,
+                                    const double* fx, const double* fy,
+                                    double Ax, double Ay, double maxr) {
+    for (; i < pq->ninbox && (i % width); i++)
+        check_inbox_one(pq, i, fx, fy, Ax, Ay, maxr);
+    return i;
+}
+
+// Clears the stars at "i" that were in the box but aren't in the circle.
+static inline void check_inbox_clear(pquad* pq, int i, unsigned int bits,
+                                     unsigned int inside) {
+    pq->inbox[i >> 6] &= ~((uint64_t)(bits & ~inside) << (i & 63));
+}
+
+// The in-box bits of the "width" stars at "i".
+static inline unsigned int check_inbox_bits(const pquad* pq, int i,
+                                            int width) {
+    return (unsigned int)(pq->inbox[i >> 6] >> (i & 63)) &
+        ((1u << width) - 1);
+}
+
+#if defined(INBOX_USE_X86)
+static CPU_TARGET("sse2") int check_inbox_sse2(pquad* pq, int i,
+                                                const double* fx,
+                                                const double* fy,
+                                                double Ax, double Ay,
+                                                double maxr) {
+    __m128d vAx = _mm_set1_pd(Ax);
+    __m128d vAy = _mm_set1_pd(Ay);
+    __m128d vcos = _mm_set1_pd(pq->costheta);
+    __m128d vsin = _mm_set1_pd(pq->sintheta);
+    __m128d vmaxr = _mm_set1_pd(maxr);
+    i = check_inbox_align(pq, i, 2, fx, fy, Ax, Ay, maxr);
+    for (; i + 2 <= pq->ninbox; i += 2) {
+        unsigned int bits = check_inbox_bits(pq, i, 2);
+        __m128d cx, cy, x, y, r;
+        if (!bits)
+            continue;
+        cx = _mm_sub_pd(_mm_loadu_pd(fx + i), vAx);
+        cy = _mm_sub_pd(_mm_loadu_pd(fy + i), vAy);
+        x = _mm_add_pd(_mm_mul_pd(cx, vcos), _mm_mul_pd(cy, vsin));
+        y = _mm_sub_pd(_mm_mul_pd(cy, vcos), _mm_mul_pd(cx, vsin));
+        r = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(x, x), x),
+                       _mm_sub_pd(_mm_mul_pd(y, y), y));
+        _mm_storeu_pd(pq->xy + 2*i,     _mm_unpacklo_pd(x, y));
+        _mm_storeu_pd(pq->xy + 2*i + 2, _mm_unpackhi_pd(x, y));
+        check_inbox_clear(pq, i, bits,
+                          _mm_movemask_pd(_mm_cmple_pd(r, vmaxr)));
+    }
+    return i;
+}
+
+static CPU_TARGET("avx") int check_inbox_avx(pquad* pq, int i,
+                                              const double* fx,
+                                              const double* fy,
+                                              double Ax, double Ay,
+                                              double maxr) {
+    __m256d vAx = _mm256_set1_pd(Ax);
+    __m256d vAy = _mm256_set1_pd(Ay);
+    __m256d vcos = _mm256_set1_pd(pq->costheta);
+    __m256d vsin = _mm256_set1_pd(pq->sintheta);
+    __m256d vmaxr = _mm256_set1_pd(maxr);
+    i = check_inbox_align(pq, i, 4, fx, fy, Ax, Ay, maxr);
+    for (; i + 4 <= pq->ninbox; i += 4) {
+        unsigned int bits = check_inbox_bits(pq, i, 4);
+        __m256d cx, cy, x, y, r, lo, hi;
+        if (!bits)
+            continue;
+        cx = _mm256_sub_pd(_mm256_loadu_pd(fx + i), vAx);
+        cy = _mm256_sub_pd(_mm256_loadu_pd(fy + i), vAy);
+        x = _mm256_add_pd(_mm256_mul_pd(cx, vcos), _mm256_mul_pd(cy, vsin));
+        y = _mm256_sub_pd(_mm256_mul_pd(cy, vcos), _mm256_mul_pd(cx, vsin));
+        r = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(x, x), x),
+                          _mm256_sub_pd(_mm256_mul_pd(y, y), y));
+        // (x0,y0,x2,y2), (x1,y1,x3,y3)
+        lo = _mm256_unpacklo_pd(x, y);
+        hi = _mm256_unpackhi_pd(x, y);
+        _mm256_storeu_pd(pq->xy + 2*i,     _mm256_permute2f128_pd(lo, hi, 0x20));
+        _mm256_storeu_pd(pq->xy + 2*i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+        check_inbox_clear(pq, i, bits,
+                          _mm256_movemask_pd(_mm256_cmp_pd(r, vmaxr, _CMP_LE_OQ)));
+    }
+    return i;
+}
+
+static CPU_TARGET("avx512f") int check_inbox_avx512(pquad* pq, int i,
+                                                     const double* fx,
+                                                     const double* fy,
+                                                     double Ax, double Ay,
+                                                     double maxr) {
+    __m512d vAx = _mm512_set1_pd(Ax);
+    __m512d vAy = _mm512_set1_pd(Ay);
+    __m512d vcos = _mm512_set1_pd(pq->costheta);
+    __m512d vsin = _mm512_set1_pd(pq->sintheta);
+    __m512d vmaxr = _mm512_set1_pd(maxr);
+    // where (x0..7, y0..7) go in (x0,y0,...,x3,y3), (x4,y4,...,x7,y7)
+    __m512i ilo = _mm512_set_epi64(11, 3, 10, 2, 9, 1, 8, 0);
+    __m512i ihi = _mm512_set_epi64(15, 7, 14, 6, 13, 5, 12, 4);
+    i = check_inbox_align(pq, i, 8, fx, fy, Ax, Ay, maxr);
+    for (; i + 8 <= pq->ninbox; i += 8) {
+        unsigned int bits = check_inbox_bits(pq, i, 8);
+        __m512d cx, cy, x, y, r;
+        if (!bits)
+            continue;
+        cx = _mm512_sub_pd(_mm512_loadu_pd(fx + i), vAx);
+        cy = _mm512_sub_pd(_mm512_loadu_pd(fy + i), vAy);
+        x = _mm512_add_pd(_mm512_mul_pd(cx, vcos), _mm512_mul_pd(cy, vsin));
+        y = _mm512_sub_pd(_mm512_mul_pd(cy, vcos), _mm512_mul_pd(cx, vsin));
+        r = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(x, x), x),
+                          _mm512_sub_pd(_mm512_mul_pd(y, y), y));
+        _mm512_storeu_pd(pq->xy + 2*i,     _mm512_permutex2var_pd(x, ilo, y));
+        _mm512_storeu_pd(pq->xy + 2*i + 8, _mm512_permutex2var_pd(x, ihi, y));
+        check_inbox_clear(pq, i, bits,
+                          _mm512_cmp_pd_mask(r, vmaxr, _CMP_LE_OQ));
+    }
+    return i;
+}
+#endif
+
+#if defined(INBOX_USE_NEON)
+static int check_inbox_neon(pquad* pq, int i, const double* fx,
+                            const double* fy, double Ax, double Ay,
+                            double maxr) {
+    float64x2_t vAx = vdupq_n_f64(Ax);
+    float64x2_t vAy = vdupq_n_f64(Ay);
+    float64x2_t vcos = vdupq_n_f64(pq->costheta);
+    float64x2_t vsin = vdupq_n_f64(pq->sintheta);
+    float64x2_t vmaxr = vdupq_n_f64(maxr);
+    i = check_inbox_align(pq, i, 2, fx, fy, Ax, Ay, maxr);
+    for (; i + 2 <= pq->ninbox; i += 2) {
+        unsigned int bits = check_inbox_bits(pq, i, 2);
+        float64x2_t cx, cy, x, y, r;
+        uint64x2_t le;
+        if (!bits)
+            continue;
+        cx = vsubq_f64(vld1q_f64(fx + i), vAx);
+        cy = vsubq_f64(vld1q_f64(fy + i), vAy);
+        x = vaddq_f64(vmulq_f64(cx, vcos), vmulq_f64(cy, vsin));
+        y = vsubq_f64(vmulq_f64(cy, vcos), vmulq_f64(cx, vsin));
+        r = vaddq_f64(vsubq_f64(vmulq_f64(x, x), x),
+                      vsubq_f64(vmulq_f64(y, y), y));
+        le = vcleq_f64(r, vmaxr);
+        vst1q_f64(pq->xy + 2*i,     vzip1q_f64(x, y));
+        vst1q_f64(pq->xy + 2*i + 2, vzip2q_f64(x, y));
+        check_inbox_clear(pq, i, bits,
+                          (unsigned int)(vgetq_lane_u64(le, 0) & 1) |
+                          ((unsigned int)(vgetq_lane_u64(le, 1) & 1) << 1));
+    }
+    return i;
+}
+#endif
+
+// The version check_inbox() uses (NULL: one star at a time), chosen once.
+static inbox_kernel_t inbox_kernel = NULL;
+static pthread_once_t inbox_kernel_once = PTHREAD_ONCE_INIT;
+
+static void choose_inbox_kernel(void) {
+    const char* name = "scalar";
+#if defined(INBOX_USE_X86)
+    if (cpu_has(CPU_AVX512F)) {
+        inbox_kernel = check_inbox_avx512;
+        name = "AVX-512";
+    } else if (cpu_has(CPU_AVX)) {
+        inbox_kernel = check_inbox_avx;
+        name = "AVX";
+    } else if (cpu_has(CPU_SSE2)) {
+        inbox_kernel = check_inbox_sse2;
+        name = "SSE2";
+    }
+#elif defined(INBOX_USE_NEON)
+    if (cpu_has(CPU_NEON)) {
+        inbox_kernel = check_inbox_neon;
+        name = "NEON";
+    }
+#endif
+    logverb("Checking field stars with the %s code.\n", name);
+}
+
+/*
+ Checks which of the "inbox" stars in [start, ninbox) are inside the
+ circle, computing their code-space positions.
+ */
 static void check_inbox(pquad* pq, int start, solver_t* solver) {
     int i;
     double Ax, Ay;
+    const double* fx = solver->fieldxy->x;
+    const double* fy = solver->fieldxy->y;
+    double tol = solver->codetol;
+    double maxr = tol * (M_SQRT2 + tol);
     field_getxy(solver, pq->fieldA, &Ax, &Ay);
-    // check which C, D points are inside the circle.
-    for (i = start; i < pq->ninbox; i++) {
-        double r;
-        double Cx, Cy, xxtmp;
-        double tol = solver->codetol;
-        if (!pq->inbox[i])
-            continue;
-        field_getxy(solver, i, &Cx, &Cy);
-        Cx -= Ax;
-        Cy -= Ay;
-        xxtmp = Cx;
-        Cx = Cx * pq->costheta + Cy * pq->sintheta;
-        Cy = -xxtmp * pq->sintheta + Cy * pq->costheta;
-
-        // make sure it's in the circle centered at (0.5, 0.5)
-        // with radius 1/sqrt(2) (plus codetol for fudge):
-        // (x-1/2)^2 + (y-1/2)^2   <=   (r + codetol)^2
-        // x^2-x+1/4 + y^2-y+1/4   <=   (1/sqrt(2) + codetol)^2
-        // x^2-x + y^2-y + 1/2     <=   1/2 + sqrt(2)*codetol + codetol^2
-        // x^2-x + y^2-y           <=   sqrt(2)*codetol + codetol^2
-        r = (Cx * Cx - Cx) + (Cy * Cy - Cy);
-        if (r > (tol * (M_SQRT2 + tol))) {
-            pq->inbox[i] = FALSE;
-            continue;
-        }
-        setx(pq->xy, i, Cx);
-        sety(pq->xy, i, Cy);
-    }
+
+    i = start;
+    if (inbox_kernel)
+        i = inbox_kernel(pq, i, fx, fy, Ax, Ay, maxr);
+    for (; i < pq->ninbox; i++)
+        check_inbox_one(pq, i, fx, fy, Ax, Ay, maxr);
 }
 
 #if defined DEBUGSOLVER
@@ -610,7 +1443,7 @@ static void print_inbox(pquad* pq) {
     int i;
     debug("[ ");
     for (i = 0; i < pq->ninbox; i++) {
-        if (pq->inbox[i])
+        if (pquad_inbox_get(pq, i))
             debug("%i ", i);
     }
     debug("] (n %i)\n", pq->ninbox);
@@ -643,7 +1476,7 @@ static void find_field_boundaries(solver_t* solver) {
 }
 
 void solver_preprocess_field(solver_t* solver) {
-    int i;
+    int i, n;
 
     // Make a copy of the original x,y list.
     solver->fieldxy = starxy_copy(solver->fieldxy_orig);
@@ -670,6 +1503,15 @@ void solver_preprocess_field(solver_t* solver) {
     }
 
     find_field_boundaries(solver);
+
+    // precompute the AB pair lengths for the stars solver_run() will use.
+    n = starxy_n(solver->fieldxy);
+    if (solver->endobj)
+        n = MIN(n, solver->endobj);
+    else if (solver->max_field_objs)
+        n = MIN(n, solver->max_field_objs);
+    pair_table_ensure(solver, n);
+
     // precompute a kdtree over the field
     solver->vf = verify_field_preprocess(solver->fieldxy);
 
@@ -695,6 +1537,10 @@ void solver_free_field(solver_t* solver) {
     if (solver->vf)
         verify_field_free(solver->vf);
     solver->vf = NULL;
+    pair_table_free(solver->pairtable);
+    solver->pairtable = NULL;
+    arena_free(solver->pquad_arena);
+    solver->pquad_arena = NULL;
 }
 
 starxy_t* solver_get_field(solver_t* solver) {
@@ -734,48 +1580,945 @@ static void add_stars(const pquad* pq, int* field, int fieldoffset,
                       int dimquad,
                       solver_t* solver, double tol2) {
     int bottom;
+    int w, wtop;
     int* f = field + fieldoffset;
     // When we're adding the first star, we start from index zero.
     // When we're adding subsequent stars, we start from the previous value
     // plus one, to avoid adding permutations.
     bottom = (adding ? f[adding-1] + 1 : 0);
+    if (bottom >= fieldtop)
+        return;
+
+    // We walk through the set bits of the "inbox" bitset in
+    // [bottom, fieldtop), a word at a time.
+    wtop = (fieldtop - 1) >> 6;
+    for (w = (bottom >> 6); w <= wtop; w++) {
+        uint64_t bits = pq->inbox[w];
+        if (w == (bottom >> 6))
+            bits &= (~(uint64_t)0) << (bottom & 63);
+        if ((w == wtop) && (fieldtop & 63))
+            bits &= ((uint64_t)1 << (fieldtop & 63)) - 1;
+        while (bits) {
+            // It looks funny that we're using f[adding] as a loop
+            // variable, but it's required because try_all_codes needs
+            // to know which field stars were used to create the quad
+            // (which are stored in the "f" array)
+            f[adding] = (w << 6) + count_trailing_zeros(bits);
+            bits &= (bits - 1);
+            if (unlikely(solver_should_quit(solver)))
+                return;
+
+            // If we've hit the end of the recursion (we're adding the last star),
+            // call try_all_codes to try the quad we've built.
+            if (adding == n_to_add-1) {
+                // (when not testing, TRY_ALL_CODES is just try_all_codes.)
+                TRY_ALL_CODES(pq, field, dimquad, solver, tol2);
+            } else {
+                // Else recurse.
+                add_stars(pq, field, fieldoffset, n_to_add, adding+1,
+                          fieldtop, dimquad, solver, tol2);
+            }
+        }
+    }
+}
+
+
+/*
+ The pquads are stored by star A: pairs[A] holds the pquads for the AB
+ pairs that can form quads (see init_ab_pquad()), in increasing order
+ of B.  Only star A's unit of work ever appends to pairs[A].
+ */
+struct pquad_list {
+    pquad* pq;
+    int n;
+    int capacity;
+};
+typedef struct pquad_list pquad_list_t;
+
+static pquad* pquad_list_append(pquad_list_t* list, const pquad* pq) {
+    if (list->n == list->capacity) {
+        int newcap = MAX(8, list->capacity * 2);
+        pquad* newpq = realloc(list->pq, newcap * sizeof(pquad));
+        if (!newpq) {
+            SYSERROR("Failed to grow pquad list to %i elements", newcap);
+            return NULL;
+        }
+        list->pq = newpq;
+        list->capacity = newcap;
+    }
+    memcpy(list->pq + list->n, pq, sizeof(pquad));
+    list->n++;
+    return list->pq + list->n - 1;
+}
+
+static void pquad_lists_free(pquad_list_t* lists, int numxy) {
+    int i;
+    if (!lists)
+        return;
+    for (i=0; i<numxy; i++)
+        free(lists[i].pq);
+    free(lists);
+}
+
+static size_t pquad_lists_bytes(const pquad_list_t* lists, int numxy) {
+    size_t n = (size_t)numxy * sizeof(pquad_list_t);
+    int i;
+    for (i=0; i<numxy; i++)
+        n += (size_t)lists[i].capacity * sizeof(pquad);
+    return n;
+}
+
+/*
+ The state of the search for one "newpoint": the pquad store and the
+ per-index quad size limits.  The work of each step of solver_run() is
+ split into "units" (see init_ab_pquad(), try_ab_quads() and
+ try_c_quads() below), which are run either in sequence or spread
+ across the worker threads.
+ */
+struct solver_step {
+    pquad_list_t* pairs;
+    int numxy;
+    int newpoint;
+    // The pairs (A, newpoint) within the quad scale range, if the
+    // solver has a pair table; otherwise all A < newpoint are tried.
+    const struct solver_pair* window;
+    int num_indexes;
+    const double* minAB2s;
+    const double* maxAB2s;
+};
+typedef struct solver_step solver_step_t;
+
+typedef void (*step_unit_func)(solver_t* solver, const solver_step_t* step,
+                               int unit);
+
+// Counters that the workers accumulate privately and that are summed
+// back into the caller's solver_t after each step.
+struct solver_counts {
+    int numtries;
+    int nummatches;
+    int numscaleok;
+    int num_cxdx_skipped;
+    int num_meanx_skipped;
+    int num_radec_skipped;
+    int num_abscale_skipped;
+};
+
+/*
+ Each step's units are split into one contiguous range per thread, so
+ that neighbouring units (which share pquads and index) tend to run in
+ the same thread.  A thread that runs out of work steals the upper half
+ of the largest range that's left.
+ */
+struct unit_range {
+    pthread_mutex_t lock;
+    // Changed only with "lock" held, but steal_units() also peeks at
+    // other threads' ranges without it, so they're stored atomically.
+    int next;
+    int end;
+};
+
+struct solver_workers_t {
+    int nthreads;
+    solver_t* top;
+    // [nthreads] private copies of "top"; the calling thread uses clones[0].
+    solver_t* clones;
+    // [nthreads] counter values when the current step began.
+    struct solver_counts* base;
+    // [nthreads - 1]
+    pthread_t* threads;
+
+    // Serializes the parts of solver_handle_hit() that touch "top".
+    pthread_mutex_t hitlock;
+
+    // Protects everything below.
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    int generation;
+    int nrunning;
+    anbool shutdown;
+    step_unit_func func;
+    const solver_step_t* step;
+
+    // [nthreads] the units left for each thread to do.
+    struct unit_range* ranges;
+};
+typedef struct solver_workers_t solver_workers_t;
+
+struct worker_arg {
+    solver_workers_t* w;
+    solver_t* clone;
+};
+
+static void get_counts(const solver_t* s, struct solver_counts* c) {
+    c->numtries = s->numtries;
+    c->nummatches = s->nummatches;
+    c->numscaleok = s->numscaleok;
+    c->num_cxdx_skipped = s->num_cxdx_skipped;
+    c->num_meanx_skipped = s->num_meanx_skipped;
+    c->num_radec_skipped = s->num_radec_skipped;
+    c->num_abscale_skipped = s->num_abscale_skipped;
+}
+
+static void set_counts(solver_t* s, const struct solver_counts* c) {
+    s->numtries = c->numtries;
+    s->nummatches = c->nummatches;
+    s->numscaleok = c->numscaleok;
+    s->num_cxdx_skipped = c->num_cxdx_skipped;
+    s->num_meanx_skipped = c->num_meanx_skipped;
+    s->num_radec_skipped = c->num_radec_skipped;
+    s->num_abscale_skipped = c->num_abscale_skipped;
+}
+
+// top += (clone - base)
+static void add_counts(solver_t* top, const solver_t* clone,
+                       const struct solver_counts* base) {
+    top->numtries += clone->numtries - base->numtries;
+    top->nummatches += clone->nummatches - base->nummatches;
+    top->numscaleok += clone->numscaleok - base->numscaleok;
+    top->num_cxdx_skipped += clone->num_cxdx_skipped - base->num_cxdx_skipped;
+    top->num_meanx_skipped += clone->num_meanx_skipped - base->num_meanx_skipped;
+    top->num_radec_skipped += clone->num_radec_skipped - base->num_radec_skipped;
+    top->num_abscale_skipped += clone->num_abscale_skipped - base->num_abscale_skipped;
+}
+
+// Returns the next unit in range "r", or -1 if it's empty.
+static int take_unit(struct unit_range* r) {
+    int unit = -1;
+    pthread_mutex_lock(&r->lock);
+    if (r->next < r->end) {
+        unit = r->next;
+        __atomic_store_n(&r->next, unit + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return unit;
+}
 
-    // It looks funny that we're using f[adding] as a loop variable, but
-    // it's required because try_all_codes needs to know which field stars
-    // were used to create the quad (which are stored in the "f" array)
-    for (f[adding]=bottom; f[adding]<fieldtop; f[adding]++) {
-        if (!pq->inbox[f[adding]])
+// Moves half of the biggest other range into thread "me"'s (empty)
+// range, and returns the first of those units, or -1 if there's
+// nothing left to steal.
+static int steal_units(solver_workers_t* w, int me) {
+    int i;
+    for (;;) {
+        int victim = -1;
+        int most = 0;
+        int lo = -1, hi = -1;
+        struct unit_range* r;
+        for (i=0; i<w->nthreads; i++) {
+            // (read without the lock; only used as a hint)
+            int n = (__atomic_load_n(&w->ranges[i].end, __ATOMIC_RELAXED) -
+                     __atomic_load_n(&w->ranges[i].next, __ATOMIC_RELAXED));
+            if (i != me && n > most) {
+                most = n;
+                victim = i;
+            }
+        }
+        if (victim == -1)
+            return -1;
+        r = w->ranges + victim;
+        pthread_mutex_lock(&r->lock);
+        if (r->next < r->end) {
+            hi = r->end;
+            lo = r->end - (r->end - r->next + 1) / 2;
+            __atomic_store_n(&r->end, lo, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (lo == -1)
+            // someone beat us to it; look again.
             continue;
-        if (unlikely(solver->quit_now))
-            return;
+        r = w->ranges + me;
+        pthread_mutex_lock(&r->lock);
+        __atomic_store_n(&r->next, lo + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->end, hi, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->lock);
+        return lo;
+    }
+}
 
-        // If we've hit the end of the recursion (we're adding the last star),
-        // call try_all_codes to try the quad we've built.
-        if (adding == n_to_add-1) {
-            // (when not testing, TRY_ALL_CODES is just try_all_codes.)
-            TRY_ALL_CODES(pq, field, dimquad, solver, tol2);
-        } else {
-            // Else recurse.
-            add_stars(pq, field, fieldoffset, n_to_add, adding+1,
-                      fieldtop, dimquad, solver, tol2);
+static void workers_run_units(solver_workers_t* w, solver_t* clone) {
+    int me = clone - w->clones;
+    switch_stage(clone, SOLVER_STAGE_OTHER);
+    for (;;) {
+        int unit = take_unit(w->ranges + me);
+        if (unit == -1)
+            unit = steal_units(w, me);
+        if (unit == -1)
+            break;
+        if (unlikely(solver_check_cancel(clone)))
+            break;
+        w->func(clone, w->step, unit);
+    }
+    switch_stage(clone, -1);
+}
+
+static void* worker_main(void* varg) {
+    struct worker_arg* arg = varg;
+    solver_workers_t* w = arg->w;
+    int generation = 0;
+
+    if (arg->clone->numa_pin)
+        an_numa_pin_thread(arg->clone->numa_node);
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->shutdown && w->generation == generation)
+            pthread_cond_wait(&w->start, &w->lock);
+        if (w->shutdown)
+            break;
+        generation = w->generation;
+        pthread_mutex_unlock(&w->lock);
+
+        workers_run_units(w, arg->clone);
+
+        pthread_mutex_lock(&w->lock);
+        w->nrunning--;
+        if (w->nrunning == 0)
+            pthread_cond_signal(&w->finished);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(arg);
+    return NULL;
+}
+
+// Makes "clone" a private copy of "top" for another thread.
+static void init_clone(solver_t* clone, solver_t* top) {
+    memcpy(clone, top, sizeof(solver_t));
+    clone->parent = top;
+    clone->codebatch = NULL;
+    clone->fitws = NULL;
+    clone->pquad_arena = NULL;
+    clone->have_best_match = FALSE;
+    clone->best_match_solves = FALSE;
+    memset(&(clone->best_match), 0, sizeof(MatchObj));
+    clone->best_index = NULL;
+    // each thread keeps its own stats; they're summed in merge_clone().
+    memset(&(clone->stats), 0, sizeof(solver_stats_t));
+    clone->stats.stage = -1;
+    if (top->stats.index)
+        init_index_stats(clone, top->stats.nindexes);
+}
+
+/*
+ The NUMA node for search thread "i" of "n".  The units of a step are
+ handed out to the threads in order, and those of try_ab_quads() and
+ try_c_quads() go index by index, so thread i starts with index
+ (nindexes * i / n).
+ */
+static int thread_numa_node(const solver_t* top, int i, int n) {
+    int nind = pl_size(top->indexes);
+    int node = -1;
+    if (nind)
+        node = index_numa_node(pl_get(top->indexes, (int)((long)nind * i / n)));
+    if (node < 0)
+        node = an_numa_node_id((int)((long)an_numa_nodes() * i / n));
+    return node;
+}
+
+static solver_workers_t* workers_new(solver_t* top, int nthreads) {
+    solver_workers_t* w;
+    int i;
+
+    w = calloc(1, sizeof(solver_workers_t));
+    w->nthreads = nthreads;
+    w->top = top;
+    w->clones = calloc(nthreads, sizeof(solver_t));
+    w->base = calloc(nthreads, sizeof(struct solver_counts));
+    w->threads = calloc(nthreads - 1, sizeof(pthread_t));
+    w->ranges = calloc(nthreads, sizeof(struct unit_range));
+    for (i=0; i<nthreads; i++)
+        pthread_mutex_init(&(w->ranges[i].lock), NULL);
+    pthread_mutex_init(&w->hitlock, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->start, NULL);
+    pthread_cond_init(&w->finished, NULL);
+
+    for (i=0; i<nthreads; i++) {
+        solver_t* clone = w->clones + i;
+        init_clone(clone, top);
+        clone->workers = w;
+        clone->pquad_arena = arena_new(0);
+        if (top->numa_pin)
+            clone->numa_node = thread_numa_node(top, i, nthreads);
+    }
+    // (the calling thread searches too)
+    if (top->numa_pin && nthreads > 1)
+        an_numa_pin_thread(w->clones[0].numa_node);
+    for (i=1; i<nthreads; i++) {
+        struct worker_arg* arg = malloc(sizeof(struct worker_arg));
+        arg->w = w;
+        arg->clone = w->clones + i;
+        if (pthread_create(w->threads + i - 1, NULL, worker_main, arg)) {
+            SYSERROR("Failed to create solver thread");
+            free(arg);
+            break;
         }
     }
+    // (if thread creation failed, carry on with the threads we have)
+    w->nthreads = i;
+    logverb("Searching with %i threads.\n", w->nthreads);
+    return w;
 }
 
+/*
+ Runs "func" for each unit in [0, nunits), either in the calling
+ thread or across the worker threads.
+ */
+static void run_step(solver_t* solver, solver_workers_t* w,
+                     step_unit_func func, const solver_step_t* step,
+                     int nunits) {
+    int i, stage;
+    if (!w) {
+        for (i=0; i<nunits; i++) {
+            func(solver, step, i);
+            if (unlikely(solver_check_cancel(solver)))
+                return;
+        }
+        return;
+    }
+
+    // the time spent in the workers is charged to the clones.
+    stage = switch_stage(solver, -1);
+    for (i=0; i<w->nthreads; i++) {
+        solver_t* clone = w->clones + i;
+        clone->quit_now = solver_should_quit(solver);
+        clone->last_examined_object = solver->last_examined_object;
+        get_counts(solver, w->base + i);
+        set_counts(clone, w->base + i);
+        // (the workers aren't running, so no locking needed)
+        w->ranges[i].next = (int)((long)nunits * i / w->nthreads);
+        w->ranges[i].end = (int)((long)nunits * (i+1) / w->nthreads);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->func = func;
+    w->step = step;
+    w->nrunning = w->nthreads - 1;
+    w->generation++;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->lock);
+
+    workers_run_units(w, w->clones);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->nrunning > 0)
+        pthread_cond_wait(&w->finished, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+
+    for (i=0; i<w->nthreads; i++) {
+        solver_t* clone = w->clones + i;
+        add_counts(solver, clone, w->base + i);
+        if (solver_should_quit(clone))
+            solver_set_quit(solver);
+    }
+    switch_stage(solver, stage);
+}
+
+// Merges the best match and stats of a thread's solver_t into "top".
+static void merge_clone(solver_t* top, solver_t* clone) {
+    add_stats(&(top->stats), &(clone->stats));
+    free(clone->stats.index);
+    if (clone->best_logodds > top->best_logodds)
+        top->best_logodds = clone->best_logodds;
+    if (clone->best_match_solves)
+        top->best_match_solves = TRUE;
+    if (!clone->have_best_match)
+        return;
+    if (!top->have_best_match ||
+        (clone->best_match.logodds > top->best_match.logodds)) {
+        if (top->have_best_match)
+            verify_free_matchobj(&top->best_match);
+        memcpy(&top->best_match, &clone->best_match, sizeof(MatchObj));
+        top->have_best_match = TRUE;
+        top->best_index = clone->best_index;
+    } else {
+        verify_free_matchobj(&clone->best_match);
+    }
+}
+
+/*
+ Stops the worker threads and merges their best matches into the
+ caller's solver_t.
+ */
+static void workers_free(solver_workers_t* w) {
+    solver_t* top = w->top;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->shutdown = TRUE;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->lock);
+    for (i=1; i<w->nthreads; i++)
+        pthread_join(w->threads[i-1], NULL);
+    if (top->numa_pin && w->nthreads > 1)
+        an_numa_unpin_thread();
+
+    for (i=0; i<w->nthreads; i++) {
+        solver_t* clone = w->clones + i;
+        code_batch_free(clone->codebatch);
+        fit_wcs_workspace_free(clone->fitws);
+        // the pquads still point into the clones' memory.
+        arena_steal(top->pquad_arena, clone->pquad_arena);
+        arena_free(clone->pquad_arena);
+        merge_clone(top, clone);
+    }
+
+    for (i=0; i<w->nthreads; i++)
+        pthread_mutex_destroy(&(w->ranges[i].lock));
+    pthread_mutex_destroy(&w->hitlock);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->start);
+    pthread_cond_destroy(&w->finished);
+    free(w->threads);
+    free(w->ranges);
+    free(w->base);
+    free(w->clones);
+    free(w);
+}
+
+// Memory used by the pquads and their buffers.
+static size_t pquad_bytes_used(const solver_t* solver,
+                               const solver_workers_t* w,
+                               const solver_step_t* step) {
+    size_t n = pquad_lists_bytes(step->pairs, step->numxy) +
+        arena_bytes_used(solver->pquad_arena);
+    int i;
+    if (w)
+        for (i=0; i<w->nthreads; i++)
+            n += arena_bytes_used(w->clones[i].pquad_arena);
+    return n;
+}
+
+// Tells all the workers to stop searching.  Call with "hitlock" held.
+static void workers_quit(solver_workers_t* w) {
+    int i;
+    solver_set_quit(w->top);
+    for (i=0; i<w->nthreads; i++)
+        solver_set_quit(w->clones + i);
+}
+
+/*
+ Candidate matches waiting to be verified.  When the queue is full, the
+ searching thread verifies the match itself, so the search slows down to
+ the verifiers' pace rather than memory growing without bound.
+ */
+#define VERIFY_QUEUE_SIZE 64
+
+struct verify_item {
+    candidate_t cand;
+    index_t* index;
+    int indexnum;
+};
+
+struct solver_verifiers_t {
+    int nthreads;
+    solver_t* top;
+    // [nthreads] private copies of "top", one per verifier thread.
+    solver_t* clones;
+    pthread_t* threads;
+    // The search workers, so that we can stop them when a verifier
+    // solves the field.  Protected by "hitlock".
+    solver_workers_t* search;
+
+    // Serializes the parts of solver_handle_hit() that touch "top",
+    // for both the verifiers and the search threads.
+    pthread_mutex_t hitlock;
+
+    // Protects everything below.
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t idle;
+    struct verify_item items[VERIFY_QUEUE_SIZE];
+    int head;
+    int n;
+    // number of verifiers working on an item.
+    int nbusy;
+    anbool shutdown;
+    // number of matches queued (rather than verified by the searcher).
+    int nqueued;
+};
+typedef struct solver_verifiers_t solver_verifiers_t;
+
+struct verifier_arg {
+    solver_verifiers_t* v;
+    solver_t* clone;
+};
+
+static anbool is_verifier(const solver_verifiers_t* v, const solver_t* sp) {
+    return (sp >= v->clones) && (sp < v->clones + v->nthreads);
+}
+
+/*
+ Queues "c" (found in the current index) for verification.  Returns
+ FALSE if the queue is full or if "sp" is a verifier, in which case the
+ caller should verify it now.
+ */
+static anbool queue_hit(solver_t* sp, const candidate_t* c) {
+    solver_verifiers_t* v = sp->verifiers;
+    struct verify_item* item;
+    if (is_verifier(v, sp))
+        return FALSE;
+    pthread_mutex_lock(&v->lock);
+    if (v->n == VERIFY_QUEUE_SIZE) {
+        pthread_mutex_unlock(&v->lock);
+        return FALSE;
+    }
+    item = v->items + ((v->head + v->n) % VERIFY_QUEUE_SIZE);
+    memcpy(&(item->cand), c, sizeof(candidate_t));
+    item->index = sp->index;
+    item->indexnum = sp->indexnum;
+    v->n++;
+    v->nqueued++;
+    pthread_cond_signal(&v->nonempty);
+    pthread_mutex_unlock(&v->lock);
+    return TRUE;
+}
+
+static void* verifier_main(void* varg) {
+    struct verifier_arg* arg = varg;
+    solver_verifiers_t* v = arg->v;
+    solver_t* clone = arg->clone;
+    struct verify_item item;
+
+    switch_stage(clone, SOLVER_STAGE_OTHER);
+    pthread_mutex_lock(&v->lock);
+    for (;;) {
+        while (!v->n && !v->shutdown)
+            pthread_cond_wait(&v->nonempty, &v->lock);
+        if (!v->n)
+            break;
+        memcpy(&item, v->items + v->head, sizeof(struct verify_item));
+        v->head = (v->head + 1) % VERIFY_QUEUE_SIZE;
+        v->n--;
+        v->nbusy++;
+        pthread_mutex_unlock(&v->lock);
+
+        // once the field is solved, the rest of the queue is just dropped.
+        if (!solver_should_quit(v->top)) {
+            clone->index = item.index;
+            clone->indexnum = item.indexnum;
+            solver_handle_candidate(clone, &(item.cand));
+        }
+
+        pthread_mutex_lock(&v->lock);
+        v->nbusy--;
+        if (!v->n && !v->nbusy)
+            pthread_cond_broadcast(&v->idle);
+    }
+    pthread_mutex_unlock(&v->lock);
+    switch_stage(clone, -1);
+    free(arg);
+    return NULL;
+}
+
+static void verifiers_free(solver_verifiers_t* v);
+
+static solver_verifiers_t* verifiers_new(solver_t* top, int nthreads) {
+    solver_verifiers_t* v;
+    int i;
+
+    v = calloc(1, sizeof(solver_verifiers_t));
+    v->top = top;
+    v->clones = calloc(nthreads, sizeof(solver_t));
+    v->threads = calloc(nthreads, sizeof(pthread_t));
+    pthread_mutex_init(&v->hitlock, NULL);
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->nonempty, NULL);
+    pthread_cond_init(&v->idle, NULL);
+    for (i=0; i<nthreads; i++) {
+        solver_t* clone = v->clones + i;
+        init_clone(clone, top);
+        clone->workers = NULL;
+        clone->verifiers = v;
+    }
+    v->nthreads = nthreads;
+    for (i=0; i<nthreads; i++) {
+        struct verifier_arg* arg = malloc(sizeof(struct verifier_arg));
+        arg->v = v;
+        arg->clone = v->clones + i;
+        if (pthread_create(v->threads + i, NULL, verifier_main, arg)) {
+            SYSERROR("Failed to create verifier thread");
+            free(arg);
+            break;
+        }
+    }
+    v->nthreads = i;
+    if (!v->nthreads) {
+        // no threads; verify synchronously.
+        verifiers_free(v);
+        return NULL;
+    }
+    logverb("Verifying with %i threads.\n", v->nthreads);
+    return v;
+}
+
+/*
+ Waits for the queued matches to be verified (or dropped, if the field
+ has been solved), stops the threads, and merges their best matches into
+ the caller's solver_t.
+ */
+static void verifiers_free(solver_verifiers_t* v) {
+    solver_t* top = v->top;
+    int i;
+
+    pthread_mutex_lock(&v->lock);
+    while (v->n || v->nbusy)
+        pthread_cond_wait(&v->idle, &v->lock);
+    v->shutdown = TRUE;
+    pthread_cond_broadcast(&v->nonempty);
+    pthread_mutex_unlock(&v->lock);
+    for (i=0; i<v->nthreads; i++)
+        pthread_join(v->threads[i], NULL);
+
+    if (v->nthreads)
+        logverb("Queued %i matches for the verifier threads.\n", v->nqueued);
+    for (i=0; i<v->nthreads; i++)
+        merge_clone(top, v->clones + i);
+
+    pthread_mutex_destroy(&v->hitlock);
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->nonempty);
+    pthread_cond_destroy(&v->idle);
+    free(v->threads);
+    free(v->clones);
+    free(v);
+}
+
+// The lock that serializes hit handling, if there are other threads.
+static pthread_mutex_t* get_hitlock(solver_t* sp) {
+    if (sp->verifiers)
+        return &sp->verifiers->hitlock;
+    if (sp->workers)
+        return &sp->workers->hitlock;
+    return NULL;
+}
+
+// Stops the search (and the other threads).  Call with the hitlock held.
+static void stop_search(solver_t* sp) {
+    solver_t* top = (sp->parent ? sp->parent : sp);
+    solver_set_quit(top);
+    if (sp->workers)
+        workers_quit(sp->workers);
+    if (sp->verifiers && sp->verifiers->search)
+        workers_quit(sp->verifiers->search);
+}
+
+// Points step->window at the pairs (A < B) within the quad scale
+// range, returning the number of them.
+static int pair_window(const solver_t* s, int B, solver_step_t* step) {
+    int start;
+    int n = pair_table_window(s->pairtable, B, s->minminAB2, s->maxmaxAB2,
+                              &start);
+    step->window = s->pairtable->pairs + start;
+    return n;
+}
+
+/*
+ Checks the scale of the AB pair, and if it can form quads for some
+ index, adds its pquad to the store, with the "inbox" buffers
+ allocated.  Returns NULL if the pair is no good.
+ */
+static pquad* add_pquad(solver_t* solver, const solver_step_t* step,
+                        int fieldA, int fieldB) {
+    pquad tmp;
+    pquad* pq;
+    size_t i;
+    int numxy = step->numxy;
+
+    memset(&tmp, 0, sizeof(pquad));
+    tmp.fieldA = fieldA;
+    tmp.fieldB = fieldB;
+    debug("  trying A=%i, B=%i\n", fieldA, fieldB);
+    check_scale(&tmp, solver);
+    if (!tmp.scale_ok) {
+        debug("    bad scale for A=%i, B=%i\n", fieldA, fieldB);
+        return NULL;
+    }
+    // The scale is within [minminAB2, maxmaxAB2], but it could still
+    // fall between the ranges of the indexes, in which case it can't
+    // be used.
+    for (i=0; i<step->num_indexes; i++)
+        if ((tmp.scale >= step->minAB2s[i]) &&
+            (tmp.scale <= step->maxAB2s[i]))
+            break;
+    if (i == step->num_indexes) {
+        debug("    no index for scale of A=%i, B=%i\n", fieldA, fieldB);
+        return NULL;
+    }
+    pq = pquad_list_append(step->pairs + fieldA, &tmp);
+    if (!pq)
+        return NULL;
+    pq->inbox = arena_alloc(solver->pquad_arena,
+                            PQUAD_INBOX_WORDS(numxy) * sizeof(uint64_t));
+    pq->xy = arena_alloc(solver->pquad_arena, numxy * 2 * sizeof(double));
+    return pq;
+}
+
+/*
+ Initializes the "pquad" for A = step->window[unit].A (or A = unit),
+ B = newpoint, ie, the quads with the new star on the diagonal.
+ */
+static void init_ab_pquad(solver_t* solver, const solver_step_t* step,
+                          int unit) {
+    int numxy = step->numxy;
+    int newpoint = step->newpoint;
+    int field[DQMAX];
+    pquad* pq;
+    int stage = switch_stage(solver, SOLVER_STAGE_PQUAD);
+
+    field[A] = (step->window ? step->window[unit].A : unit);
+    field[B] = newpoint;
+    pq = add_pquad(solver, step, field[A], field[B]);
+    if (!pq) {
+        switch_stage(solver, stage);
+        return;
+    }
+    // initialize the "inbox" array:
+    // -try all stars up to "newpoint"...
+    init_inbox(pq, newpoint + 1, numxy);
+    // -except A and B.
+    pquad_inbox_clear(pq, field[A]);
+    pquad_inbox_clear(pq, field[B]);
+    switch_stage(solver, SOLVER_STAGE_INBOX);
+    check_inbox(pq, 0, solver);
+    switch_stage(solver, stage);
+    debug("    inbox(A=%i, B=%i): ", field[A], field[B]);
+    print_inbox(pq);
+}
+
+/*
+ Tries the quads with B = newpoint, for index (unit / newpoint) and
+ A = (unit % newpoint).
+ */
+static void try_ab_quads(solver_t* solver, const solver_step_t* step,
+                         int unit) {
+    int newpoint = step->newpoint;
+    int i = unit / newpoint;
+    index_t* index = pl_get(solver->indexes, i);
+    int dimquads;
+    double tol2;
+    int field[DQMAX];
+    const pquad_list_t* list;
+    pquad* pq;
+
+    memset(field, 0, sizeof(field));
+    field[A] = unit % newpoint;
+    field[B] = newpoint;
+    // (if there is a pquad for this AB, it was the last one added)
+    list = step->pairs + field[A];
+    if (!list->n)
+        return;
+    pq = list->pq + list->n - 1;
+    if (pq->fieldB != field[B])
+        return;
+    if ((pq->scale < step->minAB2s[i]) ||
+        (pq->scale > step->maxAB2s[i]))
+        return;
+    set_index(solver, i);
+    dimquads = index_dimquads(index);
+    // set code tolerance for this index and AB pair...
+    solver->rel_field_noise2 = pq->rel_field_noise2;
+    tol2 = get_tolerance(solver);
+    // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
+    // ("dimquads - 2" because we've set stars A and B at this point)
+    add_stars(pq, field, C, dimquads-2, 0, newpoint, dimquads, solver, tol2);
+    flush_codes(solver);
+}
+
+/*
+ Adds C = newpoint to the "inbox" of the pquads for A = unit and all B in
+ (A, newpoint), if it's in the box.
+ */
+static void check_c_inbox(solver_t* solver, const solver_step_t* step,
+                          int unit) {
+    int newpoint = step->newpoint;
+    const pquad_list_t* list = step->pairs + unit;
+    int k;
+    int stage = switch_stage(solver, SOLVER_STAGE_INBOX);
+
+    for (k=0; k<list->n; k++) {
+        pquad* pq = list->pq + k;
+        if (pq->fieldB >= newpoint)
+            break;
+        // test if this C is in the box:
+        pquad_inbox_set(pq, newpoint);
+        pq->ninbox = newpoint + 1;
+        check_inbox(pq, newpoint, solver);
+        if (!pquad_inbox_get(pq, newpoint)) {
+            debug("  C is not in the box for A=%i, B=%i\n", unit, pq->fieldB);
+            continue;
+        }
+        debug("  C is in the box for A=%i, B=%i\n", unit, pq->fieldB);
+        debug("    box now:");
+        print_inbox(pq);
+        debug("\n");
+    }
+    switch_stage(solver, stage);
+}
+
+/*
+ Tries the quads with C = newpoint, for index (unit / newpoint),
+ A = (unit % newpoint), and all B in (A, newpoint).
+ */
+static void try_c_quads(solver_t* solver, const solver_step_t* step,
+                        int unit) {
+    int newpoint = step->newpoint;
+    int i = unit / newpoint;
+    index_t* index = pl_get(solver->indexes, i);
+    const pquad_list_t* list;
+    int k;
+    int dimquads;
+    double tol2;
+    int field[DQMAX];
+
+    memset(field, 0, sizeof(field));
+    field[A] = unit % newpoint;
+    field[C] = newpoint;
+    list = step->pairs + field[A];
+    dimquads = index_dimquads(index);
+    // (in this loop field[C] > field[D])
+    for (k=0; k<list->n; k++) {
+        // grab the "pquad" for this AB combo
+        pquad* pq = list->pq + k;
+        field[B] = pq->fieldB;
+        if (field[B] >= newpoint)
+            break;
+        if (!pquad_inbox_get(pq, field[C]))
+            continue;
+        if ((pq->scale < step->minAB2s[i]) ||
+            (pq->scale > step->maxAB2s[i]))
+            continue;
+
+        set_index(solver, i);
+        solver->rel_field_noise2 = pq->rel_field_noise2;
+        tol2 = get_tolerance(solver);
+
+        if (dimquads > 3) {
+            // ("dimquads - 3" because we've set stars A, B, and C at this point)
+            add_stars(pq, field, D, dimquads-3, 0, newpoint, dimquads, solver, tol2);
+        } else {
+            TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
+        }
+        if (solver_should_quit(solver))
+            return;
+    }
+    flush_codes(solver);
+}
 
 // The real deal
 void solver_run(solver_t* solver) {
-    int numxy, newpoint;
+    int numxy, newpoint, nwin;
     double usertime, systime;
     // first timer callback is called after 1 second
     time_t next_timer_callback_time = time(NULL) + 1;
-    pquad* pquads;
+    pquad_list_t* pairs;
     size_t i, num_indexes;
-    double tol2;
     int field[DQMAX];
+    solver_workers_t* workers = NULL;
 
     get_resource_stats(&usertime, &systime, NULL);
 
+    pthread_once(&inbox_kernel_once, choose_inbox_kernel);
+
     if (!solver->vf)
         solver_preprocess_field(solver);
 
@@ -784,19 +2527,25 @@ void solver_run(solver_t* solver) {
     solver->starttime = usertime + systime;
 
     numxy = starxy_n(solver->fieldxy);
-    if (solver->endobj && (numxy > solver->endobj))
-        numxy = solver->endobj;
+    if (solver->endobj) {
+        if (numxy > solver->endobj)
+            numxy = solver->endobj;
+    } else if (solver->max_field_objs && (numxy > solver->max_field_objs)) {
+        logverb("Limiting search to first %i objects\n", solver->max_field_objs);
+        numxy = solver->max_field_objs;
+    }
     if (solver->startobj >= numxy)
         return;
-    if (numxy >= 1000) {
-        logverb("Limiting search to first 1000 objects\n");
-        numxy = 1000;
-    }
+    PROFILE_BEGIN("solver_run");
 
     num_indexes = pl_size(solver->indexes);
+    if (solver->collect_stats)
+        init_index_stats(solver, num_indexes);
+    switch_stage(solver, SOLVER_STAGE_OTHER);
     {
         double minAB2s[num_indexes];
         double maxAB2s[num_indexes];
+        solver_step_t step;
         solver->minminAB2 = LARGE_VAL;
         solver->maxmaxAB2 = -LARGE_VAL;
         for (i = 0; i < num_indexes; i++) {
@@ -836,18 +2585,36 @@ void solver_run(solver_t* solver) {
          MIN(M_PI, arcsec2rad(field_diag * solver->funits_upper)) ...
          */
 
-        pquads = calloc((size_t)numxy * (size_t)numxy, sizeof(pquad));
-
-        /* We maintain an array of "potential quads" (pquad) structs, where
-         * each struct corresponds to one choice of stars A and B; the struct
-         * at index (B * numxy + A) holds information about quads that could be
-         * created using stars A,B.
-         *
-         * (We only use the above-diagonal elements of this 2D array because
-         * A<B.)
+        pairs = calloc(numxy, sizeof(pquad_list_t));
+        if (!pairs) {
+            SYSERROR("Failed to allocate pquad lists for %i objects", numxy);
+            switch_stage(solver, -1);
+            PROFILE_END("solver_run");
+            return;
+        }
+        if (!solver->pquad_arena)
+            solver->pquad_arena = arena_new(0);
+
+        step.pairs = pairs;
+        step.numxy = numxy;
+        step.num_indexes = num_indexes;
+        step.minAB2s = minAB2s;
+        step.maxAB2s = maxAB2s;
+        step.window = NULL;
+
+        // The pair table is normally built by solver_preprocess_field(),
+        // but startobj/endobj may have changed since.
+        pair_table_ensure(solver, numxy);
+
+        /* We maintain a store of "potential quads" (pquad) structs, where
+         * each struct corresponds to one choice of stars A and B (A<B), and
+         * holds information about quads that could be created using stars
+         * A,B.  Only the AB pairs that can form quads for some index are
+         * kept, so memory grows with the number of usable pairs rather than
+         * numxy^2.  The pquads for star A are in "pairs[A]", sorted by B.
          *
          * For each AB pair, we cache the scale and the rotation parameters,
-         * and we keep an array "inbox" of length "numxy" of booleans, one for
+         * and we keep a bitset "inbox" of length "numxy", one bit for
          * each star, which say whether that star is eligible to be star C or D
          * of a quad with AB at the corners.  (Obviously A and B aren't
          * eligible).
@@ -862,22 +2629,18 @@ void solver_run(solver_t* solver) {
         if (solver->startobj) {
             debug("startobj > 0; priming pquad arrays.\n");
             for (field[B] = 0; field[B] < solver->startobj; field[B]++) {
-                for (field[A] = 0; field[A] < field[B]; field[A]++) {
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    pq->fieldA = field[A];
-                    pq->fieldB = field[B];
-                    debug("trying A=%i, B=%i\n", field[A], field[B]);
-                    check_scale(pq, solver);
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
+                int j, nwin = field[B];
+                if (solver->pairtable)
+                    nwin = pair_window(solver, field[B], &step);
+                for (j = 0; j < nwin; j++) {
+                    pquad* pq;
+                    field[A] = (step.window ? step.window[j].A : j);
+                    pq = add_pquad(solver, &step, field[A], field[B]);
+                    if (!pq)
                         continue;
-                    }
-                    pq->xy = malloc(numxy * 2 * sizeof(double));
-                    pq->inbox = malloc(numxy * sizeof(anbool));
-                    memset(pq->inbox, TRUE, solver->startobj);
-                    pq->ninbox = solver->startobj;
-                    pq->inbox[field[A]] = FALSE;
-                    pq->inbox[field[B]] = FALSE;
+                    init_inbox(pq, solver->startobj, numxy);
+                    pquad_inbox_clear(pq, field[A]);
+                    pquad_inbox_clear(pq, field[B]);
                     check_inbox(pq, 0, solver);
                     debug("  inbox(A=%i, B=%i): ", field[A], field[B]);
                     print_inbox(pq);
@@ -885,6 +2648,17 @@ void solver_run(solver_t* solver) {
             }
         }
 
+        // The worker threads clone the solver, so start them once all
+        // the per-run parameters above have been set.
+        if (solver->nverifiers > 0)
+            solver->verifiers = verifiers_new(solver, solver->nverifiers);
+        // With verifiers, the search always runs in a clone, so that
+        // "solver" is only touched with the hitlock held.
+        if ((solver->nthreads > 1) || solver->verifiers)
+            workers = workers_new(solver, MAX(solver->nthreads, 1));
+        if (solver->verifiers)
+            solver->verifiers->search = workers;
+
         /* Each time through the "for" loop below, we consider a new star
          * ("newpoint").  First, we try building all quads that have the new
          * star on the diagonal (star B).  Then, we try building all quads that
@@ -916,137 +2690,91 @@ void solver_run(solver_t* solver) {
             }
 
             solver->last_examined_object = newpoint;
+            step.newpoint = newpoint;
+
             // quads with the new star on the diagonal:
-            field[B] = newpoint;
             debug("Trying quads with B=%i\n", newpoint);
-	
             // first do an index-independent scale check...
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                // initialize the "pquad" struct for this AB combo.
-                pquad* pq = pquads + field[B] * numxy + field[A];
-                pq->fieldA = field[A];
-                pq->fieldB = field[B];
-                debug("  trying A=%i, B=%i\n", field[A], field[B]);
-                check_scale(pq, solver);
-                if (!pq->scale_ok) {
-                    debug("    bad scale for A=%i, B=%i\n", field[A], field[B]);
-                    continue;
-                }
-                // initialize the "inbox" array:
-                pq->inbox = malloc(numxy * sizeof(anbool));
-                pq->xy = malloc(numxy * 2 * sizeof(double));
-                // -try all stars up to "newpoint"...
-                assert(sizeof(anbool) == 1);
-                memset(pq->inbox, TRUE, newpoint + 1);
-                pq->ninbox = newpoint + 1;
-                // -except A and B.
-                pq->inbox[field[A]] = FALSE;
-                pq->inbox[field[B]] = FALSE;
-                check_inbox(pq, 0, solver);
-                debug("    inbox(A=%i, B=%i): ", field[A], field[B]);
-                print_inbox(pq);
-            }
+            nwin = newpoint;
+            if (solver->pairtable)
+                nwin = pair_window(solver, newpoint, &step);
+            run_step(solver, workers, init_ab_pquad, &step, nwin);
 
             // Now iterate through the different indices
-            for (i = 0; i < num_indexes; i++) {
-                index_t* index = pl_get(solver->indexes, i);
-                int dimquads;
-                set_index(solver, index);
-                dimquads = index_dimquads(index);
-                for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                    // initialize the "pquad" struct for this AB combo.
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok)
-                        continue;
-                    if ((pq->scale < minAB2s[i]) ||
-                        (pq->scale > maxAB2s[i]))
-                        continue;
-                    // set code tolerance for this index and AB pair...
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-                    tol2 = get_tolerance(solver);
-                    // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
-                    // ("dimquads - 2" because we've set stars A and B at this point)
-                    add_stars(pq, field, C, dimquads-2, 0, newpoint, dimquads, solver, tol2);
-                    if (solver->quit_now)
-                        goto quitnow;
-                }
-            }
-
-            if (solver->quit_now)
+            run_step(solver, workers, try_ab_quads, &step,
+                     num_indexes * newpoint);
+            if (solver_should_quit(solver))
                 goto quitnow;
 
             // Now try building quads with the new star not on the diagonal:
-            field[C] = newpoint;
-            // (in this loop field[C] > field[D])
             debug("Trying quads with C=%i\n", newpoint);
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
-                    // grab the "pquad" for this AB combo
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    // test if this C is in the box:
-                    pq->inbox[field[C]] = TRUE;
-                    pq->ninbox = field[C] + 1;
-                    check_inbox(pq, field[C], solver);
-                    if (!pq->inbox[field[C]]) {
-                        debug("  C is not in the box for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    debug("  C is in the box for A=%i, B=%i\n", field[A], field[B]);
-                    debug("    box now:");
-                    print_inbox(pq);
-                    debug("\n");
-
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-
-                    for (i = 0; i < pl_size(solver->indexes); i++) {
-                        int dimquads;
-                        index_t* index = pl_get(solver->indexes, i);
-                        if ((pq->scale < minAB2s[i]) ||
-                            (pq->scale > maxAB2s[i]))
-                            continue;
-                        set_index(solver, index);
-                        dimquads = index_dimquads(index);
-
-                        tol2 = get_tolerance(solver);
-
-                        if (dimquads > 3) {
-                            // ("dimquads - 3" because we've set stars A, B, and C at this point)
-                            add_stars(pq, field, D, dimquads-3, 0, newpoint, dimquads, solver, tol2);
-                        } else {
-                            TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
-                        }
-                        if (solver->quit_now)
-                            goto quitnow;
-                    }
-                }
-            }
+            run_step(solver, workers, check_c_inbox, &step, newpoint);
+            run_step(solver, workers, try_c_quads, &step,
+                     num_indexes * newpoint);
+            if (solver_should_quit(solver))
+                goto quitnow;
+
             logverb("object %u of %u: %i quads tried, %i matched.\n",
                     newpoint + 1, numxy, solver->numtries, solver->nummatches);
 
             if ((solver->maxquads && (solver->numtries >= solver->maxquads))
                 || (solver->maxmatches && (solver->nummatches >= solver->maxmatches))
-                || solver->quit_now)
+                || solver_should_quit(solver))
                 break;
+
+            if (solver->max_pquad_bytes &&
+                (pquad_bytes_used(solver, workers, &step) >= solver->max_pquad_bytes)) {
+                logverb("Reached the pquad memory limit (%zu bytes) after %i objects\n",
+                        solver->max_pquad_bytes, newpoint + 1);
+                break;
+            }
         }
 
     quitnow:
-        for (i = 0; i < (numxy*numxy); i++) {
-            pquad* pq = pquads + i;
-            free(pq->inbox);
-            free(pq->xy);
+        if (solver->verifiers) {
+            pthread_mutex_lock(&solver->verifiers->hitlock);
+            solver->verifiers->search = NULL;
+            pthread_mutex_unlock(&solver->verifiers->hitlock);
+        }
+        if (workers)
+            workers_free(workers);
+        if (solver->verifiers) {
+            verifiers_free(solver->verifiers);
+            solver->verifiers = NULL;
         }
-        free(pquads);
+        code_batch_free(solver->codebatch);
+        solver->codebatch = NULL;
+        fit_wcs_workspace_free(solver->fitws);
+        solver->fitws = NULL;
+        {
+            size_t nbytes = pquad_bytes_used(solver, NULL, &step);
+            logverb("pquads used %zu bytes (%zu reserved)\n", nbytes,
+                    pquad_lists_bytes(pairs, numxy) +
+                    arena_bytes_reserved(solver->pquad_arena));
+            solver->pquad_bytes_peak = MAX(solver->pquad_bytes_peak, nbytes);
+        }
+        // The buffers are all released at once; keep the arena's
+        // blocks for the next run on this field.
+        arena_reset(solver->pquad_arena);
+        pquad_lists_free(pairs, numxy);
     }
+    switch_stage(solver, -1);
+    PROFILE_END("solver_run");
 }
 
 /**
  All the stars in this quad have been chosen.  Figure out which
  permutations of stars CDE are valid and search for matches.
  */
+// The most codes try_all_codes() queues for one quad.
+static int max_codes_per_quad(const solver_t* solver, int dimquad) {
+    int n = 2 * (solver->parity == PARITY_BOTH ? 2 : 1);
+    int i;
+    for (i=2; i<=dimquad-NBACK; i++)
+        n *= i;
+    return n;
+}
+
 static void try_all_codes(const pquad* pq,
                           const int* fieldstars, int dimquad,
                           solver_t* solver, double tol2) {
@@ -1054,8 +2782,12 @@ static void try_all_codes(const pquad* pq,
     double code[DCMAX];
     double flipcode[DCMAX];
     int i;
+    solver_index_stats_t* is;
 
     solver->numtries++;
+    is = index_stats(solver);
+    if (is)
+        is->numtries++;
 
     debug("  trying quad [");
     for (i=0; i<dimquad; i++) {
@@ -1063,6 +2795,13 @@ static void try_all_codes(const pquad* pq,
     }
     debug("]\n");
 
+    // Keep all of this quad's codes -- both parities, A and B swapped,
+    // all orders of the other stars -- in one batch, so that they share
+    // one walk down the code tree.
+    if (solver->codebatch &&
+        solver->codebatch->n + max_codes_per_quad(solver, dimquad) > CODE_BATCH_SIZE)
+        flush_codes(solver);
+
     for (i=0; i<dimquad-NBACK; i++) {
         code[2*i  ] = getx(pq->xy, fieldstars[NBACK+i]);
         code[2*i+1] = gety(pq->xy, fieldstars[NBACK+i]);
@@ -1100,7 +2839,6 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
                             const double* code, solver_t* solver,
                             anbool current_parity, double tol2) {
     int i;
-    kdtree_qres_t* result = NULL;
     int dimcode = (dimquad - 2) * 2;
     int stars[DQMAX];
     double flipcode[DCMAX];
@@ -1116,9 +2854,9 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, code, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
-    if (unlikely(solver->quit_now))
-        goto bailout;
+                     tol2, stars, NULL, 0, placed);
+    if (unlikely(solver_should_quit(solver)))
+        return;
 
     // Flipped:
     stars[0] = fieldstars[1];
@@ -1131,10 +2869,7 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, flipcode, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
-
- bailout:
-    kdtree_free_query(result);
+                     tol2, stars, NULL, 0, placed);
 }
 
 /**
@@ -1146,11 +2881,8 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult) {
+                             int slot, anbool* placed) {
     int i;
-    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
-        KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_USE_SPLIT;
     double mycode[DCMAX];
     int Nstars = dimquad - NBACK;
     int lastslot = dimquad - NBACK - 1;
@@ -1231,7 +2963,7 @@ static void try_permutations(const int* origstars, int dimquad,
             placed[i] = TRUE;
             try_permutations(origstars, dimquad, origcode, solver,
                              current_parity, tol2, stars, code, 
-                             slot+1, placed, presult);
+                             slot+1, placed);
             placed[i] = FALSE;
 
         } else {
@@ -1240,39 +2972,352 @@ static void try_permutations(const int* origstars, int dimquad,
             continue;
 #endif
 				
-            // Search with the code we've built.
-            *presult = kdtree_rangesearch_options_reuse
-                (solver->index->codekd->tree, *presult, code, tol2, options);
-            //debug("      trying ABCD = [%i %i %i %i]: %i results.\n",
-            //fstars[A], fstars[B], fstars[C], fstars[D], result->nres);
-
-            if ((*presult)->nres) {
-                double pixvals[DQMAX*2];
-                int j;
-                for (j=0; j<dimquad; j++) {
-                    setx(pixvals, j, field_getx(solver, stars[j]));
-                    sety(pixvals, j, field_gety(solver, stars[j]));
-                }
-                resolve_matches(*presult, pixvals, stars, dimquad, solver,
-                                current_parity);
-            }
-            if (unlikely(solver->quit_now))
+            // Queue up a search for the code we've built.
+            queue_code(solver, stars, code, dimquad, current_parity, tol2);
+            if (unlikely(solver_should_quit(solver)))
                 return;
         }
     }
 }
 
+/*
+ The codes of a code tree whose data were packed (see
+ kdtree_t.packed_data) are up to "pack_error" off in each dimension, so
+ up to "E" = pack_error * sqrt(dimcode) in distance.  The search is
+ widened by E, and the matches within E of the tolerance are checked
+ against the code computed from the index quad's stars.
+ */
+static void check_packed_matches(solver_t* solver, kdtree_qres_t* res,
+                                 const double* code, int dimquad,
+                                 double tol2, double E) {
+    int dimcode = (dimquad - 2) * 2;
+    double tol = sqrt(tol2);
+    double sure2 = (tol > E) ? square(tol - E) : -1.0;
+    int i, n = 0;
+
+    for (i=0; i<res->nres; i++) {
+        if (res->sdists[i] > sure2) {
+            unsigned int stars[DQMAX];
+            double starxyz[DQMAX * 3];
+            double icode[DCMAX];
+            double d2;
+            int j;
+            quadfile_get_stars(solver->index->quads, res->inds[i], stars);
+            for (j=0; j<dimquad; j++)
+                startree_get(solver->index->starkd, stars[j], starxyz + 3*j);
+            quad_compute_star_code(starxyz, icode, dimquad);
+            d2 = distsq(icode, code, dimcode);
+            if (d2 > tol2)
+                continue;
+            res->sdists[i] = d2;
+        }
+        res->inds[n] = res->inds[i];
+        res->sdists[n] = res->sdists[i];
+        n++;
+    }
+    res->nres = n;
+}
+
+// Adds the matches in "from" to those in "*to" (taking its arrays if
+// "*to" has none).
+static void qres_merge(kdtree_qres_t** to, kdtree_qres_t** from) {
+    kdtree_qres_t* t = *to;
+    kdtree_qres_t* f = *from;
+    if (!f->nres)
+        return;
+    if (!t->nres) {
+        *to = f;
+        *from = t;
+        return;
+    }
+    if (t->nres + f->nres > t->capacity) {
+        t->capacity = t->nres + f->nres;
+        t->inds = an_alloc_realloc(AN_ALLOC_LIBKD, t->inds,
+                                   t->capacity * sizeof(u32));
+        t->sdists = an_alloc_realloc(AN_ALLOC_LIBKD, t->sdists,
+                                     t->capacity * sizeof(double));
+    }
+    memcpy(t->inds + t->nres, f->inds, f->nres * sizeof(u32));
+    memcpy(t->sdists + t->nres, f->sdists, f->nres * sizeof(double));
+    t->nres += f->nres;
+}
+
+// Empties the results of the batch's first "n" codes.
+static int clear_results(solver_code_batch_t* b, int n) {
+    int k;
+    for (k=0; k<n; k++) {
+        if (!b->qres[k]) {
+            b->qres[k] = calloc(1, sizeof(kdtree_qres_t));
+            if (!b->qres[k]) {
+                SYSERROR("Failed to allocate code search result");
+                return -1;
+            }
+        }
+        b->qres[k]->nres = 0;
+    }
+    return 0;
+}
+
+// Searches the code tree "kd" for the batch's codes "k" with "want[k]"
+// set, adding the matches to their results.
+static int search_code_subtree(solver_code_batch_t* b, const kdtree_t* kd,
+                               const anbool* want, int n, const double* tol2,
+                               int options) {
+    int dimcode = (b->dimquad - 2) * 2;
+    int subk[CODE_BATCH_SIZE];
+    double subcodes[CODE_BATCH_SIZE * DCMAX];
+    double subtol2[CODE_BATCH_SIZE];
+    int i, k, m = 0;
+
+    for (k=0; k<n; k++) {
+        if (!want[k])
+            continue;
+        memcpy(subcodes + m * dimcode, b->codes + k * dimcode,
+               dimcode * sizeof(double));
+        subtol2[m] = tol2[k];
+        subk[m] = k;
+        m++;
+    }
+    if (!m)
+        return 0;
+    if (kdtree_rangesearch_batch(kd, b->binqres, subcodes, m, subtol2, options))
+        return -1;
+    for (i=0; i<m; i++)
+        qres_merge(b->qres + subk[i], b->binqres + i);
+    return 0;
+}
+
+// The full code tree to search: the copy on this thread's NUMA node, if
+// the index has one.
+static const kdtree_t* code_tree(const solver_t* solver) {
+    return index_code_tree_for_node(solver->index, solver->numa_pin ?
+                                    solver->numa_node : -1);
+}
+
+/*
+ The search of flush_codes() for an index whose code tree is also split
+ by quad scale (see codetree_t.scalebins).  A code is searched for only
+ in the bins that hold quads whose AB length fits the field quad's AB
+ pixel length and the pixel-scale range: resolve_matches() would reject
+ the quads of the other bins on their scale.  Codes that need every bin
+ search the full tree.  Each tree is searched for all its codes at once.
+ */
+static int search_scale_bins(solver_t* solver, solver_code_batch_t* b, int n,
+                             const double* tol2, int options) {
+    const codetree_t* ct = solver->index->codekd;
+    int b0[CODE_BATCH_SIZE], b1[CODE_BATCH_SIZE];
+    anbool want[CODE_BATCH_SIZE];
+    int j, k;
+
+    if (clear_results(b, n))
+        return -1;
+    for (k=0; k<n; k++) {
+        double ab2, ablo, abhi;
+        ab2 = square(field_getx(solver, b->stars[k][0]) -
+                     field_getx(solver, b->stars[k][1])) +
+            square(field_gety(solver, b->stars[k][0]) -
+                   field_gety(solver, b->stars[k][1]));
+        // (with the margin of geometry_reject())
+        ablo = sqrt(solver->abscale_low * ab2) * (1.0 - 1e-4);
+        abhi = sqrt(solver->abscale_high * ab2) * (1.0 + 1e-4);
+        codetree_scale_bins_between(ct, ablo, abhi, b0 + k, b1 + k);
+    }
+
+    // bin -1 is the full tree.
+    for (j=-1; j<ct->nscalebins; j++) {
+        for (k=0; k<n; k++) {
+            anbool all = (b0[k] == 0 && b1[k] == ct->nscalebins - 1);
+            want[k] = (j == -1) ? all : (!all && j >= b0[k] && j <= b1[k]);
+        }
+        if (search_code_subtree(b, (j == -1) ? code_tree(solver) :
+                                ct->scalebins[j], want, n, tol2, options))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ The search of flush_codes() for an index whose code tree is also split
+ by position (see codetree_t.skybins), when the solver has a position
+ hint: only the bins near the search cap are searched.  The quads of the
+ others have their AB midpoints, and so some of their stars, outside the
+ cap; resolve_matches() would reject them.
+ */
+static int search_sky_bins(solver_t* solver, solver_code_batch_t* b, int n,
+                           const double* tol2, int options) {
+    const codetree_t* ct = solver->index->codekd;
+    anbool want[CODE_BATCH_SIZE];
+    int j, k, nnear;
+
+    if (clear_results(b, n))
+        return -1;
+    if (b->skynear_size < ct->nskybins) {
+        free(b->skynear);
+        b->skynear = malloc(ct->nskybins * sizeof(anbool));
+        if (!b->skynear) {
+            b->skynear_size = 0;
+            SYSERROR("Failed to allocate %i sky bins", ct->nskybins);
+            return -1;
+        }
+        b->skynear_size = ct->nskybins;
+    }
+    nnear = codetree_sky_bins_near(ct, solver->centerxyz, solver->r2,
+                                   b->skynear);
+    for (k=0; k<n; k++)
+        want[k] = TRUE;
+    if (nnear == ct->nskybins)
+        return search_code_subtree(b, code_tree(solver), want, n, tol2, options);
+    for (j=0; j<ct->nskybins; j++)
+        if (b->skynear[j] &&
+            search_code_subtree(b, ct->skybins[j], want, n, tol2, options))
+            return -1;
+    return 0;
+}
+
+/*
+ Searches the code tree for all the queued codes at once, then handles
+ the matches in the order the codes were queued.
+ */
+static void flush_codes(solver_t* solver) {
+    solver_code_batch_t* b = solver->codebatch;
+    int options = KD_OPTIONS_COMPUTE_DISTS | KD_OPTIONS_NO_RESIZE_RESULTS |
+        KD_OPTIONS_USE_SPLIT;
+    int dimcode;
+    double packerr;
+    double tol2[CODE_BATCH_SIZE];
+    int k, n, stage;
+
+    if (!b || !b->n)
+        return;
+    n = b->n;
+    b->n = 0;
+    if (unlikely(solver_check_cancel(solver)))
+        return;
+
+    dimcode = (b->dimquad - 2) * 2;
+    packerr = solver->index->codekd->tree->pack_error * sqrt(dimcode);
+    for (k=0; k<n; k++)
+        tol2[k] = (packerr > 0) ? square(sqrt(b->tol2[k]) + packerr) : b->tol2[k];
+
+    stage = switch_stage(solver, SOLVER_STAGE_SEARCH);
+    if (solver->code_matcher ?
+        code_matcher_search(solver->code_matcher, solver->index, b->codes, n,
+                            tol2, b->qres) :
+        (solver->use_radec && solver->r2 <= 2.0 &&
+         solver->index->codekd->nskybins) ?
+        search_sky_bins(solver, b, n, tol2, options) :
+        solver->index->codekd->nscalebins ?
+        search_scale_bins(solver, b, n, tol2, options) :
+        kdtree_rangesearch_batch(code_tree(solver), b->qres,
+                                 b->codes, n, tol2, options)) {
+        ERROR("Code tree search failed");
+        switch_stage(solver, stage);
+        return;
+    }
+    if (packerr > 0)
+        for (k=0; k<n; k++)
+            check_packed_matches(solver, b->qres[k], b->codes + k * dimcode,
+                                 b->dimquad, b->tol2[k], packerr);
+    switch_stage(solver, stage);
+    for (k=0; k<n; k++) {
+        //debug("      trying ABCD = [%i %i %i %i]: %i results.\n",
+        //fstars[A], fstars[B], fstars[C], fstars[D], result->nres);
+        if (b->qres[k]->nres) {
+            double pixvals[DQMAX*2];
+            int j;
+            for (j=0; j<b->dimquad; j++) {
+                setx(pixvals, j, field_getx(solver, b->stars[k][j]));
+                sety(pixvals, j, field_gety(solver, b->stars[k][j]));
+            }
+            resolve_matches(b->qres[k], pixvals, b->stars[k], b->dimquad,
+                            solver, b->parity[k], b->numtries[k]);
+        }
+        if (unlikely(solver_should_quit(solver)))
+            return;
+    }
+}
+
+/*
+ Checks a code match against the index's quad geometry table (the
+ midpoint of stars A,B and their separation), before any of its stars
+ are fetched.  Returns 1 if the match would fail the RA,Dec check, 2 if
+ it would fail the AB scale check, 0 if it has to be looked at
+ properly.  The table is in single precision, so this only rejects
+ matches that fail by more than its rounding; the rest are decided by
+ the full checks as before.
+ */
+static int geometry_reject(const solver_t* solver, const float* geom,
+                           const double* field_xy) {
+    double abscale;
+    if (solver->use_radec && solver->r2 < 2.0) {
+        // Every star in the quad is within the search radius only if A
+        // and B are, and then so is their midpoint (for radii up to 90
+        // degrees).
+        double d2 = 0.0;
+        int i;
+        for (i=0; i<3; i++)
+            d2 += square(geom[i] - solver->centerxyz[i]);
+        if (sqrt(d2) > sqrt(solver->r2) + 1e-5)
+            return 1;
+    }
+    abscale = square((double)geom[3]) / distsq(field_xy, field_xy+2, 2);
+    if (abscale > solver->abscale_high * (1.0 + 1e-4) ||
+        abscale < solver->abscale_low * (1.0 - 1e-4))
+        return 2;
+    return 0;
+}
+
+/*
+ How many code matches ahead resolve_matches() starts reading the quads'
+ records, and then (half as far ahead, once their star IDs have
+ arrived) the stars' positions, so that the cache misses of successive
+ matches overlap rather than each waiting on the last.
+ */
+#define RESOLVE_PREFETCH 8
+// Smaller indexes stay in the CPU caches, so prefetching their records
+// would only cost time.
+#define RESOLVE_PREFETCH_MIN_BYTES (8 << 20)
+
+static anbool worth_prefetching(const index_t* index) {
+    return ((size_t)index->nquads * index->dimquads * sizeof(uint32_t) +
+            (size_t)index->nstars * 3 * sizeof(uint32_t)) >= RESOLVE_PREFETCH_MIN_BYTES;
+}
+
+static void prefetch_match(solver_t* solver, const kdtree_qres_t* krez,
+                           int jj) {
+    quadfile_t* quads = solver->index->quads;
+    int i;
+    if (jj + RESOLVE_PREFETCH < krez->nres)
+        quadfile_prefetch(quads, krez->inds[jj + RESOLVE_PREFETCH]);
+    // (with the "quadxyz" table, the stars aren't needed.)
+    if (!quads->xyzarray && jj + RESOLVE_PREFETCH/2 < krez->nres) {
+        const uint32_t* stars = quads->quadarray +
+            (size_t)krez->inds[jj + RESOLVE_PREFETCH/2] * quads->dimquads;
+        for (i=0; i<quads->dimquads; i++)
+            startree_prefetch(solver->index->starkd, stars[i]);
+    }
+}
+
 static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
                             const int* fieldstars, int dimquads,
-                            solver_t* solver, anbool current_parity) {
+                            solver_t* solver, anbool current_parity,
+                            int numtries) {
     // "field_xy" contains the xy pixel coordinates of stars A,B,C,D forming the quad
     //    [x_A,y_A, x_B,y_B, x_C,y_C, ...]
     int jj, thisquadno;
-    MatchObj mo;
+    candidate_t cand;
     unsigned int star[dimquads];
+    solver_index_stats_t* is = index_stats(solver);
+    int stage = switch_stage(solver, SOLVER_STAGE_RESOLVE);
+    anbool prefetch;
 
     assert(krez);
 
+    prefetch = (krez->nres > 1 && worth_prefetching(solver->index));
+    if (prefetch)
+        for (jj = 0; jj < MIN(krez->nres, RESOLVE_PREFETCH); jj++)
+            quadfile_prefetch(solver->index->quads, krez->inds[jj]);
+
     for (jj = 0; jj < krez->nres; jj++) {
         double starxyz[dimquads*3];
         double scale;
@@ -1281,12 +3326,43 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         int i;
         anbool outofbounds = FALSE;
         double abscale;
+        const float* geom;
+        const float* qxyz;
+
+        if (prefetch)
+            prefetch_match(solver, krez, jj);
 
         solver->nummatches++;
+        if (is)
+            is->nummatches++;
         thisquadno = krez->inds[jj];
+        geom = quadfile_get_geometry(solver->index->quads, thisquadno);
+        if (geom) {
+            int reject = geometry_reject(solver, geom, field_xy);
+            if (reject == 1) {
+                solver->num_radec_skipped++;
+                continue;
+            }
+            if (reject == 2) {
+                solver->num_abscale_skipped++;
+                continue;
+            }
+        }
         quadfile_get_stars(solver->index->quads, thisquadno, star);
+        qxyz = quadfile_get_star_xyz(solver->index->quads, thisquadno);
+        if (unlikely(solver->index->heatmap)) {
+            index_heatmap_touch_quad(solver->index->heatmap, thisquadno);
+            if (!qxyz)
+                index_heatmap_touch_stars(solver->index->heatmap,
+                                          (const int*)star, dimquads);
+        }
         for (i=0; i<dimquads; i++) {
-            startree_get(solver->index->starkd, star[i], starxyz + 3*i);
+            if (qxyz) {
+                starxyz[3*i+0] = qxyz[3*i+0];
+                starxyz[3*i+1] = qxyz[3*i+1];
+                starxyz[3*i+2] = qxyz[3*i+2];
+            } else
+                startree_get(solver->index->starkd, star[i], starxyz + 3*i);
             if (solver->use_radec)
                 if (distsq(starxyz + 3*i, solver->centerxyz, 3) > solver->r2) {
                     outofbounds = TRUE;
@@ -1315,7 +3391,10 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         }
 
         // compute TAN projection from the matching quad alone.
-        if (fit_tan_wcs(starxyz, field_xy, dimquads, &wcs, &scale)) {
+        if (!solver->fitws)
+            solver->fitws = fit_wcs_workspace_new(1, DQMAX);
+        if (fit_tan_wcs_weighted_ws(solver->fitws, starxyz, field_xy, NULL,
+                                    dimquads, &wcs, &scale)) {
             // bad quad.
             logverb("bad quad at %s:%i\n", __FILE__, __LINE__);
             continue;
@@ -1330,37 +3409,75 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
             continue;
         }
         solver->numscaleok++;
+        if (is)
+            is->numscaleok++;
+
+        memcpy(&(cand.wcstan), &wcs, sizeof(tan_t));
+        cand.code_err = krez->sdists[jj];
+        cand.scale = arcsecperpix;
+        cand.parity = current_parity;
+        cand.quads_tried = numtries;
+        cand.quads_matched = solver->nummatches;
+        cand.quads_scaleok = solver->numscaleok;
+        cand.quad_npeers = krez->nres;
+        cand.timeused = solver->timeused;
+        cand.quadno = thisquadno;
+        memcpy(cand.field, fieldstars, dimquads * sizeof(int));
+
+        if (solver_handle_candidate(solver, &cand))
+            solver_set_quit(solver);
+
+        if (unlikely(solver_should_quit(solver)))
+            break;
+    }
+    switch_stage(solver, stage);
+}
 
-        set_matchobj_template(solver, &mo);
-        memcpy(&(mo.wcstan), &wcs, sizeof(tan_t));
-        mo.wcs_valid = TRUE;
-        mo.code_err = krez->sdists[jj];
-        mo.scale = arcsecperpix;
-        mo.parity = current_parity;
-        mo.quads_tried = solver->numtries;
-        mo.quads_matched = solver->nummatches;
-        mo.quads_scaleok = solver->numscaleok;
-        mo.quad_npeers = krez->nres;
-        mo.timeused = solver->timeused;
-        mo.quadno = thisquadno;
-        mo.dimquads = dimquads;
-        for (i=0; i<dimquads; i++) {
-            mo.star[i] = star[i];
-            mo.field[i] = fieldstars[i];
-            mo.ids[i] = 0;
-        }
-
-        memcpy(mo.quadpix, field_xy, 2 * dimquads * sizeof(double));
-        memcpy(mo.quadxyz, starxyz, 3 * dimquads * sizeof(double));
-
-        set_center_and_radius(solver, &mo, &(mo.wcstan), NULL);
-
-        if (solver_handle_hit(solver, &mo, NULL, FALSE))
-            solver->quit_now = TRUE;
-
-        if (unlikely(solver->quit_now))
-            return;
+/*
+ Fills in "mo" for candidate "c" of the current index: the quad's stars
+ and their positions come from the index, and its pixel positions from
+ the field.
+ */
+static void candidate_to_matchobj(solver_t* sp, const candidate_t* c,
+                                  MatchObj* mo) {
+    int i, dimquads = quadfile_dimquads(sp->index->quads);
+    const float* qxyz;
+
+    set_matchobj_template(sp, mo);
+    memcpy(&(mo->wcstan), &(c->wcstan), sizeof(tan_t));
+    mo->wcs_valid = TRUE;
+    mo->code_err = c->code_err;
+    mo->scale = c->scale;
+    mo->parity = c->parity;
+    mo->quads_tried = c->quads_tried;
+    mo->quads_matched = c->quads_matched;
+    mo->quads_scaleok = c->quads_scaleok;
+    mo->quad_npeers = c->quad_npeers;
+    mo->timeused = c->timeused;
+    mo->quadno = c->quadno;
+    mo->dimquads = dimquads;
+    quadfile_get_stars(sp->index->quads, c->quadno, mo->star);
+    qxyz = quadfile_get_star_xyz(sp->index->quads, c->quadno);
+    for (i=0; i<dimquads; i++) {
+        mo->field[i] = c->field[i];
+        mo->ids[i] = 0;
+        field_getxy(sp, c->field[i], mo->quadpix + 2*i, mo->quadpix + 2*i + 1);
+        if (qxyz) {
+            mo->quadxyz[3*i+0] = qxyz[3*i+0];
+            mo->quadxyz[3*i+1] = qxyz[3*i+1];
+            mo->quadxyz[3*i+2] = qxyz[3*i+2];
+        } else
+            startree_get(sp->index->starkd, mo->star[i], mo->quadxyz + 3*i);
     }
+    set_center_and_radius(sp, mo, &(mo->wcstan), NULL);
+}
+
+static int solver_handle_candidate(solver_t* sp, const candidate_t* c) {
+    MatchObj mo;
+    if (sp->verifiers && queue_hit(sp, c))
+        return FALSE;
+    candidate_to_matchobj(sp, c, &mo);
+    return solver_handle_hit(sp, &mo, NULL, FALSE);
 }
 
 void solver_inject_match(solver_t* solver, MatchObj* mo, sip_t* sip) {
@@ -1372,6 +3489,15 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
     double match_distance_in_pixels2;
     anbool solved;
     double logaccept;
+    // the solver_t that solver_run() was called with.
+    solver_t* top = (sp->parent ? sp->parent : sp);
+    solver_index_stats_t* is;
+    pthread_mutex_t* hitlock;
+    int stage;
+
+    is = index_stats(sp);
+    hitlock = get_hitlock(sp);
+    stage = switch_stage(sp, SOLVER_STAGE_VERIFY);
 
     mo->indexid = sp->index->indexid;
     mo->healpix = sp->index->healpix;
@@ -1385,13 +3511,21 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
 
     logaccept = MIN(sp->logratio_tokeep, sp->logratio_totune);
 
+    PROFILE_BEGIN("verify");
     verify_hit(sp->index->starkd, sp->index->cutnside,
                mo, verifysip, sp->vf, match_distance_in_pixels2,
                sp->distractor_ratio, sp->field_maxx, sp->field_maxy,
                sp->logratio_bail_threshold, logaccept,
                sp->logratio_stoplooking,
                sp->distance_from_quad_bonus, fake_match);
-    mo->nverified = sp->num_verified++;
+    PROFILE_END("verify");
+    if (hitlock)
+        pthread_mutex_lock(hitlock);
+    mo->nverified = top->num_verified++;
+    if (hitlock)
+        pthread_mutex_unlock(hitlock);
+    if (is)
+        is->num_verified++;
 
     if (mo->logodds >= sp->best_logodds) {
         sp->best_logodds = mo->logodds;
@@ -1402,13 +3536,16 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
         mo->logodds < sp->logratio_tokeep) {
         logverb("Trying to tune up this solution (logodds = %g; %g)...\n",
                 mo->logodds, exp(mo->logodds));
+        int prev = switch_stage(sp, SOLVER_STAGE_TWEAK);
         solver_tweak2(sp, mo, 1, NULL);
+        switch_stage(sp, prev);
         logverb("After tuning, logodds = %g (%g)\n",
                 mo->logodds, exp(mo->logodds));
 
         // Since we tuned up this solution, we can't just accept the
         // resulting log-odds at face value.
         if (!fake_match) {
+            PROFILE_BEGIN("verify");
             verify_hit(sp->index->starkd, sp->index->cutnside,
                        mo, mo->sip, sp->vf, match_distance_in_pixels2,
                        sp->distractor_ratio,
@@ -1418,10 +3555,12 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
                        sp->logratio_stoplooking,
                        sp->distance_from_quad_bonus,
                        fake_match);
+            PROFILE_END("verify");
             logverb("Checking tuned result: logodds = %g (%g)\n",
                     mo->logodds, exp(mo->logodds));
         }
     }
+    switch_stage(sp, stage);
 
     if (mo->logodds < sp->logratio_toprint)
         return FALSE;
@@ -1542,9 +3681,11 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
             }
             
             int doshift = 1;
+            PROFILE_BEGIN("tweak");
             fit_sip_wcs(matchxyz, matchxy, weights, Ngood, &(sip->wcstan),
                         sp->tweak_aborder, sp->tweak_abporder, doshift,
                         sip);
+            PROFILE_END("tweak");
 
             if (log_get_level() >= LOG_VERB) {
                 printf("Final SIP on distorted positions:\n");
@@ -1602,7 +3743,14 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
         free(weights);
 
     } else if (sp->do_tweak) {
+        stage = switch_stage(sp, SOLVER_STAGE_TWEAK);
         solver_tweak2(sp, mo, sp->tweak_aborder, verifysip);
+        switch_stage(sp, stage);
+
+    } else if (verifysip && verifysip->a_order > 0) {
+        // untweaked, the verified WCS keeps its distortion.
+        mo->sip = sip_create();
+        memcpy(mo->sip, verifysip, sizeof(sip_t));
 
     } else if (!verifysip && sp->set_crpix) {
         tan_t wcs2;
@@ -1631,11 +3779,30 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
          */
     }
 
+    if (hitlock) {
+        pthread_mutex_lock(hitlock);
+        if (solver_should_quit(top)) {
+            // Another thread has already finished the search.
+            pthread_mutex_unlock(hitlock);
+            verify_free_matchobj(mo);
+            return TRUE;
+        }
+        // The callback looks at the current index.
+        top->index = sp->index;
+    }
+
     // If the user didn't supply a callback, or if the callback
     // returns TRUE, consider it solved.
     solved = (!sp->record_match_callback ||
               sp->record_match_callback(mo, sp->userdata));
 
+    if (hitlock) {
+        // The callback can also ask us to stop.
+        if (solved || solver_should_quit(top))
+            stop_search(sp);
+        pthread_mutex_unlock(hitlock);
+    }
+
     // New best match?
     if (!sp->have_best_match || (mo->logodds > sp->best_match.logodds)) {
         if (sp->have_best_match)
@@ -1676,6 +3843,8 @@ void solver_set_default_values(solver_t* solver) {
     solver->distance_from_quad_bonus = TRUE;
     solver->tweak_aborder = DEFAULT_TWEAK_ABORDER;
     solver->tweak_abporder = DEFAULT_TWEAK_ABPORDER;
+    solver->max_field_objs = DEFAULT_MAX_FIELD_OBJS;
+    solver->stats.stage = -1;
 }
 
 void solver_clear_indexes(solver_t* solver) {
@@ -1685,6 +3854,10 @@ void solver_clear_indexes(solver_t* solver) {
 
 void solver_cleanup(solver_t* solver) {
     solver_free_field(solver);
+    code_batch_free(solver->codebatch);
+    solver->codebatch = NULL;
+    fit_wcs_workspace_free(solver->fitws);
+    solver->fitws = NULL;
     pl_free(solver->indexes);
     solver->indexes = NULL;
     if (solver->have_best_match) {
@@ -1694,6 +3867,9 @@ void solver_cleanup(solver_t* solver) {
     if (solver->predistort)
         sip_free(solver->predistort);
     solver->predistort = NULL;
+    free(solver->stats.index);
+    solver->stats.index = NULL;
+    solver->stats.nindexes = 0;
 }
 
 void solver_free(solver_t* solver) {
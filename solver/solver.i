@@ -18,6 +18,9 @@
 
 #include "os-features.h"
 #include "verify.h"
+#include "solver-batch.h"
+#include "index.h"
+#include "sip.h"
 %}
 
 %init %{
@@ -111,3 +114,198 @@ static PyObject* verify_star_lists_np(PyObject* pyrefxy,
  }
 
  %}
+
+%inline %{
+
+/**
+ Solves the fields in the list "pyfields", each an (x, y, flux) tuple
+ of arrays (flux may be None) or (x, y, flux, imagew, imageh), with the
+ index_t objects in the list "pyindexes" (from
+ astrometry.util.util.index_load()), on "nthreads" threads, with the
+ interpreter lock released.  Returns a list with, for each field, None
+ or a (sip_t, logodds, nmatch, index name) tuple.
+ */
+static PyObject* solve_fields_np(PyObject* pyindexes, PyObject* pyfields,
+                                 double pixscale_low, double pixscale_high,
+                                 int parity, double logodds,
+                                 int use_radec, double ra, double dec,
+                                 double radius, int depth, int tweak_order,
+                                 double timelimit, int nthreads) {
+    swig_type_info* index_type = SWIG_TypeQuery("index_t *");
+    swig_type_info* sip_type = SWIG_TypeQuery("sip_t *");
+    int req = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED |
+        NPY_ARRAY_NOTSWAPPED | NPY_ARRAY_ELEMENTSTRIDES;
+    solver_batch_params_t params;
+    solver_batch_field_t* fields = NULL;
+    solver_batch_result_t* results = NULL;
+    PyArrayObject** arrays = NULL;
+    PyObject* rtn = NULL;
+    pl* indexes = NULL;
+    Py_ssize_t i, j, NI, NF;
+    int err;
+
+    if (!index_type || !sip_type) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "astrometry.util.util must be imported first");
+        return NULL;
+    }
+    if (!PyList_Check(pyindexes) || !PyList_Check(pyfields)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Expected lists of indexes and fields");
+        return NULL;
+    }
+    NI = PyList_Size(pyindexes);
+    NF = PyList_Size(pyfields);
+
+    indexes = pl_new(MAX(NI, 1));
+    for (i=0; i<NI; i++) {
+        index_t* index = NULL;
+        if (!SWIG_IsOK(SWIG_ConvertPtr(PyList_GetItem(pyindexes, i),
+                                       (void**)&index, index_type, 0))) {
+            PyErr_SetString(PyExc_ValueError, "Expected index_t objects");
+            goto bailout;
+        }
+        pl_append(indexes, index);
+    }
+
+    fields = calloc(MAX(NF, 1), sizeof(solver_batch_field_t));
+    results = calloc(MAX(NF, 1), sizeof(solver_batch_result_t));
+    arrays = calloc(MAX(NF, 1) * 3, sizeof(PyArrayObject*));
+    for (i=0; i<NF; i++) {
+        PyObject* tup = PyList_GetItem(pyfields, i);
+        Py_ssize_t nt = PyTuple_Check(tup) ? PyTuple_Size(tup) : 0;
+        if (nt != 3 && nt != 5) {
+            PyErr_SetString(PyExc_ValueError, "Expected fields to be "
+                            "(x, y, flux) or (x, y, flux, W, H) tuples");
+            goto bailout;
+        }
+        for (j=0; j<3; j++) {
+            PyObject* obj = PyTuple_GetItem(tup, j);
+            PyArrayObject* arr;
+            if (j == 2 && obj == Py_None)
+                continue;
+            arr = (PyArrayObject*)PyArray_FromAny(obj, PyArray_DescrFromType(NPY_DOUBLE),
+                                                  1, 1, req, NULL);
+            if (!arr) {
+                PyErr_SetString(PyExc_ValueError,
+                                "Expected x, y, flux to be 1-d double arrays");
+                goto bailout;
+            }
+            arrays[i*3 + j] = arr;
+        }
+        fields[i].N = PyArray_DIM(arrays[i*3], 0);
+        if (PyArray_DIM(arrays[i*3+1], 0) != fields[i].N ||
+            (arrays[i*3+2] && PyArray_DIM(arrays[i*3+2], 0) != fields[i].N)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "Expected x, y, flux to be the same length");
+            goto bailout;
+        }
+        fields[i].x = PyArray_DATA(arrays[i*3]);
+        fields[i].y = PyArray_DATA(arrays[i*3+1]);
+        if (arrays[i*3+2])
+            fields[i].flux = PyArray_DATA(arrays[i*3+2]);
+        if (nt == 5) {
+            fields[i].imagew = (int)PyLong_AsLong(PyTuple_GetItem(tup, 3));
+            fields[i].imageh = (int)PyLong_AsLong(PyTuple_GetItem(tup, 4));
+            if (PyErr_Occurred())
+                goto bailout;
+        }
+    }
+
+    solver_batch_params_init(&params);
+    params.pixscale_low = pixscale_low;
+    params.pixscale_high = pixscale_high;
+    params.parity = parity;
+    params.logodds_solve = logodds;
+    params.use_radec = use_radec;
+    params.ra = ra;
+    params.dec = dec;
+    params.radius = radius;
+    params.depth = depth;
+    params.tweak_order = tweak_order;
+    params.timelimit = timelimit;
+
+    Py_BEGIN_ALLOW_THREADS
+    err = solver_batch_run(indexes, &params, fields, (int)NF, nthreads,
+                           results);
+    Py_END_ALLOW_THREADS
+    if (err) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to load indexes");
+        goto bailout;
+    }
+
+    rtn = PyList_New(NF);
+    for (i=0; i<NF; i++) {
+        solver_batch_result_t* r = results + i;
+        PyObject* val;
+        if (!r->solved) {
+            Py_INCREF(Py_None);
+            PyList_SetItem(rtn, i, Py_None);
+            continue;
+        }
+        // the sip_t object takes ownership of the solution.
+        val = Py_BuildValue("(Ndis)",
+                            SWIG_NewPointerObj(r->wcs, sip_type, SWIG_POINTER_OWN),
+                            r->logodds, r->nmatch,
+                            r->index ? r->index->indexname : NULL);
+        r->wcs = NULL;
+        PyList_SetItem(rtn, i, val);
+    }
+
+ bailout:
+    if (results)
+        for (i=0; i<NF; i++)
+            sip_free(results[i].wcs);
+    if (arrays)
+        for (i=0; i<NF*3; i++)
+            Py_XDECREF(arrays[i]);
+    free(arrays);
+    free(results);
+    free(fields);
+    pl_free(indexes);
+    return rtn;
+}
+
+ %}
+
+%pythoncode %{
+
+def solve_fields(indexes, fields, pixscale_low=0., pixscale_high=0.,
+                 parity=2, logodds=None, radec=None, depth=0,
+                 tweak_order=2, timelimit=0., nthreads=0):
+    '''
+    Solves many fields against one set of loaded indexes, on "nthreads"
+    threads (all CPUs if 0), releasing the GIL while they run.
+
+    *indexes*: list of index_t objects, from
+    astrometry.util.util.index_load().
+
+    *fields*: list of (x, y, flux) or (x, y, flux, imagew, imageh)
+    tuples of numpy arrays; flux may be None, in which case the stars
+    must be brightest-first.
+
+    *pixscale_low*, *pixscale_high*: arcsec/pixel (0 for any).
+
+    *parity*: 0 normal, 1 flipped, 2 both.
+
+    *logodds*: log-odds to accept a match (default log(1e9)).
+
+    *radec*: optional (ra, dec, radius) in degrees to search within.
+
+    Returns a list with None for each unsolved field, or a
+    (sip_t, logodds, nmatch, index name) tuple.
+    '''
+    import numpy as np
+    if logodds is None:
+        logodds = np.log(1e9)
+    if radec is None:
+        use_radec, ra, dec, radius = 0, 0., 0., 0.
+    else:
+        use_radec = 1
+        ra, dec, radius = radec
+    return solve_fields_np(list(indexes), list(fields),
+                           float(pixscale_low), float(pixscale_high),
+                           int(parity), float(logodds), use_radec,
+                           float(ra), float(dec), float(radius), int(depth),
+                           int(tweak_order), float(timelimit), int(nthreads))
+%}
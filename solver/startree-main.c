@@ -16,7 +16,7 @@
 #include "log.h"
 #include "fitsioutils.h"
 
-const char* OPTIONS = "hvL:d:t:bsSci:o:R:D:PTkn:";
+const char* OPTIONS = "hvL:d:t:bsSci:o:R:D:PTkn:w:VpI";
 
 void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -31,7 +31,13 @@ void printHelp(char* progname) {
            "    [-d  <data type>]:  {double,float,u32,u16}, default u32.\n"
            "    [-S]: include separate splitdim array\n"
            "    [-c]: run kdtree_check on the resulting tree\n"
+           "    [-w <threads>]: number of threads to build the tree with (default 1)\n"
+           "    [-V]: store the tree nodes in (cache-oblivious) van Emde Boas order\n"
+           "    [-p]: pack the star positions into half as many bits, relative to\n"
+           "          each leaf (integer data types only)\n"
            "    [-P]: unpermute tree + tag-along data\n"
+           "    [-I]: also store the inverse permutation (star ID to tree order),\n"
+           "          so readers needn't compute it (not needed with -P)\n"
            "    [-T]: write tag-along table as first extension HDU\n"
            "    [-k]: keep RA,Dec columns in tag-along table\n"
            "    [-n <name>]: kd-tree name (default \"stars\")\n"
@@ -59,9 +65,11 @@ int main(int argc, char *argv[]) {
     int buildopts = 0;
     anbool checktree = FALSE;
     anbool unpermute = FALSE;
+    anbool invperm = FALSE;
     anbool remove_radec = TRUE;
     u32* perm = NULL;
     anbool tagalong_first = FALSE;
+    int nthreads = 1;
     
     if (argc <= 2) {
         printHelp(progname);
@@ -82,6 +90,9 @@ int main(int argc, char *argv[]) {
         case 'P':
             unpermute = TRUE;
             break;
+        case 'I':
+            invperm = TRUE;
+            break;
         case 'R':
             racol = optarg;
             break;
@@ -115,6 +126,15 @@ int main(int argc, char *argv[]) {
         case 'S':
             buildopts |= KD_BUILD_SPLITDIM;
             break;
+        case 'V':
+            buildopts |= KD_BUILD_VEB_LAYOUT;
+            break;
+        case 'p':
+            buildopts |= KD_BUILD_PACK_DATA;
+            break;
+        case 'w':
+            nthreads = atoi(optarg);
+            break;
         case 'v':
             loglvl++;
             break;
@@ -153,7 +173,7 @@ int main(int argc, char *argv[]) {
     logmsg("Got %i stars\n", fitstable_nrows(cat));
 
     starkd = startree_build(cat, racol, deccol, datatype, treetype,
-                            buildopts, Nleaf, argv, argc);
+                            buildopts, Nleaf, nthreads, argv, argc);
     if (!starkd) {
         ERROR("Failed to create star kdtree");
         exit(-1);
@@ -166,14 +186,15 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (treename) {
-        free(starkd->tree->name);
-        starkd->tree->name = strdup(treename);
-    }
+    if (treename)
+        kdtree_set_name(starkd->tree, treename);
 
     if (unpermute) {
         perm = starkd->tree->perm;
         starkd->tree->perm = NULL;
+    } else if (invperm) {
+        logverb("Computing inverse permutation...\n");
+        startree_compute_inverse_perm(starkd);
     }
 
     if (tagalong_first) {
@@ -184,7 +205,7 @@ int main(int argc, char *argv[]) {
             exit(-1);
         }
         if (startree_write_tagalong_table(cat, tag, racol, deccol,
-                                          (int*)perm, remove_radec)) {
+                                          (int*)perm, remove_radec, nthreads)) {
             ERROR("Failed to write tag-along table");
             exit(-1);
         }
@@ -227,7 +248,7 @@ int main(int argc, char *argv[]) {
         tag = fitstable_open_for_appending(skdtfn);
 
         if (startree_write_tagalong_table(cat, tag, racol, deccol,
-                                          (int*)perm, remove_radec)) {
+                                          (int*)perm, remove_radec, nthreads)) {
             ERROR("Failed to write tag-along table");
             exit(-1);
         }
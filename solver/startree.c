@@ -3,6 +3,7 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 #include <assert.h>
+#include <pthread.h>
 #include "startree.h"
 #include "kdtree.h"
 #include "errors.h"
@@ -12,6 +13,59 @@
 #include "fitsioutils.h"
 #include "boilerplate.h"
 #include "fitstable.h"
+#include "os-features.h"
+
+// RA,Decs are converted to xyz on several threads, in blocks of this many.
+#define XYZ_BLOCK 65536
+// Un-permuted tag-along rows are copied in batches of about this many bytes.
+#define TAGALONG_BATCH_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    double* ra;
+    double* dec;
+    double* xyz;
+    int N;
+    int nblocks;
+    int next;
+} xyz_job_t;
+
+static void* xyz_worker(void* arg) {
+    xyz_job_t* j = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->nblocks) {
+        int i0 = b * XYZ_BLOCK;
+        int n = MIN(XYZ_BLOCK, j->N - i0);
+        // (the vectorized conversion: within a few ulp of radecdeg2xyzarr.)
+        radecdeg2xyz_batch_approx(j->ra + i0, j->dec + i0,
+                                  j->xyz + (size_t)i0 * 3, n);
+    }
+    return NULL;
+}
+
+static void radecdeg2xyz_parallel(double* ra, double* dec,
+                                  double* xyz, int N, int nthreads) {
+    xyz_job_t j;
+    pthread_t* threads;
+    int t, nstarted = 0;
+
+    j.ra = ra;
+    j.dec = dec;
+    j.xyz = xyz;
+    j.N = N;
+    j.nblocks = (N + XYZ_BLOCK - 1) / XYZ_BLOCK;
+    j.next = 0;
+    nthreads = MAX(1, MIN(nthreads, j.nblocks));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, xyz_worker, &j))
+            break;
+        nstarted++;
+    }
+    xyz_worker(&j);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
 
 anbool startree_has_tagalong_data(const fitstable_t* intab) {
     // don't include RA,Dec.
@@ -21,7 +75,8 @@ anbool startree_has_tagalong_data(const fitstable_t* intab) {
 int startree_write_tagalong_table(fitstable_t* intab, fitstable_t* outtab,
                                   const char* racol, const char* deccol,
                                   int* indices,
-                                  anbool remove_radec_columns) {
+                                  anbool remove_radec_columns,
+                                  int nthreads) {
     int i, R, NB, N;
     qfits_header* hdr;
 
@@ -49,29 +104,13 @@ int startree_write_tagalong_table(fitstable_t* intab, fitstable_t* outtab,
 
     if (indices) {
         if (!remove_radec_columns) {
-            // row-by-row raw data copy; read whole tag-along array into memory
-            char* data = malloc((size_t)N * (size_t)R);
-            // FIXME -- could read row-by-row if the malloc fails.....
-            if (!data) {
-                ERROR("Failed to allocate enough memory to read full tag-along table");
-                return -1;
-            }
-            printf("Reading tag-along table...\n");
-            if (fitstable_read_nrows_data(intab, 0, N, data)) {
-                ERROR("Failed to read tag-along table");
-                free(data);
+            // raw row data copy, gathered in parallel.
+            logmsg("Writing tag-along table...\n");
+            if (fitstable_copy_rows_data_parallel(intab, indices, N, outtab,
+                                                  nthreads)) {
+                ERROR("Failed to copy tag-along table rows from input to output");
                 return -1;
             }
-            printf("Writing tag-along table...\n");
-            for (i=0; i<N; i++) {
-                if (fitstable_write_row_data(outtab, data + (size_t)indices[i]*(size_t)R)) {
-                    ERROR("Failed to write a row of data");
-                    free(data);
-                    return -1;
-                }
-            }
-            free(data);
-            
         } else {
             if (fitstable_copy_rows_data(intab, indices, N, outtab)) {
                 ERROR("Failed to copy tag-along table rows from input to output");
@@ -81,20 +120,23 @@ int startree_write_tagalong_table(fitstable_t* intab, fitstable_t* outtab,
     } else {
         char* buf;
         
-        NB = 1000;
+        NB = MAX(1, TAGALONG_BATCH_BYTES / MAX(1, R));
         logverb("Input row size: %i, output row size: %i\n", R, fitstable_row_size(outtab));
-        buf = malloc(NB * R);
-	
+        buf = malloc((size_t)MIN(NB, MAX(N, 1)) * (size_t)R);
+        if (!buf) {
+            SYSERROR("Failed to allocate tag-along copy buffer");
+            return -1;
+        }
         for (i=0; i<N; i+=NB) {
-            int nr = NB;
-            if (i+NB > N)
-                nr = N - i;
+            int nr = MIN(NB, N - i);
             if (fitstable_read_structs(intab, buf, R, i, nr)) {
                 ERROR("Failed to read tag-along data from catalog");
+                free(buf);
                 return -1;
             }
             if (fitstable_write_structs(outtab, buf, R, nr)) {
                 ERROR("Failed to write tag-along data");
+                free(buf);
                 return -1;
             }
         }
@@ -116,6 +158,7 @@ startree_t* startree_build(fitstable_t* intable,
                            // KD_BUILD_*
                            int buildopts,
                            int Nleaf,
+                           int nthreads,
                            char** args, int argc) {
     double* ra = NULL;
     double* dec = NULL;
@@ -138,8 +181,8 @@ startree_t* startree_build(fitstable_t* intable,
         datatype = KDT_DATA_U32;
     if (!treetype)
         treetype = KDT_TREE_U32;
-    if (!buildopts)
-        buildopts = KD_BUILD_SPLIT;
+    if (!(buildopts & (KD_BUILD_BBOX | KD_BUILD_SPLIT)))
+        buildopts |= KD_BUILD_SPLIT;
     if (!Nleaf)
         Nleaf = 25;
 
@@ -160,7 +203,7 @@ startree_t* startree_build(fitstable_t* intable,
         SYSERROR("Failed to malloc xyz array to build startree");
         goto bailout;
     }
-    radecdeg2xyzarrmany(ra, dec, xyz, N);
+    radecdeg2xyz_parallel(ra, dec, xyz, N, nthreads);
     free(ra);
     ra = NULL;
     free(dec);
@@ -181,6 +224,7 @@ startree_t* startree_build(fitstable_t* intable,
         high[d] = 1.0;
     }
     kdtree_set_limits(starkd->tree, low, high);
+    kdtree_set_build_threads(starkd->tree, nthreads);
     logverb("Building star kdtree...\n");
     starkd->tree = kdtree_build(starkd->tree, xyz, N, 3, Nleaf, tt, buildopts);
     if (!starkd->tree) {
@@ -190,7 +234,7 @@ startree_t* startree_build(fitstable_t* intable,
         free(xyz);
         goto bailout;
     }
-    starkd->tree->name = strdup(STARTREE_NAME);
+    kdtree_set_name(starkd->tree, STARTREE_NAME);
 
     printf("After kdtree_build:\n");
     kdtree_print(starkd->tree);
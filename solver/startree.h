@@ -21,13 +21,22 @@ startree_t* startree_build(fitstable_t* intable,
 						   // KD_BUILD_*
 						   int buildopts,
 						   int Nleaf,
+						   // threads for converting RA,Dec and building the
+						   // tree (0 or 1: none)
+						   int nthreads,
 						   char** args, int argc);
 
 anbool startree_has_tagalong_data(const fitstable_t* intab);
 
+/*
+ Copies the tag-along columns of "intable" to "outtable", in the order of
+ "indices" (if non-NULL).  A permuted copy that keeps every column is
+ gathered on "nthreads" threads.
+ */
 int startree_write_tagalong_table(fitstable_t* intable, fitstable_t* outtable,
                                   const char* racol, const char* deccol,
                                   int* indices,
-                                  anbool remove_radec_columns);
+                                  anbool remove_radec_columns,
+                                  int nthreads);
 
 #endif
@@ -0,0 +1,260 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "code-matcher.h"
+#include "codekd.h"
+#include "an-alloc.h"
+#include "index.h"
+#include "ioutils.h"
+#include "starutil.h"
+#include "mathutil.h"
+
+static int compare_u32(const void* v1, const void* v2) {
+    u32 a = *(const u32*)v1, b = *(const u32*)v2;
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+void test_grid_matches_kdtree(CuTest* tc) {
+    int N = 5000, D = 4, NQ = 50;
+    double* data = malloc(N * D * sizeof(double));
+    double queries[50 * 4];
+    double tol2s[50];
+    kdtree_qres_t* kres[50];
+    kdtree_qres_t* gres[50];
+    code_matcher_t* km;
+    code_matcher_t* gm;
+    codetree_t ct;
+    index_t index;
+    int i, q, ntotal = 0;
+
+    srand(42);
+    for (i=0; i<N*D; i++)
+        data[i] = rand() / (double)RAND_MAX;
+    for (q=0; q<NQ; q++) {
+        // half of the queries right on an index code.
+        for (i=0; i<D; i++)
+            queries[q*D + i] = (q % 2) ? data[(q*97 % N)*D + i] :
+                rand() / (double)RAND_MAX;
+        tol2s[q] = (q % 3) ? 0.01 : 0.0004;
+    }
+    memset(&ct, 0, sizeof(codetree_t));
+    ct.tree = kdtree_build(NULL, data, N, D, 8, KDTT_DOUBLE,
+                           KD_BUILD_BBOX | KD_BUILD_SPLIT);
+    memset(&index, 0, sizeof(index_t));
+    index.codekd = &ct;
+    index.indexname = "test";
+
+    km = code_matcher_new("kdtree");
+    gm = code_matcher_new("grid");
+    CuAssertPtrNotNull(tc, km);
+    CuAssertPtrNotNull(tc, gm);
+    CuAssertPtrEquals(tc, NULL, code_matcher_new("no-such-matcher"));
+    memset(kres, 0, sizeof(kres));
+    memset(gres, 0, sizeof(gres));
+    CuAssertIntEquals(tc, 0, code_matcher_search(km, &index, queries, NQ,
+                                                 tol2s, kres));
+    // twice, to check that the grid and results are reused.
+    CuAssertIntEquals(tc, 0, code_matcher_search(gm, &index, queries, NQ,
+                                                 tol2s, gres));
+    CuAssertIntEquals(tc, 0, code_matcher_search(gm, &index, queries, NQ,
+                                                 tol2s, gres));
+    for (q=0; q<NQ; q++) {
+        CuAssertIntEquals(tc, kres[q]->nres, gres[q]->nres);
+        qsort(kres[q]->inds, kres[q]->nres, sizeof(u32), compare_u32);
+        qsort(gres[q]->inds, gres[q]->nres, sizeof(u32), compare_u32);
+        for (i=0; i<kres[q]->nres; i++)
+            CuAssertIntEquals(tc, kres[q]->inds[i], gres[q]->inds[i]);
+        ntotal += gres[q]->nres;
+        kdtree_free_query(kres[q]);
+        kdtree_free_query(gres[q]);
+    }
+    CuAssertTrue(tc, ntotal > NQ);
+
+    code_matcher_free(km);
+    code_matcher_free(gm);
+    kdtree_free(ct.tree);
+    free(data);
+}
+
+void test_scale_bins(CuTest* tc) {
+    int N = 4000, D = 4, NQ = 20, NB = 4;
+    double* data = malloc(N * D * sizeof(double));
+    double* ablen = malloc(N * sizeof(double));
+    double lo[4] = { 0, 0, 0, 0 }, hi[4] = { 1, 1, 1, 1 };
+    char* fn = create_temp_file("test_scale_bins", NULL);
+    kdtree_qres_t* res = NULL;
+    codetree_t* ct;
+    FILE* fid;
+    int i, j, q, b0, b1, nbin = 0;
+
+    srand(43);
+    for (i=0; i<N*D; i++)
+        data[i] = rand() / (double)RAND_MAX;
+    for (i=0; i<N; i++)
+        ablen[i] = 0.01 + 0.01 * rand() / (double)RAND_MAX;
+    // a u16 tree, like build-astrometry-index's.
+    ct = codetree_new();
+    ct->tree = kdtree_new(N, D, 8);
+    kdtree_set_limits(ct->tree, lo, hi);
+    ct->tree = kdtree_build(ct->tree, data, N, D, 8, KDTT_DUU, KD_BUILD_SPLIT);
+    kdtree_set_name(ct->tree, CODETREE_NAME);
+    // quads are numbered in the tree's order (as unpermute-quads does)
+    an_alloc_free(AN_ALLOC_LIBKD, ct->tree->perm);
+    ct->tree->perm = NULL;
+    CuAssertIntEquals(tc, 0, codetree_write_to_file(ct, fn));
+    // (not "ab": the writer seeks back to fix up headers)
+    fid = fopen(fn, "r+b");
+    fseeko(fid, 0, SEEK_END);
+    CuAssertIntEquals(tc, 0, codetree_append_scale_bins_to(ct, ablen, NB, fid));
+    CuAssertIntEquals(tc, 0, fclose(fid));
+    codetree_close(ct);
+
+    ct = codetree_open(fn);
+    CuAssertPtrNotNull(tc, ct);
+    CuAssertIntEquals(tc, NB, ct->nscalebins);
+    for (j=0; j<NB; j++) {
+        nbin += ct->scalebins[j]->ndata;
+        CuAssertTrue(tc, ct->scalebin_lo[j] <= ct->scalebin_hi[j]);
+        if (j)
+            CuAssertTrue(tc, ct->scalebin_hi[j-1] <= ct->scalebin_lo[j]);
+        for (i=0; i<ct->scalebins[j]->ndata; i++) {
+            double ab = ablen[kdtree_permute(ct->scalebins[j], i)];
+            CuAssertTrue(tc, ab >= ct->scalebin_lo[j]);
+            CuAssertTrue(tc, ab <= ct->scalebin_hi[j]);
+        }
+    }
+    CuAssertIntEquals(tc, N, nbin);
+    CuAssertIntEquals(tc, NB, codetree_scale_bins_between(ct, 0, 1, &b0, &b1));
+    CuAssertIntEquals(tc, 0, codetree_scale_bins_between(ct, 1, 2, &b0, &b1));
+
+    // the bins in range find the same quads in range as the full tree.
+    for (q=0; q<NQ; q++) {
+        double code[4];
+        double ablo = 0.01 + 0.0004 * q;
+        double abhi = ablo + 0.001;
+        double tol2 = 0.01;
+        char* found = calloc(N, 1);
+        int nfull = 0, nbins = 0;
+        for (i=0; i<D; i++)
+            code[i] = rand() / (double)RAND_MAX;
+        res = kdtree_rangesearch_options_reuse(ct->tree, res, code, tol2,
+                                               KD_OPTIONS_NO_RESIZE_RESULTS);
+        for (i=0; i<res->nres; i++) {
+            double ab = ablen[res->inds[i]];
+            found[res->inds[i]] = 1;
+            if (ab >= ablo && ab <= abhi)
+                nfull++;
+        }
+        CuAssertTrue(tc, codetree_scale_bins_between(ct, ablo, abhi,
+                                                     &b0, &b1) > 0);
+        for (j=b0; j<=b1; j++) {
+            res = kdtree_rangesearch_options_reuse(ct->scalebins[j], res, code,
+                                                   tol2,
+                                                   KD_OPTIONS_NO_RESIZE_RESULTS);
+            for (i=0; i<res->nres; i++) {
+                double ab = ablen[res->inds[i]];
+                CuAssertIntEquals(tc, 1, found[res->inds[i]]);
+                if (ab >= ablo && ab <= abhi)
+                    nbins++;
+            }
+        }
+        CuAssertIntEquals(tc, nfull, nbins);
+        free(found);
+    }
+    kdtree_free_query(res);
+    codetree_close(ct);
+    unlink(fn);
+    free(fn);
+    free(ablen);
+    free(data);
+}
+
+void test_sky_bins(CuTest* tc) {
+    int N = 3000, D = 4, NQ = 20, nside = 2;
+    double* data = malloc(N * D * sizeof(double));
+    double* abmid = malloc(N * 3 * sizeof(double));
+    double lo[4] = { 0, 0, 0, 0 }, hi[4] = { 1, 1, 1, 1 };
+    char* fn = create_temp_file("test_sky_bins", NULL);
+    kdtree_qres_t* res = NULL;
+    anbool* near;
+    codetree_t* ct;
+    FILE* fid;
+    int i, j, q, nbin = 0;
+
+    srand(44);
+    for (i=0; i<N*D; i++)
+        data[i] = rand() / (double)RAND_MAX;
+    for (i=0; i<N; i++)
+        radecdeg2xyzarr(360.0 * rand() / (double)RAND_MAX,
+                        asin(2.0 * rand() / (double)RAND_MAX - 1.0) * 180/M_PI,
+                        abmid + 3*i);
+    ct = codetree_new();
+    ct->tree = kdtree_new(N, D, 8);
+    kdtree_set_limits(ct->tree, lo, hi);
+    ct->tree = kdtree_build(ct->tree, data, N, D, 8, KDTT_DUU, KD_BUILD_SPLIT);
+    kdtree_set_name(ct->tree, CODETREE_NAME);
+    an_alloc_free(AN_ALLOC_LIBKD, ct->tree->perm);
+    ct->tree->perm = NULL;
+    CuAssertIntEquals(tc, 0, codetree_write_to_file(ct, fn));
+    fid = fopen(fn, "r+b");
+    fseeko(fid, 0, SEEK_END);
+    CuAssertIntEquals(tc, 0, codetree_append_sky_bins_to(ct, abmid, nside, fid));
+    CuAssertIntEquals(tc, 0, fclose(fid));
+    codetree_close(ct);
+
+    ct = codetree_open(fn);
+    CuAssertPtrNotNull(tc, ct);
+    CuAssertIntEquals(tc, 12 * nside * nside, ct->nskybins);
+    for (j=0; j<ct->nskybins; j++) {
+        nbin += ct->skybins[j]->ndata;
+        for (i=0; i<ct->skybins[j]->ndata; i++) {
+            int qi = kdtree_permute(ct->skybins[j], i);
+            CuAssertTrue(tc, distsq(abmid + 3*qi, ct->skybin_xyz + 3*j, 3)
+                         <= ct->skybin_r2[j] * (1 + 1e-12));
+        }
+    }
+    CuAssertIntEquals(tc, N, nbin);
+    near = malloc(ct->nskybins * sizeof(anbool));
+
+    // the near bins find all the quads in the cap that the full tree does.
+    for (q=0; q<NQ; q++) {
+        double code[4], xyz[3];
+        double r2 = deg2distsq(10.0 + q);
+        double tol2 = 0.02;
+        int nfull = 0, nbins = 0;
+        for (i=0; i<D; i++)
+            code[i] = rand() / (double)RAND_MAX;
+        memcpy(xyz, abmid + 3*(q * 101 % N), sizeof(xyz));
+        res = kdtree_rangesearch_options_reuse(ct->tree, res, code, tol2,
+                                               KD_OPTIONS_NO_RESIZE_RESULTS);
+        for (i=0; i<res->nres; i++)
+            if (distsq(abmid + 3*res->inds[i], xyz, 3) <= r2)
+                nfull++;
+        CuAssertTrue(tc, codetree_sky_bins_near(ct, xyz, r2, near) > 0);
+        for (j=0; j<ct->nskybins; j++) {
+            if (!near[j])
+                continue;
+            res = kdtree_rangesearch_options_reuse(ct->skybins[j], res, code,
+                                                   tol2,
+                                                   KD_OPTIONS_NO_RESIZE_RESULTS);
+            for (i=0; i<res->nres; i++)
+                if (distsq(abmid + 3*res->inds[i], xyz, 3) <= r2)
+                    nbins++;
+        }
+        CuAssertIntEquals(tc, nfull, nbins);
+    }
+    kdtree_free_query(res);
+    free(near);
+    codetree_close(ct);
+    unlink(fn);
+    free(fn);
+    free(abmid);
+    free(data);
+}
@@ -0,0 +1,68 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "engine-mosaic.h"
+#include "sip.h"
+#include "starutil.h"
+#include "mathutil.h"
+
+// The focal-plane position of pixel (px,py) of "chip".
+static void to_focal(const mosaic_chip_t* chip, double px, double py,
+                     double* fx, double* fy) {
+    double r = deg2rad(chip->rotation);
+    *fx = chip->x + cos(r) * px - sin(r) * py;
+    *fy = chip->y + sin(r) * px + cos(r) * py;
+}
+
+static void to_chip(const mosaic_chip_t* chip, double fx, double fy,
+                    double* px, double* py) {
+    double r = deg2rad(chip->rotation);
+    fx -= chip->x;
+    fy -= chip->y;
+    *px =  cos(r) * fx + sin(r) * fy;
+    *py = -sin(r) * fx + cos(r) * fy;
+}
+
+void test_mosaic_predict_tan(CuTest* tc) {
+    mosaic_chip_t from = { 100.0, -50.0, 30.0 };
+    mosaic_chip_t to = { 2100.0, 300.0, -60.0 };
+    tan_t wcs, pred, back;
+    double pix[] = { 1.0, 1.0,  1024.0, 1.0,  512.0, 700.0,  1.0, 2048.0 };
+    int i;
+
+    memset(&wcs, 0, sizeof(tan_t));
+    wcs.crval[0] = 150.0;
+    wcs.crval[1] = -20.0;
+    wcs.crpix[0] = 512.5;
+    wcs.crpix[1] = 1024.5;
+    wcs.cd[0][0] = -7e-5;
+    wcs.cd[0][1] = 1e-5;
+    wcs.cd[1][0] = 1.2e-5;
+    wcs.cd[1][1] = 7e-5;
+    wcs.imagew = 1024;
+    wcs.imageh = 2048;
+
+    mosaic_predict_tan(&wcs, &from, &to, &pred);
+    for (i=0; i<4; i++) {
+        double fx, fy, px, py;
+        double xyz1[3], xyz2[3];
+        to_focal(&to, pix[2*i], pix[2*i+1], &fx, &fy);
+        to_chip(&from, fx, fy, &px, &py);
+        tan_pixelxy2xyzarr(&wcs, px, py, xyz1);
+        tan_pixelxy2xyzarr(&pred, pix[2*i], pix[2*i+1], xyz2);
+        CuAssertDblEquals(tc, 0.0, distsq2deg(distsq(xyz1, xyz2, 3)), 1e-9);
+    }
+
+    // and back again.
+    mosaic_predict_tan(&pred, &to, &from, &back);
+    CuAssertDblEquals(tc, wcs.crpix[0], back.crpix[0], 1e-8);
+    CuAssertDblEquals(tc, wcs.crpix[1], back.crpix[1], 1e-8);
+    CuAssertDblEquals(tc, wcs.cd[0][1], back.cd[0][1], 1e-15);
+    CuAssertDblEquals(tc, wcs.cd[1][0], back.cd[1][0], 1e-15);
+}
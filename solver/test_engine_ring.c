@@ -0,0 +1,102 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "engine-ring.h"
+
+static char* ring_name(char* buf, size_t len) {
+    snprintf(buf, len, "/an-test-ring-%i", (int)getpid());
+    return buf;
+}
+
+void test_frame_ring_order(CuTest* tc) {
+    char name[64];
+    frame_ring_t* r;
+    frame_ring_t* client;
+    frame_ring_slot_t* s[3];
+    frame_ring_slot_t* next;
+    int i;
+
+    r = frame_ring_create(ring_name(name, sizeof(name)), 3, 10000);
+    CuAssertPtrNotNull(tc, r);
+    CuAssertIntEquals(tc, 3, frame_ring_nslots(r));
+    CuAssertTrue(tc, frame_ring_max_payload(r) >= 10000);
+    client = frame_ring_open(name);
+    CuAssertPtrNotNull(tc, client);
+    CuAssertIntEquals(tc, 3, frame_ring_nslots(client));
+
+    for (i=0; i<3; i++) {
+        s[i] = frame_ring_acquire(client, 0);
+        CuAssertPtrNotNull(tc, s[i]);
+        CuAssertIntEquals(tc, FRAME_RING_FILLING, s[i]->state);
+        s[i]->seq = 100 + i;
+    }
+    // full.
+    CuAssertPtrEquals(tc, NULL, frame_ring_acquire(client, 0.01));
+    // nothing submitted yet.
+    CuAssertPtrEquals(tc, NULL, frame_ring_next(r, 0.01));
+
+    // taken in the order submitted, whatever the slots.
+    frame_ring_submit(client, s[2]);
+    frame_ring_submit(client, s[0]);
+    next = frame_ring_next(r, 0);
+    CuAssertPtrNotNull(tc, next);
+    CuAssertIntEquals(tc, 102, (int)next->seq);
+    CuAssertIntEquals(tc, FRAME_RING_BUSY, s[2]->state);
+    // not done yet.
+    CuAssertIntEquals(tc, -1, frame_ring_wait(client, s[2], 0.01));
+    next->status = FRAME_RING_UNSOLVED;
+    frame_ring_finish(r, next);
+    CuAssertIntEquals(tc, 0, frame_ring_wait(client, s[2], 0));
+    CuAssertIntEquals(tc, FRAME_RING_UNSOLVED, s[2]->status);
+
+    next = frame_ring_next(r, 0);
+    CuAssertPtrNotNull(tc, next);
+    CuAssertIntEquals(tc, 100, (int)next->seq);
+    frame_ring_finish(r, next);
+    // (s[1] is still being filled)
+    CuAssertPtrEquals(tc, NULL, frame_ring_next(r, 0.01));
+
+    frame_ring_release(client, s[2]);
+    next = frame_ring_acquire(client, 0);
+    CuAssertPtrEquals(tc, s[2], next);
+    CuAssertIntEquals(tc, 0, (int)next->seq);
+
+    frame_ring_close(client);
+    frame_ring_close(r);
+    CuAssertPtrEquals(tc, NULL, frame_ring_open(name));
+}
+
+void test_frame_ring_bad_frame(CuTest* tc) {
+    char name[64];
+    frame_ring_t* r;
+    engine_ring_t* er;
+    frame_ring_slot_t* s;
+
+    r = frame_ring_create(ring_name(name, sizeof(name)), 1, 1000);
+    CuAssertPtrNotNull(tc, r);
+    er = engine_ring_new(NULL, r);
+
+    s = frame_ring_acquire(r, 0);
+    s->kind = FRAME_RING_FLOAT;
+    s->width = 100;
+    s->height = 100;
+    // too big for the slot.
+    CuAssertIntEquals(tc, -1, engine_ring_solve(er, s));
+    CuAssertIntEquals(tc, FRAME_RING_ERROR, s->status);
+
+    s->kind = 42;
+    s->width = 10;
+    s->height = 10;
+    CuAssertIntEquals(tc, -1, engine_ring_solve(er, s));
+    CuAssertIntEquals(tc, FRAME_RING_ERROR, s->status);
+
+    engine_ring_free(er);
+    frame_ring_close(r);
+}
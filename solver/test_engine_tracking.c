@@ -0,0 +1,59 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "engine-tracking.h"
+#include "starxy.h"
+#include "starutil.h"
+
+void test_frame_align(CuTest* tc) {
+    int N = 100;
+    double rot = deg2rad(0.7);
+    double dx = 23.4, dy = -11.8;
+    starxy_t* prev = starxy_new(N, FALSE, FALSE);
+    starxy_t* cur = starxy_new(N + 5, FALSE, FALSE);
+    frame_align_t align;
+    int i;
+
+    srand(42);
+    for (i=0; i<N; i++)
+        starxy_set(prev, i, 1000.0 * rand() / RAND_MAX,
+                   800.0 * rand() / RAND_MAX);
+    // the current frame: prev's sources (a few of them missing) moved by
+    // the inverse of the alignment, with a few new ones mixed in.
+    for (i=0; i<N+5; i++) {
+        double x, y;
+        if (i % 20 == 0) {
+            x = 1000.0 * rand() / RAND_MAX;
+            y = 800.0 * rand() / RAND_MAX;
+        } else {
+            double px = starxy_getx(prev, i % N) - dx;
+            double py = starxy_gety(prev, i % N) - dy;
+            x =  cos(rot) * px + sin(rot) * py;
+            y = -sin(rot) * px + cos(rot) * py;
+        }
+        starxy_set(cur, i, x, y);
+    }
+
+    CuAssertIntEquals(tc, 0, frame_align(prev, cur, 3.0, &align));
+    CuAssertTrue(tc, align.nmatch >= N - 10);
+    CuAssertDblEquals(tc, 0.0, align.rms, 1e-6);
+    CuAssertDblEquals(tc, cos(rot), align.A[0][0], 1e-9);
+    CuAssertDblEquals(tc, -sin(rot), align.A[0][1], 1e-9);
+    CuAssertDblEquals(tc, sin(rot), align.A[1][0], 1e-9);
+    CuAssertDblEquals(tc, dx, align.t[0], 1e-6);
+    CuAssertDblEquals(tc, dy, align.t[1], 1e-6);
+
+    // unrelated frames don't align.
+    for (i=0; i<N+5; i++)
+        starxy_set(cur, i, 0.5 * i, 3000.0 + 40.0 * i);
+    CuAssertIntEquals(tc, -1, frame_align(prev, cur, 3.0, &align));
+
+    starxy_free(prev);
+    starxy_free(cur);
+}
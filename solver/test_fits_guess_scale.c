@@ -0,0 +1,129 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "fits-guess-scale.h"
+#include "ioutils.h"
+#include "starutil.h"
+
+static int put(unsigned char* p, unsigned int v, int nbytes, anbool be) {
+    int i;
+    for (i=0; i<nbytes; i++)
+        p[i] = be ? (v >> (8*(nbytes-1-i))) : (v >> (8*i));
+    return nbytes;
+}
+
+static int put_entry(unsigned char* p, int tag, int type, unsigned int v,
+                     anbool be) {
+    put(p, tag, 2, be);
+    put(p + 2, type, 2, be);
+    put(p + 4, 1, 4, be);
+    if (type == 3) {
+        memset(p + 8, 0, 4);
+        put(p + 8, v, 2, be);
+    } else
+        put(p + 8, v, 4, be);
+    return 12;
+}
+
+// A JPEG header with a 50 mm lens, 5 micron pixels, 4000 x 3000.
+static char* write_jpeg(anbool be) {
+    unsigned char buf[256];
+    unsigned char* t;
+    int n = 0, len;
+    char* fn = create_temp_file("exif", NULL);
+    FILE* f;
+
+    buf[n++] = 0xFF; buf[n++] = 0xD8;
+    buf[n++] = 0xFF; buf[n++] = 0xE1;
+    // (length, filled in below)
+    n += 2;
+    memcpy(buf + n, "Exif\0\0", 6);
+    n += 6;
+    t = buf + n;
+    memcpy(t, be ? "MM\0*" : "II*\0", 4);
+    put(t + 4, 8, 4, be);
+    // IFD0: just the pointer to the EXIF IFD at 26.
+    put(t + 8, 1, 2, be);
+    put_entry(t + 10, 0x8769, 4, 26, be);
+    put(t + 22, 0, 4, be);
+    // EXIF IFD: 6 entries; rationals at 104 and 112.
+    put(t + 26, 6, 2, be);
+    put_entry(t + 28, 0x920A, 5, 104, be);
+    put_entry(t + 40, 0xA20E, 5, 112, be);
+    // (per cm)
+    put_entry(t + 52, 0xA210, 3, 3, be);
+    put_entry(t + 64, 0xA405, 3, 50, be);
+    put_entry(t + 76, 0xA002, 4, 4000, be);
+    put_entry(t + 88, 0xA003, 4, 3000, be);
+    put(t + 100, 0, 4, be);
+    put(t + 104, 500, 4, be);
+    put(t + 108, 10, 4, be);
+    put(t + 112, 20000, 4, be);
+    put(t + 116, 10, 4, be);
+    n += 120;
+    len = n - 4;
+    buf[4] = len >> 8;
+    buf[5] = len & 0xff;
+    // SOF0
+    buf[n++] = 0xFF; buf[n++] = 0xC0;
+    buf[n++] = 0; buf[n++] = 11;
+    buf[n++] = 8;
+    buf[n++] = 3000 >> 8; buf[n++] = 3000 & 0xff;
+    buf[n++] = 4000 >> 8; buf[n++] = 4000 & 0xff;
+    buf[n++] = 1;
+    buf[n++] = 1; buf[n++] = 0x11; buf[n++] = 0;
+    buf[n++] = 0xFF; buf[n++] = 0xDA;
+
+    f = fopen(fn, "wb");
+    fwrite(buf, 1, n, f);
+    fclose(f);
+    return fn;
+}
+
+void test_exif_guess_scale(CuTest* tc) {
+    int k;
+    for (k=0; k<2; k++) {
+        char* fn = write_jpeg(k);
+        sl* methods = NULL;
+        dl* scales = NULL;
+        double fp = rad2arcsec(0.005 / 50.);
+        double f35 = rad2arcsec(43.26661 / 5000. / 50.);
+
+        CuAssertIntEquals(tc, 2, exif_guess_scale(fn, 0, &methods, &scales));
+        CuAssertStrEquals(tc, "exif-focalplane", sl_get(methods, 0));
+        CuAssertDblEquals(tc, fp, dl_get(scales, 0), 1e-6);
+        CuAssertStrEquals(tc, "exif-35mm", sl_get(methods, 1));
+        CuAssertDblEquals(tc, f35, dl_get(scales, 1), 1e-4);
+
+        // the same image, downsampled by 2.
+        dl_remove_all(scales);
+        CuAssertIntEquals(tc, 2, exif_guess_scale(fn, 2000, NULL, &scales));
+        CuAssertDblEquals(tc, 2. * fp, dl_get(scales, 0), 1e-6);
+        CuAssertDblEquals(tc, 2. * f35, dl_get(scales, 1), 1e-4);
+
+        sl_free2(methods);
+        dl_free(scales);
+        unlink(fn);
+        free(fn);
+    }
+}
+
+void test_exif_guess_scale_not_jpeg(CuTest* tc) {
+    char* fn = create_temp_file("exif", NULL);
+    dl* scales = NULL;
+    FILE* f = fopen(fn, "wb");
+    fprintf(f, "SIMPLE  =                    T\n");
+    fclose(f);
+    CuAssertIntEquals(tc, 0, exif_guess_scale(fn, 0, NULL, &scales));
+    CuAssertIntEquals(tc, 0, dl_size(scales));
+    dl_free(scales);
+    unlink(fn);
+    free(fn);
+}
@@ -0,0 +1,62 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cutest.h"
+#include "build-index.h"
+#include "index.h"
+#include "starkd.h"
+#include "quadfile.h"
+#include "starutil.h"
+#include "log.h"
+
+void test_index_strata(CuTest* ct) {
+    index_params_t p;
+    index_t* old;
+    index_t* s1 = NULL;
+    index_t* s2 = NULL;
+    unsigned int stars[DQMAX];
+    int i, d;
+
+    log_init(LOG_MSG);
+    old = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(ct, old);
+    CuAssertIntEquals(ct, 0, old->stratum);
+    build_index_defaults(&p);
+
+    CuAssertIntEquals(ct, 0, build_index_stratum(old, 0, 128, 1, 2, &p, &s1, NULL));
+    CuAssertIntEquals(ct, 0, build_index_stratum(old, 128, 256, 2, 2, &p, &s2, NULL));
+    CuAssertPtrNotNull(ct, s1);
+    CuAssertPtrNotNull(ct, s2);
+    CuAssertIntEquals(ct, 1, s1->stratum);
+    CuAssertIntEquals(ct, 2, s2->stratum);
+    CuAssertIntEquals(ct, 2, s1->nstrata);
+    CuAssertIntEquals(ct, old->indexid, s1->indexid);
+    CuAssertDblEquals(ct, old->index_scale_lower, s1->index_scale_lower, 1e-6);
+    CuAssertDblEquals(ct, old->index_scale_upper, s2->index_scale_upper, 1e-6);
+
+    // the brighter half of the stars; all of them.
+    CuAssertTrue(ct, startree_N(s1->starkd) < startree_N(old->starkd));
+    CuAssertTrue(ct, startree_N(s1->starkd) > 0);
+    CuAssertIntEquals(ct, startree_N(old->starkd), startree_N(s2->starkd));
+    // each quad is in one stratum.
+    CuAssertTrue(ct, quadfile_nquads(s1->quads) > 0);
+    CuAssertIntEquals(ct, quadfile_nquads(old->quads),
+                      quadfile_nquads(s1->quads) + quadfile_nquads(s2->quads));
+    for (i=0; i<quadfile_nquads(s1->quads); i++) {
+        CuAssertIntEquals(ct, 0, quadfile_get_stars(s1->quads, i, stars));
+        for (d=0; d<s1->dimquads; d++)
+            CuAssertTrue(ct, stars[d] < (unsigned int)startree_N(s1->starkd));
+    }
+    CuAssertPtrNotNull(ct, s1->starkd->sweep);
+
+    // a stratum that has no quads.
+    CuAssertIntEquals(ct, -1, build_index_stratum(old, 255, 256, 3, 3, &p, NULL, "/dev/null"));
+
+    index_free(s1);
+    index_free(s2);
+    index_free(old);
+}
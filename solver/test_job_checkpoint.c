@@ -0,0 +1,72 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "job-checkpoint.h"
+#include "sip.h"
+#include "ioutils.h"
+
+void test_job_checkpoint(CuTest* tc) {
+    char* fn = create_temp_file("ckpt", NULL);
+    job_checkpoint_t* ck;
+    checkpoint_run_t* run;
+    uint64_t k1, k2;
+    tan_t wcs;
+    int a = 1, b = 2;
+
+    k1 = job_checkpoint_hash(0, &a, sizeof(int));
+    k2 = job_checkpoint_hash(0, &b, sizeof(int));
+    CuAssertTrue(tc, k1 != k2);
+    CuAssertTrue(tc, job_checkpoint_hash(k1, &b, sizeof(int)) !=
+                 job_checkpoint_hash(k2, &a, sizeof(int)));
+
+    memset(&wcs, 0, sizeof(tan_t));
+    wcs.crval[0] = 210.25;
+    wcs.crval[1] = -33.5;
+    wcs.crpix[0] = 512.5;
+    wcs.crpix[1] = 384.5;
+    wcs.cd[0][0] = -1.2345678901234e-4;
+    wcs.cd[1][1] = 1.2345678901234e-4;
+    wcs.imagew = 1024;
+    wcs.imageh = 768;
+
+    ck = job_checkpoint_new();
+    job_checkpoint_set_run(ck, k1, FALSE, 3, 17);
+    job_checkpoint_set_run(ck, k2, FALSE, 0, 40);
+    // ... and later finished.
+    job_checkpoint_set_run(ck, k2, TRUE, 0, 0);
+    job_checkpoint_set_best(ck, 12.5, &wcs);
+    wcs.crval[0] = 0.0;
+    job_checkpoint_set_best(ck, 8.0, &wcs);
+    CuAssertIntEquals(tc, 0, job_checkpoint_write(ck, fn));
+    job_checkpoint_free(ck);
+
+    ck = job_checkpoint_read(fn);
+    CuAssertPtrNotNull(tc, ck);
+    CuAssertIntEquals(tc, 2, bl_size(ck->runs));
+    run = job_checkpoint_find(ck, k1);
+    CuAssertPtrNotNull(tc, run);
+    CuAssertIntEquals(tc, FALSE, run->done);
+    CuAssertIntEquals(tc, 3, run->index);
+    CuAssertIntEquals(tc, 17, run->object);
+    run = job_checkpoint_find(ck, k2);
+    CuAssertPtrNotNull(tc, run);
+    CuAssertIntEquals(tc, TRUE, run->done);
+    CuAssertTrue(tc, job_checkpoint_find(ck, k1 ^ k2) == NULL);
+    CuAssertIntEquals(tc, TRUE, ck->have_best);
+    CuAssertDblEquals(tc, 12.5, ck->best_logodds, 0.0);
+    CuAssertDblEquals(tc, 210.25, ck->best_wcs.crval[0], 0.0);
+    CuAssertDblEquals(tc, -1.2345678901234e-4, ck->best_wcs.cd[0][0], 0.0);
+    CuAssertDblEquals(tc, 768, ck->best_wcs.imageh, 0.0);
+    job_checkpoint_free(ck);
+
+    unlink(fn);
+    CuAssertTrue(tc, job_checkpoint_read(fn) == NULL);
+    free(fn);
+}
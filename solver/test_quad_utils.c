@@ -0,0 +1,97 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "quad-utils.h"
+#include "starutil.h"
+
+static void random_quad(double* xyz, int dimquads, double ra, double dec) {
+    int i;
+    for (i=0; i<dimquads; i++)
+        radecdeg2xyzarr(ra + 0.5 * rand() / (double)RAND_MAX,
+                        dec + 0.5 * rand() / (double)RAND_MAX, xyz + 3*i);
+}
+
+void test_star_codes_match(CuTest* tc) {
+    // more than one block, and a partial one.
+    int N = 3 * QUAD_CODE_BLOCK + 7;
+    int dimquads, q, k;
+    double* xyz = malloc((size_t)N * DQMAX * 3 * sizeof(double));
+    double* codes = malloc((size_t)N * DCMAX * sizeof(double));
+
+    srand(42);
+    for (dimquads=3; dimquads<=DQMAX; dimquads++) {
+        int dimcodes = dimquad2dimcode(dimquads);
+        for (q=0; q<N; q++)
+            random_quad(xyz + (size_t)q * dimquads * 3, dimquads,
+                        360.0 * rand() / (double)RAND_MAX,
+                        // some near the poles.
+                        (q % 10 == 0) ? 89.0 : (q % 10 == 1) ? -89.5 :
+                        170.0 * rand() / (double)RAND_MAX - 85.0);
+        quad_compute_star_codes(xyz, codes, N, dimquads);
+        for (q=0; q<N; q++) {
+            double code[DCMAX];
+            quad_compute_star_code(xyz + (size_t)q * dimquads * 3, code,
+                                   dimquads);
+            for (k=0; k<dimcodes; k++)
+                CuAssertDblEquals(tc, code[k], codes[(size_t)q * dimcodes + k],
+                                  1e-9 * MAX(1.0, fabs(code[k])));
+        }
+    }
+    free(xyz);
+    free(codes);
+}
+
+void test_star_codes_at_pole(CuTest* tc) {
+    // A and B symmetric about the north pole: their midpoint is the pole.
+    double xyz[12];
+    double code[DCMAX];
+    double codes[DCMAX];
+    int k;
+    radecdeg2xyzarr(10.0, 89.9, xyz + 0);
+    radecdeg2xyzarr(190.0, 89.9, xyz + 3);
+    radecdeg2xyzarr(60.0, 89.95, xyz + 6);
+    radecdeg2xyzarr(300.0, 89.93, xyz + 9);
+    quad_compute_star_code(xyz, code, 4);
+    quad_compute_star_codes(xyz, codes, 1, 4);
+    for (k=0; k<4; k++)
+        CuAssertDblEquals(tc, code[k], codes[k], 1e-9);
+}
+
+void test_star_codes_independent_of_blocks(CuTest* tc) {
+    // the codes don't depend on where the quads fall in the blocks.
+    int N = 2 * QUAD_CODE_BLOCK + 5;
+    int dimquads = 4;
+    int dimcodes = dimquad2dimcode(dimquads);
+    int q;
+    double* xyz = malloc((size_t)N * dimquads * 3 * sizeof(double));
+    double* codes = malloc((size_t)N * dimcodes * sizeof(double));
+    double* codes1 = malloc((size_t)N * dimcodes * sizeof(double));
+
+    srand(17);
+    for (q=0; q<N; q++)
+        random_quad(xyz + (size_t)q * dimquads * 3, dimquads,
+                    360.0 * rand() / (double)RAND_MAX,
+                    170.0 * rand() / (double)RAND_MAX - 85.0);
+    quad_compute_star_codes(xyz, codes, N, dimquads);
+    // in odd-sized pieces, then one at a time.
+    for (q=0; q<N; q+=37)
+        quad_compute_star_codes(xyz + (size_t)q * dimquads * 3,
+                                codes1 + (size_t)q * dimcodes,
+                                MIN(37, N - q), dimquads);
+    CuAssertIntEquals(tc, 0, memcmp(codes, codes1,
+                                    (size_t)N * dimcodes * sizeof(double)));
+    for (q=0; q<N; q++)
+        quad_compute_star_codes(xyz + (size_t)q * dimquads * 3,
+                                codes1 + (size_t)q * dimcodes, 1, dimquads);
+    CuAssertIntEquals(tc, 0, memcmp(codes, codes1,
+                                    (size_t)N * dimcodes * sizeof(double)));
+    free(xyz);
+    free(codes);
+    free(codes1);
+}
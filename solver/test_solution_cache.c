@@ -0,0 +1,103 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "solution-cache.h"
+#include "starxy.h"
+#include "sip.h"
+#include "ioutils.h"
+
+static const double field_xy[] = {
+    120.3, 88.1,   640.7, 402.9,  310.2, 700.5,  901.4, 150.6,
+    455.5, 333.3,  70.9, 610.4,   780.1, 690.8,  512.6, 45.2,
+    250.0, 250.0,  600.0, 600.0,
+};
+
+// The first "N" sources of the field, moved, rotated by "theta",
+// scaled by "s", and with the first two swapped.
+static starxy_t* make_field(int N, double theta, double s) {
+    starxy_t* xy = starxy_new(N, FALSE, FALSE);
+    int i;
+    for (i=0; i<N; i++) {
+        int j = (i < 2) ? (1 - i) : i;
+        double x = field_xy[2*j], y = field_xy[2*j+1];
+        starxy_setx(xy, i, 30.0 + s * (cos(theta) * x - sin(theta) * y));
+        starxy_sety(xy, i, -12.0 + s * (sin(theta) * x + cos(theta) * y));
+    }
+    return xy;
+}
+
+void test_fingerprint_invariant(CuTest* tc) {
+    field_fingerprint_t fp1, fp2;
+    starxy_t* xy1 = make_field(8, 0.0, 1.0);
+    starxy_t* xy2 = make_field(8, 0.7, 1.8);
+
+    CuAssertIntEquals(tc, 0, field_fingerprint_compute(xy1, &fp1));
+    CuAssertIntEquals(tc, 0, field_fingerprint_compute(xy2, &fp2));
+    CuAssertIntEquals(tc, SOLUTION_CACHE_NCODES, fp1.ncodes);
+    CuAssertIntEquals(tc, SOLUTION_CACHE_NCODES,
+                      field_fingerprint_matches(&fp1, &fp2));
+    starxy_free(xy1);
+    starxy_free(xy2);
+
+    // too few sources.
+    xy1 = make_field(4, 0.0, 1.0);
+    CuAssertIntEquals(tc, -1, field_fingerprint_compute(xy1, &fp1));
+    starxy_free(xy1);
+}
+
+void test_solution_cache(CuTest* tc) {
+    char* dir = create_temp_dir("solcache", NULL);
+    field_fingerprint_t fp1, fp2;
+    solution_cache_t* cache;
+    starxy_t* xy;
+    sip_t wcs, found[3];
+    char* cmd;
+
+    memset(&wcs, 0, sizeof(sip_t));
+    wcs.wcstan.crval[0] = 120.0;
+    wcs.wcstan.crval[1] = 30.0;
+    wcs.wcstan.crpix[0] = 512.0;
+    wcs.wcstan.crpix[1] = 384.0;
+    wcs.wcstan.cd[0][0] = 1e-3;
+    wcs.wcstan.cd[1][1] = 1e-3;
+    wcs.wcstan.imagew = 1024;
+    wcs.wcstan.imageh = 768;
+
+    xy = make_field(8, 0.0, 1.0);
+    field_fingerprint_compute(xy, &fp1);
+    starxy_free(xy);
+    // the same pointing, with one of the brightest sources missing.
+    xy = make_field(10, 0.3, 1.1);
+    starxy_set(xy, 3, starxy_getx(xy, 8), starxy_gety(xy, 8));
+    field_fingerprint_compute(xy, &fp2);
+    starxy_free(xy);
+    CuAssertTrue(tc, field_fingerprint_matches(&fp2, &fp1) >= 35);
+
+    cache = solution_cache_open(dir);
+    CuAssertPtrNotNull(tc, cache);
+    CuAssertIntEquals(tc, 0, solution_cache_lookup(cache, &fp2, found, 3));
+    CuAssertIntEquals(tc, 0, solution_cache_add(cache, &fp1, &wcs));
+    CuAssertIntEquals(tc, 1, solution_cache_lookup(cache, &fp2, found, 3));
+    solution_cache_free(cache);
+
+    // ... and it's still there when the cache is read again.
+    cache = solution_cache_open(dir);
+    CuAssertIntEquals(tc, 1, solution_cache_size(cache));
+    CuAssertIntEquals(tc, 1, solution_cache_lookup(cache, &fp2, found, 3));
+    CuAssertDblEquals(tc, 120.0, found[0].wcstan.crval[0], 1e-9);
+    CuAssertDblEquals(tc, 1e-3, found[0].wcstan.cd[1][1], 1e-12);
+    solution_cache_free(cache);
+
+    asprintf_safe(&cmd, "rm -rf %s", dir);
+    CuAssertIntEquals(tc, 0, system(cmd));
+    free(cmd);
+    free(dir);
+}
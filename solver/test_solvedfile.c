@@ -0,0 +1,55 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "solvedfile.h"
+#include "ioutils.h"
+#include "bl.h"
+
+void test_solvedfile_map(CuTest* tc) {
+    char* fn = create_temp_file("solved", NULL);
+    solvedfile_map_t* a;
+    solvedfile_map_t* b;
+    il* lst;
+
+    unlink(fn);
+    a = solvedfile_map_open(fn);
+    b = solvedfile_map_open(fn);
+    CuAssertPtrNotNull(tc, a);
+
+    // no file yet: nothing is solved, and reading doesn't create it.
+    CuAssertIntEquals(tc, 0, solvedfile_map_get(a, 3));
+    CuAssertIntEquals(tc, 0, file_exists(fn));
+
+    CuAssertIntEquals(tc, 0, solvedfile_map_set(a, 3));
+    CuAssertIntEquals(tc, 1, solvedfile_map_get(a, 3));
+    CuAssertIntEquals(tc, 0, solvedfile_map_get(a, 2));
+    CuAssertIntEquals(tc, 3, solvedfile_getsize(fn));
+
+    // another mapping of the file sees the update, and the file grows.
+    CuAssertIntEquals(tc, 1, solvedfile_map_get(b, 3));
+    CuAssertIntEquals(tc, 0, solvedfile_map_get(b, 10));
+    CuAssertIntEquals(tc, 0, solvedfile_map_set(b, 10));
+    CuAssertIntEquals(tc, 1, solvedfile_map_get(a, 10));
+    CuAssertIntEquals(tc, 1, solvedfile_get(fn, 10));
+
+    // ... and the file-based functions agree.
+    CuAssertIntEquals(tc, 0, solvedfile_set(fn, 1));
+    CuAssertIntEquals(tc, 1, solvedfile_map_get(b, 1));
+    lst = solvedfile_getall_solved(fn, 1, 10, 0);
+    CuAssertIntEquals(tc, 3, il_size(lst));
+    CuAssertIntEquals(tc, 1, il_get(lst, 0));
+    CuAssertIntEquals(tc, 3, il_get(lst, 1));
+    CuAssertIntEquals(tc, 10, il_get(lst, 2));
+    il_free(lst);
+
+    solvedfile_map_close(a);
+    solvedfile_map_close(b);
+    unlink(fn);
+    free(fn);
+}
@@ -0,0 +1,122 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "solver-trace.h"
+#include "solver.h"
+#include "index.h"
+#include "ioutils.h"
+
+void test_solver_trace(CuTest* tc) {
+    char* fn = create_temp_file("trace", NULL);
+    char* indfn = create_temp_file("traceindex", NULL);
+    char md5[33];
+    solver_trace_t* tr;
+    solver_t* sp;
+    solver_t* sp2;
+    index_t index;
+    bl* searches;
+    solver_trace_search_t* s;
+    solver_trace_index_t* ti;
+    FILE* fid;
+    int i;
+
+    // (the MD5 of "abc")
+    fid = fopen(indfn, "w");
+    fprintf(fid, "abc");
+    fclose(fid);
+    CuAssertIntEquals(tc, 0, solver_trace_file_md5(indfn, md5));
+    CuAssertStrEquals(tc, "900150983cd24fb0d6963f7d28e17f72", md5);
+
+    memset(&index, 0, sizeof(index_t));
+    index.indexname = indfn;
+    index.indexid = 4119;
+    index.healpix = -1;
+    index.hpnside = 1;
+
+    sp = solver_new();
+    solver_set_field(sp, starxy_new(10, TRUE, FALSE));
+    for (i=0; i<10; i++) {
+        starxy_set_x(sp->fieldxy_orig, i, 100.0 + i / 3.0);
+        starxy_set_y(sp->fieldxy_orig, i, 200.0 - i * 0.1);
+        starxy_set_flux(sp->fieldxy_orig, i, 1000.0 - i);
+    }
+    solver_add_index(sp, &index);
+    sp->funits_lower = 0.123456789012345;
+    sp->endobj = 7;
+    sp->parity = PARITY_FLIP;
+    sp->do_tweak = TRUE;
+    sp->max_pquad_bytes = 12345678;
+    sp->crpix[1] = 42.5;
+    sp->numtries = 100;
+    sp->nummatches = 10;
+    sp->num_verified = 3;
+    sp->best_match_solves = TRUE;
+    sp->best_logodds = 55.5;
+    sp->collect_stats = TRUE;
+    sp->stats.wall[SOLVER_STAGE_VERIFY] = 0.25;
+
+    tr = solver_trace_open(fn);
+    CuAssertPtrNotNull(tc, tr);
+    CuAssertIntEquals(tc, 0, solver_trace_record(tr, sp, 1, 20.0, 1.5, 1.25));
+    // the same field again, with another depth.
+    sp->startobj = 7;
+    sp->endobj = 10;
+    CuAssertIntEquals(tc, 0, solver_trace_record(tr, sp, 1, 20.0, 2.0, 2.0));
+    CuAssertIntEquals(tc, 0, solver_trace_close(tr));
+
+    searches = solver_trace_read(fn);
+    CuAssertPtrNotNull(tc, searches);
+    CuAssertIntEquals(tc, 2, bl_size(searches));
+    s = bl_access(searches, 0);
+    CuAssertIntEquals(tc, 1, s->fieldnum);
+    CuAssertDblEquals(tc, 20.0, s->logratio_tosolve, 0.0);
+    CuAssertIntEquals(tc, 10, starxy_n(s->field));
+    CuAssertDblEquals(tc, 100.0 + 5 / 3.0, starxy_get_x(s->field, 5), 0.0);
+    CuAssertDblEquals(tc, 999.0, starxy_get_flux(s->field, 1), 0.0);
+    CuAssertIntEquals(tc, 1, bl_size(s->indexes));
+    ti = bl_access(s->indexes, 0);
+    CuAssertIntEquals(tc, 4119, ti->indexid);
+    CuAssertIntEquals(tc, -1, ti->healpix);
+    CuAssertStrEquals(tc, md5, ti->md5);
+    CuAssertStrEquals(tc, indfn, ti->path);
+    CuAssertDblEquals(tc, 0.123456789012345, s->params.funits_lower, 0.0);
+    CuAssertIntEquals(tc, 7, s->params.endobj);
+    CuAssertIntEquals(tc, PARITY_FLIP, s->params.parity);
+    CuAssertIntEquals(tc, 12345678, (int)s->params.max_pquad_bytes);
+    CuAssertDblEquals(tc, 42.5, s->params.crpix[1], 0.0);
+    CuAssertIntEquals(tc, 100, s->numtries);
+    CuAssertIntEquals(tc, 3, s->num_verified);
+    CuAssertIntEquals(tc, TRUE, s->solved);
+    CuAssertDblEquals(tc, 55.5, s->best_logodds, 0.0);
+    CuAssertDblEquals(tc, 1.5, s->wall, 1e-6);
+    CuAssertDblEquals(tc, 0.25, s->stage_wall[SOLVER_STAGE_VERIFY], 1e-6);
+
+    s = bl_access(searches, 1);
+    CuAssertIntEquals(tc, 10, starxy_n(s->field));
+    CuAssertDblEquals(tc, 200.0 - 9 * 0.1, starxy_get_y(s->field, 9), 0.0);
+    CuAssertIntEquals(tc, 7, s->params.startobj);
+
+    sp2 = solver_new();
+    solver_trace_setup_solver(s, sp2);
+    CuAssertIntEquals(tc, 7, sp2->startobj);
+    CuAssertIntEquals(tc, 10, sp2->endobj);
+    CuAssertIntEquals(tc, TRUE, sp2->do_tweak);
+    CuAssertIntEquals(tc, 10, starxy_n(sp2->fieldxy_orig));
+    CuAssertIntEquals(tc, 0, pl_size(sp2->indexes));
+    solver_free(sp2);
+
+    solver_trace_free_searches(searches);
+    solver_clear_indexes(sp);
+    solver_free(sp);
+    unlink(fn);
+    unlink(indfn);
+    free(fn);
+    free(indfn);
+}
@@ -562,3 +562,74 @@ void test_tchebytweak(CuTest* tc) {
 
 }
 
+
+static void shift_stars(tweak_t* t, const tan_t* wcs, const double* xy,
+                        const double* radec, int N, int Nref, int nthreads) {
+    starxy_t* sxy = starxy_new(N, FALSE, FALSE);
+    starxy_set_xy_array(sxy, xy);
+    tweak_init(t);
+    t->nthreads = nthreads;
+    tweak_push_wcs_tan(t, wcs);
+    tweak_push_ref_ad_array(t, radec, Nref);
+    tweak_push_image_xy(t, sxy);
+    tweak_go_to(t, TWEAK_HAS_REALLY_FINELY_SHIFTED);
+    starxy_free(sxy);
+}
+
+void test_tweak_shift(CuTest* tc) {
+    // many stars, 80% of them in both lists, and the WCS off by a shift.
+    int N = 3000;
+    int Nref = 4000;
+    double* xy = malloc(2 * Nref * sizeof(double));
+    double* radec = malloc(2 * Nref * sizeof(double));
+    tan_t truth, guess;
+    tweak_t t1, t2;
+    double x, y;
+    int i, nclose;
+
+    memset(&truth, 0, sizeof(tan_t));
+    truth.imagew = truth.imageh = 2000;
+    truth.crval[0] = 150;
+    truth.crval[1] = -30;
+    truth.crpix[0] = truth.crpix[1] = 1000.5;
+    truth.cd[0][0] = truth.cd[1][1] = 1./1000.;
+    guess = truth;
+    guess.crpix[0] += 23.7;
+    guess.crpix[1] -= 11.2;
+
+    srand(7);
+    for (i=0; i<Nref; i++) {
+        x = uniform_sample(0, 2000);
+        y = uniform_sample(0, 2000);
+        tan_pixelxy2radec(&truth, x, y, radec + 2*i, radec + 2*i + 1);
+        xy[2*i] = x;
+        xy[2*i+1] = y;
+    }
+    // image stars: the first N, plus some that aren't in the catalog.
+    for (i=N*4/5; i<N; i++) {
+        xy[2*i] = uniform_sample(0, 2000);
+        xy[2*i+1] = uniform_sample(0, 2000);
+    }
+
+    shift_stars(&t1, &guess, xy, radec, N, Nref, 1);
+    shift_stars(&t2, &guess, xy, radec, N, Nref, 4);
+    CuAssertTrue(tc, t1.xs == t2.xs);
+    CuAssertTrue(tc, t1.ys == t2.ys);
+    CuAssertTrue(tc, t1.sip->wcstan.crpix[0] == t2.sip->wcstan.crpix[0]);
+    CuAssertTrue(tc, t1.sip->wcstan.crpix[1] == t2.sip->wcstan.crpix[1]);
+
+    // the matched stars now land within a pixel of their catalog stars.
+    nclose = 0;
+    for (i=0; i<N*4/5; i++) {
+        CuAssertTrue(tc, tan_radec2pixelxy(&t1.sip->wcstan, radec[2*i],
+                                           radec[2*i+1], &x, &y));
+        if (hypot(x - xy[2*i], y - xy[2*i+1]) < 1.0)
+            nclose++;
+    }
+    CuAssertIntEquals(tc, N*4/5, nclose);
+
+    tweak_clear(&t1);
+    tweak_clear(&t2);
+    free(xy);
+    free(radec);
+}
@@ -0,0 +1,112 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "fitstable.h"
+#include "uniformize-catalog.h"
+#include "starutil.h"
+#include "mathutil.h"
+
+static void write_catalog(const char* fn, int N) {
+    fitstable_t* t;
+    tfits_type dubl = fitscolumn_double_type();
+    int i;
+    srand(42);
+    t = fitstable_open_for_writing(fn);
+    fitstable_add_write_column(t, dubl, "RA", "deg");
+    fitstable_add_write_column(t, dubl, "DEC", "deg");
+    fitstable_add_write_column(t, dubl, "MAG", "mag");
+    fitstable_write_primary_header(t);
+    fitstable_write_header(t);
+    for (i=0; i<N; i++) {
+        double ra, dec, mag;
+        ra =360.0 * rand() / (double)RAND_MAX;
+        dec = rad2deg(asin(2.0 * rand() / (double)RAND_MAX - 1.0));
+        // (coarse magnitudes, so that there are ties)
+        mag = (rand() % 200) / 10.0;
+        fitstable_write_row(t, &ra, &dec, &mag);
+        if (i % 3 == 0) {
+            // and a close companion, a fraction of a degree away.
+            ra += 0.3 * rand() / (double)RAND_MAX;
+            dec = MIN(90, dec + 0.3 * rand() / (double)RAND_MAX);
+            mag = (rand() % 200) / 10.0;
+            fitstable_write_row(t, &ra, &dec, &mag);
+            i++;
+        }
+    }
+    fitstable_fix_header(t);
+    fitstable_close(t);
+}
+
+// Uniformizes "infn" into "outfn" and returns its RA column.
+static double* run_uniformize(CuTest* tc, const char* infn, const char* outfn,
+                              const char* sortcol, int bighp, int bignside,
+                              int margin, int Nside, double dedup,
+                              int nthreads, int* N) {
+    fitstable_t* in;
+    fitstable_t* out;
+    double* ra;
+    in = fitstable_open(infn);
+    CuAssertPtrNotNull(tc, in);
+    out = fitstable_open_for_writing(outfn);
+    CuAssertPtrNotNull(tc, out);
+    CuAssertIntEquals(tc, 0, uniformize_catalog(in, out, "RA", "DEC", sortcol,
+                                                TRUE, -LARGE_VAL, bighp,
+                                                bignside, margin, Nside,
+                                                dedup, 4, nthreads, NULL, 0));
+    CuAssertIntEquals(tc, 0, fitstable_fix_primary_header(out));
+    CuAssertIntEquals(tc, 0, fitstable_close(out));
+    fitstable_close(in);
+
+    out = fitstable_open(outfn);
+    CuAssertPtrNotNull(tc, out);
+    *N = fitstable_nrows(out);
+    ra = fitstable_read_column(out, "RA", fitscolumn_double_type());
+    fitstable_close(out);
+    return ra;
+}
+
+static void check_same(CuTest* tc, const char* sortcol, int bighp,
+                       int bignside, int margin, int Nside, double dedup) {
+    const char* infn = "/tmp/test-uniformize-in.fits";
+    const char* outfn = "/tmp/test-uniformize-out.fits";
+    double* ra1;
+    double* ra2;
+    int N1, N2, nthreads, i;
+
+    write_catalog(infn, 20000);
+    ra1 = run_uniformize(tc, infn, outfn, sortcol, bighp, bignside, margin,
+                         Nside, dedup, 1, &N1);
+    CuAssertTrue(tc, N1 > 0);
+    for (nthreads=2; nthreads<=5; nthreads+=3) {
+        ra2 = run_uniformize(tc, infn, outfn, sortcol, bighp, bignside, margin,
+                             Nside, dedup, nthreads, &N2);
+        CuAssertIntEquals(tc, N1, N2);
+        for (i=0; i<N1; i++)
+            CuAssertDblEquals(tc, ra1[i], ra2[i], 0.0);
+        free(ra2);
+    }
+    free(ra1);
+}
+
+void test_uniformize_parallel_allsky(CuTest* tc) {
+    check_same(tc, "MAG", -1, 1, 0, 8, 0.0);
+    check_same(tc, NULL, -1, 1, 0, 8, 0.0);
+}
+
+void test_uniformize_parallel_dedup(CuTest* tc) {
+    // a big dedup radius, so that many duplicates straddle cell edges.
+    check_same(tc, "MAG", -1, 1, 0, 8, 3600.0);
+    check_same(tc, NULL, -1, 1, 0, 16, 1200.0);
+}
+
+void test_uniformize_parallel_margin(CuTest* tc) {
+    check_same(tc, "MAG", 3, 2, 2, 16, 1800.0);
+    check_same(tc, "MAG", 9, 2, 0, 16, 0.0);
+}
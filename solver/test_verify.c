@@ -0,0 +1,81 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cutest.h"
+#include "verify.h"
+#include "mathutil.h"
+
+/*
+ Compares the blocked verification loop against the original one, for
+ a field where half the test stars are near reference stars and the
+ rest are distractors.
+ */
+static void check_fast_matches_exact(CuTest* tc, int NR, int NT) {
+    double* refxy = malloc(NR * 2 * sizeof(double));
+    double* testxy = malloc(NT * 2 * sizeof(double));
+    double* sigma2 = malloc(NT * sizeof(double));
+    double W = 1000, H = 1000;
+    double logodds[2], worst[2];
+    int besti[2];
+    int* theta[2];
+    double* allodds[2];
+    int i, k;
+
+    srand(42);
+    for (i=0; i<NR; i++) {
+        refxy[2*i+0] = uniform_sample(0, W);
+        refxy[2*i+1] = uniform_sample(0, H);
+    }
+    for (i=0; i<NT; i++) {
+        sigma2[i] = square(uniform_sample(0.5, 3.0));
+        if ((i % 2) == 0 && (i/2 < NR)) {
+            int j = i/2;
+            testxy[2*i+0] = refxy[2*j+0] + uniform_sample(-1, 1);
+            testxy[2*i+1] = refxy[2*j+1] + uniform_sample(-1, 1);
+        } else {
+            testxy[2*i+0] = uniform_sample(0, W);
+            testxy[2*i+1] = uniform_sample(0, H);
+        }
+    }
+
+    for (k=0; k<2; k++) {
+        verify_set_exact(k == 0);
+        logodds[k] = verify_star_lists(refxy, NR, testxy, sigma2, NT, W*H,
+                                       0.25, -1e100, 1e100, &besti[k],
+                                       &allodds[k], &theta[k], &worst[k],
+                                       NULL);
+    }
+    verify_set_exact(FALSE);
+
+    CuAssertTrue(tc, logodds[0] > 10);
+    CuAssertDblEquals(tc, logodds[0], logodds[1], 1e-9 * fabs(logodds[0]));
+    CuAssertDblEquals(tc, worst[0], worst[1], 1e-9 * MAX(1.0, fabs(worst[0])));
+    CuAssertIntEquals(tc, besti[0], besti[1]);
+    for (i=0; i<NT; i++) {
+        CuAssertIntEquals(tc, theta[0][i], theta[1][i]);
+        CuAssertDblEquals(tc, allodds[0][i], allodds[1][i], 1e-9);
+    }
+
+    for (k=0; k<2; k++) {
+        free(theta[k]);
+        free(allodds[k]);
+    }
+    free(refxy);
+    free(testxy);
+    free(sigma2);
+}
+
+void test_verify_fast_small(CuTest* tc) {
+    // brute-force nearest neighbours
+    check_fast_matches_exact(tc, 100, 150);
+}
+
+void test_verify_fast_large(CuTest* tc) {
+    // kdtree nearest neighbours
+    check_fast_matches_exact(tc, 1000, 300);
+}
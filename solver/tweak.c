@@ -7,6 +7,8 @@
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <gsl/gsl_matrix_double.h>
 #include <gsl/gsl_vector_double.h>
@@ -84,34 +86,108 @@ sip_t* tweak_just_do_it(const tan_t* wcs, const starxy_t* imagexy,
     return sip;
 }
 
+// The extremes of the shifts between all image / catalog pairs; since
+// subtraction is monotonic, these are exactly the extremes of the
+// pairwise differences.
 static void get_dydx_range(double* ximg, double* yimg, int nimg,
                            double* xcat, double* ycat, int ncat,
                            double *mindx, double *mindy,
                            double *maxdx, double *maxdy) {
-    int i, j;
+    double xlo = 1e100, xhi = -1e100, ylo = 1e100, yhi = -1e100;
+    double cxlo = 1e100, cxhi = -1e100, cylo = 1e100, cyhi = -1e100;
+    int i;
     *maxdx = -1e100;
     *mindx = 1e100;
     *maxdy = -1e100;
     *mindy = 1e100;
-
+    if (!nimg || !ncat)
+        return;
     for (i = 0; i < nimg; i++) {
-        for (j = 0; j < ncat; j++) {
-            double dx = ximg[i] - xcat[j];
-            double dy = yimg[i] - ycat[j];
-            *maxdx = MAX(dx, *maxdx);
-            *maxdy = MAX(dy, *maxdy);
-            *mindx = MIN(dx, *mindx);
-            *mindy = MIN(dy, *mindy);
+        xlo = MIN(xlo, ximg[i]);
+        xhi = MAX(xhi, ximg[i]);
+        ylo = MIN(ylo, yimg[i]);
+        yhi = MAX(yhi, yimg[i]);
+    }
+    for (i = 0; i < ncat; i++) {
+        cxlo = MIN(cxlo, xcat[i]);
+        cxhi = MAX(cxhi, xcat[i]);
+        cylo = MIN(cylo, ycat[i]);
+        cyhi = MAX(cyhi, ycat[i]);
+    }
+    *maxdx = xhi - cxlo;
+    *mindx = xlo - cxhi;
+    *maxdy = yhi - cylo;
+    *mindy = ylo - cyhi;
+}
+
+// Pairs voted per thread, below which the vote isn't threaded.
+#define SHIFT_PAIRS_PER_THREAD 1000000
+
+struct shift_vote {
+    const double* ximg;
+    const double* yimg;
+    int nimg;
+    // the catalog, sorted by x
+    const double* xcat;
+    const double* ycat;
+    int ncat;
+    double mindx, mindy, maxdx, maxdy;
+    int hsz;
+    // votes per bin, before smoothing
+    int* counts;
+    int next;
+};
+
+static void* shift_vote_worker(void* arg) {
+    struct shift_vote* v = arg;
+    int hsz = v->hsz;
+    int hszi = hsz - 1;
+    int i;
+    while ((i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < v->nimg) {
+        double xi = v->ximg[i];
+        double yi = v->yimg[i];
+        int lo = 0, hi = v->ncat, j;
+        // the first catalog star with dx <= maxdx; any further left
+        // lands past the right edge of the histogram.
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (xi - v->xcat[mid] > v->maxdx)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        // ... and stopping at dx < mindx, past the left edge.
+        for (j = lo; j < v->ncat; j++) {
+            double dx = xi - v->xcat[j];
+            double dy = yi - v->ycat[j];
+            int iy, ix;
+            if (dx < v->mindx)
+                break;
+            iy = hszi * ( (dy - v->mindy) / (v->maxdy - v->mindy) ); // compute deltay using implicit floor
+            ix = hszi * ( (dx - v->mindx) / (v->maxdx - v->mindx) ); // compute deltax using implicit floor
+
+            // check to make sure the point is in the box
+            if (KERNEL_MARG <= iy && iy < hsz - KERNEL_MARG &&
+                KERNEL_MARG <= ix && ix < hsz - KERNEL_MARG)
+                __atomic_fetch_add(v->counts + iy*hsz + ix, 1, __ATOMIC_RELAXED);
         }
     }
+    return NULL;
 }
 
 static void get_shift(double* ximg, double* yimg, int nimg,
                       double* xcat, double* ycat, int ncat,
                       double mindx, double mindy, double maxdx, double maxdy,
+                      int nthreads,
                       double* xshift, double* yshift) {
     int i, j;
     int themax, themaxind, ys, xs;
+    struct shift_vote v;
+    int* perm;
+    double* sorted;
+    pthread_t* threads;
+    int nstarted = 0;
+    double npairs = (double)nimg * ncat;
 
     // hough transform
     int hsz = 1000; // hough histogram size (per side)
@@ -124,24 +200,58 @@ static void get_shift(double* ximg, double* yimg, int nimg,
 
     assert(sizeof(kern) == KERNEL_SIZE * KERNEL_SIZE * sizeof(int));
 
-    for (i = 0; i < nimg; i++) {    // loop over all pairs of source-catalog objs
-        for (j = 0; j < ncat; j++) {
-            double dx = ximg[i] - xcat[j];
-            double dy = yimg[i] - ycat[j];
-            int hszi = hsz - 1;
-            int iy = hszi * ( (dy - mindy) / (maxdy - mindy) ); // compute deltay using implicit floor
-            int ix = hszi * ( (dx - mindx) / (maxdx - mindx) ); // compute deltax using implicit floor
+    // Each image / catalog pair votes for its shift; only the catalog
+    // stars whose x shift lands in the box are looked at, which is a
+    // small fraction of them once the box has shrunk.
+    perm = permuted_sort(xcat, sizeof(double), compare_doubles_asc, NULL, ncat);
+    sorted = malloc(2 * MAX(1, ncat) * sizeof(double));
+    for (j = 0; j < ncat; j++) {
+        sorted[j] = xcat[perm[j]];
+        sorted[ncat + j] = ycat[perm[j]];
+    }
+    free(perm);
+    memset(&v, 0, sizeof(v));
+    v.ximg = ximg;
+    v.yimg = yimg;
+    v.nimg = nimg;
+    v.xcat = sorted;
+    v.ycat = sorted + ncat;
+    v.ncat = ncat;
+    v.mindx = mindx;
+    v.mindy = mindy;
+    v.maxdx = maxdx;
+    v.maxdy = maxdy;
+    v.hsz = hsz;
+    v.counts = calloc(hsz * hsz, sizeof(int));
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (int)MAX(1, MIN(nthreads, npairs / SHIFT_PAIRS_PER_THREAD));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    // this thread is the first worker.
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, shift_vote_worker, &v))
+            break;
+        nstarted++;
+    }
+    shift_vote_worker(&v);
+    for (i = 0; i < nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(sorted);
 
-            // check to make sure the point is in the box
-            if (KERNEL_MARG <= iy && iy < hsz - KERNEL_MARG &&
-                KERNEL_MARG <= ix && ix < hsz - KERNEL_MARG) {
-                int kx, ky;
-                for (ky = -2; ky <= 2; ky++)
-                    for (kx = -2; kx <= 2; kx++)
-                        hough[(iy - ky)*hsz + (ix - kx)] += kern[(ky + 2) * 5 + (kx + 2)];
-            }
-        }
+    // smooth the votes
+    for (i = 0; i < hsz*hsz; i++) {
+        int kx, ky, iy, ix, n = v.counts[i];
+        if (!n)
+            continue;
+        iy = i / hsz;
+        ix = i % hsz;
+        for (ky = -2; ky <= 2; ky++)
+            for (kx = -2; kx <= 2; kx++)
+                hough[(iy - ky)*hsz + (ix - kx)] += n * kern[(ky + 2) * 5 + (kx + 2)];
     }
+    free(v.counts);
 
     // find argmax in hough
     themax = 0;
@@ -170,7 +280,7 @@ static sip_t* do_entire_shift_operation(tweak_t* t, double rho) {
     get_shift(t->x, t->y, t->n,
               t->x_ref, t->y_ref, t->n_ref,
               rho*t->mindx, rho*t->mindy, rho*t->maxdx, rho*t->maxdy,
-              &t->xs, &t->ys);
+              t->nthreads, &t->xs, &t->ys);
     wcs_shift(&(t->sip->wcstan), t->xs, t->ys);
     return NULL;
 }
@@ -377,18 +487,16 @@ void tweak_push_ref_ad_array(tweak_t* t, const double* ad, int n) {
 }
 
 static void ref_xyz_from_ad(tweak_t* t) {
-    int i;
     assert(t->state & TWEAK_HAS_REF_AD);
     assert(!t->xyz_ref);
     t->xyz_ref = malloc(sizeof(double) * 3 * t->n_ref);
     assert(t->xyz_ref);
-    for (i = 0; i < t->n_ref; i++)
-        radecdeg2xyzarr(t->a_ref[i], t->d_ref[i], t->xyz_ref + 3 * i);
+    radecdeg2xyz_batch(t->a_ref, t->d_ref, t->xyz_ref, t->n_ref);
     t->state |= TWEAK_HAS_REF_XYZ;
 }
 
 static void ref_ad_from_xyz(tweak_t* t) {
-    int i, n;
+    int n;
     assert(t->state & TWEAK_HAS_REF_XYZ);
     assert(!t->a_ref);
     assert(!t->d_ref);
@@ -397,8 +505,7 @@ static void ref_ad_from_xyz(tweak_t* t) {
     t->d_ref = malloc(sizeof(double) * n);
     assert(t->a_ref);
     assert(t->d_ref);
-    for (i=0; i<n; i++)
-        xyzarr2radecdeg(t->xyz_ref + 3*i, t->a_ref + i, t->d_ref + i);
+    xyzarr2radecdeg_batch(t->xyz_ref, t->a_ref, t->d_ref, n);
     t->state |= TWEAK_HAS_REF_XYZ;
 }
 
@@ -699,13 +806,11 @@ unsigned int tweak_advance_to(tweak_t* t, unsigned int flag) {
     }
 
     want(TWEAK_HAS_IMAGE_XYZ) {
-        int i;
         ensure(TWEAK_HAS_IMAGE_AD);
         debug("Satisfying TWEAK_HAS_IMAGE_XYZ\n");
         assert(!t->xyz);
         t->xyz = malloc(3 * t->n * sizeof(double));
-        for (i = 0; i < t->n; i++)
-            radecdeg2xyzarr(t->a[i], t->d[i], t->xyz + 3*i);
+        radecdeg2xyz_batch(t->a, t->d, t->xyz, t->n);
         done(TWEAK_HAS_IMAGE_XYZ);
     }
 
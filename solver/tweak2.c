@@ -192,6 +192,30 @@ static char* tdebugfn(const char* name) {
 
 
 
+// Projects the reference stars into pixel space and keeps the ones
+// inside the image: their positions go in "indexpix" and their indices
+// in "indexin".  Returns the number kept.
+static int project_index_stars(const sip_t* sip, const double* indexradec,
+                               int Nindex, double* indexpix, int* indexin) {
+    anbool* ok = malloc(Nindex * sizeof(anbool));
+    int i, Nin = 0;
+    sip_radec2pixelxy_array(sip, indexradec, Nindex, indexpix, ok);
+    for (i=0; i<Nindex; i++) {
+        double x = indexpix[2*i + 0];
+        double y = indexpix[2*i + 1];
+        if (!ok[i])
+            continue;
+        if (!sip_pixel_is_inside_image(sip, x, y))
+            continue;
+        indexpix[Nin*2+0] = x;
+        indexpix[Nin*2+1] = y;
+        indexin[Nin] = i;
+        Nin++;
+    }
+    free(ok);
+    return Nin;
+}
+
 sip_t* tweak2(const double* fieldxy, int Nfield,
               double fieldjitter,
               int W, int H,
@@ -225,6 +249,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
     double* odds = NULL;
     int* refperm = NULL;
     double qc[2];
+    fit_sip_normal_t* fitter;
+    fit_wcs_workspace_t* fitws;
 
     memcpy(qc, quadcenter, 2*sizeof(double));
 
@@ -239,6 +265,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
     weights = malloc(Nfield * sizeof(double));
     matchxyz = malloc(Nfield * 3 * sizeof(double));
     matchxy = malloc(Nfield * 2 * sizeof(double));
+    fitter = fit_sip_normal_new(sip_order);
+    fitws = fit_wcs_workspace_new(sip_order, Nfield);
 
     // FIXME --- hmmm, how do the annealing steps and iterating up to
     // higher orders interact?
@@ -267,7 +295,6 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         for (step=0; step<STEPS; step++) {
             double iscale;
             double ijitter;
-            double ra, dec;
             double R2;
             int Nmatch;
             int nmatch, nconf, ndist;
@@ -291,22 +318,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 sip_print_to(sipout, stdout);
 
             // Project reference sources into pixel space; keep the ones inside image bounds.
-            Nin = 0;
-            for (i=0; i<Nindex; i++) {
-                anbool ok;
-                double x,y;
-                ra  = indexradec[2*i + 0];
-                dec = indexradec[2*i + 1];
-                ok = sip_radec2pixelxy(sipout, ra, dec, &x, &y);
-                if (!ok)
-                    continue;
-                if (!sip_pixel_is_inside_image(sipout, x, y))
-                    continue;
-                indexpix[Nin*2+0] = x;
-                indexpix[Nin*2+1] = y;
-                indexin[Nin] = i;
-                Nin++;
-            }
+            Nin = project_index_stars(sipout, indexradec, Nindex,
+                                      indexpix, indexin);
             logverb("%i reference sources within the image.\n", Nin);
             //logverb("CRPIX is (%g,%g)\n", sip.wcstan.crpix[0], sip.wcstan.crpix[1]);
 
@@ -318,6 +331,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 free(fieldsigma2s);
                 free(indexpix);
                 free(indexin);
+                fit_sip_normal_free(fitter);
+                fit_wcs_workspace_free(fitws);
                 return NULL;
             }
 
@@ -434,6 +449,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 free(fieldsigma2s);
                 free(indexpix);
                 free(indexin);
+                fit_sip_normal_free(fitter);
+                fit_wcs_workspace_free(fitws);
                 return NULL;
             }
 
@@ -457,16 +474,29 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
             if (crpix) {
                 tan_t temptan;
                 logverb("Moving tangent point to given CRPIX (%g,%g)\n", crpix[0], crpix[1]);
-                fit_tan_wcs_move_tangent_point_weighted(matchxyz, matchxy, weights, Nmatch,
-                                                        crpix, &sipout->wcstan, &temptan);
-                fit_tan_wcs_move_tangent_point_weighted(matchxyz, matchxy, weights, Nmatch,
-                                                        crpix, &temptan, &sipout->wcstan);
+                fit_tan_wcs_move_tangent_point_weighted_ws(fitws, matchxyz, matchxy,
+                                                           weights, Nmatch, crpix,
+                                                           &sipout->wcstan, &temptan);
+                fit_tan_wcs_move_tangent_point_weighted_ws(fitws, matchxyz, matchxy,
+                                                           weights, Nmatch, crpix,
+                                                           &temptan, &sipout->wcstan);
             }
 
             int doshift = 1;
-            fit_sip_wcs(matchxyz, matchxy, weights, Nmatch,
-                        &(sipout->wcstan), order, sip_invorder,
-                        doshift, sipout);
+            // CRVAL moves every step, so the sums are re-accumulated
+            // into the preallocated workspace.
+            if (fitter) {
+                fit_sip_normal_reset(fitter, &(sipout->wcstan));
+                for (i=0; i<Nmatch; i++)
+                    fit_sip_normal_add(fitter, matchxyz + 3*i, matchxy + 2*i,
+                                       weights[i]);
+            }
+            if (!fitter ||
+                fit_sip_normal_solve(fitter, order, sip_invorder,
+                                     doshift, sipout))
+                fit_sip_wcs_ws(fitws, matchxyz, matchxy, weights, Nmatch,
+                               &(sipout->wcstan), order, sip_invorder,
+                               doshift, sipout);
 
             debug("Got SIP:\n");
             if (log_get_level() > LOG_VERB)
@@ -484,7 +514,6 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         double gamma = 1.0;
         double iscale;
         double ijitter;
-        double ra, dec;
         double R2;
         int nmatch, nconf, ndist;
         double pix2;
@@ -494,22 +523,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         free(refperm);
         gamma = 1.0;
         // Project reference sources into pixel space; keep the ones inside image bounds.
-        Nin = 0;
-        for (i=0; i<Nindex; i++) {
-            anbool ok;
-            double x,y;
-            ra  = indexradec[2*i + 0];
-            dec = indexradec[2*i + 1];
-            ok = sip_radec2pixelxy(sipout, ra, dec, &x, &y);
-            if (!ok)
-                continue;
-            if (!sip_pixel_is_inside_image(sipout, x, y))
-                continue;
-            indexpix[Nin*2+0] = x;
-            indexpix[Nin*2+1] = y;
-            indexin[Nin] = i;
-            Nin++;
-        }
+        Nin = project_index_stars(sipout, indexradec, Nindex,
+                                  indexpix, indexin);
         logverb("%i reference sources within the image.\n", Nin);
 
         iscale = sip_pixel_scale(sipout);
@@ -580,6 +595,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
     free(weights);
     free(matchxyz);
     free(matchxy);
+    fit_sip_normal_free(fitter);
+    fit_wcs_workspace_free(fitws);
 
     return sipout;
 }
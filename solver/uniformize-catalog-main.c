@@ -18,7 +18,7 @@
 #include "fitsioutils.h"
 #include "mathutil.h"
 
-const char* OPTIONS = "hvH:s:n:N:d:R:D:S:fm:";
+const char* OPTIONS = "hvH:s:n:N:d:R:D:S:fm:w:";
 
 void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -33,6 +33,7 @@ void printHelp(char* progname) {
            "    [-n <sweeps>]    (ie, number of stars per fine healpix grid cell); default 10\n"
            "    [-N <nside>]:   fine healpixelization grid; default 100.\n"
            "    [-d <dedup-radius>]: deduplication radius in arcseconds; default no deduplication\n"
+           "    [-w <threads>]: place the stars on this many threads (-1: one per CPU)\n"
            "    [-v]: +verbose\n"
            "\n", progname);
 }
@@ -55,6 +56,7 @@ int main(int argc, char *argv[]) {
     double dedup = 0.0;
     int margin = 0;
     double mincut = -LARGE_VAL;
+    int nthreads = 1;
 	
     fitstable_t* intable;
     fitstable_t* outtable;
@@ -94,6 +96,9 @@ int main(int argc, char *argv[]) {
         case 'm':
             margin = atoi(optarg);
             break;
+        case 'w':
+            nthreads = atoi(optarg);
+            break;
         case 'v':
             loglvl++;
             break;
@@ -143,7 +148,7 @@ int main(int argc, char *argv[]) {
     if (uniformize_catalog(intable, outtable, racol, deccol,
                            sortcol, sortasc, mincut,
                            bighp, bignside, margin,
-                           Nside, dedup, sweeps,
+                           Nside, dedup, sweeps, nthreads,
                            argv, argc)) {
         exit(-1);
     }
@@ -4,6 +4,10 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "os-features.h"
@@ -74,6 +78,458 @@ static anbool is_duplicate(int hp, double ra, double dec, int Nside,
     return FALSE;
 }
 
+/*
+ The parallel mode.  The stars' healpixes are computed on several
+ threads, and the in-bounds stars are radix-sorted by healpix, which
+ keeps them in sort order within each healpix.  Each cell then picks
+ its stars independently, deduplicating against its own stars only.
+ Pairs of picked stars in neighbouring cells that are within the
+ deduplication radius show where a neighbour would have vetoed a star;
+ those cells are redone together, serially, in sort order, until no
+ such pairs remain.  The result is the same as the serial code's.
+ */
+struct hpstar {
+    int64_t hp;
+    // position in sort order
+    int rank;
+};
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+struct uniformizer {
+    // task queue
+    void (*task)(struct uniformizer* u, int i);
+    int ntasks;
+    int next;
+
+    // sort order -> row in the table; NULL for the identity
+    const int* order;
+    const double* ra;
+    const double* dec;
+    int N;
+    int Nside;
+    anbool allsky;
+    struct oh_token* token;
+    // sorted margin healpixes, or NULL
+    const int64_t* margin;
+    size_t nmargin;
+    double dedupr2;
+    int nkeep;
+
+    int nchunks;
+    // the in-bounds stars, sorted by healpix
+    struct hpstar* stars;
+    struct hpstar* tmp;
+    int nstars;
+    int shift;
+    // per-chunk bucket counts, then offsets
+    size_t* hist;
+
+    // cells: healpix, first star, number picked, picked stars
+    // (as positions in "stars", stored at sel[cellstart[c]...])
+    int ncells;
+    int64_t* cellhp;
+    int* cellstart;
+    int* nsel;
+    int* sel;
+    int* celldup;
+    // cells to redo serially; cells found in the latest check
+    unsigned char* redo;
+    unsigned char* found;
+    // cells to check; NULL for all
+    const int* checkcells;
+};
+
+static void* uniformize_worker(void* baton) {
+    struct uniformizer* u = baton;
+    int i;
+    while ((i = __atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED)) < u->ntasks)
+        u->task(u, i);
+    return NULL;
+}
+
+static void run_tasks(struct uniformizer* u, int nthreads,
+                      void (*task)(struct uniformizer*, int), int ntasks) {
+    pthread_t* threads;
+    int i, nstarted = 0;
+    u->task = task;
+    u->ntasks = ntasks;
+    u->next = 0;
+    threads = malloc(MAX(nthreads, 1) * sizeof(pthread_t));
+    for (i=1; i<nthreads && i<ntasks; i++) {
+        if (pthread_create(threads + nstarted, NULL, uniformize_worker, u))
+            // this thread picks up the slack.
+            break;
+        nstarted++;
+    }
+    uniformize_worker(u);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+static int star_row(const struct uniformizer* u, int p) {
+    int rank = u->stars[p].rank;
+    return u->order ? u->order[rank] : rank;
+}
+
+static void star_xyz(const struct uniformizer* u, int p, double* xyz) {
+    int j = star_row(u, p);
+    radecdeg2xyzarr(u->ra[j], u->dec[j], xyz);
+}
+
+static anbool sorted_contains(const int64_t* arr, size_t n, int64_t val) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (arr[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < n && arr[lo] == val);
+}
+
+// Index of the cell of healpix "hp", or -1.
+static int find_cell(const struct uniformizer* u, int64_t hp) {
+    int lo = 0, hi = u->ncells;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (u->cellhp[mid] < hp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < u->ncells && u->cellhp[lo] == hp) ? lo : -1;
+}
+
+static void chunk_range(int n, int nchunks, int i, int* lo, int* hi) {
+    *lo = (int)((int64_t)n * i / nchunks);
+    *hi = (int)((int64_t)n * (i+1) / nchunks);
+}
+
+// Healpixes of a chunk of the stars, in sort order; -1 if out of bounds.
+static void healpix_task(struct uniformizer* u, int chunk) {
+    double ra[256], dec[256];
+    int64_t hps[256];
+    int lo, hi, i, b;
+    chunk_range(u->N, u->nchunks, chunk, &lo, &hi);
+    for (i=lo; i<hi; i++) {
+        int hp;
+        anbool oob = FALSE;
+        b = (i - lo) % 256;
+        if (b == 0) {
+            // find the healpixes of the next batch of stars at once.
+            int k, n = MIN(256, hi - i);
+            for (k=0; k<n; k++) {
+                int j = u->order ? u->order[i+k] : i+k;
+                ra[k] = u->ra[j];
+                dec[k] = u->dec[j];
+            }
+            radecdegtohealpixl_array(ra, dec, n, u->Nside, hps);
+        }
+        hp = (int)hps[b];
+        if (u->margin)
+            oob = (outside_healpix(hp, u->token) &&
+                   !sorted_contains(u->margin, u->nmargin, hp));
+        else if (!u->allsky)
+            oob = outside_healpix(hp, u->token);
+        u->tmp[i].hp = oob ? -1 : hp;
+        u->tmp[i].rank = i;
+    }
+}
+
+static void count_task(struct uniformizer* u, int chunk) {
+    size_t* hist = u->hist + (size_t)chunk * RADIX_BUCKETS;
+    int lo, hi, i;
+    chunk_range(u->nstars, u->nchunks, chunk, &lo, &hi);
+    memset(hist, 0, RADIX_BUCKETS * sizeof(size_t));
+    for (i=lo; i<hi; i++)
+        hist[(u->stars[i].hp >> u->shift) & (RADIX_BUCKETS-1)]++;
+}
+
+static void scatter_task(struct uniformizer* u, int chunk) {
+    size_t* offset = u->hist + (size_t)chunk * RADIX_BUCKETS;
+    int lo, hi, i;
+    chunk_range(u->nstars, u->nchunks, chunk, &lo, &hi);
+    for (i=lo; i<hi; i++)
+        u->tmp[offset[(u->stars[i].hp >> u->shift) & (RADIX_BUCKETS-1)]++] =
+            u->stars[i];
+}
+
+// A stable LSD radix sort of the stars by healpix.
+static void sort_stars(struct uniformizer* u, int nthreads, int64_t maxhp) {
+    int nbits = 0;
+    while (nbits < 63 && (maxhp >> nbits))
+        nbits++;
+    u->hist = malloc((size_t)u->nchunks * RADIX_BUCKETS * sizeof(size_t));
+    for (u->shift=0; u->shift<nbits; u->shift+=RADIX_BITS) {
+        struct hpstar* t;
+        size_t total = 0;
+        int d, c;
+        run_tasks(u, nthreads, count_task, u->nchunks);
+        // bucket-major, then chunk order: that keeps the sort stable.
+        for (d=0; d<RADIX_BUCKETS; d++)
+            for (c=0; c<u->nchunks; c++) {
+                size_t* h = u->hist + (size_t)c * RADIX_BUCKETS + d;
+                size_t n = *h;
+                *h = total;
+                total += n;
+            }
+        run_tasks(u, nthreads, scatter_task, u->nchunks);
+        t = u->stars;
+        u->stars = u->tmp;
+        u->tmp = t;
+    }
+    free(u->hist);
+    u->hist = NULL;
+}
+
+// Is "xyz" within the dedup radius of one of the stars picked so far
+// in cell "c"?
+static anbool near_picked(const struct uniformizer* u, double* xyz,
+                          int c) {
+    const int* sel = u->sel + u->cellstart[c];
+    int k;
+    for (k=0; k<u->nsel[c]; k++) {
+        double xyz2[3];
+        star_xyz(u, sel[k], xyz2);
+        if (!distsq_exceeds(xyz, xyz2, 3, u->dedupr2))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Picks the stars of cell "c", ignoring its neighbours.
+static void select_task(struct uniformizer* u, int c) {
+    int p;
+    int* sel = u->sel + u->cellstart[c];
+    u->nsel[c] = 0;
+    u->celldup[c] = 0;
+    for (p=u->cellstart[c]; p<u->cellstart[c+1]; p++) {
+        if (u->nkeep && u->nsel[c] >= u->nkeep)
+            break;
+        if (u->dedupr2 > 0.0) {
+            double xyz[3];
+            star_xyz(u, p, xyz);
+            if (near_picked(u, xyz, c)) {
+                u->celldup[c]++;
+                continue;
+            }
+        }
+        sel[u->nsel[c]++] = p;
+    }
+}
+
+// Looks for picked stars of cell "c" that are near picked stars of a
+// neighbouring cell, other than pairs that were both redone serially.
+static void conflict_task(struct uniformizer* u, int k) {
+    int c = u->checkcells ? u->checkcells[k] : k;
+    int neigh[8];
+    int nn, i, m;
+    nn = healpix_get_neighbours((int)u->cellhp[c], neigh, u->Nside);
+    for (i=0; i<u->nsel[c]; i++) {
+        double xyz[3];
+        star_xyz(u, u->sel[u->cellstart[c] + i], xyz);
+        for (m=0; m<nn; m++) {
+            int n = find_cell(u, neigh[m]);
+            if (n == -1 || (u->redo[c] && u->redo[n]))
+                continue;
+            if (near_picked(u, xyz, n)) {
+                __atomic_store_n(u->found + c, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(u->found + n, 1, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+    }
+}
+
+struct redo_star {
+    int rank;
+    int pos;
+    int cell;
+};
+
+static int compare_redo_stars(const void* v1, const void* v2) {
+    const struct redo_star* s1 = v1;
+    const struct redo_star* s2 = v2;
+    return (s1->rank > s2->rank) - (s1->rank < s2->rank);
+}
+
+// Redoes the cells marked in "redo" the serial way: visiting their stars
+// in sort order, and deduplicating against the neighbouring redone cells.
+// Returns the number of duplicates found.
+static int redo_cells(struct uniformizer* u) {
+    struct redo_star* rs;
+    int nrs = 0;
+    int ndup = 0;
+    int c, i;
+
+    for (c=0; c<u->ncells; c++)
+        if (u->redo[c])
+            nrs += u->cellstart[c+1] - u->cellstart[c];
+    rs = malloc(MAX(nrs, 1) * sizeof(struct redo_star));
+    nrs = 0;
+    for (c=0; c<u->ncells; c++) {
+        int p;
+        if (!u->redo[c])
+            continue;
+        u->nsel[c] = 0;
+        for (p=u->cellstart[c]; p<u->cellstart[c+1]; p++) {
+            rs[nrs].rank = u->stars[p].rank;
+            rs[nrs].pos = p;
+            rs[nrs].cell = c;
+            nrs++;
+        }
+    }
+    qsort(rs, nrs, sizeof(struct redo_star), compare_redo_stars);
+
+    for (i=0; i<nrs; i++) {
+        double xyz[3];
+        int neigh[8];
+        int nn, m;
+        anbool dup;
+        c = rs[i].cell;
+        if (u->nkeep && u->nsel[c] >= u->nkeep)
+            continue;
+        star_xyz(u, rs[i].pos, xyz);
+        dup = near_picked(u, xyz, c);
+        if (!dup) {
+            nn = healpix_get_neighbours((int)u->cellhp[c], neigh, u->Nside);
+            for (m=0; m<nn && !dup; m++) {
+                int n = find_cell(u, neigh[m]);
+                if (n != -1 && u->redo[n])
+                    dup = near_picked(u, xyz, n);
+            }
+        }
+        if (dup) {
+            ndup++;
+            continue;
+        }
+        u->sel[u->cellstart[c] + u->nsel[c]++] = rs[i].pos;
+    }
+    free(rs);
+    return ndup;
+}
+
+/*
+ Parallel version of the star placement and sweeps of
+ uniformize_catalog(): fills "outorder" with the picked rows, sweep by
+ sweep, and "npersweep"; returns the number of rows.
+ */
+static int uniformize_parallel(struct uniformizer* u, int nthreads,
+                               int nsweeps, const double* sortval,
+                               anbool sort_ascending,
+                               int* outorder, int* npersweep,
+                               int* p_noob, int* p_ndup) {
+    int64_t maxhp;
+    int i, c, k;
+    int outi = 0;
+    int ndup = 0;
+
+    u->nchunks = nthreads;
+    u->tmp = malloc(MAX(u->N, 1) * sizeof(struct hpstar));
+    run_tasks(u, nthreads, healpix_task, u->nchunks);
+    u->stars = malloc(MAX(u->N, 1) * sizeof(struct hpstar));
+    u->nstars = 0;
+    maxhp = 0;
+    for (i=0; i<u->N; i++) {
+        if (u->tmp[i].hp == -1)
+            continue;
+        maxhp = MAX(maxhp, u->tmp[i].hp);
+        u->stars[u->nstars++] = u->tmp[i];
+    }
+    *p_noob = u->N - u->nstars;
+    sort_stars(u, nthreads, maxhp);
+    free(u->tmp);
+    u->tmp = NULL;
+
+    u->ncells = 0;
+    for (i=0; i<u->nstars; i++)
+        if (i == 0 || u->stars[i].hp != u->stars[i-1].hp)
+            u->ncells++;
+    u->cellhp = malloc(MAX(u->ncells, 1) * sizeof(int64_t));
+    u->cellstart = malloc((u->ncells + 1) * sizeof(int));
+    c = 0;
+    for (i=0; i<u->nstars; i++)
+        if (i == 0 || u->stars[i].hp != u->stars[i-1].hp) {
+            u->cellhp[c] = u->stars[i].hp;
+            u->cellstart[c] = i;
+            c++;
+        }
+    u->cellstart[u->ncells] = u->nstars;
+    logverb("%i stars in %i cells\n", u->nstars, u->ncells);
+
+    u->nsel = malloc(MAX(u->ncells, 1) * sizeof(int));
+    u->celldup = malloc(MAX(u->ncells, 1) * sizeof(int));
+    u->sel = malloc(MAX(u->nstars, 1) * sizeof(int));
+    u->redo = calloc(MAX(u->ncells, 1), 1);
+    u->found = calloc(MAX(u->ncells, 1), 1);
+    run_tasks(u, nthreads, select_task, u->ncells);
+
+    if (u->dedupr2 > 0.0) {
+        int* check = malloc(MAX(u->ncells, 1) * sizeof(int));
+        int ncheck = u->ncells;
+        int round;
+        u->checkcells = NULL;
+        for (round=0;; round++) {
+            int nadded = 0;
+            run_tasks(u, nthreads, conflict_task, ncheck);
+            for (c=0; c<u->ncells; c++) {
+                if (u->found[c] && !u->redo[c]) {
+                    u->redo[c] = 1;
+                    nadded++;
+                }
+                u->found[c] = 0;
+            }
+            if (!nadded)
+                break;
+            logverb("Deduplication round %i: redoing %i more cells\n",
+                    round+1, nadded);
+            ndup = redo_cells(u);
+            // only the redone cells' picks can have changed.
+            ncheck = 0;
+            for (c=0; c<u->ncells; c++)
+                if (u->redo[c])
+                    check[ncheck++] = c;
+            u->checkcells = check;
+        }
+        u->checkcells = NULL;
+        free(check);
+    }
+    for (c=0; c<u->ncells; c++)
+        if (!u->redo[c])
+            ndup += u->celldup[c];
+    *p_ndup = ndup;
+
+    for (k=0; k<nsweeps; k++) {
+        int starti = outi;
+        for (c=0; c<u->ncells; c++) {
+            if (u->nsel[c] <= k)
+                continue;
+            outorder[outi++] = star_row(u, u->sel[u->cellstart[c] + k]);
+        }
+        logmsg("Sweep %i: %i stars\n", k+1, outi - starti);
+        npersweep[k] = outi - starti;
+        if (sortval)
+            // Re-sort within this sweep.
+            permuted_sort(sortval, sizeof(double),
+                          sort_ascending ? compare_doubles_asc : compare_doubles_desc,
+                          outorder + starti, npersweep[k]);
+    }
+
+    free(u->stars);
+    free(u->cellhp);
+    free(u->cellstart);
+    free(u->nsel);
+    free(u->celldup);
+    free(u->sel);
+    free(u->redo);
+    free(u->found);
+    return outi;
+}
+
 int uniformize_catalog(fitstable_t* intable, fitstable_t* outtable,
                        const char* racol, const char* deccol,
                        const char* sortcol, anbool sort_ascending,
@@ -85,6 +541,7 @@ int uniformize_catalog(fitstable_t* intable, fitstable_t* outtable,
                        int Nside_int,
                        double dedup_radius,
                        int nsweeps,
+                       int nthreads,
                        char** args, int argc) {
     anbool allsky;
     longmap_t* starlists;
@@ -237,64 +694,134 @@ int uniformize_catalog(fitstable_t* intable, fitstable_t* outtable,
     }
 
     dedupr2 = arcsec2distsq(dedup_radius);
-    starlists = longmap_new(sizeof(int32_t), nkeep, 0, dense);
+    outorder = malloc(N * sizeof(int));
+    outi = 0;
+    npersweep = calloc(nsweeps, sizeof(int));
 
-    logverb("Placing stars in grid cells...\n");
-    for (i=0; i<N; i++) {
-        int hp;
-        bl* lst;
-        int32_t j32;
-        anbool oob;
-        if (inorder) {
-            j = inorder[i];
-            //printf("Placing star %i (%i): sort value %s = %g, RA,Dec=%g,%g\n", i, j, sortcol, sortval[j], ra[j], dec[j]);
-        } else
-            j = i;
-		
-        hp = radecdegtohealpix(ra[j], dec[j], Nside);
-        //printf("HP %i\n", hp);
-        // in bounds?
-        oob = FALSE;
+    if (nthreads < 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > 1) {
+        struct uniformizer u;
+        int64_t* margin = NULL;
+        memset(&u, 0, sizeof(u));
         if (myhps) {
-            oob = (outside_healpix(hp, &token) && !il_sorted_contains(myhps, hp));
-        } else if (!allsky) {
-            oob = (outside_healpix(hp, &token));
-        }
-        if (oob) {
-            //printf("out of bounds.\n");
-            noob++;
-            continue;
+            u.nmargin = hpl_size(myhps);
+            margin = malloc(MAX(u.nmargin, 1) * sizeof(int64_t));
+            ll_copy(myhps, 0, u.nmargin, margin);
+            u.margin = margin;
         }
+        u.order = inorder;
+        u.ra = ra;
+        u.dec = dec;
+        u.N = N;
+        u.Nside = (int)Nside;
+        u.allsky = allsky;
+        u.token = &token;
+        u.dedupr2 = dedupr2;
+        u.nkeep = nkeep;
+        logverb("Placing stars in grid cells, on %i threads...\n", nthreads);
+        outi = uniformize_parallel(&u, nthreads, nsweeps,
+                                   sortcol ? sortval : NULL, sort_ascending,
+                                   outorder, npersweep, &noob, &ndup);
+        free(margin);
+        logverb("%i outside the healpix\n", noob);
+        logverb("%i duplicates\n", ndup);
+    } else {
+        starlists = longmap_new(sizeof(int32_t), nkeep, 0, dense);
+
+        logverb("Placing stars in grid cells...\n");
+        for (i=0; i<N; i++) {
+            int hp;
+            bl* lst;
+            int32_t j32;
+            anbool oob;
+            if (inorder) {
+                j = inorder[i];
+                //printf("Placing star %i (%i): sort value %s = %g, RA,Dec=%g,%g\n", i, j, sortcol, sortval[j], ra[j], dec[j]);
+            } else
+                j = i;
+		
+            hp = radecdegtohealpix(ra[j], dec[j], Nside);
+            //printf("HP %i\n", hp);
+            // in bounds?
+            oob = FALSE;
+            if (myhps) {
+                oob = (outside_healpix(hp, &token) && !ll_sorted_contains(myhps, hp));
+            } else if (!allsky) {
+                oob = (outside_healpix(hp, &token));
+            }
+            if (oob) {
+                //printf("out of bounds.\n");
+                noob++;
+                continue;
+            }
 
-        lst = longmap_find(starlists, hp, TRUE);
-        /*
-         printf("list has %i existing entries.\n", bl_size(lst));
-         for (k=0; k<bl_size(lst); k++) {
-         bl_get(lst, k, &j32);
-         printf("  %i: index %i, %s = %g\n", k, j32, sortcol, sortval[j32]);
-         }
-         */
-
-        // is this list full?
-        if (nkeep && (bl_size(lst) >= nkeep)) {
-            // Here we assume we're working in sorted order: once the list is full we're done.
-            //printf("Skipping: list is full.\n");
-            continue;
+            lst = longmap_find(starlists, hp, TRUE);
+            /*
+             printf("list has %i existing entries.\n", bl_size(lst));
+             for (k=0; k<bl_size(lst); k++) {
+             bl_get(lst, k, &j32);
+             printf("  %i: index %i, %s = %g\n", k, j32, sortcol, sortval[j32]);
+             }
+             */
+
+            // is this list full?
+            if (nkeep && (bl_size(lst) >= nkeep)) {
+                // Here we assume we're working in sorted order: once the list is full we're done.
+                //printf("Skipping: list is full.\n");
+                continue;
+            }
+
+            if ((dedupr2 > 0.0) &&
+                is_duplicate(hp, ra[j], dec[j], Nside, starlists, ra, dec, dedupr2)) {
+                //printf("Skipping: duplicate\n");
+                ndup++;
+                continue;
+            }
+
+            // Add the new star (by index)
+            j32 = j;
+            bl_append(lst, &j32);
         }
+        logverb("%i outside the healpix\n", noob);
+        logverb("%i duplicates\n", ndup);
+
+        for (k=0; k<nsweeps; k++) {
+            int starti = outi;
+            int32_t j32;
+            for (i=0;; i++) {
+                bl* lst;
+                int64_t hp;
+                if (!longmap_get_entry(starlists, i, &hp, &lst))
+                    break;
+                if (bl_size(lst) <= k)
+                    continue;
+                bl_get(lst, k, &j32);
+                outorder[outi] = j32;
+                //printf("sweep %i, cell #%i, hp %i, star %i, %s = %g\n", k, i, hp, j32, sortcol, sortval[j32]);
+                outi++;
+            }
+            logmsg("Sweep %i: %i stars\n", k+1, outi - starti);
+            npersweep[k] = outi - starti;
+
+            if (sortcol) {
+                // Re-sort within this sweep.
+                permuted_sort(sortval, sizeof(double),
+                              sort_ascending ? compare_doubles_asc : compare_doubles_desc,
+                              outorder + starti, npersweep[k]);
+                /*
+                 for (i=0; i<npersweep[k]; i++) {
+                 printf("  within sweep %i: star %i, j=%i, %s=%g\n",
+                 k, i, outorder[starti + i], sortcol, sortval[outorder[starti + i]]);
+                 }
+                 */
+            }
 
-        if ((dedupr2 > 0.0) &&
-            is_duplicate(hp, ra[j], dec[j], Nside, starlists, ra, dec, dedupr2)) {
-            //printf("Skipping: duplicate\n");
-            ndup++;
-            continue;
         }
+        longmap_free(starlists);
+        starlists = NULL;
 
-        // Add the new star (by index)
-        j32 = j;
-        bl_append(lst, &j32);
     }
-    logverb("%i outside the healpix\n", noob);
-    logverb("%i duplicates\n", ndup);
 
     il_free(myhps);
     myhps = NULL;
@@ -305,46 +832,6 @@ int uniformize_catalog(fitstable_t* intable, fitstable_t* outtable,
     free(dec);
     dec = NULL;
 
-    outorder = malloc(N * sizeof(int));
-    outi = 0;
-
-    npersweep = calloc(nsweeps, sizeof(int));
-
-    for (k=0; k<nsweeps; k++) {
-        int starti = outi;
-        int32_t j32;
-        for (i=0;; i++) {
-            bl* lst;
-            int64_t hp;
-            if (!longmap_get_entry(starlists, i, &hp, &lst))
-                break;
-            if (bl_size(lst) <= k)
-                continue;
-            bl_get(lst, k, &j32);
-            outorder[outi] = j32;
-            //printf("sweep %i, cell #%i, hp %i, star %i, %s = %g\n", k, i, hp, j32, sortcol, sortval[j32]);
-            outi++;
-        }
-        logmsg("Sweep %i: %i stars\n", k+1, outi - starti);
-        npersweep[k] = outi - starti;
-
-        if (sortcol) {
-            // Re-sort within this sweep.
-            permuted_sort(sortval, sizeof(double),
-                          sort_ascending ? compare_doubles_asc : compare_doubles_desc,
-                          outorder + starti, npersweep[k]);
-            /*
-             for (i=0; i<npersweep[k]; i++) {
-             printf("  within sweep %i: star %i, j=%i, %s=%g\n",
-             k, i, outorder[starti + i], sortcol, sortval[outorder[starti + i]]);
-             }
-             */
-        }
-
-    }
-    longmap_free(starlists);
-    starlists = NULL;
-
     //////
     free(sortval);
     sortval = NULL;
@@ -11,7 +11,7 @@
 #include "unpermute-quads.h"
 #include "boilerplate.h"
 
-#define OPTIONS "hq:c:Q:C:"
+#define OPTIONS "hq:c:Q:C:t:"
 
 static void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -20,6 +20,7 @@ static void printHelp(char* progname) {
            "   -c <input-code-kdtree-filename>\n"
            "   -Q <output-quad-filename>\n"
            "   -C <output-code-kdtree-filename>\n"
+           "  [-t <threads>]: number of threads (default 1)\n"
            "\n", progname);
 }
 
@@ -31,6 +32,7 @@ int main(int argc, char **args) {
     char* quadoutfn = NULL;
     char* ckdtinfn = NULL;
     char* ckdtoutfn = NULL;
+    int nthreads = 1;
 
     while ((argchar = getopt (argc, args, OPTIONS)) != -1)
         switch (argchar) {
@@ -46,6 +48,9 @@ int main(int argc, char **args) {
         case 'C':
             ckdtoutfn = optarg;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         case '?':
             fprintf(stderr, "Unknown option `-%c'.\n", optopt);
         case 'h':
@@ -62,7 +67,7 @@ int main(int argc, char **args) {
     }
 
     if (unpermute_quads_files(quadinfn, ckdtinfn, quadoutfn, ckdtoutfn,
-                              args, argc)) {
+                              nthreads, args, argc)) {
         exit(-1);
     }
     return 0;
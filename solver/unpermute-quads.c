@@ -8,8 +8,10 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "kdtree.h"
+#include "an-alloc.h"
 #include "starutil.h"
 #include "quadfile.h"
 #include "fitsioutils.h"
@@ -18,11 +20,94 @@
 #include "log.h"
 #include "errors.h"
 #include "boilerplate.h"
+#include "os-features.h"
+
+// Quads are gathered through the permutation on several threads, in
+// blocks of this many, and written out a round of blocks at a time.
+#define GATHER_BLOCK 4096
+#define GATHER_ROUND_BLOCKS 256
+
+typedef struct {
+    const uint32_t* quadsin;
+    int nquadsin;
+    const u32* perm;
+    int dimquads;
+    uint32_t* buf;
+    int q0;
+    int nquads;
+    int nblocks;
+    int next;
+    int failed;
+} gather_t;
+
+static void* gather_worker(void* arg) {
+    gather_t* g = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED)) < g->nblocks) {
+        int i0 = b * GATHER_BLOCK;
+        int i1 = MIN(g->nquads, i0 + GATHER_BLOCK);
+        int i;
+        for (i=i0; i<i1; i++) {
+            int ind = g->perm ? (int)g->perm[g->q0 + i] : g->q0 + i;
+            if (ind < 0 || ind >= g->nquadsin) {
+                ERROR("Requested quad %i, but number of quads is %i",
+                      ind, g->nquadsin);
+                __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            memcpy(g->buf + (size_t)i * g->dimquads,
+                   g->quadsin + (size_t)ind * g->dimquads,
+                   g->dimquads * sizeof(uint32_t));
+        }
+    }
+    return NULL;
+}
+
+static int gather_quads(quadfile_t* quadin, codetree_t* treein,
+                        quadfile_t* quadout, int nthreads) {
+    gather_t g;
+    pthread_t* threads;
+    int N = codetree_N(treein);
+    int roundquads = GATHER_BLOCK * GATHER_ROUND_BLOCKS;
+    int t;
+
+    memset(&g, 0, sizeof(gather_t));
+    g.quadsin = quadin->quadarray;
+    g.nquadsin = quadin->numquads;
+    g.perm = treein->tree->perm;
+    g.dimquads = quadin->dimquads;
+    g.buf = malloc((size_t)MIN(roundquads, MAX(N, 1)) * g.dimquads * sizeof(uint32_t));
+    nthreads = MAX(1, nthreads);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (g.q0=0; g.q0<N; g.q0+=roundquads) {
+        int nstarted = 0;
+        g.nquads = MIN(roundquads, N - g.q0);
+        g.nblocks = (g.nquads + GATHER_BLOCK - 1) / GATHER_BLOCK;
+        g.next = 0;
+        for (t=1; t<MIN(nthreads, g.nblocks); t++) {
+            if (pthread_create(threads + nstarted, NULL, gather_worker, &g))
+                break;
+            nstarted++;
+        }
+        gather_worker(&g);
+        for (t=0; t<nstarted; t++)
+            pthread_join(threads[t], NULL);
+        if (g.failed)
+            break;
+        if (quadfile_write_quads(quadout, g.buf, g.nquads)) {
+            ERROR("Failed to write quad entries");
+            g.failed = 1;
+            break;
+        }
+    }
+    free(threads);
+    free(g.buf);
+    return g.failed ? -1 : 0;
+}
 
 int unpermute_quads(quadfile_t* quadin, codetree_t* treein,
                     quadfile_t* quadout, codetree_t** p_treeout,
-                    char** args, int argc) {
-    int i;
+                    int nthreads, char** args, int argc) {
     qfits_header* codehdr;
     qfits_header* hdr;
     int healpix;
@@ -83,18 +168,8 @@ int unpermute_quads(quadfile_t* quadin, codetree_t* treein,
         return -1;
     }
 
-    for (i=0; i<codetree_N(treein); i++) {
-        unsigned int stars[quadin->dimquads];
-        int ind = codetree_get_permuted(treein, i);
-        if (quadfile_get_stars(quadin, ind, stars)) {
-            ERROR("Failed to read quad entry");
-            return -1;
-        }
-        if (quadfile_write_quad(quadout, stars)) {
-            ERROR("Failed to write quad entry");
-            return -1;
-        }
-    }
+    if (gather_quads(quadin, treein, quadout, nthreads))
+        return -1;
 
     if (quadfile_fix_header(quadout)) {
         ERROR("Failed to fix quadfile header");
@@ -102,7 +177,7 @@ int unpermute_quads(quadfile_t* quadin, codetree_t* treein,
     }
 
     treeout = codetree_new();
-    treeout->tree = malloc(sizeof(kdtree_t));
+    treeout->tree = an_alloc_malloc(AN_ALLOC_LIBKD, sizeof(kdtree_t));
     memcpy(treeout->tree, treein->tree, sizeof(kdtree_t));
     treeout->tree->perm = NULL;
 
@@ -131,7 +206,7 @@ int unpermute_quads(quadfile_t* quadin, codetree_t* treein,
 
 int unpermute_quads_files(const char* quadinfn, const char* ckdtinfn,
                           const char* quadoutfn, const char* ckdtoutfn,
-                          char** args, int argc) {
+                          int nthreads, char** args, int argc) {
     quadfile_t* quadin;
     quadfile_t* quadout;
     codetree_t* treein;
@@ -158,7 +233,8 @@ int unpermute_quads_files(const char* quadinfn, const char* ckdtinfn,
         return -1;
     }
 
-    if (unpermute_quads(quadin, treein, quadout, &treeout, args, argc)) {
+    if (unpermute_quads(quadin, treein, quadout, &treeout, nthreads,
+                        args, argc)) {
         return -1;
     }
 
@@ -176,7 +252,7 @@ int unpermute_quads_files(const char* quadinfn, const char* ckdtinfn,
         return -1;
     }
 
-    free(treein->tree);
+    an_alloc_free(AN_ALLOC_LIBKD, treein->tree);
     treein->tree = NULL;
     codetree_close(treein);
     return 0;
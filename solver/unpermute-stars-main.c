@@ -19,7 +19,7 @@
 #include "errors.h"
 #include "unpermute-stars.h"
 
-static const char* OPTIONS = "hs:q:S:Q:wcv";
+static const char* OPTIONS = "hs:q:S:Q:wcvt:";
 
 void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -30,6 +30,7 @@ void printHelp(char* progname) {
            "    -Q <output-quads-filename>\n"
            "   [-w]: store sweep number in output star kdtree file.\n"
            "   [-c]: check values\n"
+           "   [-t <threads>]: number of threads (default 1)\n"
            "   [-v]: more verbose\n"
            "\n", progname);
 }
@@ -45,6 +46,7 @@ int main(int argc, char **args) {
     anbool dosweeps = FALSE;
     anbool check = FALSE;
     int loglvl = LOG_MSG;
+    int nthreads = 1;
 
     while ((argchar = getopt (argc, args, OPTIONS)) != -1)
         switch (argchar) {
@@ -69,6 +71,9 @@ int main(int argc, char **args) {
         case 'w':
             dosweeps = TRUE;
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         case '?':
             ERROR("Unknown option `-%c'.\n", optopt);
         case 'h':
@@ -87,7 +92,7 @@ int main(int argc, char **args) {
     }
 
     if (unpermute_stars_files(skdtinfn, quadinfn, skdtoutfn, quadoutfn,
-                              dosweeps, check, args, argc)) {
+                              dosweeps, check, nthreads, args, argc)) {
         exit(-1);
     }
     return 0;
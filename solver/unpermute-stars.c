@@ -9,8 +9,10 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "kdtree.h"
+#include "an-alloc.h"
 #include "starutil.h"
 #include "quadfile.h"
 #include "fitsioutils.h"
@@ -19,10 +21,93 @@
 #include "boilerplate.h"
 #include "log.h"
 #include "errors.h"
+#include "os-features.h"
+
+// Quads are renumbered on several threads, in blocks of this many, and
+// written out a round of blocks at a time.
+#define RENUMBER_BLOCK 4096
+#define RENUMBER_ROUND_BLOCKS 256
+
+typedef struct {
+    const uint32_t* quadsin;
+    const int* inverse_perm;
+    int nstars;
+    int dimquads;
+    uint32_t* buf;
+    int q0;
+    int nquads;
+    int nblocks;
+    int next;
+    int failed;
+} renumber_t;
+
+static void* renumber_worker(void* arg) {
+    renumber_t* r = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->nblocks) {
+        size_t i0 = (size_t)b * RENUMBER_BLOCK * r->dimquads;
+        size_t i1 = (size_t)MIN(r->nquads, (b+1) * RENUMBER_BLOCK) * r->dimquads;
+        const uint32_t* in = r->quadsin + (size_t)r->q0 * r->dimquads;
+        size_t i;
+        for (i=i0; i<i1; i++) {
+            if (in[i] >= (uint32_t)r->nstars) {
+                ERROR("Star ID %i is out of bounds: num stars %i", in[i], r->nstars);
+                __atomic_store_n(&r->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            r->buf[i] = r->inverse_perm[in[i]];
+        }
+    }
+    return NULL;
+}
+
+static int renumber_quads(quadfile_t* qfin, const int* inverse_perm, int nstars,
+                          quadfile_t* qfout, int nthreads) {
+    renumber_t r;
+    pthread_t* threads;
+    int N = qfin->numquads;
+    int roundquads = RENUMBER_BLOCK * RENUMBER_ROUND_BLOCKS;
+    int t;
+
+    memset(&r, 0, sizeof(renumber_t));
+    r.quadsin = qfin->quadarray;
+    r.inverse_perm = inverse_perm;
+    r.nstars = nstars;
+    r.dimquads = qfin->dimquads;
+    r.buf = malloc((size_t)MIN(roundquads, MAX(N, 1)) * r.dimquads * sizeof(uint32_t));
+    nthreads = MAX(1, nthreads);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (r.q0=0; r.q0<N; r.q0+=roundquads) {
+        int nstarted = 0;
+        r.nquads = MIN(roundquads, N - r.q0);
+        r.nblocks = (r.nquads + RENUMBER_BLOCK - 1) / RENUMBER_BLOCK;
+        r.next = 0;
+        for (t=1; t<MIN(nthreads, r.nblocks); t++) {
+            if (pthread_create(threads + nstarted, NULL, renumber_worker, &r))
+                break;
+            nstarted++;
+        }
+        renumber_worker(&r);
+        for (t=0; t<nstarted; t++)
+            pthread_join(threads[t], NULL);
+        if (r.failed)
+            break;
+        if (quadfile_write_quads(qfout, r.buf, r.nquads)) {
+            ERROR("Failed to write quadfile entries.\n");
+            r.failed = 1;
+            break;
+        }
+        logmsg(".");
+    }
+    logmsg("\n");
+    free(threads);
+    free(r.buf);
+    return r.failed ? -1 : 0;
+}
 
 int unpermute_stars(startree_t* treein, quadfile_t* qfin,
                     startree_t** p_treeout, quadfile_t* qfout,
-                    anbool dosweeps, anbool check,
+                    anbool dosweeps, anbool check, int nthreads,
                     char** args, int argc) {
     startree_t* treeout;
     int i;
@@ -30,7 +115,6 @@ int unpermute_stars(startree_t* treein, quadfile_t* qfin,
     int healpix = -1;
     int hpnside = 0;
     int starhp = -1;
-    int lastgrass;
     qfits_header* qouthdr;
     qfits_header* qinhdr;
     anbool allsky;
@@ -106,27 +190,8 @@ int unpermute_stars(startree_t* treein, quadfile_t* qfin,
     }
 
 
-    lastgrass = 0;
-    for (i=0; i<qfin->numquads; i++) {
-        int j;
-        unsigned int stars[qfin->dimquads];
-        if (i*80/qfin->numquads != lastgrass) {
-            logmsg(".");
-            fflush(stdout);
-            lastgrass = i*80/qfin->numquads;
-        }
-        if (quadfile_get_stars(qfin, i, stars)) {
-            ERROR("Failed to read quadfile entry.\n");
-            return -1;
-        }
-        for (j=0; j<qfin->dimquads; j++)
-            stars[j] = treein->inverse_perm[stars[j]];
-        if (quadfile_write_quad(qfout, stars)) {
-            ERROR("Failed to write quadfile entry.\n");
-            return -1;
-        }
-    }
-    logmsg("\n");
+    if (renumber_quads(qfin, treein->inverse_perm, N, qfout, nthreads))
+        return -1;
 
 
     if (quadfile_fix_header(qfout)) {
@@ -135,7 +200,7 @@ int unpermute_stars(startree_t* treein, quadfile_t* qfin,
     }
 
     treeout = startree_new();
-    treeout->tree = malloc(sizeof(kdtree_t));
+    treeout->tree = an_alloc_malloc(AN_ALLOC_LIBKD, sizeof(kdtree_t));
     memcpy(treeout->tree, treein->tree, sizeof(kdtree_t));
     treeout->tree->perm = NULL;
 
@@ -189,7 +254,7 @@ int unpermute_stars(startree_t* treein, quadfile_t* qfin,
 }
 
 int unpermute_stars_tagalong(startree_t* treein,
-                             fitstable_t* tagout) {
+                             fitstable_t* tagout, int nthreads) {
     fitstable_t* tagin;
     qfits_header* tmphdr;
     int N;
@@ -209,7 +274,8 @@ int unpermute_stars_tagalong(startree_t* treein,
         ERROR("Failed to write tag-along table header");
         return -1;
     }
-    if (fitstable_copy_rows_data(tagin, (int*)treein->tree->perm, N, tagout)) {
+    if (fitstable_copy_rows_data_parallel(tagin, (int*)treein->tree->perm, N,
+                                          tagout, nthreads)) {
         ERROR("Failed to copy tag-along table rows from input to output");
         return -1;
     }
@@ -223,7 +289,7 @@ int unpermute_stars_tagalong(startree_t* treein,
 
 int unpermute_stars_files(const char* skdtinfn, const char* quadinfn,
                           const char* skdtoutfn, const char* quadoutfn,
-                          anbool dosweeps, anbool check,
+                          anbool dosweeps, anbool check, int nthreads,
                           char** args, int argc) {
     quadfile_t* qfin;
     quadfile_t* qfout;
@@ -255,7 +321,7 @@ int unpermute_stars_files(const char* skdtinfn, const char* quadinfn,
     }
 
     rtn = unpermute_stars(treein, qfin, &treeout, qfout,
-                          dosweeps, check, args, argc);
+                          dosweeps, check, nthreads, args, argc);
     if (rtn)
         return rtn;
 
@@ -277,7 +343,7 @@ int unpermute_stars_files(const char* skdtinfn, const char* quadinfn,
             tagout = fitstable_open_for_appending(skdtoutfn);
             tagout->table = fits_copy_table(tagin->table);
             tagout->table->nr = 0;
-            if (unpermute_stars_tagalong(treein, tagout)) {
+            if (unpermute_stars_tagalong(treein, tagout, nthreads)) {
                 ERROR("Failed to permute tag-along table");
                 return -1;
             }
@@ -291,7 +357,7 @@ int unpermute_stars_files(const char* skdtinfn, const char* quadinfn,
     quadfile_close(qfin);
     startree_close(treein);
     free(treeout->sweep);
-    free(treeout->tree);
+    an_alloc_free(AN_ALLOC_LIBKD, treeout->tree);
     treeout->tree = NULL;
     startree_close(treeout);
 
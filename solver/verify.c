@@ -5,11 +5,14 @@
 
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "verify.h"
+#include "index-heatmap.h"
 #include "permutedsort.h"
 #include "mathutil.h"
 #include "keywords.h"
@@ -17,6 +20,7 @@
 #include "sip-utils.h"
 #include "healpix.h"
 #include "datalog.h"
+#include "arena.h"
 
 #define DEBUGVERIFY 0
 
@@ -59,35 +63,311 @@ struct verify_s {
 };
 typedef struct verify_s verify_t;
 
+/*
+ Near-duplicate candidates (several quads matching the same patch of
+ sky) all search the star kdtree for nearly the same circle.  The cache
+ remembers, per index, the stars within a circle somewhat larger than
+ the one requested, so that later candidates whose circle falls inside
+ it can skip the kdtree search.
+
+ To avoid doing bigger searches for candidates that are scattered over
+ the sky, a circle is first recorded without any stars (a "ghost"); the
+ padded search happens only the second time a nearby circle is
+ requested.
+
+ The stars are kept in the order startree_search_for() returned them,
+ which is the order a search of any smaller circle would return them.
+ */
+#define VERIFY_CACHE_SIZE 32
+// Padding of the cached circles, as a fraction of the requested radius.
+#define VERIFY_CACHE_MARGIN 0.5
+
+struct verify_cache_entry {
+    const startree_t* skdt;
+    double center[3];
+    // requested radius (for ghosts) or the radius searched.
+    double radius;
+    anbool ghost;
+    double* xyz;
+    int* starid;
+    int N;
+    // for LRU replacement
+    int lastused;
+};
+
+struct verify_cache {
+    pthread_mutex_t lock;
+    struct verify_cache_entry entries[VERIFY_CACHE_SIZE];
+    int nentries;
+    int tick;
+};
+
+static struct verify_cache* verify_cache_new(void) {
+    struct verify_cache* c = calloc(1, sizeof(struct verify_cache));
+    if (!c)
+        return NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+static void verify_cache_free(struct verify_cache* c) {
+    int i;
+    if (!c)
+        return;
+    for (i=0; i<c->nentries; i++) {
+        free(c->entries[i].xyz);
+        free(c->entries[i].starid);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// Returns a free or least-recently-used entry.  Call with the lock held.
+static struct verify_cache_entry* verify_cache_slot(struct verify_cache* c) {
+    struct verify_cache_entry* e;
+    int i;
+    if (c->nentries < VERIFY_CACHE_SIZE)
+        e = c->entries + c->nentries++;
+    else {
+        e = c->entries;
+        for (i=1; i<c->nentries; i++)
+            if (c->entries[i].lastused < e->lastused)
+                e = c->entries + i;
+        free(e->xyz);
+        free(e->starid);
+    }
+    memset(e, 0, sizeof(struct verify_cache_entry));
+    e->lastused = c->tick++;
+    return e;
+}
+
+/*
+ Each thread's buffers for the index stars of the candidate it is
+ verifying, reused from one candidate to the next.
+ */
+static pthread_key_t star_results_key;
+static pthread_once_t star_results_key_once = PTHREAD_ONCE_INIT;
+
+static void free_star_results(void* v) {
+    startree_results_free_data(v);
+    free(v);
+}
+
+static void make_star_results_key(void) {
+    pthread_key_create(&star_results_key, free_star_results);
+}
+
+static startree_results_t* get_star_results(void) {
+    startree_results_t* res;
+    pthread_once(&star_results_key_once, make_star_results_key);
+    res = pthread_getspecific(star_results_key);
+    if (!res) {
+        res = calloc(1, sizeof(startree_results_t));
+        pthread_setspecific(star_results_key, res);
+    }
+    return res;
+}
+
+// Copies the stars of "e" within the circle into "res".
+static void verify_cache_copy(const struct verify_cache_entry* e,
+                              const double* center, double r2,
+                              startree_results_t* res) {
+    int i, N = 0;
+    res->N = 0;
+    if (startree_results_reserve(res, e->N, FALSE))
+        return;
+    for (i=0; i<e->N; i++) {
+        if (distsq(e->xyz + 3*i, center, 3) > r2)
+            continue;
+        memcpy(res->xyz + 3*N, e->xyz + 3*i, 3 * sizeof(double));
+        res->inds[N] = e->starid[i];
+        N++;
+    }
+    res->N = N;
+}
+
+/*
+ Finds the index stars within the circle, like startree_search_into(),
+ using the cache if possible.  Returns FALSE if the caller should do
+ the search itself.
+ */
+static anbool verify_cache_search(struct verify_cache* c,
+                                  const startree_t* skdt,
+                                  const double* center, double r2,
+                                  startree_results_t* res) {
+    struct verify_cache_entry* e;
+    double r = sqrt(r2);
+    double R;
+    anbool nearby = FALSE;
+    double* xyz;
+    int* starid;
+    int i, N;
+
+    pthread_mutex_lock(&c->lock);
+    for (i=0; i<c->nentries; i++) {
+        double d;
+        e = c->entries + i;
+        if (e->skdt != skdt)
+            continue;
+        d = sqrt(distsq(e->center, center, 3));
+        if (!e->ghost && (d + r <= e->radius)) {
+            e->lastused = c->tick++;
+            verify_cache_copy(e, center, r2, res);
+            pthread_mutex_unlock(&c->lock);
+            return TRUE;
+        }
+        if (d + r <= e->radius * (1.0 + VERIFY_CACHE_MARGIN))
+            nearby = TRUE;
+    }
+    if (!nearby) {
+        e = verify_cache_slot(c);
+        e->skdt = skdt;
+        memcpy(e->center, center, sizeof(e->center));
+        e->radius = r;
+        e->ghost = TRUE;
+        pthread_mutex_unlock(&c->lock);
+        return FALSE;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // Search a padded circle without holding the lock.
+    R = r * (1.0 + VERIFY_CACHE_MARGIN);
+    startree_search_for(skdt, center, R*R, &xyz, NULL, &starid, &N);
+
+    pthread_mutex_lock(&c->lock);
+    e = verify_cache_slot(c);
+    e->skdt = skdt;
+    memcpy(e->center, center, sizeof(e->center));
+    e->radius = R;
+    e->xyz = xyz;
+    e->starid = starid;
+    e->N = N;
+    verify_cache_copy(e, center, r2, res);
+    pthread_mutex_unlock(&c->lock);
+    return TRUE;
+}
+
+void verify_field_prefetch_index_stars(verify_field_t* vf,
+                                       const startree_t* skdt,
+                                       const double* center, double r2) {
+    struct verify_cache* c = vf->cache;
+    struct verify_cache_entry* e;
+    double* xyz;
+    int* starid;
+    int N;
+
+    if (!c)
+        return;
+    startree_search_for(skdt, center, r2, &xyz, NULL, &starid, &N);
+    pthread_mutex_lock(&c->lock);
+    e = verify_cache_slot(c);
+    e->skdt = skdt;
+    memcpy(e->center, center, sizeof(e->center));
+    e->radius = sqrt(r2);
+    e->xyz = xyz;
+    e->starid = starid;
+    e->N = N;
+    pthread_mutex_unlock(&c->lock);
+}
+
 static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas);
 
+// The grid row or column containing coordinate "x", clamped to the grid.
+static int grid_index(double x, double x0, double cell, int n) {
+    double i = floor((x - x0) / cell);
+    if (i < 0)
+        return 0;
+    if (i >= n)
+        return n-1;
+    return (int)i;
+}
+
+static int verify_field_grid_cell(const verify_field_t* vf, const double* xy) {
+    return grid_index(xy[1], vf->gridy0, vf->gridcell, vf->gridny) * vf->gridnx +
+        grid_index(xy[0], vf->gridx0, vf->gridcell, vf->gridnx);
+}
+
+/*
+ Buckets the field stars into a grid with about one star per cell.
+ */
+static int build_field_grid(verify_field_t* vf) {
+    int i, N, ncells;
+    double xlo, xhi, ylo, yhi, W, H;
+    int* counts;
+
+    N = starxy_n(vf->field);
+    xlo = ylo = LARGE_VAL;
+    xhi = yhi = -LARGE_VAL;
+    for (i=0; i<N; i++) {
+        xlo = MIN(xlo, vf->xy[2*i+0]);
+        xhi = MAX(xhi, vf->xy[2*i+0]);
+        ylo = MIN(ylo, vf->xy[2*i+1]);
+        yhi = MAX(yhi, vf->xy[2*i+1]);
+    }
+    if (!N)
+        xlo = xhi = ylo = yhi = 0.0;
+    W = xhi - xlo;
+    H = yhi - ylo;
+    vf->gridx0 = xlo;
+    vf->gridy0 = ylo;
+    if (W > 0 && H > 0)
+        vf->gridcell = sqrt(W * H / N);
+    else
+        vf->gridcell = MAX(MAX(W, H) / MAX(N, 1), 1.0);
+    vf->gridnx = MAX(1, (int)(W / vf->gridcell) + 1);
+    vf->gridny = MAX(1, (int)(H / vf->gridcell) + 1);
+    ncells = vf->gridnx * vf->gridny;
+
+    vf->gridstart = calloc(ncells + 1, sizeof(int));
+    vf->gridstars = malloc(MAX(N, 1) * sizeof(int));
+    vf->gridxy = malloc(MAX(N, 1) * 2 * sizeof(double));
+    counts = calloc(ncells, sizeof(int));
+    if (!vf->gridstart || !vf->gridstars || !vf->gridxy || !counts) {
+        free(counts);
+        return -1;
+    }
+    // counting sort by cell.
+    for (i=0; i<N; i++)
+        vf->gridstart[verify_field_grid_cell(vf, vf->xy + 2*i) + 1]++;
+    for (i=0; i<ncells; i++)
+        vf->gridstart[i+1] += vf->gridstart[i];
+    for (i=0; i<N; i++) {
+        int c = verify_field_grid_cell(vf, vf->xy + 2*i);
+        int k = vf->gridstart[c] + counts[c];
+        counts[c]++;
+        vf->gridstars[k] = i;
+        vf->gridxy[2*k+0] = vf->xy[2*i+0];
+        vf->gridxy[2*k+1] = vf->xy[2*i+1];
+    }
+    free(counts);
+    return 0;
+}
+
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
     verify_field_t* vf;
-    int Nleaf = 5;
 
-    vf = malloc(sizeof(verify_field_t));
+    vf = calloc(1, sizeof(verify_field_t));
     if (!vf) {
         fprintf(stderr, "Failed to allocate space for a verify_field_t().\n");
         return NULL;
     }
     vf->field = fieldxy;
-    // Note on kdtree type: I tried U32 (duu) but it was marginally slower.
-    // I didn't try U16 (dss) because we need a fair bit of accuracy here.
-    // Make a copy of the field objects, because we're going to build a
-    // kdtree out of them and that shuffles their order.
-    vf->fieldcopy = starxy_copy_xy(fieldxy);
     vf->xy = starxy_copy_xy(fieldxy);
-    if (!vf->fieldcopy || !vf->xy) {
+    if (!vf->xy) {
         fprintf(stderr, "Failed to copy the field.\n");
         return NULL;
     }
-    // Build a tree out of the field objects (in pixel space)
-    vf->ftree = kdtree_build(NULL, vf->fieldcopy, starxy_n(vf->field),
-                             2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    // Bucket the field objects (in pixel space)
+    if (build_field_grid(vf)) {
+        fprintf(stderr, "Failed to build the field grid.\n");
+        verify_field_free(vf);
+        return NULL;
+    }
 
     vf->do_uniformize = TRUE;
     vf->do_dedup = TRUE;
     vf->do_ror = TRUE;
+    vf->cache = verify_cache_new();
 
     return vf;
 }
@@ -95,9 +375,11 @@ verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
 void verify_field_free(verify_field_t* vf) {
     if (!vf)
         return;
-    kdtree_free(vf->ftree);
+    verify_cache_free(vf->cache);
+    free(vf->gridstart);
+    free(vf->gridstars);
+    free(vf->gridxy);
     free(vf->xy);
-    free(vf->fieldcopy);
     free(vf);
 }
 
@@ -159,6 +441,144 @@ static double logd_at(double distractor, int mu, int NR, double logbg) {
     return log(distractor + (1.0-distractor)*mu / (double)NR) + logbg;
 }
 
+static anbool exact_loglik = FALSE;
+
+void verify_set_exact(anbool exact) {
+    exact_loglik = exact;
+}
+
+/*
+ The "fast" version of real_verify_star_lists() matches the test stars
+ in blocks of VERIFY_BLOCK: the reference and test stars are copied into
+ separate x, y (and sigma^2) arrays, and the nearest-neighbour distances
+ and foreground log-likelihoods for the whole block are computed in
+ loops simple enough for the compiler to vectorize.  With more than
+ VERIFY_BRUTE_NR reference stars, the nearest neighbours are found with
+ the kdtree instead.
+ */
+#define VERIFY_BLOCK 64
+#define VERIFY_BRUTE_NR 256
+
+struct verify_block {
+    // reference stars, in "refcopy" order.
+    double* rx;
+    double* ry;
+    // the current block of test stars.
+    int n;
+    double tx[VERIFY_BLOCK];
+    double ty[VERIFY_BLOCK];
+    double sig2[VERIFY_BLOCK];
+    double d2[VERIFY_BLOCK];
+    // nearest reference star (within 5 sigma), or -1.
+    int refi[VERIFY_BLOCK];
+    double logfg[VERIFY_BLOCK];
+};
+typedef struct verify_block verify_block_t;
+
+/*
+ log(x) for positive, normal x, in a form that vectorizes: x = 2^k z
+ with z in [sqrt(1/2), sqrt(2)), and log(z) = 2 atanh(s) with
+ s = (z-1)/(z+1), |s| < 0.172.  Accurate to a few units in the last
+ place.
+ */
+static double fast_log(double x) {
+    const uint64_t off = 0x3fe6a09e667f3bcdULL; // sqrt(1/2)
+    const double ln2hi = 6.93147180369123816490e-01;
+    const double ln2lo = 1.90821492927058770002e-10;
+    union { double d; uint64_t i; } u;
+    uint64_t tmp;
+    double k, z, s, s2, p;
+    u.d = x;
+    tmp = u.i - off;
+    k = (double)(int)((int64_t)tmp >> 52);
+    u.i -= tmp & (0xfffULL << 52);
+    z = u.d;
+    s = (z - 1.0) / (z + 1.0);
+    s2 = s * s;
+    p = 2.0/21.0;
+    p = p * s2 + 2.0/19.0;
+    p = p * s2 + 2.0/17.0;
+    p = p * s2 + 2.0/15.0;
+    p = p * s2 + 2.0/13.0;
+    p = p * s2 + 2.0/11.0;
+    p = p * s2 + 2.0/9.0;
+    p = p * s2 + 2.0/7.0;
+    p = p * s2 + 2.0/5.0;
+    p = p * s2 + 2.0/3.0;
+    return k * ln2hi + (s * (2.0 + p * s2) + k * ln2lo);
+}
+
+/*
+ Finds the nearest reference star and foreground log-likelihood for
+ test stars [i0, i0 + n) (in "testperm" order).
+ */
+static void verify_match_block(verify_block_t* b, const verify_t* v,
+                               const kdtree_t* rtree, int i0, int n,
+                               double distractors) {
+    double logc = (1.0 - distractors) / (2.0 * M_PI * v->NR);
+    double arg[VERIFY_BLOCK];
+    anbool normal = TRUE;
+    int i, j;
+
+    b->n = n;
+    for (i=0; i<n; i++) {
+        int ti = v->testperm[i0 + i];
+        b->tx[i] = v->testxy[2*ti + 0];
+        b->ty[i] = v->testxy[2*ti + 1];
+        b->sig2[i] = v->testsigma[ti];
+    }
+
+    if (rtree) {
+        double txy[2 * VERIFY_BLOCK];
+        for (i=0; i<n; i++) {
+            txy[2*i + 0] = b->tx[i];
+            txy[2*i + 1] = b->ty[i];
+            arg[i] = b->sig2[i] * 25.0;
+        }
+        if (kdtree_nn_batch(rtree, txy, n, arg, b->refi, b->d2)) {
+            for (i=0; i<n; i++)
+                b->refi[i] = kdtree_nearest_neighbour_within(rtree, txy + 2*i,
+                                                             arg[i], b->d2 + i);
+        }
+        for (i=0; i<n; i++)
+            if (b->refi[i] != -1)
+                b->refi[i] = kdtree_permute(rtree, b->refi[i]);
+    } else {
+        // brute force, looping over the block in the inner loop.
+        for (i=0; i<n; i++) {
+            b->d2[i] = b->sig2[i] * 25.0;
+            b->refi[i] = -1;
+        }
+        for (j=0; j<v->NR; j++) {
+            double rx = b->rx[j];
+            double ry = b->ry[j];
+            for (i=0; i<n; i++) {
+                double dx = b->tx[i] - rx;
+                double dy = b->ty[i] - ry;
+                double d2 = dx*dx + dy*dy;
+                anbool closer = (d2 <= b->d2[i]);
+                b->d2[i] = (closer ? d2 : b->d2[i]);
+                b->refi[i] = (closer ? j : b->refi[i]);
+            }
+        }
+    }
+
+    // peak value of the Gaussian, and the foreground at the NN.
+    for (i=0; i<n; i++) {
+        arg[i] = logc / b->sig2[i];
+        normal &= (arg[i] >= DBL_MIN) & (arg[i] <= DBL_MAX);
+    }
+    if (normal)
+        for (i=0; i<n; i++)
+            b->logfg[i] = fast_log(arg[i]) - b->d2[i] / (2.0 * b->sig2[i]);
+    else
+        for (i=0; i<n; i++)
+            b->logfg[i] = log(arg[i]) - b->d2[i] / (2.0 * b->sig2[i]);
+    for (i=0; i<n; i++)
+        if (b->refi[i] == -1)
+            b->logfg[i] = -LARGE_VAL;
+}
+
 static int get_xy_bin(const double* xy,
                       double fieldW, double fieldH,
                       int nw, int nh) {
@@ -472,8 +892,11 @@ static double real_verify_star_lists(verify_t* v,
     int* theta = NULL;
     int mu;
     int* rperm;
+    anbool fast = !exact_loglik;
+    verify_block_t blk;
+    int logd_mu;
 
-    if (!v->NR || !v->NT) {
+    if ((v->NR <= 0) || (v->NT <= 0)) {
         logerr("real_verify_star_lists: NR=%i, NT=%i\n", v->NR, v->NT);
         return -LARGE_VAL;
     }
@@ -492,7 +915,18 @@ static double real_verify_star_lists(verify_t* v,
         refcopy[2*i+0] = v->refxy[2*ri+0];
         refcopy[2*i+1] = v->refxy[2*ri+1];
     }
-    rtree = kdtree_build(NULL, refcopy, v->NR, 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    rtree = NULL;
+    if (fast && (v->NR <= VERIFY_BRUTE_NR)) {
+        blk.rx = malloc(v->NR * sizeof(double));
+        blk.ry = malloc(v->NR * sizeof(double));
+        for (i=0; i<v->NR; i++) {
+            blk.rx[i] = refcopy[2*i+0];
+            blk.ry[i] = refcopy[2*i+1];
+        }
+    } else {
+        blk.rx = blk.ry = NULL;
+        rtree = kdtree_build(NULL, refcopy, v->NR, 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    }
 
     rmatches = malloc(v->NR * sizeof(int));
     for (i=0; i<v->NR; i++)
@@ -522,6 +956,8 @@ static double real_verify_star_lists(verify_t* v,
     besti = -1;
     logodds = 0.0;
     mu = 0;
+    logd = logd_at(distractors, mu, v->NR, logbg);
+    logd_mu = mu;
     for (i=0; i<v->NT; i++) {
         const double* testxy;
         double sig2;
@@ -532,38 +968,52 @@ static double real_verify_star_lists(verify_t* v,
         double logfg;
         int ti;
 
-        ti = v->testperm[i];
-        testxy = v->testxy + 2*ti;
-        sig2 = v->testsigma[ti];
+        if (fast) {
+            int k = i % VERIFY_BLOCK;
+            if (!k)
+                verify_match_block(&blk, v, rtree, i,
+                                   MIN(VERIFY_BLOCK, v->NT - i), distractors);
+            // "logd" only changes when "mu" does.
+            if (mu != logd_mu) {
+                logd = logd_at(distractors, mu, v->NR, logbg);
+                logd_mu = mu;
+            }
+            refi = blk.refi[k];
+            logfg = blk.logfg[k];
+        } else {
+            ti = v->testperm[i];
+            testxy = v->testxy + 2*ti;
+            sig2 = v->testsigma[ti];
 
-        logd = logd_at(distractors, mu, v->NR, logbg);
+            logd = logd_at(distractors, mu, v->NR, logbg);
 
-        debug2("\n");
-        debug2("test star %i: (%.1f,%.1f), sigma: %.1f\n", i, testxy[0], testxy[1], sqrt(sig2));
-
-        // find nearest ref star (within 5 sigma)
-        tmpi = kdtree_nearest_neighbour_within(rtree, testxy, sig2 * 25.0, &d2);
-        if (tmpi == -1) {
-            // no nearest neighbour within range.
-            debug2("  No nearest neighbour.\n");
-            refi = -1;
-            logfg = -LARGE_VAL;
-        } else {
-            double loggmax;
-            // Note that "refi" is w.r.t. the "refcopy" array (not the original data).
-            refi = kdtree_permute(rtree, tmpi);
-            // peak value of the Gaussian
-            loggmax = log((1.0 - distractors) / (2.0 * M_PI * sig2 * v->NR));
-            // FIXME - do something with uninformative hits?
-            // these should be eliminated by RoR filtering...
-            if (loggmax < logbg)
-                debug2("  This star is uninformative: peak %.1f, bg %.1f.\n", loggmax, logbg);
-
-            // value of the foreground Gaussian
-            logfg = loggmax - d2 / (2.0 * sig2);
+            debug2("\n");
+            debug2("test star %i: (%.1f,%.1f), sigma: %.1f\n", i, testxy[0], testxy[1], sqrt(sig2));
+
+            // find nearest ref star (within 5 sigma)
+            tmpi = kdtree_nearest_neighbour_within(rtree, testxy, sig2 * 25.0, &d2);
+            if (tmpi == -1) {
+                // no nearest neighbour within range.
+                debug2("  No nearest neighbour.\n");
+                refi = -1;
+                logfg = -LARGE_VAL;
+            } else {
+                double loggmax;
+                // Note that "refi" is w.r.t. the "refcopy" array (not the original data).
+                refi = kdtree_permute(rtree, tmpi);
+                // peak value of the Gaussian
+                loggmax = log((1.0 - distractors) / (2.0 * M_PI * sig2 * v->NR));
+                // FIXME - do something with uninformative hits?
+                // these should be eliminated by RoR filtering...
+                if (loggmax < logbg)
+                    debug2("  This star is uninformative: peak %.1f, bg %.1f.\n", loggmax, logbg);
+
+                // value of the foreground Gaussian
+                logfg = loggmax - d2 / (2.0 * sig2);
 			
-            debug2("  NN: ref star %i, dist %.2f, sigmas: %.3f, logfg: %.1f (%.1f above distractor, %.1f above bg)\n",
-                   refi, sqrt(d2), sqrt(d2 / sig2), logfg, logfg - logd, logfg - logbg);
+                debug2("  NN: ref star %i, dist %.2f, sigmas: %.3f, logfg: %.1f (%.1f above distractor, %.1f above bg)\n",
+                       refi, sqrt(d2), sqrt(d2 / sig2), logfg, logfg - logd, logfg - logbg);
+            }
         }
 
         if (logfg < logd) {
@@ -767,6 +1217,8 @@ static double real_verify_star_lists(verify_t* v,
     free(rprobs);
 
     kdtree_free(rtree);
+    free(blk.rx);
+    free(blk.ry);
     free(refcopy);
 
     return bestlogodds;
@@ -777,6 +1229,7 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
                             double fieldW, double fieldH,
                             double** p_indexradec,
                             double** indexpix, int** p_starids, int* p_nindex) {
+    startree_results_t* stars = get_star_results();
     double* indxyz;
     int i, N, NI;
     int* sweep;
@@ -790,20 +1243,22 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
     assert(sip || tan);
 
     // Find all index stars within the bounding circle of the field.
-    startree_search_for(skdt, fieldcenter, fieldr2, &indxyz, NULL, &starid, &N);
-
-    if (!indxyz) {
+    N = (stars ? startree_search_into(skdt, fieldcenter, fieldr2, FALSE,
+                                      stars) : 0);
+    if (N <= 0) {
         // no stars in range.
         *p_nindex = 0;
         return;
     }
+    indxyz = stars->xyz;
 
     // Find index stars within the rectangular field.
     inbounds = sip_filter_stars_in_field(sip, tan, indxyz, NULL, N, indexpix,
                                          NULL, &NI);
     // Apply the permutation now, so that "indexpix" and "starid" stay in sync:
     // indexpix is already in the "inbounds" ordering.
-    permutation_apply(inbounds, NI, starid, starid, sizeof(int));
+    starid = malloc(MAX(NI, 1) * sizeof(int));
+    permutation_apply(inbounds, NI, stars->inds, starid, sizeof(int));
 
     // Compute index RA,Decs if requested.
     if (p_indexradec) {
@@ -814,7 +1269,6 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
             xyzarr2radecdegarr(indxyz + 3*inbounds[i], radec + 2*i);
         *p_indexradec = radec;
     }
-    free(indxyz);
     free(inbounds);
 
     // Each index star has a "sweep number" assigned during index building;
@@ -826,21 +1280,22 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
     perm = permuted_sort(sweep, sizeof(int), compare_ints_asc, NULL, NI);
     free(sweep);
 
-    if (indexpix) {
-        permutation_apply(perm, NI, *indexpix, *indexpix, 2 * sizeof(double));
-        *indexpix = realloc(*indexpix, NI * 2 * sizeof(double));
+    {
+        void* arrays[] = { indexpix ? *indexpix : NULL,
+                           p_starids ? starid : NULL,
+                           p_indexradec ? radec : NULL };
+        int sizes[] = { 2 * sizeof(double), sizeof(int), 2 * sizeof(double) };
+        permutation_apply_multi(perm, NI, arrays, sizes, 3);
     }
 
-    if (p_starids) {
-        permutation_apply(perm, NI, starid, starid, sizeof(int));
-        starid = realloc(starid, NI * sizeof(int));
+    if (indexpix)
+        *indexpix = realloc(*indexpix, NI * 2 * sizeof(double));
+
+    if (p_starids)
         *p_starids = starid;
-    } else
+    else
         free(starid);
 
-    if (p_indexradec)
-        permutation_apply(perm, NI, radec, radec, 2 * sizeof(double));
-
     free(perm);
 
     *p_nindex = NI;
@@ -856,9 +1311,7 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
 static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas) {
     anbool* keepers = NULL;
     int i, j, ti;
-    kdtree_qres_t* res = NULL;
     double nsig2 = nsigmas*nsigmas;
-    int options = KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_SMALL_RADIUS;
 
     // default to FALSE
     keepers = calloc(v->NTall, sizeof(anbool));
@@ -868,26 +1321,40 @@ static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t*
     }
     for (i=0; i<v->NT; i++) {
         double sxy[2];
+        double r2, r;
+        int ix, iy, ixlo, ixhi, iylo, iyhi;
         ti = v->testperm[i];
         if (!keepers[ti])
             continue;
         starxy_get(vf->field, ti, sxy);
-        res = kdtree_rangesearch_options_reuse(vf->ftree, res, sxy, nsig2 * v->testsigma[ti], options);
-        for (j=0; j<res->nres; j++) {
-            int ind = res->inds[j];
-            if (ind > i) {
-                keepers[ind] = FALSE;
-                if (DEBUGVERIFY) {
-                    double otherxy[2];
-                    starxy_get(vf->field, ind, otherxy);
-                    logdebug("Field star %i at %g,%g: is close to field star %i at %g,%g.  dist is %g, sigma is %g\n", 
-                             i, sxy[0], sxy[1], ind, otherxy[0], otherxy[1],
-                             sqrt(distsq(sxy, otherxy, 2)), sqrt(nsig2 * v->testsigma[ti]));
+        r2 = nsig2 * v->testsigma[ti];
+        r = sqrt(r2);
+        // the grid cells touching the circle.
+        ixlo = grid_index(sxy[0] - r, vf->gridx0, vf->gridcell, vf->gridnx);
+        ixhi = grid_index(sxy[0] + r, vf->gridx0, vf->gridcell, vf->gridnx);
+        iylo = grid_index(sxy[1] - r, vf->gridy0, vf->gridcell, vf->gridny);
+        iyhi = grid_index(sxy[1] + r, vf->gridy0, vf->gridcell, vf->gridny);
+        for (iy=iylo; iy<=iyhi; iy++) {
+            for (ix=ixlo; ix<=ixhi; ix++) {
+                int c = iy * vf->gridnx + ix;
+                for (j=vf->gridstart[c]; j<vf->gridstart[c+1]; j++) {
+                    double dx = sxy[0] - vf->gridxy[2*j+0];
+                    double dy = sxy[1] - vf->gridxy[2*j+1];
+                    int ind = vf->gridstars[j];
+                    if ((dx*dx + dy*dy > r2) || (ind <= i))
+                        continue;
+                    keepers[ind] = FALSE;
+                    if (DEBUGVERIFY) {
+                        double otherxy[2];
+                        starxy_get(vf->field, ind, otherxy);
+                        logdebug("Field star %i at %g,%g: is close to field star %i at %g,%g.  dist is %g, sigma is %g\n", 
+                                 i, sxy[0], sxy[1], ind, otherxy[0], otherxy[1],
+                                 sqrt(distsq(sxy, otherxy, 2)), sqrt(nsig2 * v->testsigma[ti]));
+                    }
                 }
             }
         }
     }
-    kdtree_free_query(res);
     return keepers;
 }
 
@@ -924,7 +1391,8 @@ void verify_uniformize_field(const double* xy,
                              int nw, int nh,
                              int** p_bincounts,
                              int** p_binids) {
-    il** lists;
+    il* lists;
+    arena_t* arena;
     int i,j,k,p;
     int* bincounts = NULL;
     int* binids = NULL;
@@ -934,9 +1402,14 @@ void verify_uniformize_field(const double* xy,
         *p_binids = binids;
     }
 
-    lists = malloc((size_t)nw * (size_t)nh * sizeof(il*));
+    // The bin lists only live for this call; take their blocks from an
+    // arena (big enough to hold them all, typically) rather than
+    // malloc'ing each one.
+    arena = arena_new((size_t)(nw * nh + N / 16 + 1) *
+                      (sizeof(bl_node) + 16 * sizeof(int)));
+    lists = malloc((size_t)nw * (size_t)nh * sizeof(il));
     for (i=0; i<(nw*nh); i++)
-        lists[i] = il_new(16);
+        il_init_arena(lists + i, 16, arena);
 
     // put the stars in the appropriate bins.
     debug2("Test star bins:\n");
@@ -946,7 +1419,7 @@ void verify_uniformize_field(const double* xy,
         ind = perm[i];
         bin = get_xy_bin(xy + 2*ind, fieldW, fieldH, nw, nh);
         debug2("%i ", bin);
-        il_append(lists[bin], ind);
+        il_append(lists + bin, ind);
     }
     debug2("\n");
 
@@ -954,7 +1427,7 @@ void verify_uniformize_field(const double* xy,
         // note the bin occupancies.
         bincounts = malloc((size_t)nw * (size_t)nh * sizeof(int));
         for (i=0; i<(nw*nh); i++) {
-            bincounts[i] = il_size(lists[i]);
+            bincounts[i] = il_size(lists + i);
             //logverb("bin %i has %i stars\n", i, bincounts[i]);
         }
         *p_bincounts = bincounts;
@@ -966,7 +1439,7 @@ void verify_uniformize_field(const double* xy,
         for (j=0; j<nh; j++) {
             for (i=0; i<nw; i++) {
                 int binid = j*nw + i;
-                il* lst = lists[binid];
+                il* lst = lists + binid;
                 if (k >= il_size(lst))
                     continue;
                 perm[p] = il_get(lst, k);
@@ -981,8 +1454,9 @@ void verify_uniformize_field(const double* xy,
     assert(p == N);
 
     for (i=0; i<(nw*nh); i++)
-        il_free(lists[i]);
+        il_remove_all(lists + i);
     free(lists);
+    arena_free(arena);
 }
 
 double* verify_uniformize_bin_centers(double fieldW, double fieldH,
@@ -1136,11 +1610,11 @@ static void fixup_theta(int* theta, double* allodds, int ibailed, int istopped,
     for (i=0; i<NRimage; i++)
         invrperm[v->refperm[i]] = i;
 
-    if (v->refstarid)
-        permutation_apply(v->refperm, NRimage, v->refstarid, v->refstarid, sizeof(int));
-    permutation_apply(v->refperm, NRimage, v->refxy, v->refxy, 2*sizeof(double));
-    if (refxyz)
-        permutation_apply(v->refperm, NRimage, refxyz, refxyz, 3*sizeof(double));
+    {
+        void* arrays[] = { v->refstarid, v->refxy, refxyz };
+        int sizes[] = { sizeof(int), 2*sizeof(double), 3*sizeof(double) };
+        permutation_apply_multi(v->refperm, NRimage, arrays, sizes, 3);
+    }
 
     // New v->refstarid[i] is old v->refstarid[ v->refperm[i] ]
 
@@ -1229,7 +1703,9 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     double* allodds = NULL;
     sip_t thewcs;
     int ibad, igood;
+    startree_results_t* stars;
     double* refxyz = NULL;
+    anbool* refok;
     int* sweep = NULL;
     verify_t the_v;
     verify_t* v = &the_v;
@@ -1287,9 +1763,21 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
      */
     assert(skdt->sweep);
     // Find all index stars within the bounding circle of the field.
-    startree_search_for(skdt, fieldcenter, fieldr2, &refxyz, NULL, &v->refstarid, &v->NRall);
+    // (into this thread's buffers, so the search allocates nothing.)
+    stars = get_star_results();
+    if (!stars)
+        goto bailout;
+    if (!vf || !vf->cache ||
+        !verify_cache_search(vf->cache, skdt, fieldcenter, fieldr2, stars)) {
+        startree_search_into(skdt, fieldcenter, fieldr2, FALSE, stars);
+        if (skdt->heatmap)
+            index_heatmap_touch_stars(skdt->heatmap, stars->inds, stars->N);
+    }
+    v->NRall = stars->N;
+    refxyz = stars->xyz;
+    v->refstarid = stars->inds;
     debug2("%i reference stars in the bounding circle\n", v->NRall);
-    if (!refxyz) {
+    if (!v->NRall) {
         // no stars in range.
         logverb("No reference stars in the bounding circle\n");
         goto bailout;
@@ -1298,15 +1786,18 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     // Find index stars within the rectangular field.
     v->refxy = malloc(v->NRall * 2 * sizeof(double));
     v->refperm = malloc(v->NRall * sizeof(int));
+    refok = malloc(v->NRall * sizeof(anbool));
+    sip_xyzarr2pixelxy_array(v->wcs, refxyz, v->NRall, v->refxy, refok);
     igood = 0;
     for (i=0; i<v->NRall; i++) {
-        if (!sip_xyzarr2pixelxy(v->wcs, refxyz+i*3, v->refxy+i*2, v->refxy+i*2 +1) ||
+        if (!refok[i] ||
             !sip_pixel_is_inside_image(v->wcs, v->refxy[i*2], v->refxy[i*2+1])) {
             continue;
         }
         v->refperm[igood] = i;
         igood++;
     }
+    free(refok);
     v->NR = igood;
     // We sort of want to forget about stars not within the image...
     // but we don't want to change NRall...
@@ -1462,12 +1953,13 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
 
         mo->theta = etheta;
         mo->matchodds = eodds;
-        mo->refxyz = refxyz;
-        refxyz = NULL;
+        // (the stars are in this thread's buffers.)
+        mo->refxyz = malloc(v->NRall * 3 * sizeof(double));
+        memcpy(mo->refxyz, refxyz, v->NRall * 3 * sizeof(double));
         mo->refxy = v->refxy;
         v->refxy = NULL;
-        mo->refstarid = v->refstarid;
-        v->refstarid = NULL;
+        mo->refstarid = malloc(v->NRall * sizeof(int));
+        memcpy(mo->refstarid, v->refstarid, v->NRall * sizeof(int));
         mo->testperm = v->testperm;
         v->testperm = NULL;
 
@@ -1475,7 +1967,6 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     }
 
  cleanup:
-    free(refxyz);
     free(theta);
     free(allodds);
     free(v->testperm);
@@ -1483,7 +1974,6 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     free(v->tbadguys);
     free(v->refperm);
     free(v->refxy);
-    free(v->refstarid);
     free(v->badguys);
     return;
 
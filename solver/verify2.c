@@ -109,11 +109,13 @@ void verify_get_all_matches(const double* refxys, int NR,
         logverb("test star %i: (%.1f,%.1f), sigma: %.1f\n", i, testxy[0], testxy[1], sqrt(sig2));
 
         // find all ref stars within nsigma.
-        res = kdtree_rangesearch_options(rtree, testxy, sig2*nsigma*nsigma,
-                                         KD_OPTIONS_SORT_DISTS | KD_OPTIONS_SMALL_RADIUS);
+        res = kdtree_rangesearch_options_reuse(rtree, kdtree_qres_acquire(),
+                                               testxy, sig2*nsigma*nsigma,
+                                               KD_OPTIONS_SORT_DISTS | KD_OPTIONS_SMALL_RADIUS |
+                                               KD_OPTIONS_NO_RESIZE_RESULTS);
 
         if (res->nres == 0) {
-            kdtree_free_query(res);
+            kdtree_qres_release(res);
             continue;
         }
 
@@ -143,7 +145,7 @@ void verify_get_all_matches(const double* refxys, int NR,
             dl_append(problist[i], logfg);
         }
 
-        kdtree_free_query(res);
+        kdtree_qres_release(res);
     }
     kdtree_free(rtree);
     free(refcopy);
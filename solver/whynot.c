@@ -1184,7 +1184,8 @@ int main(int argc, char** args) {
             }
 
             plotstuff_free(pargs);
-            free(itree->data.any);
+            if (!itree->free_data)
+                free(itree->data.any);
             kdtree_free(itree);
         }
 
@@ -0,0 +1,164 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+#include "an-alloc.h"
+#include "log.h"
+
+static size_t libc_usable_size(void* ptr) {
+#if defined(__GLIBC__)
+    return malloc_usable_size(ptr);
+#elif defined(__APPLE__)
+    return malloc_size(ptr);
+#else
+    return 0;
+#endif
+}
+
+static const an_allocator_t libc_backend = {
+    malloc, calloc, realloc, free,
+#if defined(__GLIBC__) || defined(__APPLE__)
+    libc_usable_size,
+#else
+    NULL,
+#endif
+};
+
+static const an_allocator_t* backend = &libc_backend;
+static an_allocator_t custom_backend;
+
+// the last element is the total.
+static int64_t current[AN_ALLOC_NSUBSYSTEMS + 1];
+static int64_t peak[AN_ALLOC_NSUBSYSTEMS + 1];
+static int64_t limit = 0;
+
+static const char* names[] = { "other", "libkd", "qfits", "solver" };
+
+void an_alloc_set_backend(const an_allocator_t* b) {
+    if (!b) {
+        backend = &libc_backend;
+        return;
+    }
+    custom_backend = *b;
+    backend = &custom_backend;
+}
+
+static void raise_peak(int64_t* p, int64_t val) {
+    int64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (val > old &&
+           !__atomic_compare_exchange_n(p, &old, val, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+}
+
+static void count(int subsystem, int64_t nbytes) {
+    int64_t c;
+    if (subsystem < 0 || subsystem >= AN_ALLOC_NSUBSYSTEMS)
+        subsystem = AN_ALLOC_OTHER;
+    c = __atomic_add_fetch(current + subsystem, nbytes, __ATOMIC_RELAXED);
+    if (nbytes > 0)
+        raise_peak(peak + subsystem, c);
+    c = __atomic_add_fetch(current + AN_ALLOC_NSUBSYSTEMS, nbytes, __ATOMIC_RELAXED);
+    if (nbytes > 0)
+        raise_peak(peak + AN_ALLOC_NSUBSYSTEMS, c);
+}
+
+static size_t usable_size(void* ptr) {
+    if (!ptr || !backend->usable_size)
+        return 0;
+    return backend->usable_size(ptr);
+}
+
+void* an_alloc_malloc(int subsystem, size_t size) {
+    void* p = backend->malloc(size);
+    if (p && backend->usable_size)
+        count(subsystem, usable_size(p));
+    return p;
+}
+
+void* an_alloc_calloc(int subsystem, size_t nmemb, size_t size) {
+    void* p = backend->calloc(nmemb, size);
+    if (p && backend->usable_size)
+        count(subsystem, usable_size(p));
+    return p;
+}
+
+void* an_alloc_realloc(int subsystem, void* ptr, size_t size) {
+    size_t oldsize = usable_size(ptr);
+    void* p = backend->realloc(ptr, size);
+    // (a failed realloc leaves "ptr" as it was.)
+    if (backend->usable_size && (p || !size))
+        count(subsystem, (int64_t)usable_size(p) - (int64_t)oldsize);
+    return p;
+}
+
+char* an_alloc_strdup(int subsystem, const char* str) {
+    size_t n;
+    char* s;
+    if (!str)
+        return NULL;
+    n = strlen(str) + 1;
+    s = an_alloc_malloc(subsystem, n);
+    if (s)
+        memcpy(s, str, n);
+    return s;
+}
+
+void an_alloc_free(int subsystem, void* ptr) {
+    if (!ptr)
+        return;
+    if (backend->usable_size)
+        count(subsystem, -(int64_t)usable_size(ptr));
+    backend->free(ptr);
+}
+
+int64_t an_alloc_current(int subsystem) {
+    if (subsystem < 0 || subsystem > AN_ALLOC_NSUBSYSTEMS)
+        return 0;
+    return __atomic_load_n(current + subsystem, __ATOMIC_RELAXED);
+}
+
+int64_t an_alloc_peak(int subsystem) {
+    if (subsystem < 0 || subsystem > AN_ALLOC_NSUBSYSTEMS)
+        return 0;
+    return __atomic_load_n(peak + subsystem, __ATOMIC_RELAXED);
+}
+
+void an_alloc_reset_peaks(void) {
+    int i;
+    for (i=0; i<=AN_ALLOC_NSUBSYSTEMS; i++)
+        __atomic_store_n(peak + i, __atomic_load_n(current + i, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+}
+
+const char* an_alloc_subsystem_name(int subsystem) {
+    if (subsystem == AN_ALLOC_NSUBSYSTEMS)
+        return "total";
+    if (subsystem < 0 || subsystem > AN_ALLOC_NSUBSYSTEMS)
+        return NULL;
+    return names[subsystem];
+}
+
+void an_alloc_set_limit(int64_t bytes) {
+    limit = bytes;
+}
+
+int an_alloc_over_limit(void) {
+    return (limit > 0) && (an_alloc_current(AN_ALLOC_NSUBSYSTEMS) > limit);
+}
+
+void an_alloc_log_report(void) {
+    int i;
+    if (!backend->usable_size)
+        return;
+    for (i=0; i<=AN_ALLOC_NSUBSYSTEMS; i++)
+        logverb("Memory (%s): %.1f MB, peak %.1f MB\n", an_alloc_subsystem_name(i),
+                an_alloc_current(i) * 1e-6, an_alloc_peak(i) * 1e-6);
+}
@@ -11,6 +11,8 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "an-bool.h"
@@ -20,8 +22,19 @@
 #include "errors.h"
 #include "fitsioutils.h"
 #include "mathutil.h"
+#include "dimage.h"
 
-static const char* OPTIONS = "hi:o:Oe:p:m:IX:N:xnrsvML:H:";
+static const char* OPTIONS = "hi:o:Oe:p:m:IX:N:xnrsvML:H:j:";
+
+// Except for the ordinal transform, which needs the whole image, the
+// image is read in bands of about this many pixels per thread...
+#define BAND_PIXELS (1024*1024)
+// ... and each band is converted by several threads, this many rows at
+// a time.
+#define TASK_ROWS 16
+// The median is found from a histogram with this many bins, and then
+// the pixels in the bin that holds it.
+#define MEDIAN_BINS 65536
 
 static void printHelp(char* progname) {
     printf("%s    -i <input-file>\n"
@@ -41,28 +54,69 @@ static void printHelp(char* progname) {
            "      [-s]: write 16-bit output\n"
            "      [-v]: verbose\n"
            "      [-M]: compute & print median value\n"
+           "      [-j <threads>]: number of threads (default: 1)\n"
            "\n", progname);
 }
 
 
-static void sample_percentiles(const float* img, int nx, int ny, int margin,
-                               int NPIX, float lop, float hip,
-                               float* lo, float* hi) {
-    // the maximum number of pixels to sample
+typedef struct {
+    anqfits_t* anq;
+    int ext;
+    int plane;
+    int nx;
+    int ny;
+    // rows per band
+    int bandrows;
+} image_bands_t;
+
+static int n_bands(const image_bands_t* b) {
+    return (b->ny + b->bandrows - 1) / b->bandrows;
+}
+
+// Reads band "i": rows [*y0, *y0 + *nrows).
+static float* read_band(const image_bands_t* b, int i, int* y0, int* nrows) {
+    float* img;
+    *y0 = i * b->bandrows;
+    *nrows = MIN(b->bandrows, b->ny - *y0);
+    img = anqfits_readpix(b->anq, b->ext, 0, b->nx, *y0, *y0 + *nrows,
+                          b->plane, PTYPE_FLOAT, NULL, NULL, NULL);
+    if (!img)
+        ERROR("Failed to load pixels: rows [%i, %i)", *y0, *y0 + *nrows);
+    return img;
+}
+
+static int compare_size_asc(const void* v1, const void* v2) {
+    size_t i1 = *(const size_t*)v1;
+    size_t i2 = *(const size_t*)v2;
+    return (i1 < i2) ? -1 : ((i1 > i2) ? 1 : 0);
+}
+
+/*
+ One pass through the bands: the minimum and maximum finite pixel values,
+ and the values at the percentiles "lop" and "hip" of (up to NPIX of) the
+ pixels away from the margin.  The pixels sampled are the same as if the
+ whole image were in memory: the random positions are drawn first, then
+ picked out of each band as it goes by.
+ */
+static int band_stats(const image_bands_t* b, int margin, int NPIX,
+                      float lop, float hip, float* minval, float* maxval,
+                      float* lo, float* hi) {
+    int nx = b->nx, ny = b->ny;
     int n, np;
     int x, y;
-    int i;
+    int i, k, band;
+    size_t* inds;
     float* pix;
 
-    //fprintf(stderr, "Computing image percentiles...\n");
     n = (nx - 2*margin) * (ny - 2*margin);
     np = MIN(n, NPIX);
-    pix = malloc(np * sizeof(float));
+    inds = malloc(MAX(1, np) * sizeof(size_t));
+    pix = malloc(MAX(1, np) * sizeof(float));
     if (n < NPIX) {
         i=0;
         for (y=margin; y<(ny-margin); y++)
             for (x=margin; x<(nx-margin); x++) {
-                pix[i] = img[y*nx + x];
+                inds[i] = (size_t)y*nx + x;
                 i++;
             }
         assert(i == np);
@@ -75,28 +129,174 @@ static void sample_percentiles(const float* img, int nx, int ny, int margin,
             // machines.
             x = x % nx;
             y = y % ny;
+            inds[i] = (size_t)y*nx + x;
+        }
+        qsort(inds, np, sizeof(size_t), compare_size_asc);
+    }
 
-            pix[i] = img[y*nx + x];
+    *minval = LARGE_VALF;
+    *maxval = -LARGE_VALF;
+    k = 0;
+    for (band=0; band<n_bands(b); band++) {
+        int y0, nrows;
+        size_t off, N;
+        float* img = read_band(b, band, &y0, &nrows);
+        if (!img) {
+            free(inds);
+            free(pix);
+            return -1;
+        }
+        off = (size_t)y0 * nx;
+        N = (size_t)nrows * nx;
+        for (i=0; i<N; i++) {
+            if (isfinite(img[i])) {
+                *minval = MIN(*minval, img[i]);
+                *maxval = MAX(*maxval, img[i]);
+            }
+        }
+        for (; k<np && inds[k] < off + N; k++)
+            pix[k] = img[inds[k] - off];
+        free(img);
+    }
+    free(inds);
+
+    if (np) {
+        double ps[] = { lop, hip };
+        float pct[2];
+        if (dpercentiles(pix, np, ps, 2, 0, 1, pct) > 0) {
+            if (lo)
+                *lo = pct[0];
+            if (hi)
+                *hi = pct[1];
         }
     }
+    free(pix);
+    return 0;
+}
 
-    QSORT_R(pix, np, sizeof(float), NULL, compare_floats_asc_r);
+static int median_bin(float v, float minval, float maxval) {
+    int bin = (int)((double)(v - minval) / ((double)maxval - minval) * MEDIAN_BINS);
+    return MIN(MEDIAN_BINS-1, MAX(0, bin));
+}
 
-    if (lo) {
-        i = MIN(np-1, MAX(0, (int)(lop * np)));
-        *lo = pix[i];
+/*
+ The median of the finite pixels (which lie in [minval, maxval]), found
+ without sorting the image: one pass builds a histogram and finds the bin
+ the median is in, and another collects that bin's pixels.
+ */
+static int band_median(const image_bands_t* b, float minval, float maxval,
+                       float* median) {
+    int64_t* hist;
+    int64_t nfinite = 0, below = 0, rank;
+    float* binpix = NULL;
+    int64_t nbin = 0, nbinpix = 0;
+    int medbin, band;
+    size_t i;
+
+    if (!(maxval > minval)) {
+        *median = minval;
+        return 0;
     }
-    if (hi) {
-        i = MIN(np-1, MAX(0, (int)(hip * np)));
-        *hi = pix[i];
+    hist = calloc(MEDIAN_BINS, sizeof(int64_t));
+    for (band=0; band<n_bands(b); band++) {
+        int y0, nrows;
+        float* img = read_band(b, band, &y0, &nrows);
+        if (!img) {
+            free(hist);
+            return -1;
+        }
+        for (i=0; i<(size_t)nrows * b->nx; i++) {
+            if (!isfinite(img[i]))
+                continue;
+            hist[median_bin(img[i], minval, maxval)]++;
+            nfinite++;
+        }
+        free(img);
     }
-    free(pix);
+    rank = nfinite / 2;
+    for (medbin=0; medbin<MEDIAN_BINS; medbin++) {
+        if (below + hist[medbin] > rank)
+            break;
+        below += hist[medbin];
+    }
+    nbin = hist[medbin];
+    free(hist);
+
+    binpix = malloc(MAX(1, nbin) * sizeof(float));
+    for (band=0; band<n_bands(b); band++) {
+        int y0, nrows;
+        float* img = read_band(b, band, &y0, &nrows);
+        if (!img) {
+            free(binpix);
+            return -1;
+        }
+        for (i=0; i<(size_t)nrows * b->nx; i++) {
+            if (isfinite(img[i]) &&
+                median_bin(img[i], minval, maxval) == medbin)
+                binpix[nbinpix++] = img[i];
+        }
+        free(img);
+    }
+    assert(nbinpix == nbin);
+    *median = dselect(rank - below, nbinpix, binpix);
+    free(binpix);
+    return 0;
 }
-							   
 
+typedef struct {
+    const float* img;
+    int N;
+    float minval;
+    float scale;
+    anbool sixteenbit;
+    // output pixels (1 or 2 bytes, big-endian)
+    void* out;
+    int ntasks;
+    int taskpix;
+    int next;
+} convert_job_t;
+
+static void* convert_worker(void* arg) {
+    convert_job_t* c = arg;
+    int t;
+    while ((t = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) < c->ntasks) {
+        int i0 = t * c->taskpix;
+        int i1 = MIN(c->N, i0 + c->taskpix);
+        int i;
+        if (c->sixteenbit) {
+            uint16_t* buf = c->out;
+            for (i=i0; i<i1; i++)
+                buf[i] = htons(MIN(65535, MAX(0, round((c->img[i] - c->minval) * c->scale))));
+        } else {
+            uint8_t* buf = c->out;
+            for (i=i0; i<i1; i++)
+                buf[i] = MIN(255, MAX(0, round((c->img[i] - c->minval) * c->scale)));
+        }
+    }
+    return NULL;
+}
 
+// Converts a band of "nrows" rows of "nx" pixels on "nthreads" threads.
+static void convert_band(convert_job_t* c, int nx, int nrows, int nthreads) {
+    pthread_t* threads;
+    int t, nstarted = 0;
+    c->N = nx * nrows;
+    c->taskpix = nx * TASK_ROWS;
+    c->ntasks = (nrows + TASK_ROWS - 1) / TASK_ROWS;
+    c->next = 0;
+    nthreads = MAX(1, MIN(nthreads, c->ntasks));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, convert_worker, c))
+            break;
+        nstarted++;
+    }
+    convert_worker(c);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
 
-#define NBUF 1024
 
 int main(int argc, char *argv[]) {
     int argchar;
@@ -116,7 +316,7 @@ int main(int argc, char *argv[]) {
 
     anbool minval_set = FALSE;
     anbool maxval_set = FALSE;
-    float maxval, minval;
+    float maxval = 0, minval = 0;
     anbool find_min = FALSE;
     anbool find_max = FALSE;
 
@@ -126,6 +326,12 @@ int main(int argc, char *argv[]) {
     anbool median = FALSE;
     double lop = 0.25;
     double hip = 0.95;
+    int nthreads = 1;
+    image_bands_t bands;
+    const anqfits_image_t* animg;
+    float datamin = 0, datamax = 0;
+    float plo = 0, phi = 0;
+    anbool percentiles;
 
     while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
         switch (argchar) {
@@ -183,6 +389,9 @@ int main(int argc, char *argv[]) {
         case 'M':
             median = TRUE;
             break;
+        case 'j':
+            nthreads = MAX(1, atoi(optarg));
+            break;
         case '?':
         case 'h':
             printHelp(progname);
@@ -218,18 +427,46 @@ int main(int argc, char *argv[]) {
         ERROR("Failed to read input file: \"%s\"", infn);
         exit(-1);
     }
-    logverb("Reading pixels...\n");
-    img = anqfits_readpix(anq, ext, 0,0,0,0, plane,
-                          PTYPE_FLOAT, NULL, &nx, &ny);
-    if (!img) {
-        ERROR("Failed to load pixels.");
+    animg = anqfits_get_image_const(anq, ext);
+    if (!animg) {
+        ERROR("Failed to read image from \"%s\"", infn);
         exit(-1);
     }
+    nx = (int)animg->width;
+    ny = (int)animg->height;
+    bands.anq = anq;
+    bands.ext = ext;
+    bands.plane = plane;
+    bands.nx = nx;
+    bands.ny = ny;
+    bands.bandrows = MAX(1, (int)MIN((int64_t)ny,
+                                     (int64_t)BAND_PIXELS * nthreads / MAX(1, nx)));
+
+    // percentiles are needed for any of min, max that aren't set.
+    percentiles = !ordinal && !((minval_set || find_min) && (maxval_set || find_max));
+    if (median || percentiles || (!ordinal && (find_min || find_max))) {
+        if (percentiles) {
+            logverb("Computing image percentiles...\n");
+            if (invert) {
+                double tmp = 1 - hip;
+                hip = 1 - lop;
+                lop = tmp;
+            }
+        }
+        if (band_stats(&bands, margin, percentiles ? 10000 : 0, lop, hip,
+                       &datamin, &datamax, &plo, &phi)) {
+            ERROR("Failed to load pixels.");
+            exit(-1);
+        }
+    }
 
     if (median) {
-        int* perm = permuted_sort(img, sizeof(float), compare_floats_asc, NULL, nx*ny);
-        logmsg("Median value: %g\n", img[perm[(nx*ny)/2]]);
-        free(perm);
+        float med;
+        if (band_median(&bands, datamin, datamax, &med)) {
+            ERROR("Failed to load pixels.");
+            exit(-1);
+        }
+        logmsg("Median value: %g\n", med);
     }
 
     if (ordinal) {
@@ -238,6 +475,14 @@ int main(int argc, char *argv[]) {
         int i;
         int np = nx*ny;
 
+        logverb("Reading pixels...\n");
+        img = anqfits_readpix(anq, ext, 0,0,0,0, plane,
+                              PTYPE_FLOAT, NULL, &nx, &ny);
+        if (!img) {
+            ERROR("Failed to load pixels.");
+            exit(-1);
+        }
+
         logverb("Doing ordinal transform...\n");
         perm = permuted_sort(img, sizeof(float), compare_floats_asc, NULL, np);
 
@@ -266,47 +511,28 @@ int main(int argc, char *argv[]) {
             exit(-1);
         }
         free(outimg);
+        free(img);
 
     } else {
-        int i, j;
+        int band;
         float scale;
+        convert_job_t conv;
+        void* outbuf;
 
         if (find_min) {
-            minval = LARGE_VALF;
-            for (i=0; i<(nx*ny); i++) {
-                if (isfinite(img[i])) {
-                    minval = MIN(minval, img[i]);
-                }
-            }
+            minval = datamin;
             minval_set = TRUE;
             logverb("Minimum pixel value: %g\n", minval);
         }
         if (find_max) {
-            maxval = -LARGE_VALF;
-            for (i=0; i<(nx*ny); i++) {
-                if (isfinite(img[i])) {
-                    maxval = MAX(maxval, img[i]);
-                }
-            }
+            maxval = datamax;
             maxval_set = TRUE;
             logverb("Maximum pixel value: %g\n", maxval);
         }
-
-        if (!(minval_set && maxval_set)) {
-            int NPIX = 10000;
-
-            // percentiles.
-            if (invert) {
-                double tmp = 1 - hip;
-                hip = 1 - lop;
-                lop = tmp;
-            }
-
-            logverb("Computing image percentiles...\n");
-            sample_percentiles(img, nx, ny, margin, NPIX, lop, hip,
-                               (minval_set ? NULL : &minval),
-                               (maxval_set ? NULL : &maxval));
-        }
+        if (!minval_set)
+            minval = plo;
+        if (!maxval_set)
+            maxval = phi;
 
         if (invert) {
             scale = -((float)maxpix / (maxval - minval));
@@ -317,38 +543,34 @@ int main(int argc, char *argv[]) {
         logverb("Mapping input pixel range [%f, %f]\n", minval, maxval);
         logverb("Writing output..\n");
         fprintf(fout, "P5 %i %i %i\n", nx, ny, maxpix);
-        // Convert and write out chunks of "n" pixels at a time,
-        // starting at "i".
-        i = 0;
-        while (i < (nx*ny)) {
-            int n;
-            n = MIN(NBUF, nx*ny - i);
-            if (sixteenbit) {
-                uint16_t buf[NBUF];
-                for (j=0; j<n; j++)
-                    buf[j] = htons(MIN(65535, MAX(0, round((img[i+j] - minval) * scale))));
-                if (fwrite(buf, 2, n, fout) != n) {
-                    fprintf(stderr, "Failed to write output image: %s\n", strerror(errno));
-                    exit(-1);
-                }
-				
-            } else {
-                uint8_t buf[NBUF];
-                for (j=0; j<n; j++)
-                    buf[j] = MIN(255, MAX(0, round((img[i+j] - minval) * scale)));
-                if (fwrite(buf, 1, n, fout) != n) {
-                    fprintf(stderr, "Failed to write output image: %s\n", strerror(errno));
-                    exit(-1);
-                }
+        outbuf = malloc((size_t)bands.bandrows * nx * (sixteenbit ? 2 : 1));
+        conv.minval = minval;
+        conv.scale = scale;
+        conv.sixteenbit = sixteenbit;
+        conv.out = outbuf;
+        for (band=0; band<n_bands(&bands); band++) {
+            int y0, nrows;
+            size_t N;
+            img = read_band(&bands, band, &y0, &nrows);
+            if (!img) {
+                ERROR("Failed to load pixels.");
+                exit(-1);
+            }
+            conv.img = img;
+            convert_band(&conv, nx, nrows, nthreads);
+            free(img);
+            N = (size_t)nx * nrows;
+            if (fwrite(outbuf, sixteenbit ? 2 : 1, N, fout) != N) {
+                fprintf(stderr, "Failed to write output image: %s\n", strerror(errno));
+                exit(-1);
             }
-            i += n;
         }
+        free(outbuf);
     }
 
     if (outfn)
         fclose(fout);
     anqfits_close(anq);
-    free(img);
     logverb("Done!\n");
     return 0;
 }
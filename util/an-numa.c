@@ -0,0 +1,244 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "an-numa.h"
+#include "bl.h"
+#include "ioutils.h"
+#include "log.h"
+
+// (from <numaif.h>, which comes with libnuma)
+#define MPOL_DEFAULT    0
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE    (1 << 1)
+
+#define MAX_NODES 1024
+#define MASK_LONGS (MAX_NODES / (8 * sizeof(unsigned long)))
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+// ids of the nodes with memory.
+static il* nodes = NULL;
+// [max node id + 1]: each node's CPUs, or NULL.
+static il** node_cpus = NULL;
+static int max_node = 0;
+#ifdef __linux__
+// the process's CPUs when we started, for an_numa_unpin_thread().
+static cpu_set_t all_cpus;
+static int have_all_cpus = 0;
+#endif
+
+// Parses a sysfs list like "0-3,8,10-11" into "lst".
+static void parse_list(const char* s, il* lst) {
+    while (*s) {
+        char* end;
+        long lo, hi;
+        lo = hi = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            s = end;
+        }
+        for (; lo <= hi; lo++)
+            il_append(lst, (int)lo);
+        if (*s != ',')
+            break;
+        s++;
+    }
+}
+
+// Reads the sysfs list in file "fn" into a new list; NULL if it can't.
+static il* read_list(const char* fn) {
+    // (sysfs files claim to be a page long, so file_get_contents() fails)
+    char line[4096];
+    FILE* f;
+    il* lst;
+    f = fopen(fn, "r");
+    if (!f)
+        return NULL;
+    if (!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    lst = il_new(16);
+    parse_list(line, lst);
+    if (!il_size(lst)) {
+        il_free(lst);
+        return NULL;
+    }
+    return lst;
+}
+
+static void read_topology(void) {
+    size_t i;
+    nodes = read_list("/sys/devices/system/node/has_memory");
+    if (!nodes)
+        nodes = read_list("/sys/devices/system/node/online");
+    if (!nodes) {
+        nodes = il_new(1);
+        il_append(nodes, 0);
+    }
+    for (i=0; i<il_size(nodes); i++)
+        if (il_get(nodes, i) > max_node)
+            max_node = il_get(nodes, i);
+    node_cpus = calloc(max_node + 1, sizeof(il*));
+    for (i=0; i<il_size(nodes); i++) {
+        char* fn;
+        int node = il_get(nodes, i);
+        if (node < 0 || node >= MAX_NODES)
+            continue;
+        asprintf_safe(&fn, "/sys/devices/system/node/node%i/cpulist", node);
+        node_cpus[node] = read_list(fn);
+        free(fn);
+    }
+#ifdef __linux__
+    have_all_cpus = !sched_getaffinity(0, sizeof(cpu_set_t), &all_cpus);
+#endif
+    if (il_size(nodes) > 1)
+        logverb("%zu NUMA nodes\n", il_size(nodes));
+}
+
+static void init(void) {
+    pthread_once(&topology_once, read_topology);
+}
+
+int an_numa_nodes(void) {
+    init();
+    return il_size(nodes);
+}
+
+int an_numa_node_id(int i) {
+    init();
+    return il_get(nodes, i);
+}
+
+int an_numa_max_node(void) {
+    init();
+    return max_node + 1;
+}
+
+int an_numa_pin_thread(int node) {
+#ifdef __linux__
+    cpu_set_t set;
+    il* cpus;
+    size_t i;
+    init();
+    if (node < 0 || node > max_node || !node_cpus[node])
+        return -1;
+    cpus = node_cpus[node];
+    CPU_ZERO(&set);
+    for (i=0; i<il_size(cpus); i++)
+        if (il_get(cpus, i) < CPU_SETSIZE)
+            CPU_SET(il_get(cpus, i), &set);
+    return sched_setaffinity(0, sizeof(cpu_set_t), &set) ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+int an_numa_unpin_thread(void) {
+#ifdef __linux__
+    init();
+    if (!have_all_cpus)
+        return -1;
+    return sched_setaffinity(0, sizeof(cpu_set_t), &all_cpus) ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef __linux__
+// The memory policy and node mask for "node" (or AN_NUMA_INTERLEAVE).
+static int get_policy(int node, unsigned long* mask) {
+    size_t i;
+    memset(mask, 0, MASK_LONGS * sizeof(unsigned long));
+    if (node == AN_NUMA_INTERLEAVE) {
+        for (i=0; i<il_size(nodes); i++) {
+            int n = il_get(nodes, i);
+            if (n >= 0 && n < MAX_NODES)
+                mask[n / (8 * sizeof(long))] |= 1UL << (n % (8 * sizeof(long)));
+        }
+        return MPOL_INTERLEAVE;
+    }
+    if (node < 0 || node >= MAX_NODES)
+        return -1;
+    mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+    return MPOL_BIND;
+}
+#endif
+
+int an_numa_place(const void* addr, size_t len, int node) {
+#ifdef __linux__
+    unsigned long mask[MASK_LONGS];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start, end, p;
+    int mode, rtn;
+
+    init();
+    if (!addr || !len)
+        return 0;
+    mode = get_policy(node, mask);
+    if (mode == -1)
+        return -1;
+    start = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+    end = ((uintptr_t)addr + len + page - 1) & ~(uintptr_t)(page - 1);
+    // (pages that other processes map too stay where they are.)
+    rtn = syscall(SYS_mbind, (void*)start, end - start, mode, mask,
+                  MAX_NODES + 1, MPOL_MF_MOVE) ? -1 : 0;
+    if (syscall(SYS_set_mempolicy, mode, mask, MAX_NODES + 1))
+        return -1;
+    for (p=start; p<end; p+=page)
+        (void)*(volatile const char*)p;
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    return rtn;
+#else
+    return -1;
+#endif
+}
+
+void* an_numa_alloc_on_node(size_t len, int node) {
+    void* p;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef __linux__
+    {
+        // (before the pages are touched, so they're allocated there)
+        unsigned long mask[MASK_LONGS];
+        int mode;
+        init();
+        mode = get_policy(node, mask);
+        if (mode != -1)
+            syscall(SYS_mbind, p, len, mode, mask, MAX_NODES + 1, 0);
+    }
+#endif
+    return p;
+}
+
+void* an_numa_copy_to_node(const void* src, size_t len, int node) {
+    void* p = an_numa_alloc_on_node(len, node);
+    if (p)
+        memcpy(p, src, len);
+    return p;
+}
+
+void an_numa_free(void* p, size_t len) {
+    if (p)
+        munmap(p, len);
+}
@@ -26,6 +26,7 @@
 #include "sip.h"
 #include "sip_qfits.h"
 #include "sip-utils.h"
+#include "sip-invgrid.h"
 #include "starutil.h"
 #include "mathutil.h"
 #include "ioutils.h"
@@ -561,7 +562,14 @@ static void ansip_get_cd_matrix(const sip_t* sip, double *p_cd) {
 
 /////////////////// dispatched anwcs_t entry points //////////////////////////
 
+// The inverse grid is only valid for the WCS it was built from.
+static void drop_inverse_grid(anwcs_t* anwcs) {
+    sip_invgrid_free(anwcs->invgrid);
+    anwcs->invgrid = NULL;
+}
+
 void anwcs_set_size(anwcs_t* anwcs, int W, int H) {
+    drop_inverse_grid(anwcs);
     ANWCS_DISPATCH(anwcs, , , set_size, W, H);
 }
 
@@ -610,6 +618,7 @@ void anwcs_print_stdout(const anwcs_t* wcs) {
 void anwcs_free(anwcs_t* anwcs) {
     if (!anwcs)
         return;
+    drop_inverse_grid(anwcs);
     ANWCS_DISPATCH(anwcs, , , free);
     free(anwcs);
 }
@@ -643,10 +652,12 @@ int anwcs_write_to(const anwcs_t* wcs, FILE* fid) {
 }
 
 int anwcs_scale_wcs(anwcs_t* anwcs, double scale) {
+    drop_inverse_grid(anwcs);
     ANWCS_DISPATCH(anwcs, return, return -1, scale_wcs, scale);
 }
 
 int anwcs_rotate_wcs(anwcs_t* anwcs, double rot) {
+    drop_inverse_grid(anwcs);
     ANWCS_DISPATCH(anwcs, return, return -1, rotate_wcs, rot);
 }
 
@@ -770,6 +781,60 @@ int anwcs_xyz2pixelxy(const anwcs_t* wcs, const double* xyz, double *px, double
     return rtn;
 }
 
+int anwcs_pixelxy2radec_array(const anwcs_t* wcs, const double* xy, int N,
+                              double* radec) {
+    int i;
+    int rtn = 0;
+    assert(wcs);
+    if (wcs->type == ANWCS_TYPE_SIP) {
+        sip_pixelxy2radec_array(wcs->data, xy, N, radec);
+        return 0;
+    }
+    for (i=0; i<N; i++)
+        if (anwcs_pixelxy2radec(wcs, xy[2*i], xy[2*i+1],
+                                radec + 2*i, radec + 2*i + 1))
+            rtn = -1;
+    return rtn;
+}
+
+int anwcs_radec2pixelxy_array(const anwcs_t* wcs, const double* radec, int N,
+                              double* xy, anbool* ok) {
+    int i;
+    int ngood = 0;
+    assert(wcs);
+    if (wcs->type == ANWCS_TYPE_SIP) {
+        if (wcs->invgrid)
+            return sip_invgrid_radec2pixelxy_array(wcs->invgrid, radec, N,
+                                                   xy, ok);
+        return sip_radec2pixelxy_array(wcs->data, radec, N, xy, ok);
+    }
+    for (i=0; i<N; i++) {
+        anbool good = (anwcs_radec2pixelxy(wcs, radec[2*i], radec[2*i+1],
+                                           xy + 2*i, xy + 2*i + 1) == 0);
+        if (ok)
+            ok[i] = good;
+        if (good)
+            ngood++;
+    }
+    return ngood;
+}
+
+int anwcs_use_inverse_grid(anwcs_t* wcs, double step, int newton) {
+    sip_invgrid_t* g;
+    assert(wcs);
+    if (wcs->type != ANWCS_TYPE_SIP) {
+        ERROR("An inverse-distortion grid needs a SIP WCS (this is type %i)",
+              wcs->type);
+        return -1;
+    }
+    g = sip_invgrid_new(wcs->data, step, newton);
+    if (!g)
+        return -1;
+    drop_inverse_grid(wcs);
+    wcs->invgrid = g;
+    return 0;
+}
+
 int anwcs_get_radec_center_and_radius(const anwcs_t* anwcs,
                                       double* p_ra, double* p_dec, double* p_radius) {
     assert(anwcs);
@@ -1117,7 +1182,10 @@ int anwcs_radec2pixelxy(const anwcs_t* anwcs, double ra, double dec, double* px,
             sip_t* sip;
             anbool ok;
             sip = anwcs->data;
-            ok = sip_radec2pixelxy(sip, ra, dec, px, py);
+            if (anwcs->invgrid)
+                ok = sip_invgrid_radec2pixelxy(anwcs->invgrid, ra, dec, px, py);
+            else
+                ok = sip_radec2pixelxy(sip, ra, dec, px, py);
             if (!ok)
                 return -1;
         }
@@ -1547,6 +1615,55 @@ sip_t* anwcs_get_sip(const anwcs_t* wcs) {
     return NULL;
 }
 
+anwcs_t* anwcs_get_subimage(const anwcs_t* wcs, int x0, int y0,
+                            int W, int H) {
+    switch (wcs->type) {
+    case ANWCS_TYPE_SIP:
+        {
+            sip_t sub;
+            // (sip_shift takes FITS-style, inclusive pixel bounds)
+            sip_shift(wcs->data, &sub, x0 + 1, x0 + W, y0 + 1, y0 + H);
+            return anwcs_new_sip(&sub);
+        }
+#ifdef WCSLIB_EXISTS
+    case ANWCS_TYPE_WCSLIB:
+        {
+            const anwcslib_t* anwcslib = wcs->data;
+            struct wcsprm* wcs2 = calloc(1, sizeof(struct wcsprm));
+            anwcslib_t* sub;
+            anwcs_t* anwcs;
+            int code;
+            wcs2->flag = -1;
+            code = wcscopy(1, anwcslib->wcs, wcs2);
+            if (code) {
+                ERROR("wcslib's wcscopy() failed with code %i: %s", code, wcs_errmsg[code]);
+                free(wcs2);
+                return NULL;
+            }
+            wcs2->crpix[0] -= x0;
+            wcs2->crpix[1] -= y0;
+            code = wcsset(wcs2);
+            if (code) {
+                ERROR("wcslib's wcsset() failed with code %i: %s", code, wcs_errmsg[code]);
+                wcsfree(wcs2);
+                free(wcs2);
+                return NULL;
+            }
+            anwcs = calloc(1, sizeof(anwcs_t));
+            anwcs->type = ANWCS_TYPE_WCSLIB;
+            anwcs->data = sub = calloc(1, sizeof(anwcslib_t));
+            sub->wcs = wcs2;
+            sub->imagew = W;
+            sub->imageh = H;
+            return anwcs;
+        }
+#endif
+    default:
+        ERROR("anwcs_get_subimage: unsupported WCS type %i", wcs->type);
+        return NULL;
+    }
+}
+
 anwcs_t* anwcs_create_allsky_hammer_aitoff(double refra, double refdec,
                                            int W, int H) {
     return anwcs_create_hammer_aitoff(refra, refdec, 1.0, W, H, TRUE);
@@ -0,0 +1,155 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "errors.h"
+
+#define ARENA_DEFAULT_BLOCKSIZE (1024 * 1024)
+
+// All allocations are rounded up to a multiple of this.
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block* next;
+    // bytes of data in this block.
+    size_t size;
+    // bytes of data handed out from this block.
+    size_t used;
+};
+typedef struct arena_block arena_block_t;
+
+// Offset of the data following the block header.
+#define BLOCK_HEADER ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+static void* block_data(arena_block_t* b) {
+    return (char*)b + BLOCK_HEADER;
+}
+
+static void free_blocks(arena_block_t* b) {
+    while (b) {
+        arena_block_t* next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+arena_t* arena_new(size_t blocksize) {
+    arena_t* a = calloc(1, sizeof(arena_t));
+    if (!a) {
+        SYSERROR("Failed to allocate arena");
+        return NULL;
+    }
+    a->blocksize = (blocksize ? blocksize : ARENA_DEFAULT_BLOCKSIZE);
+    return a;
+}
+
+static arena_block_t* get_block(arena_t* a, size_t size) {
+    arena_block_t* b;
+    arena_block_t** prev;
+    // Look for a spare block that's big enough.
+    for (prev = &(a->spare); *prev; prev = &((*prev)->next)) {
+        b = *prev;
+        if (b->size >= size) {
+            *prev = b->next;
+            b->used = 0;
+            return b;
+        }
+    }
+    if (size < a->blocksize)
+        size = a->blocksize;
+    b = malloc(BLOCK_HEADER + size);
+    if (!b) {
+        SYSERROR("Failed to allocate arena block of %zu bytes", size);
+        return NULL;
+    }
+    b->size = size;
+    b->used = 0;
+    a->reserved += size;
+    return b;
+}
+
+void* arena_alloc(arena_t* a, size_t size) {
+    arena_block_t* b;
+    void* rtn;
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+    b = a->blocks;
+    if (!b || (b->size - b->used < size)) {
+        b = get_block(a, size);
+        if (!b)
+            return NULL;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    rtn = (char*)block_data(b) + b->used;
+    b->used += size;
+    a->used += size;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return rtn;
+}
+
+void* arena_calloc(arena_t* a, size_t size) {
+    void* rtn = arena_alloc(a, size);
+    if (rtn)
+        memset(rtn, 0, size);
+    return rtn;
+}
+
+void arena_reset(arena_t* a) {
+    arena_block_t* b = a->blocks;
+    while (b) {
+        arena_block_t* next = b->next;
+        b->next = a->spare;
+        a->spare = b;
+        b = next;
+    }
+    a->blocks = NULL;
+    a->used = 0;
+}
+
+void arena_steal(arena_t* dst, arena_t* src) {
+    arena_block_t* b;
+    // Put src's blocks behind dst's current block, so that dst keeps
+    // allocating from the same place.
+    while ((b = src->blocks)) {
+        src->blocks = b->next;
+        if (dst->blocks) {
+            b->next = dst->blocks->next;
+            dst->blocks->next = b;
+        } else {
+            b->next = NULL;
+            dst->blocks = b;
+        }
+    }
+    while ((b = src->spare)) {
+        src->spare = b->next;
+        b->next = dst->spare;
+        dst->spare = b;
+    }
+    dst->used += src->used;
+    if (dst->used > dst->peak)
+        dst->peak = dst->used;
+    dst->reserved += src->reserved;
+    src->used = 0;
+    src->reserved = 0;
+}
+
+void arena_free(arena_t* a) {
+    if (!a)
+        return;
+    free_blocks(a->blocks);
+    free_blocks(a->spare);
+    free(a);
+}
+
+size_t arena_bytes_used(const arena_t* a) {
+    return a->used;
+}
+
+size_t arena_bytes_reserved(const arena_t* a) {
+    return a->reserved;
+}
@@ -0,0 +1,125 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ Times dsmooth2() and dsmooth2_iir() against the original column-by-column
+ separable convolution, on a random image:
+
+   make bench_dsmooth && ./bench_dsmooth [width height]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "dimage.h"
+#include "tic.h"
+
+// The previous dsmooth2(): separable, but the y pass walks down columns.
+static void dsmooth2_reference(float *image, int nx, int ny, float sigma,
+                               float *smooth) {
+    int i, j, npix, half, start, end, sample;
+    float neghalfinvvar, total, scale, dx, sum;
+    float* kernel1D;
+    float* kernel_shifted;
+    float* smooth_temp;
+
+    npix = 2 * ((int) ceilf(3. * sigma)) + 1;
+    half = npix / 2;
+    kernel1D = malloc(npix * sizeof(float));
+    neghalfinvvar = -1.0 / (2.0 * sigma * sigma);
+    for (i=0; i<npix; i++) {
+        dx = ((float) i - 0.5 * ((float)npix - 1.));
+        kernel1D[i] = exp((dx * dx) * neghalfinvvar);
+    }
+    total = 0.0;
+    for (i=0; i<npix; i++)
+        total += kernel1D[i];
+    scale = 1. / total;
+    for (i=0; i<npix; i++)
+        kernel1D[i] *= scale;
+
+    smooth_temp = malloc(sizeof(float) * MAX(nx, ny));
+    kernel_shifted = kernel1D + half;
+    for (j=0; j<ny; j++) {
+        float* imagerow = image + (size_t)j*nx;
+        for (i=0; i<nx; i++) {
+            start = MAX(0, i - half);
+            end = MIN(nx-1, i + half);
+            sum = 0.0;
+            for (sample=start; sample <= end; sample++)
+                sum += imagerow[sample] * kernel_shifted[sample - i];
+            smooth_temp[i] = sum;
+        }
+        memcpy(smooth + (size_t)j*nx, smooth_temp, nx * sizeof(float));
+    }
+    for (i=0; i<nx; i++) {
+        float* imagecol = smooth + i;
+        for (j=0; j<ny; j++) {
+            start = MAX(0, j - half);
+            end = MIN(ny-1, j + half);
+            sum = 0.0;
+            for (sample=start; sample<=end; sample++)
+                sum += imagecol[(size_t)sample*nx] * kernel_shifted[sample - j];
+            smooth_temp[j] = sum;
+        }
+        for (j=0; j<ny; j++)
+            smooth[i + (size_t)j*nx] = smooth_temp[j];
+    }
+    free(smooth_temp);
+    free(kernel1D);
+}
+
+static float max_diff(const float* a, const float* b, size_t n) {
+    float d = 0;
+    size_t i;
+    for (i=0; i<n; i++)
+        d = MAX(d, fabsf(a[i] - b[i]));
+    return d;
+}
+
+int main(int argc, char** args) {
+    int nx = 4096, ny = 4096;
+    float sigmas[] = { 1.0, 2.0, 4.0, 8.0, 16.0 };
+    float *image, *s0, *s1, *s2;
+    size_t N, i;
+    int k;
+
+    if (argc == 3) {
+        nx = atoi(args[1]);
+        ny = atoi(args[2]);
+    }
+    N = (size_t)nx * ny;
+    image = malloc(N * sizeof(float));
+    s0 = malloc(N * sizeof(float));
+    s1 = malloc(N * sizeof(float));
+    s2 = malloc(N * sizeof(float));
+    srand(0);
+    for (i=0; i<N; i++)
+        image[i] = rand() / (float)RAND_MAX;
+
+    printf("%i x %i image; times in seconds\n", nx, ny);
+    printf("%6s %10s %10s %10s %12s %12s\n", "sigma", "reference",
+           "dsmooth2", "iir", "diff(fir)", "diff(iir)");
+    for (k=0; k<sizeof(sigmas)/sizeof(float); k++) {
+        float sigma = sigmas[k];
+        double t0, t1, t2, t3;
+        t0 = timenow();
+        dsmooth2_reference(image, nx, ny, sigma, s0);
+        t1 = timenow();
+        dsmooth2(image, nx, ny, sigma, s1);
+        t2 = timenow();
+        dsmooth2_iir(image, nx, ny, sigma, s2);
+        t3 = timenow();
+        printf("%6.1f %10.3f %10.3f %10.3f %12.3g %12.3g\n", sigma,
+               t1-t0, t2-t1, t3-t2, max_diff(s0, s1, N), max_diff(s0, s2, N));
+    }
+    free(image);
+    free(s0);
+    free(s1);
+    free(s2);
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ Times the TAN fits the solver does for each quad that matches, on
+ random quads of 4 and 5 stars, with and without a workspace; and the
+ SIP fits (of orders 2 to 5, to 100 stars) that tweak does:
+
+   make bench_fit_wcs && ./bench_fit_wcs [number-of-quads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "fit-wcs.h"
+#include "sip.h"
+#include "tic.h"
+
+int main(int argc, char** args) {
+    int nquads = 1000000;
+    int dims[] = { 4, 5 };
+    double* xy;
+    double* xyz;
+    tan_t truth, fit;
+    fit_wcs_workspace_t* ws;
+    double check = 0.0;
+    int i, k;
+
+    if (argc == 2)
+        nquads = atoi(args[1]);
+    xy = malloc((size_t)nquads * 5 * 2 * sizeof(double));
+    xyz = malloc((size_t)nquads * 5 * 3 * sizeof(double));
+    memset(&truth, 0, sizeof(tan_t));
+    truth.crpix[0] = 1024.;
+    truth.crpix[1] = 1024.;
+    truth.crval[0] = 123.4;
+    truth.crval[1] = 56.7;
+    srand(0);
+    for (i=0; i<nquads * 5; i++) {
+        double theta = 2. * M_PI * rand() / (double)RAND_MAX;
+        // a new pointing and orientation every quad.
+        if (i % 5 == 0) {
+            double sc = 1e-4 * (1. + rand() / (double)RAND_MAX);
+            truth.crval[0] = 360. * rand() / (double)RAND_MAX;
+            truth.crval[1] = 170. * rand() / (double)RAND_MAX - 85.;
+            truth.cd[0][0] = truth.cd[1][1] = sc * cos(theta);
+            truth.cd[0][1] = -sc * sin(theta);
+            truth.cd[1][0] = sc * sin(theta);
+        }
+        xy[2*i+0] = 2048. * rand() / (double)RAND_MAX;
+        xy[2*i+1] = 2048. * rand() / (double)RAND_MAX;
+        tan_pixelxy2xyzarr(&truth, xy[2*i+0], xy[2*i+1], xyz + 3*i);
+    }
+    ws = fit_wcs_workspace_new(5, 100);
+
+    printf("%i quads; times in ns per fit\n", nquads);
+    printf("%8s %12s %12s\n", "dimquads", "workspace", "no-workspace");
+    for (k=0; k<sizeof(dims)/sizeof(int); k++) {
+        int N = dims[k];
+        double scale, t0, t1, t2;
+        t0 = timenow();
+        for (i=0; i<nquads; i++) {
+            fit_tan_wcs_weighted_ws(ws, xyz + 15*i, xy + 10*i, NULL, N,
+                                    &fit, &scale);
+            check += scale;
+        }
+        t1 = timenow();
+        for (i=0; i<nquads; i++) {
+            fit_tan_wcs(xyz + 15*i, xy + 10*i, N, &fit, &scale);
+            check += scale;
+        }
+        t2 = timenow();
+        printf("%8i %12.1f %12.1f\n", N, 1e9 * (t1 - t0) / nquads,
+               1e9 * (t2 - t1) / nquads);
+    }
+    printf("%8s %12s\n", "SIP order", "100 stars");
+    for (k=2; k<=5; k++) {
+        int nfits = MAX(1, nquads / 100);
+        sip_t sip;
+        double t0, t1;
+        fit_tan_wcs(xyz, xy, 100, &fit, NULL);
+        t0 = timenow();
+        for (i=0; i<nfits; i++) {
+            // (the first quads' stars, as one field)
+            fit_sip_wcs_ws(ws, xyz, xy, NULL, 100, &fit, k, 0, 1, &sip);
+            check += sip.a[k][0];
+        }
+        t1 = timenow();
+        printf("%8i %12.1f\n", k, 1e9 * (t1 - t0) / nfits);
+    }
+    // (so that the fits aren't optimized away)
+    printf("checksum %g\n", check);
+    fit_wcs_workspace_free(ws);
+    free(xy);
+    free(xyz);
+    return 0;
+}
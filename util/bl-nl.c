@@ -167,8 +167,11 @@ ptrdiff_t NLF(remove_value)(nl* nlist, const number value) {
         for (i=0; i<node->N; i++)
             if (idat[i] == value) {
                 bl_remove_from_node(list, node, prev, i);
-                list->last_access = prev;
-                list->last_access_n = istart;
+                bl_dir_truncate(list, istart);
+                // ("prev" doesn't start at "istart", and "node" may
+                // be gone.)
+                list->last_access = NULL;
+                list->last_access_n = 0;
                 return istart + i;
             }
         istart += node->N;
@@ -214,6 +217,10 @@ void NLF(init)(nl* list, int blocksize) {
     bl_init(list, blocksize, sizeof(number));
 }
 
+void NLF(init_arena)(nl* list, int blocksize, struct arena* a) {
+    bl_init_arena(list, blocksize, sizeof(number), a);
+}
+
 void NLF(free)(nl* list) {
     bl_free(list);
 }
@@ -74,6 +74,8 @@ static void bl_sort_rec(bl* list, void* pivot,
     less = bl_new(list->blocksize, list->datasize);
     equal = bl_new(list->blocksize, list->datasize);
     greater = bl_new(list->blocksize, list->datasize);
+    // (their blocks end up in "list".)
+    less->arena = equal->arena = greater->arena = list->arena;
     for (node=list->head; node; node=node->next) {
         char* data = NODE_CHARDATA(node);
         for (i=0; i<node->N; i++) {
@@ -95,7 +97,7 @@ static void bl_sort_rec(bl* list, void* pivot,
     for (node=list->head; node;) {
         bl_node* next;
         next = node->next;
-        bl_free_node(node);
+        bl_free_node(list, node);
         node = next;
     }
     list->head = NULL;
@@ -103,6 +105,7 @@ static void bl_sort_rec(bl* list, void* pivot,
     list->N = 0;
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_truncate(list, 0);
 
     if (less->N) {
         list->head = less->head;
@@ -131,6 +134,9 @@ static void bl_sort_rec(bl* list, void* pivot,
     }
     // note, these are supposed to be "free", not "bl_free"; we've stolen
     // the blocks, we're just freeing the headers.
+    bl_dir_free(less);
+    bl_dir_free(equal);
+    bl_dir_free(greater);
     free(less);
     free(equal);
     free(greater);
@@ -15,6 +15,7 @@
 
 #include "bl.ph"
 #include "log.h"
+#include "arena.h"
 
 static bl_node* bl_new_node(bl* list);
 static void bl_remove_from_node(bl* list, bl_node* node,
@@ -82,6 +83,91 @@ static void bl_remove_from_node(bl* list, bl_node* node,
 
 
 
+static void dir_append(bl* list, bl_node* node, size_t nskipped) {
+    if (list->ndir == list->dircap) {
+        size_t cap = list->dircap ? 2 * list->dircap : 16;
+        bl_node** dir = realloc(list->dir, cap * sizeof(bl_node*));
+        size_t* start;
+        if (!dir)
+            return;
+        list->dir = dir;
+        start = realloc(list->dirstart, cap * sizeof(size_t));
+        if (!start)
+            return;
+        list->dirstart = start;
+        list->dircap = cap;
+    }
+    list->dir[list->ndir] = node;
+    list->dirstart[list->ndir] = nskipped;
+    list->ndir++;
+}
+
+bl_node* bl_find_node_dir(const bl* clist, size_t n, size_t* p_nskipped,
+                          int extend) {
+    // (the directory is a cache, so this is "const" in spirit.)
+    bl* list = (bl*)clist;
+    bl_node* node;
+    size_t nskipped;
+    size_t idx;
+
+    if (list->ndir) {
+        // binary search for the last directory entry starting at or
+        // before "n".
+        size_t lo = 0, hi = list->ndir;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (list->dirstart[mid] <= n)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        idx = lo;
+        node = list->dir[idx];
+        nskipped = list->dirstart[idx];
+    } else {
+        idx = 0;
+        node = list->head;
+        nskipped = 0;
+        if (extend && node)
+            dir_append(list, node, 0);
+    }
+    // walk forward from there, adding nodes past the end of the
+    // directory as we go.
+    while (node && n >= nskipped + node->N) {
+        nskipped += node->N;
+        node = node->next;
+        idx++;
+        if (extend && node && idx == list->ndir)
+            dir_append(list, node, nskipped);
+    }
+    assert(node);
+    if (p_nskipped)
+        *p_nskipped = nskipped;
+    return node;
+}
+
+void bl_dir_truncate(bl* list, size_t n) {
+    // keep the entries that start before "n".
+    size_t lo = 0, hi = list->ndir;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->dirstart[mid] < n)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    list->ndir = lo;
+}
+
+void bl_dir_free(bl* list) {
+    free(list->dir);
+    free(list->dirstart);
+    list->dir = NULL;
+    list->dirstart = NULL;
+    list->ndir = 0;
+    list->dircap = 0;
+}
+
 Pure int bl_datasize(const bl* list) {
     if (!list)
         return 0;
@@ -94,6 +180,7 @@ void bl_split(bl* src, bl* dest, size_t split) {
     size_t nskipped;
     size_t ind;
     size_t ntaken = src->N - split;
+    assert(src->arena == dest->arena);
     node = find_node(src, split, &nskipped);
     ind = split - nskipped;
     if (ind == 0) {
@@ -136,6 +223,7 @@ void bl_split(bl* src, bl* dest, size_t split) {
     // adjust "src".
     src->N -= ntaken;
     src->last_access = NULL;
+    bl_dir_truncate(src, 0);
 }
 
 void bl_init(bl* list, int blocksize, int datasize) {
@@ -146,6 +234,16 @@ void bl_init(bl* list, int blocksize, int datasize) {
     list->datasize  = datasize;
     list->last_access = NULL;
     list->last_access_n = 0;
+    list->dir = NULL;
+    list->dirstart = NULL;
+    list->ndir = 0;
+    list->dircap = 0;
+    list->arena = NULL;
+}
+
+void bl_init_arena(bl* list, int blocksize, int datasize, arena_t* a) {
+    bl_init(list, blocksize, datasize);
+    list->arena = a;
 }
 
 bl* bl_new(int blocksize, int datasize) {
@@ -170,16 +268,17 @@ void bl_remove_all(bl* list) {
     lastnode = NULL;
     for (n=list->head; n; n=n->next) {
         if (lastnode)
-            bl_free_node(lastnode);
+            bl_free_node(list, lastnode);
         lastnode = n;
     }
     if (lastnode)
-        bl_free_node(lastnode);
+        bl_free_node(list, lastnode);
     list->head = NULL;
     list->tail = NULL;
     list->N = 0;
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_free(list);
 }
 
 void bl_remove_all_but_first(bl* list) {
@@ -189,11 +288,11 @@ void bl_remove_all_but_first(bl* list) {
     if (list->head) {
         for (n=list->head->next; n; n=n->next) {
             if (lastnode)
-                bl_free_node(lastnode);
+                bl_free_node(list, lastnode);
             lastnode = n;
         }
         if (lastnode)
-            bl_free_node(lastnode);
+            bl_free_node(list, lastnode);
         list->head->next = NULL;
         list->head->N = 0;
         list->tail = list->head;
@@ -204,6 +303,7 @@ void bl_remove_all_but_first(bl* list) {
     list->N = 0;
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_truncate(list, 0);
 }
 
 static void bl_remove_from_node(bl* list, bl_node* node,
@@ -226,7 +326,7 @@ static void bl_remove_from_node(bl* list, bl_node* node,
             }
             prev->next = node->next;
         }
-        bl_free_node(node);
+        bl_free_node(list, node);
     } else {
         int ncopy;
         // just remove this element...
@@ -258,6 +358,7 @@ void bl_remove_index(bl* list, size_t index) {
     bl_remove_from_node(list, node, prev, index-nskipped);
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_truncate(list, nskipped);
 }
 
 void bl_remove_index_range(bl* list, size_t start, size_t length) {
@@ -276,6 +377,7 @@ void bl_remove_index_range(bl* list, size_t start, size_t length) {
 
         nskipped += node->N;
     }
+    bl_dir_truncate(list, nskipped);
 
     // begin by removing any indices that are at the end of a block.
     if (start > nskipped) {
@@ -321,7 +423,7 @@ void bl_remove_index_range(bl* list, size_t start, size_t length) {
         nskipped += n;
         todelete = node;
         node = node->next;
-        bl_free_node(todelete);
+        bl_free_node(list, todelete);
     }
     if (prev)
         prev->next = node;
@@ -350,11 +452,13 @@ static void clear_list(bl* list) {
     list->N = 0;
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_truncate(list, 0);
 }
 
 void bl_append_list(bl* list1, bl* list2) {
     list1->last_access = NULL;
     list1->last_access_n = 0;
+    assert(list1->arena == list2->arena);
     if (list1->datasize != list2->datasize) {
         printf("Error: cannot append bls with different data sizes!\n");
         assert(0);
@@ -368,6 +472,7 @@ void bl_append_list(bl* list1, bl* list2) {
 
     // if list1 is empty, then just copy over list2's head and tail.
     if (list1->head == NULL) {
+        bl_dir_truncate(list1, 0);
         list1->head = list2->head;
         list1->tail = list2->tail;
         list1->N = list2->N;
@@ -391,7 +496,10 @@ void bl_append_list(bl* list1, bl* list2) {
 static bl_node* bl_new_node(bl* list) {
     bl_node* rtn;
     // merge the mallocs for the node and its data into one malloc.
-    rtn = malloc(sizeof(bl_node) + (size_t)list->datasize * (size_t)list->blocksize);
+    if (list->arena)
+        rtn = arena_alloc(list->arena, sizeof(bl_node) + (size_t)list->datasize * (size_t)list->blocksize);
+    else
+        rtn = malloc(sizeof(bl_node) + (size_t)list->datasize * (size_t)list->blocksize);
     if (!rtn) {
         printf("Couldn't allocate memory for a bl node!\n");
         return NULL;
@@ -423,6 +531,9 @@ static void bl_append_node(bl* list, bl_node* node) {
  */
 void* bl_node_append(bl* list, bl_node* node, const void* data) {
     void* dest;
+    if (node != list->tail)
+        // this changes where the following nodes start.
+        bl_dir_truncate(list, 0);
     if (node->N == list->blocksize) {
         // create a new node and insert it after the current node.
         bl_node* newnode;
@@ -603,6 +714,7 @@ void bl_insert(bl* list, size_t index, const void* data) {
 
     list->last_access = node;
     list->last_access_n = nskipped;
+    bl_dir_truncate(list, nskipped);
 
     // if the node is full:
     //   if we're inserting at the end of this node, then create a new node.
@@ -669,7 +781,9 @@ void bl_insert(bl* list, size_t index, const void* data) {
 void* bl_access_const(const bl* list, size_t n) {
     bl_node* node;
     size_t nskipped;
-    node = find_node(list, n, &nskipped);
+    // (doesn't touch the last-access pointer or extend the directory,
+    // so this is safe to call from several threads at once.)
+    node = bl_find_node_dir(list, n, &nskipped, 0);
     // grab the element.
     return NODE_CHARDATA(node) + (n - nskipped) * list->datasize;
 }
@@ -837,6 +951,7 @@ void bl_reverse(bl* list) {
 
     list->last_access = NULL;
     list->last_access_n = 0;
+    bl_dir_truncate(list, 0);
 }
 
 void* bl_extend(bl* list) {
@@ -20,7 +20,7 @@
 #include "ioutils.h"
 #include "resample.h"
 
-static const char* OPTIONS = "hvw:o:e:O:Ns:p:D";
+static const char* OPTIONS = "hvw:o:e:O:Ns:p:DB:t:";
 
 void printHelp(char* progname) {
     fprintf(stderr, "%s [options] <input-FITS-image> <image-ext> <input-weight (filename or constant)> <weight-ext> <input-WCS> <wcs-ext> \n          [<image> <ext> <weight> <ext> <wcs> <ext>...]\n"
@@ -33,11 +33,121 @@ void printHelp(char* progname) {
             "    [-N]: use nearest-neighbour resampling (default: Lanczos)\n"
             "    [-s <sigma>]: smooth before resampling\n"
             "    [-D]: divide each image by its weight image before starting\n"
+            "    [-B <rows>]: build and write the output in bands of this many rows,\n"
+            "                 to bound memory use (default: all at once)\n"
+            "    [-t <threads>]: number of threads (default: one per CPU)\n"
             "    [-v]: more verbose\n"
             "\n", progname);
 }
 
+struct coadd_input {
+    char* imgfn;
+    int imgext;
+    char* wtfn;
+    int wtext;
+    anwcs_t* wcs;
+    // rows of the output it projects to.
+    int ylo, yhi;
+};
+
+// Reads input image "in" (and its weight image, or overall weight),
+// and applies the smoothing and weight division.
+static int read_input(const struct coadd_input* in, int plane, double sigma,
+                      anbool divweight, float** pimg, float** pwt,
+                      float* overallwt) {
+    anqfits_t* anq;
+    anqfits_t* wanq;
+    float* img;
+    float* wt = NULL;
+    int W, H;
+    const char* fn;
+    int ext;
+
+    *overallwt = 1.0;
+    fn = in->imgfn;
+    ext = in->imgext;
+    logmsg("Reading input image \"%s\" ext %i\n", fn, ext);
+
+    anq = anqfits_open(fn);
+    if (!anq) {
+        ERROR("Failed to open file \"%s\"\n", fn);
+        return -1;
+    }
 
+    img = anqfits_readpix(anq, ext, 0, 0, 0, 0, plane,
+                          PTYPE_FLOAT, NULL, &W, &H);
+    anqfits_close(anq);
+    if (!img) {
+        ERROR("Failed to read image from ext %i of %s\n", ext, fn);
+        return -1;
+    }
+    logmsg("Read image: %i x %i.\n", W, H);
+
+    if (sigma > 0.0) {
+        int k0, nk;
+        float* kernel;
+        logmsg("Smoothing by Gaussian with sigma=%g\n", sigma);
+        kernel = convolve_get_gaussian_kernel_f(sigma, 4, &k0, &nk);
+        convolve_separable_f(img, W, H, kernel, k0, nk, img, NULL);
+        free(kernel);
+    }
+
+    if (anwcs_imagew(in->wcs) != W || anwcs_imageh(in->wcs) != H) {
+        ERROR("Size mismatch between image and WCS!");
+        free(img);
+        return -1;
+    }
+
+    fn = in->wtfn;
+    ext = in->wtext;
+    if (streq(fn, "none")) {
+        logmsg("Not using weight image.\n");
+        wt = NULL;
+    } else if (file_exists(fn)) {
+        int wtW, wtH;
+        logmsg("Reading input weight image \"%s\" ext %i\n", fn, ext);
+        wanq = anqfits_open(fn);
+        if (!wanq) {
+            ERROR("Failed to open file \"%s\"\n", fn);
+            free(img);
+            return -1;
+        }
+        wt = anqfits_readpix(wanq, ext, 0, 0, 0, 0, 0,
+                             PTYPE_FLOAT, NULL, &wtW, &wtH);
+        anqfits_close(wanq);
+        if (!wt) {
+            ERROR("Failed to read image from ext %i of %s\n", ext, fn);
+            free(img);
+            return -1;
+        }
+        logmsg("Read image: %i x %i.\n", wtW, wtH);
+        if (wtW != W || wtH != H) {
+            ERROR("Size mismatch between image and weight!");
+            free(img);
+            free(wt);
+            return -1;
+        }
+    } else {
+        char* endp;
+        *overallwt = strtod(fn, &endp);
+        if (endp == fn) {
+            ERROR("Weight: \"%s\" is neither a file nor a double.\n", fn);
+            free(img);
+            return -1;
+        }
+        logmsg("Parsed weight value \"%g\"\n", *overallwt);
+    }
+
+    if (divweight && wt) {
+        int j;
+        logmsg("Dividing image by weight image...\n");
+        for (j=0; j<(W*H); j++)
+            img[j] /= wt[j];
+    }
+    *pimg = img;
+    *pwt = wt;
+    return 0;
+}
 
 int main(int argc, char** args) {
     int argchar;
@@ -49,12 +159,8 @@ int main(int argc, char** args) {
 
     anwcs_t* outwcs;
 
-    sl* inimgfns = sl_new(16);
-    sl* inwcsfns = sl_new(16);
-    sl* inwtfns = sl_new(16);
-    il* inimgexts = il_new(16);
-    il* inwcsexts = il_new(16);
-    il* inwtexts = il_new(16);
+    struct coadd_input* inputs;
+    int Ninputs;
 
     int i;
     int loglvl = LOG_MSG;
@@ -68,6 +174,12 @@ int main(int argc, char** args) {
     anbool divweight = FALSE;
 
     int plane = 0;
+    int bandrows = 0;
+    int nthreads = 0;
+    int outW, outH, y0;
+    qfitsdumper qoutimg;
+    qfits_header* hdr;
+    FILE* fid;
 
     while ((argchar = getopt(argc, args, OPTIONS)) != -1)
         switch (argchar) {
@@ -102,6 +214,12 @@ int main(int argc, char** args) {
         case 'O':
             order = atoi(optarg);
             break;
+        case 'B':
+            bandrows = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
         }
 
     log_init(loglvl);
@@ -114,27 +232,25 @@ int main(int argc, char** args) {
         exit(-1);
     }
 
-    for (i=0; i<argc/6; i++) {
-        sl_append(inimgfns, args[6*i+0]);
-        il_append(inimgexts, atoi(args[6*i+1]));
-        sl_append(inwtfns, args[6*i+2]);
-        il_append(inwtexts, atoi(args[6*i+3]));
-        sl_append(inwcsfns, args[6*i+4]);
-        il_append(inwcsexts, atoi(args[6*i+5]));
-    }
-
     logmsg("Reading output WCS file %s\n", outwcsfn);
     outwcs = anwcs_open(outwcsfn, outwcsext);
     if (!outwcs) {
         ERROR("Failed to read WCS from file: %s ext %i\n", outwcsfn, outwcsext);
         exit(-1);
     }
-
-    logmsg("Output image will be %i x %i\n", (int)anwcs_imagew(outwcs), (int)anwcs_imageh(outwcs));
-
-    coadd = coadd_new(anwcs_imagew(outwcs), anwcs_imageh(outwcs));
-
+    outW = anwcs_imagew(outwcs);
+    outH = anwcs_imageh(outwcs);
+    logmsg("Output image will be %i x %i\n", outW, outH);
+    if (bandrows <= 0 || bandrows > outH)
+        bandrows = outH;
+
+    coadd = coadd_new_band(outW, bandrows, 0);
+    if (!coadd) {
+        ERROR("Failed to allocate coadd");
+        exit(-1);
+    }
     coadd->wcs = outwcs;
+    coadd->nthreads = nthreads;
 
     if (nearest) {
         coadd->resample_func = nearest_resample_f;
@@ -145,166 +261,93 @@ int main(int argc, char** args) {
         coadd->resample_token = &largs;
     }
 
-    for (i=0; i<sl_size(inimgfns); i++) {
-        anqfits_t* anq;
-        anqfits_t* wanq;
-        float* img;
-        float* wt = NULL;
-        anwcs_t* inwcs;
+    // Read the input WCSes up front, to find which bands they cover.
+    Ninputs = argc/6;
+    inputs = calloc(Ninputs, sizeof(struct coadd_input));
+    for (i=0; i<Ninputs; i++) {
+        struct coadd_input* in = inputs + i;
         char* fn;
         int ext;
-        float overallwt = 1.0;
-        int W, H;
-
-        fn = sl_get(inimgfns, i);
-        ext = il_get(inimgexts, i);
-        logmsg("Reading input image \"%s\" ext %i\n", fn, ext);
-
-        anq = anqfits_open(fn);
-        if (!anq) {
-            ERROR("Failed to open file \"%s\"\n", fn);
-            exit(-1);
-        }
-
-        img = anqfits_readpix(anq, ext, 0, 0, 0, 0, plane,
-                              PTYPE_FLOAT, NULL, &W, &H);
-        if (!img) {
-            ERROR("Failed to read image from ext %i of %s\n", ext, fn);
-            exit(-1);
-        }
-        anqfits_close(anq);
-        logmsg("Read image: %i x %i.\n", W, H);
-
-        if (sigma > 0.0) {
-            int k0, nk;
-            float* kernel;
-            logmsg("Smoothing by Gaussian with sigma=%g\n", sigma);
-            kernel = convolve_get_gaussian_kernel_f(sigma, 4, &k0, &nk);
-            convolve_separable_f(img, W, H, kernel, k0, nk, img, NULL);
-            free(kernel);
-        }
-
-        fn = sl_get(inwcsfns, i);
-        ext = il_get(inwcsexts, i);
+        in->imgfn = args[6*i+0];
+        in->imgext = atoi(args[6*i+1]);
+        in->wtfn = args[6*i+2];
+        in->wtext = atoi(args[6*i+3]);
+        fn = args[6*i+4];
+        ext = atoi(args[6*i+5]);
         logmsg("Reading input WCS file \"%s\" ext %i\n", fn, ext);
-
-        inwcs = anwcs_open(fn, ext);
-        if (!inwcs) {
+        in->wcs = anwcs_open(fn, ext);
+        if (!in->wcs) {
             ERROR("Failed to read WCS from file \"%s\" ext %i\n", fn, ext);
             exit(-1);
         }
-        if (anwcs_pixel_scale(inwcs) == 0) {
+        if (anwcs_pixel_scale(in->wcs) == 0) {
             ERROR("Pixel scale from the WCS file is zero.  Usually this means the image has no valid WCS header.\n");
             exit(-1);
         }
-        if (anwcs_imagew(inwcs) != W || anwcs_imageh(inwcs) != H) {
-            ERROR("Size mismatch between image and WCS!");
-            exit(-1);
-        }
-
-        fn = sl_get(inwtfns, i);
-        ext = il_get(inwtexts, i);
-        if (streq(fn, "none")) {
-            logmsg("Not using weight image.\n");
-            wt = NULL;
-        } else if (file_exists(fn)) {
-            logmsg("Reading input weight image \"%s\" ext %i\n", fn, ext);
-            wanq = anqfits_open(fn);
-            if (!wanq) {
-                ERROR("Failed to open file \"%s\"\n", fn);
-                exit(-1);
-            }
-            int wtW, wtH;
-            wt = anqfits_readpix(anq, ext, 0, 0, 0, 0, 0,
-                                 PTYPE_FLOAT, NULL, &wtW, &wtH);
-            if (!wt) {
-                ERROR("Failed to read image from ext %i of %s\n", ext, fn);
-                exit(-1);
-            }
-            anqfits_close(wanq);
-            logmsg("Read image: %i x %i.\n", wtW, wtH);
-            if (wtW != W || wtH != H) {
-                ERROR("Size mismatch between image and weight!");
-                exit(-1);
-            }
-        } else {
-            char* endp;
-            overallwt = strtod(fn, &endp);
-            if (endp == fn) {
-                ERROR("Weight: \"%s\" is neither a file nor a double.\n", fn);
-                exit(-1);
-            }
-            logmsg("Parsed weight value \"%g\"\n", overallwt);
-        }
-
-        if (divweight && wt) {
-            int j;
-            logmsg("Dividing image by weight image...\n");
-            for (j=0; j<(W*H); j++)
-                img[j] /= wt[j];
-        }
-
-        coadd_add_image(coadd, img, wt, overallwt, inwcs);
-
-        anwcs_free(inwcs);
-        free(img);
-        if (wt)
-            free(wt);
+        if (!coadd_get_image_rows(coadd, in->wcs, &in->ylo, &in->yhi))
+            in->ylo = in->yhi = 0;
     }
 
-    //
     logmsg("Writing output: %s\n", outfn);
+    memset(&qoutimg, 0, sizeof(qoutimg));
+    qoutimg.filename = outfn;
+    qoutimg.npix = outW * outH;
+    qoutimg.ptype = PTYPE_FLOAT;
+    qoutimg.out_ptype = BPP_IEEE_FLOAT;
+    hdr = fits_get_header_for_image(&qoutimg, outW, NULL);
+    anwcs_add_to_header(outwcs, hdr);
+    fid = fopen(outfn, "wb");
+    if (!fid) {
+        SYSERROR("Failed to open output file \"%s\"", outfn);
+        exit(-1);
+    }
+    if (qfits_header_dump(hdr, fid) ||
+        fits_pad_file(fid) ||
+        fclose(fid)) {
+        ERROR("Failed to write FITS header to file \"%s\"", outfn);
+        exit(-1);
+    }
+    qfits_header_destroy(hdr);
 
-    coadd_divide_by_weight(coadd, 0.0);
-
-    /*
-     if (fits_write_float_image_hdr(coadd->img, coadd->W, coadd->H, outfn)) {
-     ERROR("Failed to write output image %s", outfn);
-     exit(-1);
-     }
-     */
-    /*
-     if (fits_write_float_image(coadd->img, coadd->W, coadd->H, outfn)) {
-     ERROR("Failed to write output image %s", outfn);
-     exit(-1);
-     }
-     */
-    {
-        qfitsdumper qoutimg;
-        qfits_header* hdr;
-        hdr = anqfits_get_header2(outwcsfn, outwcsext);
-        if (!hdr) {
-            ERROR("Failed to read WCS file \"%s\" ext %i\n", outwcsfn, outwcsext);
+    for (y0=0; y0<outH; y0+=bandrows) {
+        int bandH = MIN(bandrows, outH - y0);
+        if (coadd_set_band(coadd, y0, bandH))
             exit(-1);
+        if (bandH < outH)
+            logmsg("Output rows [%i, %i)\n", y0, y0 + bandH);
+        for (i=0; i<Ninputs; i++) {
+            struct coadd_input* in = inputs + i;
+            float* img;
+            float* wt = NULL;
+            float overallwt;
+            if (in->yhi <= y0 || in->ylo >= y0 + bandH)
+                continue;
+            if (read_input(in, plane, sigma, divweight, &img, &wt, &overallwt))
+                exit(-1);
+            coadd_add_image(coadd, img, wt, overallwt, in->wcs);
+            free(img);
+            free(wt);
         }
-        fits_header_mod_int(hdr, "NAXIS", 2, NULL);
-        fits_header_set_int(hdr, "NAXIS1", coadd->W, "image width");
-        fits_header_set_int(hdr, "NAXIS2", coadd->H, "image height");
-        fits_header_modf(hdr, "BITPIX", "-32", "32-bit floats");
-        memset(&qoutimg, 0, sizeof(qoutimg));
-        qoutimg.filename = outfn;
-        qoutimg.npix = coadd->W * coadd->H;
+        coadd_divide_by_weight(coadd, 0.0);
+        // append this band's pixels.
+        qoutimg.npix = outW * bandH;
         qoutimg.fbuf = coadd->img;
-        qoutimg.ptype = PTYPE_FLOAT;
-        qoutimg.out_ptype = BPP_IEEE_FLOAT;
-        if (fits_write_header_and_image(NULL, &qoutimg, coadd->W)) {
+        if (qfits_pixdump(&qoutimg)) {
             ERROR("Failed to write FITS image to file \"%s\"", outfn);
             exit(-1);
         }
-        qfits_header_destroy(hdr);
+    }
+    fid = fopen(outfn, "ab");
+    if (!fid || fits_pad_file(fid) || fclose(fid)) {
+        SYSERROR("Failed to pad output file \"%s\"", outfn);
+        exit(-1);
     }
 
     coadd_free(coadd);
-    sl_free2(inimgfns);
-    sl_free2(inwcsfns);
-    sl_free2(inwtfns);
-    il_free(inimgexts);
-    il_free(inwcsexts);
-    il_free(inwtexts);
+    for (i=0; i<Ninputs; i++)
+        anwcs_free(inputs[i].wcs);
+    free(inputs);
     anwcs_free(outwcs);
 
-
     return 0;
 }
-
-
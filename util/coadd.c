@@ -3,7 +3,10 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "coadd.h"
 #include "mathutil.h"
@@ -16,7 +19,7 @@ coadd_t* coadd_new_from_wcs(anwcs_t* wcs) {
     int W,H;
     coadd_t* co;
     W = anwcs_imagew(wcs);
-    H = anwcs_imagew(wcs);
+    H = anwcs_imageh(wcs);
     co = coadd_new(W, H);
     if (!co) {
 	return NULL;
@@ -26,15 +29,38 @@ coadd_t* coadd_new_from_wcs(anwcs_t* wcs) {
 }
 
 coadd_t* coadd_new(int W, int H) {
+    return coadd_new_band(W, H, 0);
+}
+
+coadd_t* coadd_new_band(int W, int H, int y0) {
     coadd_t* ca = calloc(1, sizeof(coadd_t));
     ca->img = calloc((size_t)W * (size_t)H, sizeof(number));
     ca->weight = calloc((size_t)W * (size_t)H, sizeof(number));
+    if (!ca->img || !ca->weight) {
+        SYSERROR("Failed to allocate %i x %i coadd", W, H);
+        coadd_free(ca);
+        return NULL;
+    }
     ca->W = W;
-    ca->H = H;
+    ca->H = ca->Hmax = H;
+    ca->y0 = y0;
+    ca->nthreads = 1;
     ca->resample_func = nearest_resample_f;
     return ca;
 }
 
+int coadd_set_band(coadd_t* ca, int y0, int H) {
+    if (H > ca->Hmax) {
+        ERROR("Coadd band of %i rows is bigger than the %i allocated", H, ca->Hmax);
+        return -1;
+    }
+    ca->y0 = y0;
+    ca->H = H;
+    memset(ca->img, 0, (size_t)ca->W * (size_t)H * sizeof(number));
+    memset(ca->weight, 0, (size_t)ca->W * (size_t)H * sizeof(number));
+    return 0;
+}
+
 void coadd_set_lanczos(coadd_t* co, int Lorder) {
     lanczos_args_t* L = calloc(1, sizeof(lanczos_args_t));
     L->weighted = 0;
@@ -94,17 +120,14 @@ static void check_bounds(const anwcs_t* wcs, double x, double y, double ra, doub
 }
 
 
-int coadd_add_image(coadd_t* ca, const number* img,
-                    const number* weightimg,
-                    number weight, const anwcs_t* wcs) {
-    int W, H;
-    int i, j;
-    int xlo,xhi,ylo,yhi;
+// Finds the region of the output image, [xlo,xhi) x [ylo,yhi), that an
+// image with WCS "wcs" projects into; the rows are of the whole output
+// image, not just the current band.
+static void image_bounds(const coadd_t* ca, const anwcs_t* wcs,
+                         int* xlo, int* xhi, int* ylo, int* yhi) {
     check_bounds_t cb;
-
-    W = anwcs_imagew(wcs);
-    H = anwcs_imageh(wcs);
-
+    int W = anwcs_imagew(wcs);
+    int H = anwcs_imageh(wcs);
     // if check_bounds:
     cb.xlo = W;
     cb.xhi = 0;
@@ -112,44 +135,124 @@ int coadd_add_image(coadd_t* ca, const number* img,
     cb.yhi = 0;
     cb.wcs = ca->wcs;
     anwcs_walk_image_boundary(wcs, 50, check_bounds, &cb);
-    xlo = MAX(0,     floor(cb.xlo));
-    xhi = MIN(ca->W,  ceil(cb.xhi)+1);
-    ylo = MAX(0,     floor(cb.ylo));
-    yhi = MIN(ca->H,  ceil(cb.yhi)+1);
-    logmsg("Image projects to output image region: [%i,%i), [%i,%i)\n", xlo, xhi, ylo, yhi);
-
-    for (i=ylo; i<yhi; i++) {
-        for (j=xlo; j<xhi; j++) {
-            double ra, dec;
-            double px, py;
-            double wt;
-            double val;
-
-            // +1 for FITS
-            if (anwcs_pixelxy2radec(ca->wcs, j+1, i+1, &ra, &dec)) {
-                ERROR("Failed to project pixel (%i,%i) through output WCS\n", j, i);
-                continue;
-            }
-            if (anwcs_radec2pixelxy(wcs, ra, dec, &px, &py)) {
-                ERROR("Failed to project pixel (%i,%i) through input WCS\n", j, i);
-                continue;
-            }
-            // -1 for FITS
-            px -= 1;
-            py -= 1;
-
-            if (px < 0 || px >= W)
-                continue;
-            if (py < 0 || py >= H)
-                continue;
-
-            val = ca->resample_func(px, py, img, weightimg, W, H, &wt,
-                                    ca->resample_token);
-            ca->img[i*ca->W + j] += val * weight;
-            ca->weight[i*ca->W + j] += wt * weight;
+    *xlo = MAX(0,     floor(cb.xlo));
+    *xhi = MIN(ca->W,  ceil(cb.xhi)+1);
+    *ylo = MAX(0,     floor(cb.ylo));
+    *yhi = ceil(cb.yhi)+1;
+}
+
+anbool coadd_get_image_rows(const coadd_t* ca, const anwcs_t* wcs,
+                            int* ylo, int* yhi) {
+    int xlo, xhi;
+    image_bounds(ca, wcs, &xlo, &xhi, ylo, yhi);
+    return (*ylo < *yhi && xlo < xhi);
+}
+
+struct add_image {
+    coadd_t* ca;
+    const number* img;
+    const number* weightimg;
+    number weight;
+    const anwcs_t* wcs;
+    int xlo, xhi;
+    // the next row to do, and the last; under "lock".
+    int nextrow, yhi;
+    pthread_mutex_t lock;
+};
+
+static void add_image_row(struct add_image* a, int i) {
+    coadd_t* ca = a->ca;
+    const anwcs_t* wcs = a->wcs;
+    int W = anwcs_imagew(wcs);
+    int H = anwcs_imageh(wcs);
+    number* imgrow = ca->img + (size_t)(i - ca->y0) * ca->W;
+    number* wtrow = ca->weight + (size_t)(i - ca->y0) * ca->W;
+    int j;
+    for (j=a->xlo; j<a->xhi; j++) {
+        double ra, dec;
+        double px, py;
+        double wt;
+        double val;
+
+        // +1 for FITS
+        if (anwcs_pixelxy2radec(ca->wcs, j+1, i+1, &ra, &dec)) {
+            ERROR("Failed to project pixel (%i,%i) through output WCS\n", j, i);
+            continue;
+        }
+        if (anwcs_radec2pixelxy(wcs, ra, dec, &px, &py)) {
+            ERROR("Failed to project pixel (%i,%i) through input WCS\n", j, i);
+            continue;
         }
-        logverb("Row %i of %i\n", i+1, ca->H);
+        // -1 for FITS
+        px -= 1;
+        py -= 1;
+
+        if (px < 0 || px >= W)
+            continue;
+        if (py < 0 || py >= H)
+            continue;
+
+        val = ca->resample_func(px, py, a->img, a->weightimg, W, H, &wt,
+                                ca->resample_token);
+        imgrow[j] += val * a->weight;
+        wtrow[j] += wt * a->weight;
+    }
+}
+
+static void* add_image_rows(void* v) {
+    struct add_image* a = v;
+    while (1) {
+        int i;
+        pthread_mutex_lock(&a->lock);
+        i = a->nextrow++;
+        pthread_mutex_unlock(&a->lock);
+        if (i >= a->yhi)
+            break;
+        add_image_row(a, i);
+        logverb("Row %i of %i\n", i+1, a->ca->y0 + a->ca->H);
     }
+    return NULL;
+}
+
+int coadd_add_image(coadd_t* ca, const number* img,
+                    const number* weightimg,
+                    number weight, const anwcs_t* wcs) {
+    struct add_image a;
+    int ylo, yhi, nthreads, nstarted, i;
+    pthread_t* threads;
+
+    memset(&a, 0, sizeof(a));
+    a.ca = ca;
+    a.img = img;
+    a.weightimg = weightimg;
+    a.weight = weight;
+    a.wcs = wcs;
+    image_bounds(ca, wcs, &a.xlo, &a.xhi, &ylo, &yhi);
+    logmsg("Image projects to output image region: [%i,%i), [%i,%i)\n",
+           a.xlo, a.xhi, ylo, yhi);
+    // clip to this band.
+    a.nextrow = MAX(ylo, ca->y0);
+    a.yhi = MIN(yhi, ca->y0 + ca->H);
+    if (a.nextrow >= a.yhi)
+        return 0;
+
+    nthreads = ca->nthreads;
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, a.yhi - a.nextrow));
+    pthread_mutex_init(&a.lock, NULL);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    // this thread is the first worker.
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, add_image_rows, &a)) {
+            SYSERROR("Failed to start coadd thread");
+            break;
+        }
+    add_image_rows(&a);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&a.lock);
     return 0;
 }
 
@@ -5,11 +5,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
+#include "os-features.h"
 #include "codekd.h"
 #include "kdtree_fits_io.h"
 #include "starutil.h"
 #include "errors.h"
+#include "fitsbin.h"
+#include "fitsioutils.h"
+#include "permutedsort.h"
+#include "healpix.h"
+#include "mathutil.h"
+#include "shmcache.h"
+#include "log.h"
+
+static int Ndata(codetree_t* s);
 
 static codetree_t* codetree_alloc() {
     codetree_t* s = calloc(1, sizeof(codetree_t));
@@ -24,6 +36,241 @@ int codetree_append_to(codetree_t* s, FILE* fid) {
     return kdtree_fits_append_tree_to(s->tree, s->header, fid);
 }
 
+// Builds a tree of the codes of "members" (indices into the tree-order
+// "codes"), like "s"'s tree, and appends it to "fid" with header "hdr".
+static int append_bin_tree(codetree_t* s, const double* codes,
+                           const int* members, int n, const char* name,
+                           const qfits_header* hdr, FILE* fid) {
+    kdtree_t* kd = s->tree;
+    int D = kd->ndim;
+    int Nleaf = qfits_header_getint(s->header, "NLEAF", 25);
+    int buildopts = 0;
+    double* bincodes;
+    kdtree_t* bkd;
+    int i, rtn;
+
+    if (kd->bb.any)
+        buildopts |= KD_BUILD_BBOX;
+    if (kd->split.any)
+        buildopts |= KD_BUILD_SPLIT;
+    if (kd->splitdim)
+        buildopts |= KD_BUILD_SPLITDIM;
+    // (a tree of one leaf has no splits: give it a bounding box instead.)
+    if (n < Nleaf)
+        buildopts = KD_BUILD_BBOX;
+    bincodes = malloc((size_t)MAX(n, 1) * D * sizeof(double));
+    if (!bincodes) {
+        SYSERROR("Failed to allocate %i codes for code kdtree \"%s\"", n, name);
+        return -1;
+    }
+    for (i=0; i<n; i++)
+        memcpy(bincodes + (size_t)i * D, codes + (size_t)members[i] * D,
+               D * sizeof(double));
+    bkd = kdtree_new(n, D, Nleaf);
+    if (kd->minval && kd->maxval)
+        kdtree_set_limits(bkd, kd->minval, kd->maxval);
+    bkd = kdtree_build(bkd, bincodes, n, D, Nleaf, kd->treetype, buildopts);
+    if (!bkd) {
+        ERROR("Failed to build code kdtree \"%s\"", name);
+        free(bincodes);
+        return -1;
+    }
+    // point the bin's permutation at quad numbers.
+    for (i=0; i<n; i++)
+        bkd->perm[i] = kdtree_permute(kd, members[bkd->perm[i]]);
+    kdtree_set_name(bkd, name);
+    rtn = kdtree_fits_append_tree_to(bkd, hdr, fid);
+    kdtree_free(bkd);
+    free(bincodes);
+    if (rtn || fits_pad_file(fid)) {
+        ERROR("Failed to write code kdtree \"%s\"", name);
+        return -1;
+    }
+    return 0;
+}
+
+// The codes, in tree order.
+static double* tree_codes(codetree_t* s) {
+    kdtree_t* kd = s->tree;
+    double* codes;
+    if (kdtree_load(kd))
+        return NULL;
+    codes = malloc((size_t)MAX(kd->ndata, 1) * kd->ndim * sizeof(double));
+    if (!codes) {
+        SYSERROR("Failed to allocate %i codes", kd->ndata);
+        return NULL;
+    }
+    kdtree_copy_data_double(kd, 0, kd->ndata, codes);
+    return codes;
+}
+
+static qfits_header* bin_header(void) {
+    qfits_header* hdr = qfits_header_default();
+    qfits_header_add(hdr, "AN_FILE", AN_FILETYPE_CODETREE, "This is a code kdtree.", NULL);
+    return hdr;
+}
+
+int codetree_append_scale_bins_to(codetree_t* s, const double* ablen,
+                                  int nbins, FILE* fid) {
+    kdtree_t* kd = s->tree;
+    int N = kd->ndata;
+    double* codes;
+    double* ab = NULL;
+    int* order = NULL;
+    int i, j, rtn = -1;
+
+    nbins = MAX(1, MIN(nbins, N));
+    codes = tree_codes(s);
+    if (!codes)
+        return -1;
+    ab = malloc((size_t)MAX(N, 1) * sizeof(double));
+    if (!ab) {
+        SYSERROR("Failed to allocate scale bins for %i codes", N);
+        goto bailout;
+    }
+    // (in tree order)
+    for (i=0; i<N; i++)
+        ab[i] = ablen[kdtree_permute(kd, i)];
+    order = permuted_sort(ab, sizeof(double), compare_doubles_asc, NULL, N);
+
+    for (j=0; j<nbins; j++) {
+        int start = (int)((int64_t)N * j / nbins);
+        int n = (int)((int64_t)N * (j+1) / nbins) - start;
+        const int* binorder = order + start;
+        qfits_header* hdr;
+        char name[64];
+
+        sprintf(name, CODETREE_SCALEBIN_NAME, j);
+        hdr = bin_header();
+        fits_header_add_int(hdr, "SCBIN", j, "Scale bin number");
+        fits_header_add_int(hdr, "SCBINS", nbins, "Number of scale bins");
+        // (to full precision, so the range holds all the bin's quads)
+        fits_header_addf(hdr, "SCBINLO", "Smallest AB length in the bin (rad)",
+                         "%.17G", ab[binorder[0]]);
+        fits_header_addf(hdr, "SCBINHI", "Largest AB length in the bin (rad)",
+                         "%.17G", ab[binorder[n-1]]);
+        rtn = append_bin_tree(s, codes, binorder, n, name, hdr, fid);
+        qfits_header_destroy(hdr);
+        if (rtn)
+            goto bailout;
+    }
+    rtn = 0;
+ bailout:
+    free(order);
+    free(ab);
+    free(codes);
+    return rtn;
+}
+
+int codetree_append_sky_bins_to(codetree_t* s, const double* abmid,
+                                int nside, FILE* fid) {
+    kdtree_t* kd = s->tree;
+    int N = kd->ndata;
+    int ncells = 12 * nside * nside;
+    double* codes;
+    int* cellstart = NULL;
+    int* members = NULL;
+    int* cell = NULL;
+    int i, c, nbins = 0, rtn = -1;
+
+    codes = tree_codes(s);
+    if (!codes)
+        return -1;
+    cellstart = calloc(ncells + 1, sizeof(int));
+    members = malloc((size_t)MAX(N, 1) * sizeof(int));
+    cell = malloc((size_t)MAX(N, 1) * sizeof(int));
+    if (!cellstart || !members || !cell) {
+        SYSERROR("Failed to allocate sky bins for %i codes", N);
+        goto bailout;
+    }
+    // counting sort of the codes (in tree order) into the cells.
+    for (i=0; i<N; i++) {
+        cell[i] = xyzarrtohealpix(abmid + 3 * (size_t)kdtree_permute(kd, i),
+                                  nside);
+        cellstart[cell[i] + 1]++;
+    }
+    for (c=0; c<ncells; c++)
+        cellstart[c+1] += cellstart[c];
+    for (i=0; i<N; i++)
+        members[cellstart[cell[i]]++] = i;
+    // (the counting sort left each cellstart at the next cell's start.)
+    memmove(cellstart + 1, cellstart, ncells * sizeof(int));
+    cellstart[0] = 0;
+
+    for (c=0; c<ncells; c++) {
+        int n = cellstart[c+1] - cellstart[c];
+        const int* binmembers = members + cellstart[c];
+        double center[3];
+        double r2 = 0.0;
+        qfits_header* hdr;
+        char name[64];
+        if (!n)
+            continue;
+        // the cap around the cell's center that holds its quads.
+        healpix_to_xyzarr(c, nside, 0.5, 0.5, center);
+        for (i=0; i<n; i++)
+            r2 = MAX(r2, distsq(center, abmid + 3 * (size_t)
+                                kdtree_permute(kd, binmembers[i]), 3));
+        sprintf(name, CODETREE_SKYBIN_NAME, nbins);
+        hdr = bin_header();
+        fits_header_add_int(hdr, "SKYHP", c, "HEALPix cell of the sky bin");
+        fits_header_add_int(hdr, "SKYNSIDE", nside, "Nside of the sky bins");
+        fits_header_addf(hdr, "SKYX", "Center of the sky bin's cap", "%.17G",
+                         center[0]);
+        fits_header_addf(hdr, "SKYY", "Center of the sky bin's cap", "%.17G",
+                         center[1]);
+        fits_header_addf(hdr, "SKYZ", "Center of the sky bin's cap", "%.17G",
+                         center[2]);
+        fits_header_addf(hdr, "SKYR2", "Squared radius of the sky bin's cap",
+                         "%.17G", r2);
+        rtn = append_bin_tree(s, codes, binmembers, n, name, hdr, fid);
+        qfits_header_destroy(hdr);
+        if (rtn)
+            goto bailout;
+        nbins++;
+    }
+    rtn = 0;
+ bailout:
+    free(cell);
+    free(members);
+    free(cellstart);
+    free(codes);
+    return rtn;
+}
+
+int codetree_scale_bins_between(const codetree_t* s, double ablo, double abhi,
+                                int* b0, int* b1) {
+    int i;
+    *b0 = *b1 = 0;
+    // bins are in increasing scale, but may overlap where they share
+    // quads of equal length.
+    for (i=0; i<s->nscalebins; i++)
+        if (s->scalebin_hi[i] >= ablo)
+            break;
+    *b0 = i;
+    for (; i<s->nscalebins; i++)
+        if (s->scalebin_lo[i] > abhi)
+            break;
+    *b1 = i - 1;
+    return MAX(0, *b1 - *b0 + 1);
+}
+
+int codetree_sky_bins_near(const codetree_t* s, const double* xyz,
+                           double r2, anbool* near) {
+    double r = sqrt(r2);
+    int i, n = 0;
+    for (i=0; i<s->nskybins; i++) {
+        // a quad whose AB midpoint is within the search cap, and within
+        // the bin's cap, makes the caps' centers this close (with a
+        // little room for rounding).
+        double maxd = r + sqrt(s->skybin_r2[i]) + 1e-9;
+        near[i] = (distsq(xyz, s->skybin_xyz + 3*i, 3) <= square(maxd));
+        if (near[i])
+            n++;
+    }
+    return n;
+}
+
 int codetree_N(codetree_t* s) {
     return s->tree->ndata;
 }
@@ -41,8 +288,72 @@ qfits_header* codetree_header(codetree_t* s) {
 }
 
 int codetree_get_permuted(codetree_t* s, int index) {
-    if (s->tree->perm) return s->tree->perm[index];
-    else return index;
+    return kdtree_permute(s->tree, index);
+}
+
+// Records bin "i", with header "hdr", of the scale or sky bins.
+static void add_scale_bin(codetree_t* s, int i, kdtree_t* bkd,
+                          const qfits_header* hdr) {
+    s->scalebins = realloc(s->scalebins, (i+1) * sizeof(kdtree_t*));
+    s->scalebin_lo = realloc(s->scalebin_lo, (i+1) * sizeof(double));
+    s->scalebin_hi = realloc(s->scalebin_hi, (i+1) * sizeof(double));
+    s->scalebins[i] = bkd;
+    s->scalebin_lo[i] = qfits_header_getdouble(hdr, "SCBINLO", 0.0);
+    s->scalebin_hi[i] = qfits_header_getdouble(hdr, "SCBINHI", 0.0);
+    s->nscalebins = i+1;
+}
+
+static void add_sky_bin(codetree_t* s, int i, kdtree_t* bkd,
+                        const qfits_header* hdr) {
+    s->skybins = realloc(s->skybins, (i+1) * sizeof(kdtree_t*));
+    s->skybin_xyz = realloc(s->skybin_xyz, (i+1) * 3 * sizeof(double));
+    s->skybin_r2 = realloc(s->skybin_r2, (i+1) * sizeof(double));
+    s->skybins[i] = bkd;
+    s->skybin_xyz[3*i+0] = qfits_header_getdouble(hdr, "SKYX", 0.0);
+    s->skybin_xyz[3*i+1] = qfits_header_getdouble(hdr, "SKYY", 0.0);
+    s->skybin_xyz[3*i+2] = qfits_header_getdouble(hdr, "SKYZ", 0.0);
+    // (a bin with no radius would match nothing.)
+    s->skybin_r2[i] = qfits_header_getdouble(hdr, "SKYR2", 4.0);
+    s->nskybins = i+1;
+}
+
+// Reads the bin trees named "nameformat", if there are any.  Each has
+// its own kdtree_fits_t, since a tree closes the one it was read from.
+static int read_bins(codetree_t* s, const char* fn, anqfits_t* fits,
+                     const char* nameformat,
+                     void (*add)(codetree_t* s, int i, kdtree_t* bkd,
+                                 const qfits_header* hdr)) {
+    kdtree_fits_t* io = NULL;
+    int i;
+    for (i=0;; i++) {
+        char name[64];
+        qfits_header* hdr;
+        kdtree_t* bkd;
+
+        if (!io)
+            io = fits ? kdtree_fits_open_fits(fits) : kdtree_fits_open(fn);
+        if (!io) {
+            ERROR("Failed to open FITS file \"%s\"", fn);
+            return -1;
+        }
+        sprintf(name, nameformat, i);
+        if (!kdtree_fits_contains_tree(io, name))
+            break;
+        bkd = kdtree_fits_read_tree(io, name, &hdr);
+        if (!bkd) {
+            ERROR("Failed to read code kdtree \"%s\" from file %s", name, fn);
+            kdtree_fits_io_close(io);
+            return -1;
+        }
+        add(s, i, bkd, hdr);
+        qfits_header_destroy(hdr);
+        fitsbin_close_fd(io);
+        // (now owned by bkd.)
+        io = NULL;
+    }
+    if (io)
+        kdtree_fits_io_close(io);
+    return 0;
 }
 
 static codetree_t* my_open(const char* fn, anqfits_t* fits) {
@@ -70,6 +381,17 @@ static codetree_t* my_open(const char* fn, anqfits_t* fits) {
         ERROR("Failed to read code kdtree from file %s\n", fn);
         goto bailout;
     }
+    if (read_bins(s, fn, fits, CODETREE_SCALEBIN_NAME, add_scale_bin) ||
+        read_bins(s, fn, fits, CODETREE_SKYBIN_NAME, add_sky_bin)) {
+        // (closes "io", too.)
+        codetree_close(s);
+        return NULL;
+    }
+
+    if (s->nscalebins)
+        logverb("Code kdtree has %i scale bins\n", s->nscalebins);
+    if (s->nskybins)
+        logverb("Code kdtree has %i sky bins\n", s->nskybins);
 
     // kdtree_fits_t is a typedef of fitsbin_t
     fitsbin_close_fd(io);
@@ -89,8 +411,21 @@ codetree_t* codetree_open(const char* fn) {
 }
 
 int codetree_close(codetree_t* s) {
+    int i;
     if (!s) return 0;
-    if (s->inverse_perm)
+    for (i=0; i<s->nscalebins; i++)
+        kdtree_fits_close(s->scalebins[i]);
+    free(s->scalebins);
+    free(s->scalebin_lo);
+    free(s->scalebin_hi);
+    for (i=0; i<s->nskybins; i++)
+        kdtree_fits_close(s->skybins[i]);
+    free(s->skybins);
+    free(s->skybin_xyz);
+    free(s->skybin_r2);
+    if (s->inverse_perm_shared)
+        shmcache_detach(s->inverse_perm, Ndata(s) * sizeof(int));
+    else if (s->inverse_perm)
         free(s->inverse_perm);
     if (s->header)
         qfits_header_destroy(s->header);
@@ -104,7 +439,29 @@ static int Ndata(codetree_t* s) {
     return s->tree->ndata;
 }
 
+static int fill_inverse_perm(void* data, size_t size, void* token) {
+    kdtree_inverse_permutation((kdtree_t*)token, data);
+    return 0;
+}
+
+// Attaches to (or creates) the shared inverse permutation, if enabled.
+static anbool get_shared_inverse_perm(codetree_t* s) {
+    fitsbin_t* fb;
+    char* key;
+    if (!shmcache_enabled() || !s->tree->io)
+        return FALSE;
+    fb = kdtree_fits_get_fitsbin(s->tree->io);
+    key = shmcache_key(fitsbin_get_filename(fb), "codes-invperm");
+    s->inverse_perm = (int*)shmcache_attach(key, Ndata(s) * sizeof(int),
+                                            fill_inverse_perm, s->tree);
+    free(key);
+    s->inverse_perm_shared = (s->inverse_perm != NULL);
+    return s->inverse_perm_shared;
+}
+
 void codetree_compute_inverse_perm(codetree_t* s) {
+    if (get_shared_inverse_perm(s))
+        return;
     // compute inverse permutation vector.
     s->inverse_perm = malloc(Ndata(s) * sizeof(int));
     if (!s->inverse_perm) {
@@ -115,6 +472,8 @@ void codetree_compute_inverse_perm(codetree_t* s) {
 }
 
 int codetree_get(codetree_t* s, unsigned int codeid, double* code) {
+    if (kdtree_load(s->tree))
+        return -1;
     if (s->tree->perm && !s->inverse_perm) {
         codetree_compute_inverse_perm(s);
         if (!s->inverse_perm)
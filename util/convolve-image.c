@@ -4,14 +4,19 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "convolve-image.h"
 #include "mathutil.h"
 #include "keywords.h"
 #include "os-features.h"
+#include "errors.h"
 
 float* convolve_get_gaussian_kernel_f(double sigma, double nsigma, int* p_k0, int* p_NK) {
     int K0, NK, i;
@@ -30,20 +35,343 @@ float* convolve_get_gaussian_kernel_f(double sigma, double nsigma, int* p_k0, in
     return kernel;
 }
 
+static int convolve_method = CONVOLVE_AUTO;
+
+void convolve_set_method(int method) {
+    convolve_method = method;
+}
+
+/*
+ An in-place complex FFT of length n (a power of two), of "z" holding n
+ interleaved (re, im) doubles; the inverse isn't scaled by 1/n.
+ */
+typedef struct {
+    int n;
+    // cos and sin of -2 pi k / n, for k < n/2.
+    double* tw;
+    int* rev;
+} fft_plan_t;
+
+static fft_plan_t* fft_plan_new(int n) {
+    fft_plan_t* p = malloc(sizeof(fft_plan_t));
+    int i, bits = 0;
+    p->n = n;
+    p->tw = malloc(n * sizeof(double));
+    p->rev = malloc(n * sizeof(int));
+    while ((1 << bits) < n)
+        bits++;
+    for (i=0; i<n/2; i++) {
+        p->tw[2*i]   = cos(-2.0 * M_PI * i / n);
+        p->tw[2*i+1] = sin(-2.0 * M_PI * i / n);
+    }
+    for (i=0; i<n; i++) {
+        int j, r = 0;
+        for (j=0; j<bits; j++)
+            if (i & (1 << j))
+                r |= 1 << (bits - 1 - j);
+        p->rev[i] = r;
+    }
+    return p;
+}
+
+static void fft_plan_free(fft_plan_t* p) {
+    if (!p)
+        return;
+    free(p->tw);
+    free(p->rev);
+    free(p);
+}
+
+static void fft(const fft_plan_t* p, double* z, anbool inverse) {
+    int n = p->n;
+    int i, len;
+    for (i=0; i<n; i++) {
+        int r = p->rev[i];
+        if (r > i) {
+            double t;
+            t = z[2*i];   z[2*i]   = z[2*r];   z[2*r]   = t;
+            t = z[2*i+1]; z[2*i+1] = z[2*r+1]; z[2*r+1] = t;
+        }
+    }
+    for (len=2; len<=n; len*=2) {
+        int half = len / 2;
+        int step = n / len;
+        int s, k;
+        for (s=0; s<n; s+=len) {
+            for (k=0; k<half; k++) {
+                double wr = p->tw[2*k*step];
+                double wi = inverse ? -p->tw[2*k*step+1] : p->tw[2*k*step+1];
+                double* a = z + 2*(s+k);
+                double* b = z + 2*(s+k+half);
+                double tr = wr * b[0] - wi * b[1];
+                double ti = wr * b[1] + wi * b[0];
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+/*
+ One pass of the separable convolution: each of the "nrows" rows (of
+ length "len") of "in" is convolved with the kernel, normalized by the
+ kernel (times the weights) within the row, and written to "out" in
+ transposed order (column r of "out", which is "nrows" wide).  The
+ threads each take a contiguous block of rows.
+ */
+struct conv_pass {
+    const float* in;
+    const float* weight;
+    float* out;
+    int len;
+    int nrows;
+    const float* kernel;
+    int K0;
+    int NK;
+    // ksum[k] = sum of kernel[0..k).
+    const double* ksum;
+    // FFT path: the plan, and the spectrum of the kernel.
+    const fft_plan_t* plan;
+    const double* kfft;
+    // this thread's rows.
+    int row0, row1;
+};
+
+// The sum of the kernel elements that fall within the row at "j".
+static double kernel_sum(const struct conv_pass* c, int j) {
+    int k0 = MAX(0, j + c->K0 - (c->len - 1));
+    int k1 = MIN(c->NK, j + c->K0 + 1);
+    return c->ksum[k1] - c->ksum[k0];
+}
+
+static void conv_row_direct(const struct conv_pass* c, int i) {
+    const float* kernel = c->kernel;
+    int W = c->len;
+    int K0 = c->K0;
+    int NK = c->NK;
+    int j, k;
+    for (j=0; j<W; j++) {
+        float sum = 0;
+        float sumw = 0;
+        /*
+         This is true convolution, so the kernel is flipped;
+         in this loop we are adding image pixels from right to left.
+         */
+        for (k = MAX(0, j + K0 - (W-1));
+             k < MIN(NK, j + K0 + 1); k++) {
+            size_t p = (size_t)i*W + j - k + K0;
+            if (c->weight) {
+                sum  += kernel[k] * c->weight[p] * c->in[p];
+                sumw += kernel[k] * c->weight[p];
+            } else {
+                sum  += kernel[k] * c->in[p];
+                sumw += kernel[k];
+            }
+        }
+        // store in transposed order
+        c->out[(size_t)j*c->nrows + i] = (sumw == 0.0) ? 0.0 : (sum / sumw);
+    }
+}
+
+// (by the bits, since isfinite() is compiled away with -ffinite-math-only.)
+static anbool row_is_finite(const float* row, int n) {
+    int j;
+    for (j=0; j<n; j++) {
+        uint32_t u;
+        memcpy(&u, row + j, sizeof(u));
+        if ((u & 0x7f800000) == 0x7f800000)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ Convolves rows "i" and "i2" (or, with weights, row "i" times the
+ weights and the weights themselves) as the real and imaginary parts of
+ one complex FFT: the kernel is real, so the two don't mix.
+ */
+static void conv_rows_fft(const struct conv_pass* c, int i, int i2,
+                          double* z) {
+    const float* a = c->in + (size_t)i * c->len;
+    const float* w = c->weight ? c->weight + (size_t)i * c->len : NULL;
+    const float* b = (i2 >= 0) ? c->in + (size_t)i2 * c->len : NULL;
+    int n = c->plan->n;
+    double scale = 1.0 / n;
+    double wmax = 0;
+    int j;
+
+    memset(z, 0, 2 * n * sizeof(double));
+    for (j=0; j<c->len; j++) {
+        if (w) {
+            z[2*j]   = (double)w[j] * a[j];
+            z[2*j+1] = w[j];
+            wmax = MAX(wmax, fabs(w[j]));
+        } else {
+            z[2*j] = a[j];
+            if (b)
+                z[2*j+1] = b[j];
+        }
+    }
+    fft(c->plan, z, FALSE);
+    for (j=0; j<n; j++) {
+        double kr = c->kfft[2*j];
+        double ki = c->kfft[2*j+1];
+        double zr = z[2*j];
+        double zi = z[2*j+1];
+        z[2*j]   = zr * kr - zi * ki;
+        z[2*j+1] = zr * ki + zi * kr;
+    }
+    fft(c->plan, z, TRUE);
+    for (j=0; j<c->len; j++) {
+        // the convolution at j is at j + K0 (the kernel's center).
+        double re = z[2*(j + c->K0)] * scale;
+        double im = z[2*(j + c->K0) + 1] * scale;
+        if (w) {
+            // (round-off leaves a little in windows with no weight.)
+            float v = (fabs(im) <= 1e-9 * wmax * c->ksum[c->NK]) ? 0.0 : re / im;
+            c->out[(size_t)j*c->nrows + i] = v;
+        } else {
+            double sumw = kernel_sum(c, j);
+            c->out[(size_t)j*c->nrows + i] = (sumw == 0.0) ? 0.0 : re / sumw;
+            if (b)
+                c->out[(size_t)j*c->nrows + i2] = (sumw == 0.0) ? 0.0 : im / sumw;
+        }
+    }
+}
+
+static void* conv_pass_rows(void* v) {
+    const struct conv_pass* c = v;
+    double* z = NULL;
+    int i;
+
+    if (c->plan)
+        z = malloc(2 * c->plan->n * sizeof(double));
+    for (i=c->row0; i<c->row1; i++) {
+        const float* row = c->in + (size_t)i * c->len;
+        // Non-finite pixels would spread over the whole row through the
+        // FFT, rather than just the kernel's width.
+        if (!z || !row_is_finite(row, c->len) ||
+            (c->weight && !row_is_finite(c->weight + (size_t)i * c->len,
+                                          c->len))) {
+            conv_row_direct(c, i);
+            continue;
+        }
+        // pair up rows without weights.
+        if (!c->weight && i + 1 < c->row1 &&
+            row_is_finite(row + c->len, c->len)) {
+            conv_rows_fft(c, i, i + 1, z);
+            i++;
+            continue;
+        }
+        conv_rows_fft(c, i, -1, z);
+    }
+    free(z);
+    return NULL;
+}
+
+// Images with at least this many pixels are convolved on several threads.
+#define CONVOLVE_THREAD_PIXELS (1 << 20)
+
+static int get_nthreads(int nthreads, int W, int H) {
+    if (nthreads <= 0)
+        nthreads = ((size_t)W * H >= CONVOLVE_THREAD_PIXELS) ?
+            (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    return MAX(1, nthreads);
+}
+
+static anbool use_fft(int NK) {
+    if (convolve_method == CONVOLVE_DIRECT)
+        return FALSE;
+    if (convolve_method == CONVOLVE_FFT)
+        return TRUE;
+    return NK >= CONVOLVE_FFT_MIN_NK;
+}
+
+static void run_pass(struct conv_pass* c, int nthreads) {
+    struct conv_pass* targs;
+    pthread_t* threads;
+    int t, nstarted;
+    fft_plan_t* plan = NULL;
+    double* kfft = NULL;
+    double* ksum;
+    int k;
+
+    ksum = malloc((c->NK + 1) * sizeof(double));
+    ksum[0] = 0;
+    for (k=0; k<c->NK; k++)
+        ksum[k+1] = ksum[k] + c->kernel[k];
+    c->ksum = ksum;
+
+    if (use_fft(c->NK)) {
+        int n = 1;
+        while (n < c->len + c->NK - 1)
+            n *= 2;
+        plan = fft_plan_new(n);
+        kfft = calloc(2 * n, sizeof(double));
+        for (k=0; k<c->NK; k++)
+            kfft[2*k] = c->kernel[k];
+        fft(plan, kfft, FALSE);
+    }
+    c->plan = plan;
+    c->kfft = kfft;
+
+    nthreads = MIN(nthreads, c->nrows);
+    if (nthreads <= 1) {
+        c->row0 = 0;
+        c->row1 = c->nrows;
+        conv_pass_rows(c);
+    } else {
+        targs = malloc(nthreads * sizeof(struct conv_pass));
+        threads = malloc(nthreads * sizeof(pthread_t));
+        for (t=0; t<nthreads; t++) {
+            targs[t] = *c;
+            targs[t].row0 = (int)((int64_t)c->nrows * t / nthreads);
+            targs[t].row1 = (int)((int64_t)c->nrows * (t+1) / nthreads);
+        }
+        for (nstarted=1; nstarted<nthreads; nstarted++)
+            if (pthread_create(threads + nstarted, NULL, conv_pass_rows,
+                               targs + nstarted)) {
+                SYSERROR("Failed to start convolution thread");
+                break;
+            }
+        conv_pass_rows(targs);
+        for (t=1; t<nstarted; t++)
+            pthread_join(threads[t], NULL);
+        // do the shares of any threads that failed to start.
+        for (t=nstarted; t<nthreads; t++)
+            conv_pass_rows(targs + t);
+        free(threads);
+        free(targs);
+    }
+    fft_plan_free(plan);
+    free(kfft);
+    free(ksum);
+}
 
 float* convolve_separable_f(const float* img, int W, int H,
                             const float* kernel, int K0, int NK,
                             float* outimg, float* tempimg) {
-    return convolve_separable_weighted_f(img, W, H, NULL, kernel, K0, NK, outimg, tempimg);
+    return convolve_separable_weighted_threaded_f(img, W, H, NULL, kernel, K0,
+                                                  NK, outimg, tempimg, 0);
 }
 
-
 float* convolve_separable_weighted_f(const float* img, int W, int H,
                                      const float* weight,
                                      const float* kernel, int K0, int NK,
                                      float* outimg, float* tempimg) {
+    return convolve_separable_weighted_threaded_f(img, W, H, weight, kernel,
+                                                  K0, NK, outimg, tempimg, 0);
+}
+
+float* convolve_separable_weighted_threaded_f(const float* img, int W, int H,
+                                              const float* weight,
+                                              const float* kernel, int K0,
+                                              int NK, float* outimg,
+                                              float* tempimg, int nthreads) {
     float* freeimg = NULL;
-    int i, j, k;
+    struct conv_pass c;
 
     if (!tempimg)
         freeimg = tempimg = malloc((size_t)W * (size_t)H * sizeof(float));
@@ -51,67 +379,28 @@ float* convolve_separable_weighted_f(const float* img, int W, int H,
     if (!outimg)
         outimg = malloc((size_t)W * (size_t)H * sizeof(float));
 
-    for (i=0; i<H; i++) {
-        /* // DEBUG
-         anbool touchedleft = FALSE;
-         anbool touchedright = FALSE;
-         */
-        for (j=0; j<W; j++) {
-            float sum = 0;
-            float sumw = 0;
-            /*
-             This is true convolution, so the kernel is flipped;
-             in this loop we are adding image pixels from right to left.
-             */
-
-            /*
-             printf("j=%i, W=%i, K0=%i, NK=%i, unrestricted j = [%i, %i),"
-             "k -> [%i, %i), j -> [%i, %i)\n",
-             j, W, K0, NK, j-0+K0, j-NK+K0, MAX(0, j + K0 - (W-1)), MIN(NK, j + K0 + 1),
-             j + K0 - MAX(0, j + K0 - (W-1)), j + K0 - MIN(NK, j + K0 + 1));
-             */
-
-            for (k = MAX(0, j + K0 - (W-1));
-                 k < MIN(NK, j + K0 + 1); k++) {
-
-                /*
-                 assert((j - k + K0) >= 0);
-                 assert((k - k + K0) <= (W-1));
-                 touchedleft |= ((j - k + K0) == 0);
-                 touchedright |= ((j - k + K0) == (W-1));
-                 */
-
-                int p = i*W + j - k + K0;
-                if (weight) {
-                    sum  += kernel[k] * weight[p] * img[p];
-                    sumw += kernel[k] * weight[p];
-                } else {
-                    sum  += kernel[k] * img[p];
-                    sumw += kernel[k];
-                }
-            }
-            // store into temp image in transposed order
-            tempimg[j*H + i] = (sumw == 0.0) ? 0.0 : (sum / sumw);
-        }
-        //assert(touchedleft);
-        //assert(touchedright);
-    }
+    nthreads = get_nthreads(nthreads, W, H);
+
+    // along the rows, into "tempimg" transposed...
+    memset(&c, 0, sizeof(c));
+    c.in = img;
+    c.weight = weight;
+    c.out = tempimg;
+    c.len = W;
+    c.nrows = H;
+    c.kernel = kernel;
+    c.K0 = K0;
+    c.NK = NK;
+    run_pass(&c, nthreads);
+
+    // ... and along its rows (the columns), back into "outimg".
+    c.in = tempimg;
+    c.weight = NULL;
+    c.out = outimg;
+    c.len = H;
+    c.nrows = W;
+    run_pass(&c, nthreads);
 
-    for (j=0; j<W; j++) {
-        for (i=0; i<H; i++) {
-            float sum = 0;
-            float sumw = 0;
-            for (k = MAX(0, i + K0 - (H-1));
-                 k < MIN(NK, i + K0 + 1); k++) {
-                int p = j*H + i - k + K0;
-                sum  += kernel[k] * tempimg[p];
-                sumw += kernel[k];
-            }
-            outimg[i*W + j] = (sumw == 0.0) ? 0.0 : (sum / sumw);
-        }
-    }
     free(freeimg);
     return outimg;
 }
-
-
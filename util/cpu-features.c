@@ -0,0 +1,106 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "cpu-features.h"
+#include "log.h"
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+// what the CPU has, capped by AN_SIMD.
+static unsigned int probed = 0;
+// ... further restricted by cpu_features_restrict().
+static volatile unsigned int restrict_mask = ~0u;
+
+// The instruction sets up to a level, for AN_SIMD.
+static const struct {
+    const char* name;
+    unsigned int bits;
+} levels[] = {
+    { "none",   0 },
+    { "sse2",   CPU_SSE2 },
+    { "avx",    CPU_SSE2 | CPU_AVX },
+    { "avx2",   CPU_SSE2 | CPU_AVX | CPU_AVX2 },
+    { "avx512", CPU_SSE2 | CPU_AVX | CPU_AVX2 | CPU_AVX512F },
+};
+
+static void probe(void) {
+    const char* env;
+    size_t i;
+
+#if defined(CPU_DISPATCH_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        probed |= CPU_SSE2;
+    if (__builtin_cpu_supports("avx"))
+        probed |= CPU_AVX;
+    if (__builtin_cpu_supports("avx2"))
+        probed |= CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        probed |= CPU_AVX512F;
+#else
+#if defined(__SSE2__)
+    probed |= CPU_SSE2;
+#endif
+#if defined(__AVX__)
+    probed |= CPU_AVX;
+#endif
+#if defined(__AVX2__)
+    probed |= CPU_AVX2;
+#endif
+#if defined(__AVX512F__)
+    probed |= CPU_AVX512F;
+#endif
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    probed |= CPU_NEON;
+#endif
+
+    env = getenv("AN_SIMD");
+    if (!env || !env[0])
+        return;
+    for (i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+        if (strcasecmp(env, levels[i].name))
+            continue;
+        // (NEON isn't optional, so it stays unless the cap is "none".)
+        if (levels[i].bits)
+            probed &= (levels[i].bits | CPU_NEON);
+        else
+            probed = 0;
+        return;
+    }
+    logerr("Unknown AN_SIMD value \"%s\" (expected none, sse2, avx, avx2 "
+           "or avx512); ignoring it.\n", env);
+}
+
+unsigned int cpu_features(void) {
+    pthread_once(&probe_once, probe);
+    return probed & restrict_mask;
+}
+
+anbool cpu_has(unsigned int features) {
+    return (cpu_features() & features) == features;
+}
+
+void cpu_features_restrict(unsigned int mask) {
+    restrict_mask = mask;
+}
+
+const char* cpu_features_name(void) {
+    unsigned int f = cpu_features();
+    if (f & CPU_AVX512F)
+        return "avx512";
+    if (f & CPU_AVX2)
+        return "avx2";
+    if (f & CPU_AVX)
+        return "avx";
+    if (f & CPU_SSE2)
+        return "sse2";
+    if (f & CPU_NEON)
+        return "neon";
+    return "none";
+}
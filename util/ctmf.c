@@ -36,6 +36,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 /* Type declarations */
 #ifdef _MSC_VER
@@ -81,6 +82,16 @@ typedef UINT32 uint32_t;
 #include <arm_neon.h>
 #endif
 
+#include "cpu-features.h"
+
+/*
+ * With GCC on x86, ctmf_helper() is also compiled for AVX2, and the
+ * version to run is chosen when the program runs (see cpu-features.h).
+ */
+#if defined(USE_SSE2) && defined(CPU_DISPATCH_X86)
+#define USE_AVX2_HELPER 1
+#endif
+
 /* Compiler peculiarities */
 #if defined(__GNUC__)
 #include <stdint.h>
@@ -108,11 +119,11 @@ typedef UINT32 uint32_t;
  * is 8 bit wide. Pixels inserted in the fine level also get inserted into the
  * coarse bucket designated by the 4 MSBs of the fine bucket value.
  *
- * The structure is aligned on 16 bytes, which is a prerequisite for SIMD
- * instructions. Each bucket is 16 bit wide, which means that extra care must be
+ * The structure is aligned on 32 bytes, which is a prerequisite for SIMD
+ * instructions (16 would do, but AVX2 works on 32 at a time). Each bucket is 16 bit wide, which means that extra care must be
  * taken to prevent overflow.
  */
-typedef struct align(16)
+typedef struct align(32)
 {
     uint16_t coarse[16];
     uint16_t fine[16][16];
@@ -133,8 +144,23 @@ typedef struct align(16)
 /**
  * Adds histograms \a x and \a y and stores the result in \a y. Makes use of
  * SSE2, MMX or Altivec, if available.
+ *
+ * For the AVX2 helper, the 16 bins are a GCC vector, which the compiler turns
+ * into two SSE2 operations or a single AVX2 one depending on the function the
+ * operation is inlined into.
  */
-#if defined(USE_SSE2)
+#if defined(USE_AVX2_HELPER)
+typedef uint16_t histogram_vec __attribute__ ((vector_size (32)));
+
+static inline void histogram_add( const uint16_t x[16], uint16_t y[16] )
+{
+    histogram_vec a, b;
+    memcpy( &a, x, sizeof(a) );
+    memcpy( &b, y, sizeof(b) );
+    b += a;
+    memcpy( y, &b, sizeof(b) );
+}
+#elif defined(USE_SSE2)
 static inline void histogram_add( const uint16_t x[16], uint16_t y[16] )
 {
     *(__m128i*) &y[0] = _mm_add_epi16( *(__m128i*) &y[0], *(__m128i*) &x[0] );
@@ -176,7 +202,16 @@ static inline void histogram_add( const uint16_t x[16], uint16_t y[16] )
  * Subtracts histogram \a x from \a y and stores the result in \a y. Makes use
  * of SSE2, MMX or Altivec, if available.
  */
-#if defined(USE_SSE2)
+#if defined(USE_AVX2_HELPER)
+static inline void histogram_sub( const uint16_t x[16], uint16_t y[16] )
+{
+    histogram_vec a, b;
+    memcpy( &a, x, sizeof(a) );
+    memcpy( &b, y, sizeof(b) );
+    b -= a;
+    memcpy( y, &b, sizeof(b) );
+}
+#elif defined(USE_SSE2)
 static inline void histogram_sub( const uint16_t x[16], uint16_t y[16] )
 {
     *(__m128i*) &y[0] = _mm_sub_epi16( *(__m128i*) &y[0], *(__m128i*) &x[0] );
@@ -224,7 +259,15 @@ static inline void histogram_muladd( const uint16_t a, const uint16_t x[16],
 }
 
 
+/*
+ * (Inlined into ctmf_helper_default() and ctmf_helper_avx2(), so that each
+ * gets its own copy.)
+ */
+#if defined(USE_AVX2_HELPER)
+static inline __attribute__ ((always_inline)) void ctmf_helper(
+#else
 static void ctmf_helper(
+#endif
         const unsigned char* const src, unsigned char* const dst,
         const int width, const int height,
         const int src_step, const int dst_step,
@@ -252,8 +295,8 @@ static void ctmf_helper(
     sz_fine   = (size_t)(16 * 16) * (size_t)n * (size_t)cn * sizeof(uint16_t);
     /* SSE2 and MMX need aligned memory, provided by _mm_malloc(). */
 #if defined(USE_SSE2) || defined(USE_MMX)
-    h_coarse = (uint16_t*) _mm_malloc( sz_coarse, 16 );
-    h_fine   = (uint16_t*) _mm_malloc( sz_fine,   16 );
+    h_coarse = (uint16_t*) _mm_malloc( sz_coarse, 32 );
+    h_fine   = (uint16_t*) _mm_malloc( sz_fine,   32 );
     memset( h_coarse, 0, sz_coarse );
     memset( h_fine,   0, sz_fine   );
 #else
@@ -375,11 +418,92 @@ static void ctmf_helper(
 #endif
 }
 
-void ctmf(
+typedef void (*ctmf_helper_func)(
         const unsigned char* const src, unsigned char* const dst,
         const int width, const int height,
         const int src_step, const int dst_step,
-        const int r, const int cn, const long unsigned int memsize
+        const int r, const int cn,
+        const int pad_left, const int pad_right
+        );
+
+static void ctmf_helper_default(
+        const unsigned char* const src, unsigned char* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn,
+        const int pad_left, const int pad_right
+        )
+{
+    ctmf_helper( src, dst, width, height, src_step, dst_step, r, cn,
+            pad_left, pad_right );
+}
+
+#if defined(USE_AVX2_HELPER)
+static CPU_TARGET("avx2") void ctmf_helper_avx2(
+        const unsigned char* const src, unsigned char* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn,
+        const int pad_left, const int pad_right
+        )
+{
+    ctmf_helper( src, dst, width, height, src_step, dst_step, r, cn,
+            pad_left, pad_right );
+}
+#endif
+
+/*
+ * One vertical stripe, for ctmf_threaded(): the stripes write disjoint
+ * columns of the destination, so they can be filtered in any order.
+ */
+struct ctmf_stripe {
+    int i;
+    int stripe;
+    int pad_left;
+    int pad_right;
+};
+
+struct ctmf_job {
+    const unsigned char* src;
+    unsigned char* dst;
+    int height;
+    int src_step;
+    int dst_step;
+    int r;
+    int cn;
+    const struct ctmf_stripe* stripes;
+    int nstripes;
+    int next;
+    pthread_mutex_t lock;
+    ctmf_helper_func helper;
+};
+
+static void* ctmf_worker( void* arg )
+{
+    struct ctmf_job* job = (struct ctmf_job*) arg;
+    for ( ;; ) {
+        const struct ctmf_stripe* s;
+        int k;
+        pthread_mutex_lock( &job->lock );
+        k = job->next++;
+        pthread_mutex_unlock( &job->lock );
+        if ( k >= job->nstripes ) {
+            break;
+        }
+        s = job->stripes + k;
+        job->helper( job->src + job->cn*s->i, job->dst + job->cn*s->i,
+                s->stripe, job->height, job->src_step, job->dst_step,
+                job->r, job->cn, s->pad_left, s->pad_right );
+    }
+    return NULL;
+}
+
+void ctmf_threaded(
+        const unsigned char* const src, unsigned char* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn, const long unsigned int memsize,
+        int nthreads
         )
 {
     /*
@@ -410,12 +534,34 @@ void ctmf(
      * Also, note that the leftmost and rightmost stripes don't need overlap.
      * A flag is passed to ctmf_helper() so that it treats these cases as if the
      * image was zero-padded.
+     *
+     * With several threads, the image is cut into at least one stripe per
+     * thread, as long as the stripes stay wide compared with the overlap.
      */
     int stripes = (int) ceil( (double) (width - 2*r) / (memsize / sizeof(Histogram) - 2*r) );
-    int stripe_size = (int) ceil( (double) ( width + stripes*2*r - 2*r ) / stripes );
-
+    int stripe_size;
+    struct ctmf_stripe* list;
+    struct ctmf_job job;
+    pthread_t* threads;
+    int nlist = 0;
+    int nstarted;
     int i;
 
+    if ( nthreads > 1 ) {
+        int max_stripes = width / (4*r + 64);
+        if ( max_stripes > nthreads ) {
+            max_stripes = nthreads;
+        }
+        if ( stripes < max_stripes ) {
+            stripes = max_stripes;
+        }
+    }
+    if ( stripes < 1 ) {
+        stripes = 1;
+    }
+    stripe_size = (int) ceil( (double) ( width + stripes*2*r - 2*r ) / stripes );
+
+    list = (struct ctmf_stripe*) malloc( (stripes + 1) * sizeof(struct ctmf_stripe) );
     for ( i = 0; i < width; i += stripe_size - 2*r ) {
         int stripe = stripe_size;
         /* Make sure that the filter kernel fits into one stripe. */
@@ -423,11 +569,65 @@ void ctmf(
             stripe = width - i;
         }
 
-        ctmf_helper( src + cn*i, dst + cn*i, stripe, height, src_step, dst_step, r, cn,
-                i == 0, stripe == width - i );
+        list[nlist].i = i;
+        list[nlist].stripe = stripe;
+        list[nlist].pad_left = (i == 0);
+        list[nlist].pad_right = (stripe == width - i);
+        nlist++;
 
         if ( stripe == width - i ) {
             break;
         }
     }
+
+    job.src = src;
+    job.dst = dst;
+    job.height = height;
+    job.src_step = src_step;
+    job.dst_step = dst_step;
+    job.r = r;
+    job.cn = cn;
+    job.stripes = list;
+    job.nstripes = nlist;
+    job.next = 0;
+    pthread_mutex_init( &job.lock, NULL );
+    job.helper = ctmf_helper_default;
+#if defined(USE_AVX2_HELPER)
+    if ( cpu_has( CPU_AVX2 ) ) {
+        job.helper = ctmf_helper_avx2;
+    }
+#endif
+
+    if ( nthreads > nlist ) {
+        nthreads = nlist;
+    }
+    threads = NULL;
+    nstarted = 0;
+    if ( nthreads > 1 ) {
+        threads = (pthread_t*) malloc( (nthreads - 1) * sizeof(pthread_t) );
+        for ( nstarted = 0; nstarted < nthreads - 1; ++nstarted ) {
+            if ( pthread_create( &threads[nstarted], NULL, ctmf_worker, &job ) ) {
+                break;
+            }
+        }
+    }
+    /* The calling thread works too, and finishes whatever is left. */
+    ctmf_worker( &job );
+    for ( i = 0; i < nstarted; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+    free( threads );
+    pthread_mutex_destroy( &job.lock );
+    free( list );
+}
+
+void ctmf(
+        const unsigned char* const src, unsigned char* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn, const long unsigned int memsize
+        )
+{
+    ctmf_threaded( src, dst, width, height, src_step, dst_step, r, cn,
+            memsize, 1 );
 }
@@ -8,6 +8,8 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "dimage.h"
@@ -15,6 +17,7 @@
 #include "simplexy-common.h"
 #include "log.h"
 #include "mathutil.h"
+#include "errors.h"
 
 /*
  * dallpeaks.c
@@ -118,6 +121,295 @@ static int max_gaussian(float* image, int W, int H, float sigma,
     return 0;
 }
 
+/*
+ The blobs are independent, so they are handed out to threads one at a
+ time (they vary a lot in size).  Each thread keeps its own cutout
+ buffers and appends the peaks it finds to its own list, noting where
+ each blob's peaks went; afterwards the lists are joined in blob order,
+ keeping the first "maxnpeaks", which gives the same result as doing
+ the blobs one after another.
+ */
+
+// A connected component: pixels indx[k0..k1), in a box at
+// (xmin,ymin) of size onx x ony.
+struct blob {
+    int current;
+    int k0, k1;
+    int xmin, ymin, onx, ony;
+    // its peaks: thread "thread"'s peaks [first, first+npeaks).
+    int thread;
+    int first;
+    int npeaks;
+};
+
+struct peak_job {
+    const void* image;
+    int nx, ny;
+    const int* object;
+    const int* indx;
+    struct blob* blobs;
+    int nblobs;
+    // the next blob to hand out.
+    int next;
+    float dpsf, sigma, dlim, saddle, minpeak;
+    int maxper, maxnpeaks;
+};
+
+/*
+ The peaks' centroids are found with dcen3x3_batch(), so each thread
+ queues its peaks (over many blobs: most blobs have one peak) and does
+ them CENTROID_BATCH at a time.  Each queued peak has already been
+ given its slot in the thread's list, holding the pixel center, which
+ is filled in when the batch is done.  A peak whose 3x3 box fails is
+ retried with the 5x5 box (every other pixel) if it is far enough from
+ the edge, and then with max_gaussian() on a copy of its blob's cutout.
+ */
+#define CENTROID_BATCH 256
+
+struct centroid_queue {
+    int n;
+    // pixel k of peak i's 3x3 box is box3[k * CENTROID_BATCH + i].
+    float box3[9 * CENTROID_BATCH];
+    float box5[9 * CENTROID_BATCH];
+    // the peak's slot in the thread's list.
+    int slot[CENTROID_BATCH];
+    // the peak in its blob's cutout, and the cutout's position.
+    int xc[CENTROID_BATCH], yc[CENTROID_BATCH];
+    int xmin[CENTROID_BATCH], ymin[CENTROID_BATCH];
+    // for messages: the object number and subpeak.
+    int current[CENTROID_BATCH], subpeak[CENTROID_BATCH];
+    // for peaks with a 5x5 box: the cutout copy, at "cutouts" + cutout[i].
+    anbool has5[CENTROID_BATCH];
+    size_t cutout[CENTROID_BATCH];
+    int onx[CENTROID_BATCH], ony[CENTROID_BATCH];
+    float* cutouts;
+    size_t ncutout, cutoutcap;
+};
+
+// A thread's scratch space and the peaks it has found.
+struct peak_worker {
+    struct peak_job* job;
+    int id;
+    int npix;
+    float* oimage;
+    float* simage;
+    int* xc;
+    int* yc;
+    float* x;
+    float* y;
+    int n, cap;
+    struct centroid_queue* queue;
+};
+
+static void add_peak(struct peak_worker* w, float x, float y) {
+    if (w->n == w->cap) {
+        w->cap = MAX(256, 2 * w->cap);
+        w->x = realloc(w->x, w->cap * sizeof(float));
+        w->y = realloc(w->y, w->cap * sizeof(float));
+    }
+    w->x[w->n] = x;
+    w->y[w->n] = y;
+    w->n++;
+}
+
+// Copies the cutout "oimage" for the peaks queued from this blob.
+static size_t save_cutout(struct centroid_queue* q, const float* oimage,
+                          int onx, int ony) {
+    size_t off = q->ncutout;
+    size_t npix = (size_t)onx * ony;
+    if (off + npix > q->cutoutcap) {
+        q->cutoutcap = MAX(off + npix, 2 * q->cutoutcap);
+        q->cutouts = realloc(q->cutouts, q->cutoutcap * sizeof(float));
+    }
+    memcpy(q->cutouts + off, oimage, npix * sizeof(float));
+    q->ncutout += npix;
+    return off;
+}
+
+static void flush_centroids(struct peak_worker* w) {
+    struct centroid_queue* q = w->queue;
+    float cx[CENTROID_BATCH], cy[CENTROID_BATCH];
+    uint8_t ok[CENTROID_BATCH];
+    int retry[CENTROID_BATCH];
+    int i, j, k, nretry = 0;
+
+    dcen3x3_batch(q->box3, CENTROID_BATCH, q->n, cx, cy, ok);
+    for (i=0; i<q->n; i++) {
+        if (ok[i]) {
+            assert(isfinite(cx[i]));
+            assert(isfinite(cy[i]));
+            w->x[q->slot[i]] = (cx[i]-1.0) + q->xc[i] + q->xmin[i];
+            w->y[q->slot[i]] = (cy[i]-1.0) + q->yc[i] + q->ymin[i];
+        } else if (q->has5[i]) {
+            debug("Peak %i subpeak %i at (%i,%i): searching for centroid in 3x3 box failed; trying 5x5 box...\n", q->current[i], q->subpeak[i], q->xmin[i]+q->xc[i], q->ymin[i]+q->yc[i]);
+            // (packed down in place: nretry <= i.)
+            for (k=0; k<9; k++)
+                q->box5[k * CENTROID_BATCH + nretry] = q->box5[k * CENTROID_BATCH + i];
+            retry[nretry++] = i;
+        } else {
+            logverb("Failed to find (3x3) centroid of peak %i, subpeak %i at (%i,%i), and too close to edge for 5x5\n",
+                    q->current[i], q->subpeak[i], q->xmin[i]+q->xc[i], q->ymin[i]+q->yc[i]);
+        }
+    }
+
+    dcen3x3_batch(q->box5, CENTROID_BATCH, nretry, cx, cy, ok);
+    for (j=0; j<nretry; j++) {
+        i = retry[j];
+        if (ok[j]) {
+            w->x[q->slot[i]] = 2.0*(cx[j]-1.0) + q->xc[i] + q->xmin[i];
+            w->y[q->slot[i]] = 2.0*(cy[j]-1.0) + q->yc[i] + q->ymin[i];
+        } else {
+            float tmpxc, tmpyc;
+            logverb("Failed to find (5x5) centroid of peak %i, subpeak %i at (%i,%i)\n", q->current[i], q->subpeak[i], q->xmin[i]+q->xc[i], q->ymin[i]+q->yc[i]);
+            max_gaussian(q->cutouts + q->cutout[i], q->onx[i], q->ony[i],
+                         w->job->dpsf, q->xc[i], q->yc[i], &tmpxc, &tmpyc);
+            debug("max_gaussian: %g,%g\n", tmpxc, tmpyc);
+            w->x[q->slot[i]] = tmpxc + q->xmin[i];
+            w->y[q->slot[i]] = tmpyc + q->ymin[i];
+        }
+        assert(isfinite(w->x[q->slot[i]]));
+        assert(isfinite(w->y[q->slot[i]]));
+    }
+    q->n = 0;
+    q->ncutout = 0;
+}
+
+/* Groups the connected pixels together.  We do this by computing a
+ permutation index array that would sort the "object" array.  (Recall
+ that the "object" array labels the connected components.)  All the
+ unlabelled pixels (object == -1) are listed first, then the indices of
+ all the pixels labeled with (object == 0), (object == 1), etc.  The
+ pixel coordinate is (x,y) = (indx[i] % nx, indx[i] / nx).  Blobs
+ smaller than 3x3 or bigger than maxsize are skipped. */
+static void list_blobs(struct peak_job* job, int maxsize) {
+    int nx = job->nx;
+    int ny = job->ny;
+    const int* object = job->object;
+    int* indx;
+    int k, cap = 0;
+
+    indx = permuted_sort(object, sizeof(int), compare_ints_asc, NULL, nx*ny);
+    job->indx = indx;
+    job->blobs = NULL;
+    job->nblobs = 0;
+
+    // skip over the unlabelled pixels (object == -1)
+    for (k=0; k<(nx*ny) && object[indx[k]] == -1; k++);
+
+    while (k < (nx*ny)) {
+        struct blob b;
+        int m, xcurr, ycurr;
+        int xmax, ymax, xmin, ymin;
+
+        // the object number we're looking at.
+        b.current = object[indx[k]];
+
+        // find the object limits in pixel space.
+        xmax = -1;
+        xmin = nx + 1;
+        ymax = -1;
+        ymin = ny + 1;
+        for (m=k; m<(nx*ny) && object[indx[m]] == b.current; m++) {
+            xcurr = indx[m] % nx;
+            ycurr = indx[m] / nx;
+            xmin = MIN(xmin, xcurr);
+            xmax = MAX(xmax, xcurr);
+            ymin = MIN(ymin, ycurr);
+            ymax = MAX(ymax, ycurr);
+        }
+        b.k0 = k;
+        b.k1 = m;
+        k = m;
+
+        b.xmin = xmin;
+        b.ymin = ymin;
+        b.onx = xmax - xmin + 1;
+        b.ony = ymax - ymin + 1;
+        if (b.onx < 3 || b.ony < 3) {
+            logverb("Skipping object %i: too small, %ix%i (x %i:%i, y %i:%i)\n",
+                    b.current, b.onx, b.ony, xmin,xmax, ymin,ymax);
+            continue;
+        }
+        if (b.ony > maxsize || b.onx > maxsize) {
+            logverb("Skipping object %i: too big, %ix%i (x %i:%i, y %i:%i)\n",
+                    b.current, b.onx, b.ony, xmin,xmax, ymin,ymax);
+            continue;
+        }
+        b.thread = 0;
+        b.first = 0;
+        b.npeaks = 0;
+        if (job->nblobs == cap) {
+            cap = MAX(256, 2 * cap);
+            job->blobs = realloc(job->blobs, cap * sizeof(struct blob));
+        }
+        job->blobs[job->nblobs++] = b;
+    }
+}
+
+// Runs "thread" on "nthreads" workers and joins up their peaks.
+static int run_peak_job(struct peak_job* job, int nthreads,
+                        void* (*thread)(void*),
+                        float* xcen, float* ycen, int* npeaks) {
+    struct peak_worker* workers;
+    pthread_t* threads;
+    int i, nstarted;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, job->nblobs));
+    job->next = 0;
+
+    workers = calloc(nthreads, sizeof(struct peak_worker));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        workers[i].job = job;
+        workers[i].id = i;
+        workers[i].xc = malloc(sizeof(int) * job->maxper);
+        workers[i].yc = malloc(sizeof(int) * job->maxper);
+        workers[i].queue = calloc(1, sizeof(struct centroid_queue));
+    }
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, thread, workers + nstarted)) {
+            SYSERROR("Failed to start peak-finding thread");
+            break;
+        }
+    // (the blobs are handed out as they go, so whoever runs picks up
+    // the work of threads that failed to start.)
+    thread(workers);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+
+    *npeaks = 0;
+    for (i=0; i<job->nblobs && *npeaks < job->maxnpeaks; i++) {
+        struct blob* b = job->blobs + i;
+        struct peak_worker* w = workers + b->thread;
+        int n = b->npeaks;
+        if (*npeaks + n > job->maxnpeaks) {
+            logverb("Skipping all further subpeaks: exceeded max number (%i)\n",
+                    job->maxnpeaks);
+            n = job->maxnpeaks - *npeaks;
+        }
+        memcpy(xcen + *npeaks, w->x + b->first, n * sizeof(float));
+        memcpy(ycen + *npeaks, w->y + b->first, n * sizeof(float));
+        *npeaks += n;
+    }
+
+    for (i=0; i<nthreads; i++) {
+        free(workers[i].oimage);
+        free(workers[i].simage);
+        free(workers[i].xc);
+        free(workers[i].yc);
+        free(workers[i].x);
+        free(workers[i].y);
+        free(workers[i].queue->cutouts);
+        free(workers[i].queue);
+    }
+    free(workers);
+    free(threads);
+    free((int*)job->indx);
+    free(job->blobs);
+    return 1;
+}
 
 #define IMGTYPE float
 #define SUFFIX
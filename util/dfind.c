@@ -8,7 +8,11 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
+#include "os-features.h"
+#include "errors.h"
 #include "simplexy-common.h"
 #include "dimage.h"
 #include "bl.h"
@@ -104,17 +108,189 @@ static dimage_label_t relabel_image(il* on_pixels,
     return maxcontiguouslabel;
 }
 
+/*
+ * The threaded version cuts the image into bands of rows and labels each
+ * band on its own with dfind2(), numbering band b's labels from
+ * offset[b] so that they don't collide.  Then the labels that touch
+ * across each band border are joined in a union-find forest whose roots
+ * are always the smallest label of their set; since labels grow in
+ * raster order, ordering the roots gives the same numbering that a
+ * single dfind2() over the whole image would.  The borders are merged
+ * concurrently, each join being a compare-and-swap on the parent of the
+ * larger root, which only succeeds while that label is still a root.
+ */
+struct dfind_band {
+    const void* image;
+    int nx;
+    int y0, y1;
+    int* object;
+    int nobjects;
+    // the first label of this band, and of the band above it.
+    int offset;
+    int aboveoffset;
+    dimage_label_t* parent;
+    const dimage_label_t* number;
+};
+
+static dimage_label_t uf_find(dimage_label_t* parent, dimage_label_t x) {
+    dimage_label_t p;
+    while ((p = __atomic_load_n(parent + x, __ATOMIC_ACQUIRE)) != x)
+        x = p;
+    return x;
+}
+
+static void uf_union(dimage_label_t* parent, dimage_label_t a,
+                     dimage_label_t b) {
+    for (;;) {
+        dimage_label_t expect;
+        a = uf_find(parent, a);
+        b = uf_find(parent, b);
+        if (a == b)
+            return;
+        if (a < b) {
+            dimage_label_t tmp = a;
+            a = b;
+            b = tmp;
+        }
+        expect = a;
+        if (__atomic_compare_exchange_n(parent + a, &expect, b, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+        // someone else re-rooted "a"; try again.
+    }
+}
+
+// Joins the labels of the first row of the band with those above it.
+static void* merge_band_border(void* v) {
+    struct dfind_band* b = v;
+    int nx = b->nx;
+    const int* row = b->object + (size_t)b->y0 * nx;
+    const int* above = row - nx;
+    int ix, i;
+    for (ix=0; ix<nx; ix++) {
+        if (row[ix] == -1)
+            continue;
+        for (i = MAX(0, ix - 1); i <= MIN(ix + 1, nx - 1); i++)
+            if (above[i] != -1)
+                uf_union(b->parent, b->offset + row[ix],
+                         b->aboveoffset + above[i]);
+    }
+    return NULL;
+}
+
+static void* relabel_band(void* v) {
+    struct dfind_band* b = v;
+    int* object = b->object + (size_t)b->y0 * b->nx;
+    size_t i, n = (size_t)(b->y1 - b->y0) * b->nx;
+    for (i=0; i<n; i++)
+        if (object[i] != -1)
+            object[i] = b->number[b->offset + object[i]];
+    return NULL;
+}
+
+// Runs "func" on each of the bands, one thread per band.
+static void run_bands(void* (*func)(void*), struct dfind_band* bands,
+                      int first, int nbands) {
+    pthread_t* threads;
+    int i, nstarted;
+
+    threads = malloc(nbands * sizeof(pthread_t));
+    for (nstarted=first+1; nstarted<nbands; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, func, bands + nstarted)) {
+            SYSERROR("Failed to start connected-components thread");
+            break;
+        }
+    func(bands + first);
+    for (i=first+1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    for (i=nstarted; i<nbands; i++)
+        func(bands + i);
+    free(threads);
+}
+
+// the fewest rows worth giving a thread.
+#define DFIND_MIN_BAND_ROWS 32
+
+static int dfind2_threaded_bands(const void* image, int nx, int ny,
+                                 int* object, int* pnobjects, int nthreads,
+                                 void* (*label_band)(void*)) {
+    struct dfind_band* bands;
+    dimage_label_t* parent;
+    dimage_label_t* number;
+    int nbands, b, nlabels, nobjects;
+    dimage_label_t l;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nbands = MAX(1, MIN(nthreads, ny / DFIND_MIN_BAND_ROWS));
+
+    bands = calloc(nbands, sizeof(struct dfind_band));
+    for (b=0; b<nbands; b++) {
+        bands[b].image = image;
+        bands[b].nx = nx;
+        bands[b].y0 = (int)((long)ny * b / nbands);
+        bands[b].y1 = (int)((long)ny * (b+1) / nbands);
+        bands[b].object = object;
+    }
+    run_bands(label_band, bands, 0, nbands);
+    if (nbands == 1) {
+        if (pnobjects)
+            *pnobjects = bands[0].nobjects;
+        free(bands);
+        return 1;
+    }
+
+    nlabels = 0;
+    for (b=0; b<nbands; b++) {
+        bands[b].offset = nlabels;
+        bands[b].aboveoffset = b ? bands[b-1].offset : 0;
+        nlabels += bands[b].nobjects;
+    }
+    parent = malloc(MAX(1, nlabels) * sizeof(dimage_label_t));
+    number = malloc(MAX(1, nlabels) * sizeof(dimage_label_t));
+    for (l=0; l<nlabels; l++)
+        parent[l] = l;
+    for (b=0; b<nbands; b++) {
+        bands[b].parent = parent;
+        bands[b].number = number;
+    }
+    run_bands(merge_band_border, bands, 1, nbands);
+
+    // a root comes before the rest of its set, so it is numbered first.
+    nobjects = 0;
+    for (l=0; l<nlabels; l++) {
+        dimage_label_t root = uf_find(parent, l);
+        number[l] = (root == l) ? nobjects++ : number[root];
+    }
+    run_bands(relabel_band, bands, 0, nbands);
+
+    if (pnobjects)
+        *pnobjects = nobjects;
+    free(parent);
+    free(number);
+    free(bands);
+    return 1;
+}
+
 // Yummy preprocessor templating goodness!
 
 #define DFIND2 dfind2
+#define DFIND2_THREADED dfind2_threaded
+#define DFIND2_LABEL_BAND dfind2_label_band
 #define IMGTYPE int
 #include "dfind2.c"
 #undef DFIND2
+#undef DFIND2_THREADED
+#undef DFIND2_LABEL_BAND
 #undef IMGTYPE
 
 #define DFIND2 dfind2_u8
+#define DFIND2_THREADED dfind2_u8_threaded
+#define DFIND2_LABEL_BAND dfind2_u8_label_band
 #define IMGTYPE unsigned char
 #include "dfind2.c"
 #undef DFIND2
+#undef DFIND2_THREADED
+#undef DFIND2_LABEL_BAND
 #undef IMGTYPE
 
@@ -4,7 +4,8 @@
  */
 
 // This file gets #included in dfind.c, with
-// DFIND2 and IMGTYPE defined appropriately.
+// DFIND2, DFIND2_THREADED, DFIND2_LABEL_BAND and IMGTYPE defined
+// appropriately.
 // I did this so that we can handle int* and
 // unsigned char* images using the same code.
 
@@ -108,3 +109,21 @@ int DFIND2(const IMGTYPE* image,
     il_free(on_pixels);
     return 1;
 }
+
+static void* DFIND2_LABEL_BAND(void* v) {
+    struct dfind_band* b = v;
+    const IMGTYPE* image = b->image;
+    DFIND2(image + (size_t)b->y0 * b->nx, b->nx, b->y1 - b->y0,
+           b->object + (size_t)b->y0 * b->nx, &b->nobjects);
+    return NULL;
+}
+
+int DFIND2_THREADED(const IMGTYPE* image,
+                    int nx,
+                    int ny,
+                    int* object,
+                    int* pnobjects,
+                    int nthreads) {
+    return dfind2_threaded_bands(image, nx, ny, object, pnobjects, nthreads,
+                                 DFIND2_LABEL_BAND);
+}
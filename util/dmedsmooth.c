@@ -8,9 +8,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "simplexy-common.h"
+#include "dimage.h"
+#include "errors.h"
 
 /*
  * dmedsmooth.c
@@ -22,9 +26,6 @@
  * 1/2006 */
 
 
-float dselip(unsigned long k, unsigned long n, float *arr);
-
-
 int dmedsmooth_gridpoints(int nx, int halfbox, int* p_nxgrid, int** p_xgrid,
                           int** p_xlo, int** p_xhi) {
     int nxgrid;
@@ -54,56 +55,95 @@ int dmedsmooth_gridpoints(int nx, int halfbox, int* p_nxgrid, int** p_xgrid,
     return 0;
 }
 
-int dmedsmooth_grid(const float* image,
-                    const uint8_t *masked,
-                    int nx,
-                    int ny,
-                    int halfbox,
-                    float **p_grid, int** p_xgrid, int** p_ygrid,
-                    int* p_nxgrid, int* p_nygrid) {
-    float* arr = NULL;
-    float* grid = NULL;
-    int *xlo = NULL;
-    int *xhi = NULL;
-    int *ylo = NULL;
-    int *yhi = NULL;
+/*
+ The grid boxes and the rows of the interpolated image are independent,
+ so both steps can be split over threads: grid row j goes to thread
+ (j % nthreads), and each thread interpolates a contiguous block of
+ image rows, adding up the grid points in the same order as a single
+ thread would.
+ */
+struct medsmooth_args {
+    const float* image;
+    const uint8_t* masked;
+    int nx, ny;
+    int halfbox;
     int nxgrid, nygrid;
-    int i, j, nb, jp, ip, nm;
+    const int* xlo;
+    const int* xhi;
+    const int* ylo;
+    const int* yhi;
+    const int* xgrid;
+    const int* ygrid;
+    float* grid;
+    float* smooth;
+    int nthreads;
+    // this thread's share.
+    int thread;
+};
 
-    if (dmedsmooth_gridpoints(nx, halfbox, &nxgrid, p_xgrid, &xlo, &xhi)) {
-        return 1;
+// Runs "func" on "nthreads" copies of "args", numbered 0..nthreads-1.
+static void run_threads(void* (*func)(void*), struct medsmooth_args* args,
+                        int nthreads) {
+    struct medsmooth_args* targs;
+    pthread_t* threads;
+    int i, nstarted;
+
+    if (nthreads <= 1) {
+        args->nthreads = 1;
+        args->thread = 0;
+        func(args);
+        return;
     }
-    if (dmedsmooth_gridpoints(ny, halfbox, &nygrid, p_ygrid, &ylo, &yhi)) {
-        FREEVEC(xlo);
-        FREEVEC(xhi);
-        FREEVEC(*p_xgrid);
-        return 1;
+    targs = malloc(nthreads * sizeof(struct medsmooth_args));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        targs[i] = *args;
+        targs[i].nthreads = nthreads;
+        targs[i].thread = i;
     }
-    *p_nxgrid = nxgrid;
-    *p_nygrid = nygrid;
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, func, targs + nstarted)) {
+            SYSERROR("Failed to start median-smoothing thread");
+            break;
+        }
+    func(targs);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    // do the shares of any threads that failed to start.
+    for (i=nstarted; i<nthreads; i++)
+        func(targs + i);
+    free(threads);
+    free(targs);
+}
 
-    /*
-     for (i=0; i<nxgrid; i++)
-     printf("xgrid %i, xlo %i, xhi %i\n", (*p_xgrid)[i], xlo[i], xhi[i]);
-     for (i=0; i<nygrid; i++)
-     printf("ygrid %i, ylo %i, yhi %i\n", (*p_ygrid)[i], ylo[i], yhi[i]);
-     */
+static int get_nthreads(int nthreads) {
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return MAX(1, nthreads);
+}
 
-    // the median-filtered image (subsampled on a grid).
-    *p_grid = grid = (float *) malloc((size_t)(nxgrid * nygrid) *
-                                      sizeof(float));
+static void* grid_rows(void* v) {
+    struct medsmooth_args* a = v;
+    const float* image = a->image;
+    const uint8_t* masked = a->masked;
+    const int* xlo = a->xlo;
+    const int* xhi = a->xhi;
+    int nx = a->nx;
+    int nxgrid = a->nxgrid;
+    float* arr;
+    int i, j, nb, jp, ip, nm;
 
-    arr = (float *) malloc((size_t)((halfbox * 2 + 5) *
-                                    (halfbox * 2 + 5)) * sizeof(float));
+    arr = (float *) malloc((size_t)((a->halfbox * 2 + 5) *
+                                    (a->halfbox * 2 + 5)) * sizeof(float));
 
-    for (j=0; j<nygrid; j++) {
+    for (j=a->thread; j<a->nygrid; j+=a->nthreads) {
         for (i=0; i<nxgrid; i++) {
             nb = 0;
-            for (jp=ylo[j]; jp<=yhi[j]; jp++) {
-                const float* imageptr = image + xlo[i] + jp * nx;
+            for (jp=a->ylo[j]; jp<=a->yhi[j]; jp++) {
+                const float* imageptr = image + xlo[i] + (size_t)jp * nx;
                 float f;
                 if (masked) {
-                    const uint8_t* maskptr = masked + xlo[i] + jp * nx;
+                    const uint8_t* maskptr = masked + xlo[i] + (size_t)jp * nx;
                     for (ip=xlo[i]; ip<=xhi[i]; ip++, imageptr++, maskptr++) {
                         if (*maskptr)
                             continue;
@@ -125,42 +165,117 @@ int dmedsmooth_grid(const float* image,
             }
             if (nb > 1) {
                 nm = nb / 2;
-                grid[i + j*nxgrid] = dselip(nm, nb, arr);
+                a->grid[i + j*nxgrid] = dselect(nm, nb, arr);
             } else {
                 //grid[i + j*nxgrid] = image[(long)xlo[i] + ((long)ylo[j]) * nx];
-                grid[i + j*nxgrid] = 0.0;
+                a->grid[i + j*nxgrid] = 0.0;
             }
         }
     }
+    FREEVEC(arr);
+    return NULL;
+}
+
+static int medsmooth_grid(const float* image,
+                          const uint8_t *masked,
+                          int nx,
+                          int ny,
+                          int halfbox,
+                          float **p_grid, int** p_xgrid, int** p_ygrid,
+                          int* p_nxgrid, int* p_nygrid,
+                          int nthreads) {
+    struct medsmooth_args args;
+    int *xlo = NULL;
+    int *xhi = NULL;
+    int *ylo = NULL;
+    int *yhi = NULL;
+    int nxgrid, nygrid;
+
+    if (dmedsmooth_gridpoints(nx, halfbox, &nxgrid, p_xgrid, &xlo, &xhi)) {
+        return 1;
+    }
+    if (dmedsmooth_gridpoints(ny, halfbox, &nygrid, p_ygrid, &ylo, &yhi)) {
+        FREEVEC(xlo);
+        FREEVEC(xhi);
+        FREEVEC(*p_xgrid);
+        return 1;
+    }
+    *p_nxgrid = nxgrid;
+    *p_nygrid = nygrid;
+
+    /*
+     for (i=0; i<nxgrid; i++)
+     printf("xgrid %i, xlo %i, xhi %i\n", (*p_xgrid)[i], xlo[i], xhi[i]);
+     for (i=0; i<nygrid; i++)
+     printf("ygrid %i, ylo %i, yhi %i\n", (*p_ygrid)[i], ylo[i], yhi[i]);
+     */
+
+    // the median-filtered image (subsampled on a grid).
+    *p_grid = (float *) malloc((size_t)(nxgrid * nygrid) * sizeof(float));
+
+    memset(&args, 0, sizeof(args));
+    args.image = image;
+    args.masked = masked;
+    args.nx = nx;
+    args.ny = ny;
+    args.halfbox = halfbox;
+    args.nxgrid = nxgrid;
+    args.nygrid = nygrid;
+    args.xlo = xlo;
+    args.xhi = xhi;
+    args.ylo = ylo;
+    args.yhi = yhi;
+    args.grid = *p_grid;
+    run_threads(grid_rows, &args, MIN(nthreads, nygrid));
+
     FREEVEC(xlo);
     FREEVEC(ylo);
     FREEVEC(xhi);
     FREEVEC(yhi);
-    FREEVEC(arr);
     return 0;
 }
 
-int dmedsmooth_interpolate(const float* grid,
-                           int nx, int ny,
-                           int nxgrid, int nygrid,
-                           const int* xgrid, const int* ygrid,
-                           int halfbox,
-                           float* smooth) {
+int dmedsmooth_grid(const float* image,
+                    const uint8_t *masked,
+                    int nx,
+                    int ny,
+                    int halfbox,
+                    float **p_grid, int** p_xgrid, int** p_ygrid,
+                    int* p_nxgrid, int* p_nygrid) {
+    return medsmooth_grid(image, masked, nx, ny, halfbox, p_grid,
+                          p_xgrid, p_ygrid, p_nxgrid, p_nygrid, 1);
+}
+
+static void* interpolate_rows(void* v) {
+    struct medsmooth_args* a = v;
+    const float* grid = a->grid;
+    const int* xgrid = a->xgrid;
+    const int* ygrid = a->ygrid;
+    float* smooth = a->smooth;
+    int nx = a->nx;
+    int nxgrid = a->nxgrid;
+    int nygrid = a->nygrid;
+    int halfbox = a->halfbox;
+    // this thread's rows: [row0, row1)
+    int row0 = (int)((long)a->ny * a->thread / a->nthreads);
+    int row1 = (int)((long)a->ny * (a->thread + 1) / a->nthreads);
     int i, j;
     int jst, jnd, ist, ind;
     int ypsize, ymsize, xpsize, xmsize;
     int jp, ip;
 
-    for (j = 0;j < ny;j++)
+    for (j = row0;j < row1;j++)
         for (i = 0;i < nx;i++)
-            smooth[i + j*nx] = 0.;
+            smooth[i + (size_t)j*nx] = 0.;
     for (j = 0;j < nygrid;j++) {
         jst = (int) ( (float) ygrid[j] - halfbox * 1.5);
         jnd = (int) ( (float) ygrid[j] + halfbox * 1.5);
-        if (jst < 0)
-            jst = 0;
-        if (jnd > ny - 1)
-            jnd = ny - 1;
+        if (jst < row0)
+            jst = row0;
+        if (jnd > row1 - 1)
+            jnd = row1 - 1;
+        if (jst > jnd)
+            continue;
         ypsize = halfbox;
         ymsize = halfbox;
         if (j == 0)
@@ -227,33 +342,68 @@ int dmedsmooth_interpolate(const float* grid,
                     else
                         // xkernel = 0
                         continue;
-                    smooth[ip + jp*nx] += xkernel * ykernel * grid[i + j * nxgrid];
+                    smooth[ip + (size_t)jp*nx] += xkernel * ykernel * grid[i + j * nxgrid];
                 }
             }
         }
     }
+    return NULL;
+}
+
+static int medsmooth_interpolate(const float* grid,
+                                 int nx, int ny,
+                                 int nxgrid, int nygrid,
+                                 const int* xgrid, const int* ygrid,
+                                 int halfbox,
+                                 float* smooth,
+                                 int nthreads) {
+    struct medsmooth_args args;
+    memset(&args, 0, sizeof(args));
+    args.nx = nx;
+    args.ny = ny;
+    args.halfbox = halfbox;
+    args.nxgrid = nxgrid;
+    args.nygrid = nygrid;
+    args.xgrid = xgrid;
+    args.ygrid = ygrid;
+    // (not modified)
+    args.grid = (float*)grid;
+    args.smooth = smooth;
+    run_threads(interpolate_rows, &args, MIN(nthreads, ny));
     return 0;
 }
 
+int dmedsmooth_interpolate(const float* grid,
+                           int nx, int ny,
+                           int nxgrid, int nygrid,
+                           const int* xgrid, const int* ygrid,
+                           int halfbox,
+                           float* smooth) {
+    return medsmooth_interpolate(grid, nx, ny, nxgrid, nygrid, xgrid, ygrid,
+                                 halfbox, smooth, 1);
+}
 
-int dmedsmooth(const float *image,
-               const uint8_t *masked,
-               int nx,
-               int ny,
-               int halfbox,
-               float *smooth)
+
+int dmedsmooth_threaded(const float *image,
+                        const uint8_t *masked,
+                        int nx,
+                        int ny,
+                        int halfbox,
+                        float *smooth,
+                        int nthreads)
 {
     float *grid = NULL;
     int *xgrid = NULL;
     int *ygrid = NULL;
     int nxgrid, nygrid;
 
-    if (dmedsmooth_grid(image, masked, nx, ny, halfbox,
-                        &grid, &xgrid, &ygrid, &nxgrid, &nygrid)) {
+    nthreads = get_nthreads(nthreads);
+    if (medsmooth_grid(image, masked, nx, ny, halfbox,
+                       &grid, &xgrid, &ygrid, &nxgrid, &nygrid, nthreads)) {
         return 0;
     }
-    if (dmedsmooth_interpolate(grid, nx, ny, nxgrid, nygrid,
-                               xgrid, ygrid, halfbox, smooth)) {
+    if (medsmooth_interpolate(grid, nx, ny, nxgrid, nygrid,
+                              xgrid, ygrid, halfbox, smooth, nthreads)) {
         return 0;
     }
 
@@ -263,3 +413,13 @@ int dmedsmooth(const float *image,
 
     return 1;
 }
+
+int dmedsmooth(const float *image,
+               const uint8_t *masked,
+               int nx,
+               int ny,
+               int halfbox,
+               float *smooth)
+{
+    return dmedsmooth_threaded(image, masked, nx, ny, halfbox, smooth, 1);
+}
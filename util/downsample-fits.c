@@ -9,6 +9,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "an-bool.h"
@@ -21,17 +22,83 @@
 #include "qfits_convert.h"
 #include "qfits_header.h"
 
-static const char* OPTIONS = "hvs:e:";
+static const char* OPTIONS = "hvs:e:j:";
+
+// The image is read in bands of about this many pixels per thread...
+#define BAND_PIXELS (1024*1024)
+// ... and each band's output is averaged and converted by several
+// threads, this many output rows at a time.
+#define TASK_ROWS 16
 
 static void printHelp(char* progname) {
     printf("%s  [options]  <input-file> <output-file>\n"
            "    use \"-\" to write to stdout.\n"
            "      [-s <scale>]: downsample scale (default: 2): integer\n"
            "      [-e <extension>]: read extension (default: 0)\n"
+           "      [-j <threads>]: number of threads (default: 1)\n"
            "      [-v]: verbose\n"
            "\n", progname);
 }
 
+typedef struct {
+    // the input band, W x H
+    const float* img;
+    int W;
+    int H;
+    int scale;
+    int edge;
+    int out_bitpix;
+    // the output band, outw x outh, and it as FITS pixels.
+    float* outimg;
+    char* outbuf;
+    int outw;
+    int outh;
+    int ntasks;
+    int next;
+    int failed;
+} band_job_t;
+
+static void* band_worker(void* arg) {
+    band_job_t* b = arg;
+    int nbytes = abs(b->out_bitpix)/8;
+    int t;
+    while ((t = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->ntasks) {
+        int j0 = t * TASK_ROWS;
+        int j1 = MIN(b->outh, j0 + TASK_ROWS);
+        int y0 = j0 * b->scale;
+        int y1 = MIN(b->H, j1 * b->scale);
+        size_t i;
+        average_image_f(b->img + (size_t)y0 * b->W, b->W, y1 - y0, b->scale,
+                        b->edge, NULL, NULL, b->outimg + (size_t)j0 * b->outw);
+        for (i=(size_t)j0 * b->outw; i<(size_t)j1 * b->outw; i++) {
+            if (qfits_pixel_ctofits(PTYPE_FLOAT, b->out_bitpix,
+                                    b->outimg + i, b->outbuf + i * nbytes))
+                b->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+// Averages and converts a band on "nthreads" threads.
+static int downsample_band(band_job_t* b, int nthreads) {
+    pthread_t* threads;
+    int t, nstarted = 0;
+    b->ntasks = (b->outh + TASK_ROWS - 1) / TASK_ROWS;
+    b->next = 0;
+    b->failed = 0;
+    nthreads = MAX(1, MIN(nthreads, b->ntasks));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, band_worker, b))
+            break;
+        nstarted++;
+    }
+    band_worker(b);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    return b->failed ? -1 : 0;
+}
 
 int main(int argc, char *argv[]) {
     int argchar;
@@ -55,6 +122,9 @@ int main(int argc, char *argv[]) {
     int edge = EDGE_TRUNCATE;
     int ext = 0;
     int npixout = 0;
+    int nthreads = 1;
+    band_job_t band;
+    char* outbuf;
 
     while ((argchar = getopt (argc, argv, OPTIONS)) != -1)
         switch (argchar) {
@@ -67,6 +137,9 @@ int main(int argc, char *argv[]) {
         case 'e':
             ext = atoi(optarg);
             break;
+        case 'j':
+            nthreads = MAX(1, atoi(optarg));
+            break;
         case '?':
         case 'h':
             printHelp(argv[0]);
@@ -106,13 +179,12 @@ int main(int argc, char *argv[]) {
         exit(-1);
     }
     animg = anqfits_get_image_const(anq, ext);
-    
-    W = (int)animg->width;
-    H = (int)animg->height;
     if (!animg) {
-        ERROR("Failde to read image from \"%s\"", infn);
+        ERROR("Failed to read image from \"%s\"", infn);
         exit(-1);
     }
+    W = (int)animg->width;
+    H = (int)animg->height;
 
     /*
      if (tostdout)
@@ -145,62 +217,70 @@ int main(int argc, char *argv[]) {
     }
     qfits_header_destroy(hdr);
 
+    // Whole rows, in bands of a multiple of "scale" rows.
     winw = W;
-    winh = (int)ceil(ceil(1024*1024 / (float)winw) / (float)scale) * scale;
+    winh = (int)ceil(ceil(BAND_PIXELS * (float)nthreads / (float)winw) / (float)scale) * scale;
+
+    outimg = malloc((size_t)((winw + scale - 1) / scale) *
+                    (size_t)(winh / scale) * sizeof(float));
+    outbuf = malloc((size_t)((winw + scale - 1) / scale) *
+                    (size_t)(winh / scale) * (abs(out_bitpix)/8));
+    if (!outimg || !outbuf) {
+        SYSERROR("Failed to allocate output buffers");
+        exit(-1);
+    }
 
-    outimg = malloc((size_t)ceil(winw/scale)*(size_t)ceil(winh/scale) * sizeof(float));
-			
     logmsg("Image is %i x %i x %i\n", W, H, (int)animg->planes);
     logmsg("Output will be %i x %i x %i\n", outw, outh, (int)animg->planes);
     logverb("Reading in blocks of %i x %i\n", winw, winh);
     for (plane=0; plane<animg->planes; plane++) {
-        int bx, by;
-        int nx, ny;
+        int by;
         for (by=0; by<(int)ceil(H / (float)winh); by++) {
-            for (bx=0; bx<(int)ceil(W / (float)winw); bx++) {
-                int i;
-                int lox, loy, hix, hiy, outw, outh;
-                nx = MIN(winw, W - bx*winw);
-                ny = MIN(winh, H - by*winh);
-                lox = bx*winw;
-                loy = by*winh;
-                hix = lox + nx;
-                hiy = loy + ny;
-                logverb("  reading %i,%i + %i,%i\n", lox, loy, nx, ny);
-
-                img = anqfits_readpix(anq, ext, lox, hix, loy, hiy, plane,
-                                      PTYPE_FLOAT, NULL, &W, &H);
-                if (!img) {
-                    ERROR("Failed to load pixel window: x=[%i, %i), y=[%i,%i), plane %i\n",
-                          lox, hix, loy, hiy, plane);
-                    exit(-1);
-                }
-
-                average_image_f(img, nx, ny, scale, edge,
-                                &outw, &outh, outimg);
-                free(img);
-
-                logverb("  writing %i x %i\n", outw, outh);
-                if (outw * outh == 0)
-                    continue;
-
-                for (i=0; i<outw*outh; i++) {
-                    int nbytes = abs(out_bitpix)/8;
-                    char buf[nbytes];
-                    if (qfits_pixel_ctofits(PTYPE_FLOAT, out_bitpix,
-                                            outimg + i, buf)) {
-                        ERROR("Failed to convert pixel to FITS type\n");
-                        exit(-1);
-                    }
-                    if (fwrite(buf, nbytes, 1, fout) != 1) {
-                        ERROR("Failed to write pixels\n");
-                        exit(-1);
-                    }
-                }
-                npixout += outw*outh;
+            int lox, loy, hix, hiy, nx, ny;
+            size_t nout;
+            nx = W;
+            ny = MIN(winh, H - by*winh);
+            lox = 0;
+            loy = by*winh;
+            hix = lox + nx;
+            hiy = loy + ny;
+            logverb("  reading %i,%i + %i,%i\n", lox, loy, nx, ny);
+
+            img = anqfits_readpix(anq, ext, lox, hix, loy, hiy, plane,
+                                  PTYPE_FLOAT, NULL, NULL, NULL);
+            if (!img) {
+                ERROR("Failed to load pixel window: x=[%i, %i), y=[%i,%i), plane %i\n",
+                      lox, hix, loy, hiy, plane);
+                exit(-1);
+            }
+
+            band.img = img;
+            band.W = nx;
+            band.H = ny;
+            band.scale = scale;
+            band.edge = edge;
+            band.out_bitpix = out_bitpix;
+            band.outimg = outimg;
+            band.outbuf = outbuf;
+            get_output_image_size(nx, ny, scale, edge, &band.outw, &band.outh);
+            if (downsample_band(&band, nthreads)) {
+                ERROR("Failed to convert pixels to FITS type\n");
+                exit(-1);
+            }
+            free(img);
+
+            nout = (size_t)band.outw * band.outh;
+            logverb("  writing %i x %i\n", band.outw, band.outh);
+            if (nout == 0)
+                continue;
+            if (fwrite(outbuf, abs(out_bitpix)/8, nout, fout) != nout) {
+                ERROR("Failed to write pixels\n");
+                exit(-1);
             }
+            npixout += nout;
         }
     }
+    free(outbuf);
     free(outimg);
     anqfits_close(anq);
 
@@ -0,0 +1,324 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "dimage.h"
+#include "mathutil.h"
+#include "errors.h"
+
+// Values are handed out to threads this many at a time.
+#define CHUNK (1 << 16)
+// Bins that hold at most this many values have them collected and
+// selected from directly...
+#define COLLECT_MAX (1 << 18)
+// ... otherwise the bin is histogrammed again, up to this many times.
+#define MAX_LEVELS 4
+
+// (We're built with -ffinite-math-only, so isfinite() can't be trusted.)
+static int is_finite(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits & 0x7f800000) != 0x7f800000;
+}
+
+enum { PASS_RANGE, PASS_HIST, PASS_COLLECT, PASS_MIN };
+
+struct pct_job {
+    const float* data;
+    size_t N;
+    int pass;
+    // the set of values the pass looks at: the finite ones that fall in
+    // bin bin[l] of level l's histogram (lo[l], scale[l]), for each
+    // l < nlevels.
+    int nlevels;
+    double lo[MAX_LEVELS];
+    double scale[MAX_LEVELS];
+    int bin[MAX_LEVELS];
+    // the histogram this pass builds: DPERCENTILE_BINS bins from "hlo",
+    // "hscale" bins per unit.
+    double hlo, hscale;
+    int64_t* hist;
+    // PASS_RANGE and PASS_MIN results, under "lock".
+    float minval, maxval;
+    int64_t n;
+    // PASS_COLLECT output.
+    float* collected;
+    int64_t ncollected;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static int value_bin(double v, double lo, double scale) {
+    double b = (v - lo) * scale;
+    if (b < 0)
+        return 0;
+    if (b >= DPERCENTILE_BINS)
+        return DPERCENTILE_BINS - 1;
+    return (int)b;
+}
+
+static int in_set(const struct pct_job* job, float v) {
+    int l;
+    if (!is_finite(v))
+        return 0;
+    for (l=0; l<job->nlevels; l++)
+        if (value_bin(v, job->lo[l], job->scale[l]) != job->bin[l])
+            return 0;
+    return 1;
+}
+
+static void* pct_worker(void* arg) {
+    struct pct_job* job = arg;
+    int64_t* hist = NULL;
+    float mn = LARGE_VALF, mx = -LARGE_VALF;
+    int64_t n = 0;
+    size_t start, i;
+
+    if (job->pass == PASS_HIST)
+        hist = calloc(DPERCENTILE_BINS, sizeof(int64_t));
+    while ((start = __atomic_fetch_add(&job->next, CHUNK, __ATOMIC_RELAXED)) < job->N) {
+        size_t end = MIN(job->N, start + CHUNK);
+        for (i=start; i<end; i++) {
+            float v = job->data[i];
+            if (!in_set(job, v))
+                continue;
+            switch (job->pass) {
+            case PASS_RANGE:
+            case PASS_MIN:
+                mn = MIN(mn, v);
+                mx = MAX(mx, v);
+                n++;
+                break;
+            case PASS_HIST:
+                if (hist)
+                    hist[value_bin(v, job->hlo, job->hscale)]++;
+                break;
+            case PASS_COLLECT:
+                job->collected[__atomic_fetch_add(&job->ncollected, 1,
+                                                  __ATOMIC_RELAXED)] = v;
+                break;
+            }
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    if (job->pass == PASS_HIST) {
+        if (hist)
+            for (i=0; i<DPERCENTILE_BINS; i++)
+                job->hist[i] += hist[i];
+        else
+            job->n = -1;
+    } else if (n) {
+        job->minval = MIN(job->minval, mn);
+        job->maxval = MAX(job->maxval, mx);
+        job->n += n;
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(hist);
+    return NULL;
+}
+
+static int run_pass(struct pct_job* job, int pass, int nthreads) {
+    pthread_t* threads;
+    int t, nstarted = 0;
+    job->pass = pass;
+    job->next = 0;
+    job->minval = LARGE_VALF;
+    job->maxval = -LARGE_VALF;
+    job->n = 0;
+    job->ncollected = 0;
+    if (pass == PASS_HIST)
+        memset(job->hist, 0, DPERCENTILE_BINS * sizeof(int64_t));
+    nthreads = (int)MAX(1, MIN((size_t)nthreads, (job->N + CHUNK - 1) / CHUNK));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    // this thread is the first worker.
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, pct_worker, job))
+            break;
+        nstarted++;
+    }
+    pct_worker(job);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    if (pass == PASS_HIST && job->n == -1) {
+        SYSERROR("Failed to allocate histogram");
+        return -1;
+    }
+    return 0;
+}
+
+// Finds the bin of job->hist holding rank "rank"; "below" is the count
+// in the bins before it.
+static int find_bin(const struct pct_job* job, int64_t rank, int64_t* below) {
+    int b;
+    *below = 0;
+    for (b=0; b<DPERCENTILE_BINS-1; b++) {
+        if (*below + job->hist[b] > rank)
+            break;
+        *below += job->hist[b];
+    }
+    return b;
+}
+
+// The value of rank "rank" among the finite values, given the level-0
+// histogram in "hist0" (over [minval, maxval]).
+static int select_rank(struct pct_job* job, const int64_t* hist0,
+                       float minval, float maxval, int64_t rank,
+                       int nthreads, float* out) {
+    double lo = minval;
+    double scale = DPERCENTILE_BINS / ((double)maxval - (double)minval);
+    int64_t below;
+    int level;
+
+    memcpy(job->hist, hist0, DPERCENTILE_BINS * sizeof(int64_t));
+    job->nlevels = 0;
+    for (level=0;; level++) {
+        int b = find_bin(job, rank, &below);
+        int64_t count = job->hist[b];
+        rank -= below;
+        job->lo[level] = lo;
+        job->scale[level] = scale;
+        job->bin[level] = b;
+        job->nlevels = level + 1;
+        if (count <= COLLECT_MAX) {
+            job->collected = malloc(MAX(1, count) * sizeof(float));
+            if (!job->collected) {
+                SYSERROR("Failed to allocate %lli values", (long long)count);
+                return -1;
+            }
+            if (run_pass(job, PASS_COLLECT, nthreads)) {
+                free(job->collected);
+                return -1;
+            }
+            *out = dselect(rank, job->ncollected, job->collected);
+            free(job->collected);
+            job->collected = NULL;
+            return 0;
+        }
+        if (level + 1 == MAX_LEVELS) {
+            // the bin is (max-min) / DPERCENTILE_BINS^MAX_LEVELS wide.
+            if (run_pass(job, PASS_MIN, nthreads))
+                return -1;
+            *out = job->minval;
+            return 0;
+        }
+        // histogram the bin.
+        lo += b / scale;
+        scale *= DPERCENTILE_BINS;
+        job->hlo = lo;
+        job->hscale = scale;
+        if (run_pass(job, PASS_HIST, nthreads))
+            return -1;
+    }
+}
+
+static int64_t percentiles_exact(const float* data, size_t N,
+                                 const double* ps, int np, int nthreads,
+                                 float* out) {
+    struct pct_job job;
+    int64_t* hist0 = NULL;
+    int64_t rtn = -1;
+    int i;
+
+    if (N <= COLLECT_MAX) {
+        // small enough to select from directly.
+        float* vals = malloc(MAX(1, N) * sizeof(float));
+        int64_t n = 0;
+        size_t j;
+        if (!vals) {
+            SYSERROR("Failed to allocate %zu values", N);
+            return -1;
+        }
+        for (j=0; j<N; j++)
+            if (is_finite(data[j]))
+                vals[n++] = data[j];
+        for (i=0; n && i<np; i++)
+            out[i] = dselect(MAX(0, MIN(n - 1, (int64_t)(ps[i] * n))), n, vals);
+        free(vals);
+        return n;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.data = data;
+    job.N = N;
+    pthread_mutex_init(&job.lock, NULL);
+    if (run_pass(&job, PASS_RANGE, nthreads))
+        goto bailout;
+    rtn = job.n;
+    if (job.n == 0)
+        goto bailout;
+    if (job.minval == job.maxval) {
+        for (i=0; i<np; i++)
+            out[i] = job.minval;
+        goto bailout;
+    }
+    job.hist = malloc(DPERCENTILE_BINS * sizeof(int64_t));
+    hist0 = malloc(DPERCENTILE_BINS * sizeof(int64_t));
+    if (!job.hist || !hist0) {
+        SYSERROR("Failed to allocate histogram");
+        rtn = -1;
+        goto bailout;
+    }
+    job.hlo = job.minval;
+    job.hscale = DPERCENTILE_BINS / ((double)job.maxval - (double)job.minval);
+    {
+        float minval = job.minval, maxval = job.maxval;
+        int64_t n = job.n;
+        if (run_pass(&job, PASS_HIST, nthreads)) {
+            rtn = -1;
+            goto bailout;
+        }
+        memcpy(hist0, job.hist, DPERCENTILE_BINS * sizeof(int64_t));
+        for (i=0; i<np; i++) {
+            int64_t rank = MAX(0, MIN(n - 1, (int64_t)(ps[i] * n)));
+            if (select_rank(&job, hist0, minval, maxval, rank, nthreads,
+                            out + i)) {
+                rtn = -1;
+                goto bailout;
+            }
+        }
+    }
+ bailout:
+    pthread_mutex_destroy(&job.lock);
+    free(job.hist);
+    free(hist0);
+    return rtn;
+}
+
+int64_t dpercentiles(const float* data, size_t N, const double* ps, int np,
+                     size_t nsample, int nthreads, float* out) {
+    float* sample;
+    uint64_t state;
+    int64_t rtn;
+    size_t i;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (!nsample || nsample >= N)
+        return percentiles_exact(data, N, ps, np, nthreads, out);
+
+    // one value at a random position in each of "nsample" equal strides,
+    // from a fixed seed so that the results are repeatable.
+    sample = malloc(nsample * sizeof(float));
+    if (!sample) {
+        SYSERROR("Failed to allocate %zu samples", nsample);
+        return -1;
+    }
+    state = 0x9E3779B97F4A7C15ULL;
+    for (i=0; i<nsample; i++) {
+        size_t lo = (size_t)((double)N * i / nsample);
+        size_t hi = (size_t)((double)N * (i+1) / nsample);
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        sample[i] = data[lo + (size_t)((state >> 33) % MAX(1, hi - lo))];
+    }
+    rtn = percentiles_exact(sample, nsample, ps, np, 1, out);
+    free(sample);
+    return rtn;
+}
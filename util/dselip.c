@@ -8,6 +8,7 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
 
 // for compare_floats_asc
 #include "permutedsort.h"
@@ -31,25 +32,86 @@ void dselip_cleanup() {
 
 #else
 
-static int high_water_mark = 0;
-static float* past_data = NULL;
+// Each thread keeps its own scratch buffer, so that simplexy can run on
+// several image tiles at once.
+struct dselip_buffer {
+    float* data;
+    unsigned long size;
+};
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+static void free_buffer(void* v) {
+    struct dselip_buffer* b = v;
+    if (!b)
+        return;
+    free(b->data);
+    free(b);
+}
+
+static void make_buffer_key(void) {
+    pthread_key_create(&buffer_key, free_buffer);
+}
+
+static struct dselip_buffer* get_buffer(void) {
+    struct dselip_buffer* b;
+    pthread_once(&buffer_key_once, make_buffer_key);
+    b = pthread_getspecific(buffer_key);
+    if (!b) {
+        b = calloc(1, sizeof(struct dselip_buffer));
+        pthread_setspecific(buffer_key, b);
+    }
+    return b;
+}
 
 float dselip(unsigned long k, unsigned long n, float *arr) {
-    if (n > high_water_mark) {
-        free(past_data);
-        past_data = malloc(sizeof(float) * n);
-        high_water_mark = n;
+    struct dselip_buffer* b = get_buffer();
+    if (n > b->size) {
+        free(b->data);
+        b->data = malloc(sizeof(float) * n);
+        b->size = n;
         //printf("dselip watermark=%lu\n",n);
     }
-    memcpy(past_data, arr, sizeof(float) * n);
-    qsort(past_data, n, sizeof(float), compare_floats_asc);
-    return past_data[k];
+    memcpy(b->data, arr, sizeof(float) * n);
+    qsort(b->data, n, sizeof(float), compare_floats_asc);
+    return b->data[k];
 }
 
 void dselip_cleanup() {
-    free(past_data);
-    past_data = NULL;
-    high_water_mark = 0;
+    pthread_once(&buffer_key_once, make_buffer_key);
+    free_buffer(pthread_getspecific(buffer_key));
+    pthread_setspecific(buffer_key, NULL);
 }
 
 #endif
+
+float dselect(unsigned long k, unsigned long n, float *arr) {
+    // Wirth's selection: partition around arr[k], keeping the part that
+    // contains k.
+    long lo = 0, hi = (long)n - 1;
+    long kk = (long)k;
+    assert(k < n);
+    while (lo < hi) {
+        float x = arr[kk];
+        long i = lo, j = hi;
+        do {
+            while (arr[i] < x)
+                i++;
+            while (x < arr[j])
+                j--;
+            if (i <= j) {
+                float t = arr[i];
+                arr[i] = arr[j];
+                arr[j] = t;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+        if (j < kk)
+            lo = i;
+        if (kk < i)
+            hi = j;
+    }
+    return arr[kk];
+}
@@ -8,10 +8,14 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
+#include "os-features.h"
 #include "dimage.h"
 #include "simplexy-common.h"
 #include "log.h"
+#include "errors.h"
 
 /*
  * dsigma.c
@@ -21,6 +25,259 @@
  * Mike Blanton
  * 1/2006 */
 
+/*
+ The samples are the differences between pixels (x, y) and (x+sp, y+sp)
+ on a grid of spacing (dx, dy) over a rectangle of the image; the grid
+ rows are split among the threads, each filling its part of "diff".
+ The selection (dselect()) is reentrant, so several of these can run at
+ once, as for the tiles of a noise map.
+ */
+struct sigma_job {
+    const void* image;
+    // image width (row stride)
+    int nx;
+    // the rectangle [x0,x1) x [y0,y1)
+    int x0, x1, y0, y1;
+    int sp, dx, dy;
+    // grid columns and rows
+    int ngx, ngy;
+    float* diff;
+    void (*sample)(const struct sigma_job* job, int gy0, int gy1);
+};
+
+// Below this many samples, one thread is used (if not told otherwise).
+#define DSIGMA_THREAD_SAMPLES (1 << 18)
+
+struct sigma_thread {
+    const struct sigma_job* job;
+    int gy0, gy1;
+};
+
+static void* sample_thread(void* v) {
+    struct sigma_thread* t = v;
+    t->job->sample(t->job, t->gy0, t->gy1);
+    return NULL;
+}
+
+// Sets the grid; returns the number of samples.
+static int sigma_grid(struct sigma_job* job, int gridsize) {
+    int w = job->x1 - job->x0;
+    int h = job->y1 - job->y0;
+    int dx, dy;
+
+    if (gridsize == 0)
+        gridsize = 20;
+
+    dx = gridsize;
+    if (dx > w / 4)
+        dx = w / 4;
+    if (dx <= 0)
+        dx = 1;
+
+    dy = gridsize;
+    if (dy > h / 4)
+        dy = h / 4;
+    if (dy <= 0)
+        dy = 1;
+
+    job->dx = dx;
+    job->dy = dy;
+    job->ngx = MAX(0, (w - job->sp + dx-1) / dx);
+    job->ngy = MAX(0, (h - job->sp + dy-1) / dy);
+    return job->ngx * job->ngy;
+}
+
+static void sample_all(struct sigma_job* job, int nthreads) {
+    struct sigma_thread* ts;
+    pthread_t* threads;
+    int ndiff = job->ngx * job->ngy;
+    int i, nstarted;
+
+    if (nthreads <= 0)
+        nthreads = (ndiff >= DSIGMA_THREAD_SAMPLES) ?
+            (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    nthreads = MAX(1, MIN(nthreads, job->ngy));
+    if (nthreads == 1) {
+        job->sample(job, 0, job->ngy);
+        return;
+    }
+    ts = malloc(nthreads * sizeof(struct sigma_thread));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        ts[i].job = job;
+        ts[i].gy0 = (int)((long)job->ngy * i / nthreads);
+        ts[i].gy1 = (int)((long)job->ngy * (i+1) / nthreads);
+    }
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, sample_thread, ts + nstarted)) {
+            SYSERROR("Failed to start noise-sampling thread");
+            break;
+        }
+    sample_thread(ts);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    // (whatever didn't get a thread is done here.)
+    for (i=nstarted; i<nthreads; i++)
+        sample_thread(ts + i);
+    free(ts);
+    free(threads);
+}
+
+// The noise from the "ndiff" samples in "diff" (which is reordered).
+static int sigma_from_diffs(float* diff, int ndiff, float* sigma) {
+    float tot;
+    int i;
+
+    if (ndiff <= 10) {
+        tot = 0.;
+        for (i = 0; i < ndiff; i++)
+            tot += diff[i] * diff[i];
+        *sigma = sqrt(tot / (float) ndiff);
+        return 0;
+    }
+
+    /*
+     estimate sigma in a clever way to avoid having our estimate
+     biased by outliers. outliers come into the diff list when we
+     sampled a point where the upper point was on a source, but the
+     lower one was not (or vice versa).  Since the sample variance
+     involves squaring the already-large outliers, they drastically
+     affect the final sigma estimate. by sorting, the outliers go to
+     the top and only affect the final value very slightly, because
+     they are a small fraction of the total entries in diff (or so we
+     hope!)
+     */
+    {
+        double Nsigma=0.7;
+        double s = 0.0;
+        // Sample the sorted list of squared differences at different
+        // percentiles (starting at ~50th)
+        while (s == 0.0) {
+            int k = (int)floor(ndiff * erf(Nsigma / M_SQRT2));
+            if (k >=  ndiff) {
+                logerr("Failed to estimate the image noise.  Setting sigma=1.  Expect the worst.\n");
+                // FIXME - Could try a finer grid of sample points...
+                s = 1.0;
+                break;
+            }
+            // (the k-th smallest doesn't care how dselect() left the
+            // others.)
+            s = dselect(k, ndiff, diff) / (Nsigma * M_SQRT2);
+            logverb("Nsigma=%g, s=%g\n", Nsigma, s);
+            Nsigma += 0.1;
+        }
+        *sigma = s;
+    }
+    return 1;
+}
+
+static int measure(struct sigma_job* job, int gridsize, int nthreads,
+                   float* sigma) {
+    int ndiff;
+    int rtn;
+
+    if (job->x1 - job->x0 == 1 && job->y1 - job->y0 == 1) {
+        *sigma = 0.;
+        return 0;
+    }
+    /* get a bunch of noise 'samples' by looking at the differences between two
+     * diagonally spaced pixels (usually 5) */
+    ndiff = sigma_grid(job, gridsize);
+    if (ndiff <= 1) {
+        *sigma = 0.;
+        return 0;
+    }
+    logverb("Sampling sigma at %i points\n", ndiff);
+    job->diff = malloc(ndiff * sizeof(float));
+    if (!job->diff) {
+        SYSERROR("Failed to allocate %i noise samples", ndiff);
+        *sigma = 0.;
+        return 0;
+    }
+    sample_all(job, nthreads);
+    rtn = sigma_from_diffs(job->diff, ndiff, sigma);
+    FREEVEC(job->diff);
+    return rtn;
+}
+
+/*
+ The noise map: the tiles are handed out to the threads one at a time,
+ and each is measured on one thread.
+ */
+struct sigma_map_job {
+    const struct sigma_job* proto;
+    int gridsize;
+    int ntx, nty;
+    float* map;
+    int next;
+    int nmeasured;
+};
+
+static void* map_thread(void* v) {
+    struct sigma_map_job* m = v;
+    const struct sigma_job* p = m->proto;
+    int nx = p->x1 - p->x0;
+    int ny = p->y1 - p->y0;
+    for (;;) {
+        struct sigma_job job;
+        int k = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED);
+        int tx, ty;
+        float sig = 0.0;
+        if (k >= m->ntx * m->nty)
+            break;
+        tx = k % m->ntx;
+        ty = k / m->ntx;
+        job = *p;
+        job.x0 = p->x0 + (int)((long)nx * tx / m->ntx);
+        job.x1 = p->x0 + (int)((long)nx * (tx+1) / m->ntx);
+        job.y0 = p->y0 + (int)((long)ny * ty / m->nty);
+        job.y1 = p->y0 + (int)((long)ny * (ty+1) / m->nty);
+        if (measure(&job, m->gridsize, 1, &sig) && sig > 0) {
+            m->map[k] = sig;
+            __atomic_fetch_add(&m->nmeasured, 1, __ATOMIC_RELAXED);
+        } else
+            m->map[k] = 0.0;
+    }
+    return NULL;
+}
+
+static int measure_map(const struct sigma_job* proto, int gridsize,
+                       int ntx, int nty, int nthreads, float* map) {
+    struct sigma_map_job m;
+    pthread_t* threads;
+    int i, nstarted;
+
+    m.proto = proto;
+    m.gridsize = gridsize;
+    m.ntx = ntx;
+    m.nty = nty;
+    m.map = map;
+    m.next = 0;
+    m.nmeasured = 0;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, ntx * nty));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, map_thread, &m)) {
+            SYSERROR("Failed to start noise-map thread");
+            break;
+        }
+    // (the tiles are handed out as they go, so this thread picks up
+    // the work of threads that failed to start.)
+    map_thread(&m);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    return m.nmeasured;
+}
+
+int dsigma_gridsize(int nx, int ny, int nsamples) {
+    if (nsamples <= 0)
+        return 0;
+    return MAX(1, (int)floor(sqrt((double)nx * (double)ny / (double)nsamples)));
+}
 
 #define IMGTYPE float
 #define DSIGMA_SUFF
@@ -33,4 +290,3 @@
 #include "dsigma.inc"
 #undef IMGTYPE
 #undef DSIGMA_SUFF
-
@@ -8,9 +8,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <complex.h>
 
 #include "os-features.h"
 #include "simplexy-common.h"
+#include "dimage.h"
+#include "mathutil.h"
+#include "log.h"
 
 /*
  * dsmooth.c
@@ -21,6 +25,61 @@
  * 1/2006 
  */
 
+// A normalized Gaussian kernel out to 3 sigma; its length is "*npix".
+static float* gaussian_kernel(float sigma, int* p_npix) {
+    int i, npix;
+    float neghalfinvvar, total, scale, dx;
+    float* kernel1D;
+
+    npix = 2 * ((int) ceilf(3. * sigma)) + 1;
+    kernel1D = malloc(npix * sizeof(float));
+    neghalfinvvar = -1.0 / (2.0 * sigma * sigma);
+    for (i=0; i<npix; i++) {
+        dx = ((float) i - 0.5 * ((float)npix - 1.));
+        kernel1D[i] = exp((dx * dx) * neghalfinvvar);
+    }
+    total = 0.0;
+    for (i=0; i<npix; i++)
+        total += kernel1D[i];
+    scale = 1. / total;
+    for (i=0; i<npix; i++)
+        kernel1D[i] *= scale;
+    *p_npix = npix;
+    return kernel1D;
+}
+
+// Row buffers are aligned for vector loads.
+static float* aligned_floats(size_t n) {
+    void* p = NULL;
+    if (posix_memalign(&p, 64, MAX(n, 1) * sizeof(float)))
+        return NULL;
+    return p;
+}
+
+// out[i] = sum_k kernel[k] * padded[i + k], for i in [0, nx).  The inner
+// loops run over contiguous pixels so the compiler can vectorize them.
+static void convolve_row(const float* restrict padded, int nx,
+                         const float* restrict kernel, int npix,
+                         float* restrict out) {
+    int i, k;
+    for (i=0; i<nx; i++)
+        out[i] = 0.0;
+    for (k=0; k<npix; k++) {
+        const float w = kernel[k];
+        const float* restrict p = padded + k;
+        for (i=0; i<nx; i++)
+            out[i] += w * p[i];
+    }
+}
+
+// out[i] += w * row[i]
+static void add_scaled_row(const float* restrict row, float w, int nx,
+                           float* restrict out) {
+    int i;
+    for (i=0; i<nx; i++)
+        out[i] += w * row[i];
+}
+
 #define IMGTYPE float
 #define SUFFIX
 #include "dsmooth.inc"
@@ -104,3 +163,377 @@ int dsmooth(float *image,
     return (1);
 } /* end photfrac */
 
+
+/*
+ Recursive (IIR) Gaussian: R. Deriche, "Recursively implementing the
+ Gaussian and its derivatives", INRIA RR-1893 (1993).  The Gaussian is
+ fit by a sum of two damped cosines, which is a fourth-order causal
+ filter plus its mirror image; the response is within about 0.05% of the
+ peak of the sampled Gaussian.  Like dsmooth2(), it treats the image as
+ surrounded by zeros.
+ */
+struct deriche {
+    // causal numerator (taps 0..3), anti-causal numerator (taps 1..4),
+    // and the denominator shared by both (d[0] = 1).
+    float n[4];
+    float m[5];
+    float d[5];
+};
+
+// poly (with *np coefficients) *= (1 - root * z)
+static void poly_mul_root(double complex* poly, int* np, double complex root) {
+    int i;
+    poly[*np] = 0;
+    for (i=*np; i>0; i--)
+        poly[i] -= root * poly[i-1];
+    (*np)++;
+}
+
+static void deriche_coefficients(float sigma, struct deriche* c) {
+    const double a[2] = { 1.680, -0.6803 };
+    const double b[2] = { 3.735, -0.2598 };
+    const double lambda[2] = { 1.783, 1.723 };
+    const double omega[2] = { 0.6318, 1.997 };
+    double complex pole[4], alpha[4];
+    double complex D[5], N[5], M[6], t[6];
+    double sumN = 0, sumM = 0, sumD = 0, scale;
+    int i, j, k, nd, nt;
+
+    for (k=0; k<2; k++) {
+        pole[2*k] = cexp((-lambda[k] + I * omega[k]) / sigma);
+        pole[2*k+1] = conj(pole[2*k]);
+        alpha[2*k] = (a[k] - I * b[k]) / 2.0;
+        alpha[2*k+1] = conj(alpha[2*k]);
+    }
+    D[0] = 1;
+    nd = 1;
+    for (k=0; k<4; k++)
+        poly_mul_root(D, &nd, pole[k]);
+    for (i=0; i<5; i++)
+        N[i] = M[i] = 0;
+    M[5] = 0;
+    for (k=0; k<4; k++) {
+        // causal: alpha_k / (1 - p_k z^-1)
+        t[0] = alpha[k];
+        nt = 1;
+        for (j=0; j<4; j++)
+            if (j != k)
+                poly_mul_root(t, &nt, pole[j]);
+        for (i=0; i<nt; i++)
+            N[i] += t[i];
+        // anti-causal: alpha_k p_k z / (1 - p_k z)
+        t[0] = 0;
+        t[1] = alpha[k] * pole[k];
+        nt = 2;
+        for (j=0; j<4; j++)
+            if (j != k)
+                poly_mul_root(t, &nt, pole[j]);
+        for (i=0; i<nt; i++)
+            M[i] += t[i];
+    }
+    for (i=0; i<4; i++)
+        sumN += creal(N[i]);
+    for (i=1; i<5; i++)
+        sumM += creal(M[i]);
+    for (i=0; i<5; i++)
+        sumD += creal(D[i]);
+    // unit gain
+    scale = sumD / (sumN + sumM);
+    for (i=0; i<4; i++)
+        c->n[i] = creal(N[i]) * scale;
+    c->m[0] = 0;
+    for (i=1; i<5; i++)
+        c->m[i] = creal(M[i]) * scale;
+    for (i=0; i<5; i++)
+        c->d[i] = creal(D[i]);
+}
+
+/*
+ Filters "width" interleaved lines of length "n": element t of line j is
+ in[t * width + j].  "causal" and "out" are scratch and result, the same
+ size as "in".
+ */
+static void deriche_lines(const struct deriche* c, const float* in, int n,
+                          int width, float* causal, float* out) {
+    int t, k, j;
+    for (t=0; t<n; t++) {
+        float* y = causal + (size_t)t * width;
+        for (j=0; j<width; j++)
+            y[j] = 0;
+        for (k=0; k<4 && k<=t; k++) {
+            const float* x = in + (size_t)(t-k) * width;
+            for (j=0; j<width; j++)
+                y[j] += c->n[k] * x[j];
+        }
+        for (k=1; k<5 && k<=t; k++) {
+            const float* yk = causal + (size_t)(t-k) * width;
+            for (j=0; j<width; j++)
+                y[j] -= c->d[k] * yk[j];
+        }
+    }
+    for (t=n-1; t>=0; t--) {
+        float* y = out + (size_t)t * width;
+        for (j=0; j<width; j++)
+            y[j] = 0;
+        for (k=1; k<5 && t+k<n; k++) {
+            const float* x = in + (size_t)(t+k) * width;
+            const float* yk = out + (size_t)(t+k) * width;
+            for (j=0; j<width; j++)
+                y[j] += c->m[k] * x[j] - c->d[k] * yk[j];
+        }
+    }
+    for (t=0; t<n; t++) {
+        float* y = out + (size_t)t * width;
+        const float* yc = causal + (size_t)t * width;
+        for (j=0; j<width; j++)
+            y[j] += yc[j];
+    }
+}
+
+// rows or columns filtered at once.
+#define IIR_BLOCK 64
+
+void dsmooth2_iir(float *image, int nx, int ny, float sigma, float *smooth) {
+    struct deriche c;
+    float *in, *causal, *out;
+    int i, j, x0, y0, w;
+
+    if (sigma < DSMOOTH2_IIR_MIN_SIGMA) {
+        dsmooth2(image, nx, ny, sigma, smooth);
+        return;
+    }
+    deriche_coefficients(sigma, &c);
+
+    in = aligned_floats((size_t)MAX(nx, ny) * IIR_BLOCK);
+    causal = aligned_floats((size_t)MAX(nx, ny) * IIR_BLOCK);
+    out = aligned_floats((size_t)MAX(nx, ny) * IIR_BLOCK);
+
+    // x direction, in blocks of rows, transposed so that the rows are
+    // filtered side by side.
+    for (y0=0; y0<ny; y0+=IIR_BLOCK) {
+        w = MIN(IIR_BLOCK, ny - y0);
+        for (j=0; j<w; j++)
+            for (i=0; i<nx; i++)
+                in[(size_t)i*w + j] = image[(size_t)(y0 + j)*nx + i];
+        deriche_lines(&c, in, nx, w, causal, out);
+        for (j=0; j<w; j++)
+            for (i=0; i<nx; i++)
+                smooth[(size_t)(y0 + j)*nx + i] = out[(size_t)i*w + j];
+    }
+
+    // y direction, in blocks of columns.
+    for (x0=0; x0<nx; x0+=IIR_BLOCK) {
+        w = MIN(IIR_BLOCK, nx - x0);
+        for (j=0; j<ny; j++)
+            memcpy(in + (size_t)j*w, smooth + (size_t)j*nx + x0,
+                   w * sizeof(float));
+        deriche_lines(&c, in, ny, w, causal, out);
+        for (j=0; j<ny; j++)
+            for (i=0; i<w; i++)
+                smooth[(size_t)j*nx + x0 + i] = out[(size_t)j*w + i];
+    }
+    free(in);
+    free(causal);
+    free(out);
+}
+
+/*
+ Smoothing and block-averaging are both separable and linear, so the
+ x-smoothed rows can be averaged in x right away, and the ring buffer
+ only has to hold rows "outw" wide.  Each output row is then the average
+ of the y-smoothed rows of its block.
+ */
+void dsmooth2_average_u8(const uint8_t* image, int nx, int ny, float sigma,
+                         int S, float* output) {
+    int i, j, jo, npix, half, start, end, sample, next, nrows;
+    int outw = (nx + S - 1) / S;
+    int outh = (ny + S - 1) / S;
+    float* kernel1D;
+    float* kernel_shifted;
+    float* padded;
+    float* xrow;
+    float* ring;
+
+    kernel1D = gaussian_kernel(sigma, &npix);
+    half = npix / 2;
+    kernel_shifted = kernel1D + half;
+
+    padded = aligned_floats((size_t)nx + 2*half);
+    memset(padded, 0, ((size_t)nx + 2*half) * sizeof(float));
+    xrow = aligned_floats(nx);
+    // x-smoothed, x-averaged row "r" is at ring + (r % npix) * outw.
+    ring = aligned_floats((size_t)npix * outw);
+
+    next = 0;
+    for (jo=0; jo<outh; jo++) {
+        float* out = output + (size_t)jo * outw;
+        for (i=0; i<outw; i++)
+            out[i] = 0.0;
+        nrows = MIN(S, ny - jo*S);
+        for (j=jo*S; j<jo*S + nrows; j++) {
+            start = MAX(0, j - half);
+            end = MIN(ny-1, j + half);
+            for (; next <= end; next++) {
+                const uint8_t* imagerow = image + (size_t)next*nx;
+                float* r = ring + (size_t)(next % npix) * outw;
+                for (i=0; i<nx; i++)
+                    padded[half + i] = imagerow[i];
+                convolve_row(padded, nx, kernel1D, npix, xrow);
+                for (i=0; i<outw; i++) {
+                    int k, n = MIN(S, nx - i*S);
+                    float sum = 0.0;
+                    for (k=0; k<n; k++)
+                        sum += xrow[i*S + k];
+                    r[i] = sum / n;
+                }
+            }
+            for (sample=start; sample<=end; sample++)
+                add_scaled_row(ring + (size_t)(sample % npix) * outw,
+                               kernel_shifted[sample - j], outw, out);
+        }
+        for (i=0; i<outw; i++)
+            out[i] /= nrows;
+    }
+    free(padded);
+    free(xrow);
+    free(ring);
+    FREEVEC(kernel1D);
+}
+
+// Where the rows of dsmooth2_mask() and dsmooth2_mask_i16() come from.
+struct mask_input {
+    float* image;
+    // if non-NULL, the background, which is replaced by image - bg.
+    float* bg;
+    const int16_t* image_i16;
+};
+
+static void mask_input_row(const struct mask_input* in, int nx, int j,
+                           float* restrict row) {
+    size_t off = (size_t)j * nx;
+    int i;
+    if (in->image_i16) {
+        const int16_t* im = in->image_i16 + off;
+        for (i=0; i<nx; i++)
+            row[i] = im[i];
+    } else if (in->bg) {
+        const float* restrict im = in->image + off;
+        float* restrict bg = in->bg + off;
+        for (i=0; i<nx; i++) {
+            bg[i] = im[i] - bg[i];
+            row[i] = bg[i];
+        }
+    } else
+        memcpy(row, in->image + off, nx * sizeof(float));
+}
+
+/*
+ The rows are smoothed as in dsmooth2(), and each smoothed row is
+ thresholded as soon as it is done.  The significant pixels are spread
+ "boxsize" columns sideways along the row, and "lastrow[i]" remembers
+ the last row in which column i was so flagged; once row j is done, mask
+ row j - boxsize is final: a pixel is set if its column was flagged
+ within "boxsize" rows of it.  This gives the same mask as dmask().
+ */
+static int smooth_mask(const struct mask_input* in, int nx, int ny,
+                       float dpsf, float limit, uint8_t* mask) {
+    int boxsize = 3 * dpsf;
+    int i, j, r, npix, half, start, end, sample, next, last;
+    int flagged_one = 0;
+    float maxval = -LARGE_VALF;
+    float* kernel1D;
+    float* kernel_shifted;
+    float* padded;
+    float* ring;
+    float* out;
+    uint8_t* hit;
+    int* lastrow;
+
+    kernel1D = gaussian_kernel(dpsf, &npix);
+    half = npix / 2;
+    kernel_shifted = kernel1D + half;
+
+    padded = aligned_floats((size_t)nx + 2*half);
+    memset(padded, 0, ((size_t)nx + 2*half) * sizeof(float));
+    ring = aligned_floats((size_t)npix * nx);
+    out = aligned_floats(nx);
+    hit = malloc(nx);
+    lastrow = malloc(nx * sizeof(int));
+    for (i=0; i<nx; i++)
+        lastrow[i] = -boxsize - 1;
+
+    next = 0;
+    for (j=0; j<ny + boxsize; j++) {
+        if (j < ny) {
+            start = MAX(0, j - half);
+            end = MIN(ny-1, j + half);
+            for (; next <= end; next++) {
+                mask_input_row(in, nx, next, padded + half);
+                convolve_row(padded, nx, kernel1D, npix,
+                             ring + (size_t)(next % npix) * nx);
+            }
+            for (i=0; i<nx; i++)
+                out[i] = 0.0;
+            for (sample=start; sample<=end; sample++)
+                add_scaled_row(ring + (size_t)(sample % npix) * nx,
+                               kernel_shifted[sample - j], nx, out);
+
+            // (NaNs count as significant, as in dmask().)
+            last = -boxsize - 1;
+            for (i=0; i<nx; i++) {
+                maxval = MAX(maxval, out[i]);
+                if (!(out[i] < limit))
+                    last = i;
+                hit[i] = (i - last <= boxsize);
+            }
+            last = nx + boxsize;
+            for (i=nx-1; i>=0; i--) {
+                if (!(out[i] < limit))
+                    last = i;
+                if (hit[i] || last - i <= boxsize) {
+                    lastrow[i] = j;
+                    flagged_one = 1;
+                }
+            }
+        }
+        r = j - boxsize;
+        if (r >= 0) {
+            uint8_t* m = mask + (size_t)r * nx;
+            for (i=0; i<nx; i++)
+                m[i] = (lastrow[i] >= r - boxsize);
+        }
+    }
+    free(padded);
+    free(ring);
+    free(out);
+    free(hit);
+    free(lastrow);
+    FREEVEC(kernel1D);
+
+    if (!flagged_one) {
+        logmsg("No pixels were marked as significant.\n"
+               "  significance threshold = %g\n"
+               "  max value in image = %g\n",
+               limit, maxval);
+        return 0;
+    }
+    return 1;
+}
+
+int dsmooth2_mask(float* image, float* bg, int nx, int ny, float dpsf,
+                  float limit, uint8_t* mask) {
+    struct mask_input in;
+    in.image = image;
+    in.bg = bg;
+    in.image_i16 = NULL;
+    return smooth_mask(&in, nx, ny, dpsf, limit, mask);
+}
+
+int dsmooth2_mask_i16(const int16_t* image, int nx, int ny, float dpsf,
+                      float limit, uint8_t* mask) {
+    struct mask_input in;
+    in.image = NULL;
+    in.bg = NULL;
+    in.image_i16 = image;
+    return smooth_mask(&in, nx, ny, dpsf, limit, mask);
+}
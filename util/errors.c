@@ -11,9 +11,12 @@
 #include "errors.h"
 #include "ioutils.h"
 #include "an-bool.h"
+#include "an-thread.h"
 
 static pl* estack = NULL;
 static anbool atexit_registered = FALSE;
+// serializes reporting, so that threads can report errors.
+AN_THREAD_DECLARE_STATIC_MUTEX(errlock);
 
 static err_t* error_copy(err_t* e) {
     int i, N;
@@ -81,7 +84,8 @@ void errors_clear_stack() {
     error_stack_clear(errors_get_state());
 }
 
-err_t* errors_get_state() {
+// call with "errlock" held.
+static err_t* get_state(void) {
     if (!estack) {
         estack = pl_new(4);
         // register an atexit() function to clean up.
@@ -98,6 +102,14 @@ err_t* errors_get_state() {
     return pl_get(estack, pl_size(estack)-1);
 }
 
+err_t* errors_get_state() {
+    err_t* e;
+    AN_THREAD_LOCK(errlock);
+    e = get_state();
+    AN_THREAD_UNLOCK(errlock);
+    return e;
+}
+
 void errors_free() {
     int i;
     if (!estack)
@@ -134,12 +146,14 @@ void report_error(const char* modfile, int modline,
                   const char* modfunc, const char* fmt, ...) {
     va_list va;
     va_start(va, fmt);
-    error_reportv(errors_get_state(), modfile, modline, modfunc, fmt, va);
+    AN_THREAD_LOCK(errlock);
+    error_reportv(get_state(), modfile, modline, modfunc, fmt, va);
+    AN_THREAD_UNLOCK(errlock);
     va_end(va);
 }
 
 void report_errno() {
-    error_report(errors_get_state(), "system", -1, "", "%s", strerror(errno));
+    report_error("system", -1, "", "%s", strerror(errno));
 }
 
 err_t* error_new() {
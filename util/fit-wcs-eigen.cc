@@ -0,0 +1,54 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ The least-squares kernel of fit-wcs.c, in Eigen; built (and used
+ instead of GSL's QR) when WITH_EIGEN is set -- see makefile.eigen.
+ The SIP fits have (order+1)(order+2)/2 columns, so those counts get
+ fixed-size instantiations: the column loops are unrolled and
+ vectorized, and the only heap use is Eigen's for the M-row factors.
+ */
+#include <Eigen/Dense>
+
+using namespace Eigen;
+
+extern "C" {
+#include "fit-wcs-eigen.h"
+}
+
+typedef Map<const Matrix<double, Dynamic, Dynamic, RowMajor>, 0,
+            OuterStride<> > MatrixMap;
+typedef Map<const VectorXd> VectorMap;
+
+template<int NC>
+static int lssolve(const double* A, int stride, const double* b1,
+                   const double* b2, int M, int N,
+                   double* x1, double* x2) {
+    typedef Matrix<double, Dynamic, NC> MatrixType;
+    typedef Matrix<double, NC, 1> SolutionType;
+    MatrixMap mA(A, M, N, OuterStride<>(stride));
+    HouseholderQR<MatrixType> qr(mA);
+    SolutionType s1 = qr.solve(VectorMap(b1, M));
+    SolutionType s2 = qr.solve(VectorMap(b2, M));
+    if (!s1.allFinite() || !s2.allFinite())
+        return -1;
+    Map<SolutionType>(x1, N) = s1;
+    Map<SolutionType>(x2, N) = s2;
+    return 0;
+}
+
+extern "C"
+int fit_wcs_eigen_lssolve(const double* A, int stride, const double* b1,
+                          const double* b2, int M, int N,
+                          double* x1, double* x2) {
+    switch (N) {
+    case 3:  return lssolve<3> (A, stride, b1, b2, M, N, x1, x2);
+    case 6:  return lssolve<6> (A, stride, b1, b2, M, N, x1, x2);
+    case 10: return lssolve<10>(A, stride, b1, b2, M, N, x1, x2);
+    case 15: return lssolve<15>(A, stride, b1, b2, M, N, x1, x2);
+    case 21: return lssolve<21>(A, stride, b1, b2, M, N, x1, x2);
+    }
+    return lssolve<Dynamic>(A, stride, b1, b2, M, N, x1, x2);
+}
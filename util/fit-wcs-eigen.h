@@ -0,0 +1,20 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef FIT_WCS_EIGEN_H
+#define FIT_WCS_EIGEN_H
+
+/**
+ Solves the least-squares problems  min || b1 - A x1 ||, || b2 - A x2 ||
+ for the M x N (M >= N) row-major matrix "A" with row stride "stride",
+ by Householder QR.  Does not modify its inputs.  Returns -1 if the
+ solution is not finite.
+
+ Only built with WITH_EIGEN (see makefile.eigen).
+ */
+int fit_wcs_eigen_lssolve(const double* A, int stride, const double* b1,
+                          const double* b2, int M, int N,
+                          double* x1, double* x2);
+
+#endif
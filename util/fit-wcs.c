@@ -4,6 +4,8 @@
  */
 #include <math.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "gsl/gsl_matrix.h"
 #include "gsl/gsl_linalg.h"
@@ -18,8 +20,114 @@
 #include "log.h"
 #include "errors.h"
 #include "gslutils.h"
+#ifdef HAVE_EIGEN
+#include "fit-wcs-eigen.h"
+#endif
 #include "sip-utils.h"
 
+struct fit_wcs_workspace_t {
+    int maxorder;
+    int maxstars;
+    int maxterms;
+    // least-squares matrix (maxstars x maxterms), targets, solutions.
+    gsl_matrix* A;
+    gsl_vector* b1;
+    gsl_vector* b2;
+    gsl_vector* x1;
+    gsl_vector* x2;
+    gsl_vector* tau;
+    gsl_vector* resid;
+    // projected-star and field coordinates for the TAN fit.
+    double* p;
+    double* f;
+};
+
+fit_wcs_workspace_t* fit_wcs_workspace_new(int maxorder, int maxstars) {
+    fit_wcs_workspace_t* ws;
+    if (maxorder < 1)
+        maxorder = 1;
+    if (maxstars < 1)
+        maxstars = 1;
+    ws = calloc(1, sizeof(fit_wcs_workspace_t));
+    ws->maxorder = maxorder;
+    ws->maxstars = maxstars;
+    ws->maxterms = (maxorder + 1) * (maxorder + 2) / 2;
+    ws->A     = gsl_matrix_alloc(maxstars, ws->maxterms);
+    ws->b1    = gsl_vector_alloc(maxstars);
+    ws->b2    = gsl_vector_alloc(maxstars);
+    ws->resid = gsl_vector_alloc(maxstars);
+    ws->x1    = gsl_vector_alloc(ws->maxterms);
+    ws->x2    = gsl_vector_alloc(ws->maxterms);
+    ws->tau   = gsl_vector_alloc(ws->maxterms);
+    ws->p = malloc(2 * maxstars * sizeof(double));
+    ws->f = malloc(2 * maxstars * sizeof(double));
+    return ws;
+}
+
+void fit_wcs_workspace_free(fit_wcs_workspace_t* ws) {
+    if (!ws)
+        return;
+    gsl_matrix_free(ws->A);
+    gsl_vector_free(ws->b1);
+    gsl_vector_free(ws->b2);
+    gsl_vector_free(ws->resid);
+    gsl_vector_free(ws->x1);
+    gsl_vector_free(ws->x2);
+    gsl_vector_free(ws->tau);
+    free(ws->p);
+    free(ws->f);
+    free(ws);
+}
+
+static int fit_wcs_workspace_check(const fit_wcs_workspace_t* ws,
+                                   int M, int order) {
+    if (M > ws->maxstars) {
+        ERROR("Fit workspace holds %i stars; %i requested", ws->maxstars, M);
+        return -1;
+    }
+    if (order > ws->maxorder) {
+        ERROR("Fit workspace holds order %i; %i requested", ws->maxorder, order);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ Solves the least-squares problems  min || b1 - A x1 ||, || b2 - A x2 ||
+ for the leading M rows and N columns of the workspace matrix, by QR
+ decomposition in place (or by fit_wcs_eigen_lssolve() in builds with
+ Eigen); the solutions are left in ws->x1, ws->x2.
+ */
+static int fit_wcs_workspace_solve(fit_wcs_workspace_t* ws, int M, int N) {
+    _gsl_matrix_view A = gsl_matrix_submatrix(ws->A, 0, 0, M, N);
+    _gsl_vector_view b1 = gsl_vector_subvector(ws->b1, 0, M);
+    _gsl_vector_view b2 = gsl_vector_subvector(ws->b2, 0, M);
+    _gsl_vector_view x1 = gsl_vector_subvector(ws->x1, 0, N);
+    _gsl_vector_view x2 = gsl_vector_subvector(ws->x2, 0, N);
+#ifndef HAVE_EIGEN
+    _gsl_vector_view tau = gsl_vector_subvector(ws->tau, 0, N);
+    _gsl_vector_view r = gsl_vector_subvector(ws->resid, 0, M);
+#endif
+
+    if (M < N) {
+        ERROR("Too few correspondences for the SIP order specified (%i < %i)\n", M, N);
+        return -1;
+    }
+#ifdef HAVE_EIGEN
+    return fit_wcs_eigen_lssolve(A.matrix.data, A.matrix.tda, b1.vector.data,
+                                 b2.vector.data, M, N, x1.vector.data,
+                                 x2.vector.data);
+#else
+    if (gsl_linalg_QR_decomp(&(A.matrix), &(tau.vector)) ||
+        gsl_linalg_QR_lssolve(&(A.matrix), &(tau.vector), &(b1.vector),
+                              &(x1.vector), &(r.vector)) ||
+        gsl_linalg_QR_lssolve(&(A.matrix), &(tau.vector), &(b2.vector),
+                              &(x2.vector), &(r.vector)))
+        return -1;
+    return 0;
+#endif
+}
+
 int fit_sip_wcs_2(const double* starxyz,
                   const double* fieldxy,
                   const double* weights,
@@ -73,26 +181,124 @@ int fit_sip_wcs_2(const double* starxyz,
                        sip_order, inv_order, doshift, sipout);
 }
 
-int fit_sip_wcs(const double* starxyz,
-                const double* fieldxy,
-                const double* weights,
-                int M,
-                const tan_t* tanin1,
-                int sip_order,
-                int inv_order,
-                int doshift,
-                sip_t* sipout) {
+/*
+ Fills in the CD matrix (if "doshift"), the forward SIP terms, and the
+ inverse SIP terms of "sipout" from the solution vectors x1, x2 of the
+ least-squares problem described in fit_sip_wcs(); applies the shift
+ (if "doshift").
+ */
+static void sip_from_solution(sip_t* sipout, const double* x1,
+                              const double* x2, int sip_order, int doshift) {
+    double cdinv[2][2];
+    double sx=0, sy=0, sU, sV, su, sv;
+    int j, p, q, order;
+    Unused int i;
+    Unused int N = (sip_order + 1) * (sip_order + 2) / 2;
+
+    // Row 0 of X are the shift (p=0, q=0) terms.
+    // Row 1 of X are the terms that multiply "u".
+    // Row 2 of X are the terms that multiply "v".
+
+    if (doshift) {
+        // Grab CD.
+        sipout->wcstan.cd[0][0] = x1[1];
+        sipout->wcstan.cd[0][1] = x1[2];
+        sipout->wcstan.cd[1][0] = x2[1];
+        sipout->wcstan.cd[1][1] = x2[2];
+
+        // Compute inv(CD)
+        i = invert_2by2_arr((const double*)(sipout->wcstan.cd),
+                            (double*)cdinv);
+        assert(i == 0);
+
+        // Grab the shift.
+        sx = x1[0];
+        sy = x2[0];
+
+    } else {
+        // Compute inv(CD)
+        i = invert_2by2_arr((const double*)(sipout->wcstan.cd),
+                            (double*)cdinv);
+        assert(i == 0);
+    }
+
+    // Extract the SIP coefficients.
+    //  (this includes the 0 and 1 order terms, which we later overwrite)
+    j = 0;
+    for (order=0; order<=sip_order; order++) {
+        for (q=0; q<=order; q++) {
+            p = order - q;
+            assert(j >= 0);
+            assert(j < N);
+            assert(p >= 0);
+            assert(q >= 0);
+            assert(p + q <= sip_order);
+
+            sipout->a[p][q] =
+                cdinv[0][0] * x1[j] +
+                cdinv[0][1] * x2[j];
+
+            sipout->b[p][q] =
+                cdinv[1][0] * x1[j] +
+                cdinv[1][1] * x2[j];
+            j++;
+        }
+    }
+    assert(j == N);
+
+    if (doshift) {
+        // We have already dealt with the shift and linear terms, so zero them out
+        // in the SIP coefficient matrix.
+        sipout->a[0][0] = 0.0;
+        sipout->a[0][1] = 0.0;
+        sipout->a[1][0] = 0.0;
+        sipout->b[0][0] = 0.0;
+        sipout->b[0][1] = 0.0;
+        sipout->b[1][0] = 0.0;
+    }
+
+    sip_compute_inverse_polynomials(sipout, 0, 0, 0, 0, 0, 0);
+
+    if (doshift) {
+        sU =
+            cdinv[0][0] * sx +
+            cdinv[0][1] * sy;
+        sV =
+            cdinv[1][0] * sx +
+            cdinv[1][1] * sy;
+        logverb("Applying shift of sx,sy = %g,%g deg (%g,%g pix) to CRVAL and CD.\n",
+                sx, sy, sU, sV);
+
+        sip_calc_inv_distortion(sipout, sU, sV, &su, &sv);
+
+        debug("sx = %g, sy = %g\n", sx, sy);
+        debug("sU = %g, sV = %g\n", sU, sV);
+        debug("su = %g, sv = %g\n", su, sv);
+
+        wcs_shift(&(sipout->wcstan), -su, -sv);
+    }
+
+}
+
+int fit_sip_wcs_ws(fit_wcs_workspace_t* ws,
+                   const double* starxyz,
+                   const double* fieldxy,
+                   const double* weights,
+                   int M,
+                   const tan_t* tanin1,
+                   int sip_order,
+                   int inv_order,
+                   int doshift,
+                   sip_t* sipout) {
     int sip_coeffs;
     double xyzcrval[3];
-    double cdinv[2][2];
-    double sx, sy, sU, sV, su, sv;
     int N;
     int i, j, p, q, order;
     double totalweight;
-    int rtn;
     gsl_matrix *mA;
-    gsl_vector *b1, *b2, *x1, *x2;
-    gsl_vector *r1=NULL, *r2=NULL;
+    gsl_vector *b1, *b2;
+    _gsl_matrix_view vA;
+    _gsl_vector_view vb1, vb2;
     tan_t tanin2;
     int ngood;
     const tan_t* tanin = &tanin2;
@@ -119,12 +325,14 @@ int fit_sip_wcs(const double* starxyz,
         return -1;
     }
 
-    mA = gsl_matrix_alloc(M, N);
-    b1 = gsl_vector_alloc(M);
-    b2 = gsl_vector_alloc(M);
-    assert(mA);
-    assert(b1);
-    assert(b2);
+    if (fit_wcs_workspace_check(ws, M, sip_order))
+        return -1;
+    vA  = gsl_matrix_submatrix(ws->A, 0, 0, M, N);
+    vb1 = gsl_vector_subvector(ws->b1, 0, M);
+    vb2 = gsl_vector_subvector(ws->b2, 0, M);
+    mA = &(vA.matrix);
+    b1 = &(vb1.vector);
+    b2 = &(vb2.vector);
 
     /*
      *  We use a clever trick to estimate CD, A, and B terms in two
@@ -293,9 +501,9 @@ int fit_sip_wcs(const double* starxyz,
         assert(j == N);
 
         // The shift - aka (0,0) - SIP coefficient must be 1.
-        assert(gsl_matrix_get(mA, i, 0) == 1.0 * weight);
-        assert(fabs(gsl_matrix_get(mA, i, 1) - u * weight) < 1e-12);
-        assert(fabs(gsl_matrix_get(mA, i, 2) - v * weight) < 1e-12);
+        assert(gsl_matrix_get(mA, ngood, 0) == 1.0 * weight);
+        assert(fabs(gsl_matrix_get(mA, ngood, 1) - u * weight) < 1e-12);
+        assert(fabs(gsl_matrix_get(mA, ngood, 2) - v * weight) < 1e-12);
 
         ngood++;
     }
@@ -308,141 +516,249 @@ int fit_sip_wcs(const double* starxyz,
     if (weights)
         logverb("Total weight: %g\n", totalweight);
 
-    if (ngood < M) {
-        _gsl_vector_view sub_b1 = gsl_vector_subvector(b1, 0, ngood);
-        _gsl_vector_view sub_b2 = gsl_vector_subvector(b2, 0, ngood);
-        _gsl_matrix_view sub_mA = gsl_matrix_submatrix(mA, 0, 0, ngood, N);
-
-        rtn = gslutils_solve_leastsquares_v(&(sub_mA.matrix), 2,
-                                            &(sub_b1.vector), &x1, NULL,
-                                            &(sub_b2.vector), &x2, NULL);
-
-    } else {
-        // Solve the equation.
-        rtn = gslutils_solve_leastsquares_v(mA, 2, b1, &x1, NULL, b2, &x2, NULL);
-    }
-    if (rtn) {
+    if (fit_wcs_workspace_solve(ws, ngood, N)) {
         ERROR("Failed to solve SIP matrix equation!");
         return -1;
     }
 
-    // Row 0 of X are the shift (p=0, q=0) terms.
-    // Row 1 of X are the terms that multiply "u".
-    // Row 2 of X are the terms that multiply "v".
-
-    if (doshift) {
-        // Grab CD.
-        sipout->wcstan.cd[0][0] = gsl_vector_get(x1, 1);
-        sipout->wcstan.cd[0][1] = gsl_vector_get(x1, 2);
-        sipout->wcstan.cd[1][0] = gsl_vector_get(x2, 1);
-        sipout->wcstan.cd[1][1] = gsl_vector_get(x2, 2);
+    sip_from_solution(sipout, ws->x1->data, ws->x2->data, sip_order, doshift);
 
-        // Compute inv(CD)
-        i = invert_2by2_arr((const double*)(sipout->wcstan.cd),
-                            (double*)cdinv);
-        assert(i == 0);
+    return 0;
+}
 
-        // Grab the shift.
-        sx = gsl_vector_get(x1, 0);
-        sy = gsl_vector_get(x2, 0);
 
-    } else {
-        // Compute inv(CD)
-        i = invert_2by2_arr((const double*)(sipout->wcstan.cd),
-                            (double*)cdinv);
-        assert(i == 0);
-    }
 
-    // Extract the SIP coefficients.
-    //  (this includes the 0 and 1 order terms, which we later overwrite)
-    j = 0;
-    for (order=0; order<=sip_order; order++) {
-        for (q=0; q<=order; q++) {
-            p = order - q;
-            assert(j >= 0);
-            assert(j < N);
-            assert(p >= 0);
-            assert(q >= 0);
-            assert(p + q <= sip_order);
 
-            sipout->a[p][q] =
-                cdinv[0][0] * gsl_vector_get(x1, j) +
-                cdinv[0][1] * gsl_vector_get(x2, j);
 
-            sipout->b[p][q] =
-                cdinv[1][0] * gsl_vector_get(x1, j) +
-                cdinv[1][1] * gsl_vector_get(x2, j);
-            j++;
-        }
-    }
-    assert(j == N);
+int fit_sip_wcs(const double* starxyz,
+                const double* fieldxy,
+                const double* weights,
+                int M,
+                const tan_t* tanin,
+                int sip_order,
+                int inv_order,
+                int doshift,
+                sip_t* sipout) {
+    fit_wcs_workspace_t* ws;
+    int rtn;
+    ws = fit_wcs_workspace_new(MAX(sip_order, 1), M);
+    rtn = fit_sip_wcs_ws(ws, starxyz, fieldxy, weights, M, tanin, sip_order,
+                         inv_order, doshift, sipout);
+    fit_wcs_workspace_free(ws);
+    return rtn;
+}
 
-    if (doshift) {
-        // We have already dealt with the shift and linear terms, so zero them out
-        // in the SIP coefficient matrix.
-        sipout->a[0][0] = 0.0;
-        sipout->a[0][1] = 0.0;
-        sipout->a[1][0] = 0.0;
-        sipout->b[0][0] = 0.0;
-        sipout->b[0][1] = 0.0;
-        sipout->b[1][0] = 0.0;
+fit_sip_normal_t* fit_sip_normal_new(int maxorder) {
+    fit_sip_normal_t* f;
+    int NT;
+    if (maxorder < 1)
+        maxorder = 1;
+    if (maxorder >= SIP_MAXORDER) {
+        ERROR("SIP order %i too large (max %i)", maxorder, SIP_MAXORDER-1);
+        return NULL;
     }
+    NT = (maxorder + 1) * (maxorder + 2) / 2;
+    f = calloc(1, sizeof(fit_sip_normal_t));
+    f->maxorder = maxorder;
+    f->NT = NT;
+    f->ata   = malloc(NT * NT * sizeof(double));
+    f->chol  = malloc(NT * NT * sizeof(double));
+    f->atb1  = malloc(NT * sizeof(double));
+    f->atb2  = malloc(NT * sizeof(double));
+    f->x1    = malloc(NT * sizeof(double));
+    f->x2    = malloc(NT * sizeof(double));
+    f->terms = malloc(NT * sizeof(double));
+    return f;
+}
 
-    sip_compute_inverse_polynomials(sipout, 0, 0, 0, 0, 0, 0);
-
-    if (doshift) {
-        sU =
-            cdinv[0][0] * sx +
-            cdinv[0][1] * sy;
-        sV =
-            cdinv[1][0] * sx +
-            cdinv[1][1] * sy;
-        logverb("Applying shift of sx,sy = %g,%g deg (%g,%g pix) to CRVAL and CD.\n",
-                sx, sy, sU, sV);
+void fit_sip_normal_free(fit_sip_normal_t* f) {
+    if (!f)
+        return;
+    free(f->ata);
+    free(f->chol);
+    free(f->atb1);
+    free(f->atb2);
+    free(f->x1);
+    free(f->x2);
+    free(f->terms);
+    free(f);
+}
 
-        sip_calc_inv_distortion(sipout, sU, sV, &su, &sv);
+void fit_sip_normal_reset(fit_sip_normal_t* f, const tan_t* tan) {
+    int NT = f->NT;
+    memcpy(&(f->tan), tan, sizeof(tan_t));
+    radecdeg2xyzarr(tan->crval[0], tan->crval[1], f->xyzcrval);
+    f->scale = 0.5 * MAX(tan->imagew, tan->imageh);
+    if (f->scale <= 0)
+        f->scale = 1.0;
+    memset(f->ata,  0, NT * NT * sizeof(double));
+    memset(f->atb1, 0, NT * sizeof(double));
+    memset(f->atb2, 0, NT * sizeof(double));
+    f->npairs = 0;
+    f->totalweight = 0.0;
+}
 
-        debug("sx = %g, sy = %g\n", sx, sy);
-        debug("sU = %g, sV = %g\n", sU, sV);
-        debug("su = %g, sv = %g\n", su, sv);
+static int fit_sip_normal_accumulate(fit_sip_normal_t* f, const double* starxyz,
+                                     const double* fieldxy, double weight,
+                                     double sign) {
+    double upow[SIP_MAXORDER], vpow[SIP_MAXORDER];
+    double x, y, u, v, w2;
+    double* t = f->terms;
+    int NT = f->NT;
+    int j, k, p, q, order;
 
-        wcs_shift(&(sipout->wcstan), -su, -sv);
+    if (!star_coords(starxyz, f->xyzcrval, TRUE, &x, &y))
+        return -1;
+    assert(weight >= 0.0);
+    if (weight == 0.0)
+        return 0;
+    w2 = sign * weight * weight;
+
+    u = (fieldxy[0] - f->tan.crpix[0]) / f->scale;
+    v = (fieldxy[1] - f->tan.crpix[1]) / f->scale;
+    upow[0] = vpow[0] = 1.0;
+    for (j=1; j<=f->maxorder; j++) {
+        upow[j] = upow[j-1] * u;
+        vpow[j] = vpow[j-1] * v;
     }
+    // same term order as fit_sip_wcs().
+    j = 0;
+    for (order=0; order<=f->maxorder; order++)
+        for (q=0; q<=order; q++) {
+            p = order - q;
+            t[j++] = upow[p] * vpow[q];
+        }
 
-    if (r1)
-        gsl_vector_free(r1);
-    if (r2)
-        gsl_vector_free(r2);
+    x = rad2deg(x);
+    y = rad2deg(y);
+    for (j=0; j<NT; j++) {
+        double wt = w2 * t[j];
+        double* row = f->ata + j*NT;
+        for (k=j; k<NT; k++)
+            row[k] += wt * t[k];
+        f->atb1[j] += wt * x;
+        f->atb2[j] += wt * y;
+    }
+    if (sign > 0) {
+        f->npairs++;
+        f->totalweight += weight;
+    } else {
+        f->npairs--;
+        f->totalweight -= weight;
+    }
+    return 0;
+}
 
-    gsl_matrix_free(mA);
-    gsl_vector_free(b1);
-    gsl_vector_free(b2);
-    gsl_vector_free(x1);
-    gsl_vector_free(x2);
+int fit_sip_normal_add(fit_sip_normal_t* f, const double* starxyz,
+                       const double* fieldxy, double weight) {
+    return fit_sip_normal_accumulate(f, starxyz, fieldxy, weight, 1.0);
+}
 
-    return 0;
+int fit_sip_normal_remove(fit_sip_normal_t* f, const double* starxyz,
+                          const double* fieldxy, double weight) {
+    return fit_sip_normal_accumulate(f, starxyz, fieldxy, weight, -1.0);
 }
 
+int fit_sip_normal_solve(fit_sip_normal_t* f, int sip_order, int inv_order,
+                         int doshift, sip_t* sipout) {
+    int N, NT = f->NT;
+    int i, j, k, order, q;
+    double* L = f->chol;
+    double* x1 = f->x1;
+    double* x2 = f->x2;
+    double s;
 
+    // We need at least the linear terms to compute CD.
+    if (sip_order < 1)
+        sip_order = 1;
+    if (sip_order > f->maxorder) {
+        ERROR("SIP order %i is larger than the workspace order %i",
+              sip_order, f->maxorder);
+        return -1;
+    }
+    N = (sip_order + 1) * (sip_order + 2) / 2;
+    if (f->npairs < N) {
+        ERROR("Too few correspondences for the SIP order specified (%i < %i)\n",
+              f->npairs, N);
+        return -1;
+    }
 
+    // Cholesky-factor the leading N x N block: A^T A = L L^T, with L
+    // stored in the lower triangle (row-major).
+    for (j=0; j<N; j++) {
+        double d = f->ata[j*NT + j];
+        for (k=0; k<j; k++)
+            d -= L[j*NT + k] * L[j*NT + k];
+        if (!(d > 1e-14 * f->ata[j*NT + j])) {
+            ERROR("SIP normal equations are singular (term %i)", j);
+            return -1;
+        }
+        d = sqrt(d);
+        L[j*NT + j] = d;
+        for (i=j+1; i<N; i++) {
+            s = f->ata[j*NT + i];
+            for (k=0; k<j; k++)
+                s -= L[i*NT + k] * L[j*NT + k];
+            L[i*NT + j] = s / d;
+        }
+    }
+    // Forward- and back-substitute for both right-hand sides.
+    for (i=0; i<N; i++) {
+        double s1 = f->atb1[i], s2 = f->atb2[i];
+        for (k=0; k<i; k++) {
+            s1 -= L[i*NT + k] * x1[k];
+            s2 -= L[i*NT + k] * x2[k];
+        }
+        x1[i] = s1 / L[i*NT + i];
+        x2[i] = s2 / L[i*NT + i];
+    }
+    for (i=N-1; i>=0; i--) {
+        double s1 = x1[i], s2 = x2[i];
+        for (k=i+1; k<N; k++) {
+            s1 -= L[k*NT + i] * x1[k];
+            s2 -= L[k*NT + i] * x2[k];
+        }
+        x1[i] = s1 / L[i*NT + i];
+        x2[i] = s2 / L[i*NT + i];
+    }
+    // Undo the conditioning scale: term (p,q) was fit in units of
+    // scale^(p+q) pixels.
+    j = 0;
+    s = 1.0;
+    for (order=0; order<=sip_order; order++) {
+        for (q=0; q<=order; q++) {
+            x1[j] /= s;
+            x2[j] /= s;
+            j++;
+        }
+        s *= f->scale;
+    }
 
+    memset(sipout, 0, sizeof(sip_t));
+    memcpy(&(sipout->wcstan), &(f->tan), sizeof(tan_t));
+    sipout->a_order  = sipout->b_order  = sip_order;
+    sipout->ap_order = sipout->bp_order = inv_order;
+    sip_from_solution(sipout, x1, x2, sip_order, doshift);
+    return 0;
+}
 
-int fit_sip_coefficients(const double* starxyz,
-                         const double* fieldxy,
-                         const double* weights,
-                         int M,
-                         const tan_t* tanin1,
-                         int sip_order,
-                         int inv_order,
-                         sip_t* sipout) {
+int fit_sip_coefficients_ws(fit_wcs_workspace_t* ws,
+                            const double* starxyz,
+                            const double* fieldxy,
+                            const double* weights,
+                            int M,
+                            const tan_t* tanin1,
+                            int sip_order,
+                            int inv_order,
+                            sip_t* sipout) {
     int sip_coeffs;
     int N;
     int i, j, p, q, order;
     double totalweight;
-    int rtn;
     gsl_matrix *mA;
-    gsl_vector *b1, *b2, *x1, *x2;
-    gsl_vector *r1=NULL, *r2=NULL;
+    gsl_vector *b1, *b2;
+    _gsl_matrix_view vA;
+    _gsl_vector_view vb1, vb2;
     tan_t tanin2;
     int ngood;
     const tan_t* tanin = &tanin2;
@@ -469,12 +785,14 @@ int fit_sip_coefficients(const double* starxyz,
         return -1;
     }
 
-    mA = gsl_matrix_alloc(M, N);
-    b1 = gsl_vector_alloc(M);
-    b2 = gsl_vector_alloc(M);
-    assert(mA);
-    assert(b1);
-    assert(b2);
+    if (fit_wcs_workspace_check(ws, M, sip_order))
+        return -1;
+    vA  = gsl_matrix_submatrix(ws->A, 0, 0, M, N);
+    vb1 = gsl_vector_subvector(ws->b1, 0, M);
+    vb2 = gsl_vector_subvector(ws->b2, 0, M);
+    mA = &(vA.matrix);
+    b1 = &(vb1.vector);
+    b2 = &(vb2.vector);
 
     /**
      * We're going to fit for the "forward" SIP coefficients
@@ -564,20 +882,7 @@ int fit_sip_coefficients(const double* starxyz,
     if (weights)
         logverb("Total weight: %g\n", totalweight);
 
-    if (ngood < M) {
-        _gsl_vector_view sub_b1 = gsl_vector_subvector(b1, 0, ngood);
-        _gsl_vector_view sub_b2 = gsl_vector_subvector(b2, 0, ngood);
-        _gsl_matrix_view sub_mA = gsl_matrix_submatrix(mA, 0, 0, ngood, N);
-
-        rtn = gslutils_solve_leastsquares_v(&(sub_mA.matrix), 2,
-                                            &(sub_b1.vector), &x1, NULL,
-                                            &(sub_b2.vector), &x2, NULL);
-
-    } else {
-        // Solve the equation.
-        rtn = gslutils_solve_leastsquares_v(mA, 2, b1, &x1, NULL, b2, &x2, NULL);
-    }
-    if (rtn) {
+    if (fit_wcs_workspace_solve(ws, ngood, N)) {
         ERROR("Failed to solve SIP matrix equation!");
         return -1;
     }
@@ -592,27 +897,33 @@ int fit_sip_coefficients(const double* starxyz,
             assert(p >= 0);
             assert(q >= 0);
             assert(p + q <= sip_order);
-            sipout->a[p][q] = gsl_vector_get(x1, j);
-            sipout->b[p][q] = gsl_vector_get(x2, j);
+            sipout->a[p][q] = gsl_vector_get(ws->x1, j);
+            sipout->b[p][q] = gsl_vector_get(ws->x2, j);
             j++;
         }
     }
     assert(j == N);
 
-    if (r1)
-        gsl_vector_free(r1);
-    if (r2)
-        gsl_vector_free(r2);
-
-    gsl_matrix_free(mA);
-    gsl_vector_free(b1);
-    gsl_vector_free(b2);
-    gsl_vector_free(x1);
-    gsl_vector_free(x2);
-
     return 0;
 }
 
+int fit_sip_coefficients(const double* starxyz,
+                         const double* fieldxy,
+                         const double* weights,
+                         int M,
+                         const tan_t* tanin,
+                         int sip_order,
+                         int inv_order,
+                         sip_t* sipout) {
+    fit_wcs_workspace_t* ws;
+    int rtn;
+    ws = fit_wcs_workspace_new(MAX(sip_order, 1), M);
+    rtn = fit_sip_coefficients_ws(ws, starxyz, fieldxy, weights, M, tanin,
+                                  sip_order, inv_order, sipout);
+    fit_wcs_workspace_free(ws);
+    return rtn;
+}
+
 
 // Given a pixel offset (shift in image plane), adjust the WCS
 // CRVAL to the position given by CRPIX + offset.
@@ -668,8 +979,68 @@ void wcs_shift(tan_t* wcs, double xs, double ys) {
 
 
 
+// fits of up to this many stars (eg, a quad) need no allocation.
+#define SMALL_FIT_N 16
+
+/*
+ The orthogonal matrix R = V U', where cov = U S V' is the SVD of the
+ 2x2 matrix "cov" (row-major): the rotation (if det(cov) > 0) or
+ reflection (if det(cov) < 0) that best aligns the two point sets.  In
+ two dimensions it is proportional to cov' plus or minus the transpose
+ of its cofactor matrix, so it needs no SVD.  Returns -1 if "cov" is so
+ close to singular that the choice is ill-conditioned.
+ */
+static int rotation_2x2(const double* cov, double* R) {
+    double a = cov[0], b = cov[1], c = cov[2], d = cov[3];
+    double det = a*d - b*c;
+    double norm2 = a*a + b*b + c*c + d*d;
+    double s;
+    if (!(fabs(det) > 1e-12 * norm2))
+        return -1;
+    if (det > 0) {
+        s = 1.0 / sqrt(square(a + d) + square(b - c));
+        R[0] = R[3] = (a + d) * s;
+        R[1] = (c - b) * s;
+        R[2] = (b - c) * s;
+    } else {
+        s = 1.0 / sqrt(square(a - d) + square(b + c));
+        R[0] = (a - d) * s;
+        R[1] = R[2] = (b + c) * s;
+        R[3] = (d - a) * s;
+    }
+    return 0;
+}
+
+// rotation_2x2(), by SVD; this also copes with singular "cov" (which it
+// overwrites).
+static void rotation_2x2_svd(double* cov, double* R) {
+    double Varr[4], Swork[4];
+    gsl_matrix_view vV, vSwork, vcov, vR;
+    gsl_vector_view vS, vwork;
+    gsl_matrix* A;
+    gsl_matrix* U;
+
+    vV    = gsl_matrix_view_array(Varr, 2, 2);
+    // (the bundled GSL lacks gsl_vector_view_array)
+    vSwork = gsl_matrix_view_array(Swork, 2, 2);
+    vS    = gsl_matrix_row(&(vSwork.matrix), 0);
+    vwork = gsl_matrix_row(&(vSwork.matrix), 1);
+    vcov = gsl_matrix_view_array(cov, 2, 2);
+    vR   = gsl_matrix_view_array(R, 2, 2);
+    A = &(vcov.matrix);
+    // The Jacobi version doesn't always compute an orthonormal U if S has zeros.
+    //gsl_linalg_SV_decomp_jacobi(A, V, S);
+    gsl_linalg_SV_decomp(A, &(vV.matrix), &(vS.vector), &(vwork.vector));
+    // the U result is written to A.
+    U = A;
+    // R = V U'
+    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &(vV.matrix), U, 0.0,
+                   &(vR.matrix));
+}
+
 static
-int fit_tan_wcs_solve(const double* starxyz,
+int fit_tan_wcs_solve(fit_wcs_workspace_t* ws,
+                      const double* starxyz,
                       const double* fieldxy,
                       const double* weights,
                       int N,
@@ -690,13 +1061,7 @@ int fit_tan_wcs_solve(const double* starxyz,
     double w = 0;
     double totalw;
 
-    gsl_matrix* A;
-    gsl_matrix* U;
-    gsl_matrix* V;
-    gsl_vector* S;
-    gsl_vector* work;
-    gsl_matrix_view vcov;
-    gsl_matrix_view vR;
+    double pbuf[2 * SMALL_FIT_N], fbuf[2 * SMALL_FIT_N];
 
     double crxyz[3];
 
@@ -711,9 +1076,20 @@ int fit_tan_wcs_solve(const double* starxyz,
         memset(tanout, 0, sizeof(tan_t));
     }
 
+    if (ws && fit_wcs_workspace_check(ws, N, 1))
+        return -1;
+
     // -allocate and fill "p" and "f" arrays. ("projected" and "field")
-    p = malloc(N * 2 * sizeof(double));
-    f = malloc(N * 2 * sizeof(double));
+    if (ws) {
+        p = ws->p;
+        f = ws->f;
+    } else if (N <= SMALL_FIT_N) {
+        p = pbuf;
+        f = fbuf;
+    } else {
+        p = malloc(N * 2 * sizeof(double));
+        f = malloc(N * 2 * sizeof(double));
+    }
 
     // -get field center-of-mass
     totalw = 0.0;
@@ -780,23 +1156,8 @@ int fit_tan_wcs_solve(const double* starxyz,
     for (i=0; i<4; i++)
         assert(isfinite(cov[i]));
 
-    // -run SVD
-    V = gsl_matrix_alloc(2, 2);
-    S = gsl_vector_alloc(2);
-    work = gsl_vector_alloc(2);
-    vcov = gsl_matrix_view_array(cov, 2, 2);
-    vR   = gsl_matrix_view_array(R, 2, 2);
-    A = &(vcov.matrix);
-    // The Jacobi version doesn't always compute an orthonormal U if S has zeros.
-    //gsl_linalg_SV_decomp_jacobi(A, V, S);
-    gsl_linalg_SV_decomp(A, V, S, work);
-    // the U result is written to A.
-    U = A;
-    gsl_vector_free(S);
-    gsl_vector_free(work);
-    // R = V U'
-    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, V, U, 0.0, &(vR.matrix));
-    gsl_matrix_free(V);
+    if (rotation_2x2(cov, R))
+        rotation_2x2_svd(cov, R);
 
     for (i=0; i<4; i++)
         assert(isfinite(R[i]));
@@ -859,8 +1220,10 @@ int fit_tan_wcs_solve(const double* starxyz,
     }
 
     if (p_scale) *p_scale = scale;
-    free(p);
-    free(f);
+    if (!ws && p != pbuf) {
+        free(p);
+        free(f);
+    }
     return 0;
 }
 
@@ -874,8 +1237,8 @@ int fit_tan_wcs_move_tangent_point_weighted(const double* starxyz,
                                             const double* crpix,
                                             const tan_t* tanin,
                                             tan_t* tanout) {
-    return fit_tan_wcs_solve(starxyz, fieldxy, weights, N, crpix, tanin, tanout,
-                             NULL);
+    return fit_tan_wcs_solve(NULL, starxyz, fieldxy, weights, N, crpix, tanin,
+                             tanout, NULL);
 }
 
 int fit_tan_wcs_move_tangent_point(const double* starxyz,
@@ -896,7 +1259,8 @@ int fit_tan_wcs_weighted(const double* starxyz,
                          // output:
                          tan_t* tan,
                          double* p_scale) {
-    return fit_tan_wcs_solve(starxyz, fieldxy, weights, N, NULL, NULL, tan, p_scale);
+    return fit_tan_wcs_solve(NULL, starxyz, fieldxy, weights, N, NULL, NULL, tan,
+                             p_scale);
 }
 
 int fit_tan_wcs(const double* starxyz,
@@ -909,3 +1273,79 @@ int fit_tan_wcs(const double* starxyz,
                                 tan, p_scale);
 }
 
+int fit_tan_wcs_move_tangent_point_weighted_ws(fit_wcs_workspace_t* ws,
+                                               const double* starxyz,
+                                               const double* fieldxy,
+                                               const double* weights,
+                                               int N,
+                                               const double* crpix,
+                                               const tan_t* tanin,
+                                               tan_t* tanout) {
+    return fit_tan_wcs_solve(ws, starxyz, fieldxy, weights, N, crpix, tanin,
+                             tanout, NULL);
+}
+
+int fit_tan_wcs_weighted_ws(fit_wcs_workspace_t* ws,
+                            const double* starxyz,
+                            const double* fieldxy,
+                            const double* weights,
+                            int N,
+                            tan_t* tan,
+                            double* p_scale) {
+    return fit_tan_wcs_solve(ws, starxyz, fieldxy, weights, N, NULL, NULL, tan,
+                             p_scale);
+}
+
+// (per side) the grid of pixels fit_wcs_transformed() fits to.
+#define TRANSFORM_GRID 10
+
+int fit_wcs_transformed(const sip_t* in, const double A[2][2],
+                        const double* t, double W, double H, sip_t* out) {
+    double xy[2 * TRANSFORM_GRID * TRANSFORM_GRID];
+    double xyz[3 * TRANSFORM_GRID * TRANSFORM_GRID];
+    double det = A[0][0] * A[1][1] - A[0][1] * A[1][0];
+    double c[2], crpix[2];
+    tan_t tan, t1;
+    int i, j, n = 0;
+
+    if (det == 0.0)
+        return -1;
+    // the TAN part maps over exactly...
+    tan = in->wcstan;
+    for (i=0; i<2; i++) {
+        tan.cd[i][0] = in->wcstan.cd[i][0] * A[0][0] + in->wcstan.cd[i][1] * A[1][0];
+        tan.cd[i][1] = in->wcstan.cd[i][0] * A[0][1] + in->wcstan.cd[i][1] * A[1][1];
+    }
+    c[0] = in->wcstan.crpix[0] - t[0];
+    c[1] = in->wcstan.crpix[1] - t[1];
+    tan.crpix[0] = ( A[1][1] * c[0] - A[0][1] * c[1]) / det;
+    tan.crpix[1] = (-A[1][0] * c[0] + A[0][0] * c[1]) / det;
+    tan.imagew = W;
+    tan.imageh = H;
+
+    // ... and is then moved to the centre, along with the SIP terms.
+    for (i=0; i<TRANSFORM_GRID; i++)
+        for (j=0; j<TRANSFORM_GRID; j++) {
+            double px = 0.5 + W * j / (TRANSFORM_GRID - 1);
+            double py = 0.5 + H * i / (TRANSFORM_GRID - 1);
+            xy[2*n+0] = px;
+            xy[2*n+1] = py;
+            sip_pixelxy2xyzarr(in, A[0][0] * px + A[0][1] * py + t[0],
+                               A[1][0] * px + A[1][1] * py + t[1], xyz + 3*n);
+            n++;
+        }
+    crpix[0] = wcs_pixel_center_for_size(W);
+    crpix[1] = wcs_pixel_center_for_size(H);
+    if (fit_tan_wcs_move_tangent_point(xyz, xy, n, crpix, &tan, &t1) ||
+        fit_tan_wcs_move_tangent_point(xyz, xy, n, crpix, &t1, &tan))
+        return -1;
+    tan.imagew = W;
+    tan.imageh = H;
+    memset(out, 0, sizeof(sip_t));
+    if (in->a_order == 0) {
+        out->wcstan = tan;
+        return 0;
+    }
+    return fit_sip_wcs(xyz, xy, NULL, n, &tan, in->a_order, in->ap_order, 1,
+                       out);
+}
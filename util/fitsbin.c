@@ -9,7 +9,12 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
 
+#include "os-features.h"
 #include "keywords.h"
 #include "fitsbin.h"
 #include "fitsioutils.h"
@@ -24,7 +29,10 @@
 struct fitsext {
     qfits_header* header;
     char* tablename;
-    bl* items;
+    // the rows, contiguous; handed over to the chunk that reads them.
+    char* items;
+    size_t nitems;
+    int itemsize;
 };
 typedef struct fitsext fitsext_t;
 
@@ -87,6 +95,114 @@ static fitsbin_t* new_fitsbin(const char* fn) {
     return fb;
 }
 
+static int mmap_policy = 0;
+static size_t mmap_populate_max = 0;
+
+void fitsbin_set_mmap_policy(int flags, size_t populate_max) {
+    mmap_policy = flags;
+    mmap_populate_max = populate_max;
+}
+
+int fitsbin_get_mmap_policy(size_t* populate_max) {
+    if (populate_max)
+        *populate_max = mmap_populate_max;
+    return mmap_policy;
+}
+
+int fitsbin_parse_mmap_flags(const char* str) {
+    int flags = 0;
+    while (*str) {
+        size_t n;
+        str += strspn(str, " \t,");
+        n = strcspn(str, " \t,");
+        if (!n)
+            break;
+        if (n == 8 && !strncasecmp(str, "willneed", n))
+            flags |= FITSBIN_MMAP_WILLNEED;
+        else if (n == 6 && !strncasecmp(str, "random", n))
+            flags |= FITSBIN_MMAP_RANDOM;
+        else if (n == 8 && !strncasecmp(str, "hugepage", n))
+            flags |= FITSBIN_MMAP_HUGEPAGE;
+        else if (n == 8 && !strncasecmp(str, "populate", n))
+            flags |= FITSBIN_MMAP_POPULATE;
+        else if (n == 8 && !strncasecmp(str, "prefetch", n))
+            flags |= FITSBIN_MMAP_PREFETCH;
+        else if (n == 4 && !strncasecmp(str, "read", n))
+            flags |= FITSBIN_MMAP_READ;
+        else if (n == 4 && !strncasecmp(str, "lazy", n))
+            flags |= FITSBIN_MMAP_LAZY;
+        else {
+            ERROR("Unknown mmap flag \"%.*s\"", (int)n, str);
+            return -1;
+        }
+        str += n;
+    }
+    return flags;
+}
+
+struct prefetch_args {
+    int fd;
+    off_t start;
+    size_t size;
+};
+
+// Reads a byte range of a (dup'd) file descriptor, to pull it into the
+// page cache, then closes it.  It doesn't touch the mapping itself, so
+// the chunk can be unmapped (and the file closed) while this runs.
+static void* prefetch_thread(void* varg) {
+    struct prefetch_args* args = varg;
+    read_parallel(args->fd, NULL, args->size, args->start,
+                  get_parallel_read_threads());
+    close(args->fd);
+    free(args);
+    return NULL;
+}
+
+static void start_prefetch(int fd, off_t start, size_t size) {
+    struct prefetch_args* args;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    args = malloc(sizeof(struct prefetch_args));
+    if (!args)
+        return;
+    args->fd = dup(fd);
+    if (args->fd == -1) {
+        free(args);
+        return;
+    }
+    args->start = start;
+    args->size = size;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetch_thread, args)) {
+        close(args->fd);
+        free(args);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Applies the mmap policy to a freshly-mapped chunk.
+static void advise_chunk(fitsbin_chunk_t* chunk, int fd, off_t mapstart) {
+#ifdef MADV_WILLNEED
+    if (mmap_policy & FITSBIN_MMAP_WILLNEED)
+        madvise(chunk->map, chunk->mapsize, MADV_WILLNEED);
+#endif
+#ifdef MADV_RANDOM
+    if (mmap_policy & FITSBIN_MMAP_RANDOM)
+        madvise(chunk->map, chunk->mapsize, MADV_RANDOM);
+#endif
+#ifdef MADV_HUGEPAGE
+    // (only anonymous and some filesystems' mappings can use huge pages;
+    // the kernel ignores this otherwise.)
+    if (mmap_policy & FITSBIN_MMAP_HUGEPAGE)
+        madvise(chunk->map, chunk->mapsize, MADV_HUGEPAGE);
+#endif
+    if ((mmap_policy & FITSBIN_MMAP_PREFETCH) &&
+        !(mmap_policy & FITSBIN_MMAP_READ))
+        start_prefetch(fd, mapstart, chunk->mapsize);
+}
+
 static anbool in_memory(fitsbin_t* fb) {
     return fb->inmemory;
 }
@@ -168,12 +284,12 @@ int fitsbin_close(fitsbin_t* fb) {
     if (in_memory(fb)) {
         for (i=0; i<bl_size(fb->extensions); i++) {
             fitsext_t* ext = bl_access(fb->extensions, i);
-            bl_free(ext->items);
+            free(ext->items);
             qfits_header_destroy(ext->header);
             free(ext->tablename);
         }
         bl_free(fb->extensions);
-        bl_free(fb->items);
+        free(fb->items);
     }
 
     if (fb->tables) {
@@ -335,10 +451,17 @@ int fitsbin_fix_chunk_header(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
         if (!fb->extensions)
             fb->extensions = bl_new(4, sizeof(fitsext_t));
         ext.header = qfits_header_copy(chunk->header);
-        ext.items = fb->items;
+        // (trim the slack left by growing)
+        ext.items = fb->nitems ?
+            realloc(fb->items, fb->nitems * (size_t)chunk->itemsize) : fb->items;
+        if (!ext.items)
+            ext.items = fb->items;
+        ext.nitems = fb->nitems;
+        ext.itemsize = chunk->itemsize;
         ext.tablename = strdup(chunk->tablename);
         bl_append(fb->extensions, &ext);
         fb->items = NULL;
+        fb->nitems = fb->itemscap = 0;
         return 0;
     }
 
@@ -367,14 +490,22 @@ int fitsbin_write_items_to(fitsbin_chunk_t* chunk, void* data, int N, FILE* fid)
 
 int fitsbin_write_items(fitsbin_t* fb, fitsbin_chunk_t* chunk, void* data, int N) {
     if (in_memory(fb)) {
-        int i;
-        char* src = data;
-        if (!fb->items)
-            fb->items = bl_new(1024, chunk->itemsize);
-        for (i=0; i<N; i++) {
-            bl_append(fb->items, src);
-            src += chunk->itemsize;
+        size_t sz = chunk->itemsize;
+        if (fb->nitems + N > fb->itemscap) {
+            size_t cap = MAX(1024, 2 * fb->itemscap);
+            char* items;
+            while (cap < fb->nitems + N)
+                cap *= 2;
+            items = realloc(fb->items, cap * sz);
+            if (!items) {
+                SYSERROR("Failed to grow in-memory table to %zu items", cap);
+                return -1;
+            }
+            fb->items = items;
+            fb->itemscap = cap;
         }
+        memcpy(fb->items + fb->nitems * sz, data, N * sz);
+        fb->nitems += N;
     } else {
         if (fitsbin_write_items_to(chunk, data, N, fb->fid))
             return -1;
@@ -420,6 +551,8 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
     int table_nrows;
     int table_rowsize;
     fitsext_t* inmemext = NULL;
+    anbool reopened = FALSE;
+    int rtn = -1;
 
     if (in_memory(fb)) {
         int i;
@@ -432,12 +565,17 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
             gotit = TRUE;
             break;
         }
-        if (!gotit && chunk->required) {
-            ERROR("Couldn't find table \"%s\"", chunk->tablename);
+        if (!gotit) {
+            if (chunk->required)
+                ERROR("Couldn't find table \"%s\"", chunk->tablename);
+            return -1;
+        }
+        if (inmemext->nitems && !inmemext->items) {
+            ERROR("Table \"%s\" has already been read", chunk->tablename);
             return -1;
         }
-        table_nrows = bl_size(inmemext->items);
-        table_rowsize = bl_datasize(inmemext->items);
+        table_nrows = inmemext->nitems;
+        table_rowsize = inmemext->itemsize;
         chunk->header = qfits_header_copy(inmemext->header);
 
     } else {
@@ -487,13 +625,10 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
 
     expected = (size_t)chunk->itemsize * (size_t)chunk->nrows;
     if (in_memory(fb)) {
-        int i;
-        chunk->data = malloc(expected);
-        for (i=0; i<chunk->nrows; i++) {
-            memcpy(((char*)chunk->data) + (size_t)i * (size_t)chunk->itemsize,
-                   bl_access(inmemext->items, i), chunk->itemsize);
-        }
-        // delete inmemext->items ?
+        // The rows are already contiguous: hand them over, rather than
+        // keeping two copies.
+        chunk->data = inmemext->items;
+        inmemext->items = NULL;
 
     } else {
 
@@ -505,18 +640,60 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
                   (int)(tabsize / (off_t)FITS_BLOCK_SIZE));
             return -1;
         }
+        // (the file may have been closed with fitsbin_close_fd() since it
+        // was opened; then reopen it just for this chunk.)
+        if (!fb->fid) {
+            fb->fid = fopen(fb->filename, "rb");
+            if (!fb->fid) {
+                SYSERROR("Failed to reopen file \"%s\"", fb->filename);
+                return -1;
+            }
+            reopened = TRUE;
+        }
         get_mmap_size(tabstart, tabsize, &mapstart, &(chunk->mapsize), &mapoffset);
         mode = PROT_READ;
         flags = MAP_SHARED;
-        chunk->map = mmap(0, chunk->mapsize, mode, flags, fileno(fb->fid), mapstart);
+#ifdef MAP_POPULATE
+        if ((mmap_policy & FITSBIN_MMAP_POPULATE) &&
+            (!mmap_populate_max || chunk->mapsize <= mmap_populate_max))
+            flags |= MAP_POPULATE;
+#endif
+        if (mmap_policy & FITSBIN_MMAP_READ) {
+            // read it into anonymous memory, so that free_chunk() can
+            // still munmap() it.
+            chunk->map = mmap(0, chunk->mapsize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk->map == MAP_FAILED) {
+                SYSERROR("Couldn't allocate %zu bytes for table \"%s\"",
+                         chunk->mapsize, chunk->tablename);
+                chunk->map = NULL;
+                goto bailout;
+            }
+            if (read_parallel(fileno(fb->fid), chunk->map, chunk->mapsize,
+                              mapstart, get_parallel_read_threads())) {
+                ERROR("Failed to read table \"%s\" from file \"%s\"",
+                      chunk->tablename, fb->filename);
+                munmap(chunk->map, chunk->mapsize);
+                chunk->map = NULL;
+                goto bailout;
+            }
+            mprotect(chunk->map, chunk->mapsize, PROT_READ);
+        } else
+            chunk->map = mmap(0, chunk->mapsize, mode, flags, fileno(fb->fid), mapstart);
         if (chunk->map == MAP_FAILED) {
             SYSERROR("Couldn't mmap file \"%s\"", fb->filename);
             chunk->map = NULL;
-            return -1;
+            goto bailout;
         }
+        if (mmap_policy)
+            advise_chunk(chunk, fileno(fb->fid), mapstart);
         chunk->data = chunk->map + mapoffset;
     }
-    return 0;
+    rtn = 0;
+ bailout:
+    if (reopened)
+        fitsbin_close_fd(fb);
+    return rtn;
 }
 
 int fitsbin_read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
@@ -526,6 +703,20 @@ int fitsbin_read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
     return 0;
 }
 
+anbool fitsbin_has_chunk(fitsbin_t* fb, const char* tablename) {
+    off_t start, size;
+    int i;
+    if (in_memory(fb)) {
+        for (i=0; i<bl_size(fb->extensions); i++) {
+            fitsext_t* ext = bl_access(fb->extensions, i);
+            if (!strcasecmp(ext->tablename, tablename))
+                return TRUE;
+        }
+        return FALSE;
+    }
+    return (find_table_column(fb, tablename, &start, &size, NULL) == 0);
+}
+
 int fitsbin_read(fitsbin_t* fb) {
     int i;
 
@@ -840,6 +840,225 @@ int fits_pad_file_with(FILE* fid, char pad) {
     return 0;
 }
 
+uint32_t fits_datasum(uint32_t sum, const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t s = sum;
+    size_t i;
+    for (i=0; i+4<=len; i+=4)
+        s += ((uint32_t)p[i] << 24) | ((uint32_t)p[i+1] << 16) |
+            ((uint32_t)p[i+2] << 8) | (uint32_t)p[i+3];
+    // fold the carries back in (ones'-complement addition).
+    while (s >> 32)
+        s = (s & 0xffffffff) + (s >> 32);
+    return (uint32_t)s;
+}
+
+// Copies "len" bytes from "fin" to "fout" (if not NULL), adding them to
+// the DATASUM "*sum".
+static int copy_and_sum(FILE* fin, FILE* fout, off_t len, uint32_t* sum) {
+    size_t blocksize = 1024 * 1024;
+    char* buf = malloc(blocksize);
+    if (!buf) {
+        SYSERROR("Failed to allocate copy buffer");
+        return -1;
+    }
+    while (len > 0) {
+        size_t n = MIN((off_t)blocksize, len);
+        if (fread(buf, 1, n, fin) != n) {
+            SYSERROR("Failed to read FITS data");
+            free(buf);
+            return -1;
+        }
+        if (fout && fwrite(buf, 1, n, fout) != n) {
+            SYSERROR("Failed to write FITS data");
+            free(buf);
+            return -1;
+        }
+        *sum = fits_datasum(*sum, buf, n);
+        len -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+static int write_card(FILE* fout, const char* key, const char* val,
+                      const char* com) {
+    char card[FITS_LINESZ + 1];
+    if (!key)
+        memset(card, ' ', FITS_LINESZ);
+    else {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%-8.8s= %-20s / %s", key, val, com);
+        sprintf(card, "%-80.80s", buf);
+    }
+    if (fwrite(card, 1, FITS_LINESZ, fout) != FITS_LINESZ) {
+        SYSERROR("Failed to write FITS header");
+        return -1;
+    }
+    return 0;
+}
+
+int fits_copy_aligned(const char* infn, const char* outfn, int align) {
+    anqfits_t* anq = NULL;
+    FILE* fin = NULL;
+    FILE* fout = NULL;
+    char* hdr = NULL;
+    int rtn = -1;
+    int ext, N;
+
+    if (align <= 0 || (align & (align - 1))) {
+        ERROR("Alignment must be a power of two, not %i", align);
+        return -1;
+    }
+    anq = anqfits_open(infn);
+    if (!anq) {
+        ERROR("Failed to open FITS file \"%s\"", infn);
+        return -1;
+    }
+    fin = fopen(infn, "rb");
+    if (!fin) {
+        SYSERROR("Failed to open \"%s\"", infn);
+        goto bailout;
+    }
+    fout = fopen(outfn, "wb");
+    if (!fout) {
+        SYSERROR("Failed to open \"%s\" for writing", outfn);
+        goto bailout;
+    }
+    N = anqfits_n_ext(anq);
+    for (ext=0; ext<N; ext++) {
+        off_t hsize = anqfits_header_size(anq, ext);
+        off_t dsize = anqfits_data_size(anq, ext);
+        off_t pos = ftello(fout);
+        off_t sumpos = -1;
+        int ncards = hsize / FITS_LINESZ;
+        int nout, nblocks, i;
+        uint32_t sum = 0;
+        char val[32];
+
+        free(hdr);
+        hdr = malloc(hsize);
+        if (!hdr || fseeko(fin, anqfits_header_start(anq, ext), SEEK_SET) ||
+            fread(hdr, 1, hsize, fin) != (size_t)hsize) {
+            SYSERROR("Failed to read header %i of \"%s\"", ext, infn);
+            goto bailout;
+        }
+        // copy the cards up to END, dropping checksums that won't hold.
+        nout = 0;
+        for (i=0; i<ncards; i++) {
+            const char* card = hdr + i * FITS_LINESZ;
+            if (!strncmp(card, "END     ", 8))
+                break;
+            if (!strncmp(card, "DATASUM ", 8) || !strncmp(card, "CHECKSUM", 8))
+                continue;
+            if (fwrite(card, 1, FITS_LINESZ, fout) != FITS_LINESZ) {
+                SYSERROR("Failed to write FITS header");
+                goto bailout;
+            }
+            nout++;
+        }
+        if (dsize) {
+            // (filled in once the data have been copied)
+            sumpos = ftello(fout);
+            if (write_card(fout, "DATASUM", "'0'", "data unit checksum"))
+                goto bailout;
+            nout++;
+        }
+        // pad with blank cards so that the data start is aligned.
+        nblocks = (nout + 1 + FITS_NCARDS - 1) / FITS_NCARDS;
+        while (dsize && (pos + (off_t)nblocks * FITS_BLOCK_SIZE) % align)
+            nblocks++;
+        for (; nout < nblocks * FITS_NCARDS - 1; nout++)
+            if (write_card(fout, NULL, NULL, NULL))
+                goto bailout;
+        if (fprintf(fout, "%-80s", "END") != FITS_LINESZ) {
+            SYSERROR("Failed to write FITS header");
+            goto bailout;
+        }
+
+        if (fseeko(fin, anqfits_data_start(anq, ext), SEEK_SET) ||
+            copy_and_sum(fin, fout, dsize, &sum))
+            goto bailout;
+        if (sumpos >= 0) {
+            off_t end = ftello(fout);
+            sprintf(val, "'%u'", sum);
+            if (fseeko(fout, sumpos, SEEK_SET) ||
+                write_card(fout, "DATASUM", val, "data unit checksum") ||
+                fseeko(fout, end, SEEK_SET)) {
+                SYSERROR("Failed to write DATASUM to \"%s\"", outfn);
+                goto bailout;
+            }
+        }
+    }
+    if (fclose(fout)) {
+        fout = NULL;
+        SYSERROR("Failed to close \"%s\"", outfn);
+        goto bailout;
+    }
+    fout = NULL;
+    rtn = 0;
+ bailout:
+    free(hdr);
+    if (fin)
+        fclose(fin);
+    if (fout)
+        fclose(fout);
+    anqfits_close(anq);
+    return rtn;
+}
+
+int fits_check_datasums(const char* fn, int* nchecked) {
+    anqfits_t* anq;
+    FILE* fin;
+    int ext, N;
+    int nbad = 0;
+
+    if (nchecked)
+        *nchecked = 0;
+    anq = anqfits_open(fn);
+    if (!anq) {
+        ERROR("Failed to open FITS file \"%s\"", fn);
+        return -1;
+    }
+    fin = fopen(fn, "rb");
+    if (!fin) {
+        SYSERROR("Failed to open \"%s\"", fn);
+        anqfits_close(anq);
+        return -1;
+    }
+    N = anqfits_n_ext(anq);
+    for (ext=0; ext<N; ext++) {
+        const qfits_header* hdr = anqfits_get_header_const(anq, ext);
+        char* str;
+        uint32_t sum = 0;
+        unsigned long expect;
+        if (!hdr) {
+            nbad = -1;
+            break;
+        }
+        str = fits_get_dupstring(hdr, "DATASUM");
+        if (!str)
+            continue;
+        expect = strtoul(str, NULL, 10);
+        free(str);
+        if (fseeko(fin, anqfits_data_start(anq, ext), SEEK_SET) ||
+            copy_and_sum(fin, NULL, anqfits_data_size(anq, ext), &sum)) {
+            nbad = -1;
+            break;
+        }
+        if (nchecked)
+            (*nchecked)++;
+        if (sum != expect) {
+            logmsg("%s: extension %i: DATASUM is %lu, data sum to %u\n",
+                   fn, ext, expect, sum);
+            nbad++;
+        }
+    }
+    fclose(fin);
+    anqfits_close(anq);
+    return nbad;
+}
+
 int fits_pad_file(FILE* fid) {
     return fits_pad_file_with(fid, 0);
 }
@@ -4,9 +4,11 @@
  */
 
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
 #include <stdarg.h>
 #include <errors.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "fitstable.h"
@@ -14,7 +16,10 @@
 #include "fitsfile.h"
 #include "ioutils.h"
 #include "an-endian.h"
+#include "permutedsort.h"
 #include "anqfits.h"
+#include "qfits_memory.h"
+#include "qfits_byteswap.h"
 
 #include "log.h"
 
@@ -46,8 +51,10 @@ typedef struct fitscol_t fitscol_t;
 struct fitsext {
     qfits_header* header;
     qfits_table* table;
-    // bl data size == row size.
-    bl* rows;
+    char* memrows;
+    size_t nmemrows;
+    size_t memrowscap;
+    int memrowsize;
 };
 typedef struct fitsext fitsext_t;
 
@@ -107,12 +114,77 @@ static anbool is_writing(const fitstable_t* t) {
     //return t->writing;
 }
 
+// Rows written to a file are packed into a buffer of this size and
+// written out in large blocks.
+#define WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Writes out any buffered rows; this must be called before anything
+// else touches "fid".
+static int flush_write_buffer(fitstable_t* t) {
+    size_t n = t->wbufused;
+    if (!n)
+        return 0;
+    t->wbufused = 0;
+    if (fwrite(t->wbuf, 1, n, t->fid) != n) {
+        SYSERROR("Failed to write %zu bytes of rows to %s", n, t->fn);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns space for an "R"-byte row at the end of the write buffer,
+// flushing it first if it's full.  The row is added by commit_row().
+// Returns NULL for rows too big to buffer (or on error).
+static char* write_buffer_row(fitstable_t* t, size_t R) {
+    if (R > WRITE_BUFFER_SIZE)
+        return NULL;
+    if (!t->wbuf) {
+        t->wbuf = malloc(WRITE_BUFFER_SIZE);
+        if (!t->wbuf)
+            return NULL;
+    }
+    if (t->wbufused + R > WRITE_BUFFER_SIZE &&
+        flush_write_buffer(t))
+        return NULL;
+    return t->wbuf + t->wbufused;
+}
+
+static void commit_row(fitstable_t* t, size_t R) {
+    t->wbufused += R;
+}
+
 static void ensure_row_list_exists(fitstable_t* table) {
-    if (!table->rows) {
+    if (!table->memrows && !table->nmemrows) {
         // how big are the rows?
-        int rowsize = offset_of_column(table, bl_size(table->cols));
-        table->rows = bl_new(1024, rowsize);
+        table->memrowsize = offset_of_column(table, bl_size(table->cols));
+    }
+}
+
+static char* mem_row(const fitstable_t* table, size_t i) {
+    return table->memrows + i * (size_t)table->memrowsize;
+}
+
+// Appends "N" zeroed rows to an in-memory table; returns the first.
+static char* append_mem_rows(fitstable_t* table, size_t N) {
+    char* row;
+    ensure_row_list_exists(table);
+    if (table->nmemrows + N > table->memrowscap) {
+        size_t cap = MAX(1024, 2 * table->memrowscap);
+        char* rows;
+        while (cap < table->nmemrows + N)
+            cap *= 2;
+        rows = realloc(table->memrows, cap * (size_t)table->memrowsize);
+        if (!rows) {
+            SYSERROR("Failed to grow in-memory table to %zu rows", cap);
+            return NULL;
+        }
+        table->memrows = rows;
+        table->memrowscap = cap;
     }
+    row = mem_row(table, table->nmemrows);
+    memset(row, 0, N * (size_t)table->memrowsize);
+    table->nmemrows += N;
+    return row;
 }
 
 static anbool in_memory(const fitstable_t* t) {
@@ -188,6 +260,21 @@ int fitstable_ncols(const fitstable_t* t) {
     return ncols(t);
 }
 
+static int open_for_row_reads(fitstable_t* table) {
+    off_t start;
+    if (table->readfid)
+        return 0;
+    table->readfid = fopen(table->fn, "rb");
+    if (!table->readfid) {
+        SYSERROR("Failed to open FITS table %s for reading", table->fn);
+        return -1;
+    }
+    assert(table->anq);
+    start = anqfits_data_start(table->anq, table->extension);
+    table->end_table_offset = start;
+    return 0;
+}
+
 int fitstable_read_row_data(fitstable_t* table, int row, void* dest) {
     return fitstable_read_nrows_data(table, row, 1, dest);
 }
@@ -203,30 +290,29 @@ int fitstable_read_nrows_data(fitstable_t* table, int row0, int nrows,
     assert(dest);
     R = fitstable_row_size(table);
     if (in_memory(table)) {
-        int i;
-        char* cdest = dest;
-        for (i=0; i<nrows; i++)
-            memcpy(cdest, bl_access(table->rows, row0 + i), R);
+        memcpy(dest, mem_row(table, row0), (size_t)R * (size_t)nrows);
         return 0;
     }
-    if (!table->readfid) {
-        table->readfid = fopen(table->fn, "rb");
-        if (!table->readfid) {
-            SYSERROR("Failed to open FITS table %s for reading", table->fn);
+    if (is_writing(table) && (flush_write_buffer(table) || fflush(table->fid))) {
+        SYSERROR("Failed to flush rows written to %s", table->fn);
+        return -1;
+    }
+    if (open_for_row_reads(table))
+        return -1;
+    off = get_row_offset(table, row0);
+    nread = (size_t)R * (size_t)nrows;
+    if (get_parallel_read_threads() && nread > 4*1024*1024) {
+        // (this doesn't use readfid's buffer, and every read seeks first)
+        if (read_at(fileno(table->readfid), dest, nread, off)) {
+            ERROR("Failed to read %i rows starting from %i, from %s", nrows, row0, table->fn);
             return -1;
         }
-
-        assert(table->anq);
-        off_t start;
-        start = anqfits_data_start(table->anq, table->extension);
-        table->end_table_offset = start;
+        return 0;
     }
-    off = get_row_offset(table, row0);
     if (fseeko(table->readfid, off, SEEK_SET)) {
         SYSERROR("Failed to fseeko() to read a row");
         return -1;
     }
-    nread = (size_t)R * (size_t)nrows;
     if (fread(dest, 1, nread, table->readfid) != nread) {
         SYSERROR("Failed to read %i rows starting from %i, from %s", nrows, row0, table->fn);
         return -1;
@@ -262,18 +348,26 @@ void fitstable_endian_flip_row_data(fitstable_t* table, void* data) {
 }
 
 static int write_row_data(fitstable_t* table, void* data, int R) {
+    char* row;
     assert(table);
     assert(data);
     if (in_memory(table)) {
-        ensure_row_list_exists(table);
-        bl_append(table->rows, data);
+        row = append_mem_rows(table, 1);
+        if (!row)
+            return -1;
+        memcpy(row, data, table->memrowsize);
         // ?
         table->table->nr++;
         return 0;
     }
     if (R == 0)
         R = fitstable_row_size(table);
-    if (fwrite(data, 1, R, table->fid) != R) {
+    row = write_buffer_row(table, R);
+    if (row) {
+        memcpy(row, data, R);
+        commit_row(table, R);
+    } else if (flush_write_buffer(table) ||
+               fwrite(data, 1, R, table->fid) != R) {
         SYSERROR("Failed to write a row to %s", table->fn);
         return -1;
     }
@@ -316,6 +410,325 @@ int fitstable_copy_rows_data(fitstable_t* intable, int* rows, int N, fitstable_t
     return 0;
 }
 
+// Rows are gathered in blocks of about this many bytes...
+#define GATHER_BLOCK_BYTES (256 * 1024)
+// ... and written in rounds of this many blocks.
+#define GATHER_ROUND_BLOCKS 64
+
+struct gather {
+    fitstable_t* intable;
+    const int* rows;
+    int R;
+    // field sizes, for endian-flipping; NULL if not needed.
+    int* flipsizes;
+    int nflip;
+    char* buf;
+    int row0;
+    int nrows;
+    int blockrows;
+    int nblocks;
+    int next;
+    int failed;
+};
+
+static void* gather_worker(void* arg) {
+    struct gather* g = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED)) < g->nblocks) {
+        int i0 = b * g->blockrows;
+        int i1 = MIN(g->nrows, i0 + g->blockrows);
+        int i;
+        for (i=i0; i<i1; i++) {
+            int row = g->row0 + i;
+            char* dest = g->buf + (size_t)i * (size_t)g->R;
+            if (g->rows)
+                row = g->rows[row];
+            if (in_memory(g->intable))
+                memcpy(dest, mem_row(g->intable, row), g->R);
+            else if (read_at(fileno(g->intable->readfid), dest, g->R,
+                             get_row_offset(g->intable, row))) {
+                SYSERROR("Failed to read row %i from %s", row, g->intable->fn);
+                __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            if (g->flipsizes) {
+                int j;
+                char* cursor = dest;
+                for (j=0; j<g->nflip; j++) {
+                    endian_swap(cursor, g->flipsizes[j]);
+                    cursor += g->flipsizes[j];
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+int fitstable_copy_rows_data_parallel(fitstable_t* intable, const int* rows,
+                                      int N, fitstable_t* outtable,
+                                      int nthreads) {
+    struct gather g;
+    fitstable_t* fliptable = NULL;
+    pthread_t* threads;
+    int roundrows;
+    int i, t;
+    int rtn = -1;
+
+    if (nthreads <= 1)
+        return fitstable_copy_rows_data(intable, (int*)rows, N, outtable);
+
+    memset(&g, 0, sizeof(struct gather));
+    g.intable = intable;
+    g.rows = rows;
+    g.R = fitstable_row_size(intable);
+    if (!in_memory(intable) && open_for_row_reads(intable))
+        return -1;
+    // As in fitstable_copy_rows_data(), the in-memory side does the flip.
+    if (need_endian_flip() && (in_memory(intable) != in_memory(outtable)))
+        fliptable = in_memory(intable) ? intable : outtable;
+    if (fliptable) {
+        for (i=0; i<ncols(fliptable); i++)
+            g.nflip += getcol(fliptable, i)->arraysize;
+        g.flipsizes = malloc(g.nflip * sizeof(int));
+        g.nflip = 0;
+        for (i=0; i<ncols(fliptable); i++) {
+            fitscol_t* col = getcol(fliptable, i);
+            int j;
+            for (j=0; j<col->arraysize; j++)
+                g.flipsizes[g.nflip++] = col->fitssize;
+        }
+    }
+    if (!in_memory(outtable) && flush_write_buffer(outtable))
+        goto bailout;
+
+    g.blockrows = MAX(1, GATHER_BLOCK_BYTES / MAX(1, g.R));
+    roundrows = g.blockrows * GATHER_ROUND_BLOCKS;
+    g.buf = malloc((size_t)MIN(roundrows, MAX(N, 1)) * (size_t)g.R);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (g.row0=0; g.row0<N; g.row0+=roundrows) {
+        int nstarted = 0;
+        g.nrows = MIN(roundrows, N - g.row0);
+        g.nblocks = (g.nrows + g.blockrows - 1) / g.blockrows;
+        g.next = 0;
+        for (t=1; t<MIN(nthreads, g.nblocks); t++) {
+            if (pthread_create(threads + nstarted, NULL, gather_worker, &g))
+                break;
+            nstarted++;
+        }
+        gather_worker(&g);
+        for (t=0; t<nstarted; t++)
+            pthread_join(threads[t], NULL);
+        if (g.failed)
+            break;
+
+        if (in_memory(outtable)) {
+            for (i=0; i<g.nrows; i++)
+                if (write_row_data(outtable, g.buf + (size_t)i * g.R, g.R))
+                    break;
+            if (i < g.nrows) {
+                g.failed = 1;
+                break;
+            }
+        } else {
+            size_t n = (size_t)g.nrows * (size_t)g.R;
+            if (fwrite(g.buf, 1, n, outtable->fid) != n) {
+                SYSERROR("Failed to write %i rows to %s", g.nrows, outtable->fn);
+                g.failed = 1;
+                break;
+            }
+            outtable->table->nr += g.nrows;
+        }
+    }
+    free(threads);
+    if (!g.failed)
+        rtn = 0;
+ bailout:
+    free(g.buf);
+    free(g.flipsizes);
+    return rtn;
+}
+
+// A gather starts a thread for at least this many runs of rows.
+#define GATHER_RUNS_PER_THREAD 256
+
+struct fitstable_gather_t {
+    fitstable_t* tab;
+    int R;
+    // the requested rows, in the order they were asked for...
+    int N;
+    // ... are rows[slot[i]], the distinct rows in file order.
+    int* slot;
+    int nrows;
+    // raw rows, as in the table (big-endian, if from a file)
+    char* rows;
+    // runs of consecutive rows: run i is table rows
+    // [runrow[i], runrow[i] + runlen[i]), at rows + runslot[i] * R.
+    int nruns;
+    int* runrow;
+    int* runlen;
+    int* runslot;
+    int next;
+    int failed;
+};
+
+static void* gather_runs_worker(void* arg) {
+    fitstable_gather_t* g = arg;
+    int r;
+    while ((r = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED)) < g->nruns) {
+        char* dest = g->rows + (size_t)g->runslot[r] * (size_t)g->R;
+        size_t n = (size_t)g->runlen[r] * (size_t)g->R;
+        if (in_memory(g->tab))
+            memcpy(dest, mem_row(g->tab, g->runrow[r]), n);
+        else if (read_at(fileno(g->tab->readfid), dest, n,
+                         get_row_offset(g->tab, g->runrow[r]))) {
+            SYSERROR("Failed to read %i rows from %s", g->runlen[r], g->tab->fn);
+            __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+fitstable_gather_t* fitstable_gather_rows(fitstable_t* tab, const int* inds,
+                                          int N, int nthreads) {
+    fitstable_gather_t* g;
+    int* order = NULL;
+    pthread_t* threads = NULL;
+    int i, t, nstarted = 0;
+
+    if (!in_memory(tab) && tab->table->tab_t != QFITS_BINTABLE) {
+        ERROR("Can only gather rows of a binary table");
+        return NULL;
+    }
+    g = calloc(1, sizeof(fitstable_gather_t));
+    g->tab = tab;
+    g->R = fitstable_row_size(tab);
+    g->N = N;
+    g->slot = malloc(MAX(N, 1) * sizeof(int));
+    g->runrow = malloc(MAX(N, 1) * sizeof(int));
+    g->runlen = malloc(MAX(N, 1) * sizeof(int));
+    g->runslot = malloc(MAX(N, 1) * sizeof(int));
+    order = permuted_sort(inds, sizeof(int), compare_ints_asc, NULL, N);
+    if (!g->slot || !g->runrow || !g->runlen || !g->runslot || (N && !order))
+        goto bailout;
+    for (i=0; i<N; i++) {
+        int row = inds[order[i]];
+        if (row < 0 || row >= fitstable_nrows(tab)) {
+            ERROR("Row %i is outside the table's %i rows", row,
+                  fitstable_nrows(tab));
+            goto bailout;
+        }
+        if (g->nrows && row == g->runrow[g->nruns-1] + g->runlen[g->nruns-1] - 1) {
+            // (a repeat)
+        } else if (g->nruns &&
+                   row == g->runrow[g->nruns-1] + g->runlen[g->nruns-1]) {
+            g->runlen[g->nruns-1]++;
+            g->nrows++;
+        } else {
+            g->runrow[g->nruns] = row;
+            g->runlen[g->nruns] = 1;
+            g->runslot[g->nruns] = g->nrows;
+            g->nruns++;
+            g->nrows++;
+        }
+        g->slot[order[i]] = g->nrows - 1;
+    }
+    free(order);
+    order = NULL;
+
+    g->rows = malloc(MAX((size_t)g->nrows * (size_t)g->R, 1));
+    if (!g->rows)
+        goto bailout;
+    if (!in_memory(tab) && open_for_row_reads(tab))
+        goto bailout;
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MIN(nthreads, g->nruns / GATHER_RUNS_PER_THREAD);
+    if (nthreads > 1)
+        threads = malloc(nthreads * sizeof(pthread_t));
+    for (t=1; threads && t<nthreads; t++) {
+        if (pthread_create(threads + nstarted, NULL, gather_runs_worker, g))
+            break;
+        nstarted++;
+    }
+    gather_runs_worker(g);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    if (g->failed)
+        goto bailout;
+    return g;
+
+ bailout:
+    free(order);
+    fitstable_gather_free(g);
+    return NULL;
+}
+
+void* fitstable_gather_column(const fitstable_gather_t* g, const char* colname,
+                              tfits_type ctype, int* p_arraysize) {
+    const fitstable_t* tab = g->tab;
+    qfits_col* col;
+    int colnum, off, fitstype, fitssize, csize, arraysize, fsize;
+    char *fitsdata, *cdata;
+    int i;
+
+    colnum = fits_find_column(tab->table, colname);
+    if (colnum == -1) {
+        ERROR("Column \"%s\" not found in FITS table %s", colname, tab->fn);
+        return NULL;
+    }
+    col = tab->table->col + colnum;
+    fitstype = col->atom_type;
+    fitssize = fits_get_atom_size(fitstype);
+    csize = fits_get_atom_size(ctype);
+    arraysize = col->atom_nb;
+    fsize = fitssize * arraysize;
+    off = fits_offset_of_column(tab->table, colnum);
+    if (p_arraysize)
+        *p_arraysize = arraysize;
+
+    fitsdata = malloc(MAX((size_t)g->N * (size_t)fsize, 1));
+    if (!fitsdata) {
+        SYSERROR("Failed to allocate column \"%s\"", colname);
+        return NULL;
+    }
+    for (i=0; i<g->N; i++)
+        memcpy(fitsdata + (size_t)i * fsize,
+               g->rows + (size_t)g->slot[i] * (size_t)g->R + off, fsize);
+    // rows read from a file are big-endian.
+    if (!in_memory(tab) && need_endian_flip() && fitssize > 1) {
+        size_t k;
+        for (k=0; k<(size_t)g->N * (size_t)arraysize; k++)
+            endian_swap(fitsdata + k * fitssize, fitssize);
+    }
+    if (fitstype == ctype)
+        return fitsdata;
+    cdata = malloc(MAX((size_t)g->N * (size_t)arraysize * (size_t)csize, 1));
+    if (cdata)
+        fits_convert_data(cdata, csize * arraysize, ctype,
+                          fitsdata, fsize, fitstype, arraysize, g->N);
+    else
+        SYSERROR("Failed to allocate column \"%s\"", colname);
+    free(fitsdata);
+    return cdata;
+}
+
+int fitstable_gather_nrows(const fitstable_gather_t* g) {
+    return g->nrows;
+}
+
+void fitstable_gather_free(fitstable_gather_t* g) {
+    if (!g)
+        return;
+    free(g->slot);
+    free(g->rows);
+    free(g->runrow);
+    free(g->runlen);
+    free(g->runslot);
+    free(g);
+}
+
 int fitstable_copy_row_data(fitstable_t* table, int row, fitstable_t* outtable) {
     return fitstable_copy_rows_data(table, &row, 1, outtable);
 }
@@ -637,12 +1050,12 @@ int fitstable_read_structs(fitstable_t* tab, void* struc,
             int j;
             int off = offset_of_column(tab, i);
             int sz;
-            if (!tab->rows) {
+            if (!tab->memrows) {
                 ERROR("No data has been written to this fitstable");
                 return -1;
             }
-            if (offset + N > bl_size(tab->rows)) {
-                ERROR("Number of data items requested exceeds number of rows: offset %i, n %i, nrows %zu", offset, N, bl_size(tab->rows));
+            if (offset + N > tab->nmemrows) {
+                ERROR("Number of data items requested exceeds number of rows: offset %i, n %i, nrows %zu", offset, N, tab->nmemrows);
                 return -1;
             }
 
@@ -650,7 +1063,7 @@ int fitstable_read_structs(fitstable_t* tab, void* struc,
             sz = fitscolumn_get_size(col);
             for (j=0; j<N; j++)
                 memcpy(((char*)dest) + j * stride,
-                       ((char*)bl_access(tab->rows, offset+j)) + off,
+                       mem_row(tab, offset+j) + off,
                        sz);
         } else {
             // Read from FITS file...
@@ -686,10 +1099,19 @@ static int write_one(fitstable_t* table, const void* struc, anbool flip,
 
     char* thisrow = NULL;
     int rowoff = 0;
+    // writing to a file: is "thisrow" a slot in the write buffer?
+    anbool buffered = FALSE;
+    int R = 0;
 
     if (in_memory(table)) {
-        ensure_row_list_exists(table);
-        thisrow = calloc(1, bl_datasize(table->rows));
+        // (written in place, at the end of the table)
+        thisrow = append_mem_rows(table, 1);
+        if (!thisrow)
+            return -1;
+    } else {
+        R = fitstable_get_struct_size(table);
+        thisrow = write_buffer_row(table, R);
+        buffered = (thisrow != NULL);
     }
 
     for (i=0; i<nc; i++) {
@@ -731,7 +1153,26 @@ static int write_one(fitstable_t* table, const void* struc, anbool flip,
             int nb = fitscolumn_get_size(col);
             memcpy(thisrow + rowoff, columndata, nb);
             rowoff += nb;
+        } else if (buffered && columndata) {
+            int nb = fitscolumn_get_size(col);
+            memcpy(thisrow + rowoff, columndata, nb);
+            if (flip && need_endian_flip() && col->fitssize > 1)
+                qfits_swap_bytes_array(thisrow + rowoff, col->fitssize,
+                                       col->arraysize);
+            rowoff += nb;
         } else {
+            if (buffered) {
+                // A skipped column: the bytes already in the file have
+                // to be kept, so write out what we have so far and
+                // finish this row unbuffered.
+                buffered = FALSE;
+                if (flush_write_buffer(table) ||
+                    fwrite(thisrow, 1, rowoff, table->fid) != (size_t)rowoff) {
+                    SYSERROR("Failed to write a row to %s", table->fn);
+                    ret = -1;
+                    break;
+                }
+            }
             ret = fits_write_data_array(table->fid, columndata,
                                         col->fitstype, col->arraysize, flip);
             if (ret)
@@ -739,9 +1180,8 @@ static int write_one(fitstable_t* table, const void* struc, anbool flip,
         }
     }
     free(buf);
-    if (in_memory(table))
-        bl_append(table->rows, thisrow);
-    free(thisrow);
+    if (!in_memory(table) && buffered && !ret)
+        commit_row(table, R);
     table->table->nr++;
     return ret;
 }
@@ -804,6 +1244,8 @@ int fitstable_write_one_column(fitstable_t* table, int colnum,
 
     off = offset_of_column(table, colnum);
     if (!in_memory(table)) {
+        if (flush_write_buffer(table))
+            return -1;
         foffset = ftello(table->fid);
         // jump to row start...
         start = get_row_offset(table, rowoffset) + off;
@@ -826,7 +1268,7 @@ int fitstable_write_one_column(fitstable_t* table, int colnum,
 
     if (in_memory(table)) {
         for (i=0; i<nrows; i++) {
-            memcpy(((char*)bl_access(table->rows, rowoffset + i)) + off,
+            memcpy(mem_row(table, rowoffset + i) + off,
                    src, (size_t)col->fitssize * (size_t)col->arraysize);
             src = ((const char*)src) + src_stride;
         }
@@ -883,6 +1325,7 @@ static void* read_array_into(const fitstable_t* tab,
     char* fitsdata;
     int cstride;
     int fitsstride;
+    anbool strided;
     int N;
 
     colnum = fits_find_column(tab->table, colname);
@@ -924,8 +1367,11 @@ static void* read_array_into(const fitstable_t* tab,
         cstride = csize * arraysize;
 
     fitsstride = fitssize * arraysize;
-    if (csize < fitssize) {
+    // Reading into every "deststride" bytes of "dest"?
+    strided = (cstride != csize * arraysize);
+    if (csize < fitssize || strided) {
         // Need to allocate a bigger temp array and down-convert the data.
+        // (or spread it out to the requested stride.)
         // HACK - could set data=tempdata and realloc after (if 'dest' is NULL)
         tempdata = calloc((size_t)Nread * (size_t)arraysize, fitssize);
         fitsdata = tempdata;
@@ -938,12 +1384,12 @@ static void* read_array_into(const fitstable_t* tab,
         int i;
         int off;
         int sz;
-        if (!tab->rows) {
+        if (!tab->memrows) {
             ERROR("No data has been written to this fitstable");
             return NULL;
         }
-        if (offset + Nread > bl_size(tab->rows)) {
-            ERROR("Number of data items requested exceeds number of rows: offset %i, n %i, nrows %zu", offset, Nread, bl_size(tab->rows));
+        if (offset + Nread > tab->nmemrows) {
+            ERROR("Number of data items requested exceeds number of rows: offset %i, n %i, nrows %zu", offset, Nread, tab->nmemrows);
             return NULL;
         }
         off = fits_offset_of_column(tab->table, colnum);
@@ -951,12 +1397,12 @@ static void* read_array_into(const fitstable_t* tab,
         if (inds) {
             for (i=0; i<Nread; i++)
                 memcpy(fitsdata + i * fitsstride,
-                       ((char*)bl_access(tab->rows, inds[i])) + off,
+                       mem_row(tab, inds[i]) + off,
                        sz);
         } else {
             for (i=0; i<Nread; i++)
                 memcpy(fitsdata + i * fitsstride,
-                       ((char*)bl_access(tab->rows, offset+i)) + off,
+                       mem_row(tab, offset+i) + off,
                        sz);
         }
     } else {
@@ -976,7 +1422,7 @@ static void* read_array_into(const fitstable_t* tab,
     }
 
     if (fitstype != ctype) {
-        if (csize <= fitssize) {
+        if (csize <= fitssize || strided) {
             // work forward
             fits_convert_data(cdata, cstride, ctype,
                               fitsdata, fitsstride, fitstype,
@@ -989,6 +1435,11 @@ static void* read_array_into(const fitstable_t* tab,
                               -fitssize, fitstype,
                               1, (size_t)Nread * (size_t)arraysize);
         }
+    } else if (strided) {
+        int i;
+        for (i=0; i<Nread; i++)
+            memcpy(cdata + (size_t)i * cstride, fitsdata + (size_t)i * fitsstride,
+                   fitsstride);
     }
 
     free(tempdata);
@@ -1057,6 +1508,121 @@ void* fitstable_read_column_offset(const fitstable_t* tab,
     return read_array(tab, colname, ctype, FALSE, offset, N);
 }
 
+struct fitstable_view_t {
+    const fitstable_t* tab;
+    char* colname;
+    tfits_type ctype;
+    int csize;
+    int arraysize;
+    int nrows;
+    // direct: the whole column, mapped; row i starts at map + i * stride.
+    char* map;
+    int stride;
+    char* freeaddr;
+    size_t freesize;
+    // otherwise: the rows converted by the last fitstable_view_rows() call.
+    char* buf;
+    size_t bufrows;
+};
+
+fitstable_view_t* fitstable_view_column(const fitstable_t* tab,
+                                        const char* colname,
+                                        tfits_type ctype) {
+    fitstable_view_t* view;
+    qfits_col* col;
+    int colnum;
+    int fitssize;
+
+    colnum = fits_find_column(tab->table, colname);
+    if (colnum == -1) {
+        ERROR("Column \"%s\" not found in FITS table %s", colname, tab->fn);
+        return NULL;
+    }
+    col = tab->table->col + colnum;
+    fitssize = fits_get_atom_size(col->atom_type);
+
+    view = calloc(1, sizeof(fitstable_view_t));
+    view->tab = tab;
+    view->colname = strdup(colname);
+    view->ctype = ctype;
+    view->csize = fits_get_atom_size(ctype);
+    view->arraysize = col->atom_nb;
+    view->nrows = tab->table->nr;
+
+    // The file's bytes can be handed out as they are if no conversion
+    // or byte-swapping is needed; so can an in-memory table's rows.
+    if (in_memory(tab) && col->atom_type == ctype && tab->memrows) {
+        view->map = mem_row(tab, 0) + fits_offset_of_column(tab->table, colnum);
+        view->stride = tab->memrowsize;
+    } else if (!in_memory(tab) && tab->table->tab_t == QFITS_BINTABLE &&
+        col->atom_type == ctype && (fitssize == 1 || !need_endian_flip()) &&
+        view->nrows > 0) {
+        int width = tab->table->tab_w;
+        if (width == -1)
+            width = qfits_compute_table_width(tab->table);
+        if (width > 0) {
+            // (map only up to the end of the last field, not the last row)
+            size_t len = (size_t)(view->nrows - 1) * (size_t)width +
+                (size_t)fitssize * (size_t)view->arraysize;
+            view->map = qfits_falloc2(tab->table->filename, col->off_beg, len,
+                                      &view->freeaddr, &view->freesize);
+            if (view->map)
+                view->stride = width;
+            else
+                logverb("Failed to map column \"%s\"; will read it instead\n",
+                        colname);
+        }
+    }
+    if (!view->map)
+        view->stride = view->csize * view->arraysize;
+    return view;
+}
+
+anbool fitstable_view_is_direct(const fitstable_view_t* view) {
+    return (view->map != NULL);
+}
+
+int fitstable_view_nrows(const fitstable_view_t* view) {
+    return view->nrows;
+}
+
+int fitstable_view_array_size(const fitstable_view_t* view) {
+    return view->arraysize;
+}
+
+const void* fitstable_view_rows(fitstable_view_t* view, int start, int N,
+                                int* p_stride) {
+    if (start < 0 || N < 0 || start + N > view->nrows) {
+        ERROR("Rows %i to %i requested from column \"%s\", which has %i rows",
+              start, start + N, view->colname, view->nrows);
+        return NULL;
+    }
+    if (p_stride)
+        *p_stride = view->stride;
+    if (view->map)
+        return view->map + (size_t)start * (size_t)view->stride;
+
+    if ((size_t)N > view->bufrows) {
+        free(view->buf);
+        view->bufrows = MAX(N, 1);
+        view->buf = malloc(view->bufrows * view->stride);
+    }
+    if (N && !read_array_into(view->tab, view->colname, view->ctype, TRUE,
+                              start, NULL, N, view->buf, view->stride, 0, NULL))
+        return NULL;
+    return view->buf;
+}
+
+void fitstable_view_free(fitstable_view_t* view) {
+    if (!view)
+        return;
+    if (view->freeaddr)
+        qfits_fdealloc2(view->freeaddr, view->freesize);
+    free(view->buf);
+    free(view->colname);
+    free(view);
+}
+
 qfits_header* fitstable_get_primary_header(const fitstable_t* t) {
     return t->primheader;
 }
@@ -1069,8 +1635,10 @@ qfits_header* fitstable_get_header(fitstable_t* t) {
 }
 
 void fitstable_next_extension(fitstable_t* tab) {
-    if (is_writing(tab))
+    if (is_writing(tab)) {
+        flush_write_buffer(tab);
         fits_pad_file(tab->fid);
+    }
 
     if (in_memory(tab)) {
         fitsext_t ext;
@@ -1080,9 +1648,13 @@ void fitstable_next_extension(fitstable_t* tab) {
         fitstable_fix_header(tab);
         ext.table = tab->table;
         ext.header = tab->header;
-        ext.rows = tab->rows;
+        ext.memrows = tab->memrows;
+        ext.nmemrows = tab->nmemrows;
+        ext.memrowscap = tab->memrowscap;
+        ext.memrowsize = tab->memrowsize;
         bl_append(tab->extensions, &ext);
-        tab->rows = NULL;
+        tab->memrows = NULL;
+        tab->nmemrows = tab->memrowscap = 0;
     } else {
         qfits_table_close(tab->table);
         qfits_header_destroy(tab->header);
@@ -1291,6 +1863,8 @@ int fitstable_close(fitstable_t* tab) {
     int rtn = 0;
     if (!tab) return 0;
     if (is_writing(tab)) {
+        if (flush_write_buffer(tab))
+            rtn = -1;
         if (tab->fid) {
             if (fclose(tab->fid)) {
                 SYSERROR("Failed to close output file %s", tab->fn);
@@ -1311,6 +1885,7 @@ int fitstable_close(fitstable_t* tab) {
     if (tab->table)
         qfits_table_close(tab->table);
     free(tab->fn);
+    free(tab->wbuf);
     for (i=0; i<ncols(tab); i++) {
         fitscol_t* col = getcol(tab, i);
         free(col->colname);
@@ -1321,14 +1896,12 @@ int fitstable_close(fitstable_t* tab) {
         buffered_read_free(tab->br);
         free(tab->br);
     }
-    if (tab->rows) {
-        bl_free(tab->rows);
-    }
+    free(tab->memrows);
     if (tab->extensions) {
         for (i=0; i<bl_size(tab->extensions); i++) {
             fitsext_t* ext = bl_access(tab->extensions, i);
-            if (ext->rows != tab->rows)
-                bl_free(ext->rows);
+            if (ext->memrows != tab->memrows)
+                free(ext->memrows);
             if (ext->header != tab->header)
                 qfits_header_destroy(ext->header);
             if (ext->table != tab->table)
@@ -1392,7 +1965,10 @@ int fitstable_open_extension(fitstable_t* tab, int ext) {
         theext = bl_access(tab->extensions, ext-1);
         tab->table = theext->table;
         tab->header = theext->header;
-        tab->rows = theext->rows;
+        tab->memrows = theext->memrows;
+        tab->nmemrows = theext->nmemrows;
+        tab->memrowscap = theext->memrowscap;
+        tab->memrowsize = theext->memrowsize;
         tab->extension = ext;
 
     } else {
@@ -1497,12 +2073,14 @@ int fitstable_read_extension(fitstable_t* tab, int ext) {
 
 int fitstable_write_primary_header(fitstable_t* t) {
     if (in_memory(t)) return 0;
+    if (flush_write_buffer(t)) return -1;
     return fitsfile_write_primary_header(t->fid, t->primheader,
                                          &t->end_header_offset, t->fn);
 }
 
 int fitstable_fix_primary_header(fitstable_t* t) {
     if (in_memory(t)) return 0;
+    if (flush_write_buffer(t)) return -1;
     return fitsfile_fix_primary_header(t->fid, t->primheader,
                                        &t->end_header_offset, t->fn);
 }
@@ -1527,6 +2105,7 @@ int fitstable_write_header(fitstable_t* t) {
         }
     }
     if (in_memory(t)) return 0;
+    if (flush_write_buffer(t)) return -1;
 
     return fitsfile_write_header(t->fid, t->header,
                                  &t->table_offset, &t->end_table_offset,
@@ -1534,14 +2113,22 @@ int fitstable_write_header(fitstable_t* t) {
 }
 
 int fitstable_pad_with(fitstable_t* t, char pad) {
+    if (flush_write_buffer(t)) return -1;
     return fitsfile_pad_with(t->fid, pad);
 }
 
+int fitstable_flush(fitstable_t* t) {
+    if (in_memory(t))
+        return 0;
+    return flush_write_buffer(t);
+}
+
 int fitstable_fix_header(fitstable_t* t) {
     // update NAXIS2 to reflect the number of rows written.
     fits_header_mod_int(t->header, "NAXIS2", t->table->nr, NULL);
 
     if (in_memory(t)) return 0;
+    if (flush_write_buffer(t)) return -1;
 
     //printf("fitstable_fix_header: ext %i, table offset was %lu, fn %s\n",
     //t->extension, (long)t->table_offset, t->fn);
@@ -3,10 +3,18 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
+#include <math.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os-features.h"
 #include "bl.h"
 #include "healpix.h"
+#include "healpix-utils.h"
 #include "mathutil.h"
 #include "starutil.h"
+#include "permutedsort.h"
 
 il* healpix_region_search(int seed, il* seeds, int Nside,
                           il* accepted, il* rejected,
@@ -187,3 +195,202 @@ il* healpix_rangesearch_radec(double ra, double dec, double radius, int Nside, i
     radecdeg2xyzarr(ra, dec, xyz);
     return hp_rangesearch(xyz, radius, Nside, hps, FALSE);
 }
+
+/*
+ Hierarchical coverage queries.  Each big healpix is split in half,
+ recursively, into rectangular blocks of pixels [x0,x1) x [y0,y1); a
+ block that is entirely inside or outside the region is settled at
+ once, so only the blocks along the region's boundary are refined down
+ to single pixels.
+ */
+enum { BLOCK_OUT, BLOCK_IN, BLOCK_PARTIAL };
+
+struct range_search {
+    int Nside;
+    // disc: center and radius (in degrees)
+    const double* xyz;
+    double radius;
+    // convex polygon: unit normals of its edges' great circles, pointing
+    // inward.
+    double* normals;
+    int nedges;
+    // found ranges, as [lo, hi) pairs, in no particular order.
+    int64_t* ranges;
+    size_t nranges;
+    size_t capacity;
+};
+
+// Bounds a block by a circle around its center; the radius (in degrees)
+// is padded by half, as in index-lookup.c, since the block's edges are
+// not great circles.
+static void block_cap(int bighp, int Nside, int x0, int x1, int y0, int y1,
+                      double* center, double* radius) {
+    double pixrad2 = 0.0;
+    int i;
+    healpix_to_xyzarr(bighp, 1, 0.5 * (x0 + x1) / Nside,
+                      0.5 * (y0 + y1) / Nside, center);
+    for (i=0; i<9; i++) {
+        double p[3];
+        if (i == 4)
+            continue;
+        healpix_to_xyzarr(bighp, 1, (x0 + 0.5 * (i / 3) * (x1 - x0)) / Nside,
+                          (y0 + 0.5 * (i % 3) * (y1 - y0)) / Nside, p);
+        pixrad2 = MAX(pixrad2, distsq(center, p, 3));
+    }
+    *radius = 1.5 * distsq2deg(pixrad2);
+}
+
+static int classify_block(const struct range_search* rs, int bighp,
+                          int x0, int x1, int y0, int y1) {
+    double center[3], r;
+    block_cap(bighp, rs->Nside, x0, x1, y0, y1, center, &r);
+    if (rs->xyz) {
+        double d = distsq2deg(distsq(center, rs->xyz, 3));
+        if (d - r > rs->radius)
+            return BLOCK_OUT;
+        if (d + r <= rs->radius)
+            return BLOCK_IN;
+        return BLOCK_PARTIAL;
+    } else {
+        anbool in = (r < 90.0);
+        double sinr = sin(deg2rad(MIN(r, 90.0)));
+        int i;
+        for (i=0; i<rs->nedges; i++) {
+            double s = (center[0] * rs->normals[3*i+0] +
+                        center[1] * rs->normals[3*i+1] +
+                        center[2] * rs->normals[3*i+2]);
+            if (r < 90.0 && s < -sinr)
+                return BLOCK_OUT;
+            if (s < sinr)
+                in = FALSE;
+        }
+        return in ? BLOCK_IN : BLOCK_PARTIAL;
+    }
+}
+
+static void add_range(struct range_search* rs, int64_t lo, int64_t hi) {
+    if (rs->nranges == rs->capacity) {
+        rs->capacity = MAX(64, rs->capacity * 2);
+        rs->ranges = realloc(rs->ranges, 2 * rs->capacity * sizeof(int64_t));
+    }
+    rs->ranges[2 * rs->nranges] = lo;
+    rs->ranges[2 * rs->nranges + 1] = hi;
+    rs->nranges++;
+}
+
+static void add_block(struct range_search* rs, int bighp,
+                      int x0, int x1, int y0, int y1) {
+    int64_t ns = rs->Nside;
+    int64_t base = (int64_t)bighp * ns * ns;
+    int x;
+    if (y0 == 0 && y1 == rs->Nside) {
+        // whole rows are contiguous.
+        add_range(rs, base + x0 * ns, base + x1 * ns);
+        return;
+    }
+    for (x=x0; x<x1; x++)
+        add_range(rs, base + x * ns + y0, base + x * ns + y1);
+}
+
+static void search_block(struct range_search* rs, int bighp,
+                         int x0, int x1, int y0, int y1) {
+    int c = classify_block(rs, bighp, x0, x1, y0, y1);
+    if (c == BLOCK_OUT)
+        return;
+    if (c == BLOCK_PARTIAL) {
+        if (x1 - x0 > 1 || y1 - y0 > 1) {
+            // split the longer side.
+            if (x1 - x0 >= y1 - y0) {
+                int xm = (x0 + x1) / 2;
+                search_block(rs, bighp, x0, xm, y0, y1);
+                search_block(rs, bighp, xm, x1, y0, y1);
+            } else {
+                int ym = (y0 + y1) / 2;
+                search_block(rs, bighp, x0, x1, y0, ym);
+                search_block(rs, bighp, x0, x1, ym, y1);
+            }
+            return;
+        }
+        // a single pixel on the boundary: decide exactly for discs (when
+        // the pixel number fits in an int); keep it otherwise.
+        if (rs->xyz && (int64_t)12 * rs->Nside * rs->Nside <= INT_MAX) {
+            int hp = healpix_compose_xy(bighp, x0, y0, rs->Nside);
+            if (healpix_distance_to_xyz(hp, rs->Nside, rs->xyz, NULL) > rs->radius)
+                return;
+        }
+    }
+    add_block(rs, bighp, x0, x1, y0, y1);
+}
+
+static ll* range_search(struct range_search* rs, ll* ranges) {
+    size_t i;
+    int bighp;
+    int64_t lo = 0, hi = -1;
+    if (!ranges)
+        ranges = ll_new(256);
+    for (bighp=0; bighp<12; bighp++)
+        search_block(rs, bighp, 0, rs->Nside, 0, rs->Nside);
+    // sort by start (the ranges are disjoint), and merge adjacent ones.
+    qsort(rs->ranges, rs->nranges, 2 * sizeof(int64_t), compare_int64_asc);
+    for (i=0; i<rs->nranges; i++) {
+        if (rs->ranges[2*i] == hi) {
+            hi = rs->ranges[2*i+1];
+            continue;
+        }
+        if (hi > lo) {
+            ll_append(ranges, lo);
+            ll_append(ranges, hi);
+        }
+        lo = rs->ranges[2*i];
+        hi = rs->ranges[2*i+1];
+    }
+    if (hi > lo) {
+        ll_append(ranges, lo);
+        ll_append(ranges, hi);
+    }
+    free(rs->ranges);
+    return ranges;
+}
+
+ll* healpix_disc_ranges(const double* xyz, double radius, int Nside,
+                        ll* ranges) {
+    struct range_search rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.Nside = Nside;
+    rs.xyz = xyz;
+    rs.radius = radius;
+    return range_search(&rs, ranges);
+}
+
+ll* healpix_disc_ranges_radec(double ra, double dec, double radius,
+                              int Nside, ll* ranges) {
+    double xyz[3];
+    radecdeg2xyzarr(ra, dec, xyz);
+    return healpix_disc_ranges(xyz, radius, Nside, ranges);
+}
+
+ll* healpix_polygon_ranges(const double* verts, int nverts, int Nside,
+                           ll* ranges) {
+    struct range_search rs;
+    int i;
+    memset(&rs, 0, sizeof(rs));
+    rs.Nside = Nside;
+    rs.nedges = nverts;
+    rs.normals = malloc(3 * nverts * sizeof(double));
+    for (i=0; i<nverts; i++) {
+        cross_product((double*)verts + 3*i, (double*)verts + 3*((i+1) % nverts),
+                      rs.normals + 3*i);
+        normalize_3(rs.normals + 3*i);
+    }
+    ranges = range_search(&rs, ranges);
+    free(rs.normals);
+    return ranges;
+}
+
+int64_t healpix_ranges_count(ll* ranges) {
+    int64_t n = 0;
+    size_t i;
+    for (i=0; i+1<ll_size(ranges); i+=2)
+        n += ll_get(ranges, i+1) - ll_get(ranges, i);
+    return n;
+}
@@ -1003,6 +1003,85 @@ int xyzarrtohealpixf(const double* xyz,int Nside, double* p_dx, double* p_dy) {
     return xyztohealpixf(xyz[0], xyz[1], xyz[2], Nside, p_dx, p_dy);
 }
 
+// The same computation as xyztohp() plus hptointl(), arranged for the
+// batch functions below: no (dx,dy), fmod() and round() replaced by an
+// exact fma()-based remainder, and the equatorial-region quadrant
+// chosen with selects rather than nested branches.  The results are
+// bit-for-bit those of xyztohealpixl().
+static Inline int64_t xyz_to_hpl(double vx, double vy, double vz, int Nside) {
+    const double twothirds = 2.0 / 3.0;
+    const double pi = M_PI;
+    const double halfpi = 0.5 * M_PI;
+    int64_t ns = Nside;
+    double phi, phi_t, xx, yy;
+    int offset, basehp, x, y;
+
+    phi = atan2(vy, vx);
+    if (phi < 0.0)
+        phi += 2.0 * M_PI;
+    // phi_t = fmod(phi, halfpi): the remainder is exactly representable,
+    // so fma() computes it exactly once "offset" is the true quotient.
+    offset = (int)(phi / halfpi);
+    phi_t = fma(-offset, halfpi, phi);
+    if (phi_t < 0.0) {
+        offset--;
+        phi_t = fma(-offset, halfpi, phi);
+    } else if (phi_t >= halfpi) {
+        offset++;
+        phi_t = fma(-offset, halfpi, phi);
+    }
+    offset &= 3;
+
+    if ((vz >= twothirds) || (vz <= -twothirds)) {
+        anbool north = (vz >= twothirds);
+        double zfactor = north ? 1.0 : -1.0;
+        double root, kx, ky;
+        root = (1.0 - vz*zfactor) * 3.0 * mysquare(Nside * (2.0 * phi_t - pi) / pi);
+        kx = (root <= 0.0) ? 0.0 : sqrt(root);
+        root = (1.0 - vz*zfactor) * 3.0 * mysquare(Nside * 2.0 * phi_t / pi);
+        ky = (root <= 0.0) ? 0.0 : sqrt(root);
+        xx = north ? (Nside - kx) : ky;
+        yy = north ? (Nside - ky) : kx;
+        x = MIN(Nside-1, floor(xx));
+        y = MIN(Nside-1, floor(yy));
+        basehp = north ? offset : (8 + offset);
+    } else {
+        double zunits = (vz + twothirds) / (4.0 / 3.0);
+        double phiunits = phi_t / halfpi;
+        anbool east, west;
+        xx = (zunits + phiunits) * Nside;
+        yy = (zunits - phiunits + 1.0) * Nside;
+        east = (xx >= Nside);
+        west = (yy >= Nside);
+        xx -= east ? Nside : 0;
+        yy -= west ? Nside : 0;
+        basehp = east ? (west ? offset : (((offset + 1) & 3) + 4)) :
+            (west ? (offset + 4) : (8 + offset));
+        x = MAX(0, MIN(Nside-1, floor(xx)));
+        y = MAX(0, MIN(Nside-1, floor(yy)));
+    }
+    return (((int64_t)basehp * ns + x) * ns) + y;
+}
+
+void xyzarrtohealpixl_array(const double* xyz, size_t N, int Nside,
+                            int64_t* hps) {
+    size_t i;
+    assert(Nside > 0);
+    for (i=0; i<N; i++)
+        hps[i] = xyz_to_hpl(xyz[3*i], xyz[3*i+1], xyz[3*i+2], Nside);
+}
+
+void radecdegtohealpixl_array(const double* ra, const double* dec, size_t N,
+                              int Nside, int64_t* hps) {
+    size_t i;
+    assert(Nside > 0);
+    for (i=0; i<N; i++) {
+        double r = deg2rad(ra[i]);
+        double d = deg2rad(dec[i]);
+        hps[i] = xyz_to_hpl(radec2x(r, d), radec2y(r, d), radec2z(r, d), Nside);
+    }
+}
+
 static void hp_to_xyz(hp_t* hp, int Nside,
                       double dx, double dy, 
                       double* rx, double *ry, double *rz) {
@@ -1145,6 +1224,29 @@ void healpixl_to_xyzarr(int64_t ihp, int Nside, double dx, double dy,
     hp_to_xyz(&hp, Nside, dx, dy, xyz, xyz+1, xyz+2);
 }
 
+void healpixl_to_xyzarr_array(const int64_t* hps, size_t N, int Nside,
+                              double dx, double dy, double* xyz) {
+    size_t i;
+    for (i=0; i<N; i++) {
+        hp_t hp;
+        longtohp(hps[i], &hp, Nside);
+        hp_to_xyz(&hp, Nside, dx, dy, xyz + 3*i, xyz + 3*i+1, xyz + 3*i+2);
+    }
+}
+
+void healpixl_to_radecdeg_array(const int64_t* hps, size_t N, int Nside,
+                                double dx, double dy,
+                                double* ra, double* dec) {
+    size_t i;
+    for (i=0; i<N; i++) {
+        hp_t hp;
+        double xyz[3];
+        longtohp(hps[i], &hp, Nside);
+        hp_to_xyz(&hp, Nside, dx, dy, xyz, xyz+1, xyz+2);
+        xyzarr2radecdeg(xyz, ra + i, dec + i);
+    }
+}
+
 void healpix_to_radec(int hp, int Nside,
                       double dx, double dy,
                       double* ra, double* dec) {
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "healpix.h"
@@ -23,6 +24,7 @@
 #include "fitstable.h"
 #include "ioutils.h"
 #include "mathutil.h"
+#include "permutedsort.h"
 
 /**
  Accepts a list of input FITS tables, all with exactly the same
@@ -34,7 +36,7 @@
  rows that are within (or within range) of the healpix.
  */
 
-const char* OPTIONS = "hvn:r:d:m:o:gc:e:t:b:RC";
+const char* OPTIONS = "hvn:r:d:m:o:gc:e:t:b:RCw:";
 
 void printHelp(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -51,6 +53,7 @@ void printHelp(char* progname) {
            "    [-C]: close output files after each input file has been read\n"
            "    [-t <temp-dir>]: use the given temp dir; default is /tmp\n"
            "    [-b <backref-file>]: save the filenumber->filename map in this file; enables writing backreferences too\n"
+           "    [-w <threads>]: find the healpixes of the rows on this many threads; default 1\n"
            "    [-v]: +verbose\n"
            "\n\n\n"
            "WARNING: The input FITS files MUST have EXACTLY the same format!!",
@@ -64,13 +67,149 @@ struct cap_s {
 };
 typedef struct cap_s cap_t;
 
-static int refill_rowbuffer(void* baton, void* buffer,
-                            unsigned int offset, unsigned int nelems) {
-    fitstable_t* table = baton;
-    //printf("refill_rowbuffer: offset %i, n %i\n", offset, nelems);
-    return fitstable_read_nrows_data(table, offset, nelems, buffer);
+// Rows are read, and their healpixes found, in batches of about this
+// many bytes.
+#define BATCH_BYTES (32 * 1024 * 1024)
+
+struct splitter_s {
+    int nside;
+    int NHP;
+    double margin;
+    cap_t* mincaps;
+    cap_t* maxcaps;
+    // For each healpix, the healpixes whose maxcaps can reach into it,
+    // in increasing order.
+    int** neighbours;
+    int* nneighbours;
+};
+typedef struct splitter_s splitter_t;
+
+// Finds, for each healpix, the healpixes whose maxcaps overlap its own
+// maxcap (which contains the whole healpix), so that each row only has
+// to be tested against those.
+static void find_neighbours(splitter_t* sp) {
+    double rmax = 0.0;
+    il* cands = il_new(64);
+    int i, j;
+    sp->neighbours = calloc(sp->NHP, sizeof(int*));
+    sp->nneighbours = calloc(sp->NHP, sizeof(int));
+    for (i=0; i<sp->NHP; i++)
+        rmax = MAX(rmax, sqrt(sp->maxcaps[i].r2));
+    for (i=0; i<sp->NHP; i++) {
+        double ri = sqrt(sp->maxcaps[i].r2);
+        il_remove_all(cands);
+        if (ri + rmax >= 2.0) {
+            for (j=0; j<sp->NHP; j++)
+                il_append(cands, j);
+        } else {
+            healpix_rangesearch_xyz(sp->maxcaps[i].xyz, dist2deg(ri + rmax),
+                                    sp->nside, cands);
+            il_append(cands, i);
+        }
+        sp->neighbours[i] = malloc(il_size(cands) * sizeof(int));
+        for (j=0; j<il_size(cands); j++) {
+            int hp = il_get(cands, j);
+            double d2 = distsq(sp->maxcaps[i].xyz, sp->maxcaps[hp].xyz, 3);
+            if (d2 > square(ri + sqrt(sp->maxcaps[hp].r2)))
+                continue;
+            sp->neighbours[i][sp->nneighbours[i]++] = hp;
+        }
+        qsort(sp->neighbours[i], sp->nneighbours[i], sizeof(int), compare_ints_asc);
+        // drop duplicates
+        if (sp->nneighbours[i]) {
+            int n = 1;
+            for (j=1; j<sp->nneighbours[i]; j++)
+                if (sp->neighbours[i][j] != sp->neighbours[i][n-1])
+                    sp->neighbours[i][n++] = sp->neighbours[i][j];
+            sp->nneighbours[i] = n;
+        }
+        logverb("Healpix %i: %i neighbours\n", i, sp->nneighbours[i]);
+    }
+    il_free(cands);
 }
 
+// Appends to "hps" the healpixes that the given point belongs in.
+static void classify_row(const splitter_t* sp, double ra, double dec, il* hps) {
+    double xyz[3];
+    const int* nb;
+    int n, k;
+
+    if (sp->margin == 0) {
+        il_append(hps, radecdegtohealpix(ra, dec, sp->nside));
+        return;
+    }
+    radecdeg2xyzarr(ra, dec, xyz);
+    n = xyzarrtohealpix(xyz, sp->nside);
+    nb = sp->neighbours[n];
+    n = sp->nneighbours[n];
+    for (k=0; k<n; k++) {
+        int j = nb[k];
+        if (distsq(xyz, sp->mincaps[j].xyz, 3) <= sp->mincaps[j].r2) {
+            il_append(hps, j);
+            return;
+        }
+    }
+    for (k=0; k<n; k++) {
+        int j = nb[k];
+        if ((distsq(xyz, sp->maxcaps[j].xyz, 3) <= sp->maxcaps[j].r2) &&
+            healpix_within_range_of_xyz(j, sp->nside, xyz, sp->margin))
+            il_append(hps, j);
+    }
+}
+
+struct classify_s {
+    const splitter_t* sp;
+    const double* radec;
+    int nrows;
+    // number of healpixes for each row
+    int* nhps;
+    // healpixes of the rows in each chunk
+    il** chunkhps;
+    int nchunks;
+    int next;
+};
+
+static int chunk_start(const struct classify_s* c, int k) {
+    return (int)((int64_t)c->nrows * k / c->nchunks);
+}
+
+static void* classify_worker(void* arg) {
+    struct classify_s* c = arg;
+    for (;;) {
+        int k = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+        int r, lo, hi;
+        if (k >= c->nchunks)
+            break;
+        lo = chunk_start(c, k);
+        hi = chunk_start(c, k+1);
+        for (r=lo; r<hi; r++) {
+            int n0 = il_size(c->chunkhps[k]);
+            classify_row(c->sp, c->radec[2*r], c->radec[2*r+1], c->chunkhps[k]);
+            c->nhps[r] = il_size(c->chunkhps[k]) - n0;
+        }
+    }
+    return NULL;
+}
+
+// Finds the healpixes of a batch of rows, in "nchunks" contiguous
+// chunks, on up to "nchunks" threads.
+static void classify_rows(struct classify_s* c) {
+    pthread_t* threads;
+    int i, nstarted = 0;
+    c->next = 0;
+    for (i=0; i<c->nchunks; i++)
+        il_remove_all(c->chunkhps[i]);
+    threads = malloc(MAX(1, c->nchunks - 1) * sizeof(pthread_t));
+    for (i=0; i<c->nchunks-1; i++) {
+        if (pthread_create(threads + nstarted, NULL, classify_worker, c))
+            break;
+        nstarted++;
+    }
+    classify_worker(c);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
 
 int main(int argc, char *argv[]) {
     int argchar;
@@ -92,6 +231,9 @@ int main(int argc, char *argv[]) {
     anbool ringindex = FALSE;
     anbool closefiles = FALSE;
     off_t* resume_offsets = NULL;
+    int nthreads = 1;
+    splitter_t sp;
+    struct classify_s cl;
     
     fitstable_t* intable;
     fitstable_t* intable2;
@@ -108,6 +250,9 @@ int main(int argc, char *argv[]) {
         case 'C':
             closefiles = TRUE;
             break;
+        case 'w':
+            nthreads = MAX(1, atoi(optarg));
+            break;
         case 'R':
             ringindex = TRUE;
             break;
@@ -278,6 +423,22 @@ int main(int argc, char *argv[]) {
         assert(r2a >= r2b);
     }
 
+    memset(&sp, 0, sizeof(splitter_t));
+    sp.nside = nside;
+    sp.NHP = NHP;
+    sp.margin = margin;
+    sp.mincaps = mincaps;
+    sp.maxcaps = maxcaps;
+    if (margin != 0)
+        find_neighbours(&sp);
+
+    memset(&cl, 0, sizeof(struct classify_s));
+    cl.sp = &sp;
+    cl.nchunks = nthreads;
+    cl.chunkhps = malloc(nthreads * sizeof(il*));
+    for (i=0; i<nthreads; i++)
+        cl.chunkhps[i] = il_new(4096);
+
     if (backref) {
         fitstable_t* tab = fitstable_open_for_writing(backref);
         int maxlen = 0;
@@ -321,10 +482,12 @@ int main(int argc, char *argv[]) {
     for (i=0; i<sl_size(infns); i++) {
         char* infn = sl_get(infns, i);
         char* originfn = infn;
-        int r, NR;
+        int r, r0, NR;
+        int k, ihp;
         tfits_type any, dubl;
-        il* hps = NULL;
-        bread_t* rowbuf;
+        char* rowblock;
+        double* radec;
+        int B;
         int R;
         char* tempfn = NULL;
         char* padrowdata = NULL;
@@ -370,89 +533,60 @@ int main(int argc, char *argv[]) {
         fitstable_add_read_column_struct(intable, dubl, 1, 0, any, racol, TRUE);
         fitstable_add_read_column_struct(intable, dubl, 1, sizeof(double), any, deccol, TRUE);
 
-        fitstable_use_buffered_reading(intable, 2*sizeof(double), 1000);
-
         R = fitstable_row_size(intable);
-        rowbuf = buffered_read_new(R, 1000, NR, refill_rowbuffer, intable);
 
         if (fitstable_read_extension(intable, 1)) {
             ERROR("Failed to find RA and DEC columns (called \"%s\" and \"%s\" in the FITS file)", racol, deccol);
             exit(-1);
         }
 
+        B = MAX(1, MIN(NR, BATCH_BYTES / MAX(1, R)));
+        rowblock = malloc((size_t)B * R);
+        radec = malloc((size_t)B * 2 * sizeof(double));
+        cl.nhps = malloc(B * sizeof(int));
+        assert(rowblock && radec && cl.nhps);
+        cl.radec = radec;
+
+        r0 = 0;
+        cl.nrows = 0;
+        k = 0;
+        ihp = 0;
         for (r=0; r<NR; r++) {
             int hp = -1;
-            double ra, dec;
             int j;
-            double* rd;
             void* rowdata;
             void* rdata;
             anbool flipped;
-
-            if (r && ((r % 100000) == 0)) {
-                logmsg("Reading row %i of %i\n", r, NR);
-            }
-
-            //printf("reading RA,Dec for row %i\n", r);
-            rd = fitstable_next_struct(intable);
-            ra = rd[0];
-            dec = rd[1];
-
-            logverb("row %i: ra,dec %g,%g\n", r, ra, dec);
-            if (margin == 0) {
-                hp = radecdegtohealpix(ra, dec, nside);
-                logverb("  --> healpix %i\n", hp);
-            } else {
-
-                double xyz[3];
-                anbool gotit = FALSE;
-                double d2;
-                if (!hps)
-                    hps = il_new(4);
-                radecdeg2xyzarr(ra, dec, xyz);
-                for (j=0; j<NHP; j++) {
-                    d2 = distsq(xyz, mincaps[j].xyz, 3);
-                    if (d2 <= mincaps[j].r2) {
-                        logverb("  -> in mincap %i  (dist %g vs %g)\n", j, sqrt(d2), sqrt(mincaps[j].r2));
-                        il_append(hps, j);
-                        gotit = TRUE;
-                        break;
-                    }
-                }
-                if (!gotit) {
-                    for (j=0; j<NHP; j++) {
-                        d2 = distsq(xyz, maxcaps[j].xyz, 3);
-                        if (d2 <= maxcaps[j].r2) {
-                            logverb("  -> in maxcap %i  (dist %g vs %g)\n", j, sqrt(d2), sqrt(maxcaps[j].r2));
-                            if (healpix_within_range_of_xyz(j, nside, xyz, margin)) {
-                                logverb("  -> and within range.\n");
-                                il_append(hps, j);
-                            }
-                        }
-                    }
+            il* hps;
+
+            if (r == r0 + cl.nrows) {
+                // read the next batch of rows and find their healpixes.
+                r0 = r;
+                cl.nrows = MIN(B, NR - r0);
+                if (r0)
+                    logmsg("Reading row %i of %i\n", r0, NR);
+                if (fitstable_read_nrows_data(intable, r0, cl.nrows, rowblock) ||
+                    fitstable_read_structs(intable, radec, 2*sizeof(double), r0, cl.nrows)) {
+                    ERROR("Failed to read rows %i to %i of input table \"%s\"",
+                          r0, r0 + cl.nrows, infn);
+                    exit(-1);
                 }
-
-                //hps = healpix_rangesearch_radec(ra, dec, margin, nside, hps);
-
-                logverb("  --> healpixes: [");
-                for (j=0; j<il_size(hps); j++)
-                    logverb(" %i", il_get(hps, j));
-                logverb(" ]\n");
+                classify_rows(&cl);
+                k = 0;
+                ihp = 0;
             }
+            while (r - r0 >= chunk_start(&cl, k+1)) {
+                k++;
+                ihp = 0;
+            }
+            hps = cl.chunkhps[k];
 
-            //printf("Reading rowdata for row %i\n", r);
-            rowdata = buffered_read(rowbuf);
-            assert(rowdata);
+            logverb("row %i: ra,dec %g,%g\n", r, radec[2*(r-r0)], radec[2*(r-r0)+1]);
+            rowdata = rowblock + (size_t)(r - r0) * R;
 
             flipped = FALSE;
-            j=0;
-            while (1) {
-                if (hps) {
-                    if (j >= il_size(hps))
-                        break;
-                    hp = il_get(hps, j);
-                    j++;
-                }
+            for (j=0; j<cl.nhps[r - r0]; j++) {
+                hp = il_get(hps, ihp++);
                 assert(hp < NHP);
                 assert(hp >= 0);
 
@@ -553,21 +687,13 @@ int main(int argc, char *argv[]) {
                     }
                 }
 
-                if (!hps)
-                    break;
             }
-            if (hps)
-                il_remove_all(hps);
-
         }
-        buffered_read_free(rowbuf);
-        // wack... buffered_read_free() just frees its internal buffer,
-        // not the "rowbuf" struct itself.
-        // who wrote this crazy code?  Oh, me of 5 years ago.  Jerk.
-        free(rowbuf);
+        free(rowblock);
+        free(radec);
+        free(cl.nhps);
 
         fitstable_close(intable);
-        il_free(hps);
 
         if (tempfn) {
             logverb("Removing temp file %s\n", tempfn);
@@ -584,7 +710,12 @@ int main(int argc, char *argv[]) {
             if (closefiles && (outtables[ii]->fid == NULL))
                 continue;
 
-            off_t offset = ftello(outtables[ii]->fid);
+            off_t offset;
+            if (fitstable_flush(outtables[ii])) {
+                ERROR("Failed to write rows for healpix %i", ii);
+                exit(-1);
+            }
+            offset = ftello(outtables[ii]->fid);
             if (closefiles) {
                 resume_offsets[ii] = offset;
                 logverb("Closing healpix %i (saving offset %lu)\n", ii, (long)offset);
@@ -642,6 +773,15 @@ int main(int argc, char *argv[]) {
 
     free(mincaps);
     free(maxcaps);
+    if (sp.neighbours) {
+        for (i=0; i<NHP; i++)
+            free(sp.neighbours[i]);
+        free(sp.neighbours);
+        free(sp.nneighbours);
+    }
+    for (i=0; i<nthreads; i++)
+        il_free(cl.chunkhps[i]);
+    free(cl.chunkhps);
 
     free(resume_offsets);
     
@@ -19,17 +19,20 @@
 #include "errors.h"
 #include "log.h"
 #include "mathutil.h"
+#include "tic.h"
 
-static float* upconvert(unsigned char* u8,
-                        int nx, int ny) {
-    int i;
-    float* f = malloc((size_t)nx * (size_t)ny * sizeof(float));
+// Smooths and downsamples a u8 image straight into a new float image.
+static float* rebin_u8(const unsigned char* u8,
+                       int W, int H, int S,
+                       int* newW, int* newH) {
+    float* f;
+    get_output_image_size(W, H, S, EDGE_AVERAGE, newW, newH);
+    f = malloc((size_t)(*newW) * (size_t)(*newH) * sizeof(float));
     if (!f) {
-        SYSERROR("Failed to allocate image array to upconvert u8 image to floating-point.");
+        SYSERROR("Failed to allocate image array to downsample u8 image.");
         return NULL;
     }
-    for (i=0; i<(nx*ny); i++)
-        f[i] = u8[i];
+    dsmooth2_average_u8(u8, W, H, S, S, f);
     return f;
 }
 
@@ -54,21 +57,25 @@ int image2xy_run(simplexy_t* s,
                  int downsample, int downsample_as_required) {
     int newW, newH;
     anbool free_fimage = FALSE;
+    // the caller's u8 image, which we put back when we're done.
+    unsigned char* image_u8 = s->image_u8;
     // the factor by which to downsample.
     int S = downsample ? downsample : 1;
     int jj;
     anbool tryagain;
     int rtn = -1;
 
+    PROFILE_BEGIN("image2xy");
     if (downsample && downsample > 1) {
         logmsg("Downsampling by %i...\n", S);
-        if (!s->image) {
-            s->image = upconvert(s->image_u8, s->nx, s->ny);
+        if (s->image_u8) {
+            s->image = rebin_u8(s->image_u8, s->nx, s->ny, S, &newW, &newH);
+            if (!s->image)
+                goto bailout;
             free_fimage = TRUE;
-        }
-        if (!s->image)
-            goto bailout;
-        rebin(&s->image, s->nx, s->ny, S, &newW, &newH);
+            s->image_u8 = NULL;
+        } else
+            rebin(&s->image, s->nx, s->ny, S, &newW, &newH);
         s->nx = newW;
         s->ny = newH;
     }
@@ -81,13 +88,14 @@ int image2xy_run(simplexy_t* s,
             downsample_as_required) {
             logmsg("Downsampling by 2...\n");
             if (s->image_u8) {
-                s->image = upconvert(s->image_u8, s->nx, s->ny);
+                s->image = rebin_u8(s->image_u8, s->nx, s->ny, 2,
+                                    &newW, &newH);
                 if (!s->image)
                     goto bailout;
                 free_fimage = TRUE;
                 s->image_u8 = NULL;
-            }
-            rebin(&s->image, s->nx, s->ny, 2, &newW, &newH);
+            } else
+                rebin(&s->image, s->nx, s->ny, 2, &newW, &newH);
             s->nx = newW;
             s->ny = newH;
             S *= 2;
@@ -111,7 +119,9 @@ int image2xy_run(simplexy_t* s,
     if (free_fimage) {
         free(s->image);
         s->image = NULL;
+        s->image_u8 = image_u8;
     }
+    PROFILE_END("image2xy");
     return rtn;
 }
 
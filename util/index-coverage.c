@@ -0,0 +1,193 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "os-features.h"
+#include "index-coverage.h"
+#include "healpix.h"
+#include "healpix-utils.h"
+#include "fitstable.h"
+#include "fitsioutils.h"
+#include "starutil.h"
+#include "ioutils.h"
+#include "errors.h"
+#include "log.h"
+
+#define MAX_COVERAGE_NSIDE 256
+
+int index_coverage_nside(double quadsize_arcsec) {
+    int nside = 1;
+    while (nside < MAX_COVERAGE_NSIDE &&
+           healpix_side_length_arcmin(2 * nside) * 60.0 >= quadsize_arcsec)
+        nside *= 2;
+    return nside;
+}
+
+static int compare_int64_asc(const void* v1, const void* v2) {
+    int64_t a = *(const int64_t*)v1;
+    int64_t b = *(const int64_t*)v2;
+    return (a > b) - (a < b);
+}
+
+ll* index_coverage_from_xyz(const double* xyz, int N, int nside) {
+    ll* ranges = ll_new(256);
+    int64_t* hps;
+    int64_t* all;
+    size_t nall = 0;
+    size_t i;
+    int j;
+
+    hps = malloc((size_t)MAX(N, 1) * sizeof(int64_t));
+    xyzarrtohealpixl_array(xyz, N, nside, hps);
+    qsort(hps, N, sizeof(int64_t), compare_int64_asc);
+    // the distinct pixels, and their neighbours.
+    all = malloc((size_t)MAX(N, 1) * 9 * sizeof(int64_t));
+    for (i=0; i<(size_t)N; i++) {
+        int neigh[8];
+        int nn;
+        if (i && hps[i] == hps[i-1])
+            continue;
+        all[nall++] = hps[i];
+        nn = healpix_get_neighbours((int)hps[i], neigh, nside);
+        for (j=0; j<nn; j++)
+            all[nall++] = neigh[j];
+    }
+    free(hps);
+    qsort(all, nall, sizeof(int64_t), compare_int64_asc);
+    for (i=0; i<nall; i++) {
+        size_t n = ll_size(ranges);
+        if (n && all[i] <= ll_get(ranges, n-1)) {
+            if (all[i] == ll_get(ranges, n-1))
+                ll_set(ranges, n-1, all[i] + 1);
+            continue;
+        }
+        ll_append(ranges, all[i]);
+        ll_append(ranges, all[i] + 1);
+    }
+    free(all);
+    return ranges;
+}
+
+int index_coverage_write_to(const ll* ranges, int nside, FILE* fid) {
+    fitstable_t* tab;
+    qfits_header* hdr;
+    tfits_type i64 = fitscolumn_i64_type();
+    size_t i;
+
+    tab = fitstable_open_for_appending_to(fid);
+    if (!tab) {
+        ERROR("Failed to start coverage table");
+        return -1;
+    }
+    fitstable_add_write_column(tab, i64, "LO", "");
+    fitstable_add_write_column(tab, i64, "HI", "");
+    hdr = fitstable_get_header(tab);
+    qfits_header_add(hdr, "AN_FILE", AN_FILETYPE_COVERAGE,
+                     "Sky coverage of the index", NULL);
+    fits_header_add_int(hdr, "COVNSIDE", nside,
+                        "Healpix Nside of the coverage ranges");
+    if (fitstable_write_header(tab)) {
+        ERROR("Failed to write coverage table header");
+        goto bailout;
+    }
+    for (i=0; i+1<ll_size(ranges); i+=2) {
+        int64_t lo = ll_get((ll*)ranges, i);
+        int64_t hi = ll_get((ll*)ranges, i+1);
+        if (fitstable_write_row(tab, &lo, &hi)) {
+            ERROR("Failed to write coverage range");
+            goto bailout;
+        }
+    }
+    if (fitstable_fix_header(tab)) {
+        ERROR("Failed to fix coverage table header");
+        goto bailout;
+    }
+    // clear this so that fitstable_close() doesn't fclose() it.
+    tab->fid = NULL;
+    fitstable_close(tab);
+    return 0;
+ bailout:
+    tab->fid = NULL;
+    fitstable_close(tab);
+    return -1;
+}
+
+int index_coverage_read(anqfits_t* fits, int* nside, int64_t** ranges,
+                        int* nranges) {
+    fitstable_t* tab;
+    int64_t* lo;
+    int64_t* hi;
+    int next, ext, i, N;
+
+    next = anqfits_n_ext(fits);
+    for (ext=1; ext<next; ext++) {
+        const qfits_header* hdr = anqfits_get_header_const(fits, ext);
+        char* type;
+        anbool eq;
+        if (!hdr)
+            continue;
+        type = fits_get_dupstring(hdr, "AN_FILE");
+        eq = streq(type, AN_FILETYPE_COVERAGE);
+        free(type);
+        if (eq)
+            break;
+    }
+    if (ext >= next)
+        return 1;
+
+    tab = fitstable_open_extension_2(fits->filename, ext);
+    if (!tab) {
+        ERROR("Failed to open coverage table in %s", fits->filename);
+        return -1;
+    }
+    *nside = qfits_header_getint(fitstable_get_header(tab), "COVNSIDE", -1);
+    N = fitstable_nrows(tab);
+    lo = fitstable_read_column(tab, "LO", fitscolumn_i64_type());
+    hi = fitstable_read_column(tab, "HI", fitscolumn_i64_type());
+    fitstable_close(tab);
+    if (*nside < 1 || (N && (!lo || !hi))) {
+        ERROR("Failed to read coverage table in %s", fits->filename);
+        free(lo);
+        free(hi);
+        return -1;
+    }
+    *ranges = malloc((size_t)MAX(N, 1) * 2 * sizeof(int64_t));
+    for (i=0; i<N; i++) {
+        (*ranges)[2*i  ] = lo[i];
+        (*ranges)[2*i+1] = hi[i];
+    }
+    *nranges = N;
+    free(lo);
+    free(hi);
+    return 0;
+}
+
+anbool index_coverage_overlaps(const int64_t* ranges, int nranges,
+                               const ll* hps) {
+    size_t i = 0;
+    int j = 0;
+    // walk the two sorted lists of ranges, looking for an overlap.
+    while (i+1 < ll_size(hps) && j < nranges) {
+        int64_t lo = ll_get((ll*)hps, i);
+        int64_t hi = ll_get((ll*)hps, i+1);
+        if (hi <= ranges[2*j])
+            i += 2;
+        else if (ranges[2*j+1] <= lo)
+            j++;
+        else
+            return TRUE;
+    }
+    return FALSE;
+}
+
+anbool index_coverage_intersects(int nside, const int64_t* ranges,
+                                 int nranges, const double* xyz,
+                                 double radius_deg) {
+    ll* disc = healpix_disc_ranges(xyz, radius_deg, nside, NULL);
+    anbool hit = index_coverage_overlaps(ranges, nranges, disc);
+    ll_free(disc);
+    return hit;
+}
@@ -0,0 +1,547 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "index-heatmap.h"
+#include "index.h"
+#include "kdtree.h"
+#include "kdtree_fits_io.h"
+#include "anqfits.h"
+#include "fitsioutils.h"
+#include "ioutils.h"
+#include "an-thread.h"
+#include "errors.h"
+#include "log.h"
+
+// Quad and star records are counted by blocks of about this many bytes.
+#define HEAT_BLOCK_BYTES 4096
+
+static const char* array_names[INDEX_HEAT_N] = {
+    "quads", "stars", "codekd", "starkd"
+};
+
+struct index_heatmap {
+    char* indexfn;
+    int rate;
+    uint64_t tick;
+    uint64_t nsampled;
+    int64_t nrecords[INDEX_HEAT_N];
+    int recbytes[INDEX_HEAT_N];
+    int perblock[INDEX_HEAT_N];
+    off_t offset[INDEX_HEAT_N];
+    int64_t nblocks[INDEX_HEAT_N];
+    uint32_t* counts[INDEX_HEAT_N];
+    // the kd-tree node tables: names, and (offset, size) pairs.
+    sl* tablenames;
+    int64_t* tables;
+    // for finding the leaves that hold codes and stars; the inverse
+    // permutations are looked up each time, since they can be computed
+    // after the heatmap is made.
+    const codetree_t* codekd;
+    const startree_t* starkd;
+    // the counts are allocated on the first sample, since indexes are
+    // often loaded just for their metadata.
+    pthread_mutex_t lock;
+    anbool allocated;
+};
+
+// process-wide settings; see index_heatmap_set_dir().
+AN_THREAD_DECLARE_STATIC_MUTEX(settings_lock);
+static char* heatmap_dir = NULL;
+static int heatmap_rate = 1;
+
+int index_heatmap_set_dir(const char* dir, int rate) {
+    if (dir && mkdir_p(dir)) {
+        ERROR("Failed to create heatmap directory \"%s\"", dir);
+        return -1;
+    }
+    AN_THREAD_LOCK(settings_lock);
+    free(heatmap_dir);
+    heatmap_dir = dir ? strdup(dir) : NULL;
+    heatmap_rate = (rate > 1) ? rate : 1;
+    AN_THREAD_UNLOCK(settings_lock);
+    return 0;
+}
+
+const char* index_heatmap_get_dir(void) {
+    return heatmap_dir;
+}
+
+const char* index_heatmap_array_name(int array) {
+    if (array < 0 || array >= INDEX_HEAT_N)
+        return NULL;
+    return array_names[array];
+}
+
+char* index_heatmap_filename(const char* dir, const char* indexfn) {
+    char* base = basename_safe(indexfn);
+    char* fn;
+    asprintf_safe(&fn, "%s/%s.heat", dir, base);
+    free(base);
+    return fn;
+}
+
+// Finds the table in "fits" that has column "name"; returns 0 on success.
+static int find_table(const anqfits_t* fits, const char* name,
+                      off_t* start, off_t* size) {
+    int i;
+    if (!fits)
+        return -1;
+    for (i=1; i<anqfits_n_ext(fits); i++) {
+        const qfits_table* table = anqfits_get_table_const(fits, i);
+        if (!table || fits_find_column(table, name) == -1)
+            continue;
+        return anqfits_get_data_start_and_size(fits, i, start, size);
+    }
+    return -1;
+}
+
+static void set_array(index_heatmap_t* hm, int a, int64_t nrecords,
+                      int recbytes, int perblock, off_t offset) {
+    hm->nrecords[a] = nrecords;
+    hm->recbytes[a] = recbytes;
+    hm->perblock[a] = MAX(1, perblock);
+    hm->offset[a] = offset;
+    hm->nblocks[a] = (nrecords + hm->perblock[a] - 1) / hm->perblock[a];
+}
+
+// The bytes of the node tables per node.
+static int node_bytes(const kdtree_t* kd) {
+    if (!kd->nnodes)
+        return 0;
+    return (kdtree_sizeof_lr(kd) + kdtree_sizeof_bb(kd) +
+            kdtree_sizeof_split(kd) + kdtree_sizeof_splitdim(kd)) / kd->nnodes;
+}
+
+static void add_tree_tables(index_heatmap_t* hm, const anqfits_t* fits,
+                            const kdtree_t* kd, int64_t** tables) {
+    const char* names[] = { KD_STR_LR, KD_STR_BB, KD_STR_SPLIT,
+                            KD_STR_SPLITDIM, KD_STR_BB_VEB, KD_STR_SPLIT_VEB,
+                            KD_STR_SPLITDIM_VEB };
+    size_t i;
+    for (i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        char* name;
+        off_t start, size;
+        int n;
+        asprintf_safe(&name, "%s_%s", names[i], kd->name);
+        if (find_table(fits, name, &start, &size)) {
+            free(name);
+            continue;
+        }
+        n = sl_size(hm->tablenames);
+        *tables = realloc(*tables, (n + 1) * 2 * sizeof(int64_t));
+        (*tables)[2*n] = start;
+        (*tables)[2*n+1] = size;
+        sl_append_nocopy(hm->tablenames, name);
+    }
+}
+
+index_heatmap_t* index_heatmap_new(const index_t* index, int rate) {
+    index_heatmap_t* hm;
+    const kdtree_t* ckd = index->codekd->tree;
+    const kdtree_t* skd = index->starkd->tree;
+    off_t start, size;
+    char* name;
+    int recbytes;
+
+    hm = calloc(1, sizeof(index_heatmap_t));
+    hm->indexfn = strdup(index->indexfn);
+    hm->rate = (rate > 1) ? rate : 1;
+    hm->codekd = index->codekd;
+    hm->starkd = index->starkd;
+    hm->tablenames = sl_new(8);
+    pthread_mutex_init(&hm->lock, NULL);
+
+    recbytes = index->quads->dimquads * sizeof(uint32_t);
+    set_array(hm, INDEX_HEAT_QUADS, index->quads->numquads, recbytes,
+              HEAT_BLOCK_BYTES / recbytes,
+              find_table(index->fits, "quads", &start, &size) ? -1 : start);
+
+    recbytes = skd->ndata ? kdtree_sizeof_data(skd) / skd->ndata : 1;
+    asprintf_safe(&name, "%s_%s", KD_STR_DATA, skd->name);
+    set_array(hm, INDEX_HEAT_STARS, skd->ndata, recbytes,
+              HEAT_BLOCK_BYTES / MAX(1, recbytes),
+              find_table(index->fits, name, &start, &size) ? -1 : start);
+    free(name);
+
+    set_array(hm, INDEX_HEAT_CODEKD, ckd->nnodes, node_bytes(ckd), 1, -1);
+    set_array(hm, INDEX_HEAT_STARKD, skd->nnodes, node_bytes(skd), 1, -1);
+    add_tree_tables(hm, index->fits, ckd, &hm->tables);
+    add_tree_tables(hm, index->fits, skd, &hm->tables);
+    return hm;
+}
+
+void index_heatmap_free(index_heatmap_t* hm) {
+    int a;
+    if (!hm)
+        return;
+    for (a=0; a<INDEX_HEAT_N; a++)
+        free(hm->counts[a]);
+    sl_free2(hm->tablenames);
+    free(hm->tables);
+    free(hm->indexfn);
+    pthread_mutex_destroy(&hm->lock);
+    free(hm);
+}
+
+void index_heatmap_attach(index_t* index) {
+    char* dir = NULL;
+    int rate;
+    if (index->heatmap || !index->codekd || !index->quads || !index->starkd)
+        return;
+    AN_THREAD_LOCK(settings_lock);
+    if (heatmap_dir)
+        dir = strdup(heatmap_dir);
+    rate = heatmap_rate;
+    AN_THREAD_UNLOCK(settings_lock);
+    if (!dir)
+        return;
+    index->heatmap = index_heatmap_new(index, rate);
+    index->heatmap_dir = dir;
+    if (!index->starkd->heatmap)
+        index->starkd->heatmap = index->heatmap;
+}
+
+void index_heatmap_detach(index_t* index) {
+    char* fn;
+    if (!index->heatmap)
+        return;
+    // (nothing to add if the index was only loaded for its metadata.)
+    if (index->heatmap->nsampled) {
+        // (index_close() has freed "indexfn" by now.)
+        fn = index_heatmap_filename(index->heatmap_dir,
+                                    index->heatmap->indexfn);
+        if (index_heatmap_flush(index->heatmap, fn))
+            logmsg("Failed to write the heatmap of index %s.\n",
+                   index->heatmap->indexfn);
+        else
+            logverb("Wrote heatmap %s\n", fn);
+        free(fn);
+    }
+    if (index->starkd && index->starkd->heatmap == index->heatmap)
+        index->starkd->heatmap = NULL;
+    index_heatmap_free(index->heatmap);
+    index->heatmap = NULL;
+    free(index->heatmap_dir);
+    index->heatmap_dir = NULL;
+}
+
+// Is this access one of the sampled ones?
+static anbool sample(index_heatmap_t* hm) {
+    if (hm->rate == 1 ||
+        __atomic_add_fetch(&hm->tick, 1, __ATOMIC_RELAXED) % hm->rate == 0) {
+        if (!__atomic_load_n(&hm->allocated, __ATOMIC_ACQUIRE)) {
+            int a;
+            pthread_mutex_lock(&hm->lock);
+            if (!hm->allocated) {
+                for (a=0; a<INDEX_HEAT_N; a++)
+                    hm->counts[a] = calloc(MAX(1, hm->nblocks[a]),
+                                           sizeof(uint32_t));
+                __atomic_store_n(&hm->allocated, TRUE, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&hm->lock);
+        }
+        __atomic_add_fetch(&hm->nsampled, 1, __ATOMIC_RELAXED);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void count(index_heatmap_t* hm, int a, int64_t block) {
+    if (block < 0 || block >= hm->nblocks[a])
+        return;
+    __atomic_add_fetch(hm->counts[a] + block, 1, __ATOMIC_RELAXED);
+}
+
+// Counts the leaf of "kd" that holds data point "pos" (in tree order),
+// and its ancestors.
+static void count_leaf(index_heatmap_t* hm, int a, const kdtree_t* kd,
+                       int pos) {
+    int lo, hi, node;
+    if (pos < 0 || pos >= kd->ndata || !kd->nnodes)
+        return;
+    // the last leaf whose first point is at or before "pos".
+    lo = kd->ninterior;
+    hi = kd->nnodes - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (kdtree_leaf_left(kd, mid) <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    for (node = lo;; node = (node - 1) / 2) {
+        count(hm, a, node);
+        if (!node)
+            break;
+    }
+}
+
+// The position in tree order of point "id", or -1 if it isn't known.
+static int tree_position(const kdtree_t* kd, const int* inverse_perm, int id) {
+    if (inverse_perm)
+        return inverse_perm[id];
+    if (kd->perm)
+        return -1;
+    return id;
+}
+
+void index_heatmap_touch_quad(index_heatmap_t* hm, int quadno) {
+    const kdtree_t* kd = hm->codekd->tree;
+    if (!sample(hm))
+        return;
+    count(hm, INDEX_HEAT_QUADS, quadno / hm->perblock[INDEX_HEAT_QUADS]);
+    if (quadno >= 0 && quadno < kd->ndata)
+        count_leaf(hm, INDEX_HEAT_CODEKD, kd,
+                   tree_position(kd, hm->codekd->inverse_perm, quadno));
+}
+
+void index_heatmap_touch_stars(index_heatmap_t* hm, const int* starids,
+                               int N) {
+    const kdtree_t* kd = hm->starkd->tree;
+    int i;
+    if (!N || !sample(hm))
+        return;
+    for (i=0; i<N; i++) {
+        int pos;
+        if (starids[i] < 0 || starids[i] >= kd->ndata)
+            continue;
+        pos = tree_position(kd, hm->starkd->inverse_perm, starids[i]);
+        // the data are in tree order.
+        if (pos >= 0)
+            count(hm, INDEX_HEAT_STARS, pos / hm->perblock[INDEX_HEAT_STARS]);
+        count_leaf(hm, INDEX_HEAT_STARKD, kd, pos);
+    }
+}
+
+// Does the heatmap read from a file describe the same arrays as "hm"?
+static anbool same_layout(const index_heatmap_t* hm,
+                          const index_heatmap_file_t* hf) {
+    int a;
+    for (a=0; a<INDEX_HEAT_N; a++)
+        if (hf->nrecords[a] != hm->nrecords[a] ||
+            hf->perblock[a] != hm->perblock[a] ||
+            hf->nblocks[a] != hm->nblocks[a])
+            return FALSE;
+    return TRUE;
+}
+
+int index_heatmap_flush(index_heatmap_t* hm, const char* fn) {
+    index_heatmap_file_t* old = NULL;
+    char* lockfn = NULL;
+    char* tmpfn = NULL;
+    FILE* fid = NULL;
+    int lockfd;
+    uint64_t samples;
+    int a, i;
+    int rtn = -1;
+
+    asprintf_safe(&lockfn, "%s.lock", fn);
+    lockfd = open(lockfn, O_RDWR | O_CREAT, 0666);
+    if (lockfd == -1) {
+        SYSERROR("Failed to open heatmap lock file \"%s\"", lockfn);
+        free(lockfn);
+        return -1;
+    }
+    if (flock(lockfd, LOCK_EX)) {
+        SYSERROR("Failed to lock heatmap file \"%s\"", lockfn);
+        goto bailout;
+    }
+    if (file_exists(fn)) {
+        old = index_heatmap_read(fn);
+        if (old && !same_layout(hm, old)) {
+            logmsg("Heatmap \"%s\" is for a different layout of the index; "
+                   "replacing it.\n", fn);
+            index_heatmap_file_free(old);
+            old = NULL;
+        }
+        if (!old)
+            errors_clear_stack();
+    }
+
+    asprintf_safe(&tmpfn, "%s.tmp", fn);
+    fid = fopen(tmpfn, "w");
+    if (!fid) {
+        SYSERROR("Failed to open heatmap file \"%s\" for writing", tmpfn);
+        goto bailout;
+    }
+    samples = hm->nsampled * hm->rate + (old ? old->samples : 0);
+    fprintf(fid, "# astrometry.net index heatmap\n");
+    fprintf(fid, "file %s\n", hm->indexfn);
+    fprintf(fid, "rate %i\n", hm->rate);
+    fprintf(fid, "samples %llu\n", (unsigned long long)samples);
+    for (a=0; a<INDEX_HEAT_N; a++)
+        fprintf(fid, "array %s %lld %i %i %lld\n", array_names[a],
+                (long long)hm->nrecords[a], hm->recbytes[a], hm->perblock[a],
+                (long long)hm->offset[a]);
+    for (i=0; i<sl_size(hm->tablenames); i++)
+        fprintf(fid, "table %s %lld %lld\n", sl_get(hm->tablenames, i),
+                (long long)hm->tables[2*i], (long long)hm->tables[2*i+1]);
+    for (a=0; a<INDEX_HEAT_N; a++) {
+        int64_t b;
+        for (b=0; b<hm->nblocks[a]; b++) {
+            uint64_t c = hm->allocated ?
+                (uint64_t)hm->counts[a][b] * hm->rate : 0;
+            if (old)
+                c += old->counts[a][b];
+            if (c)
+                fprintf(fid, "heat %s %lld %llu\n", array_names[a],
+                        (long long)b, (unsigned long long)c);
+        }
+    }
+    if (fclose(fid)) {
+        fid = NULL;
+        SYSERROR("Failed to write heatmap file \"%s\"", tmpfn);
+        goto bailout;
+    }
+    fid = NULL;
+    if (rename(tmpfn, fn)) {
+        SYSERROR("Failed to rename \"%s\" to \"%s\"", tmpfn, fn);
+        goto bailout;
+    }
+    if (hm->allocated)
+        for (a=0; a<INDEX_HEAT_N; a++)
+            memset(hm->counts[a], 0, hm->nblocks[a] * sizeof(uint32_t));
+    hm->nsampled = 0;
+    rtn = 0;
+
+ bailout:
+    if (fid)
+        fclose(fid);
+    index_heatmap_file_free(old);
+    flock(lockfd, LOCK_UN);
+    close(lockfd);
+    free(lockfn);
+    free(tmpfn);
+    return rtn;
+}
+
+static int array_index(const char* name) {
+    int a;
+    for (a=0; a<INDEX_HEAT_N; a++)
+        if (streq(name, array_names[a]))
+            return a;
+    return -1;
+}
+
+index_heatmap_file_t* index_heatmap_read(const char* fn) {
+    index_heatmap_file_t* hf;
+    sl* lines;
+    size_t i;
+
+    lines = file_get_lines(fn, FALSE);
+    if (!lines) {
+        ERROR("Failed to read heatmap file \"%s\"", fn);
+        return NULL;
+    }
+    hf = calloc(1, sizeof(index_heatmap_file_t));
+    for (i=0; i<sl_size(lines); i++) {
+        char* line = sl_get(lines, i);
+        char name[64];
+        long long n1, n3;
+        unsigned long long c;
+        int n2, n4, a;
+
+        if (!line[0] || line[0] == '#')
+            continue;
+        if (starts_with(line, "file ")) {
+            free(hf->indexfn);
+            hf->indexfn = strdup(line + 5);
+        } else if (sscanf(line, "rate %i", &hf->rate) == 1) {
+        } else if (sscanf(line, "samples %llu", &c) == 1) {
+            hf->samples = c;
+        } else if (sscanf(line, "array %63s %lld %i %i %lld", name, &n1, &n2,
+                          &n4, &n3) == 5) {
+            a = array_index(name);
+            if (a == -1 || n1 < 0 || n4 < 1 || hf->counts[a])
+                goto bad;
+            hf->nrecords[a] = n1;
+            hf->recbytes[a] = n2;
+            hf->perblock[a] = n4;
+            hf->offset[a] = n3;
+            hf->nblocks[a] = (n1 + n4 - 1) / n4;
+            hf->counts[a] = calloc(MAX(1, hf->nblocks[a]), sizeof(uint64_t));
+        } else if (sscanf(line, "table %63s %lld %lld", name, &n1, &n3) == 3) {
+            hf->tables = realloc(hf->tables,
+                                 (hf->ntables + 1) * 2 * sizeof(int64_t));
+            hf->tables[2*hf->ntables] = n1;
+            hf->tables[2*hf->ntables+1] = n3;
+            hf->ntables++;
+        } else if (sscanf(line, "heat %63s %lld %llu", name, &n1, &c) == 3) {
+            a = array_index(name);
+            if (a == -1 || !hf->counts[a] || n1 < 0 || n1 >= hf->nblocks[a])
+                goto bad;
+            hf->counts[a][n1] += c;
+        } else
+            goto bad;
+        continue;
+    bad:
+        ERROR("Heatmap file \"%s\", line %zu: can't parse \"%s\"", fn, i+1,
+              line);
+        sl_free2(lines);
+        index_heatmap_file_free(hf);
+        return NULL;
+    }
+    sl_free2(lines);
+    for (i=0; i<INDEX_HEAT_N; i++)
+        if (!hf->counts[i]) {
+            ERROR("Heatmap file \"%s\" has no \"%s\" array", fn,
+                  array_names[i]);
+            index_heatmap_file_free(hf);
+            return NULL;
+        }
+    return hf;
+}
+
+void index_heatmap_file_free(index_heatmap_file_t* hf) {
+    int a;
+    if (!hf)
+        return;
+    for (a=0; a<INDEX_HEAT_N; a++)
+        free(hf->counts[a]);
+    free(hf->tables);
+    free(hf->indexfn);
+    free(hf);
+}
+
+int index_heatmap_read_hot_list(const char* fn, int64_t** ranges) {
+    sl* lines;
+    size_t i;
+    int n = 0;
+
+    *ranges = NULL;
+    lines = file_get_lines(fn, FALSE);
+    if (!lines) {
+        ERROR("Failed to read hot list \"%s\"", fn);
+        return -1;
+    }
+    *ranges = malloc(MAX(1, sl_size(lines)) * 2 * sizeof(int64_t));
+    for (i=0; i<sl_size(lines); i++) {
+        char* line = sl_get(lines, i);
+        long long off, len;
+        if (!line[0] || line[0] == '#')
+            continue;
+        if (sscanf(line, "%lld %lld", &off, &len) != 2 || off < 0 || len < 0) {
+            ERROR("Hot list \"%s\", line %zu: expected \"<offset> <bytes>\", "
+                  "got \"%s\"", fn, i+1, line);
+            sl_free2(lines);
+            free(*ranges);
+            *ranges = NULL;
+            return -1;
+        }
+        (*ranges)[2*n] = off;
+        (*ranges)[2*n+1] = len;
+        n++;
+    }
+    sl_free2(lines);
+    return n;
+}
@@ -0,0 +1,243 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "index-lookup.h"
+#include "index-coverage.h"
+#include "healpix.h"
+#include "healpix-utils.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "log.h"
+
+// deepest level of the tree: Nside = 2^MAX_LEVEL.
+#define MAX_LEVEL 8
+// distinct coverage-map Nsides whose search discs are kept.
+#define MAX_DISCS 8
+
+struct other_tile {
+    int healpix;
+    int nside;
+    int pos;
+};
+
+struct coverage_map {
+    int nside;
+    // NULL if the index has no coverage map.
+    int64_t* ranges;
+    int nranges;
+};
+
+struct index_lookup_t {
+    // positions of all-sky indexes.
+    il* allsky;
+    // indexes whose Nside isn't in the tree; "struct other_tile"s.
+    bl* others;
+    // levels 0..nlevels-1 of the tree are in use.
+    int nlevels;
+    // [level][healpix (xy scheme)]: positions of the indexes of that tile,
+    // or NULL.
+    il** tiles[MAX_LEVEL+1];
+    // [level][healpix]: does this pixel, or any pixel under it, have
+    // indexes?
+    unsigned char* occupied[MAX_LEVEL+1];
+    // [position]: copies of the indexes' coverage maps.
+    int nindexes;
+    struct coverage_map* coverage;
+};
+
+static int level_of_nside(int nside) {
+    int level;
+    for (level=0; level<=MAX_LEVEL; level++)
+        if (nside == (1 << level))
+            return level;
+    return -1;
+}
+
+static void add_to_tree(index_lookup_t* lookup, int level, int hp, int pos) {
+    int nside = 1 << level;
+    int big, x, y;
+    int l;
+
+    while (lookup->nlevels <= level) {
+        int n = 1 << lookup->nlevels;
+        lookup->tiles[lookup->nlevels] = calloc(12 * n * n, sizeof(il*));
+        lookup->occupied[lookup->nlevels] = calloc(12 * n * n, 1);
+        lookup->nlevels++;
+    }
+    if (!lookup->tiles[level][hp])
+        lookup->tiles[level][hp] = il_new(4);
+    il_append(lookup->tiles[level][hp], pos);
+
+    // mark this pixel and its parents.
+    healpix_decompose_xy(hp, &big, &x, &y, nside);
+    for (l=level; l>=0; l--) {
+        int n = 1 << l;
+        lookup->occupied[l][healpix_compose_xy(big, x, y, n)] = 1;
+        x /= 2;
+        y /= 2;
+    }
+}
+
+index_lookup_t* index_lookup_new(pl* indexes) {
+    index_lookup_t* lookup;
+    int i;
+
+    lookup = calloc(1, sizeof(index_lookup_t));
+    lookup->allsky = il_new(16);
+    lookup->others = bl_new(16, sizeof(struct other_tile));
+    lookup->nindexes = pl_size(indexes);
+    lookup->coverage = calloc(MAX(lookup->nindexes, 1),
+                              sizeof(struct coverage_map));
+
+    for (i=0; i<pl_size(indexes); i++) {
+        index_t* ind = pl_get(indexes, i);
+        int level;
+        if (ind->coverage) {
+            struct coverage_map* c = lookup->coverage + i;
+            size_t sz = (size_t)MAX(ind->ncoverage, 1) * 2 * sizeof(int64_t);
+            c->nside = ind->covnside;
+            c->nranges = ind->ncoverage;
+            c->ranges = malloc(sz);
+            memcpy(c->ranges, ind->coverage, sz);
+        }
+        if (ind->healpix == -1) {
+            il_append(lookup->allsky, i);
+            continue;
+        }
+        level = level_of_nside(ind->hpnside);
+        if (level == -1 || ind->healpix < 0 ||
+            ind->healpix >= 12 * ind->hpnside * ind->hpnside) {
+            struct other_tile t;
+            t.healpix = ind->healpix;
+            t.nside = ind->hpnside;
+            t.pos = i;
+            bl_append(lookup->others, &t);
+            continue;
+        }
+        add_to_tree(lookup, level, ind->healpix, i);
+    }
+    debug("Index lookup: %zu all-sky, %zu others, %i levels\n",
+          il_size(lookup->allsky), bl_size(lookup->others), lookup->nlevels);
+    return lookup;
+}
+
+void index_lookup_free(index_lookup_t* lookup) {
+    int l, i;
+    if (!lookup)
+        return;
+    for (l=0; l<lookup->nlevels; l++) {
+        int n = 1 << l;
+        for (i=0; i<12*n*n; i++)
+            if (lookup->tiles[l][i])
+                il_free(lookup->tiles[l][i]);
+        free(lookup->tiles[l]);
+        free(lookup->occupied[l]);
+    }
+    for (i=0; i<lookup->nindexes; i++)
+        free(lookup->coverage[i].ranges);
+    free(lookup->coverage);
+    il_free(lookup->allsky);
+    bl_free(lookup->others);
+    free(lookup);
+}
+
+/*
+ Could any part of the pixel be within "radius" degrees of "xyz"?  This
+ must never say no when healpix_distance_to_xyz() for the pixel or any
+ pixel inside it would say yes, so it errs on the side of yes: it bounds
+ the pixel by a circle around its center, padded by half.
+ */
+static anbool maybe_in_range(int hp, int nside, const double* xyz,
+                             double radius) {
+    double center[3];
+    double pixrad2 = 0.0;
+    double pixrad;
+    int i;
+    healpix_to_xyzarr(hp, nside, 0.5, 0.5, center);
+    for (i=0; i<9; i++) {
+        double p[3];
+        if (i == 4)
+            continue;
+        healpix_to_xyzarr(hp, nside, 0.5 * (i / 3), 0.5 * (i % 3), p);
+        pixrad2 = MAX(pixrad2, distsq(center, p, 3));
+    }
+    pixrad = 1.5 * distsq2deg(pixrad2);
+    return (distsq2deg(distsq(center, xyz, 3)) <= radius + pixrad);
+}
+
+static void search_tree(const index_lookup_t* lookup, int level, int hp,
+                        const double* xyz, double radius, il* result) {
+    int nside = 1 << level;
+    int big, x, y;
+    int dx, dy;
+    il* here;
+
+    if (!lookup->occupied[level][hp])
+        return;
+    if (!maybe_in_range(hp, nside, xyz, radius))
+        return;
+    here = lookup->tiles[level][hp];
+    if (here && healpix_distance_to_xyz(hp, nside, xyz, NULL) <= radius)
+        il_append_list(result, here);
+    if (level + 1 >= lookup->nlevels)
+        return;
+    healpix_decompose_xy(hp, &big, &x, &y, nside);
+    for (dy=0; dy<2; dy++)
+        for (dx=0; dx<2; dx++)
+            search_tree(lookup, level + 1,
+                        healpix_compose_xy(big, 2*x + dx, 2*y + dy, 2*nside),
+                        xyz, radius, result);
+}
+
+void index_lookup_search(const index_lookup_t* lookup, double ra,
+                         double dec, double radius_deg, il* result) {
+    double xyz[3];
+    il* found = il_new(16);
+    ll* discs[MAX_DISCS];
+    int discnside[MAX_DISCS];
+    int ndiscs = 0;
+    size_t i;
+    int hp;
+
+    radecdeg2xyzarr(ra, dec, xyz);
+    il_append_list(found, lookup->allsky);
+    for (i=0; i<bl_size(lookup->others); i++) {
+        struct other_tile* t = bl_access(lookup->others, i);
+        if (healpix_distance_to_xyz(t->healpix, t->nside, xyz, NULL) <= radius_deg)
+            il_append(found, t->pos);
+    }
+    if (lookup->nlevels)
+        for (hp=0; hp<12; hp++)
+            search_tree(lookup, 0, hp, xyz, radius_deg, found);
+    il_sort(found, 1);
+    for (i=0; i<il_size(found); i++) {
+        int pos = il_get(found, i);
+        const struct coverage_map* c = lookup->coverage + pos;
+        if (c->ranges) {
+            // the disc, at each coverage Nside, is only computed once.
+            ll* disc = NULL;
+            int k;
+            for (k=0; k<ndiscs; k++)
+                if (discnside[k] == c->nside)
+                    disc = discs[k];
+            if (!disc && ndiscs < MAX_DISCS) {
+                disc = discs[ndiscs] =
+                    healpix_disc_ranges(xyz, radius_deg, c->nside, NULL);
+                discnside[ndiscs++] = c->nside;
+            }
+            if (disc ? !index_coverage_overlaps(c->ranges, c->nranges, disc) :
+                !index_coverage_intersects(c->nside, c->ranges, c->nranges,
+                                           xyz, radius_deg))
+                continue;
+        }
+        il_append(result, pos);
+    }
+    for (i=0; i<ndiscs; i++)
+        ll_free(discs[i]);
+    il_free(found);
+}
@@ -0,0 +1,584 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "index-remote.h"
+#include "index.h"
+#include "ioutils.h"
+#include "bl-sort.h"
+#include "log.h"
+#include "errors.h"
+
+#define DEFAULT_CHUNK_SIZE (16 * 1024 * 1024)
+#define DEFAULT_CONNECTIONS 4
+
+// (files in the cache directory that aren't cached index files start
+// with ".")
+#define MANIFEST_COPY ".remote-manifest"
+#define USAGE_FILE ".remote-usage"
+// A download in progress: the file so far, and one byte per chunk
+// saying whether that chunk is in it yet.
+#define PART_SUFFIX ".part"
+#define CHUNKS_SUFFIX ".chunks"
+
+struct index_remote {
+    char* url;
+    char* cachedir;
+    int64_t maxbytes;
+    int64_t chunksize;
+    int nconns;
+    // the store's files (from its manifest) and their sizes.
+    sl* names;
+    ll* sizes;
+
+    // Protects everything below.
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    // how many times each file has been fetched with this cache.
+    il* uses;
+    // is file i being downloaded?
+    anbool* busy;
+    // files to download in the background.
+    il* prefetchq;
+    anbool prefetching;
+    anbool stopping;
+    pthread_t prefetcher;
+};
+
+// Runs "curl" on "url", with "args" before it.
+static int run_curl(const char* args, const char* url) {
+    char* esc = shell_escape(url);
+    char* cmd;
+    sl* errlines = NULL;
+    int rtn;
+    asprintf_safe(&cmd, "curl -sSfL %s %s", args, esc);
+    rtn = run_command_get_outputs(cmd, NULL, &errlines);
+    if (rtn && errlines && sl_size(errlines))
+        ERROR("%s", sl_get(errlines, 0));
+    if (errlines)
+        sl_free2(errlines);
+    free(cmd);
+    free(esc);
+    return rtn ? -1 : 0;
+}
+
+// Downloads the "len" bytes at "offset" of "url" into "buf".
+static int fetch_range(const char* url, int64_t offset, int64_t len,
+                       char* buf) {
+    char* esc = shell_escape(url);
+    char* cmd;
+    FILE* p;
+    size_t n;
+    anbool extra;
+    int status;
+
+    asprintf_safe(&cmd, "curl -sSfL -r %lld-%lld %s", (long long)offset,
+                  (long long)(offset + len - 1), esc);
+    free(esc);
+    p = popen(cmd, "r");
+    free(cmd);
+    if (!p) {
+        SYSERROR("Failed to run curl");
+        return -1;
+    }
+    n = fread(buf, 1, len, p);
+    // (more than that means the server ignored the range.)
+    extra = (n == (size_t)len) && (fgetc(p) != EOF);
+    status = pclose(p);
+    if (status || n != (size_t)len || extra) {
+        ERROR("Failed to download bytes %lld-%lld of %s",
+              (long long)offset, (long long)(offset + len - 1), url);
+        return -1;
+    }
+    return 0;
+}
+
+static char* cache_path(const index_remote_t* r, const char* name) {
+    char* path;
+    asprintf_safe(&path, "%s/%s", r->cachedir, name);
+    return path;
+}
+
+static void read_usage(index_remote_t* r) {
+    char* fn = cache_path(r, USAGE_FILE);
+    FILE* f = fopen(fn, "r");
+    char name[1024];
+    int count;
+    free(fn);
+    if (!f)
+        return;
+    while (fscanf(f, "%i %1023s", &count, name) == 2) {
+        ssize_t i = sl_index_of(r->names, name);
+        if (i >= 0)
+            il_set(r->uses, i, count);
+    }
+    fclose(f);
+}
+
+// (called with the lock held)
+static void write_usage(index_remote_t* r) {
+    char* fn = cache_path(r, USAGE_FILE);
+    char* tmpfn;
+    FILE* f;
+    size_t i;
+    asprintf_safe(&tmpfn, "%s.tmp", fn);
+    f = fopen(tmpfn, "w");
+    if (!f) {
+        logverb("Can't write %s: %s\n", tmpfn, strerror(errno));
+        free(tmpfn);
+        free(fn);
+        return;
+    }
+    for (i=0; i<sl_size(r->names); i++)
+        if (il_get(r->uses, i))
+            fprintf(f, "%i %s\n", il_get(r->uses, i), sl_get(r->names, i));
+    if (fclose(f) || rename(tmpfn, fn))
+        logverb("Can't write %s: %s\n", fn, strerror(errno));
+    free(tmpfn);
+    free(fn);
+}
+
+index_remote_t* index_remote_open(const char* url, const char* cachedir,
+                                  int64_t maxbytes) {
+    index_remote_t* r;
+    char* manifesturl;
+    char* fn;
+    char* tmpfn;
+    char* args;
+    pl* indexes;
+    size_t i;
+
+    if (mkdir_p(cachedir))
+        return NULL;
+    r = calloc(1, sizeof(index_remote_t));
+    r->url = strdup(url);
+    // (no trailing slash)
+    while (strlen(r->url) > 1 && r->url[strlen(r->url)-1] == '/')
+        r->url[strlen(r->url)-1] = '\0';
+    r->cachedir = strdup(cachedir);
+    r->maxbytes = maxbytes;
+    r->chunksize = DEFAULT_CHUNK_SIZE;
+    r->nconns = DEFAULT_CONNECTIONS;
+    r->names = sl_new(64);
+    r->sizes = ll_new(64);
+    r->uses = il_new(64);
+    r->prefetchq = il_new(16);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->idle, NULL);
+
+    asprintf_safe(&manifesturl, "%s/%s", r->url, INDEX_MANIFEST_FILENAME);
+    fn = cache_path(r, MANIFEST_COPY);
+    asprintf_safe(&tmpfn, "%s.tmp", fn);
+    args = shell_escape(tmpfn);
+    free(tmpfn);
+    asprintf_safe(&tmpfn, "-o %s", args);
+    free(args);
+    args = tmpfn;
+    tmpfn = NULL;
+    asprintf_safe(&tmpfn, "%s.tmp", fn);
+    if (run_curl(args, manifesturl) || rename(tmpfn, fn)) {
+        if (!file_exists(fn)) {
+            ERROR("Failed to download index manifest %s", manifesturl);
+            goto bailout;
+        }
+        logmsg("Failed to download index manifest %s; using the copy from "
+               "an earlier run\n", manifesturl);
+    }
+    indexes = pl_new(64);
+    if (index_manifest_read(fn, r->cachedir, indexes, r->sizes)) {
+        ERROR("Failed to read index manifest %s", manifesturl);
+        pl_free(indexes);
+        goto bailout;
+    }
+    for (i=0; i<pl_size(indexes); i++) {
+        index_t* ind = pl_get(indexes, i);
+        sl_append(r->names, ind->indexfn + strlen(r->cachedir) + 1);
+        il_append(r->uses, 0);
+        index_free(ind);
+    }
+    pl_free(indexes);
+    r->busy = calloc(MAX(1, sl_size(r->names)), sizeof(anbool));
+    read_usage(r);
+    logverb("Remote index store %s has %zu indexes\n", r->url,
+            sl_size(r->names));
+    free(args);
+    free(tmpfn);
+    free(fn);
+    free(manifesturl);
+    return r;
+
+ bailout:
+    unlink(tmpfn);
+    free(args);
+    free(tmpfn);
+    free(fn);
+    free(manifesturl);
+    index_remote_close(r);
+    return NULL;
+}
+
+void index_remote_set_chunks(index_remote_t* r, int64_t chunksize,
+                             int nconnections) {
+    r->chunksize = MAX(1, chunksize);
+    r->nconns = MAX(1, nconnections);
+}
+
+int index_remote_list(index_remote_t* r, pl* indexes) {
+    char* fn = cache_path(r, MANIFEST_COPY);
+    size_t i, i0 = pl_size(indexes);
+    int rtn = index_manifest_read(fn, r->cachedir, indexes, NULL);
+    free(fn);
+    if (rtn)
+        return rtn;
+    for (i=i0; i<pl_size(indexes); i++) {
+        index_t* ind = pl_get(indexes, i);
+        ind->remote = r;
+    }
+    return 0;
+}
+
+struct cached_file {
+    char* path;
+    int64_t size;
+    time_t mtime;
+};
+
+static int compare_mtime(const void* v1, const void* v2) {
+    const struct cached_file* f1 = v1;
+    const struct cached_file* f2 = v2;
+    if (f1->mtime < f2->mtime)
+        return -1;
+    if (f1->mtime > f2->mtime)
+        return 1;
+    return strcmp(f1->path, f2->path);
+}
+
+// Does "fn" belong to the file (or the download of the file) "name"?
+static anbool is_file_of(const char* fn, const char* name) {
+    size_t n = strlen(name);
+    return (strncmp(fn, name, n) == 0) &&
+        (!fn[n] || streq(fn + n, PART_SUFFIX) || streq(fn + n, CHUNKS_SUFFIX));
+}
+
+/*
+ Removes least-recently-used files until "need" more bytes fit in the
+ cache, leaving alone the files being downloaded.  (Called with the
+ lock held.)
+ */
+static int make_room(index_remote_t* r, int64_t need) {
+    DIR* d;
+    bl* files;
+    int64_t total = 0;
+    size_t i;
+    int rtn = 0;
+
+    if (!r->maxbytes)
+        return 0;
+    if (need > r->maxbytes) {
+        ERROR("Index file of %lld bytes doesn't fit in the %lld-byte cache %s",
+              (long long)need, (long long)r->maxbytes, r->cachedir);
+        return -1;
+    }
+    d = opendir(r->cachedir);
+    if (!d) {
+        SYSERROR("Failed to open cache directory \"%s\"", r->cachedir);
+        return -1;
+    }
+    files = bl_new(64, sizeof(struct cached_file));
+    for (;;) {
+        struct dirent* de = readdir(d);
+        struct stat st;
+        struct cached_file f;
+        anbool busy = FALSE;
+        if (!de)
+            break;
+        if (de->d_name[0] == '.')
+            continue;
+        f.path = cache_path(r, de->d_name);
+        if (stat(f.path, &st) || !S_ISREG(st.st_mode)) {
+            free(f.path);
+            continue;
+        }
+        // (blocks, since downloads in progress are sparse)
+        f.size = MIN((int64_t)st.st_size, (int64_t)st.st_blocks * 512);
+        f.mtime = st.st_mtime;
+        total += f.size;
+        for (i=0; i<sl_size(r->names); i++)
+            if (r->busy[i] && is_file_of(de->d_name, sl_get(r->names, i)))
+                busy = TRUE;
+        if (busy)
+            free(f.path);
+        else
+            bl_append(files, &f);
+    }
+    closedir(d);
+    bl_sort(files, compare_mtime);
+    for (i=0; i<bl_size(files); i++) {
+        struct cached_file* f = bl_access(files, i);
+        if (total + need > r->maxbytes) {
+            logverb("Removing %s from the index cache\n", f->path);
+            if (unlink(f->path))
+                SYSERROR("Failed to remove %s", f->path);
+            else
+                total -= f->size;
+        }
+        free(f->path);
+    }
+    bl_free(files);
+    if (total + need > r->maxbytes) {
+        ERROR("Failed to make room for %lld bytes in the index cache %s",
+              (long long)need, r->cachedir);
+        rtn = -1;
+    }
+    return rtn;
+}
+
+struct download {
+    const char* url;
+    int64_t size;
+    int64_t chunksize;
+    int64_t nchunks;
+    int fd;
+    int chunksfd;
+    // chunk i is done if done[i]
+    char* done;
+    int64_t next;
+    int failed;
+};
+
+static void* download_worker(void* varg) {
+    struct download* d = varg;
+    char* buf = malloc(d->chunksize);
+    if (!buf) {
+        __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        int64_t i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+        int64_t off, len;
+        if (i >= d->nchunks || __atomic_load_n(&d->failed, __ATOMIC_RELAXED))
+            break;
+        if (d->done[i])
+            continue;
+        off = i * d->chunksize;
+        len = MIN(d->chunksize, d->size - off);
+        if (fetch_range(d->url, off, len, buf) ||
+            pwrite(d->fd, buf, len, off) != len ||
+            // (the data must be on disk before the chunk is marked done)
+            fdatasync(d->fd) ||
+            pwrite(d->chunksfd, "\1", 1, i) != 1) {
+            __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Downloads file "name" of size "size" to "path", resuming an earlier
+// download if there was one.
+static int download(index_remote_t* r, const char* name, int64_t size,
+                    const char* path) {
+    struct download d;
+    pthread_t threads[64];
+    char* url;
+    char* partfn;
+    char* chunksfn;
+    int i, nthreads, nstarted = 0;
+    int64_t ndone = 0;
+    int rtn = -1;
+
+    asprintf_safe(&url, "%s/%s", r->url, name);
+    asprintf_safe(&partfn, "%s%s", path, PART_SUFFIX);
+    asprintf_safe(&chunksfn, "%s%s", path, CHUNKS_SUFFIX);
+    memset(&d, 0, sizeof(d));
+    d.url = url;
+    d.size = size;
+    d.chunksize = r->chunksize;
+    d.nchunks = (size + r->chunksize - 1) / r->chunksize;
+    d.fd = open(partfn, O_RDWR | O_CREAT, 0666);
+    d.chunksfd = open(chunksfn, O_RDWR | O_CREAT, 0666);
+    d.done = calloc(MAX(1, d.nchunks), 1);
+    if (d.fd == -1 || d.chunksfd == -1) {
+        SYSERROR("Failed to create %s", partfn);
+        goto bailout;
+    }
+    // (a chunks file from a download with another chunk size is no use.)
+    if (ftruncate(d.fd, size) ||
+        pread(d.chunksfd, d.done, d.nchunks, 0) < 0 ||
+        ftruncate(d.chunksfd, d.nchunks)) {
+        SYSERROR("Failed to set up download to %s", partfn);
+        goto bailout;
+    }
+    for (i=0; i<d.nchunks; i++)
+        ndone += (d.done[i] != 0);
+    if (ndone)
+        logmsg("Resuming download of %s (%lld of %lld chunks done)\n", url,
+               (long long)ndone, (long long)d.nchunks);
+    else
+        logmsg("Downloading %s (%lld bytes)\n", url, (long long)size);
+
+    nthreads = (int)MIN((int64_t)MIN(r->nconns, 64), MAX(1, d.nchunks - ndone));
+    for (i=1; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, download_worker, &d))
+            // the remaining threads pick up the slack.
+            break;
+        nstarted++;
+    }
+    download_worker(&d);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    if (d.failed) {
+        ERROR("Failed to download %s; the next try will resume it", url);
+        goto bailout;
+    }
+    if (rename(partfn, path)) {
+        SYSERROR("Failed to rename %s to %s", partfn, path);
+        goto bailout;
+    }
+    unlink(chunksfn);
+    rtn = 0;
+
+ bailout:
+    if (d.fd != -1)
+        close(d.fd);
+    if (d.chunksfd != -1)
+        close(d.chunksfd);
+    free(d.done);
+    free(chunksfn);
+    free(partfn);
+    free(url);
+    return rtn;
+}
+
+// Downloads "path" if needed; counts it as a use if "used".
+static int fetch(index_remote_t* r, const char* path, anbool used) {
+    size_t n = strlen(r->cachedir);
+    const char* name;
+    ssize_t i;
+    int64_t size;
+    struct stat st;
+    int rtn = 0;
+
+    if (strncmp(path, r->cachedir, n) || path[n] != '/') {
+        ERROR("File %s is not in the index cache %s", path, r->cachedir);
+        return -1;
+    }
+    name = path + n + 1;
+    i = sl_index_of(r->names, name);
+    if (i < 0) {
+        ERROR("File %s is not in the remote index store %s", name, r->url);
+        return -1;
+    }
+    size = ll_get(r->sizes, i);
+
+    pthread_mutex_lock(&r->lock);
+    // (one download of a file at a time)
+    while (r->busy[i])
+        pthread_cond_wait(&r->idle, &r->lock);
+    if (stat(path, &st) || st.st_size != size) {
+        if (make_room(r, size)) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+        r->busy[i] = TRUE;
+        pthread_mutex_unlock(&r->lock);
+        rtn = download(r, name, size, path);
+        pthread_mutex_lock(&r->lock);
+        r->busy[i] = FALSE;
+        pthread_cond_broadcast(&r->idle);
+    } else if (utimes(path, NULL))
+        // (the cache evicts by modification time)
+        SYSERROR("Failed to touch %s", path);
+    if (!rtn && used) {
+        il_set(r->uses, i, il_get(r->uses, i) + 1);
+        write_usage(r);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rtn;
+}
+
+int index_remote_fetch(index_remote_t* r, const char* path) {
+    return fetch(r, path, TRUE);
+}
+
+static void* prefetch_main(void* varg) {
+    index_remote_t* r = varg;
+    pthread_mutex_lock(&r->lock);
+    while (il_size(r->prefetchq) && !r->stopping) {
+        int i = il_pop(r->prefetchq);
+        char* path = cache_path(r, sl_get(r->names, i));
+        pthread_mutex_unlock(&r->lock);
+        if (fetch(r, path, FALSE))
+            logmsg("Failed to prefetch %s\n", path);
+        free(path);
+        pthread_mutex_lock(&r->lock);
+    }
+    r->prefetching = FALSE;
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+int index_remote_prefetch(index_remote_t* r, int n) {
+    int k, nq = 0;
+    size_t i;
+    pthread_mutex_lock(&r->lock);
+    // (the queue is popped from the end, so push the least-used first)
+    for (k=0; k<n; k++) {
+        int best = -1;
+        for (i=0; i<sl_size(r->names); i++)
+            if (il_get(r->uses, i) > 0 && !il_contains(r->prefetchq, i) &&
+                (best == -1 || il_get(r->uses, i) > il_get(r->uses, best)))
+                best = i;
+        if (best == -1)
+            break;
+        il_insert(r->prefetchq, 0, best);
+        nq++;
+    }
+    if (il_size(r->prefetchq) && !r->prefetching) {
+        if (r->prefetcher)
+            // (the last one has finished, but hasn't been joined)
+            pthread_join(r->prefetcher, NULL);
+        if (pthread_create(&r->prefetcher, NULL, prefetch_main, r)) {
+            SYSERROR("Failed to start the index prefetch thread");
+            r->prefetcher = 0;
+            il_remove_all(r->prefetchq);
+            nq = 0;
+        } else
+            r->prefetching = TRUE;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return nq;
+}
+
+void index_remote_close(index_remote_t* r) {
+    if (!r)
+        return;
+    pthread_mutex_lock(&r->lock);
+    r->stopping = TRUE;
+    pthread_mutex_unlock(&r->lock);
+    if (r->prefetcher)
+        pthread_join(r->prefetcher, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->idle);
+    sl_free2(r->names);
+    ll_free(r->sizes);
+    il_free(r->uses);
+    il_free(r->prefetchq);
+    free(r->busy);
+    free(r->url);
+    free(r->cachedir);
+    free(r);
+}
@@ -3,7 +3,20 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
 #include "index.h"
+#include "index-coverage.h"
+#include "index-remote.h"
+#include "index-heatmap.h"
 #include "log.h"
 #include "errors.h"
 #include "ioutils.h"
@@ -11,8 +24,11 @@
 #include "tic.h"
 
 #include "anqfits.h"
+#include "fitsioutils.h"
 #include "qfits_rw.h"
 #include "starutil.h"
+#include "an-thread.h"
+#include "an-numa.h"
 
 anbool index_overlaps_scale_range(index_t* meta,
                                   double quadlo, double quadhi) {
@@ -25,11 +41,16 @@ anbool index_overlaps_scale_range(index_t* meta,
 }
 
 anbool index_is_within_range(index_t* meta, double ra, double dec, double radius_deg) {
-    if (meta->healpix == -1) {
-        // allsky; tautology
+    double xyz[3];
+    // (all-sky indexes' tiles are always in range)
+    if (meta->healpix != -1 &&
+        healpix_distance_to_radec(meta->healpix, meta->hpnside, ra, dec, NULL) > radius_deg)
+        return FALSE;
+    if (!meta->coverage)
         return TRUE;
-    }
-    return (healpix_distance_to_radec(meta->healpix, meta->hpnside, ra, dec, NULL) <= radius_deg);
+    radecdeg2xyzarr(ra, dec, xyz);
+    return index_coverage_intersects(meta->covnside, meta->coverage,
+                                     meta->ncoverage, xyz, radius_deg);
 }
 
 int index_get_quad_dim(const index_t* index) {
@@ -231,6 +252,7 @@ static void get_cut_params(index_t* index) {
 }
 
 static void set_meta(index_t* index) {
+    qfits_header* hdr;
     index->index_scale_upper = quadfile_get_index_scale_upper_arcsec(index->quads);
     index->index_scale_lower = quadfile_get_index_scale_lower_arcsec(index->quads);
     index->indexid = index->quads->indexid;
@@ -252,6 +274,15 @@ static void set_meta(index_t* index) {
     index->cx_less_than_dx = qfits_header_getboolean(index->codekd->header, "CXDX", FALSE);
 
     index->meanx_less_than_half = qfits_header_getboolean(index->codekd->header, "CXDXLT1", FALSE);
+
+    // written by build_index_shared_skdt().
+    hdr = quadfile_get_header(index->quads);
+    free(index->skdtfn);
+    index->skdtfn = hdr ? fits_get_dupstring(hdr, "SKDTFN") : NULL;
+    index->skdt_nstars = hdr ? qfits_header_getint(hdr, "SKDTN", 0) : 0;
+    // written by build_index_stratum().
+    index->stratum = hdr ? qfits_header_getint(hdr, "STRATUM", 0) : 0;
+    index->nstrata = hdr ? qfits_header_getint(hdr, "NSTRATA", 0) : 0;
 }
 
 int index_dimquads(index_t* indx) {
@@ -302,6 +333,13 @@ index_t* index_load(const char* indexname, int flags, index_t* dest) {
             dest->index_scale_lower, dest->index_scale_upper);
     logverb("Index has %i quads and %i stars\n", dest->nquads, dest->nstars);
 
+    if (index_coverage_read(dest->fits, &dest->covnside, &dest->coverage,
+                            &dest->ncoverage) == -1)
+        goto bailout;
+    if (dest->coverage)
+        logverb("Index has a coverage map: %i ranges at Nside %i\n",
+                dest->ncoverage, dest->covnside);
+
     if (!dest->circle) {
         ERROR("Code kdtree does not contain the CIRCLE header.");
         goto bailout;
@@ -321,7 +359,159 @@ index_t* index_load(const char* indexname, int flags, index_t* dest) {
     return NULL;
 }
 
+// NUMA placement; see index_numa_set_policy().
+static int numa_policy = INDEX_NUMA_OFF;
+static size_t numa_replicate_max = 0;
+
+void index_numa_set_policy(int policy, size_t replicate_max) {
+    numa_policy = policy;
+    numa_replicate_max = replicate_max;
+}
+
+int index_numa_node(const index_t* index) {
+    return (numa_policy == INDEX_NUMA_LOCAL) ? index->numa_node : -1;
+}
+
+const kdtree_t* index_code_tree_for_node(const index_t* index, int node) {
+    if (index->code_replicas && node >= 0 && node < an_numa_max_node() &&
+        index->code_replicas[node])
+        return index->code_replicas[node];
+    return index->codekd->tree;
+}
+
+// (kdtree_sizeof_bb() counts one corner of each box)
+static size_t tree_bb_bytes(const kdtree_t* kd) {
+    if (!kd->bb.any || !kd->nnodes)
+        return 0;
+    return kdtree_sizeof_bb(kd) / kd->nnodes * 2 * kd->n_bb;
+}
+
+static size_t tree_node_bytes(const kdtree_t* kd) {
+    return tree_bb_bytes(kd) +
+        (kd->split.any ? kdtree_sizeof_split(kd) : 0) +
+        (kd->splitdim ? kdtree_sizeof_splitdim(kd) : 0) +
+        (kd->lr ? kdtree_sizeof_lr(kd) : 0);
+}
+
+static void place_tree(const kdtree_t* kd, int node) {
+    if (!kd || kdtree_load(kd))
+        return;
+    an_numa_place(kd->lr, kd->lr ? kdtree_sizeof_lr(kd) : 0, node);
+    an_numa_place(kd->perm, kd->perm ? kdtree_sizeof_perm(kd) : 0, node);
+    an_numa_place(kd->bb.any, tree_bb_bytes(kd), node);
+    an_numa_place(kd->split.any, kd->split.any ? kdtree_sizeof_split(kd) : 0,
+                  node);
+    an_numa_place(kd->splitdim,
+                  kd->splitdim ? kdtree_sizeof_splitdim(kd) : 0, node);
+    an_numa_place(kd->data.any, kdtree_sizeof_data(kd), node);
+}
+
+static void free_replica(kdtree_t* r) {
+    if (!r)
+        return;
+    an_numa_free(r->bb.any, tree_bb_bytes(r));
+    an_numa_free(r->split.any, r->split.any ? kdtree_sizeof_split(r) : 0);
+    an_numa_free(r->splitdim, r->splitdim ? kdtree_sizeof_splitdim(r) : 0);
+    an_numa_free(r->lr, r->lr ? kdtree_sizeof_lr(r) : 0);
+    free(r);
+}
+
+/*
+ A copy of "kd" that shares its data and permutation arrays but has its
+ own node arrays, on "node".
+ */
+static kdtree_t* replicate_tree(const kdtree_t* kd, int node) {
+    kdtree_t* r = malloc(sizeof(kdtree_t));
+    if (!r)
+        return NULL;
+    memcpy(r, kd, sizeof(kdtree_t));
+    r->bb.any = r->split.any = NULL;
+    r->splitdim = NULL;
+    r->lr = NULL;
+    if ((kd->bb.any &&
+         !(r->bb.any = an_numa_copy_to_node(kd->bb.any, tree_bb_bytes(kd),
+                                            node))) ||
+        (kd->split.any &&
+         !(r->split.any = an_numa_copy_to_node(kd->split.any,
+                                               kdtree_sizeof_split(kd), node))) ||
+        (kd->splitdim &&
+         !(r->splitdim = an_numa_copy_to_node(kd->splitdim,
+                                              kdtree_sizeof_splitdim(kd), node))) ||
+        (kd->lr &&
+         !(r->lr = an_numa_copy_to_node(kd->lr, kdtree_sizeof_lr(kd), node)))) {
+        free_replica(r);
+        return NULL;
+    }
+    return r;
+}
+
+static void free_code_replicas(index_t* index) {
+    int i;
+    if (!index->code_replicas)
+        return;
+    for (i=0; i<an_numa_max_node(); i++)
+        free_replica(index->code_replicas[i]);
+    free(index->code_replicas);
+    index->code_replicas = NULL;
+}
+
+void index_numa_place(index_t* index) {
+    int node = (numa_policy == INDEX_NUMA_LOCAL) ? index->numa_node :
+        AN_NUMA_INTERLEAVE;
+    const codetree_t* ct = index->codekd;
+    const quadfile_t* qf = index->quads;
+    size_t nq = (size_t)qf->numquads;
+    int i;
+
+    if (numa_policy == INDEX_NUMA_OFF)
+        return;
+    place_tree(ct->tree, node);
+    for (i=0; i<ct->nscalebins; i++)
+        place_tree(ct->scalebins[i], node);
+    for (i=0; i<ct->nskybins; i++)
+        place_tree(ct->skybins[i], node);
+    if (!index->shared_starkd)
+        place_tree(index->starkd->tree, node);
+    an_numa_place(qf->quadarray, nq * qf->dimquads * sizeof(uint32_t), node);
+    an_numa_place(qf->geomarray, nq * QUADFILE_GEOM_FLOATS * sizeof(float),
+                  node);
+    if (qf->xyzarray)
+        an_numa_place(qf->xyzarray, nq * qf->dimquads * 3 * sizeof(float),
+                      node);
+
+    if (!numa_replicate_max || index->code_replicas ||
+        tree_node_bytes(ct->tree) > numa_replicate_max)
+        return;
+    index->code_replicas = calloc(an_numa_max_node(), sizeof(kdtree_t*));
+    for (i=0; i<an_numa_nodes(); i++) {
+        int n = an_numa_node_id(i);
+        index->code_replicas[n] = replicate_tree(ct->tree, n);
+        if (!index->code_replicas[n]) {
+            ERROR("Failed to copy the code tree of %s to NUMA node %i",
+                  index->indexname, n);
+            free_code_replicas(index);
+            return;
+        }
+    }
+    logverb("Copied the code tree nodes (%zu bytes) of %s to %i NUMA node(s)\n",
+            tree_node_bytes(ct->tree), index->indexname, an_numa_nodes());
+}
+
 int index_reload(index_t* index) {
+    anbool loaded;
+    PROFILE_BEGIN("index-load");
+    // Indexes whose metadata came from a manifest haven't been opened.
+    if (!index->fits) {
+        // ... and remote ones may not have been downloaded yet.
+        if (index->remote && index_remote_fetch(index->remote, index->indexfn))
+            goto bailout;
+        index->fits = anqfits_open(index->indexfn);
+        if (!index->fits) {
+            ERROR("Failed to open FITS file %s", index->indexfn);
+            goto bailout;
+        }
+    }
+    loaded = !index->starkd || !index->quads || !index->codekd;
     // Read .skdt file...
     if (!index->starkd) {
         index->starkd = startree_open_fits(index->fits);
@@ -348,14 +538,180 @@ int index_reload(index_t* index) {
             goto bailout;
         }
     }
+    if (loaded)
+        index_numa_place(index);
+    index_heatmap_attach(index);
+    PROFILE_END("index-load");
     return 0;
 
  bailout:
+    PROFILE_END("index-load");
     return -1;
 }
 
+// protects "refcount" and "acquire_loaded" of all indexes, and the
+// residency state below.
+AN_THREAD_DECLARE_STATIC_MUTEX(acquire_lock);
+
+// Indexes loaded by index_acquire() and kept loaded; see
+// index_residency_set_budget().
+static size_t residency_budget = 0;
+static int residency_policy = INDEX_RESIDENCY_LRU;
+static pl* resident = NULL;
+static uint64_t residency_clock = 0;
+static index_residency_stats_t residency_stats;
+
+// The size of the index's files.
+static size_t index_file_bytes(const index_t* index) {
+    struct stat st;
+    size_t bytes = 0;
+    if (index->indexfn && !stat(index->indexfn, &st))
+        bytes += st.st_size;
+    if (index->skdtfn && !index->shared_starkd) {
+        char* dir = dirname_safe(index->indexfn);
+        char* fn;
+        asprintf_safe(&fn, "%s/%s", dir, index->skdtfn);
+        if (!stat(fn, &st))
+            bytes += st.st_size;
+        free(fn);
+        free(dir);
+    }
+    return bytes;
+}
+
+// Should "a" be evicted before "b"?
+static anbool evict_before(const index_t* a, const index_t* b) {
+    if (residency_policy == INDEX_RESIDENCY_SOLVES && a->nsolves != b->nsolves)
+        return a->nsolves < b->nsolves;
+    return a->last_used < b->last_used;
+}
+
+static void residency_remove(index_t* index) {
+    pl_remove_value(resident, index);
+    residency_stats.nresident--;
+    residency_stats.resident_bytes -= index->resident_bytes;
+}
+
+// Unloads unreferenced indexes until the rest fit in the budget.  (Called
+// with the lock held.)
+static void residency_evict(void) {
+    while (resident && residency_stats.resident_bytes > residency_budget) {
+        index_t* victim = NULL;
+        size_t i;
+        for (i=0; i<pl_size(resident); i++) {
+            index_t* ind = pl_get(resident, i);
+            if (!ind->refcount && (!victim || evict_before(ind, victim)))
+                victim = ind;
+        }
+        if (!victim)
+            // (the rest are in use)
+            break;
+        debug("Evicting index %s (%zu bytes)\n", victim->indexname,
+              victim->resident_bytes);
+        residency_remove(victim);
+        index_unload(victim);
+        victim->acquire_loaded = FALSE;
+        residency_stats.evictions++;
+    }
+}
+
+void index_residency_set_budget(size_t maxbytes, int policy) {
+    AN_THREAD_LOCK(acquire_lock);
+    residency_budget = maxbytes;
+    residency_policy = policy;
+    if (!resident)
+        resident = pl_new(16);
+    // (a budget of zero unloads them all, as index_release() would have.)
+    residency_evict();
+    AN_THREAD_UNLOCK(acquire_lock);
+}
+
+void index_residency_solved(index_t* index) {
+    AN_THREAD_LOCK(acquire_lock);
+    index->nsolves++;
+    AN_THREAD_UNLOCK(acquire_lock);
+}
+
+void index_residency_get_stats(index_residency_stats_t* stats) {
+    AN_THREAD_LOCK(acquire_lock);
+    *stats = residency_stats;
+    AN_THREAD_UNLOCK(acquire_lock);
+}
+
+int index_acquire(index_t* index) {
+    int rtn = -1;
+    AN_THREAD_LOCK(acquire_lock);
+    if (!index->codekd || !index->quads || !index->starkd) {
+        if (index_reload(index)) {
+            ERROR("Failed to load index %s", index->indexfn);
+            goto bailout;
+        }
+        index->acquire_loaded = TRUE;
+        residency_stats.misses++;
+        if (residency_budget) {
+            index->resident_bytes = index_file_bytes(index);
+            pl_append(resident, index);
+            residency_stats.nresident++;
+            residency_stats.resident_bytes += index->resident_bytes;
+            // (this one is about to be referenced, so stays)
+            index->refcount++;
+            residency_evict();
+            index->refcount--;
+        }
+    } else
+        residency_stats.hits++;
+    if (!index->refcount) {
+        // (lazily-read trees are mapped here, at first use.)
+        int i;
+        if (kdtree_load(index->starkd->tree) ||
+            kdtree_load(index->codekd->tree)) {
+            ERROR("Failed to read kd-trees from index %s", index->indexfn);
+            goto bailout;
+        }
+        for (i=0; i<index->codekd->nscalebins; i++)
+            if (kdtree_load(index->codekd->scalebins[i])) {
+                ERROR("Failed to read kd-trees from index %s", index->indexfn);
+                goto bailout;
+            }
+        for (i=0; i<index->codekd->nskybins; i++)
+            if (kdtree_load(index->codekd->skybins[i])) {
+                ERROR("Failed to read kd-trees from index %s", index->indexfn);
+                goto bailout;
+            }
+        if (index->starkd->tree->perm)
+            startree_compute_inverse_perm(index->starkd);
+        if (index->codekd->tree->perm)
+            codetree_compute_inverse_perm(index->codekd);
+    }
+    index->refcount++;
+    rtn = 0;
+ bailout:
+    AN_THREAD_UNLOCK(acquire_lock);
+    return rtn;
+}
+
+void index_release(index_t* index) {
+    AN_THREAD_LOCK(acquire_lock);
+    assert(index->refcount > 0);
+    index->refcount--;
+    index->last_used = ++residency_clock;
+    if (!index->refcount && index->acquire_loaded) {
+        if (residency_budget && pl_contains(resident, index))
+            residency_evict();
+        else {
+            if (resident && pl_contains(resident, index))
+                residency_remove(index);
+            index_unload(index);
+            index->acquire_loaded = FALSE;
+        }
+    }
+    AN_THREAD_UNLOCK(acquire_lock);
+}
+
 void index_unload(index_t* index) {
-    if (index->starkd) {
+    index_heatmap_detach(index);
+    free_code_replicas(index);
+    if (index->starkd && !index->shared_starkd) {
         startree_close(index->starkd);
         index->starkd = NULL;
     }
@@ -399,10 +755,16 @@ int index_close_fds(index_t* ind) {
 
 void index_close(index_t* index) {
     if (!index) return;
+    AN_THREAD_LOCK(acquire_lock);
+    if (resident && pl_contains(resident, index))
+        residency_remove(index);
+    AN_THREAD_UNLOCK(acquire_lock);
     free(index->indexname);
     free(index->indexfn);
     free(index->cutband);
+    free(index->coverage);
     index->indexname = index->indexfn = NULL;
+    index->coverage = NULL;
     index_unload(index);
     if (index->fits)
         anqfits_close(index->fits);
@@ -413,3 +775,376 @@ void index_free(index_t* index) {
     index_close(index);
     free(index);
 }
+
+#define INDEX_MANIFEST_HEADER "# astrometry.net index manifest v4"
+
+struct manifest_entry {
+    char* filename;
+    off_t size;
+    time_t mtime;
+    // NULL if the file isn't an index.
+    index_t* meta;
+};
+
+static void free_manifest(bl* entries) {
+    size_t i;
+    if (!entries)
+        return;
+    for (i=0; i<bl_size(entries); i++) {
+        struct manifest_entry* e = bl_access(entries, i);
+        free(e->filename);
+        if (e->meta)
+            index_free(e->meta);
+    }
+    bl_free(entries);
+}
+
+static char* manifest_filename(const char* dir) {
+    char* fn;
+    asprintf_safe(&fn, "%s/%s", dir, INDEX_MANIFEST_FILENAME);
+    return fn;
+}
+
+// Reads the optional coverage map that follows an index's metadata:
+// a tab, Nside, the number of ranges, and the ranges.
+static int read_manifest_coverage(const char* line, index_t* m) {
+    const char* p = strchr(line + 1, '\t');
+    int nread, k;
+    if (!p)
+        return 0;
+    if (sscanf(p, "\t%i %i%n", &m->covnside, &m->ncoverage, &nread) != 2 ||
+        m->ncoverage < 0)
+        return -1;
+    p += nread;
+    m->coverage = malloc((size_t)MAX(m->ncoverage, 1) * 2 * sizeof(int64_t));
+    for (k=0; k<2*m->ncoverage; k++) {
+        long long v;
+        if (sscanf(p, " %lld%n", &v, &nread) != 1) {
+            free(m->coverage);
+            m->coverage = NULL;
+            return -1;
+        }
+        m->coverage[k] = v;
+        p += nread;
+    }
+    return 0;
+}
+
+// Returns NULL if the manifest file "fn" doesn't exist or can't be parsed.
+static bl* read_manifest_file(const char* fn) {
+    FILE* f;
+    bl* entries;
+    char* line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    anbool first = TRUE;
+
+    f = fopen(fn, "r");
+    if (!f) {
+        logverb("No index manifest %s\n", fn);
+        return NULL;
+    }
+    entries = bl_new(256, sizeof(struct manifest_entry));
+    while ((len = getline(&line, &linesize, f)) != -1) {
+        struct manifest_entry e;
+        char* tab;
+        long long size, mtime;
+        int isindex, nread;
+        char band[64];
+        char skdt[256];
+        int circle, cxdx, meanx;
+        index_t* m;
+
+        if (len && line[len-1] == '\n')
+            line[--len] = '\0';
+        if (first) {
+            first = FALSE;
+            if (!streq(line, INDEX_MANIFEST_HEADER)) {
+                logmsg("Index manifest %s has an unknown format; ignoring it\n", fn);
+                goto bailout;
+            }
+            continue;
+        }
+        tab = strchr(line, '\t');
+        if (!tab)
+            goto badline;
+        *tab = '\0';
+        if (sscanf(tab + 1, "%lld\t%lld\t%i%n", &size, &mtime, &isindex,
+                   &nread) != 3)
+            goto badline;
+        memset(&e, 0, sizeof(e));
+        e.size = size;
+        e.mtime = mtime;
+        if (isindex) {
+            m = e.meta = calloc(1, sizeof(index_t));
+            if (sscanf(tab + 1 + nread,
+                       "\t%i %i %i %lg %i %i %lg %63s %i %i %i %i %lg %lg %i %i %i %255s %i %i %i",
+                       &m->indexid, &m->healpix, &m->hpnside, &m->index_jitter,
+                       &m->cutnside, &m->cutnsweep, &m->cutdedup, band,
+                       &m->cutmargin, &circle, &cxdx, &meanx,
+                       &m->index_scale_upper, &m->index_scale_lower,
+                       &m->dimquads, &m->nstars, &m->nquads,
+                       skdt, &m->skdt_nstars, &m->stratum, &m->nstrata) != 21) {
+                free(m);
+                goto badline;
+            }
+            m->cutband = streq(band, "-") ? NULL : strdup(band);
+            m->skdtfn = streq(skdt, "-") ? NULL : strdup(skdt);
+            m->circle = circle;
+            m->cx_less_than_dx = cxdx;
+            m->meanx_less_than_half = meanx;
+            if (read_manifest_coverage(tab + 1 + nread, m)) {
+                free(m->cutband);
+                free(m->skdtfn);
+                free(m);
+                goto badline;
+            }
+        }
+        e.filename = strdup(line);
+        bl_append(entries, &e);
+        continue;
+    badline:
+        logmsg("Failed to parse a line of index manifest %s; ignoring it\n", fn);
+        goto bailout;
+    }
+    free(line);
+    fclose(f);
+    return entries;
+
+ bailout:
+    free(line);
+    fclose(f);
+    free_manifest(entries);
+    return NULL;
+}
+
+static bl* read_manifest(const char* dir) {
+    char* fn = manifest_filename(dir);
+    bl* entries = read_manifest_file(fn);
+    free(fn);
+    return entries;
+}
+
+// Can "s" be written as one word of at most "maxlen" characters?
+static anbool manifest_word(const char* s, int maxlen) {
+    int i;
+    if (!s || !s[0] || streq(s, "-") || (int)strlen(s) > maxlen)
+        return FALSE;
+    for (i=0; s[i]; i++)
+        if (isspace((unsigned char)s[i]))
+            return FALSE;
+    return TRUE;
+}
+
+static int write_manifest(const char* dir, bl* entries) {
+    char* fn = manifest_filename(dir);
+    char* tmpfn;
+    FILE* f;
+    size_t i;
+
+    // write and rename, so that readers never see a partial manifest.
+    asprintf_safe(&tmpfn, "%s.tmp.%i", fn, (int)getpid());
+    f = fopen(tmpfn, "w");
+    if (!f) {
+        logverb("Can't write index manifest %s: %s\n", tmpfn, strerror(errno));
+        free(tmpfn);
+        free(fn);
+        return -1;
+    }
+    fprintf(f, "%s\n", INDEX_MANIFEST_HEADER);
+    for (i=0; i<bl_size(entries); i++) {
+        struct manifest_entry* e = bl_access(entries, i);
+        index_t* m = e->meta;
+        fprintf(f, "%s\t%lld\t%lld\t%i", e->filename, (long long)e->size,
+                (long long)e->mtime, m ? 1 : 0);
+        if (m)
+            fprintf(f, "\t%i %i %i %.17g %i %i %.17g %s %i %i %i %i %.17g %.17g %i %i %i %s %i %i %i",
+                    m->indexid, m->healpix, m->hpnside, m->index_jitter,
+                    m->cutnside, m->cutnsweep, m->cutdedup,
+                    (m->cutband && strlen(m->cutband)) ? m->cutband : "-",
+                    m->cutmargin, (int)m->circle, (int)m->cx_less_than_dx,
+                    (int)m->meanx_less_than_half,
+                    m->index_scale_upper, m->index_scale_lower,
+                    m->dimquads, m->nstars, m->nquads,
+                    // (a name that doesn't fit the format isn't kept.)
+                    manifest_word(m->skdtfn, 255) ? m->skdtfn : "-",
+                    m->skdt_nstars, m->stratum, m->nstrata);
+        if (m && m->coverage) {
+            int k;
+            fprintf(f, "\t%i %i", m->covnside, m->ncoverage);
+            for (k=0; k<2*m->ncoverage; k++)
+                fprintf(f, " %lld", (long long)m->coverage[k]);
+        }
+        fprintf(f, "\n");
+    }
+    if (fclose(f) || rename(tmpfn, fn)) {
+        SYSERROR("Failed to write index manifest %s", fn);
+        unlink(tmpfn);
+        free(tmpfn);
+        free(fn);
+        return -1;
+    }
+    logverb("Wrote index manifest %s (%zu files)\n", fn, bl_size(entries));
+    free(tmpfn);
+    free(fn);
+    return 0;
+}
+
+static struct manifest_entry* find_entry(bl* entries, const char* filename) {
+    size_t i;
+    if (!entries)
+        return NULL;
+    for (i=0; i<bl_size(entries); i++) {
+        struct manifest_entry* e = bl_access(entries, i);
+        if (streq(e->filename, filename))
+            return e;
+    }
+    return NULL;
+}
+
+// A metadata-only index_t for the file "path", copied from "meta".
+static index_t* index_from_meta(const index_t* meta, const char* path) {
+    index_t* ind = calloc(1, sizeof(index_t));
+    memcpy(ind, meta, sizeof(index_t));
+    ind->codekd = NULL;
+    ind->quads = NULL;
+    ind->starkd = NULL;
+    ind->fits = NULL;
+    ind->indexfn = strdup(path);
+    ind->indexname = strdup(path);
+    ind->cutband = strdup_safe(meta->cutband);
+    ind->skdtfn = strdup_safe(meta->skdtfn);
+    if (meta->coverage) {
+        size_t sz = (size_t)MAX(meta->ncoverage, 1) * 2 * sizeof(int64_t);
+        ind->coverage = malloc(sz);
+        memcpy(ind->coverage, meta->coverage, sz);
+    }
+    return ind;
+}
+
+static int compare_entries(const void* v1, const void* v2) {
+    const struct manifest_entry* e1 = v1;
+    const struct manifest_entry* e2 = v2;
+    return strcmp(e1->filename, e2->filename);
+}
+
+int index_manifest_read(const char* fn, const char* dir, pl* indexes,
+                        ll* sizes) {
+    bl* entries = read_manifest_file(fn);
+    size_t i;
+    if (!entries)
+        return -1;
+    for (i=0; i<bl_size(entries); i++) {
+        struct manifest_entry* e = bl_access(entries, i);
+        char* path;
+        if (!e->meta)
+            continue;
+        asprintf_safe(&path, "%s/%s", dir, e->filename);
+        pl_append(indexes, index_from_meta(e->meta, path));
+        if (sizes)
+            ll_append(sizes, e->size);
+        free(path);
+    }
+    free_manifest(entries);
+    return 0;
+}
+
+int index_manifest_scan(const char* dir, int flags, pl* indexes) {
+    DIR* d;
+    bl* old = NULL;
+    bl* entries;
+    anbool changed = FALSE;
+    size_t i;
+    int rtn = 0;
+
+    d = opendir(dir);
+    if (!d) {
+        SYSERROR("Failed to open index directory \"%s\"", dir);
+        return -1;
+    }
+    if (!(flags & INDEX_MANIFEST_REBUILD))
+        old = read_manifest(dir);
+    if (!old)
+        changed = TRUE;
+    entries = bl_new(256, sizeof(struct manifest_entry));
+
+    while (1) {
+        struct dirent* de;
+        struct stat st;
+        struct manifest_entry e;
+        struct manifest_entry* olde;
+        char* path;
+
+        errno = 0;
+        de = readdir(d);
+        if (!de) {
+            if (errno)
+                SYSERROR("Failed to read entry from directory \"%s\"", dir);
+            break;
+        }
+        if (de->d_name[0] == '.' ||
+            starts_with(de->d_name, INDEX_MANIFEST_FILENAME))
+            continue;
+        asprintf_safe(&path, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) || S_ISDIR(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        memset(&e, 0, sizeof(e));
+        e.filename = strdup(de->d_name);
+        e.size = st.st_size;
+        e.mtime = st.st_mtime;
+
+        olde = find_entry(old, de->d_name);
+        if (olde && olde->size == e.size && olde->mtime == e.mtime) {
+            // steal the cached metadata.
+            e.meta = olde->meta;
+            olde->meta = NULL;
+        } else {
+            char* err;
+            anbool ok;
+            changed = TRUE;
+            logverb("Reading index metadata from \"%s\"\n", path);
+            errors_start_logging_to_string();
+            ok = index_is_file_index(path);
+            if (ok)
+                e.meta = index_load(path, INDEX_ONLY_LOAD_METADATA, NULL);
+            err = errors_stop_logging_to_string(": ");
+            if (e.meta) {
+                // keep only the metadata.
+                index_t* m = index_from_meta(e.meta, path);
+                index_free(e.meta);
+                e.meta = m;
+            } else
+                logverb("File is not an index: %s\n", err);
+            free(err);
+        }
+        free(path);
+        // sorted by filename, like the directory listing in the engine.
+        bl_insert_sorted(entries, &e, compare_entries);
+    }
+    closedir(d);
+
+    if (old && bl_size(old) != bl_size(entries))
+        // (some files were removed)
+        changed = TRUE;
+    free_manifest(old);
+
+    if (changed && (flags & INDEX_MANIFEST_UPDATE) &&
+        write_manifest(dir, entries))
+        rtn = 1;
+
+    if (indexes) {
+        for (i=0; i<bl_size(entries); i++) {
+            struct manifest_entry* e = bl_access(entries, i);
+            char* path;
+            if (!e->meta)
+                continue;
+            asprintf_safe(&path, "%s/%s", dir, e->filename);
+            pl_append(indexes, index_from_meta(e->meta, path));
+            free(path);
+        }
+    }
+    free_manifest(entries);
+    return rtn;
+}
@@ -24,6 +24,7 @@
 #include <libgen.h>
 #include <dirent.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "ioutils.h"
@@ -758,6 +759,120 @@ char* file_get_contents_offset(const char* fn, int offset, int size) {
     return NULL;
 }
 
+// Reads are cut into segments of this size, which are handed out to the
+// reader threads.
+#define READ_SEGMENT_SIZE (4 * 1024 * 1024)
+#define MAX_READ_THREADS 16
+
+static int parallel_read_threads = 0;
+
+void set_parallel_read_threads(int nthreads) {
+    parallel_read_threads = nthreads;
+}
+
+int get_parallel_read_threads(void) {
+    return parallel_read_threads;
+}
+
+struct read_job {
+    int fd;
+    char* buf;
+    size_t len;
+    off_t offset;
+    size_t nextseg;
+    size_t nsegs;
+    int failed;
+};
+
+static int pread_fully(int fd, char* buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t nr = pread(fd, buf, len, offset);
+        if (nr < 0 && errno == EINTR)
+            continue;
+        if (nr <= 0)
+            return -1;
+        buf += nr;
+        len -= nr;
+        offset += nr;
+    }
+    return 0;
+}
+
+static void* read_worker(void* varg) {
+    struct read_job* job = varg;
+    // with no destination buffer, we're just pulling the data into the
+    // page cache.
+    char* scratch = NULL;
+    if (!job->buf) {
+        scratch = malloc(READ_SEGMENT_SIZE);
+        if (!scratch) {
+            job->failed = 1;
+            return NULL;
+        }
+    }
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->nextseg, 1, __ATOMIC_RELAXED);
+        size_t start, n;
+        if (i >= job->nsegs || __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+            break;
+        start = i * READ_SEGMENT_SIZE;
+        n = MIN((size_t)READ_SEGMENT_SIZE, job->len - start);
+        if (pread_fully(job->fd, scratch ? scratch : job->buf + start, n,
+                        job->offset + (off_t)start)) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    free(scratch);
+    return NULL;
+}
+
+int read_parallel(int fd, void* buf, size_t len, off_t offset, int nthreads) {
+    struct read_job job;
+    pthread_t threads[MAX_READ_THREADS];
+    int i, nstarted;
+
+    job.fd = fd;
+    job.buf = buf;
+    job.len = len;
+    job.offset = offset;
+    job.nextseg = 0;
+    job.nsegs = (len + READ_SEGMENT_SIZE - 1) / READ_SEGMENT_SIZE;
+    job.failed = 0;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, MAX_READ_THREADS));
+    if ((size_t)nthreads > job.nsegs)
+        nthreads = MAX(1, (int)job.nsegs);
+
+    nstarted = 0;
+    for (i=1; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, read_worker, &job))
+            // the remaining threads pick up the slack.
+            break;
+        nstarted++;
+    }
+    read_worker(&job);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    if (job.failed) {
+        SYSERROR("Failed to read %zu bytes at offset %lld", len, (long long)offset);
+        return -1;
+    }
+    return 0;
+}
+
+int read_at(int fd, void* buf, size_t len, off_t offset) {
+    if (parallel_read_threads && len > READ_SEGMENT_SIZE)
+        return read_parallel(fd, buf, len, offset, parallel_read_threads);
+    if (pread_fully(fd, buf, len, offset)) {
+        SYSERROR("Failed to read %zu bytes at offset %lld", len, (long long)offset);
+        return -1;
+    }
+    return 0;
+}
+
 void* file_get_contents(const char* fn, size_t* len, anbool addzero) {
     struct stat st;
     char* buf;
@@ -776,11 +891,13 @@ void* file_get_contents(const char* fn, size_t* len, anbool addzero) {
     buf = malloc(size + (addzero ? 1 : 0));
     if (!buf) {
         fprintf(stderr, "file_get_contents: couldn't malloc %lu bytes.\n", (long)size);
+        fclose(fid);
         return NULL;
     }
-    if (fread(buf, 1, size, fid) != size) {
+    if (read_at(fileno(fid), buf, size, 0)) {
         fprintf(stderr, "file_get_contents: failed to read %lu bytes: %s\n", (long)size, strerror(errno));
         free(buf);
+        fclose(fid);
         return NULL;
     }
     fclose(fid);
@@ -9,6 +9,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "log.h"
 #include "an-thread.h"
@@ -46,7 +51,11 @@ void log_init_structure(log_t* logger, enum log_level level) {
 }
 
 void log_init(enum log_level level) {
+    const char* env;
     log_init_structure(get_logger(), level);
+    env = getenv("AN_LOG_ASYNC");
+    if (env && env[0] && strcmp(env, "0"))
+        log_set_async(TRUE);
 }
 
 void log_set_level(enum log_level level) {
@@ -58,6 +67,8 @@ void log_set_timestamp(anbool b) {
 }
 
 void log_to(FILE* fid) {
+    // the caller may be about to close the previous FILE*.
+    log_flush();
     get_logger()->f = fid;
 }
 
@@ -85,11 +96,350 @@ void log_free(log_t* log) {
 
 AN_THREAD_DECLARE_STATIC_MUTEX(loglock);
 
+/*
+ Asynchronous mode.  Each thread formats its messages into a ring
+ buffer of its own (a single-producer, single-consumer queue, so the
+ producer takes no lock); a background thread merges the rings in the
+ order the messages were logged and writes them out in batches,
+ flushing each FILE* once per batch rather than once per line.
+
+ A record is a struct log_record followed by the text, padded to a
+ multiple of 8 bytes.  A record never wraps around the end of the
+ buffer: a "len" of LOG_RING_WRAP tells the reader to skip to the start.
+ "head" and "tail" count bytes ever written and read; only the owning
+ thread moves "head", only the drain thread moves "tail".
+ */
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_RING_WRAP 0xffffffffu
+#define LOG_MAX_FIDS  16
+
+struct log_record {
+    uint32_t len;
+    uint64_t seq;
+    FILE* f;
+};
+
+#define LOG_ALIGN(n) (((n) + 7) & ~((size_t)7))
+#define LOG_RECORD_SIZE(len) (LOG_ALIGN(sizeof(struct log_record) + (len)))
+
+struct log_ring {
+    char* buf;
+    size_t head;
+    size_t tail;
+    int dead;
+    struct log_ring* next;
+};
+
+static int g_async = 0;
+static uint64_t g_seq = 0;
+
+// "drainlock" guards the list of rings and the draining itself.
+static pthread_mutex_t drainlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t draincond = PTHREAD_COND_INITIALIZER;
+static struct log_ring* g_rings = NULL;
+static pthread_t g_drainer;
+static int g_drainer_running = 0;
+static int g_drainer_stop = 0;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void ring_dead(void* v) {
+    struct log_ring* r = v;
+    // the drain thread frees it once it has been emptied.
+    if (r)
+        __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_atfork_prepare(void);
+static void log_atfork_parent(void);
+static void log_atfork_child(void);
+
+static void make_ring_key(void) {
+    pthread_key_create(&ring_key, ring_dead);
+    pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+}
+
+static struct log_ring* get_ring(void) {
+    struct log_ring* r;
+    pthread_once(&ring_key_once, make_ring_key);
+    r = pthread_getspecific(ring_key);
+    if (r)
+        return r;
+    r = calloc(1, sizeof(struct log_ring));
+    if (!r)
+        return NULL;
+    r->buf = malloc(LOG_RING_SIZE);
+    if (!r->buf) {
+        free(r);
+        return NULL;
+    }
+    pthread_setspecific(ring_key, r);
+    pthread_mutex_lock(&drainlock);
+    r->next = g_rings;
+    g_rings = r;
+    pthread_mutex_unlock(&drainlock);
+    return r;
+}
+
+// Returns the record at the ring's tail, or NULL if it is empty.
+static struct log_record* ring_peek(struct log_ring* r) {
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    struct log_record* rec;
+    if (r->tail == head)
+        return NULL;
+    rec = (struct log_record*)(r->buf + (r->tail & (LOG_RING_SIZE-1)));
+    if (rec->len != LOG_RING_WRAP)
+        return rec;
+    __atomic_store_n(&r->tail, r->tail + LOG_RING_SIZE - (r->tail & (LOG_RING_SIZE-1)),
+                     __ATOMIC_RELEASE);
+    if (r->tail == head)
+        return NULL;
+    return (struct log_record*)(r->buf + (r->tail & (LOG_RING_SIZE-1)));
+}
+
+// Writes out everything queued so far.  Call with "drainlock" held.
+static void drain_locked(void) {
+    FILE* fids[LOG_MAX_FIDS];
+    int nfids = 0;
+    int i;
+    struct log_ring** pr;
+
+    for (;;) {
+        struct log_ring* best = NULL;
+        struct log_record* bestrec = NULL;
+        struct log_ring* r;
+        for (r=g_rings; r; r=r->next) {
+            struct log_record* rec = ring_peek(r);
+            if (rec && (!bestrec || rec->seq < bestrec->seq)) {
+                best = r;
+                bestrec = rec;
+            }
+        }
+        if (!best)
+            break;
+        fwrite(bestrec + 1, 1, bestrec->len, bestrec->f);
+        for (i=0; i<nfids; i++)
+            if (fids[i] == bestrec->f)
+                break;
+        if (i == nfids) {
+            if (nfids == LOG_MAX_FIDS)
+                fflush(fids[--nfids]);
+            fids[nfids++] = bestrec->f;
+        }
+        __atomic_store_n(&best->tail, best->tail + LOG_RECORD_SIZE(bestrec->len),
+                         __ATOMIC_RELEASE);
+    }
+    for (i=0; i<nfids; i++)
+        fflush(fids[i]);
+
+    // free the rings of threads that have exited.
+    pr = &g_rings;
+    while (*pr) {
+        struct log_ring* r = *pr;
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+            r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+            *pr = r->next;
+            free(r->buf);
+            free(r);
+        } else
+            pr = &r->next;
+    }
+}
+
+static void* drain_thread(void* v) {
+    pthread_mutex_lock(&drainlock);
+    while (!g_drainer_stop) {
+        struct timeval tv;
+        struct timespec ts;
+        drain_locked();
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec;
+        ts.tv_nsec = tv.tv_usec * 1000 + 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&draincond, &drainlock, &ts);
+    }
+    drain_locked();
+    pthread_mutex_unlock(&drainlock);
+    return NULL;
+}
+
+static int start_drainer(void) {
+    int rtn = 0;
+    pthread_mutex_lock(&drainlock);
+    if (!g_drainer_running) {
+        g_drainer_stop = 0;
+        if (pthread_create(&g_drainer, NULL, drain_thread, NULL))
+            rtn = -1;
+        else
+            __atomic_store_n(&g_drainer_running, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&drainlock);
+    return rtn;
+}
+
+static void stop_drainer(void) {
+    pthread_mutex_lock(&drainlock);
+    if (!g_drainer_running) {
+        drain_locked();
+        pthread_mutex_unlock(&drainlock);
+        return;
+    }
+    g_drainer_stop = 1;
+    pthread_cond_signal(&draincond);
+    pthread_mutex_unlock(&drainlock);
+    pthread_join(g_drainer, NULL);
+    __atomic_store_n(&g_drainer_running, 0, __ATOMIC_RELEASE);
+}
+
+static void log_atexit(void) {
+    __atomic_store_n(&g_async, 0, __ATOMIC_RELEASE);
+    stop_drainer();
+}
+
+static void log_atfork_prepare(void) {
+    pthread_mutex_lock(&drainlock);
+    drain_locked();
+}
+
+static void log_atfork_parent(void) {
+    pthread_mutex_unlock(&drainlock);
+}
+
+static void log_atfork_child(void) {
+    struct log_ring* mine = pthread_getspecific(ring_key);
+    struct log_ring* r;
+    // whatever the other threads queued meanwhile is the parent's to
+    // write, and those threads don't exist here.  The drain thread is
+    // restarted by the next message.
+    for (r=g_rings; r; r=r->next) {
+        r->tail = r->head;
+        if (r != mine)
+            r->dead = 1;
+    }
+    g_drainer_running = 0;
+    pthread_cond_init(&draincond, NULL);
+    pthread_mutex_unlock(&drainlock);
+}
+
+static void register_atexit(void) {
+    atexit(log_atexit);
+}
+
+int log_set_async(anbool async) {
+    static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
+    if (!async) {
+        if (!__atomic_load_n(&g_async, __ATOMIC_ACQUIRE))
+            return 0;
+        __atomic_store_n(&g_async, 0, __ATOMIC_RELEASE);
+        stop_drainer();
+        return 0;
+    }
+    pthread_once(&ring_key_once, make_ring_key);
+    pthread_once(&atexit_once, register_atexit);
+    if (start_drainer())
+        return -1;
+    __atomic_store_n(&g_async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_flush(void) {
+    if (!__atomic_load_n(&g_async, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&drainlock);
+    drain_locked();
+    pthread_mutex_unlock(&drainlock);
+}
+
+// Queues "len" bytes of "text" for "f".  Returns -1 if the message
+// can't be queued (no ring, or it is too big for one).
+static int log_enqueue(FILE* f, const char* text, size_t len) {
+    struct log_ring* r;
+    size_t need = LOG_RECORD_SIZE(len);
+
+    if (need > LOG_RING_SIZE / 2)
+        return -1;
+    if (!__atomic_load_n(&g_drainer_running, __ATOMIC_ACQUIRE) &&
+        start_drainer())
+        return -1;
+    r = get_ring();
+    if (!r)
+        return -1;
+    for (;;) {
+        size_t head = r->head;
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        size_t off = head & (LOG_RING_SIZE-1);
+        size_t toend = LOG_RING_SIZE - off;
+        size_t total = (toend < need) ? toend + need : need;
+        struct log_record* rec;
+        if (LOG_RING_SIZE - (head - tail) < total) {
+            // full: hurry the drain thread along.
+            pthread_cond_signal(&draincond);
+            sched_yield();
+            continue;
+        }
+        if (toend < need) {
+            ((struct log_record*)(r->buf + off))->len = LOG_RING_WRAP;
+            head += toend;
+            off = 0;
+        }
+        rec = (struct log_record*)(r->buf + off);
+        rec->len = (uint32_t)len;
+        rec->seq = __atomic_fetch_add(&g_seq, 1, __ATOMIC_RELAXED);
+        rec->f = f;
+        memcpy(rec + 1, text, len);
+        __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+        return 0;
+    }
+}
+
+// Formats the message (the arguments may not outlive this call) and
+// queues it.  Returns -1 if it must be written synchronously instead.
+static int log_async(const log_t* logger, const char* format, va_list va) {
+    char stackbuf[1024];
+    char* buf = stackbuf;
+    int nts = 0;
+    int n, rtn;
+    va_list va2;
+
+    if (logger->timestamp)
+        nts = snprintf(stackbuf, sizeof(stackbuf), "[%6i: %.3f] ",
+                       (int)getpid(), timenow() - logger->t0);
+    va_copy(va2, va);
+    n = vsnprintf(stackbuf + nts, sizeof(stackbuf) - nts, format, va2);
+    va_end(va2);
+    if (n < 0)
+        return -1;
+    if ((size_t)(nts + n) >= sizeof(stackbuf)) {
+        buf = malloc(nts + n + 1);
+        if (!buf)
+            return -1;
+        memcpy(buf, stackbuf, nts);
+        va_copy(va2, va);
+        vsnprintf(buf + nts, n + 1, format, va2);
+        va_end(va2);
+    }
+    rtn = log_enqueue(logger->f, buf, nts + n);
+    if (buf != stackbuf)
+        free(buf);
+    return rtn;
+}
+
 static void loglvl(const log_t* logger, enum log_level level,
                    const char* file, int line, const char* func,
                    const char* format, va_list va) {
     if (level > logger->level)
         return;
+    if (__atomic_load_n(&g_async, __ATOMIC_ACQUIRE)) {
+        // (user-specified functions are still called synchronously.)
+        if (!logger->logfunc && logger->f && log_async(logger, format, va) == 0)
+            return;
+        // keep this message after the ones already queued.
+        log_flush();
+    }
     AN_THREAD_LOCK(loglock);
     if (logger->f) {
         if (logger->timestamp)
@@ -118,6 +468,8 @@ int log_get_level() {
 }
 
 FILE* log_get_fid() {
+    // callers write to it directly; keep their output after ours.
+    log_flush();
     return get_logger()->f;
 }
 
@@ -119,6 +119,7 @@ int multiindex_add_index(multiindex_t* mi, const char* fn, int flags) {
     }
 	
     ind = index_build_from(codes, quads, mi->starkd);
+    ind->shared_starkd = TRUE;
     ind->fits = fits;
     if (!ind->indexname)
         ind->indexname = strdup(fn);
@@ -127,12 +128,9 @@ int multiindex_add_index(multiindex_t* mi, const char* fn, int flags) {
 
     pl_append(mi->inds, ind);
 
-    if (flags & INDEX_ONLY_LOAD_METADATA) {
-        // don't let it unload the starkd!
-        ind->starkd = NULL;
+    if (flags & INDEX_ONLY_LOAD_METADATA)
+        // (this leaves the shared starkd loaded.)
         index_unload(ind);
-        ind->starkd = mi->starkd;
-    }
 
     return 0;
  bailout:
@@ -0,0 +1,322 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "oset.h"
+
+// Target size of a node's key array.
+#define NODE_BYTES 512
+#define MIN_CAP 8
+// The tree can't get this deep with MIN_CAP >= 8.
+#define MAX_DEPTH 64
+
+struct oset_node {
+    // number of elements (leaves) or separator keys (inner nodes).
+    int n;
+    anbool isleaf;
+    // the next leaf, in order (leaves only).
+    struct oset_node* next;
+    // n+1 children (inner nodes only); there is room for one extra,
+    // and one extra key, so that a node can overflow before it is split.
+    struct oset_node** children;
+    char* keys;
+};
+typedef struct oset_node oset_node;
+
+static char* KEY(const oset* s, const oset_node* node, int i) {
+    return node->keys + (size_t)i * s->datasize;
+}
+
+static oset_node* new_node(const oset* s, anbool isleaf) {
+    size_t nkids = isleaf ? 0 : (s->innercap + 2);
+    size_t nkeys = (isleaf ? s->leafcap : s->innercap) + 1;
+    oset_node* node = malloc(sizeof(oset_node) + nkids * sizeof(oset_node*) +
+                             nkeys * s->datasize);
+    if (!node)
+        return NULL;
+    node->n = 0;
+    node->isleaf = isleaf;
+    node->next = NULL;
+    node->children = isleaf ? NULL : (oset_node**)(node + 1);
+    node->keys = (char*)(node + 1) + nkids * sizeof(oset_node*);
+    return node;
+}
+
+static void free_node(oset_node* node) {
+    int i;
+    if (!node->isleaf)
+        for (i=0; i<=node->n; i++)
+            free_node(node->children[i]);
+    free(node);
+}
+
+static int compare(const oset* s, const void* v1, const void* v2) {
+    if (s->isint64) {
+        int64_t a = *(const int64_t*)v1;
+        int64_t b = *(const int64_t*)v2;
+        return (a > b) - (a < b);
+    }
+    return s->compare(v1, v2, s->token);
+}
+
+// Returns the number of keys in "node" that are less than (or, if
+// "orequal", less than or equal to) "data".
+static int count_below(const oset* s, const oset_node* node,
+                       const void* data, anbool orequal) {
+    int lo, hi;
+    if (s->isint64) {
+        // branch-free, so that it vectorizes.
+        const int64_t* k = (const int64_t*)node->keys;
+        int64_t x = *(const int64_t*)data;
+        int i, c = 0;
+        if (orequal)
+            for (i=0; i<node->n; i++)
+                c += (k[i] <= x);
+        else
+            for (i=0; i<node->n; i++)
+                c += (k[i] < x);
+        return c;
+    }
+    lo = 0;
+    hi = node->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = s->compare(KEY(s, node, mid), data, s->token);
+        if (c < 0 || (orequal && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static oset* new_set(int datasize) {
+    oset* s = calloc(1, sizeof(oset));
+    if (!s)
+        return NULL;
+    s->datasize = datasize;
+    s->leafcap = s->innercap = NODE_BYTES / datasize;
+    if (s->leafcap < MIN_CAP)
+        s->leafcap = s->innercap = MIN_CAP;
+    return s;
+}
+
+oset* oset_new(int datasize, oset_compare_func compare, void* token) {
+    oset* s = new_set(datasize);
+    if (!s)
+        return NULL;
+    s->compare = compare;
+    s->token = token;
+    return s;
+}
+
+oset* oset_new_int64(void) {
+    oset* s = new_set(sizeof(int64_t));
+    if (!s)
+        return NULL;
+    s->isint64 = TRUE;
+    return s;
+}
+
+void oset_free(oset* s) {
+    if (!s)
+        return;
+    if (s->root)
+        free_node(s->root);
+    free(s);
+}
+
+size_t oset_size(const oset* s) {
+    return s->N;
+}
+
+anbool oset_contains(const oset* s, const void* data) {
+    const oset_node* node = s->root;
+    int i;
+    if (!node)
+        return FALSE;
+    while (!node->isleaf)
+        node = node->children[count_below(s, node, data, TRUE)];
+    i = count_below(s, node, data, FALSE);
+    return (i < node->n && compare(s, KEY(s, node, i), data) == 0);
+}
+
+anbool oset_insert(oset* s, const void* data, anbool unique) {
+    oset_node* path[MAX_DEPTH];
+    int slot[MAX_DEPTH];
+    int depth = 0;
+    int ds = s->datasize;
+    oset_node* node;
+    oset_node* right;
+    oset_node* root;
+    const char* sep;
+    int i;
+
+    if (!s->root) {
+        s->root = s->first = new_node(s, TRUE);
+        if (!s->root)
+            return FALSE;
+    }
+    node = s->root;
+    while (!node->isleaf) {
+        i = count_below(s, node, data, TRUE);
+        assert(depth < MAX_DEPTH);
+        path[depth] = node;
+        slot[depth] = i;
+        depth++;
+        node = node->children[i];
+    }
+    if (unique) {
+        i = count_below(s, node, data, FALSE);
+        if (i < node->n && compare(s, KEY(s, node, i), data) == 0)
+            return FALSE;
+    } else
+        i = count_below(s, node, data, TRUE);
+
+    memmove(KEY(s, node, i+1), KEY(s, node, i), (size_t)(node->n - i) * ds);
+    memcpy(KEY(s, node, i), data, ds);
+    node->n++;
+    s->N++;
+    if (node->n <= s->leafcap)
+        return TRUE;
+
+    // split the leaf; its right half moves to a new leaf.
+    right = new_node(s, TRUE);
+    right->n = node->n - node->n / 2;
+    node->n /= 2;
+    memcpy(right->keys, KEY(s, node, node->n), (size_t)right->n * ds);
+    right->next = node->next;
+    node->next = right;
+    sep = right->keys;
+
+    // insert the new node into its parent, splitting upward as needed.
+    while (depth > 0) {
+        oset_node* parent;
+        int mid;
+        depth--;
+        parent = path[depth];
+        i = slot[depth];
+        memmove(KEY(s, parent, i+1), KEY(s, parent, i),
+                (size_t)(parent->n - i) * ds);
+        memcpy(KEY(s, parent, i), sep, ds);
+        memmove(parent->children + i + 2, parent->children + i + 1,
+                (parent->n - i) * sizeof(oset_node*));
+        parent->children[i+1] = right;
+        parent->n++;
+        if (parent->n <= s->innercap)
+            return TRUE;
+
+        // the middle key moves up; the keys to its right move to a new node.
+        mid = parent->n / 2;
+        right = new_node(s, FALSE);
+        right->n = parent->n - mid - 1;
+        memcpy(right->keys, KEY(s, parent, mid+1), (size_t)right->n * ds);
+        memcpy(right->children, parent->children + mid + 1,
+               (right->n + 1) * sizeof(oset_node*));
+        parent->n = mid;
+        // (still intact, just past the end of "parent"'s keys)
+        sep = KEY(s, parent, mid);
+    }
+
+    root = new_node(s, FALSE);
+    memcpy(root->keys, sep, ds);
+    root->children[0] = s->root;
+    root->children[1] = right;
+    root->n = 1;
+    s->root = root;
+    return TRUE;
+}
+
+anbool oset_insert_int64(oset* s, int64_t val, anbool unique) {
+    assert(s->isint64);
+    return oset_insert(s, &val, unique);
+}
+
+anbool oset_contains_int64(const oset* s, int64_t val) {
+    assert(s->isint64);
+    return oset_contains(s, &val);
+}
+
+void oset_copy(const oset* s, void* dest) {
+    const oset_node* leaf;
+    char* out = dest;
+    for (leaf = s->first; leaf; leaf = leaf->next) {
+        memcpy(out, leaf->keys, (size_t)leaf->n * s->datasize);
+        out += (size_t)leaf->n * s->datasize;
+    }
+}
+
+void oset_iter_init(const oset* s, oset_iter* it) {
+    it->leaf = s->first;
+    it->index = 0;
+    it->datasize = s->datasize;
+}
+
+const void* oset_iter_next(oset_iter* it) {
+    while (it->leaf && it->index >= it->leaf->n) {
+        it->leaf = it->leaf->next;
+        it->index = 0;
+    }
+    if (!it->leaf)
+        return NULL;
+    return it->leaf->keys + (size_t)(it->index++) * it->datasize;
+}
+
+// Checks the subtree at "node", whose elements must lie within
+// ["lo", "hi"] (either may be NULL); returns the number of elements, or
+// -1 on error.  "leafdepth" is the depth of the leaves, once known.
+static ptrdiff_t check_node(const oset* s, const oset_node* node,
+                            const void* lo, const void* hi,
+                            int level, int* leafdepth,
+                            const oset_node** nextleaf) {
+    ptrdiff_t total = 0;
+    int i;
+    if (node->n > (node->isleaf ? s->leafcap : s->innercap))
+        return -1;
+    for (i=0; i<node->n; i++) {
+        const char* k = KEY(s, node, i);
+        if (i && compare(s, KEY(s, node, i-1), k) > 0)
+            return -1;
+        if ((lo && compare(s, lo, k) > 0) || (hi && compare(s, k, hi) > 0))
+            return -1;
+    }
+    if (node->isleaf) {
+        if (*leafdepth == -1)
+            *leafdepth = level;
+        if (level != *leafdepth)
+            return -1;
+        // the leaves must be chained in order.
+        if (node != *nextleaf)
+            return -1;
+        *nextleaf = node->next;
+        return node->n;
+    }
+    if (node->n < 1)
+        return -1;
+    for (i=0; i<=node->n; i++) {
+        ptrdiff_t n = check_node(s, node->children[i],
+                                 i ? KEY(s, node, i-1) : lo,
+                                 (i < node->n) ? KEY(s, node, i) : hi,
+                                 level + 1, leafdepth, nextleaf);
+        if (n < 0)
+            return -1;
+        total += n;
+    }
+    return total;
+}
+
+int oset_check(const oset* s) {
+    int leafdepth = -1;
+    const oset_node* nextleaf = s->first;
+    if (!s->root)
+        return (s->N == 0) ? 0 : -1;
+    if (check_node(s, s->root, NULL, NULL, 0, &leafdepth, &nextleaf)
+        != (ptrdiff_t)s->N)
+        return -1;
+    return nextleaf ? -1 : 0;
+}
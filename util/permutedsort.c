@@ -9,10 +9,12 @@
 #include <stdio.h>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include "permutedsort.h"
 #include "os-features.h"
 #include "ioutils.h"
+#include "an-bool.h"
 
 int* permutation_init(int* perm, int N) {
     int i;
@@ -25,27 +27,141 @@ int* permutation_init(int* perm, int N) {
     return perm;
 }
 
+/*
+ Applying a permutation in place: element i takes the value of element
+ perm[i], which takes that of perm[perm[i]], and so on around the
+ cycle back to i, so only the one element at the start of each cycle
+ needs saving; a bitmap marks the elements still to do.  That needs
+ "perm" to be a permutation of [0, N).  Selections with perm[i] >= i
+ (such as the indices of a subset, in order) are just copied forward,
+ and anything else (repeated indices, say) goes through a copy.
+ */
+
+// (the element copies, with the common sizes known at compile time)
+static inline void copy_elem(char* dst, const char* src, int elemsize) {
+    switch (elemsize) {
+    case 4:  memcpy(dst, src, 4);  break;
+    case 8:  memcpy(dst, src, 8);  break;
+    case 16: memcpy(dst, src, 16); break;
+    case 24: memcpy(dst, src, 24); break;
+    default: memcpy(dst, src, elemsize);
+    }
+}
+
+static void apply_with_copy(const int* perm, int N, char* array, int elemsize) {
+    char* temparr = malloc((size_t)elemsize * (size_t)N);
+    int i;
+    for (i=0; i<N; i++)
+        copy_elem(temparr + (size_t)i * elemsize,
+                  array + (size_t)perm[i] * elemsize, elemsize);
+    memcpy(array, temparr, (size_t)elemsize * (size_t)N);
+    free(temparr);
+}
+
+static void apply_in_place(const int* perm, int N, void** arrays,
+                           const int* elemsizes, int narrays) {
+    uint64_t* todo;
+    char* saved;
+    size_t nsaved;
+    int nw = (N + 63) / 64;
+    int i, j, k, w;
+
+    for (i=0; i<N; i++)
+        if (perm[i] < i)
+            break;
+    if (i == N) {
+        for (k=0; k<narrays; k++) {
+            char* a = arrays[k];
+            int es = elemsizes[k];
+            if (!a)
+                continue;
+            for (i=0; i<N; i++)
+                if (perm[i] != i)
+                    copy_elem(a + (size_t)i * es, a + (size_t)perm[i] * es, es);
+        }
+        return;
+    }
+
+    todo = calloc(nw, sizeof(uint64_t));
+    for (i=0; i<N; i++) {
+        int p = perm[i];
+        if (p < 0 || p >= N || (todo[p >> 6] >> (p & 63)) & 1)
+            break;
+        todo[p >> 6] |= (uint64_t)1 << (p & 63);
+    }
+    if (i < N) {
+        free(todo);
+        for (k=0; k<narrays; k++)
+            if (arrays[k])
+                apply_with_copy(perm, N, arrays[k], elemsizes[k]);
+        return;
+    }
+
+    // Every bit is set now; they get cleared as the elements are done.
+    nsaved = 0;
+    for (k=0; k<narrays; k++)
+        if (arrays[k])
+            nsaved += elemsizes[k];
+    saved = malloc(MAX(nsaved, 1));
+    for (w=0; w<nw; w++) {
+        while (todo[w]) {
+            size_t off;
+            i = w * 64 + __builtin_ctzll(todo[w]);
+            todo[w] &= ~((uint64_t)1 << (i & 63));
+            if (perm[i] == i)
+                continue;
+            off = 0;
+            for (k=0; k<narrays; k++) {
+                if (!arrays[k])
+                    continue;
+                copy_elem(saved + off, (char*)arrays[k] + (size_t)i * elemsizes[k],
+                          elemsizes[k]);
+                off += elemsizes[k];
+            }
+            for (j=i; perm[j] != i; j=perm[j]) {
+                int p = perm[j];
+                for (k=0; k<narrays; k++) {
+                    char* a = arrays[k];
+                    int es = elemsizes[k];
+                    if (a)
+                        copy_elem(a + (size_t)j * es, a + (size_t)p * es, es);
+                }
+                todo[p >> 6] &= ~((uint64_t)1 << (p & 63));
+            }
+            off = 0;
+            for (k=0; k<narrays; k++) {
+                if (!arrays[k])
+                    continue;
+                copy_elem((char*)arrays[k] + (size_t)j * elemsizes[k], saved + off,
+                          elemsizes[k]);
+                off += elemsizes[k];
+            }
+        }
+    }
+    free(saved);
+    free(todo);
+}
+
 void permutation_apply(const int* perm, int Nperm, const void* inarray,
                        void* outarray, int elemsize) {
-    void* temparr = NULL;
-    int i;
     const char* cinput;
     char* coutput;
+    int i;
 
     if (inarray == outarray) {
-        temparr = malloc((size_t)elemsize * (size_t)Nperm);
-        coutput = temparr;
-    } else
-        coutput = outarray;
-
+        apply_in_place(perm, Nperm, &outarray, &elemsize, 1);
+        return;
+    }
     cinput = inarray;
+    coutput = outarray;
     for (i=0; i<Nperm; i++)
-        memcpy(coutput + i * elemsize, cinput + (size_t)perm[i] * (size_t)elemsize, elemsize);
+        copy_elem(coutput + (size_t)i * elemsize,
+                  cinput + (size_t)perm[i] * (size_t)elemsize, elemsize);
+}
 
-    if (inarray == outarray) {
-        memcpy(outarray, temparr, (size_t)elemsize * (size_t)Nperm);
-        free(temparr);
-    }
+void permutation_apply_multi(const int* perm, int Nperm, void** arrays,
+                             const int* elemsizes, int narrays) {
+    apply_in_place(perm, Nperm, arrays, elemsizes, narrays);
 }
 
 struct permuted_sort_t {
@@ -67,6 +183,283 @@ static int QSORT_COMPARISON_FUNCTION(compare_permuted, void* user, const void* v
     return ps->compare(val1, val2);
 }
 
+/*
+ The comparators below on doubles, floats, ints and int64s order their
+ values the same way as unsigned integer keys made from their bits
+ (flipped for the "desc" versions; NaNs last, as in COMPARE), so
+ permuted_sort() with one of them extracts the keys once and runs a
+ radix sort on them, rather than qsort with two indirect loads and a
+ callback per comparison.  The radix sort is stable: elements that
+ compare equal keep their order in "perm".
+ */
+enum key_kind {
+    KEY_NONE = 0,
+    KEY_DOUBLE,
+    KEY_FLOAT,
+    KEY_INT,
+    KEY_INT64,
+};
+
+static enum key_kind comparator_keys(int (*compare)(const void*, const void*),
+                                     anbool* desc) {
+    *desc = (compare == compare_doubles_desc || compare == compare_floats_desc ||
+             compare == compare_ints_desc || compare == compare_int64_desc);
+    if (compare == compare_doubles_asc || compare == compare_doubles_desc)
+        return KEY_DOUBLE;
+    if (compare == compare_floats_asc || compare == compare_floats_desc)
+        return KEY_FLOAT;
+    if (compare == compare_ints_asc || compare == compare_ints_desc)
+        return KEY_INT;
+    if (compare == compare_int64_asc || compare == compare_int64_desc)
+        return KEY_INT64;
+    return KEY_NONE;
+}
+
+static uint64_t value_key(const char* p, enum key_kind kind, anbool desc) {
+    uint64_t k;
+    switch (kind) {
+    case KEY_DOUBLE: {
+        uint64_t u;
+        memcpy(&u, p, sizeof(u));
+        // (bit tests: we may be built with -ffinite-math-only)
+        if ((u & 0x7ff0000000000000ULL) == 0x7ff0000000000000ULL &&
+            (u & 0x000fffffffffffffULL))
+            return UINT64_MAX;
+        // -0 and +0 compare equal.
+        if (u == 0x8000000000000000ULL)
+            u = 0;
+        k = (u >> 63) ? ~u : (u | 0x8000000000000000ULL);
+        break;
+    }
+    case KEY_FLOAT: {
+        uint32_t u;
+        memcpy(&u, p, sizeof(u));
+        if ((u & 0x7f800000) == 0x7f800000 && (u & 0x007fffff))
+            return UINT32_MAX;
+        if (u == 0x80000000u)
+            u = 0;
+        k = (u >> 31) ? (uint32_t)~u : (u | 0x80000000u);
+        break;
+    }
+    case KEY_INT: {
+        int i;
+        memcpy(&i, p, sizeof(i));
+        k = (uint32_t)i ^ 0x80000000u;
+        break;
+    }
+    case KEY_INT64: {
+        int64_t i;
+        memcpy(&i, p, sizeof(i));
+        k = (uint64_t)i ^ 0x8000000000000000ULL;
+        break;
+    }
+    default:
+        return 0;
+    }
+    if (desc)
+        k = (kind == KEY_DOUBLE || kind == KEY_INT64) ? ~k : (uint32_t)~k;
+    return k;
+}
+
+// Sorts "keys", and "vals" along with them, on the low "nbytes" bytes of
+// the keys; stable.
+static void radix_sort_keys(uint64_t* keys, int* vals, int N, int nbytes) {
+    size_t (*hist)[256];
+    uint64_t* srck = keys;
+    int* srcv = vals;
+    uint64_t* dstk;
+    int* dstv;
+    int b, i;
+
+    if (N <= 32) {
+        // insertion sort
+        for (i=1; i<N; i++) {
+            uint64_t k = keys[i];
+            int v = vals[i];
+            int j;
+            for (j=i; j>0 && keys[j-1] > k; j--) {
+                keys[j] = keys[j-1];
+                vals[j] = vals[j-1];
+            }
+            keys[j] = k;
+            vals[j] = v;
+        }
+        return;
+    }
+
+    hist = calloc(nbytes, sizeof(*hist));
+    for (i=0; i<N; i++)
+        for (b=0; b<nbytes; b++)
+            hist[b][(keys[i] >> (8*b)) & 0xff]++;
+
+    dstk = malloc((size_t)N * sizeof(uint64_t));
+    dstv = malloc((size_t)N * sizeof(int));
+    for (b=0; b<nbytes; b++) {
+        size_t pos[256];
+        size_t total = 0;
+        uint64_t* tk;
+        int* tv;
+        int d;
+        // all the keys have the same digit here.
+        if (hist[b][(srck[0] >> (8*b)) & 0xff] == (size_t)N)
+            continue;
+        for (d=0; d<256; d++) {
+            pos[d] = total;
+            total += hist[b][d];
+        }
+        for (i=0; i<N; i++) {
+            size_t j = pos[(srck[i] >> (8*b)) & 0xff]++;
+            dstk[j] = srck[i];
+            dstv[j] = srcv[i];
+        }
+        tk = srck; srck = dstk; dstk = tk;
+        tv = srcv; srcv = dstv; dstv = tv;
+    }
+    if (srck != keys) {
+        memcpy(keys, srck, (size_t)N * sizeof(uint64_t));
+        memcpy(vals, srcv, (size_t)N * sizeof(int));
+        dstk = srck;
+        dstv = srcv;
+    }
+    free(hist);
+    free(dstk);
+    free(dstv);
+}
+
+// Sorts "perm" with a radix sort, if "compare" is one of ours.
+static anbool permuted_sort_keys(const void* realarray, int array_stride,
+                                 int (*compare)(const void*, const void*),
+                                 int* perm, int N) {
+    const char* darray = realarray;
+    enum key_kind kind;
+    anbool desc;
+    uint64_t* keys;
+    int nbytes;
+    int i;
+
+    kind = comparator_keys(compare, &desc);
+    if (kind == KEY_NONE)
+        return FALSE;
+    keys = malloc((size_t)N * sizeof(uint64_t));
+    if (!keys)
+        return FALSE;
+    for (i=0; i<N; i++)
+        keys[i] = value_key(darray + (size_t)perm[i] * (size_t)array_stride,
+                            kind, desc);
+    nbytes = (kind == KEY_DOUBLE || kind == KEY_INT64) ? 8 : 4;
+    radix_sort_keys(keys, perm, N, nbytes);
+    free(keys);
+    return TRUE;
+}
+
+// Returns the k-th smallest of "keys" (0-indexed), reordering them.
+static uint64_t select_key(uint64_t* keys, int N, int k) {
+    int lo = 0, hi = N - 1;
+    while (hi > lo) {
+        uint64_t a = keys[lo], b = keys[(lo + hi) / 2], c = keys[hi];
+        // median of three
+        uint64_t pivot = (a < b) ? ((b < c) ? b : MAX(a, c))
+            : ((a < c) ? a : MAX(b, c));
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (keys[i] < pivot)
+                i++;
+            while (keys[j] > pivot)
+                j--;
+            if (i <= j) {
+                uint64_t t = keys[i];
+                keys[i] = keys[j];
+                keys[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return keys[k];
+}
+
+int* permuted_sort_topk(const void* realarray, int array_stride,
+                        int (*compare)(const void*, const void*),
+                        int K, int N) {
+    const char* darray = realarray;
+    enum key_kind kind;
+    anbool desc;
+    uint64_t *keys, *sel;
+    uint64_t kth;
+    int* perm;
+    int i, n;
+
+    K = MAX(0, MIN(K, N));
+    kind = comparator_keys(compare, &desc);
+    // (sorting everything is about as quick as selecting most of it)
+    if (kind == KEY_NONE || K > N / 4) {
+        perm = permuted_sort(realarray, array_stride, compare, NULL, N);
+        if (perm && K < N)
+            perm = realloc(perm, MAX(K, 1) * sizeof(int));
+        return perm;
+    }
+    perm = malloc(MAX(K, 1) * sizeof(int));
+    keys = malloc((size_t)N * sizeof(uint64_t));
+    sel = malloc((size_t)N * sizeof(uint64_t));
+    if (!perm || !keys || !sel) {
+        free(perm);
+        free(keys);
+        free(sel);
+        return NULL;
+    }
+    if (!K) {
+        free(keys);
+        free(sel);
+        return perm;
+    }
+    for (i=0; i<N; i++)
+        keys[i] = value_key(darray + (size_t)i * (size_t)array_stride,
+                            kind, desc);
+    memcpy(sel, keys, (size_t)N * sizeof(uint64_t));
+    kth = select_key(sel, N, K-1);
+
+    // Everything below the K-th key, then as many of those equal to it as
+    // fit, each in index order -- so that the stable sort of these K
+    // gives the first K of the full stable sort.
+    n = 0;
+    for (i=0; i<N; i++) {
+        if (keys[i] < kth) {
+            sel[n] = keys[i];
+            perm[n++] = i;
+        }
+    }
+    for (i=0; i<N && n<K; i++) {
+        if (keys[i] == kth) {
+            sel[n] = keys[i];
+            perm[n++] = i;
+        }
+    }
+    assert(n == K);
+    radix_sort_keys(sel, perm, K,
+                    (kind == KEY_DOUBLE || kind == KEY_INT64) ? 8 : 4);
+    free(keys);
+    free(sel);
+    return perm;
+}
+
+anbool permuted_sort_key(const void* value,
+                         int (*compare)(const void*, const void*),
+                         uint64_t* key) {
+    enum key_kind kind;
+    anbool desc;
+    kind = comparator_keys(compare, &desc);
+    if (kind == KEY_NONE)
+        return FALSE;
+    *key = value_key(value, kind, desc);
+    return TRUE;
+}
+
 int* permuted_sort(const void* realarray, int array_stride,
                    int (*compare)(const void*, const void*),
                    int* perm, int N) {
@@ -74,6 +467,9 @@ int* permuted_sort(const void* realarray, int array_stride,
     if (!perm)
         perm = permutation_init(perm, N);
 
+    if (N > 1 && permuted_sort_keys(realarray, array_stride, compare, perm, N))
+        return perm;
+
     ps.compare = compare;
     ps.data_array = realarray;
     ps.data_array_stride = array_stride;
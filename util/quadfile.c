@@ -12,11 +12,28 @@
 #include "qfits_header.h"
 #include "fitsioutils.h"
 #include "starutil.h"
+#include "mathutil.h"
 #include "ioutils.h"
 #include "errors.h"
 #include "an-endian.h"
+#include "keywords.h"
 
 #define CHUNK_QUADS 0
+#define CHUNK_GEOM  1
+#define CHUNK_XYZ   2
+
+#define GEOM_TABLE "quadgeom"
+#define XYZ_TABLE  "quadxyz"
+
+static anbool load_star_xyz = FALSE;
+
+void quadfile_set_load_star_xyz(anbool load) {
+    load_star_xyz = load;
+}
+
+anbool quadfile_get_load_star_xyz(void) {
+    return load_star_xyz;
+}
 
 static fitsbin_chunk_t* quads_chunk(quadfile_t* qf) {
     return fitsbin_get_chunk(qf->fb, CHUNK_QUADS);
@@ -50,6 +67,20 @@ static int callback_read_header(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
     return 0;
 }
 
+static int callback_read_geom_header(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
+    quadfile_t* qf = chunk->userdata;
+    chunk->itemsize = QUADFILE_GEOM_FLOATS * sizeof(float);
+    chunk->nrows = qf->numquads;
+    return 0;
+}
+
+static int callback_read_xyz_header(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
+    quadfile_t* qf = chunk->userdata;
+    chunk->itemsize = qf->dimquads * 3 * sizeof(float);
+    chunk->nrows = qf->numquads;
+    return 0;
+}
+
 static quadfile_t* new_quadfile(const char* fn, anqfits_t* fits, anbool writing) {
     quadfile_t* qf;
     fitsbin_chunk_t chunk;
@@ -85,7 +116,25 @@ static quadfile_t* new_quadfile(const char* fn, anqfits_t* fits, anbool writing)
     chunk.userdata = qf;
     fitsbin_add_chunk(qf->fb, &chunk);
     fitsbin_chunk_clean(&chunk);
-    
+
+    if (!writing) {
+        fitsbin_chunk_init(&chunk);
+        chunk.tablename = GEOM_TABLE;
+        chunk.required = 0;
+        chunk.callback_read_header = callback_read_geom_header;
+        chunk.userdata = qf;
+        fitsbin_add_chunk(qf->fb, &chunk);
+        fitsbin_chunk_clean(&chunk);
+    }
+    if (!writing && load_star_xyz) {
+        fitsbin_chunk_init(&chunk);
+        chunk.tablename = XYZ_TABLE;
+        chunk.required = 0;
+        chunk.callback_read_header = callback_read_xyz_header;
+        chunk.userdata = qf;
+        fitsbin_add_chunk(qf->fb, &chunk);
+        fitsbin_chunk_clean(&chunk);
+    }
     return qf;
 }
 
@@ -136,6 +185,9 @@ static quadfile_t* my_open(const char* fn, anqfits_t* fits) {
     }
     chunk = quads_chunk(qf);
     qf->quadarray = chunk->data;
+    qf->geomarray = fitsbin_get_chunk(qf->fb, CHUNK_GEOM)->data;
+    if (fitsbin_n_chunks(qf->fb) > CHUNK_XYZ)
+        qf->xyzarray = fitsbin_get_chunk(qf->fb, CHUNK_XYZ)->data;
 
     // close fd.
     if (qf->fb->fid) {
@@ -299,6 +351,15 @@ int quadfile_write_quad(quadfile_t* qf, unsigned int* stars) {
     return 0;
 }
 
+int quadfile_write_quads(quadfile_t* qf, const uint32_t* stars, int N) {
+    if (fitsbin_write_items(qf->fb, quads_chunk(qf), (void*)stars, N)) {
+        ERROR("Failed to write %i quads", N);
+        return -1;
+    }
+    qf->numquads += N;
+    return 0;
+}
+
 int quadfile_write_all_quads_to(quadfile_t* qf, FILE* fid) {
     fitsbin_chunk_t* chunk = quads_chunk(qf);
     if (fitsbin_write_items_to(chunk, qf->quadarray, quadfile_nquads(qf), fid)) {
@@ -349,5 +410,84 @@ int quadfile_get_stars(const quadfile_t* qf, unsigned int quadid, unsigned int*
     return 0;
 }
 
+const float* quadfile_get_geometry(const quadfile_t* qf, unsigned int quadid) {
+    if (!qf->geomarray || quadid >= qf->numquads)
+        return NULL;
+    return qf->geomarray + (size_t)quadid * QUADFILE_GEOM_FLOATS;
+}
+
+void quadfile_compute_geometry(const quadfile_t* qf, const double* starxyz,
+                               float* geom) {
+    int q, d;
+    for (q=0; q<qf->numquads; q++) {
+        const uint32_t* quad = qf->quadarray + (size_t)q * qf->dimquads;
+        const double* A = starxyz + 3 * (size_t)quad[0];
+        const double* B = starxyz + 3 * (size_t)quad[1];
+        float* g = geom + (size_t)q * QUADFILE_GEOM_FLOATS;
+        double mid[3];
+        double norm = 0.0;
+        for (d=0; d<3; d++) {
+            mid[d] = A[d] + B[d];
+            norm += mid[d] * mid[d];
+        }
+        norm = sqrt(norm);
+        for (d=0; d<3; d++)
+            g[d] = (norm > 0.0) ? (mid[d] / norm) : 0.0;
+        g[3] = distsq2rad(distsq(A, B, 3));
+    }
+}
+
+static int write_table_to(quadfile_t* qf, const char* name, int itemsize,
+                          const void* data, FILE* fid) {
+    fitsbin_chunk_t chunk;
+    int rtn;
+    fitsbin_chunk_init(&chunk);
+    chunk.tablename = (char*)name;
+    chunk.itemsize = itemsize;
+    chunk.nrows = qf->numquads;
+    chunk.data = (void*)data;
+    rtn = fitsbin_write_chunk_to(qf->fb, &chunk, fid);
+    fitsbin_chunk_clean(&chunk);
+    if (rtn)
+        ERROR("Failed to write \"%s\" table", name);
+    return rtn;
+}
+
+int quadfile_write_geometry_to(quadfile_t* qf, const float* geom, FILE* fid) {
+    return write_table_to(qf, GEOM_TABLE, QUADFILE_GEOM_FLOATS * sizeof(float),
+                          geom, fid);
+}
+
+const float* quadfile_get_star_xyz(const quadfile_t* qf, unsigned int quadid) {
+    if (!qf->xyzarray || quadid >= qf->numquads)
+        return NULL;
+    return qf->xyzarray + (size_t)quadid * qf->dimquads * 3;
+}
+
+void quadfile_prefetch(const quadfile_t* qf, unsigned int quadid) {
+    if (quadid >= qf->numquads)
+        return;
+    prefetch_read(qf->quadarray + (size_t)quadid * qf->dimquads);
+    if (qf->geomarray)
+        prefetch_read(qf->geomarray + (size_t)quadid * QUADFILE_GEOM_FLOATS);
+    if (qf->xyzarray) {
+        const float* xyz = qf->xyzarray + (size_t)quadid * qf->dimquads * 3;
+        // (a row can straddle two cache lines)
+        prefetch_read(xyz);
+        prefetch_read(xyz + qf->dimquads * 3 - 1);
+    }
+}
 
+void quadfile_compute_star_xyz(const quadfile_t* qf, const double* starxyz,
+                               float* xyz) {
+    size_t i, n = (size_t)qf->numquads * qf->dimquads;
+    int d;
+    for (i=0; i<n; i++)
+        for (d=0; d<3; d++)
+            xyz[i*3 + d] = starxyz[3 * (size_t)qf->quadarray[i] + d];
+}
 
+int quadfile_write_star_xyz_to(quadfile_t* qf, const float* xyz, FILE* fid) {
+    return write_table_to(qf, XYZ_TABLE, qf->dimquads * 3 * sizeof(float),
+                          xyz, fid);
+}
@@ -43,6 +43,79 @@ double lanczos(double x, int order) {
      */
 }
 
+lanczos_table_t* lanczos_table_new(int order) {
+    lanczos_table_t* table;
+    int i, N;
+    if (order < 1 || order > LANCZOS_TABLE_MAX_ORDER) {
+        ERROR("Lanczos order %i not supported (1 to %i)", order,
+              LANCZOS_TABLE_MAX_ORDER);
+        return NULL;
+    }
+    table = malloc(sizeof(lanczos_table_t));
+    table->order = order;
+    N = order * LANCZOS_TABLE_RES + 2;
+    table->k = malloc(N * sizeof(float));
+    for (i=0; i<N; i++)
+        table->k[i] = lanczos(i / (double)LANCZOS_TABLE_RES, order);
+    return table;
+}
+
+void lanczos_table_free(lanczos_table_t* table) {
+    if (!table)
+        return;
+    free(table->k);
+    free(table);
+}
+
+static inline float lanczos_table_lookup(const float* k, double x) {
+    double fi = fabs(x) * LANCZOS_TABLE_RES;
+    int i = (int)fi;
+    float f = (float)(fi - i);
+    return k[i] + f * (k[i+1] - k[i]);
+}
+
+float lanczos_table_resample_f(const lanczos_table_t* table,
+                               double px, double py, const float* img,
+                               int W, int H, int weighted) {
+    const int order = table->order;
+    const int ntaps = 2 * order;
+    float KX[2*LANCZOS_TABLE_MAX_ORDER];
+    int IX[2*LANCZOS_TABLE_MAX_ORDER];
+    int x0, y0, dx, dy;
+    float sum = 0, weight = 0;
+
+    // the taps with non-zero weight; those off the image get zero weight
+    // (and a valid index), so that the inner loop has no branches.
+    x0 = (int)floor(px) - order + 1;
+    y0 = (int)floor(py) - order + 1;
+    for (dx=0; dx<ntaps; dx++) {
+        int x = x0 + dx;
+        anbool in = (x >= 0 && x < W);
+        KX[dx] = in ? lanczos_table_lookup(table->k, px - x) : 0.0f;
+        IX[dx] = in ? x : 0;
+    }
+    for (dy=0; dy<ntaps; dy++) {
+        int y = y0 + dy;
+        const float* row;
+        float ky, xsum = 0, xweight = 0;
+        if (y < 0 || y >= H)
+            continue;
+        ky = lanczos_table_lookup(table->k, py - y);
+        row = img + (size_t)y * W;
+        for (dx=0; dx<ntaps; dx++) {
+            float pix = row[IX[dx]];
+            anbool ok = !isnan(pix);
+            xsum += ok ? KX[dx] * pix : 0.0f;
+            xweight += ok ? KX[dx] : 0.0f;
+        }
+        sum += ky * xsum;
+        weight += ky * xweight;
+    }
+    if (weighted)
+        return sum / weight;
+    return sum;
+}
+
 #define MANGLEGLUE2(n,f) n ## _ ## f
 #define MANGLEGLUE(n,f) MANGLEGLUE2(n,f)
 #define MANGLE(func) MANGLEGLUE(func, numbername)
@@ -0,0 +1,184 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmcache.h"
+#include "ioutils.h"
+#include "errors.h"
+#include "log.h"
+
+#define SHMCACHE_MAGIC 0x414e534d
+// the data starts this far into the segment.
+#define HEADER_SIZE 64
+// how long to wait for another process to fill a segment, in ms.
+#define WAIT_MS 60000
+
+struct header {
+    uint32_t magic;
+    uint32_t ready;
+    uint64_t size;
+};
+
+static anbool shm_enabled = FALSE;
+
+void shmcache_set_enabled(anbool enabled) {
+    shm_enabled = enabled;
+}
+
+anbool shmcache_enabled(void) {
+    return shm_enabled;
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t n) {
+    const unsigned char* c = p;
+    size_t i;
+    for (i=0; i<n; i++) {
+        h ^= c[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+char* shmcache_key(const char* filename, const char* what) {
+    struct stat st;
+    char path[PATH_MAX];
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t v;
+    char* key;
+
+    if (stat(filename, &st)) {
+        SYSERROR("Failed to stat \"%s\"", filename);
+        return NULL;
+    }
+    if (!realpath(filename, path))
+        strncpy(path, filename, sizeof(path)-1);
+    h = hash_bytes(h, path, strlen(path));
+    v = st.st_ino;
+    h = hash_bytes(h, &v, sizeof(v));
+    v = st.st_size;
+    h = hash_bytes(h, &v, sizeof(v));
+    v = st.st_mtime;
+    h = hash_bytes(h, &v, sizeof(v));
+    asprintf_safe(&key, "/an-%s-%016llx", what, (unsigned long long)h);
+    return key;
+}
+
+// Maps an existing segment, waiting for it to be filled.
+static const void* attach_existing(const char* key, size_t size) {
+    int fd;
+    struct stat st;
+    void* map;
+    struct header* hdr;
+    int waited;
+
+    for (waited=0; waited<WAIT_MS; waited+=10) {
+        fd = shm_open(key, O_RDONLY, 0);
+        if (fd == -1) {
+            if (errno == ENOENT)
+                // the creator gave up.
+                return NULL;
+            SYSERROR("Failed to open shared memory \"%s\"", key);
+            return NULL;
+        }
+        if (fstat(fd, &st)) {
+            SYSERROR("Failed to stat shared memory \"%s\"", key);
+            close(fd);
+            return NULL;
+        }
+        if ((size_t)st.st_size == HEADER_SIZE + size) {
+            map = mmap(NULL, HEADER_SIZE + size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) {
+                SYSERROR("Failed to map shared memory \"%s\"", key);
+                return NULL;
+            }
+            hdr = map;
+            if (hdr->magic == SHMCACHE_MAGIC && hdr->size == size &&
+                __atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE))
+                return (char*)map + HEADER_SIZE;
+            munmap(map, HEADER_SIZE + size);
+        } else {
+            close(fd);
+            // (the creator hasn't sized it yet if it's empty)
+            if (st.st_size) {
+                ERROR("Shared memory \"%s\" has the wrong size", key);
+                return NULL;
+            }
+        }
+        // still being filled.
+        usleep(10000);
+    }
+    logmsg("Gave up waiting for shared memory \"%s\"\n", key);
+    return NULL;
+}
+
+const void* shmcache_attach(const char* key, size_t size,
+                            shmcache_fill_func fill, void* token) {
+    int fd;
+    void* map;
+    struct header* hdr;
+
+    if (!shm_enabled || !key)
+        return NULL;
+
+    fd = shm_open(key, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        if (errno == EEXIST)
+            return attach_existing(key, size);
+        SYSERROR("Failed to create shared memory \"%s\"", key);
+        return NULL;
+    }
+    if (ftruncate(fd, HEADER_SIZE + size)) {
+        SYSERROR("Failed to size shared memory \"%s\"", key);
+        close(fd);
+        shm_unlink(key);
+        return NULL;
+    }
+    map = mmap(NULL, HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SYSERROR("Failed to map shared memory \"%s\"", key);
+        shm_unlink(key);
+        return NULL;
+    }
+    hdr = map;
+    hdr->magic = SHMCACHE_MAGIC;
+    hdr->size = size;
+    if (fill((char*)map + HEADER_SIZE, size, token)) {
+        ERROR("Failed to fill shared memory \"%s\"", key);
+        munmap(map, HEADER_SIZE + size);
+        shm_unlink(key);
+        return NULL;
+    }
+    __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+    mprotect(map, HEADER_SIZE + size, PROT_READ);
+    debug("Created shared memory \"%s\" (%zu bytes)\n", key, size);
+    return (char*)map + HEADER_SIZE;
+}
+
+void shmcache_detach(const void* data, size_t size) {
+    if (!data)
+        return;
+    munmap((char*)data - HEADER_SIZE, HEADER_SIZE + size);
+}
+
+int shmcache_remove(const char* key) {
+    if (shm_unlink(key)) {
+        SYSERROR("Failed to remove shared memory \"%s\"", key);
+        return -1;
+    }
+    return 0;
+}
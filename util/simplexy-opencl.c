@@ -0,0 +1,584 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "os-features.h"
+#include "simplexy-opencl.h"
+#include "simplexy-common.h"
+#include "dimage.h"
+#include "mathutil.h"
+#include "log.h"
+#include "errors.h"
+
+/*
+ The kernels follow the CPU code step for step, adding things up in the
+ same order, so the results agree with it to rounding (the CPU build may
+ fuse multiply-adds where the device does not):
+
+ median_grid: one work-group per dmedsmooth() grid box finds the median
+   of the finite pixels in the box by radix selection on the float bits,
+   eight bits at a time.
+ subtract_background: one work-item per pixel adds up the interpolation
+   kernel over the grid points near it (see interpolate_rows() in
+   dmedsmooth.c), and subtracts that from the image.
+ smooth_rows, smooth_cols: the separable Gaussian of dsmooth2(), with
+   the image surrounded by zeros.
+ mask_rows, mask_cols: the box around each pixel at or above the limit
+   (or NaN) of dmask(), spread along the rows and then the columns.
+ */
+static const char* kernel_source =
+    "#pragma OPENCL FP_CONTRACT OFF\n"
+    "\n"
+    "uint float_key(float f) {\n"
+    "    uint u = as_uint(f);\n"
+    "    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);\n"
+    "}\n"
+    "\n"
+    "__kernel void median_grid(__global const float* image, int nx,\n"
+    "                          __global const int* xlo, __global const int* xhi,\n"
+    "                          __global const int* ylo, __global const int* yhi,\n"
+    "                          int nxgrid, __global float* grid) {\n"
+    "    __local uint hist[256];\n"
+    "    __local uint nfinite;\n"
+    "    __local uint prefix;\n"
+    "    __local uint want;\n"
+    "    int cell = get_group_id(0);\n"
+    "    int lid = get_local_id(0);\n"
+    "    int nl = get_local_size(0);\n"
+    "    int x0 = xlo[cell % nxgrid];\n"
+    "    int y0 = ylo[cell / nxgrid];\n"
+    "    int W = xhi[cell % nxgrid] - x0 + 1;\n"
+    "    int n = W * (yhi[cell / nxgrid] - y0 + 1);\n"
+    "    uint fixed = 0;\n"
+    "    uint count = 0;\n"
+    "    int p, shift;\n"
+    "    if (lid == 0) {\n"
+    "        nfinite = 0;\n"
+    "        prefix = 0;\n"
+    "    }\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    for (p=lid; p<n; p+=nl)\n"
+    "        if (isfinite(image[(size_t)(y0 + p / W) * nx + x0 + p % W]))\n"
+    "            count++;\n"
+    "    atomic_add(&nfinite, count);\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    if (nfinite <= 1) {\n"
+    "        if (lid == 0)\n"
+    "            grid[cell] = 0.0f;\n"
+    "        return;\n"
+    "    }\n"
+    "    if (lid == 0)\n"
+    "        want = nfinite / 2;\n"
+    "    for (shift=24; shift>=0; shift-=8) {\n"
+    "        uint pre;\n"
+    "        for (p=lid; p<256; p+=nl)\n"
+    "            hist[p] = 0;\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "        pre = prefix;\n"
+    "        for (p=lid; p<n; p+=nl) {\n"
+    "            float f = image[(size_t)(y0 + p / W) * nx + x0 + p % W];\n"
+    "            uint key;\n"
+    "            if (!isfinite(f))\n"
+    "                continue;\n"
+    "            key = float_key(f);\n"
+    "            if ((key & fixed) != pre)\n"
+    "                continue;\n"
+    "            atomic_inc(&hist[(key >> shift) & 0xff]);\n"
+    "        }\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "        if (lid == 0) {\n"
+    "            uint w = want;\n"
+    "            uint b;\n"
+    "            for (b=0; b<255 && w >= hist[b]; b++)\n"
+    "                w -= hist[b];\n"
+    "            want = w;\n"
+    "            prefix = pre | (b << shift);\n"
+    "        }\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "        fixed |= (0xffu << shift);\n"
+    "    }\n"
+    "    if (lid == 0) {\n"
+    "        uint key = prefix;\n"
+    "        grid[cell] = as_float((key & 0x80000000u) ?\n"
+    "                              (key & 0x7fffffffu) : ~key);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "float interp_kernel(int d, int psize, int msize) {\n"
+    "    float f = (float)d;\n"
+    "    if (f >= 0)\n"
+    "        f /= (float)psize;\n"
+    "    else\n"
+    "        f /= (float)(-msize);\n"
+    "    if ((f >= 0.5f) && (f < 1.5f))\n"
+    "        return 0.5f * ((f - 1.5f) * (f - 1.5f));\n"
+    "    if (f < 0.5f)\n"
+    "        return 0.75f - (f * f);\n"
+    "    return 0.0f;\n"
+    "}\n"
+    "\n"
+    "__kernel void subtract_background(__global const float* image,\n"
+    "                                  int nx, int ny,\n"
+    "                                  __global const float* grid,\n"
+    "                                  __global const int* xgrid, int nxgrid,\n"
+    "                                  __global const int* ygrid, int nygrid,\n"
+    "                                  int halfbox, __global float* bgsub) {\n"
+    "    int ip = get_global_id(0);\n"
+    "    int jp = get_global_id(1);\n"
+    "    // the grid points are \"halfbox\" apart, and the kernel is\n"
+    "    // 1.5 * halfbox wide, so only those within two of (ic, jc) count.\n"
+    "    int ic = (ip - xgrid[1]) / halfbox + 1;\n"
+    "    int jc = (jp - ygrid[1]) / halfbox + 1;\n"
+    "    float sum = 0.0f;\n"
+    "    int i, j;\n"
+    "    for (j=max(0, jc-2); j<=min(nygrid-1, jc+2); j++) {\n"
+    "        int jst = (int)((float)ygrid[j] - halfbox * 1.5f);\n"
+    "        int jnd = (int)((float)ygrid[j] + halfbox * 1.5f);\n"
+    "        int ypsize = halfbox;\n"
+    "        int ymsize = halfbox;\n"
+    "        float ykernel;\n"
+    "        if (jp < max(jst, 0) || jp > min(jnd, ny - 1))\n"
+    "            continue;\n"
+    "        if (j == 0)\n"
+    "            ypsize = ygrid[1] - ygrid[0];\n"
+    "        if (j == 1)\n"
+    "            ymsize = ygrid[1] - ygrid[0];\n"
+    "        if (j == nygrid - 2)\n"
+    "            ypsize = ygrid[nygrid - 1] - ygrid[nygrid - 2];\n"
+    "        if (j == nygrid - 1)\n"
+    "            ymsize = ygrid[nygrid - 1] - ygrid[nygrid - 2];\n"
+    "        ykernel = interp_kernel(jp - ygrid[j], ypsize, ymsize);\n"
+    "        if (ykernel == 0.0f)\n"
+    "            continue;\n"
+    "        for (i=max(0, ic-2); i<=min(nxgrid-1, ic+2); i++) {\n"
+    "            int ist = (int)((float)xgrid[i] - halfbox * 1.5f);\n"
+    "            int ind = (int)((float)xgrid[i] + halfbox * 1.5f);\n"
+    "            int xpsize = halfbox;\n"
+    "            int xmsize = halfbox;\n"
+    "            float xkernel;\n"
+    "            if (ip < max(ist, 0) || ip > min(ind, nx - 1))\n"
+    "                continue;\n"
+    "            if (i == 0)\n"
+    "                xpsize = xgrid[1] - xgrid[0];\n"
+    "            if (i == 1)\n"
+    "                xmsize = xgrid[1] - xgrid[0];\n"
+    "            if (i == nxgrid - 2)\n"
+    "                xpsize = xgrid[nxgrid - 1] - xgrid[nxgrid - 2];\n"
+    "            if (i == nxgrid - 1)\n"
+    "                xmsize = xgrid[nxgrid - 1] - xgrid[nxgrid - 2];\n"
+    "            xkernel = interp_kernel(ip - xgrid[i], xpsize, xmsize);\n"
+    "            if (xkernel == 0.0f)\n"
+    "                continue;\n"
+    "            sum += xkernel * ykernel * grid[i + j * nxgrid];\n"
+    "        }\n"
+    "    }\n"
+    "    bgsub[(size_t)jp * nx + ip] = image[(size_t)jp * nx + ip] - sum;\n"
+    "}\n"
+    "\n"
+    "__kernel void smooth_rows(__global const float* image, int nx,\n"
+    "                          __constant float* kernel1D, int npix,\n"
+    "                          __global float* out) {\n"
+    "    int i = get_global_id(0);\n"
+    "    size_t row = (size_t)get_global_id(1) * nx;\n"
+    "    int half = npix / 2;\n"
+    "    float sum = 0.0f;\n"
+    "    int k;\n"
+    "    for (k=0; k<npix; k++) {\n"
+    "        int ip = i + k - half;\n"
+    "        float v = (ip >= 0 && ip < nx) ? image[row + ip] : 0.0f;\n"
+    "        sum += kernel1D[k] * v;\n"
+    "    }\n"
+    "    out[row + i] = sum;\n"
+    "}\n"
+    "\n"
+    "__kernel void smooth_cols(__global const float* rows, int nx, int ny,\n"
+    "                          __constant float* kernel1D, int npix,\n"
+    "                          __global float* out) {\n"
+    "    int i = get_global_id(0);\n"
+    "    int j = get_global_id(1);\n"
+    "    int half = npix / 2;\n"
+    "    float sum = 0.0f;\n"
+    "    int sample;\n"
+    "    for (sample=max(0, j - half); sample<=min(ny - 1, j + half); sample++)\n"
+    "        sum += kernel1D[sample - j + half] * rows[(size_t)sample * nx + i];\n"
+    "    out[(size_t)j * nx + i] = sum;\n"
+    "}\n"
+    "\n"
+    "__kernel void mask_rows(__global const float* smooth, int nx,\n"
+    "                        float limit, int boxsize, __global uchar* hit) {\n"
+    "    int i = get_global_id(0);\n"
+    "    size_t row = (size_t)get_global_id(1) * nx;\n"
+    "    uchar h = 0;\n"
+    "    int ip;\n"
+    "    for (ip=max(0, i - boxsize); ip<=min(nx - 1, i + boxsize); ip++)\n"
+    "        if (!(smooth[row + ip] < limit)) {\n"
+    "            h = 1;\n"
+    "            break;\n"
+    "        }\n"
+    "    hit[row + i] = h;\n"
+    "}\n"
+    "\n"
+    "__kernel void mask_cols(__global const uchar* hit, int nx, int ny,\n"
+    "                        int boxsize, __global uchar* mask) {\n"
+    "    int i = get_global_id(0);\n"
+    "    int j = get_global_id(1);\n"
+    "    uchar m = 0;\n"
+    "    int jp;\n"
+    "    for (jp=max(0, j - boxsize); jp<=min(ny - 1, j + boxsize); jp++)\n"
+    "        if (hit[(size_t)jp * nx + i]) {\n"
+    "            m = 1;\n"
+    "            break;\n"
+    "        }\n"
+    "    mask[(size_t)j * nx + i] = m;\n"
+    "}\n";
+
+struct opencl_state {
+    anbool ok;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel median_grid;
+    cl_kernel subtract_background;
+    cl_kernel smooth_rows;
+    cl_kernel smooth_cols;
+    cl_kernel mask_rows;
+    cl_kernel mask_cols;
+    // work-group size for median_grid.
+    size_t median_wg;
+};
+
+static struct opencl_state ocl;
+static pthread_once_t ocl_once = PTHREAD_ONCE_INIT;
+// (the kernels' arguments are shared, so one run at a time.)
+static pthread_mutex_t ocl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The first GPU on any platform, or else the first device of any kind.
+static anbool find_device(cl_device_id* p_device) {
+    cl_platform_id platforms[16];
+    cl_uint nplat = 0;
+    cl_uint i;
+    int pass;
+
+    if (clGetPlatformIDs(16, platforms, &nplat) != CL_SUCCESS || nplat == 0)
+        return FALSE;
+    nplat = MIN(nplat, 16);
+    for (pass=0; pass<2; pass++)
+        for (i=0; i<nplat; i++) {
+            cl_uint ndev = 0;
+            if (clGetDeviceIDs(platforms[i],
+                               pass == 0 ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL,
+                               1, p_device, &ndev) == CL_SUCCESS && ndev > 0)
+                return TRUE;
+        }
+    return FALSE;
+}
+
+static cl_kernel make_kernel(const char* name, cl_int* err) {
+    cl_kernel k;
+    if (*err != CL_SUCCESS)
+        return NULL;
+    k = clCreateKernel(ocl.program, name, err);
+    if (*err != CL_SUCCESS)
+        ERROR("Failed to create OpenCL kernel \"%s\": error %i", name, (int)*err);
+    return k;
+}
+
+static void setup_opencl(void) {
+    cl_device_id device;
+    char name[256];
+    cl_int err;
+
+    if (!find_device(&device)) {
+        logverb("simplexy: no OpenCL device found.\n");
+        return;
+    }
+    memset(name, 0, sizeof(name));
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+
+    ocl.context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        ERROR("Failed to create an OpenCL context on \"%s\": error %i",
+              name, (int)err);
+        return;
+    }
+    ocl.queue = clCreateCommandQueue(ocl.context, device, 0, &err);
+    if (err != CL_SUCCESS) {
+        ERROR("Failed to create an OpenCL command queue: error %i", (int)err);
+        return;
+    }
+    ocl.program = clCreateProgramWithSource(ocl.context, 1, &kernel_source,
+                                            NULL, &err);
+    if (err == CL_SUCCESS)
+        err = clBuildProgram(ocl.program, 1, &device, "", NULL, NULL);
+    if (err != CL_SUCCESS) {
+        char buildlog[4096];
+        memset(buildlog, 0, sizeof(buildlog));
+        if (ocl.program)
+            clGetProgramBuildInfo(ocl.program, device, CL_PROGRAM_BUILD_LOG,
+                                  sizeof(buildlog) - 1, buildlog, NULL);
+        ERROR("Failed to build the simplexy OpenCL kernels: error %i\n%s",
+              (int)err, buildlog);
+        return;
+    }
+    ocl.median_grid = make_kernel("median_grid", &err);
+    ocl.subtract_background = make_kernel("subtract_background", &err);
+    ocl.smooth_rows = make_kernel("smooth_rows", &err);
+    ocl.smooth_cols = make_kernel("smooth_cols", &err);
+    ocl.mask_rows = make_kernel("mask_rows", &err);
+    ocl.mask_cols = make_kernel("mask_cols", &err);
+    if (err != CL_SUCCESS)
+        return;
+    if (clGetKernelWorkGroupInfo(ocl.median_grid, device,
+                                 CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+                                 &ocl.median_wg, NULL) != CL_SUCCESS)
+        ocl.median_wg = 1;
+    ocl.median_wg = MAX(1, MIN(ocl.median_wg, 128));
+    logverb("simplexy: using OpenCL device \"%s\"\n", name);
+    ocl.ok = TRUE;
+}
+
+anbool simplexy_opencl_available(void) {
+    pthread_once(&ocl_once, setup_opencl);
+    return ocl.ok;
+}
+
+// As in dsmooth.c.
+static float* gaussian_kernel(float sigma, int* p_npix) {
+    int i, npix;
+    float neghalfinvvar, total, scale, dx;
+    float* kernel1D;
+
+    npix = 2 * ((int) ceilf(3. * sigma)) + 1;
+    kernel1D = malloc(npix * sizeof(float));
+    neghalfinvvar = -1.0 / (2.0 * sigma * sigma);
+    for (i=0; i<npix; i++) {
+        dx = ((float) i - 0.5 * ((float)npix - 1.));
+        kernel1D[i] = exp((dx * dx) * neghalfinvvar);
+    }
+    total = 0.0;
+    for (i=0; i<npix; i++)
+        total += kernel1D[i];
+    scale = 1. / total;
+    for (i=0; i<npix; i++)
+        kernel1D[i] *= scale;
+    *p_npix = npix;
+    return kernel1D;
+}
+
+static cl_mem make_buffer(cl_mem_flags flags, size_t size, const void* data,
+                          cl_int* err) {
+    cl_mem m;
+    if (*err != CL_SUCCESS)
+        return NULL;
+    m = clCreateBuffer(ocl.context, flags | (data ? CL_MEM_COPY_HOST_PTR : 0),
+                       MAX(size, 1), (void*)data, err);
+    return m;
+}
+
+static void release(cl_mem m) {
+    if (m)
+        clReleaseMemObject(m);
+}
+
+static cl_int run_2d(cl_kernel k, int nx, int ny) {
+    size_t global[2];
+    global[0] = nx;
+    global[1] = ny;
+    return clEnqueueNDRangeKernel(ocl.queue, k, 2, NULL, global, NULL,
+                                  0, NULL, NULL);
+}
+
+int simplexy_opencl_detect(const float* image, int nx, int ny, int halfbox,
+                           float dpsf, float limit, float* bgsub,
+                           uint8_t* mask, int* found) {
+    size_t npixels = (size_t)nx * (size_t)ny;
+    int boxsize = 3 * dpsf;
+    int nxgrid = 0, nygrid = 0;
+    int *xgrid = NULL, *xlo = NULL, *xhi = NULL;
+    int *ygrid = NULL, *ylo = NULL, *yhi = NULL;
+    float* kernel1D = NULL;
+    int npix;
+    cl_mem d_image = NULL, d_bgsub = NULL, d_rows = NULL, d_smooth = NULL;
+    cl_mem d_hit = NULL, d_mask = NULL, d_kernel = NULL, d_grid = NULL;
+    cl_mem d_xgrid = NULL, d_xlo = NULL, d_xhi = NULL;
+    cl_mem d_ygrid = NULL, d_ylo = NULL, d_yhi = NULL;
+    cl_mem d_input;
+    cl_int err = CL_SUCCESS;
+    cl_kernel k;
+    int rtn = -1;
+
+    if (!simplexy_opencl_available())
+        return -1;
+    pthread_mutex_lock(&ocl_lock);
+
+    kernel1D = gaussian_kernel(dpsf, &npix);
+    d_image = make_buffer(CL_MEM_READ_ONLY, npixels * sizeof(float), image,
+                          &err);
+    d_rows = make_buffer(CL_MEM_READ_WRITE, npixels * sizeof(float), NULL,
+                         &err);
+    d_smooth = make_buffer(CL_MEM_READ_WRITE, npixels * sizeof(float), NULL,
+                           &err);
+    d_hit = make_buffer(CL_MEM_READ_WRITE, npixels, NULL, &err);
+    d_mask = make_buffer(CL_MEM_WRITE_ONLY, npixels, NULL, &err);
+    d_kernel = make_buffer(CL_MEM_READ_ONLY, npix * sizeof(float), kernel1D,
+                           &err);
+    d_input = d_image;
+
+    if (bgsub) {
+        size_t global, local;
+        dmedsmooth_gridpoints(nx, halfbox, &nxgrid, &xgrid, &xlo, &xhi);
+        dmedsmooth_gridpoints(ny, halfbox, &nygrid, &ygrid, &ylo, &yhi);
+        d_bgsub = make_buffer(CL_MEM_READ_WRITE, npixels * sizeof(float),
+                              NULL, &err);
+        d_grid = make_buffer(CL_MEM_READ_WRITE,
+                             (size_t)nxgrid * nygrid * sizeof(float), NULL, &err);
+        d_xgrid = make_buffer(CL_MEM_READ_ONLY, nxgrid * sizeof(int), xgrid, &err);
+        d_xlo = make_buffer(CL_MEM_READ_ONLY, nxgrid * sizeof(int), xlo, &err);
+        d_xhi = make_buffer(CL_MEM_READ_ONLY, nxgrid * sizeof(int), xhi, &err);
+        d_ygrid = make_buffer(CL_MEM_READ_ONLY, nygrid * sizeof(int), ygrid, &err);
+        d_ylo = make_buffer(CL_MEM_READ_ONLY, nygrid * sizeof(int), ylo, &err);
+        d_yhi = make_buffer(CL_MEM_READ_ONLY, nygrid * sizeof(int), yhi, &err);
+        if (err != CL_SUCCESS)
+            goto bailout;
+
+        k = ocl.median_grid;
+        err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_image);
+        err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+        err |= clSetKernelArg(k, 2, sizeof(cl_mem), &d_xlo);
+        err |= clSetKernelArg(k, 3, sizeof(cl_mem), &d_xhi);
+        err |= clSetKernelArg(k, 4, sizeof(cl_mem), &d_ylo);
+        err |= clSetKernelArg(k, 5, sizeof(cl_mem), &d_yhi);
+        err |= clSetKernelArg(k, 6, sizeof(int), &nxgrid);
+        err |= clSetKernelArg(k, 7, sizeof(cl_mem), &d_grid);
+        local = ocl.median_wg;
+        global = (size_t)nxgrid * nygrid * local;
+        if (err == CL_SUCCESS)
+            err = clEnqueueNDRangeKernel(ocl.queue, k, 1, NULL, &global, &local,
+                                         0, NULL, NULL);
+
+        k = ocl.subtract_background;
+        err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_image);
+        err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+        err |= clSetKernelArg(k, 2, sizeof(int), &ny);
+        err |= clSetKernelArg(k, 3, sizeof(cl_mem), &d_grid);
+        err |= clSetKernelArg(k, 4, sizeof(cl_mem), &d_xgrid);
+        err |= clSetKernelArg(k, 5, sizeof(int), &nxgrid);
+        err |= clSetKernelArg(k, 6, sizeof(cl_mem), &d_ygrid);
+        err |= clSetKernelArg(k, 7, sizeof(int), &nygrid);
+        err |= clSetKernelArg(k, 8, sizeof(int), &halfbox);
+        err |= clSetKernelArg(k, 9, sizeof(cl_mem), &d_bgsub);
+        if (err == CL_SUCCESS)
+            err = run_2d(k, nx, ny);
+        d_input = d_bgsub;
+    }
+    if (err != CL_SUCCESS)
+        goto bailout;
+
+    k = ocl.smooth_rows;
+    err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_input);
+    err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+    err |= clSetKernelArg(k, 2, sizeof(cl_mem), &d_kernel);
+    err |= clSetKernelArg(k, 3, sizeof(int), &npix);
+    err |= clSetKernelArg(k, 4, sizeof(cl_mem), &d_rows);
+    if (err == CL_SUCCESS)
+        err = run_2d(k, nx, ny);
+
+    k = ocl.smooth_cols;
+    err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_rows);
+    err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+    err |= clSetKernelArg(k, 2, sizeof(int), &ny);
+    err |= clSetKernelArg(k, 3, sizeof(cl_mem), &d_kernel);
+    err |= clSetKernelArg(k, 4, sizeof(int), &npix);
+    err |= clSetKernelArg(k, 5, sizeof(cl_mem), &d_smooth);
+    if (err == CL_SUCCESS)
+        err = run_2d(k, nx, ny);
+
+    k = ocl.mask_rows;
+    err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_smooth);
+    err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+    err |= clSetKernelArg(k, 2, sizeof(float), &limit);
+    err |= clSetKernelArg(k, 3, sizeof(int), &boxsize);
+    err |= clSetKernelArg(k, 4, sizeof(cl_mem), &d_hit);
+    if (err == CL_SUCCESS)
+        err = run_2d(k, nx, ny);
+
+    k = ocl.mask_cols;
+    err |= clSetKernelArg(k, 0, sizeof(cl_mem), &d_hit);
+    err |= clSetKernelArg(k, 1, sizeof(int), &nx);
+    err |= clSetKernelArg(k, 2, sizeof(int), &ny);
+    err |= clSetKernelArg(k, 3, sizeof(int), &boxsize);
+    err |= clSetKernelArg(k, 4, sizeof(cl_mem), &d_mask);
+    if (err == CL_SUCCESS)
+        err = run_2d(k, nx, ny);
+
+    if (err == CL_SUCCESS && bgsub)
+        err = clEnqueueReadBuffer(ocl.queue, d_bgsub, CL_FALSE, 0,
+                                  npixels * sizeof(float), bgsub,
+                                  0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueReadBuffer(ocl.queue, d_mask, CL_TRUE, 0, npixels, mask,
+                                  0, NULL, NULL);
+    if (err != CL_SUCCESS)
+        goto bailout;
+
+    *found = (memchr(mask, 1, npixels) != NULL);
+    if (!*found) {
+        // (as dmask() says; this is the rare case, so read it back.)
+        float* smooth = malloc(npixels * sizeof(float));
+        float maxval = -LARGE_VALF;
+        size_t i;
+        err = clEnqueueReadBuffer(ocl.queue, d_smooth, CL_TRUE, 0,
+                                  npixels * sizeof(float), smooth,
+                                  0, NULL, NULL);
+        for (i=0; err == CL_SUCCESS && i<npixels; i++)
+            maxval = MAX(maxval, smooth[i]);
+        free(smooth);
+        logmsg("No pixels were marked as significant.\n"
+               "  significance threshold = %g\n"
+               "  max value in image = %g\n",
+               limit, maxval);
+    }
+    rtn = 0;
+
+ bailout:
+    if (rtn)
+        logmsg("simplexy: OpenCL error %i; running on the CPU instead.\n",
+               (int)err);
+    clFinish(ocl.queue);
+    release(d_image);
+    release(d_bgsub);
+    release(d_rows);
+    release(d_smooth);
+    release(d_hit);
+    release(d_mask);
+    release(d_kernel);
+    release(d_grid);
+    release(d_xgrid);
+    release(d_xlo);
+    release(d_xhi);
+    release(d_ygrid);
+    release(d_ylo);
+    release(d_yhi);
+    pthread_mutex_unlock(&ocl_lock);
+    free(kernel1D);
+    free(xgrid);
+    free(xlo);
+    free(xhi);
+    free(ygrid);
+    free(ylo);
+    free(yhi);
+    return rtn;
+}
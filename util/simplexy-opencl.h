@@ -0,0 +1,38 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#ifndef SIMPLEXY_OPENCL_H
+#define SIMPLEXY_OPENCL_H
+
+#include <stdint.h>
+
+#include "an-bool.h"
+
+/**
+ Returns TRUE if there is an OpenCL device to run simplexy on (the
+ first GPU, or failing that the first device of any kind).  The device
+ is set up, and the kernels compiled, on the first call.
+ */
+anbool simplexy_opencl_available(void);
+
+/**
+ The background, smoothing and masking steps of simplexy on the OpenCL
+ device, with the image uploaded once and only the results read back.
+
+ If "bgsub" is non-NULL, the background of the "nx" x "ny" "image" is
+ estimated as by dmedsmooth() with "halfbox", and "bgsub" is set to the
+ image minus the background; otherwise the image is used as it is.
+ That is smoothed as by dsmooth2() with "dpsf", and "mask" set as by
+ dmask() with "limit".  Sets "found" to what dmask() would return.
+
+ Returns 0 on success, or -1 if the device can't be used, in which case
+ the outputs are not set.
+
+ Only built with WITH_OPENCL (see makefile.opencl).
+ */
+int simplexy_opencl_detect(const float* image, int nx, int ny, int halfbox,
+                           float dpsf, float limit, float* bgsub,
+                           uint8_t* mask, int* found);
+
+#endif
@@ -8,6 +8,8 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "simplexy.h"
@@ -18,6 +20,10 @@
 #include "errors.h"
 #include "resample.h"
 #include "an-bool.h"
+#include "tic.h"
+#ifdef HAVE_OPENCL
+#include "simplexy-opencl.h"
+#endif
 
 /*
  * simplexy.c
@@ -171,53 +177,126 @@ void simplexy_free_contents(simplexy_t* s) {
     s->fluxL = s->backgroundL = NULL;
 }
 
-int simplexy_run(simplexy_t* s) {
-    int i;
-    int nx = s->nx;
-    int ny = s->ny;
-    float limit;
-    uint8_t* mask;
-    // background-subtracted image.
-    float* bgsub = NULL;
-    int16_t* bgsub_i16 = NULL;
-    // malloc'd background image to free.
-    void* bgfree = NULL;
-    // PSF-smoothed image.
-    float* smoothed = NULL;
-    // malloc'd smoothed image to free.
-    void* smoothfree = NULL;
-    // Connected-components image.
-    int* ccimg = NULL;
-    int nblobs;
- 
-    /* Exactly one of s->image and s->image_u8 should be non-NULL.*/
-    assert(s->image || s->image_u8);
-    assert(!s->image || !s->image_u8);
+// The number of threads to use: "nthreads", or one per CPU.
+static int simplexy_nthreads(const simplexy_t* s) {
+    if (s->nthreads > 0)
+        return s->nthreads;
+    return MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
 
-    logverb("simplexy: nx=%d, ny=%d\n", nx, ny);
-    logverb("simplexy: dpsf=%f, plim=%f, dlim=%f, saddle=%f\n",
-            s->dpsf, s->plim, s->dlim, s->saddle);
-    logverb("simplexy: maxper=%d, maxnpeaks=%d, maxsize=%d, halfbox=%d\n",
-            s->maxper, s->maxnpeaks, s->maxsize, s->halfbox);
+static void measure_sigma(simplexy_t* s) {
+    int grid = dsigma_gridsize(s->nx, s->ny, s->sigmasamples);
+    if (s->image_u8)
+        dsigma_u8_threaded(s->image_u8, s->nx, s->ny, 5, grid, s->nthreads,
+                           &(s->sigma));
+    else
+        dsigma_threaded(s->image, s->nx, s->ny, 5, grid, s->nthreads,
+                        &(s->sigma));
+}
 
-    if (s->invert) {
-        if (s->image) {
-            for (i=0; i<nx*ny; i++)
-                s->image[i] = -s->image[i];
-        } else {
-            for (i=0; i<nx*ny; i++)
-                s->image_u8[i] = 255 - s->image_u8[i];
-        }
+/*
+ The cache keeps the background-subtracted image (which it owns unless
+ it is the input image itself, with "nobgsub"), the measured noise, and
+ the smoothed image along with the "dpsf" it was smoothed with.  The
+ first two are good for as long as the image and the background
+ settings stay the same.
+ */
+struct simplexy_cache_t {
+    // the input image and settings that "bgsub" was computed from.
+    const void* image;
+    int nx, ny;
+    int halfbox;
+    int nobgsub;
+    int invert;
+
+    float* bgsub;
+    int16_t* bgsub_i16;
+    void* bgfree;
+    // the measured noise, or zero.
+    float sigma;
+    float* smoothed;
+    float dpsf;
+};
+
+simplexy_cache_t* simplexy_cache_new(void) {
+    return calloc(1, sizeof(simplexy_cache_t));
+}
+
+void simplexy_cache_reset(simplexy_cache_t* c) {
+    if (!c)
+        return;
+    free(c->bgfree);
+    free(c->smoothed);
+    memset(c, 0, sizeof(simplexy_cache_t));
+}
+
+void simplexy_cache_free(simplexy_cache_t* c) {
+    simplexy_cache_reset(c);
+    free(c);
+}
+
+static const void* cache_image(const simplexy_t* s) {
+    return s->image ? (const void*)s->image : (const void*)s->image_u8;
+}
+
+static anbool cache_has_background(const simplexy_cache_t* c,
+                                   const simplexy_t* s) {
+    return (c->image && c->image == cache_image(s) &&
+            c->nx == s->nx && c->ny == s->ny &&
+            c->halfbox == s->halfbox && c->nobgsub == s->nobgsub &&
+            c->invert == s->invert);
+}
+
+// Keeps the background-subtracted image of "s" (after the background
+// step, which may have adjusted "halfbox").
+static void cache_keep_background(simplexy_cache_t* c, const simplexy_t* s,
+                                  float* bgsub, int16_t* bgsub_i16,
+                                  void* bgfree) {
+    c->image = cache_image(s);
+    c->nx = s->nx;
+    c->ny = s->ny;
+    c->halfbox = s->halfbox;
+    c->nobgsub = s->nobgsub;
+    c->invert = s->invert;
+    c->bgsub = bgsub;
+    c->bgsub_i16 = bgsub_i16;
+    c->bgfree = bgfree;
+}
+
+static void invert_image(simplexy_t* s) {
+    int i;
+    if (!s->invert)
+        return;
+    if (s->image) {
+        for (i=0; i<s->nx*s->ny; i++)
+            s->image[i] = -s->image[i];
+    } else {
+        for (i=0; i<s->nx*s->ny; i++)
+            s->image_u8[i] = 255 - s->image_u8[i];
     }
+}
+
+/*
+ Subtracts the background, setting one of "bgsub" and "bgsub_i16" and,
+ if it was allocated, "bgfree".  If "fused", the float background is
+ left in "bgsub" for dsmooth2_mask() to subtract, and "subtract_pending"
+ is set.
+ */
+static void subtract_background(simplexy_t* s, anbool fused, float** bgsub,
+                                int16_t** bgsub_i16, void** bgfree,
+                                anbool* subtract_pending) {
+    int i;
+    int nx = s->nx;
+    int ny = s->ny;
 
     if (s->nobgsub) {
         if (s->image)
-            bgsub = s->image;
+            *bgsub = s->image;
         else {
-            bgsub_i16 = malloc((size_t)nx * (size_t)ny * sizeof(int16_t));
-            bgfree = bgsub_i16;
+            *bgsub_i16 = malloc((size_t)nx * (size_t)ny * sizeof(int16_t));
+            *bgfree = *bgsub_i16;
             for (i=0; i<nx*ny; i++)
-                bgsub_i16[i] = s->image_u8[i];
+                (*bgsub_i16)[i] = s->image_u8[i];
         }
 
     } else {
@@ -227,18 +306,23 @@ int simplexy_run(simplexy_t* s) {
         if (s->image) {
             float* medianfiltered;
             medianfiltered = malloc((size_t)nx * (size_t)ny * sizeof(float));
-            bgfree = medianfiltered;
-            dmedsmooth(s->image, NULL, nx, ny, s->halfbox, medianfiltered);
+            *bgfree = medianfiltered;
+            dmedsmooth_threaded(s->image, NULL, nx, ny, s->halfbox,
+                                medianfiltered, s->nthreads);
 
             if (s->bgimgfn) {
                 logverb("Writing background (median-filtered) image \"%s\"\n", s->bgimgfn);
                 write_fits_float_image(medianfiltered, nx, ny, s->bgimgfn);
             }
 
-            // subtract background from image, placing result in background.
-            for (i=0; i<nx*ny; i++)
-                medianfiltered[i] = s->image[i] - medianfiltered[i];
-            bgsub = medianfiltered;
+            // subtract background from image, placing result in
+            // background -- or leave that to dsmooth2_mask().
+            if (!fused)
+                for (i=0; i<nx*ny; i++)
+                    medianfiltered[i] = s->image[i] - medianfiltered[i];
+            else
+                *subtract_pending = TRUE;
+            *bgsub = medianfiltered;
             medianfiltered = NULL;
 
         } else {
@@ -250,7 +334,8 @@ int simplexy_run(simplexy_t* s) {
             assert(MIN(nx,ny) >= 2*s->halfbox+1);
 
             medianfiltered_u8 = malloc((size_t)nx * (size_t)ny * sizeof(unsigned char));
-            ctmf(s->image_u8, medianfiltered_u8, nx, ny, nx, nx, s->halfbox, 1, 512*1024);
+            ctmf_threaded(s->image_u8, medianfiltered_u8, nx, ny, nx, nx,
+                          s->halfbox, 1, 512*1024, simplexy_nthreads(s));
 
             if (s->bgimgfn) {
                 logverb("Writing background (median-filtered) image \"%s\"\n", s->bgimgfn);
@@ -258,57 +343,143 @@ int simplexy_run(simplexy_t* s) {
             }
 
             // Background-subtracted image.
-            bgsub_i16 = malloc((size_t)nx * (size_t)ny * sizeof(int16_t));
-            bgfree = bgsub_i16;
+            *bgsub_i16 = malloc((size_t)nx * (size_t)ny * sizeof(int16_t));
+            *bgfree = *bgsub_i16;
             for (i=0; i<nx*ny; i++)
                 //bgsub_i16[i] = (int16_t)s->image_u8[i] - (int16_t)medianfiltered_u8[i];
-                bgsub_i16[i] = s->image_u8[i] - medianfiltered_u8[i];
+                (*bgsub_i16)[i] = s->image_u8[i] - medianfiltered_u8[i];
             free(medianfiltered_u8);
         }
 
-        if (s->bgsubimgfn) {
+        if (s->bgsubimgfn && !*subtract_pending) {
             logverb("Writing background-subtracted image \"%s\"\n", s->bgsubimgfn);
-            if (bgsub)
-                write_fits_float_image(bgsub, nx, ny, s->bgsubimgfn);
+            if (*bgsub)
+                write_fits_float_image(*bgsub, nx, ny, s->bgsubimgfn);
             else
-                write_fits_i16_image(bgsub_i16, nx, ny, s->bgsubimgfn);
+                write_fits_i16_image(*bgsub_i16, nx, ny, s->bgsubimgfn);
         }
     }
+}
 
-    if (s->dpsf > 0.0) {
-        smoothed = malloc((size_t)nx * (size_t)ny * sizeof(float));
-        smoothfree = smoothed;
-        /* smooth by the point spread function (the optimal detection
-         filter, since we assume a symmetric Gaussian PSF) */
-        if (bgsub)
-            dsmooth2(bgsub, nx, ny, s->dpsf, smoothed);
-        else
-            dsmooth2_i16(bgsub_i16, nx, ny, s->dpsf, smoothed);
-    } else {
-        if (bgsub)
-            smoothed = bgsub;
-        else {
-            smoothed = malloc((size_t)nx * (size_t)ny * sizeof(float));
-            smoothfree = smoothed;
-            for (i=0; i<(nx*ny); i++)
-                smoothed[i] = bgsub_i16[i];
-        }
+// Can the background, smoothing and masking be done on an OpenCL device?
+static anbool use_opencl(const simplexy_t* s, const simplexy_cache_t* cache) {
+#ifdef HAVE_OPENCL
+    return (s->gpu && s->image && !cache && s->dpsf > 0.0 &&
+            !s->bgimgfn && !s->smoothimgfn && simplexy_opencl_available());
+#else
+    return FALSE;
+#endif
+}
+
+#ifdef HAVE_OPENCL
+/*
+ Runs the background, smoothing and masking steps on the OpenCL device,
+ setting "mask", "found", "bgsub" and, if it was allocated, "bgfree".
+ Returns 0 on success.
+ */
+static int detect_opencl(simplexy_t* s, float limit, uint8_t* mask,
+                         float** bgsub, void** bgfree, int* found) {
+    float* bg = NULL;
+    int rtn;
+
+    if (!s->nobgsub)
+        bg = malloc((size_t)s->nx * (size_t)s->ny * sizeof(float));
+    logverb("simplexy: median smoothing, smoothing and finding objects "
+            "on the OpenCL device...\n");
+    PROFILE_BEGIN("detect");
+    rtn = simplexy_opencl_detect(s->image, s->nx, s->ny, s->halfbox, s->dpsf,
+                                 limit, bg, mask, found);
+    PROFILE_END("detect");
+    if (rtn) {
+        free(bg);
+        return rtn;
     }
+    if (bg) {
+        *bgsub = bg;
+        *bgfree = bg;
+        if (s->bgsubimgfn) {
+            logverb("Writing background-subtracted image \"%s\"\n", s->bgsubimgfn);
+            write_fits_float_image(bg, s->nx, s->ny, s->bgsubimgfn);
+        }
+    } else
+        *bgsub = s->image;
+    return 0;
+}
+#endif
+
+// Runs simplexy on the whole image; if "tile", quietly.
+static int run_image(simplexy_t* s, anbool tile) {
+    int i;
+    int nx = s->nx;
+    int ny = s->ny;
+    float limit;
+    uint8_t* mask;
+    // background-subtracted image.
+    float* bgsub = NULL;
+    int16_t* bgsub_i16 = NULL;
+    // malloc'd background image to free.
+    void* bgfree = NULL;
+    // PSF-smoothed image.
+    float* smoothed = NULL;
+    // malloc'd smoothed image to free.
+    void* smoothfree = NULL;
+    // Connected-components image.
+    int* ccimg = NULL;
+    int nblobs;
+    // intermediate products kept from earlier runs on this image.  (The
+    // background image itself isn't kept, so it can't be written out.)
+    simplexy_cache_t* cache = (tile || s->bgimgfn) ? NULL : s->cache;
+    // smooth and threshold in one pass, without a smoothed image?
+    anbool fused = (s->dpsf > 0.0 && !s->smoothimgfn && !cache);
+    // "bgsub" still holds the background, for dsmooth2_mask() to subtract.
+    anbool subtract_pending = FALSE;
+    // do the background, smoothing and masking on the OpenCL device?
+    anbool opencl = use_opencl(s, cache);
+    int found;
+ 
+    /* Exactly one of s->image and s->image_u8 should be non-NULL.*/
+    assert(s->image || s->image_u8);
+    assert(!s->image || !s->image_u8);
+
+    logverb("simplexy: nx=%d, ny=%d\n", nx, ny);
+    logverb("simplexy: dpsf=%f, plim=%f, dlim=%f, saddle=%f\n",
+            s->dpsf, s->plim, s->dlim, s->saddle);
+    logverb("simplexy: maxper=%d, maxnpeaks=%d, maxsize=%d, halfbox=%d\n",
+            s->maxper, s->maxnpeaks, s->maxsize, s->halfbox);
 
-    if (s->smoothimgfn) {
-        logverb("Writing smoothed background-subtracted image \"%s\"\n",
-                s->smoothimgfn);
-        write_fits_float_image(smoothed, nx, ny, s->smoothimgfn);
+    if (cache && cache_has_background(cache, s)) {
+        // (the image was inverted, if need be, by the earlier run.)
+        logverb("simplexy: using the cached background-subtracted image\n");
+        bgsub = cache->bgsub;
+        bgsub_i16 = cache->bgsub_i16;
+    } else {
+        simplexy_cache_reset(cache);
+        invert_image(s);
+        // (with "opencl", after the noise is measured, below.)
+        if (!opencl) {
+            PROFILE_BEGIN("background");
+            subtract_background(s, fused, &bgsub, &bgsub_i16, &bgfree,
+                                &subtract_pending);
+            PROFILE_END("background");
+        }
+        if (cache) {
+            cache_keep_background(cache, s, bgsub, bgsub_i16, bgfree);
+            bgfree = NULL;
+        }
     }
 
     // estimate the noise in the image (sigma)
-    if (s->sigma == 0.0) {
+    if (s->sigma == 0.0 && cache && cache->sigma != 0.0) {
+        s->sigma = cache->sigma;
+        logverb("simplexy: using the cached sigma=%g.\n", s->sigma);
+    } else if (s->sigma == 0.0) {
         logverb("simplexy: measuring image noise (sigma)...\n");
-        if (s->image_u8)
-            dsigma_u8(s->image_u8, nx, ny, 5, 0, &(s->sigma));
-        else
-            dsigma(s->image, nx, ny, 5, 0, &(s->sigma));
+        PROFILE_BEGIN("sigma");
+        measure_sigma(s);
+        PROFILE_END("sigma");
         logverb("simplexy: found sigma=%g.\n", s->sigma);
+        if (cache)
+            cache->sigma = s->sigma;
     } else {
         logverb("simplexy: assuming sigma=%g.\n", s->sigma);
     }
@@ -319,7 +490,6 @@ int simplexy_run(simplexy_t* s) {
      *    The difference is only significant for small sigma, which
      *    would mean your image is undersampled anyway.
      */
-    logverb("simplexy: finding objects...\n");
     limit = (s->sigma / (2.0 * sqrt(M_PI) * s->dpsf)) * s->plim;
 
     if (s->globalbg != 0.0) {
@@ -327,13 +497,96 @@ int simplexy_run(simplexy_t* s) {
         logverb("Increased detection limit by %g to %g to compensate for global background level\n", s->globalbg, limit);
     }
 
-    /* find pixels above the noise level, and flag a box of pixels around each one. */
     mask = malloc((size_t)nx*(size_t)ny);
-    if (!dmask(smoothed, nx, ny, limit, s->dpsf, mask)) {
+
+#ifdef HAVE_OPENCL
+    if (opencl && detect_opencl(s, limit, mask, &bgsub, &bgfree, &found)) {
+        // the device failed: do it all here.
+        opencl = FALSE;
+        PROFILE_BEGIN("background");
+        subtract_background(s, fused, &bgsub, &bgsub_i16, &bgfree,
+                            &subtract_pending);
+        PROFILE_END("background");
+    }
+#endif
+
+    if (opencl) {
+        if (!found) {
+            FREEVEC(mask);
+            FREEVEC(bgfree);
+            return 0;
+        }
+
+    } else if (fused) {
+        /* smooth by the point spread function, and find pixels above the
+         noise level, flagging a box of pixels around each one, as the
+         rows go by. */
+        logverb("simplexy: smoothing and finding objects...\n");
+        PROFILE_BEGIN("detect");
+        if (bgsub)
+            found = dsmooth2_mask(subtract_pending ? s->image : bgsub,
+                                  subtract_pending ? bgsub : NULL,
+                                  nx, ny, s->dpsf, limit, mask);
+        else
+            found = dsmooth2_mask_i16(bgsub_i16, nx, ny, s->dpsf, limit, mask);
+        PROFILE_END("detect");
+        if (subtract_pending && s->bgsubimgfn) {
+            logverb("Writing background-subtracted image \"%s\"\n", s->bgsubimgfn);
+            write_fits_float_image(bgsub, nx, ny, s->bgsubimgfn);
+        }
+        if (!found)
+            return 0;
+
+    } else {
+        if (s->dpsf > 0.0 && cache && cache->smoothed &&
+            cache->dpsf == s->dpsf) {
+            logverb("simplexy: using the cached smoothed image\n");
+            smoothed = cache->smoothed;
+        } else if (s->dpsf > 0.0) {
+            smoothed = malloc((size_t)nx * (size_t)ny * sizeof(float));
+            smoothfree = smoothed;
+            /* smooth by the point spread function (the optimal detection
+             filter, since we assume a symmetric Gaussian PSF) */
+            PROFILE_BEGIN("smooth");
+            if (bgsub)
+                dsmooth2(bgsub, nx, ny, s->dpsf, smoothed);
+            else
+                dsmooth2_i16(bgsub_i16, nx, ny, s->dpsf, smoothed);
+            PROFILE_END("smooth");
+            if (cache) {
+                free(cache->smoothed);
+                cache->smoothed = smoothed;
+                cache->dpsf = s->dpsf;
+                smoothfree = NULL;
+            }
+        } else {
+            if (bgsub)
+                smoothed = bgsub;
+            else {
+                smoothed = malloc((size_t)nx * (size_t)ny * sizeof(float));
+                smoothfree = smoothed;
+                for (i=0; i<(nx*ny); i++)
+                    smoothed[i] = bgsub_i16[i];
+            }
+        }
+
+        if (s->smoothimgfn) {
+            logverb("Writing smoothed background-subtracted image \"%s\"\n",
+                    s->smoothimgfn);
+            write_fits_float_image(smoothed, nx, ny, s->smoothimgfn);
+        }
+
+        /* find pixels above the noise level, and flag a box of pixels around each one. */
+        logverb("simplexy: finding objects...\n");
+        PROFILE_BEGIN("detect");
+        found = dmask(smoothed, nx, ny, limit, s->dpsf, mask);
+        PROFILE_END("detect");
+        if (!found) {
+            FREEVEC(smoothfree);
+            return 0;
+        }
         FREEVEC(smoothfree);
-        return 0;
     }
-    FREEVEC(smoothfree);
 
     /* save the mask image, if requested. */
     if (s->maskimgfn) {
@@ -355,7 +608,9 @@ int simplexy_run(simplexy_t* s) {
 
     /* find connected-components in the mask image. */
     ccimg = malloc((size_t)nx * (size_t)ny * sizeof(int));
-    dfind2_u8(mask, nx, ny, ccimg, &nblobs);
+    PROFILE_BEGIN("components");
+    dfind2_u8_threaded(mask, nx, ny, ccimg, &nblobs, simplexy_nthreads(s));
+    PROFILE_END("components");
     FREEVEC(mask);
     logverb("simplexy: found %i blobs\n", nblobs);
 
@@ -391,13 +646,20 @@ int simplexy_run(simplexy_t* s) {
 	
     /* find all peaks within each object */
     logverb("simplexy: finding peaks...\n");
+    PROFILE_BEGIN("peaks");
     if (bgsub)
-        dallpeaks(bgsub, nx, ny, ccimg, s->x, s->y, &(s->npeaks), s->dpsf,
-                  s->sigma, s->dlim, s->saddle, s->maxper, s->maxnpeaks, s->sigma, s->maxsize);
+        dallpeaks_threaded(bgsub, nx, ny, ccimg, s->x, s->y, &(s->npeaks),
+                           s->dpsf, s->sigma, s->dlim, s->saddle, s->maxper,
+                           s->maxnpeaks, s->sigma, s->maxsize,
+                           simplexy_nthreads(s));
     else
-        dallpeaks_i16(bgsub_i16, nx, ny, ccimg, s->x, s->y, &(s->npeaks), s->dpsf,
-                      s->sigma, s->dlim, s->saddle, s->maxper, s->maxnpeaks, s->sigma, s->maxsize);
-    logmsg("simplexy: found %i sources.\n", s->npeaks);
+        dallpeaks_i16_threaded(bgsub_i16, nx, ny, ccimg, s->x, s->y,
+                               &(s->npeaks), s->dpsf, s->sigma, s->dlim,
+                               s->saddle, s->maxper, s->maxnpeaks, s->sigma,
+                               s->maxsize, simplexy_nthreads(s));
+    PROFILE_END("peaks");
+    if (!tile)
+        logmsg("simplexy: found %i sources.\n", s->npeaks);
     FREEVEC(ccimg);
 
     s->x   = realloc(s->x, s->npeaks * sizeof(float));
@@ -491,6 +753,509 @@ int simplexy_run(simplexy_t* s) {
     return 1;
 }
 
+/*
+ Tiled mode: the image is cut into tiles of about "tilesize" pixels
+ square, and each tile, plus a halo around it, is run through
+ run_image() on its own, on a pool of threads.  The halo covers the
+ background box and the smoothing and masking kernels, so the pixels in
+ the core of each tile see the same neighbourhood as they would in the
+ full image; each tile keeps only the sources whose (rounded) position
+ is in its core.  Sources right on a seam can still be found by both
+ tiles (at slightly different positions); of any two from different
+ tiles within "dlim" pixels of each other, the fainter is dropped.
+
+ The noise is measured on the whole image first, so that all tiles use
+ the same detection threshold -- or, with "tilesigma", on each tile's
+ core (as a noise map), tiles where that fails getting the median.
+ */
+struct tile {
+    // core [x0,x1) x [y0,y1); with halo, [hx0,hx1) x [hy0,hy1).
+    int x0, x1, y0, y1;
+    int hx0, hx1, hy0, hy1;
+    // results, in full-image coordinates.
+    // the noise level, if measured per tile.
+    float sigma;
+    int npeaks;
+    float* x;
+    float* y;
+    float* flux;
+    float* background;
+    float* fluxL;
+    float* backgroundL;
+    int rtn;
+};
+
+struct tile_pool {
+    const simplexy_t* s;
+    struct tile* tiles;
+    int ntiles;
+    int next;
+    pthread_mutex_t lock;
+};
+
+// Runs simplexy on the pixels of tile "t" (with halo), "image" or
+// "image_u8", using "nthreads" threads, and keeps the sources in the core.
+static void run_tile_image(const simplexy_t* s, struct tile* t,
+                           float* image, uint8_t* image_u8, int nthreads) {
+    simplexy_t ts;
+    int i, n;
+
+    memcpy(&ts, s, sizeof(simplexy_t));
+    ts.nx = t->hx1 - t->hx0;
+    ts.ny = t->hy1 - t->hy0;
+    ts.image = image;
+    ts.image_u8 = image_u8;
+    ts.invert = 0;
+    ts.tilesize = 0;
+    ts.nthreads = nthreads;
+    if (t->sigma > 0)
+        ts.sigma = t->sigma;
+    ts.x = ts.y = ts.flux = ts.background = ts.fluxL = ts.backgroundL = NULL;
+    ts.npeaks = 0;
+    ts.bgimgfn = ts.maskimgfn = ts.blobimgfn = ts.bgsubimgfn = ts.smoothimgfn = NULL;
+
+    t->rtn = run_image(&ts, TRUE);
+
+    n = 0;
+    for (i=0; i<ts.npeaks; i++) {
+        float x = ts.x[i] + t->hx0;
+        float y = ts.y[i] + t->hy0;
+        int ix = (int)(x + 0.5);
+        int iy = (int)(y + 0.5);
+        if (ix < t->x0 || ix >= t->x1 || iy < t->y0 || iy >= t->y1)
+            continue;
+        ts.x[n] = x;
+        ts.y[n] = y;
+        ts.flux[n] = ts.flux[i];
+        ts.background[n] = ts.background[i];
+        if (ts.Lorder) {
+            ts.fluxL[n] = ts.fluxL[i];
+            ts.backgroundL[n] = ts.backgroundL[i];
+        }
+        n++;
+    }
+    t->npeaks = n;
+    t->x = ts.x;
+    t->y = ts.y;
+    t->flux = ts.flux;
+    t->background = ts.background;
+    t->fluxL = ts.fluxL;
+    t->backgroundL = ts.backgroundL;
+}
+
+static void run_tile(const simplexy_t* s, struct tile* t) {
+    int W = t->hx1 - t->hx0;
+    int H = t->hy1 - t->hy0;
+    float* image = NULL;
+    uint8_t* image_u8 = NULL;
+    int j;
+
+    if (s->image) {
+        image = malloc((size_t)W * (size_t)H * sizeof(float));
+        for (j=0; j<H; j++)
+            memcpy(image + (size_t)j * W,
+                   s->image + (size_t)(t->hy0 + j) * s->nx + t->hx0,
+                   W * sizeof(float));
+    } else {
+        image_u8 = malloc((size_t)W * (size_t)H);
+        for (j=0; j<H; j++)
+            memcpy(image_u8 + (size_t)j * W,
+                   s->image_u8 + (size_t)(t->hy0 + j) * s->nx + t->hx0, W);
+    }
+    // (the tiles themselves are run in parallel.)
+    run_tile_image(s, t, image, image_u8, 1);
+    free(image);
+    free(image_u8);
+    dselip_cleanup();
+}
+
+static void* tile_thread(void* arg) {
+    struct tile_pool* pool = arg;
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->ntiles)
+            break;
+        run_tile(pool->s, pool->tiles + i);
+    }
+    return NULL;
+}
+
+struct seam_source {
+    float x;
+    float y;
+    float flux;
+    int tile;
+    int index;
+};
+
+static int compare_seam_x(const void* v1, const void* v2) {
+    const struct seam_source* s1 = v1;
+    const struct seam_source* s2 = v2;
+    if (s1->x < s2->x)
+        return -1;
+    if (s1->x > s2->x)
+        return 1;
+    return 0;
+}
+
+// Marks (in "drop") the fainter of the sources from different tiles that
+// are within "dlim" of each other near the seams.
+static void dedup_seams(const simplexy_t* s, struct tile* tiles, int ntiles,
+                        int* offsets, uint8_t* drop) {
+    struct seam_source* seam;
+    int nseam = 0;
+    int total = offsets[ntiles];
+    float margin = s->dlim + 1.0;
+    int i, j, k;
+
+    seam = malloc(MAX(1, total) * sizeof(struct seam_source));
+    for (k=0; k<ntiles; k++) {
+        struct tile* t = tiles + k;
+        for (i=0; i<t->npeaks; i++) {
+            float x = t->x[i];
+            float y = t->y[i];
+            // near an inner edge of the core?
+            if (!((t->x0 > 0 && x - t->x0 < margin) ||
+                  (t->x1 < s->nx && t->x1 - x < margin) ||
+                  (t->y0 > 0 && y - t->y0 < margin) ||
+                  (t->y1 < s->ny && t->y1 - y < margin)))
+                continue;
+            seam[nseam].x = x;
+            seam[nseam].y = y;
+            seam[nseam].flux = t->flux[i];
+            seam[nseam].tile = k;
+            seam[nseam].index = offsets[k] + i;
+            nseam++;
+        }
+    }
+    qsort(seam, nseam, sizeof(struct seam_source), compare_seam_x);
+    for (i=0; i<nseam; i++) {
+        for (j=i+1; j<nseam && seam[j].x - seam[i].x <= s->dlim; j++) {
+            struct seam_source* a = seam + i;
+            struct seam_source* b = seam + j;
+            if (a->tile == b->tile)
+                continue;
+            if ((a->x - b->x)*(a->x - b->x) + (a->y - b->y)*(a->y - b->y) >
+                s->dlim * s->dlim)
+                continue;
+            if (a->flux >= b->flux)
+                drop[b->index] = 1;
+            else
+                drop[a->index] = 1;
+        }
+    }
+    free(seam);
+}
+
+// Collects the sources of the tiles into "s", and frees them.
+static int stitch_tiles(simplexy_t* s, struct tile* tiles, int ntiles) {
+    int* offsets;
+    uint8_t* drop;
+    int i, k, n, total;
+    int rtn = 0;
+
+    offsets = malloc((ntiles + 1) * sizeof(int));
+    offsets[0] = 0;
+    for (k=0; k<ntiles; k++) {
+        offsets[k+1] = offsets[k] + tiles[k].npeaks;
+        // (as for the whole image, 1 if any sources were found.)
+        if (tiles[k].rtn)
+            rtn = 1;
+    }
+    total = offsets[ntiles];
+    drop = calloc(MAX(1, total), 1);
+    dedup_seams(s, tiles, ntiles, offsets, drop);
+
+    n = 0;
+    for (i=0; i<total; i++)
+        if (!drop[i])
+            n++;
+    n = MIN(n, s->maxnpeaks);
+    s->npeaks = n;
+    s->x = malloc(n * sizeof(float));
+    s->y = malloc(n * sizeof(float));
+    s->flux = malloc(n * sizeof(float));
+    s->background = malloc(n * sizeof(float));
+    if (s->Lorder) {
+        s->fluxL = malloc(n * sizeof(float));
+        s->backgroundL = malloc(n * sizeof(float));
+    }
+    n = 0;
+    for (k=0; k<ntiles; k++) {
+        struct tile* t = tiles + k;
+        for (i=0; i<t->npeaks && n<s->npeaks; i++) {
+            if (drop[offsets[k] + i])
+                continue;
+            s->x[n] = t->x[i];
+            s->y[n] = t->y[i];
+            s->flux[n] = t->flux[i];
+            s->background[n] = t->background[i];
+            if (s->Lorder) {
+                s->fluxL[n] = t->fluxL[i];
+                s->backgroundL[n] = t->backgroundL[i];
+            }
+            n++;
+        }
+        free(t->x);
+        free(t->y);
+        free(t->flux);
+        free(t->background);
+        free(t->fluxL);
+        free(t->backgroundL);
+    }
+    logmsg("simplexy: found %i sources.\n", s->npeaks);
+    free(drop);
+    free(offsets);
+    return rtn;
+}
+
+// background box + smoothing kernel + mask box.
+static int tile_halo(const simplexy_t* s) {
+    return s->halfbox + 2 * (int)ceilf(3.0 * s->dpsf) + 2;
+}
+
+static int compare_floats(const void* v1, const void* v2) {
+    float f1 = *(const float*)v1;
+    float f2 = *(const float*)v2;
+    if (f1 < f2)
+        return -1;
+    if (f1 > f2)
+        return 1;
+    return 0;
+}
+
+// Sets each tile's noise level, and "sigma" to their median.
+static void measure_tile_sigmas(simplexy_t* s, struct tile* tiles,
+                                int ntx, int nty) {
+    int ntiles = ntx * nty;
+    int grid = dsigma_gridsize(s->nx, s->ny, s->sigmasamples);
+    float* map = calloc(ntiles, sizeof(float));
+    float* sorted = malloc(ntiles * sizeof(float));
+    int k, n = 0;
+
+    if (s->image_u8)
+        dsigma_map_u8(s->image_u8, s->nx, s->ny, 5, grid, ntx, nty,
+                      simplexy_nthreads(s), map);
+    else
+        dsigma_map(s->image, s->nx, s->ny, 5, grid, ntx, nty,
+                   simplexy_nthreads(s), map);
+    for (k=0; k<ntiles; k++)
+        if (map[k] > 0)
+            sorted[n++] = map[k];
+    if (n) {
+        qsort(sorted, n, sizeof(float), compare_floats);
+        s->sigma = sorted[n / 2];
+    } else
+        s->sigma = 1.0;
+    for (k=0; k<ntiles; k++) {
+        tiles[k].sigma = (map[k] > 0 ? map[k] : s->sigma);
+        debug("simplexy: tile %i sigma %g\n", k, tiles[k].sigma);
+    }
+    free(map);
+    free(sorted);
+}
+
+static int run_tiled(simplexy_t* s) {
+    int nx = s->nx;
+    int ny = s->ny;
+    int ntx, nty, ntiles;
+    int halo;
+    struct tile* tiles;
+    struct tile_pool pool;
+    pthread_t* threads;
+    int nthreads, nstarted;
+    int i, k;
+    int rtn;
+
+    invert_image(s);
+    halo = tile_halo(s);
+    ntx = (nx + s->tilesize - 1) / s->tilesize;
+    nty = (ny + s->tilesize - 1) / s->tilesize;
+    ntiles = ntx * nty;
+    tiles = calloc(ntiles, sizeof(struct tile));
+
+    if (s->sigma == 0.0 && s->tilesigma) {
+        logverb("simplexy: measuring image noise (sigma) in %i x %i tiles...\n",
+                ntx, nty);
+        PROFILE_BEGIN("sigma");
+        measure_tile_sigmas(s, tiles, ntx, nty);
+        PROFILE_END("sigma");
+        logverb("simplexy: found median sigma=%g.\n", s->sigma);
+    } else if (s->sigma == 0.0) {
+        logverb("simplexy: measuring image noise (sigma)...\n");
+        PROFILE_BEGIN("sigma");
+        measure_sigma(s);
+        PROFILE_END("sigma");
+        logverb("simplexy: found sigma=%g.\n", s->sigma);
+    }
+
+    for (k=0; k<ntiles; k++) {
+        struct tile* t = tiles + k;
+        int tx = k % ntx;
+        int ty = k / ntx;
+        t->x0 = (int)((long)nx * tx / ntx);
+        t->x1 = (int)((long)nx * (tx+1) / ntx);
+        t->y0 = (int)((long)ny * ty / nty);
+        t->y1 = (int)((long)ny * (ty+1) / nty);
+        t->hx0 = MAX(0, t->x0 - halo);
+        t->hx1 = MIN(nx, t->x1 + halo);
+        t->hy0 = MAX(0, t->y0 - halo);
+        t->hy1 = MIN(ny, t->y1 + halo);
+    }
+
+    nthreads = MAX(1, MIN(simplexy_nthreads(s), ntiles));
+    logverb("simplexy: running %i x %i tiles (halo %i) on %i threads\n",
+            ntx, nty, halo, nthreads);
+
+    pool.s = s;
+    pool.tiles = tiles;
+    pool.ntiles = ntiles;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    threads = calloc(nthreads, sizeof(pthread_t));
+    // the calling thread is one of the workers.
+    for (nstarted=0; nstarted<nthreads-1; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, tile_thread, &pool)) {
+            SYSERROR("Failed to start simplexy tile thread");
+            break;
+        }
+    tile_thread(&pool);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+
+    rtn = stitch_tiles(s, tiles, ntiles);
+    free(tiles);
+    return rtn;
+}
+
+int simplexy_run(simplexy_t* s) {
+    // (the debugging images are only written for the whole image, and
+    // the OpenCL device takes the whole image at once.)
+    if (s->tilesize > 0 && (s->nx > s->tilesize || s->ny > s->tilesize) &&
+        !(s->bgimgfn || s->maskimgfn || s->blobimgfn || s->bgsubimgfn ||
+          s->smoothimgfn) && !use_opencl(s, s->cache))
+        return run_tiled(s);
+    return run_image(s, FALSE);
+}
+
+/*
+ Streaming mode: the image is read in full-width bands of "bandrows"
+ rows; each band plus a halo of rows above and below is run like a tile
+ (see run_tiled()), and the buffer slides down the image, keeping the
+ rows shared with the next band.  If the noise level is not given, it is
+ the median of the noise measured in each band, in a first pass.
+ */
+int simplexy_run_streaming(simplexy_t* s, simplexy_read_rows_func read_rows,
+                           void* token) {
+    int nx = s->nx;
+    int ny = s->ny;
+    int bandrows = (s->bandrows > 0 ? s->bandrows : SIMPLEXY_DEFAULT_BANDROWS);
+    int halo = tile_halo(s);
+    int nbands = (ny + bandrows - 1) / bandrows;
+    int maxrows = MIN(ny, bandrows + 2*halo);
+    struct tile* tiles;
+    float* buf;
+    int buf_y0 = 0, buf_n = 0;
+    int b;
+    size_t i;
+    int rtn = -1;
+
+    assert(!s->image && !s->image_u8);
+    buf = malloc((size_t)nx * (size_t)maxrows * sizeof(float));
+    tiles = calloc(nbands, sizeof(struct tile));
+    if (!buf || !tiles) {
+        SYSERROR("Failed to allocate %i x %i image band", nx, maxrows);
+        goto bailout;
+    }
+
+    if (s->sigma == 0.0) {
+        float* sigmas = calloc(nbands, sizeof(float));
+        int nsig = 0;
+        logverb("simplexy: measuring image noise (sigma) in %i bands...\n",
+                nbands);
+        for (b=0; b<nbands; b++) {
+            int y0 = (int)((long)ny * b / nbands);
+            int y1 = (int)((long)ny * (b+1) / nbands);
+            float sig = 0.0;
+            if (read_rows(token, y0, y1 - y0, buf)) {
+                ERROR("Failed to read image rows %i to %i", y0, y1);
+                free(sigmas);
+                goto bailout;
+            }
+            dsigma_threaded(buf, nx, y1 - y0, 5,
+                            dsigma_gridsize(nx, ny, s->sigmasamples),
+                            s->nthreads, &sig);
+            if (sig > 0)
+                sigmas[nsig++] = sig;
+        }
+        if (nsig) {
+            qsort(sigmas, nsig, sizeof(float), compare_floats);
+            s->sigma = sigmas[nsig / 2];
+        } else
+            s->sigma = 1.0;
+        free(sigmas);
+        logverb("simplexy: found sigma=%g.\n", s->sigma);
+    }
+
+    logverb("simplexy: streaming %i bands of %i rows (halo %i)\n",
+            nbands, bandrows, halo);
+    for (b=0; b<nbands; b++) {
+        struct tile* t = tiles + b;
+        int keep = 0;
+        t->x0 = t->hx0 = 0;
+        t->x1 = t->hx1 = nx;
+        t->y0 = (int)((long)ny * b / nbands);
+        t->y1 = (int)((long)ny * (b+1) / nbands);
+        t->hy0 = MAX(0, t->y0 - halo);
+        t->hy1 = MIN(ny, t->y1 + halo);
+
+        // slide the rows this band shares with the last one to the top.
+        if (buf_n && t->hy0 >= buf_y0 && t->hy0 < buf_y0 + buf_n) {
+            keep = buf_y0 + buf_n - t->hy0;
+            memmove(buf, buf + (size_t)(t->hy0 - buf_y0) * nx,
+                    (size_t)keep * nx * sizeof(float));
+        }
+        if (read_rows(token, t->hy0 + keep, t->hy1 - t->hy0 - keep,
+                      buf + (size_t)keep * nx)) {
+            ERROR("Failed to read image rows %i to %i", t->hy0 + keep, t->hy1);
+            goto bailout;
+        }
+        if (s->invert)
+            for (i=(size_t)keep * nx; i<(size_t)(t->hy1 - t->hy0) * nx; i++)
+                buf[i] = -buf[i];
+        buf_y0 = t->hy0;
+        buf_n = t->hy1 - t->hy0;
+
+        run_tile_image(s, t, buf, NULL, s->nthreads);
+        logverb("simplexy: band %i of %i: %i sources\n", b+1, nbands,
+                t->npeaks);
+    }
+    rtn = stitch_tiles(s, tiles, nbands);
+    free(tiles);
+    tiles = NULL;
+
+ bailout:
+    if (tiles) {
+        for (b=0; b<nbands; b++) {
+            free(tiles[b].x);
+            free(tiles[b].y);
+            free(tiles[b].flux);
+            free(tiles[b].background);
+            free(tiles[b].fluxL);
+            free(tiles[b].backgroundL);
+        }
+        free(tiles);
+    }
+    free(buf);
+    dselip_cleanup();
+    return rtn;
+}
+
 void simplexy_clean_cache() {
     dselip_cleanup();
 }
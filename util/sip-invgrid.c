@@ -0,0 +1,335 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "os-features.h"
+#include "sip-invgrid.h"
+#include "sip.h"
+#include "mathutil.h"
+#include "errors.h"
+#include "log.h"
+
+// Cells across the larger image dimension, by default.
+#define INVGRID_DEFAULT_CELLS 32
+
+// Extra nodes around the image: one for the bicubic stencil, one for slack.
+#define INVGRID_MARGIN 2
+
+// Newton iterations used when building the table (or for points outside it).
+#define INVGRID_MAX_ITERS 20
+#define INVGRID_TOL 1e-10
+
+// Forward SIP polynomial "c" and its partial derivatives at u,v.
+static void poly_deriv(const double c[SIP_MAXORDER][SIP_MAXORDER], int order,
+                       double u, double v,
+                       double* f, double* fu, double* fv) {
+    double powu[SIP_MAXORDER+1];
+    double powv[SIP_MAXORDER+1];
+    int p, q;
+    *f = *fu = *fv = 0.0;
+    if (order < 0)
+        return;
+    powu[0] = powv[0] = 1.0;
+    for (p=1; p<=order; p++) {
+        powu[p] = powu[p-1] * u;
+        powv[p] = powv[p-1] * v;
+    }
+    for (p=0; p<=order; p++)
+        for (q=0; p+q<=order; q++) {
+            *f += c[p][q] * powu[p] * powv[q];
+            if (p)
+                *fu += p * c[p][q] * powu[p-1] * powv[q];
+            if (q)
+                *fv += q * c[p][q] * powu[p] * powv[q-1];
+        }
+}
+
+// One Newton step towards u + f(u,v) = U, v + g(u,v) = V.  Returns the
+// size of the residual before the step.
+static double newton_step(const sip_t* sip, double U, double V,
+                          double* u, double* v) {
+    double f, fu, fv, g, gu, gv;
+    double F1, F2, j11, j12, j21, j22, det;
+    poly_deriv(sip->a, sip->a_order, *u, *v, &f, &fu, &fv);
+    poly_deriv(sip->b, sip->b_order, *u, *v, &g, &gu, &gv);
+    F1 = *u + f - U;
+    F2 = *v + g - V;
+    j11 = 1.0 + fu;
+    j12 = fv;
+    j21 = gu;
+    j22 = 1.0 + gv;
+    det = j11 * j22 - j12 * j21;
+    if (det == 0.0)
+        return fabs(F1) + fabs(F2);
+    *u -= ( j22 * F1 - j12 * F2) / det;
+    *v -= (-j21 * F1 + j11 * F2) / det;
+    return fabs(F1) + fabs(F2);
+}
+
+// Inverts the forward distortion at U,V (relative to CRPIX) by Newton's
+// method, starting from *u,*v.
+static void newton_solve(const sip_t* sip, double U, double V,
+                         double* u, double* v) {
+    int i;
+    for (i=0; i<INVGRID_MAX_ITERS; i++)
+        if (newton_step(sip, U, V, u, v) < INVGRID_TOL)
+            break;
+}
+
+static void initial_guess(const sip_t* sip, double U, double V,
+                          double* u, double* v) {
+    if (sip->ap_order > 0 || sip->bp_order > 0)
+        sip_calc_inv_distortion(sip, U, V, u, v);
+    else {
+        *u = U;
+        *v = V;
+    }
+}
+
+static void catmull_rom(double t, double* w) {
+    double t2 = t*t;
+    double t3 = t2*t;
+    w[0] = 0.5 * (-t3 + 2.0*t2 - t);
+    w[1] = 0.5 * (3.0*t3 - 5.0*t2 + 2.0);
+    w[2] = 0.5 * (-3.0*t3 + 4.0*t2 + t);
+    w[3] = 0.5 * (t3 - t2);
+}
+
+// Interpolates the table at U,V; returns FALSE if that is outside it.
+static anbool interpolate(const sip_invgrid_t* g, double U, double V,
+                          double* u, double* v) {
+    double gx = (U - g->u0) / g->step;
+    double gy = (V - g->v0) / g->step;
+    int ix, iy, i, j;
+    double wx[4], wy[4];
+    double su = 0, sv = 0;
+    if (!(gx >= 1.0 && gy >= 1.0))
+        return FALSE;
+    ix = (int)gx;
+    iy = (int)gy;
+    if (ix + 2 >= g->NX || iy + 2 >= g->NY)
+        return FALSE;
+    catmull_rom(gx - ix, wx);
+    catmull_rom(gy - iy, wy);
+    for (j=0; j<4; j++) {
+        int row = (iy - 1 + j) * g->NX + (ix - 1);
+        double ru = 0, rv = 0;
+        for (i=0; i<4; i++) {
+            ru += wx[i] * g->du[row + i];
+            rv += wx[i] * g->dv[row + i];
+        }
+        su += wy[j] * ru;
+        sv += wy[j] * rv;
+    }
+    *u = U + su;
+    *v = V + sv;
+    return TRUE;
+}
+
+static anbool has_distortions(const sip_t* sip) {
+    return (sip->a_order > 0 || sip->b_order > 0);
+}
+
+sip_invgrid_t* sip_invgrid_new(const sip_t* sip, double step, int newton) {
+    sip_invgrid_t* g;
+    if (has_distortions(sip) &&
+        (sip->wcstan.imagew <= 0 || sip->wcstan.imageh <= 0)) {
+        ERROR("sip_invgrid_new: the WCS must have its image size set");
+        return NULL;
+    }
+    g = calloc(1, sizeof(sip_invgrid_t));
+    memcpy(&g->sip, sip, sizeof(sip_t));
+    if (step <= 0)
+        step = MAX(sip->wcstan.imagew, sip->wcstan.imageh) /
+            (double)INVGRID_DEFAULT_CELLS;
+    g->step = MAX(step, 1.0);
+    g->newton = MAX(newton, 0);
+    return g;
+}
+
+void sip_invgrid_free(sip_invgrid_t* g) {
+    if (!g)
+        return;
+    free(g->du);
+    free(g->dv);
+    free(g);
+}
+
+int sip_invgrid_build(sip_invgrid_t* g) {
+    const sip_t* sip = &g->sip;
+    double W, H;
+    double umin, umax, vmin, vmax;
+    int i, j, k, NB;
+
+    if (g->built)
+        return 0;
+    if (!has_distortions(sip)) {
+        g->built = TRUE;
+        return 0;
+    }
+
+    // Bounding box of the image edges in undistorted coordinates.
+    W = sip->wcstan.imagew;
+    H = sip->wcstan.imageh;
+    umin = vmin =  HUGE_VAL;
+    umax = vmax = -HUGE_VAL;
+    NB = 4 * INVGRID_DEFAULT_CELLS;
+    for (k=0; k<=NB; k++) {
+        double t = (double)k / NB;
+        double edge[4][2] = { { 0.5 + t*W, 0.5 }, { 0.5 + t*W, 0.5 + H },
+                              { 0.5, 0.5 + t*H }, { 0.5 + W, 0.5 + t*H } };
+        for (i=0; i<4; i++) {
+            double U, V;
+            sip_calc_distortion(sip, edge[i][0] - sip->wcstan.crpix[0],
+                                edge[i][1] - sip->wcstan.crpix[1], &U, &V);
+            umin = MIN(umin, U);
+            umax = MAX(umax, U);
+            vmin = MIN(vmin, V);
+            vmax = MAX(vmax, V);
+        }
+    }
+
+    g->NX = (int)ceil((umax - umin) / g->step) + 1 + 2*INVGRID_MARGIN;
+    g->NY = (int)ceil((vmax - vmin) / g->step) + 1 + 2*INVGRID_MARGIN;
+    g->u0 = umin - INVGRID_MARGIN * g->step;
+    g->v0 = vmin - INVGRID_MARGIN * g->step;
+    g->du = malloc(g->NX * g->NY * sizeof(double));
+    g->dv = malloc(g->NX * g->NY * sizeof(double));
+    if (!g->du || !g->dv) {
+        SYSERROR("Failed to allocate SIP inverse grid of %i x %i", g->NX, g->NY);
+        free(g->du);
+        free(g->dv);
+        g->du = g->dv = NULL;
+        return -1;
+    }
+    logverb("Building SIP inverse grid: %i x %i nodes, step %g pixels\n",
+            g->NX, g->NY, g->step);
+
+    for (j=0; j<g->NY; j++) {
+        double V = g->v0 + j * g->step;
+        for (i=0; i<g->NX; i++) {
+            double U = g->u0 + i * g->step;
+            double u, v;
+            int node = j * g->NX + i;
+            // start from the neighbouring solution if there is one.
+            if (i) {
+                u = U + g->du[node-1];
+                v = V + g->dv[node-1];
+            } else if (j) {
+                u = U + g->du[node - g->NX];
+                v = V + g->dv[node - g->NX];
+            } else
+                initial_guess(sip, U, V, &u, &v);
+            newton_solve(sip, U, V, &u, &v);
+            g->du[node] = u - U;
+            g->dv[node] = v - V;
+        }
+    }
+    g->built = TRUE;
+
+    // Check the interpolation error at the cell centers.
+    g->maxerr = 0.0;
+    for (j=1; j<g->NY-2; j++)
+        for (i=1; i<g->NX-2; i++) {
+            double U = g->u0 + (i + 0.5) * g->step;
+            double V = g->v0 + (j + 0.5) * g->step;
+            double u, v, U2, V2;
+            if (!interpolate(g, U, V, &u, &v))
+                continue;
+            sip_calc_distortion(sip, u, v, &U2, &V2);
+            g->maxerr = MAX(g->maxerr, hypot(U2 - U, V2 - V));
+        }
+    logverb("SIP inverse grid: max interpolation error %g pixels\n", g->maxerr);
+    return 0;
+}
+
+double sip_invgrid_max_error(sip_invgrid_t* g) {
+    if (sip_invgrid_build(g))
+        return HUGE_VAL;
+    return g->maxerr;
+}
+
+// U,V relative to CRPIX -> u,v relative to CRPIX.
+static void undistort_relative(sip_invgrid_t* g, double U, double V,
+                               double* u, double* v) {
+    int i;
+    if (interpolate(g, U, V, u, v)) {
+        for (i=0; i<g->newton; i++)
+            newton_step(&g->sip, U, V, u, v);
+        return;
+    }
+    // Outside the table: start from scratch.
+    initial_guess(&g->sip, U, V, u, v);
+    newton_solve(&g->sip, U, V, u, v);
+}
+
+void sip_invgrid_undistort(sip_invgrid_t* g, double x, double y,
+                           double* px, double* py) {
+    const double* crpix = g->sip.wcstan.crpix;
+    double u, v;
+    if (sip_invgrid_build(g) || !has_distortions(&g->sip)) {
+        sip_pixel_undistortion(&g->sip, x, y, px, py);
+        return;
+    }
+    undistort_relative(g, x - crpix[0], y - crpix[1], &u, &v);
+    *px = u + crpix[0];
+    *py = v + crpix[1];
+}
+
+anbool sip_invgrid_radec2pixelxy(sip_invgrid_t* g, double ra, double dec,
+                                 double* px, double* py) {
+    double x, y;
+    if (!tan_radec2pixelxy(&g->sip.wcstan, ra, dec, &x, &y))
+        return FALSE;
+    sip_invgrid_undistort(g, x, y, px, py);
+    return TRUE;
+}
+
+// Applies the inverse distortion to the TAN pixel positions "xy" in place.
+static void undistort_array(sip_invgrid_t* g, int N, double* xy,
+                            const anbool* ok) {
+    const double* crpix = g->sip.wcstan.crpix;
+    int i;
+    if (sip_invgrid_build(g)) {
+        for (i=0; i<N; i++)
+            if (ok[i])
+                sip_pixel_undistortion(&g->sip, xy[2*i], xy[2*i+1],
+                                       xy + 2*i, xy + 2*i + 1);
+        return;
+    }
+    if (!has_distortions(&g->sip))
+        return;
+    for (i=0; i<N; i++) {
+        double u, v;
+        if (!ok[i])
+            continue;
+        undistort_relative(g, xy[2*i] - crpix[0], xy[2*i+1] - crpix[1], &u, &v);
+        xy[2*i+0] = u + crpix[0];
+        xy[2*i+1] = v + crpix[1];
+    }
+}
+
+int sip_invgrid_radec2pixelxy_array(sip_invgrid_t* g, const double* radec,
+                                    int N, double* xy, anbool* ok) {
+    anbool* myok = ok ? ok : malloc(N * sizeof(anbool));
+    int ngood = tan_radec2pixelxy_array(&g->sip.wcstan, radec, N, xy, myok);
+    undistort_array(g, N, xy, myok);
+    if (!ok)
+        free(myok);
+    return ngood;
+}
+
+int sip_invgrid_xyzarr2pixelxy_array(sip_invgrid_t* g, const double* xyz,
+                                     int N, double* xy, anbool* ok) {
+    anbool* myok = ok ? ok : malloc(N * sizeof(anbool));
+    int ngood = tan_xyzarr2pixelxy_array(&g->sip.wcstan, xyz, N, xy, myok);
+    undistort_array(g, N, xy, myok);
+    if (!ok)
+        free(myok);
+    return ngood;
+}
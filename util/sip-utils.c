@@ -12,6 +12,7 @@
 
 #include "os-features.h"
 #include "sip-utils.h"
+#include "sip-invgrid.h"
 #include "gslutils.h"
 #include "starutil.h"
 #include "mathutil.h"
@@ -269,7 +270,8 @@ int* sip_filter_stars_in_field(const sip_t* sip, const tan_t* tan,
                                int N, double** p_xy, int* inds, int* p_Ngood) {
     int i, Ngood;
     int W, H;
-    double* xy = NULL;
+    double* xy;
+    anbool* ok;
     anbool allocd = FALSE;
 	
     assert(sip || tan);
@@ -282,55 +284,61 @@ int* sip_filter_stars_in_field(const sip_t* sip, const tan_t* tan,
         allocd = TRUE;
     }
 
-    if (p_xy)
-        xy = malloc(N * 2 * sizeof(double));
+    // Project all the stars at once, then keep the ones inside the image.
+    xy = malloc(N * 2 * sizeof(double));
+    ok = malloc(N * sizeof(anbool));
 
     if (sip) {
+        sip_invgrid_t* grid = NULL;
         W = sip->wcstan.imagew;
         H = sip->wcstan.imageh;
+        // Without AP,BP terms, invert the distortion with a grid.
+        if (sip->a_order > 0 && sip->ap_order == 0)
+            grid = sip_invgrid_new(sip, 0, 1);
+        if (grid) {
+            if (xyz)
+                sip_invgrid_xyzarr2pixelxy_array(grid, xyz, N, xy, ok);
+            else
+                sip_invgrid_radec2pixelxy_array(grid, radec, N, xy, ok);
+            sip_invgrid_free(grid);
+        } else if (xyz)
+            sip_xyzarr2pixelxy_array(sip, xyz, N, xy, ok);
+        else
+            sip_radec2pixelxy_array(sip, radec, N, xy, ok);
     } else {
         W = tan->imagew;
         H = tan->imageh;
+        if (xyz)
+            tan_xyzarr2pixelxy_array(tan, xyz, N, xy, ok);
+        else
+            tan_radec2pixelxy_array(tan, radec, N, xy, ok);
     }
 
     for (i=0; i<N; i++) {
         double x, y;
-        if (xyz) {
-            if (sip) {
-                if (!sip_xyzarr2pixelxy(sip, xyz + i*3, &x, &y))
-                    continue;
-            } else {
-                if (!tan_xyzarr2pixelxy(tan, xyz + i*3, &x, &y))
-                    continue;
-            }
-        } else {
-            if (sip) {
-                if (!sip_radec2pixelxy(sip, radec[i*2], radec[i*2+1], &x, &y))
-                    continue;
-            } else {
-                if (!tan_radec2pixelxy(tan, radec[i*2], radec[i*2+1], &x, &y))
-                    continue;
-            }
-        }
+        if (!ok[i])
+            continue;
+        x = xy[i * 2 + 0];
+        y = xy[i * 2 + 1];
         // FIXME -- check half- and one-pixel FITS issues.
         if ((x < 0) || (y < 0) || (x >= W) || (y >= H))
             continue;
 
         inds[Ngood] = i;
-        if (xy) {
-            xy[Ngood * 2 + 0] = x;
-            xy[Ngood * 2 + 1] = y;
-        }
+        // (Ngood <= i, so this never overwrites a point not yet checked.)
+        xy[Ngood * 2 + 0] = x;
+        xy[Ngood * 2 + 1] = y;
         Ngood++;
     }
+    free(ok);
 
     if (allocd)
         inds = realloc(inds, Ngood * sizeof(int));
 
-    if (xy)
-        xy = realloc(xy, Ngood * 2 * sizeof(double));
     if (p_xy)
-        *p_xy = xy;
+        *p_xy = realloc(xy, Ngood * 2 * sizeof(double));
+    else
+        free(xy);
 
     *p_Ngood = Ngood;
 	
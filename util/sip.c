@@ -435,6 +435,326 @@ void sip_calc_inv_distortion(const sip_t* sip, double U, double V, double* u, do
     *v = V + gUV;
 }
 
+/*
+ Array versions.
+
+ These transform N points at a time: the CD inverse, the tangent-plane
+ basis vectors and the polynomial orders are worked out once per call
+ rather than once per point.  The points are processed in blocks of
+ SIP_ARRAY_BLOCK; within a block the x and y coordinates are held in
+ separate arrays and every loop over points is innermost, so the
+ compiler can vectorize them.
+ */
+#define SIP_ARRAY_BLOCK 256
+
+// Evaluates the SIP polynomial with the given coefficients and order at
+// (u[i], v[i]) for n <= SIP_ARRAY_BLOCK points, writing the results to
+// "out".  Uses Horner's scheme in v for each power of u, and then in u.
+static void sip_poly_block(const double c[SIP_MAXORDER][SIP_MAXORDER],
+                           int order, const double* u, const double* v,
+                           int n, double* out) {
+    double t[SIP_ARRAY_BLOCK];
+    int p, q, i;
+    for (i=0; i<n; i++)
+        out[i] = 0.0;
+    for (p=order; p>=0; p--) {
+        const double* cp = c[p];
+        double chi = cp[order - p];
+        for (i=0; i<n; i++)
+            t[i] = chi;
+        for (q=order-p-1; q>=0; q--) {
+            double cq = cp[q];
+            for (i=0; i<n; i++)
+                t[i] = t[i] * v[i] + cq;
+        }
+        for (i=0; i<n; i++)
+            out[i] = out[i] * u[i] + t[i];
+    }
+}
+
+// U = u + f(u,v), V = v + g(u,v) for one block.
+static void sip_distortion_block(const double a[SIP_MAXORDER][SIP_MAXORDER],
+                                 int a_order,
+                                 const double b[SIP_MAXORDER][SIP_MAXORDER],
+                                 int b_order,
+                                 const double* u, const double* v, int n,
+                                 double* U, double* V) {
+    double fuv[SIP_ARRAY_BLOCK];
+    double guv[SIP_ARRAY_BLOCK];
+    int i;
+    sip_poly_block(a, a_order, u, v, n, fuv);
+    sip_poly_block(b, b_order, u, v, n, guv);
+    for (i=0; i<n; i++) {
+        U[i] = u[i] + fuv[i];
+        V[i] = v[i] + guv[i];
+    }
+}
+
+void sip_calc_distortion_array(const sip_t* sip, const double* u,
+                               const double* v, int N,
+                               double* U, double* V) {
+    int i;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        sip_distortion_block(sip->a, sip->a_order, sip->b, sip->b_order,
+                             u+i, v+i, n, U+i, V+i);
+    }
+}
+
+void sip_calc_inv_distortion_array(const sip_t* sip, const double* U,
+                                   const double* V, int N,
+                                   double* u, double* v) {
+    int i;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        sip_distortion_block(sip->ap, sip->ap_order, sip->bp, sip->bp_order,
+                             U+i, V+i, n, u+i, v+i);
+    }
+}
+
+// Pixels (interleaved, N points) to XYZ unit vectors, through the
+// (optional) forward SIP distortion.
+static void pixelxy2xyzarr_array(const tan_t* tan, const sip_t* sip,
+                                 const double* xy, int N, double* xyz) {
+    double u[SIP_ARRAY_BLOCK], v[SIP_ARRAY_BLOCK];
+    double rx, ry, rz;
+    double ix, iy, jx, jy, jz;
+    double cdx[2][2];
+    int i, j;
+
+    // The CD matrix, converted to radians and with the factor of -1
+    // that tan_iwc2xyzarr() applies to x.
+    cdx[0][0] = -deg2rad(tan->cd[0][0]);
+    cdx[0][1] = -deg2rad(tan->cd[0][1]);
+    cdx[1][0] =  deg2rad(tan->cd[1][0]);
+    cdx[1][1] =  deg2rad(tan->cd[1][1]);
+
+    // Same basis as tan_iwc2xyzarr().
+    radecdeg2xyz(tan->crval[0], tan->crval[1], &rx, &ry, &rz);
+    if (rz == 1.0 || rz == -1.0) {
+        ix = -1.0;
+        iy = 0.0;
+    } else {
+        double norm;
+        ix = ry;
+        iy = -rx;
+        norm = hypot(ix, iy);
+        ix /= norm;
+        iy /= norm;
+    }
+    jx = iy * rz;
+    jy =         - ix * rz;
+    jz = ix * ry - iy * rx;
+    normalize(&jx, &jy, &jz);
+
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        const double* bxy = xy + 2*i;
+        double* bxyz = xyz + 3*i;
+        for (j=0; j<n; j++) {
+            u[j] = bxy[2*j+0] - tan->crpix[0];
+            v[j] = bxy[2*j+1] - tan->crpix[1];
+        }
+        if (sip)
+            sip_distortion_block(sip->a, sip->a_order, sip->b, sip->b_order,
+                                 u, v, n, u, v);
+        for (j=0; j<n; j++) {
+            double x = cdx[0][0] * u[j] + cdx[0][1] * v[j];
+            double y = cdx[1][0] * u[j] + cdx[1][1] * v[j];
+            double* s = bxyz + 3*j;
+            if (tan->sin) {
+                double rfrac;
+                assert((x*x + y*y) < 1.0);
+                rfrac = sqrt(1.0 - (x*x + y*y));
+                s[0] = ix*x + jx*y + rx * rfrac;
+                s[1] = iy*x + jy*y + ry * rfrac;
+                s[2] =        jz*y + rz * rfrac;
+            } else {
+                double invlen;
+                s[0] = ix*x + jx*y + rx;
+                s[1] = iy*x + jy*y + ry;
+                s[2] =        jz*y + rz;
+                invlen = 1.0 / sqrt(s[0]*s[0] + s[1]*s[1] + s[2]*s[2]);
+                s[0] *= invlen;
+                s[1] *= invlen;
+                s[2] *= invlen;
+            }
+        }
+    }
+}
+
+// XYZ unit vectors (N points) to pixels (interleaved), through the
+// (optional) inverse SIP distortion.  Returns the number of points that
+// project onto the tangent plane; ok[i] (if non-NULL) says which.
+static int xyzarr2pixelxy_array(const tan_t* tan, const sip_t* sip,
+                                const double* xyz, int N,
+                                double* xy, anbool* ok) {
+    double U[SIP_ARRAY_BLOCK], V[SIP_ARRAY_BLOCK];
+    anbool good[SIP_ARRAY_BLOCK];
+    double r[3];
+    double cdi[2][2];
+    double etax, etay, xix, xiy, xiz, norm;
+    anbool pole;
+    int i, j;
+    int ngood = 0;
+    Unused int rtn;
+
+    rtn = invert_2by2_arr((const double*)tan->cd, (double*)cdi);
+    assert(rtn == 0);
+    // iwc is in degrees
+    for (i=0; i<2; i++)
+        for (j=0; j<2; j++)
+            cdi[i][j] = rad2deg(cdi[i][j]);
+
+    radecdeg2xyzarr(tan->crval[0], tan->crval[1], r);
+    // star_coords() treats the poles specially; leave those to it.
+    pole = (r[2] == 1.0 || r[2] == -1.0);
+    // Same basis as star_coords().
+    etax = -r[1];
+    etay =  r[0];
+    norm = hypot(etax, etay);
+    if (norm > 0) {
+        etax /= norm;
+        etay /= norm;
+    }
+    xix = -r[2] * etay;
+    xiy =  r[2] * etax;
+    xiz =  r[0] * etay - r[1] * etax;
+
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        const double* bxyz = xyz + 3*i;
+        double* bxy = xy + 2*i;
+        for (j=0; j<n; j++) {
+            const double* s = bxyz + 3*j;
+            double x, y;
+            if (pole) {
+                good[j] = star_coords(s, r, !tan->sin, &x, &y);
+            } else {
+                double sdotr = s[0] * r[0] + s[1] * r[1] + s[2] * r[2];
+                good[j] = (sdotr > 0.0);
+                x = s[0] * etax + s[1] * etay;
+                y = s[0] *  xix + s[1] *  xiy + s[2] * xiz;
+                if (!tan->sin) {
+                    double inv_sdotr = good[j] ? 1.0 / sdotr : 0.0;
+                    x *= inv_sdotr;
+                    y *= inv_sdotr;
+                }
+            }
+            if (!good[j])
+                x = y = 0.0;
+            U[j] = cdi[0][0] * x + cdi[0][1] * y;
+            V[j] = cdi[1][0] * x + cdi[1][1] * y;
+        }
+        if (sip)
+            sip_distortion_block(sip->ap, sip->ap_order, sip->bp, sip->bp_order,
+                                 U, V, n, U, V);
+        for (j=0; j<n; j++) {
+            if (ok)
+                ok[i+j] = good[j];
+            if (!good[j])
+                continue;
+            bxy[2*j+0] = U[j] + tan->crpix[0];
+            bxy[2*j+1] = V[j] + tan->crpix[1];
+            ngood++;
+        }
+    }
+    return ngood;
+}
+
+static void radec2xyz_array(const double* radec, int N, double* xyz) {
+    radecdegarr2xyzarr_batch(radec, xyz, N);
+}
+
+static void xyz2radec_array(const double* xyz, int N, double* radec) {
+    xyzarr2radecdegarr_batch(xyz, radec, N);
+}
+
+static const sip_t* sip_if_distorted(const sip_t* sip) {
+    return has_distortions(sip) ? sip : NULL;
+}
+
+static const sip_t* sip_if_inverse(const sip_t* sip) {
+    if (!has_distortions(sip))
+        return NULL;
+    if (sip->a_order != 0 && sip->ap_order == 0) {
+        fprintf(stderr, "suspicious inversion; no inverse SIP coeffs "
+                "yet there are forward SIP coeffs\n");
+    }
+    return sip;
+}
+
+void tan_pixelxy2xyzarr_array(const tan_t* tan, const double* xy, int N,
+                              double* xyz) {
+    pixelxy2xyzarr_array(tan, NULL, xy, N, xyz);
+}
+
+void tan_pixelxy2radec_array(const tan_t* tan, const double* xy, int N,
+                             double* radec) {
+    double xyz[3 * SIP_ARRAY_BLOCK];
+    int i;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        pixelxy2xyzarr_array(tan, NULL, xy + 2*i, n, xyz);
+        xyz2radec_array(xyz, n, radec + 2*i);
+    }
+}
+
+void sip_pixelxy2xyzarr_array(const sip_t* sip, const double* xy, int N,
+                              double* xyz) {
+    pixelxy2xyzarr_array(&(sip->wcstan), sip_if_distorted(sip), xy, N, xyz);
+}
+
+void sip_pixelxy2radec_array(const sip_t* sip, const double* xy, int N,
+                             double* radec) {
+    double xyz[3 * SIP_ARRAY_BLOCK];
+    const sip_t* dsip = sip_if_distorted(sip);
+    int i;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        pixelxy2xyzarr_array(&(sip->wcstan), dsip, xy + 2*i, n, xyz);
+        xyz2radec_array(xyz, n, radec + 2*i);
+    }
+}
+
+int tan_xyzarr2pixelxy_array(const tan_t* tan, const double* xyz, int N,
+                             double* xy, anbool* ok) {
+    return xyzarr2pixelxy_array(tan, NULL, xyz, N, xy, ok);
+}
+
+int tan_radec2pixelxy_array(const tan_t* tan, const double* radec, int N,
+                            double* xy, anbool* ok) {
+    double xyz[3 * SIP_ARRAY_BLOCK];
+    int i, ngood = 0;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        radec2xyz_array(radec + 2*i, n, xyz);
+        ngood += xyzarr2pixelxy_array(tan, NULL, xyz, n, xy + 2*i,
+                                      ok ? ok + i : NULL);
+    }
+    return ngood;
+}
+
+int sip_xyzarr2pixelxy_array(const sip_t* sip, const double* xyz, int N,
+                             double* xy, anbool* ok) {
+    return xyzarr2pixelxy_array(&(sip->wcstan), sip_if_inverse(sip),
+                                xyz, N, xy, ok);
+}
+
+int sip_radec2pixelxy_array(const sip_t* sip, const double* radec, int N,
+                            double* xy, anbool* ok) {
+    double xyz[3 * SIP_ARRAY_BLOCK];
+    const sip_t* isip = sip_if_inverse(sip);
+    int i, ngood = 0;
+    for (i=0; i<N; i+=SIP_ARRAY_BLOCK) {
+        int n = MIN(SIP_ARRAY_BLOCK, N - i);
+        radec2xyz_array(radec + 2*i, n, xyz);
+        ngood += xyzarr2pixelxy_array(&(sip->wcstan), isip, xyz, n, xy + 2*i,
+                                      ok ? ok + i : NULL);
+    }
+    return ngood;
+}
+
 double tan_det_cd(const tan_t* tan) {
     return (tan->cd[0][0]*tan->cd[1][1] - tan->cd[0][1]*tan->cd[1][0]);
 }
@@ -6,7 +6,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
+#include "os-features.h"
 #include "starkd.h"
 #include "kdtree.h"
 #include "kdtree_fits_io.h"
@@ -18,6 +20,9 @@
 #include "log.h"
 #include "ioutils.h"
 #include "fitsioutils.h"
+#include "shmcache.h"
+
+static int Ndata(const startree_t* s);
 
 static startree_t* startree_alloc() {
     startree_t* s = calloc(1, sizeof(startree_t));
@@ -108,6 +113,16 @@ double* startree_get_data_column_array(startree_t* s, const char* colname, const
     return arr;
 }
 
+fitstable_gather_t* startree_gather_tagalong(startree_t* s, const int* indices,
+                                             int N, int nthreads) {
+    fitstable_t* table = startree_get_tagalong(s);
+    if (!table) {
+        ERROR("No tag-along data found");
+        return NULL;
+    }
+    return fitstable_gather_rows(table, indices, N, nthreads);
+}
+
 void startree_free_data_column(startree_t* s, double* d) {
     free(d);
 }
@@ -130,11 +145,15 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
     double* xyz;
     int i, N;
 
-    opts = KD_OPTIONS_SMALL_RADIUS;
+    opts = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_NO_RESIZE_RESULTS;
     if (xyzresults || radecresults)
         opts |= KD_OPTIONS_RETURN_POINTS;
 
-    res = kdtree_rangesearch_options(s->tree, xyzcenter, radius2, opts);
+    // (verification searches once per candidate: pool the results.)
+    res = kdtree_qres_acquire();
+    if (res)
+        res = kdtree_rangesearch_options_reuse(s->tree, res, xyzcenter,
+                                               radius2, opts);
 	
     if (!res || !res->nres) {
         if (xyzresults)
@@ -144,8 +163,7 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
         if (starinds)
             *starinds = NULL;
         *nresults = 0;
-        if (res)
-            kdtree_free_query(res);
+        kdtree_qres_release(res);
         return;
     }
 
@@ -159,18 +177,89 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
             xyzarr2radecdegarr(xyz + i*3, (*radecresults) + i*2);
     }
     if (xyzresults) {
-        // Steal the results array.
-        *xyzresults = xyz;
-        res->results.d = NULL;
+        *xyzresults = malloc(N * 3 * sizeof(double));
+        memcpy(*xyzresults, xyz, N * 3 * sizeof(double));
     }
     if (starinds) {
         *starinds = malloc(res->nres * sizeof(int));
         for (i=0; i<N; i++)
             (*starinds)[i] = res->inds[i];
     }
-    kdtree_free_query(res);
+    kdtree_qres_release(res);
+}
+
+int startree_results_reserve(startree_results_t* res, int N, anbool radec) {
+    int cap;
+    if (N > res->capacity) {
+        double* xyz;
+        int* inds;
+        cap = MAX(N, 2 * res->capacity);
+        xyz = realloc(res->xyz, (size_t)cap * 3 * sizeof(double));
+        if (xyz)
+            res->xyz = xyz;
+        inds = realloc(res->inds, (size_t)cap * sizeof(int));
+        if (inds)
+            res->inds = inds;
+        if (!xyz || !inds) {
+            SYSERROR("Failed to grow star search results to %i stars", cap);
+            return -1;
+        }
+        res->capacity = cap;
+    }
+    if (radec && N > res->radec_capacity) {
+        double* rd;
+        cap = MAX(N, 2 * res->radec_capacity);
+        rd = realloc(res->radec, (size_t)cap * 2 * sizeof(double));
+        if (!rd) {
+            SYSERROR("Failed to grow star search results to %i stars", cap);
+            return -1;
+        }
+        res->radec = rd;
+        res->radec_capacity = cap;
+    }
+    return 0;
+}
+
+int startree_search_into(const startree_t* s, const double* xyzcenter,
+                         double radius2, anbool radec,
+                         startree_results_t* res) {
+    kdtree_qres_t* qres;
+    int i, N;
+
+    res->N = 0;
+    qres = kdtree_qres_acquire();
+    if (qres)
+        qres = kdtree_rangesearch_options_reuse(s->tree, qres, xyzcenter, radius2,
+                                                KD_OPTIONS_SMALL_RADIUS |
+                                                KD_OPTIONS_NO_RESIZE_RESULTS |
+                                                KD_OPTIONS_RETURN_POINTS);
+    if (!qres)
+        return -1;
+    N = qres->nres;
+    if (startree_results_reserve(res, N, radec)) {
+        kdtree_qres_release(qres);
+        return -1;
+    }
+    if (N)
+        memcpy(res->xyz, qres->results.d, (size_t)N * 3 * sizeof(double));
+    for (i=0; i<N; i++)
+        res->inds[i] = qres->inds[i];
+    if (radec)
+        for (i=0; i<N; i++)
+            xyzarr2radecdegarr(res->xyz + i*3, res->radec + i*2);
+    res->N = N;
+    kdtree_qres_release(qres);
+    return N;
 }
 
+void startree_results_free_data(startree_results_t* res) {
+    if (!res)
+        return;
+    free(res->xyz);
+    free(res->radec);
+    free(res->inds);
+    memset(res, 0, sizeof(startree_results_t));
+}
 
 void startree_search(const startree_t* s, const double* xyzcenter, double radius2,
                      double** xyzresults, double** radecresults, int* nresults) {
@@ -210,6 +299,21 @@ static bl* get_chunks(startree_t* s, il* wordsizes) {
     if (wordsizes)
         il_append(wordsizes, sizeof(uint8_t));
 
+    // (only trees with a permutation have an inverse.)
+    if (kd->perm) {
+        fitsbin_chunk_init(&chunk);
+        // (as the tree's permutation: fitsbin's forced_type is for bytes.)
+        chunk.tablename = "invperm";
+        chunk.itemsize = sizeof(int32_t);
+        chunk.nrows = kd->ndata;
+        chunk.data = s->inverse_perm;
+        chunk.userdata = &(s->inverse_perm);
+        chunk.required = FALSE;
+        bl_append(chunks, &chunk);
+        if (wordsizes)
+            il_append(wordsizes, sizeof(int32_t));
+    }
+
     fitsbin_chunk_clean(&chunk);
     return chunks;
 }
@@ -278,6 +382,7 @@ static startree_t* my_open(const char* fn, anqfits_t* fits) {
         *dest = chunk->data;
     }
     bl_free(chunks);
+    s->inverse_perm_in_file = (s->inverse_perm != NULL);
     gettimeofday(&tv2, NULL);
     debug("reading chunks took %g ms\n", millis_between(&tv1, &tv2));
 
@@ -309,14 +414,19 @@ startree_t* startree_open(const char* fn) {
  */
 int startree_close(startree_t* s) {
     if (!s) return 0;
-    if (s->inverse_perm)
+    if (s->inverse_perm_shared)
+        shmcache_detach(s->inverse_perm, Ndata(s) * sizeof(int));
+    else if (s->inverse_perm && !s->inverse_perm_in_file)
         free(s->inverse_perm);
     if (s->header)
         qfits_header_destroy(s->header);
     if (s->tree) {
         if (s->writing) {
-            free(s->tree->data.any);
-            s->tree->data.any = NULL;
+            // (converted data belongs to the tree; kdtree_free() frees it.)
+            if (!s->tree->free_data) {
+                free(s->tree->data.any);
+                s->tree->data.any = NULL;
+            }
             kdtree_free(s->tree);
             free(s->sweep);
         }
@@ -410,9 +520,31 @@ int startree_check_inverse_perm(startree_t* s) {
     return 0;
 }
 
+static int fill_inverse_perm(void* data, size_t size, void* token) {
+    kdtree_inverse_permutation((kdtree_t*)token, data);
+    return 0;
+}
+
+// Attaches to (or creates) the shared inverse permutation, if enabled.
+static anbool get_shared_inverse_perm(startree_t* s) {
+    fitsbin_t* fb;
+    char* key;
+    if (!shmcache_enabled() || !s->tree->io)
+        return FALSE;
+    fb = kdtree_fits_get_fitsbin(s->tree->io);
+    key = shmcache_key(fitsbin_get_filename(fb), "stars-invperm");
+    s->inverse_perm = (int*)shmcache_attach(key, Ndata(s) * sizeof(int),
+                                            fill_inverse_perm, s->tree);
+    free(key);
+    s->inverse_perm_shared = (s->inverse_perm != NULL);
+    return s->inverse_perm_shared;
+}
+
 void startree_compute_inverse_perm(startree_t* s) {
     if (s->inverse_perm)
         return;
+    if (get_shared_inverse_perm(s))
+        return;
     // compute inverse permutation vector.
     s->inverse_perm = malloc(Ndata(s) * sizeof(int));
     if (!s->inverse_perm) {
@@ -484,6 +616,8 @@ int startree_get_sweep(const startree_t* s, int ind) {
 }
 
 int startree_get(startree_t* s, int starid, double* posn) {
+    if (kdtree_load(s->tree))
+        return -1;
     if (s->tree->perm && !s->inverse_perm) {
         startree_compute_inverse_perm(s);
         if (!s->inverse_perm)
@@ -502,6 +636,28 @@ int startree_get(startree_t* s, int starid, double* posn) {
     return 0;
 }
 
+void startree_prefetch(const startree_t* s, int starid) {
+    const kdtree_t* kd = s->tree;
+    size_t sz;
+    if (!kd->data.any || starid < 0 || starid >= Ndata(s))
+        return;
+    if (kd->perm) {
+        if (!s->inverse_perm)
+            return;
+        starid = s->inverse_perm[starid];
+    }
+    switch (kdtree_datatype(kd)) {
+    case KDT_DATA_DOUBLE: sz = sizeof(double);   break;
+    case KDT_DATA_FLOAT:  sz = sizeof(float);    break;
+    case KDT_DATA_U64:    sz = sizeof(uint64_t); break;
+    case KDT_DATA_U32:    sz = sizeof(uint32_t); break;
+    case KDT_DATA_U16:    sz = sizeof(uint16_t); break;
+    default:
+        return;
+    }
+    prefetch_read((const char*)kd->data.any + (size_t)starid * kd->ndim * sz);
+}
+
 int startree_get_radec(startree_t* s, int starid, double* ra, double* dec) {
     double xyz[3];
     int rtn;
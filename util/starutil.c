@@ -15,6 +15,7 @@
 #include "mathutil.h"
 #include "starutil.h"
 #include "errors.h"
+#include "cpu-features.h"
 
 #define POGSON 2.51188643150958
 #define LOGP   0.92103403719762
@@ -204,6 +205,277 @@ double deg_between_radecdeg(double ra1, double dec1, double ra2, double dec2) {
     return arcsec2deg(arcsec_between_radecdeg(ra1, dec1, ra2, dec2));
 }
 
+/*
+ The kernels of the _batch_approx conversions: sin and cos, and atan2, as
+ polynomials (the coefficients of fdlibm's __kernel_sin, __kernel_cos
+ and atan) with branch-free argument reduction, so that the loops over
+ them vectorize.  Angles in degrees are reduced to [-45, 45] degrees
+ exactly before converting to radians, so sin and cos are within about
+ one unit in the last place; atan2 is within about two.
+ */
+// adding and subtracting this rounds a double (|x| < 2^51) to an integer.
+#define ROUND_MAGIC 6755399441055744.0
+
+#define PI_4_HI 7.85398163397448278999e-01
+#define PI_4_LO 3.06161699786838301793e-17
+#define PI_2_HI 1.57079632679489655800e+00
+#define PI_2_LO 6.12323399573676603587e-17
+#define PI_HI   3.14159265358979311600e+00
+#define PI_LO   1.22464679914735317723e-16
+#define TAN_PI_8 0.41421356237309503
+
+static inline __attribute__ ((always_inline))
+void sincosdeg_poly(double deg, double* s, double* c) {
+    double q = (deg * (1.0 / 90.0) + ROUND_MAGIC) - ROUND_MAGIC;
+    int iq = (int)q;
+    double r = (deg - q * 90.0) * RAD_PER_DEG;
+    double z = r * r;
+    double sr, cr, sv, cv;
+    sr = r + r * z * (-1.66666666666666324348e-01 +
+                      z * (8.33333333332248946124e-03 +
+                           z * (-1.98412698298579493134e-04 +
+                                z * (2.75573137070700676789e-06 +
+                                     z * (-2.50507602534068634195e-08 +
+                                          z * 1.58969099521155010221e-10)))));
+    cr = 1.0 - 0.5 * z +
+        z * z * (4.16666666666666019037e-02 +
+                 z * (-1.38888888888741095749e-03 +
+                      z * (2.48015872894767294178e-05 +
+                           z * (-2.75573143513906633035e-07 +
+                                z * (2.08757232129817482790e-09 +
+                                     z * -1.13596475577881948265e-11)))));
+    // quadrant iq: sin(iq * 90 + r), cos(iq * 90 + r)
+    sv = (iq & 1) ? cr : sr;
+    cv = (iq & 1) ? sr : cr;
+    *s = (iq & 2) ? -sv : sv;
+    *c = ((iq + 1) & 2) ? -cv : cv;
+}
+
+// atan2(y, x), in (-pi, pi].
+static inline __attribute__ ((always_inline))
+double atan2_poly(double y, double x) {
+    double ax = fabs(x), ay = fabs(y);
+    double mx = MAX(ax, ay), mn = MIN(ax, ay);
+    // atan(mn/mx), reducing mn/mx above tan(pi/8) by pi/4.
+    int big = (mn > TAN_PI_8 * mx);
+    double num = big ? mn - mx : mn;
+    double den = big ? mn + mx : mx;
+    double t, z, w, s1, s2, p, a;
+    den = (den == 0.0) ? 1.0 : den;
+    t = num / den;
+    z = t * t;
+    w = z * z;
+    s1 = z * (3.33333333333329318027e-01 +
+              w * (1.42857142725034663711e-01 +
+                   w * (9.09088713343650656196e-02 +
+                        w * (6.66107313738753120669e-02 +
+                             w * (4.97687799461593236017e-02 +
+                                  w * 1.62858201153657823623e-02)))));
+    s2 = w * (-1.99999999998764832476e-01 +
+              w * (-1.11111104054623557880e-01 +
+                   w * (-7.69187620504482999495e-02 +
+                        w * (-5.83357013379057348645e-02 +
+                             w * -3.65315727442169155270e-02))));
+    p = t * (s1 + s2);
+    a = big ? PI_4_HI - ((p - PI_4_LO) - t) : t - p;
+    a = (ay > ax) ? (PI_2_HI - a) + PI_2_LO : a;
+    a = (x < 0) ? (PI_HI - a) + PI_LO : a;
+    return (y < 0) ? -a : a;
+}
+
+static inline __attribute__ ((always_inline))
+void radecdeg2xyz_poly(double ra, double dec, double* xyz) {
+    double sr, cr, sd, cd;
+    sincosdeg_poly(ra, &sr, &cr);
+    sincosdeg_poly(dec, &sd, &cd);
+    xyz[0] = cd * cr;
+    xyz[1] = cd * sr;
+    xyz[2] = sd;
+}
+
+static inline __attribute__ ((always_inline))
+void xyz2radecdeg_poly(const double* xyz, double* ra, double* dec) {
+    double x = xyz[0], y = xyz[1], z = xyz[2];
+    // (the constants, not rad2deg(): that can't be inlined under -fPIC.)
+    double r = atan2_poly(y, x) * DEG_PER_RAD;
+    *ra = (r < 0) ? r + 360.0 : r;
+    // (rather than asin(z), which is ill-conditioned at the poles)
+    *dec = atan2_poly(z, sqrt(x * x + y * y)) * DEG_PER_RAD;
+}
+
+// The angle (radians) between unit vectors "dist2" apart (squared).
+static inline __attribute__ ((always_inline))
+double distsq2rad_poly(double dist2) {
+    // half the chord, and cos of half the angle (4 - d2 is exact near 4).
+    // (fmin() and the fabs()es, of things >= 0, keep the loops
+    // vectorizable: sqrt() goes without its errno check.)
+    double d2 = fmin(dist2, 4.0);
+    return 2.0 * atan2_poly(sqrt(fabs(d2)), sqrt(fabs(4.0 - d2)));
+}
+
+/*
+ Each loop name##_body() is compiled for the baseline and, on x86, for
+ AVX2 (picked at run time) as name##_simd().
+ */
+#define BATCH_LOOPS(name, params, args)                                 \
+    static void name##_default params { name##_body args; }             \
+    BATCH_AVX2(name, params, args)                                      \
+    static void name##_simd params {                                    \
+        BATCH_DISPATCH(name, args);                                     \
+        name##_default args;                                            \
+    }
+
+#if defined(CPU_DISPATCH_X86)
+#define BATCH_AVX2(name, params, args)                                  \
+    static CPU_TARGET("avx2,fma") void name##_avx2 params { name##_body args; }
+#define BATCH_DISPATCH(name, args)                                      \
+    if (cpu_has(CPU_AVX2)) {                                            \
+        name##_avx2 args;                                               \
+        return;                                                         \
+    }
+#else
+#define BATCH_AVX2(name, params, args)
+#define BATCH_DISPATCH(name, args)
+#endif
+
+static inline __attribute__ ((always_inline))
+void radecdeg2xyz_body(const double* restrict ra, const double* restrict dec,
+                       int rstride, double* restrict xyz, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        radecdeg2xyz_poly(ra[(size_t)i * rstride], dec[(size_t)i * rstride],
+                          xyz + (size_t)i * 3);
+}
+// (radec interleaved has "rstride" 2.)
+BATCH_LOOPS(radecdeg2xyz,
+            (const double* restrict ra, const double* restrict dec,
+             int rstride, double* restrict xyz, int n),
+            (ra, dec, rstride, xyz, n))
+
+static inline __attribute__ ((always_inline))
+void xyz2radecdeg_body(const double* restrict xyz, double* restrict ra,
+                       double* restrict dec, int rstride, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        xyz2radecdeg_poly(xyz + (size_t)i * 3, ra + (size_t)i * rstride,
+                          dec + (size_t)i * rstride);
+}
+BATCH_LOOPS(xyz2radecdeg,
+            (const double* restrict xyz, double* restrict ra,
+             double* restrict dec, int rstride, int n),
+            (xyz, ra, dec, rstride, n))
+
+static inline __attribute__ ((always_inline))
+void distsq2deg_body(const double* restrict dist2, double* restrict out,
+                     double scale, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        out[i] = distsq2rad_poly(dist2[i]) * scale;
+}
+BATCH_LOOPS(distsq2deg,
+            (const double* restrict dist2, double* restrict out,
+             double scale, int n),
+            (dist2, out, scale, n))
+
+static inline __attribute__ ((always_inline))
+void arcsec_between_body(const double* restrict ra1, const double* restrict dec1,
+                         const double* restrict ra2, const double* restrict dec2,
+                         double* restrict arcsec, int n) {
+    int i;
+    for (i=0; i<n; i++) {
+        double a[3], b[3], d2;
+        radecdeg2xyz_poly(ra1[i], dec1[i], a);
+        radecdeg2xyz_poly(ra2[i], dec2[i], b);
+        d2 = (a[0] - b[0]) * (a[0] - b[0]) +
+            (a[1] - b[1]) * (a[1] - b[1]) +
+            (a[2] - b[2]) * (a[2] - b[2]);
+        arcsec[i] = distsq2rad_poly(d2) * ARCSEC_PER_RAD;
+    }
+}
+BATCH_LOOPS(arcsec_between,
+            (const double* restrict ra1, const double* restrict dec1,
+             const double* restrict ra2, const double* restrict dec2,
+             double* restrict arcsec, int n),
+            (ra1, dec1, ra2, dec2, arcsec, n))
+
+void radecdeg2xyz_batch(const double* ra, const double* dec, double* xyz, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        radecdeg2xyzarr(ra[i], dec[i], xyz + (size_t)i * 3);
+}
+
+void radecdegarr2xyzarr_batch(const double* radec, double* xyz, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        radecdeg2xyzarr(radec[2*(size_t)i], radec[2*(size_t)i + 1],
+                        xyz + (size_t)i * 3);
+}
+
+void xyzarr2radecdeg_batch(const double* xyz, double* ra, double* dec, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        xyzarr2radecdeg(xyz + (size_t)i * 3, ra + i, dec + i);
+}
+
+void xyzarr2radecdegarr_batch(const double* xyz, double* radec, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        xyzarr2radecdeg(xyz + (size_t)i * 3, radec + 2*(size_t)i,
+                        radec + 2*(size_t)i + 1);
+}
+
+void distsq2deg_batch(const double* dist2, double* deg, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        deg[i] = distsq2deg(dist2[i]);
+}
+
+void distsq2arcsec_batch(const double* dist2, double* arcsec, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        arcsec[i] = distsq2arcsec(dist2[i]);
+}
+
+void arcsec_between_radecdeg_batch(const double* ra1, const double* dec1,
+                                   const double* ra2, const double* dec2,
+                                   double* arcsec, int n) {
+    int i;
+    for (i=0; i<n; i++)
+        arcsec[i] = arcsec_between_radecdeg(ra1[i], dec1[i], ra2[i], dec2[i]);
+}
+
+void radecdeg2xyz_batch_approx(const double* ra, const double* dec,
+                               double* xyz, int n) {
+    radecdeg2xyz_simd(ra, dec, 1, xyz, n);
+}
+
+void radecdegarr2xyzarr_batch_approx(const double* radec, double* xyz, int n) {
+    radecdeg2xyz_simd(radec, radec + 1, 2, xyz, n);
+}
+
+void xyzarr2radecdeg_batch_approx(const double* xyz, double* ra, double* dec,
+                                  int n) {
+    xyz2radecdeg_simd(xyz, ra, dec, 1, n);
+}
+
+void xyzarr2radecdegarr_batch_approx(const double* xyz, double* radec, int n) {
+    xyz2radecdeg_simd(xyz, radec, radec + 1, 2, n);
+}
+
+void distsq2deg_batch_approx(const double* dist2, double* deg, int n) {
+    distsq2deg_simd(dist2, deg, DEG_PER_RAD, n);
+}
+
+void distsq2arcsec_batch_approx(const double* dist2, double* arcsec, int n) {
+    distsq2deg_simd(dist2, arcsec, ARCSEC_PER_RAD, n);
+}
+
+void arcsec_between_radecdeg_batch_approx(const double* ra1, const double* dec1,
+                                          const double* ra2, const double* dec2,
+                                          double* arcsec, int n) {
+    arcsec_between_simd(ra1, dec1, ra2, dec2, arcsec, n);
+}
+
 void project_equal_area(double x, double y, double z, double* projx, double* projy) {
     double Xp = x*sqrt(1./(1. + z));
     double Yp = y*sqrt(1./(1. + z));
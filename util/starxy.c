@@ -169,12 +169,11 @@ void starxy_sort_by_flux(starxy_t* s) {
     int* perm;
     perm = permuted_sort(s->flux, sizeof(double), compare_doubles_desc,
                          NULL, s->N);
-    permutation_apply(perm, s->N, s->x, s->x, sizeof(double));
-    permutation_apply(perm, s->N, s->y, s->y, sizeof(double));
-    if (s->flux)
-        permutation_apply(perm, s->N, s->flux, s->flux, sizeof(double));
-    if (s->background)
-        permutation_apply(perm, s->N, s->background, s->background, sizeof(double));
+    {
+        void* arrays[] = { s->x, s->y, s->flux, s->background };
+        int sizes[] = { sizeof(double), sizeof(double), sizeof(double), sizeof(double) };
+        permutation_apply_multi(perm, s->N, arrays, sizes, 4);
+    }
     free(perm);
 }
 
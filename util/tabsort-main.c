@@ -10,12 +10,16 @@
 #include "tabsort.h"
 #include "fitsioutils.h"
 
-static const char* OPTIONS = "hd";
+static const char* OPTIONS = "hdr:w:t:";
 
 static void printHelp(char* progname) {
     printf("%s  [options]  <column-name> <input-file> <output-file>\n"
            "  options include:\n"
-           "      [-d]: sort in descending order (default, ascending)\n",
+           "      [-d]: sort in descending order (default, ascending)\n"
+           "      [-r <rows>]: for tables too big to sort in memory: sort runs of\n"
+           "                   this many rows, spill them to temp files, and merge\n"
+           "      [-w <threads>]: with -r, sort this many runs at once (default 1)\n"
+           "      [-t <temp-dir>]: with -r, temp directory (default /tmp)\n",
            progname);
 }
 
@@ -27,12 +31,24 @@ int main(int argc, char *argv[]) {
     char* colname = NULL;
     char* progname = argv[0];
     anbool descending = FALSE;
+    long long runrows = 0;
+    int nthreads = 1;
+    char* tempdir = NULL;
 
     while ((argchar = getopt(argc, argv, OPTIONS)) != -1)
         switch (argchar) {
         case 'd':
             descending = TRUE;
             break;
+        case 'r':
+            runrows = atoll(optarg);
+            break;
+        case 'w':
+            nthreads = atoi(optarg);
+            break;
+        case 't':
+            tempdir = optarg;
+            break;
         case '?':
         case 'h':
             printHelp(progname);
@@ -52,6 +68,9 @@ int main(int argc, char *argv[]) {
 
     fits_use_error_system();
 
+    if (runrows)
+        return tabsort_external(infn, outfn, colname, descending, runrows,
+                                nthreads, tempdir);
     return tabsort(infn, outfn, colname, descending);
 }
 
@@ -7,17 +7,263 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 
+#include "tabsort.h"
 #include "anqfits.h"
 #include "ioutils.h"
 #include "fitsioutils.h"
 #include "permutedsort.h"
+#include "an-endian.h"
+#include "os-features.h"
 #include "errors.h"
 
-int tabsort(const char* infn, const char* outfn, const char* colname,
-            int descending) {
+// One sorted run of rows, spilled to a temp file.
+typedef struct {
+    char* fn;
+    int64_t start;
+    int64_t N;
+    // for merging:
+    FILE* f;
+    unsigned char* row;
+    uint64_t key;
+} run_t;
+
+typedef struct {
+    const unsigned char* tabledata;
+    int tab_w;
+    int off;
+    int atomsize;
+    int (*sort_func)(const void*, const void*);
+    run_t* runs;
+    int nruns;
+    int next;
+    int failed;
+} runsort_t;
+
+// Reads the (big-endian) sort-column value from "row" into "val".
+static void get_value(const unsigned char* row, int off, int atomsize,
+                      void* val) {
+    memcpy(val, row + off, atomsize);
+    if (atomsize == 8)
+        v64_ntoh(val);
+    else
+        v32_ntoh(val);
+}
+
+static int write_run(runsort_t* rs, run_t* run) {
+    char* vals;
+    int* perm;
+    FILE* f;
+    int64_t i;
+    int rtn = -1;
+
+    vals = malloc(run->N * rs->atomsize);
+    if (!vals) {
+        ERROR("Failed to allocate sort column for %lli rows", (long long)run->N);
+        return -1;
+    }
+    for (i=0; i<run->N; i++)
+        get_value(rs->tabledata + (size_t)(run->start + i) * rs->tab_w,
+                  rs->off, rs->atomsize, vals + i * rs->atomsize);
+    perm = permuted_sort(vals, rs->atomsize, rs->sort_func, NULL, run->N);
+    free(vals);
+
+    f = fopen(run->fn, "wb");
+    if (!f) {
+        SYSERROR("Failed to open temp file %s", run->fn);
+        free(perm);
+        return -1;
+    }
+    for (i=0; i<run->N; i++) {
+        const unsigned char* rowptr = rs->tabledata +
+            (size_t)(run->start + perm[i]) * rs->tab_w;
+        if (fwrite(rowptr, 1, rs->tab_w, f) != rs->tab_w) {
+            SYSERROR("Failed to write temp file %s", run->fn);
+            goto bailout;
+        }
+    }
+    rtn = 0;
+ bailout:
+    if (fclose(f)) {
+        SYSERROR("Failed to close temp file %s", run->fn);
+        rtn = -1;
+    }
+    free(perm);
+    return rtn;
+}
+
+static void* runsort_worker(void* arg) {
+    runsort_t* rs = arg;
+    int r;
+    while ((r = __atomic_fetch_add(&rs->next, 1, __ATOMIC_RELAXED)) < rs->nruns) {
+        if (__atomic_load_n(&rs->failed, __ATOMIC_RELAXED))
+            break;
+        if (write_run(rs, rs->runs + r))
+            __atomic_store_n(&rs->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Reads the next row of "run" and computes its key; returns 1 at the end.
+static int next_row(runsort_t* rs, run_t* run) {
+    char val[8];
+    if (fread(run->row, 1, rs->tab_w, run->f) != rs->tab_w) {
+        if (ferror(run->f)) {
+            SYSERROR("Failed to read temp file %s", run->fn);
+            return -1;
+        }
+        return 1;
+    }
+    get_value(run->row, rs->off, rs->atomsize, val);
+    permuted_sort_key(val, rs->sort_func, &run->key);
+    return 0;
+}
+
+// Heap order: by key, then by run, so that ties keep their input order.
+static int run_less(const run_t* runs, int a, int b) {
+    if (runs[a].key != runs[b].key)
+        return runs[a].key < runs[b].key;
+    return a < b;
+}
+
+static void sift_down(const run_t* runs, int* heap, int N, int i) {
+    for (;;) {
+        int c = 2*i + 1;
+        int tmp;
+        if (c >= N)
+            break;
+        if (c+1 < N && run_less(runs, heap[c+1], heap[c]))
+            c++;
+        if (!run_less(runs, heap[c], heap[i]))
+            break;
+        tmp = heap[c];
+        heap[c] = heap[i];
+        heap[i] = tmp;
+        i = c;
+    }
+}
+
+static int merge_runs(runsort_t* rs, FILE* fout) {
+    int* heap;
+    int N = 0;
+    int i;
+    int rtn = -1;
+    int64_t nout = 0;
+
+    heap = malloc(rs->nruns * sizeof(int));
+    for (i=0; i<rs->nruns; i++) {
+        run_t* run = rs->runs + i;
+        int r;
+        run->f = fopen(run->fn, "rb");
+        if (!run->f) {
+            SYSERROR("Failed to open temp file %s", run->fn);
+            goto bailout;
+        }
+        run->row = malloc(rs->tab_w);
+        r = next_row(rs, run);
+        if (r == -1)
+            goto bailout;
+        if (r == 0)
+            heap[N++] = i;
+    }
+    for (i=N/2-1; i>=0; i--)
+        sift_down(rs->runs, heap, N, i);
+
+    while (N) {
+        run_t* run = rs->runs + heap[0];
+        int r;
+        if (nout % 1000000 == 0)
+            printf("Writing row %lli\n", (long long)nout);
+        if (fwrite(run->row, 1, rs->tab_w, fout) != rs->tab_w) {
+            SYSERROR("Failed to write FITS table row");
+            goto bailout;
+        }
+        nout++;
+        r = next_row(rs, run);
+        if (r == -1)
+            goto bailout;
+        if (r == 1)
+            heap[0] = heap[--N];
+        sift_down(rs->runs, heap, N, 0);
+    }
+    rtn = 0;
+ bailout:
+    for (i=0; i<rs->nruns; i++) {
+        if (rs->runs[i].f)
+            fclose(rs->runs[i].f);
+        rs->runs[i].f = NULL;
+        free(rs->runs[i].row);
+        rs->runs[i].row = NULL;
+    }
+    free(heap);
+    return rtn;
+}
+
+// Sorts the rows of the table in runs of "runrows" on "nthreads" threads,
+// spilling each run to a temp file, then merges the runs into "fout".
+static int sort_rows_external(const unsigned char* tabledata,
+                              qfits_table* table, int c,
+                              int (*sort_func)(const void*, const void*),
+                              int64_t runrows, int nthreads,
+                              const char* tempdir, FILE* fout) {
+    runsort_t rs;
+    pthread_t* threads;
+    int nstarted;
+    int i;
+    int rtn = -1;
+
+    memset(&rs, 0, sizeof(runsort_t));
+    rs.tabledata = tabledata;
+    rs.tab_w = table->tab_w;
+    // (not col->off_beg: that's from the start of the file)
+    rs.off = fits_offset_of_column(table, c);
+    rs.atomsize = fits_get_atom_size(table->col[c].atom_type);
+    rs.sort_func = sort_func;
+    rs.nruns = (int)((table->nr + runrows - 1) / runrows);
+    rs.runs = calloc(rs.nruns, sizeof(run_t));
+    for (i=0; i<rs.nruns; i++) {
+        rs.runs[i].fn = create_temp_file("tabsort", tempdir);
+        rs.runs[i].start = (int64_t)i * runrows;
+        rs.runs[i].N = MIN(runrows, table->nr - rs.runs[i].start);
+    }
+    printf("Sorting %i runs of up to %lli rows\n", rs.nruns, (long long)runrows);
+
+    if (nthreads < 1)
+        nthreads = 1;
+    nthreads = MIN(nthreads, rs.nruns);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    nstarted = 0;
+    for (i=1; i<nthreads; i++) {
+        if (pthread_create(threads + nstarted, NULL, runsort_worker, &rs))
+            break;
+        nstarted++;
+    }
+    runsort_worker(&rs);
+    for (i=0; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    if (rs.failed)
+        goto bailout;
+
+    printf("Merging %i runs\n", rs.nruns);
+    if (merge_runs(&rs, fout))
+        goto bailout;
+    rtn = 0;
+ bailout:
+    for (i=0; i<rs.nruns; i++) {
+        unlink(rs.runs[i].fn);
+        free(rs.runs[i].fn);
+    }
+    free(rs.runs);
+    return rtn;
+}
+
+static int sort_file(const char* infn, const char* outfn, const char* colname,
+                     int descending, int64_t runrows, int nthreads,
+                     const char* tempdir) {
     FILE* fin;
     FILE* fout;
     int ext, nextens;
@@ -67,6 +313,7 @@ int tabsort(const char* infn, const char* outfn, const char* colname,
         unsigned char* tabledata;
         unsigned char* tablehdr;
         off_t hdrstart, hdrsize, datsize, datstart;
+        anbool external;
         int i;
 
         hdrstart = anqfits_header_start(anq, ext);
@@ -90,21 +337,18 @@ int tabsort(const char* infn, const char* outfn, const char* colname,
         col = table->col + c;
         switch (col->atom_type) {
         case TFITS_BIN_TYPE_D:
-            data = realloc(data, table->nr * sizeof(double));
             if (descending)
                 sort_func = compare_doubles_desc;
             else
                 sort_func = compare_doubles_asc;
             break;
         case TFITS_BIN_TYPE_E:
-            data = realloc(data, table->nr * sizeof(float));
             if (descending)
                 sort_func = compare_floats_desc;
             else
                 sort_func = compare_floats_asc;
             break;
         case TFITS_BIN_TYPE_K:
-            data = realloc(data, table->nr * sizeof(int64_t));
             if (descending)
                 sort_func = compare_int64_desc;
             else
@@ -115,14 +359,18 @@ int tabsort(const char* infn, const char* outfn, const char* colname,
             ERROR("Column %s is neither FITS type D, E, nor K.  Skipping.", colname);
             continue;
         }
-
-        // Grab the sort column.
         atomsize = fits_get_atom_size(col->atom_type);
-        printf("Reading sort column \"%s\"\n", colname);
-        qfits_query_column_seq_to_array(table, c, 0, table->nr, data, atomsize);
-        // Sort it.
-        printf("Sorting sort column\n");
-        perm = permuted_sort(data, atomsize, sort_func, NULL, table->nr);
+        external = (runrows > 0 && table->nr > runrows);
+
+        if (!external) {
+            // Grab the sort column.
+            data = realloc(data, (size_t)table->nr * atomsize);
+            printf("Reading sort column \"%s\"\n", colname);
+            qfits_query_column_seq_to_array(table, c, 0, table->nr, data, atomsize);
+            // Sort it.
+            printf("Sorting sort column\n");
+            perm = permuted_sort(data, atomsize, sort_func, NULL, table->nr);
+        }
 
         // mmap the input file.
         printf("mmapping input file\n");
@@ -146,15 +394,23 @@ int tabsort(const char* infn, const char* outfn, const char* colname,
             goto bailout;
         }
 
-        for (i=0; i<table->nr; i++) {
-            unsigned char* rowptr;
-            if (i % 100000 == 0)
-                printf("Writing row %i\n", i);
-            rowptr = tabledata + (off_t)(perm[i]) * (off_t)table->tab_w;
-            if (fwrite(rowptr, 1, table->tab_w, fout) != table->tab_w) {
-                SYSERROR("Failed to write FITS table row");
+        if (external) {
+            if (sort_rows_external(tabledata, table, c, sort_func, runrows,
+                                   nthreads, tempdir, fout)) {
+                ERROR("Failed to sort extension %i", ext);
                 goto bailout;
             }
+        } else {
+            for (i=0; i<table->nr; i++) {
+                unsigned char* rowptr;
+                if (i % 100000 == 0)
+                    printf("Writing row %i\n", i);
+                rowptr = tabledata + (off_t)(perm[i]) * (off_t)table->tab_w;
+                if (fwrite(rowptr, 1, table->tab_w, fout) != table->tab_w) {
+                    SYSERROR("Failed to write FITS table row");
+                    goto bailout;
+                }
+            }
         }
 
         munmap(map, mapsize);
@@ -192,3 +448,18 @@ int tabsort(const char* infn, const char* outfn, const char* colname,
     return -1;
 }
 
+int tabsort(const char* infn, const char* outfn, const char* colname,
+            int descending) {
+    return sort_file(infn, outfn, colname, descending, 0, 1, NULL);
+}
+
+int tabsort_external(const char* infn, const char* outfn, const char* colname,
+                     int descending, int64_t runrows, int nthreads,
+                     const char* tempdir) {
+    if (runrows < 1) {
+        ERROR("Run size must be positive, not %lli", (long long)runrows);
+        return -1;
+    }
+    return sort_file(infn, outfn, colname, descending, runrows, nthreads,
+                     tempdir);
+}
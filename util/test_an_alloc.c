@@ -0,0 +1,128 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "an-alloc.h"
+#include "kdtree.h"
+#include "kdtree_fits_io.h"
+#include "ioutils.h"
+
+static int nmallocs = 0;
+
+static void* counting_malloc(size_t sz) {
+    nmallocs++;
+    return malloc(sz);
+}
+
+void test_an_alloc_counts(CuTest* tc) {
+    int64_t kd0, tot0;
+    char* p;
+    char* s;
+
+    kd0 = an_alloc_current(AN_ALLOC_LIBKD);
+    tot0 = an_alloc_current(AN_ALLOC_NSUBSYSTEMS);
+    p = an_alloc_malloc(AN_ALLOC_LIBKD, 100000);
+    CuAssertPtrNotNull(tc, p);
+    if (!an_alloc_current(AN_ALLOC_NSUBSYSTEMS) && !tot0) {
+        // no malloc_usable_size() on this platform.
+        an_alloc_free(AN_ALLOC_LIBKD, p);
+        return;
+    }
+    CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) >= kd0 + 100000);
+    CuAssertTrue(tc, an_alloc_peak(AN_ALLOC_LIBKD) >= kd0 + 100000);
+    CuAssertTrue(tc, an_alloc_current(AN_ALLOC_NSUBSYSTEMS) >= tot0 + 100000);
+
+    p = an_alloc_realloc(AN_ALLOC_LIBKD, p, 200000);
+    CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) >= kd0 + 200000);
+    s = an_alloc_strdup(AN_ALLOC_QFITS, "hello");
+    CuAssertStrEquals(tc, "hello", s);
+
+    an_alloc_set_limit(tot0 + 150000);
+    CuAssertTrue(tc, an_alloc_over_limit());
+    an_alloc_free(AN_ALLOC_LIBKD, p);
+    CuAssertTrue(tc, !an_alloc_over_limit());
+    an_alloc_set_limit(0);
+    an_alloc_free(AN_ALLOC_QFITS, s);
+
+    CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) == kd0);
+    // the peak stays until it's reset.
+    CuAssertTrue(tc, an_alloc_peak(AN_ALLOC_LIBKD) >= kd0 + 200000);
+    an_alloc_reset_peaks();
+    CuAssertTrue(tc, an_alloc_peak(AN_ALLOC_LIBKD) == kd0);
+    CuAssertStrEquals(tc, "libkd", an_alloc_subsystem_name(AN_ALLOC_LIBKD));
+    CuAssertStrEquals(tc, "total", an_alloc_subsystem_name(AN_ALLOC_NSUBSYSTEMS));
+}
+
+void test_an_alloc_backend(CuTest* tc) {
+    an_allocator_t b = { counting_malloc, calloc, realloc, free, NULL };
+    void* p;
+    nmallocs = 0;
+    an_alloc_set_backend(&b);
+    p = an_alloc_malloc(AN_ALLOC_SOLVER, 10);
+    CuAssertIntEquals(tc, 1, nmallocs);
+    an_alloc_free(AN_ALLOC_SOLVER, p);
+    an_alloc_set_backend(NULL);
+    p = an_alloc_malloc(AN_ALLOC_SOLVER, 10);
+    CuAssertIntEquals(tc, 1, nmallocs);
+    an_alloc_free(AN_ALLOC_SOLVER, p);
+}
+
+// Everything libkd allocates for a tree is released by kdtree_free() (or
+// kdtree_fits_close()), so its count returns to where it started.
+void test_an_alloc_libkd_tree(CuTest* tc) {
+    int N = 1000, D = 3;
+    double lo[3] = { 0, 0, 0 };
+    double hi[3] = { 1, 1, 1 };
+    int treetypes[] = { KDTT_DOUBLE, KDTT_DDU, KDTT_DUU, KDTT_DSS };
+    double* data;
+    kdtree_t* kd;
+    int64_t kd0;
+    char* fn;
+    int i;
+
+    data = malloc(N * D * sizeof(double));
+    srand(42);
+    for (i=0; i<N*D; i++)
+        data[i] = rand() / (double)RAND_MAX;
+    kd0 = an_alloc_current(AN_ALLOC_LIBKD);
+
+    for (i=0; i<sizeof(treetypes)/sizeof(int); i++) {
+        // without and with preset limits.
+        kd = kdtree_build(NULL, data, N, D, 10, treetypes[i], KD_BUILD_SPLIT);
+        CuAssertPtrNotNull(tc, kd);
+        kdtree_set_name(kd, "first");
+        kdtree_set_name(kd, "second");
+        kdtree_free(kd);
+        CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) == kd0);
+
+        kd = kdtree_new(N, D, 10);
+        kdtree_set_limits(kd, lo, hi);
+        kd = kdtree_build(kd, data, N, D, 10, treetypes[i], KD_BUILD_BBOX);
+        CuAssertPtrNotNull(tc, kd);
+        kdtree_free(kd);
+        CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) == kd0);
+    }
+
+    // the name read from a file.
+    fn = create_temp_file("test_an_alloc", NULL);
+    kd = kdtree_build(NULL, data, N, D, 10, KDTT_DUU, KD_BUILD_SPLIT);
+    kdtree_set_name(kd, "fromfile");
+    CuAssertIntEquals(tc, 0, kdtree_fits_write(kd, fn, NULL));
+    kdtree_free(kd);
+    kd = kdtree_fits_read(fn, "fromfile", NULL);
+    CuAssertPtrNotNull(tc, kd);
+    CuAssertStrEquals(tc, "fromfile", kd->name);
+    kdtree_fits_close(kd);
+    CuAssertTrue(tc, an_alloc_current(AN_ALLOC_LIBKD) == kd0);
+
+    unlink(fn);
+    free(fn);
+    free(data);
+}
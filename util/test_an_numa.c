@@ -0,0 +1,88 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "an-numa.h"
+#include "index.h"
+#include "kdtree.h"
+
+void test_an_numa_memory(CuTest* tc) {
+    int i, n = an_numa_nodes();
+    int node = an_numa_node_id(0);
+    size_t len = 100000;
+    char* src;
+    char* p;
+
+    CuAssertTrue(tc, n >= 1);
+    for (i=0; i<n; i++)
+        CuAssertTrue(tc, an_numa_node_id(i) < an_numa_max_node());
+
+    src = malloc(len);
+    for (i=0; i<(int)len; i++)
+        src[i] = (char)i;
+    p = an_numa_copy_to_node(src, len, node);
+    CuAssertPtrNotNull(tc, p);
+    CuAssertIntEquals(tc, 0, memcmp(src, p, len));
+    // (where the kernel has no NUMA support, placing fails harmlessly)
+    an_numa_place(src + 10, len - 20, AN_NUMA_INTERLEAVE);
+    an_numa_place(p, len, node);
+    CuAssertIntEquals(tc, 0, memcmp(src, p, len));
+    an_numa_free(p, len);
+    free(src);
+
+    if (!an_numa_pin_thread(node))
+        CuAssertIntEquals(tc, 0, an_numa_unpin_thread());
+    CuAssertIntEquals(tc, -1, an_numa_pin_thread(an_numa_max_node()));
+}
+
+void test_an_numa_replicas(CuTest* tc) {
+    index_t* ind;
+    const kdtree_t* kd;
+    const kdtree_t* r;
+    kdtree_qres_t* res1;
+    kdtree_qres_t* res2;
+    double pt[4] = { 0.3, 0.4, 0.5, 0.6 };
+    int node = an_numa_node_id(0);
+
+    index_numa_set_policy(INDEX_NUMA_LOCAL, 100 * 1024 * 1024);
+    ind = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(tc, ind);
+    CuAssertIntEquals(tc, 0, index_numa_node(ind));
+    CuAssertPtrNotNull(tc, ind->code_replicas);
+    kd = ind->codekd->tree;
+    r = index_code_tree_for_node(ind, node);
+    CuAssert(tc, "a copy", r != kd);
+    CuAssert(tc, "own nodes", r->bb.any != kd->bb.any ||
+             r->split.any != kd->split.any);
+    CuAssertPtrEquals(tc, kd->data.any, r->data.any);
+    CuAssertPtrEquals(tc, kd, index_code_tree_for_node(ind, -1));
+
+    res1 = kdtree_rangesearch(kd, pt, 0.01);
+    res2 = kdtree_rangesearch(r, pt, 0.01);
+    CuAssertIntEquals(tc, res1->nres, res2->nres);
+    CuAssertTrue(tc, res1->nres > 0);
+    CuAssertIntEquals(tc, 0, memcmp(res1->inds, res2->inds,
+                                    res1->nres * sizeof(u32)));
+    kdtree_free_query(res1);
+    kdtree_free_query(res2);
+
+    // unloading drops the copies.
+    index_unload(ind);
+    CuAssertPtrEquals(tc, NULL, ind->code_replicas);
+    index_free(ind);
+
+    // too big to copy.
+    index_numa_set_policy(INDEX_NUMA_INTERLEAVE, 1);
+    ind = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(tc, ind);
+    CuAssertIntEquals(tc, -1, index_numa_node(ind));
+    CuAssertPtrEquals(tc, NULL, ind->code_replicas);
+    index_free(ind);
+    index_numa_set_policy(INDEX_NUMA_OFF, 0);
+}
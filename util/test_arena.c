@@ -0,0 +1,77 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "arena.h"
+
+void test_arena_alloc(CuTest* tc) {
+    arena_t* a = arena_new(1000);
+    char* p[100];
+    int i, j;
+
+    for (i=0; i<100; i++) {
+        p[i] = arena_alloc(a, i+1);
+        CuAssertPtrNotNull(tc, p[i]);
+        // aligned for doubles
+        CuAssertIntEquals(tc, 0, (int)((uintptr_t)p[i] % sizeof(double)));
+        memset(p[i], i, i+1);
+    }
+    // nothing got stomped on
+    for (i=0; i<100; i++)
+        for (j=0; j<=i; j++)
+            CuAssertIntEquals(tc, i, p[i][j]);
+    CuAssertTrue(tc, arena_bytes_used(a) >= 5050);
+    CuAssertTrue(tc, arena_bytes_reserved(a) >= arena_bytes_used(a));
+
+    // bigger than a block
+    p[0] = arena_calloc(a, 5000);
+    for (i=0; i<5000; i++)
+        CuAssertIntEquals(tc, 0, p[0][i]);
+    arena_free(a);
+}
+
+void test_arena_reset(CuTest* tc) {
+    arena_t* a = arena_new(4096);
+    size_t reserved;
+    int i;
+
+    for (i=0; i<100; i++)
+        arena_alloc(a, 100);
+    reserved = arena_bytes_reserved(a);
+    arena_reset(a);
+    CuAssertIntEquals(tc, 0, (int)arena_bytes_used(a));
+    // the blocks get reused
+    for (i=0; i<100; i++)
+        arena_alloc(a, 100);
+    CuAssertIntEquals(tc, (int)reserved, (int)arena_bytes_reserved(a));
+    CuAssertTrue(tc, a->peak >= 10000);
+    arena_free(a);
+}
+
+void test_arena_steal(CuTest* tc) {
+    arena_t* a = arena_new(1024);
+    arena_t* b = arena_new(1024);
+    int* x;
+    int* y;
+
+    x = arena_alloc(a, sizeof(int));
+    *x = 42;
+    y = arena_alloc(b, 2000);
+    y[0] = 17;
+    arena_steal(a, b);
+    CuAssertIntEquals(tc, 0, (int)arena_bytes_used(b));
+    CuAssertIntEquals(tc, 0, (int)arena_bytes_reserved(b));
+    CuAssertTrue(tc, arena_bytes_used(a) >= 2000 + sizeof(int));
+    CuAssertIntEquals(tc, 42, *x);
+    CuAssertIntEquals(tc, 17, y[0]);
+    // "a" still allocates from its own block.
+    CuAssertPtrNotNull(tc, arena_alloc(a, 16));
+    arena_free(b);
+    arena_free(a);
+}
@@ -7,10 +7,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 #include "cutest.h"
 #include "an-bool.h"
 #include "bl.h"
+#include "arena.h"
+#include "bl-sort.h"
+#include "permutedsort.h"
+#include "tic.h"
 
 void test_big_list(CuTest* tc) {
     // Test size_t sizes and indices of bl's.
@@ -616,3 +622,102 @@ void test_sl_join(CuTest* tc) {
     sl_free2(s);
 }
 
+
+// Random inserts, removals, sets and gets, checked against a plain array.
+void test_random_access_ops(CuTest* tc) {
+    int N = 0, cap = 20000;
+    int* arr = malloc(cap * sizeof(int));
+    il* lst = il_new(7);
+    int i, k;
+    srand(1234);
+    for (i=0; i<5000; i++) {
+        il_append(lst, i);
+        arr[N++] = i;
+    }
+    for (k=0; k<20000; k++) {
+        int op = rand() % 6;
+        int j = N ? rand() % N : 0;
+        if (op == 0 && N < cap) {
+            il_insert(lst, j, -k);
+            memmove(arr + j + 1, arr + j, (N - j) * sizeof(int));
+            arr[j] = -k;
+            N++;
+        } else if (op == 1 && N) {
+            il_remove(lst, j);
+            memmove(arr + j, arr + j + 1, (N - j - 1) * sizeof(int));
+            N--;
+        } else if (op == 2 && N) {
+            il_set(lst, j, k);
+            arr[j] = k;
+        } else if (op == 3 && N < cap) {
+            il_append(lst, k);
+            arr[N++] = k;
+        } else if (op == 4 && N > 10) {
+            int len = rand() % 10;
+            il_remove_index_range(lst, j % (N - len), len);
+            j %= (N - len);
+            memmove(arr + j, arr + j + len, (N - j - len) * sizeof(int));
+            N -= len;
+        } else if (N) {
+            CuAssertIntEquals(tc, arr[j], il_get(lst, j));
+            CuAssertIntEquals(tc, arr[j], *(int*)bl_access_const(lst, j));
+        }
+        CuAssertIntEquals(tc, N, il_size(lst));
+    }
+    for (i=0; i<N; i++)
+        CuAssertIntEquals(tc, arr[i], il_get(lst, i));
+    CuAssertIntEquals(tc, 0, il_check_consistency(lst));
+    il_free(lst);
+    free(arr);
+}
+
+// Microbenchmark: random-access reads of a long list with small blocks.
+void test_random_access_speed(CuTest* tc) {
+    int N = 1000000;
+    int M = 1000000;
+    il* lst = il_new(32);
+    size_t j;
+    int i;
+    double t0;
+    int64_t sum = 0, expect = 0;
+    for (i=0; i<N; i++)
+        il_append(lst, i);
+    j = 0;
+    t0 = timenow();
+    for (i=0; i<M; i++) {
+        j = (j * 1103515245 + 12345) % N;
+        sum += il_get(lst, j);
+        expect += j;
+    }
+    printf("%i random il_get()s on a list of %i (blocksize 32): %g s\n",
+           M, N, timenow() - t0);
+    CuAssertTrue(tc, sum == expect);
+    il_free(lst);
+}
+
+// A list whose blocks come from an arena behaves like any other.
+void test_arena_list(CuTest* tc) {
+    arena_t* a = arena_new(0);
+    il lst, other;
+    int i;
+    il_init_arena(&lst, 8, a);
+    il_init_arena(&other, 8, a);
+    for (i=0; i<1000; i++)
+        il_append(&lst, 999 - i);
+    il_insert(&lst, 500, -1);
+    il_remove(&lst, 500);
+    il_remove_index_range(&lst, 100, 50);
+    CuAssertIntEquals(tc, 950, il_size(&lst));
+    bl_sort(&lst, compare_ints_asc);
+    for (i=1; i<il_size(&lst); i++)
+        CuAssertTrue(tc, il_get(&lst, i-1) < il_get(&lst, i));
+    il_append(&other, 5000);
+    il_append_list(&lst, &other);
+    CuAssertIntEquals(tc, 951, il_size(&lst));
+    CuAssertIntEquals(tc, 5000, il_get(&lst, 950));
+    CuAssertIntEquals(tc, 0, il_check_consistency(&lst));
+    il_remove_all(&lst);
+    il_remove_all(&other);
+    CuAssertIntEquals(tc, 0, il_size(&lst));
+    arena_free(a);
+}
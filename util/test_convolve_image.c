@@ -4,6 +4,7 @@
  */
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -11,6 +12,7 @@
 #include "cutest.h"
 #include "convolve-image.h"
 #include "fitsioutils.h"
+#include "os-features.h"
 
 void test_conv_1(CuTest* tc) {
     int W = 13;
@@ -34,3 +36,130 @@ void test_conv_1(CuTest* tc) {
 }
 
 
+
+// Fills "img" with noise plus a few bright points.
+static void fill_image(float* img, int W, int H) {
+    int i;
+    srand(42);
+    for (i=0; i<W*H; i++)
+        img[i] = 100.0 + 10.0 * rand() / (double)RAND_MAX;
+    for (i=0; i<20; i++)
+        img[rand() % (W*H)] = 1e4;
+}
+
+static double max_rel_diff(const float* a, const float* b, int N) {
+    double mx = 0;
+    int i;
+    for (i=0; i<N; i++) {
+        double d = fabs(a[i] - b[i]) / MAX(1.0, fabs(a[i]));
+        if (d > mx)
+            mx = d;
+    }
+    return mx;
+}
+
+static void check_paths(CuTest* tc, int W, int H, double sigma,
+                        const float* weight, int nthreads) {
+    float* img = malloc(W * H * sizeof(float));
+    float* kernel;
+    float* direct;
+    float* viafft;
+    int K0, NK;
+
+    fill_image(img, W, H);
+    kernel = convolve_get_gaussian_kernel_f(sigma, 4., &K0, &NK);
+    convolve_set_method(CONVOLVE_DIRECT);
+    direct = convolve_separable_weighted_threaded_f(img, W, H, weight, kernel,
+                                                    K0, NK, NULL, NULL, 1);
+    convolve_set_method(CONVOLVE_FFT);
+    viafft = convolve_separable_weighted_threaded_f(img, W, H, weight, kernel,
+                                                    K0, NK, NULL, NULL,
+                                                    nthreads);
+    convolve_set_method(CONVOLVE_AUTO);
+    CuAssertTrue(tc, max_rel_diff(direct, viafft, W*H) < 1e-5);
+    free(direct);
+    free(viafft);
+    free(kernel);
+    free(img);
+}
+
+void test_conv_fft_matches_direct(CuTest* tc) {
+    // kernels narrower and wider than the image; odd and even sizes.
+    check_paths(tc, 64, 48, 2.0, NULL, 1);
+    check_paths(tc, 101, 37, 15.0, NULL, 1);
+    check_paths(tc, 200, 150, 8.0, NULL, 4);
+    check_paths(tc, 7, 5, 3.0, NULL, 1);
+}
+
+void test_conv_fft_weighted(CuTest* tc) {
+    int W = 120, H = 90;
+    float* weight = malloc(W * H * sizeof(float));
+    int i, j;
+    // constant weights, with masked-out patches -- including whole rows,
+    // and a block wider than the kernel.
+    for (i=0; i<H; i++)
+        for (j=0; j<W; j++)
+            weight[i*W + j] = ((i % 17 == 3) ||
+                               (i > 40 && i < 80 && j > 10 && j < 60) ||
+                               ((i * 7 + j * 3) % 11 == 0)) ? 0.0 : 2.0;
+    check_paths(tc, W, H, 4.0, weight, 1);
+    check_paths(tc, W, H, 4.0, weight, 3);
+    free(weight);
+}
+
+// (isfinite() is compiled away with -ffinite-math-only.)
+static int finite_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return (u & 0x7f800000) != 0x7f800000;
+}
+
+void test_conv_fft_nonfinite(CuTest* tc) {
+    int W = 80, H = 60;
+    float* img = malloc(W * H * sizeof(float));
+    float* kernel;
+    float* out;
+    int K0, NK, j;
+
+    fill_image(img, W, H);
+    img[10*W + 5] = NAN;
+    kernel = convolve_get_gaussian_kernel_f(5.0, 4., &K0, &NK);
+    CuAssertTrue(tc, NK >= CONVOLVE_FFT_MIN_NK);
+    out = convolve_separable_f(img, W, H, kernel, K0, NK, NULL, NULL);
+    // the NaN spreads only as far as the kernel reaches.
+    CuAssertTrue(tc, !finite_bits(out[10*W + 5]));
+    for (j=0; j<W; j++)
+        CuAssertTrue(tc, finite_bits(out[40*W + j]));
+    CuAssertTrue(tc, finite_bits(out[10*W + 5 + K0 + 1]));
+    free(out);
+    free(kernel);
+    free(img);
+}
+
+void test_conv_threads(CuTest* tc) {
+    int W = 150, H = 130;
+    float* img = malloc(W * H * sizeof(float));
+    float* kernel;
+    float* one;
+    float* many;
+    int K0, NK, i;
+
+    fill_image(img, W, H);
+    kernel = convolve_get_gaussian_kernel_f(1.5, 4., &K0, &NK);
+    // (direct sums: the same in any number of threads.)
+    one = convolve_separable_weighted_threaded_f(img, W, H, NULL, kernel, K0,
+                                                 NK, NULL, NULL, 1);
+    many = convolve_separable_weighted_threaded_f(img, W, H, NULL, kernel, K0,
+                                                  NK, NULL, NULL, 5);
+    for (i=0; i<W*H; i++)
+        CuAssertTrue(tc, one[i] == many[i]);
+    // in place.
+    convolve_separable_weighted_threaded_f(img, W, H, NULL, kernel, K0, NK,
+                                           img, NULL, 5);
+    for (i=0; i<W*H; i++)
+        CuAssertTrue(tc, one[i] == img[i]);
+    free(one);
+    free(many);
+    free(kernel);
+    free(img);
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ctmf.h"
+#include "cpu-features.h"
 #include "cutest.h"
 
 void test_simple_median(CuTest* tc) {
@@ -29,3 +30,49 @@ void test_simple_median(CuTest* tc) {
     for (i=0; i<sizeof(test_data); i++)
         CuAssertIntEquals(tc, 0, results[i]);
 }
+
+// Running the stripes on several threads gives the same result.
+void test_ctmf_threaded(CuTest* tc) {
+    int W = 1100, H = 90;
+    int r = 12;
+    unsigned char* img = malloc(W * H);
+    unsigned char* r1 = malloc(W * H);
+    unsigned char* r2 = malloc(W * H);
+    unsigned int seed = 5;
+    int i;
+    for (i=0; i<W*H; i++)
+        img[i] = rand_r(&seed) % 256;
+    ctmf(img, r1, W, H, W, W, r, 1, 512*1024);
+    ctmf_threaded(img, r2, W, H, W, W, r, 1, 512*1024, 4);
+    CuAssertIntEquals(tc, 0, memcmp(r1, r2, W * H));
+    // small cache, so several stripes even on one thread.
+    ctmf_threaded(img, r2, W, H, W, W, r, 1, 64*1024, 3);
+    CuAssertIntEquals(tc, 0, memcmp(r1, r2, W * H));
+    free(img);
+    free(r1);
+    free(r2);
+}
+
+// The baseline and the widest version the CPU can run agree.
+void test_ctmf_simd_versions(CuTest* tc) {
+    int W = 700, H = 60;
+    int r = 7;
+    unsigned char* img = malloc(W * H * 3);
+    unsigned char* r1 = malloc(W * H * 3);
+    unsigned char* r2 = malloc(W * H * 3);
+    unsigned int seed = 11;
+    int i;
+    for (i=0; i<W*H*3; i++)
+        img[i] = rand_r(&seed) % 256;
+    ctmf(img, r1, W, H, W*3, W*3, r, 3, 512*1024);
+    cpu_features_restrict(0);
+    CuAssertIntEquals(tc, 0, cpu_features());
+    CuAssertTrue(tc, cpu_has(0));
+    CuAssertTrue(tc, !cpu_has(CPU_SSE2));
+    ctmf(img, r2, W, H, W*3, W*3, r, 3, 512*1024);
+    cpu_features_restrict(~0u);
+    CuAssertIntEquals(tc, 0, memcmp(r1, r2, W * H * 3));
+    free(img);
+    free(r1);
+    free(r2);
+}
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
 
 #include "cutest.h"
 #include "dimage.h"
@@ -71,3 +72,55 @@ void test_dcen3x3_3(CuTest* tc) {
     printf("(%g,%g) -> (%g,%g)\n", XX, YY, xc, yc);
 }
 
+
+void test_dcen3x3_batch(CuTest* tc) {
+    // peaks with noise, flat boxes, and slopes, which fail.
+    int N = 1000;
+    int i, k, nok = 0;
+    float* boxes = malloc(9 * N * sizeof(float));
+    float* xc = malloc(N * sizeof(float));
+    float* yc = malloc(N * sizeof(float));
+    uint8_t* ok = malloc(N);
+
+    srand(42);
+    for (i=0; i<N; i++) {
+        float XX = 0.5 + rand() / (float)RAND_MAX;
+        float YY = 0.5 + rand() / (float)RAND_MAX;
+        int kind = i % 4;
+        for (k=0; k<9; k++) {
+            float dx = (k % 3) - XX;
+            float dy = (k / 3) - YY;
+            float v;
+            if (kind == 0)
+                v = 40. - 3. * (dx*dx + dy*dy);
+            else if (kind == 1)
+                v = 40. - 3. * (dx*dx + dy*dy) + 0.5 * rand() / (float)RAND_MAX;
+            else if (kind == 2)
+                v = 10.;
+            else
+                v = 10. * (k % 3) + (k / 3);
+            boxes[k * N + i] = v;
+        }
+    }
+    dcen3x3_batch(boxes, N, N, xc, yc, ok);
+    for (i=0; i<N; i++) {
+        float image[9];
+        float x, y;
+        int rtn;
+        for (k=0; k<9; k++)
+            image[k] = boxes[k * N + i];
+        rtn = dcen3x3(image, &x, &y);
+        CuAssertIntEquals(tc, rtn, ok[i]);
+        if (!rtn)
+            continue;
+        nok++;
+        CuAssertTrue(tc, x == xc[i]);
+        CuAssertTrue(tc, y == yc[i]);
+    }
+    CuAssertTrue(tc, nok >= N / 2);
+    CuAssertTrue(tc, nok < N);
+    free(boxes);
+    free(xc);
+    free(yc);
+    free(ok);
+}
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dimage.h"
 #include "cutest.h"
@@ -271,3 +272,42 @@ void test_collapsing_find_simple(CuTest* tc) {
     CuAssertIntEquals(tc, equivs[2], 0);
     CuAssertIntEquals(tc, equivs[3], 0);
 }
+
+void test_threaded(CuTest* tc) {
+    int nx = 101, ny = 300;
+    int* img = malloc(nx * ny * sizeof(int));
+    unsigned char* u8img = malloc(nx * ny);
+    int* serial = malloc(nx * ny * sizeof(int));
+    int* threaded = malloc(nx * ny * sizeof(int));
+    int nserial, nthreaded;
+    int i, nthreads;
+
+    initial_max_groups = 50;
+    srand(42);
+    for (i=0; i<nx*ny; i++)
+        img[i] = (rand() % 100) < 45;
+    // a snake that winds down through every band.
+    for (i=0; i<ny; i++)
+        img[i*nx + (i / 10) % 2 * (nx-1)] = 1;
+    for (i=0; i<ny; i+=10)
+        img[i*nx + (i/10 % 2) * (nx/2)] = 1;
+    for (i=0; i<nx*ny; i++)
+        u8img[i] = img[i];
+    dfind2(img, nx, ny, serial, &nserial);
+
+    for (nthreads=1; nthreads<=8; nthreads++) {
+        dfind2_threaded(img, nx, ny, threaded, &nthreaded, nthreads);
+        CuAssertIntEquals(tc, nserial, nthreaded);
+        CuAssertIntEquals(tc, 0, memcmp(serial, threaded,
+                                        nx * ny * sizeof(int)));
+        memset(threaded, 0, nx * ny * sizeof(int));
+        dfind2_u8_threaded(u8img, nx, ny, threaded, &nthreaded, nthreads);
+        CuAssertIntEquals(tc, nserial, nthreaded);
+        CuAssertIntEquals(tc, 0, memcmp(serial, threaded,
+                                        nx * ny * sizeof(int)));
+    }
+    free(img);
+    free(u8img);
+    free(serial);
+    free(threaded);
+}
@@ -0,0 +1,57 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "dimage.h"
+#include "permutedsort.h"
+
+void test_dselect(CuTest* tc) {
+    unsigned int seed = 7;
+    int trial;
+    for (trial=0; trial<50; trial++) {
+        int n = 1 + rand_r(&seed) % 300;
+        float* arr = malloc(n * sizeof(float));
+        float* sorted = malloc(n * sizeof(float));
+        int i, k;
+        for (i=0; i<n; i++)
+            // (with plenty of repeats)
+            arr[i] = (trial % 2) ? rand_r(&seed) % 10 : rand_r(&seed);
+        memcpy(sorted, arr, n * sizeof(float));
+        qsort(sorted, n, sizeof(float), compare_floats_asc);
+        k = rand_r(&seed) % n;
+        CuAssertTrue(tc, dselect(k, n, arr) == sorted[k]);
+        CuAssertTrue(tc, dselect(n/2, n, arr) == sorted[n/2]);
+        free(arr);
+        free(sorted);
+    }
+}
+
+void test_dmedsmooth_threaded(CuTest* tc) {
+    int W = 301, H = 257;
+    int halfbox = 20;
+    float* image = malloc(W * H * sizeof(float));
+    float* s1 = malloc(W * H * sizeof(float));
+    float* s2 = malloc(W * H * sizeof(float));
+    unsigned int seed = 3;
+    int i;
+
+    for (i=0; i<W*H; i++)
+        image[i] = 1000.0 * rand_r(&seed) / RAND_MAX + (i % W);
+    image[W * 10 + 10] = NAN;
+
+    CuAssertIntEquals(tc, 1, dmedsmooth(image, NULL, W, H, halfbox, s1));
+    CuAssertIntEquals(tc, 1, dmedsmooth_threaded(image, NULL, W, H, halfbox,
+                                                 s2, 4));
+    CuAssertIntEquals(tc, 0, memcmp(s1, s2, W * H * sizeof(float)));
+
+    free(image);
+    free(s1);
+    free(s2);
+}
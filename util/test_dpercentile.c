@@ -0,0 +1,144 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "dimage.h"
+
+static int compare_floats(const void* v1, const void* v2) {
+    float f1 = *(const float*)v1;
+    float f2 = *(const float*)v2;
+    if (f1 < f2)
+        return -1;
+    if (f1 > f2)
+        return 1;
+    return 0;
+}
+
+static void check_exact(CuTest* tc, const float* data, int N,
+                        const float* finite, int Nfinite, int nthreads) {
+    double ps[] = { 0.0, 0.001, 0.1, 0.25, 0.5, 0.75, 0.98, 0.999, 1.0 };
+    int np = sizeof(ps) / sizeof(double);
+    float* sorted;
+    float out[9];
+    int i;
+
+    sorted = malloc(Nfinite * sizeof(float));
+    memcpy(sorted, finite, Nfinite * sizeof(float));
+    qsort(sorted, Nfinite, sizeof(float), compare_floats);
+    CuAssertIntEquals(tc, Nfinite,
+                      (int)dpercentiles(data, N, ps, np, 0, nthreads, out));
+    for (i=0; i<np; i++) {
+        int rank = (int)(ps[i] * Nfinite);
+        if (rank > Nfinite - 1)
+            rank = Nfinite - 1;
+        CuAssertTrue(tc, out[i] == sorted[rank]);
+    }
+    free(sorted);
+}
+
+void test_dpercentile_exact(CuTest* tc) {
+    int N = 100000;
+    float* data = malloc(N * sizeof(float));
+    int i;
+    srand(0);
+    for (i=0; i<N; i++)
+        data[i] = 1000. * rand() / (float)RAND_MAX - 10.;
+    check_exact(tc, data, N, data, N, 1);
+    check_exact(tc, data, N, data, N, 4);
+    // a few values
+    check_exact(tc, data, 3, data, 3, 1);
+    check_exact(tc, data, 1, data, 1, 1);
+    free(data);
+}
+
+void test_dpercentile_clumped(CuTest* tc) {
+    // most of the values in one first-level bin, and many repeated, so
+    // that bin has to be histogrammed again.
+    int N = 1500000;
+    float* data = malloc(N * sizeof(float));
+    int i;
+    srand(1);
+    for (i=0; i<N; i++) {
+        if (i % 3 == 0)
+            data[i] = 100.;
+        else if (i % 100 == 1)
+            data[i] = 1e6 * rand() / (float)RAND_MAX;
+        else
+            data[i] = 100. + rand() / (float)RAND_MAX;
+    }
+    check_exact(tc, data, N, data, N, 1);
+    check_exact(tc, data, N, data, N, 3);
+    free(data);
+}
+
+void test_dpercentile_nonfinite(CuTest* tc) {
+    int N = 10000;
+    float* data = malloc(N * sizeof(float));
+    float* finite = malloc(N * sizeof(float));
+    float out;
+    double p = 0.5;
+    int i, nf = 0;
+    srand(2);
+    for (i=0; i<N; i++) {
+        if (i % 7 == 0)
+            data[i] = (i % 2) ? HUGE_VALF : -HUGE_VALF;
+        else if (i % 11 == 0) {
+            // a NaN, whatever the compiler thinks of NAN.
+            unsigned int bits = 0x7fc00000;
+            memcpy(data + i, &bits, sizeof(float));
+        } else {
+            data[i] = rand() / (float)RAND_MAX;
+            finite[nf++] = data[i];
+        }
+    }
+    check_exact(tc, data, N, finite, nf, 2);
+
+    for (i=0; i<N; i++)
+        data[i] = HUGE_VALF;
+    out = -1.;
+    CuAssertIntEquals(tc, 0, (int)dpercentiles(data, N, &p, 1, 0, 1, &out));
+    CuAssertTrue(tc, out == -1.);
+
+    for (i=0; i<N; i++)
+        data[i] = 5.;
+    CuAssertIntEquals(tc, N, (int)dpercentiles(data, N, &p, 1, 0, 1, &out));
+    CuAssertTrue(tc, out == 5.);
+    free(data);
+    free(finite);
+}
+
+void test_dpercentile_sampled(CuTest* tc) {
+    // values 0..N-1 shuffled, so a value is its own rank.
+    int N = 1000000;
+    int nsample = 30000;
+    double ps[] = { 0.1, 0.5, 0.98 };
+    float* data = malloc(N * sizeof(float));
+    float out[3], out2[3];
+    int i;
+    srand(3);
+    for (i=0; i<N; i++)
+        data[i] = i;
+    for (i=N-1; i>0; i--) {
+        int j = rand() % (i+1);
+        float t = data[i];
+        data[i] = data[j];
+        data[j] = t;
+    }
+    CuAssertIntEquals(tc, nsample,
+                      (int)dpercentiles(data, N, ps, 3, nsample, 1, out));
+    for (i=0; i<3; i++) {
+        double sigma = sqrt(ps[i] * (1. - ps[i]) / nsample) * N;
+        CuAssertTrue(tc, fabs(out[i] - ps[i] * N) < 5. * sigma);
+    }
+    // repeatable
+    dpercentiles(data, N, ps, 3, nsample, 1, out2);
+    CuAssertTrue(tc, memcmp(out, out2, sizeof(out)) == 0);
+    free(data);
+}
@@ -0,0 +1,65 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "dimage.h"
+
+static float gaussian(void) {
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+// noise of "sig1" on the left half and "sig2" on the right.
+static float* noise_image(int W, int H, float sig1, float sig2) {
+    float* img = malloc(W * H * sizeof(float));
+    int i, j;
+    srand(1);
+    for (j=0; j<H; j++)
+        for (i=0; i<W; i++)
+            img[j*W + i] = 100. + (i < W/2 ? sig1 : sig2) * gaussian();
+    return img;
+}
+
+void test_dsigma_threaded(CuTest* tc) {
+    int W = 1000, H = 700;
+    float* img = noise_image(W, H, 3.0, 3.0);
+    float s1, s2, s3;
+    int grid;
+
+    CuAssertIntEquals(tc, 1, dsigma(img, W, H, 5, 0, &s1));
+    CuAssertDblEquals(tc, 3.0, s1, 0.3);
+    // the same on several threads.
+    CuAssertIntEquals(tc, 1, dsigma_threaded(img, W, H, 5, 0, 4, &s2));
+    CuAssertTrue(tc, s1 == s2);
+    CuAssertIntEquals(tc, 1, dsigma_threaded(img, W, H, 5, 1, 0, &s3));
+    CuAssertDblEquals(tc, 3.0, s3, 0.05);
+
+    grid = dsigma_gridsize(W, H, 10000);
+    CuAssertIntEquals(tc, 8, grid);
+    CuAssertIntEquals(tc, 0, dsigma_gridsize(W, H, 0));
+    CuAssertIntEquals(tc, 1, dsigma_gridsize(W, H, 10 * W * H));
+    free(img);
+}
+
+void test_dsigma_map(CuTest* tc) {
+    int W = 800, H = 400;
+    float* img = noise_image(W, H, 2.0, 6.0);
+    float map[4];
+
+    CuAssertIntEquals(tc, 4, dsigma_map(img, W, H, 5, 0, 2, 2, 3, map));
+    CuAssertDblEquals(tc, 2.0, map[0], 0.3);
+    CuAssertDblEquals(tc, 6.0, map[1], 0.9);
+    CuAssertDblEquals(tc, 2.0, map[2], 0.3);
+    CuAssertDblEquals(tc, 6.0, map[3], 0.9);
+
+    // tiles too small to measure.
+    CuAssertIntEquals(tc, 0, dsigma_map(img, 8, 4, 5, 0, 2, 2, 1, map));
+    CuAssertTrue(tc, map[0] == 0.0);
+    free(img);
+}
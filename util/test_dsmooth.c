@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 
 #include "cutest.h"
 
@@ -114,3 +115,132 @@ void test_dsmooth2_inplace(CuTest* tc) {
     free(smooth1);
     free(smooth2);
 }
+
+void dsmooth2_iir(float *image, int nx, int ny, float sigma, float *smooth);
+
+void test_dsmooth2_iir(CuTest* tc) {
+    int nx = 120, ny = 110;
+    float sigma = 6.0;
+    int edge = (int)(4 * sigma);
+    float* img = calloc(nx * ny, sizeof(float));
+    float* s1 = calloc(nx * ny, sizeof(float));
+    float* s2 = calloc(nx * ny, sizeof(float));
+    float peak, maxdiff;
+    int i, j;
+
+    // point source
+    img[60 * nx + 55] = 1.0;
+    dsmooth2(img, nx, ny, sigma, s1);
+    dsmooth2_iir(img, nx, ny, sigma, s2);
+    peak = s1[60 * nx + 55];
+    maxdiff = 0;
+    for (i=0; i<nx*ny; i++)
+        maxdiff = fmaxf(maxdiff, fabsf(s1[i] - s2[i]));
+    CuAssertTrue(tc, maxdiff < 0.01 * peak);
+
+    // noise, in place, away from the edges.
+    free(img);
+    img = random_image(nx, ny);
+    dsmooth2(img, nx, ny, sigma, s1);
+    dsmooth2_iir(img, nx, ny, sigma, img);
+    maxdiff = 0;
+    for (j=edge; j<ny-edge; j++)
+        for (i=edge; i<nx-edge; i++)
+            maxdiff = fmaxf(maxdiff, fabsf(s1[j*nx+i] - img[j*nx+i]));
+    CuAssertTrue(tc, maxdiff < 0.005);
+
+    free(img);
+    free(s1);
+    free(s2);
+}
+
+void dsmooth2_u8(uint8_t *image, int nx, int ny, float sigma, float *smooth);
+void dsmooth2_average_u8(const uint8_t* image, int nx, int ny, float sigma,
+                         int S, float* output);
+float* average_image_f(const float* image, int W, int H,
+                       int blocksize, int edgehandling,
+                       int* newW, int* newH,
+                       float* output);
+
+void test_dsmooth2_average_u8(CuTest* tc) {
+    int nx = 103, ny = 77;
+    uint8_t* img = malloc(nx * ny);
+    float* smooth = malloc(nx * ny * sizeof(float));
+    float* avg;
+    float* out;
+    int S, i, outw, outh;
+
+    for (i=0; i<nx*ny; i++)
+        img[i] = rand() % 256;
+    for (S=2; S<=5; S++) {
+        dsmooth2_u8(img, nx, ny, S, smooth);
+        // (1 = EDGE_AVERAGE)
+        avg = average_image_f(smooth, nx, ny, S, 1, &outw, &outh, NULL);
+        CuAssertIntEquals(tc, (nx + S - 1) / S, outw);
+        CuAssertIntEquals(tc, (ny + S - 1) / S, outh);
+        out = malloc(outw * outh * sizeof(float));
+        dsmooth2_average_u8(img, nx, ny, S, S, out);
+        CuAssertIntEquals(tc, 0, compare_images(avg, out, outw, outh, 1e-3));
+        free(out);
+        free(avg);
+    }
+    free(img);
+    free(smooth);
+}
+
+void dsmooth2_i16(int16_t *image, int nx, int ny, float sigma, float *smooth);
+int dmask(float *image, int nx, int ny, float limit,
+          float dpsf, uint8_t* mask);
+int dsmooth2_mask(float* image, float* bg, int nx, int ny, float dpsf,
+                  float limit, uint8_t* mask);
+int dsmooth2_mask_i16(const int16_t* image, int nx, int ny, float dpsf,
+                      float limit, uint8_t* mask);
+
+void test_dsmooth2_mask(CuTest* tc) {
+    int nx = 90, ny = 70;
+    float* img = random_image(nx, ny);
+    float* bg = malloc(nx * ny * sizeof(float));
+    float* bgsub = malloc(nx * ny * sizeof(float));
+    float* smooth = malloc(nx * ny * sizeof(float));
+    int16_t* img16 = malloc(nx * ny * sizeof(int16_t));
+    uint8_t* mask1 = malloc(nx * ny);
+    uint8_t* mask2 = malloc(nx * ny);
+    float dpsf;
+    int i;
+
+    for (i=0; i<nx*ny; i++) {
+        bg[i] = 0.25 * (i % nx) / nx;
+        img16[i] = (int16_t)(img[i] * 20) - 8;
+    }
+    for (dpsf=0.5; dpsf<4; dpsf+=1.1) {
+        float limit = 0.55;
+        // float, with the background subtracted on the way.
+        for (i=0; i<nx*ny; i++)
+            bgsub[i] = img[i] - bg[i];
+        dsmooth2(bgsub, nx, ny, dpsf, smooth);
+        CuAssertIntEquals(tc, dmask(smooth, nx, ny, limit, dpsf, mask1),
+                          dsmooth2_mask(img, bg, nx, ny, dpsf, limit, mask2));
+        CuAssertIntEquals(tc, 0, memcmp(mask1, mask2, nx * ny));
+        CuAssertIntEquals(tc, 0, memcmp(bg, bgsub, nx * ny * sizeof(float)));
+        for (i=0; i<nx*ny; i++)
+            bg[i] = 0.25 * (i % nx) / nx;
+
+        // nothing significant.
+        CuAssertIntEquals(tc, 0, dsmooth2_mask(img, NULL, nx, ny, dpsf,
+                                               2.0, mask2));
+
+        // int16.
+        dsmooth2_i16(img16, nx, ny, dpsf, smooth);
+        limit = 3.0;
+        CuAssertIntEquals(tc, dmask(smooth, nx, ny, limit, dpsf, mask1),
+                          dsmooth2_mask_i16(img16, nx, ny, dpsf, limit, mask2));
+        CuAssertIntEquals(tc, 0, memcmp(mask1, mask2, nx * ny));
+    }
+    free(img);
+    free(bg);
+    free(bgsub);
+    free(smooth);
+    free(img16);
+    free(mask1);
+    free(mask2);
+}
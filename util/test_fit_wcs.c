@@ -159,6 +159,224 @@ void test_wcs_shift(CuTest* tc) {
      */
 }
 
+static void make_sip_stars(sip_t* wcs, double* xy, double* xyz, int N) {
+    int i;
+    memset(wcs, 0, sizeof(sip_t));
+    wcs->wcstan.crpix[0] = 512.5;
+    wcs->wcstan.crpix[1] = 480.2;
+    wcs->wcstan.crval[0] = 39.0268;
+    wcs->wcstan.crval[1] = 65.0062;
+    wcs->wcstan.cd[0][0] =  0.00061453;
+    wcs->wcstan.cd[0][1] = -0.0035865;
+    wcs->wcstan.cd[1][0] = -0.0035971;
+    wcs->wcstan.cd[1][1] = -0.00061653;
+    wcs->wcstan.imagew = 1024;
+    wcs->wcstan.imageh = 1000;
+    wcs->a_order = wcs->b_order = 3;
+    wcs->a[0][2] = 3.7161e-06;
+    wcs->a[1][1] = 2.4926e-06;
+    wcs->a[2][0] = -1.9189e-05;
+    wcs->a[3][0] = 2.0e-9;
+    wcs->b[0][2] = -3.0798e-05;
+    wcs->b[1][1] = 1.8929e-07;
+    wcs->b[2][0] = 8.5835e-06;
+    wcs->b[1][2] = -1.5e-9;
+    for (i=0; i<N; i++) {
+        xy[2*i+0] = 1024. * (i % 37) / 37. + 3.;
+        xy[2*i+1] = 1000. * (i / 37) / (N / 37 + 1) + 7.;
+        sip_pixelxy2xyzarr(wcs, xy[2*i+0], xy[2*i+1], xyz + 3*i);
+    }
+}
+
+static void assert_sip_close(CuTest* tc, const sip_t* s1, const sip_t* s2) {
+    int p, q;
+    CuAssertDblEquals(tc, s1->wcstan.crval[0], s2->wcstan.crval[0], 1e-9);
+    CuAssertDblEquals(tc, s1->wcstan.crval[1], s2->wcstan.crval[1], 1e-9);
+    for (p=0; p<2; p++)
+        for (q=0; q<2; q++)
+            CuAssertDblEquals(tc, s1->wcstan.cd[p][q], s2->wcstan.cd[p][q],
+                              1e-11);
+    for (p=0; p<=s1->a_order; p++)
+        for (q=0; p+q<=s1->a_order; q++) {
+            CuAssertDblEquals(tc, s1->a[p][q], s2->a[p][q],
+                              1e-8 * pow(1e-3, p+q));
+            CuAssertDblEquals(tc, s1->b[p][q], s2->b[p][q],
+                              1e-8 * pow(1e-3, p+q));
+        }
+}
+
+void test_fit_sip_normal(CuTest* tc) {
+    int N = 37 * 20;
+    double xy[2 * 37 * 20];
+    double xyz[3 * 37 * 20];
+    double weights[37 * 20];
+    sip_t truth, qr, ne;
+    tan_t tan;
+    fit_sip_normal_t* f;
+    int i, rtn;
+
+    make_sip_stars(&truth, xy, xyz, N);
+    for (i=0; i<N; i++)
+        weights[i] = 0.5 + 0.5 * (i % 3) / 2.;
+    // Start from a slightly-wrong TAN, as tweak2 does.
+    memcpy(&tan, &(truth.wcstan), sizeof(tan_t));
+    tan.crval[0] += 1e-3;
+    tan.cd[0][0] *= 1.001;
+
+    rtn = fit_sip_wcs(xyz, xy, weights, N, &tan, 3, 4, 1, &qr);
+    CuAssertIntEquals(tc, 0, rtn);
+
+    f = fit_sip_normal_new(4);
+    CuAssertPtrNotNull(tc, f);
+    fit_sip_normal_reset(f, &tan);
+    for (i=0; i<N; i++)
+        CuAssertIntEquals(tc, 0, fit_sip_normal_add(f, xyz + 3*i, xy + 2*i,
+                                                    weights[i]));
+    CuAssertIntEquals(tc, N, f->npairs);
+    rtn = fit_sip_normal_solve(f, 3, 4, 1, &ne);
+    CuAssertIntEquals(tc, 0, rtn);
+    CuAssertIntEquals(tc, 3, ne.a_order);
+    CuAssertIntEquals(tc, 4, ne.ap_order);
+    assert_sip_close(tc, &qr, &ne);
+    // The distortion is recovered.
+    CuAssertDblEquals(tc, truth.a[2][0], ne.a[2][0], 1e-9);
+    CuAssertDblEquals(tc, truth.b[1][2], ne.b[1][2], 1e-11);
+
+    // Adding bogus pairs and removing them again gives the same fit.
+    for (i=0; i<10; i++) {
+        double bad[2];
+        bad[0] = xy[2*i+1];
+        bad[1] = xy[2*i+0];
+        fit_sip_normal_add(f, xyz + 3*(N-1-i), bad, 1.0);
+    }
+    CuAssertIntEquals(tc, N+10, f->npairs);
+    for (i=0; i<10; i++) {
+        double bad[2];
+        bad[0] = xy[2*i+1];
+        bad[1] = xy[2*i+0];
+        fit_sip_normal_remove(f, xyz + 3*(N-1-i), bad, 1.0);
+    }
+    CuAssertIntEquals(tc, N, f->npairs);
+    rtn = fit_sip_normal_solve(f, 3, 4, 1, &ne);
+    CuAssertIntEquals(tc, 0, rtn);
+    assert_sip_close(tc, &qr, &ne);
+
+    // A lower order is solved from the same sums.
+    rtn = fit_sip_wcs(xyz, xy, weights, N, &tan, 2, 3, 1, &qr);
+    CuAssertIntEquals(tc, 0, rtn);
+    rtn = fit_sip_normal_solve(f, 2, 3, 1, &ne);
+    CuAssertIntEquals(tc, 0, rtn);
+    assert_sip_close(tc, &qr, &ne);
+
+    // Too few pairs.
+    fit_sip_normal_reset(f, &tan);
+    for (i=0; i<5; i++)
+        fit_sip_normal_add(f, xyz + 3*i, xy + 2*i, 1.0);
+    CuAssertIntEquals(tc, -1, fit_sip_normal_solve(f, 2, 3, 1, &ne));
+
+    fit_sip_normal_free(f);
+}
+
+void test_fit_wcs_workspace(CuTest* tc) {
+    int N = 37 * 20;
+    double xy[2 * 37 * 20];
+    double xyz[3 * 37 * 20];
+    sip_t truth, s1, s2;
+    tan_t t1, t2;
+    double sc1, sc2;
+    fit_wcs_workspace_t* ws;
+    int k;
+
+    make_sip_stars(&truth, xy, xyz, N);
+    ws = fit_wcs_workspace_new(3, N);
+    CuAssertPtrNotNull(tc, ws);
+
+    CuAssertIntEquals(tc, 0, fit_sip_wcs(xyz, xy, NULL, N, &(truth.wcstan),
+                                         3, 4, 1, &s1));
+    // Reusing the workspace, with fewer stars and lower orders in between,
+    // gives the same answer each time.
+    for (k=0; k<3; k++) {
+        CuAssertIntEquals(tc, 0, fit_sip_wcs_ws(ws, xyz, xy, NULL, N/2,
+                                                &(truth.wcstan), 2, 2, 1, &s2));
+        CuAssertIntEquals(tc, 0, fit_sip_wcs_ws(ws, xyz, xy, NULL, N,
+                                                &(truth.wcstan), 3, 4, 1, &s2));
+        assert_sip_close(tc, &s1, &s2);
+    }
+
+    CuAssertIntEquals(tc, 0, fit_sip_coefficients(xyz, xy, NULL, N,
+                                                  &(truth.wcstan), 3, 0, &s1));
+    CuAssertIntEquals(tc, 0, fit_sip_coefficients_ws(ws, xyz, xy, NULL, N,
+                                                     &(truth.wcstan), 3, 0, &s2));
+    assert_sip_close(tc, &s1, &s2);
+
+    CuAssertIntEquals(tc, 0, fit_tan_wcs(xyz, xy, N, &t1, &sc1));
+    CuAssertIntEquals(tc, 0, fit_tan_wcs_weighted_ws(ws, xyz, xy, NULL, N,
+                                                     &t2, &sc2));
+    CuAssertDblEquals(tc, sc1, sc2, 1e-15);
+    CuAssertDblEquals(tc, t1.crval[0], t2.crval[0], 1e-12);
+    CuAssertDblEquals(tc, t1.crval[1], t2.crval[1], 1e-12);
+    CuAssertDblEquals(tc, t1.cd[0][1], t2.cd[0][1], 1e-15);
+
+    // Too small.
+    CuAssertIntEquals(tc, -1, fit_sip_wcs_ws(ws, xyz, xy, NULL, N,
+                                             &(truth.wcstan), 4, 4, 1, &s2));
+    fit_wcs_workspace_free(ws);
+    ws = fit_wcs_workspace_new(3, 10);
+    CuAssertIntEquals(tc, -1, fit_tan_wcs_weighted_ws(ws, xyz, xy, NULL, N,
+                                                      &t2, &sc2));
+    fit_wcs_workspace_free(ws);
+}
+
+// Quads (4 or 5 stars) are fit in closed form; check both parities, and
+// the SVD fallback for collinear stars.
+void test_fit_tan_wcs_quad(CuTest* tc) {
+    double xy[10] = { 400., 380., 470., 455., 420., 450., 455., 395.,
+                      440., 410. };
+    double xyz[15];
+    tan_t truth, fit;
+    double scale;
+    int parity, N, i, j, k;
+
+    for (parity=0; parity<2; parity++) {
+        memset(&truth, 0, sizeof(tan_t));
+        truth.crpix[0] = 437.0;
+        truth.crpix[1] = 418.0;
+        truth.crval[0] = 210.3;
+        truth.crval[1] = -35.8;
+        // (conformal, as the fit is)
+        truth.cd[0][0] =  0.00061453;
+        truth.cd[0][1] = -0.0035865;
+        truth.cd[1][0] =  0.0035865;
+        truth.cd[1][1] =  0.00061453;
+        if (parity) {
+            truth.cd[0][0] *= -1.;
+            truth.cd[1][0] *= -1.;
+        }
+        for (N=4; N<=5; N++) {
+            for (i=0; i<N; i++)
+                tan_pixelxy2xyzarr(&truth, xy[2*i], xy[2*i+1], xyz + 3*i);
+            CuAssertIntEquals(tc, 0, fit_tan_wcs(xyz, xy, N, &fit, &scale));
+            // (the fit is only approximate: see the FIXME in
+            // fit_tan_wcs_solve())
+            for (j=0; j<2; j++)
+                for (k=0; k<2; k++)
+                    CuAssertDblEquals(tc, truth.cd[j][k], fit.cd[j][k], 5e-6);
+            CuAssertDblEquals(tc, sqrt(fabs(tan_det_cd(&truth))), scale, 5e-6);
+        }
+    }
+
+    // collinear stars.
+    for (i=0; i<4; i++) {
+        xy[2*i+0] = 100. + 10. * i;
+        xy[2*i+1] = 200. + 5. * i;
+        tan_pixelxy2xyzarr(&truth, xy[2*i], xy[2*i+1], xyz + 3*i);
+    }
+    CuAssertIntEquals(tc, 0, fit_tan_wcs(xyz, xy, 4, &fit, &scale));
+    for (j=0; j<2; j++)
+        for (k=0; k<2; k++)
+            CuAssertTrue(tc, isfinite(fit.cd[j][k]));
+}
+
 #if 0
 int main() {
     CuString *output = CuStringNew();
@@ -66,6 +66,84 @@ void test_fitsbin_1(CuTest* ct) {
     CuAssertIntEquals(ct, 0, fitsbin_close(in));
 }
 
+void test_fitsbin_mmap_policy(CuTest* ct) {
+    fitsbin_t* in, *out;
+    int i;
+    int N = 100000;
+    double* outdata;
+    char* fn;
+    fitsbin_chunk_t chunk;
+    size_t popmax;
+
+    CuAssertIntEquals(ct, FITSBIN_MMAP_RANDOM | FITSBIN_MMAP_PREFETCH,
+                      fitsbin_parse_mmap_flags(" random,prefetch "));
+    CuAssertIntEquals(ct, 0, fitsbin_parse_mmap_flags(""));
+    CuAssertIntEquals(ct, -1, fitsbin_parse_mmap_flags("willneed bogus"));
+
+    outdata = malloc(N * sizeof(double));
+    for (i=0; i<N; i++)
+        outdata[i] = i;
+
+    fn = get_tmpfile(1);
+    out = fitsbin_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, out);
+    CuAssertIntEquals(ct, 0, fitsbin_write_primary_header(out));
+    fitsbin_chunk_init(&chunk);
+    chunk.tablename = "small";
+    chunk.itemsize = sizeof(double);
+    chunk.nrows = 10;
+    chunk.data = outdata;
+    CuAssertIntEquals(ct, 0, fitsbin_write_chunk(out, &chunk));
+    fitsbin_chunk_reset(&chunk);
+    chunk.tablename = "big";
+    chunk.itemsize = sizeof(double);
+    chunk.nrows = N;
+    chunk.data = outdata;
+    CuAssertIntEquals(ct, 0, fitsbin_write_chunk(out, &chunk));
+    CuAssertIntEquals(ct, 0, fitsbin_fix_primary_header(out));
+    CuAssertIntEquals(ct, 0, fitsbin_close(out));
+    fitsbin_chunk_clean(&chunk);
+
+    fitsbin_set_mmap_policy(FITSBIN_MMAP_WILLNEED | FITSBIN_MMAP_RANDOM |
+                            FITSBIN_MMAP_HUGEPAGE | FITSBIN_MMAP_POPULATE |
+                            FITSBIN_MMAP_PREFETCH, 65536);
+    CuAssertIntEquals(ct, FITSBIN_MMAP_WILLNEED | FITSBIN_MMAP_RANDOM |
+                      FITSBIN_MMAP_HUGEPAGE | FITSBIN_MMAP_POPULATE |
+                      FITSBIN_MMAP_PREFETCH, fitsbin_get_mmap_policy(&popmax));
+    CuAssertIntEquals(ct, 65536, popmax);
+
+    // the policy shouldn't change what is read.
+    in = fitsbin_open(fn);
+    CuAssertPtrNotNull(ct, in);
+    fitsbin_chunk_init(&chunk);
+    chunk.tablename = "small";
+    CuAssertIntEquals(ct, 0, fitsbin_read_chunk(in, &chunk));
+    CuAssertIntEquals(ct, 10, chunk.nrows);
+    CuAssertIntEquals(ct, 0, memcmp(outdata, chunk.data, 10 * sizeof(double)));
+    fitsbin_chunk_init(&chunk);
+    chunk.tablename = "big";
+    CuAssertIntEquals(ct, 0, fitsbin_read_chunk(in, &chunk));
+    CuAssertIntEquals(ct, N, chunk.nrows);
+    CuAssertIntEquals(ct, 0, memcmp(outdata, chunk.data, N * sizeof(double)));
+    CuAssertIntEquals(ct, 0, fitsbin_close(in));
+
+    // nor should reading the chunks instead of mapping them.
+    CuAssertIntEquals(ct, FITSBIN_MMAP_READ | FITSBIN_MMAP_HUGEPAGE,
+                      fitsbin_parse_mmap_flags("read hugepage"));
+    fitsbin_set_mmap_policy(FITSBIN_MMAP_READ | FITSBIN_MMAP_HUGEPAGE, 0);
+    in = fitsbin_open(fn);
+    CuAssertPtrNotNull(ct, in);
+    fitsbin_chunk_init(&chunk);
+    chunk.tablename = "big";
+    CuAssertIntEquals(ct, 0, fitsbin_read_chunk(in, &chunk));
+    CuAssertIntEquals(ct, N, chunk.nrows);
+    CuAssertIntEquals(ct, 0, memcmp(outdata, chunk.data, N * sizeof(double)));
+    CuAssertIntEquals(ct, 0, fitsbin_close(in));
+
+    fitsbin_set_mmap_policy(0, 0);
+    free(outdata);
+}
+
 void test_fitsbin_2(CuTest* ct) {
     fitsbin_t* in, *out;
     int i;
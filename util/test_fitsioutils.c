@@ -7,14 +7,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "cutest.h"
 
 #include "qfits_header.h"
 #include "qfits_rw.h"
+#include "qfits_byteswap.h"
+#include "anqfits.h"
 
 #include "fitsioutils.h"
 #include "qfits_header.h"
+#include "index.h"
 
 static void expect(CuTest* tc, const char* header, const char* key, const char* val) {
     char buf[4096];
@@ -172,3 +177,243 @@ void test_write_long_string(CuTest* tc) {
 }
 
 
+
+void test_header_index(CuTest* tc) {
+    qfits_header* hdr;
+    char key[16];
+    char val[16];
+    int i;
+
+    hdr = qfits_header_default();
+    for (i=0; i<100; i++) {
+        sprintf(key, "KEY%i", i);
+        sprintf(val, "%i", i);
+        qfits_header_add(hdr, key, val, NULL, NULL);
+    }
+    // a duplicate: lookups find the first one.
+    qfits_header_add(hdr, "KEY7", "700", NULL, NULL);
+    for (i=0; i<100; i++) {
+        sprintf(key, "key%i", i);
+        CuAssertIntEquals(tc, i, qfits_header_getint(hdr, key, -1));
+    }
+    CuAssertPtrEquals(tc, NULL, qfits_header_getstr(hdr, "NOSUCH"));
+
+    // cards added after the index was built.
+    for (i=100; i<200; i++) {
+        sprintf(key, "KEY%i", i);
+        sprintf(val, "%i", i);
+        qfits_header_append(hdr, key, val, NULL, NULL);
+    }
+    CuAssertIntEquals(tc, 150, qfits_header_getint(hdr, "KEY150", -1));
+    CuAssertIntEquals(tc, 7, qfits_header_getint(hdr, "KEY7", -1));
+
+    // an earlier card with the same key hides the later ones.
+    qfits_header_add_after(hdr, "KEY3", "KEY7", "37", NULL, NULL);
+    CuAssertIntEquals(tc, 37, qfits_header_getint(hdr, "KEY7", -1));
+    qfits_header_del(hdr, "KEY7");
+    CuAssertIntEquals(tc, 7, qfits_header_getint(hdr, "KEY7", -1));
+    qfits_header_del(hdr, "KEY7");
+    CuAssertIntEquals(tc, 700, qfits_header_getint(hdr, "KEY7", -1));
+    qfits_header_mod(hdr, "KEY7", "7000", "comment");
+    CuAssertIntEquals(tc, 7000, qfits_header_getint(hdr, "KEY7", -1));
+    CuAssertStrEquals(tc, "comment", qfits_header_getcom(hdr, "KEY7"));
+    qfits_header_del(hdr, "KEY7");
+    CuAssertIntEquals(tc, -1, qfits_header_getint(hdr, "KEY7", -1));
+
+    qfits_header_destroy(hdr);
+}
+
+void test_swap_bytes_array(CuTest* tc) {
+    unsigned char a[200], b[200];
+    int sizes[] = { 2, 4, 8, 3 };
+    int s, i, n;
+
+    for (s=0; s<4; s++) {
+        int sz = sizes[s];
+        n = 199 / sz;
+        for (i=0; i<200; i++)
+            a[i] = b[i] = i * 7 + 1;
+        // (start one byte in, so the values are unaligned)
+        qfits_swap_bytes_array(a + 1, sz, n);
+        for (i=0; i<n; i++)
+            qfits_swap_bytes(b + 1 + i*sz, sz);
+        CuAssertIntEquals(tc, 0, memcmp(a, b, sizeof(a)));
+    }
+}
+
+void test_convert_data_packed(CuTest* tc) {
+    tfits_type pairs[][2] = {
+        { TFITS_BIN_TYPE_E, TFITS_BIN_TYPE_D },
+        { TFITS_BIN_TYPE_D, TFITS_BIN_TYPE_E },
+        { TFITS_BIN_TYPE_J, TFITS_BIN_TYPE_D },
+        { TFITS_BIN_TYPE_J, TFITS_BIN_TYPE_E },
+        { TFITS_BIN_TYPE_I, TFITS_BIN_TYPE_D },
+        { TFITS_BIN_TYPE_I, TFITS_BIN_TYPE_E },
+        { TFITS_BIN_TYPE_B, TFITS_BIN_TYPE_E },
+    };
+    int N = 37;
+    int p, i;
+
+    for (p=0; p<sizeof(pairs)/sizeof(pairs[0]); p++) {
+        tfits_type st = pairs[p][0], dt = pairs[p][1];
+        int ss = fits_get_atom_size(st);
+        int ds = fits_get_atom_size(dt);
+        double vals[37];
+        char src[37*8];
+        char spread[37*16];
+        char expect[37*16];
+        char packed[37*8];
+        char inplace[37*8];
+
+        for (i=0; i<N; i++)
+            vals[i] = (st == TFITS_BIN_TYPE_B) ? (i * 7) % 256 :
+                (i - 18) * 1234.567;
+        fits_convert_data(src, ss, st, vals, sizeof(double),
+                          TFITS_BIN_TYPE_D, 1, N);
+        // with gaps between the values, the generic code does it.
+        for (i=0; i<N; i++)
+            memcpy(spread + i*2*ss, src + i*ss, ss);
+        CuAssertIntEquals(tc, 0, fits_convert_data(expect, 2*ds, dt, spread, 2*ss,
+                                                   st, 1, N));
+        CuAssertIntEquals(tc, 0, fits_convert_data(packed, ds, dt, src, ss,
+                                                   st, 1, N));
+        for (i=0; i<N; i++)
+            CuAssertIntEquals(tc, 0, memcmp(packed + i*ds, expect + i*2*ds, ds));
+
+        // in place, the way fitstable reads columns.
+        memcpy(inplace, src, N*ss);
+        if (ds > ss)
+            fits_convert_data(inplace + (N-1)*ds, -ds, dt,
+                              inplace + (N-1)*ss, -ss, st, 1, N);
+        else
+            fits_convert_data(inplace, ds, dt, inplace, ss, st, 1, N);
+        CuAssertIntEquals(tc, 0, memcmp(packed, inplace, N*ds));
+    }
+}
+
+void test_datasum(CuTest* tc) {
+    unsigned char words[] = { 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x02,
+                              0x01, 0x02, 0x03, 0x04 };
+    // ones'-complement: the carry wraps around.
+    CuAssertIntEquals(tc, 2, fits_datasum(0, words, 8));
+    CuAssertIntEquals(tc, 0x01020306,
+                      fits_datasum(fits_datasum(0, words, 8), words + 8, 4));
+}
+
+void test_copy_aligned(CuTest* tc) {
+    const char* fn = "/tmp/test-fitsioutils-aligned.fits";
+    anqfits_t* anq;
+    index_t* ind;
+    FILE* fid;
+    int i, nchecked;
+    off_t off;
+
+    CuAssertIntEquals(tc, -1, fits_copy_aligned("../demo/index-4119.fits",
+                                                fn, 1000));
+    CuAssertIntEquals(tc, 0, fits_copy_aligned("../demo/index-4119.fits",
+                                               fn, 4096));
+    anq = anqfits_open(fn);
+    CuAssertPtrNotNull(tc, anq);
+    for (i=0; i<anqfits_n_ext(anq); i++)
+        if (anqfits_data_size(anq, i))
+            CuAssertIntEquals(tc, 0, anqfits_data_start(anq, i) % 4096);
+    off = anqfits_data_start(anq, 1);
+    anqfits_close(anq);
+
+    CuAssertIntEquals(tc, 0, fits_check_datasums(fn, &nchecked));
+    CuAssertTrue(tc, nchecked > 0);
+
+    // it's still an index.
+    ind = index_load(fn, 0, NULL);
+    CuAssertPtrNotNull(tc, ind);
+    CuAssertTrue(tc, index_nstars(ind) > 0);
+    index_free(ind);
+
+    // a flipped bit is caught.
+    fid = fopen(fn, "r+b");
+    CuAssertPtrNotNull(tc, fid);
+    CuAssertIntEquals(tc, 0, fseeko(fid, off + 5, SEEK_SET));
+    i = fgetc(fid);
+    CuAssertIntEquals(tc, 0, fseeko(fid, off + 5, SEEK_SET));
+    fputc(i ^ 0x10, fid);
+    fclose(fid);
+    CuAssertIntEquals(tc, 1, fits_check_datasums(fn, &nchecked));
+    unlink(fn);
+}
+
+// pixel (x, y) of plane p of the image written below, before scaling.
+static int16_t readpix_raw(int x, int y, int p) {
+    return (int16_t)(x + 7*y + 1000*p - 500);
+}
+
+void test_readpix_window(CuTest* tc) {
+    const char* fn = "/tmp/test-fitsioutils-readpix.fits";
+    int W = 100, H = 30, NP = 2;
+    qfits_header* hdr;
+    anqfits_t* anq;
+    FILE* fid;
+    float* f;
+    double* d;
+    int32_t* n;
+    int x, y, p, w, h;
+
+    hdr = qfits_header_default();
+    qfits_header_add(hdr, "BITPIX", "16", NULL, NULL);
+    qfits_header_add(hdr, "NAXIS", "3", NULL, NULL);
+    qfits_header_add(hdr, "NAXIS1", "100", NULL, NULL);
+    qfits_header_add(hdr, "NAXIS2", "30", NULL, NULL);
+    qfits_header_add(hdr, "NAXIS3", "2", NULL, NULL);
+    qfits_header_add(hdr, "BZERO", "32768", NULL, NULL);
+    qfits_header_add(hdr, "BSCALE", "0.5", NULL, NULL);
+    fid = fopen(fn, "wb");
+    CuAssertPtrNotNull(tc, fid);
+    CuAssertIntEquals(tc, 0, qfits_header_dump(hdr, fid));
+    qfits_header_destroy(hdr);
+    for (p=0; p<NP; p++)
+        for (y=0; y<H; y++)
+            for (x=0; x<W; x++) {
+                int16_t v = readpix_raw(x, y, p);
+                fputc((v >> 8) & 0xff, fid);
+                fputc(v & 0xff, fid);
+            }
+    CuAssertIntEquals(tc, 0, fits_pad_file(fid));
+    fclose(fid);
+
+    anq = anqfits_open(fn);
+    CuAssertPtrNotNull(tc, anq);
+
+    // a narrow cutout (read row by row) of the second plane.
+    f = anqfits_readpix(anq, 0, 10, 20, 5, 25, 1, PTYPE_FLOAT, NULL, &w, &h);
+    CuAssertPtrNotNull(tc, f);
+    CuAssertIntEquals(tc, 10, w);
+    CuAssertIntEquals(tc, 20, h);
+    for (y=0; y<h; y++)
+        for (x=0; x<w; x++)
+            CuAssertDblEquals(tc, 32768 + 0.5 * readpix_raw(x+10, y+5, 1),
+                              f[y*w + x], 1e-6);
+    free(f);
+
+    // a wide one (mapped).
+    d = anqfits_readpix(anq, 0, 0, 0, 3, 6, 1, PTYPE_DOUBLE, NULL, &w, &h);
+    CuAssertPtrNotNull(tc, d);
+    CuAssertIntEquals(tc, W, w);
+    CuAssertIntEquals(tc, 3, h);
+    for (y=0; y<h; y++)
+        for (x=0; x<w; x++)
+            CuAssertDblEquals(tc, 32768 + 0.5 * readpix_raw(x, y+3, 1),
+                              d[y*w + x], 1e-12);
+    free(d);
+
+    // the first plane, into a given buffer, as integers.
+    n = malloc(4 * 2 * sizeof(int32_t));
+    CuAssertPtrEquals(tc, n, anqfits_readpix(anq, 0, 50, 54, 0, 2, 0,
+                                             PTYPE_INT, n, &w, &h));
+    for (y=0; y<2; y++)
+        for (x=0; x<4; x++)
+            CuAssertIntEquals(tc, (int32_t)(32768 + 0.5 * readpix_raw(x+50, y, 0)),
+                              n[y*4 + x]);
+    free(n);
+
+    anqfits_close(anq);
+    unlink(fn);
+}
@@ -3,9 +3,15 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 #include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "os-features.h"
 
 #include "fitstable.h"
 #include "fitsioutils.h"
+#include "anqfits.h"
 #include "permutedsort.h"
 #include "an-endian.h"
 #include "qfits_header.h"
@@ -224,7 +230,7 @@ void test_copy_rows_inmemory(CuTest* ct) {
     printf("\n");
 
     printf("row0:  ");
-    print_hex(bl_access(t1->rows, 1), bl_datasize(t1->rows));
+    print_hex(t1->memrows + t1->memrowsize, t1->memrowsize);
     printf("\n");
 
     rtn = fitstable_switch_to_reading(t1);
@@ -456,6 +462,97 @@ void test_multi_headers(CuTest* ct) {
     CuAssertIntEquals(ct, fitstable_close(tab), 0);
 }
 
+static void write_many_extensions(CuTest* ct, const char* fn, int N) {
+    fitstable_t* outtab;
+    qfits_header* hdr;
+    tfits_type dubl = fitscolumn_double_type();
+    double x;
+    int i;
+
+    outtab = fitstable_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, outtab);
+    CuAssertIntEquals(ct, 0, fitstable_write_primary_header(outtab));
+    for (i=0; i<N; i++) {
+        if (i) {
+            fitstable_next_extension(outtab);
+            fitstable_clear_table(outtab);
+        }
+        fitstable_add_write_column(outtab, dubl, "X", "");
+        hdr = fitstable_get_header(outtab);
+        fits_header_add_int(hdr, "EXTNUM", i, NULL);
+        CuAssertIntEquals(ct, 0, fitstable_write_header(outtab));
+        // a different number of rows in each extension.
+        for (x=0; x<i % 500; x++)
+            CuAssertIntEquals(ct, 0, fitstable_write_row(outtab, &x));
+        CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+}
+
+void test_hdu_index(CuTest* ct) {
+    anqfits_t* scanned, *anq;
+    char* fn;
+    char idxfn[300];
+    fitstable_t* tab;
+    double* x;
+    int N = 1100;
+    int i, j;
+
+    fn = get_tmpfile(11);
+    sprintf(idxfn, "%s.hdus", fn);
+    remove(idxfn);
+    write_many_extensions(ct, fn, N);
+
+    scanned = anqfits_open(fn);
+    CuAssertPtrNotNull(ct, scanned);
+    CuAssertIntEquals(ct, N+1, anqfits_n_ext(scanned));
+    CuAssertIntEquals(ct, -1, access(idxfn, F_OK));
+
+    anqfits_set_hdu_index_enabled(1);
+    // the first open scans and writes the index, the second reads it.
+    for (j=0; j<2; j++) {
+        anq = anqfits_open(fn);
+        CuAssertPtrNotNull(ct, anq);
+        CuAssertIntEquals(ct, 0, access(idxfn, F_OK));
+        CuAssertIntEquals(ct, N+1, anqfits_n_ext(anq));
+        for (i=0; i<=N; i++) {
+            CuAssertIntEquals(ct, anqfits_header_start(scanned, i),
+                              anqfits_header_start(anq, i));
+            CuAssertIntEquals(ct, anqfits_header_size(scanned, i),
+                              anqfits_header_size(anq, i));
+            CuAssertIntEquals(ct, anqfits_data_start(scanned, i),
+                              anqfits_data_start(anq, i));
+            CuAssertIntEquals(ct, anqfits_data_size(scanned, i),
+                              anqfits_data_size(anq, i));
+        }
+        CuAssertIntEquals(ct, 1077, qfits_header_getint
+                          (anqfits_get_header_const(anq, 1078), "EXTNUM", -1));
+        anqfits_close(anq);
+    }
+    anqfits_close(scanned);
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+    CuAssertIntEquals(ct, 0, fitstable_open_extension(tab, 1099));
+    CuAssertIntEquals(ct, 1098 % 500, fitstable_nrows(tab));
+    x = fitstable_read_column(tab, "X", fitscolumn_double_type());
+    CuAssertPtrNotNull(ct, x);
+    for (i=0; i<fitstable_nrows(tab); i++)
+        CuAssertDblEquals(ct, i, x[i], 0.0);
+    free(x);
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+
+    // a rewritten file doesn't match its old index.
+    write_many_extensions(ct, fn, 10);
+    anq = anqfits_open(fn);
+    CuAssertPtrNotNull(ct, anq);
+    CuAssertIntEquals(ct, 11, anqfits_n_ext(anq));
+    anqfits_close(anq);
+
+    anqfits_set_hdu_index_enabled(0);
+    remove(idxfn);
+}
+
 void test_one_int_column_write_read(CuTest* ct) {
     fitstable_t* tab, *outtab;
     int i;
@@ -566,6 +663,150 @@ void test_two_columns_with_conversion(CuTest* ct) {
     CuAssertIntEquals(ct, 0, fitstable_close(tab));
 }
 
+void test_column_view(CuTest* ct) {
+    fitstable_t* tab, *outtab;
+    fitstable_view_t* view;
+    int i, j;
+    int N = 100;
+    uint8_t outf[N];
+    double outx[N];
+    const uint8_t* f;
+    const char* x;
+    int stride;
+    char* fn;
+
+    tfits_type u8 = fitscolumn_u8_type();
+    tfits_type dubl = fitscolumn_double_type();
+    tfits_type flt = fitscolumn_float_type();
+
+    fn = get_tmpfile(9);
+    outtab = fitstable_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, outtab);
+    fitstable_add_write_column(outtab, u8,   "F", "");
+    fitstable_add_write_column(outtab, dubl, "X", "");
+    CuAssertIntEquals(ct, 0, fitstable_write_primary_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_write_header(outtab));
+    for (i=0; i<N; i++) {
+        outf[i] = 3*i;
+        outx[i] = 0.5 * i;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(outtab, outf+i, outx+i));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+
+    CuAssertPtrEquals(ct, NULL, fitstable_view_column(tab, "NOPE", u8));
+
+    // bytes need no conversion: the view points into the file.
+    view = fitstable_view_column(tab, "F", u8);
+    CuAssertPtrNotNull(ct, view);
+    CuAssertIntEquals(ct, TRUE, fitstable_view_is_direct(view));
+    CuAssertIntEquals(ct, N, fitstable_view_nrows(view));
+    f = fitstable_view_rows(view, 0, N, &stride);
+    CuAssertPtrNotNull(ct, f);
+    CuAssertIntEquals(ct, fitstable_row_size(tab), stride);
+    for (i=0; i<N; i++)
+        CuAssertIntEquals(ct, outf[i], f[i * stride]);
+    CuAssertPtrEquals(ct, NULL, (void*)fitstable_view_rows(view, 90, 11, NULL));
+    fitstable_view_free(view);
+
+    // doubles, read as they are or converted, in blocks.
+    for (j=0; j<2; j++) {
+        view = fitstable_view_column(tab, "X", j ? flt : dubl);
+        CuAssertPtrNotNull(ct, view);
+        if (j)
+            CuAssertIntEquals(ct, FALSE, fitstable_view_is_direct(view));
+        for (i=0; i<N; i+=30) {
+            int k, n = MIN(30, N - i);
+            x = fitstable_view_rows(view, i, n, &stride);
+            CuAssertPtrNotNull(ct, x);
+            for (k=0; k<n; k++) {
+                double v;
+                if (j)
+                    v = *(const float*)(x + k * stride);
+                else
+                    // (a direct view's rows need not be aligned)
+                    memcpy(&v, x + k * stride, sizeof(double));
+                CuAssertDblEquals(ct, outx[i+k], v, 1e-12);
+            }
+        }
+        fitstable_view_free(view);
+    }
+
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+}
+
+void test_buffered_rows(CuTest* ct) {
+    fitstable_t* tab, *outtab;
+    int i, N = 300000;
+    int16_t a[3];
+    double x, y;
+    int16_t* ina;
+    double* inx;
+    double* iny;
+    double fix[10];
+    char* fn;
+
+    tfits_type i16 = TFITS_BIN_TYPE_I;
+    tfits_type dubl = fitscolumn_double_type();
+    tfits_type flt = fitscolumn_float_type();
+
+    // more rows than fit in one write buffer.
+    fn = get_tmpfile(10);
+    outtab = fitstable_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, outtab);
+    fitstable_add_write_column_array(outtab, i16, 3, "A", "");
+    fitstable_add_write_column(outtab, dubl, "X", "");
+    fitstable_add_write_column_convert(outtab, flt, dubl, "Y", "");
+    CuAssertIntEquals(ct, 0, fitstable_write_primary_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_write_header(outtab));
+    for (i=0; i<N; i++) {
+        a[0] = i;
+        a[1] = -i;
+        a[2] = i >> 8;
+        x = i * 0.5;
+        y = i * 2.0;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(outtab, a, &x, &y));
+    }
+    // overwrite some of the rows that are still buffered.
+    for (i=0; i<10; i++)
+        fix[i] = -1.0 - i;
+    CuAssertIntEquals(ct, 0, fitstable_write_one_column(outtab, 1, N-5, 5, fix,
+                                                        sizeof(double)));
+    CuAssertIntEquals(ct, 0, fitstable_write_one_column(outtab, 1, 7, 5, fix+5,
+                                                        sizeof(double)));
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+    CuAssertIntEquals(ct, N, fitstable_nrows(tab));
+    ina = fitstable_read_column_array(tab, "A", i16);
+    inx = fitstable_read_column(tab, "X", dubl);
+    iny = fitstable_read_column(tab, "Y", dubl);
+    CuAssertPtrNotNull(ct, ina);
+    CuAssertPtrNotNull(ct, inx);
+    CuAssertPtrNotNull(ct, iny);
+    for (i=0; i<N; i++) {
+        CuAssertIntEquals(ct, (int16_t)i, ina[3*i]);
+        CuAssertIntEquals(ct, (int16_t)-i, ina[3*i+1]);
+        CuAssertIntEquals(ct, (int16_t)(i >> 8), ina[3*i+2]);
+        if (i >= N-5)
+            CuAssertDblEquals(ct, fix[i - (N-5)], inx[i], 0.0);
+        else if (i >= 7 && i < 12)
+            CuAssertDblEquals(ct, fix[5 + i - 7], inx[i], 0.0);
+        else
+            CuAssertDblEquals(ct, i * 0.5, inx[i], 0.0);
+        CuAssertDblEquals(ct, i * 2.0, iny[i], 0.0);
+    }
+    free(ina);
+    free(inx);
+    free(iny);
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+}
+
 void test_arrays(CuTest* ct) {
     fitstable_t* tab, *outtab;
     int i;
@@ -994,6 +1235,68 @@ void test_inmemory_one_column_write_read(CuTest* ct) {
     CuAssertIntEquals(ct, 0, fitstable_close(tab));
 }
 
+void test_inmemory_contiguous_rows(CuTest* ct) {
+    fitstable_t* tab;
+    fitstable_view_t* view;
+    int i, N = 5000;
+    int32_t a;
+    double x;
+    char rows[3 * 12];
+    const char* px;
+    int stride;
+    tfits_type i32 = TFITS_BIN_TYPE_J;
+    tfits_type dubl = fitscolumn_double_type();
+
+    tab = fitstable_open_in_memory();
+    CuAssertPtrNotNull(ct, tab);
+    fitstable_add_write_column(tab, i32, "A", "");
+    fitstable_add_write_column(tab, dubl, "X", "");
+    CuAssertIntEquals(ct, 0, fitstable_write_primary_header(tab));
+    CuAssertIntEquals(ct, 0, fitstable_write_header(tab));
+    for (i=0; i<N; i++) {
+        a = i;
+        x = i * 0.25;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(tab, &a, &x));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(tab));
+    CuAssertIntEquals(ct, 0, fitstable_switch_to_reading(tab));
+    CuAssertIntEquals(ct, N, fitstable_nrows(tab));
+
+    // (in-memory rows are in FITS layout, but not byte-swapped)
+    CuAssertIntEquals(ct, 12, fitstable_row_size(tab));
+    CuAssertIntEquals(ct, 0, fitstable_read_nrows_data(tab, 4000, 3, rows));
+    for (i=0; i<3; i++) {
+        memcpy(&a, rows + i*12, sizeof(int32_t));
+        memcpy(&x, rows + i*12 + 4, sizeof(double));
+        CuAssertIntEquals(ct, 4000 + i, a);
+        CuAssertDblEquals(ct, (4000 + i) * 0.25, x, 0.0);
+    }
+
+    // no conversion needed: the view points at the rows themselves.
+    view = fitstable_view_column(tab, "X", dubl);
+    CuAssertPtrNotNull(ct, view);
+    CuAssertIntEquals(ct, TRUE, fitstable_view_is_direct(view));
+    px = fitstable_view_rows(view, 0, N, &stride);
+    CuAssertPtrNotNull(ct, px);
+    CuAssertIntEquals(ct, 12, stride);
+    for (i=0; i<N; i++) {
+        memcpy(&x, px + i * stride, sizeof(double));
+        CuAssertDblEquals(ct, i * 0.25, x, 0.0);
+    }
+    fitstable_view_free(view);
+
+    view = fitstable_view_column(tab, "A", dubl);
+    CuAssertPtrNotNull(ct, view);
+    CuAssertIntEquals(ct, FALSE, fitstable_view_is_direct(view));
+    px = fitstable_view_rows(view, 100, 10, &stride);
+    CuAssertPtrNotNull(ct, px);
+    for (i=0; i<10; i++)
+        CuAssertDblEquals(ct, 100 + i, *(const double*)(px + i * stride), 0.0);
+    fitstable_view_free(view);
+
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+}
+
 void test_inmemory_headers(CuTest* ct) {
     fitstable_t* tab;
     qfits_header* hdr;
@@ -1480,3 +1783,226 @@ void test_inmemory_struct_1(CuTest* ct) {
     CuAssertIntEquals(ct, 0, fitstable_close(tab));
 
 }
+
+static void check_permuted_rows(CuTest* ct, fitstable_t* tab, const int* perm,
+                                int N) {
+    int16_t* ina;
+    double* inx;
+    int i;
+    ina = fitstable_read_column_array(tab, "A", TFITS_BIN_TYPE_I);
+    inx = fitstable_read_column(tab, "X", fitscolumn_double_type());
+    CuAssertPtrNotNull(ct, ina);
+    CuAssertPtrNotNull(ct, inx);
+    for (i=0; i<N; i++) {
+        CuAssertIntEquals(ct, (int16_t)perm[i], ina[3*i]);
+        CuAssertIntEquals(ct, (int16_t)-perm[i], ina[3*i+1]);
+        CuAssertDblEquals(ct, perm[i] * 0.5, inx[i], 0.0);
+    }
+    free(ina);
+    free(inx);
+}
+
+static fitstable_t* open_rows_table(CuTest* ct, const char* fn) {
+    fitstable_t* tab;
+    tab = fn ? fitstable_open_for_writing(fn) : fitstable_open_in_memory();
+    CuAssertPtrNotNull(ct, tab);
+    fitstable_add_write_column_array(tab, TFITS_BIN_TYPE_I, 3, "A", "");
+    fitstable_add_write_column(tab, fitscolumn_double_type(), "X", "");
+    if (fn)
+        CuAssertIntEquals(ct, 0, fitstable_write_primary_header(tab));
+    CuAssertIntEquals(ct, 0, fitstable_write_header(tab));
+    return tab;
+}
+
+void test_copy_rows_parallel(CuTest* ct) {
+    fitstable_t* tab;
+    fitstable_t* outtab;
+    int i, nthreads, N = 100003;
+    int* perm;
+    int16_t a[3];
+    double x;
+    char* fn = strdup(get_tmpfile(11));
+    char* outfn = strdup(get_tmpfile(12));
+
+    outtab = open_rows_table(ct, fn);
+    for (i=0; i<N; i++) {
+        a[0] = i;
+        a[1] = -i;
+        a[2] = 0;
+        x = i * 0.5;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(outtab, a, &x));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+
+    perm = malloc(N * sizeof(int));
+    for (i=0; i<N; i++)
+        perm[i] = (int)(((int64_t)i * 7919) % N);
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+    for (nthreads=1; nthreads<=4; nthreads+=3) {
+        // file to file
+        outtab = open_rows_table(ct, outfn);
+        CuAssertIntEquals(ct, 0, fitstable_copy_rows_data_parallel(tab, perm, N, outtab, nthreads));
+        CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+        CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+        outtab = fitstable_open(outfn);
+        CuAssertPtrNotNull(ct, outtab);
+        CuAssertIntEquals(ct, N, fitstable_nrows(outtab));
+        check_permuted_rows(ct, outtab, perm, N);
+        CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+
+        // file to memory
+        outtab = open_rows_table(ct, NULL);
+        CuAssertIntEquals(ct, 0, fitstable_copy_rows_data_parallel(tab, perm, N, outtab, nthreads));
+        CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+        CuAssertIntEquals(ct, 0, fitstable_switch_to_reading(outtab));
+        CuAssertIntEquals(ct, N, fitstable_nrows(outtab));
+        check_permuted_rows(ct, outtab, perm, N);
+        CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+    free(perm);
+    free(fn);
+    free(outfn);
+}
+
+void test_flush(CuTest* ct) {
+    fitstable_t* tab;
+    int16_t a[3] = { 1, 2, 3 };
+    double x = 4.0;
+    off_t before;
+    char* fn = strdup(get_tmpfile(13));
+
+    tab = open_rows_table(ct, fn);
+    before = ftello(tab->fid);
+    CuAssertIntEquals(ct, 0, fitstable_write_row(tab, a, &x));
+    CuAssertIntEquals(ct, 0, fitstable_write_row(tab, a, &x));
+    // rows sit in the write buffer until flushed.
+    CuAssertIntEquals(ct, 0, fitstable_flush(tab));
+    CuAssertIntEquals(ct, (int)(before + 2 * fitstable_row_size(tab)),
+                      (int)ftello(tab->fid));
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(tab));
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+    free(fn);
+}
+
+void test_read_column_inds_into_stride(CuTest* ct) {
+    fitstable_t* tab, *outtab;
+    int i;
+    int N = 10;
+    int32_t outx[N];
+    double outy[N];
+    int inds[] = { 7, 2, 9 };
+    struct {
+        int32_t x;
+        float pad;
+        double y;
+        float yf;
+    } rows[4];
+    char* fn = strdup(get_tmpfile(14));
+    tfits_type i32 = TFITS_BIN_TYPE_J;
+    tfits_type dubl = fitscolumn_double_type();
+    tfits_type flt = fitscolumn_float_type();
+
+    outtab = fitstable_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, outtab);
+    fitstable_add_write_column(outtab, i32,  "X", NULL);
+    fitstable_add_write_column(outtab, dubl, "Y", NULL);
+    CuAssertIntEquals(ct, 0, fitstable_write_primary_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_write_header(outtab));
+    for (i=0; i<N; i++) {
+        outx[i] = 100 + i;
+        outy[i] = 0.5 * i;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(outtab, outx+i, outy+i));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(outtab));
+    CuAssertIntEquals(ct, 0, fitstable_close(outtab));
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+    for (i=0; i<4; i++)
+        rows[i].pad = -1;
+    // same type as the file, and converted; each into every sizeof(rows[0]).
+    CuAssertIntEquals(ct, 0, fitstable_read_column_inds_into
+                      (tab, "X", i32, &rows[0].x, sizeof(rows[0]), inds, 3));
+    CuAssertIntEquals(ct, 0, fitstable_read_column_inds_into
+                      (tab, "Y", dubl, &rows[0].y, sizeof(rows[0]), inds, 3));
+    CuAssertIntEquals(ct, 0, fitstable_read_column_inds_into
+                      (tab, "Y", flt, &rows[0].yf, sizeof(rows[0]), inds, 3));
+    for (i=0; i<3; i++) {
+        CuAssertIntEquals(ct, outx[inds[i]], rows[i].x);
+        CuAssertDblEquals(ct, outy[inds[i]], rows[i].y, 0.0);
+        CuAssertDblEquals(ct, outy[inds[i]], rows[i].yf, 0.0);
+        CuAssertDblEquals(ct, -1, rows[i].pad, 0.0);
+    }
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+    free(fn);
+}
+
+void test_gather_rows(CuTest* ct) {
+    fitstable_t* tab;
+    int i, k, nthreads, N = 20000, M = 5000;
+    int16_t a[3];
+    double x;
+    int* inds;
+    char* fn = strdup(get_tmpfile(15));
+
+    tab = open_rows_table(ct, fn);
+    for (i=0; i<N; i++) {
+        a[0] = i;
+        a[1] = -i;
+        a[2] = i % 7;
+        x = i * 0.5;
+        CuAssertIntEquals(ct, 0, fitstable_write_row(tab, a, &x));
+    }
+    CuAssertIntEquals(ct, 0, fitstable_fix_header(tab));
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+
+    // random order, with repeats and some runs of neighbours.
+    inds = malloc(M * sizeof(int));
+    srand(5);
+    for (i=0; i<M; i++)
+        inds[i] = (i % 10 < 3 && i) ? MIN(N-1, inds[i-1] + 1) : rand() % N;
+
+    tab = fitstable_open(fn);
+    CuAssertPtrNotNull(ct, tab);
+    for (nthreads=1; nthreads<=4; nthreads+=3) {
+        fitstable_gather_t* g;
+        int16_t *ga, *ra;
+        double *gx, *rx;
+        float* gxf;
+        int arr = 0;
+        g = fitstable_gather_rows(tab, inds, M, nthreads);
+        CuAssertPtrNotNull(ct, g);
+        CuAssertTrue(ct, fitstable_gather_nrows(g) < M);
+        ga = fitstable_gather_column(g, "A", TFITS_BIN_TYPE_I, &arr);
+        CuAssertIntEquals(ct, 3, arr);
+        gx = fitstable_gather_column(g, "X", fitscolumn_double_type(), NULL);
+        gxf = fitstable_gather_column(g, "X", fitscolumn_float_type(), NULL);
+        ra = fitstable_read_column_array_inds(tab, "A", TFITS_BIN_TYPE_I,
+                                              inds, M, NULL);
+        rx = fitstable_read_column_inds(tab, "X", fitscolumn_double_type(),
+                                        inds, M);
+        CuAssertPtrNotNull(ct, ga);
+        CuAssertPtrNotNull(ct, gx);
+        CuAssertPtrNotNull(ct, gxf);
+        CuAssertIntEquals(ct, 0, memcmp(ga, ra, M * 3 * sizeof(int16_t)));
+        CuAssertIntEquals(ct, 0, memcmp(gx, rx, M * sizeof(double)));
+        for (k=0; k<M; k++)
+            CuAssertTrue(ct, gxf[k] == (float)(inds[k] * 0.5));
+        CuAssertPtrEquals(ct, NULL, fitstable_gather_column(g, "NOPE",
+                                                            TFITS_BIN_TYPE_I,
+                                                            NULL));
+        free(ga);
+        free(ra);
+        free(gx);
+        free(rx);
+        free(gxf);
+        fitstable_gather_free(g);
+    }
+    CuAssertIntEquals(ct, 0, fitstable_close(tab));
+    free(inds);
+    free(fn);
+}
@@ -6,6 +6,8 @@
 #include <math.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "os-features.h"
 #include "cutest.h"
@@ -740,3 +742,152 @@ int main(int argc, char** args) {
     return 0;
 }
 #endif
+
+// The batch conversions must agree exactly with the one-point versions,
+// including on the region and quadrant boundaries.
+void test_healpix_arrays(CuTest* ct) {
+    int N = 20000;
+    double* ra = malloc(N * sizeof(double));
+    double* dec = malloc(N * sizeof(double));
+    double* xyz = malloc(3 * N * sizeof(double));
+    double* xyz2 = malloc(3 * N * sizeof(double));
+    int64_t* hps = malloc(N * sizeof(int64_t));
+    int64_t* hps2 = malloc(N * sizeof(int64_t));
+    int nsides[] = { 1, 3, 64, 1000, 1<<20 };
+    int i, k;
+
+    srand(31);
+    for (i=0; i<N; i++) {
+        switch (i % 4) {
+        case 0:
+            ra[i] = 360.0 * rand() / RAND_MAX;
+            dec[i] = 180.0 * rand() / RAND_MAX - 90.0;
+            break;
+        case 1:
+            // quadrant boundaries
+            ra[i] = 90.0 * (rand() % 5);
+            dec[i] = 180.0 * rand() / RAND_MAX - 90.0;
+            break;
+        case 2:
+            // near the polar-cap boundaries and the poles
+            ra[i] = 360.0 * rand() / RAND_MAX;
+            dec[i] = rad2deg(asin(2.0/3.0)) * ((rand() % 2) ? 1 : -1) +
+                1e-9 * (rand() % 3 - 1);
+            break;
+        default:
+            ra[i] = 360.0 * rand() / RAND_MAX;
+            dec[i] = (rand() % 2) ? 90.0 : -90.0;
+            break;
+        }
+        radecdeg2xyzarr(ra[i], dec[i], xyz + 3*i);
+    }
+    for (k=0; k<sizeof(nsides)/sizeof(int); k++) {
+        int nside = nsides[k];
+        xyzarrtohealpixl_array(xyz, N, nside, hps);
+        radecdegtohealpixl_array(ra, dec, N, nside, hps2);
+        for (i=0; i<N; i++) {
+            CuAssertTrue(ct, hps[i] == xyzarrtohealpixl(xyz + 3*i, nside));
+            CuAssertTrue(ct, hps2[i] == radecdegtohealpixl(ra[i], dec[i], nside));
+        }
+        healpixl_to_xyzarr_array(hps, N, nside, 0.25, 0.75, xyz2);
+        healpixl_to_radecdeg_array(hps, N, nside, 0.25, 0.75, ra, dec);
+        for (i=0; i<N; i++) {
+            double one[3], r, d;
+            healpixl_to_xyzarr(hps[i], nside, 0.25, 0.75, one);
+            CuAssertTrue(ct, memcmp(one, xyz2 + 3*i, sizeof(one)) == 0);
+            healpixl_to_radecdeg(hps[i], nside, 0.25, 0.75, &r, &d);
+            CuAssertTrue(ct, r == ra[i] && d == dec[i]);
+        }
+        // (ra,dec now hold healpix points, which the next nside checks too.)
+    }
+    free(ra);
+    free(dec);
+    free(xyz);
+    free(xyz2);
+    free(hps);
+    free(hps2);
+}
+
+static anbool in_ranges(ll* ranges, int64_t hp) {
+    size_t i;
+    for (i=0; i<ll_size(ranges); i+=2)
+        if (hp >= ll_get(ranges, i) && hp < ll_get(ranges, i+1))
+            return TRUE;
+    return FALSE;
+}
+
+void test_healpix_disc_ranges(CuTest* ct) {
+    double radii[] = { 0.3, 2.0, 17.0, 60.0, 130.0 };
+    int nsides[] = { 1, 7, 32 };
+    int i, k, t;
+    srand(5);
+    for (t=0; t<4; t++) {
+        double ra = 360.0 * rand() / RAND_MAX;
+        double dec = (t == 3) ? 90.0 : (180.0 * rand() / RAND_MAX - 90.0);
+        double xyz[3];
+        radecdeg2xyzarr(ra, dec, xyz);
+        for (k=0; k<sizeof(nsides)/sizeof(int); k++) {
+            int nside = nsides[k];
+            for (i=0; i<sizeof(radii)/sizeof(double); i++) {
+                ll* ranges = healpix_disc_ranges(xyz, radii[i], nside, NULL);
+                int64_t n = 0;
+                size_t j;
+                int hp;
+                // sorted, disjoint and merged
+                for (j=0; j+2<ll_size(ranges); j+=2)
+                    CuAssertTrue(ct, ll_get(ranges, j+1) < ll_get(ranges, j+2));
+                for (hp=0; hp<12*nside*nside; hp++) {
+                    anbool want = healpix_within_range_of_xyz(hp, nside, xyz, radii[i]);
+                    CuAssertIntEquals(ct, want, in_ranges(ranges, hp));
+                    n += want;
+                }
+                CuAssertTrue(ct, n == healpix_ranges_count(ranges));
+                ll_free(ranges);
+            }
+        }
+    }
+}
+
+void test_healpix_polygon_ranges(CuTest* ct) {
+    // a quadrilateral, counter-clockwise seen from outside
+    double radec[] = { 10, -5,  40, -8,  45, 30,  5, 20 };
+    double verts[12], normals[12];
+    int nside = 40;
+    double pixrad = deg2rad(2.0 * healpix_side_length_arcmin(nside) / 60.0);
+    ll* ranges;
+    int hp, i;
+    for (i=0; i<4; i++)
+        radecdeg2xyzarr(radec[2*i], radec[2*i+1], verts + 3*i);
+    for (i=0; i<4; i++) {
+        const double* a = verts + 3*i;
+        const double* b = verts + 3*((i+1)%4);
+        double* n = normals + 3*i;
+        double len;
+        n[0] = a[1]*b[2] - a[2]*b[1];
+        n[1] = a[2]*b[0] - a[0]*b[2];
+        n[2] = a[0]*b[1] - a[1]*b[0];
+        len = sqrt(square(n[0]) + square(n[1]) + square(n[2]));
+        n[0] /= len;
+        n[1] /= len;
+        n[2] /= len;
+    }
+    ranges = healpix_polygon_ranges(verts, 4, nside, NULL);
+    CuAssertTrue(ct, healpix_ranges_count(ranges) > 0);
+    for (hp=0; hp<12*nside*nside; hp++) {
+        double c[3];
+        anbool inside = TRUE, near = TRUE;
+        healpix_to_xyzarr(hp, nside, 0.5, 0.5, c);
+        for (i=0; i<4; i++) {
+            double s = c[0]*normals[3*i] + c[1]*normals[3*i+1] + c[2]*normals[3*i+2];
+            if (s < 0)
+                inside = FALSE;
+            if (s < -sin(pixrad))
+                near = FALSE;
+        }
+        if (inside)
+            CuAssertTrue(ct, in_ranges(ranges, hp));
+        if (in_ranges(ranges, hp))
+            CuAssertTrue(ct, near);
+    }
+    ll_free(ranges);
+}
@@ -0,0 +1,184 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cutest.h"
+#include "index.h"
+#include "starkd.h"
+
+#define NTHREADS 8
+
+static void* acquire_and_search(void* arg) {
+    index_t* ind = arg;
+    double xyz[3];
+    long ok = 0;
+    int i;
+    for (i=0; i<20; i++) {
+        if (index_acquire(ind))
+            return NULL;
+        if (startree_get(ind->starkd, i, xyz) == 0)
+            ok++;
+        index_release(ind);
+    }
+    return (void*)ok;
+}
+
+void test_index_acquire_release(CuTest* ct) {
+    index_t* ind;
+
+    ind = index_load("../demo/index-4119.fits", INDEX_ONLY_LOAD_METADATA, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    CuAssertPtrEquals(ct, NULL, ind->starkd);
+
+    CuAssertIntEquals(ct, 0, index_acquire(ind));
+    CuAssertPtrNotNull(ct, ind->starkd);
+    CuAssertPtrNotNull(ct, ind->codekd);
+    CuAssertPtrNotNull(ct, ind->quads);
+    CuAssertIntEquals(ct, 0, index_acquire(ind));
+    CuAssertIntEquals(ct, 2, ind->refcount);
+
+    index_release(ind);
+    CuAssertPtrNotNull(ct, ind->starkd);
+    index_release(ind);
+    // loaded by index_acquire(), so unloaded with the last reference.
+    CuAssertIntEquals(ct, 0, ind->refcount);
+    CuAssertPtrEquals(ct, NULL, ind->starkd);
+    CuAssertPtrEquals(ct, NULL, ind->codekd);
+
+    index_free(ind);
+}
+
+void test_index_acquire_loaded(CuTest* ct) {
+    index_t* ind;
+
+    // a fully-loaded index stays loaded.
+    ind = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    CuAssertIntEquals(ct, 0, index_acquire(ind));
+    index_release(ind);
+    CuAssertPtrNotNull(ct, ind->starkd);
+    CuAssertPtrNotNull(ct, ind->codekd);
+    index_free(ind);
+}
+
+void test_index_acquire_threads(CuTest* ct) {
+    index_t* ind;
+    pthread_t threads[NTHREADS];
+    int i;
+
+    ind = index_load("../demo/index-4119.fits", INDEX_ONLY_LOAD_METADATA, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    for (i=0; i<NTHREADS; i++)
+        CuAssertIntEquals(ct, 0, pthread_create(threads + i, NULL,
+                                                acquire_and_search, ind));
+    for (i=0; i<NTHREADS; i++) {
+        void* ok;
+        pthread_join(threads[i], &ok);
+        CuAssertIntEquals(ct, 20, (int)(long)ok);
+    }
+    CuAssertIntEquals(ct, 0, ind->refcount);
+    CuAssertPtrEquals(ct, NULL, ind->starkd);
+    index_free(ind);
+}
+
+void test_startree_search_into(CuTest* ct) {
+    index_t* ind;
+    startree_results_t res;
+    int k;
+
+    ind = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    memset(&res, 0, sizeof(res));
+    // the same buffers, reused for searches of different sizes.
+    for (k=0; k<8; k++) {
+        double center[3];
+        double *xyz, *radec;
+        int *inds;
+        int i, N;
+        double r2 = 1e-4 * (1 + (k % 4) * 10);
+        startree_get(ind->starkd, k * 37, center);
+        startree_search_for(ind->starkd, center, r2, &xyz, &radec, &inds, &N);
+        CuAssertIntEquals(ct, N, startree_search_into(ind->starkd, center, r2,
+                                                      (k % 2), &res));
+        CuAssertIntEquals(ct, N, res.N);
+        CuAssertTrue(ct, N > 0);
+        CuAssertTrue(ct, res.capacity >= N);
+        CuAssertIntEquals(ct, 0, memcmp(xyz, res.xyz, N * 3 * sizeof(double)));
+        CuAssertIntEquals(ct, 0, memcmp(inds, res.inds, N * sizeof(int)));
+        if (k % 2)
+            for (i=0; i<2*N; i++)
+                CuAssertDblEquals(ct, radec[i], res.radec[i], 1e-12);
+        free(xyz);
+        free(radec);
+        free(inds);
+    }
+    startree_results_free_data(&res);
+    CuAssertPtrEquals(ct, NULL, res.xyz);
+    index_free(ind);
+}
+
+void test_index_residency(CuTest* ct) {
+    index_t* inds[3];
+    index_residency_stats_t st;
+    int64_t hits0, misses0;
+    size_t bytes;
+    int i;
+
+    for (i=0; i<3; i++) {
+        inds[i] = index_load("../demo/index-4119.fits", INDEX_ONLY_LOAD_METADATA, NULL);
+        CuAssertPtrNotNull(ct, inds[i]);
+    }
+    index_residency_get_stats(&st);
+    hits0 = st.hits;
+    misses0 = st.misses;
+    // room for two of the three.
+    bytes = 144000;
+    index_residency_set_budget(2 * bytes + bytes / 2, INDEX_RESIDENCY_LRU);
+
+    for (i=0; i<2; i++) {
+        CuAssertIntEquals(ct, 0, index_acquire(inds[i]));
+        index_release(inds[i]);
+    }
+    // both stay loaded; using 0 again makes 1 the least recently used.
+    CuAssertPtrNotNull(ct, inds[0]->starkd);
+    CuAssertPtrNotNull(ct, inds[1]->starkd);
+    CuAssertIntEquals(ct, 0, index_acquire(inds[0]));
+    index_release(inds[0]);
+    CuAssertIntEquals(ct, 0, index_acquire(inds[2]));
+    index_release(inds[2]);
+    CuAssertPtrNotNull(ct, inds[0]->starkd);
+    CuAssertPtrEquals(ct, NULL, inds[1]->starkd);
+    CuAssertPtrNotNull(ct, inds[2]->starkd);
+
+    index_residency_get_stats(&st);
+    CuAssertIntEquals(ct, 2, st.nresident);
+    CuAssertIntEquals(ct, 2 * bytes, st.resident_bytes);
+    CuAssertIntEquals(ct, 1, st.evictions);
+    // (the hit was index 0's second use)
+    CuAssertIntEquals(ct, 1, st.hits - hits0);
+    CuAssertIntEquals(ct, 3, st.misses - misses0);
+
+    // by solves: index 2 has solved a field, so 0 goes.
+    index_residency_set_budget(2 * bytes + bytes / 2, INDEX_RESIDENCY_SOLVES);
+    index_residency_solved(inds[2]);
+    CuAssertIntEquals(ct, 0, index_acquire(inds[1]));
+    index_release(inds[1]);
+    CuAssertPtrEquals(ct, NULL, inds[0]->starkd);
+    CuAssertPtrNotNull(ct, inds[1]->starkd);
+    CuAssertPtrNotNull(ct, inds[2]->starkd);
+
+    // freeing a resident index drops it; no budget unloads the rest.
+    index_free(inds[1]);
+    index_residency_set_budget(0, INDEX_RESIDENCY_LRU);
+    CuAssertPtrEquals(ct, NULL, inds[2]->starkd);
+    index_residency_get_stats(&st);
+    CuAssertIntEquals(ct, 0, st.nresident);
+    CuAssertIntEquals(ct, 0, st.resident_bytes);
+    index_free(inds[0]);
+    index_free(inds[2]);
+}
@@ -0,0 +1,133 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "index.h"
+#include "index-heatmap.h"
+#include "starkd.h"
+#include "ioutils.h"
+
+static uint64_t total(const index_heatmap_file_t* hf, int a) {
+    uint64_t sum = 0;
+    int64_t b;
+    for (b=0; b<hf->nblocks[a]; b++)
+        sum += hf->counts[a][b];
+    return sum;
+}
+
+void test_index_heatmap(CuTest* ct) {
+    char* dir = create_temp_dir("heat", "/tmp");
+    index_t* ind;
+    index_heatmap_file_t* hf;
+    char* fn;
+    int stars[] = { 0, 1, 2, 5, 100 };
+    int i;
+
+    CuAssertPtrNotNull(ct, dir);
+    CuAssertIntEquals(ct, 0, index_heatmap_set_dir(dir, 1));
+
+    // metadata-only loads don't write a heatmap.
+    ind = index_load("../demo/index-4119.fits", INDEX_ONLY_LOAD_METADATA, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    CuAssertPtrEquals(ct, NULL, ind->heatmap);
+    fn = index_heatmap_filename(dir, ind->indexfn);
+    CuAssertIntEquals(ct, 0, file_exists(fn));
+
+    for (i=0; i<2; i++) {
+        CuAssertIntEquals(ct, 0, index_reload(ind));
+        CuAssertPtrNotNull(ct, ind->heatmap);
+        CuAssertPtrEquals(ct, ind->heatmap, ind->starkd->heatmap);
+        index_heatmap_touch_quad(ind->heatmap, 0);
+        index_heatmap_touch_quad(ind->heatmap, ind->nquads - 1);
+        index_heatmap_touch_stars(ind->heatmap, stars, 5);
+        index_unload(ind);
+        CuAssertPtrEquals(ct, NULL, ind->heatmap);
+    }
+
+    // the second unload added to the first one's counts.
+    hf = index_heatmap_read(fn);
+    CuAssertPtrNotNull(ct, hf);
+    CuAssertIntEquals(ct, 6, (int)hf->samples);
+    CuAssertIntEquals(ct, ind->nquads, (int)hf->nrecords[INDEX_HEAT_QUADS]);
+    CuAssertIntEquals(ct, 4, (int)total(hf, INDEX_HEAT_QUADS));
+    CuAssertIntEquals(ct, 2, (int)hf->counts[INDEX_HEAT_QUADS][0]);
+    CuAssertIntEquals(ct, 10, (int)total(hf, INDEX_HEAT_STARS));
+    CuAssertTrue(ct, hf->offset[INDEX_HEAT_QUADS] > 0);
+    CuAssertTrue(ct, hf->ntables > 0);
+    // the roots: every quad's code, and every star.
+    CuAssertIntEquals(ct, 4, (int)hf->counts[INDEX_HEAT_CODEKD][0]);
+    CuAssertIntEquals(ct, 10, (int)hf->counts[INDEX_HEAT_STARKD][0]);
+    index_heatmap_file_free(hf);
+
+    index_free(ind);
+    CuAssertIntEquals(ct, 0, index_heatmap_set_dir(NULL, 1));
+    unlink(fn);
+    free(fn);
+    asprintf_safe(&fn, "%s/index-4119.fits.heat.lock", dir);
+    unlink(fn);
+    free(fn);
+    rmdir(dir);
+    free(dir);
+}
+
+void test_index_heatmap_sampled(CuTest* ct) {
+    char* dir = create_temp_dir("heat", "/tmp");
+    index_t* ind;
+    index_heatmap_file_t* hf;
+    char* fn;
+    int i;
+
+    CuAssertIntEquals(ct, 0, index_heatmap_set_dir(dir, 4));
+    ind = index_load("../demo/index-4119.fits", 0, NULL);
+    CuAssertPtrNotNull(ct, ind);
+    for (i=0; i<100; i++)
+        index_heatmap_touch_quad(ind->heatmap, i);
+    fn = index_heatmap_filename(dir, ind->indexfn);
+    index_free(ind);
+
+    // one in four sampled, counted four times.
+    hf = index_heatmap_read(fn);
+    CuAssertPtrNotNull(ct, hf);
+    CuAssertIntEquals(ct, 4, hf->rate);
+    CuAssertIntEquals(ct, 100, (int)hf->samples);
+    CuAssertIntEquals(ct, 100, (int)total(hf, INDEX_HEAT_QUADS));
+    index_heatmap_file_free(hf);
+
+    CuAssertIntEquals(ct, 0, index_heatmap_set_dir(NULL, 1));
+    unlink(fn);
+    free(fn);
+    asprintf_safe(&fn, "%s/index-4119.fits.heat.lock", dir);
+    unlink(fn);
+    free(fn);
+    rmdir(dir);
+    free(dir);
+}
+
+void test_index_heatmap_hot_list(CuTest* ct) {
+    char* fn = create_temp_file("hot", "/tmp");
+    FILE* fid;
+    int64_t* ranges;
+
+    fid = fopen(fn, "w");
+    fprintf(fid, "# a hot list\n0 4096\n\n8192 12288\n");
+    fclose(fid);
+    CuAssertIntEquals(ct, 2, index_heatmap_read_hot_list(fn, &ranges));
+    CuAssertIntEquals(ct, 0, (int)ranges[0]);
+    CuAssertIntEquals(ct, 4096, (int)ranges[1]);
+    CuAssertIntEquals(ct, 8192, (int)ranges[2]);
+    CuAssertIntEquals(ct, 12288, (int)ranges[3]);
+    free(ranges);
+
+    fid = fopen(fn, "w");
+    fprintf(fid, "0 x\n");
+    fclose(fid);
+    CuAssertIntEquals(ct, -1, index_heatmap_read_hot_list(fn, &ranges));
+    unlink(fn);
+    free(fn);
+}
@@ -0,0 +1,143 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "index-lookup.h"
+#include "index-coverage.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "healpix.h"
+#include "bl.h"
+
+void test_index_lookup_matches_brute_force(CuTest* ct) {
+    // power-of-two, odd and all-sky Nsides.
+    int nsides[] = { 1, 2, 4, 3, 32, -1 };
+    int nn = sizeof(nsides) / sizeof(int);
+    pl* indexes = pl_new(256);
+    index_lookup_t* lookup;
+    index_t* inds;
+    int N = 0;
+    int i, j, k;
+
+    srand(42);
+    inds = calloc(nn * 100, sizeof(index_t));
+    for (i=0; i<nn; i++) {
+        int nside = nsides[i];
+        int npix = (nside == -1) ? 1 : 12 * nside * nside;
+        for (j=0; j<MIN(npix, 100); j++) {
+            index_t* ind = inds + N;
+            ind->hpnside = (nside == -1) ? 1 : nside;
+            ind->healpix = (nside == -1) ? -1 : (rand() % npix);
+            pl_append(indexes, ind);
+            N++;
+        }
+    }
+
+    lookup = index_lookup_new(indexes);
+    for (k=0; k<500; k++) {
+        double ra = 360.0 * rand() / (double)RAND_MAX;
+        double dec = 180.0 * rand() / (double)RAND_MAX - 90.0;
+        double radius = 20.0 * rand() / (double)RAND_MAX;
+        il* got = il_new(16);
+        il* want = il_new(16);
+        if (k == 0) {
+            ra = 0.0;
+            dec = 90.0;
+        }
+        index_lookup_search(lookup, ra, dec, radius, got);
+        for (i=0; i<N; i++)
+            if (index_is_within_range(pl_get(indexes, i), ra, dec, radius))
+                il_append(want, i);
+        CuAssertIntEquals(ct, il_size(want), il_size(got));
+        for (i=0; i<il_size(want); i++)
+            CuAssertIntEquals(ct, il_get(want, i), il_get(got, i));
+        il_free(got);
+        il_free(want);
+    }
+    index_lookup_free(lookup);
+    pl_free(indexes);
+    free(inds);
+}
+
+// Indexes whose stars fill only part of their tiles: the lookup still
+// agrees with index_is_within_range(), and never drops an index with a
+// star within the search radius.
+void test_index_lookup_coverage(CuTest* ct) {
+    pl* indexes = pl_new(64);
+    index_lookup_t* lookup;
+    index_t* inds;
+    double* stars;
+    int nper = 50;
+    int N = 40;
+    int i, j, k;
+
+    srand(17);
+    inds = calloc(N, sizeof(index_t));
+    stars = malloc(N * nper * 3 * sizeof(double));
+    for (i=0; i<N; i++) {
+        index_t* ind = inds + i;
+        // a clump of stars within a degree of a random point.
+        double ra = 360.0 * rand() / (double)RAND_MAX;
+        double dec = 180.0 * rand() / (double)RAND_MAX - 90.0;
+        ll* ranges;
+        for (j=0; j<nper; j++)
+            radecdeg2xyzarr(ra + (rand() / (double)RAND_MAX - 0.5) / MAX(cos(deg2rad(dec)), 0.1),
+                            MIN(90.0, MAX(-90.0, dec + rand() / (double)RAND_MAX - 0.5)),
+                            stars + 3*(i*nper + j));
+        // half all-sky, half in an Nside=2 tile.
+        ind->hpnside = (i % 2) ? 2 : 1;
+        ind->healpix = (i % 2) ? xyzarrtohealpix(stars + 3*i*nper, 2) : -1;
+        ind->covnside = index_coverage_nside(3600.0);
+        ranges = index_coverage_from_xyz(stars + 3*i*nper, nper, ind->covnside);
+        ind->ncoverage = ll_size(ranges) / 2;
+        ind->coverage = malloc(ll_size(ranges) * sizeof(int64_t));
+        ll_copy(ranges, 0, ll_size(ranges), ind->coverage);
+        ll_free(ranges);
+        pl_append(indexes, ind);
+    }
+    CuAssertIntEquals(ct, 32, inds[0].covnside);
+
+    lookup = index_lookup_new(indexes);
+    for (k=0; k<100; k++) {
+        double xyz[3];
+        double ra = 360.0 * rand() / (double)RAND_MAX;
+        double dec = 180.0 * rand() / (double)RAND_MAX - 90.0;
+        double radius = 30.0 * rand() / (double)RAND_MAX;
+        il* got = il_new(16);
+        il* want = il_new(16);
+        radecdeg2xyzarr(ra, dec, xyz);
+        index_lookup_search(lookup, ra, dec, radius, got);
+        for (i=0; i<N; i++) {
+            if (index_is_within_range(pl_get(indexes, i), ra, dec, radius))
+                il_append(want, i);
+            for (j=0; j<nper; j++)
+                if (distsq2deg(distsq(xyz, stars + 3*(i*nper + j), 3)) <= radius)
+                    break;
+            if (j < nper)
+                CuAssert(ct, "index with a star in range", il_contains(got, i));
+        }
+        CuAssertIntEquals(ct, il_size(want), il_size(got));
+        for (i=0; i<il_size(want); i++)
+            CuAssertIntEquals(ct, il_get(want, i), il_get(got, i));
+        il_free(got);
+        il_free(want);
+    }
+    // the clumps are small, so most searches skip most of the indexes.
+    {
+        il* got = il_new(16);
+        index_lookup_search(lookup, 0.0, 0.0, 1.0, got);
+        CuAssertTrue(ct, il_size(got) < N / 2);
+        il_free(got);
+    }
+    index_lookup_free(lookup);
+    for (i=0; i<N; i++)
+        free(inds[i].coverage);
+    pl_free(indexes);
+    free(inds);
+    free(stars);
+}
@@ -0,0 +1,115 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "index.h"
+#include "index-coverage.h"
+#include "fitsioutils.h"
+#include "ioutils.h"
+#include "bl.h"
+
+static void assert_meta_equal(CuTest* ct, const index_t* a, const index_t* b) {
+    CuAssertIntEquals(ct, a->indexid, b->indexid);
+    CuAssertIntEquals(ct, a->healpix, b->healpix);
+    CuAssertIntEquals(ct, a->hpnside, b->hpnside);
+    CuAssertDblEquals(ct, a->index_jitter, b->index_jitter, 0.0);
+    CuAssertIntEquals(ct, a->cutnside, b->cutnside);
+    CuAssertIntEquals(ct, a->cutnsweep, b->cutnsweep);
+    CuAssertDblEquals(ct, a->cutdedup, b->cutdedup, 0.0);
+    CuAssertIntEquals(ct, a->cutmargin, b->cutmargin);
+    CuAssertIntEquals(ct, a->circle, b->circle);
+    CuAssertIntEquals(ct, a->cx_less_than_dx, b->cx_less_than_dx);
+    CuAssertIntEquals(ct, a->meanx_less_than_half, b->meanx_less_than_half);
+    CuAssertDblEquals(ct, a->index_scale_upper, b->index_scale_upper, 0.0);
+    CuAssertDblEquals(ct, a->index_scale_lower, b->index_scale_lower, 0.0);
+    CuAssertIntEquals(ct, a->dimquads, b->dimquads);
+    CuAssertIntEquals(ct, a->nstars, b->nstars);
+    CuAssertIntEquals(ct, a->nquads, b->nquads);
+    CuAssertStrEquals(ct, a->indexfn, b->indexfn);
+    CuAssertIntEquals(ct, !a->skdtfn, !b->skdtfn);
+    if (a->skdtfn)
+        CuAssertStrEquals(ct, a->skdtfn, b->skdtfn);
+    CuAssertIntEquals(ct, a->skdt_nstars, b->skdt_nstars);
+    CuAssertIntEquals(ct, a->stratum, b->stratum);
+    CuAssertIntEquals(ct, a->nstrata, b->nstrata);
+    CuAssertIntEquals(ct, a->covnside, b->covnside);
+    CuAssertIntEquals(ct, a->ncoverage, b->ncoverage);
+    CuAssertIntEquals(ct, !a->coverage, !b->coverage);
+    if (a->coverage)
+        CuAssertIntEquals(ct, 0, memcmp(a->coverage, b->coverage,
+                                        2 * a->ncoverage * sizeof(int64_t)));
+}
+
+void test_index_manifest(CuTest* ct) {
+    char* dir;
+    char* indfn;
+    char* otherfn;
+    char* manfn;
+    index_t* ind;
+    index_t* direct;
+    pl* inds;
+    int pass;
+    FILE* f;
+
+    dir = create_temp_dir("test_index_manifest", "/tmp");
+    CuAssertPtrNotNull(ct, dir);
+    asprintf_safe(&indfn, "%s/index-4119.fits", dir);
+    asprintf_safe(&otherfn, "%s/README", dir);
+    asprintf_safe(&manfn, "%s/%s", dir, INDEX_MANIFEST_FILENAME);
+    CuAssertIntEquals(ct, 0, copy_file("../demo/index-4119.fits", indfn));
+    {
+        // give the copy a coverage map.
+        int64_t cov[] = { 10, 20, 100, 101 };
+        ll* ranges = ll_new(4);
+        ll_append_array(ranges, cov, 4);
+        f = fopen(indfn, "r+b");
+        CuAssertIntEquals(ct, 0, index_coverage_write_to(ranges, 4, f));
+        CuAssertIntEquals(ct, 0, fits_pad_file(f));
+        fclose(f);
+        ll_free(ranges);
+    }
+    f = fopen(otherfn, "w");
+    fprintf(f, "not an index\n");
+    fclose(f);
+
+    direct = index_load(indfn, INDEX_ONLY_LOAD_METADATA, NULL);
+    CuAssertPtrNotNull(ct, direct);
+    CuAssertIntEquals(ct, 4, direct->covnside);
+    CuAssertIntEquals(ct, 2, direct->ncoverage);
+    CuAssertPtrNotNull(ct, direct->coverage);
+    CuAssertTrue(ct, direct->coverage[2] == 100);
+
+    // first pass writes the manifest; second reads it.
+    for (pass=0; pass<2; pass++) {
+        inds = pl_new(4);
+        CuAssertIntEquals(ct, 0, index_manifest_scan(dir, INDEX_MANIFEST_UPDATE, inds));
+        CuAssertIntEquals(ct, 1, pl_size(inds));
+        CuAssert(ct, "manifest written", file_exists(manfn));
+        ind = pl_get(inds, 0);
+        CuAssertPtrEquals(ct, NULL, ind->fits);
+        assert_meta_equal(ct, direct, ind);
+        if (pass == 1) {
+            // the index can be opened from its manifest entry.
+            CuAssertIntEquals(ct, 0, index_reload(ind));
+            CuAssertIntEquals(ct, direct->nquads, index_nquads(ind));
+        }
+        index_free(ind);
+        pl_free(inds);
+    }
+
+    index_free(direct);
+    unlink(indfn);
+    unlink(otherfn);
+    unlink(manfn);
+    rmdir(dir);
+    free(indfn);
+    free(otherfn);
+    free(manfn);
+    free(dir);
+}
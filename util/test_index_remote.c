@@ -0,0 +1,156 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "index.h"
+#include "index-remote.h"
+#include "ioutils.h"
+#include "bl.h"
+
+#define CHUNK 10000
+
+static anbool files_equal(const char* fn1, const char* fn2) {
+    size_t n1, n2;
+    char* d1 = file_get_contents(fn1, &n1, FALSE);
+    char* d2 = file_get_contents(fn2, &n2, FALSE);
+    anbool eq = d1 && d2 && (n1 == n2) && !memcmp(d1, d2, n1);
+    free(d1);
+    free(d2);
+    return eq;
+}
+
+static void free_indexes(pl* inds) {
+    size_t i;
+    for (i=0; i<pl_size(inds); i++)
+        index_free(pl_get(inds, i));
+    pl_free(inds);
+}
+
+void test_index_remote(CuTest* ct) {
+    char* remote = create_temp_dir("test_index_remote", "/tmp");
+    char* cache = create_temp_dir("test_index_remote_cache", "/tmp");
+    char* url;
+    char* fna;
+    char* fnb;
+    char* cachea;
+    char* cacheb;
+    char* part;
+    char* chunks;
+    char* cmd;
+    char* data;
+    size_t len;
+    index_remote_t* r;
+    pl* inds;
+    index_t* ind;
+    FILE* f;
+    int i;
+
+    CuAssertPtrNotNull(ct, remote);
+    CuAssertPtrNotNull(ct, cache);
+    asprintf_safe(&url, "file://%s", remote);
+    asprintf_safe(&fna, "%s/index-a.fits", remote);
+    asprintf_safe(&fnb, "%s/index-b.fits", remote);
+    asprintf_safe(&cachea, "%s/index-a.fits", cache);
+    asprintf_safe(&cacheb, "%s/index-b.fits", cache);
+    CuAssertIntEquals(ct, 0, copy_file("../demo/index-4119.fits", fna));
+    CuAssertIntEquals(ct, 0, copy_file("../demo/index-4119.fits", fnb));
+    CuAssertIntEquals(ct, 0, index_manifest_scan(remote, INDEX_MANIFEST_UPDATE,
+                                                 NULL));
+
+    // room for one file, not two.
+    r = index_remote_open(url, cache, 200000);
+    CuAssertPtrNotNull(ct, r);
+    index_remote_set_chunks(r, CHUNK, 3);
+    inds = pl_new(4);
+    CuAssertIntEquals(ct, 0, index_remote_list(r, inds));
+    CuAssertIntEquals(ct, 2, pl_size(inds));
+    ind = pl_get(inds, 0);
+    CuAssertPtrEquals(ct, NULL, ind->fits);
+    CuAssert(ct, "not downloaded yet", !file_exists(cachea));
+
+    // loading it downloads it.
+    CuAssertIntEquals(ct, 0, index_reload(ind));
+    CuAssert(ct, "downloaded", files_equal(fna, ind->indexfn));
+    CuAssertIntEquals(ct, 4119, ind->indexid);
+
+    // ... and loading the other evicts the first.
+    ind = pl_get(inds, 1);
+    CuAssertIntEquals(ct, 0, index_reload(ind));
+    CuAssert(ct, "downloaded", files_equal(fnb, ind->indexfn));
+    CuAssert(ct, "evicted", !file_exists(cachea));
+    free_indexes(inds);
+    index_remote_close(r);
+
+    /*
+     An interrupted download of index-a: all chunks but the first are
+     done.  Scribble on the remote copy after the first chunk, so that a
+     re-download of those chunks would show.
+     */
+    data = file_get_contents(fna, &len, FALSE);
+    CuAssertPtrNotNull(ct, data);
+    asprintf_safe(&part, "%s.part", cachea);
+    asprintf_safe(&chunks, "%s.chunks", cachea);
+    f = fopen(part, "wb");
+    memset(data, 0, CHUNK);
+    fwrite(data, 1, len, f);
+    fclose(f);
+    f = fopen(chunks, "wb");
+    for (i=0; i<(int)((len + CHUNK - 1) / CHUNK); i++)
+        fputc(i > 0, f);
+    fclose(f);
+    free(data);
+    asprintf_safe(&cmd, "cp %s %s.orig && dd if=/dev/zero of=%s bs=1 "
+                  "seek=%i count=100 conv=notrunc 2>/dev/null",
+                  fna, fna, fna, CHUNK);
+    CuAssertIntEquals(ct, 0, system(cmd));
+    free(cmd);
+
+    r = index_remote_open(url, cache, 0);
+    CuAssertPtrNotNull(ct, r);
+    index_remote_set_chunks(r, CHUNK, 2);
+    CuAssertIntEquals(ct, 0, index_remote_fetch(r, cachea));
+    CuAssert(ct, "resumed", !file_exists(part) && !file_exists(chunks));
+    asprintf_safe(&cmd, "%s.orig", fna);
+    CuAssert(ct, "resumed", files_equal(cmd, cachea));
+    unlink(cmd);
+    free(cmd);
+
+    // both have been used: prefetching brings back index-b (evicted
+    // above).
+    CuAssertIntEquals(ct, 2, index_remote_prefetch(r, 5));
+    for (i=0; i<100 && !file_exists(cacheb); i++)
+        usleep(100000);
+    index_remote_close(r);
+    CuAssert(ct, "prefetched", files_equal(fnb, cacheb));
+
+    // without the remote manifest, the cached copy is used.
+    asprintf_safe(&cmd, "%s/%s", remote, INDEX_MANIFEST_FILENAME);
+    unlink(cmd);
+    free(cmd);
+    r = index_remote_open(url, cache, 0);
+    CuAssertPtrNotNull(ct, r);
+    inds = pl_new(4);
+    CuAssertIntEquals(ct, 0, index_remote_list(r, inds));
+    CuAssertIntEquals(ct, 2, pl_size(inds));
+    free_indexes(inds);
+    index_remote_close(r);
+
+    asprintf_safe(&cmd, "rm -rf %s %s", remote, cache);
+    CuAssertIntEquals(ct, 0, system(cmd));
+    free(cmd);
+    free(part);
+    free(chunks);
+    free(cachea);
+    free(cacheb);
+    free(fna);
+    free(fnb);
+    free(url);
+    free(remote);
+    free(cache);
+}
@@ -7,6 +7,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "cutest.h"
 #include "ioutils.h"
@@ -325,3 +328,48 @@ void test_canon_5(CuTest* tc) {
     assertCanon(tc, "/../..//x", "/x");
 }
 
+
+void test_read_parallel(CuTest* tc) {
+    // a bit over two 4 MB segments.
+    size_t N = 9 * 1024 * 1024 + 123;
+    unsigned char* data;
+    unsigned char* buf;
+    char* fn;
+    FILE* fid;
+    int fd;
+    size_t i;
+
+    data = malloc(N);
+    buf = malloc(N);
+    for (i=0; i<N; i++)
+        data[i] = (i * 2654435761u) >> 24;
+    fn = create_temp_file("test_read_parallel", NULL);
+    fid = fopen(fn, "wb");
+    CuAssertPtrNotNull(tc, fid);
+    CuAssertIntEquals(tc, N, fwrite(data, 1, N, fid));
+    CuAssertIntEquals(tc, 0, fclose(fid));
+
+    fd = open(fn, O_RDONLY);
+    CuAssertTrue(tc, fd >= 0);
+    memset(buf, 0, N);
+    CuAssertIntEquals(tc, 0, read_parallel(fd, buf, N - 1000, 1000, 3));
+    CuAssertIntEquals(tc, 0, memcmp(buf, data + 1000, N - 1000));
+    // just into the page cache.
+    CuAssertIntEquals(tc, 0, read_parallel(fd, NULL, N, 0, 0));
+    // past the end of the file.
+    CuAssertIntEquals(tc, -1, read_parallel(fd, buf, N, 1000, 2));
+
+    set_parallel_read_threads(4);
+    memset(buf, 0, N);
+    CuAssertIntEquals(tc, 0, read_at(fd, buf, N, 0));
+    CuAssertIntEquals(tc, 0, memcmp(buf, data, N));
+    set_parallel_read_threads(0);
+    CuAssertIntEquals(tc, 0, read_at(fd, buf, 10, 5));
+    CuAssertIntEquals(tc, 0, memcmp(buf, data + 5, 10));
+    close(fd);
+
+    unlink(fn);
+    free(fn);
+    free(data);
+    free(buf);
+}
@@ -117,3 +117,65 @@ void test_log_func(CuTest* tc) {
 
 }
 
+#define ASYNC_NLINES 20000
+
+struct async_args {
+    int id;
+    FILE* f;
+};
+
+static void* async_thread(void* v) {
+    struct async_args* a = v;
+    int i;
+    // (test_log_ts made logging thread-specific.)
+    log_set_level(LOG_MSG);
+    log_to(a->f);
+    for (i=0; i<ASYNC_NLINES; i++)
+        logmsg("thread %i line %i\n", a->id, i);
+    return NULL;
+}
+
+void test_log_async(CuTest* tc) {
+    pthread_t t1, t2;
+    struct async_args a1, a2;
+    int next[3] = { 0, 0, 0 };
+    char* fn;
+    FILE* f;
+    sl* lst;
+    size_t i;
+
+    log_init(LOG_MSG);
+    fn = create_temp_file("log", NULL);
+    f = fopen(fn, "w");
+    log_to(f);
+    CuAssertIntEquals(tc, 0, log_set_async(TRUE));
+
+    a1.id = 1;
+    a2.id = 2;
+    a1.f = a2.f = f;
+    CuAssertIntEquals(tc, 0, pthread_create(&t1, NULL, async_thread, &a1));
+    CuAssertIntEquals(tc, 0, pthread_create(&t2, NULL, async_thread, &a2));
+    CuAssertIntEquals(tc, 0, pthread_join(t1, NULL));
+    CuAssertIntEquals(tc, 0, pthread_join(t2, NULL));
+    logmsg("done\n");
+
+    CuAssertIntEquals(tc, 0, log_set_async(FALSE));
+    log_to(stdout);
+    fclose(f);
+
+    // every line is there, and each thread's lines are in order.
+    lst = file_get_lines(fn, FALSE);
+    CuAssertIntEquals(tc, 2*ASYNC_NLINES + 1, sl_size(lst));
+    for (i=0; i<2*ASYNC_NLINES; i++) {
+        int id, line;
+        CuAssertIntEquals(tc, 2, sscanf(sl_get(lst, i), "thread %i line %i",
+                                        &id, &line));
+        CuAssertTrue(tc, id == 1 || id == 2);
+        CuAssertIntEquals(tc, next[id], line);
+        next[id]++;
+    }
+    CuAssertStrEquals(tc, "done", sl_get(lst, 2*ASYNC_NLINES));
+    sl_free2(lst);
+    unlink(fn);
+    free(fn);
+}
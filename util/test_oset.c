@@ -0,0 +1,98 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "oset.h"
+#include "bl.h"
+#include "permutedsort.h"
+
+void test_oset_int64(CuTest* tc) {
+    oset* s = oset_new_int64();
+    ll* ref = ll_new(256);
+    int64_t* vals;
+    oset_iter it;
+    const int64_t* v;
+    size_t i;
+    int k;
+    srand(99);
+    for (k=0; k<100000; k++) {
+        int64_t x = ((int64_t)(rand() % 20000) - 10000) << 20;
+        anbool added = oset_insert_int64(s, x, TRUE);
+        CuAssertIntEquals(tc, !ll_sorted_contains(ref, x), added);
+        ll_insert_unique_ascending(ref, x);
+        CuAssertTrue(tc, oset_contains_int64(s, x));
+    }
+    CuAssertIntEquals(tc, 0, oset_check(s));
+    CuAssertIntEquals(tc, (int)ll_size(ref), (int)oset_size(s));
+    CuAssertTrue(tc, !oset_contains_int64(s, 12345));
+
+    vals = malloc(oset_size(s) * sizeof(int64_t));
+    oset_copy(s, vals);
+    oset_iter_init(s, &it);
+    for (i=0; i<ll_size(ref); i++) {
+        CuAssertTrue(tc, vals[i] == ll_get(ref, i));
+        v = oset_iter_next(&it);
+        CuAssertPtrNotNull(tc, v);
+        CuAssertTrue(tc, *v == ll_get(ref, i));
+    }
+    CuAssertPtrEquals(tc, NULL, (void*)oset_iter_next(&it));
+    free(vals);
+    ll_free(ref);
+    oset_free(s);
+}
+
+static int compare_pairs(const void* v1, const void* v2, void* token) {
+    const int* p1 = v1;
+    const int* p2 = v2;
+    int* ncalls = token;
+    (*ncalls)++;
+    if (p1[0] != p2[0])
+        return (p1[0] < p2[0]) ? -1 : 1;
+    return 0;
+}
+
+// A multiset of (key, serial) pairs ordered by key alone: equal keys stay
+// in insertion order.
+void test_oset_multiset(CuTest* tc) {
+    int ncalls = 0;
+    oset* s = oset_new(2 * sizeof(int), compare_pairs, &ncalls);
+    oset_iter it;
+    const int* p;
+    const int* prev = NULL;
+    int k, n = 0;
+    srand(7);
+    for (k=0; k<30000; k++) {
+        int pair[2];
+        pair[0] = rand() % 500;
+        pair[1] = k;
+        CuAssertTrue(tc, oset_insert(s, pair, FALSE));
+    }
+    CuAssertTrue(tc, ncalls > 0);
+    CuAssertIntEquals(tc, 0, oset_check(s));
+    CuAssertIntEquals(tc, 30000, (int)oset_size(s));
+    oset_iter_init(s, &it);
+    while ((p = oset_iter_next(&it))) {
+        if (prev) {
+            CuAssertTrue(tc, prev[0] <= p[0]);
+            if (prev[0] == p[0])
+                CuAssertTrue(tc, prev[1] < p[1]);
+        }
+        prev = p;
+        n++;
+    }
+    CuAssertIntEquals(tc, 30000, n);
+    for (k=0; k<500; k++) {
+        int pair[2] = { k, -1 };
+        CuAssertTrue(tc, oset_contains(s, pair));
+        // already there
+        CuAssertTrue(tc, !oset_insert(s, pair, TRUE));
+    }
+    CuAssertIntEquals(tc, 30000, (int)oset_size(s));
+    oset_free(s);
+}
@@ -0,0 +1,214 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "permutedsort.h"
+
+struct rec {
+    double d;
+    float f;
+    int i;
+    int64_t l;
+    char pad[3];
+};
+
+static void make_recs(struct rec* r, int N) {
+    int k;
+    srand(42);
+    for (k=0; k<N; k++) {
+        // plenty of ties, and both signs.
+        int v = (rand() % 201) - 100;
+        r[k].d = v * 0.25;
+        r[k].f = v * 0.5f;
+        r[k].i = v * 1000003;
+        r[k].l = (int64_t)v << 40;
+    }
+    r[3].d = -0.0;
+    r[5].d = 0.0;
+    r[4].f = -0.0f;
+    r[6].f = 0.0f;
+}
+
+// Checks that "perm" is a permutation that sorts "r" according to
+// "compare", and that equal elements are in their original order.
+static void check_sorted(CuTest* tc, const struct rec* r, const void* field,
+                         int (*compare)(const void*, const void*),
+                         const int* perm, int N) {
+    char* seen = calloc(N, 1);
+    int k;
+    for (k=0; k<N; k++) {
+        CuAssertTrue(tc, perm[k] >= 0 && perm[k] < N);
+        CuAssertIntEquals(tc, 0, seen[perm[k]]);
+        seen[perm[k]] = 1;
+    }
+    for (k=1; k<N; k++) {
+        const char* v0 = (const char*)field + perm[k-1] * sizeof(struct rec);
+        const char* v1 = (const char*)field + perm[k] * sizeof(struct rec);
+        int c = compare(v0, v1);
+        CuAssertTrue(tc, c <= 0);
+        if (c == 0)
+            CuAssertTrue(tc, perm[k-1] < perm[k]);
+    }
+    free(seen);
+}
+
+static void check_all(CuTest* tc, int N) {
+    struct rec* r = calloc(N, sizeof(struct rec));
+    int (*compares[])(const void*, const void*) = {
+        compare_doubles_asc, compare_doubles_desc,
+        compare_floats_asc, compare_floats_desc,
+        compare_ints_asc, compare_ints_desc,
+        compare_int64_asc, compare_int64_desc,
+    };
+    int k;
+    make_recs(r, N);
+    for (k=0; k<8; k++) {
+        const void* field;
+        int* perm;
+        switch (k / 2) {
+        case 0: field = &r[0].d; break;
+        case 1: field = &r[0].f; break;
+        case 2: field = &r[0].i; break;
+        default: field = &r[0].l; break;
+        }
+        perm = permuted_sort(field, sizeof(struct rec), compares[k], NULL, N);
+        check_sorted(tc, r, field, compares[k], perm, N);
+        free(perm);
+    }
+    free(r);
+}
+
+void test_permuted_sort_small(CuTest* tc) {
+    check_all(tc, 20);
+}
+
+void test_permuted_sort_large(CuTest* tc) {
+    check_all(tc, 5000);
+}
+
+void test_permuted_sort_existing_perm(CuTest* tc) {
+    double vals[] = { 3, 1, 2, 1, 3, 0 };
+    // sorts the given subset, in the given order for ties.
+    int perm[] = { 4, 3, 0, 1 };
+    permuted_sort(vals, sizeof(double), compare_doubles_asc, perm, 4);
+    CuAssertIntEquals(tc, 3, perm[0]);
+    CuAssertIntEquals(tc, 1, perm[1]);
+    CuAssertIntEquals(tc, 4, perm[2]);
+    CuAssertIntEquals(tc, 0, perm[3]);
+}
+
+void test_permuted_sort_nan(CuTest* tc) {
+    double vals[40];
+    uint64_t nanbits = 0x7ff8000000000000ULL;
+    int* perm;
+    int k;
+    for (k=0; k<40; k++)
+        vals[k] = 40 - k;
+    memcpy(vals + 7, &nanbits, sizeof(double));
+    // NaNs go last, in either direction.
+    perm = permuted_sort(vals, sizeof(double), compare_doubles_asc, NULL, 40);
+    CuAssertIntEquals(tc, 7, perm[39]);
+    CuAssertIntEquals(tc, 39, perm[0]);
+    free(perm);
+    perm = permuted_sort(vals, sizeof(double), compare_doubles_desc, NULL, 40);
+    CuAssertIntEquals(tc, 7, perm[39]);
+    CuAssertIntEquals(tc, 0, perm[0]);
+    free(perm);
+}
+
+void test_permuted_sort_topk(CuTest* tc) {
+    int N = 5000;
+    struct rec* r = calloc(N, sizeof(struct rec));
+    int Ks[] = { 0, 1, 7, 100, 1000, 3000, 5000, 6000 };
+    int k, j;
+    make_recs(r, N);
+    for (k=0; k<2; k++) {
+        int (*compare)(const void*, const void*) =
+            k ? compare_doubles_desc : compare_ints_asc;
+        const void* field = k ? (const void*)&r[0].d : (const void*)&r[0].i;
+        int* full = permuted_sort(field, sizeof(struct rec), compare, NULL, N);
+        for (j=0; j<sizeof(Ks)/sizeof(int); j++) {
+            int K = Ks[j];
+            int* top = permuted_sort_topk(field, sizeof(struct rec), compare,
+                                          K, N);
+            CuAssertPtrNotNull(tc, top);
+            // ties included, it is the start of the full sort.
+            CuAssertIntEquals(tc, 0, memcmp(full, top,
+                                            (K < N ? K : N) * sizeof(int)));
+            free(top);
+        }
+        free(full);
+    }
+    free(r);
+}
+
+// Checks in-place permutation_apply() against applying it into a copy,
+// for a shuffle, an in-order subset and a selection with repeats.
+void test_permutation_apply_in_place(CuTest* tc) {
+    int N = 1000;
+    int* perm = malloc(N * sizeof(int));
+    double* in = malloc(N * 3 * sizeof(double));
+    double* out = malloc(N * 3 * sizeof(double));
+    double* arr = malloc(N * 3 * sizeof(double));
+    int t, k, es, M;
+    srand(1);
+    for (k=0; k<N*3; k++)
+        in[k] = k;
+    for (t=0; t<3; t++) {
+        switch (t) {
+        case 0:
+            permutation_init(perm, N);
+            for (k=N-1; k>0; k--) {
+                int j = rand() % (k+1);
+                int tmp = perm[k];
+                perm[k] = perm[j];
+                perm[j] = tmp;
+            }
+            M = N;
+            break;
+        case 1:
+            for (M=0, k=0; k<N; k++)
+                if (rand() % 3)
+                    perm[M++] = k;
+            break;
+        default:
+            for (k=0; k<N; k++)
+                perm[k] = rand() % N;
+            M = N;
+            break;
+        }
+        for (es=4; es<=24; es+=4) {
+            permutation_apply(perm, M, in, out, es);
+            memcpy(arr, in, N * 3 * sizeof(double));
+            permutation_apply(perm, M, arr, arr, es);
+            CuAssertIntEquals(tc, 0, memcmp(out, arr, (size_t)M * es));
+        }
+    }
+    free(perm);
+    free(in);
+    free(out);
+    free(arr);
+}
+
+void test_permutation_apply_multi(CuTest* tc) {
+    double x[] = { 0, 1, 2, 3, 4, 5 };
+    int id[] = { 10, 11, 12, 13, 14, 15 };
+    double xy[] = { 0,0, 1,1, 2,2, 3,3, 4,4, 5,5 };
+    int perm[] = { 3, 5, 0, 4, 2, 1 };
+    void* arrays[] = { x, NULL, id, xy };
+    int sizes[] = { sizeof(double), 1, sizeof(int), 2 * sizeof(double) };
+    int k;
+    permutation_apply_multi(perm, 6, arrays, sizes, 4);
+    for (k=0; k<6; k++) {
+        CuAssertDblEquals(tc, perm[k], x[k], 0);
+        CuAssertIntEquals(tc, 10 + perm[k], id[k]);
+        CuAssertDblEquals(tc, perm[k], xy[2*k], 0);
+        CuAssertDblEquals(tc, perm[k], xy[2*k+1], 0);
+    }
+}
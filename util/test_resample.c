@@ -0,0 +1,209 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cutest.h"
+#include "resample.h"
+#include "wcs-resample.h"
+#include "anwcs.h"
+#include "sip.h"
+#include "sip-utils.h"
+#include "mathutil.h"
+#include "starutil.h"
+#include "anqfits.h"
+#include "fitsioutils.h"
+#include "ioutils.h"
+
+static float* random_image(int W, int H) {
+    float* img = malloc((size_t)W * H * sizeof(float));
+    int i;
+    for (i=0; i<W*H; i++)
+        img[i] = rand() / (float)RAND_MAX;
+    return img;
+}
+
+void test_lanczos_table(CuTest* tc) {
+    int W = 40, H = 30;
+    float* img;
+    lanczos_table_t* table;
+    lanczos_args_t largs;
+    int i, order;
+
+    srand(42);
+    img = random_image(W, H);
+    CuAssertPtrEquals(tc, NULL, lanczos_table_new(LANCZOS_TABLE_MAX_ORDER + 1));
+    for (order=2; order<=LANCZOS_TABLE_MAX_ORDER; order++) {
+        table = lanczos_table_new(order);
+        CuAssertPtrNotNull(tc, table);
+        memset(&largs, 0, sizeof(largs));
+        largs.order = order;
+        for (i=0; i<1000; i++) {
+            double px = -order + (W + 2*order) * (rand() / (double)RAND_MAX);
+            double py = -order + (H + 2*order) * (rand() / (double)RAND_MAX);
+            double exact;
+            largs.weighted = 0;
+            exact = lanczos_resample_unw_sep_f(px, py, img, W, H, &largs);
+            CuAssertDblEquals(tc, exact, lanczos_table_resample_f(table, px, py, img, W, H, 0), 1e-4);
+            // (the weighted version can divide by zero off the edges)
+            if (px < 0 || py < 0 || px > W-1 || py > H-1)
+                continue;
+            largs.weighted = 1;
+            exact = lanczos_resample_unw_sep_f(px, py, img, W, H, &largs);
+            CuAssertDblEquals(tc, exact, lanczos_table_resample_f(table, px, py, img, W, H, 1), 1e-4);
+        }
+        lanczos_table_free(table);
+    }
+    free(img);
+}
+
+static anwcs_t* make_wcs(double ra, double dec, double scale, double rot,
+                         int W, int H, double a20) {
+    sip_t sip;
+    memset(&sip, 0, sizeof(sip));
+    sip.wcstan.crval[0] = ra;
+    sip.wcstan.crval[1] = dec;
+    sip.wcstan.crpix[0] = W/2 + 0.5;
+    sip.wcstan.crpix[1] = H/2 + 0.5;
+    sip.wcstan.cd[0][0] = -scale * cos(deg2rad(rot));
+    sip.wcstan.cd[0][1] =  scale * sin(deg2rad(rot));
+    sip.wcstan.cd[1][0] =  scale * sin(deg2rad(rot));
+    sip.wcstan.cd[1][1] =  scale * cos(deg2rad(rot));
+    sip.wcstan.imagew = W;
+    sip.wcstan.imageh = H;
+    sip.a_order = sip.b_order = 2;
+    sip.a[2][0] = a20;
+    sip.ap_order = sip.bp_order = 4;
+    sip_compute_inverse_polynomials(&sip, 0, 0, 0, 0, 0, 0);
+    return anwcs_new_sip(&sip);
+}
+
+void test_resample_wcs_fast(CuTest* tc) {
+    int inW = 300, inH = 200, outW = 250, outH = 230;
+    anwcs_t* inwcs = make_wcs(150, 30, 1e-3, 0, inW, inH, 2e-6);
+    anwcs_t* outwcs = make_wcs(150.05, 30.02, 1.1e-3, 25, outW, outH, 0);
+    float* inimg;
+    float* exact;
+    float* fast;
+    int i, order, nset = 0;
+
+    srand(43);
+    inimg = random_image(inW, inH);
+    exact = malloc((size_t)outW * outH * sizeof(float));
+    fast = malloc((size_t)outW * outH * sizeof(float));
+    for (order=0; order<=3; order+=3) {
+        for (i=0; i<outW*outH; i++)
+            exact[i] = fast[i] = -1;
+        CuAssertIntEquals(tc, 0, resample_wcs(inwcs, inimg, inW, inH, outwcs, exact, outW, outH, 0, order));
+        CuAssertIntEquals(tc, 0, resample_wcs_fast(inwcs, inimg, inW, inH, outwcs, fast, outW, outH, 0, order, 1e-3, 3));
+        for (i=0; i<outW*outH; i++) {
+            // (resample_wcs() clips to the box around the input image's
+            // corners, and so skips some of the Lanczos margin.)
+            if (exact[i] == -1)
+                continue;
+            nset++;
+            // nearest-neighbour can round the other way, and the mapping
+            // is only good to 1e-3 pixel.
+            if (order == 0 && exact[i] != fast[i]) {
+                CuAssertTrue(tc, fast[i] >= 0);
+                continue;
+            }
+            CuAssertDblEquals(tc, exact[i], fast[i], order ? 2e-3 : 0);
+        }
+        // exact mapping, one thread.
+        for (i=0; i<outW*outH; i++)
+            fast[i] = -1;
+        CuAssertIntEquals(tc, 0, resample_wcs_fast(inwcs, inimg, inW, inH, outwcs, fast, outW, outH, 0, order, 0, 1));
+        for (i=0; i<outW*outH; i++)
+            if (exact[i] != -1)
+                CuAssertDblEquals(tc, exact[i], fast[i], order ? 1e-4 : 0);
+    }
+    // the images must overlap for this to test anything.
+    CuAssertTrue(tc, nset > outW * outH / 2);
+    free(inimg);
+    free(exact);
+    free(fast);
+    anwcs_free(inwcs);
+    anwcs_free(outwcs);
+}
+
+static float* read_image(const char* fn, int* W, int* H) {
+    anqfits_t* anq = anqfits_open(fn);
+    float* img;
+    if (!anq)
+        return NULL;
+    img = anqfits_readpix(anq, 0, 0, 0, 0, 0, 0, PTYPE_FLOAT, NULL, W, H);
+    anqfits_close(anq);
+    return img;
+}
+
+void test_resample_wcs_files_tiled(CuTest* tc) {
+    int inW = 300, inH = 200, outW = 250, outH = 230;
+    anwcs_t* inwcs = make_wcs(150, 30, 1e-3, 0, inW, inH, 2e-6);
+    anwcs_t* outwcs = make_wcs(150.05, 30.02, 1.1e-3, 25, outW, outH, 0);
+    char* infn = create_temp_file("test-resample-in", NULL);
+    char* wcsfn = create_temp_file("test-resample-wcs", NULL);
+    char* wholefn = create_temp_file("test-resample-whole", NULL);
+    char* tiledfn = create_temp_file("test-resample-tiled", NULL);
+    qfits_header* hdr;
+    qfitsdumper qd;
+    float* inimg;
+    float* whole;
+    float* tiled;
+    int i, order, tilerows, W, H, nset;
+
+    srand(44);
+    inimg = random_image(inW, inH);
+    memset(&qd, 0, sizeof(qd));
+    qd.filename = infn;
+    qd.npix = inW * inH;
+    qd.ptype = PTYPE_FLOAT;
+    qd.fbuf = inimg;
+    qd.out_ptype = BPP_IEEE_FLOAT;
+    hdr = fits_get_header_for_image(&qd, inW, NULL);
+    anwcs_add_to_header(inwcs, hdr);
+    CuAssertIntEquals(tc, 0, fits_write_header_and_image(hdr, &qd, inW));
+    qfits_header_destroy(hdr);
+    CuAssertIntEquals(tc, 0, anwcs_write(outwcs, wcsfn));
+
+    for (order=0; order<=3; order+=3) {
+        CuAssertIntEquals(tc, 0, resample_wcs_files(infn, 0, infn, 0, wcsfn, 0, wholefn, order, 0, 1e-3, 3, 0));
+        whole = read_image(wholefn, &W, &H);
+        CuAssertPtrNotNull(tc, whole);
+        CuAssertIntEquals(tc, outW, W);
+        CuAssertIntEquals(tc, outH, H);
+        nset = 0;
+        for (i=0; i<outW*outH; i++)
+            if (whole[i] != 0)
+                nset++;
+        CuAssertTrue(tc, nset > outW * outH / 2);
+        // band heights that are and aren't whole rows of grid cells, and
+        // bigger than the image.
+        for (tilerows=1; tilerows<=1000; tilerows*=10) {
+            CuAssertIntEquals(tc, 0, resample_wcs_files(infn, 0, infn, 0, wcsfn, 0, tiledfn, order, 0, 1e-3, 2, tilerows));
+            tiled = read_image(tiledfn, &W, &H);
+            CuAssertPtrNotNull(tc, tiled);
+            CuAssertIntEquals(tc, outW, W);
+            CuAssertIntEquals(tc, outH, H);
+            for (i=0; i<outW*outH; i++)
+                CuAssertTrue(tc, whole[i] == tiled[i]);
+            free(tiled);
+        }
+        free(whole);
+    }
+    unlink(infn);
+    unlink(wcsfn);
+    unlink(wholefn);
+    unlink(tiledfn);
+    free(infn);
+    free(wcsfn);
+    free(wholefn);
+    free(tiledfn);
+    free(inimg);
+    anwcs_free(inwcs);
+    anwcs_free(outwcs);
+}
@@ -0,0 +1,68 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "cutest.h"
+#include "shmcache.h"
+
+static int nfilled;
+
+static int fill_squares(void* data, size_t size, void* token) {
+    int* arr = data;
+    int i;
+    for (i=0; i<size/sizeof(int); i++)
+        arr[i] = i * i;
+    nfilled++;
+    return 0;
+}
+
+void test_shmcache_attach(CuTest* ct) {
+    const char* key = "/an-test-shmcache";
+    const int N = 1000;
+    const int* a;
+    const int* b;
+    pid_t pid;
+    int status;
+    int i;
+
+    shmcache_set_enabled(FALSE);
+    CuAssertPtrEquals(ct, NULL, (void*)shmcache_attach(key, N*sizeof(int),
+                                                       fill_squares, NULL));
+    shmcache_set_enabled(TRUE);
+
+    nfilled = 0;
+    a = shmcache_attach(key, N*sizeof(int), fill_squares, NULL);
+    if (!a)
+        // no POSIX shared memory here.
+        return;
+    CuAssertIntEquals(ct, 1, nfilled);
+
+    // a second attach (here, and in another process) shares the first.
+    b = shmcache_attach(key, N*sizeof(int), fill_squares, NULL);
+    CuAssertPtrNotNull(ct, b);
+    CuAssertIntEquals(ct, 1, nfilled);
+    for (i=0; i<N; i++)
+        CuAssertIntEquals(ct, i*i, b[i]);
+
+    pid = fork();
+    if (pid == 0) {
+        const int* c = shmcache_attach(key, N*sizeof(int), fill_squares, NULL);
+        _exit((c && nfilled == 1 && c[N-1] == (N-1)*(N-1)) ? 0 : 1);
+    }
+    CuAssert(ct, "fork", pid > 0);
+    waitpid(pid, &status, 0);
+    CuAssert(ct, "child attached", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // a segment of another size is refused.
+    CuAssertPtrEquals(ct, NULL, (void*)shmcache_attach(key, 2*N*sizeof(int),
+                                                       fill_squares, NULL));
+
+    shmcache_detach(a, N*sizeof(int));
+    shmcache_detach(b, N*sizeof(int));
+    CuAssertIntEquals(ct, 0, shmcache_remove(key));
+    shmcache_set_enabled(FALSE);
+}
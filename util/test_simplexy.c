@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #include "cutest.h"
 #include "dimage.h"
@@ -51,3 +52,229 @@ void test_simplexy_1(CuTest* tc) {
     CuAssertIntEquals(tc, 1, rtn);
     CuAssertIntEquals(tc, 1, N);
 }
+
+static float* synthetic_image(int W, int H, int NS) {
+    float* image;
+    int i, j, k;
+    unsigned int seed = 42;
+
+    image = malloc(W * H * sizeof(float));
+    for (i=0; i<W*H; i++)
+        image[i] = 100 + 10.0 * ((float)rand_r(&seed) / RAND_MAX - 0.5);
+    for (k=0; k<NS; k++) {
+        float sx = 10 + (W - 20) * ((float)rand_r(&seed) / RAND_MAX);
+        float sy = 10 + (H - 20) * ((float)rand_r(&seed) / RAND_MAX);
+        for (j=(int)sy-8; j<(int)sy+9; j++)
+            for (i=(int)sx-8; i<(int)sx+9; i++)
+                image[j*W + i] += 500 * exp(-((i-sx)*(i-sx) + (j-sy)*(j-sy)) /
+                                            (2. * 1.5 * 1.5));
+    }
+    return image;
+}
+
+static void assert_same_sources(CuTest* tc, simplexy_t* s1, simplexy_t* s2) {
+    int i, j;
+    CuAssertIntEquals(tc, s1->npeaks, s2->npeaks);
+    for (i=0; i<s1->npeaks; i++) {
+        anbool found = FALSE;
+        for (j=0; j<s2->npeaks; j++)
+            if (fabs(s1->x[i] - s2->x[j]) < 0.1 &&
+                fabs(s1->y[i] - s2->y[j]) < 0.1)
+                found = TRUE;
+        CuAssertTrue(tc, found);
+    }
+}
+
+// Tiled and whole-image runs find the same stars.
+void test_simplexy_tiled(CuTest* tc) {
+    int W = 500, H = 300;
+    int NS = 60;
+    simplexy_t s1, s2;
+
+    memset(&s1, 0, sizeof(simplexy_t));
+    simplexy_fill_in_defaults(&s1);
+    s1.image = synthetic_image(W, H, NS);
+    s1.nx = W;
+    s1.ny = H;
+    memcpy(&s2, &s1, sizeof(simplexy_t));
+    s2.image = synthetic_image(W, H, NS);
+    s2.tilesize = 128;
+    s2.nthreads = 3;
+
+    CuAssertIntEquals(tc, 1, simplexy_run(&s1));
+    CuAssertIntEquals(tc, 1, simplexy_run(&s2));
+    CuAssertTrue(tc, s1.npeaks > NS/2);
+    assert_same_sources(tc, &s1, &s2);
+    simplexy_free_contents(&s1);
+    simplexy_free_contents(&s2);
+}
+
+struct rows_token {
+    const float* image;
+    int W;
+    int H;
+    int nread;
+};
+
+static int read_test_rows(void* token, int y0, int nrows, float* rows) {
+    struct rows_token* t = token;
+    if (y0 < 0 || y0 + nrows > t->H)
+        return -1;
+    memcpy(rows, t->image + (size_t)y0 * t->W,
+           (size_t)nrows * t->W * sizeof(float));
+    t->nread += nrows;
+    return 0;
+}
+
+// Streaming the image in bands finds the same stars as the whole image.
+void test_simplexy_streaming(CuTest* tc) {
+    int W = 300, H = 700;
+    int NS = 60;
+    simplexy_t s1, s2;
+    struct rows_token token;
+
+    memset(&s1, 0, sizeof(simplexy_t));
+    simplexy_fill_in_defaults(&s1);
+    s1.image = synthetic_image(W, H, NS);
+    s1.nx = W;
+    s1.ny = H;
+    memcpy(&s2, &s1, sizeof(simplexy_t));
+    s2.image = NULL;
+    s2.bandrows = 100;
+
+    token.image = s1.image;
+    token.W = W;
+    token.H = H;
+    token.nread = 0;
+
+    CuAssertIntEquals(tc, 1, simplexy_run(&s1));
+    CuAssertIntEquals(tc, 1, simplexy_run_streaming(&s2, read_test_rows, &token));
+    CuAssertTrue(tc, s1.npeaks > NS/2);
+    assert_same_sources(tc, &s1, &s2);
+    // each row is read once to measure sigma, and once more to find sources.
+    CuAssertIntEquals(tc, 2 * H, token.nread);
+    simplexy_free_contents(&s1);
+    simplexy_free_contents(&s2);
+}
+
+void test_dallpeaks_threaded(CuTest* tc) {
+    int W = 300, H = 200;
+    float* image = synthetic_image(W, H, 80);
+    uint8_t* mask = malloc(W * H);
+    int* objs = malloc(W * H * sizeof(int));
+    int maxnpeaks = 1000;
+    float* x1 = malloc(maxnpeaks * sizeof(float));
+    float* y1 = malloc(maxnpeaks * sizeof(float));
+    float* x2 = malloc(maxnpeaks * sizeof(float));
+    float* y2 = malloc(maxnpeaks * sizeof(float));
+    int i, n1, n2, nthreads;
+
+    for (i=0; i<W*H; i++) {
+        image[i] -= 100;
+        mask[i] = (image[i] > 20);
+    }
+    dfind2_u8(mask, W, H, objs, NULL);
+    dallpeaks(image, W, H, objs, x1, y1, &n1, 1.0, 3.0, 1.0, 5.0,
+              1000, maxnpeaks, 3.0, 500);
+    CuAssertTrue(tc, n1 > 40);
+    for (nthreads=2; nthreads<=4; nthreads++) {
+        dallpeaks_threaded(image, W, H, objs, x2, y2, &n2, 1.0, 3.0, 1.0, 5.0,
+                           1000, maxnpeaks, 3.0, 500, nthreads);
+        CuAssertIntEquals(tc, n1, n2);
+        CuAssertIntEquals(tc, 0, memcmp(x1, x2, n1 * sizeof(float)));
+        CuAssertIntEquals(tc, 0, memcmp(y1, y2, n1 * sizeof(float)));
+    }
+    // the cap on the number of peaks keeps the first ones.
+    dallpeaks_threaded(image, W, H, objs, x2, y2, &n2, 1.0, 3.0, 1.0, 5.0,
+                       1000, 10, 3.0, 500, 3);
+    CuAssertIntEquals(tc, 10, n2);
+    CuAssertIntEquals(tc, 0, memcmp(x1, x2, 10 * sizeof(float)));
+
+    free(image);
+    free(mask);
+    free(objs);
+    free(x1);
+    free(y1);
+    free(x2);
+    free(y2);
+}
+
+static void free_sources(simplexy_t* s) {
+    free(s->x);
+    free(s->y);
+    free(s->flux);
+    free(s->background);
+    s->x = s->y = s->flux = s->background = NULL;
+    s->npeaks = 0;
+}
+
+void test_simplexy_cache(CuTest* tc) {
+    int W = 300, H = 200;
+    int NS = 40;
+    simplexy_t s1, s2;
+    int i;
+
+    memset(&s1, 0, sizeof(simplexy_t));
+    simplexy_fill_in_defaults(&s1);
+    s1.image = synthetic_image(W, H, NS);
+    s1.nx = W;
+    s1.ny = H;
+    s1.cache = simplexy_cache_new();
+    CuAssertIntEquals(tc, 1, simplexy_run(&s1));
+    free_sources(&s1);
+
+    // new thresholds, then a new PSF width: the same as starting afresh.
+    for (i=0; i<2; i++) {
+        if (i == 0)
+            s1.plim = 30;
+        else
+            s1.dpsf = 1.5;
+        CuAssertIntEquals(tc, 1, simplexy_run(&s1));
+
+        memset(&s2, 0, sizeof(simplexy_t));
+        simplexy_fill_in_defaults(&s2);
+        s2.image = synthetic_image(W, H, NS);
+        s2.nx = W;
+        s2.ny = H;
+        s2.plim = s1.plim;
+        s2.dpsf = s1.dpsf;
+        CuAssertIntEquals(tc, 1, simplexy_run(&s2));
+        assert_same_sources(tc, &s1, &s2);
+        CuAssertIntEquals(tc, 0, memcmp(s1.flux, s2.flux,
+                                        s1.npeaks * sizeof(float)));
+        simplexy_free_contents(&s2);
+        free_sources(&s1);
+    }
+    simplexy_cache_free(s1.cache);
+    simplexy_free_contents(&s1);
+}
+
+// The OpenCL device (if there is one; otherwise the CPU) finds the same
+// stars as the CPU, with and without background subtraction.
+void test_simplexy_gpu(CuTest* tc) {
+    int W = 400, H = 300;
+    int NS = 50;
+    simplexy_t s1, s2;
+    int nobgsub;
+
+    for (nobgsub=0; nobgsub<2; nobgsub++) {
+        memset(&s1, 0, sizeof(simplexy_t));
+        simplexy_fill_in_defaults(&s1);
+        s1.image = synthetic_image(W, H, NS);
+        s1.nx = W;
+        s1.ny = H;
+        s1.nobgsub = nobgsub;
+        if (nobgsub)
+            s1.globalbg = 100;
+        memcpy(&s2, &s1, sizeof(simplexy_t));
+        s2.image = synthetic_image(W, H, NS);
+        s2.gpu = TRUE;
+
+        CuAssertIntEquals(tc, 1, simplexy_run(&s1));
+        CuAssertIntEquals(tc, 1, simplexy_run(&s2));
+        CuAssertTrue(tc, s1.npeaks > NS/2);
+        assert_same_sources(tc, &s1, &s2);
+        simplexy_free_contents(&s1);
+        simplexy_free_contents(&s2);
+    }
+}
@@ -4,6 +4,7 @@
  */
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
@@ -12,6 +13,7 @@
 #include "sip.h"
 #include "sip_qfits.h"
 #include "sip-utils.h"
+#include "sip-invgrid.h"
 
 static const char* wcsfile = "SIMPLE  =                    T / Standard FITS file                             BITPIX  =                    8 / ASCII or bytes array                           NAXIS   =                    0 / Minimal header                                 EXTEND  =                    T / There may be FITS ext                          CTYPE1  = 'RA---TAN-SIP' / TAN (gnomic) projection + SIP distortions            CTYPE2  = 'DEC--TAN-SIP' / TAN (gnomic) projection + SIP distortions            WCSAXES =                    2 / no comment                                     EQUINOX =               2000.0 / Equatorial coordinates definition (yr)         LONPOLE =                180.0 / no comment                                     LATPOLE =                  0.0 / no comment                                     CRVAL1  =        11.5705189886 / RA  of reference point                         CRVAL2  =        42.1541506988 / DEC of reference point                         CRPIX1  =                 2048 / X reference pixel                              CRPIX2  =                 1024 / Y reference pixel                              CUNIT1  = 'deg     ' / X pixel scale units                                      CUNIT2  = 'deg     ' / Y pixel scale units                                      CD1_1   =    7.78009863032E-06 / Transformation matrix                          CD1_2   =    -1.0992330198E-05 / no comment                                     CD2_1   =   -1.14560595236E-05 / no comment                                     CD2_2   =   -8.63206896621E-06 / no comment                                     IMAGEW  =                 4096 / Image width,  in pixels.                       IMAGEH  =                 2048 / Image height, in pixels.                       A_ORDER =                    4 / Polynomial order, axis 1                       A_0_2   =    2.16626045427E-06 / no comment                                     A_0_3   =    8.43135826028E-12 / no comment                                     A_0_4   =    1.27723787676E-14 / no comment                                     A_1_1   =   -5.20376831571E-06 / no comment                                     A_1_2   =    -5.2962390408E-10 / no comment                                     A_1_3   =   -1.75526102672E-14 / no comment                                     A_2_0   =     8.5443232652E-06 / no comment                                     A_2_1   =   -4.30755974621E-11 / no comment                                     A_2_2   =    3.82502701466E-14 / no comment                                     A_3_0   =    -4.7567645697E-10 / no comment                                     A_3_1   =    6.11248660507E-15 / no comment                                     A_4_0   =    2.60134165707E-14 / no comment                                     B_ORDER =                    4 / Polynomial order, axis 2                       B_0_2   =   -7.23056869993E-06 / no comment                                     B_0_3   =   -4.21356193854E-10 / no comment                                     B_0_4   =    2.93970053558E-15 / no comment                                     B_1_1   =    6.17195785471E-06 / no comment                                     B_1_2   =   -6.69823252817E-11 / no comment                                     B_1_3   =    1.83536133989E-14 / no comment                                     B_2_0   =   -1.74786318896E-06 / no comment                                     B_2_1   =   -5.15555867797E-10 / no comment                                     B_2_2   =   -2.78970082125E-14 / no comment                                     B_3_0   =    8.45057919961E-11 / no comment                                     B_3_1   =    2.40980945623E-16 / no comment                                     B_4_0   =   -1.72877462519E-14 / no comment                                     AP_ORDER=                    0 / Inv polynomial order, axis 1                   BP_ORDER=                    0 / Inv polynomial order, axis 2                   END                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             ";
 
@@ -55,3 +57,146 @@ void test_compute_inverse(CuTest* tc) {
 }
 
 
+void test_array_transforms(CuTest* tc) {
+    int i, N, ngood;
+    double *xy, *radec, *xyz, *xy2, *radec2, *xyz2;
+    anbool* ok;
+    double x, y;
+    sip_t* wcs = sip_from_string(wcsfile, 0, NULL);
+    CuAssertPtrNotNull(tc, wcs);
+    CuAssertIntEquals(tc, 0, sip_ensure_inverse_polynomials(wcs));
+
+    // a grid over the image, more than one block's worth.
+    N = 0;
+    xy = malloc(2 * 41 * 21 * sizeof(double));
+    for (y=0; y<=sip_imageh(wcs); y+=100)
+        for (x=0; x<=sip_imagew(wcs); x+=100) {
+            xy[2*N+0] = x;
+            xy[2*N+1] = y;
+            N++;
+        }
+    radec = malloc(2 * N * sizeof(double));
+    radec2 = malloc(2 * N * sizeof(double));
+    xyz = malloc(3 * N * sizeof(double));
+    xyz2 = malloc(3 * N * sizeof(double));
+    xy2 = malloc(2 * N * sizeof(double));
+    ok = malloc(N * sizeof(anbool));
+
+    sip_pixelxy2radec_array(wcs, xy, N, radec);
+    sip_pixelxy2xyzarr_array(wcs, xy, N, xyz);
+    for (i=0; i<N; i++) {
+        double ra, dec, sxyz[3];
+        sip_pixelxy2radec(wcs, xy[2*i], xy[2*i+1], &ra, &dec);
+        CuAssertDblEquals(tc, ra,  radec[2*i+0], 1e-10);
+        CuAssertDblEquals(tc, dec, radec[2*i+1], 1e-10);
+        sip_pixelxy2xyzarr(wcs, xy[2*i], xy[2*i+1], sxyz);
+        CuAssertDblEquals(tc, sxyz[0], xyz[3*i+0], 1e-12);
+        CuAssertDblEquals(tc, sxyz[1], xyz[3*i+1], 1e-12);
+        CuAssertDblEquals(tc, sxyz[2], xyz[3*i+2], 1e-12);
+    }
+
+    // put one point on the far side of the sky.
+    radec[0] += 180.;
+    radec[1] = -radec[1];
+    xyz[0] = -xyz[0];
+    xyz[1] = -xyz[1];
+    xyz[2] = -xyz[2];
+
+    ngood = sip_radec2pixelxy_array(wcs, radec, N, xy2, ok);
+    CuAssertIntEquals(tc, N-1, ngood);
+    CuAssertIntEquals(tc, FALSE, ok[0]);
+    for (i=1; i<N; i++) {
+        double sx, sy;
+        CuAssertTrue(tc, ok[i]);
+        CuAssertTrue(tc, sip_radec2pixelxy(wcs, radec[2*i], radec[2*i+1],
+                                           &sx, &sy));
+        CuAssertDblEquals(tc, sx, xy2[2*i+0], 1e-6);
+        CuAssertDblEquals(tc, sy, xy2[2*i+1], 1e-6);
+        CuAssertDblEquals(tc, xy[2*i+0], xy2[2*i+0], 1e-2);
+        CuAssertDblEquals(tc, xy[2*i+1], xy2[2*i+1], 1e-2);
+    }
+
+    ngood = sip_xyzarr2pixelxy_array(wcs, xyz, N, xy2, NULL);
+    CuAssertIntEquals(tc, N-1, ngood);
+    for (i=1; i<N; i++) {
+        CuAssertDblEquals(tc, xy[2*i+0], xy2[2*i+0], 1e-2);
+        CuAssertDblEquals(tc, xy[2*i+1], xy2[2*i+1], 1e-2);
+    }
+
+    // TAN only.
+    ngood = tan_xyzarr2pixelxy_array(&(wcs->wcstan), xyz, N, xy2, ok);
+    CuAssertIntEquals(tc, N-1, ngood);
+    tan_pixelxy2radec_array(&(wcs->wcstan), xy2+2, N-1, radec2+2);
+    for (i=1; i<N; i++) {
+        double sx, sy;
+        CuAssertTrue(tc, tan_xyzarr2pixelxy(&(wcs->wcstan), xyz+3*i, &sx, &sy));
+        CuAssertDblEquals(tc, sx, xy2[2*i+0], 1e-6);
+        CuAssertDblEquals(tc, sy, xy2[2*i+1], 1e-6);
+        tan_pixelxy2xyzarr_array(&(wcs->wcstan), xy2+2*i, 1, xyz2);
+        CuAssertDblEquals(tc, xyz[3*i+0], xyz2[0], 1e-12);
+        CuAssertDblEquals(tc, xyz[3*i+1], xyz2[1], 1e-12);
+        CuAssertDblEquals(tc, xyz[3*i+2], xyz2[2], 1e-12);
+        CuAssertDblEquals(tc, radec[2*i+0], radec2[2*i+0], 1e-9);
+        CuAssertDblEquals(tc, radec[2*i+1], radec2[2*i+1], 1e-9);
+    }
+
+    free(xy);
+    free(xy2);
+    free(radec);
+    free(radec2);
+    free(xyz);
+    free(xyz2);
+    free(ok);
+    sip_free(wcs);
+}
+
+void test_inverse_grid(CuTest* tc) {
+    double x, y;
+    double maxerr;
+    sip_invgrid_t* g;
+    sip_invgrid_t* gn;
+    // This WCS has no AP,BP terms.
+    sip_t* wcs = sip_from_string(wcsfile, 0, NULL);
+    CuAssertPtrNotNull(tc, wcs);
+    CuAssertIntEquals(tc, 0, wcs->ap_order);
+
+    g = sip_invgrid_new(wcs, 0, 0);
+    gn = sip_invgrid_new(wcs, 0, 2);
+    CuAssertPtrNotNull(tc, g);
+    CuAssertPtrNotNull(tc, gn);
+    CuAssertIntEquals(tc, 0, sip_invgrid_build(g));
+    maxerr = sip_invgrid_max_error(g);
+    printf("SIP inverse grid: max error %g pixels\n", maxerr);
+    CuAssertTrue(tc, maxerr < 1e-2);
+
+    for (y=0; y<=sip_imageh(wcs); y+=100) {
+        for (x=0; x<=sip_imagew(wcs); x+=100) {
+            double ra, dec, x2, y2;
+            double radec[2], xy[2];
+            anbool ok;
+            sip_pixelxy2radec(wcs, x, y, &ra, &dec);
+            CuAssertTrue(tc, sip_invgrid_radec2pixelxy(g, ra, dec, &x2, &y2));
+            CuAssertDblEquals(tc, x, x2, 1e-2);
+            CuAssertDblEquals(tc, y, y2, 1e-2);
+            CuAssertTrue(tc, sip_invgrid_radec2pixelxy(gn, ra, dec, &x2, &y2));
+            CuAssertDblEquals(tc, x, x2, 1e-6);
+            CuAssertDblEquals(tc, y, y2, 1e-6);
+            radec[0] = ra;
+            radec[1] = dec;
+            CuAssertIntEquals(tc, 1, sip_invgrid_radec2pixelxy_array(gn, radec, 1, xy, &ok));
+            CuAssertTrue(tc, ok);
+            CuAssertDblEquals(tc, x2, xy[0], 1e-9);
+            CuAssertDblEquals(tc, y2, xy[1], 1e-9);
+        }
+    }
+    // Far outside the grid: falls back to Newton's method.
+    sip_pixel_distortion(wcs, -5000, 8000, &x, &y);
+    sip_invgrid_undistort(g, x, y, &x, &y);
+    CuAssertDblEquals(tc, -5000, x, 1e-6);
+    CuAssertDblEquals(tc,  8000, y, 1e-6);
+
+    sip_invgrid_free(g);
+    sip_invgrid_free(gn);
+    sip_free(wcs);
+}
+
@@ -0,0 +1,71 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "starkd.h"
+#include "kdtree.h"
+#include "starutil.h"
+#include "ioutils.h"
+
+// Builds a star tree (with a permutation) of N random stars.
+static startree_t* build_tree(int N) {
+    startree_t* s = startree_new();
+    double* xyz = malloc(N * 3 * sizeof(double));
+    double lo[3] = { -1, -1, -1 };
+    double hi[3] = { 1, 1, 1 };
+    int i;
+    srand(7);
+    for (i=0; i<N; i++)
+        radecdeg2xyzarr(360.0 * rand() / (double)RAND_MAX,
+                        180.0 * rand() / (double)RAND_MAX - 90.0, xyz + 3*i);
+    s->tree = kdtree_new(N, 3, 10);
+    kdtree_set_limits(s->tree, lo, hi);
+    s->tree = kdtree_build(s->tree, xyz, N, 3, 10,
+                           KDTT_DOUBLE_U32, KD_BUILD_SPLIT);
+    kdtree_set_name(s->tree, STARTREE_NAME);
+    return s;
+}
+
+static void check_invperm(CuTest* tc, const char* fn, anbool stored,
+                          const int* expect, int N) {
+    startree_t* s = startree_open(fn);
+    double xyz[3];
+    CuAssertPtrNotNull(tc, s);
+    CuAssertIntEquals(tc, stored, s->inverse_perm_in_file);
+    startree_compute_inverse_perm(s);
+    CuAssertPtrNotNull(tc, s->inverse_perm);
+    CuAssertIntEquals(tc, 0, memcmp(expect, s->inverse_perm, N * sizeof(int)));
+    CuAssertIntEquals(tc, 0, startree_get(s, N / 2, xyz));
+    startree_close(s);
+}
+
+void test_startree_stored_inverse_perm(CuTest* tc) {
+    int N = 1000;
+    char* fn1 = create_temp_file("test_starkd", "/tmp");
+    char* fn2 = create_temp_file("test_starkd", "/tmp");
+    startree_t* s = build_tree(N);
+    int* expect;
+
+    // without the table, it's computed at load.
+    CuAssertIntEquals(tc, 0, startree_write_to_file(s, fn1));
+    startree_compute_inverse_perm(s);
+    expect = malloc(N * sizeof(int));
+    memcpy(expect, s->inverse_perm, N * sizeof(int));
+    CuAssertIntEquals(tc, 0, startree_write_to_file(s, fn2));
+    startree_close(s);
+
+    check_invperm(tc, fn1, FALSE, expect, N);
+    check_invperm(tc, fn2, TRUE, expect, N);
+
+    free(expect);
+    unlink(fn1);
+    unlink(fn2);
+    free(fn1);
+    free(fn2);
+}
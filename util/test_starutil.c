@@ -5,8 +5,12 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "starutil.h"
+#include "mathutil.h"
 #include "cutest.h"
 
 void test_ra2hmsstring(CuTest* tc) {
@@ -152,3 +156,107 @@ void test_xtodistsq(CuTest* tc) {
     x = distsq2arcsec(distsq);
     CuAssertDblEquals(tc, distsq, arcsec2distsq(x), 1e-8);
 }
+
+// The _batch_approx conversions against long-double math.
+void test_batch_conversions(CuTest* tc) {
+    int N = 20000;
+    double* ra = malloc(N * sizeof(double));
+    double* dec = malloc(N * sizeof(double));
+    double* xyz = malloc(3 * N * sizeof(double));
+    double* xyz2 = malloc(3 * N * sizeof(double));
+    double* ra2 = malloc(N * sizeof(double));
+    double* dec2 = malloc(N * sizeof(double));
+    double* d2 = malloc(N * sizeof(double));
+    double* out = malloc(N * sizeof(double));
+    double maxerr = 0, maxangerr = 0, maxdisterr = 0;
+    int i;
+    srand(13);
+    for (i=0; i<N; i++) {
+        ra[i] = 720.0 * rand() / (double)RAND_MAX - 360.0;
+        dec[i] = 180.0 * rand() / (double)RAND_MAX - 90.0;
+    }
+    // quadrant edges and poles.
+    ra[0] = 0.0;   dec[0] = 90.0;
+    ra[1] = 90.0;  dec[1] = -90.0;
+    ra[2] = 180.0; dec[2] = 0.0;
+    ra[3] = 270.0; dec[3] = 89.9999999;
+    ra[4] = 360.0; dec[4] = 45.0;
+    ra[5] = -45.0; dec[5] = -45.0;
+
+    radecdeg2xyz_batch_approx(ra, dec, xyz, N);
+    for (i=0; i<N; i++) {
+        long double r = ra[i] * (M_PI / 180.0L), d = dec[i] * (M_PI / 180.0L);
+        maxerr = fmax(maxerr, fabs(xyz[3*i+0] - (double)(cosl(d) * cosl(r))));
+        maxerr = fmax(maxerr, fabs(xyz[3*i+1] - (double)(cosl(d) * sinl(r))));
+        maxerr = fmax(maxerr, fabs(xyz[3*i+2] - (double)sinl(d)));
+    }
+    CuAssertTrue(tc, maxerr < 1e-15);
+    CuAssertDblEquals(tc, 0.0, xyz[1*3 + 0], 0.0);
+    CuAssertDblEquals(tc, -1.0, xyz[2*3 + 0], 0.0);
+
+    xyzarr2radecdeg_batch_approx(xyz, ra2, dec2, N);
+    for (i=0; i<N; i++) {
+        long double x = xyz[3*i], y = xyz[3*i+1], z = xyz[3*i+2];
+        long double r = atan2l(y, x), d = atan2l(z, sqrtl(x*x + y*y));
+        if (r < 0)
+            r += 2.0L * M_PI;
+        // (RA is arbitrary at the poles.)
+        if (fabs(dec[i]) < 90.0)
+            maxangerr = fmax(maxangerr, fabs(ra2[i] - (double)(r * (180.0L / M_PI))));
+        maxangerr = fmax(maxangerr, fabs(dec2[i] - (double)(d * (180.0L / M_PI))));
+        CuAssertTrue(tc, ra2[i] >= 0.0 && ra2[i] <= 360.0);
+    }
+    CuAssertTrue(tc, maxangerr < 1e-15 * DEG_PER_RAD * 4);
+
+    // distances, from tiny to antipodal.
+    for (i=0; i<N; i++)
+        d2[i] = (i % 2) ? 4.0 * rand() / (double)RAND_MAX :
+            pow(10.0, -20.0 * rand() / (double)RAND_MAX);
+    d2[0] = 0.0;
+    d2[1] = 4.0;
+    distsq2arcsec_batch_approx(d2, out, N);
+    for (i=0; i<N; i++) {
+        long double truth = 2.0L * asinl(sqrtl(d2[i]) / 2.0L) * (180.0L * 3600.0L / M_PI);
+        maxdisterr = fmax(maxdisterr, fabs(out[i] - (double)truth) / fmax(1.0, (double)truth));
+    }
+    CuAssertTrue(tc, maxdisterr < 1e-15);
+    CuAssertDblEquals(tc, 180.0 * 3600.0, out[1], 1e-9);
+
+    arcsec_between_radecdeg_batch_approx(ra, dec, ra2, dec2, out, N);
+    for (i=0; i<N; i++)
+        CuAssertTrue(tc, out[i] < 1e-9);
+
+    // the approximate positions are within 1e-9 arcsec of the precise ones.
+    radecdeg2xyz_batch(ra, dec, xyz, N);
+    radecdeg2xyz_batch_approx(ra, dec, xyz2, N);
+    for (i=0; i<N; i++)
+        CuAssertTrue(tc, distsq2arcsec(distsq(xyz + 3*i, xyz2 + 3*i, 3)) < 1e-9);
+    xyzarr2radecdeg_batch(xyz, ra2, dec2, N);
+    xyzarr2radecdeg_batch_approx(xyz, ra, dec, N);
+    arcsec_between_radecdeg_batch(ra, dec, ra2, dec2, out, N);
+    for (i=0; i<N; i++)
+        CuAssertTrue(tc, out[i] < 1e-9);
+
+    // the plain _batch functions are the scalar ones, bit for bit.
+    for (i=0; i<N; i++) {
+        double p[3];
+        double r, d;
+        radecdeg2xyzarr(ra[i], dec[i], p);
+        radecdeg2xyz_batch(ra + i, dec + i, xyz + 3*i, 1);
+        CuAssertTrue(tc, memcmp(p, xyz + 3*i, sizeof(p)) == 0);
+        xyzarr2radecdeg(p, &r, &d);
+        xyzarr2radecdeg_batch(p, ra2 + i, dec2 + i, 1);
+        CuAssertTrue(tc, r == ra2[i] && d == dec2[i]);
+    }
+
+    printf("batch conversions: max errors xyz %g, angles %g deg, distances %g\n",
+           maxerr, maxangerr, maxdisterr);
+    free(ra);
+    free(dec);
+    free(xyz);
+    free(xyz2);
+    free(ra2);
+    free(dec2);
+    free(d2);
+    free(out);
+}
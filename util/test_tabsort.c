@@ -0,0 +1,93 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tabsort.h"
+#include "fitstable.h"
+#include "ioutils.h"
+
+#include "cutest.h"
+
+static void write_table(const char* fn, int N) {
+    fitstable_t* t;
+    int i;
+    srand(17);
+    t = fitstable_open_for_writing(fn);
+    fitstable_add_write_column(t, fitscolumn_int_type(), "ID", "");
+    fitstable_add_write_column(t, fitscolumn_double_type(), "MAG", "");
+    fitstable_add_write_column(t, fitscolumn_i64_type(), "HP", "");
+    fitstable_write_primary_header(t);
+    fitstable_write_header(t);
+    for (i=0; i<N; i++) {
+        // (coarse values, so that there are ties)
+        double mag = (rand() % 50) * 0.1;
+        int64_t hp = (int64_t)(rand() % 30) << 33;
+        fitstable_write_row(t, &i, &mag, &hp);
+    }
+    fitstable_fix_header(t);
+    fitstable_close(t);
+}
+
+static void check_external(CuTest* tc, const char* col, int descending) {
+    const char* infn = "/tmp/test-tabsort-in.fits";
+    const char* fn1 = "/tmp/test-tabsort-1.fits";
+    const char* fn2 = "/tmp/test-tabsort-2.fits";
+    char* buf1;
+    char* buf2;
+    size_t len1, len2;
+
+    write_table(infn, 1000);
+    CuAssertIntEquals(tc, 0, tabsort(infn, fn1, col, descending));
+    // uneven runs, more of them than threads.
+    CuAssertIntEquals(tc, 0, tabsort_external(infn, fn2, col, descending,
+                                              73, 3, NULL));
+    buf1 = file_get_contents(fn1, &len1, FALSE);
+    buf2 = file_get_contents(fn2, &len2, FALSE);
+    CuAssertPtrNotNull(tc, buf1);
+    CuAssertPtrNotNull(tc, buf2);
+    CuAssertIntEquals(tc, (int)len1, (int)len2);
+    CuAssertIntEquals(tc, 0, memcmp(buf1, buf2, len1));
+    free(buf1);
+    free(buf2);
+}
+
+void test_tabsort_stable(CuTest* tc) {
+    const char* infn = "/tmp/test-tabsort-in.fits";
+    const char* outfn = "/tmp/test-tabsort-1.fits";
+    fitstable_t* t;
+    double* mag;
+    int* id;
+    int i, N;
+
+    write_table(infn, 1000);
+    CuAssertIntEquals(tc, 0, tabsort(infn, outfn, "MAG", FALSE));
+    t = fitstable_open(outfn);
+    CuAssertPtrNotNull(tc, t);
+    N = fitstable_nrows(t);
+    CuAssertIntEquals(tc, 1000, N);
+    mag = fitstable_read_column(t, "MAG", fitscolumn_double_type());
+    id = fitstable_read_column(t, "ID", fitscolumn_int_type());
+    for (i=1; i<N; i++) {
+        CuAssertTrue(tc, mag[i-1] <= mag[i]);
+        if (mag[i-1] == mag[i])
+            CuAssertTrue(tc, id[i-1] < id[i]);
+    }
+    free(mag);
+    free(id);
+    fitstable_close(t);
+}
+
+void test_tabsort_external_double(CuTest* tc) {
+    check_external(tc, "MAG", FALSE);
+    check_external(tc, "MAG", TRUE);
+}
+
+void test_tabsort_external_int64(CuTest* tc) {
+    check_external(tc, "HP", FALSE);
+    check_external(tc, "HP", TRUE);
+}
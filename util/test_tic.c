@@ -0,0 +1,82 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cutest.h"
+#include "tic.h"
+#include "ioutils.h"
+
+static void* worker(void* arg) {
+    PROFILE_BEGIN("outer");
+    PROFILE_BEGIN("inner");
+    usleep(2000);
+    PROFILE_END("inner");
+    PROFILE_END("outer");
+    return NULL;
+}
+
+// Returns the value of the line for "stack" in the folded profile, or -1.
+static long folded_value(const char* txt, const char* stack) {
+    const char* p = txt;
+    size_t n = strlen(stack);
+    while (p && *p) {
+        if (!strncmp(p, stack, n) && p[n] == ' ')
+            return atol(p + n + 1);
+        p = strchr(p, '\n');
+        if (p)
+            p++;
+    }
+    return -1;
+}
+
+void test_profile(CuTest* tc) {
+    pthread_t thread;
+    char* fn = create_temp_file("test_tic", NULL);
+    char* txt;
+    long inner;
+
+    // (disabled: nothing recorded.)
+    worker(NULL);
+    profile_enable(1);
+    // unbalanced ends are ignored.
+    PROFILE_END("nothing");
+    worker(NULL);
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_join(thread, NULL);
+    // an inner region left open is closed with its parent.
+    PROFILE_BEGIN("outer");
+    PROFILE_BEGIN("leaked");
+    PROFILE_END("outer");
+    PROFILE_BEGIN("second");
+    usleep(1000);
+    PROFILE_END("second");
+    profile_enable(0);
+
+    unlink(fn);
+    CuAssertIntEquals(tc, 0, profile_append_to_file(fn, "test"));
+    txt = file_get_contents(fn, NULL, TRUE);
+    CuAssertPtrNotNull(tc, txt);
+    // the two threads' times are summed into one line.
+    inner = folded_value(txt, "test;outer;inner");
+    CuAssertTrue(tc, inner >= 4000);
+    CuAssertTrue(tc, inner < 1000000);
+    CuAssertTrue(tc, folded_value(txt, "test;outer;leaked") >= 0);
+    CuAssertTrue(tc, folded_value(txt, "test;second") >= 1000);
+    CuAssertIntEquals(tc, -1, folded_value(txt, "test;nothing"));
+    free(txt);
+
+    profile_reset();
+    unlink(fn);
+    CuAssertIntEquals(tc, 0, profile_append_to_file(fn, "test"));
+    txt = file_get_contents(fn, NULL, TRUE);
+    CuAssertIntEquals(tc, -1, folded_value(txt, "test;outer;inner"));
+    free(txt);
+    unlink(fn);
+    free(fn);
+}
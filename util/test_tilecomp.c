@@ -0,0 +1,283 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cutest.h"
+#include "anqfits.h"
+#include "qfits_tilecomp.h"
+
+struct bitwriter {
+    unsigned char* p;
+    int n;
+};
+
+static void put_bits(struct bitwriter* w, uint32_t val, int nbits) {
+    int i;
+    for (i=nbits-1; i>=0; i--) {
+        if (w->n % 8 == 0)
+            w->p[w->n / 8] = 0;
+        if ((val >> i) & 1)
+            w->p[w->n / 8] |= 0x80 >> (w->n % 8);
+        w->n++;
+    }
+}
+
+// Rice compression, the way fpack does it.
+static int rice_compress(const int32_t* a, int n, int bytepix, int nblock,
+                         unsigned char* out) {
+    int fsbits = (bytepix == 1 ? 3 : bytepix == 2 ? 4 : 5);
+    int fsmax = (bytepix == 1 ? 6 : bytepix == 2 ? 14 : 25);
+    int bbits = 8 * bytepix;
+    uint32_t mask = (bbits == 32) ? 0xffffffff : ((1u << bbits) - 1);
+    struct bitwriter w;
+    int32_t lastpix;
+    int i, j;
+
+    w.p = out;
+    w.n = 0;
+    put_bits(&w, (uint32_t)a[0] & mask, bbits);
+    lastpix = a[0];
+    for (i=0; i<n; i+=nblock) {
+        int nb = (n - i < nblock) ? n - i : nblock;
+        uint32_t diff[64];
+        double pixelsum = 0, dpsum;
+        uint32_t psum;
+        int fs;
+        for (j=0; j<nb; j++) {
+            // (the differences wrap around at "bytepix" bytes)
+            int32_t pdiff = (int32_t)((uint32_t)a[i+j] - (uint32_t)lastpix);
+            if (bytepix == 1)
+                pdiff = (int8_t)pdiff;
+            else if (bytepix == 2)
+                pdiff = (int16_t)pdiff;
+            diff[j] = (pdiff < 0) ? ~((uint32_t)pdiff << 1) : ((uint32_t)pdiff << 1);
+            diff[j] &= mask;
+            pixelsum += diff[j];
+            lastpix = a[i+j];
+        }
+        dpsum = (pixelsum - (nb/2) - 1) / nb;
+        if (dpsum < 0)
+            dpsum = 0.0;
+        psum = ((uint32_t)dpsum) >> 1;
+        for (fs=0; psum>0; fs++)
+            psum >>= 1;
+        if (fs >= fsmax) {
+            put_bits(&w, fsmax+1, fsbits);
+            for (j=0; j<nb; j++)
+                put_bits(&w, diff[j], bbits);
+        } else if (fs == 0 && pixelsum == 0) {
+            put_bits(&w, 0, fsbits);
+        } else {
+            put_bits(&w, fs+1, fsbits);
+            for (j=0; j<nb; j++) {
+                uint32_t top = diff[j] >> fs;
+                uint32_t k;
+                for (k=0; k<top; k++)
+                    put_bits(&w, 0, 1);
+                put_bits(&w, 1, 1);
+                if (fs)
+                    put_bits(&w, diff[j] & ((1u << fs) - 1), fs);
+            }
+        }
+    }
+    return (w.n + 7) / 8;
+}
+
+static int ncards;
+
+static void card(FILE* f, const char* key, const char* val) {
+    char buf[81];
+    if (val)
+        sprintf(buf, "%-8s= %20s", key, val);
+    else
+        sprintf(buf, "%-8s", key);
+    fprintf(f, "%-80s", buf);
+    ncards++;
+}
+
+static void card_int(FILE* f, const char* key, int val) {
+    char buf[32];
+    sprintf(buf, "%i", val);
+    card(f, key, buf);
+}
+
+static void end_header(FILE* f) {
+    card(f, "END", NULL);
+    for (; ncards % 36; ncards++)
+        fprintf(f, "%-80s", "");
+}
+
+// Writes an NX x NY image of "values", Rice-compressed in TX x TY tiles.
+static void write_tiled(const char* fn, int bitpix, int bytepix,
+                        const int32_t* values, int NX, int NY, int TX, int TY,
+                        const char** extra) {
+    unsigned char heap[100000];
+    unsigned char rows[1000 * 8];
+    int32_t tile[1000];
+    size_t nheap = 0;
+    int ntiles = 0;
+    int tx, ty, x, y, i;
+    FILE* f;
+
+    for (ty=0; ty<NY; ty+=TY)
+        for (tx=0; tx<NX; tx+=TX) {
+            int n = 0, nc;
+            for (y=ty; y<ty+TY && y<NY; y++)
+                for (x=tx; x<tx+TX && x<NX; x++)
+                    tile[n++] = values[y*NX + x];
+            nc = rice_compress(tile, n, bytepix, 32, heap + nheap);
+            for (i=0; i<4; i++) {
+                rows[ntiles*8 + i] = (nc >> (24 - 8*i)) & 0xff;
+                rows[ntiles*8 + 4 + i] = (nheap >> (24 - 8*i)) & 0xff;
+            }
+            nheap += nc;
+            ntiles++;
+        }
+
+    f = fopen(fn, "wb");
+    ncards = 0;
+    card(f, "SIMPLE", "T");
+    card_int(f, "BITPIX", 8);
+    card_int(f, "NAXIS", 0);
+    card(f, "EXTEND", "T");
+    end_header(f);
+    ncards = 0;
+    card(f, "XTENSION", "'BINTABLE'");
+    card_int(f, "BITPIX", 8);
+    card_int(f, "NAXIS", 2);
+    card_int(f, "NAXIS1", 8);
+    card_int(f, "NAXIS2", ntiles);
+    card_int(f, "PCOUNT", nheap);
+    card_int(f, "GCOUNT", 1);
+    card_int(f, "TFIELDS", 1);
+    card(f, "TTYPE1", "'COMPRESSED_DATA'");
+    card(f, "TFORM1", "'1PB(1000)'");
+    card(f, "ZIMAGE", "T");
+    card_int(f, "ZBITPIX", bitpix);
+    card_int(f, "ZNAXIS", 2);
+    card_int(f, "ZNAXIS1", NX);
+    card_int(f, "ZNAXIS2", NY);
+    card_int(f, "ZTILE1", TX);
+    card_int(f, "ZTILE2", TY);
+    card(f, "ZCMPTYPE", "'RICE_1'");
+    card(f, "ZNAME1", "'BLOCKSIZE'");
+    card_int(f, "ZVAL1", 32);
+    card(f, "ZNAME2", "'BYTEPIX'");
+    card_int(f, "ZVAL2", bytepix);
+    for (; extra && *extra; extra+=2)
+        card(f, extra[0], extra[1]);
+    end_header(f);
+    fwrite(rows, 1, ntiles * 8, f);
+    fwrite(heap, 1, nheap, f);
+    for (i=ntiles*8 + nheap; i % 2880; i++)
+        fputc(0, f);
+    fclose(f);
+}
+
+static void make_values(int32_t* v, int N, int bitpix) {
+    int i;
+    uint32_t s = 42;
+    for (i=0; i<N; i++) {
+        s = s * 1103515245 + 12345;
+        if (i % 97 < 40)
+            // flat, then smooth, then noisy...
+            v[i] = 100;
+        else if (i % 97 < 70)
+            v[i] = 100 + (i % 7) + (s >> 28);
+        else
+            v[i] = (int16_t)(s >> 16);
+        if (bitpix == 8)
+            v[i] &= 0xff;
+    }
+}
+
+void test_tilecomp_int16(CuTest* tc) {
+    const char* fn = "/tmp/test-tilecomp-1.fits";
+    const char* extra[] = { "BZERO", "32768", NULL };
+    int NX = 37, NY = 23;
+    int32_t vals[37*23];
+    anqfits_t* anq;
+    int32_t* img;
+    float* win;
+    int W, H, x, y;
+
+    make_values(vals, NX*NY, 16);
+    write_tiled(fn, 16, 2, vals, NX, NY, 10, 5, extra);
+
+    anq = anqfits_open(fn);
+    CuAssertPtrNotNull(tc, anq);
+    img = anqfits_readpix(anq, 1, 0, 0, 0, 0, 0, PTYPE_INT, NULL, &W, &H);
+    CuAssertPtrNotNull(tc, img);
+    CuAssertIntEquals(tc, NX, W);
+    CuAssertIntEquals(tc, NY, H);
+    for (y=0; y<NY; y++)
+        for (x=0; x<NX; x++)
+            CuAssertIntEquals(tc, vals[y*NX + x] + 32768, img[y*NX + x]);
+    free(img);
+
+    // a window that cuts through tiles.
+    win = anqfits_readpix(anq, 1, 5, 26, 3, 17, 0, PTYPE_FLOAT, NULL, &W, &H);
+    CuAssertPtrNotNull(tc, win);
+    CuAssertIntEquals(tc, 21, W);
+    CuAssertIntEquals(tc, 14, H);
+    for (y=0; y<H; y++)
+        for (x=0; x<W; x++)
+            CuAssertDblEquals(tc, vals[(y+3)*NX + x+5] + 32768.0,
+                              win[y*W + x], 0.0);
+    free(win);
+    anqfits_close(anq);
+}
+
+// (we're built with -ffinite-math-only, so isnan() can't be trusted.)
+static int is_nan(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return ((u & 0x7ff0000000000000ULL) == 0x7ff0000000000000ULL) &&
+        (u & 0x000fffffffffffffULL);
+}
+
+void test_tilecomp_quantized(CuTest* tc) {
+    const char* fn = "/tmp/test-tilecomp-2.fits";
+    const char* extra[] = { "ZQUANTIZ", "'NO_DITHER'", "ZSCALE", "0.25",
+                            "ZZERO", "10.0", "ZBLANK", "-2147483647", NULL };
+    int NX = 50, NY = 8;
+    int32_t vals[50*8];
+    anqfits_t* anq;
+    double* img;
+    int i;
+
+    make_values(vals, NX*NY, 32);
+    vals[17] = -2147483647;
+    write_tiled(fn, -32, 4, vals, NX, NY, NX, 1, extra);
+
+    anq = anqfits_open(fn);
+    CuAssertPtrNotNull(tc, anq);
+    img = anqfits_readpix(anq, 1, 0, 0, 0, 0, 0, PTYPE_DOUBLE, NULL, NULL, NULL);
+    CuAssertPtrNotNull(tc, img);
+    for (i=0; i<NX*NY; i++) {
+        if (i == 17)
+            CuAssertTrue(tc, is_nan(img[i]));
+        else
+            CuAssertDblEquals(tc, vals[i] * 0.25 + 10.0, img[i], 0.0);
+    }
+    free(img);
+    anqfits_close(anq);
+}
+
+void test_rice_bytes(CuTest* tc) {
+    int32_t vals[300], out[300];
+    unsigned char buf[2000];
+    int n, i;
+
+    make_values(vals, 300, 8);
+    n = rice_compress(vals, 300, 1, 32, buf);
+    CuAssertIntEquals(tc, 0, qfits_rice_decompress(buf, n, 1, 32, out, 300));
+    for (i=0; i<300; i++)
+        CuAssertIntEquals(tc, vals[i], out[i]);
+    // truncated data is an error, not a crash.
+    CuAssertIntEquals(tc, -1, qfits_rice_decompress(buf, n/2, 1, 32, out, 300));
+}
@@ -298,3 +298,61 @@ void test_read_write_xy(CuTest* ct) {
     free(fn);
 }
 
+
+void test_read_rows(CuTest* ct) {
+    xylist_t *in, *out;
+    char* fn = get_tmpfile(4);
+    starxy_t fld;
+    starxy_t* rows;
+    int N = 50;
+    double x[N], y[N], flux[N];
+    int i;
+
+    for (i=0; i<N; i++) {
+        x[i] = i;
+        y[i] = 2 * i;
+        flux[i] = 1000 - i;
+    }
+    fld.N = N;
+    fld.x = x;
+    fld.y = y;
+    fld.flux = flux;
+    fld.background = NULL;
+
+    out = xylist_open_for_writing(fn);
+    CuAssertPtrNotNull(ct, out);
+    xylist_set_include_flux(out, TRUE);
+    CuAssertIntEquals(ct, 0, xylist_write_primary_header(out));
+    CuAssertIntEquals(ct, 0, xylist_write_header(out));
+    CuAssertIntEquals(ct, 0, xylist_write_field(out, &fld));
+    CuAssertIntEquals(ct, 0, xylist_fix_header(out));
+    CuAssertIntEquals(ct, 0, xylist_close(out));
+
+    in = xylist_open(fn);
+    CuAssertPtrNotNull(ct, in);
+    xylist_set_include_flux(in, TRUE);
+    CuAssertIntEquals(ct, N, xylist_get_nrows(in));
+
+    // the first (brightest) few
+    rows = xylist_read_field_rows(in, 0, 10, NULL);
+    CuAssertPtrNotNull(ct, rows);
+    CuAssertIntEquals(ct, 10, starxy_n(rows));
+    for (i=0; i<10; i++) {
+        CuAssertTrue(ct, rows->x[i] == x[i]);
+        CuAssertTrue(ct, rows->flux[i] == flux[i]);
+    }
+    starxy_free(rows);
+
+    // a range running off the end is cut short
+    rows = xylist_read_field_rows(in, 45, 10, NULL);
+    CuAssertPtrNotNull(ct, rows);
+    CuAssertIntEquals(ct, 5, starxy_n(rows));
+    for (i=0; i<5; i++)
+        CuAssertTrue(ct, rows->y[i] == y[45 + i]);
+    starxy_free(rows);
+
+    CuAssertPtrEquals(ct, NULL, xylist_read_field_rows(in, N+1, 1, NULL));
+
+    CuAssertIntEquals(ct, 0, xylist_close(in));
+    free(fn);
+}
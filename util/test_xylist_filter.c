@@ -0,0 +1,172 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cutest.h"
+#include "xylist-filter.h"
+#include "starxy.h"
+#include "fitstable.h"
+#include "ioutils.h"
+
+void test_removelines(CuTest* tc) {
+    // a scatter of sources, plus a bad column at x=50.
+    double x[40], y[40];
+    anbool keep[40];
+    int i, N = 0;
+    for (i=0; i<20; i++) {
+        x[N] = (i * 37) % 97 + 0.3;
+        y[N] = (i * 53) % 89 + 0.6;
+        N++;
+    }
+    for (i=0; i<20; i++) {
+        x[N] = 50.2;
+        y[N] = 2 + 4.5 * i;
+        N++;
+    }
+    for (i=0; i<N; i++)
+        keep[i] = TRUE;
+    CuAssertIntEquals(tc, 20, removelines(x, y, N, 10, keep));
+    for (i=0; i<20; i++)
+        CuAssertIntEquals(tc, x[i] >= 49.5 && x[i] < 50.5 ? FALSE : TRUE, keep[i]);
+    for (i=20; i<N; i++)
+        CuAssertIntEquals(tc, FALSE, keep[i]);
+}
+
+void test_uniformize(CuTest* tc) {
+    // four bright sources in the lower-left corner, then one in each of
+    // the other corners.
+    double x[] = { 1, 2, 1, 2, 99, 1, 99 };
+    double y[] = { 1, 1, 2, 2, 1, 99, 99 };
+    int expect[] = { 0, 4, 5, 6, 1, 2, 3 };
+    int* order;
+    int i, N;
+
+    order = uniformize(x, y, 7, 4, &N);
+    CuAssertIntEquals(tc, 7, N);
+    for (i=0; i<N; i++)
+        CuAssertIntEquals(tc, expect[i], order[i]);
+    free(order);
+}
+
+void test_resort_flux_background(CuTest* tc) {
+    double flux[] = { 10, 30, 20, 5 };
+    double back[] = { 0, 0, 0, 100 };
+    // by flux: 1, 2, 0, 3; by flux + background: 3, 1, 2, 0.
+    int expect[] = { 1, 3, 2, 0 };
+    int* order;
+    int i;
+
+    order = resort_flux_background(flux, back, 4, FALSE);
+    for (i=0; i<4; i++)
+        CuAssertIntEquals(tc, expect[i], order[i]);
+    free(order);
+}
+
+// the sources of test_removelines(), with flux = index.
+static starxy_t* bad_column_sources(void) {
+    starxy_t* xy = starxy_new(40, TRUE, FALSE);
+    int i;
+    for (i=0; i<20; i++) {
+        starxy_set(xy, i, (i * 37) % 97 + 0.3, (i * 53) % 89 + 0.6);
+        starxy_set(xy, 20 + i, 50.2, 2 + 4.5 * i);
+    }
+    for (i=0; i<40; i++)
+        starxy_set_flux(xy, i, i);
+    return xy;
+}
+
+void test_starxy_removelines(CuTest* tc) {
+    starxy_t* xy = bad_column_sources();
+    int i, n = 0;
+    CuAssertIntEquals(tc, 20, starxy_removelines(xy, 10));
+    CuAssertIntEquals(tc, 20, starxy_n(xy));
+    // the survivors keep their order (and their fluxes).
+    for (i=0; i<20; i++) {
+        if ((i * 37) % 97 == 50)
+            continue;
+        CuAssertDblEquals(tc, i, starxy_get_flux(xy, n), 0);
+        n++;
+    }
+    starxy_free(xy);
+}
+
+void test_removelines_file(CuTest* tc) {
+    char* infn = create_temp_file("test_removelines_in", NULL);
+    char* outfn = create_temp_file("test_removelines_out", NULL);
+    starxy_t* xy = bad_column_sources();
+    fitstable_t* tab;
+    double* x;
+    int* id;
+    int i;
+
+    tab = fitstable_open_for_writing(infn);
+    fitstable_add_write_column(tab, TFITS_BIN_TYPE_D, "X", "");
+    fitstable_add_write_column(tab, TFITS_BIN_TYPE_D, "Y", "");
+    fitstable_add_write_column(tab, TFITS_BIN_TYPE_J, "ID", "");
+    CuAssertIntEquals(tc, 0, fitstable_write_primary_header(tab));
+    CuAssertIntEquals(tc, 0, fitstable_write_header(tab));
+    for (i=0; i<xy->N; i++)
+        CuAssertIntEquals(tc, 0, fitstable_write_row(tab, xy->x + i,
+                                                     xy->y + i, &i));
+    CuAssertIntEquals(tc, 0, fitstable_fix_header(tab));
+    CuAssertIntEquals(tc, 0, fitstable_close(tab));
+
+    CuAssertIntEquals(tc, 0, removelines_file(infn, outfn, NULL, NULL, 10));
+    starxy_removelines(xy, 10);
+
+    tab = fitstable_open(outfn);
+    CuAssertPtrNotNull(tc, tab);
+    CuAssertIntEquals(tc, xy->N, fitstable_nrows(tab));
+    x = fitstable_read_column(tab, "X", TFITS_BIN_TYPE_D);
+    // the other columns come along.
+    id = fitstable_read_column(tab, "ID", TFITS_BIN_TYPE_J);
+    for (i=0; i<xy->N; i++) {
+        CuAssertDblEquals(tc, xy->x[i], x[i], 0);
+        CuAssertDblEquals(tc, xy->flux[i], id[i], 0);
+    }
+    free(x);
+    free(id);
+    fitstable_close(tab);
+    starxy_free(xy);
+    unlink(infn);
+    unlink(outfn);
+    free(infn);
+    free(outfn);
+}
+
+void test_resort_flux_background_topk(CuTest* tc) {
+    int N = 200000;
+    double* flux = malloc(N * sizeof(double));
+    double* back = malloc(N * sizeof(double));
+    int Ks[] = { 1, 10, 1000, N };
+    int* full;
+    int i, j;
+
+    srand(4);
+    for (i=0; i<N; i++) {
+        // with ties
+        flux[i] = rand() % 5000;
+        back[i] = rand() % 100;
+    }
+    full = resort_flux_background(flux, back, N, FALSE);
+    for (j=0; j<sizeof(Ks)/sizeof(int); j++) {
+        int* top = resort_flux_background_topk(flux, back, N, FALSE, Ks[j]);
+        CuAssertIntEquals(tc, 0, memcmp(full, top, Ks[j] * sizeof(int)));
+        free(top);
+    }
+    // every source, once
+    {
+        char* seen = calloc(N, 1);
+        for (i=0; i<N; i++) {
+            CuAssertIntEquals(tc, 0, seen[full[i]]);
+            seen[full[i]] = 1;
+        }
+        free(seen);
+    }
+    free(full);
+    free(flux);
+    free(back);
+}
@@ -10,6 +10,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "tic.h"
 #include "errors.h"
@@ -76,3 +78,223 @@ void toc() {
     logmsg("Used %g s user, %g s system (%g s total), %g s wall time since last check\n",
            utime-startutime, stime-startstime, (utime + stime)-(startutime+startstime), dtime2);
 }
+
+/* Hierarchical profiling. */
+
+int profile_enabled = 0;
+
+struct prof_node {
+    const char* name;
+    struct prof_node* parent;
+    struct prof_node* child;
+    struct prof_node* sibling;
+    // when the region was last entered, and the total time in it.
+    double start;
+    double total;
+};
+
+// Each thread keeps its own tree of regions; all the trees are listed,
+// so that profile_write() can sum them.
+struct prof_thread {
+    struct prof_node root;
+    struct prof_node* current;
+    struct prof_thread* next;
+};
+
+static pthread_key_t prof_key;
+static pthread_once_t prof_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_thread* prof_threads = NULL;
+
+static char* prof_env_fn = NULL;
+static char* prof_env_root = NULL;
+
+static double prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void make_prof_key(void) {
+    // (no destructor: a thread's times outlive it.)
+    pthread_key_create(&prof_key, NULL);
+}
+
+static struct prof_thread* get_prof_thread(void) {
+    struct prof_thread* t;
+    pthread_once(&prof_key_once, make_prof_key);
+    t = pthread_getspecific(prof_key);
+    if (!t) {
+        t = calloc(1, sizeof(struct prof_thread));
+        t->current = &(t->root);
+        pthread_setspecific(prof_key, t);
+        pthread_mutex_lock(&prof_lock);
+        t->next = prof_threads;
+        prof_threads = t;
+        pthread_mutex_unlock(&prof_lock);
+    }
+    return t;
+}
+
+static struct prof_node* get_child(struct prof_node* parent,
+                                   const char* name) {
+    struct prof_node* c;
+    for (c = parent->child; c; c = c->sibling)
+        if (c->name == name || !strcmp(c->name, name))
+            return c;
+    c = calloc(1, sizeof(struct prof_node));
+    c->name = name;
+    c->parent = parent;
+    c->sibling = parent->child;
+    parent->child = c;
+    return c;
+}
+
+void profile_push(const char* name) {
+    struct prof_thread* t = get_prof_thread();
+    struct prof_node* n = get_child(t->current, name);
+    n->start = prof_now();
+    t->current = n;
+}
+
+void profile_pop(const char* name) {
+    struct prof_thread* t = get_prof_thread();
+    struct prof_node* n;
+    double now;
+    // find the region being closed; it may not be open at all if
+    // profiling was turned on inside it.
+    for (n = t->current; n != &(t->root); n = n->parent)
+        if (n->name == name || !strcmp(n->name, name))
+            break;
+    if (n == &(t->root))
+        return;
+    // (regions left open inside it are closed too.)
+    now = prof_now();
+    for (; t->current != n->parent; t->current = t->current->parent)
+        t->current->total += now - t->current->start;
+}
+
+void profile_enable(int enable) {
+    profile_enabled = enable;
+}
+
+int profile_flush(const char* root) {
+    int rtn;
+    if (!prof_env_fn || !profile_enabled)
+        return 0;
+    rtn = profile_append_to_file(prof_env_fn, root);
+    profile_reset();
+    return rtn;
+}
+
+static void prof_atexit(void) {
+    profile_flush(prof_env_root);
+}
+
+int profile_enable_from_env(const char* progname) {
+    const char* fn = getenv("AN_PROFILE");
+    if (!fn || !fn[0])
+        return 0;
+    if (!prof_env_fn)
+        atexit(prof_atexit);
+    free(prof_env_fn);
+    free(prof_env_root);
+    prof_env_fn = strdup(fn);
+    prof_env_root = strdup(progname);
+    profile_enable(1);
+    return 1;
+}
+
+// Adds the times in the tree "src" into the tree "dst".
+static void prof_merge(struct prof_node* dst, const struct prof_node* src) {
+    const struct prof_node* c;
+    dst->total += src->total;
+    for (c = src->child; c; c = c->sibling)
+        prof_merge(get_child(dst, c->name), c);
+}
+
+static void prof_free_children(struct prof_node* n) {
+    struct prof_node* c = n->child;
+    while (c) {
+        struct prof_node* next = c->sibling;
+        prof_free_children(c);
+        free(c);
+        c = next;
+    }
+    n->child = NULL;
+}
+
+static void prof_write_node(FILE* fid, const struct prof_node* n,
+                            char* stack, size_t len, size_t size) {
+    const struct prof_node* c;
+    double self = n->total;
+    int k;
+    k = snprintf(stack + len, size - len, ";%s", n->name);
+    if (k < 0 || len + k >= size)
+        return;
+    len += k;
+    for (c = n->child; c; c = c->sibling) {
+        self -= c->total;
+        prof_write_node(fid, c, stack, len, size);
+        stack[len] = '\0';
+    }
+    if (self > 0)
+        fprintf(fid, "%s %.0f\n", stack, self * 1e6);
+}
+
+int profile_write(FILE* fid, const char* root) {
+    struct prof_node all;
+    const struct prof_node* c;
+    struct prof_thread* t;
+    char stack[4096];
+    size_t len;
+
+    memset(&all, 0, sizeof(all));
+    pthread_mutex_lock(&prof_lock);
+    for (t = prof_threads; t; t = t->next)
+        prof_merge(&all, &(t->root));
+    pthread_mutex_unlock(&prof_lock);
+
+    snprintf(stack, sizeof(stack), "%s", root);
+    len = strlen(stack);
+    for (c = all.child; c; c = c->sibling) {
+        prof_write_node(fid, c, stack, len, sizeof(stack));
+        stack[len] = '\0';
+    }
+    prof_free_children(&all);
+    if (ferror(fid)) {
+        SYSERROR("Failed to write profile");
+        return -1;
+    }
+    return 0;
+}
+
+int profile_append_to_file(const char* fn, const char* root) {
+    FILE* fid = fopen(fn, "a");
+    int rtn;
+    if (!fid) {
+        SYSERROR("Failed to open profile file \"%s\"", fn);
+        return -1;
+    }
+    rtn = profile_write(fid, root);
+    if (fclose(fid)) {
+        SYSERROR("Failed to close profile file \"%s\"", fn);
+        return -1;
+    }
+    return rtn;
+}
+
+static void prof_zero(struct prof_node* n) {
+    struct prof_node* c;
+    n->total = 0;
+    for (c = n->child; c; c = c->sibling)
+        prof_zero(c);
+}
+
+void profile_reset() {
+    struct prof_thread* t;
+    pthread_mutex_lock(&prof_lock);
+    for (t = prof_threads; t; t = t->next)
+        prof_zero(&(t->root));
+    pthread_mutex_unlock(&prof_lock);
+}
@@ -1023,9 +1023,127 @@ long quadfile_addr(index_t* ind);
 // xyztohealpixf
 %apply double *OUTPUT { double *p_dx, double *p_dy };
 
+// (numpy versions below)
+%ignore xyzarrtohealpixl_array;
+%ignore radecdegtohealpixl_array;
+%ignore healpixl_to_xyzarr_array;
+%ignore healpixl_to_radecdeg_array;
+
 %include "healpix.h"
 %include "healpix-utils.h"
 
+%{
+    static PyArrayObject* healpix_array_in(PyObject* arr, int type, int ndim,
+                                           const char* name) {
+        int req = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED |
+            NPY_ARRAY_NOTSWAPPED | NPY_ARRAY_ELEMENTSTRIDES;
+        PyArrayObject* np_arr = (PyArrayObject*)PyArray_FromAny
+            (arr, PyArray_DescrFromType(type), ndim, ndim, req, NULL);
+        if (!np_arr) {
+            PyErr_Format(PyExc_ValueError, "Failed to convert %s to a %i-d array of %s",
+                         name, ndim, (type == NPY_INT64) ? "int64" : "float64");
+            return NULL;
+        }
+        return np_arr;
+    }
+%}
+
+%inline %{
+    // Numpy versions of the batch healpix conversions; each converts a
+    // whole array in one C loop.
+
+    // (RA, Dec) arrays, in degrees -> int64 array of healpixes.
+    static PyObject* radecdegtohealpixl_numpy(PyObject* py_ra, PyObject* py_dec,
+                                              int nside) {
+        PyArrayObject *np_ra, *np_dec, *np_hp;
+        npy_intp N;
+        np_ra = healpix_array_in(py_ra, NPY_DOUBLE, 1, "ra");
+        if (!np_ra)
+            return NULL;
+        np_dec = healpix_array_in(py_dec, NPY_DOUBLE, 1, "dec");
+        if (!np_dec) {
+            Py_DECREF(np_ra);
+            return NULL;
+        }
+        N = PyArray_SIZE(np_ra);
+        if (PyArray_SIZE(np_dec) != N) {
+            PyErr_SetString(PyExc_ValueError, "Expected ra and dec arrays to be the same length");
+            Py_DECREF(np_ra);
+            Py_DECREF(np_dec);
+            return NULL;
+        }
+        np_hp = (PyArrayObject*)PyArray_SimpleNew(1, &N, NPY_INT64);
+        if (np_hp)
+            radecdegtohealpixl_array(PyArray_DATA(np_ra), PyArray_DATA(np_dec),
+                                     N, nside, PyArray_DATA(np_hp));
+        Py_DECREF(np_ra);
+        Py_DECREF(np_dec);
+        return (PyObject*)np_hp;
+    }
+
+    // (N,3) array of unit vectors -> int64 array of healpixes.
+    static PyObject* xyzarrtohealpixl_numpy(PyObject* py_xyz, int nside) {
+        PyArrayObject *np_xyz, *np_hp;
+        npy_intp N;
+        np_xyz = healpix_array_in(py_xyz, NPY_DOUBLE, 2, "xyz");
+        if (!np_xyz)
+            return NULL;
+        if (PyArray_DIM(np_xyz, 1) != 3) {
+            PyErr_SetString(PyExc_ValueError, "Expected xyz array to have shape (N,3)");
+            Py_DECREF(np_xyz);
+            return NULL;
+        }
+        N = PyArray_DIM(np_xyz, 0);
+        np_hp = (PyArrayObject*)PyArray_SimpleNew(1, &N, NPY_INT64);
+        if (np_hp)
+            xyzarrtohealpixl_array(PyArray_DATA(np_xyz), N, nside,
+                                   PyArray_DATA(np_hp));
+        Py_DECREF(np_xyz);
+        return (PyObject*)np_hp;
+    }
+
+    // int64 array of healpixes -> (ra, dec) tuple of arrays, in degrees.
+    static PyObject* healpixl_to_radecdeg_numpy(PyObject* py_hp, int nside,
+                                                double dx, double dy) {
+        PyArrayObject *np_hp, *np_ra, *np_dec;
+        npy_intp N;
+        np_hp = healpix_array_in(py_hp, NPY_INT64, 1, "hp");
+        if (!np_hp)
+            return NULL;
+        N = PyArray_SIZE(np_hp);
+        np_ra = (PyArrayObject*)PyArray_SimpleNew(1, &N, NPY_DOUBLE);
+        np_dec = (PyArrayObject*)PyArray_SimpleNew(1, &N, NPY_DOUBLE);
+        if (!np_ra || !np_dec) {
+            Py_XDECREF(np_ra);
+            Py_XDECREF(np_dec);
+            Py_DECREF(np_hp);
+            return NULL;
+        }
+        healpixl_to_radecdeg_array(PyArray_DATA(np_hp), N, nside, dx, dy,
+                                   PyArray_DATA(np_ra), PyArray_DATA(np_dec));
+        Py_DECREF(np_hp);
+        return Py_BuildValue("(NN)", np_ra, np_dec);
+    }
+
+    // int64 array of healpixes -> (N,3) array of unit vectors.
+    static PyObject* healpixl_to_xyzarr_numpy(PyObject* py_hp, int nside,
+                                              double dx, double dy) {
+        PyArrayObject *np_hp, *np_xyz;
+        npy_intp dims[2];
+        np_hp = healpix_array_in(py_hp, NPY_INT64, 1, "hp");
+        if (!np_hp)
+            return NULL;
+        dims[0] = PyArray_SIZE(np_hp);
+        dims[1] = 3;
+        np_xyz = (PyArrayObject*)PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+        if (np_xyz)
+            healpixl_to_xyzarr_array(PyArray_DATA(np_hp), dims[0], nside, dx, dy,
+                                     PyArray_DATA(np_xyz));
+        Py_DECREF(np_hp);
+        return (PyObject*)np_xyz;
+    }
+%}
+
 
 // anwcs_get_radec_center_and_radius
 %apply double *OUTPUT { double *p_ra, double *p_dec, double *p_radius };
@@ -1941,17 +2059,26 @@ Sip = sip_t
          const void* baton,
          PyObject* in1, PyObject* in2);
 
+    // (see wcs_array_transform(), below)
+    enum {
+        WCS_ARRAY_TAN_XY2RD, WCS_ARRAY_TAN_RD2XY,
+        WCS_ARRAY_SIP_XY2RD, WCS_ARRAY_SIP_RD2XY,
+        WCS_ARRAY_ANWCS_XY2RD, WCS_ARRAY_ANWCS_RD2XY,
+    };
+    static PyObject* wcs_array_transform(int kind, const void* wcs,
+                                         PyObject* in1, PyObject* in2);
+
 static PyObject* tan_rd2xy_wrapper(const tan_t* wcs,
                                    PyObject* in1, PyObject* in2) {
-    return broadcast_2to2ok((f_2to2ok)tan_radec2pixelxy, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_TAN_RD2XY, wcs, in1, in2);
 }
 static PyObject* sip_rd2xy_wrapper(const sip_t* wcs,
                                    PyObject* in1, PyObject* in2) {
-    return broadcast_2to2ok((f_2to2ok)sip_radec2pixelxy, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_SIP_RD2XY, wcs, in1, in2);
 }
 static PyObject* anwcs_rd2xy_wrapper(const anwcs_t* wcs,
                                      PyObject* in1, PyObject* in2) {
-    return broadcast_2to2i((f_2to2i)anwcs_radec2pixelxy, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_ANWCS_RD2XY, wcs, in1, in2);
 }
 
 static PyObject* tan_iwc2xy_wrapper(const tan_t* wcs,
@@ -1992,15 +2119,15 @@ static PyObject* sip_rd2iwc_wrapper(const sip_t* wcs,
 
 static PyObject* tan_xy2rd_wrapper(const tan_t* wcs,
                                    PyObject* in1, PyObject* in2) {
-    return broadcast_2to2((f_2to2)tan_pixelxy2radec, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_TAN_XY2RD, wcs, in1, in2);
 }
 static PyObject* sip_xy2rd_wrapper(const sip_t* wcs,
                                    PyObject* in1, PyObject* in2) {
-    return broadcast_2to2((f_2to2)sip_pixelxy2radec, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_SIP_XY2RD, wcs, in1, in2);
 }
 static PyObject* anwcs_xy2rd_wrapper(const anwcs_t* wcs,
                                    PyObject* in1, PyObject* in2) {
-    return broadcast_2to2i((f_2to2i)anwcs_pixelxy2radec, wcs, in1, in2);
+    return wcs_array_transform(WCS_ARRAY_ANWCS_XY2RD, wcs, in1, in2);
 }
 
     static PyObject* broadcast_2to2ok
@@ -2451,6 +2578,156 @@ static PyObject* anwcs_xy2rd_wrapper(const anwcs_t* wcs,
         return ret;
     }
 
+    // Whole-array versions of the pixel <-> RA,Dec transforms above, for
+    // inputs that are two arrays of the same shape: they call the batched
+    // transforms in sip.h / anwcs.h, with the interpreter lock released,
+    // rather than a function per point.  Other inputs (scalars, or arrays
+    // that need broadcasting) go through the broadcast_* functions.
+    // points per call to the batched transform.
+    #define WCS_ARRAY_BLOCK 4096
+
+    // Runs "kind" on "in1","in2" (N values each) into "out1","out2",
+    // setting "ok" (anbools, or for anwcs, ints that are 0 on success) if
+    // non-NULL.  Returns 0, or -1 if an anwcs pixel -> RA,Dec transform
+    // failed somewhere.
+    static int wcs_array_run(int kind, const void* wcs,
+                             const double* in1, const double* in2,
+                             npy_intp N, double* out1, double* out2,
+                             void* ok) {
+        double* inbuf = malloc(WCS_ARRAY_BLOCK * 2 * sizeof(double));
+        double* outbuf = malloc(WCS_ARRAY_BLOCK * 2 * sizeof(double));
+        anbool* okbuf = malloc(WCS_ARRAY_BLOCK * sizeof(anbool));
+        npy_intp i, j;
+        int rtn = 0;
+        for (i=0; i<N; i+=WCS_ARRAY_BLOCK) {
+            int n = (int)MIN(N - i, WCS_ARRAY_BLOCK);
+            for (j=0; j<n; j++) {
+                inbuf[2*j  ] = in1[i+j];
+                inbuf[2*j+1] = in2[i+j];
+            }
+            switch (kind) {
+            case WCS_ARRAY_TAN_XY2RD:
+                tan_pixelxy2radec_array(wcs, inbuf, n, outbuf);
+                break;
+            case WCS_ARRAY_TAN_RD2XY:
+                tan_radec2pixelxy_array(wcs, inbuf, n, outbuf, okbuf);
+                break;
+            case WCS_ARRAY_SIP_XY2RD:
+                sip_pixelxy2radec_array(wcs, inbuf, n, outbuf);
+                break;
+            case WCS_ARRAY_SIP_RD2XY:
+                sip_radec2pixelxy_array(wcs, inbuf, n, outbuf, okbuf);
+                break;
+            case WCS_ARRAY_ANWCS_XY2RD:
+                if (anwcs_pixelxy2radec_array(wcs, inbuf, n, outbuf))
+                    rtn = -1;
+                memset(okbuf, 1, n);
+                break;
+            case WCS_ARRAY_ANWCS_RD2XY:
+                anwcs_radec2pixelxy_array(wcs, inbuf, n, outbuf, okbuf);
+                break;
+            }
+            for (j=0; j<n; j++) {
+                out1[i+j] = outbuf[2*j  ];
+                out2[i+j] = outbuf[2*j+1];
+            }
+            if (kind == WCS_ARRAY_ANWCS_XY2RD || kind == WCS_ARRAY_ANWCS_RD2XY) {
+                for (j=0; j<n; j++)
+                    ((int*)ok)[i+j] = okbuf[j] ? 0 : -1;
+            } else if (ok)
+                memcpy((anbool*)ok + i, okbuf, n);
+        }
+        free(inbuf);
+        free(outbuf);
+        free(okbuf);
+        return rtn;
+    }
+
+    static PyObject* wcs_array_transform(int kind, const void* wcs,
+                                         PyObject* in1, PyObject* in2) {
+        int req = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED |
+            NPY_ARRAY_NOTSWAPPED | NPY_ARRAY_ELEMENTSTRIDES;
+        PyArrayObject *np_in1 = NULL, *np_in2 = NULL;
+        PyArrayObject *np_out1 = NULL, *np_out2 = NULL, *np_ok = NULL;
+        anbool anwcs = (kind == WCS_ARRAY_ANWCS_XY2RD ||
+                        kind == WCS_ARRAY_ANWCS_RD2XY);
+        anbool withok = (kind != WCS_ARRAY_TAN_XY2RD &&
+                         kind != WCS_ARRAY_SIP_XY2RD);
+        PyObject* ret = NULL;
+        npy_intp N;
+        int ndim, err;
+
+        if (!PyArray_Check(in1) || !PyArray_Check(in2) ||
+            !PyArray_SAMESHAPE((PyArrayObject*)in1, (PyArrayObject*)in2) ||
+            PyArray_SIZE((PyArrayObject*)in1) == 0)
+            goto broadcast;
+        np_in1 = (PyArrayObject*)PyArray_FromAny(in1, PyArray_DescrFromType(NPY_DOUBLE),
+                                                 0, 0, req, NULL);
+        np_in2 = (PyArrayObject*)PyArray_FromAny(in2, PyArray_DescrFromType(NPY_DOUBLE),
+                                                 0, 0, req, NULL);
+        if (!np_in1 || !np_in2) {
+            Py_XDECREF(np_in1);
+            Py_XDECREF(np_in2);
+            return NULL;
+        }
+        ndim = PyArray_NDIM(np_in1);
+        N = PyArray_SIZE(np_in1);
+        np_out1 = (PyArrayObject*)PyArray_SimpleNew(ndim, PyArray_DIMS(np_in1), NPY_DOUBLE);
+        np_out2 = (PyArrayObject*)PyArray_SimpleNew(ndim, PyArray_DIMS(np_in1), NPY_DOUBLE);
+        if (withok)
+            np_ok = (PyArrayObject*)PyArray_SimpleNew(ndim, PyArray_DIMS(np_in1),
+                                                      anwcs ? NPY_INT : NPY_BOOL);
+        if (!np_out1 || !np_out2 || (withok && !np_ok))
+            goto bailout;
+
+        Py_BEGIN_ALLOW_THREADS
+        err = wcs_array_run(kind, wcs, PyArray_DATA(np_in1), PyArray_DATA(np_in2),
+                            N, PyArray_DATA(np_out1), PyArray_DATA(np_out2),
+                            np_ok ? PyArray_DATA(np_ok) : NULL);
+        Py_END_ALLOW_THREADS
+        if (err) {
+            // (anwcs_pixelxy2radec_array() doesn't say which points failed.)
+            Py_DECREF(np_in1);
+            Py_DECREF(np_in2);
+            Py_DECREF(np_out1);
+            Py_DECREF(np_out2);
+            Py_XDECREF(np_ok);
+            goto broadcast;
+        }
+        if (withok)
+            ret = Py_BuildValue("(NNN)", np_ok, np_out1, np_out2);
+        else
+            ret = Py_BuildValue("(NN)", np_out1, np_out2);
+        Py_DECREF(np_in1);
+        Py_DECREF(np_in2);
+        return ret;
+
+    bailout:
+        Py_XDECREF(np_in1);
+        Py_XDECREF(np_in2);
+        Py_XDECREF(np_out1);
+        Py_XDECREF(np_out2);
+        Py_XDECREF(np_ok);
+        return NULL;
+
+    broadcast:
+        switch (kind) {
+        case WCS_ARRAY_TAN_XY2RD:
+            return broadcast_2to2((f_2to2)tan_pixelxy2radec, wcs, in1, in2);
+        case WCS_ARRAY_TAN_RD2XY:
+            return broadcast_2to2ok((f_2to2ok)tan_radec2pixelxy, wcs, in1, in2);
+        case WCS_ARRAY_SIP_XY2RD:
+            return broadcast_2to2((f_2to2)sip_pixelxy2radec, wcs, in1, in2);
+        case WCS_ARRAY_SIP_RD2XY:
+            return broadcast_2to2ok((f_2to2ok)sip_radec2pixelxy, wcs, in1, in2);
+        case WCS_ARRAY_ANWCS_XY2RD:
+            return broadcast_2to2i((f_2to2i)anwcs_pixelxy2radec, wcs, in1, in2);
+        case WCS_ARRAY_ANWCS_RD2XY:
+            return broadcast_2to2i((f_2to2i)anwcs_radec2pixelxy, wcs, in1, in2);
+        }
+        return NULL;
+    }
+
     static int tan_wcs_resample(tan_t* inwcs, tan_t* outwcs,
                                 PyObject* py_inimg, PyObject* py_outimg,
                                 int weighted, int lorder) {
@@ -18,7 +18,7 @@
 #include "log.h"
 #include "mathutil.h"
 
-const char* OPTIONS = "hi:o:w:f:R:D:te:r:d:Lv";
+const char* OPTIONS = "hi:o:w:f:R:D:te:r:d:Lgv";
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -31,6 +31,7 @@ void print_help(char* progname) {
            "  [-R <RA-column-name> -D <Dec-column-name>]\n"
            "  [-t]: just use TAN projection, even if SIP extension exists\n"
            "  [-L]: force using WCSlib rather than Astrometry.net routines\n"
+           "  [-g]: invert SIP distortion with an interpolated grid, not the AP,BP terms\n"
            "  [-v]: +verbose\n"
            "You can also just specify a single point to convert (printed to stdout)\n"
            "   [-r <ra>], RA in deg.\n"
@@ -51,6 +52,7 @@ int main(int argc, char** args) {
     int ext = 0;
     double ra=LARGE_VAL, dec=LARGE_VAL;
     anbool wcslib = FALSE;
+    anbool invgrid = FALSE;
     int loglvl = LOG_MSG;
 
     fields = il_new(16);
@@ -63,6 +65,9 @@ int main(int argc, char** args) {
         case 'L':
             wcslib = TRUE;
             break;
+        case 'g':
+            invgrid = TRUE;
+            break;
         case 'r':
             ra = atof(optarg);
             break;
@@ -127,6 +132,11 @@ int main(int argc, char** args) {
             ERROR("Failed to read WCS file");
             exit(-1);
         }
+        if (invgrid && wcs->type == ANWCS_TYPE_SIP &&
+            anwcs_use_inverse_grid(wcs, 0, 1)) {
+            ERROR("Failed to set up SIP inverse grid");
+            exit(-1);
+        }
         logverb("Read WCS:\n");
         if (log_get_level() >= LOG_VERB) {
             anwcs_print(wcs, log_get_fid());
@@ -144,7 +154,7 @@ int main(int argc, char** args) {
 
 
     if (wcs_rd2xy(wcsfn, ext, rdlsfn, xylsfn,
-                  rcol, dcol, forcetan, wcslib, fields)) {
+                  rcol, dcol, forcetan, wcslib, invgrid, fields)) {
         ERROR("wcs-rd2xy failed");
         exit(-1);
     }
@@ -19,6 +19,7 @@ int wcs_rd2xy(const char* wcsfn, int wcsext,
               const char* rdlsfn, const char* xylsfn,
               const char* racol, const char* deccol,
               int forcetan, int forcewcslib,
+              int invgrid,
               il* fields) {
     xylist_t* xyls = NULL;
     rdlist_t* rdls = NULL;
@@ -39,6 +40,11 @@ int wcs_rd2xy(const char* wcsfn, int wcsext,
         ERROR("Failed to read WCS file \"%s\", extension %i", wcsfn, wcsext);
         return -1;
     }
+    if (invgrid && wcs->type == ANWCS_TYPE_SIP &&
+        anwcs_use_inverse_grid(wcs, 0, 1)) {
+        ERROR("Failed to set up SIP inverse grid");
+        goto bailout;
+    }
 
     // read RDLS.
     rdls = rdlist_open(rdlsfn);
@@ -78,6 +84,9 @@ int wcs_rd2xy(const char* wcsfn, int wcsext,
         int j;
         starxy_t xy;
         rd_t rd;
+        double* radec;
+        double* pix;
+        anbool* ok;
 
         if (!rdlist_read_field_num(rdls, fieldnum, &rd)) {
             ERROR("Failed to read rdls file \"%s\" field %i", rdlsfn, fieldnum);
@@ -91,18 +100,26 @@ int wcs_rd2xy(const char* wcsfn, int wcsext,
             goto bailout;
         }
 
+        radec = malloc(rd_n(&rd) * 2 * sizeof(double));
+        pix = malloc(rd_n(&rd) * 2 * sizeof(double));
+        ok = malloc(rd_n(&rd) * sizeof(anbool));
+        for (j=0; j<rd_n(&rd); j++) {
+            radec[2*j+0] = rd_getra (&rd, j);
+            radec[2*j+1] = rd_getdec(&rd, j);
+        }
+        anwcs_radec2pixelxy_array(wcs, radec, rd_n(&rd), pix, ok);
         for (j=0; j<rd_n(&rd); j++) {
-            double x, y, ra, dec;
-            ra  = rd_getra (&rd, j);
-            dec = rd_getdec(&rd, j);
-            if (anwcs_radec2pixelxy(wcs, ra, dec, &x, &y)) {
+            if (!ok[j]) {
                 static double nan = 1.0/0.0;
-                ERROR("Point RA,Dec = (%g,%g) projects to the opposite side of the sphere", ra, dec);
+                ERROR("Point RA,Dec = (%g,%g) projects to the opposite side of the sphere", radec[2*j], radec[2*j+1]);
                 starxy_set(&xy, j, nan, nan);
                 continue;
             }
-            starxy_set(&xy, j, x, y);
+            starxy_set(&xy, j, pix[2*j], pix[2*j+1]);
         }
+        free(radec);
+        free(pix);
+        free(ok);
         if (xylist_write_field(xyls, &xy)) {
             ERROR("Failed to write xyls field");
             goto bailout;
@@ -18,7 +18,7 @@
 #include "errors.h"
 #include "fitsioutils.h"
 
-const char* OPTIONS = "hw:e:E:x:L:z";
+const char* OPTIONS = "hw:e:E:x:L:za:t:T:";
 
 void print_help(char* progname) {
     BOILERPLATE_HELP_HEADER(stdout);
@@ -29,6 +29,12 @@ void print_help(char* progname) {
            "   [-x <output WCS FITS extension>] (default: 0)\n"
            "   [-L <Lanczos order>] (default: nearest-neighbor resampling)\n"
            "   [-z]: zero out inf/nan input image value\n"
+           "   [-a <max error>]: interpolate the pixel mapping where it is accurate to\n"
+           "        this many input pixels; 0 for the exact mapping (default: 0.01)\n"
+           "   [-t <threads>]: number of threads (default: one per CPU)\n"
+           "   [-T <rows>]: resample and write the output this many rows at a time,\n"
+           "        reading only the input pixels each band needs; 0 for the whole\n"
+           "        image at once (default: 512)\n"
            "\n", progname);
 }
 
@@ -43,7 +49,10 @@ int main(int argc, char** args) {
     int inimgext = 0;
     int outwcsext = 0;
     int Lorder = 0;
-    int zinf;
+    int zinf = 0;
+    double maxerr = 0.01;
+    int nthreads = 0;
+    int tilerows = 512;
 
     while ((c = getopt(argc, args, OPTIONS)) != -1) {
         switch (c) {
@@ -68,6 +77,15 @@ int main(int argc, char** args) {
         case 'z':
             zinf = 1;
             break;
+        case 'a':
+            maxerr = atof(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'T':
+            tilerows = atoi(optarg);
+            break;
         }
     }
 
@@ -88,7 +106,7 @@ int main(int argc, char** args) {
 
     if (resample_wcs_files(infitsfn, inimgext, inwcsfn, inwcsext,
                            outwcsfn, outwcsext, outfitsfn, Lorder,
-                           zinf)) {
+                           zinf, maxerr, nthreads, tilerows)) {
         ERROR("Failed to resample image");
         exit(-1);
     }
@@ -8,6 +8,8 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "os-features.h"
 #include "wcs-resample.h"
@@ -23,12 +25,20 @@
 #include "anwcs.h"
 #include "resample.h"
 #include "mathutil.h"
+#include "fitsfile.h"
+#include "qfits_convert.h"
+
+static int resample_tiled(const anqfits_t* anqin, int ext,
+                          const anwcs_t* inwcs, const anwcs_t* outwcs,
+                          const char* outfitsfn, int lorder, int zero_inf,
+                          double maxerr, int nthreads, int tilerows);
 
 int resample_wcs_files(const char* infitsfn, int infitsext,
                        const char* inwcsfn, int inwcsext,
                        const char* outwcsfn, int outwcsext,
                        const char* outfitsfn, int lorder,
-                       int zero_inf) {
+                       int zero_inf, double maxerr, int nthreads,
+                       int tilerows) {
 
     anwcs_t* inwcs;
     anwcs_t* outwcs;
@@ -72,6 +82,14 @@ int resample_wcs_files(const char* infitsfn, int infitsext,
         ERROR("Failed to open \"%s\"", infitsfn);
         return -1;
     }
+    if (tilerows > 0) {
+        int rtn = resample_tiled(anqin, infitsext, inwcs, outwcs, outfitsfn,
+                                 lorder, zero_inf, maxerr, nthreads, tilerows);
+        anqfits_close(anqin);
+        anwcs_free(inwcs);
+        anwcs_free(outwcs);
+        return rtn;
+    }
     inimg = (float*)anqfits_readpix(anqin, infitsext, 0, 0, 0, 0, 0,
                                     PTYPE_FLOAT, NULL, &inW, &inH);
     anqfits_close(anqin);
@@ -95,8 +113,9 @@ int resample_wcs_files(const char* infitsfn, int infitsext,
 
     outimg = calloc((size_t)outW * (size_t)outH, sizeof(float));
 
-    if (resample_wcs(inwcs, inimg, inW, inH,
-                     outwcs, outimg, outW, outH, 1, lorder)) {
+    if (resample_wcs_fast(inwcs, inimg, inW, inH,
+                          outwcs, outimg, outW, outH, 1, lorder,
+                          maxerr, nthreads)) {
         ERROR("Failed to resample");
         return -1;
     }
@@ -307,6 +326,492 @@ int resample_wcs(const anwcs_t* inwcs, const float* inimg, int inW, int inH,
 }
 
 
+// Maps output pixel (x,y) to input pixel coordinates, all zero-indexed.
+static anbool map_pixel(const anwcs_t* outwcs, const anwcs_t* inwcs,
+                        double x, double y, double* inx, double* iny) {
+    double xyz[3];
+    // +1 for FITS pixel coordinates.
+    if (anwcs_pixelxy2xyz(outwcs, x+1, y+1, xyz) ||
+        anwcs_xyz2pixelxy(inwcs, xyz, inx, iny))
+        return FALSE;
+    *inx -= 1.0;
+    *iny -= 1.0;
+    return TRUE;
+}
+
+struct fast_resample {
+    const anwcs_t* inwcs;
+    // "inimg" holds a subW x subH window of the inW x inH input image,
+    // starting at pixel (inx0, iny0).
+    const float* inimg;
+    int inW, inH;
+    int inx0, iny0, subW, subH;
+    const anwcs_t* outwcs;
+    // "outimg" holds output rows outy0 and up.
+    float* outimg;
+    int outW, outH;
+    int outy0;
+    int weighted;
+    int lorder;
+    const lanczos_table_t* table;
+    double maxerr;
+    // grid nodes: GW x GH of them, at output pixels gx[], gy[]; the
+    // input pixel position of each, and whether the mapping succeeded.
+    int GW, GH;
+    int* gx;
+    int* gy;
+    double* ginx;
+    double* giny;
+    anbool* gok;
+    // the input pixel position of each output pixel in rows outy0 and
+    // up (-LARGE_VAL where it doesn't map), for the tiled mode's first
+    // pass.  (Not NaN: we're built with -ffinite-math-only.)
+    double* posx;
+    double* posy;
+    // what to do with a row of grid cells.
+    void (*dorow)(struct fast_resample* r, int cj);
+    // the next row of grid cells to do, under "lock".
+    int nextrow;
+    pthread_mutex_t lock;
+};
+
+static void resample_pixel(struct fast_resample* r, int i, int j,
+                           double inx, double iny) {
+    float pix;
+    int lorder = r->lorder;
+    if (lorder == 0) {
+        int x,y;
+        // Nearest-neighbour resampling
+        x = round(inx);
+        y = round(iny);
+        if (x < 0 || x >= r->inW || y < 0 || y >= r->inH)
+            return;
+        pix = r->inimg[(size_t)(y - r->iny0) * r->subW + (x - r->inx0)];
+    } else {
+        if (inx < (-lorder) || inx >= (r->inW+lorder) ||
+            iny < (-lorder) || iny >= (r->inH+lorder))
+            return;
+        pix = lanczos_table_resample_f(r->table, inx - r->inx0, iny - r->iny0,
+                                       r->inimg, r->subW, r->subH, r->weighted);
+    }
+    r->outimg[(size_t)(j - r->outy0) * r->outW + i] = pix;
+}
+
+static void store_position(struct fast_resample* r, int i, int j,
+                           double inx, double iny) {
+    size_t k = (size_t)(j - r->outy0) * r->outW + i;
+    r->posx[k] = inx;
+    r->posy[k] = iny;
+}
+
+// Can grid cell (ci,cj) be interpolated?  Its corners must all map, and
+// the interpolation must match the exact mapping at its center and edge
+// midpoints.
+static anbool cell_interpolates(struct fast_resample* r, int ci, int cj) {
+    int k, n00 = cj*r->GW + ci;
+    int corners[4] = { n00, n00 + 1, n00 + r->GW, n00 + r->GW + 1 };
+    // (fx, fy) of the check points within the cell.
+    const double fchk[5][2] = { {0.5,0.5}, {0.5,0}, {0.5,1}, {0,0.5}, {1,0.5} };
+    if (r->maxerr <= 0)
+        return FALSE;
+    for (k=0; k<4; k++)
+        if (!r->gok[corners[k]])
+            return FALSE;
+    for (k=0; k<5; k++) {
+        double fx = fchk[k][0], fy = fchk[k][1];
+        double x = r->gx[ci] + fx * (r->gx[ci+1] - r->gx[ci]);
+        double y = r->gy[cj] + fy * (r->gy[cj+1] - r->gy[cj]);
+        double inx, iny, ix, iy;
+        if (!map_pixel(r->outwcs, r->inwcs, x, y, &inx, &iny))
+            return FALSE;
+        ix = (1-fy) * ((1-fx) * r->ginx[corners[0]] + fx * r->ginx[corners[1]]) +
+            fy * ((1-fx) * r->ginx[corners[2]] + fx * r->ginx[corners[3]]);
+        iy = (1-fy) * ((1-fx) * r->giny[corners[0]] + fx * r->giny[corners[1]]) +
+            fy * ((1-fx) * r->giny[corners[2]] + fx * r->giny[corners[3]]);
+        if (hypot(ix - inx, iy - iny) > r->maxerr)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Calls "func" with the input pixel position of each output pixel in
+// grid cell (ci,cj) that maps (and might land on the input image).
+static void map_cell(struct fast_resample* r, int ci, int cj,
+                     void (*func)(struct fast_resample*, int, int,
+                                  double, double)) {
+    int i, j, k;
+    int ilo = r->gx[ci], ihi = r->gx[ci+1];
+    int jlo = r->gy[cj], jhi = r->gy[cj+1];
+
+    if (cell_interpolates(r, ci, cj)) {
+        int n00 = cj*r->GW + ci;
+        int corners[4] = { n00, n00 + 1, n00 + r->GW, n00 + r->GW + 1 };
+        double xmin = LARGE_VAL, xmax = -LARGE_VAL;
+        double ymin = LARGE_VAL, ymax = -LARGE_VAL;
+        double margin = r->lorder + 1;
+        double dw = r->gx[ci+1] - r->gx[ci];
+        double dh = r->gy[cj+1] - r->gy[cj];
+        // bilinear interpolation stays within the corners' bounding box;
+        // skip cells that map entirely off the input image.
+        for (k=0; k<4; k++) {
+            xmin = MIN(xmin, r->ginx[corners[k]]);
+            xmax = MAX(xmax, r->ginx[corners[k]]);
+            ymin = MIN(ymin, r->giny[corners[k]]);
+            ymax = MAX(ymax, r->giny[corners[k]]);
+        }
+        if (xmax < -margin || xmin >= r->inW + margin ||
+            ymax < -margin || ymin >= r->inH + margin)
+            return;
+        for (j=jlo; j<jhi; j++) {
+            double fy = (j - jlo) / dh;
+            // input positions at the left and right edges of this row.
+            double lx = (1-fy) * r->ginx[corners[0]] + fy * r->ginx[corners[2]];
+            double ly = (1-fy) * r->giny[corners[0]] + fy * r->giny[corners[2]];
+            double rx = (1-fy) * r->ginx[corners[1]] + fy * r->ginx[corners[3]];
+            double ry = (1-fy) * r->giny[corners[1]] + fy * r->giny[corners[3]];
+            for (i=ilo; i<ihi; i++) {
+                double fx = (i - ilo) / dw;
+                func(r, i, j, lx + fx * (rx - lx), ly + fx * (ry - ly));
+            }
+        }
+        return;
+    }
+    for (j=jlo; j<jhi; j++)
+        for (i=ilo; i<ihi; i++) {
+            double inx, iny;
+            if (map_pixel(r->outwcs, r->inwcs, i, j, &inx, &iny))
+                func(r, i, j, inx, iny);
+        }
+}
+
+static void resample_row(struct fast_resample* r, int cj) {
+    int ci;
+    for (ci=0; ci<r->GW-1; ci++)
+        map_cell(r, ci, cj, resample_pixel);
+}
+
+static void position_row(struct fast_resample* r, int cj) {
+    int ci;
+    for (ci=0; ci<r->GW-1; ci++)
+        map_cell(r, ci, cj, store_position);
+}
+
+// Resamples the output pixels whose positions position_row() stored.
+static void sample_row(struct fast_resample* r, int cj) {
+    int i, j;
+    for (j=r->gy[cj]; j<r->gy[cj+1]; j++)
+        for (i=0; i<r->outW; i++) {
+            size_t k = (size_t)(j - r->outy0) * r->outW + i;
+            if (r->posx[k] > -LARGE_VAL)
+                resample_pixel(r, i, j, r->posx[k], r->posy[k]);
+        }
+}
+
+static void* fast_resample_rows(void* v) {
+    struct fast_resample* r = v;
+    while (1) {
+        int cj;
+        pthread_mutex_lock(&r->lock);
+        cj = r->nextrow++;
+        pthread_mutex_unlock(&r->lock);
+        if (cj >= r->GH - 1)
+            break;
+        r->dorow(r, cj);
+    }
+    return NULL;
+}
+
+// Hands out the rows of grid cells, with "dorow", to "nthreads" threads.
+static void run_rows(struct fast_resample* r,
+                     void (*dorow)(struct fast_resample*, int),
+                     int nthreads) {
+    pthread_t* threads;
+    int i, nstarted;
+    r->dorow = dorow;
+    r->nextrow = 0;
+    nthreads = MAX(1, MIN(nthreads, r->GH - 1));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    // this thread is the first worker.
+    for (nstarted=1; nstarted<nthreads; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, fast_resample_rows, r)) {
+            SYSERROR("Failed to start resampling thread");
+            break;
+        }
+    fast_resample_rows(r);
+    for (i=1; i<nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Grid node positions along an axis of length N: every "step" pixels,
+// and one past the end, so that cell i covers [nodes[i], nodes[i+1]).
+static int* grid_nodes(int N, int step, int* pn) {
+    int n = (N + step - 1) / step + 1;
+    int* nodes = malloc(n * sizeof(int));
+    int i;
+    for (i=0; i<n; i++)
+        nodes[i] = MIN(i * step, N);
+    *pn = n;
+    return nodes;
+}
+
+// Sets up the grid over output rows [y0, y1).  "always" maps the nodes
+// even when they won't be interpolated between.
+static void grid_init(struct fast_resample* r, int y0, int y1, anbool always) {
+    int i, j;
+    r->gx = grid_nodes(r->outW, RESAMPLE_GRID_STEP, &r->GW);
+    r->gy = grid_nodes(y1 - y0, RESAMPLE_GRID_STEP, &r->GH);
+    for (j=0; j<r->GH; j++)
+        r->gy[j] += y0;
+    r->ginx = malloc((size_t)r->GW * r->GH * sizeof(double));
+    r->giny = malloc((size_t)r->GW * r->GH * sizeof(double));
+    r->gok  = malloc((size_t)r->GW * r->GH * sizeof(anbool));
+    for (j=0; j<r->GH; j++)
+        for (i=0; i<r->GW; i++) {
+            int n = j*r->GW + i;
+            r->gok[n] = (always || r->maxerr > 0) &&
+                map_pixel(r->outwcs, r->inwcs, r->gx[i], r->gy[j],
+                          r->ginx + n, r->giny + n);
+        }
+}
+
+static void grid_free(struct fast_resample* r) {
+    free(r->gx);
+    free(r->gy);
+    free(r->ginx);
+    free(r->giny);
+    free(r->gok);
+    r->gx = r->gy = NULL;
+    r->ginx = r->giny = NULL;
+    r->gok = NULL;
+}
+
+int resample_wcs_fast(const anwcs_t* inwcs, const float* inimg,
+                      int inW, int inH,
+                      const anwcs_t* outwcs, float* outimg,
+                      int outW, int outH,
+                      int weighted, int lorder,
+                      double maxerr, int nthreads) {
+    struct fast_resample r;
+    lanczos_table_t* table = NULL;
+
+    if (outW < 1 || outH < 1)
+        return 0;
+    if (lorder) {
+        table = lanczos_table_new(lorder);
+        if (!table)
+            return -1;
+    }
+    memset(&r, 0, sizeof(r));
+    r.inwcs = inwcs;
+    r.inimg = inimg;
+    r.inW = r.subW = inW;
+    r.inH = r.subH = inH;
+    r.outwcs = outwcs;
+    r.outimg = outimg;
+    r.outW = outW;
+    r.outH = outH;
+    r.weighted = weighted;
+    r.lorder = lorder;
+    r.table = table;
+    r.maxerr = maxerr;
+    grid_init(&r, 0, outH, FALSE);
+    pthread_mutex_init(&r.lock, NULL);
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    logverb("Resampling %i x %i pixels in %i rows of grid cells on %i threads\n",
+            outW, outH, r.GH - 1, MAX(1, MIN(nthreads, r.GH - 1)));
+    run_rows(&r, resample_row, nthreads);
+
+    pthread_mutex_destroy(&r.lock);
+    grid_free(&r);
+    lanczos_table_free(table);
+    return 0;
+}
+
+/*
+ Resamples and writes the output image "tilerows" rows at a time.  For
+ each band, a first pass finds the input position of each output pixel
+ (as resample_wcs_fast() does), and from them the window of the input
+ image that the band needs; that window is read, and a second pass
+ resamples from it.
+ */
+static int resample_tiled(const anqfits_t* anqin, int ext,
+                          const anwcs_t* inwcs, const anwcs_t* outwcs,
+                          const char* outfitsfn, int lorder, int zero_inf,
+                          double maxerr, int nthreads, int tilerows) {
+    struct fast_resample r;
+    const anqfits_image_t* imginfo;
+    lanczos_table_t* table = NULL;
+    qfits_header* hdr = NULL;
+    FILE* fid = NULL;
+    off_t hdrend;
+    float* band = NULL;
+    char* outbuf = NULL;
+    double pmin = LARGE_VAL, pmax = -LARGE_VAL;
+    size_t i, npix;
+    int y0, rtn = -1;
+
+    imginfo = anqfits_get_image_const(anqin, ext);
+    if (!imginfo) {
+        ERROR("Failed to read image header from extension %i", ext);
+        return -1;
+    }
+    if (lorder) {
+        table = lanczos_table_new(lorder);
+        if (!table)
+            return -1;
+    }
+    memset(&r, 0, sizeof(r));
+    r.inwcs = inwcs;
+    r.inW = imginfo->width;
+    r.inH = imginfo->height;
+    r.outwcs = outwcs;
+    r.outW = anwcs_imagew(outwcs);
+    r.outH = anwcs_imageh(outwcs);
+    r.weighted = 1;
+    r.lorder = lorder;
+    r.table = table;
+    r.maxerr = maxerr;
+    pthread_mutex_init(&r.lock, NULL);
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    logmsg("Input  image is %i x %i pixels.\n", r.inW, r.inH);
+    logmsg("Output image is %i x %i pixels.\n", r.outW, r.outH);
+
+    // bands of whole rows of grid cells, so that the grid (and so the
+    // output) is the same as when resampling the whole image at once.
+    tilerows = RESAMPLE_GRID_STEP *
+        MAX(1, (tilerows + RESAMPLE_GRID_STEP - 1) / RESAMPLE_GRID_STEP);
+    tilerows = MAX(1, MIN(tilerows, r.outH));
+    npix = (size_t)r.outW * tilerows;
+    band = malloc(npix * sizeof(float));
+    outbuf = malloc(npix * sizeof(float));
+    r.posx = malloc(npix * sizeof(double));
+    r.posy = malloc(npix * sizeof(double));
+    if (!band || !outbuf || !r.posx || !r.posy) {
+        SYSERROR("Failed to allocate resampling buffers for %i rows", tilerows);
+        goto bailout;
+    }
+    r.outimg = band;
+
+    // the header first, with DATAMIN and DATAMAX filled in at the end.
+    hdr = fits_get_header_for_image2(r.outW, r.outH, BPP_IEEE_FLOAT, NULL);
+    anwcs_add_to_header(outwcs, hdr);
+    fits_header_add_double(hdr, "DATAMIN", 0.0, "min pixel value");
+    fits_header_add_double(hdr, "DATAMAX", 0.0, "max pixel value");
+    fid = fopen(outfitsfn, "wb");
+    if (!fid) {
+        SYSERROR("Failed to open file \"%s\" for output", outfitsfn);
+        goto bailout;
+    }
+    if (fitsfile_write_primary_header(fid, hdr, &hdrend, outfitsfn))
+        goto bailout;
+
+    for (y0=0; y0<r.outH; y0+=tilerows) {
+        int y1 = MIN(r.outH, y0 + tilerows);
+        size_t nb = (size_t)r.outW * (y1 - y0);
+        double xlo = LARGE_VAL, xhi = -LARGE_VAL;
+        double ylo = LARGE_VAL, yhi = -LARGE_VAL;
+        int wx0, wx1, wy0, wy1;
+        float* inimg = NULL;
+
+        r.outy0 = y0;
+        for (i=0; i<nb; i++) {
+            band[i] = 0.0;
+            r.posx[i] = r.posy[i] = -LARGE_VAL;
+        }
+        grid_init(&r, y0, y1, FALSE);
+        run_rows(&r, position_row, nthreads);
+
+        // the input window: the pixels around each position that lands
+        // on (or within the Lanczos margin of) the input image.
+        for (i=0; i<nb; i++) {
+            double x = r.posx[i], y = r.posy[i];
+            if (x < -lorder - 1 || x >= r.inW + lorder + 1 ||
+                y < -lorder - 1 || y >= r.inH + lorder + 1)
+                continue;
+            xlo = MIN(xlo, x);
+            xhi = MAX(xhi, x);
+            ylo = MIN(ylo, y);
+            yhi = MAX(yhi, y);
+        }
+        if (xlo <= xhi) {
+            wx0 = MAX(0, (int)floor(xlo) - lorder);
+            wx1 = MIN(r.inW, (int)floor(xhi) + lorder + 2);
+            wy0 = MAX(0, (int)floor(ylo) - lorder);
+            wy1 = MIN(r.inH, (int)floor(yhi) + lorder + 2);
+        } else
+            wx0 = wx1 = wy0 = wy1 = 0;
+
+        if (wx0 < wx1 && wy0 < wy1) {
+            logverb("Output rows [%i, %i): reading input [%i, %i) x [%i, %i)\n",
+                    y0, y1, wx0, wx1, wy0, wy1);
+            inimg = anqfits_readpix(anqin, ext, wx0, wx1, wy0, wy1, 0,
+                                    PTYPE_FLOAT, NULL, &r.subW, &r.subH);
+            if (!inimg) {
+                ERROR("Failed to read input pixels [%i, %i) x [%i, %i)",
+                      wx0, wx1, wy0, wy1);
+                grid_free(&r);
+                goto bailout;
+            }
+            if (zero_inf)
+                for (i=0; i<(size_t)r.subW * r.subH; i++)
+                    if (!isfinite(inimg[i]))
+                        inimg[i] = 0.0;
+            r.inimg = inimg;
+            r.inx0 = wx0;
+            r.iny0 = wy0;
+            run_rows(&r, sample_row, nthreads);
+            free(inimg);
+            r.inimg = NULL;
+        } else
+            logverb("Output rows [%i, %i) don't overlap the input image\n",
+                    y0, y1);
+        grid_free(&r);
+
+        for (i=0; i<nb; i++) {
+            pmin = MIN(pmin, band[i]);
+            pmax = MAX(pmax, band[i]);
+            qfits_pixel_ctofits(PTYPE_FLOAT, BPP_IEEE_FLOAT, band + i,
+                                outbuf + i * sizeof(float));
+        }
+        if (fwrite(outbuf, sizeof(float), nb, fid) != nb) {
+            SYSERROR("Failed to write image to file \"%s\"", outfitsfn);
+            goto bailout;
+        }
+    }
+    logmsg("Output image bounds: %g to %g\n", pmin, pmax);
+
+    fits_header_mod_double(hdr, "DATAMIN", pmin, "min pixel value");
+    fits_header_mod_double(hdr, "DATAMAX", pmax, "max pixel value");
+    if (fits_pad_file(fid) ||
+        fitsfile_fix_primary_header(fid, hdr, &hdrend, outfitsfn))
+        goto bailout;
+    if (fclose(fid)) {
+        fid = NULL;
+        SYSERROR("Failed to close file \"%s\"", outfitsfn);
+        goto bailout;
+    }
+    fid = NULL;
+    rtn = 0;
+
+ bailout:
+    if (fid)
+        fclose(fid);
+    if (hdr)
+        qfits_header_destroy(hdr);
+    pthread_mutex_destroy(&r.lock);
+    free(band);
+    free(outbuf);
+    free(r.posx);
+    free(r.posy);
+    lanczos_table_free(table);
+    return rtn;
+}
+
 int resample_wcs_rgba(const anwcs_t* inwcs, const unsigned char* inimg,
                       int inW, int inH,
                       const anwcs_t* outwcs, unsigned char* outimg,
@@ -8,16 +8,48 @@
 
 #include "anwcs.h"
 
+/**
+ Resamples an image file onto the output WCS, with resample_wcs_fast().
+
+ With "tilerows" > 0, the output is resampled and written in bands of
+ that many rows (rounded up to whole rows of grid cells), and only the
+ window of the input image each band needs is read, so that neither
+ image is held in memory whole.  The output is the same either way.
+ */
 int resample_wcs_files(const char* infitsfn, int infitsext,
 					   const char* inwcsfn, int inwcsext,
 					   const char* outwcsfn, int outwcsext,
 					   const char* outfitsfn, int lanczos_order,
-                       int zero_inf);
+                       int zero_inf, double maxerr, int nthreads,
+                       int tilerows);
 
 int resample_wcs(const anwcs_t* inwcs, const float* inimg, int inW, int inH,
 				 const anwcs_t* outwcs, float* outimg, int outW, int outH,
 				 int weighted, int lanczos_order);
 
+/**
+ Like resample_wcs(), but faster, for large images:
+
+ -the output-to-input pixel mapping is computed exactly on a grid of
+  nodes every RESAMPLE_GRID_STEP output pixels, and interpolated
+  bilinearly within each grid cell.  Each cell is checked at its center
+  and edge midpoints; cells where the interpolation is off by more than
+  "maxerr" input pixels (or where the mapping fails at a node) fall back
+  to the exact mapping.  "maxerr" <= 0 means always exact.
+
+ -Lanczos resampling uses a tabulated kernel (see lanczos_table_new()).
+
+ -rows of grid cells are handed out to "nthreads" threads (0 means one
+  per CPU).
+ */
+#define RESAMPLE_GRID_STEP 16
+int resample_wcs_fast(const anwcs_t* inwcs, const float* inimg,
+                      int inW, int inH,
+                      const anwcs_t* outwcs, float* outimg,
+                      int outW, int outH,
+                      int weighted, int lanczos_order,
+                      double maxerr, int nthreads);
+
 int resample_wcs_rgba(const anwcs_t* inwcs, const unsigned char* inimg,
 					  int inW, int inH,
 					  const anwcs_t* outwcs, unsigned char* outimg,
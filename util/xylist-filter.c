@@ -0,0 +1,450 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "os-features.h"
+#include "xylist-filter.h"
+#include "permutedsort.h"
+#include "fitstable.h"
+#include "fitsioutils.h"
+#include "anqfits.h"
+#include "ioutils.h"
+#include "errors.h"
+#include "log.h"
+
+/*
+ As in removelines.py: one-pixel bins centered on the integers; the
+ bins holding more than one source are compared with a Poisson
+ distribution whose mean is the average (count - 1) of those bins.
+ (The "log factorial" is the one removelines.py uses, k(k-1)/2.)
+ */
+static void hist_remove_lines(const double* x, int N, double cut,
+                              anbool* keep) {
+    double xmax = -HUGE_VAL;
+    int* counts;
+    int nbins;
+    int i, noccupied = 0;
+    double mean = 0.0;
+    anbool* bad;
+
+    for (i=0; i<N; i++)
+        if (isfinite(x[i]))
+            xmax = fmax(xmax, x[i]);
+    if (xmax < -0.5)
+        return;
+    // bin edges -0.5, 0.5, ..., up to xmax + 1.5.
+    nbins = (int)ceil(xmax + 2.0) - 1;
+    counts = calloc(nbins, sizeof(int));
+    bad = calloc(nbins, sizeof(anbool));
+    for (i=0; i<N; i++) {
+        int b;
+        if (!isfinite(x[i]) || x[i] < -0.5)
+            continue;
+        b = (int)floor(x[i] + 0.5);
+        if (b >= nbins)
+            b = nbins - 1;
+        counts[b]++;
+    }
+    for (i=0; i<nbins; i++) {
+        if (counts[i] > 1) {
+            noccupied++;
+            mean += counts[i] - 1;
+        }
+    }
+    if (noccupied) {
+        anbool anybad = FALSE;
+        mean /= noccupied;
+        for (i=0; i<nbins; i++) {
+            double k, logp;
+            if (counts[i] <= 1)
+                continue;
+            k = counts[i] - 1;
+            logp = k * log(mean) - mean - 0.5 * k * (k - 1);
+            if (logp < -cut)
+                bad[i] = anybad = TRUE;
+        }
+        if (anybad)
+            for (i=0; i<N; i++) {
+                int b;
+                if (!isfinite(x[i]) || x[i] < -0.5)
+                    continue;
+                b = (int)floor(x[i] + 0.5);
+                if (b < nbins && bad[b])
+                    keep[i] = FALSE;
+            }
+    }
+    free(counts);
+    free(bad);
+}
+
+int removelines(const double* x, const double* y, int N, double cut,
+                anbool* keep) {
+    int i, ncut = 0;
+    anbool* k = malloc(N * sizeof(anbool));
+    for (i=0; i<N; i++)
+        k[i] = TRUE;
+    hist_remove_lines(x, N, cut, k);
+    hist_remove_lines(y, N, cut, k);
+    for (i=0; i<N; i++) {
+        if (k[i])
+            continue;
+        if (keep[i])
+            ncut++;
+        keep[i] = FALSE;
+    }
+    free(k);
+    logverb("removelines: removed %i sources\n", ncut);
+    return ncut;
+}
+
+int* uniformize(const double* x, const double* y, int N, int nboxes,
+                int* pN) {
+    double xlo = HUGE_VAL, xhi = -HUGE_VAL, ylo = HUGE_VAL, yhi = -HUGE_VAL;
+    double W, H;
+    int NX, NY;
+    int* order;
+    int* rank;
+    int* boxcount;
+    int* rankstart;
+    int i, n = 0, maxrank = 0;
+
+    order = malloc(MAX(N, 1) * sizeof(int));
+    for (i=0; i<N; i++) {
+        if (!(isfinite(x[i]) && isfinite(y[i])))
+            continue;
+        xlo = fmin(xlo, x[i]);
+        xhi = fmax(xhi, x[i]);
+        ylo = fmin(ylo, y[i]);
+        yhi = fmax(yhi, y[i]);
+        order[n++] = i;
+    }
+    if (n < N)
+        logverb("uniformize: %i source positions are not finite.\n", N - n);
+    *pN = n;
+    W = xhi - xlo;
+    H = yhi - ylo;
+    if (n == 0 || W == 0 || H == 0)
+        return order;
+
+    // (rint() rounds half to even, like numpy's round().)
+    NX = (int)MAX(1, rint(W / sqrt(W * H / (double)nboxes)));
+    NY = (int)MAX(1, rint(nboxes / (double)NX));
+    logverb("uniformize: %i x %i boxes\n", NX, NY);
+
+    // each source's rank within its box...
+    rank = malloc(n * sizeof(int));
+    boxcount = calloc((size_t)NX * NY, sizeof(int));
+    for (i=0; i<n; i++) {
+        int j = order[i];
+        int ix = (int)floor((x[j] - xlo) / W * NX);
+        int iy = (int)floor((y[j] - ylo) / H * NY);
+        ix = MAX(0, MIN(NX-1, ix));
+        iy = MAX(0, MIN(NY-1, iy));
+        rank[i] = boxcount[iy * NX + ix]++;
+        maxrank = MAX(maxrank, rank[i]);
+    }
+    free(boxcount);
+    // ... then a stable counting sort by rank.
+    rankstart = calloc(maxrank + 2, sizeof(int));
+    for (i=0; i<n; i++)
+        rankstart[rank[i] + 1]++;
+    for (i=0; i<=maxrank; i++)
+        rankstart[i+1] += rankstart[i];
+    {
+        int* sorted = malloc(n * sizeof(int));
+        for (i=0; i<n; i++)
+            sorted[rankstart[rank[i]]++] = order[i];
+        free(order);
+        order = sorted;
+    }
+    free(rankstart);
+    free(rank);
+    return order;
+}
+
+// Sorting the fluxes and the raw fluxes at once is worth a second
+// thread for at least this many sources.
+#define RESORT_THREAD_MIN 100000
+
+struct raw_sort {
+    const double* raw;
+    int (*compare)(const void*, const void*);
+    int N;
+    int* perm;
+};
+
+static void* raw_sort_thread(void* arg) {
+    struct raw_sort* rs = arg;
+    rs->perm = permuted_sort(rs->raw, sizeof(double), rs->compare, NULL,
+                             rs->N);
+    return NULL;
+}
+
+static int* resort_order(const double* flux, const double* background,
+                         int N, anbool ascending, int K) {
+    int (*compare)(const void*, const void*) =
+        ascending ? compare_doubles_asc : compare_doubles_desc;
+    double* raw;
+    int *perm1, *perm2, *order;
+    anbool* used;
+    int i, j, n = 0;
+
+    // Each step of the interleaving below takes the next source of each
+    // ordering, so the first K sources come from the first K of each.
+    K = MIN(K, N);
+    // non-background-subtracted flux.
+    raw = malloc(MAX(N, 1) * sizeof(double));
+    for (i=0; i<N; i++)
+        raw[i] = flux[i] + background[i];
+    if (K < N) {
+        perm1 = permuted_sort_topk(flux, sizeof(double), compare, K, N);
+        perm2 = permuted_sort_topk(raw, sizeof(double), compare, K, N);
+    } else {
+        struct raw_sort rs;
+        pthread_t thread;
+        anbool threaded = FALSE;
+        rs.raw = raw;
+        rs.compare = compare;
+        rs.N = N;
+        rs.perm = NULL;
+        if (N >= RESORT_THREAD_MIN && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+            threaded = (pthread_create(&thread, NULL, raw_sort_thread,
+                                       &rs) == 0);
+        perm1 = permuted_sort(flux, sizeof(double), compare, NULL, N);
+        if (threaded)
+            pthread_join(thread, NULL);
+        else
+            raw_sort_thread(&rs);
+        perm2 = rs.perm;
+    }
+    used = calloc(MAX(N, 1), sizeof(anbool));
+    order = malloc(MAX(N, 1) * sizeof(int));
+    for (i=0; i<K && n<K; i++) {
+        int inds[] = { perm1[i], perm2[i] };
+        for (j=0; j<2 && n<K; j++) {
+            if (used[inds[j]])
+                continue;
+            used[inds[j]] = TRUE;
+            order[n++] = inds[j];
+        }
+    }
+    free(used);
+    free(perm1);
+    free(perm2);
+    free(raw);
+    return order;
+}
+
+int* resort_flux_background(const double* flux, const double* background,
+                            int N, anbool ascending) {
+    return resort_order(flux, background, N, ascending, N);
+}
+
+int* resort_flux_background_topk(const double* flux,
+                                 const double* background,
+                                 int N, anbool ascending, int K) {
+    return resort_order(flux, background, N, ascending, K);
+}
+
+// Reorders (or subsets) the source list: element i becomes perm[i].
+static void starxy_permute(starxy_t* xy, const int* perm, int N) {
+    void* arrays[] = { xy->x, xy->y, xy->flux, xy->background };
+    int sizes[] = { sizeof(double), sizeof(double), sizeof(double), sizeof(double) };
+    permutation_apply_multi(perm, N, arrays, sizes, 4);
+    xy->N = N;
+}
+
+static int* removelines_order(const double* x, const double* y, int N,
+                              double cut, int* pN) {
+    anbool* keep = malloc(MAX(N, 1) * sizeof(anbool));
+    int* order = malloc(MAX(N, 1) * sizeof(int));
+    int i, n = 0;
+    for (i=0; i<N; i++)
+        keep[i] = TRUE;
+    removelines(x, y, N, cut, keep);
+    for (i=0; i<N; i++)
+        if (keep[i])
+            order[n++] = i;
+    free(keep);
+    *pN = n;
+    return order;
+}
+
+int starxy_removelines(starxy_t* xy, double cut) {
+    int N0 = xy->N;
+    int n;
+    int* order = removelines_order(xy->x, xy->y, xy->N, cut, &n);
+    starxy_permute(xy, order, n);
+    free(order);
+    return N0 - n;
+}
+
+void starxy_uniformize(starxy_t* xy, int nboxes) {
+    int n;
+    int* order = uniformize(xy->x, xy->y, xy->N, nboxes, &n);
+    starxy_permute(xy, order, n);
+    free(order);
+}
+
+struct filter_args {
+    // removelines (if nboxes == 0) or uniformize.
+    double cut;
+    int nboxes;
+};
+
+static int* filter_order(const double* x, const double* y, int N,
+                         const struct filter_args* args, int* pN) {
+    if (args->nboxes)
+        return uniformize(x, y, N, args->nboxes, pN);
+    return removelines_order(x, y, N, args->cut, pN);
+}
+
+static int filter_file(const char* infn, const char* outfn,
+                       const char* xcol, const char* ycol,
+                       const struct filter_args* args) {
+    FILE* fin = NULL;
+    FILE* fout = NULL;
+    double *x = NULL, *y = NULL;
+    int *order = NULL;
+    int nextens, ext;
+    fitstable_t* tab = NULL;
+    anqfits_t* anq = NULL;
+    qfits_header* hdr = NULL;
+
+    if (!xcol)
+        xcol = "X";
+    if (!ycol)
+        ycol = "Y";
+
+    fin = fopen(infn, "rb");
+    if (!fin) {
+        SYSERROR("Failed to open input file %s", infn);
+        return -1;
+    }
+    fout = fopen(outfn, "wb");
+    if (!fout) {
+        SYSERROR("Failed to open output file %s", outfn);
+        goto bailout;
+    }
+
+    // copy the main header exactly.
+    anq = anqfits_open(infn);
+    if (!anq) {
+        ERROR("Failed to open file \"%s\"", infn);
+        goto bailout;
+    }
+    if (pipe_file_offset(fin, anqfits_header_start(anq, 0),
+                         anqfits_header_size(anq, 0), fout)) {
+        ERROR("Failed to copy primary FITS header.");
+        goto bailout;
+    }
+
+    tab = fitstable_open(infn);
+    if (!tab) {
+        ERROR("Failed to open FITS table in file %s", infn);
+        goto bailout;
+    }
+
+    nextens = anqfits_n_ext(anq);
+    for (ext=1; ext<nextens; ext++) {
+        off_t datstart;
+        int i, N, n, rowsize;
+
+        if (!anqfits_is_table(anq, ext)) {
+            ERROR("Extension %i isn't a table. Skipping", ext);
+            continue;
+        }
+        if (fitstable_read_extension(tab, ext)) {
+            ERROR("Failed to read FITS table from extension %i", ext);
+            goto bailout;
+        }
+        rowsize = fitstable_row_size(tab);
+        datstart = anqfits_data_start(anq, ext);
+        N = fitstable_nrows(tab);
+        x = fitstable_read_column(tab, xcol, TFITS_BIN_TYPE_D);
+        y = fitstable_read_column(tab, ycol, TFITS_BIN_TYPE_D);
+        if (N && !(x && y)) {
+            ERROR("Failed to read columns %s, %s from extension %i",
+                  xcol, ycol, ext);
+            goto bailout;
+        }
+        order = filter_order(x, y, N, args, &n);
+
+        // the input header, with the new number of rows.
+        hdr = anqfits_get_header(anq, ext);
+        {
+            char val[16];
+            sprintf(val, "%i", n);
+            fits_update_value(hdr, "NAXIS2", val);
+        }
+        if (qfits_header_dump(hdr, fout)) {
+            ERROR("Failed to write the header of extension %i", ext);
+            goto bailout;
+        }
+        qfits_header_destroy(hdr);
+        hdr = NULL;
+        for (i=0; i<n; i++) {
+            if (pipe_file_offset(fin, datstart + (off_t)order[i] * rowsize,
+                                 rowsize, fout)) {
+                ERROR("Failed to copy row %i", order[i]);
+                goto bailout;
+            }
+        }
+        if (fits_pad_file(fout)) {
+            ERROR("Failed to add padding to extension %i", ext);
+            goto bailout;
+        }
+        free(x);
+        x = NULL;
+        free(y);
+        y = NULL;
+        free(order);
+        order = NULL;
+    }
+
+    fitstable_close(tab);
+    anqfits_close(anq);
+    fclose(fin);
+    if (fclose(fout)) {
+        SYSERROR("Failed to close output file %s", outfn);
+        return -1;
+    }
+    return 0;
+
+ bailout:
+    if (hdr)
+        qfits_header_destroy(hdr);
+    if (tab)
+        fitstable_close(tab);
+    if (anq)
+        anqfits_close(anq);
+    if (fout)
+        fclose(fout);
+    fclose(fin);
+    free(x);
+    free(y);
+    free(order);
+    return -1;
+}
+
+int removelines_file(const char* infn, const char* outfn,
+                     const char* xcol, const char* ycol, double cut) {
+    struct filter_args args;
+    memset(&args, 0, sizeof(args));
+    args.cut = cut;
+    return filter_file(infn, outfn, xcol, ycol, &args);
+}
+
+int uniformize_file(const char* infn, const char* outfn,
+                    const char* xcol, const char* ycol, int nboxes) {
+    struct filter_args args;
+    memset(&args, 0, sizeof(args));
+    args.nboxes = nboxes;
+    return filter_file(infn, outfn, xcol, ycol, &args);
+}
@@ -276,33 +276,54 @@ int xylist_write_field(xylist_t* ls, starxy_t* fld) {
     return 0;
 }
 
+int xylist_get_nrows(xylist_t* ls) {
+    assert(is_reading(ls));
+    if (!ls->table->table)
+        xylist_open_field(ls, ls->table->extension);
+    if (!ls->table->table)
+        return -1;
+    return fitstable_nrows(ls->table);
+}
+
 starxy_t* xylist_read_field(xylist_t* ls, starxy_t* fld) {
+    return xylist_read_field_rows(ls, 0, -1, fld);
+}
+
+starxy_t* xylist_read_field_rows(xylist_t* ls, int offset, int N,
+                                 starxy_t* fld) {
     anbool freeit = FALSE;
     tfits_type dubl = fitscolumn_double_type();
+    int nrows;
     assert(is_reading(ls));
 
-    if (!ls->table->table)
-        xylist_open_field(ls, ls->table->extension);
-
-    if (!ls->table->table) {
+    nrows = xylist_get_nrows(ls);
+    if (nrows < 0) {
         // FITS table not found.
         return NULL;
     }
+    if (offset < 0 || offset > nrows) {
+        ERROR("Row offset %i is outside the field's %i rows", offset, nrows);
+        return NULL;
+    }
+    if (N < 0 || N > nrows - offset)
+        N = nrows - offset;
 
     if (!fld) {
         fld = calloc(1, sizeof(starxy_t));
         freeit = TRUE;
     }
 
-    fld->N = fitstable_nrows(ls->table);
-    fld->x = fitstable_read_column(ls->table, ls->xname, dubl);
-    fld->y = fitstable_read_column(ls->table, ls->yname, dubl);
+    fld->N = N;
+    fld->x = fitstable_read_column_offset(ls->table, ls->xname, dubl, offset, N);
+    fld->y = fitstable_read_column_offset(ls->table, ls->yname, dubl, offset, N);
     if (ls->include_flux)
-        fld->flux = fitstable_read_column(ls->table, "FLUX", dubl);
+        fld->flux = fitstable_read_column_offset(ls->table, "FLUX", dubl,
+                                                 offset, N);
     else
         fld->flux = NULL;
     if (ls->include_background)
-        fld->background = fitstable_read_column(ls->table, "BACKGROUND", dubl);
+        fld->background = fitstable_read_column_offset(ls->table, "BACKGROUND",
+                                                       dubl, offset, N);
     else
         fld->background = NULL;
 